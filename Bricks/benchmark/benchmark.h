@@ -0,0 +1,335 @@
+// A header-only microbenchmark harness, for each module to keep a suite of benchmarks next to its tests.
+//
+// BRICKS_BENCHMARK(PushMessage) {
+//   Queue queue;
+//   while (state.KeepRunning()) {
+//     queue.PushMessage("foo");
+//   }
+// }
+//
+// BRICKS_BENCHMARK_MAIN();
+//
+// Each benchmark is run with a growing number of iterations until one run takes --bricks_benchmark_min_ms,
+// the calibration runs doubling as the warmup, then --bricks_benchmark_repetitions more times with that
+// number of iterations. The results, emitted as JSON into the standard output, are the mean, the standard
+// deviation, the 95% confidence interval and the minimum of the nanoseconds per iteration across
+// the repetitions, along with the heap allocations per iteration.
+//
+// The allocations are counted by the global `operator new`, replaced by `BRICKS_COUNT_ALLOCATIONS()`
+// of `util/allocation_counter.h`, which `BRICKS_BENCHMARK_MAIN()` includes. Thus a benchmark binary is a single
+// translation unit, and the allocations of all the threads of the process are counted, not only those
+// of the benchmark thread.
+//
+// With --bricks_benchmark_perf_counters, the cycles, the instructions, the last level cache misses
+// and the context switches of the benchmark thread are reported per iteration as well, those of them
+// the host has, see `perf_counters.h`.
+//
+// The benchmarks that process items or bytes report them with `State::SetItemsProcessed()` and
+// `State::SetBytesProcessed()`, once per run, for the items per second and the megabytes per second
+// across the repetitions to be emitted as well.
+//
+// The code in `State::PauseTiming()` ... `State::ResumeTiming()` is excluded from the time, the allocations
+// and the performance counters. `DoNotOptimize()` keeps the compiler from optimizing away the value
+// that is not used.
+
+#ifndef BRICKS_BENCHMARK_BENCHMARK_H
+#define BRICKS_BENCHMARK_BENCHMARK_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../dflags/dflags.h"
+#include "../strings/printf.h"
+#include "../time/tsc.h"
+#include "../util/allocation_counter.h"
+
+#include "perf_counters.h"
+
+namespace bricks {
+namespace benchmark {
+
+template <typename T>
+inline void DoNotOptimize(const T& value) {
+  asm volatile("" : : "r"(&value) : "memory");
+}
+
+class State final {
+ public:
+  // The performance counters, if any, are to be reset by the caller.
+  explicit State(uint64_t iterations, PerfCounters* perf_counters = nullptr)
+      : iterations_(iterations), remaining_(iterations), perf_counters_(perf_counters) {}
+
+  // Returns true `Iterations()` times. The timing starts with the first call and stops with the last one.
+  bool KeepRunning() {
+    if (remaining_) {
+      if (remaining_ == iterations_) {
+        ResumeTiming();
+      }
+      --remaining_;
+      return true;
+    } else {
+      PauseTiming();
+      return false;
+    }
+  }
+
+  uint64_t Iterations() const { return iterations_; }
+
+  void PauseTiming() {
+    if (running_) {
+      elapsed_ns_ += bricks::time::HighResolutionNowNanoseconds() - started_ns_;
+      allocations_ += AllocationCounters::Process().load(std::memory_order_relaxed) - started_allocations_;
+      if (perf_counters_) {
+        perf_counters_->Pause();
+      }
+      running_ = false;
+    }
+  }
+
+  void ResumeTiming() {
+    if (!running_) {
+      running_ = true;
+      if (perf_counters_) {
+        perf_counters_->Resume();
+      }
+      started_allocations_ = AllocationCounters::Process().load(std::memory_order_relaxed);
+      started_ns_ = bricks::time::HighResolutionNowNanoseconds();
+    }
+  }
+
+  uint64_t ElapsedNanoseconds() const { return elapsed_ns_; }
+  uint64_t Allocations() const { return allocations_; }
+
+  // The totals of the run, not of an iteration; the throughput is reported for the nonzero ones.
+  void SetItemsProcessed(uint64_t items) { items_processed_ = items; }
+  void SetBytesProcessed(uint64_t bytes) { bytes_processed_ = bytes; }
+  uint64_t ItemsProcessed() const { return items_processed_; }
+  uint64_t BytesProcessed() const { return bytes_processed_; }
+
+ private:
+  const uint64_t iterations_;
+  uint64_t remaining_;
+  bool running_ = false;
+  uint64_t started_ns_ = 0;
+  uint64_t elapsed_ns_ = 0;
+  uint64_t started_allocations_ = 0;
+  uint64_t allocations_ = 0;
+  uint64_t items_processed_ = 0;
+  uint64_t bytes_processed_ = 0;
+  PerfCounters* const perf_counters_;
+};
+
+typedef std::function<void(State&)> T_BENCHMARK;
+
+struct Benchmark {
+  std::string name;
+  T_BENCHMARK f;
+};
+
+inline std::vector<Benchmark>& Registry() {
+  static std::vector<Benchmark> registry;
+  return registry;
+}
+
+struct Registerer {
+  Registerer(const char* name, T_BENCHMARK f) { Registry().push_back(Benchmark{name, f}); }
+};
+
+struct Options {
+  // Run only the benchmarks with this substring in their names, all of them if empty.
+  std::string filter;
+  // The time the calibrated number of iterations should take.
+  uint64_t min_ms = 100;
+  size_t repetitions = 5;
+  // The upper bound on the number of iterations, for the benchmarks that do next to nothing.
+  uint64_t max_iterations = 1000000000;
+  // Whether to collect the performance counters of the timed runs.
+  bool perf_counters = false;
+};
+
+struct Result {
+  std::string name;
+  uint64_t iterations = 0;
+  size_t repetitions = 0;
+  double mean_ns = 0.0;
+  double stddev_ns = 0.0;
+  // The half-width of the 95% confidence interval of the mean, with Student's t-distribution.
+  double ci95_ns = 0.0;
+  double min_ns = 0.0;
+  double allocations_per_iteration = 0.0;
+  // With `State::SetItemsProcessed()` and `State::SetBytesProcessed()`, zero otherwise.
+  double items_per_second = 0.0;
+  double megabytes_per_second = 0.0;
+  // With `Options::perf_counters`, the counters the host has, in the order of `PerfCounter`.
+  bool perf_counters_available[kNumberOfPerfCounters] = {false, false, false, false};
+  double perf_counters_per_iteration[kNumberOfPerfCounters] = {0.0, 0.0, 0.0, 0.0};
+};
+
+// The two-sided 95% quantile of Student's t-distribution with `degrees` degrees of freedom.
+inline double StudentT95(size_t degrees) {
+  static const double table[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                 2.201,  2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                 2.080,  2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+  if (!degrees) {
+    return 0.0;
+  }
+  return degrees <= sizeof(table) / sizeof(table[0]) ? table[degrees - 1] : 1.960;
+}
+
+inline Result RunBenchmark(const Benchmark& benchmark, const Options& options) {
+  const uint64_t min_ns = options.min_ms * 1000000;
+  uint64_t iterations = 1;
+  while (true) {
+    State state(iterations);
+    benchmark.f(state);
+    const uint64_t elapsed_ns = state.ElapsedNanoseconds();
+    if (elapsed_ns >= min_ns || iterations >= options.max_iterations) {
+      break;
+    }
+    // Aim a bit past the target, growing by at most ten times per run, as the first runs are the noisiest.
+    const double estimate = elapsed_ns ? 1.4 * iterations * min_ns / elapsed_ns : 10.0 * iterations;
+    const uint64_t next = static_cast<uint64_t>(std::min(estimate, 10.0 * iterations));
+    iterations = std::min(std::max(next, iterations + 1), options.max_iterations);
+  }
+
+  Result result;
+  result.name = benchmark.name;
+  result.iterations = iterations;
+  result.repetitions = std::max(options.repetitions, static_cast<size_t>(1));
+  std::vector<double> ns_per_iteration;
+  uint64_t allocations = 0;
+  uint64_t elapsed_ns = 0;
+  uint64_t items = 0;
+  uint64_t bytes = 0;
+  // Opened on the benchmark thread, as the counters count the thread that opened them.
+  std::unique_ptr<PerfCounters> perf_counters(options.perf_counters ? new PerfCounters() : nullptr);
+  PerfCounterValues perf_counter_values;
+  for (size_t i = 0; i < result.repetitions; ++i) {
+    if (perf_counters) {
+      perf_counters->Reset();
+    }
+    State state(iterations, perf_counters.get());
+    benchmark.f(state);
+    ns_per_iteration.push_back(static_cast<double>(state.ElapsedNanoseconds()) / iterations);
+    allocations += state.Allocations();
+    elapsed_ns += state.ElapsedNanoseconds();
+    items += state.ItemsProcessed();
+    bytes += state.BytesProcessed();
+    if (perf_counters) {
+      perf_counter_values += perf_counters->Read();
+    }
+  }
+  result.min_ns = ns_per_iteration.front();
+  for (double ns : ns_per_iteration) {
+    result.mean_ns += ns;
+    result.min_ns = std::min(result.min_ns, ns);
+  }
+  result.mean_ns /= result.repetitions;
+  if (result.repetitions > 1) {
+    double sum_of_squares = 0.0;
+    for (double ns : ns_per_iteration) {
+      sum_of_squares += (ns - result.mean_ns) * (ns - result.mean_ns);
+    }
+    result.stddev_ns = std::sqrt(sum_of_squares / (result.repetitions - 1));
+    result.ci95_ns = StudentT95(result.repetitions - 1) * result.stddev_ns / std::sqrt(result.repetitions);
+  }
+  result.allocations_per_iteration = static_cast<double>(allocations) / (iterations * result.repetitions);
+  if (elapsed_ns) {
+    result.items_per_second = 1e9 * items / elapsed_ns;
+    result.megabytes_per_second = 1e9 * bytes / elapsed_ns / (1024 * 1024);
+  }
+  for (size_t i = 0; i < kNumberOfPerfCounters; ++i) {
+    result.perf_counters_available[i] = perf_counter_values.available[i];
+    result.perf_counters_per_iteration[i] =
+        static_cast<double>(perf_counter_values.values[i]) / (iterations * result.repetitions);
+  }
+  return result;
+}
+
+// Runs the registered benchmarks that pass the filter, in the order of their registration.
+inline std::vector<Result> RunBenchmarks(const Options& options) {
+  std::vector<Result> results;
+  for (const Benchmark& benchmark : Registry()) {
+    if (benchmark.name.find(options.filter) != std::string::npos) {
+      std::cerr << "Running " << benchmark.name << " ..." << std::endl;
+      results.push_back(RunBenchmark(benchmark, options));
+    }
+  }
+  return results;
+}
+
+// The names are the C++ identifiers of `BRICKS_BENCHMARK()`, thus need no escaping.
+// The throughput and the performance counters are only present if reported and available, respectively.
+inline std::string ResultsAsJSON(const std::vector<Result>& results) {
+  std::string json = "{\"benchmarks\":[";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result& r = results[i];
+    bricks::strings::AppendPrintf(json,
+                                  "%s\n{\"name\":\"%s\",\"iterations\":%llu,\"repetitions\":%llu,"
+                                  "\"ns_per_iteration\":{\"mean\":%.3f,\"stddev\":%.3f,"
+                                  "\"ci95\":%.3f,\"min\":%.3f},"
+                                  "\"allocations_per_iteration\":%.3f",
+                                  i ? "," : "",
+                                  r.name.c_str(),
+                                  static_cast<unsigned long long>(r.iterations),
+                                  static_cast<unsigned long long>(r.repetitions),
+                                  r.mean_ns,
+                                  r.stddev_ns,
+                                  r.ci95_ns,
+                                  r.min_ns,
+                                  r.allocations_per_iteration);
+    if (r.items_per_second > 0.0) {
+      bricks::strings::AppendPrintf(json, ",\"items_per_second\":%.3f", r.items_per_second);
+    }
+    if (r.megabytes_per_second > 0.0) {
+      bricks::strings::AppendPrintf(json, ",\"megabytes_per_second\":%.3f", r.megabytes_per_second);
+    }
+    bool any_perf_counters = false;
+    for (size_t c = 0; c < kNumberOfPerfCounters; ++c) {
+      if (r.perf_counters_available[c]) {
+        json += any_perf_counters ? "," : ",\"perf_counters_per_iteration\":{";
+        bricks::strings::AppendPrintf(
+            json, "\"%s\":%.3f", PerfCounterName(c), r.perf_counters_per_iteration[c]);
+        any_perf_counters = true;
+      }
+    }
+    json += any_perf_counters ? "}}" : "}";
+  }
+  json += "\n]}\n";
+  return json;
+}
+
+}  // namespace benchmark
+}  // namespace bricks
+
+#define BRICKS_BENCHMARK(name)                                                                                 \
+  static void BricksBenchmark_##name(::bricks::benchmark::State& state);                                       \
+  static ::bricks::benchmark::Registerer bricks_benchmark_registerer_##name(#name, BricksBenchmark_##name);    \
+  static void BricksBenchmark_##name(::bricks::benchmark::State& state)
+
+#define BRICKS_BENCHMARK_MAIN()                                                                                \
+  BRICKS_COUNT_ALLOCATIONS()                                                                                   \
+  DEFINE_string(bricks_benchmark_filter, "", "Run only the benchmarks with this substring in their names.");   \
+  DEFINE_uint64(bricks_benchmark_min_ms, 100, "The time to calibrate the number of iterations to, in ms.");    \
+  DEFINE_uint64(bricks_benchmark_repetitions, 5, "The number of timed runs of each benchmark.");               \
+  DEFINE_bool(bricks_benchmark_perf_counters, false, "Report the hardware performance counters as well.");     \
+  int main(int argc, char** argv) {                                                                            \
+    ParseDFlags(&argc, &argv);                                                                                 \
+    ::bricks::benchmark::Options options;                                                                      \
+    options.filter = FLAGS_bricks_benchmark_filter;                                                            \
+    options.min_ms = FLAGS_bricks_benchmark_min_ms;                                                            \
+    options.repetitions = FLAGS_bricks_benchmark_repetitions;                                                  \
+    options.perf_counters = FLAGS_bricks_benchmark_perf_counters;                                              \
+    std::cout << ::bricks::benchmark::ResultsAsJSON(::bricks::benchmark::RunBenchmarks(options));              \
+    return 0;                                                                                                  \
+  }
+
+#endif  // BRICKS_BENCHMARK_BENCHMARK_H
@@ -0,0 +1,165 @@
+// The hardware performance counters of the calling thread, with `perf_event_open()`, for the benchmarks
+// to report the cycles, the instructions, the last level cache misses and the context switches per operation.
+//
+// PerfCounters counters;
+// counters.Resume();
+// queue.PushMessage(message);
+// counters.Pause();
+// const PerfCounterValues values = counters.Read();
+//
+// The counters are opened as one group, for all of them to count over the same time. The hardware ones count
+// the user space only, as the default `perf_event_paranoid` setting allows; the context switches are counted
+// by the kernel. Any counter the host does not have, such as the hardware ones in most virtual machines,
+// or the ones the permissions do not allow, is reported as not available. Outside of Linux none are.
+
+#ifndef BRICKS_BENCHMARK_PERF_COUNTERS_H
+#define BRICKS_BENCHMARK_PERF_COUNTERS_H
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace bricks {
+namespace benchmark {
+
+enum class PerfCounter : size_t { Cycles = 0, Instructions, LLCMisses, ContextSwitches };
+const size_t kNumberOfPerfCounters = 4;
+
+// The names of the counters, as they are reported, in the order of `PerfCounter`.
+inline const char* PerfCounterName(size_t index) {
+  static const char* const names[kNumberOfPerfCounters] = {
+      "cycles", "instructions", "llc_misses", "context_switches"};
+  return names[index];
+}
+
+struct PerfCounterValues {
+  uint64_t values[kNumberOfPerfCounters] = {0, 0, 0, 0};
+  bool available[kNumberOfPerfCounters] = {false, false, false, false};
+
+  uint64_t operator[](PerfCounter counter) const { return values[static_cast<size_t>(counter)]; }
+  bool Available(PerfCounter counter) const { return available[static_cast<size_t>(counter)]; }
+  bool AnyAvailable() const {
+    for (bool a : available) {
+      if (a) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  PerfCounterValues& operator+=(const PerfCounterValues& rhs) {
+    for (size_t i = 0; i < kNumberOfPerfCounters; ++i) {
+      values[i] += rhs.values[i];
+      available[i] = available[i] || rhs.available[i];
+    }
+    return *this;
+  }
+};
+
+// Counts the thread that constructed it only. Not thread safe: keep one instance per thread.
+class PerfCounters final {
+ public:
+  PerfCounters() {
+    for (int& fd : fds_) {
+      fd = -1;
+    }
+#if defined(__linux__)
+    Open(PerfCounter::Cycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, true);
+    Open(PerfCounter::Instructions, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, true);
+    Open(PerfCounter::LLCMisses, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, true);
+    // In user space only, no context switches would be counted.
+    Open(PerfCounter::ContextSwitches, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, false);
+#endif
+  }
+
+  ~PerfCounters() {
+#if defined(__linux__)
+    for (int fd : fds_) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+#endif
+  }
+
+  bool AnyAvailable() const { return leader_ >= 0; }
+
+  // Starts or stops all the counters at once. A system call each, thus to be called around a region
+  // that is long enough for its overhead to not matter, or where the rest of the time is also counted.
+  void Resume() {
+#if defined(__linux__)
+    if (leader_ >= 0) {
+      ::ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+  }
+  void Pause() {
+#if defined(__linux__)
+    if (leader_ >= 0) {
+      ::ioctl(leader_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+  }
+
+  // Zeroes the counters, for the next `Read()` to return what is counted from now on.
+  void Reset() {
+#if defined(__linux__)
+    if (leader_ >= 0) {
+      ::ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+  }
+
+  PerfCounterValues Read() const {
+    PerfCounterValues result;
+#if defined(__linux__)
+    for (size_t i = 0; i < kNumberOfPerfCounters; ++i) {
+      uint64_t value;
+      if (fds_[i] >= 0 && ::read(fds_[i], &value, sizeof(value)) == static_cast<ssize_t>(sizeof(value))) {
+        result.values[i] = value;
+        result.available[i] = true;
+      }
+    }
+#endif
+    return result;
+  }
+
+ private:
+#if defined(__linux__)
+  void Open(PerfCounter counter, uint32_t type, uint64_t config, bool user_space_only) {
+    perf_event_attr attr;
+    ::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    // The group starts disabled, and is enabled by its leader.
+    attr.disabled = leader_ < 0;
+    attr.exclude_kernel = user_space_only;
+    attr.exclude_hv = 1;
+    const int fd = static_cast<int>(::syscall(__NR_perf_event_open, &attr, 0, -1, leader_, 0));
+    if (fd >= 0) {
+      fds_[static_cast<size_t>(counter)] = fd;
+      if (leader_ < 0) {
+        leader_ = fd;
+      }
+    }
+  }
+#endif
+
+  int fds_[kNumberOfPerfCounters];
+  int leader_ = -1;
+
+  PerfCounters(const PerfCounters&) = delete;
+  void operator=(const PerfCounters&) = delete;
+};
+
+}  // namespace benchmark
+}  // namespace bricks
+
+#endif  // BRICKS_BENCHMARK_PERF_COUNTERS_H
@@ -0,0 +1,130 @@
+#include "benchmark.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../3party/gtest/gtest.h"
+#include "../3party/gtest/gtest-main.h"
+
+BRICKS_COUNT_ALLOCATIONS();
+
+BRICKS_BENCHMARK(HarnessTestAllocatesOnce) {
+  while (state.KeepRunning()) {
+    std::unique_ptr<std::string> s(new std::string());
+    bricks::benchmark::DoNotOptimize(s);
+  }
+}
+
+BRICKS_BENCHMARK(HarnessTestAllocatesWhilePaused) {
+  uint64_t sum = 0;
+  while (state.KeepRunning()) {
+    state.PauseTiming();
+    std::unique_ptr<uint64_t> value(new uint64_t(state.Iterations()));
+    bricks::benchmark::DoNotOptimize(value);
+    state.ResumeTiming();
+    sum += *value;
+  }
+  bricks::benchmark::DoNotOptimize(sum);
+}
+
+TEST(Benchmark, CalibratesAndCountsAllocations) {
+  bricks::benchmark::Options options;
+  options.filter = "HarnessTest";
+  options.min_ms = 5;
+  options.repetitions = 3;
+  const std::vector<bricks::benchmark::Result> results = bricks::benchmark::RunBenchmarks(options);
+  ASSERT_EQ(2u, results.size());
+
+  EXPECT_EQ("HarnessTestAllocatesOnce", results[0].name);
+  EXPECT_EQ(3u, results[0].repetitions);
+  EXPECT_GT(results[0].iterations, 1u);
+  EXPECT_GT(results[0].mean_ns, 0.0);
+  EXPECT_LE(results[0].min_ns, results[0].mean_ns);
+  EXPECT_GE(results[0].iterations * results[0].mean_ns, 5e6 * 0.5);
+  EXPECT_EQ(1.0, results[0].allocations_per_iteration);
+
+  EXPECT_EQ("HarnessTestAllocatesWhilePaused", results[1].name);
+  EXPECT_EQ(0.0, results[1].allocations_per_iteration);
+
+  const std::string json = bricks::benchmark::ResultsAsJSON(results);
+  EXPECT_EQ(0u, json.find("{\"benchmarks\":[\n{\"name\":\"HarnessTestAllocatesOnce\",\"iterations\":"));
+  EXPECT_NE(std::string::npos, json.find("\"allocations_per_iteration\":1.000}"));
+  EXPECT_NE(std::string::npos, json.find("\n{\"name\":\"HarnessTestAllocatesWhilePaused\""));
+
+  options.filter = "WhilePaused";
+  EXPECT_EQ(1u, bricks::benchmark::RunBenchmarks(options).size());
+}
+
+// A megabyte per item, each taking at least a millisecond.
+BRICKS_BENCHMARK(ThroughputTestSleeps) {
+  while (state.KeepRunning()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  state.SetItemsProcessed(state.Iterations());
+  state.SetBytesProcessed(state.Iterations() * 1024 * 1024);
+}
+
+TEST(Benchmark, ReportsThroughput) {
+  bricks::benchmark::Options options;
+  options.filter = "ThroughputTest";
+  options.min_ms = 5;
+  options.repetitions = 2;
+  const std::vector<bricks::benchmark::Result> results = bricks::benchmark::RunBenchmarks(options);
+  ASSERT_EQ(1u, results.size());
+  EXPECT_GT(results[0].items_per_second, 0.0);
+  EXPECT_LE(results[0].items_per_second, 1000.0);
+  EXPECT_NEAR(results[0].items_per_second, results[0].megabytes_per_second, 1e-6);
+
+  const std::string json = bricks::benchmark::ResultsAsJSON(results);
+  EXPECT_NE(std::string::npos, json.find(",\"items_per_second\":"));
+  EXPECT_NE(std::string::npos, json.find(",\"megabytes_per_second\":"));
+  EXPECT_EQ(std::string::npos,
+            bricks::benchmark::ResultsAsJSON({bricks::benchmark::Result()}).find("per_second"));
+}
+
+TEST(Benchmark, ConfidenceInterval) {
+  EXPECT_EQ(0.0, bricks::benchmark::StudentT95(0));
+  EXPECT_EQ(12.706, bricks::benchmark::StudentT95(1));
+  EXPECT_EQ(2.776, bricks::benchmark::StudentT95(4));
+  EXPECT_EQ(1.960, bricks::benchmark::StudentT95(1000));
+}
+
+// The hosts may not have any of the counters, such as the hardware ones in virtual machines,
+// thus only those available are checked.
+TEST(Benchmark, PerfCounters) {
+  using bricks::benchmark::PerfCounter;
+  bricks::benchmark::PerfCounters counters;
+  counters.Resume();
+  for (int i = 0; i < 3; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  counters.Pause();
+  const bricks::benchmark::PerfCounterValues values = counters.Read();
+  EXPECT_EQ(counters.AnyAvailable(), values.AnyAvailable());
+  if (values.Available(PerfCounter::ContextSwitches)) {
+    EXPECT_GE(values[PerfCounter::ContextSwitches], 3u);
+  }
+  if (values.Available(PerfCounter::Instructions)) {
+    EXPECT_GT(values[PerfCounter::Instructions], 0u);
+  }
+
+  // Paused, nothing more is counted.
+  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  EXPECT_EQ(values[PerfCounter::ContextSwitches], counters.Read()[PerfCounter::ContextSwitches]);
+  counters.Reset();
+  EXPECT_EQ(0u, counters.Read()[PerfCounter::ContextSwitches]);
+
+  bricks::benchmark::Options options;
+  options.filter = "HarnessTestAllocatesOnce";
+  options.min_ms = 5;
+  options.repetitions = 2;
+  options.perf_counters = true;
+  const std::vector<bricks::benchmark::Result> results = bricks::benchmark::RunBenchmarks(options);
+  ASSERT_EQ(1u, results.size());
+  const std::string json = bricks::benchmark::ResultsAsJSON(results);
+  EXPECT_EQ(values.AnyAvailable(), json.find(",\"perf_counters_per_iteration\":{") != std::string::npos) << json;
+  EXPECT_EQ(std::string::npos, bricks::benchmark::ResultsAsJSON({bricks::benchmark::Result()}).find("perf"));
+}
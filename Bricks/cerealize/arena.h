@@ -0,0 +1,190 @@
+// `CerealArena` is a monotonic buffer for the records parsed in batches, see `ForEachInArena()`
+// of the parsers in `cerealize.h`. The memory is handed out from large blocks and never freed one object
+// at a time: `Reset()` makes all of it available again, keeping the blocks for the next batch.
+//
+// The parsing code sets the arena of the thread with `ScopedCerealArena`, and the records opt in to it:
+// the types deriving from `CerealArenaAllocated` are constructed in it, and `CerealArenaAllocator`
+// is the allocator for their members, such as `CerealArenaString`. Outside of an arena, both fall back
+// to the global `operator new`. The records constructed in an arena must not outlive the batch.
+//
+// The blocks come from the `memory::MemoryResource` given to the arena, by default the one accounted for
+// as "cerealize_arena", see `memory/accounting.h`, for the memory held by the parsing to show in the metrics.
+
+#ifndef BRICKS_CEREALIZE_ARENA_H
+#define BRICKS_CEREALIZE_ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../memory/accounting.h"
+#include "../memory/memory_resource.h"
+
+namespace bricks {
+namespace cerealize {
+
+const size_t kCerealArenaDefaultBlockSize = 1024 * 1024;
+
+inline memory::MemoryResource* CerealArenaMemoryResource() {
+  static memory::MemoryResource* resource = memory::SubsystemMemoryResource("cerealize_arena");
+  return resource;
+}
+
+class CerealArena final {
+ public:
+  explicit CerealArena(size_t block_size = kCerealArenaDefaultBlockSize,
+                       memory::MemoryResource* resource = CerealArenaMemoryResource())
+      : block_size_(block_size), resource_(resource) {}
+
+  ~CerealArena() {
+    for (const Block& block : blocks_) {
+      resource_->Deallocate(block.data, block.size);
+    }
+  }
+
+  void* Allocate(size_t size) {
+    const size_t alignment = alignof(std::max_align_t);
+    size = (size + alignment - 1) / alignment * alignment;
+    while (current_ < blocks_.size() && blocks_[current_].used + size > blocks_[current_].size) {
+      ++current_;
+    }
+    if (current_ == blocks_.size()) {
+      const size_t block_size = std::max(size, block_size_);
+      blocks_.push_back(Block{static_cast<char*>(resource_->Allocate(block_size)), block_size, 0});
+    }
+    Block& block = blocks_[current_];
+    void* result = block.data + block.used;
+    block.used += size;
+    used_ += size;
+    return result;
+  }
+
+  bool Contains(const void* p) const {
+    const char* c = static_cast<const char*>(p);
+    for (const Block& block : blocks_) {
+      if (c >= block.data && c < block.data + block.size) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Makes all the memory available again. The objects in it must have been destructed.
+  void Reset() {
+    for (Block& block : blocks_) {
+      block.used = 0;
+    }
+    current_ = 0;
+    used_ = 0;
+  }
+
+  size_t BytesUsed() const { return used_; }
+
+  // The arena of this thread, or null.
+  static CerealArena*& Current() {
+    static thread_local CerealArena* current = nullptr;
+    return current;
+  }
+
+ private:
+  struct Block {
+    char* data;
+    size_t size;
+    size_t used;
+  };
+
+  const size_t block_size_;
+  memory::MemoryResource* const resource_;
+  std::vector<Block> blocks_;
+  size_t current_ = 0;
+  size_t used_ = 0;
+
+  CerealArena(const CerealArena&) = delete;
+  void operator=(const CerealArena&) = delete;
+};
+
+// Makes `arena` the arena of this thread for the lifetime of the object.
+class ScopedCerealArena final {
+ public:
+  explicit ScopedCerealArena(CerealArena& arena) : previous_(CerealArena::Current()) {
+    CerealArena::Current() = &arena;
+  }
+  ~ScopedCerealArena() { CerealArena::Current() = previous_; }
+
+ private:
+  CerealArena* const previous_;
+
+  ScopedCerealArena(const ScopedCerealArena&) = delete;
+  void operator=(const ScopedCerealArena&) = delete;
+};
+
+inline void* CerealArenaAllocate(size_t size) {
+  CerealArena* arena = CerealArena::Current();
+  return arena ? arena->Allocate(size) : ::operator new(size);
+}
+
+inline void CerealArenaDeallocate(void* p) {
+  CerealArena* arena = CerealArena::Current();
+  if (!arena || !arena->Contains(p)) {
+    ::operator delete(p);
+  }
+}
+
+// The base for the record types to be constructed in the arena of the thread, if there is one.
+struct CerealArenaAllocated {
+  static void* operator new(size_t size) { return CerealArenaAllocate(size); }
+  static void operator delete(void* p) { CerealArenaDeallocate(p); }
+};
+
+template <typename T>
+struct CerealArenaAllocator {
+  typedef T value_type;
+
+  CerealArenaAllocator() = default;
+  template <typename U>
+  CerealArenaAllocator(const CerealArenaAllocator<U>&) {}
+
+  T* allocate(size_t n) { return static_cast<T*>(CerealArenaAllocate(n * sizeof(T))); }
+  void deallocate(T* p, size_t) { CerealArenaDeallocate(p); }
+
+  // The pre-C++11 allocator interface, still expected by some implementations of `std::basic_string`.
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef std::ptrdiff_t difference_type;
+  template <typename U>
+  struct rebind {
+    typedef CerealArenaAllocator<U> other;
+  };
+  size_type max_size() const { return static_cast<size_type>(-1) / sizeof(T); }
+  template <typename U, typename... ARGS>
+  void construct(U* p, ARGS&&... args) {
+    ::new (static_cast<void*>(p)) U(std::forward<ARGS>(args)...);
+  }
+  template <typename U>
+  void destroy(U* p) {
+    p->~U();
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const CerealArenaAllocator<T>&, const CerealArenaAllocator<U>&) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const CerealArenaAllocator<T>&, const CerealArenaAllocator<U>&) {
+  return false;
+}
+
+typedef std::basic_string<char, std::char_traits<char>, CerealArenaAllocator<char>> CerealArenaString;
+
+}  // namespace cerealize
+}  // namespace bricks
+
+#endif  // BRICKS_CEREALIZE_ARENA_H
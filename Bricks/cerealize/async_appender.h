@@ -0,0 +1,117 @@
+// `AsyncCerealFileAppender` is the `GenericCerealFileAppender` that serializes and writes the records
+// on a thread of its own, for the call sites logging the events to only pay for a move into a queue.
+//
+// The records are moved into the message queue `T_MQ<CONSUMER, T_ENTRY>`, such as `EfficientMQ` from
+// `CachingMessageQueue/mq_efficient.h`, the only consumer thread of which serializes them into the file,
+// in batches. It is the queue that bounds the number of the records pending, and decides what happens
+// once it is full, with its overflow policy: the producers wait, or the oldest or the newest records
+// are dropped, and counted by `NumberOfDroppedEntries()`. The queue is given the extra constructor
+// arguments of the appender, such as its buffer size:
+//
+//   template <typename CONSUMER, typename MESSAGE>
+//   using EventsMQ = EfficientMQ<CONSUMER, MESSAGE, 4096, MQOverflowPolicy::DropOldest>;
+//
+//   AsyncCerealFileAppender<std::unique_ptr<MapsYouEventBase>, EventsMQ> appender("events.bin");
+//   appender << std::unique_ptr<MapsYouEventBase>(new EventAppStart());
+//
+// `T_ENTRY` is a record type, a `rtti::Variant` of them, or a `std::unique_ptr` of the base type of the
+// polymorphic ones, written as the object it points to, and skipped if null. The queue should define
+// `bool PushMessage(T_ENTRY&&)`, and call `OnMessages(begin, end, number_of_dropped_entries)` of its consumer
+// for the batches, as `EfficientMQ` does, or `OnMessage(entry, number_of_dropped_entries)` for each record.
+// The batches are written out into the file as they are serialized; the records passed one by one are kept
+// in the buffer of the appender until it fills up, or until `Flush()`. The destructor writes out all
+// the records accepted by the queue.
+
+#ifndef BRICKS_CEREALIZE_ASYNC_APPENDER_H
+#define BRICKS_CEREALIZE_ASYNC_APPENDER_H
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "cerealize.h"
+
+namespace bricks {
+namespace cerealize {
+
+template <typename T_ENTRY,
+          template <typename, typename> class T_MQ,
+          CerealFormat T_CEREAL_FORMAT = CerealFormat::Default,
+          typename T_OUTPUT_FILE = std::ofstream>
+class AsyncCerealFileAppender {
+ public:
+  // The arguments past the file name are passed on to the constructor of the queue.
+  template <typename... MQ_ARGS>
+  explicit AsyncCerealFileAppender(const std::string& filename, MQ_ARGS&&... mq_args)
+      : writer_(filename), mq_(writer_, std::forward<MQ_ARGS>(mq_args)...) {}
+
+  // Returns false if the queue has rejected the record. THREAD SAFE.
+  bool Push(T_ENTRY&& entry) { return mq_.PushMessage(std::move(entry)); }
+
+  AsyncCerealFileAppender& operator<<(T_ENTRY&& entry) {
+    Push(std::move(entry));
+    return *this;
+  }
+
+  // Writes out the records serialized so far, not the ones still in the queue. THREAD SAFE.
+  void Flush() {
+    std::lock_guard<std::mutex> lock(writer_.mutex);
+    writer_.appender.Flush();
+  }
+
+  // The number of records dropped so far, as reported by the queue along with the records after them.
+  size_t NumberOfDroppedEntries() const { return writer_.dropped; }
+
+ private:
+  AsyncCerealFileAppender() = delete;
+  AsyncCerealFileAppender(const AsyncCerealFileAppender&) = delete;
+  void operator=(const AsyncCerealFileAppender&) = delete;
+  AsyncCerealFileAppender(AsyncCerealFileAppender&&) = delete;
+  void operator=(AsyncCerealFileAppender&&) = delete;
+
+  // The consumer of the queue, called from its only thread. The mutex is only contended by `Flush()`.
+  struct Writer {
+    explicit Writer(const std::string& filename) : appender(filename), dropped(0) {}
+
+    void OnMessage(const T_ENTRY& entry, size_t number_of_dropped_entries_if_any) {
+      dropped += number_of_dropped_entries_if_any;
+      std::lock_guard<std::mutex> lock(mutex);
+      Write(entry);
+    }
+    void OnMessages(const T_ENTRY* begin, const T_ENTRY* end, size_t number_of_dropped_entries_if_any) {
+      dropped += number_of_dropped_entries_if_any;
+      std::lock_guard<std::mutex> lock(mutex);
+      for (const T_ENTRY* it = begin; it != end; ++it) {
+        Write(*it);
+      }
+      appender.Flush();
+    }
+
+    template <typename T>
+    void Write(const T& entry) {
+      appender << entry;
+    }
+    template <typename T, typename T_DELETER>
+    void Write(const std::unique_ptr<T, T_DELETER>& entry) {
+      if (entry) {
+        appender << entry;
+      }
+    }
+
+    GenericCerealFileAppender<T_CEREAL_FORMAT, T_OUTPUT_FILE> appender;
+    std::mutex mutex;
+    std::atomic<size_t> dropped;
+  };
+
+  // The order matters: the queue is destructed, and thus drained into the file, first.
+  Writer writer_;
+  T_MQ<Writer, T_ENTRY> mq_;
+};
+
+}  // namespace cerealize
+}  // namespace bricks
+
+#endif  // BRICKS_CEREALIZE_ASYNC_APPENDER_H
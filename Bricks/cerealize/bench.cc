@@ -0,0 +1,286 @@
+// The benchmarks of serializing and parsing a record as JSON, run with `make bench`.
+//
+// The record is serialized the way the JSON lines appender does it, with a cereal archive per record into
+// a reused line buffer, and parsed back both with a cereal archive and in place with `CerealJSONInSituParser`.
+//
+// The file benchmarks append, parse and dispatch `kRecordsPerIteration` polymorphic events per iteration,
+// binary and JSON, small and large, and report the records per second and the megabytes per second
+// of the file. The parsing ones open the file in each iteration, as the JSON archive parses all of it then.
+// `EndOfFile*` time the call that finds there are no more records: the exception `GenericCerealFileParser`
+// catches for it, against the check of `CerealMappedFileParser`.
+
+#include "cerealize.h"
+#include "json_sax.h"
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "../benchmark/benchmark.h"
+#include "../file/file.h"
+
+using bricks::benchmark::DoNotOptimize;
+using bricks::benchmark::State;
+using bricks::cerealize::CerealFormat;
+
+// The polymorphic events, at global namespace scope, as `BRICKS_CEREALIZE_REGISTER_TYPE_WITH_NAME()` requires.
+struct BenchEventBase {
+  uint64_t timestamp = 1234567890123;
+  virtual ~BenchEventBase() = default;
+  template <class A>
+  void serialize(A& ar) {
+    ar(CEREAL_NVP(timestamp));
+  }
+};
+
+#define BENCH_SMALL_EVENT(M_NAME, M_SHORT_NAME)                 \
+  struct M_NAME;                                                \
+  BRICKS_CEREALIZE_REGISTER_TYPE_WITH_NAME(M_NAME, M_SHORT_NAME); \
+  struct M_NAME : BenchEventBase {                              \
+    typedef BenchEventBase CEREAL_BASE_TYPE;                    \
+    uint32_t value = 42;                                        \
+    template <class A>                                          \
+    void serialize(A& ar) {                                     \
+      BenchEventBase::serialize(ar);                            \
+      ar(CEREAL_NVP(value));                                    \
+    }                                                           \
+  }
+
+BENCH_SMALL_EVENT(BenchSmallEventA, "a");
+BENCH_SMALL_EVENT(BenchSmallEventB, "b");
+BENCH_SMALL_EVENT(BenchSmallEventC, "c");
+BENCH_SMALL_EVENT(BenchSmallEventD, "d");
+
+struct BenchLargeEvent;
+BRICKS_CEREALIZE_REGISTER_TYPE_WITH_NAME(BenchLargeEvent, "l");
+struct BenchLargeEvent : BenchEventBase {
+  typedef BenchEventBase CEREAL_BASE_TYPE;
+  std::string text = std::string(256, 'x');
+  std::vector<uint64_t> values = std::vector<uint64_t>(32, 1000000007);
+  template <class A>
+  void serialize(A& ar) {
+    BenchEventBase::serialize(ar);
+    ar(CEREAL_NVP(text), CEREAL_NVP(values));
+  }
+};
+
+namespace {
+
+struct Point {
+  int x = 0;
+  double y = 0;
+  template <class A>
+  void serialize(A& ar) {
+    ar(CEREAL_NVP(x), CEREAL_NVP(y));
+  }
+};
+
+struct Request {
+  uint64_t id = 0;
+  bool flag = false;
+  std::string name;
+  std::vector<Point> points;
+  template <class A>
+  void serialize(A& ar) {
+    ar(CEREAL_NVP(id), CEREAL_NVP(flag), CEREAL_NVP(name), CEREAL_NVP(points));
+  }
+};
+
+const char* const kRequestJSON =
+    "{\"id\":12345678901,\"flag\":true,\"name\":\"benchmark\","
+    "\"points\":[{\"x\":1,\"y\":0.5},{\"x\":-2,\"y\":3.0},{\"x\":3,\"y\":-4.25},{\"x\":4,\"y\":1e3}]}";
+
+const size_t kRecordsPerIteration = 100;
+const char* const kEventsFileName = "build/optimized/bench_events";
+
+template <typename T_EVENT>
+struct Events {
+  template <CerealFormat FORMAT>
+  static void Append(bricks::cerealize::GenericCerealFileAppender<FORMAT>& appender, size_t count) {
+    const T_EVENT event;
+    for (size_t i = 0; i < count; ++i) {
+      appender << event;
+    }
+  }
+};
+
+// The events of the four small types in turn, for the dispatching to take each branch.
+struct MixedSmallEvents {};
+template <>
+struct Events<MixedSmallEvents> {
+  template <CerealFormat FORMAT>
+  static void Append(bricks::cerealize::GenericCerealFileAppender<FORMAT>& appender, size_t count) {
+    const BenchSmallEventA a;
+    const BenchSmallEventB b;
+    const BenchSmallEventC c;
+    const BenchSmallEventD d;
+    for (size_t i = 0; i < count; i += 4) {
+      appender << a << b << c << d;
+    }
+  }
+};
+
+template <CerealFormat FORMAT, typename T_EVENT>
+uint64_t WriteEventsFile(size_t count) {
+  {
+    bricks::cerealize::GenericCerealFileAppender<FORMAT> appender(kEventsFileName, false);
+    Events<T_EVENT>::template Append<FORMAT>(appender, count);
+  }
+  return bricks::FileSystem::GetFileSize(kEventsFileName);
+}
+
+template <CerealFormat FORMAT, typename T_EVENT>
+void AppendEvents(State& state) {
+  {
+    bricks::cerealize::GenericCerealFileAppender<FORMAT> appender(kEventsFileName, false);
+    while (state.KeepRunning()) {
+      Events<T_EVENT>::template Append<FORMAT>(appender, kRecordsPerIteration);
+    }
+  }
+  state.SetItemsProcessed(state.Iterations() * kRecordsPerIteration);
+  state.SetBytesProcessed(bricks::FileSystem::GetFileSize(kEventsFileName));
+  bricks::FileSystem::RemoveFile(kEventsFileName);
+}
+
+struct CountingProcessor {
+  uint64_t count = 0;
+  void operator()(const BenchEventBase& e) { count += e.timestamp & 1; }
+};
+
+template <CerealFormat FORMAT, typename T_EVENT>
+void ParseEvents(State& state) {
+  const uint64_t file_size = WriteEventsFile<FORMAT, T_EVENT>(kRecordsPerIteration);
+  CountingProcessor processor;
+  while (state.KeepRunning()) {
+    bricks::cerealize::GenericCerealFileParser<BenchEventBase, FORMAT> parser(kEventsFileName);
+    for (size_t i = 0; i < kRecordsPerIteration; ++i) {
+      parser.Next(processor);
+    }
+  }
+  DoNotOptimize(processor.count);
+  state.SetItemsProcessed(state.Iterations() * kRecordsPerIteration);
+  state.SetBytesProcessed(state.Iterations() * file_size);
+  bricks::FileSystem::RemoveFile(kEventsFileName);
+}
+
+// Handles the first two or all four of the small event types, and the rest as the base type.
+template <typename T_DERIVED_TYPE_LIST>
+struct DispatchingProcessor {
+  typedef BenchEventBase BASE_TYPE;
+  typedef T_DERIVED_TYPE_LIST DERIVED_TYPE_LIST;
+  uint64_t count = 0;
+  void operator()(const BenchEventBase&) { count += 1; }
+  void operator()(const BenchSmallEventA& e) { count += e.value; }
+  void operator()(const BenchSmallEventB& e) { count += e.value * 2; }
+  void operator()(const BenchSmallEventC& e) { count += e.value * 3; }
+  void operator()(const BenchSmallEventD& e) { count += e.value * 4; }
+};
+
+template <typename T_DERIVED_TYPE_LIST>
+void DispatchEvents(State& state) {
+  const uint64_t file_size = WriteEventsFile<CerealFormat::Binary, MixedSmallEvents>(kRecordsPerIteration);
+  DispatchingProcessor<T_DERIVED_TYPE_LIST> processor;
+  while (state.KeepRunning()) {
+    bricks::cerealize::CerealFileParser<BenchEventBase> parser(kEventsFileName);
+    for (size_t i = 0; i < kRecordsPerIteration; ++i) {
+      parser.NextWithDispatching(processor);
+    }
+  }
+  DoNotOptimize(processor.count);
+  state.SetItemsProcessed(state.Iterations() * kRecordsPerIteration);
+  state.SetBytesProcessed(state.Iterations() * file_size);
+  bricks::FileSystem::RemoveFile(kEventsFileName);
+}
+
+// Opens the file of one event and parses it with the timing paused, to time the call past it only.
+template <typename T_PARSER>
+void ParseEndOfFile(State& state) {
+  WriteEventsFile<CerealFormat::Binary, BenchSmallEventA>(1);
+  CountingProcessor processor;
+  bool more = false;
+  while (state.KeepRunning()) {
+    state.PauseTiming();
+    std::unique_ptr<T_PARSER> parser(new T_PARSER(kEventsFileName));
+    parser->Next(processor);
+    state.ResumeTiming();
+    more |= parser->Next(processor);
+    state.PauseTiming();
+    parser.reset();
+    state.ResumeTiming();
+  }
+  DoNotOptimize(more);
+  bricks::FileSystem::RemoveFile(kEventsFileName);
+}
+
+}  // namespace
+
+BRICKS_BENCHMARK(AppendBinarySmallEvents) { AppendEvents<CerealFormat::Binary, BenchSmallEventA>(state); }
+BRICKS_BENCHMARK(AppendJSONSmallEvents) { AppendEvents<CerealFormat::JSON, BenchSmallEventA>(state); }
+BRICKS_BENCHMARK(AppendBinaryLargeEvents) { AppendEvents<CerealFormat::Binary, BenchLargeEvent>(state); }
+BRICKS_BENCHMARK(AppendJSONLargeEvents) { AppendEvents<CerealFormat::JSON, BenchLargeEvent>(state); }
+
+BRICKS_BENCHMARK(ParseBinarySmallEvents) { ParseEvents<CerealFormat::Binary, BenchSmallEventA>(state); }
+BRICKS_BENCHMARK(ParseJSONSmallEvents) { ParseEvents<CerealFormat::JSON, BenchSmallEventA>(state); }
+BRICKS_BENCHMARK(ParseBinaryLargeEvents) { ParseEvents<CerealFormat::Binary, BenchLargeEvent>(state); }
+BRICKS_BENCHMARK(ParseJSONLargeEvents) { ParseEvents<CerealFormat::JSON, BenchLargeEvent>(state); }
+BRICKS_BENCHMARK(ParseBinaryMixedEvents) { ParseEvents<CerealFormat::Binary, MixedSmallEvents>(state); }
+
+BRICKS_BENCHMARK(DispatchBinaryOfTwoTypes) {
+  DispatchEvents<std::tuple<BenchSmallEventA, BenchSmallEventB>>(state);
+}
+BRICKS_BENCHMARK(DispatchBinaryOfFourTypes) {
+  DispatchEvents<std::tuple<BenchSmallEventA, BenchSmallEventB, BenchSmallEventC, BenchSmallEventD>>(state);
+}
+
+BRICKS_BENCHMARK(EndOfFileWithException) {
+  ParseEndOfFile<bricks::cerealize::CerealFileParser<BenchEventBase>>(state);
+}
+BRICKS_BENCHMARK(EndOfFileOfMappedFile) {
+  ParseEndOfFile<bricks::cerealize::CerealMappedFileParser<BenchEventBase>>(state);
+}
+
+BRICKS_BENCHMARK(SerializeJSONLine) {
+  Request request;
+  request.id = 12345678901;
+  request.name = "benchmark";
+  request.points.resize(4);
+  bricks::cerealize::CerealLineBuffer line;
+  std::ostream stream(&line);
+  while (state.KeepRunning()) {
+    line.Clear();
+    {
+      cereal::JSONOutputArchive so(stream, cereal::JSONOutputArchive::Options::NoIndent());
+      so(cereal::make_nvp("value0", request));
+    }
+    DoNotOptimize(line.FinishLine());
+  }
+}
+
+BRICKS_BENCHMARK(ParseJSONWithArchive) {
+  const std::string json = std::string("{\"value0\":") + kRequestJSON + "}";
+  while (state.KeepRunning()) {
+    Request request;
+    bricks::cerealize::CerealMemoryInputBuffer buffer(json.data(), json.data() + json.length());
+    std::istream stream(&buffer);
+    cereal::JSONInputArchive si(stream);
+    si(cereal::make_nvp("value0", request));
+    DoNotOptimize(request);
+  }
+}
+
+// Copies the JSON into the buffer for each parse, as the parsing overwrites it.
+BRICKS_BENCHMARK(ParseJSONInSitu) {
+  const size_t length = std::strlen(kRequestJSON) + 1;
+  std::vector<char> buffer(length);
+  bricks::cerealize::CerealJSONInSituParser parser;
+  Request request;
+  while (state.KeepRunning()) {
+    std::memcpy(buffer.data(), kRequestJSON, length);
+    parser.Parse(buffer.data(), request);
+    DoNotOptimize(request);
+  }
+}
+
+BRICKS_BENCHMARK_MAIN();
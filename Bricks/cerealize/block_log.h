@@ -0,0 +1,450 @@
+// The block log is a binary cereal file of records with timestamps, split into blocks and indexed,
+// for the readers to go over a time range without parsing the whole file.
+//
+// The file starts with `kCerealBlockLogFileMagic`, followed by the blocks and the index:
+// * Each block is `kCerealBlockLogBlockMagic`, its `CerealBlockLogHeader` and its payload. The header
+//   holds the number of records, their minimum and maximum timestamps, and the number of records
+//   of each type. The payload is a binary cereal stream of the timestamps and the records, compressed
+//   with zlib with `BRICKS_CEREALIZE_ZLIB`, unless that does not make it smaller.
+// * The index is the `std::vector<CerealBlockLogBlock>` of the headers of all the blocks with their offsets,
+//   followed by its own offset as `uint64_t` and `kCerealBlockLogIndexMagic`.
+//
+// Each block is written by an archive of its own, thus the polymorphic types of `CEREAL_BASE_TYPE`
+// are registered in each block anew, and the blocks can be parsed independently of one another, in parallel.
+//
+// The index is written when the appender is destructed. Without it, if the appender did not finish,
+// the readers and the appenders rebuild it from the headers of the blocks, up to the last complete one.
+
+#ifndef BRICKS_CEREALIZE_BLOCK_LOG_H
+#define BRICKS_CEREALIZE_BLOCK_LOG_H
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+#if defined(BRICKS_CEREALIZE_ZLIB)
+#include <zlib.h>
+#endif
+
+#include "cerealize.h"
+#include "exceptions.h"
+
+#include "../executor/executor.h"
+#include "../file/file.h"
+#include "../time/chrono.h"
+
+namespace bricks {
+namespace cerealize {
+
+const char kCerealBlockLogFileMagic[] = "CBLOG001";
+const char kCerealBlockLogBlockMagic[] = "CBLK";
+const char kCerealBlockLogIndexMagic[] = "CBLINDEX";
+const size_t kCerealBlockLogFileMagicSize = sizeof(kCerealBlockLogFileMagic) - 1;
+const size_t kCerealBlockLogBlockMagicSize = sizeof(kCerealBlockLogBlockMagic) - 1;
+const size_t kCerealBlockLogIndexMagicSize = sizeof(kCerealBlockLogIndexMagic) - 1;
+
+// The size of the payload of a block, before compression, after which the block is written out.
+const size_t kCerealBlockLogDefaultBlockSize = 1024 * 1024;
+
+const uint32_t kCerealBlockLogCompressed = 1;
+
+struct CerealBlockLogHeader {
+  uint32_t flags = 0;
+  uint64_t stored_size = 0;
+  uint64_t raw_size = 0;
+  uint64_t records = 0;
+  uint64_t min_timestamp = std::numeric_limits<uint64_t>::max();
+  uint64_t max_timestamp = 0;
+  // The number of records of each type, by the names the types are registered with in cereal.
+  std::map<std::string, uint64_t> types;
+
+  template <class A>
+  void serialize(A& ar) {
+    ar(CEREAL_NVP(flags),
+       CEREAL_NVP(stored_size),
+       CEREAL_NVP(raw_size),
+       CEREAL_NVP(records),
+       CEREAL_NVP(min_timestamp),
+       CEREAL_NVP(max_timestamp),
+       CEREAL_NVP(types));
+  }
+};
+
+struct CerealBlockLogBlock {
+  uint64_t offset = 0;
+  uint64_t payload_offset = 0;
+  CerealBlockLogHeader header;
+
+  // Whether the block may have records with the timestamps in [from, to).
+  bool Overlaps(uint64_t from, uint64_t to) const {
+    return header.records && header.max_timestamp >= from && header.min_timestamp < to;
+  }
+
+  template <class A>
+  void serialize(A& ar) {
+    ar(CEREAL_NVP(offset), CEREAL_NVP(payload_offset), CEREAL_NVP(header));
+  }
+};
+
+// The name of type `T` in the type histograms: the one it is registered with in cereal, if it is.
+template <typename T>
+struct CerealBlockLogTypeName {
+  template <typename U>
+  static std::string Impl(decltype(cereal::detail::binding_name<U>::name(), int())) {
+    return cereal::detail::binding_name<U>::name();
+  }
+  template <typename U>
+  static std::string Impl(...) {
+    return typeid(U).name();
+  }
+  static std::string Name() { return Impl<T>(0); }
+};
+
+// Reads the index of the block log in `data`, or, if there is none, rebuilds it from the headers of the blocks.
+// Returns the offset at which the blocks end, and sets `recovered` if the index has been rebuilt.
+// Throws `CerealBlockLogInvalidFileException` if the data does not start with `kCerealBlockLogFileMagic`.
+inline uint64_t LoadCerealBlockLogIndex(const char* data,
+                                        size_t size,
+                                        std::vector<CerealBlockLogBlock>& blocks,
+                                        bool& recovered) {
+  if (size < kCerealBlockLogFileMagicSize ||
+      std::memcmp(data, kCerealBlockLogFileMagic, kCerealBlockLogFileMagicSize)) {
+    throw CerealBlockLogInvalidFileException();
+  }
+  blocks.clear();
+  recovered = false;
+  const size_t trailer_size = sizeof(uint64_t) + kCerealBlockLogIndexMagicSize;
+  if (size >= kCerealBlockLogFileMagicSize + trailer_size &&
+      !std::memcmp(data + size - kCerealBlockLogIndexMagicSize, kCerealBlockLogIndexMagic,
+                   kCerealBlockLogIndexMagicSize)) {
+    uint64_t index_offset;
+    std::memcpy(&index_offset, data + size - trailer_size, sizeof(index_offset));
+    if (index_offset >= kCerealBlockLogFileMagicSize && index_offset <= size - trailer_size) {
+      try {
+        CerealMemoryInputBuffer buffer(data + index_offset, data + size - trailer_size);
+        std::istream stream(&buffer);
+        cereal::BinaryInputArchive archive(stream);
+        archive(blocks);
+        return index_offset;
+      } catch (cereal::Exception&) {
+        blocks.clear();
+      }
+    }
+  }
+  recovered = true;
+  uint64_t offset = kCerealBlockLogFileMagicSize;
+  while (offset + kCerealBlockLogBlockMagicSize <= size &&
+         !std::memcmp(data + offset, kCerealBlockLogBlockMagic, kCerealBlockLogBlockMagicSize)) {
+    CerealBlockLogBlock block;
+    block.offset = offset;
+    try {
+      CerealMemoryInputBuffer buffer(data + offset + kCerealBlockLogBlockMagicSize, data + size);
+      std::istream stream(&buffer);
+      cereal::BinaryInputArchive archive(stream);
+      archive(block.header);
+      block.payload_offset = offset + kCerealBlockLogBlockMagicSize + buffer.Offset();
+    } catch (cereal::Exception&) {
+      break;
+    }
+    if (block.header.stored_size > size - block.payload_offset) {
+      break;
+    }
+    offset = block.payload_offset + block.header.stored_size;
+    blocks.push_back(std::move(block));
+  }
+  return offset;
+}
+
+// `CerealBlockLogAppender` appends the records to a block log, with `Append(timestamp, entry)`, or with
+// `operator<<(entry)` for the current time. As with `CerealFileAppender`, the type of the entry should define
+// `CEREAL_BASE_TYPE`. The block is written out once its payload exceeds `block_size` bytes, and on `Flush()`.
+//
+// With `append`, the blocks are appended to the existing ones, and the index is written anew.
+// Throws `CerealBlockLogInvalidFileException` if the existing file is not a block log.
+class CerealBlockLogAppender final {
+ public:
+  explicit CerealBlockLogAppender(const std::string& filename,
+                                  bool append = true,
+                                  size_t block_size = kCerealBlockLogDefaultBlockSize)
+      : block_size_(block_size) {
+    if (append && FileSize(filename)) {
+      {
+        const MemoryMappedFile file(filename);
+        bool recovered;
+        size_ = LoadCerealBlockLogIndex(file.data(), file.size(), blocks_, recovered);
+      }
+      // Drops the index, or the incomplete block, for the new blocks to follow the existing ones.
+      if (::truncate(filename.c_str(), static_cast<off_t>(size_))) {
+        throw FileException();
+      }
+      fo_.open(filename, std::ofstream::app | std::ofstream::binary);
+    } else {
+      fo_.open(filename, std::ofstream::trunc | std::ofstream::binary);
+      Write(kCerealBlockLogFileMagic, kCerealBlockLogFileMagicSize);
+    }
+    if (!fo_) {
+      throw FileException();
+    }
+    StartBlock();
+  }
+
+  ~CerealBlockLogAppender() {
+    try {
+      WriteBlock();
+      std::ostringstream index;
+      cereal::BinaryOutputArchive archive(index);
+      archive(blocks_);
+      const uint64_t index_offset = size_;
+      Write(index.str().data(), index.str().length());
+      Write(reinterpret_cast<const char*>(&index_offset), sizeof(index_offset));
+      Write(kCerealBlockLogIndexMagic, kCerealBlockLogIndexMagicSize);
+    } catch (const FileException&) {
+      // The next reader or appender rebuilds the index from the blocks that have been written.
+    }
+  }
+
+  template <typename T>
+  typename std::enable_if<sizeof(typename T::CEREAL_BASE_TYPE) != 0, CerealBlockLogAppender&>::type Append(
+      uint64_t timestamp, const T& entry) {
+    (*so_)(timestamp, WithBaseType<typename T::CEREAL_BASE_TYPE>(entry));
+    header_.min_timestamp = std::min(header_.min_timestamp, timestamp);
+    header_.max_timestamp = std::max(header_.max_timestamp, timestamp);
+    ++header_.records;
+    static const std::string name = CerealBlockLogTypeName<T>::Name();
+    ++header_.types[name];
+    if (static_cast<size_t>(os_.tellp()) >= block_size_) {
+      WriteBlock();
+      StartBlock();
+    }
+    return *this;
+  }
+
+  template <typename T>
+  CerealBlockLogAppender& operator<<(const T& entry) {
+    return Append(static_cast<uint64_t>(bricks::time::Now()), entry);
+  }
+
+  // Writes out the current block, even if it is not full.
+  void Flush() {
+    if (header_.records) {
+      WriteBlock();
+      StartBlock();
+    }
+    fo_.flush();
+  }
+
+  const std::vector<CerealBlockLogBlock>& Blocks() const { return blocks_; }
+
+ private:
+  CerealBlockLogAppender() = delete;
+  CerealBlockLogAppender(const CerealBlockLogAppender&) = delete;
+  void operator=(const CerealBlockLogAppender&) = delete;
+
+  static size_t FileSize(const std::string& filename) {
+    std::ifstream fi(filename, std::ifstream::binary | std::ifstream::ate);
+    return fi ? static_cast<size_t>(fi.tellg()) : 0;
+  }
+
+  void Write(const char* data, size_t size) {
+    fo_.write(data, static_cast<std::streamsize>(size));
+    if (fo_.bad()) {
+      throw FileException();
+    }
+    size_ += size;
+  }
+
+  void StartBlock() {
+    os_.str(std::string());
+    CerealBindRegisteredTypes<cereal::BinaryOutputArchive>();
+    so_.reset(new cereal::BinaryOutputArchive(os_));
+    header_ = CerealBlockLogHeader();
+  }
+
+  void WriteBlock() {
+    if (!header_.records) {
+      return;
+    }
+    so_.reset();
+    const std::string raw = os_.str();
+    header_.raw_size = raw.length();
+    const std::string* payload = &raw;
+#if defined(BRICKS_CEREALIZE_ZLIB)
+    uLongf compressed_size = ::compressBound(static_cast<uLong>(raw.length()));
+    std::string compressed(compressed_size, '\0');
+    if (::compress(reinterpret_cast<Bytef*>(&compressed[0]),
+                   &compressed_size,
+                   reinterpret_cast<const Bytef*>(raw.data()),
+                   static_cast<uLong>(raw.length())) == Z_OK &&
+        compressed_size < raw.length()) {
+      compressed.resize(compressed_size);
+      header_.flags |= kCerealBlockLogCompressed;
+      payload = &compressed;
+    }
+#endif
+    header_.stored_size = payload->length();
+    std::ostringstream header;
+    cereal::BinaryOutputArchive archive(header);
+    archive(header_);
+    CerealBlockLogBlock block;
+    block.offset = size_;
+    block.payload_offset = size_ + kCerealBlockLogBlockMagicSize + header.str().length();
+    block.header = header_;
+    Write(kCerealBlockLogBlockMagic, kCerealBlockLogBlockMagicSize);
+    Write(header.str().data(), header.str().length());
+    Write(payload->data(), payload->length());
+    blocks_.push_back(std::move(block));
+  }
+
+  const size_t block_size_;
+  std::ofstream fo_;
+  // The number of bytes in the file.
+  uint64_t size_ = 0;
+  std::vector<CerealBlockLogBlock> blocks_;
+
+  // The current block, serialized by an archive of its own.
+  CerealBlockLogHeader header_;
+  std::ostringstream os_;
+  std::unique_ptr<cereal::BinaryOutputArchive> so_;
+};
+
+// `CerealBlockLogReader` parses the records of a block log from memory, mapped with `MemoryMappedFile`.
+// `SelectBlocks()` finds the blocks that may have the records in a time range, and of a type, by their headers.
+// `ForEachInBlock()`, `ForEach()` and `ParseInParallel()` call `f` for the records with the timestamps
+// in [from, to), parsing only the blocks overlapping the range.
+//
+// Throws `CerealBlockLogInvalidFileException` if the file is not a block log, and, while parsing,
+// `CerealBlockLogCorruptedBlockException` if a block fails to decompress, `cereal::Exception` if it fails
+// to parse, and `CerealBlockLogCompressionNotSupportedException` for the compressed ones
+// without `BRICKS_CEREALIZE_ZLIB`.
+template <typename T_ENTRY>
+class CerealBlockLogReader final {
+ public:
+  explicit CerealBlockLogReader(const std::string& filename) : file_(filename) {
+    LoadCerealBlockLogIndex(file_.data(), file_.size(), blocks_, recovered_);
+  }
+
+  const std::vector<CerealBlockLogBlock>& Blocks() const { return blocks_; }
+
+  // Whether the index has been rebuilt from the headers of the blocks, since the file had none.
+  bool Recovered() const { return recovered_; }
+
+  // The indexes of the blocks overlapping [from, to), and with the records of `type`, unless it is empty.
+  std::vector<size_t> SelectBlocks(uint64_t from = 0,
+                                   uint64_t to = std::numeric_limits<uint64_t>::max(),
+                                   const std::string& type = "") const {
+    std::vector<size_t> result;
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      if (blocks_[i].Overlaps(from, to) && (type.empty() || blocks_[i].header.types.count(type))) {
+        result.push_back(i);
+      }
+    }
+    return result;
+  }
+
+  // Calls `f(timestamp, const T_ENTRY&)` for the records of the block in [from, to), and returns their number.
+  template <typename F>
+  size_t ForEachInBlock(size_t index,
+                        F&& f,
+                        uint64_t from = 0,
+                        uint64_t to = std::numeric_limits<uint64_t>::max()) const {
+    const CerealBlockLogBlock& block = blocks_[index];
+    const char* begin = file_.data() + block.payload_offset;
+    const char* end = begin + block.header.stored_size;
+    std::string raw;
+    if (block.header.flags & kCerealBlockLogCompressed) {
+#if defined(BRICKS_CEREALIZE_ZLIB)
+      raw.resize(block.header.raw_size);
+      uLongf raw_size = static_cast<uLongf>(block.header.raw_size);
+      if (::uncompress(reinterpret_cast<Bytef*>(&raw[0]),
+                       &raw_size,
+                       reinterpret_cast<const Bytef*>(begin),
+                       static_cast<uLong>(block.header.stored_size)) != Z_OK ||
+          raw_size != block.header.raw_size) {
+        throw CerealBlockLogCorruptedBlockException();
+      }
+      begin = raw.data();
+      end = begin + raw.length();
+#else
+      throw CerealBlockLogCompressionNotSupportedException();
+#endif
+    }
+    CerealMemoryInputBuffer buffer(begin, end);
+    std::istream stream(&buffer);
+    CerealBindRegisteredTypes<cereal::BinaryInputArchive>();
+    cereal::BinaryInputArchive si(stream);
+    size_t count = 0;
+    for (uint64_t i = 0; i < block.header.records; ++i) {
+      uint64_t timestamp;
+      std::unique_ptr<T_ENTRY> entry;
+      si(timestamp, entry);
+      if (timestamp >= from && timestamp < to) {
+        f(timestamp, *entry.get());
+        ++count;
+      }
+    }
+    return count;
+  }
+
+  // Calls `f(timestamp, const T_ENTRY&)` for the records in [from, to), in order, and returns their number.
+  template <typename F>
+  size_t ForEach(F&& f, uint64_t from = 0, uint64_t to = std::numeric_limits<uint64_t>::max()) const {
+    size_t count = 0;
+    for (size_t index : SelectBlocks(from, to)) {
+      count += ForEachInBlock(index, f, from, to);
+    }
+    return count;
+  }
+
+  // Calls `f(slot_index, timestamp, const T_ENTRY&)` for the records in [from, to), from `threads` slots
+  // run concurrently on `Executor::Shared()`, each taking the next block to decompress and parse. The calls
+  // for a slot come from one thread at a time. The records of each block are passed in order.
+  // Rethrows the first exception thrown by `f` or the parsing.
+  template <typename F>
+  void ParseInParallel(size_t threads,
+                       F&& f,
+                       uint64_t from = 0,
+                       uint64_t to = std::numeric_limits<uint64_t>::max()) const {
+    const std::vector<size_t> selected = SelectBlocks(from, to);
+    if (selected.empty()) {
+      return;
+    }
+    threads = std::max(static_cast<size_t>(1), std::min(threads, selected.size()));
+    std::atomic_size_t next(0);
+    Executor::Shared().ParallelFor(0, threads, [this, &selected, &next, &f, from, to](size_t t) {
+      try {
+        for (size_t i = next++; i < selected.size(); i = next++) {
+          ForEachInBlock(selected[i], [&f, t](uint64_t timestamp, const T_ENTRY& entry) {
+            f(t, timestamp, entry);
+          }, from, to);
+        }
+      } catch (...) {
+        next = selected.size();
+        throw;
+      }
+    });
+  }
+
+ private:
+  CerealBlockLogReader() = delete;
+  CerealBlockLogReader(const CerealBlockLogReader&) = delete;
+  void operator=(const CerealBlockLogReader&) = delete;
+
+  const MemoryMappedFile file_;
+  std::vector<CerealBlockLogBlock> blocks_;
+  bool recovered_;
+};
+
+}  // namespace cerealize
+}  // namespace bricks
+
+#endif  // BRICKS_CEREALIZE_BLOCK_LOG_H
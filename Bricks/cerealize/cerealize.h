@@ -1,19 +1,91 @@
 #ifndef BRICKS_CEREALIZE_H
 #define BRICKS_CEREALIZE_H
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <istream>
+#include <limits>
+#include <streambuf>
+#include <vector>
 
 #include "../3party/cereal/include/types/string.hpp"
 #include "../3party/cereal/include/types/vector.hpp"
 #include "../3party/cereal/include/types/map.hpp"
 
-#include "../3party/cereal/include/types/polymorphic.hpp"
-
-#include "../3party/cereal/include/archives/binary.hpp"
-#include "../3party/cereal/include/archives/json.hpp"
-#include "../3party/cereal/include/archives/xml.hpp"
+#include "arena.h"
+#include "envelope.h"
+#include "flat.h"
+#include "registration.h"
 
+#include "../executor/executor.h"
+#include "../file/file.h"
 #include "../rtti/dispatcher.h"
+#include "../rtti/variant.h"
+
+namespace bricks {
+namespace cerealize {
+namespace impl {
+
+template <class A>
+struct CerealVariantValueSaver {
+  A& ar;
+  template <typename T>
+  void operator()(const T& value) {
+    ar(cereal::make_nvp("value", value));
+  }
+};
+
+template <class A>
+struct CerealVariantValueLoader {
+  A& ar;
+  template <typename T>
+  void operator()(T& value) {
+    ar(cereal::make_nvp("value", value));
+  }
+};
+
+}  // namespace impl
+}  // namespace cerealize
+}  // namespace bricks
+
+// The variants of `rtti/variant.h` are the index of the type of the value, and the value, in all the formats.
+// The index is the position of the type in the list: the types can be appended to it, not reordered.
+// The value is parsed into the one the variant holds already if it is of the same type.
+namespace cereal {
+template <class A, typename... TYPES>
+void save(A& ar, const bricks::rtti::Variant<TYPES...>& variant) {
+  ar(make_nvp("index", static_cast<std::uint32_t>(variant.Index())));
+  bricks::cerealize::impl::CerealVariantValueSaver<A> saver{ar};
+  variant.Visit(saver);
+}
+template <class A, typename... TYPES>
+void load(A& ar, bricks::rtti::Variant<TYPES...>& variant) {
+  std::uint32_t index;
+  ar(make_nvp("index", index));
+  if (index >= sizeof...(TYPES)) {
+    throw Exception("The index of the type of the variant is out of range.");
+  }
+  variant.EmplaceIndex(index);
+  bricks::cerealize::impl::CerealVariantValueLoader<A> loader{ar};
+  variant.Visit(loader);
+}
+}  // namespace cereal
+
+#ifndef BRICKS_CEREALIZE_NO_JSON
+// The JSON archives of Cereal serialize `std::string` only, and not the strings with other allocators.
+namespace cereal {
+inline void save(JSONOutputArchive& ar, const bricks::cerealize::CerealArenaString& str) {
+  ar.saveValue(std::string(str.data(), str.length()));
+}
+inline void load(JSONInputArchive& ar, bricks::cerealize::CerealArenaString& str) {
+  std::string value;
+  ar.loadValue(value);
+  str.assign(value.data(), value.length());
+}
+}  // namespace cereal
+#endif  // BRICKS_CEREALIZE_NO_JSON
 
 namespace bricks {
 namespace cerealize {
@@ -36,7 +108,8 @@ WithBaseType(const ENTRY& object) {
 }
 
 // Enumeration for compile-time format selection.
-enum class CerealFormat { Default = 0, Binary = 0, JSON };
+// `JSONLines` is one JSON object per record per line, written and parsed with an archive per line.
+enum class CerealFormat { Default = 0, Binary = 0, JSON, JSONLines };
 
 // Templated stream types.
 template <CerealFormat>
@@ -48,29 +121,157 @@ struct CerealStreamType<CerealFormat::Binary> {
   typedef cereal::BinaryOutputArchive Output;
 };
 
+#ifndef BRICKS_CEREALIZE_NO_JSON
 template <>
 struct CerealStreamType<CerealFormat::JSON> {
   typedef cereal::JSONInputArchive Input;
   typedef cereal::JSONOutputArchive Output;
 };
 
+template <>
+struct CerealStreamType<CerealFormat::JSONLines> {
+  typedef cereal::JSONInputArchive Input;
+  typedef cereal::JSONOutputArchive Output;
+};
+#endif  // BRICKS_CEREALIZE_NO_JSON
+
+// `CerealOutputBuffer` is the `std::streambuf` the appenders serialize into: the archives write the records
+// into a buffer of `buffer_size` bytes with no virtual calls until it fills up, and the buffer goes out
+// to `T_OUTPUT_FILE` in one `write()` and `flush()` when it does, or on `pubsync()`. The writes larger
+// than the buffer bypass it. `T_OUTPUT_FILE` is `std::ofstream` or `bricks::PosixOutputFile`, or anything else
+// with `write(const char*, std::streamsize)`, `flush()` and `bad()`.
+template <typename T_OUTPUT_FILE>
+class CerealOutputBuffer final : public std::streambuf {
+ public:
+  CerealOutputBuffer(T_OUTPUT_FILE& file, size_t buffer_size) : file_(file), buffer_(buffer_size) {
+    setp(&buffer_[0], &buffer_[0] + buffer_.size());
+  }
+  ~CerealOutputBuffer() { sync(); }
+
+  size_t BufferedSize() const { return static_cast<size_t>(pptr() - pbase()); }
+
+ protected:
+  int_type overflow(int_type c) override {
+    if (sync()) {
+      return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(const char* data, std::streamsize length) override {
+    const size_t size = static_cast<size_t>(length);
+    if (size > static_cast<size_t>(epptr() - pptr())) {
+      if (sync()) {
+        return 0;
+      }
+      if (size >= buffer_.size()) {
+        file_.write(data, length);
+        file_.flush();
+        return file_.bad() ? 0 : length;
+      }
+    }
+    std::memcpy(pptr(), data, size);
+    pbump(static_cast<int>(size));
+    return length;
+  }
+
+  int sync() override {
+    if (pptr() != pbase()) {
+      file_.write(pbase(), pptr() - pbase());
+      file_.flush();
+      setp(&buffer_[0], &buffer_[0] + buffer_.size());
+    }
+    return file_.bad() ? -1 : 0;
+  }
+
+ private:
+  T_OUTPUT_FILE& file_;
+  std::vector<char> buffer_;
+};
+
+const size_t kCerealFileAppenderDefaultBufferSize = 1024 * 1024;
+
 // `CerealFileAppender` appends cereal-ized records to a file.
 // The format is selected by a template parameter, defaults to binary. All formats are supported.
 // Writes are performed using templated `operator <<(const T& entry)`.
 // Is type `T` defines a typedef of `CEREAL_BASE_TYPE`, polymorphic serialization is used.
-template <CerealFormat T_CEREAL_FORMAT>
+// The derived types are registered with `CEREAL_REGISTER_TYPE_WITH_NAME()`, or with
+// `BRICKS_CEREALIZE_REGISTER_TYPE_WITH_NAME()` to be bound to the archives on first use, see `registration.h`.
+// In the binary format, the types with `BRICKS_FLAT_FIELDS` are written as flat records instead, see `flat.h`.
+//
+// The records are buffered in a `CerealOutputBuffer` of `buffer_size` bytes, reused from one write
+// to the next, and reach the file once it fills up, on `Flush()`, and on destruction. With
+// `bricks::PosixOutputFile` as `T_OUTPUT_FILE` they are written with plain `write()`-s to the file descriptor.
+// The JSON formats serialize the flat types with cereal, as any other ones.
+template <typename T, CerealFormat T_CEREAL_FORMAT>
+struct IsFlatRecordType {
+  enum { value = HasFlatFields<T>::value && T_CEREAL_FORMAT == CerealFormat::Binary };
+};
+
+template <CerealFormat T_CEREAL_FORMAT, typename T_OUTPUT_FILE = std::ofstream>
 class GenericCerealFileAppender {
  public:
-  explicit GenericCerealFileAppender(const std::string& filename, bool append = true)
-      : fo_(filename, (append ? std::ofstream::app : std::ofstream::trunc) | std::ofstream::binary), so_(fo_) {}
+  explicit GenericCerealFileAppender(const std::string& filename,
+                                     bool append = true,
+                                     size_t buffer_size = kCerealFileAppenderDefaultBufferSize)
+      : fo_(filename, (append ? std::ofstream::app : std::ofstream::trunc) | std::ofstream::binary),
+        buffer_(fo_, buffer_size),
+        os_(&buffer_),
+        so_(os_) {
+    CerealBindRegisteredTypes<typename CerealStreamType<T_CEREAL_FORMAT>::Output>();
+  }
 
   template <typename T>
-  typename std::enable_if<sizeof(typename T::CEREAL_BASE_TYPE) != 0, GenericCerealFileAppender&>::type
+  typename std::enable_if<sizeof(typename T::CEREAL_BASE_TYPE) != 0 &&
+                              !IsFlatRecordType<T, T_CEREAL_FORMAT>::value,
+                          GenericCerealFileAppender&>::type
   operator<<(const T& entry) {
-    so_(WithBaseType<typename T::CEREAL_BASE_TYPE>(entry));
+    WritePolymorphic(WithBaseType<typename T::CEREAL_BASE_TYPE>(entry),
+                     std::is_polymorphic<typename T::CEREAL_BASE_TYPE>());
     return *this;
   }
 
+  // The object pointed to, by its base type `T`, as the one of the polymorphic types derived from it it is.
+  template <typename T, typename T_DELETER>
+  GenericCerealFileAppender& operator<<(const std::unique_ptr<T, T_DELETER>& entry) {
+    WritePolymorphic(WithBaseType<T>(*entry), std::is_polymorphic<T>());
+    return *this;
+  }
+
+  // The flat record goes into the buffer in one piece, past the cereal-ized records written before it.
+  template <typename T>
+  typename std::enable_if<IsFlatRecordType<T, T_CEREAL_FORMAT>::value, GenericCerealFileAppender&>::type
+  operator<<(const T& entry) {
+    char record[FlatCodec<T>::kRecordSize];
+    FlatCodec<T>::EncodeRecord(entry, record);
+    buffer_.sputn(record, static_cast<std::streamsize>(sizeof(record)));
+    return *this;
+  }
+
+  // The variant is written as it is, as the index of the type of its value followed by the value,
+  // with no polymorphic type name, see `NextVariant()` of the parsers.
+  template <typename... TYPES>
+  GenericCerealFileAppender& operator<<(const rtti::Variant<TYPES...>& entry) {
+    so_(entry);
+    return *this;
+  }
+
+  // Writes out the buffered records. The JSON format is only complete once the appender is destructed,
+  // while the JSON lines one is after each record.
+  void Flush() { buffer_.pubsync(); }
+
+  size_t BufferedSize() const { return buffer_.BufferedSize(); }
+
+  // Has the polymorphic records of the binary format written from now on go behind an envelope, for the
+  // selective scans to skip the ones of the types they do not need, see `envelope.h`. Ignored by the others.
+  void EnvelopeRecords(bool envelope = true) {
+    envelope_records_ = envelope && T_CEREAL_FORMAT == CerealFormat::Binary;
+  }
+
  private:
   GenericCerealFileAppender() = delete;
   GenericCerealFileAppender(const GenericCerealFileAppender&) = delete;
@@ -78,23 +279,97 @@ class GenericCerealFileAppender {
   GenericCerealFileAppender(GenericCerealFileAppender&&) = delete;
   void operator=(GenericCerealFileAppender&&) = delete;
 
-  std::ofstream fo_;
+  // The enveloped record is serialized aside first, by the same archive, and goes into the buffer
+  // behind its header once its length is known.
+  template <typename T_POINTER>
+  void WritePolymorphic(const T_POINTER& pointer, std::true_type) {
+    if (!envelope_records_) {
+      so_(pointer);
+      return;
+    }
+    envelope_buffer_.Clear();
+    os_.rdbuf(&envelope_buffer_);
+    try {
+      so_(pointer);
+    } catch (...) {
+      os_.rdbuf(&buffer_);
+      throw;
+    }
+    os_.rdbuf(&buffer_);
+    if (envelope_buffer_.Size() > std::numeric_limits<std::uint32_t>::max()) {
+      throw cereal::Exception("The record is too large to be enveloped.");
+    }
+    char header[kEnvelopedRecordHeaderSize];
+    EncodeEnvelopeHeader(envelope_type_ids_.Of(envelope_buffer_.Data(), envelope_buffer_.Size()),
+                         static_cast<std::uint32_t>(envelope_buffer_.Size()),
+                         header);
+    buffer_.sputn(header, static_cast<std::streamsize>(sizeof(header)));
+    buffer_.sputn(envelope_buffer_.Data(), static_cast<std::streamsize>(envelope_buffer_.Size()));
+  }
+  // The records of the types that are not polymorphic are never enveloped.
+  template <typename T_POINTER>
+  void WritePolymorphic(const T_POINTER& pointer, std::false_type) {
+    so_(pointer);
+  }
+
+  // Destructed in the reverse order: the archive completes its output before the buffer writes it out.
+  T_OUTPUT_FILE fo_;
+  CerealOutputBuffer<T_OUTPUT_FILE> buffer_;
+  std::ostream os_;
   typename CerealStreamType<T_CEREAL_FORMAT>::Output so_;
+  bool envelope_records_ = false;
+  CerealEnvelopeBuffer envelope_buffer_;
+  CerealEnvelopeTypeIds envelope_type_ids_;
 };
 typedef GenericCerealFileAppender<CerealFormat::Default> CerealFileAppender;
 
+const size_t kCerealArenaDefaultBatchSize = 1000;
+
+// Parses the entries with `parse(entry)`, which returns false past the last one, in batches of `batch_size`
+// constructed in `arena`, calls `f(const T_ENTRY&)` for each, and resets the arena after each batch.
+// Returns the number of entries.
+template <typename T_ENTRY, typename T_PARSE, typename F>
+size_t ForEachInArenaBatches(CerealArena& arena, size_t batch_size, T_PARSE&& parse, F&& f) {
+  size_t total = 0;
+  bool more = true;
+  while (more) {
+    {
+      const ScopedCerealArena scope(arena);
+      // Destructed before `scope`, for the entries and their members to be freed to the arena.
+      std::vector<std::unique_ptr<T_ENTRY>> batch;
+      batch.reserve(batch_size);
+      while (batch.size() < batch_size) {
+        std::unique_ptr<T_ENTRY> entry;
+        if (!parse(entry)) {
+          more = false;
+          break;
+        }
+        batch.push_back(std::move(entry));
+      }
+      for (const std::unique_ptr<T_ENTRY>& entry : batch) {
+        f(*entry.get());
+      }
+      total += batch.size();
+    }
+    arena.Reset();
+  }
+  return total;
+}
+
 // `CerealFileParser` de-cereal-izes records from file given their type and passes them over to `T_PROCESSOR`.
 template <typename T_ENTRY, CerealFormat T_CEREAL_FORMAT>
 class GenericCerealFileParser {
  public:
-  explicit GenericCerealFileParser(const std::string& filename) : fi_(filename), si_(fi_) {}
+  explicit GenericCerealFileParser(const std::string& filename) : fi_(filename), si_(fi_) {
+    CerealBindRegisteredTypes<typename CerealStreamType<T_CEREAL_FORMAT>::Input>();
+  }
 
   // `Next` calls `T_PROCESSOR::operator()(const T_ENTRY&)` for the next entry, or returns false.
   template <typename T_PROCESSOR>
   bool Next(T_PROCESSOR& processor) {
     try {
       std::unique_ptr<T_ENTRY> entry;
-      si_(entry);
+      Parse(entry);
       processor(*entry.get());
       return true;
     } catch (cereal::Exception&) {
@@ -125,10 +400,10 @@ class GenericCerealFileParser {
   bool NextWithDispatching(T_PROCESSOR& processor) {
     try {
       std::unique_ptr<T_ENTRY> entry;
-      si_(entry);
-      bricks::rtti::RuntimeTupleDispatcher<typename T_PROCESSOR::BASE_TYPE,
-                                           typename T_PROCESSOR::DERIVED_TYPE_LIST>::DispatchCall(*entry.get(),
-                                                                                                  processor);
+      Parse(entry);
+      typedef bricks::rtti::RuntimeTupleTableDispatcher<typename T_PROCESSOR::BASE_TYPE,
+                                                        typename T_PROCESSOR::DERIVED_TYPE_LIST> Dispatcher;
+      Dispatcher::DispatchCall(*entry.get(), processor);
       return true;
     } catch (cereal::Exception&) {
       // TODO(dkorolev): Should check whether we have reached the end of the file here, otherwise
@@ -138,6 +413,66 @@ class GenericCerealFileParser {
     }
   }
 
+  // `NextOfTypes` is `NextWithDispatching` for the entries of the types of `T_PROCESSOR::DERIVED_TYPE_LIST`
+  // only: the enveloped and the flat entries of the other types are skipped without being parsed,
+  // see `envelope.h`, and the processor is not called for them.
+  template <typename T_PROCESSOR>
+  bool NextOfTypes(T_PROCESSOR& processor) {
+    typedef CerealRecordTypeFilter<typename T_PROCESSOR::DERIVED_TYPE_LIST> T_FILTER;
+    try {
+      std::unique_ptr<T_ENTRY> entry;
+      while (!ParseUnlessSkipped(entry, T_FILTER::Instance())) {
+      }
+      typedef bricks::rtti::RuntimeTupleTableDispatcher<typename T_PROCESSOR::BASE_TYPE,
+                                                        typename T_PROCESSOR::DERIVED_TYPE_LIST> Dispatcher;
+      Dispatcher::DispatchCall(*entry.get(), processor);
+      return true;
+    } catch (cereal::Exception&) {
+      return false;
+    }
+  }
+
+  // `NextVariant` parses the next entry, written as a `bricks::rtti::Variant`, into `variant`, or returns
+  // false. The value is parsed in place, into the one held already if it is of the same type, with neither
+  // a `std::unique_ptr` nor a polymorphic type name per entry. `T_ENTRY` can be the variant itself.
+  template <typename... TYPES>
+  bool NextVariant(rtti::Variant<TYPES...>& variant) {
+    try {
+      si_(variant);
+      return true;
+    } catch (cereal::Exception&) {
+      return false;
+    }
+  }
+
+  // `NextWithVariantDispatching` calls `T_PROCESSOR::operator()(const T&)` for the next entry, written as
+  // the variant of `T_PROCESSOR::DERIVED_TYPE_LIST`, dispatched with its jump table, or returns false.
+  template <typename T_PROCESSOR>
+  bool NextWithVariantDispatching(T_PROCESSOR& processor) {
+    typedef typename rtti::TupleVariant<typename T_PROCESSOR::DERIVED_TYPE_LIST>::type T_VARIANT;
+    T_VARIANT variant;
+    if (!NextVariant(variant)) {
+      return false;
+    }
+    static_cast<const T_VARIANT&>(variant).Visit(processor);
+    return true;
+  }
+
+  // `ForEachInArena` calls `f(const T_ENTRY&)` for each of the remaining entries, parsed in batches
+  // of `batch_size` into `arena`, to not allocate and free the memory for each, see `arena.h`.
+  // Returns the number of entries.
+  template <typename F>
+  size_t ForEachInArena(CerealArena& arena, F&& f, size_t batch_size = kCerealArenaDefaultBatchSize) {
+    return ForEachInArenaBatches<T_ENTRY>(arena, batch_size, [this](std::unique_ptr<T_ENTRY>& entry) {
+      try {
+        Parse(entry);
+        return true;
+      } catch (cereal::Exception&) {
+        return false;
+      }
+    }, std::forward<F>(f));
+  }
+
  private:
   GenericCerealFileParser() = delete;
   GenericCerealFileParser(const GenericCerealFileParser&) = delete;
@@ -145,12 +480,575 @@ class GenericCerealFileParser {
   GenericCerealFileParser(GenericCerealFileParser&&) = delete;
   void operator=(GenericCerealFileParser&&) = delete;
 
+  void Parse(std::unique_ptr<T_ENTRY>& entry) { ParseUnlessSkipped(entry, CerealAllRecordTypes()); }
+
+  // In the binary format, looks at the four bytes the record starts with first: the flat record is parsed
+  // right here, the enveloped one is parsed past its header, and the others are put back for the archive
+  // to parse. The flat and the enveloped records of the types `filter` does not match are skipped instead,
+  // and false is returned for them. Throws `cereal::Exception` past the end.
+  template <typename T_FILTER>
+  bool ParseUnlessSkipped(std::unique_ptr<T_ENTRY>& entry, const T_FILTER& filter) {
+    if (T_CEREAL_FORMAT == CerealFormat::Binary && std::is_polymorphic<T_ENTRY>::value) {
+      std::streambuf& input = *fi_.rdbuf();
+      char header[kEnvelopedRecordHeaderSize];
+      const std::streamsize length = input.sgetn(header, kFlatRecordHeaderSize);
+      std::uint32_t tag;
+      if (length == kFlatRecordHeaderSize && IsFlatRecordHeader(header, tag)) {
+        if (!filter.MatchesFlatTag(tag)) {
+          SkipInput(FlatTypeRegistry<T_ENTRY>::Instance().Get(tag).size);
+          return false;
+        }
+        ParseFlat(tag, entry);
+        return true;
+      }
+      if (length == kFlatRecordHeaderSize && HasEnvelopedRecordMarker(header)) {
+        const std::streamsize rest = kEnvelopedRecordHeaderSize - kFlatRecordHeaderSize;
+        std::uint32_t type_id;
+        std::uint32_t record_length;
+        if (input.sgetn(header + kFlatRecordHeaderSize, rest) != rest ||
+            !IsEnvelopedRecordHeader(header, type_id, record_length)) {
+          throw cereal::Exception("The enveloped record is truncated.");
+        }
+        if (!filter.MatchesTypeId(type_id)) {
+          SkipEnvelopedRecord(record_length);
+          return false;
+        }
+        si_(entry);
+        return true;
+      }
+      // The header is usually still in the buffer of the file, otherwise the file is seeked back.
+      std::streamsize back = 0;
+      while (back < length && !traits::eq_int_type(input.sungetc(), traits::eof())) {
+        ++back;
+      }
+      if (back < length) {
+        input.pubseekoff(back - length, std::ios_base::cur, std::ios_base::in);
+      }
+    }
+    si_(entry);
+    return true;
+  }
+
+  // The record naming its type is read in full, for the archive to learn the name, and the others are skipped.
+  void SkipEnvelopedRecord(std::uint32_t length) {
+    std::streambuf& input = *fi_.rdbuf();
+    const std::streamsize size = static_cast<std::streamsize>(length);
+    skipped_record_.resize(sizeof(std::uint32_t));
+    if (length < sizeof(std::uint32_t) ||
+        input.sgetn(skipped_record_.data(), sizeof(std::uint32_t)) != sizeof(std::uint32_t)) {
+      throw cereal::Exception("The enveloped record is truncated.");
+    }
+    if (!CerealRecordMayNameType(skipped_record_.data())) {
+      SkipInput(length - sizeof(std::uint32_t));
+      return;
+    }
+    skipped_record_.resize(length);
+    const std::streamsize rest = size - static_cast<std::streamsize>(sizeof(std::uint32_t));
+    if (input.sgetn(skipped_record_.data() + sizeof(std::uint32_t), rest) != rest) {
+      throw cereal::Exception("The enveloped record is truncated.");
+    }
+    std::uint32_t id;
+    std::string name;
+    if (CerealRecordNamesType(skipped_record_.data(), length, id, name)) {
+      si_.registerPolymorphicName(id, name);
+    }
+  }
+
+  // The small records are read past, mostly within the buffer of the file, and the larger ones seeked over.
+  void SkipInput(size_t size) {
+    std::streambuf& input = *fi_.rdbuf();
+    char skipped[4096];
+    if (size > sizeof(skipped)) {
+      input.pubseekoff(static_cast<std::streamoff>(size), std::ios_base::cur, std::ios_base::in);
+    } else if (input.sgetn(skipped, static_cast<std::streamsize>(size)) != static_cast<std::streamsize>(size)) {
+      throw cereal::Exception("The skipped record is truncated.");
+    }
+  }
+
+  void ParseFlat(std::uint32_t tag, std::unique_ptr<T_ENTRY>& entry) {
+    const typename FlatTypeRegistry<T_ENTRY>::Type& type = FlatTypeRegistry<T_ENTRY>::Instance().Get(tag);
+    flat_fields_.resize(type.size);
+    const std::streamsize size = static_cast<std::streamsize>(type.size);
+    if (fi_.rdbuf()->sgetn(flat_fields_.data(), size) != size) {
+      throw cereal::Exception("The flat record is truncated.");
+    }
+    entry.reset(type.decode(flat_fields_.data()));
+  }
+
+  typedef std::char_traits<char> traits;
+
   std::ifstream fi_;
   typename CerealStreamType<T_CEREAL_FORMAT>::Input si_;
+  // The fields of the flat record, and the skipped record naming its type, reused from one to the next.
+  std::vector<char> flat_fields_;
+  std::vector<char> skipped_record_;
 };
 template <typename T_ENTRY>
 using CerealFileParser = GenericCerealFileParser<T_ENTRY, CerealFormat::Default>;
 
+// `CerealMemoryInputBuffer` is the `std::streambuf` the binary archive reads the mapped file from, in place.
+class CerealMemoryInputBuffer final : public std::streambuf {
+ public:
+  CerealMemoryInputBuffer(const char* begin, const char* end) {
+    char* b = const_cast<char*>(begin);
+    setg(b, b, b + (end - begin));
+  }
+  size_t Offset() const { return static_cast<size_t>(gptr() - eback()); }
+  bool AtEnd() const { return gptr() == egptr(); }
+
+  // The unread part, for the flat records to be parsed in place and skipped.
+  const char* Current() const { return gptr(); }
+  const char* End() const { return egptr(); }
+  void Skip(size_t size) { gbump(static_cast<int>(size)); }
+};
+
+// Parses the next record from `buffer`, either the flat one in place, or with `archive` reading from it,
+// past the envelope if there is one. The flat and the enveloped records of the types `filter` does not match
+// are skipped instead, with the type the skipped record names registered with `archive`, and false is returned.
+template <typename T_ENTRY, typename T_FILTER = CerealAllRecordTypes>
+bool ParseCerealRecordInMemory(CerealMemoryInputBuffer& buffer,
+                               cereal::BinaryInputArchive& archive,
+                               std::unique_ptr<T_ENTRY>& entry,
+                               const T_FILTER& filter = T_FILTER()) {
+  if (std::is_polymorphic<T_ENTRY>::value) {
+    const size_t available = static_cast<size_t>(buffer.End() - buffer.Current());
+    std::uint32_t tag;
+    if (available >= kFlatRecordHeaderSize && IsFlatRecordHeader(buffer.Current(), tag) &&
+        !filter.MatchesFlatTag(tag)) {
+      const size_t size = kFlatRecordHeaderSize + FlatTypeRegistry<T_ENTRY>::Instance().Get(tag).size;
+      if (size > available) {
+        throw cereal::Exception("The flat record is truncated.");
+      }
+      buffer.Skip(size);
+      return false;
+    }
+    std::uint32_t type_id;
+    std::uint32_t length;
+    if (available >= kEnvelopedRecordHeaderSize && IsEnvelopedRecordHeader(buffer.Current(), type_id, length)) {
+      if (length > available - kEnvelopedRecordHeaderSize) {
+        throw cereal::Exception("The enveloped record is truncated.");
+      }
+      buffer.Skip(kEnvelopedRecordHeaderSize);
+      if (!filter.MatchesTypeId(type_id)) {
+        std::uint32_t id;
+        std::string name;
+        if (CerealRecordNamesType(buffer.Current(), length, id, name)) {
+          archive.registerPolymorphicName(id, name);
+        }
+        buffer.Skip(length);
+        return false;
+      }
+      archive(entry);
+      return true;
+    }
+  }
+  const size_t size = ParseFlatRecord(buffer.Current(), buffer.End(), entry);
+  if (size) {
+    buffer.Skip(size);
+  } else {
+    archive(entry);
+  }
+  return true;
+}
+
+// The offsets of the records of a binary cereal file, and the names of the polymorphic types,
+// each with the index of the record that introduces it, for the parsing to start from any record.
+struct CerealFileIndex {
+  struct PolymorphicName {
+    size_t record;
+    std::uint32_t id;
+    std::string name;
+  };
+  std::vector<size_t> offsets;
+  std::vector<PolymorphicName> names;
+};
+
+// `CerealMappedFileParser` parses a binary cereal file, such as written by `CerealFileAppender`,
+// from memory, mapped with `MemoryMappedFile`. `Next()`, `NextLambda()` and `NextWithDispatching()`
+// are the same as those of `GenericCerealFileParser`, except that the end of the file is checked for
+// before parsing the next record: they return false there, and let the `cereal::Exception` through
+// for the records that are truncated or malformed.
+//
+// `BuildIndex()` parses the file once to find where the records start. With the index, `ParseInParallel()`
+// splits the records into `threads` ranges and parses them on the workers of `Executor::Shared()`, each with
+// an archive of its own that knows the polymorphic type names introduced before the range.
+template <typename T_ENTRY>
+class CerealMappedFileParser {
+ public:
+  explicit CerealMappedFileParser(const std::string& filename)
+      : file_(filename), buffer_(file_.data(), file_.data() + file_.size()), stream_(&buffer_), si_(stream_) {
+    CerealBindRegisteredTypes<cereal::BinaryInputArchive>();
+  }
+
+  bool AtEnd() const { return buffer_.AtEnd(); }
+
+  template <typename T_PROCESSOR>
+  bool Next(T_PROCESSOR& processor) {
+    if (AtEnd()) {
+      return false;
+    }
+    std::unique_ptr<T_ENTRY> entry;
+    ParseCerealRecordInMemory(buffer_, si_, entry);
+    processor(*entry.get());
+    return true;
+  }
+
+  template <typename T_PROCESSOR>
+  bool NextLambda(T_PROCESSOR processor) {
+    return Next(processor);
+  }
+
+  template <typename T_PROCESSOR>
+  bool NextWithDispatching(T_PROCESSOR& processor) {
+    if (AtEnd()) {
+      return false;
+    }
+    std::unique_ptr<T_ENTRY> entry;
+    ParseCerealRecordInMemory(buffer_, si_, entry);
+    typedef bricks::rtti::RuntimeTupleTableDispatcher<typename T_PROCESSOR::BASE_TYPE,
+                                                      typename T_PROCESSOR::DERIVED_TYPE_LIST> Dispatcher;
+    Dispatcher::DispatchCall(*entry.get(), processor);
+    return true;
+  }
+
+  // Same as `GenericCerealFileParser::NextOfTypes()`, with the records skipped bumped past in memory.
+  template <typename T_PROCESSOR>
+  bool NextOfTypes(T_PROCESSOR& processor) {
+    typedef CerealRecordTypeFilter<typename T_PROCESSOR::DERIVED_TYPE_LIST> T_FILTER;
+    std::unique_ptr<T_ENTRY> entry;
+    do {
+      if (AtEnd()) {
+        return false;
+      }
+    } while (!ParseCerealRecordInMemory(buffer_, si_, entry, T_FILTER::Instance()));
+    typedef bricks::rtti::RuntimeTupleTableDispatcher<typename T_PROCESSOR::BASE_TYPE,
+                                                      typename T_PROCESSOR::DERIVED_TYPE_LIST> Dispatcher;
+    Dispatcher::DispatchCall(*entry.get(), processor);
+    return true;
+  }
+
+  // Same as those of `GenericCerealFileParser`.
+  template <typename... TYPES>
+  bool NextVariant(rtti::Variant<TYPES...>& variant) {
+    if (AtEnd()) {
+      return false;
+    }
+    si_(variant);
+    return true;
+  }
+
+  template <typename T_PROCESSOR>
+  bool NextWithVariantDispatching(T_PROCESSOR& processor) {
+    typedef typename rtti::TupleVariant<typename T_PROCESSOR::DERIVED_TYPE_LIST>::type T_VARIANT;
+    T_VARIANT variant;
+    if (!NextVariant(variant)) {
+      return false;
+    }
+    static_cast<const T_VARIANT&>(variant).Visit(processor);
+    return true;
+  }
+
+  // Same as `GenericCerealFileParser::ForEachInArena()`.
+  template <typename F>
+  size_t ForEachInArena(CerealArena& arena, F&& f, size_t batch_size = kCerealArenaDefaultBatchSize) {
+    return ForEachInArenaBatches<T_ENTRY>(arena, batch_size, [this](std::unique_ptr<T_ENTRY>& entry) {
+      if (AtEnd()) {
+        return false;
+      }
+      ParseCerealRecordInMemory(buffer_, si_, entry);
+      return true;
+    }, std::forward<F>(f));
+  }
+
+  // Parses the whole file, independently of `Next()`. Throws `cereal::Exception` if it is malformed.
+  CerealFileIndex BuildIndex() const {
+    CerealFileIndex index;
+    CerealMemoryInputBuffer buffer(file_.data(), file_.data() + file_.size());
+    std::istream stream(&buffer);
+    cereal::BinaryInputArchive si(stream);
+    while (!buffer.AtEnd()) {
+      const size_t offset = buffer.Offset();
+      std::unique_ptr<T_ENTRY> entry;
+      ParseCerealRecordInMemory(buffer, si, entry);
+      AddPolymorphicName(index, offset, buffer.Offset());
+      index.offsets.push_back(offset);
+    }
+    return index;
+  }
+
+  // Calls `f(range_index, entry)` for each record, for `threads` ranges concurrently, each going over
+  // a contiguous range of the records in order. The calls for a range come from one thread at a time.
+  // Rethrows the first exception thrown by `f` or the parsing; the ranges not started yet are skipped.
+  template <typename F>
+  void ParseInParallel(const CerealFileIndex& index, size_t threads, F&& f) const {
+    const size_t records = index.offsets.size();
+    if (!records) {
+      return;
+    }
+    threads = std::max(static_cast<size_t>(1), std::min(threads, records));
+    Executor::Shared().ParallelFor(0, threads, [this, &index, &f, records, threads](size_t t) {
+      const size_t begin = records * t / threads;
+      const size_t end = records * (t + 1) / threads;
+      CerealMemoryInputBuffer buffer(file_.data() + index.offsets[begin],
+                                     file_.data() + (end < records ? index.offsets[end] : file_.size()));
+      std::istream stream(&buffer);
+      cereal::BinaryInputArchive si(stream);
+      for (const auto& name : index.names) {
+        if (name.record < begin) {
+          si.registerPolymorphicName(name.id, name.name);
+        }
+      }
+      for (size_t i = begin; i < end; ++i) {
+        std::unique_ptr<T_ENTRY> entry;
+        ParseCerealRecordInMemory(buffer, si, entry);
+        f(t, *entry.get());
+      }
+    });
+  }
+
+ private:
+  CerealMappedFileParser() = delete;
+  CerealMappedFileParser(const CerealMappedFileParser&) = delete;
+  void operator=(const CerealMappedFileParser&) = delete;
+  CerealMappedFileParser(CerealMappedFileParser&&) = delete;
+  void operator=(CerealMappedFileParser&&) = delete;
+
+  // A polymorphic record introducing its type starts with its id, with the most significant bit set,
+  // followed by the name, as cereal's `getInputBinding()` reads them, past the envelope, if there is one.
+  // Called once the record has been parsed, thus `end` is past it. The flat records have the second most
+  // significant bit set as well, and introduce nothing.
+  void AddPolymorphicName(CerealFileIndex& index, size_t offset, size_t end) const {
+    if (std::is_polymorphic<T_ENTRY>::value) {
+      std::uint32_t type_id;
+      std::uint32_t length;
+      if (end - offset >= kEnvelopedRecordHeaderSize &&
+          IsEnvelopedRecordHeader(file_.data() + offset, type_id, length)) {
+        offset += kEnvelopedRecordHeaderSize;
+      }
+      std::uint32_t id;
+      std::string name;
+      if (CerealRecordNamesType(file_.data() + offset, end - offset, id, name)) {
+        index.names.push_back({index.offsets.size(), id, std::move(name)});
+      }
+    }
+  }
+
+  const MemoryMappedFile file_;
+  CerealMemoryInputBuffer buffer_;
+  std::istream stream_;
+  cereal::BinaryInputArchive si_;
+};
+
+#ifndef BRICKS_CEREALIZE_NO_JSON
+
+// `CerealLineBuffer` is the `std::streambuf` the JSON archive of each line writes into, growing as needed,
+// and reused from one line to the next. The archive pretty-prints the record: `FinishLine()` removes
+// the newlines it puts between the values, and ends the line. The newlines in the strings are escaped.
+class CerealLineBuffer final : public std::streambuf {
+ public:
+  CerealLineBuffer() : buffer_(256) { Clear(); }
+
+  void Clear() { setp(&buffer_[0], &buffer_[0] + buffer_.size()); }
+
+  // Returns the length of the line at `data()`.
+  size_t FinishLine() {
+    sputc('\n');
+    char* end = std::remove(pbase(), pptr() - 1, '\n');
+    *end++ = '\n';
+    return static_cast<size_t>(end - pbase());
+  }
+
+  const char* data() const { return pbase(); }
+
+ protected:
+  int_type overflow(int_type c) override {
+    const size_t size = static_cast<size_t>(pptr() - pbase());
+    buffer_.resize(buffer_.size() * 2);
+    setp(&buffer_[0], &buffer_[0] + buffer_.size());
+    pbump(static_cast<int>(size));
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+ private:
+  std::vector<char> buffer_;
+};
+
+// Same as `GenericCerealFileAppender`, with each record serialized by an archive of its own onto a line
+// of its own, the polymorphic type names included. The output is complete after each record, thus the files
+// can be appended to, and their lines parsed independently of one another.
+template <typename T_OUTPUT_FILE>
+class GenericCerealFileAppender<CerealFormat::JSONLines, T_OUTPUT_FILE> {
+ public:
+  explicit GenericCerealFileAppender(const std::string& filename,
+                                     bool append = true,
+                                     size_t buffer_size = kCerealFileAppenderDefaultBufferSize)
+      : fo_(filename, (append ? std::ofstream::app : std::ofstream::trunc) | std::ofstream::binary),
+        buffer_(fo_, buffer_size),
+        line_stream_(&line_) {
+    CerealBindRegisteredTypes<cereal::JSONOutputArchive>();
+  }
+
+  template <typename T>
+  typename std::enable_if<sizeof(typename T::CEREAL_BASE_TYPE) != 0, GenericCerealFileAppender&>::type
+  operator<<(const T& entry) {
+    line_.Clear();
+    {
+      cereal::JSONOutputArchive so(line_stream_, cereal::JSONOutputArchive::Options::NoIndent());
+      so(WithBaseType<typename T::CEREAL_BASE_TYPE>(entry));
+    }
+    const size_t length = line_.FinishLine();
+    buffer_.sputn(line_.data(), static_cast<std::streamsize>(length));
+    return *this;
+  }
+
+  void Flush() { buffer_.pubsync(); }
+
+  size_t BufferedSize() const { return buffer_.BufferedSize(); }
+
+ private:
+  GenericCerealFileAppender() = delete;
+  GenericCerealFileAppender(const GenericCerealFileAppender&) = delete;
+  void operator=(const GenericCerealFileAppender&) = delete;
+  GenericCerealFileAppender(GenericCerealFileAppender&&) = delete;
+  void operator=(GenericCerealFileAppender&&) = delete;
+
+  T_OUTPUT_FILE fo_;
+  CerealOutputBuffer<T_OUTPUT_FILE> buffer_;
+  CerealLineBuffer line_;
+  std::ostream line_stream_;
+};
+
+// Parses the record on the line in [begin, end). Throws `cereal::Exception` if it is malformed.
+template <typename T_ENTRY>
+void ParseCerealJSONLine(const char* begin, const char* end, std::unique_ptr<T_ENTRY>& entry) {
+  CerealBindRegisteredTypes<cereal::JSONInputArchive>();
+  CerealMemoryInputBuffer buffer(begin, end);
+  std::istream stream(&buffer);
+  cereal::JSONInputArchive si(stream);
+  si(entry);
+}
+
+// Same as `GenericCerealFileParser`, one line at a time. The empty lines are skipped. Since the end of the file
+// is unambiguous, `Next()`, `NextLambda()` and `NextWithDispatching()` return false there only, and, as those
+// of `CerealMappedFileParser`, let the `cereal::Exception` through for the malformed lines.
+template <typename T_ENTRY>
+class GenericCerealFileParser<T_ENTRY, CerealFormat::JSONLines> {
+ public:
+  explicit GenericCerealFileParser(const std::string& filename) : fi_(filename) {}
+
+  template <typename T_PROCESSOR>
+  bool Next(T_PROCESSOR& processor) {
+    std::unique_ptr<T_ENTRY> entry;
+    if (!Parse(entry)) {
+      return false;
+    }
+    processor(*entry.get());
+    return true;
+  }
+
+  template <typename T_PROCESSOR>
+  bool NextLambda(T_PROCESSOR processor) {
+    return Next(processor);
+  }
+
+  template <typename T_PROCESSOR>
+  bool NextWithDispatching(T_PROCESSOR& processor) {
+    std::unique_ptr<T_ENTRY> entry;
+    if (!Parse(entry)) {
+      return false;
+    }
+    typedef bricks::rtti::RuntimeTupleTableDispatcher<typename T_PROCESSOR::BASE_TYPE,
+                                                      typename T_PROCESSOR::DERIVED_TYPE_LIST> Dispatcher;
+    Dispatcher::DispatchCall(*entry.get(), processor);
+    return true;
+  }
+
+  template <typename F>
+  size_t ForEachInArena(CerealArena& arena, F&& f, size_t batch_size = kCerealArenaDefaultBatchSize) {
+    return ForEachInArenaBatches<T_ENTRY>(arena, batch_size, [this](std::unique_ptr<T_ENTRY>& entry) {
+      return Parse(entry);
+    }, std::forward<F>(f));
+  }
+
+ private:
+  GenericCerealFileParser() = delete;
+  GenericCerealFileParser(const GenericCerealFileParser&) = delete;
+  void operator=(const GenericCerealFileParser&) = delete;
+  GenericCerealFileParser(GenericCerealFileParser&&) = delete;
+  void operator=(GenericCerealFileParser&&) = delete;
+
+  bool Parse(std::unique_ptr<T_ENTRY>& entry) {
+    while (std::getline(fi_, line_)) {
+      if (!line_.empty()) {
+        ParseCerealJSONLine(line_.data(), line_.data() + line_.length(), entry);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::ifstream fi_;
+  // Reused from one line to the next.
+  std::string line_;
+};
+
+// `CerealMappedJSONLinesParser` parses a JSON lines file from memory, mapped with `MemoryMappedFile`.
+// `ParseInParallel()` splits the file into `threads` ranges of about the same size at the line breaks,
+// and parses them on the workers of `Executor::Shared()`.
+template <typename T_ENTRY>
+class CerealMappedJSONLinesParser {
+ public:
+  explicit CerealMappedJSONLinesParser(const std::string& filename) : file_(filename) {}
+
+  // Calls `f(range_index, entry)` for each record, for `threads` ranges concurrently, each going over
+  // a contiguous range of the lines in order. The calls for a range come from one thread at a time.
+  // Rethrows the first exception thrown by `f` or the parsing; the ranges not started yet are skipped.
+  template <typename F>
+  void ParseInParallel(size_t threads, F&& f) const {
+    const char* const data = file_.data();
+    const size_t size = file_.size();
+    if (!size) {
+      return;
+    }
+    threads = std::max(static_cast<size_t>(1), std::min(threads, size));
+    // Each range starts past the line break at or after its share of the file, and ends where the next starts.
+    std::vector<size_t> starts(threads + 1, size);
+    starts[0] = 0;
+    for (size_t t = 1; t < threads; ++t) {
+      const size_t from = std::max(size * t / threads, starts[t - 1]);
+      const void* newline = from < size ? std::memchr(data + from, '\n', size - from) : nullptr;
+      starts[t] = newline ? static_cast<size_t>(static_cast<const char*>(newline) - data) + 1 : size;
+    }
+    Executor::Shared().ParallelFor(0, threads, [data, &starts, &f](size_t t) {
+      const char* begin = data + starts[t];
+      const char* const end = data + starts[t + 1];
+      while (begin != end) {
+        const void* newline = std::memchr(begin, '\n', static_cast<size_t>(end - begin));
+        const char* line_end = newline ? static_cast<const char*>(newline) : end;
+        if (line_end != begin) {
+          std::unique_ptr<T_ENTRY> entry;
+          ParseCerealJSONLine(begin, line_end, entry);
+          f(t, *entry.get());
+        }
+        begin = (line_end == end) ? end : line_end + 1;
+      }
+    });
+  }
+
+ private:
+  CerealMappedJSONLinesParser() = delete;
+  CerealMappedJSONLinesParser(const CerealMappedJSONLinesParser&) = delete;
+  void operator=(const CerealMappedJSONLinesParser&) = delete;
+
+  const MemoryMappedFile file_;
+};
+
+#endif  // BRICKS_CEREALIZE_NO_JSON
+
 }  // namespace cerealize
 }  // namespace bricks
 
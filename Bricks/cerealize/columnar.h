@@ -0,0 +1,587 @@
+// The columnar file holds the records of a cereal log transposed into columns, for the scans by type and
+// field to go over the arrays of the values instead of parsing each polymorphic record.
+//
+// `CerealColumnarAppender` dispatches the records by their types, as `NextWithDispatching()` does, and
+// collects the fields each type lists in its `serialize()`, named as for cereal's JSON archives, into
+// the columns of the block of the type. The arithmetic, enum and `bool` fields become the fixed-width columns
+// of `int64_t`, `uint64_t` or `double`, with the minimum and the maximum of the block, and the strings
+// the dictionary-encoded ones, of `uint32_t` codes. The fields of the other types are left out. The block
+// of a type is written out once it has `block_size` records, and the incomplete ones on destruction.
+//
+// The file is `kCerealColumnarFileMagic`, followed by the blocks. Each block is its size, the number
+// of records, the number of columns and the name of the type the records are of, followed by the columns,
+// each with its kind, name, minimum and maximum, and values. All the numbers are 64-bit and all the arrays
+// are padded to eight bytes, for `CerealColumnarFile` to map the file and point into it with no copying
+// but of the dictionaries.
+//
+// The scans, `CountInRange()` and `SumInRange()`, are branch-free loops over the arrays, for the compiler to
+// vectorize, and `CerealColumnarFile` skips the blocks by their minimums and maximums, and runs the others
+// on the workers of `Executor::Shared()`. As in the block log, the ranges are [from, to).
+
+#ifndef BRICKS_CEREALIZE_COLUMNAR_H
+#define BRICKS_CEREALIZE_COLUMNAR_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <typeindex>
+#include <unordered_map>
+#include <vector>
+
+#include "block_log.h"
+#include "cerealize.h"
+#include "exceptions.h"
+
+#include "../executor/executor.h"
+#include "../file/file.h"
+#include "../rtti/dispatcher.h"
+
+namespace bricks {
+namespace cerealize {
+
+const char kCerealColumnarFileMagic[] = "CCOL0001";
+const size_t kCerealColumnarFileMagicSize = sizeof(kCerealColumnarFileMagic) - 1;
+
+const size_t kCerealColumnarDefaultBlockSize = 64 * 1024;
+
+enum class CerealColumnKind : uint64_t { Int64 = 1, UInt64 = 2, Double = 3, String = 4 };
+
+// The kind of the column of the values of type `T`, for the types the scans are defined for.
+template <typename T>
+struct CerealColumnKindOf;
+template <>
+struct CerealColumnKindOf<int64_t> {
+  static constexpr CerealColumnKind value = CerealColumnKind::Int64;
+};
+template <>
+struct CerealColumnKindOf<uint64_t> {
+  static constexpr CerealColumnKind value = CerealColumnKind::UInt64;
+};
+template <>
+struct CerealColumnKindOf<double> {
+  static constexpr CerealColumnKind value = CerealColumnKind::Double;
+};
+
+// The number of the values in [from, to).
+template <typename T>
+size_t CountInRange(const T* values, size_t size, T from, T to) {
+  size_t count = 0;
+  for (size_t i = 0; i < size; ++i) {
+    count += static_cast<size_t>((values[i] >= from) & (values[i] < to));
+  }
+  return count;
+}
+
+// The sum of `values[i]` for which `filter[i]` is in [from, to).
+template <typename T_FILTER, typename T_VALUE>
+T_VALUE SumInRange(const T_FILTER* filter, const T_VALUE* values, size_t size, T_FILTER from, T_FILTER to) {
+  T_VALUE sum = 0;
+  for (size_t i = 0; i < size; ++i) {
+    sum += ((filter[i] >= from) & (filter[i] < to)) ? values[i] : T_VALUE(0);
+  }
+  return sum;
+}
+
+// The number of the codes equal to `code`.
+inline size_t CountEqual(const uint32_t* codes, size_t size, uint32_t code) {
+  size_t count = 0;
+  for (size_t i = 0; i < size; ++i) {
+    count += static_cast<size_t>(codes[i] == code);
+  }
+  return count;
+}
+
+namespace impl {
+
+inline size_t CerealColumnarPadded(size_t size) { return (size + 7) / 8 * 8; }
+
+// The values of one field of the records of the block being built.
+struct CerealColumnBuilder {
+  std::string name;
+  CerealColumnKind kind;
+  std::vector<uint64_t> values;  // The bits of `int64_t`, `uint64_t` or `double`, for the numeric kinds.
+  std::vector<uint32_t> codes;
+  std::vector<std::string> dictionary;
+  std::unordered_map<std::string, uint32_t> dictionary_codes;
+  uint64_t min = 0;
+  uint64_t max = 0;
+
+  template <typename T>
+  void Add(T value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    if (values.empty()) {
+      min = max = bits;
+    } else {
+      T current_min, current_max;
+      std::memcpy(&current_min, &min, sizeof(min));
+      std::memcpy(&current_max, &max, sizeof(max));
+      if (value < current_min) {
+        min = bits;
+      }
+      if (value > current_max) {
+        max = bits;
+      }
+    }
+    values.push_back(bits);
+  }
+
+  void AddString(const char* data, size_t length) {
+    const std::string value(data, length);
+    const auto it = dictionary_codes.find(value);
+    if (it != dictionary_codes.end()) {
+      codes.push_back(it->second);
+    } else {
+      const uint32_t code = static_cast<uint32_t>(dictionary.size());
+      dictionary_codes.emplace(value, code);
+      dictionary.push_back(value);
+      codes.push_back(code);
+    }
+  }
+};
+
+// The records of one type, collected for the next block of the type.
+struct CerealColumnarBlockBuilder {
+  std::string type;
+  uint64_t records = 0;
+  std::vector<CerealColumnBuilder> columns;
+
+  void Clear() {
+    records = 0;
+    columns.clear();
+  }
+
+  // Appends the block to `output`.
+  void Write(std::string& output) const {
+    const size_t begin = output.size();
+    Put(output, 0);  // The size of the block, set below.
+    Put(output, records);
+    Put(output, columns.size());
+    PutString(output, type);
+    for (const CerealColumnBuilder& column : columns) {
+      Put(output, static_cast<uint64_t>(column.kind));
+      PutString(output, column.name);
+      Put(output, column.min);
+      Put(output, column.max);
+      if (column.kind != CerealColumnKind::String) {
+        PutBytes(output, column.values.data(), column.values.size() * sizeof(uint64_t));
+      } else {
+        Put(output, column.dictionary.size());
+        for (const std::string& value : column.dictionary) {
+          PutString(output, value);
+        }
+        PutBytes(output, column.codes.data(), column.codes.size() * sizeof(uint32_t));
+      }
+    }
+    const uint64_t size = output.size() - begin;
+    std::memcpy(&output[begin], &size, sizeof(size));
+  }
+
+  static void Put(std::string& output, uint64_t value) {
+    output.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+  static void PutBytes(std::string& output, const void* data, size_t size) {
+    if (size) {
+      output.append(static_cast<const char*>(data), size);
+    }
+    output.append(CerealColumnarPadded(size) - size, '\0');
+  }
+  static void PutString(std::string& output, const std::string& value) {
+    Put(output, value.length());
+    PutBytes(output, value.data(), value.length());
+  }
+};
+
+// The archive for `serialize()` to append the fields of the record to the columns of the block with.
+// The first record of the block creates the columns, and the next ones append to them, in the same order.
+class CerealColumnarArchive final {
+ public:
+  explicit CerealColumnarArchive(CerealColumnarBlockBuilder& block)
+      : block_(block), create_(!block.records), column_(0), unnamed_(0) {}
+
+  template <typename... ARGS>
+  void operator()(ARGS&&... args) {
+    Bind(std::forward<ARGS>(args)...);
+  }
+
+ private:
+  void Bind() {}
+
+  template <typename T, typename... TAIL>
+  void Bind(T&& head, TAIL&&... tail) {
+    Named(head);
+    Bind(std::forward<TAIL>(tail)...);
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_base_of<cereal::detail::NameValuePairCore, T>::value>::type Named(T& nvp) {
+    Field(nvp.name, nvp.value);
+  }
+
+  template <typename T>
+  typename std::enable_if<!std::is_base_of<cereal::detail::NameValuePairCore, T>::value>::type Named(T& value) {
+    // The names cereal's JSON archives give to the values with no names.
+    const size_t index = unnamed_++;
+    if (create_) {
+      Field(("value" + std::to_string(index)).c_str(), value);
+    } else {
+      Field(nullptr, value);
+    }
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_floating_point<T>::value>::type Field(const char* name, const T& value) {
+    Column(name, CerealColumnKind::Double).Add(static_cast<double>(value));
+  }
+
+  template <typename T>
+  typename std::enable_if<(std::is_integral<T>::value && std::is_signed<T>::value) || std::is_enum<T>::value ||
+                          std::is_same<T, bool>::value>::type
+  Field(const char* name, const T& value) {
+    Column(name, CerealColumnKind::Int64).Add(static_cast<int64_t>(value));
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value &&
+                          !std::is_same<T, bool>::value>::type
+  Field(const char* name, const T& value) {
+    Column(name, CerealColumnKind::UInt64).Add(static_cast<uint64_t>(value));
+  }
+
+  template <typename TRAITS, typename ALLOCATOR>
+  void Field(const char* name, const std::basic_string<char, TRAITS, ALLOCATOR>& value) {
+    Column(name, CerealColumnKind::String).AddString(value.data(), value.length());
+  }
+
+  // The fields of the other types are left out.
+  template <typename T>
+  typename std::enable_if<!std::is_arithmetic<T>::value && !std::is_enum<T>::value>::type Field(const char*,
+                                                                                              const T&) {}
+
+  CerealColumnBuilder& Column(const char* name, CerealColumnKind kind) {
+    if (create_) {
+      block_.columns.emplace_back();
+      block_.columns.back().name = name;
+      block_.columns.back().kind = kind;
+    }
+    return block_.columns[column_++];
+  }
+
+  CerealColumnarBlockBuilder& block_;
+  const bool create_;
+  size_t column_;
+  size_t unnamed_;
+};
+
+}  // namespace impl
+
+// Appends the records of `T_BASE`, dispatched by the types of `T_TYPE_LIST`, an `std::tuple<>` of them,
+// to the columnar file. The records of none of the types are appended with the fields of `T_BASE`.
+template <typename T_BASE, typename T_TYPE_LIST>
+class CerealColumnarAppender final {
+ public:
+  explicit CerealColumnarAppender(const std::string& filename,
+                                  size_t block_size = kCerealColumnarDefaultBlockSize)
+      : fo_(filename, std::ofstream::trunc | std::ofstream::binary),
+        block_size_(std::max(block_size, static_cast<size_t>(1))) {
+    fo_.write(kCerealColumnarFileMagic, kCerealColumnarFileMagicSize);
+  }
+
+  ~CerealColumnarAppender() { Flush(); }
+
+  CerealColumnarAppender& operator<<(const T_BASE& entry) {
+    Processor processor{*this};
+    bricks::rtti::RuntimeTupleTableDispatcher<T_BASE, T_TYPE_LIST>::DispatchCall(entry, processor);
+    return *this;
+  }
+
+  // Writes out the incomplete blocks. Throws `FileException` if the file could not be written to.
+  void Flush() {
+    for (auto& block : blocks_) {
+      WriteBlock(*block.second);
+    }
+    fo_.flush();
+    if (fo_.bad()) {
+      throw FileException();
+    }
+  }
+
+ private:
+  struct Processor {
+    CerealColumnarAppender& self;
+    template <typename T>
+    void operator()(const T& entry) {
+      self.Append(entry);
+    }
+  };
+
+  template <typename T>
+  void Append(const T& entry) {
+    std::unique_ptr<impl::CerealColumnarBlockBuilder>& block = blocks_[std::type_index(typeid(T))];
+    if (!block) {
+      block.reset(new impl::CerealColumnarBlockBuilder());
+      block->type = CerealBlockLogTypeName<T>::Name();
+    }
+    impl::CerealColumnarArchive archive(*block);
+    const_cast<T&>(entry).serialize(archive);
+    if (++block->records >= block_size_) {
+      WriteBlock(*block);
+    }
+  }
+
+  void WriteBlock(impl::CerealColumnarBlockBuilder& block) {
+    if (block.records) {
+      output_.clear();
+      block.Write(output_);
+      fo_.write(output_.data(), output_.size());
+      block.Clear();
+    }
+  }
+
+  std::ofstream fo_;
+  const size_t block_size_;
+  std::unordered_map<std::type_index, std::unique_ptr<impl::CerealColumnarBlockBuilder>> blocks_;
+  // Reused from one block to the next.
+  std::string output_;
+
+  CerealColumnarAppender(const CerealColumnarAppender&) = delete;
+  void operator=(const CerealColumnarAppender&) = delete;
+};
+
+// Converts the binary cereal file of the records of `T_BASE` into the columnar one.
+// Returns the number of records.
+template <typename T_BASE, typename T_TYPE_LIST>
+size_t ConvertCerealFileToColumnar(const std::string& input,
+                                   const std::string& output,
+                                   size_t block_size = kCerealColumnarDefaultBlockSize) {
+  CerealMappedFileParser<T_BASE> parser(input);
+  CerealColumnarAppender<T_BASE, T_TYPE_LIST> appender(output, block_size);
+  size_t records = 0;
+  while (parser.NextLambda([&appender, &records](const T_BASE& entry) {
+    appender << entry;
+    ++records;
+  }))
+    ;
+  return records;
+}
+
+// A column of a block of the mapped columnar file. The values point into the file.
+struct CerealColumn {
+  std::string name;
+  CerealColumnKind kind;
+  size_t size;
+  const void* values;  // `size` values of `int64_t`, `uint64_t` or `double`, or `uint32_t` codes.
+  std::vector<std::string> dictionary;
+  uint64_t min;
+  uint64_t max;
+
+  // Throws `CerealColumnarKindMismatchException` unless the column is of the kind of `T`.
+  template <typename T>
+  const T* Values() const {
+    if (kind != CerealColumnKindOf<T>::value) {
+      throw CerealColumnarKindMismatchException();
+    }
+    return static_cast<const T*>(values);
+  }
+  const uint32_t* Codes() const {
+    if (kind != CerealColumnKind::String) {
+      throw CerealColumnarKindMismatchException();
+    }
+    return static_cast<const uint32_t*>(values);
+  }
+
+  template <typename T>
+  T Min() const {
+    return As<T>(min);
+  }
+  template <typename T>
+  T Max() const {
+    return As<T>(max);
+  }
+
+  // The code of `value` in the dictionary, or `size()` of it if it is not there.
+  uint32_t Code(const std::string& value) const {
+    return static_cast<uint32_t>(std::find(dictionary.begin(), dictionary.end(), value) - dictionary.begin());
+  }
+
+  // Whether the values may be in [from, to), and whether all of them are.
+  template <typename T>
+  bool Overlaps(T from, T to) const {
+    return size && Max<T>() >= from && Min<T>() < to;
+  }
+  template <typename T>
+  bool Within(T from, T to) const {
+    return Min<T>() >= from && Max<T>() < to;
+  }
+
+ private:
+  template <typename T>
+  T As(uint64_t bits) const {
+    if (kind != CerealColumnKindOf<T>::value) {
+      throw CerealColumnarKindMismatchException();
+    }
+    T value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+};
+
+struct CerealColumnarBlock {
+  std::string type;
+  size_t records;
+  std::vector<CerealColumn> columns;
+
+  // The column of the name, or nullptr if the type has none.
+  const CerealColumn* Column(const std::string& name) const {
+    for (const CerealColumn& column : columns) {
+      if (column.name == name) {
+        return &column;
+      }
+    }
+    return nullptr;
+  }
+};
+
+// The columnar file, mapped into memory. Throws `CerealColumnarInvalidFileException` if it is malformed.
+class CerealColumnarFile final {
+ public:
+  explicit CerealColumnarFile(const std::string& filename) : file_(filename) {
+    const char* const data = file_.data();
+    const size_t size = file_.size();
+    if (size < kCerealColumnarFileMagicSize ||
+        std::memcmp(data, kCerealColumnarFileMagic, kCerealColumnarFileMagicSize)) {
+      throw CerealColumnarInvalidFileException();
+    }
+    size_t offset = kCerealColumnarFileMagicSize;
+    while (offset < size) {
+      Reader reader{data, offset, size};
+      const uint64_t block_size = reader.Get();
+      if (block_size > size - offset) {
+        throw CerealColumnarInvalidFileException();
+      }
+      reader.end = offset + block_size;
+      blocks_.emplace_back();
+      CerealColumnarBlock& block = blocks_.back();
+      block.records = reader.Get();
+      const uint64_t columns = reader.Get();
+      if (block.records > block_size || columns > block_size) {
+        throw CerealColumnarInvalidFileException();
+      }
+      block.type = reader.GetString();
+      for (uint64_t i = 0; i < columns; ++i) {
+        block.columns.emplace_back();
+        CerealColumn& column = block.columns.back();
+        column.kind = static_cast<CerealColumnKind>(reader.Get());
+        column.name = reader.GetString();
+        column.min = reader.Get();
+        column.max = reader.Get();
+        column.size = block.records;
+        if (column.kind == CerealColumnKind::String) {
+          const uint64_t dictionary = reader.Get();
+          for (uint64_t j = 0; j < dictionary; ++j) {
+            column.dictionary.push_back(reader.GetString());
+          }
+          column.values = reader.GetBytes(block.records * sizeof(uint32_t));
+        } else if (column.kind == CerealColumnKind::Int64 || column.kind == CerealColumnKind::UInt64 ||
+                   column.kind == CerealColumnKind::Double) {
+          column.values = reader.GetBytes(block.records * sizeof(uint64_t));
+        } else {
+          throw CerealColumnarInvalidFileException();
+        }
+      }
+      offset += block_size;
+    }
+  }
+
+  const std::vector<CerealColumnarBlock>& Blocks() const { return blocks_; }
+
+  // The number of the records of each type with the values of `column`, of the kind of `T`, in [from, to).
+  // The types with no such column are left out.
+  template <typename T>
+  std::map<std::string, size_t> CountByTypeInRange(const std::string& column, T from, T to) const {
+    std::vector<size_t> counts(blocks_.size());
+    Executor::Shared().ParallelFor(0, blocks_.size(), [this, &column, &counts, from, to](size_t i) {
+      const CerealColumn* values = blocks_[i].Column(column);
+      if (!values || !values->Overlaps(from, to)) {
+        return;
+      }
+      counts[i] =
+          values->Within(from, to) ? values->size : CountInRange(values->Values<T>(), values->size, from, to);
+    });
+    std::map<std::string, size_t> result;
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      if (blocks_[i].Column(column)) {
+        result[blocks_[i].type] += counts[i];
+      }
+    }
+    return result;
+  }
+
+  // The sum of `column`, of the kind of `T_VALUE`, over the records of each type with the values of `filter`,
+  // of the kind of `T_FILTER`, in [from, to). The types with no such columns are left out.
+  template <typename T_VALUE, typename T_FILTER>
+  std::map<std::string, T_VALUE> SumByTypeInRange(const std::string& column,
+                                                  const std::string& filter,
+                                                  T_FILTER from,
+                                                  T_FILTER to) const {
+    std::vector<T_VALUE> sums(blocks_.size());
+    Executor::Shared().ParallelFor(0, blocks_.size(), [this, &column, &filter, &sums, from, to](size_t i) {
+      const CerealColumn* values = blocks_[i].Column(column);
+      const CerealColumn* filter_values = blocks_[i].Column(filter);
+      if (values && filter_values && filter_values->Overlaps(from, to)) {
+        sums[i] =
+            SumInRange(filter_values->Values<T_FILTER>(), values->Values<T_VALUE>(), values->size, from, to);
+      }
+    });
+    std::map<std::string, T_VALUE> result;
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      if (blocks_[i].Column(column) && blocks_[i].Column(filter)) {
+        result[blocks_[i].type] += sums[i];
+      }
+    }
+    return result;
+  }
+
+ private:
+  struct Reader {
+    const char* data;
+    size_t offset;
+    size_t end;
+
+    const char* GetBytes(size_t size) {
+      const size_t padded = impl::CerealColumnarPadded(size);
+      if (padded < size || padded > end - offset) {
+        throw CerealColumnarInvalidFileException();
+      }
+      const char* result = data + offset;
+      offset += padded;
+      return result;
+    }
+    uint64_t Get() {
+      uint64_t value;
+      std::memcpy(&value, GetBytes(sizeof(value)), sizeof(value));
+      return value;
+    }
+    std::string GetString() {
+      const uint64_t length = Get();
+      return std::string(GetBytes(length), length);
+    }
+  };
+
+  const MemoryMappedFile file_;
+  std::vector<CerealColumnarBlock> blocks_;
+
+  CerealColumnarFile(const CerealColumnarFile&) = delete;
+  void operator=(const CerealColumnarFile&) = delete;
+};
+
+}  // namespace cerealize
+}  // namespace bricks
+
+#endif  // BRICKS_CEREALIZE_COLUMNAR_H
@@ -0,0 +1,234 @@
+// Record envelopes: the polymorphic records of the binary files the selective scans skip without parsing them.
+//
+// `GenericCerealFileAppender::EnvelopeRecords()` has the appender write each polymorphic record of the binary
+// format behind an eight-byte header: `kEnvelopedRecordMarker | type_id`, followed by the length of the record
+// as cereal has serialized it. The type id is the 29-bit FNV-1a hash of the name the type is registered with,
+// see `CerealEnvelopeTypeId()`. As for the flat records, see `flat.h`, the marker is an id cereal never writes
+// for a polymorphic type, thus the enveloped records, the flat ones and the plain cereal-ized ones
+// share the file:
+//
+//   CerealFileAppender appender("events.bin");
+//   appender.EnvelopeRecords();
+//   appender << EventClick() << EventView();
+//
+// All the parsers of the binary format read the enveloped records as they read the others. `NextOfTypes()`
+// of the parsers only parses the records of the types of `T_PROCESSOR::DERIVED_TYPE_LIST`, and dispatches
+// them as `NextWithDispatching()` does; the enveloped records, and the flat ones, of the other types are
+// skipped, seeked over in the file or bumped past in memory. The records written without the envelope are
+// parsed and dispatched as usual, as are the ones of the types sharing the hash of the name with a listed one.
+//
+// The record skipped may be where the type of the records after it is named, as cereal names each type once,
+// in the first record of it. The parsers only read that name out of the skipped record, and register it with
+// their archive, for the records after it to be parsed.
+
+#ifndef BRICKS_CEREALIZE_ENVELOPE_H
+#define BRICKS_CEREALIZE_ENVELOPE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <streambuf>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "flat.h"
+
+#include "../3party/cereal/include/details/helpers.hpp"
+#include "../3party/cereal/include/types/polymorphic.hpp"
+
+namespace bricks {
+namespace cerealize {
+
+const std::uint32_t kEnvelopedRecordMarker = 0xA0000000u;
+const std::uint32_t kEnvelopedRecordMarkerMask = 0xE0000000u;
+const std::uint32_t kEnvelopedRecordHeaderSize = 2 * sizeof(std::uint32_t);
+
+// The type id of the envelopes of the records of the type registered as `name`. Never zero, the type id
+// of the records the type of which is not known, such as those of the base type itself.
+inline std::uint32_t CerealEnvelopeTypeId(const char* name, size_t length) {
+  std::uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; ++i) {
+    hash = (hash ^ static_cast<std::uint8_t>(name[i])) * 16777619u;
+  }
+  hash &= ~kEnvelopedRecordMarkerMask;
+  return hash ? hash : 1u;
+}
+
+inline void EncodeEnvelopeHeader(std::uint32_t type_id, std::uint32_t length, char* header) {
+  const std::uint32_t value = kEnvelopedRecordMarker | type_id;
+  std::memcpy(header, &value, sizeof(value));
+  std::memcpy(header + sizeof(value), &length, sizeof(length));
+}
+
+// Whether the record starting with the four bytes of `header` is an enveloped one.
+inline bool HasEnvelopedRecordMarker(const char* header) {
+  std::uint32_t value;
+  std::memcpy(&value, header, sizeof(value));
+  return (value & kEnvelopedRecordMarkerMask) == kEnvelopedRecordMarker;
+}
+
+// Whether the record starting with the eight bytes of `header` is an enveloped one, and its type id and length.
+inline bool IsEnvelopedRecordHeader(const char* header, std::uint32_t& type_id, std::uint32_t& length) {
+  if (!HasEnvelopedRecordMarker(header)) {
+    return false;
+  }
+  std::memcpy(&type_id, header, sizeof(type_id));
+  type_id &= ~kEnvelopedRecordMarkerMask;
+  std::memcpy(&length, header + sizeof(type_id), sizeof(length));
+  return true;
+}
+
+// Whether the polymorphic record starting with the four bytes of `record`, as cereal has serialized it,
+// may name its type. With the most significant bit of the id set, cereal's `getInputBinding()` reads the name
+// past it; with the second one set, the record is of the base type, and names none.
+inline bool CerealRecordMayNameType(const char* record) {
+  const std::uint32_t msb = static_cast<std::uint32_t>(cereal::detail::msb_32bit);
+  const std::uint32_t msb2 = static_cast<std::uint32_t>(cereal::detail::msb2_32bit);
+  std::uint32_t id;
+  std::memcpy(&id, record, sizeof(id));
+  return (id & msb) && !(id & msb2);
+}
+
+// Whether the polymorphic record of `size` bytes at `record` names its type, and the cereal id, as it is
+// registered with the archives, and the name of the type if it does.
+inline bool CerealRecordNamesType(const char* record, size_t size, std::uint32_t& id, std::string& name) {
+  cereal::size_type length;
+  if (size < sizeof(id) + sizeof(length) || !CerealRecordMayNameType(record)) {
+    return false;
+  }
+  std::memcpy(&id, record, sizeof(id));
+  std::memcpy(&length, record + sizeof(id), sizeof(length));
+  if (length > size - sizeof(id) - sizeof(length)) {
+    return false;
+  }
+  name.assign(record + sizeof(id) + sizeof(length), static_cast<size_t>(length));
+  return true;
+}
+
+// The type ids of the records the appender writes, learned from the names of the types cereal writes
+// into the first record of each, by the ids cereal has given them in the file.
+class CerealEnvelopeTypeIds final {
+ public:
+  std::uint32_t Of(const char* record, size_t size) {
+    std::uint32_t id;
+    std::string name;
+    if (CerealRecordNamesType(record, size, id, name)) {
+      id &= ~static_cast<std::uint32_t>(cereal::detail::msb_32bit);
+      if (type_ids_.size() <= id) {
+        type_ids_.resize(id + 1);
+      }
+      type_ids_[id] = CerealEnvelopeTypeId(name.data(), name.length());
+      return type_ids_[id];
+    }
+    if (size < sizeof(id)) {
+      return 0;
+    }
+    std::memcpy(&id, record, sizeof(id));
+    return id < type_ids_.size() ? type_ids_[id] : 0;
+  }
+
+ private:
+  std::vector<std::uint32_t> type_ids_;
+};
+
+// `CerealEnvelopeBuffer` is the `std::streambuf` the archive serializes the enveloped record into first,
+// for its length to be known before it goes out, reused from one record to the next.
+class CerealEnvelopeBuffer final : public std::streambuf {
+ public:
+  const char* Data() const { return buffer_.data(); }
+  size_t Size() const { return buffer_.size(); }
+  void Clear() { buffer_.clear(); }
+
+ protected:
+  int_type overflow(int_type c) override {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      buffer_.push_back(traits_type::to_char_type(c));
+    }
+    return traits_type::not_eof(c);
+  }
+  std::streamsize xsputn(const char* data, std::streamsize length) override {
+    buffer_.insert(buffer_.end(), data, data + length);
+    return length;
+  }
+
+ private:
+  std::vector<char> buffer_;
+};
+
+// The filter matching all the records, for the parsers to parse them all.
+struct CerealAllRecordTypes final {
+  bool MatchesTypeId(std::uint32_t) const { return true; }
+  bool MatchesFlatTag(std::uint32_t) const { return true; }
+};
+
+namespace impl {
+
+template <typename T>
+struct HasCerealBindingName {
+  template <typename U>
+  static constexpr bool Check(decltype(cereal::detail::binding_name<U>::name())*) {
+    return true;
+  }
+  template <typename U>
+  static constexpr bool Check(...) {
+    return false;
+  }
+  enum { value = Check<T>(nullptr) };
+};
+
+}  // namespace impl
+
+// The envelope type ids and the flat tags of the types of the tuple `T_TYPE_LIST`, see `NextOfTypes()`.
+template <typename T_TYPE_LIST>
+class CerealRecordTypeFilter;
+
+template <typename... TYPES>
+class CerealRecordTypeFilter<std::tuple<TYPES...>> final {
+ public:
+  static const CerealRecordTypeFilter& Instance() {
+    static const CerealRecordTypeFilter filter;
+    return filter;
+  }
+
+  // The records the type of which is not known, with the type id of zero, are never skipped.
+  bool MatchesTypeId(std::uint32_t type_id) const {
+    return !type_id || std::find(type_ids_.begin(), type_ids_.end(), type_id) != type_ids_.end();
+  }
+  bool MatchesFlatTag(std::uint32_t tag) const {
+    return std::find(flat_tags_.begin(), flat_tags_.end(), tag) != flat_tags_.end();
+  }
+
+ private:
+  CerealRecordTypeFilter() {
+    const int unused[] = {(Add<TYPES>(), 0)..., 0};
+    static_cast<void>(unused);
+  }
+
+  template <typename T>
+  void Add() {
+    AddTypeId<T>(std::integral_constant<bool, impl::HasCerealBindingName<T>::value>());
+    AddFlatTag<T>(std::integral_constant<bool, HasFlatFields<T>::value>());
+  }
+  template <typename T>
+  void AddTypeId(std::true_type) {
+    const char* name = cereal::detail::binding_name<T>::name();
+    type_ids_.push_back(CerealEnvelopeTypeId(name, std::strlen(name)));
+  }
+  template <typename T>
+  void AddTypeId(std::false_type) {}
+  template <typename T>
+  void AddFlatTag(std::true_type) {
+    flat_tags_.push_back(static_cast<std::uint32_t>(T::BRICKS_FLAT_TAG));
+  }
+  template <typename T>
+  void AddFlatTag(std::false_type) {}
+
+  std::vector<std::uint32_t> type_ids_;
+  std::vector<std::uint32_t> flat_tags_;
+};
+
+}  // namespace cerealize
+}  // namespace bricks
+
+#endif  // BRICKS_CEREALIZE_ENVELOPE_H
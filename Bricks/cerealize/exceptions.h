@@ -0,0 +1,23 @@
+#ifndef BRICKS_CEREALIZE_EXCEPTIONS_H
+#define BRICKS_CEREALIZE_EXCEPTIONS_H
+
+#include "../exception.h"
+
+namespace bricks {
+namespace cerealize {
+
+struct CerealizeException : Exception {};
+
+struct CerealBlockLogException : CerealizeException {};
+struct CerealBlockLogInvalidFileException : CerealBlockLogException {};
+struct CerealBlockLogCorruptedBlockException : CerealBlockLogException {};
+struct CerealBlockLogCompressionNotSupportedException : CerealBlockLogException {};
+
+struct CerealColumnarException : CerealizeException {};
+struct CerealColumnarInvalidFileException : CerealColumnarException {};
+struct CerealColumnarKindMismatchException : CerealColumnarException {};
+
+}  // namespace cerealize
+}  // namespace bricks
+
+#endif  // BRICKS_CEREALIZE_EXCEPTIONS_H
@@ -0,0 +1,211 @@
+// Flat records: the fast path of `CerealFileAppender` and the binary parsers for the fixed-size event types.
+//
+// A type lists its fields and picks a tag with `BRICKS_FLAT_FIELDS(tag, fields...)` in its body, and is
+// registered with `BRICKS_FLAT_REGISTER_TYPE(type)` at namespace scope, as `CEREAL_REGISTER_TYPE` would do:
+//
+//   struct EventClick : EventBase {
+//     typedef EventBase CEREAL_BASE_TYPE;
+//     uint64_t timestamp;
+//     int32_t x, y;
+//     char button[8];
+//     BRICKS_FLAT_FIELDS(1, timestamp, x, y, button);
+//   };
+//   BRICKS_FLAT_REGISTER_TYPE(EventClick);
+//
+// The appender then writes the record as a four-byte header, `kFlatRecordMarker | tag`, followed by the bytes
+// of the fields, back to back, with no padding and no per-field calls: the layout is computed at compile time.
+// The header is an id cereal never writes for a polymorphic type, thus the flat records and the cereal-ized
+// ones share the file, and the parsers tell them apart by the first four bytes of each record.
+//
+// The fields should be trivially copyable, and are read back on the architecture they were written on.
+// The tag identifies the type among the flat types of the same `CEREAL_BASE_TYPE`, which should be polymorphic,
+// and should stay the same, along with the fields, for the files written to be parsed.
+
+#ifndef BRICKS_CEREALIZE_FLAT_H
+#define BRICKS_CEREALIZE_FLAT_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "../3party/cereal/include/details/helpers.hpp"
+
+namespace bricks {
+namespace cerealize {
+
+#define BRICKS_FLAT_FIELDS(M_TAG, ...)                                      \
+  enum : std::uint16_t { BRICKS_FLAT_TAG = M_TAG };                         \
+  auto BricksFlatFields()->decltype(std::tie(__VA_ARGS__)) {                \
+    return std::tie(__VA_ARGS__);                                           \
+  }                                                                         \
+  auto BricksFlatFields() const->decltype(std::tie(__VA_ARGS__)) {          \
+    return std::tie(__VA_ARGS__);                                           \
+  }
+
+#define BRICKS_FLAT_REGISTER_TYPE(M_TYPE) BRICKS_FLAT_REGISTER_TYPE_IMPL(M_TYPE, __LINE__)
+#define BRICKS_FLAT_REGISTER_TYPE_IMPL(M_TYPE, M_LINE) BRICKS_FLAT_REGISTER_TYPE_IMPL2(M_TYPE, M_LINE)
+#define BRICKS_FLAT_REGISTER_TYPE_IMPL2(M_TYPE, M_LINE)                                       \
+  static const bool bricks_flat_type_registered_##M_LINE =                                   \
+      ::bricks::cerealize::FlatTypeRegistry<M_TYPE::CEREAL_BASE_TYPE>::Instance().Register<M_TYPE>()
+
+const std::uint32_t kFlatRecordMarker = 0xC0000000u;
+const std::uint32_t kFlatRecordHeaderSize = sizeof(std::uint32_t);
+
+template <typename T>
+struct HasFlatFields {
+  template <typename U>
+  static constexpr bool Check(decltype(U::BRICKS_FLAT_TAG)*) {
+    return true;
+  }
+  template <typename U>
+  static constexpr bool Check(...) {
+    return false;
+  }
+  enum { value = Check<T>(nullptr) };
+};
+
+namespace impl {
+
+template <typename T_TUPLE, size_t I = 0, size_t N = std::tuple_size<T_TUPLE>::value>
+struct FlatFields {
+  typedef typename std::remove_reference<typename std::tuple_element<I, T_TUPLE>::type>::type Field;
+  static_assert(std::is_trivially_copyable<Field>::value, "The flat fields should be trivially copyable.");
+  typedef FlatFields<T_TUPLE, I + 1, N> Rest;
+
+  enum { kSize = sizeof(Field) + Rest::kSize };
+
+  static void Encode(const T_TUPLE& fields, char* output) {
+    std::memcpy(output, &std::get<I>(fields), sizeof(Field));
+    Rest::Encode(fields, output + sizeof(Field));
+  }
+  static void Decode(const char* input, const T_TUPLE& fields) {
+    std::memcpy(&std::get<I>(fields), input, sizeof(Field));
+    Rest::Decode(input + sizeof(Field), fields);
+  }
+};
+
+template <typename T_TUPLE, size_t N>
+struct FlatFields<T_TUPLE, N, N> {
+  enum { kSize = 0 };
+  static void Encode(const T_TUPLE&, char*) {}
+  static void Decode(const char*, const T_TUPLE&) {}
+};
+
+}  // namespace impl
+
+// Encodes and decodes the fields of `T`, the size of the encoded fields known at compile time.
+template <typename T>
+struct FlatCodec {
+  typedef impl::FlatFields<decltype(std::declval<T&>().BricksFlatFields())> MutableFields;
+  typedef impl::FlatFields<decltype(std::declval<const T&>().BricksFlatFields())> ConstFields;
+
+  enum : size_t { kSize = ConstFields::kSize, kRecordSize = kFlatRecordHeaderSize + kSize };
+
+  // Writes `kRecordSize` bytes: the header and the fields.
+  static void EncodeRecord(const T& entry, char* output) {
+    const std::uint32_t header = kFlatRecordMarker | static_cast<std::uint32_t>(T::BRICKS_FLAT_TAG);
+    std::memcpy(output, &header, sizeof(header));
+    ConstFields::Encode(entry.BricksFlatFields(), output + kFlatRecordHeaderSize);
+  }
+
+  // Reads `kSize` bytes of the fields, past the header.
+  static void Decode(const char* input, T& entry) { MutableFields::Decode(input, entry.BricksFlatFields()); }
+};
+
+// Whether the record starting with the four bytes of `header` is a flat one, and the tag of its type if it is.
+inline bool IsFlatRecordHeader(const char* header, std::uint32_t& tag) {
+  std::uint32_t value;
+  std::memcpy(&value, header, sizeof(value));
+  if ((value & kFlatRecordMarker) != kFlatRecordMarker) {
+    return false;
+  }
+  tag = value & ~kFlatRecordMarker;
+  return true;
+}
+
+// The flat types of the base type `T_BASE`, by tag, for the parsers to construct the records of.
+template <typename T_BASE>
+class FlatTypeRegistry final {
+ public:
+  typedef T_BASE* (*Decoder)(const char*);
+
+  struct Type {
+    Decoder decode = nullptr;
+    size_t size = 0;
+  };
+
+  static FlatTypeRegistry& Instance() {
+    static FlatTypeRegistry registry;
+    return registry;
+  }
+
+  // Called once per translation unit registering the type; throws `cereal::Exception` on conflicting tags.
+  template <typename T>
+  bool Register() {
+    static_assert(std::is_base_of<T_BASE, T>::value, "The flat type should derive from its base type.");
+    static_assert(std::is_polymorphic<T_BASE>::value, "The base type of the flat types should be polymorphic.");
+    const size_t tag = static_cast<size_t>(T::BRICKS_FLAT_TAG);
+    if (types_.size() <= tag) {
+      types_.resize(tag + 1);
+    }
+    Type& type = types_[tag];
+    if (type.decode && type.decode != &DecodeType<T>) {
+      throw cereal::Exception("Two flat types of the same base type have the same tag.");
+    }
+    type.decode = &DecodeType<T>;
+    type.size = FlatCodec<T>::kSize;
+    return true;
+  }
+
+  // Throws `cereal::Exception` if no type has been registered with the tag.
+  const Type& Get(std::uint32_t tag) const {
+    if (tag >= types_.size() || !types_[tag].decode) {
+      throw cereal::Exception("The flat record is of the type not registered.");
+    }
+    return types_[tag];
+  }
+
+ private:
+  FlatTypeRegistry() = default;
+
+  template <typename T>
+  static T_BASE* DecodeType(const char* input) {
+    std::unique_ptr<T> entry(new T());
+    FlatCodec<T>::Decode(input, *entry);
+    return entry.release();
+  }
+
+  std::vector<Type> types_;
+};
+
+// Parses the flat record at [begin, end), if the record there is a flat one, and returns its size then,
+// or returns zero otherwise. Throws `cereal::Exception` for the records truncated or of the types not known.
+template <typename T_ENTRY>
+typename std::enable_if<std::is_polymorphic<T_ENTRY>::value, size_t>::type ParseFlatRecord(
+    const char* begin, const char* end, std::unique_ptr<T_ENTRY>& entry) {
+  std::uint32_t tag;
+  if (static_cast<size_t>(end - begin) < kFlatRecordHeaderSize || !IsFlatRecordHeader(begin, tag)) {
+    return 0;
+  }
+  const typename FlatTypeRegistry<T_ENTRY>::Type& type = FlatTypeRegistry<T_ENTRY>::Instance().Get(tag);
+  if (static_cast<size_t>(end - begin) < kFlatRecordHeaderSize + type.size) {
+    throw cereal::Exception("The flat record is truncated.");
+  }
+  entry.reset(type.decode(begin + kFlatRecordHeaderSize));
+  return kFlatRecordHeaderSize + type.size;
+}
+
+// The records of the types that are not polymorphic are never flat.
+template <typename T_ENTRY>
+typename std::enable_if<!std::is_polymorphic<T_ENTRY>::value, size_t>::type ParseFlatRecord(
+    const char*, const char*, std::unique_ptr<T_ENTRY>&) {
+  return 0;
+}
+
+}  // namespace cerealize
+}  // namespace bricks
+
+#endif  // BRICKS_CEREALIZE_FLAT_H
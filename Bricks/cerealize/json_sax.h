@@ -0,0 +1,604 @@
+// In-situ SAX parsing of JSON into the records, with no DOM built, for replaying JSON logs and parsing bodies.
+//
+// `CerealJSONInSituParser` has the reader of rapidjson parse the JSON in place, destructively, and assigns
+// the values straight to the fields of the record, as they are parsed. The fields are the ones listed by
+// the `serialize()` method of the record, named as for cereal's JSON archives: the `CEREAL_NVP()`-s by their
+// names, and the rest "value0", "value1", and so on. The keys of no field are skipped, along with their values,
+// and the fields of no key keep their values.
+//
+// The fields can be of the arithmetic and enum types, `bool`, `std::string`, `CerealArenaString`,
+// `CerealInSituString`, `std::vector`-s and `std::unique_ptr`-s of these, and the types with `serialize()`.
+// `CerealInSituString` points into the parsed buffer, with no copy made, and is only valid as long as it is.
+//
+// The polymorphic records, as written by cereal, such as by `GenericCerealFileAppender<JSONLines>`, are created
+// by the names of their types, for the types registered with `BRICKS_JSON_SAX_REGISTER_TYPE()` next to
+// `CEREAL_REGISTER_TYPE_WITH_NAME()` or `BRICKS_CEREALIZE_REGISTER_TYPE_WITH_NAME()`.
+// `CerealJSONLinesInSituParser` replays the JSON lines files this way.
+
+#ifndef BRICKS_CEREALIZE_JSON_SAX_H
+#define BRICKS_CEREALIZE_JSON_SAX_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+#include "../3party/cereal/include/types/polymorphic.hpp"
+#include "../3party/cereal/include/archives/json.hpp"
+
+#include "arena.h"
+
+#include "../rtti/dispatcher.h"
+
+namespace bricks {
+namespace cerealize {
+
+// The string value parsed in place: points into the buffer, and is null-terminated there.
+struct CerealInSituString {
+  const char* data = "";
+  size_t length = 0;
+
+  std::string ToString() const { return std::string(data, length); }
+  bool operator==(const std::string& rhs) const {
+    return length == rhs.length() && !std::memcmp(data, rhs.data(), length);
+  }
+  bool operator!=(const std::string& rhs) const { return !operator==(rhs); }
+};
+
+}  // namespace cerealize
+}  // namespace bricks
+
+// For the records with `CerealInSituString`-s to be written with the JSON archives.
+namespace cereal {
+inline void save(JSONOutputArchive& ar, const bricks::cerealize::CerealInSituString& str) {
+  ar.saveValue(str.ToString());
+}
+}  // namespace cereal
+
+namespace bricks {
+namespace cerealize {
+
+namespace impl {
+
+struct JSONSAXFrame;
+
+struct JSONSAXNumber {
+  enum class Kind { Signed, Unsigned, Floating };
+  Kind kind;
+  int64_t i;
+  uint64_t u;
+  double d;
+
+  template <typename T>
+  T As() const {
+    return kind == Kind::Signed ? static_cast<T>(i) : kind == Kind::Unsigned ? static_cast<T>(u)
+                                                                             : static_cast<T>(d);
+  }
+};
+
+// How the values are assigned to the field of some type. The values of the types not allowed are nullptr-s.
+// `object` and `array` bind the frame of the object or the array starting to the field.
+struct JSONSAXOps {
+  void (*number)(void* field, const JSONSAXNumber& value);
+  void (*boolean)(void* field, bool value);
+  void (*string)(void* field, const char* value, size_t length);
+  void (*object)(void* field, JSONSAXFrame& frame);
+  void (*array)(void* field, JSONSAXFrame& frame);
+};
+
+struct JSONSAXField {
+  const char* name;
+  size_t length;
+  void* field;
+  const JSONSAXOps* ops;
+};
+
+// The object or the array being parsed, or the value being skipped.
+struct JSONSAXFrame {
+  enum class Kind { Object, Array, Skipped };
+  Kind kind;
+  // The object: its fields, the number of the unnamed ones, and the field of the key just parsed, if any.
+  std::vector<JSONSAXField> fields;
+  size_t unnamed;
+  bool after_key;
+  const JSONSAXField* key;
+  // The array: appends the element, and returns it.
+  void* array;
+  void* (*append)(void* array);
+  const JSONSAXOps* element_ops;
+  // The value skipped: the number of the objects and arrays it has open.
+  size_t depth;
+};
+
+template <typename T, typename ENABLE = void>
+struct JSONSAXValue;
+
+// The archive for `serialize()` to list the fields of the object with, in the frame of the object.
+class JSONSAXSchema final {
+ public:
+  explicit JSONSAXSchema(JSONSAXFrame& frame) : frame_(frame) {}
+
+  template <typename... ARGS>
+  void operator()(ARGS&&... args) {
+    Bind(std::forward<ARGS>(args)...);
+  }
+
+ private:
+  void Bind() {}
+
+  template <typename T, typename... TAIL>
+  void Bind(T&& head, TAIL&&... tail) {
+    Add(head);
+    Bind(std::forward<TAIL>(tail)...);
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_base_of<cereal::detail::NameValuePairCore, T>::value>::type Add(T& nvp) {
+    typedef typename std::remove_reference<decltype(nvp.value)>::type Field;
+    AddField(nvp.name, std::strlen(nvp.name), const_cast<typename std::remove_cv<Field>::type*>(&nvp.value));
+  }
+
+  template <typename T>
+  typename std::enable_if<!std::is_base_of<cereal::detail::NameValuePairCore, T>::value>::type Add(T& value) {
+    // The names cereal's JSON archives give to the values with no names.
+    static const char* const names[] = {"value0", "value1", "value2",  "value3",  "value4",  "value5",
+                                        "value6", "value7", "value8",  "value9",  "value10", "value11",
+                                        "value12", "value13", "value14", "value15"};
+    if (frame_.unnamed >= sizeof(names) / sizeof(names[0])) {
+      throw cereal::Exception("Too many unnamed fields for in-situ JSON parsing.");
+    }
+    const char* name = names[frame_.unnamed++];
+    AddField(name, std::strlen(name), &value);
+  }
+
+  template <typename T>
+  void AddField(const char* name, size_t length, T* field) {
+    frame_.fields.push_back(JSONSAXField{name, length, field, JSONSAXValue<T>::Ops()});
+  }
+
+  JSONSAXFrame& frame_;
+};
+
+// The objects: the fields listed by their `serialize()`.
+template <typename T, typename ENABLE>
+struct JSONSAXValue {
+  static const JSONSAXOps* Ops() {
+    static const JSONSAXOps ops{nullptr, nullptr, nullptr, &Object, nullptr};
+    return &ops;
+  }
+  static void Object(void* field, JSONSAXFrame& frame) {
+    JSONSAXSchema schema(frame);
+    static_cast<T*>(field)->serialize(schema);
+  }
+};
+
+template <typename T>
+struct JSONSAXValue<T, typename std::enable_if<std::is_arithmetic<T>::value || std::is_enum<T>::value>::type> {
+  static const JSONSAXOps* Ops() {
+    static const JSONSAXOps ops{&Number, nullptr, nullptr, nullptr, nullptr};
+    return &ops;
+  }
+  static void Number(void* field, const JSONSAXNumber& value) {
+    typedef typename std::conditional<std::is_enum<T>::value, int64_t, T>::type Value;
+    *static_cast<T*>(field) = static_cast<T>(value.As<Value>());
+  }
+};
+
+template <>
+struct JSONSAXValue<bool> {
+  static const JSONSAXOps* Ops() {
+    static const JSONSAXOps ops{nullptr, &Boolean, nullptr, nullptr, nullptr};
+    return &ops;
+  }
+  static void Boolean(void* field, bool value) { *static_cast<bool*>(field) = value; }
+};
+
+template <typename TRAITS, typename ALLOCATOR>
+struct JSONSAXValue<std::basic_string<char, TRAITS, ALLOCATOR>> {
+  static const JSONSAXOps* Ops() {
+    static const JSONSAXOps ops{nullptr, nullptr, &String, nullptr, nullptr};
+    return &ops;
+  }
+  static void String(void* field, const char* value, size_t length) {
+    static_cast<std::basic_string<char, TRAITS, ALLOCATOR>*>(field)->assign(value, length);
+  }
+};
+
+template <>
+struct JSONSAXValue<CerealInSituString> {
+  static const JSONSAXOps* Ops() {
+    static const JSONSAXOps ops{nullptr, nullptr, &String, nullptr, nullptr};
+    return &ops;
+  }
+  static void String(void* field, const char* value, size_t length) {
+    CerealInSituString& string = *static_cast<CerealInSituString*>(field);
+    string.data = value;
+    string.length = length;
+  }
+};
+
+template <typename T, typename ALLOCATOR>
+struct JSONSAXValue<std::vector<T, ALLOCATOR>> {
+  static const JSONSAXOps* Ops() {
+    static const JSONSAXOps ops{nullptr, nullptr, nullptr, nullptr, &Array};
+    return &ops;
+  }
+  static void Array(void* field, JSONSAXFrame& frame) {
+    static_cast<std::vector<T, ALLOCATOR>*>(field)->clear();
+    frame.array = field;
+    frame.append = &Append;
+    frame.element_ops = JSONSAXValue<T>::Ops();
+  }
+  static void* Append(void* array) {
+    std::vector<T, ALLOCATOR>& vector = *static_cast<std::vector<T, ALLOCATOR>*>(array);
+    vector.emplace_back();
+    return &vector.back();
+  }
+};
+
+// The types of the polymorphic records, by the names cereal writes them with.
+template <typename T_BASE>
+class JSONSAXTypeRegistry final {
+ public:
+  struct Type {
+    T_BASE* (*create)();
+  };
+
+  static JSONSAXTypeRegistry& Instance() {
+    static JSONSAXTypeRegistry registry;
+    return registry;
+  }
+
+  template <typename T>
+  bool Register() {
+    static_assert(std::is_base_of<T_BASE, T>::value, "The type should derive from its base type.");
+    types_[cereal::detail::binding_name<T>::name()] = Type{&Create<T>};
+    bindings_[std::type_index(typeid(T))] = &Bind<T>;
+    return true;
+  }
+
+  // Throws `cereal::Exception` if no type has been registered with the name.
+  const Type& Get(const char* name, size_t length) const {
+    const auto it = types_.find(std::string(name, length));
+    if (it == types_.end()) {
+      throw cereal::Exception("The JSON record is of the type not registered: " + std::string(name, length));
+    }
+    return it->second;
+  }
+
+  // Binds the fields of the entry created by the type returned from `Get()`, of the same dynamic type.
+  void BindFields(T_BASE& entry, JSONSAXFrame& frame) const {
+    bindings_.at(std::type_index(typeid(entry)))(&entry, frame);
+  }
+
+ private:
+  JSONSAXTypeRegistry() = default;
+
+  template <typename T>
+  static T_BASE* Create() {
+    return new T();
+  }
+  template <typename T>
+  static void Bind(T_BASE* entry, JSONSAXFrame& frame) {
+    JSONSAXValue<T>::Object(static_cast<T*>(entry), frame);
+  }
+
+  std::unordered_map<std::string, Type> types_;
+  std::unordered_map<std::type_index, void (*)(T_BASE*, JSONSAXFrame&)> bindings_;
+};
+
+// The pointers, as cereal's JSON archives write them: `{"polymorphic_id": ..., "polymorphic_name": "...",
+// "ptr_wrapper": {"valid": 1, "data": {...}}}`, or just the "ptr_wrapper" for the non-polymorphic types.
+// All the keys refer to the `std::unique_ptr` itself, each with ops of its own.
+template <typename T>
+struct JSONSAXValue<std::unique_ptr<T>> {
+  static const JSONSAXOps* Ops() {
+    static const JSONSAXOps ops{nullptr, nullptr, nullptr, &Object, nullptr};
+    return &ops;
+  }
+  static void Object(void* field, JSONSAXFrame& frame) {
+    static_cast<std::unique_ptr<T>*>(field)->reset();
+    static const JSONSAXOps name_ops{nullptr, nullptr, &Name, nullptr, nullptr};
+    static const JSONSAXOps wrapper_ops{nullptr, nullptr, nullptr, &Wrapper, nullptr};
+    frame.fields.push_back(JSONSAXField{"polymorphic_name", 16, field, &name_ops});
+    frame.fields.push_back(JSONSAXField{"ptr_wrapper", 11, field, &wrapper_ops});
+  }
+  static void Wrapper(void* field, JSONSAXFrame& frame) {
+    static const JSONSAXOps data_ops{nullptr, nullptr, nullptr, &Data, nullptr};
+    frame.fields.push_back(JSONSAXField{"data", 4, field, &data_ops});
+  }
+  static void Name(void* field, const char* name, size_t length) { Create(field, name, length); }
+  static void Data(void* field, JSONSAXFrame& frame) { BindData(field, frame); }
+
+  template <typename U = T>
+  static typename std::enable_if<std::is_polymorphic<U>::value>::type Create(void* field,
+                                                                            const char* name,
+                                                                            size_t length) {
+    const typename JSONSAXTypeRegistry<T>::Type& type = JSONSAXTypeRegistry<T>::Instance().Get(name, length);
+    static_cast<std::unique_ptr<T>*>(field)->reset(type.create());
+  }
+  template <typename U = T>
+  static typename std::enable_if<!std::is_polymorphic<U>::value>::type Create(void*, const char*, size_t) {}
+
+  template <typename U = T>
+  static typename std::enable_if<std::is_polymorphic<U>::value>::type BindData(void* field,
+                                                                              JSONSAXFrame& frame) {
+    std::unique_ptr<T>& entry = *static_cast<std::unique_ptr<T>*>(field);
+    if (!entry) {
+      throw cereal::Exception("The polymorphic JSON record has no type name.");
+    }
+    JSONSAXTypeRegistry<T>::Instance().BindFields(*entry, frame);
+  }
+  template <typename U = T>
+  static typename std::enable_if<!std::is_polymorphic<U>::value>::type BindData(void* field,
+                                                                               JSONSAXFrame& frame) {
+    std::unique_ptr<T>& entry = *static_cast<std::unique_ptr<T>*>(field);
+    entry.reset(new T());
+    JSONSAXValue<T>::Object(entry.get(), frame);
+  }
+};
+
+// The handler for the reader of rapidjson, assigning the values it parses to the fields of the frames.
+class JSONSAXHandler final {
+ public:
+  typedef char Ch;
+
+  void Start(void* root, const JSONSAXOps* ops) {
+    root_ = JSONSAXField{"", 0, root, ops};
+    depth_ = 0;
+    root_taken_ = false;
+  }
+
+  void Null_() {
+    if (!Skipping()) {
+      Target();
+    }
+  }
+  void Bool_(bool value) {
+    if (!Skipping()) {
+      const JSONSAXField* target = Target();
+      if (target) {
+        Check(target, target->ops->boolean)(target->field, value);
+      }
+    }
+  }
+  void Int(int value) { Number(JSONSAXNumber{JSONSAXNumber::Kind::Signed, value, 0, 0}); }
+  void Uint(unsigned value) { Number(JSONSAXNumber{JSONSAXNumber::Kind::Unsigned, 0, value, 0}); }
+  void Int64(int64_t value) { Number(JSONSAXNumber{JSONSAXNumber::Kind::Signed, value, 0, 0}); }
+  void Uint64(uint64_t value) { Number(JSONSAXNumber{JSONSAXNumber::Kind::Unsigned, 0, value, 0}); }
+  void Double(double value) { Number(JSONSAXNumber{JSONSAXNumber::Kind::Floating, 0, 0, value}); }
+
+  void String(const char* value, rapidjson::SizeType length, bool) {
+    if (Skipping()) {
+      return;
+    }
+    if (depth_ && Top().kind == JSONSAXFrame::Kind::Object && !Top().after_key) {
+      Key(value, length);
+      return;
+    }
+    const JSONSAXField* target = Target();
+    if (target) {
+      Check(target, target->ops->string)(target->field, value, length);
+    }
+  }
+
+  void StartObject() { Open(JSONSAXFrame::Kind::Object); }
+  void EndObject(rapidjson::SizeType) { Close(); }
+  void StartArray() { Open(JSONSAXFrame::Kind::Array); }
+  void EndArray(rapidjson::SizeType) { Close(); }
+
+ private:
+  JSONSAXFrame& Top() { return frames_[depth_ - 1]; }
+
+  bool Skipping() { return depth_ && Top().kind == JSONSAXFrame::Kind::Skipped; }
+
+  void Number(const JSONSAXNumber& value) {
+    if (!Skipping()) {
+      const JSONSAXField* target = Target();
+      if (target) {
+        Check(target, target->ops->number)(target->field, value);
+      }
+    }
+  }
+
+  void Key(const char* name, size_t length) {
+    JSONSAXFrame& frame = Top();
+    frame.after_key = true;
+    frame.key = nullptr;
+    for (const JSONSAXField& field : frame.fields) {
+      if (field.length == length && !std::memcmp(field.name, name, length)) {
+        frame.key = &field;
+        return;
+      }
+    }
+  }
+
+  // The field the value just parsed goes to, or nullptr if it is to be skipped.
+  const JSONSAXField* Target() {
+    if (!depth_) {
+      if (root_taken_) {
+        throw cereal::Exception("More than one JSON value to parse.");
+      }
+      root_taken_ = true;
+      return &root_;
+    }
+    JSONSAXFrame& frame = Top();
+    if (frame.kind == JSONSAXFrame::Kind::Array) {
+      element_ = JSONSAXField{"", 0, frame.append(frame.array), frame.element_ops};
+      return &element_;
+    }
+    frame.after_key = false;
+    return frame.key;
+  }
+
+  template <typename F>
+  static F Check(const JSONSAXField* target, F f) {
+    if (!f) {
+      throw cereal::Exception("The JSON value is of the wrong type for `" + std::string(target->name) + "`.");
+    }
+    return f;
+  }
+
+  void Open(JSONSAXFrame::Kind kind) {
+    if (Skipping()) {
+      ++Top().depth;
+      return;
+    }
+    const JSONSAXField* target = Target();
+    if (depth_ == frames_.size()) {
+      frames_.emplace_back();
+    }
+    JSONSAXFrame& frame = frames_[depth_++];
+    frame.depth = 0;
+    if (!target) {
+      frame.kind = JSONSAXFrame::Kind::Skipped;
+    } else if (kind == JSONSAXFrame::Kind::Object) {
+      frame.kind = kind;
+      frame.fields.clear();
+      frame.unnamed = 0;
+      frame.after_key = false;
+      frame.key = nullptr;
+      Check(target, target->ops->object)(target->field, frame);
+    } else {
+      frame.kind = kind;
+      Check(target, target->ops->array)(target->field, frame);
+    }
+  }
+
+  void Close() {
+    if (Skipping() && Top().depth) {
+      --Top().depth;
+    } else {
+      --depth_;
+    }
+  }
+
+  JSONSAXField root_;
+  JSONSAXField element_;
+  bool root_taken_ = false;
+  // Reused from one value to the next, along with the fields of the frames. Only [0, depth_) are open.
+  std::vector<JSONSAXFrame> frames_;
+  size_t depth_ = 0;
+};
+
+// The record as written by cereal's JSON archives: the pointer to it, named "value0".
+template <typename T_ENTRY>
+struct JSONSAXRecord {
+  std::unique_ptr<T_ENTRY>& entry;
+  template <class A>
+  void serialize(A& ar) {
+    ar(cereal::make_nvp("value0", entry));
+  }
+};
+
+}  // namespace impl
+
+#define BRICKS_JSON_SAX_REGISTER_TYPE(M_TYPE) BRICKS_JSON_SAX_REGISTER_TYPE_IMPL(M_TYPE, __LINE__)
+#define BRICKS_JSON_SAX_REGISTER_TYPE_IMPL(M_TYPE, M_LINE) BRICKS_JSON_SAX_REGISTER_TYPE_IMPL2(M_TYPE, M_LINE)
+#define BRICKS_JSON_SAX_REGISTER_TYPE_IMPL2(M_TYPE, M_LINE)                                             \
+  static const bool bricks_json_sax_type_registered_##M_LINE =                                         \
+      ::bricks::cerealize::impl::JSONSAXTypeRegistry<M_TYPE::CEREAL_BASE_TYPE>::Instance().Register<M_TYPE>()
+
+// Parses the JSON in place. Reused from one buffer to the next, to not allocate per parse. NOT THREAD SAFE.
+// Throws `cereal::Exception` if the JSON is malformed, or does not fit the record.
+class CerealJSONInSituParser final {
+ public:
+  CerealJSONInSituParser() = default;
+
+  // Parses the JSON object in `json`, which is null-terminated, and is overwritten, into the fields of `entry`.
+  template <typename T>
+  void Parse(char* json, T& entry) {
+    handler_.Start(&entry, impl::JSONSAXValue<T>::Ops());
+    Run(json);
+  }
+
+  // Parses the record written by cereal's JSON archives, `{"value0": ...}`, such as a JSON lines file line.
+  template <typename T_ENTRY>
+  void ParseRecord(char* json, std::unique_ptr<T_ENTRY>& entry) {
+    impl::JSONSAXRecord<T_ENTRY> record{entry};
+    entry.reset();
+    Parse(json, record);
+    if (!entry) {
+      throw cereal::Exception("The JSON record is empty.");
+    }
+  }
+
+ private:
+  void Run(char* json) {
+    rapidjson::InsituStringStream stream(json);
+    if (!reader_.Parse<rapidjson::kParseInsituFlag>(stream, handler_)) {
+      throw cereal::Exception(std::string("Malformed JSON: ") + reader_.GetParseError());
+    }
+  }
+
+  rapidjson::Reader reader_;
+  impl::JSONSAXHandler handler_;
+
+  CerealJSONInSituParser(const CerealJSONInSituParser&) = delete;
+  void operator=(const CerealJSONInSituParser&) = delete;
+};
+
+// Same as `GenericCerealFileParser<T_ENTRY, CerealFormat::JSONLines>`, parsing each line in place, see above.
+// The `CerealInSituString`-s of the record point into the line, and are valid until the next one is parsed.
+template <typename T_ENTRY>
+class CerealJSONLinesInSituParser final {
+ public:
+  explicit CerealJSONLinesInSituParser(const std::string& filename) : fi_(filename) {}
+
+  template <typename T_PROCESSOR>
+  bool Next(T_PROCESSOR& processor) {
+    if (!Parse()) {
+      return false;
+    }
+    processor(*entry_.get());
+    return true;
+  }
+
+  template <typename T_PROCESSOR>
+  bool NextLambda(T_PROCESSOR processor) {
+    return Next(processor);
+  }
+
+  template <typename T_PROCESSOR>
+  bool NextWithDispatching(T_PROCESSOR& processor) {
+    if (!Parse()) {
+      return false;
+    }
+    typedef bricks::rtti::RuntimeTupleTableDispatcher<typename T_PROCESSOR::BASE_TYPE,
+                                                      typename T_PROCESSOR::DERIVED_TYPE_LIST> Dispatcher;
+    Dispatcher::DispatchCall(*entry_.get(), processor);
+    return true;
+  }
+
+ private:
+  CerealJSONLinesInSituParser() = delete;
+  CerealJSONLinesInSituParser(const CerealJSONLinesInSituParser&) = delete;
+  void operator=(const CerealJSONLinesInSituParser&) = delete;
+
+  bool Parse() {
+    while (std::getline(fi_, line_)) {
+      if (!line_.empty()) {
+        parser_.ParseRecord(&line_[0], entry_);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::ifstream fi_;
+  // Reused from one line to the next, and parsed in place.
+  std::string line_;
+  std::unique_ptr<T_ENTRY> entry_;
+  CerealJSONInSituParser parser_;
+};
+
+}  // namespace cerealize
+}  // namespace bricks
+
+#endif  // BRICKS_CEREALIZE_JSON_SAX_H
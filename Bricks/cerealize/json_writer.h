@@ -0,0 +1,223 @@
+// Writing the records as JSON straight into a reusable buffer, with no archive and no stream, for the HTTP
+// responses.
+//
+// `CerealJSONWriter` has the writer of rapidjson emit the fields listed by the `serialize()` method
+// of the record, named as for cereal's JSON archives: the `CEREAL_NVP()`-s by their names, and the rest
+// "value0", "value1", and so on. Unlike cereal's `JSONOutputArchive`, the record itself is written,
+// not wrapped into `{"value0": ...}`, with no whitespace, and with no `std::ostringstream` in between:
+// the buffer, rapidjson's `StringBuffer`, is sent as it is.
+//
+//   CerealJSONWriter writer;
+//   writer.SendHTTPResponse(connection, response);  // One `Content-Length` response.
+//   auto sender = connection.SendChunkedHTTPResponse(HTTPResponseCode::OK, kCerealJSONContentType);
+//   for (const auto& entry : entries) {
+//     writer.Send(sender, entry);  // One JSON object per line.
+//   }
+//
+// The fields can be of the arithmetic and enum types, `bool`, `std::string`, `CerealArenaString`,
+// `CerealInSituString`, `std::vector`-s and `std::unique_ptr`-s of these, and the types with `serialize()`.
+// The `std::unique_ptr`-s are written as the objects they point to, or `null`, and the enums as numbers.
+// The writer keeps its buffer from one record to the next, to not allocate once it has grown. NOT THREAD SAFE.
+
+#ifndef BRICKS_CEREALIZE_JSON_WRITER_H
+#define BRICKS_CEREALIZE_JSON_WRITER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "../3party/cereal/include/external/rapidjson/stringbuffer.h"
+#include "../3party/cereal/include/external/rapidjson/writer.h"
+
+#include "json_sax.h"
+
+#include "../net/http/codes.h"
+
+namespace bricks {
+namespace cerealize {
+
+const char* const kCerealJSONContentType = "application/json; charset=utf-8";
+const size_t kCerealJSONWriterDefaultInitialCapacity = 4096;
+
+namespace impl {
+
+typedef rapidjson::Writer<rapidjson::StringBuffer> JSONWriterBackend;
+
+template <typename T, typename ENABLE = void>
+struct JSONWriterValue;
+
+// The archive for `serialize()` to write the fields of the object with, as the keys and the values.
+class JSONWriterFields final {
+ public:
+  explicit JSONWriterFields(JSONWriterBackend& writer) : writer_(writer) {}
+
+  template <typename... ARGS>
+  void operator()(ARGS&&... args) {
+    Write(std::forward<ARGS>(args)...);
+  }
+
+ private:
+  void Write() {}
+
+  template <typename T, typename... TAIL>
+  void Write(T&& head, TAIL&&... tail) {
+    Add(head);
+    Write(std::forward<TAIL>(tail)...);
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_base_of<cereal::detail::NameValuePairCore, T>::value>::type Add(T& nvp) {
+    typedef typename std::decay<decltype(nvp.value)>::type Field;
+    writer_.String(nvp.name, static_cast<rapidjson::SizeType>(std::strlen(nvp.name)));
+    JSONWriterValue<Field>::Write(writer_, nvp.value);
+  }
+
+  template <typename T>
+  typename std::enable_if<!std::is_base_of<cereal::detail::NameValuePairCore, T>::value>::type Add(T& value) {
+    // The names cereal's JSON archives give to the values with no names.
+    char name[32];
+    const int length = snprintf(name, sizeof(name), "value%zu", unnamed_++);
+    writer_.String(name, static_cast<rapidjson::SizeType>(length));
+    JSONWriterValue<typename std::decay<T>::type>::Write(writer_, value);
+  }
+
+  JSONWriterBackend& writer_;
+  size_t unnamed_ = 0;
+};
+
+// The objects: the fields listed by their `serialize()`, which is not `const`, and does not modify the object.
+template <typename T, typename ENABLE>
+struct JSONWriterValue {
+  static void Write(JSONWriterBackend& writer, const T& value) {
+    writer.StartObject();
+    JSONWriterFields fields(writer);
+    const_cast<T&>(value).serialize(fields);
+    writer.EndObject();
+  }
+};
+
+template <typename T>
+struct JSONWriterValue<T,
+                       typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type> {
+  static void Write(JSONWriterBackend& writer, T value) { writer.Int64(static_cast<int64_t>(value)); }
+};
+
+template <typename T>
+struct JSONWriterValue<
+    T,
+    typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value &&
+                            !std::is_same<T, bool>::value>::type> {
+  static void Write(JSONWriterBackend& writer, T value) { writer.Uint64(static_cast<uint64_t>(value)); }
+};
+
+template <typename T>
+struct JSONWriterValue<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+  static void Write(JSONWriterBackend& writer, T value) { writer.Double(static_cast<double>(value)); }
+};
+
+template <typename T>
+struct JSONWriterValue<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+  static void Write(JSONWriterBackend& writer, T value) {
+    JSONWriterValue<typename std::underlying_type<T>::type>::Write(
+        writer, static_cast<typename std::underlying_type<T>::type>(value));
+  }
+};
+
+template <>
+struct JSONWriterValue<bool> {
+  static void Write(JSONWriterBackend& writer, bool value) { writer.Bool_(value); }
+};
+
+template <typename TRAITS, typename ALLOCATOR>
+struct JSONWriterValue<std::basic_string<char, TRAITS, ALLOCATOR>> {
+  static void Write(JSONWriterBackend& writer, const std::basic_string<char, TRAITS, ALLOCATOR>& value) {
+    writer.String(value.data(), static_cast<rapidjson::SizeType>(value.length()));
+  }
+};
+
+template <>
+struct JSONWriterValue<CerealInSituString> {
+  static void Write(JSONWriterBackend& writer, const CerealInSituString& value) {
+    writer.String(value.data, static_cast<rapidjson::SizeType>(value.length));
+  }
+};
+
+template <typename T, typename ALLOCATOR>
+struct JSONWriterValue<std::vector<T, ALLOCATOR>> {
+  static void Write(JSONWriterBackend& writer, const std::vector<T, ALLOCATOR>& value) {
+    writer.StartArray();
+    for (const T& element : value) {
+      JSONWriterValue<T>::Write(writer, element);
+    }
+    writer.EndArray();
+  }
+};
+
+template <typename T>
+struct JSONWriterValue<std::unique_ptr<T>> {
+  static_assert(!std::is_polymorphic<T>::value, "The polymorphic records are written with cereal's archives.");
+  static void Write(JSONWriterBackend& writer, const std::unique_ptr<T>& value) {
+    if (value) {
+      JSONWriterValue<T>::Write(writer, *value);
+    } else {
+      writer.Null_();
+    }
+  }
+};
+
+}  // namespace impl
+
+class CerealJSONWriter final {
+ public:
+  explicit CerealJSONWriter(size_t initial_capacity = kCerealJSONWriterDefaultInitialCapacity)
+      : buffer_(nullptr, initial_capacity), writer_(buffer_, std::numeric_limits<double>::max_digits10) {}
+
+  // Writes `entry` into the buffer, in place of what has been written before.
+  template <typename T>
+  CerealJSONWriter& Write(const T& entry) {
+    buffer_.Clear();
+    impl::JSONWriterValue<T>::Write(writer_, entry);
+    return *this;
+  }
+
+  // The JSON last written, valid until the next `Write()`. Null-terminated.
+  const char* data() const { return buffer_.GetString(); }
+  size_t size() const { return buffer_.Size(); }
+  std::string ToString() const { return std::string(data(), size()); }
+
+  // Writes `entry` and sends it as the response over `connection`, such as `HTTPServerConnection`.
+  template <typename T_CONNECTION, typename T>
+  void SendHTTPResponse(T_CONNECTION& connection,
+                        const T& entry,
+                        net::HTTPResponseCode code = net::HTTPResponseCode::OK,
+                        const std::string& content_type = kCerealJSONContentType) {
+    Write(entry);
+    connection.SendHTTPResponse(data(), size(), code, content_type);
+  }
+
+  // Writes `entry`, followed by a newline, and sends it with `sender`, such as `ChunkedResponseSender`.
+  template <typename T_SENDER, typename T>
+  void Send(T_SENDER& sender, const T& entry) {
+    Write(entry);
+    buffer_.Put('\n');
+    sender.Send(data(), size());
+  }
+
+ private:
+  rapidjson::StringBuffer buffer_;
+  impl::JSONWriterBackend writer_;
+
+  CerealJSONWriter(const CerealJSONWriter&) = delete;
+  void operator=(const CerealJSONWriter&) = delete;
+};
+
+}  // namespace cerealize
+}  // namespace bricks
+
+#endif  // BRICKS_CEREALIZE_JSON_WRITER_H
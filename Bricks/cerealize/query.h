@@ -0,0 +1,143 @@
+// `CerealLogQuery` runs an aggregation over a set of cereal logs, such as written by `CerealFileAppender`,
+// in parallel, instead of a loop of `NextWithDispatching()` over each file in turn.
+//
+// The files are added one by one, or by the directory, optionally only those named with the prefix and
+// the suffix given, such as "finalized-" and ".bin" for the finalized files of FSQ. A file is the unit
+// of work: the files are taken largest first by the workers of `Executor::Shared()` and the calling thread,
+// each parsing its files with `CerealMappedFileParser` into a partial aggregate of its own, and the partial
+// aggregates are merged once all the files are done. With many files, as FSQ leaves behind, the throughput
+// grows with the number of cores; a single file is parsed by a single thread.
+//
+// `Run()` takes an aggregate with `operator()(const T&)` for each type `T` of `T_TYPE_LIST`, and for `T_BASE`,
+// the records being dispatched as with `RuntimeTupleTableDispatcher`, and `Merge(const T_AGGREGATE&)`, which
+// should not depend on the order the partial aggregates are merged in. Each worker starts from a copy
+// of the aggregate passed in. `MapReduce<T>()` is the shortcut for one type `T`: the records of the type
+// that pass the filter are mapped to values, and the values are reduced into the result.
+//
+// The first exception thrown by the parsing or the aggregate, such as `cereal::Exception` for a malformed
+// file, is rethrown, with the files not taken yet skipped.
+
+#ifndef BRICKS_CEREALIZE_QUERY_H
+#define BRICKS_CEREALIZE_QUERY_H
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cerealize.h"
+
+#include "../executor/executor.h"
+#include "../file/file.h"
+#include "../rtti/dispatcher.h"
+
+namespace bricks {
+namespace cerealize {
+
+template <typename T_BASE, typename T_TYPE_LIST>
+class CerealLogQuery final {
+ public:
+  typedef bricks::rtti::RuntimeTupleTableDispatcher<T_BASE, T_TYPE_LIST> Dispatcher;
+
+  CerealLogQuery() = default;
+
+  CerealLogQuery& AddFile(const std::string& filename) {
+    files_.emplace_back(FileSystem::GetFileSize(filename), filename);
+    return *this;
+  }
+
+  // Adds the regular files of `directory` with the names starting with `prefix` and ending with `suffix`.
+  CerealLogQuery& AddDirectory(const std::string& directory,
+                               const std::string& prefix = "",
+                               const std::string& suffix = "") {
+    typedef FileSystem::DirectoryEntry Entry;
+    FileSystem::ScanDirEntriesUntil(directory, [this, &directory, &prefix, &suffix](const Entry& e) {
+      const std::string name(e.name, e.name_length);
+      if (name.length() >= prefix.length() + suffix.length() && !name.compare(0, prefix.length(), prefix) &&
+          !name.compare(name.length() - suffix.length(), suffix.length(), suffix) && e.IsRegularFile()) {
+        files_.emplace_back(e.Size(), FileSystem::JoinPath(directory, name));
+      }
+      return true;
+    });
+    return *this;
+  }
+
+  size_t NumberOfFiles() const { return files_.size(); }
+
+  // Returns the partial aggregates of all the records of all the files merged, or `aggregate` for no files.
+  template <typename T_AGGREGATE>
+  T_AGGREGATE Run(const T_AGGREGATE& aggregate) const {
+    std::vector<std::pair<uint64_t, std::string>> files(files_);
+    std::sort(files.begin(), files.end(), [](const std::pair<uint64_t, std::string>& lhs,
+                                             const std::pair<uint64_t, std::string>& rhs) {
+      return lhs.first > rhs.first;
+    });
+    const size_t workers = std::min(files.size(), Executor::Shared().Threads() + 1);
+    std::vector<T_AGGREGATE> partials(workers, aggregate);
+    std::atomic<size_t> next(0);
+    Executor::Shared().ParallelFor(0, workers, [&files, &partials, &next](size_t worker) {
+      T_AGGREGATE& partial = partials[worker];
+      const auto dispatch = [&partial](const T_BASE& entry) { Dispatcher::DispatchCall(entry, partial); };
+      for (size_t i = next++; i < files.size(); i = next++) {
+        CerealMappedFileParser<T_BASE> parser(files[i].second);
+        while (parser.NextLambda(dispatch)) {
+        }
+      }
+    });
+    if (partials.empty()) {
+      return aggregate;
+    }
+    for (size_t i = 1; i < partials.size(); ++i) {
+      partials.front().Merge(partials[i]);
+    }
+    return std::move(partials.front());
+  }
+
+  // Calls `reduce(result, map(entry))` for each record of type `T` for which `filter(entry)` is true,
+  // starting from `initial` for each worker, then `reduce(result, partial)` for the results of the workers.
+  template <typename T, typename T_RESULT, typename F_FILTER, typename F_MAP, typename F_REDUCE>
+  T_RESULT MapReduce(T_RESULT initial, F_FILTER filter, F_MAP map, F_REDUCE reduce) const {
+    return Run(MapReduceAggregate<T, T_RESULT, F_FILTER, F_MAP, F_REDUCE>(initial, filter, map, reduce)).result;
+  }
+
+  // The number of the records of type `T` for which `filter(entry)` is true.
+  template <typename T, typename F_FILTER>
+  size_t Count(F_FILTER filter) const {
+    return MapReduce<T>(static_cast<size_t>(0),
+                        filter,
+                        [](const T&) { return static_cast<size_t>(1); },
+                        [](size_t& result, size_t value) { result += value; });
+  }
+
+ private:
+  template <typename T, typename T_RESULT, typename F_FILTER, typename F_MAP, typename F_REDUCE>
+  struct MapReduceAggregate {
+    MapReduceAggregate(T_RESULT initial, F_FILTER filter, F_MAP map, F_REDUCE reduce)
+        : result(initial), filter(filter), map(map), reduce(reduce) {}
+
+    void operator()(const T& entry) {
+      if (filter(entry)) {
+        reduce(result, map(entry));
+      }
+    }
+    // The records of the other types.
+    template <typename T_OTHER>
+    void operator()(const T_OTHER&) {}
+
+    void Merge(const MapReduceAggregate& partial) { reduce(result, partial.result); }
+
+    T_RESULT result;
+    F_FILTER filter;
+    F_MAP map;
+    F_REDUCE reduce;
+  };
+
+  // The sizes of the files and their names.
+  std::vector<std::pair<uint64_t, std::string>> files_;
+};
+
+}  // namespace cerealize
+}  // namespace bricks
+
+#endif  // BRICKS_CEREALIZE_QUERY_H
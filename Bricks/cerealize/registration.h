@@ -0,0 +1,159 @@
+// Lazy registration of the polymorphic types, for the binaries with many of them to not pay for it at startup.
+//
+// `CEREAL_REGISTER_TYPE_WITH_NAME(type, name)` binds the type to each archive included before it, during
+// the static initialization: a map entry, with two `std::function`-s, per type, per input and output archive.
+// `BRICKS_CEREALIZE_REGISTER_TYPE_WITH_NAME(type, name)`, used the same way, only names the type then,
+// and links it into a list, with no allocations. The types of the list are bound to the archives of a format
+// the first time an appender or a parser of `cerealize.h` uses that format, and to the other formats never,
+// unless they are used too:
+//
+//   struct EventClick;
+//   BRICKS_CEREALIZE_REGISTER_TYPE_WITH_NAME(EventClick, "click");
+//   struct EventClick : EventBase { ... };
+//
+// The code creating the archives of cereal itself calls `CerealBindRegisteredTypes<archive type>()` first.
+// The types should be registered at namespace scope, before `main()`, as with cereal's own macros.
+//
+// The archives are selected at compile time: define `BRICKS_CEREALIZE_NO_JSON` or `BRICKS_CEREALIZE_NO_XML`
+// before including `cerealize.h` for the JSON or the XML archives, and their static objects, to be left out.
+
+#ifndef BRICKS_CEREALIZE_REGISTRATION_H
+#define BRICKS_CEREALIZE_REGISTRATION_H
+
+#include <type_traits>
+
+#include "../3party/cereal/include/types/polymorphic.hpp"
+
+#include "../3party/cereal/include/archives/binary.hpp"
+#ifndef BRICKS_CEREALIZE_NO_JSON
+#include "../3party/cereal/include/archives/json.hpp"
+#endif
+#ifndef BRICKS_CEREALIZE_NO_XML
+#include "../3party/cereal/include/archives/xml.hpp"
+#endif
+
+namespace bricks {
+namespace cerealize {
+
+enum class CerealArchiveFormat : int { Binary = 0, JSON, XML };
+
+template <typename T_ARCHIVE>
+struct CerealArchiveFormatOf;
+
+template <>
+struct CerealArchiveFormatOf<cereal::BinaryInputArchive> {
+  static constexpr CerealArchiveFormat value = CerealArchiveFormat::Binary;
+};
+template <>
+struct CerealArchiveFormatOf<cereal::BinaryOutputArchive> {
+  static constexpr CerealArchiveFormat value = CerealArchiveFormat::Binary;
+};
+#ifndef BRICKS_CEREALIZE_NO_JSON
+template <>
+struct CerealArchiveFormatOf<cereal::JSONInputArchive> {
+  static constexpr CerealArchiveFormat value = CerealArchiveFormat::JSON;
+};
+template <>
+struct CerealArchiveFormatOf<cereal::JSONOutputArchive> {
+  static constexpr CerealArchiveFormat value = CerealArchiveFormat::JSON;
+};
+#endif
+#ifndef BRICKS_CEREALIZE_NO_XML
+template <>
+struct CerealArchiveFormatOf<cereal::XMLInputArchive> {
+  static constexpr CerealArchiveFormat value = CerealArchiveFormat::XML;
+};
+template <>
+struct CerealArchiveFormatOf<cereal::XMLOutputArchive> {
+  static constexpr CerealArchiveFormat value = CerealArchiveFormat::XML;
+};
+#endif
+
+namespace impl {
+
+// A type registered lazily: the function binding it to the archives of a format, and the next type of the list.
+struct CerealLazyType final {
+  explicit CerealLazyType(void (*bind)(CerealArchiveFormat)) : bind(bind), next(Head()) { Head() = this; }
+
+  // Constant-initialized, thus there before the first type links itself in.
+  static CerealLazyType*& Head() {
+    static CerealLazyType* head = nullptr;
+    return head;
+  }
+
+  void (*const bind)(CerealArchiveFormat);
+  CerealLazyType* const next;
+};
+
+// The same map entries `CEREAL_BIND_TO_ARCHIVES()` makes, constructed on first use instead of at startup.
+template <typename T_INPUT, typename T_OUTPUT, typename T>
+void CerealBindTypeToArchives(std::false_type) {
+  static const cereal::detail::InputBindingCreator<T_INPUT, T> input;
+  static const cereal::detail::OutputBindingCreator<T_OUTPUT, T> output;
+  static_cast<void>(input);
+  static_cast<void>(output);
+}
+
+// The abstract types are never serialized as they are, and cereal does not bind them either.
+template <typename T_INPUT, typename T_OUTPUT, typename T>
+void CerealBindTypeToArchives(std::true_type) {}
+
+template <typename T>
+void CerealBindLazyType(CerealArchiveFormat format) {
+  static_assert(std::is_polymorphic<T>::value, "Attempting to register non polymorphic type.");
+  if (format == CerealArchiveFormat::Binary) {
+    CerealBindTypeToArchives<cereal::BinaryInputArchive, cereal::BinaryOutputArchive, T>(std::is_abstract<T>());
+  }
+#ifndef BRICKS_CEREALIZE_NO_JSON
+  if (format == CerealArchiveFormat::JSON) {
+    CerealBindTypeToArchives<cereal::JSONInputArchive, cereal::JSONOutputArchive, T>(std::is_abstract<T>());
+  }
+#endif
+#ifndef BRICKS_CEREALIZE_NO_XML
+  if (format == CerealArchiveFormat::XML) {
+    CerealBindTypeToArchives<cereal::XMLInputArchive, cereal::XMLOutputArchive, T>(std::is_abstract<T>());
+  }
+#endif
+}
+
+// Binds all the types of the list to the archives of the format, once, thread safe, as a local static is.
+template <CerealArchiveFormat FORMAT>
+void CerealBindLazyTypes() {
+  static const bool bound = []() {
+    for (const CerealLazyType* type = CerealLazyType::Head(); type; type = type->next) {
+      type->bind(FORMAT);
+    }
+    return true;
+  }();
+  static_cast<void>(bound);
+}
+
+}  // namespace impl
+
+// Binds the types registered with `BRICKS_CEREALIZE_REGISTER_TYPE_WITH_NAME()` to the archives of the format
+// of `T_ARCHIVE`, for the polymorphic records to be written and parsed with it. Only does it the first time.
+template <typename T_ARCHIVE>
+inline void CerealBindRegisteredTypes() {
+  impl::CerealBindLazyTypes<CerealArchiveFormatOf<T_ARCHIVE>::value>();
+}
+
+}  // namespace cerealize
+}  // namespace bricks
+
+#define BRICKS_CEREALIZE_REGISTER_TYPE_WITH_NAME(M_TYPE, M_NAME) \
+  BRICKS_CEREALIZE_REGISTER_TYPE_IMPL(M_TYPE, M_NAME, __LINE__)
+#define BRICKS_CEREALIZE_REGISTER_TYPE_IMPL(M_TYPE, M_NAME, M_LINE) \
+  BRICKS_CEREALIZE_REGISTER_TYPE_IMPL2(M_TYPE, M_NAME, M_LINE)
+#define BRICKS_CEREALIZE_REGISTER_TYPE_IMPL2(M_TYPE, M_NAME, M_LINE)                          \
+  namespace cereal {                                                                         \
+  namespace detail {                                                                         \
+  template <>                                                                                \
+  struct binding_name<M_TYPE> {                                                              \
+    static constexpr char const* name() { return M_NAME; }                                   \
+  };                                                                                         \
+  }                                                                                          \
+  }                                                                                          \
+  static ::bricks::cerealize::impl::CerealLazyType bricks_cerealize_lazy_type_##M_LINE(      \
+      &::bricks::cerealize::impl::CerealBindLazyType<M_TYPE>)
+
+#endif  // BRICKS_CEREALIZE_REGISTRATION_H
@@ -9,13 +9,23 @@
 // * Add and parse --n=10000 entries: --vbros=FILENAME and --vyser=FILENAME.
 // * Non-polymorphic types, JSON and binary, success and failure.
 
+#include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <iostream>
 #include <tuple>
 
 #include "../cerealize.h"
+#include "../async_appender.h"
+#include "../block_log.h"
+#include "../columnar.h"
+#include "../json_sax.h"
+#include "../json_writer.h"
+#include "../query.h"
 
 #include "../../file/file.h"
 #include "../../dflags/dflags.h"
+#include "../../strings/printf.h"
 
 #include "test_event_base.h"
 #include "test_event_derived.h"
@@ -25,9 +35,124 @@
 
 using namespace bricks;
 using namespace cerealize;
+using bricks::strings::Printf;
 
 DEFINE_string(filename_prefix, "build/example_data/", "Prefix for intermediate output files.");
 
+BRICKS_JSON_SAX_REGISTER_TYPE(EventAppStart);
+BRICKS_JSON_SAX_REGISTER_TYPE(EventAppSuspend);
+BRICKS_JSON_SAX_REGISTER_TYPE(EventAppResume);
+
+// The record type to parse the JSON objects into in place, as the HTTP bodies are.
+struct InSituPoint {
+  int x = 0;
+  double y = 0;
+  template <class A>
+  void serialize(A& ar) {
+    ar(CEREAL_NVP(x), CEREAL_NVP(y));
+  }
+};
+
+struct InSituRequest {
+  uint64_t id = 0;
+  bool flag = false;
+  std::string copied;
+  CerealInSituString in_place;
+  std::vector<InSituPoint> points;
+  std::vector<std::string> tags;
+  std::unique_ptr<InSituPoint> origin;
+  template <class A>
+  void serialize(A& ar) {
+    ar(CEREAL_NVP(id), CEREAL_NVP(flag), CEREAL_NVP(copied), CEREAL_NVP(in_place));
+    ar(CEREAL_NVP(points), CEREAL_NVP(tags), CEREAL_NVP(origin));
+  }
+};
+
+// The record types to construct in an arena, along with their members.
+struct ArenaEventBase : CerealArenaAllocated {
+  CerealArenaString text;
+  virtual ~ArenaEventBase() {}
+  template <class A>
+  void serialize(A& ar) {
+    ar(CEREAL_NVP(text));
+  }
+};
+
+struct ArenaEvent;
+CEREAL_REGISTER_TYPE_WITH_NAME(ArenaEvent, "arena");
+struct ArenaEvent : ArenaEventBase {
+  typedef ArenaEventBase CEREAL_BASE_TYPE;
+  std::vector<int, CerealArenaAllocator<int>> values;
+  template <class A>
+  void serialize(A& ar) {
+    ArenaEventBase::serialize(ar);
+    ar(CEREAL_NVP(values));
+  }
+};
+
+// The record type written as a flat record, in the same files as the cereal-ized `MapsYouEventBase`-s.
+struct EventFlatClick : MapsYouEventBase {
+  typedef MapsYouEventBase CEREAL_BASE_TYPE;
+  uint64_t timestamp = 0;
+  int32_t x = 0;
+  int32_t y = 0;
+  char button[8] = {};
+  virtual std::string ShortType() const override { return "fc"; }
+  BRICKS_FLAT_FIELDS(1, timestamp, x, y, button);
+};
+BRICKS_FLAT_REGISTER_TYPE(EventFlatClick);
+
+static EventFlatClick FlatClick(uint64_t timestamp, int32_t x, int32_t y, const char* button) {
+  EventFlatClick e;
+  e.timestamp = timestamp;
+  e.x = x;
+  e.y = y;
+  std::strncpy(e.button, button, sizeof(e.button) - 1);
+  return e;
+}
+
+static std::string FlatClickAsString(const MapsYouEventBase& base) {
+  const EventFlatClick& e = dynamic_cast<const EventFlatClick&>(base);
+  return Printf("%s:%d,%d,%d,%s", e.ShortType().c_str(), static_cast<int>(e.timestamp), e.x, e.y, e.button);
+}
+
+// The record types to export into columns: the fields of the numeric types, of strings, and of neither.
+struct ColumnarEventBase {
+  uint64_t timestamp = 0;
+  virtual ~ColumnarEventBase() {}
+  template <class A>
+  void serialize(A& ar) {
+    ar(CEREAL_NVP(timestamp));
+  }
+};
+
+struct ColumnarClick;
+CEREAL_REGISTER_TYPE_WITH_NAME(ColumnarClick, "click");
+struct ColumnarClick : ColumnarEventBase {
+  typedef ColumnarEventBase CEREAL_BASE_TYPE;
+  int32_t x = 0;
+  std::string button;
+  std::vector<int> path;
+  template <class A>
+  void serialize(A& ar) {
+    ColumnarEventBase::serialize(ar);
+    ar(CEREAL_NVP(x), CEREAL_NVP(button), CEREAL_NVP(path));
+  }
+};
+
+struct ColumnarView;
+CEREAL_REGISTER_TYPE_WITH_NAME(ColumnarView, "view");
+struct ColumnarView : ColumnarEventBase {
+  typedef ColumnarEventBase CEREAL_BASE_TYPE;
+  double duration = 0;
+  bool first = false;
+  template <class A>
+  void serialize(A& ar) {
+    ColumnarEventBase::serialize(ar);
+    ar(CEREAL_NVP(duration), first);
+  }
+};
+
 static std::string CurrentTestName() {
   // via https://code.google.com/p/googletest/wiki/AdvancedGuide#Getting_the_Current_Test%27s_Name
   return ::testing::UnitTest::GetInstance()->current_test_info()->name();
@@ -152,3 +277,994 @@ TEST(Cerealize, ConsumerSupportsPolymorphicTypes) {
       " UID=, UID_Google=, UID_Apple=, UID_Facebook=, baz=baz RESUME \n",
       consumer.os.str());
 }
+
+TEST(Cerealize, AppenderBuffersUntilFlushed) {
+  RemoveFile(CurrentTestTempFileName(), RemoveFileParameters::Silent);
+
+  EventAppStart a;
+  EventAppSuspend b;
+  EventAppResume c;
+
+  {
+    CerealFileAppender appender(CurrentTestTempFileName());
+    appender << a << b;
+    EXPECT_GT(appender.BufferedSize(), 0u);
+    EXPECT_EQ(0u, FileSystem::GetFileSize(CurrentTestTempFileName()));
+    appender.Flush();
+    EXPECT_EQ(0u, appender.BufferedSize());
+    const uint64_t flushed_size = FileSystem::GetFileSize(CurrentTestTempFileName());
+    EXPECT_GT(flushed_size, 0u);
+    appender << c;
+    EXPECT_EQ(flushed_size, FileSystem::GetFileSize(CurrentTestTempFileName()));
+  }
+
+  // A buffer smaller than the records is written out as it fills up.
+  {
+    CerealFileAppender appender(CurrentTestTempFileName(), true, 16);
+    const uint64_t size_before = FileSystem::GetFileSize(CurrentTestTempFileName());
+    appender << a;
+    EXPECT_GT(FileSystem::GetFileSize(CurrentTestTempFileName()), size_before);
+    EXPECT_LT(appender.BufferedSize(), 16u);
+  }
+
+  CerealFileParser<MapsYouEventBase> f(CurrentTestTempFileName());
+  std::ostringstream os;
+  while (f.NextLambda([&os](const MapsYouEventBase& e) { os << e.ShortType() << '\n'; }))
+    ;
+  EXPECT_EQ("a\nas\nar\na\n", os.str());
+}
+
+TEST(Cerealize, AppenderWritesThroughPosixOutputFile) {
+  RemoveFile(CurrentTestTempFileName(), RemoveFileParameters::Silent);
+
+  EventAppStart a;
+  EventAppSuspend b;
+  EventAppResume c;
+
+  GenericCerealFileAppender<CerealFormat::Binary, PosixOutputFile>(CurrentTestTempFileName()) << a << b;
+  GenericCerealFileAppender<CerealFormat::Binary, PosixOutputFile>(CurrentTestTempFileName(), true, 1) << c;
+  {
+    CerealFileParser<MapsYouEventBase> f(CurrentTestTempFileName());
+    std::ostringstream os;
+    while (f.NextLambda([&os](const MapsYouEventBase& e) { os << e.ShortType() << '\n'; }))
+      ;
+    EXPECT_EQ("a\nas\nar\n", os.str());
+  }
+
+  // The JSON archive completes its output on destruction, before the buffer is written out.
+  GenericCerealFileAppender<CerealFormat::JSON, PosixOutputFile>(CurrentTestTempFileName(), false) << a << c;
+  {
+    GenericCerealFileParser<MapsYouEventBase, CerealFormat::JSON> f(CurrentTestTempFileName());
+    std::ostringstream os;
+    while (f.NextLambda([&os](const MapsYouEventBase& e) { os << e.ShortType() << '\n'; }))
+      ;
+    EXPECT_EQ("a\nar\n", os.str());
+  }
+}
+
+// The queue for `AsyncCerealFileAppender` to pass on the records through: on the thread pushing them,
+// in batches of three, rejecting every fourth record, and passing on the rest on destruction.
+template <typename CONSUMER, typename MESSAGE>
+struct BatchesOfThreeMQ {
+  explicit BatchesOfThreeMQ(CONSUMER& consumer) : consumer(consumer) {}
+  ~BatchesOfThreeMQ() { Export(); }
+
+  bool PushMessage(MESSAGE&& message) {
+    if (!(++pushed % 4)) {
+      ++dropped;
+      return false;
+    }
+    batch.push_back(std::move(message));
+    if (batch.size() == 3) {
+      Export();
+    }
+    return true;
+  }
+  void Export() {
+    if (!batch.empty()) {
+      consumer.OnMessages(&batch.front(), &batch.front() + batch.size(), dropped);
+      batch.clear();
+      dropped = 0;
+    }
+  }
+
+  CONSUMER& consumer;
+  std::vector<MESSAGE> batch;
+  size_t pushed = 0;
+  size_t dropped = 0;
+};
+
+TEST(Cerealize, AsyncAppenderWritesTheBatchesOfTheQueue) {
+  RemoveFile(CurrentTestTempFileName(), RemoveFileParameters::Silent);
+
+  typedef std::unique_ptr<MapsYouEventBase> Entry;
+  const auto ShortTypes = []() {
+    CerealFileParser<MapsYouEventBase> f(CurrentTestTempFileName());
+    std::ostringstream os;
+    while (f.NextLambda([&os](const MapsYouEventBase& e) { os << e.ShortType() << '\n'; }))
+      ;
+    return os.str();
+  };
+
+  {
+    AsyncCerealFileAppender<Entry, BatchesOfThreeMQ> appender(CurrentTestTempFileName());
+    appender << Entry(new EventAppStart()) << Entry(new EventAppSuspend());
+    EXPECT_EQ(0u, FileSystem::GetFileSize(CurrentTestTempFileName()));
+    EXPECT_TRUE(appender.Push(Entry(new EventAppResume())));
+    // The batch is written out as a whole, with its polymorphic records of the types they are.
+    EXPECT_EQ("a\nas\nar\n", ShortTypes());
+
+    EXPECT_FALSE(appender.Push(Entry(new EventAppStart())));
+    appender << Entry(new EventAppSuspend()) << Entry(new EventAppResume()) << Entry(new EventAppStart());
+    EXPECT_EQ(1u, appender.NumberOfDroppedEntries());
+    EXPECT_EQ("a\nas\nar\nas\nar\na\n", ShortTypes());
+    // The eighth record is rejected, and the ninth one is written out on destruction.
+    appender << Entry(new EventAppStart()) << Entry(new EventAppResume());
+  }
+  EXPECT_EQ("a\nas\nar\nas\nar\na\nar\n", ShortTypes());
+}
+
+TEST(Cerealize, MappedFileParserDetectsEndOfFile) {
+  RemoveFile(CurrentTestTempFileName(), RemoveFileParameters::Silent);
+
+  EventAppStart a;
+  EventAppSuspend b;
+  EventAppResume c;
+
+  CerealFileAppender(CurrentTestTempFileName()) << a << b;
+  CerealFileAppender(CurrentTestTempFileName()) << c;
+
+  {
+    CerealMappedFileParser<MapsYouEventBase> f(CurrentTestTempFileName());
+    std::ostringstream os;
+    while (f.NextLambda([&os](const MapsYouEventBase& e) { os << e.ShortType() << '\n'; }))
+      ;
+    EXPECT_EQ("a\nas\nar\n", os.str());
+    EXPECT_TRUE(f.AtEnd());
+  }
+
+  // A truncated record is an error, not the end of the file.
+  const std::string contents = ReadFileAsString(CurrentTestTempFileName());
+  WriteStringToFile(CurrentTestTempFileName(), contents.substr(0, contents.length() - 2));
+  CerealMappedFileParser<MapsYouEventBase> f(CurrentTestTempFileName());
+  size_t parsed = 0;
+  ASSERT_THROW(while (f.NextLambda([&parsed](const MapsYouEventBase&) { ++parsed; })), cereal::Exception);
+  EXPECT_EQ(2u, parsed);
+}
+
+// The events of a closed list are written and parsed as variants, dispatched with no `dynamic_cast`-s.
+TEST(Cerealize, VariantsSerializeAndParseWithoutPolymorphism) {
+  typedef std::tuple<EventAppStart, EventAppSuspend, EventAppResume> Events;
+  typedef rtti::TupleVariant<Events>::type Event;
+  struct ExampleConsumer {
+    typedef MapsYouEventBase BASE_TYPE;
+    typedef Events DERIVED_TYPE_LIST;
+    enum FixTypedefDefinedButNotUsedWarning { FOO = sizeof(BASE_TYPE), BAR = sizeof(DERIVED_TYPE_LIST) };
+
+    std::ostringstream os;
+    void operator()(const EventAppStart& e) { os << "START " << e.foo << '\n'; }
+    void operator()(const EventAppSuspend& e) { os << "SUSPEND " << e.bar << '\n'; }
+    void operator()(const EventAppResume& e) { os << "RESUME " << e.baz << '\n'; }
+  };
+  const std::string expected = "START foo\nRESUME baz\nSUSPEND bar\nSUSPEND bar\n";
+
+  RemoveFile(CurrentTestTempFileName(), RemoveFileParameters::Silent);
+  {
+    CerealFileAppender appender(CurrentTestTempFileName());
+    appender << Event(EventAppStart()) << Event(EventAppResume());
+    Event event;
+    event.Emplace<EventAppSuspend>();
+    appender << event << event;
+  }
+  {
+    CerealFileParser<Event> f(CurrentTestTempFileName());
+    ExampleConsumer consumer;
+    while (f.NextWithVariantDispatching(consumer))
+      ;
+    EXPECT_EQ(expected, consumer.os.str());
+  }
+  {
+    CerealMappedFileParser<Event> f(CurrentTestTempFileName());
+    ExampleConsumer consumer;
+    Event event;
+    while (f.NextVariant(event)) {
+      static_cast<const Event&>(event).Visit(consumer);
+    }
+    EXPECT_EQ(expected, consumer.os.str());
+  }
+
+  RemoveFile(CurrentTestTempFileName(), RemoveFileParameters::Silent);
+  {
+    GenericCerealFileAppender<CerealFormat::JSON> appender(CurrentTestTempFileName());
+    appender << Event(EventAppStart()) << Event(EventAppResume()) << Event(EventAppSuspend())
+             << Event(EventAppSuspend());
+  }
+  EXPECT_NE(std::string::npos, ReadFileAsString(CurrentTestTempFileName()).find("\"index\": 2"));
+  GenericCerealFileParser<Event, CerealFormat::JSON> f(CurrentTestTempFileName());
+  ExampleConsumer consumer;
+  while (f.NextWithVariantDispatching(consumer))
+    ;
+  EXPECT_EQ(expected, consumer.os.str());
+}
+
+TEST(Cerealize, MappedFileParserParsesInParallel) {
+  RemoveFile(CurrentTestTempFileName(), RemoveFileParameters::Silent);
+
+  const size_t kRecords = 1000;
+  const size_t kThreads = 4;
+  std::string expected;
+  {
+    CerealFileAppender appender(CurrentTestTempFileName());
+    for (size_t i = 0; i < kRecords; ++i) {
+      if (i % 3 == 0) {
+        EventAppStart e;
+        e.uid = std::to_string(i);
+        appender << e;
+      } else if (i % 3 == 1) {
+        EventAppSuspend e;
+        e.uid = std::to_string(i);
+        appender << e;
+      } else {
+        EventAppResume e;
+        e.uid = std::to_string(i);
+        appender << e;
+      }
+    }
+  }
+
+  CerealMappedFileParser<MapsYouEventBase> f(CurrentTestTempFileName());
+  const CerealFileIndex index = f.BuildIndex();
+  ASSERT_EQ(kRecords, index.offsets.size());
+  EXPECT_EQ(0u, index.offsets[0]);
+  // Each of the three types is introduced once, by the first record of its type.
+  ASSERT_EQ(3u, index.names.size());
+  EXPECT_EQ("a", index.names[0].name);
+  EXPECT_EQ(2u, index.names[2].record);
+
+  std::vector<std::vector<std::string>> per_thread(kThreads);
+  f.ParseInParallel(index, kThreads, [&per_thread](size_t thread, const MapsYouEventBase& e) {
+    per_thread[thread].push_back(e.ShortType() + ':' + e.uid);
+  });
+  std::vector<std::string> all;
+  for (const auto& records : per_thread) {
+    EXPECT_EQ(kRecords / kThreads, records.size());
+    all.insert(all.end(), records.begin(), records.end());
+  }
+  ASSERT_EQ(kRecords, all.size());
+  const char* const types[] = {"a", "as", "ar"};
+  for (size_t i = 0; i < kRecords; ++i) {
+    EXPECT_EQ(std::string(types[i % 3]) + ':' + std::to_string(i), all[i]);
+  }
+}
+
+TEST(Cerealize, FlatRecordsShareTheFileWithCerealizedOnes) {
+  RemoveFile(CurrentTestTempFileName(), RemoveFileParameters::Silent);
+
+  EventAppStart a;
+  EventAppSuspend b;
+  CerealFileAppender(CurrentTestTempFileName()) << a << FlatClick(100, 1, 2, "left") << b;
+  CerealFileAppender(CurrentTestTempFileName()) << FlatClick(101, -3, 4, "right");
+
+  const auto f = [](const MapsYouEventBase& e) {
+    return e.ShortType() == "fc" ? FlatClickAsString(e) : e.ShortType();
+  };
+  const std::string expected = "a fc:100,1,2,left as fc:101,-3,4,right ";
+
+  {
+    CerealFileParser<MapsYouEventBase> parser(CurrentTestTempFileName());
+    std::string parsed;
+    while (parser.NextLambda([&parsed, &f](const MapsYouEventBase& e) { parsed += f(e) + ' '; }))
+      ;
+    EXPECT_EQ(expected, parsed);
+  }
+  {
+    CerealMappedFileParser<MapsYouEventBase> parser(CurrentTestTempFileName());
+    std::string parsed;
+    while (parser.NextLambda([&parsed, &f](const MapsYouEventBase& e) { parsed += f(e) + ' '; }))
+      ;
+    EXPECT_EQ(expected, parsed);
+  }
+
+  // The flat record is the four-byte header and the 24 bytes of the fields.
+  const std::string contents = ReadFileAsString(CurrentTestTempFileName());
+  EXPECT_EQ(4u + 24u, FlatCodec<EventFlatClick>::kRecordSize);
+  ASSERT_GE(contents.length(), 28u);
+  const std::string last = contents.substr(contents.length() - 28u);
+  std::uint32_t tag;
+  ASSERT_TRUE(IsFlatRecordHeader(last.data(), tag));
+  EXPECT_EQ(1u, tag);
+
+  // The truncated flat record is an error, as is the flat record of a type not known.
+  WriteStringToFile(CurrentTestTempFileName(), contents.substr(0, contents.length() - 2));
+  {
+    CerealMappedFileParser<MapsYouEventBase> parser(CurrentTestTempFileName());
+    size_t parsed = 0;
+    ASSERT_THROW(while (parser.NextLambda([&parsed](const MapsYouEventBase&) { ++parsed; })),
+                 cereal::Exception);
+    EXPECT_EQ(3u, parsed);
+  }
+  {
+    CerealFileParser<MapsYouEventBase> parser(CurrentTestTempFileName());
+    size_t parsed = 0;
+    while (parser.NextLambda([&parsed](const MapsYouEventBase&) { ++parsed; }))
+      ;
+    EXPECT_EQ(3u, parsed);
+  }
+  std::string unknown = last;
+  unknown[0] = 42;
+  WriteStringToFile(CurrentTestTempFileName(), unknown);
+  CerealMappedFileParser<MapsYouEventBase> parser(CurrentTestTempFileName());
+  ASSERT_THROW(parser.NextLambda([](const MapsYouEventBase&) {}), cereal::Exception);
+}
+
+TEST(Cerealize, MappedFileParserIndexesAndParsesFlatRecordsInParallel) {
+  RemoveFile(CurrentTestTempFileName(), RemoveFileParameters::Silent);
+
+  const size_t kRecords = 1000;
+  const size_t kThreads = 4;
+  {
+    CerealFileAppender appender(CurrentTestTempFileName());
+    for (size_t i = 0; i < kRecords; ++i) {
+      if (i % 4 == 1) {
+        EventAppStart e;
+        e.uid = std::to_string(i);
+        appender << e;
+      } else {
+        appender << FlatClick(i, static_cast<int32_t>(i % 4), 0, "x");
+      }
+    }
+  }
+
+  CerealMappedFileParser<MapsYouEventBase> f(CurrentTestTempFileName());
+  const CerealFileIndex index = f.BuildIndex();
+  ASSERT_EQ(kRecords, index.offsets.size());
+  // The first record is flat and 28 bytes long; the flat records introduce no polymorphic names.
+  EXPECT_EQ(28u, index.offsets[1]);
+  ASSERT_EQ(1u, index.names.size());
+  EXPECT_EQ("a", index.names[0].name);
+  EXPECT_EQ(1u, index.names[0].record);
+
+  std::vector<std::vector<std::string>> per_thread(kThreads);
+  f.ParseInParallel(index, kThreads, [&per_thread](size_t thread, const MapsYouEventBase& e) {
+    per_thread[thread].push_back(e.ShortType() == "fc" ? FlatClickAsString(e) : e.ShortType() + ':' + e.uid);
+  });
+  std::vector<std::string> all;
+  for (const auto& records : per_thread) {
+    all.insert(all.end(), records.begin(), records.end());
+  }
+  ASSERT_EQ(kRecords, all.size());
+  for (size_t i = 0; i < kRecords; ++i) {
+    const int n = static_cast<int>(i);
+    EXPECT_EQ((i % 4 == 1) ? Printf("a:%d", n) : Printf("fc:%d,%d,0,x", n, n % 4), all[i]);
+  }
+}
+
+TEST(Cerealize, EnvelopedRecordsAreSkippedByType) {
+  RemoveFile(CurrentTestTempFileName(), RemoveFileParameters::Silent);
+
+  EventAppStart a;
+  EventAppSuspend b;
+  EventAppResume c;
+  {
+    CerealFileAppender appender(CurrentTestTempFileName());
+    appender.EnvelopeRecords();
+    appender << a << b << FlatClick(100, 1, 2, "left") << c << b;
+    // The record of the type named in a skipped one, written with no envelope, is parsed as usual.
+    appender.EnvelopeRecords(false);
+    appender << b;
+  }
+  {
+    CerealFileAppender appender(CurrentTestTempFileName());
+    appender.EnvelopeRecords();
+    appender << std::unique_ptr<MapsYouEventBase>(new EventAppSuspend()) << a;
+  }
+
+  // The first record is enveloped, with the type id of the name of its type.
+  const std::string contents = ReadFileAsString(CurrentTestTempFileName());
+  std::uint32_t type_id;
+  std::uint32_t length;
+  ASSERT_TRUE(IsEnvelopedRecordHeader(contents.data(), type_id, length));
+  EXPECT_EQ(CerealEnvelopeTypeId("a", 1), type_id);
+  std::uint32_t id;
+  std::string name;
+  ASSERT_TRUE(CerealRecordNamesType(contents.data() + kEnvelopedRecordHeaderSize, length, id, name));
+  EXPECT_EQ("a", name);
+
+  struct StartAndResume {
+    typedef MapsYouEventBase BASE_TYPE;
+    typedef std::tuple<EventAppStart, EventAppResume> DERIVED_TYPE_LIST;
+    enum FixTypedefDefinedButNotUsedWarning { FOO = sizeof(BASE_TYPE), BAR = sizeof(DERIVED_TYPE_LIST) };
+    std::string parsed;
+    void operator()(const MapsYouEventBase& e) { parsed += "other:" + e.ShortType() + ' '; }
+    void operator()(const EventAppStart& e) { parsed += e.ShortType() + ' '; }
+    void operator()(const EventAppResume& e) { parsed += e.ShortType() + ' '; }
+  };
+  const std::string expected = "a ar other:as a ";
+  {
+    CerealFileParser<MapsYouEventBase> parser(CurrentTestTempFileName());
+    StartAndResume processor;
+    while (parser.NextOfTypes(processor))
+      ;
+    EXPECT_EQ(expected, processor.parsed);
+  }
+  {
+    CerealMappedFileParser<MapsYouEventBase> parser(CurrentTestTempFileName());
+    StartAndResume processor;
+    while (parser.NextOfTypes(processor))
+      ;
+    EXPECT_EQ(expected, processor.parsed);
+  }
+
+  // The other ways to parse the file parse all of its records.
+  const std::string all = "a as fc ar as as as a ";
+  {
+    CerealFileParser<MapsYouEventBase> parser(CurrentTestTempFileName());
+    std::string parsed;
+    while (parser.NextLambda([&parsed](const MapsYouEventBase& e) { parsed += e.ShortType() + ' '; }))
+      ;
+    EXPECT_EQ(all, parsed);
+  }
+  CerealMappedFileParser<MapsYouEventBase> parser(CurrentTestTempFileName());
+  const CerealFileIndex index = parser.BuildIndex();
+  ASSERT_EQ(8u, index.offsets.size());
+  ASSERT_EQ(5u, index.names.size());
+  EXPECT_EQ("ar", index.names[2].name);
+  EXPECT_EQ(3u, index.names[2].record);
+  std::vector<std::string> per_thread(3);
+  parser.ParseInParallel(index, 3, [&per_thread](size_t thread, const MapsYouEventBase& e) {
+    per_thread[thread] += e.ShortType() + ' ';
+  });
+  EXPECT_EQ(all, per_thread[0] + per_thread[1] + per_thread[2]);
+}
+
+TEST(Cerealize, ParsesInArena) {
+  RemoveFile(CurrentTestTempFileName(), RemoveFileParameters::Silent);
+
+  {
+    CerealFileAppender appender(CurrentTestTempFileName());
+    for (int i = 0; i < 10; ++i) {
+      ArenaEvent e;
+      e.text = CerealArenaString(100, static_cast<char>('a' + i));
+      e.values.push_back(i);
+      e.values.push_back(i * i);
+      appender << e;
+    }
+  }
+
+  CerealArena arena(4096);
+  std::string parsed;
+  size_t in_arena = 0;
+  size_t max_bytes_used = 0;
+  const auto f = [&](const ArenaEventBase& base) {
+    const ArenaEvent& e = dynamic_cast<const ArenaEvent&>(base);
+    parsed += Printf("%c%d,%d ", e.text[0], e.values[0], e.values[1]);
+    if (arena.Contains(&e) && arena.Contains(e.text.data()) && arena.Contains(e.values.data())) {
+      ++in_arena;
+    }
+    max_bytes_used = std::max(max_bytes_used, arena.BytesUsed());
+  };
+
+  CerealFileParser<ArenaEventBase> f1(CurrentTestTempFileName());
+  EXPECT_EQ(10u, f1.ForEachInArena(arena, f, 4));
+  EXPECT_EQ("a0,0 b1,1 c2,4 d3,9 e4,16 f5,25 g6,36 h7,49 i8,64 j9,81 ", parsed);
+  EXPECT_EQ(10u, in_arena);
+  EXPECT_EQ(0u, arena.BytesUsed());
+  // The arena is reset after each batch of four entries.
+  EXPECT_LT(max_bytes_used, 4096u);
+  EXPECT_TRUE(CerealArena::Current() == nullptr);
+
+  parsed.clear();
+  in_arena = 0;
+  CerealMappedFileParser<ArenaEventBase> f2(CurrentTestTempFileName());
+  EXPECT_EQ(10u, f2.ForEachInArena(arena, f));
+  EXPECT_EQ("a0,0 b1,1 c2,4 d3,9 e4,16 f5,25 g6,36 h7,49 i8,64 j9,81 ", parsed);
+  EXPECT_EQ(10u, in_arena);
+
+  // Outside of the arena, the same types are allocated as usual.
+  ArenaEvent e;
+  e.text = CerealArenaString(100, 'x');
+  EXPECT_FALSE(arena.Contains(e.text.data()));
+}
+
+TEST(Cerealize, ColumnarExportIsScannedByTypeAndField) {
+  const std::string log = CurrentTestTempFileName() + ".log";
+  const std::string columnar = CurrentTestTempFileName() + ".columnar";
+  RemoveFile(log, RemoveFileParameters::Silent);
+
+  const size_t kRecords = 1000;
+  {
+    CerealFileAppender appender(log);
+    for (size_t i = 0; i < kRecords; ++i) {
+      if (i % 3 == 0) {
+        ColumnarView e;
+        e.timestamp = i;
+        e.duration = i * 0.5;
+        e.first = (i == 0);
+        appender << e;
+      } else {
+        ColumnarClick e;
+        e.timestamp = i;
+        e.x = -static_cast<int32_t>(i);
+        e.button = (i % 2) ? "left" : "right";
+        e.path.push_back(1);
+        appender << e;
+      }
+    }
+  }
+  typedef std::tuple<ColumnarClick, ColumnarView> Types;
+  EXPECT_EQ(kRecords, (ConvertCerealFileToColumnar<ColumnarEventBase, Types>(log, columnar, 100)));
+
+  const CerealColumnarFile file(columnar);
+  std::map<std::string, size_t> blocks;
+  std::map<std::string, size_t> records;
+  for (const CerealColumnarBlock& block : file.Blocks()) {
+    ++blocks[block.type];
+    records[block.type] += block.records;
+  }
+  EXPECT_EQ(7u, blocks["click"]);
+  EXPECT_EQ(4u, blocks["view"]);
+  EXPECT_EQ(666u, records["click"]);
+  EXPECT_EQ(334u, records["view"]);
+
+  // The first block of clicks: the records 1, 2, 4, 5, ..., 149.
+  const CerealColumnarBlock& clicks = file.Blocks()[0];
+  ASSERT_EQ("click", clicks.type);
+  ASSERT_EQ(100u, clicks.records);
+  ASSERT_EQ(3u, clicks.columns.size());
+  EXPECT_TRUE(clicks.Column("path") == nullptr);
+  EXPECT_EQ(1u, clicks.Column("timestamp")->Min<uint64_t>());
+  EXPECT_EQ(149u, clicks.Column("timestamp")->Max<uint64_t>());
+  EXPECT_EQ(-149, clicks.Column("x")->Min<int64_t>());
+  const CerealColumn& button = *clicks.Column("button");
+  ASSERT_EQ(2u, button.dictionary.size());
+  EXPECT_EQ("left", button.dictionary[button.Codes()[0]]);
+  EXPECT_EQ(50u, CountEqual(button.Codes(), button.size, button.Code("right")));
+  EXPECT_THROW(button.Values<int64_t>(), CerealColumnarKindMismatchException);
+  EXPECT_EQ(1, file.Blocks()[1].Column("value0")->Max<int64_t>());
+
+  std::map<std::string, size_t> counts = file.CountByTypeInRange<uint64_t>("timestamp", 100, 400);
+  EXPECT_EQ(200u, counts["click"]);
+  EXPECT_EQ(100u, counts["view"]);
+  counts = file.CountByTypeInRange<uint64_t>("timestamp", 2000, 3000);
+  EXPECT_EQ(2u, counts.size());
+  EXPECT_EQ(0u, counts["click"]);
+  EXPECT_EQ(1u, file.CountByTypeInRange<double>("duration", 0, 10).size());
+  EXPECT_THROW(file.CountByTypeInRange<int64_t>("timestamp", 0, 10), CerealColumnarKindMismatchException);
+
+  // The durations of the views with the timestamps in [300, 600): 0.5 * (300 + 303 + ... + 597).
+  const std::map<std::string, double> sums =
+      file.SumByTypeInRange<double, uint64_t>("duration", "timestamp", 300, 600);
+  ASSERT_EQ(1u, sums.size());
+  EXPECT_EQ(0.5 * (300 + 597) * 100 / 2, sums.at("view"));
+
+  WriteStringToFile(columnar, ReadFileAsString(columnar).substr(0, 1000));
+  EXPECT_THROW(CerealColumnarFile file(columnar), CerealColumnarInvalidFileException);
+}
+
+// Counts the records by type, and sums `x` of the clicks.
+struct ColumnarEventsAggregate {
+  size_t clicks = 0;
+  size_t views = 0;
+  size_t others = 0;
+  int64_t x = 0;
+  void operator()(const ColumnarClick& e) {
+    ++clicks;
+    x += e.x;
+  }
+  void operator()(const ColumnarView&) { ++views; }
+  void operator()(const ColumnarEventBase&) { ++others; }
+  void Merge(const ColumnarEventsAggregate& rhs) {
+    clicks += rhs.clicks;
+    views += rhs.views;
+    others += rhs.others;
+    x += rhs.x;
+  }
+};
+
+TEST(Cerealize, LogQueryAggregatesFilesInParallel) {
+  const std::string directory = CurrentTestTempFileName() + ".dir";
+  FileSystem::CreateDirectory(directory);
+  std::vector<std::string> files;
+  for (int i = 0; i < 10; ++i) {
+    files.push_back(FileSystem::JoinPath(directory, bricks::strings::Printf("finalized-%05d.bin", i)));
+  }
+  files.push_back(FileSystem::JoinPath(directory, "current-00010.bin"));
+  size_t timestamp = 0;
+  for (const std::string& file : files) {
+    RemoveFile(file, RemoveFileParameters::Silent);
+    CerealFileAppender appender(file);
+    for (int i = 0; i < 100; ++i, ++timestamp) {
+      if (timestamp % 4 == 0) {
+        ColumnarView e;
+        e.timestamp = timestamp;
+        e.duration = 2.0;
+        appender << e;
+      } else {
+        ColumnarClick e;
+        e.timestamp = timestamp;
+        e.x = 1;
+        e.button = (timestamp % 2) ? "left" : "right";
+        appender << e;
+      }
+    }
+  }
+
+  typedef CerealLogQuery<ColumnarEventBase, std::tuple<ColumnarClick, ColumnarView>> Query;
+  Query query;
+  query.AddDirectory(directory, "finalized-", ".bin");
+  ASSERT_EQ(10u, query.NumberOfFiles());
+
+  const ColumnarEventsAggregate aggregate = query.Run(ColumnarEventsAggregate());
+  EXPECT_EQ(750u, aggregate.clicks);
+  EXPECT_EQ(250u, aggregate.views);
+  EXPECT_EQ(0u, aggregate.others);
+  EXPECT_EQ(750, aggregate.x);
+
+  EXPECT_EQ(500u, query.Count<ColumnarClick>([](const ColumnarClick& e) { return e.button == "left"; }));
+  EXPECT_EQ(100.0,
+            query.MapReduce<ColumnarView>(0.0,
+                                          [](const ColumnarView& e) { return e.timestamp < 200; },
+                                          [](const ColumnarView& e) { return e.duration; },
+                                          [](double& result, double value) { result += value; }));
+
+  EXPECT_EQ(150u, Query().AddFile(files.back()).AddFile(files.front()).Run(ColumnarEventsAggregate()).clicks);
+
+  WriteStringToFile(files.front(), ReadFileAsString(files.front()).substr(0, 100));
+  EXPECT_THROW(query.Run(ColumnarEventsAggregate()), cereal::Exception);
+
+  for (const std::string& file : files) {
+    RemoveFile(file);
+  }
+}
+
+TEST(Cerealize, BlockLogSkipsBlocksOutsideOfTimeRange) {
+  RemoveFile(CurrentTestTempFileName(), RemoveFileParameters::Silent);
+
+  {
+    CerealBlockLogAppender appender(CurrentTestTempFileName(), false, 1000);
+    for (int i = 0; i < 100; ++i) {
+      EventAppStart a;
+      EventAppSuspend b;
+      a.uid = b.uid = Printf("%03d", i);
+      appender.Append(i * 10, a);
+      if (i >= 50) {
+        appender.Append(i * 10 + 5, b);
+      }
+    }
+  }
+
+  CerealBlockLogReader<MapsYouEventBase> reader(CurrentTestTempFileName());
+  EXPECT_FALSE(reader.Recovered());
+  const std::vector<CerealBlockLogBlock>& blocks = reader.Blocks();
+  ASSERT_LT(3u, blocks.size());
+  uint64_t records = 0;
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    records += blocks[i].header.records;
+    EXPECT_LE(blocks[i].header.min_timestamp, blocks[i].header.max_timestamp);
+    if (i) {
+      EXPECT_LT(blocks[i - 1].header.max_timestamp, blocks[i].header.min_timestamp);
+    }
+    // The default values of the fields make the blocks compressible.
+    EXPECT_EQ(kCerealBlockLogCompressed, blocks[i].header.flags);
+    EXPECT_LT(blocks[i].header.stored_size, blocks[i].header.raw_size);
+  }
+  EXPECT_EQ(150u, records);
+  EXPECT_EQ(blocks.front().header.records, blocks.front().header.types.at("a"));
+  EXPECT_EQ(0u, blocks.front().header.types.count("as"));
+  EXPECT_EQ(1u, blocks.back().header.types.count("as"));
+
+  const std::vector<size_t> selected = reader.SelectBlocks(300, 320);
+  EXPECT_LE(1u, selected.size());
+  EXPECT_GT(blocks.size(), selected.size());
+  EXPECT_EQ(reader.SelectBlocks(505).size(), reader.SelectBlocks(0, 1000, "as").size());
+
+  std::string parsed;
+  EXPECT_EQ(4u, reader.ForEach([&parsed](uint64_t timestamp, const MapsYouEventBase& e) {
+    parsed += Printf("%d:%s:%s ", static_cast<int>(timestamp), e.ShortType().c_str(), e.uid.c_str());
+  }, 490, 515));
+  EXPECT_EQ("490:a:049 500:a:050 505:as:050 510:a:051 ", parsed);
+
+  std::vector<size_t> per_thread(4);
+  std::atomic_size_t total(0);
+  reader.ParseInParallel(4, [&per_thread, &total](size_t thread, uint64_t, const MapsYouEventBase&) {
+    ++per_thread[thread];
+    ++total;
+  });
+  EXPECT_EQ(150u, total);
+  EXPECT_EQ(150u, per_thread[0] + per_thread[1] + per_thread[2] + per_thread[3]);
+}
+
+TEST(Cerealize, BlockLogIsAppendedToAndRecoveredWithoutIndex) {
+  RemoveFile(CurrentTestTempFileName(), RemoveFileParameters::Silent);
+
+  EventAppStart a;
+  EventAppResume c;
+  {
+    CerealBlockLogAppender appender(CurrentTestTempFileName());
+    appender.Append(1, a).Append(2, c);
+  }
+  {
+    CerealBlockLogAppender appender(CurrentTestTempFileName());
+    appender.Append(3, a);
+    appender.Flush();
+    appender.Append(4, c);
+    appender.Flush();
+  }
+
+  std::string parsed;
+  const auto f = [&parsed](uint64_t timestamp, const MapsYouEventBase& e) {
+    parsed += Printf("%d:%s ", static_cast<int>(timestamp), e.ShortType().c_str());
+  };
+  {
+    CerealBlockLogReader<MapsYouEventBase> reader(CurrentTestTempFileName());
+    EXPECT_FALSE(reader.Recovered());
+    EXPECT_EQ(3u, reader.Blocks().size());
+    EXPECT_EQ(4u, reader.ForEach(f));
+    EXPECT_EQ("1:a 2:ar 3:a 4:ar ", parsed);
+  }
+
+  // Without the index, and with the last block cut short, the complete blocks are still there.
+  const std::string contents = ReadFileAsString(CurrentTestTempFileName());
+  {
+    CerealBlockLogReader<MapsYouEventBase> reader(CurrentTestTempFileName());
+    WriteStringToFile(CurrentTestTempFileName(), contents.substr(0, reader.Blocks().back().payload_offset + 1));
+  }
+  {
+    CerealBlockLogReader<MapsYouEventBase> reader(CurrentTestTempFileName());
+    EXPECT_TRUE(reader.Recovered());
+    EXPECT_EQ(2u, reader.Blocks().size());
+    parsed.clear();
+    EXPECT_EQ(3u, reader.ForEach(f));
+    EXPECT_EQ("1:a 2:ar 3:a ", parsed);
+  }
+  {
+    CerealBlockLogAppender appender(CurrentTestTempFileName());
+    appender.Append(5, c);
+  }
+  {
+    CerealBlockLogReader<MapsYouEventBase> reader(CurrentTestTempFileName());
+    EXPECT_FALSE(reader.Recovered());
+    parsed.clear();
+    EXPECT_EQ(4u, reader.ForEach(f));
+    EXPECT_EQ("1:a 2:ar 3:a 5:ar ", parsed);
+  }
+
+  WriteStringToFile(CurrentTestTempFileName(), "Not a block log.");
+  ASSERT_THROW((CerealBlockLogReader<MapsYouEventBase>(CurrentTestTempFileName())),
+               CerealBlockLogInvalidFileException);
+  ASSERT_THROW((CerealBlockLogAppender(CurrentTestTempFileName())), CerealBlockLogInvalidFileException);
+}
+
+TEST(Cerealize, JSONLinesSerializesAndParsesLineByLine) {
+  RemoveFile(CurrentTestTempFileName(), RemoveFileParameters::Silent);
+
+  EventAppStart a;
+  EventAppSuspend b;
+  EventAppResume c;
+  a.uid = "multi\nline";
+  c.baz = std::string(1000, 'z');
+  GenericCerealFileAppender<CerealFormat::JSONLines>(CurrentTestTempFileName()) << a << b;
+  // Unlike JSON, JSON lines can be appended to.
+  GenericCerealFileAppender<CerealFormat::JSONLines>(CurrentTestTempFileName()) << c << a;
+
+  const std::string contents = ReadFileAsString(CurrentTestTempFileName());
+  EXPECT_EQ(4, std::count(contents.begin(), contents.end(), '\n'));
+  EXPECT_EQ('{', contents[0]);
+  EXPECT_EQ('\n', contents.back());
+
+  std::string parsed;
+  const auto f = [&parsed](const MapsYouEventBase& e) {
+    parsed += e.ShortType() + ':' + e.uid + ' ';
+  };
+  GenericCerealFileParser<MapsYouEventBase, CerealFormat::JSONLines> parser(CurrentTestTempFileName());
+  EXPECT_TRUE(parser.NextLambda(f));
+  EXPECT_TRUE(parser.NextLambda(f));
+  EXPECT_TRUE(parser.NextLambda([&parsed](const MapsYouEventBase& e) {
+    parsed += Printf("%d ", static_cast<int>(dynamic_cast<const EventAppResume&>(e).baz.length()));
+  }));
+  EXPECT_TRUE(parser.NextLambda(f));
+  EXPECT_FALSE(parser.NextLambda(f));
+  EXPECT_EQ("a:multi\nline as: 1000 a:multi\nline ", parsed);
+
+  std::vector<std::string> per_thread(3);
+  CerealMappedJSONLinesParser<MapsYouEventBase>(CurrentTestTempFileName())
+      .ParseInParallel(3, [&per_thread](size_t thread, const MapsYouEventBase& e) {
+        per_thread[thread] += e.ShortType() + ' ';
+      });
+  EXPECT_EQ("a as ar a ", per_thread[0] + per_thread[1] + per_thread[2]);
+
+  WriteStringToFile(CurrentTestTempFileName(), "{}\n", true);
+  ASSERT_THROW(CerealMappedJSONLinesParser<MapsYouEventBase>(CurrentTestTempFileName())
+                   .ParseInParallel(2, [](size_t, const MapsYouEventBase&) {}),
+               cereal::Exception);
+}
+
+TEST(Cerealize, JSONLinesAreReplayedInSitu) {
+  RemoveFile(CurrentTestTempFileName(), RemoveFileParameters::Silent);
+
+  EventAppStart a;
+  EventAppSuspend b;
+  EventAppResume c;
+  a.uid = "multi\nline \"quoted\"";
+  b.uid_google = "g";
+  c.baz = std::string(1000, 'z');
+  GenericCerealFileAppender<CerealFormat::JSONLines>(CurrentTestTempFileName()) << a << b << c;
+  WriteStringToFile(CurrentTestTempFileName(), "\n", true);
+
+  std::ostringstream os;
+  CerealJSONLinesInSituParser<MapsYouEventBase> parser(CurrentTestTempFileName());
+  EXPECT_TRUE(parser.NextLambda([&os](const MapsYouEventBase& e) { e.AppendTo(os) << '\n'; }));
+  EXPECT_TRUE(parser.NextLambda([&os](const MapsYouEventBase& e) { e.AppendTo(os) << '\n'; }));
+  EXPECT_TRUE(parser.NextLambda([&os](const MapsYouEventBase& e) {
+    os << dynamic_cast<const EventAppResume&>(e).baz.length() << '\n';
+  }));
+  EXPECT_FALSE(parser.NextLambda([](const MapsYouEventBase&) {}));
+  EXPECT_EQ(
+      "Type=EventAppStart, ShortType=\"a\", UID=multi\nline \"quoted\", "
+      "UID_Google=, UID_Apple=, UID_Facebook=, foo=foo\n"
+      "Type=EventAppSuspend, ShortType=\"as\", UID=, UID_Google=g, UID_Apple=, UID_Facebook=, bar=bar\n"
+      "1000\n",
+      os.str());
+
+  // The types not registered, and the records that are not JSON, are errors.
+  WriteStringToFile(CurrentTestTempFileName(),
+                    "{\"value0\": {\"polymorphic_id\": 1, \"polymorphic_name\": \"nope\"}}\n"
+                    "{\"value0\": \n");
+  CerealJSONLinesInSituParser<MapsYouEventBase> bad(CurrentTestTempFileName());
+  ASSERT_THROW(bad.NextLambda([](const MapsYouEventBase&) {}), cereal::Exception);
+  ASSERT_THROW(bad.NextLambda([](const MapsYouEventBase&) {}), cereal::Exception);
+  EXPECT_FALSE(bad.NextLambda([](const MapsYouEventBase&) {}));
+}
+
+TEST(Cerealize, JSONObjectsAreParsedInSitu) {
+  std::string json =
+      "{\"id\": 12345678901, \"flag\": true, \"unknown\": {\"a\": [1, {\"b\": 2}], \"c\": \"d\"},"
+      " \"copied\": \"c\\u00e9\", \"in_place\": \"tab\\there\", \"tags\": [\"x\", \"yy\"],"
+      " \"points\": [{\"x\": 1, \"y\": 0.5}, {\"x\": -2, \"y\": 3, \"z\": null}], \"origin\": null}";
+  std::vector<char> buffer(json.begin(), json.end());
+  buffer.push_back('\0');
+
+  CerealJSONInSituParser parser;
+  InSituRequest request;
+  parser.Parse(buffer.data(), request);
+  EXPECT_EQ(12345678901u, request.id);
+  EXPECT_TRUE(request.flag);
+  EXPECT_EQ("c\xc3\xa9", request.copied);
+  EXPECT_TRUE(request.in_place == "tab\there");
+  EXPECT_TRUE(request.in_place.data > buffer.data() && request.in_place.data < buffer.data() + buffer.size());
+  ASSERT_EQ(2u, request.points.size());
+  EXPECT_EQ(1, request.points[0].x);
+  EXPECT_EQ(0.5, request.points[0].y);
+  EXPECT_EQ(-2, request.points[1].x);
+  EXPECT_EQ(3.0, request.points[1].y);
+  EXPECT_EQ("x,yy", request.tags[0] + ',' + request.tags[1]);
+  EXPECT_TRUE(request.origin == nullptr);
+
+  // The fields of no key keep their values, and the pointers are parsed as cereal writes them.
+  json = "{\"origin\": {\"ptr_wrapper\": {\"valid\": 1, \"data\": {\"x\": 7}}}}";
+  parser.Parse(&json[0], request);
+  EXPECT_EQ(12345678901u, request.id);
+  ASSERT_TRUE(request.origin != nullptr);
+  EXPECT_EQ(7, request.origin->x);
+
+  json = "{\"id\": \"string\"}";
+  ASSERT_THROW(parser.Parse(&json[0], request), cereal::Exception);
+  json = "{\"id\": 1,}";
+  ASSERT_THROW(parser.Parse(&json[0], request), cereal::Exception);
+}
+
+// The record type to write as the JSON of an HTTP response, with the fields of all the types supported.
+enum class WrittenColor : int { Red = 1, Green = 2 };
+struct WrittenResponse {
+  int8_t small = -5;
+  uint64_t big = 18446744073709551615ull;
+  double ratio = 0.25;
+  bool ok = true;
+  WrittenColor color = WrittenColor::Green;
+  std::string text = "quote \" and \\ and \n";
+  std::vector<InSituPoint> points;
+  std::unique_ptr<InSituPoint> origin;
+  int unnamed = 42;
+  template <class A>
+  void serialize(A& ar) {
+    ar(CEREAL_NVP(small), CEREAL_NVP(big), CEREAL_NVP(ratio), CEREAL_NVP(ok), CEREAL_NVP(color));
+    ar(CEREAL_NVP(text), CEREAL_NVP(points), CEREAL_NVP(origin), unnamed);
+  }
+};
+
+struct MockJSONConnection {
+  std::string body;
+  net::HTTPResponseCode code;
+  std::string content_type;
+  void SendHTTPResponse(const char* data, size_t length, net::HTTPResponseCode c, const std::string& type) {
+    body.assign(data, length);
+    code = c;
+    content_type = type;
+  }
+};
+
+struct MockJSONSender {
+  std::vector<std::string> chunks;
+  void Send(const char* data, size_t length) { chunks.emplace_back(data, length); }
+};
+
+TEST(Cerealize, JSONWriterWritesRecordsWithoutArchives) {
+  CerealJSONWriter writer;
+  WrittenResponse response;
+  response.points.resize(2);
+  response.points[0].x = 1;
+  response.points[1].y = -1.5;
+  EXPECT_EQ(
+      "{\"small\":-5,\"big\":18446744073709551615,\"ratio\":0.25,\"ok\":true,\"color\":2,"
+      "\"text\":\"quote \\\" and \\\\ and \\n\",\"points\":[{\"x\":1,\"y\":0},{\"x\":0,\"y\":-1.5}],"
+      "\"origin\":null,\"value0\":42}",
+      writer.Write(response).ToString());
+
+  // The fields are written as by cereal's JSON archives, with no "value0" around the record itself,
+  // and with no whitespace.
+  InSituPoint point;
+  point.x = 3;
+  point.y = 0.1;
+  std::ostringstream os;
+  {
+    cereal::JSONOutputArchive ar(os, cereal::JSONOutputArchive::Options::NoIndent());
+    ar(point);
+  }
+  std::string archived = os.str();
+  archived.erase(std::remove_if(archived.begin(), archived.end(), ::isspace), archived.end());
+  EXPECT_EQ(archived, "{\"value0\":" + writer.Write(point).ToString() + "}");
+
+  // And parsed back in place.
+  response.origin.reset(new InSituPoint());
+  response.origin->x = 7;
+  writer.Write(response);
+  std::vector<char> buffer(writer.data(), writer.data() + writer.size() + 1);
+  InSituRequest parsed;
+  CerealJSONInSituParser().Parse(buffer.data(), parsed);
+  ASSERT_EQ(2u, parsed.points.size());
+  EXPECT_EQ(-1.5, parsed.points[1].y);
+
+  MockJSONConnection connection;
+  writer.SendHTTPResponse(connection, point, net::HTTPResponseCode::Created);
+  EXPECT_EQ("{\"x\":3,\"y\":0.10000000000000001}", connection.body);
+  EXPECT_EQ(net::HTTPResponseCode::Created, connection.code);
+  EXPECT_EQ(std::string(kCerealJSONContentType), connection.content_type);
+
+  MockJSONSender sender;
+  writer.Send(sender, point);
+  point.x = 4;
+  writer.Send(sender, point);
+  ASSERT_EQ(2u, sender.chunks.size());
+  EXPECT_EQ("{\"x\":3,\"y\":0.10000000000000001}\n", sender.chunks[0]);
+  EXPECT_EQ("{\"x\":4,\"y\":0.10000000000000001}\n", sender.chunks[1]);
+}
+
+TEST(Cerealize, RegisteredTypesAreBoundToArchivesOnFirstUse) {
+  // No test writes XML: the lazily registered types are not bound to its archives until asked for.
+  const auto& output = cereal::detail::StaticObject<
+      cereal::detail::OutputBindingMap<cereal::XMLOutputArchive>>::getInstance().map;
+  const std::type_index type(typeid(EventAppStart));
+  EXPECT_EQ(0u, output.count(type));
+  // The types registered with cereal's own macro are bound to all the archives at startup.
+  EXPECT_EQ(1u, output.count(std::type_index(typeid(ArenaEvent))));
+
+  CerealBindRegisteredTypes<cereal::XMLOutputArchive>();
+  EXPECT_EQ(1u, output.count(type));
+  const auto& input = cereal::detail::StaticObject<
+      cereal::detail::InputBindingMap<cereal::XMLInputArchive>>::getInstance().map;
+  EXPECT_EQ(1u, input.count("a"));
+
+  std::ostringstream os;
+  {
+    cereal::XMLOutputArchive ar(os);
+    EventAppStart event;
+    event.uid = "lazy";
+    ar(WithBaseType<MapsYouEventBase>(event));
+  }
+  std::istringstream is(os.str());
+  cereal::XMLInputArchive ar(is);
+  std::unique_ptr<MapsYouEventBase> parsed;
+  ar(parsed);
+  EXPECT_EQ("a", parsed->ShortType());
+  EXPECT_EQ("lazy", parsed->uid);
+}
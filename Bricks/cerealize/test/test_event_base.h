@@ -39,7 +39,7 @@ struct MapsYouEventBase {
 // *** NOTE: Unforunately, events should be defined at global namespace scope. ***
 #define MAPSYOU_EVENT(M_EVENT_CLASS_NAME, M_IMMEDIATE_BASE_CLASS_NAME, M_SHORT_NAME) \
   struct M_EVENT_CLASS_NAME;                                                         \
-  CEREAL_REGISTER_TYPE_WITH_NAME(M_EVENT_CLASS_NAME, M_SHORT_NAME);                  \
+  BRICKS_CEREALIZE_REGISTER_TYPE_WITH_NAME(M_EVENT_CLASS_NAME, M_SHORT_NAME);         \
   struct M_EVENT_CLASS_NAME##Helper : MapsYouEventBase {                             \
     typedef MapsYouEventBase CEREAL_BASE_TYPE;                                       \
     typedef M_IMMEDIATE_BASE_CLASS_NAME SUPER;                                       \
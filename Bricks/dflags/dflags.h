@@ -30,18 +30,44 @@ int main(int argc, char** argv) {
 // In other words ./main foo --flag_bar=bar baz results in argc=2, new argv == { argv[0], "foo", "baz" }.
 //
 // Passing --help will cause ParseDFlags() to print all registered flags with their descriptions and exit(0).
+//
+// Passing --flagfile=path parses the flags from the file, one "--flag=value" per line, in place: the flags
+// that follow it on the command line override the ones from the file. The file is memory-mapped and parsed
+// in one pass; empty lines and lines starting with '#' are skipped, and flagfiles can not be nested.
+//
+// `DEFINE_atomic_int32`, `_uint32`, `_int64`, `_uint64`, `_double` and `_bool` define `std::atomic<>` flags,
+// which can also be set while the program is running, see `SetDFlagsAtRuntime()`, `ReloadDFlagsFromFile()`
+// and `ScopedFlagfileReloaderOnSIGHUP`, for the knobs that are tuned without restarts.
+//
+// The registered flags are kept in an open-addressing hash table, and the numeric ones are parsed
+// with `strto*()`, for the binaries that define hundreds of flags to start up fast.
 
 #ifndef DFLAGS_H
 #define DFLAGS_H
 
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
 #include <cstring>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "../file/file.h"
+
 namespace dflags {
 
 inline void TerminateExecution(const int code, const std::string& message) {
@@ -56,6 +82,97 @@ class FlagRegistererBase {
   virtual std::string TypeAsString() const = 0;
   virtual std::string DefaultValueAsString() const = 0;
   virtual std::string DescriptionAsString() const = 0;
+  // Only the `DEFINE_atomic_*` flags can be set while the program is running.
+  virtual bool IsAtomic() const { return false; }
+  // Returns false if the value can not be parsed. With `dry_run`, only checks that it can be.
+  virtual bool SetValueAtRuntime(const std::string&, bool /*dry_run*/) const { return false; }
+};
+
+// The registered flags, in an open-addressing hash table with linear probing. The hash of each name
+// is computed once, on registration, and compared before the name itself, so that looking a flag up
+// costs one hash of the name being parsed and, most of the time, one string comparison.
+class FlagsTable {
+ public:
+  struct Entry {
+    uint64_t hash = 0;
+    std::string name;
+    FlagRegistererBase* impl = nullptr;
+  };
+
+  // FNV-1a.
+  static uint64_t Hash(const char* name, size_t length) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; ++i) {
+      hash = (hash ^ static_cast<unsigned char>(name[i])) * 1099511628211ull;
+    }
+    return hash;
+  }
+
+  // Registering a flag under the name already taken replaces it.
+  void Insert(const std::string& name, FlagRegistererBase* impl) {
+    if ((size_ + 1) * 2 > entries_.size()) {
+      Grow();
+    }
+    Entry& entry = Slot(Hash(name.data(), name.length()), name.data(), name.length());
+    if (!entry.impl) {
+      entry.hash = Hash(name.data(), name.length());
+      entry.name = name;
+      ++size_;
+    }
+    entry.impl = impl;
+  }
+
+  // Returns nullptr if there is no such flag.
+  const Entry* Find(const char* name, size_t length) const {
+    if (!size_) {
+      return nullptr;
+    }
+    const Entry& entry = const_cast<FlagsTable*>(this)->Slot(Hash(name, length), name, length);
+    return entry.impl ? &entry : nullptr;
+  }
+
+  size_t size() const { return size_; }
+
+  // For `--help`, which lists the flags by name.
+  std::map<std::string, FlagRegistererBase*> SortedByName() const {
+    std::map<std::string, FlagRegistererBase*> flags;
+    for (const Entry& entry : entries_) {
+      if (entry.impl) {
+        flags[entry.name] = entry.impl;
+      }
+    }
+    return flags;
+  }
+
+ private:
+  // The slot holding the flag, or the empty slot to put it into. The table is never more than half full.
+  Entry& Slot(uint64_t hash, const char* name, size_t length) {
+    const size_t mask = entries_.size() - 1;
+    for (size_t i = static_cast<size_t>(hash) & mask;; i = (i + 1) & mask) {
+      Entry& entry = entries_[i];
+      if (!entry.impl ||
+          (entry.hash == hash && entry.name.length() == length &&
+           !std::memcmp(entry.name.data(), name, length))) {
+        return entry;
+      }
+    }
+  }
+
+  void Grow() {
+    std::vector<Entry> entries(std::max(entries_.size() * 2, static_cast<size_t>(16)));
+    entries_.swap(entries);
+    for (Entry& entry : entries) {
+      if (entry.impl) {
+        Entry& slot = Slot(entry.hash, entry.name.data(), entry.name.length());
+        slot.hash = entry.hash;
+        slot.name = std::move(entry.name);
+        slot.impl = entry.impl;
+      }
+    }
+  }
+
+  std::vector<Entry> entries_;
+  size_t size_ = 0;
 };
 
 class FlagsRegistererSingleton {
@@ -63,6 +180,9 @@ class FlagsRegistererSingleton {
   virtual ~FlagsRegistererSingleton() {}
   virtual void RegisterFlag(const std::string& name, FlagRegistererBase* impl) = 0;
   virtual void ParseFlags(int& argc, char**& argv) = 0;
+  virtual bool SetFlagsAtRuntime(const std::vector<std::pair<std::string, std::string>>& flags,
+                                 std::string* error) = 0;
+  virtual bool ReloadFlagsFromFile(const std::string& file_name, std::string* error) = 0;
   virtual void PrintHelpAndExit(const std::map<std::string, FlagRegistererBase*>& flags) const {
     PrintHelp(flags, HelpPrinterOStream());
     std::exit(HelpPrinterReturnCode());
@@ -87,7 +207,7 @@ class FlagsManager {
  public:
   class DefaultRegisterer : public FlagsRegistererSingleton {
    public:
-    void RegisterFlag(const std::string& name, FlagRegistererBase* impl) override { flags_[name] = impl; }
+    void RegisterFlag(const std::string& name, FlagRegistererBase* impl) override { flags_.Insert(name, impl); }
 
     void ParseFlags(int& argc, char**& argv) override {
       if (parse_flags_called_) {
@@ -108,22 +228,21 @@ class FlagsManager {
                                  std::string() + "Parameter: '" + argv[i] + "' has too many dashes in front.");
             }
           }
-          const char* equals_sign = strstr(flag, "=");
-          const std::pair<std::string, const char*> key_value =
-              equals_sign ? std::make_pair(std::string(flag, equals_sign), equals_sign + 1)
-                          : (++i, std::make_pair(flag, argv[i]));
-          if (key_value.first == "help") {
+          const char* equals_sign = strchr(flag, '=');
+          const size_t key_length = equals_sign ? static_cast<size_t>(equals_sign - flag) : strlen(flag);
+          const char* value = equals_sign ? equals_sign + 1 : argv[++i];
+          if (key_length == 4 && !strncmp(flag, "help", 4)) {
             UserRequestedHelp();
           } else {
             if (i == argc) {
-              TerminateExecution(
-                  -1, std::string() + "Flag: '" + key_value.first + "' is not provided with the value.");
+              TerminateExecution(-1,
+                                 std::string() + "Flag: '" + std::string(flag, key_length) +
+                                     "' is not provided with the value.");
             }
-            const auto cit = flags_.find(key_value.first);
-            if (cit == flags_.end()) {
-              TerminateExecution(-1, std::string() + "Undefined flag: '" + key_value.first + "'.");
+            if (key_length == 8 && !strncmp(flag, "flagfile", 8)) {
+              ParseFlagsFromFile(value);
             } else {
-              cit->second->ParseValue(cit->first, key_value.second);
+              ParseFlag(flag, key_length, value, strlen(value));
             }
           }
         } else {
@@ -135,12 +254,149 @@ class FlagsManager {
       argv = &argv_[0];
     }
 
+    // Parses the flags from the file, one "--flag=value" or "-flag=value" per line. Can also be called
+    // before, or instead of, `ParseFlags()`, to load the flags from a config file.
+    void ParseFlagsFromFile(const std::string& file_name) {
+      try {
+        const bricks::MemoryMappedFile file(file_name);
+        ParseFlagsFromBuffer(file.data(), file.size());
+      } catch (const bricks::FileException&) {
+        TerminateExecution(-1, std::string() + "Can not read flagfile '" + file_name + "'.");
+      }
+    }
+
+    // Sets the `DEFINE_atomic_*` flags while the program is running: from an admin endpoint, or from
+    // the flagfile reloaded on SIGHUP. Either all the flags are set, or, if any of them is undefined,
+    // is not atomic or can not be parsed, none is, and false is returned with the reason in `error`.
+    // Overlapping calls are serialized; the readers of the flags never wait.
+    bool SetFlagsAtRuntime(const std::vector<std::pair<std::string, std::string>>& flags,
+                           std::string* error) override {
+      std::lock_guard<std::mutex> lock(set_at_runtime_mutex_);
+      std::vector<std::pair<const FlagsTable::Entry*, const std::string*>> parsed;
+      std::string reason;
+      for (const auto& flag : flags) {
+        const FlagsTable::Entry* entry = flags_.Find(flag.first.data(), flag.first.length());
+        if (!entry) {
+          reason = "Undefined flag: '" + flag.first + "'.";
+        } else if (!entry->impl->IsAtomic()) {
+          reason = "Flag: '" + flag.first + "' can not be set at runtime.";
+        } else if (!entry->impl->SetValueAtRuntime(flag.second, true)) {
+          reason = "Can not parse '" + flag.second + "' for flag '" + flag.first + "'.";
+        } else {
+          parsed.emplace_back(entry, &flag.second);
+          continue;
+        }
+        if (error) {
+          *error = reason;
+        }
+        return false;
+      }
+      for (const auto& flag : parsed) {
+        flag.first->impl->SetValueAtRuntime(*flag.second, false);
+      }
+      return true;
+    }
+
+    // Same as `SetFlagsAtRuntime()`, for the flags of the flagfile.
+    bool ReloadFlagsFromFile(const std::string& file_name, std::string* error) override {
+      std::vector<std::pair<std::string, std::string>> flags;
+      std::string reason;
+      try {
+        const bricks::MemoryMappedFile file(file_name);
+        if (!ForEachFlagInFlagfile(
+                file.data(),
+                file.size(),
+                [&flags](const char* key, size_t key_length, const char* value, size_t value_length) {
+                  flags.emplace_back(std::string(key, key_length), std::string(value, value_length));
+                },
+                reason)) {
+          if (error) {
+            *error = reason;
+          }
+          return false;
+        }
+      } catch (const bricks::FileException&) {
+        if (error) {
+          *error = "Can not read flagfile '" + file_name + "'.";
+        }
+        return false;
+      }
+      return SetFlagsAtRuntime(flags, error);
+    }
+
    private:
     void UserRequestedHelp() {
-      Singleton().PrintHelpAndExit(flags_);
+      Singleton().PrintHelpAndExit(flags_.SortedByName());
     }  // LCOV_EXCL_LINE -- exclude this line from unit test line coverage report.
 
-    std::map<std::string, FlagRegistererBase*> flags_;
+    void ParseFlag(const char* key, size_t key_length, const char* value, size_t value_length) {
+      const FlagsTable::Entry* entry = flags_.Find(key, key_length);
+      if (!entry) {
+        TerminateExecution(-1, std::string() + "Undefined flag: '" + std::string(key, key_length) + "'.");
+      } else {
+        entry->impl->ParseValue(entry->name, std::string(value, value_length));
+      }
+    }
+
+    void ParseFlagsFromBuffer(const char* data, size_t size) {
+      std::string error;
+      if (!ForEachFlagInFlagfile(
+              data,
+              size,
+              [this](const char* key, size_t key_length, const char* value, size_t value_length) {
+                ParseFlag(key, key_length, value, value_length);
+              },
+              error)) {
+        TerminateExecution(-1, error);
+      }
+    }
+
+    // Calls `f(key, key_length, value, value_length)` for each flag of the flagfile, in one pass.
+    // Returns false, with the reason in `error`, on the first malformed line.
+    template <typename F>
+    static bool ForEachFlagInFlagfile(const char* data, size_t size, F&& f, std::string& error) {
+      const char* const end = data + size;
+      while (data != end) {
+        const char* line_end = static_cast<const char*>(memchr(data, '\n', end - data));
+        if (!line_end) {
+          line_end = end;
+        }
+        const char* begin = data;
+        const char* stop = line_end;
+        data = (line_end == end) ? end : line_end + 1;
+        if (stop != begin && stop[-1] == '\r') {
+          --stop;
+        }
+        while (begin != stop && std::isspace(static_cast<unsigned char>(*begin))) {
+          ++begin;
+        }
+        if (begin == stop || *begin == '#') {
+          continue;
+        }
+        const char* flag = begin;
+        while (flag != stop && *flag == '-') {
+          ++flag;
+        }
+        if (flag - begin > 2) {
+          error = "Flagfile line: '" + std::string(begin, stop) + "' has too many dashes in front.";
+          return false;
+        }
+        if (flag == begin) {
+          error = "Flagfile line: '" + std::string(begin, stop) + "' is not a flag.";
+          return false;
+        }
+        const char* equals_sign = static_cast<const char*>(memchr(flag, '=', stop - flag));
+        if (!equals_sign) {
+          error = "Flag: '" + std::string(flag, stop) + "' is not provided with the value.";
+          return false;
+        }
+        f(flag, equals_sign - flag, equals_sign + 1, stop - (equals_sign + 1));
+      }
+      return true;
+    }
+
+    FlagsTable flags_;
+    std::mutex set_at_runtime_mutex_;
     bool parse_flags_called_ = false;
     std::vector<char*> argv_;
   };
@@ -177,12 +433,88 @@ class FlagsManager {
   static void ParseFlags(int& argc, char**& argv) { Singleton().ParseFlags(argc, argv); }
 };
 
+// Numeric flags are parsed with `strto*()` rather than with `std::istringstream`, which is many times slower
+// and which reads `int8_t` and `uint8_t` as characters. The whole value should be a number in the range
+// of the type of the flag.
+template <typename T,
+          bool IS_INTEGRAL = std::is_integral<T>::value,
+          bool IS_SIGNED = std::is_signed<T>::value,
+          bool IS_FLOATING_POINT = std::is_floating_point<T>::value>
+struct FlagValueParser {
+  static bool Parse(const std::string& from, T& to) {
+    std::istringstream is(from);
+    // Workaronud for a bug in `clang++ -std=c++11` on Mac,
+    // clang++ --version `LLVM version 6.0 (clang-600.0.56)`.
+    // See: http://www.quora.com/Does-Macs-clang++-have-a-bug-with-return-type-of-templated-functions
+    return static_cast<bool>(is >> to);
+  }
+};
+
+// `strto*()` skip the leading whitespace, which `std::istringstream` would not allow for an empty value either.
+inline bool IsNumberToParse(const std::string& from) {
+  return !from.empty() && !std::isspace(static_cast<unsigned char>(from[0]));
+}
+
+template <typename T>
+struct FlagValueParser<T, true, true, false> {
+  static bool Parse(const std::string& from, T& to) {
+    if (!IsNumberToParse(from)) {
+      return false;
+    }
+    char* end;
+    errno = 0;
+    const long long value = std::strtoll(from.c_str(), &end, 10);
+    if (errno || *end || value < std::numeric_limits<T>::min() || value > std::numeric_limits<T>::max()) {
+      return false;
+    }
+    to = static_cast<T>(value);
+    return true;
+  }
+};
+
+template <typename T>
+struct FlagValueParser<T, true, false, false> {
+  static bool Parse(const std::string& from, T& to) {
+    // `strtoull()` would negate a negative value.
+    if (!IsNumberToParse(from) || from[0] == '-') {
+      return false;
+    }
+    char* end;
+    errno = 0;
+    const unsigned long long value = std::strtoull(from.c_str(), &end, 10);
+    if (errno || *end || value > std::numeric_limits<T>::max()) {
+      return false;
+    }
+    to = static_cast<T>(value);
+    return true;
+  }
+};
+
+inline void StrToFloatingPoint(const char* from, char** end, float& to) { to = std::strtof(from, end); }
+inline void StrToFloatingPoint(const char* from, char** end, double& to) { to = std::strtod(from, end); }
+inline void StrToFloatingPoint(const char* from, char** end, long double& to) { to = std::strtold(from, end); }
+
+template <typename T>
+struct FlagValueParser<T, false, true, true> {
+  static bool Parse(const std::string& from, T& to) {
+    if (!IsNumberToParse(from)) {
+      return false;
+    }
+    char* end;
+    errno = 0;
+    T value;
+    StrToFloatingPoint(from.c_str(), &end, value);
+    if (errno || *end) {
+      return false;
+    }
+    to = value;
+    return true;
+  }
+};
+
 template <typename T>
 bool FromStringSupportingStringAndBool(const std::string& from, T& to) {
-  std::istringstream is(from);
-  // Workaronud for a bug in `clang++ -std=c++11` on Mac, clang++ --version `LLVM version 6.0 (clang-600.0.56)`.
-  // See: http://www.quora.com/Does-Macs-clang++-have-a-bug-with-return-type-of-templated-functions
-  return static_cast<bool>(is >> to);
+  return FlagValueParser<T>::Parse(from, to);
 }
 
 template <>
@@ -253,6 +585,58 @@ class FlagRegisterer : public FlagRegistererBase {
   const std::string description_;
 };
 
+// The `DEFINE_atomic_*` flags are `std::atomic<>`-s, lock-free for all the supported types, for the hot paths
+// to read them, with `FLAGS_foo.load(std::memory_order_relaxed)` or just `FLAGS_foo`, while they are being set
+// at runtime by `SetDFlagsAtRuntime()` or `ReloadDFlagsFromFile()`.
+template <typename FLAG_TYPE>
+class AtomicFlagRegisterer : public FlagRegistererBase {
+  static_assert(std::is_arithmetic<FLAG_TYPE>::value, "Only numeric and boolean flags can be atomic.");
+
+ public:
+  AtomicFlagRegisterer(std::atomic<FLAG_TYPE>& ref,
+                       const std::string& name,
+                       const std::string& type,
+                       const FLAG_TYPE default_value,
+                       const std::string& description)
+      : ref_(ref), name_(name), type_(type), default_value_(default_value), description_(description) {
+    FlagsManager::RegisterFlag(name, this);
+  }
+
+  virtual void ParseValue(const std::string& name, const std::string& value) const override {
+    if (!SetValueAtRuntime(value, false)) {
+      TerminateExecution(-1, std::string("Can not parse '") + value + "' for flag '" + name + "'.");
+    }
+  }
+
+  virtual bool IsAtomic() const override { return true; }
+
+  virtual bool SetValueAtRuntime(const std::string& value, bool dry_run) const override {
+    FLAG_TYPE parsed;
+    if (!FromStringSupportingStringAndBool(value, parsed)) {
+      return false;
+    }
+    if (!dry_run) {
+      ref_.store(parsed, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  virtual std::string TypeAsString() const override { return type_; }
+
+  virtual std::string DefaultValueAsString() const override {
+    return ToStringSupportingStringAndBool(default_value_);
+  }
+
+  virtual std::string DescriptionAsString() const override { return description_; }
+
+ private:
+  std::atomic<FLAG_TYPE>& ref_;
+  const std::string name_;
+  const std::string type_;
+  const FLAG_TYPE default_value_;
+  const std::string description_;
+};
+
 #define DEFINE_flag(type, name, default_value, description) \
   type FLAGS_##name = default_value;                        \
   ::dflags::FlagRegisterer<type> REGISTERER_##name(         \
@@ -272,10 +656,118 @@ class FlagRegisterer : public FlagRegistererBase {
   DEFINE_flag(std::string, name, default_value, description)
 #define DEFINE_bool(name, default_value, description) DEFINE_flag(bool, name, default_value, description)
 
+#define DEFINE_atomic_flag(type, name, default_value, description) \
+  std::atomic<type> FLAGS_##name(default_value);                   \
+  ::dflags::AtomicFlagRegisterer<type> REGISTERER_##name(          \
+      FLAGS_##name, #name, "atomic " #type, default_value, description)
+
+#define DEFINE_atomic_int32(name, default_value, description) \
+  DEFINE_atomic_flag(int32_t, name, default_value, description)
+#define DEFINE_atomic_uint32(name, default_value, description) \
+  DEFINE_atomic_flag(uint32_t, name, default_value, description)
+#define DEFINE_atomic_int64(name, default_value, description) \
+  DEFINE_atomic_flag(int64_t, name, default_value, description)
+#define DEFINE_atomic_uint64(name, default_value, description) \
+  DEFINE_atomic_flag(uint64_t, name, default_value, description)
+#define DEFINE_atomic_double(name, default_value, description) \
+  DEFINE_atomic_flag(double, name, default_value, description)
+#define DEFINE_atomic_bool(name, default_value, description) \
+  DEFINE_atomic_flag(bool, name, default_value, description)
+
+// Reloads the `DEFINE_atomic_*` flags from the flagfile each time the process receives SIGHUP, on a thread
+// of its own: the signal handler only writes a byte into a pipe. `callback(ok, error)`, if set, is called
+// on that thread after each reload. At most one instance may exist at a time.
+class ScopedFlagfileReloaderOnSIGHUP final {
+ public:
+  typedef std::function<void(bool, const std::string&)> Callback;
+
+  explicit ScopedFlagfileReloaderOnSIGHUP(const std::string& file_name, Callback callback = Callback())
+      : file_name_(file_name), callback_(callback) {
+    int fds[2];
+    if (PipeWriteFd() >= 0 || ::pipe(fds)) {
+      TerminateExecution(-1, "Can not set up the flagfile reloader.");
+    }
+    read_fd_ = fds[0];
+    ::fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    ::fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    // The signal handler must never block, the reloads requested while the pipe is full are coalesced.
+    ::fcntl(fds[1], F_SETFL, ::fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    PipeWriteFd() = fds[1];
+    thread_ = std::thread(&ScopedFlagfileReloaderOnSIGHUP::Thread, this);
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = &ScopedFlagfileReloaderOnSIGHUP::SignalHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    ::sigaction(SIGHUP, &action, &previous_action_);
+  }
+
+  ~ScopedFlagfileReloaderOnSIGHUP() {
+    ::sigaction(SIGHUP, &previous_action_, nullptr);
+    const char c = kStop;
+    while (::write(PipeWriteFd(), &c, 1) != 1 && errno == EINTR) {
+    }
+    thread_.join();
+    ::close(PipeWriteFd());
+    ::close(read_fd_);
+    PipeWriteFd() = -1;
+  }
+
+ private:
+  enum : char { kReload = 'R', kStop = 'S' };
+
+  static int& PipeWriteFd() {
+    static int fd = -1;
+    return fd;
+  }
+
+  static void SignalHandler(int) {
+    const int saved_errno = errno;
+    const char c = kReload;
+    if (::write(PipeWriteFd(), &c, 1)) {
+    }
+    errno = saved_errno;
+  }
+
+  void Thread() {
+    char c;
+    while (true) {
+      const ssize_t result = ::read(read_fd_, &c, 1);
+      if (result == 1 && c == kReload) {
+        std::string error;
+        const bool ok = FlagsManager::Singleton().ReloadFlagsFromFile(file_name_, &error);
+        if (callback_) {
+          callback_(ok, error);
+        }
+      } else if (!(result < 0 && errno == EINTR)) {
+        return;
+      }
+    }
+  }
+
+  const std::string file_name_;
+  const Callback callback_;
+  int read_fd_ = -1;
+  std::thread thread_;
+  struct sigaction previous_action_;
+
+  ScopedFlagfileReloaderOnSIGHUP(const ScopedFlagfileReloaderOnSIGHUP&) = delete;
+  void operator=(const ScopedFlagfileReloaderOnSIGHUP&) = delete;
+};
+
 }  // namespace dflags
 
 inline void ParseDFlags(int* argc, char*** argv) { ::dflags::FlagsManager::ParseFlags(*argc, *argv); }
 
+inline bool SetDFlagsAtRuntime(const std::vector<std::pair<std::string, std::string>>& flags,
+                               std::string* error = nullptr) {
+  return ::dflags::FlagsManager::Singleton().SetFlagsAtRuntime(flags, error);
+}
+
+inline bool ReloadDFlagsFromFile(const std::string& file_name, std::string* error = nullptr) {
+  return ::dflags::FlagsManager::Singleton().ReloadFlagsFromFile(file_name, error);
+}
+
 namespace fake_google {
 struct UnambiguousGoogleFriendlyIntPointerWrapper {
   int* p;
@@ -3,8 +3,15 @@
 #include "../3party/gtest/gtest.h"
 #include "../3party/gtest/gtest-main.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
 #include <string>
 #include <sstream>
+#include <vector>
+
+#include <signal.h>
 
 TEST(DFlags, DefinesAFlag) {
   ::dflags::FlagsManager::DefaultRegisterer local_registerer;
@@ -285,3 +292,199 @@ TEST(DFlags, UnparsableValueDeathTest) {
     EXPECT_DEATH(ParseDFlags(&argc, &argv), "Can not parse '' for flag 'flag_int16'\\.");
   }
 }
+
+TEST(DFlags, ParsesNumbersStrictly) {
+  ::dflags::FlagsManager::DefaultRegisterer local_registerer;
+  auto local_registerer_scope = ::dflags::FlagsManager::ScopedSingletonInjector(local_registerer);
+  DEFINE_int8(flag_int8, 0, "");
+  DEFINE_uint8(flag_uint8, 0, "");
+  DEFINE_int64(flag_int64, 0, "");
+  DEFINE_uint64(flag_uint64, 0, "");
+  DEFINE_float(flag_float, 0, "");
+  DEFINE_double(flag_double, 0, "");
+  int argc = 7;
+  char p1[] = "./ParsesNumbersStrictly";
+  char p2[] = "--flag_int8=-100";
+  char p3[] = "--flag_uint8=200";
+  char p4[] = "--flag_int64=-9223372036854775808";
+  char p5[] = "--flag_uint64=18446744073709551615";
+  char p6[] = "--flag_float=0.5";
+  char p7[] = "--flag_double=-1.25e10";
+  char* pp[] = {p1, p2, p3, p4, p5, p6, p7};
+  char** argv = pp;
+  ParseDFlags(&argc, &argv);
+  EXPECT_EQ(-100, FLAGS_flag_int8);
+  EXPECT_EQ(200, FLAGS_flag_uint8);
+  EXPECT_EQ(std::numeric_limits<int64_t>::min(), FLAGS_flag_int64);
+  EXPECT_EQ(std::numeric_limits<uint64_t>::max(), FLAGS_flag_uint64);
+  EXPECT_EQ(0.5f, FLAGS_flag_float);
+  EXPECT_EQ(-1.25e10, FLAGS_flag_double);
+
+  int8_t i8 = 0;
+  EXPECT_FALSE(::dflags::FromStringSupportingStringAndBool("128", i8));
+  EXPECT_FALSE(::dflags::FromStringSupportingStringAndBool("12abc", i8));
+  EXPECT_FALSE(::dflags::FromStringSupportingStringAndBool(" 1", i8));
+  uint64_t u64 = 0;
+  EXPECT_FALSE(::dflags::FromStringSupportingStringAndBool("-1", u64));
+  EXPECT_FALSE(::dflags::FromStringSupportingStringAndBool("18446744073709551616", u64));
+  double d = 0;
+  EXPECT_FALSE(::dflags::FromStringSupportingStringAndBool("1e999", d));
+  EXPECT_FALSE(::dflags::FromStringSupportingStringAndBool("1.5x", d));
+  EXPECT_EQ(0, i8);
+  EXPECT_EQ(0u, u64);
+  EXPECT_EQ(0, d);
+}
+
+TEST(DFlags, RegistersManyFlags) {
+  struct MockFlag : ::dflags::FlagRegistererBase {
+    mutable std::string value;
+    void ParseValue(const std::string&, const std::string& v) const override { value = v; }
+    std::string TypeAsString() const override { return "mock"; }
+    std::string DefaultValueAsString() const override { return ""; }
+    std::string DescriptionAsString() const override { return ""; }
+  };
+  ::dflags::FlagsManager::DefaultRegisterer local_registerer;
+  auto local_registerer_scope = ::dflags::FlagsManager::ScopedSingletonInjector(local_registerer);
+  std::vector<MockFlag> flags(1000);
+  std::vector<std::string> args;
+  for (size_t i = 0; i < flags.size(); ++i) {
+    ::dflags::FlagsManager::RegisterFlag("flag" + std::to_string(i), &flags[i]);
+    args.push_back("--flag" + std::to_string(i) + "=" + std::to_string(i * i));
+  }
+  std::vector<char*> argv_storage;
+  char p1[] = "./RegistersManyFlags";
+  argv_storage.push_back(p1);
+  for (std::string& arg : args) {
+    argv_storage.push_back(&arg[0]);
+  }
+  int argc = argv_storage.size();
+  char** argv = &argv_storage[0];
+  ParseDFlags(&argc, &argv);
+  ASSERT_EQ(1, argc);
+  for (size_t i = 0; i < flags.size(); ++i) {
+    EXPECT_EQ(std::to_string(i * i), flags[i].value);
+  }
+}
+
+TEST(DFlags, ParsesFlagfile) {
+  ::dflags::FlagsManager::DefaultRegisterer local_registerer;
+  auto local_registerer_scope = ::dflags::FlagsManager::ScopedSingletonInjector(local_registerer);
+  DEFINE_string(flag_string, "", "");
+  DEFINE_int32(flag_int32, 0, "");
+  DEFINE_bool(flag_bool, false, "");
+  DEFINE_double(flag_double, 0, "");
+  const std::string file_name = ".flagfile";
+  const bricks::ScopedRemoveFile remove_flagfile(file_name);
+  bricks::WriteStringToFile(file_name,
+                            "# Comment.\n"
+                            "\n"
+                            "--flag_string=foo bar \r\n"
+                            "  -flag_int32=42\n"
+                            "--flag_bool=true\n"
+                            "--flag_double=0.5");
+  int argc = 4;
+  char p1[] = "./ParsesFlagfile";
+  char p2[] = "--flagfile";
+  char p3[] = ".flagfile";
+  char p4[] = "--flag_double=1.5";
+  char* pp[] = {p1, p2, p3, p4};
+  char** argv = pp;
+  ParseDFlags(&argc, &argv);
+  ASSERT_EQ(1, argc);
+  EXPECT_EQ("foo bar ", FLAGS_flag_string);
+  EXPECT_EQ(42, FLAGS_flag_int32);
+  EXPECT_TRUE(FLAGS_flag_bool);
+  EXPECT_EQ(1.5, FLAGS_flag_double);
+}
+
+TEST(DFlags, FlagfileDeathTest) {
+  ::dflags::FlagsManager::DefaultRegisterer local_registerer;
+  auto local_registerer_scope = ::dflags::FlagsManager::ScopedSingletonInjector(local_registerer);
+  DEFINE_int32(flag_int32, 0, "");
+  const std::string file_name = ".flagfile";
+  const bricks::ScopedRemoveFile remove_flagfile(file_name);
+  EXPECT_DEATH(local_registerer.ParseFlagsFromFile(file_name), "Can not read flagfile '\\.flagfile'\\.");
+  bricks::WriteStringToFile(file_name, "--flag_int32=1\n--undefined_flag=2\n");
+  EXPECT_DEATH(local_registerer.ParseFlagsFromFile(file_name), "Undefined flag: 'undefined_flag'\\.");
+  bricks::WriteStringToFile(file_name, "flag_int32=1\n");
+  EXPECT_DEATH(local_registerer.ParseFlagsFromFile(file_name),
+               "Flagfile line: 'flag_int32=1' is not a flag\\.");
+  bricks::WriteStringToFile(file_name, "--flag_int32\n");
+  EXPECT_DEATH(local_registerer.ParseFlagsFromFile(file_name),
+               "Flag: 'flag_int32' is not provided with the value\\.");
+  bricks::WriteStringToFile(file_name, "--flag_int32=x\n");
+  EXPECT_DEATH(local_registerer.ParseFlagsFromFile(file_name), "Can not parse 'x' for flag 'flag_int32'\\.");
+}
+
+TEST(DFlags, SetsAtomicFlagsAtRuntime) {
+  ::dflags::FlagsManager::DefaultRegisterer local_registerer;
+  auto local_registerer_scope = ::dflags::FlagsManager::ScopedSingletonInjector(local_registerer);
+  DEFINE_atomic_int32(flag_int32, 1, "");
+  DEFINE_atomic_uint64(flag_uint64, 2, "");
+  DEFINE_atomic_double(flag_double, 0.5, "");
+  DEFINE_atomic_bool(flag_bool, false, "");
+  DEFINE_int32(flag_plain, 0, "");
+  static_assert(std::is_same<decltype(FLAGS_flag_int32), std::atomic<int32_t>>::value, "");
+  EXPECT_TRUE(FLAGS_flag_int32.is_lock_free());
+  EXPECT_TRUE(FLAGS_flag_uint64.is_lock_free());
+  EXPECT_TRUE(FLAGS_flag_double.is_lock_free());
+  int argc = 2;
+  char p1[] = "./SetsAtomicFlagsAtRuntime";
+  char p2[] = "--flag_int32=10";
+  char* pp[] = {p1, p2};
+  char** argv = pp;
+  ParseDFlags(&argc, &argv);
+  EXPECT_EQ(10, FLAGS_flag_int32);
+
+  std::string error;
+  EXPECT_TRUE(SetDFlagsAtRuntime({{"flag_int32", "-3"}, {"flag_bool", "true"}}, &error));
+  EXPECT_EQ(-3, FLAGS_flag_int32.load(std::memory_order_relaxed));
+  EXPECT_TRUE(FLAGS_flag_bool);
+
+  // All or nothing.
+  EXPECT_FALSE(SetDFlagsAtRuntime({{"flag_int32", "4"}, {"flag_plain", "1"}}, &error));
+  EXPECT_EQ("Flag: 'flag_plain' can not be set at runtime.", error);
+  EXPECT_FALSE(SetDFlagsAtRuntime({{"flag_int32", "4"}, {"flag_uint64", "-1"}}, &error));
+  EXPECT_EQ("Can not parse '-1' for flag 'flag_uint64'.", error);
+  EXPECT_FALSE(SetDFlagsAtRuntime({{"flag_undefined", "4"}}, &error));
+  EXPECT_EQ("Undefined flag: 'flag_undefined'.", error);
+  EXPECT_EQ(-3, FLAGS_flag_int32);
+  EXPECT_EQ(0, FLAGS_flag_plain);
+
+  const std::string file_name = ".flagfile";
+  const bricks::ScopedRemoveFile remove_flagfile(file_name);
+  EXPECT_FALSE(ReloadDFlagsFromFile(file_name, &error));
+  EXPECT_EQ("Can not read flagfile '.flagfile'.", error);
+  bricks::WriteStringToFile(file_name, "--flag_uint64=100\n--flag_double=2.5\n");
+  EXPECT_TRUE(ReloadDFlagsFromFile(file_name, &error));
+  EXPECT_EQ(100u, FLAGS_flag_uint64);
+  EXPECT_EQ(2.5, FLAGS_flag_double);
+  bricks::WriteStringToFile(file_name, "--flag_uint64=200\nflag_double=3.5\n");
+  EXPECT_FALSE(ReloadDFlagsFromFile(file_name, &error));
+  EXPECT_EQ("Flagfile line: 'flag_double=3.5' is not a flag.", error);
+  EXPECT_EQ(100u, FLAGS_flag_uint64);
+}
+
+TEST(DFlags, ReloadsFlagfileOnSIGHUP) {
+  ::dflags::FlagsManager::DefaultRegisterer local_registerer;
+  auto local_registerer_scope = ::dflags::FlagsManager::ScopedSingletonInjector(local_registerer);
+  DEFINE_atomic_int64(flag_int64, 0, "");
+  const std::string file_name = ".flagfile";
+  const bricks::ScopedRemoveFile remove_flagfile(file_name);
+  bricks::WriteStringToFile(file_name, "--flag_int64=42\n");
+  std::mutex mutex;
+  std::condition_variable condition;
+  int reloads = 0;
+  {
+    ::dflags::ScopedFlagfileReloaderOnSIGHUP reloader(file_name, [&](bool ok, const std::string& error) {
+      EXPECT_TRUE(ok) << error;
+      std::lock_guard<std::mutex> lock(mutex);
+      ++reloads;
+      condition.notify_all();
+    });
+    ::raise(SIGHUP);
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [&reloads]() { return reloads == 1; });
+  }
+  EXPECT_EQ(42, FLAGS_flag_int64);
+}
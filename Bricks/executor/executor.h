@@ -0,0 +1,341 @@
+// A work-stealing executor: runs the submitted tasks on a pool of worker threads, one per core by default.
+//
+// Each worker has its own deques of tasks, one per priority. The tasks submitted from a worker go to its own
+// deques, and it takes them back last in, first out, for locality; the tasks submitted from other threads are
+// spread over the workers round-robin. Idle workers steal from the other end of the deques of the others,
+// first in, first out, and park once there is nothing to steal. The higher priority tasks are taken first,
+// whichever deque they are in. Tasks of the same priority are not ordered across workers.
+//
+// `ParallelFor()` runs a loop body for a range of indexes on the workers, with the calling thread taking part,
+// thus it is safe to call from within a task, and makes progress even when all the workers are busy.
+//
+// A task that is about to block, on I/O or on a lock held for long, should say so with a `ScopedBlocking`
+// in its scope. While it is in effect, the pool is compensated with an extra worker thread, up to the limit,
+// for the number of the workers running tasks to stay at the target. Extra workers retire, waiting to be
+// needed again, once the blocked ones are back. By default, there can be as many of them as the workers.
+//
+// `Executor::Shared()` is the executor for the code that does not own one, with a worker per core.
+// The destructor runs the tasks submitted so far, and joins the threads.
+
+#ifndef BRICKS_EXECUTOR_EXECUTOR_H
+#define BRICKS_EXECUTOR_EXECUTOR_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace bricks {
+
+class Executor final {
+  struct Worker;
+
+ public:
+  enum class Priority : size_t { High = 0, Normal = 1, Low = 2 };
+  enum { kPriorities = 3 };
+
+  // The number of the attempts to find a task an idle worker makes before parking.
+  enum { kStealAttemptsBeforeParking = 64 };
+
+  explicit Executor(size_t threads = DefaultThreads(), size_t max_compensation_threads = DefaultThreads())
+      : threads_(std::max(threads, static_cast<size_t>(1))) {
+    const size_t capacity = threads_ + max_compensation_threads;
+    for (size_t i = 0; i < capacity; ++i) {
+      workers_.emplace_back(new Worker(i));
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < threads_; ++i) {
+      StartWorker();
+    }
+  }
+
+  ~Executor() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    condition_variable_.notify_all();
+    retired_condition_variable_.notify_all();
+    for (size_t i = 0; i < started_; ++i) {
+      workers_[i]->thread.join();
+    }
+  }
+
+  static size_t DefaultThreads() {
+    return std::max(std::thread::hardware_concurrency(), 1u);
+  }
+
+  static Executor& Shared() {
+    static Executor executor;
+    return executor;
+  }
+
+  // The number of the worker threads running tasks, not counting the compensation ones.
+  size_t Threads() const {
+    return threads_;
+  }
+
+  // The number of the worker threads started so far, including the compensation ones, retired or not.
+  size_t StartedThreads() const {
+    return started_;
+  }
+
+  // Runs `task` on one of the workers. The task should not throw. THREAD SAFE.
+  void Submit(std::function<void()> task, Priority priority = Priority::Normal) {
+    Worker* self = CurrentWorker();
+    Worker& worker = (self && self->executor == this) ? *self : *workers_[next_worker_++ % threads_];
+    // Counted before it is pushed, for `pending_` to never go below the number of the tasks in the deques.
+    ++pending_;
+    {
+      std::lock_guard<std::mutex> lock(worker.mutex);
+      worker.tasks[static_cast<size_t>(priority)].push_back(std::move(task));
+    }
+    if (parked_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      condition_variable_.notify_one();
+    }
+  }
+
+  // Calls `f(i)` for each `i` in [begin, end), in parallel, and returns once all the calls have returned.
+  // The indexes are taken `grain` at a time, by the calling thread and by up to `Threads()` tasks.
+  // If some call throws, the indexes not taken yet are skipped, and the first exception is rethrown.
+  template <typename F>
+  void ParallelFor(size_t begin, size_t end, F&& f, size_t grain = 1, Priority priority = Priority::Normal) {
+    if (begin >= end) {
+      return;
+    }
+    grain = std::max(grain, static_cast<size_t>(1));
+    const size_t chunks = (end - begin + grain - 1) / grain;
+    std::shared_ptr<ParallelForState> state = std::make_shared<ParallelForState>();
+    std::function<void()> run = [state, begin, end, grain, chunks, &f]() {
+      for (size_t chunk = state->next++; chunk < chunks; chunk = state->next++) {
+        try {
+          const size_t chunk_end = std::min(begin + (chunk + 1) * grain, end);
+          for (size_t i = begin + chunk * grain; i < chunk_end; ++i) {
+            f(i);
+          }
+        } catch (...) {
+          // The chunks not taken yet are skipped, and count as done.
+          const size_t taken = std::min(state->next.exchange(chunks), chunks);
+          std::lock_guard<std::mutex> lock(state->mutex);
+          if (!state->exception) {
+            state->exception = std::current_exception();
+          }
+          state->done += chunks - taken;
+        }
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (++state->done == chunks) {
+          state->condition_variable.notify_all();
+        }
+      }
+    };
+    // The helpers that start once all the chunks have been taken return right away. They do not touch `f`.
+    const size_t helpers = std::min(chunks - 1, threads_);
+    for (size_t i = 0; i < helpers; ++i) {
+      Submit(run, priority);
+    }
+    run();
+    {
+      ScopedBlocking blocking;
+      std::unique_lock<std::mutex> lock(state->mutex);
+      state->condition_variable.wait(lock, [&state, chunks] { return state->done == chunks; });
+    }
+    if (state->exception) {
+      std::rethrow_exception(state->exception);
+    }
+  }
+
+  // Marks the task running on the current thread as blocked for the lifetime of the object,
+  // for the executor to run another worker meanwhile. No-op on the threads that are not workers.
+  class ScopedBlocking final {
+   public:
+    ScopedBlocking() : worker_(CurrentWorker()) {
+      if (worker_) {
+        worker_->executor->EnterBlocking();
+      }
+    }
+    ~ScopedBlocking() {
+      if (worker_) {
+        worker_->executor->LeaveBlocking();
+      }
+    }
+
+   private:
+    Worker* const worker_;
+
+    ScopedBlocking(const ScopedBlocking&) = delete;
+    void operator=(const ScopedBlocking&) = delete;
+  };
+
+ private:
+  struct Worker {
+    const size_t index;
+    Executor* executor = nullptr;
+    // The deques of the tasks, by priority. The worker takes them from the back, the thieves from the front.
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks[kPriorities];
+    std::thread thread;
+
+    explicit Worker(size_t index) : index(index) {}
+  };
+
+  struct ParallelForState {
+    std::atomic_size_t next{0};
+    size_t done = 0;
+    std::exception_ptr exception;
+    std::mutex mutex;
+    std::condition_variable condition_variable;
+  };
+
+  static Worker*& CurrentWorker() {
+    static thread_local Worker* worker = nullptr;
+    return worker;
+  }
+
+  // MUTEX-LOCKED.
+  void StartWorker() {
+    Worker& worker = *workers_[started_];
+    worker.executor = this;
+    worker.thread = std::thread(&Executor::WorkerThread, this, std::ref(worker));
+    ++started_;
+  }
+
+  void WorkerThread(Worker& worker) {
+    CurrentWorker() = &worker;
+    size_t attempts = 0;
+    while (true) {
+      std::function<void()> task;
+      if (TakeTask(worker, task)) {
+        attempts = 0;
+        task();
+        if (worker.index >= threads_) {
+          MaybeRetire();
+        }
+        continue;
+      }
+      if (++attempts < kStealAttemptsBeforeParking) {
+        std::this_thread::yield();
+        continue;
+      }
+      attempts = 0;
+      std::unique_lock<std::mutex> lock(mutex_);
+      ++parked_;
+      condition_variable_.wait(lock, [this] { return pending_ || stopping_; });
+      --parked_;
+      if (stopping_ && !pending_) {
+        return;
+      }
+    }
+  }
+
+  // Takes the task of the highest priority, from the back of the own deque, or from the front of the others.
+  bool TakeTask(Worker& self, std::function<void()>& task) {
+    if (!pending_) {
+      return false;
+    }
+    const size_t started = started_;
+    for (size_t priority = 0; priority < kPriorities; ++priority) {
+      {
+        std::lock_guard<std::mutex> lock(self.mutex);
+        std::deque<std::function<void()>>& tasks = self.tasks[priority];
+        if (!tasks.empty()) {
+          task = std::move(tasks.back());
+          tasks.pop_back();
+          --pending_;
+          return true;
+        }
+      }
+      for (size_t i = 1; i < started; ++i) {
+        Worker& victim = *workers_[(self.index + i) % started];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        std::deque<std::function<void()>>& tasks = victim.tasks[priority];
+        if (!tasks.empty()) {
+          task = std::move(tasks.front());
+          tasks.pop_front();
+          --pending_;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  // The number of the workers that can run tasks now. MUTEX-LOCKED.
+  size_t Running() const {
+    return started_ - retired_ - blocked_;
+  }
+
+  void EnterBlocking() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++blocked_;
+    if (Running() < threads_) {
+      if (retired_ > unretire_requests_) {
+        ++unretire_requests_;
+        retired_condition_variable_.notify_all();
+      } else if (started_ < workers_.size() && !stopping_) {
+        StartWorker();
+      }
+    }
+  }
+
+  void LeaveBlocking() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    --blocked_;
+  }
+
+  // Has the compensation worker wait, once the blocked workers are back, until it is needed again.
+  void MaybeRetire() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (Running() + unretire_requests_ <= threads_ || stopping_) {
+      return;
+    }
+    if (unretire_requests_) {
+      // A retired worker has been asked to come back, and this one is still running, which is just as well.
+      --unretire_requests_;
+      return;
+    }
+    ++retired_;
+    retired_condition_variable_.wait(lock, [this] { return unretire_requests_ || stopping_; });
+    if (unretire_requests_) {
+      --unretire_requests_;
+    }
+    --retired_;
+  }
+
+  const size_t threads_;
+
+  // All the workers, up to the maximum number of them, allocated upfront, for the thieves to not lock
+  // the vector. Only [0, started_) have their threads running.
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic_size_t started_{0};
+
+  // The number of the tasks in all the deques, or being pushed into them.
+  std::atomic_size_t pending_{0};
+  std::atomic_size_t next_worker_{0};
+
+  // The parked workers wait on `condition_variable_`, the retired ones on `retired_condition_variable_`.
+  // The counters, but `parked_`, which the submitters check without locking, are guarded by `mutex_`.
+  std::mutex mutex_;
+  std::condition_variable condition_variable_;
+  std::condition_variable retired_condition_variable_;
+  std::atomic_size_t parked_{0};
+  size_t blocked_ = 0;
+  size_t retired_ = 0;
+  size_t unretire_requests_ = 0;
+  bool stopping_ = false;
+
+  Executor(const Executor&) = delete;
+  void operator=(const Executor&) = delete;
+};
+
+}  // namespace bricks
+
+#endif  // BRICKS_EXECUTOR_EXECUTOR_H
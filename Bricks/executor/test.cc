@@ -0,0 +1,127 @@
+#include "executor.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../3party/gtest/gtest.h"
+#include "../3party/gtest/gtest-main.h"
+
+using bricks::Executor;
+
+TEST(Executor, RunsAllTheSubmittedTasks) {
+  std::atomic_int sum(0);
+  {
+    Executor executor(4);
+    for (int i = 1; i <= 1000; ++i) {
+      executor.Submit([&sum, i]() { sum += i; });
+    }
+  }
+  EXPECT_EQ(500500, sum);
+}
+
+TEST(Executor, TasksSubmittedFromTasksAreRun) {
+  std::atomic_int count(0);
+  {
+    Executor executor(4);
+    for (int i = 0; i < 10; ++i) {
+      executor.Submit([&executor, &count]() {
+        for (int j = 0; j < 10; ++j) {
+          executor.Submit([&count]() { ++count; });
+        }
+      });
+    }
+  }
+  EXPECT_EQ(100, count);
+}
+
+TEST(Executor, HigherPriorityTasksAreTakenFirst) {
+  std::string order;
+  {
+    Executor executor(1, 0);
+    std::mutex gate;
+    std::unique_lock<std::mutex> lock(gate);
+    // Holds the only worker until all the tasks have been submitted.
+    std::atomic_bool started(false);
+    executor.Submit([&gate, &started]() {
+      started = true;
+      std::lock_guard<std::mutex> wait(gate);
+    });
+    while (!started) {
+      std::this_thread::yield();
+    }
+    executor.Submit([&order]() { order += 'l'; }, Executor::Priority::Low);
+    executor.Submit([&order]() { order += 'n'; }, Executor::Priority::Normal);
+    executor.Submit([&order]() { order += 'h'; }, Executor::Priority::High);
+    executor.Submit([&order]() { order += 'N'; }, Executor::Priority::Normal);
+    lock.unlock();
+  }
+  // Within a priority, the worker takes its own tasks last in, first out.
+  EXPECT_EQ("hNnl", order);
+}
+
+TEST(Executor, ParallelForCoversTheRange) {
+  Executor executor(4);
+  std::vector<int> calls(1000, 0);
+  executor.ParallelFor(0, calls.size(), [&calls](size_t i) { ++calls[i]; }, 7);
+  EXPECT_EQ(std::vector<int>(1000, 1), calls);
+  executor.ParallelFor(5, 5, [](size_t) { ASSERT_TRUE(false); });
+}
+
+TEST(Executor, ParallelForCanBeNested) {
+  Executor executor(2);
+  std::atomic_int count(0);
+  executor.ParallelFor(0, 10, [&executor, &count](size_t) {
+    executor.ParallelFor(0, 10, [&count](size_t) { ++count; });
+  });
+  EXPECT_EQ(100, count);
+}
+
+TEST(Executor, ParallelForRethrowsTheException) {
+  Executor executor(4);
+  std::atomic_int count(0);
+  ASSERT_THROW(executor.ParallelFor(0, 1000, [&count](size_t i) {
+    ++count;
+    if (i == 10) {
+      throw std::logic_error("10");
+    }
+  }), std::logic_error);
+  EXPECT_GE(count, 11);
+  // The executor is still usable.
+  executor.ParallelFor(0, 10, [&count](size_t) { ++count; });
+}
+
+TEST(Executor, BlockingTasksAreCompensated) {
+  Executor executor(2, 2);
+  EXPECT_EQ(2u, executor.StartedThreads());
+  std::mutex gate;
+  std::unique_lock<std::mutex> lock(gate);
+  std::atomic_int blocked(0);
+  for (int i = 0; i < 2; ++i) {
+    executor.Submit([&gate, &blocked]() {
+      Executor::ScopedBlocking blocking;
+      ++blocked;
+      std::lock_guard<std::mutex> wait(gate);
+    });
+  }
+  while (blocked != 2) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(4u, executor.StartedThreads());
+  // The compensation workers run the tasks while the others are blocked.
+  std::atomic_int count(0);
+  executor.ParallelFor(0, 100, [&count](size_t) { ++count; });
+  EXPECT_EQ(100, count);
+  lock.unlock();
+}
+
+TEST(Executor, SharedExecutorHasAWorkerPerCore) {
+  EXPECT_EQ(Executor::DefaultThreads(), Executor::Shared().Threads());
+  std::atomic_int count(0);
+  Executor::Shared().ParallelFor(0, 100, [&count](size_t) { ++count; });
+  EXPECT_EQ(100, count);
+}
@@ -0,0 +1,248 @@
+// `AsyncFileIO` runs file operations, such as renames, removals, syncs and writes, on a pool of threads,
+// calling `completion(ok)` on the thread that has run each of them.
+//
+// The operations are ordered per file: each one is started only after all the operations submitted before it
+// on the same file name are complete. A rename is ordered with respect to both its old and its new name,
+// so that, for example, a removal of the new name submitted after the rename never runs before it.
+// The operations on different files run concurrently, up to the number of threads. The file names are compared
+// as strings, thus the operations on the same file should name it the same way.
+//
+// `Barrier(file_name, completion)` calls `completion(true)` once all the operations submitted on the file
+// before it are done, and `WaitUntilIdle()` blocks until all the submitted operations are.
+// The destructor completes all of them before returning.
+
+#ifndef BRICKS_FILE_ASYNC_IO_H
+#define BRICKS_FILE_ASYNC_IO_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "file.h"
+
+namespace bricks {
+
+class AsyncFileIO final {
+ public:
+  typedef std::function<void(bool)> Completion;
+
+  explicit AsyncFileIO(size_t threads = 2) {
+    for (size_t i = 0; i < std::max(threads, static_cast<size_t>(1)); ++i) {
+      threads_.emplace_back(&AsyncFileIO::Thread, this);
+    }
+  }
+
+  ~AsyncFileIO() {
+    WaitUntilIdle();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      destructing_ = true;
+    }
+    ready_condition_.notify_all();
+    for (std::thread& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  void Rename(const std::string& old_name, const std::string& new_name, Completion completion = Completion()) {
+    Submit({old_name, new_name},
+           [old_name, new_name]() { return !::rename(old_name.c_str(), new_name.c_str()); },
+           std::move(completion));
+  }
+
+  void Remove(const std::string& file_name, Completion completion = Completion()) {
+    Submit({file_name}, [file_name]() { return !::remove(file_name.c_str()); }, std::move(completion));
+  }
+
+  // Flushes the file to disk.
+  void Sync(const std::string& file_name, Completion completion = Completion()) {
+    Submit({file_name},
+           [file_name]() {
+             const int fd = ::open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+             if (fd < 0) {
+               return false;
+             }
+#if defined(__APPLE__)
+             const bool ok = !::fsync(fd);
+#else
+             const bool ok = !::fdatasync(fd);
+#endif
+             ::close(fd);
+             return ok;
+           },
+           std::move(completion));
+  }
+
+  // Reserves disk space for the file to grow up to `size_in_bytes`, without changing its size. Linux only,
+  // elsewhere completes successfully doing nothing.
+  void Preallocate(const std::string& file_name, uint64_t size_in_bytes, Completion completion = Completion()) {
+    Submit({file_name},
+           [file_name, size_in_bytes]() {
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+             const int fd = ::open(file_name.c_str(), O_WRONLY | O_CLOEXEC);
+             if (fd < 0) {
+               return false;
+             }
+             const bool ok = !::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size_in_bytes));
+             ::close(fd);
+             return ok;
+#else
+             static_cast<void>(size_in_bytes);
+             return true;
+#endif
+           },
+           std::move(completion));
+  }
+
+  void Write(const std::string& file_name,
+             const std::string& contents,
+             bool append = false,
+             Completion completion = Completion()) {
+    Submit({file_name},
+           [file_name, contents, append]() {
+             try {
+               WriteStringToFile(file_name, contents, append);
+               return true;
+             } catch (const FileException&) {
+               return false;
+             }
+           },
+           std::move(completion));
+  }
+
+  void WriteAtomically(const std::string& file_name,
+                       const std::string& contents,
+                       WriteFileAtomicallyParameters parameters = WriteFileAtomicallyParameters::Durable,
+                       Completion completion = Completion()) {
+    Submit({file_name},
+           [file_name, contents, parameters]() {
+             try {
+               WriteFileAtomically(file_name, contents, parameters);
+               return true;
+             } catch (const FileException&) {
+               return false;
+             }
+           },
+           std::move(completion));
+  }
+
+  void Barrier(const std::string& file_name, Completion completion) {
+    Submit({file_name}, []() { return true; }, std::move(completion));
+  }
+
+  // Runs `operation()`, returning whether it has succeeded, ordered with respect to the operations on `files`.
+  void Submit(const std::vector<std::string>& files, std::function<bool()> operation, Completion completion) {
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->files = files;
+    std::sort(job->files.begin(), job->files.end());
+    job->files.erase(std::unique(job->files.begin(), job->files.end()), job->files.end());
+    job->operation = std::move(operation);
+    job->completion = std::move(completion);
+    bool ready;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++pending_;
+      for (const std::string& file : job->files) {
+        std::deque<std::shared_ptr<Job>>& queue = queues_[file];
+        queue.push_back(job);
+        if (queue.size() == 1) {
+          ++job->files_at_front;
+        }
+      }
+      ready = (job->files_at_front == job->files.size());
+      if (ready) {
+        ready_.push_back(job);
+      }
+    }
+    if (ready) {
+      ready_condition_.notify_one();
+    }
+  }
+
+  void WaitUntilIdle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_condition_.wait(lock, [this]() { return !pending_; });
+  }
+
+ private:
+  struct Job {
+    std::vector<std::string> files;
+    std::function<bool()> operation;
+    Completion completion;
+    // The number of `files` this job is the first one to run on.
+    size_t files_at_front = 0;
+  };
+
+  void Thread() {
+    while (true) {
+      std::shared_ptr<Job> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_condition_.wait(lock, [this]() { return destructing_ || !ready_.empty(); });
+        if (ready_.empty()) {
+          return;
+        }
+        job = std::move(ready_.front());
+        ready_.pop_front();
+      }
+      const bool ok = job->operation();
+      if (job->completion) {
+        job->completion(ok);
+      }
+      size_t newly_ready = 0;
+      bool idle;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const std::string& file : job->files) {
+          const auto it = queues_.find(file);
+          std::deque<std::shared_ptr<Job>>& queue = it->second;
+          queue.pop_front();
+          if (queue.empty()) {
+            queues_.erase(it);
+          } else {
+            const std::shared_ptr<Job>& next = queue.front();
+            if (++next->files_at_front == next->files.size()) {
+              ready_.push_back(next);
+              ++newly_ready;
+            }
+          }
+        }
+        idle = !--pending_;
+      }
+      for (size_t i = 0; i < newly_ready; ++i) {
+        ready_condition_.notify_one();
+      }
+      if (idle) {
+        idle_condition_.notify_all();
+      }
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable ready_condition_;
+  std::condition_variable idle_condition_;
+  // The jobs on each file, in the order of submission, the first one being the running or the next to run one.
+  std::unordered_map<std::string, std::deque<std::shared_ptr<Job>>> queues_;
+  std::deque<std::shared_ptr<Job>> ready_;
+  size_t pending_ = 0;
+  bool destructing_ = false;
+  std::vector<std::thread> threads_;
+
+  AsyncFileIO(const AsyncFileIO&) = delete;
+  void operator=(const AsyncFileIO&) = delete;
+};
+
+}  // namespace bricks
+
+#endif  // BRICKS_FILE_ASYNC_IO_H
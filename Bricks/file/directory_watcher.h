@@ -0,0 +1,166 @@
+// Watches a directory for the files that appear in it: created, written, or moved into it by other processes.
+// Uses inotify on Linux and kqueue on macOS and BSD. Kqueue only reports that the directory has changed,
+// so there every file present in the directory is reported on each change, and the caller is expected
+// to ignore the files it already knows of.
+
+#ifndef BRICKS_FILE_DIRECTORY_WATCHER_H
+#define BRICKS_FILE_DIRECTORY_WATCHER_H
+
+#include <cerrno>
+#include <functional>
+#include <string>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#define BRICKS_DIRECTORY_WATCHER_KQUEUE
+#include <sys/event.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#endif
+
+#include "exceptions.h"
+#include "file.h"
+
+namespace bricks {
+
+class DirectoryWatcher final {
+ public:
+  // Throws `FileException` if the directory can not be watched.
+  explicit DirectoryWatcher(const std::string& directory) : directory_(directory) {
+    if (::pipe(interrupt_pipe_)) {
+      throw FileException();
+    }
+    ::fcntl(interrupt_pipe_[0], F_SETFD, FD_CLOEXEC);
+    ::fcntl(interrupt_pipe_[1], F_SETFD, FD_CLOEXEC);
+#if defined(__linux__)
+    fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd_ < 0 || ::inotify_add_watch(fd_, directory.c_str(), IN_MOVED_TO | IN_CLOSE_WRITE) < 0) {
+      CloseAndThrow();
+    }
+#elif defined(BRICKS_DIRECTORY_WATCHER_KQUEUE)
+#if defined(O_EVTONLY)
+    directory_fd_ = ::open(directory.c_str(), O_EVTONLY);
+#else
+    directory_fd_ = ::open(directory.c_str(), O_RDONLY);
+#endif
+    fd_ = ::kqueue();
+    if (directory_fd_ < 0 || fd_ < 0) {
+      CloseAndThrow();
+    }
+    struct kevent changes[2];
+    EV_SET(&changes[0], directory_fd_, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0, nullptr);
+    EV_SET(&changes[1], interrupt_pipe_[0], EVFILT_READ, EV_ADD, 0, 0, nullptr);
+    if (::kevent(fd_, changes, 2, nullptr, 0, nullptr) < 0) {
+      CloseAndThrow();
+    }
+#else
+    CloseAndThrow();
+#endif
+  }
+
+  ~DirectoryWatcher() {
+    Close();
+  }
+
+  // Blocks until files appear in the directory, and calls `f(file_name)` for each of them.
+  // Returns false, possibly before calling `f`, once `Interrupt()` has been called.
+  bool WaitForFiles(std::function<void(const std::string&)> f) {
+#if defined(__linux__)
+    struct pollfd fds[2];
+    fds[0].fd = fd_;
+    fds[0].events = POLLIN;
+    fds[1].fd = interrupt_pipe_[0];
+    fds[1].events = POLLIN;
+    while (true) {
+      if (::poll(fds, 2, -1) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      if (fds[1].revents) {
+        return false;
+      }
+      if (fds[0].revents & POLLIN) {
+        break;
+      }
+    }
+    alignas(struct inotify_event) char buffer[16 * 1024];
+    ssize_t length;
+    while ((length = ::read(fd_, buffer, sizeof(buffer))) > 0) {
+      for (const char* p = buffer; p < buffer + length;) {
+        const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+        if (event->mask & IN_Q_OVERFLOW) {
+          // The events have been dropped by the kernel, report everything.
+          ReportAllFiles(f);
+        } else if (event->len && !(event->mask & IN_ISDIR)) {
+          f(event->name);
+        }
+        p += sizeof(struct inotify_event) + event->len;
+      }
+    }
+    return true;
+#elif defined(BRICKS_DIRECTORY_WATCHER_KQUEUE)
+    struct kevent event;
+    int n;
+    while ((n = ::kevent(fd_, nullptr, 0, &event, 1, nullptr)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0 || static_cast<int>(event.ident) == interrupt_pipe_[0]) {
+      return false;
+    }
+    ReportAllFiles(f);
+    return true;
+#else
+    static_cast<void>(f);
+    return false;
+#endif
+  }
+
+  // Makes the pending and all the future calls to `WaitForFiles()` return false. THREAD SAFE.
+  void Interrupt() {
+    const char c = 0;
+    if (::write(interrupt_pipe_[1], &c, 1) < 0) {
+      // Nothing to do, `WaitForFiles()` is woken up by the first byte written already.
+    }
+  }
+
+ private:
+  void ReportAllFiles(std::function<void(const std::string&)>& f) const {
+    FileSystem::ScanDir(directory_, f);
+  }
+
+  void Close() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+    if (directory_fd_ >= 0) {
+      ::close(directory_fd_);
+      directory_fd_ = -1;
+    }
+    ::close(interrupt_pipe_[0]);
+    ::close(interrupt_pipe_[1]);
+  }
+
+  void CloseAndThrow() {
+    Close();
+    throw FileException();
+  }
+
+  const std::string directory_;
+  int fd_ = -1;
+  int directory_fd_ = -1;
+  int interrupt_pipe_[2] = {-1, -1};
+
+  DirectoryWatcher(const DirectoryWatcher&) = delete;
+  void operator=(const DirectoryWatcher&) = delete;
+};
+
+}  // namespace bricks
+
+#endif  // BRICKS_FILE_DIRECTORY_WATCHER_H
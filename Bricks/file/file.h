@@ -29,12 +29,21 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 *******************************************************************************/
 
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
 #include <fstream>
+#include <functional>
 #include <string>
 #include <cstring>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "exceptions.h"
 
@@ -42,37 +51,98 @@ SOFTWARE.
 
 namespace bricks {
 
-inline std::string ReadFileAsString(std::string const& file_name) {
-  try {
-    std::ifstream fi;
-    fi.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-    fi.open(file_name, std::ifstream::binary);
-    fi.seekg(0, std::ios::end);
-    const size_t size = fi.tellg();
-    std::string buffer(size, '\0');
-    fi.seekg(0);
-    if (fi.read(&buffer[0], size).good()) {
-      return buffer;
+// Writes all the data into the file descriptor, resuming after partial writes and interruptions.
+inline bool WriteToFileDescriptor(int fd, const char* data, size_t size) {
+  while (size) {
+    const ssize_t written = ::write(fd, data, size);
+    if (written < 0) {
+      if (errno != EINTR) {
+        return false;
+      }
     } else {
-      // TODO(dkorolev): Ask Alex whether there's a better way than what I have here with two exceptions.
-      throw FileException();
+      data += written;
+      size -= static_cast<size_t>(written);
     }
-  } catch (const std::ifstream::failure&) {
+  }
+  return true;
+}
+
+// Writes all the chunks with `writev()`, resuming after partial writes and interruptions,
+// at most `IOV_MAX` chunks at a time. Modifies `chunks` along the way.
+inline bool WriteChunksToFileDescriptor(int fd, struct iovec* chunks, int count) {
+  while (count > 0) {
+    const ssize_t written = ::writev(fd, chunks, std::min(count, static_cast<int>(IOV_MAX)));
+    if (written < 0) {
+      if (errno != EINTR) {
+        return false;
+      }
+      continue;
+    }
+    size_t remaining = static_cast<size_t>(written);
+    while (count > 0 && remaining >= chunks->iov_len) {
+      remaining -= chunks->iov_len;
+      ++chunks;
+      --count;
+    }
+    if (count > 0) {
+      chunks->iov_base = static_cast<char*>(chunks->iov_base) + remaining;
+      chunks->iov_len -= remaining;
+    }
+  }
+  return true;
+}
+
+inline void WriteStringToFile(const std::string& file_name, const std::string& contents, bool append = false) {
+  const int fd =
+      ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+  if (fd < 0) {
     throw FileException();
-  } catch (FileException()) {
+  }
+  const bool ok = WriteToFileDescriptor(fd, contents.data(), contents.size());
+  if (::close(fd) || !ok) {
     throw FileException();
   }
 }
 
-inline void WriteStringToFile(const std::string& file_name, const std::string& contents, bool append = false) {
-  try {
-    std::ofstream fo;
-    fo.exceptions(std::ofstream::failbit | std::ofstream::badbit);
-    fo.open(file_name, (append ? std::ofstream::app : std::ofstream::trunc) | std::ofstream::binary);
-    fo << contents;
-  } catch (const std::ofstream::failure&) {
+// `Durable` flushes the file to disk before it replaces the old one, and the directory after.
+// `NoSync` only guarantees the file is either the old one or the new one after a crash of the process,
+// not after a power loss.
+enum class WriteFileAtomicallyParameters { Durable, NoSync };
+
+// Replaces the contents of the file at once: the readers, or the next run after a crash,
+// see either the old file or the new one, never a partially written one. Writes `${file_name}.tmp` first,
+// then renames it over `file_name`. Throws `FileException`, with the old file left intact.
+inline void WriteFileAtomically(
+    const std::string& file_name,
+    const std::string& contents,
+    WriteFileAtomicallyParameters parameters = WriteFileAtomicallyParameters::Durable) {
+  const bool durable = (parameters == WriteFileAtomicallyParameters::Durable);
+  const std::string temporary_file_name = file_name + ".tmp";
+  const int fd = ::open(temporary_file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    throw FileException();
+  }
+  bool ok = WriteToFileDescriptor(fd, contents.data(), contents.size());
+#if defined(__APPLE__)
+  ok = ok && (!durable || !::fsync(fd));
+#else
+  ok = ok && (!durable || !::fdatasync(fd));
+#endif
+  ok = !::close(fd) && ok;
+  if (!ok || ::rename(temporary_file_name.c_str(), file_name.c_str())) {
+    ::unlink(temporary_file_name.c_str());
     throw FileException();
   }
+  if (durable) {
+    // The rename itself is durable once the directory is.
+    const size_t slash = file_name.rfind('/');
+    const std::string directory = (slash == std::string::npos) ? "." : file_name.substr(0, slash + 1);
+    const int directory_fd = ::open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+    if (directory_fd >= 0) {
+      ::fsync(directory_fd);
+      ::close(directory_fd);
+    }
+  }
 }
 
 enum class RemoveFileParameters { ThrowExceptionOnError, Silent };
@@ -99,9 +169,391 @@ class ScopedRemoveFile final {
   std::string file_name_;
 };
 
+// The hint to the kernel on how the memory-mapped file is going to be read.
+// `Sequential` has the whole file read ahead, `Random` turns read-ahead off.
+enum class MemoryMappedFileAccess { Sequential, Random };
+
+// Read-only memory-mapped view of the whole file, unmapped in the destructor.
+// Lets the file be parsed or sent over without copying it into the heap.
+// An empty file is a valid view with `data() == nullptr` and `size() == 0`.
+class MemoryMappedFile final {
+ public:
+  explicit MemoryMappedFile(const std::string& file_name,
+                            MemoryMappedFileAccess access = MemoryMappedFileAccess::Sequential) {
+    fd_ = ::open(file_name.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+      throw FileException();
+    }
+    struct stat info;
+    if (::fstat(fd_, &info)) {
+      ::close(fd_);
+      throw FileException();
+    }
+    size_ = static_cast<size_t>(info.st_size);
+    if (size_) {
+      void* address = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+      if (address == MAP_FAILED) {
+        ::close(fd_);
+        throw FileException();
+      }
+      data_ = static_cast<const char*>(address);
+      if (access == MemoryMappedFileAccess::Sequential) {
+        ::madvise(address, size_, MADV_SEQUENTIAL);
+        ::madvise(address, size_, MADV_WILLNEED);
+      } else {
+        ::madvise(address, size_, MADV_RANDOM);
+      }
+    }
+  }
+  ~MemoryMappedFile() {
+    if (data_) {
+      ::munmap(const_cast<char*>(data_), size_);
+    }
+    ::close(fd_);
+  }
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  MemoryMappedFile(const MemoryMappedFile&) = delete;
+  void operator=(const MemoryMappedFile&) = delete;
+
+  int fd_ = -1;
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Files of up to this size are read into the string with `read()`. The larger ones are copied
+// from their memory mapping instead, which spares zero-filling the string before reading into it.
+const size_t kReadFileAsStringMaxSizeToRead = 64 * 1024;
+
+// Reads the whole file just opened as `fd` with one `fstat()` and, normally, one `read()` or `mmap()`.
+// The files that report zero size, such as the ones in `/proc`, are read until the end. Does not close `fd`.
+inline std::string ReadFileDescriptorAsString(int fd) {
+  struct stat info;
+  if (::fstat(fd, &info) || S_ISDIR(info.st_mode)) {
+    throw FileException();
+  }
+  const size_t size = static_cast<size_t>(info.st_size);
+  std::string result;
+  if (size > kReadFileAsStringMaxSizeToRead) {
+    void* address = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address == MAP_FAILED) {
+      throw FileException();
+    }
+    const auto munmap_guard = MakeScopeGuard([address, size]() { ::munmap(address, size); });
+    ::madvise(address, size, MADV_SEQUENTIAL);
+    result.assign(static_cast<const char*>(address), size);
+  } else {
+    result.resize(size ? size : 4096);
+    size_t offset = 0;
+    while (true) {
+      if (offset == result.size()) {
+        if (size) {
+          break;
+        }
+        result.resize(result.size() * 2);
+      }
+      const ssize_t bytes_read = ::read(fd, &result[offset], result.size() - offset);
+      if (bytes_read < 0) {
+        if (errno != EINTR) {
+          throw FileException();
+        }
+      } else if (bytes_read == 0) {
+        break;
+      } else {
+        offset += static_cast<size_t>(bytes_read);
+      }
+    }
+    result.resize(offset);
+  }
+  return result;
+}
+
+// Reads the whole file with one `open()`, see `ReadFileDescriptorAsString()`.
+inline std::string ReadFileAsString(std::string const& file_name) {
+  const int fd = ::open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw FileException();
+  }
+  const auto close_guard = MakeScopeGuard([fd]() { ::close(fd); });
+  return ReadFileDescriptorAsString(fd);
+}
+
+// Output file writing directly into the file descriptor, a drop-in replacement for `std::ofstream`
+// as the `OutputFile` of a file system, at the cost of no formatted output.
+// Opened with `O_APPEND` if the mode has `std::ios_base::app`, truncated otherwise.
+//
+// `write()` collects the data in a buffer of its own, written out on `flush()`, with the data exceeding
+// the buffer written together with what has been buffered by one `writev()`. There is no locale, no sentry
+// objects and no virtual calls on the way. With `O_APPEND` the file offset is irrelevant, thus no `pwritev()`.
+class PosixOutputFile final {
+ public:
+  enum { kBufferSize = 64 * 1024 };
+
+  explicit PosixOutputFile(const std::string& file_name, std::ios_base::openmode mode = std::ios_base::out)
+      : fd_(::open(file_name.c_str(),
+                   O_WRONLY | O_CREAT | O_CLOEXEC | ((mode & std::ios_base::app) ? O_APPEND : O_TRUNC),
+                   0644)),
+        bad_(fd_ < 0) {
+  }
+  ~PosixOutputFile() {
+    flush();
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  PosixOutputFile& write(const char* data, std::streamsize length) {
+    const size_t size = static_cast<size_t>(length);
+    if (buffer_.size() + size <= kBufferSize) {
+      buffer_.append(data, size);
+    } else {
+      struct iovec chunks[2];
+      chunks[0].iov_base = const_cast<char*>(buffer_.data());
+      chunks[0].iov_len = buffer_.size();
+      chunks[1].iov_base = const_cast<char*>(data);
+      chunks[1].iov_len = size;
+      WriteChunks(chunks, 2, buffer_.size() + size);
+      buffer_.clear();
+    }
+    return *this;
+  }
+  PosixOutputFile& flush() {
+    if (!buffer_.empty()) {
+      struct iovec chunk;
+      chunk.iov_base = const_cast<char*>(buffer_.data());
+      chunk.iov_len = buffer_.size();
+      WriteChunks(&chunk, 1, buffer_.size());
+      buffer_.clear();
+    }
+    return *this;
+  }
+  bool bad() const {
+    return bad_;
+  }
+
+  // Reserves disk space for the file to grow up to `size_in_bytes`, without changing its size. Linux only.
+  void Preallocate(uint64_t size_in_bytes) {
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+    if (fd_ >= 0) {
+      ::fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size_in_bytes));
+    }
+#else
+    static_cast<void>(size_in_bytes);
+#endif
+  }
+
+  // Keeps the file from filling up the page cache as it grows, for the files that are written once and
+  // read back much later, if at all: the data is written back and dropped in batches of `bytes`,
+  // see `DropWrittenDataFromPageCache()`, at the cost of the writer occasionally waiting for the disk.
+  // Linux only, zero turns it off. The whole file is still dropped by `DropFromPageCache()`.
+  void DropFromPageCacheEvery(uint64_t bytes) {
+    drop_every_ = bytes;
+    if (drop_every_ && fd_ >= 0) {
+      const off_t end = ::lseek(fd_, 0, SEEK_END);
+      offset_ = end > 0 ? static_cast<uint64_t>(end) : 0;
+      writeback_started_ = dropped_ = offset_;
+    }
+  }
+
+  // Writes out the buffer and tells the kernel the contents of the file will not be needed in the page cache.
+  void DropFromPageCache() {
+    flush();
+#if defined(POSIX_FADV_DONTNEED)
+    if (fd_ >= 0) {
+      ::fdatasync(fd_);
+      ::posix_fadvise(fd_, 0, 0, POSIX_FADV_DONTNEED);
+    }
+#endif
+  }
+
+ private:
+  PosixOutputFile(const PosixOutputFile&) = delete;
+  void operator=(const PosixOutputFile&) = delete;
+
+  void WriteChunks(struct iovec* chunks, int count, size_t size) {
+    if (!bad_ && !WriteChunksToFileDescriptor(fd_, chunks, count)) {
+      bad_ = true;
+    }
+    if (drop_every_ && !bad_) {
+      offset_ += size;
+      DropWrittenDataFromPageCache();
+    }
+  }
+
+  // Once another `drop_every_` bytes have been written, waits for the writeback of the bytes started
+  // the previous time, normally complete by then, drops them, and starts the writeback of the new ones.
+  void DropWrittenDataFromPageCache() {
+#if defined(__linux__) && defined(SYNC_FILE_RANGE_WRITE)
+    if (offset_ - writeback_started_ >= drop_every_) {
+      if (writeback_started_ > dropped_) {
+        const off_t begin = static_cast<off_t>(dropped_);
+        const off_t length = static_cast<off_t>(writeback_started_ - dropped_);
+        ::sync_file_range(fd_,
+                          begin,
+                          length,
+                          SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        ::posix_fadvise(fd_, begin, length, POSIX_FADV_DONTNEED);
+        dropped_ = writeback_started_;
+      }
+      ::sync_file_range(fd_,
+                        static_cast<off_t>(writeback_started_),
+                        static_cast<off_t>(offset_ - writeback_started_),
+                        SYNC_FILE_RANGE_WRITE);
+      writeback_started_ = offset_;
+    }
+#endif
+  }
+
+  const int fd_;
+  bool bad_;
+  std::string buffer_;
+  // For `DropFromPageCacheEvery()`: the offsets in the file of the end of the data written,
+  // of the data the writeback has been started for, and of the data dropped from the page cache.
+  uint64_t drop_every_ = 0;
+  uint64_t offset_ = 0;
+  uint64_t writeback_started_ = 0;
+  uint64_t dropped_ = 0;
+};
+
+// A small file of a fixed size, such as a state record, overwritten in place with `pwrite()`.
+// The file is created if needed and resized to `size_in_bytes` on open, so that the updates never
+// allocate disk space or change the file metadata. Throws `FileException` if the file can not be opened.
+class FixedSizeFile final {
+ public:
+  FixedSizeFile(const std::string& file_name, size_t size_in_bytes)
+      : fd_(::open(file_name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)), size_(size_in_bytes) {
+    if (fd_ < 0 || ::ftruncate(fd_, static_cast<off_t>(size_)) != 0) {
+      if (fd_ >= 0) {
+        ::close(fd_);
+      }
+      throw FileException();
+    }
+  }
+  ~FixedSizeFile() {
+    ::close(fd_);
+  }
+
+  // Overwrites the whole file. Returns false on an I/O error.
+  bool Write(const char* data) {
+    size_t offset = 0;
+    while (offset < size_) {
+      const ssize_t written = ::pwrite(fd_, data + offset, size_ - offset, static_cast<off_t>(offset));
+      if (written < 0) {
+        if (errno != EINTR) {
+          return false;
+        }
+      } else {
+        offset += static_cast<size_t>(written);
+      }
+    }
+    return true;
+  }
+
+  // Flushes the written data to disk.
+  bool Sync() {
+#if defined(__APPLE__)
+    return ::fsync(fd_) == 0;
+#else
+    return ::fdatasync(fd_) == 0;
+#endif
+  }
+
+ private:
+  FixedSizeFile(const FixedSizeFile&) = delete;
+  void operator=(const FixedSizeFile&) = delete;
+
+  const int fd_;
+  const size_t size_;
+};
+
+enum class DirectoryEntryType { RegularFile, Directory, Other };
+
+// An entry of the directory being scanned by `FileSystem::ScanDirEntriesUntil()`, valid during the callback.
+// The name points into the buffer of `readdir()`. The type comes from `d_type`, and the size and
+// the modification time are taken with one `fstatat()` relative to the directory, when first needed.
+class PosixDirectoryEntry final {
+ public:
+  PosixDirectoryEntry(int directory_fd, const struct dirent* entry)
+      : name(entry->d_name), name_length(::strlen(entry->d_name)), directory_fd_(directory_fd) {
+#if defined(DT_UNKNOWN)
+    if (entry->d_type == DT_REG) {
+      type_ = DirectoryEntryType::RegularFile;
+      has_type_ = true;
+    } else if (entry->d_type == DT_DIR) {
+      type_ = DirectoryEntryType::Directory;
+      has_type_ = true;
+    } else if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK) {
+      type_ = DirectoryEntryType::Other;
+      has_type_ = true;
+    }
+#endif
+  }
+
+  const char* const name;
+  const size_t name_length;
+
+  // Symbolic links are followed.
+  DirectoryEntryType Type() const {
+    if (!has_type_) {
+      Stat();
+    }
+    return type_;
+  }
+  bool IsRegularFile() const { return Type() == DirectoryEntryType::RegularFile; }
+  // Zero if the file is gone by now.
+  uint64_t Size() const {
+    Stat();
+    return size_;
+  }
+  uint64_t ModificationTimeMilliseconds() const {
+    Stat();
+    return modification_time_ms_;
+  }
+
+ private:
+  void Stat() const {
+    if (!stat_done_) {
+      stat_done_ = true;
+      struct stat info;
+      if (!::fstatat(directory_fd_, name, &info, 0)) {
+        if (S_ISREG(info.st_mode)) {
+          type_ = DirectoryEntryType::RegularFile;
+        } else if (S_ISDIR(info.st_mode)) {
+          type_ = DirectoryEntryType::Directory;
+        } else {
+          type_ = DirectoryEntryType::Other;
+        }
+        size_ = static_cast<uint64_t>(info.st_size);
+#if defined(__APPLE__)
+        const struct timespec& mtime = info.st_mtimespec;
+#else
+        const struct timespec& mtime = info.st_mtim;
+#endif
+        modification_time_ms_ =
+            static_cast<uint64_t>(mtime.tv_sec) * 1000ull + static_cast<uint64_t>(mtime.tv_nsec) / 1000000ull;
+      } else {
+        type_ = DirectoryEntryType::Other;
+      }
+      has_type_ = true;
+    }
+  }
+
+  const int directory_fd_;
+  mutable DirectoryEntryType type_ = DirectoryEntryType::Other;
+  mutable bool has_type_ = false;
+  mutable bool stat_done_ = false;
+  mutable uint64_t size_ = 0;
+  mutable uint64_t modification_time_ms_ = 0;
+};
+
 // Platform-indepenent, injection-friendly filesystem wrapper.
 struct FileSystem {
   typedef std::ofstream OutputFile;
+  typedef bricks::MemoryMappedFile MappedFile;
+  typedef bricks::PosixDirectoryEntry DirectoryEntry;
 
   static inline std::string ReadFileAsString(std::string const& file_name) {
     return bricks::ReadFileAsString(file_name);
@@ -113,14 +565,26 @@ struct FileSystem {
     bricks::WriteStringToFile(file_name, contents, append);
   }
 
+  static inline void WriteFileAtomically(
+      const std::string& file_name,
+      const std::string& contents,
+      WriteFileAtomicallyParameters parameters = WriteFileAtomicallyParameters::Durable) {
+    bricks::WriteFileAtomically(file_name, contents, parameters);
+  }
+
+  // With one allocation, as FSQ joins the paths of the files it finalizes under its lock.
   static inline std::string JoinPath(const std::string& path_name, const std::string& base_name) {
     if (path_name.empty()) {
       return base_name;
-    } else if (path_name.back() == '/') {
-      return path_name + base_name;
-    } else {
-      return path_name + '/' + base_name;
     }
+    std::string result;
+    result.reserve(path_name.length() + 1 + base_name.length());
+    result += path_name;
+    if (path_name.back() != '/') {
+      result += '/';
+    }
+    result += base_name;
+    return result;
   }
 
   static inline void RenameFile(const std::string& old_name, const std::string& new_name) {
@@ -129,6 +593,29 @@ struct FileSystem {
     }
   }
 
+  // Renames the file unless a file with the new name exists, atomically, for the processes sharing
+  // a directory to not overwrite each other's files. Returns false if there is one.
+  // Uses `renameat2(RENAME_NOREPLACE)` where available, for the file to be seen as moved, by inotify
+  // included; then, a hard link, and a plain rename on the file systems with no hard links.
+  static inline bool RenameFileUnlessExists(const std::string& old_name, const std::string& new_name) {
+#if defined(RENAME_NOREPLACE)
+    if (!::renameat2(AT_FDCWD, old_name.c_str(), AT_FDCWD, new_name.c_str(), RENAME_NOREPLACE)) {
+      return true;
+    } else if (errno == EEXIST) {
+      return false;
+    }
+#endif
+    if (!::link(old_name.c_str(), new_name.c_str())) {
+      ::unlink(old_name.c_str());
+      return true;
+    } else if (errno == EEXIST || FileExists(new_name)) {
+      return false;
+    } else {
+      RenameFile(old_name, new_name);
+      return true;
+    }
+  }
+
   static inline void RemoveFile(const std::string& file_name,
                                 RemoveFileParameters parameters = RemoveFileParameters::ThrowExceptionOnError) {
     bricks::RemoveFile(file_name, parameters);
@@ -156,6 +643,32 @@ struct FileSystem {
     });
   }
 
+  // Calls `f(const DirectoryEntry&)` for each entry of the directory but "." and "..", until it returns false.
+  // Unlike `ScanDirUntil()`, there is no `std::function` and no `std::string` per entry, and the sizes
+  // of the files are taken relative to the directory, not by their full path names.
+  template <typename F>
+  static inline void ScanDirEntriesUntil(const std::string& directory, F&& f) {
+    DIR* dir = ::opendir(directory.c_str());
+    if (dir) {
+      const auto closedir_guard = MakeScopeGuard([dir]() { ::closedir(dir); });
+      const int directory_fd = ::dirfd(dir);
+      while (const struct dirent* entry = ::readdir(dir)) {
+        const char* name = entry->d_name;
+        if (*name && !(name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))) {
+          const DirectoryEntry current(directory_fd, entry);
+          if (!f(current)) {
+            return;
+          }
+        }
+      }
+    }
+  }
+
+  static inline bool FileExists(const std::string& file_name) {
+    struct stat info;
+    return !::stat(file_name.c_str(), &info);
+  }
+
   static inline uint64_t GetFileSize(const std::string& file_name) {
     struct stat info;
     if (stat(file_name.c_str(), &info)) {
@@ -166,12 +679,52 @@ struct FileSystem {
     }
   }
 
+  static inline void TruncateFile(const std::string& file_name, uint64_t size) {
+    if (::truncate(file_name.c_str(), static_cast<off_t>(size))) {
+      // TODO(dkorolev): Throw an exception and analyze errno.
+    }
+  }
+
   static inline void CreateDirectory(const std::string& directory) {
     // Hard-code default permissions to avoid cross-platform compatibility issues.
     ::mkdir(directory.c_str(), 0755);
   }
 };
 
+// The filesystem wrapper with files appended to via `PosixOutputFile`.
+struct PosixFileSystem : FileSystem {
+  typedef PosixOutputFile OutputFile;
+
+  // Renames the file and empties it, keeping its disk space reserved on Linux, for it to be appended to again.
+  static inline void RecycleFile(const std::string& file_name, const std::string& new_file_name) {
+    const uint64_t size = GetFileSize(file_name);
+    RenameFile(file_name, new_file_name);
+    const int fd = ::open(new_file_name.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+    if (fd >= 0) {
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+      ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size));
+#else
+      static_cast<void>(size);
+#endif
+      ::close(fd);
+    }
+  }
+
+  // Has the kernel start reading the file into the page cache in the background, for it to be read warm.
+  // Only where `posix_fadvise()` is available, a no-op elsewhere.
+  static inline void PrefetchFile(const std::string& file_name) {
+#if defined(POSIX_FADV_WILLNEED)
+    const int fd = ::open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+      ::close(fd);
+    }
+#else
+    static_cast<void>(file_name);
+#endif
+  }
+};
+
 }  // namespace bricks
 
 #endif  // BRICKS_FILE_FILE_H
@@ -0,0 +1,77 @@
+// An advisory exclusive lock on a file, with `flock()`, for processes to agree on which one of them
+// owns a shared resource, such as a directory. The lock is held by the open file description, thus is
+// released once the process holding it exits, crashes included, and two `FileLock`-s of one process
+// on the same file exclude each other, as two processes would.
+
+#ifndef BRICKS_FILE_FILE_LOCK_H
+#define BRICKS_FILE_FILE_LOCK_H
+
+#include <cerrno>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "exceptions.h"
+
+namespace bricks {
+
+class FileLock final {
+ public:
+  // Creates the file if it does not exist, and does not lock it yet. Throws `FileException` if it can not.
+  explicit FileLock(const std::string& file_name) : fd_(::open(file_name.c_str(), O_RDWR | O_CREAT, 0644)) {
+    if (fd_ < 0) {
+      throw FileException();
+    }
+    ::fcntl(fd_, F_SETFD, FD_CLOEXEC);
+  }
+
+  ~FileLock() { ::close(fd_); }
+
+  // Returns false right away if the file is locked by someone else.
+  bool TryLock() {
+    if (!locked_) {
+      locked_ = !Flock(LOCK_EX | LOCK_NB);
+    }
+    return locked_;
+  }
+
+  // Waits for the file to be unlocked by whoever holds it. Throws `FileException` on errors.
+  void Lock() {
+    if (!locked_) {
+      if (Flock(LOCK_EX)) {
+        throw FileException();
+      }
+      locked_ = true;
+    }
+  }
+
+  void Unlock() {
+    if (locked_) {
+      Flock(LOCK_UN);
+      locked_ = false;
+    }
+  }
+
+  bool Locked() const { return locked_; }
+
+ private:
+  int Flock(int operation) {
+    int result;
+    do {
+      result = ::flock(fd_, operation);
+    } while (result && errno == EINTR);
+    return result;
+  }
+
+  const int fd_;
+  bool locked_ = false;
+
+  FileLock(const FileLock&) = delete;
+  void operator=(const FileLock&) = delete;
+};
+
+}  // namespace bricks
+
+#endif  // BRICKS_FILE_FILE_LOCK_H
@@ -0,0 +1,322 @@
+// In-memory drop-in replacement for `FileSystem`, to run the code written against its static interface,
+// such as FSQ, with no disk involved: in tests, and to benchmark the CPU overhead of the code itself.
+//
+// The files are kept in a process-wide hash map, keyed by the full path name and split into shards,
+// each guarded by a mutex of its own. Directories are implicit: `ScanDir()` lists the files whose path
+// is the directory name followed by a slash and the file name, and `CreateDirectory()` does nothing.
+// `MappedFile` holds a copy of the contents of the file as of its construction.
+//
+// `InMemoryFileSystem::Settings()` injects latency into, and makes fail, a fraction of the operations,
+// to profile or test the code under a slow or flaky file system. All operations are THREAD SAFE.
+
+#ifndef BRICKS_FILE_IN_MEMORY_FILE_SYSTEM_H
+#define BRICKS_FILE_IN_MEMORY_FILE_SYSTEM_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <ios>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "exceptions.h"
+#include "file.h"
+
+namespace bricks {
+
+struct InMemoryFileSystem {
+  // Latency and failure injection, applied to each operation on files, zeroes to disable.
+  struct InjectedFaults {
+    // The delay, in microseconds, to add to each operation.
+    std::atomic<uint64_t> latency_us;
+    // Every `fail_every_n_operations`-th operation fails: reads and renames throw `FileException`,
+    // and the output file goes `bad()`.
+    std::atomic<uint64_t> fail_every_n_operations;
+    std::atomic<uint64_t> operations;
+    InjectedFaults() : latency_us(0), fail_every_n_operations(0), operations(0) {
+    }
+  };
+  static InjectedFaults& Settings() {
+    static InjectedFaults settings;
+    return settings;
+  }
+
+  class OutputFile final {
+   public:
+    explicit OutputFile(const std::string& file_name, std::ios_base::openmode mode = std::ios_base::out)
+        : file_name_(file_name) {
+      if (InjectFaults()) {
+        bad_ = true;
+        return;
+      }
+      Storage::Shard& shard = Storage::ShardOf(file_name_);
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      std::string& contents = shard.files[file_name_];
+      if (!(mode & std::ios_base::app)) {
+        contents.clear();
+      }
+    }
+    OutputFile& write(const char* data, std::streamsize length) {
+      if (!bad_) {
+        if (InjectFaults()) {
+          bad_ = true;
+        } else {
+          Storage::Shard& shard = Storage::ShardOf(file_name_);
+          std::lock_guard<std::mutex> lock(shard.mutex);
+          const auto cit = shard.files.find(file_name_);
+          if (cit != shard.files.end()) {
+            cit->second.append(data, static_cast<size_t>(length));
+          } else {
+            // The file has been removed or renamed while open.
+            bad_ = true;
+          }
+        }
+      }
+      return *this;
+    }
+    OutputFile& flush() {
+      return *this;
+    }
+    bool bad() const {
+      return bad_;
+    }
+
+   private:
+    OutputFile(const OutputFile&) = delete;
+    void operator=(const OutputFile&) = delete;
+
+    const std::string file_name_;
+    bool bad_ = false;
+  };
+
+  class MappedFile final {
+   public:
+    explicit MappedFile(const std::string& file_name) : contents_(ReadFileAsString(file_name)) {
+    }
+    const char* data() const {
+      return contents_.empty() ? nullptr : contents_.data();
+    }
+    size_t size() const {
+      return contents_.size();
+    }
+
+   private:
+    MappedFile(const MappedFile&) = delete;
+    void operator=(const MappedFile&) = delete;
+
+    const std::string contents_;
+  };
+
+  static inline std::string ReadFileAsString(const std::string& file_name) {
+    if (InjectFaults()) {
+      throw FileException();
+    }
+    Storage::Shard& shard = Storage::ShardOf(file_name);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto cit = shard.files.find(file_name);
+    if (cit == shard.files.end()) {
+      throw FileException();
+    }
+    return cit->second;
+  }
+
+  static inline void WriteStringToFile(const std::string& file_name,
+                                       const std::string& contents,
+                                       bool append = false) {
+    if (InjectFaults()) {
+      throw FileException();
+    }
+    Storage::Shard& shard = Storage::ShardOf(file_name);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    std::string& file = shard.files[file_name];
+    if (append) {
+      file += contents;
+    } else {
+      file = contents;
+    }
+  }
+
+  // Replacing the contents under the lock of the shard is atomic as is, and there is no disk to sync.
+  static inline void WriteFileAtomically(
+      const std::string& file_name,
+      const std::string& contents,
+      WriteFileAtomicallyParameters = WriteFileAtomicallyParameters::Durable) {
+    WriteStringToFile(file_name, contents);
+  }
+
+  static inline std::string JoinPath(const std::string& path_name, const std::string& base_name) {
+    return FileSystem::JoinPath(path_name, base_name);
+  }
+
+  static inline void RenameFile(const std::string& old_name, const std::string& new_name) {
+    if (InjectFaults()) {
+      throw FileException();
+    }
+    Storage::Shard& from = Storage::ShardOf(old_name);
+    Storage::Shard& to = Storage::ShardOf(new_name);
+    // Lock the two shards in a fixed order, to not deadlock with a concurrent rename the other way.
+    std::unique_lock<std::mutex> first((&from < &to ? from : to).mutex);
+    std::unique_lock<std::mutex> second;
+    if (&from != &to) {
+      second = std::unique_lock<std::mutex>((&from < &to ? to : from).mutex);
+    }
+    const auto it = from.files.find(old_name);
+    if (it == from.files.end()) {
+      throw FileException();
+    }
+    std::string contents = std::move(it->second);
+    from.files.erase(it);
+    to.files[new_name] = std::move(contents);
+  }
+
+  // Renames the file and empties it, for it to be appended to again.
+  static inline void RecycleFile(const std::string& file_name, const std::string& new_file_name) {
+    RenameFile(file_name, new_file_name);
+    TruncateFile(new_file_name, 0);
+  }
+
+  static inline void RemoveFile(const std::string& file_name,
+                                RemoveFileParameters parameters = RemoveFileParameters::ThrowExceptionOnError) {
+    Storage::Shard& shard = Storage::ShardOf(file_name);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (!shard.files.erase(file_name) && parameters == RemoveFileParameters::ThrowExceptionOnError) {
+      throw FileException();
+    }
+  }
+
+  static inline void ScanDirUntil(const std::string& directory,
+                                  std::function<bool(const std::string&)> lambda) {
+    // Collect the names first, for `lambda` to be free to operate on the files.
+    std::vector<std::string> names;
+    const std::string prefix = JoinPath(directory, "");
+    for (Storage::Shard& shard : Storage::Singleton().shards) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      for (const auto& file : shard.files) {
+        const std::string& name = file.first;
+        if (name.length() > prefix.length() && !name.compare(0, prefix.length(), prefix) &&
+            name.find('/', prefix.length()) == std::string::npos) {
+          names.push_back(name.substr(prefix.length()));
+        }
+      }
+    }
+    for (const std::string& name : names) {
+      if (!lambda(name)) {
+        return;
+      }
+    }
+  }
+
+  // The counterpart of `PosixDirectoryEntry`, with the size of the file as of the scan.
+  struct DirectoryEntry {
+    DirectoryEntry(const std::string& name, uint64_t size)
+        : name(name.c_str()), name_length(name.length()), size_(size) {
+    }
+    const char* const name;
+    const size_t name_length;
+    DirectoryEntryType Type() const { return DirectoryEntryType::RegularFile; }
+    bool IsRegularFile() const { return true; }
+    uint64_t Size() const { return size_; }
+    uint64_t ModificationTimeMilliseconds() const { return 0; }
+
+   private:
+    const uint64_t size_;
+  };
+
+  template <typename F>
+  static inline void ScanDirEntriesUntil(const std::string& directory, F&& f) {
+    std::vector<std::pair<std::string, uint64_t>> files;
+    const std::string prefix = JoinPath(directory, "");
+    for (Storage::Shard& shard : Storage::Singleton().shards) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      for (const auto& file : shard.files) {
+        const std::string& name = file.first;
+        if (name.length() > prefix.length() && !name.compare(0, prefix.length(), prefix) &&
+            name.find('/', prefix.length()) == std::string::npos) {
+          files.emplace_back(name.substr(prefix.length()), file.second.length());
+        }
+      }
+    }
+    for (const auto& file : files) {
+      if (!f(DirectoryEntry(file.first, file.second))) {
+        return;
+      }
+    }
+  }
+
+  static inline void ScanDir(const std::string& directory, std::function<void(const std::string&)> lambda) {
+    ScanDirUntil(directory, [lambda](const std::string& filename) {
+      lambda(filename);
+      return true;
+    });
+  }
+
+  static inline bool FileExists(const std::string& file_name) {
+    Storage::Shard& shard = Storage::ShardOf(file_name);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.files.count(file_name) != 0;
+  }
+
+  static inline uint64_t GetFileSize(const std::string& file_name) {
+    Storage::Shard& shard = Storage::ShardOf(file_name);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto cit = shard.files.find(file_name);
+    return cit != shard.files.end() ? static_cast<uint64_t>(cit->second.size()) : 0;
+  }
+
+  static inline void TruncateFile(const std::string& file_name, uint64_t size) {
+    Storage::Shard& shard = Storage::ShardOf(file_name);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto it = shard.files.find(file_name);
+    if (it != shard.files.end()) {
+      it->second.resize(static_cast<size_t>(size));
+    }
+  }
+
+  static inline void CreateDirectory(const std::string&) {
+  }
+
+  // Removes all the files. For the tests to start from scratch.
+  static inline void RemoveAllFiles() {
+    for (Storage::Shard& shard : Storage::Singleton().shards) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.files.clear();
+    }
+  }
+
+ private:
+  struct Storage {
+    enum { kNumberOfShards = 16 };
+    struct Shard {
+      std::mutex mutex;
+      std::unordered_map<std::string, std::string> files;
+    };
+    Shard shards[kNumberOfShards];
+
+    static Storage& Singleton() {
+      static Storage storage;
+      return storage;
+    }
+    static Shard& ShardOf(const std::string& file_name) {
+      return Singleton().shards[std::hash<std::string>()(file_name) % kNumberOfShards];
+    }
+  };
+
+  // Sleeps for the injected latency, and returns true if this operation should fail.
+  static bool InjectFaults() {
+    InjectedFaults& settings = Settings();
+    const uint64_t latency_us = settings.latency_us;
+    if (latency_us) {
+      std::this_thread::sleep_for(std::chrono::microseconds(latency_us));
+    }
+    const uint64_t n = settings.fail_every_n_operations;
+    return n && (++settings.operations % n) == 0;
+  }
+};
+
+}  // namespace bricks
+
+#endif  // BRICKS_FILE_IN_MEMORY_FILE_SYSTEM_H
@@ -0,0 +1,120 @@
+// The bulk logging bridge: the events logged on the Java side reach the native code in batches, through a ring
+// in a direct `ByteBuffer`, rather than one JNI call and one `jstring` conversion each.
+//
+// The Java side allocates the ring with `ByteBuffer.allocateDirect(capacity).order(ByteOrder.nativeOrder())`,
+// writes the events into it, and, once it runs out of room, or once in a while, such as on a timer, calls
+// a native method of its own with the ring and the two positions, which drains the events with
+// `DrainEventRing()`. The positions are the numbers of bytes written into the ring and read out of it so far,
+// and the offset of a position in the ring is the position modulo its capacity. Each event is its length,
+// as a native order 32-bit integer, followed by its bytes. An event never wraps around the end of the ring:
+// if there is less room than it needs till the end, the writer marks the rest as skipped with the length of -1,
+// unless fewer than four bytes are left, and writes the event at offset zero, counting the skipped bytes
+// into its position. Once the ring is drained, both positions may start over at the next offset zero instead:
+//
+//   synchronized void log(byte[] event) {  // With `4 + event.length <= capacity`.
+//     final int needed = 4 + event.length;
+//     long offset = write % capacity;
+//     final long skip = capacity - offset < needed ? capacity - offset : 0;
+//     if (capacity - (write - read) < skip + needed) {
+//       read = nativeDrainEvents(ring, read, write);  // Returns `write`, the ring is empty.
+//       read = write = write + skip;
+//     } else if (skip > 0) {
+//       if (skip >= 4) { ring.putInt((int) offset, -1); }
+//       write += skip;
+//     }
+//     offset = write % capacity;
+//     ring.putInt((int) offset, event.length);
+//     ring.position((int) offset + 4);
+//     ring.put(event);
+//     write += needed;
+//   }
+//
+// The native method returns the position it has read up to, for the Java side to reuse the room,
+// and passes each event on, with no copies, to a callback, which typically pushes it into the queue
+// feeding the FSQ, as `EfficientMQ::EmplaceMessage()` does with no allocations in the steady state:
+//
+//   extern "C" JNIEXPORT jlong JNICALL Java_org_alohalytics_Statistics_nativeDrainEvents(
+//       JNIEnv* env, jclass, jobject ring, jlong read, jlong write) {
+//     return bricks::java_wrapper::DrainEventRing(env, ring, read, write, [](const char* data, size_t length) {
+//       mq.EmplaceMessage(length, [=](std::string& event) { std::memcpy(&event[0], data, length); });
+//     });
+//   }
+//
+// The events are drained on the thread of the Java side calling the native method, synchronized with its
+// writes by the call itself. A corrupted ring, with a length that does not fit what has been written,
+// has the rest of it skipped, up to `write`, for the Java side to go on from there.
+//
+// The JNI overload is only there on Java and Android. The one taking the bytes of the ring builds anywhere,
+// which is how `test.cc` exercises it.
+
+#ifndef BRICKS_JAVA_WRAPPER_EVENT_RING_H
+#define BRICKS_JAVA_WRAPPER_EVENT_RING_H
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#include "../port.h"
+
+#if defined(BRICKS_JAVA) || defined(BRICKS_ANDROID)
+#include "java_wrapper.h"
+#endif
+
+namespace bricks {
+namespace java_wrapper {
+
+// The length of the event that marks the rest of the ring till its end as skipped.
+const std::int32_t kEventRingSkipToStart = -1;
+
+// Calls `f(const char* data, size_t length)` for each event of the ring of `capacity` bytes at `ring`
+// between `read` and `write`. Returns the position up to which the events have been read, which is `write`.
+template <typename F>
+inline std::uint64_t DrainEventRing(const char* ring,
+                                    std::uint64_t capacity,
+                                    std::uint64_t read,
+                                    std::uint64_t write,
+                                    F&& f) {
+  while (read < write) {
+    const std::uint64_t offset = read % capacity;
+    const std::uint64_t till_end = capacity - offset;
+    if (till_end < sizeof(std::int32_t)) {
+      read += till_end;
+      continue;
+    }
+    std::int32_t length;
+    std::memcpy(&length, ring + offset, sizeof(length));
+    if (length == kEventRingSkipToStart) {
+      read += till_end;
+      continue;
+    }
+    const std::uint64_t event_size = sizeof(length) + static_cast<std::uint64_t>(length);
+    if (length < 0 || event_size > till_end || event_size > write - read) {
+      return write;  // Corrupted, see the top of this file.
+    }
+    f(ring + offset + sizeof(length), static_cast<size_t>(length));
+    read += event_size;
+  }
+  return write;
+}
+
+#if defined(BRICKS_JAVA) || defined(BRICKS_ANDROID)
+// The same for the direct `ByteBuffer` `ring` of the Java side. Returns `read` as is if it is not a direct one.
+template <typename F>
+inline jlong DrainEventRing(JNIEnv* env, jobject ring, jlong read, jlong write, F&& f) {
+  const char* data = static_cast<const char*>(env->GetDirectBufferAddress(ring));
+  const jlong capacity = env->GetDirectBufferCapacity(ring);
+  if (!data || capacity <= 0 || read < 0 || write < read) {
+    return read;
+  }
+  return static_cast<jlong>(DrainEventRing(data,
+                                           static_cast<std::uint64_t>(capacity),
+                                           static_cast<std::uint64_t>(read),
+                                           static_cast<std::uint64_t>(write),
+                                           std::forward<F>(f)));
+}
+#endif
+
+}  // namespace java_wrapper
+}  // namespace bricks
+
+#endif  // BRICKS_JAVA_WRAPPER_EVENT_RING_H
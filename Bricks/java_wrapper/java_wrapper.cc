@@ -6,6 +6,13 @@ extern "C" {
 JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void*) {
   auto& JAVA = bricks::java_wrapper::JavaWrapper::Singleton();
   JAVA.jvm = vm;
+  JNIEnv* env;
+  if (JNI_OK != vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6)) {
+    return JNI_ERR;
+  }
+  // Resolve everything the HTTP client needs once, instead of on each request. Without the transport classes,
+  // the HTTP requests fail, while the rest of the library still works.
+  bricks::java_wrapper::JavaWrapper::ResolveHTTPTransport(env);
   return JNI_VERSION_1_6;
 }
 }  // extern "C"
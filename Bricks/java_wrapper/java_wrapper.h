@@ -34,19 +34,98 @@
 namespace bricks {
 namespace java_wrapper {
 
+// The Java side of the HTTP client: a `Params` class, constructed from the URL, passed to and returned by
+// the static `run()` method of the transport class. Override the names to use classes of another package.
+#ifndef BRICKS_JAVA_HTTP_TRANSPORT_CLASS
+#define BRICKS_JAVA_HTTP_TRANSPORT_CLASS "org/alohalytics/HttpTransport"
+#endif
+#ifndef BRICKS_JAVA_HTTP_PARAMS_CLASS
+#define BRICKS_JAVA_HTTP_PARAMS_CLASS BRICKS_JAVA_HTTP_TRANSPORT_CLASS "$Params"
+#endif
+
 struct JavaWrapper {
+  // All the classes, methods and fields are resolved once, in `JNI_OnLoad()`, see `ResolveHTTPTransport()`.
   struct Instance {
     JavaVM* jvm = nullptr;
     jclass httpParamsClass = 0;
     jmethodID httpParamsConstructor = 0;
     jclass httpTransportClass = 0;
     jmethodID httpTransportClass_run = 0;
+    jfieldID dataField = 0;
+    // `java.nio.ByteBuffer dataBuffer`, if the Java side has it: the direct buffers the bodies are passed in
+    // with no copies through `byte[]`, see `net/api/impl/java.h`. Zero if it does not, and `data` is used.
+    jfieldID dataBufferField = 0;
+    jmethodID byteBufferLimit = 0;
+    jfieldID contentTypeField = 0;
+    jfieldID userAgentField = 0;
+    jfieldID inputFilePathField = 0;
+    jfieldID outputFilePathField = 0;
+    jfieldID httpResponseCodeField = 0;
+    jfieldID receivedUrlField = 0;
   };
 
   static Instance& Singleton() {
     static Instance instance;
     return instance;
   }
+
+  // Resolves the HTTP transport classes and the IDs of their members, holding global references
+  // to the classes. Returns false, with the exception cleared, if the required ones can not be found.
+  static bool ResolveHTTPTransport(JNIEnv* env) {
+    Instance& JAVA = Singleton();
+    const auto resolve_class = [env](const char* name) -> jclass {
+      const jclass local = env->FindClass(name);
+      if (!local) {
+        return 0;
+      }
+      const jclass global = static_cast<jclass>(env->NewGlobalRef(local));
+      env->DeleteLocalRef(local);
+      return global;
+    };
+    JAVA.httpParamsClass = resolve_class(BRICKS_JAVA_HTTP_PARAMS_CLASS);
+    CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+    JAVA.httpTransportClass = resolve_class(BRICKS_JAVA_HTTP_TRANSPORT_CLASS);
+    CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+    if (!JAVA.httpParamsClass || !JAVA.httpTransportClass) {
+      return false;
+    }
+    JAVA.httpParamsConstructor = env->GetMethodID(JAVA.httpParamsClass, "<init>", "(Ljava/lang/String;)V");
+    CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+    JAVA.httpTransportClass_run =
+        env->GetStaticMethodID(JAVA.httpTransportClass,
+                               "run",
+                               "(L" BRICKS_JAVA_HTTP_PARAMS_CLASS ";)L" BRICKS_JAVA_HTTP_PARAMS_CLASS ";");
+    CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+    const auto field = [env, &JAVA](const char* name, const char* signature) {
+      return env->GetFieldID(JAVA.httpParamsClass, name, signature);
+    };
+    JAVA.dataField = field("data", "[B");
+    CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+    JAVA.contentTypeField = field("contentType", "Ljava/lang/String;");
+    CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+    JAVA.userAgentField = field("userAgent", "Ljava/lang/String;");
+    CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+    JAVA.inputFilePathField = field("inputFilePath", "Ljava/lang/String;");
+    CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+    JAVA.outputFilePathField = field("outputFilePath", "Ljava/lang/String;");
+    CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+    JAVA.httpResponseCodeField = field("httpResponseCode", "I");
+    CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+    JAVA.receivedUrlField = field("receivedUrl", "Ljava/lang/String;");
+    CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+    // Optional, the older Java sides only have `byte[] data`.
+    JAVA.dataBufferField = field("dataBuffer", "Ljava/nio/ByteBuffer;");
+    if (env->ExceptionCheck()) {
+      env->ExceptionClear();
+      JAVA.dataBufferField = 0;
+    }
+    const jclass buffer_class = env->FindClass("java/nio/Buffer");
+    CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+    JAVA.byteBufferLimit = env->GetMethodID(buffer_class, "limit", "()I");
+    env->DeleteLocalRef(buffer_class);
+    CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+    return true;
+  }
 };
 
 inline std::string ToStdString(JNIEnv* env, jstring str) {
@@ -0,0 +1,136 @@
+#include "event_ring.h"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../3party/gtest/gtest.h"
+#include "../3party/gtest/gtest-main.h"
+
+using bricks::java_wrapper::DrainEventRing;
+using bricks::java_wrapper::kEventRingSkipToStart;
+
+namespace {
+
+// The Java side of the ring, as in the comment at the top of `event_ring.h`, with no JNI in between.
+struct EventRing {
+  std::vector<char> ring;
+  std::uint64_t read = 0;
+  std::uint64_t write = 0;
+  std::vector<std::string> events;
+
+  explicit EventRing(size_t capacity) : ring(capacity, '\x7f') {}
+
+  void Log(const std::string& event) {
+    const std::uint64_t capacity = ring.size();
+    const std::uint64_t needed = 4 + event.length();
+    std::uint64_t offset = write % capacity;
+    const std::uint64_t skip = capacity - offset < needed ? capacity - offset : 0;
+    if (capacity - (write - read) < skip + needed) {
+      Drain();
+      read = write = write + skip;
+    } else if (skip > 0) {
+      if (skip >= 4) {
+        PutInt(offset, kEventRingSkipToStart);
+      }
+      write += skip;
+    }
+    offset = write % capacity;
+    PutInt(offset, static_cast<std::int32_t>(event.length()));
+    std::memcpy(&ring[offset + 4], event.data(), event.length());
+    write += needed;
+  }
+
+  void Drain() {
+    read = DrainEventRing(&ring[0],
+                          ring.size(),
+                          read,
+                          write,
+                          [this](const char* data, size_t length) { events.emplace_back(data, length); });
+  }
+
+  void PutInt(std::uint64_t offset, std::int32_t value) { std::memcpy(&ring[offset], &value, sizeof(value)); }
+
+  std::int32_t GetInt(std::uint64_t offset) const {
+    std::int32_t value;
+    std::memcpy(&value, &ring[offset], sizeof(value));
+    return value;
+  }
+};
+
+}  // namespace
+
+TEST(EventRing, DrainsTheEventsInOrder) {
+  EventRing ring(64);
+  ring.Log("foo");
+  ring.Log("");
+  ring.Log("bar");
+  ring.Drain();
+  EXPECT_EQ(std::vector<std::string>({"foo", "", "bar"}), ring.events);
+  EXPECT_EQ(ring.write, ring.read);
+  ring.Drain();
+  EXPECT_EQ(3u, ring.events.size());
+}
+
+TEST(EventRing, SkipsToTheStartPastTheMarker) {
+  EventRing ring(32);
+  ring.Log("0123456789");
+  ring.Log("abcdefghij");
+  ring.Drain();
+  EXPECT_EQ(28u, ring.read);
+  ring.Log("ABCDEFGHIJ");
+  EXPECT_EQ(kEventRingSkipToStart, ring.GetInt(28));
+  EXPECT_EQ(46u, ring.write);
+  ring.Drain();
+  EXPECT_EQ(std::vector<std::string>({"0123456789", "abcdefghij", "ABCDEFGHIJ"}), ring.events);
+  EXPECT_EQ(46u, ring.read);
+}
+
+TEST(EventRing, SkipsTheTailOfFewerThanFourBytes) {
+  EventRing ring(32);
+  ring.Log("012345678901");
+  ring.Log("abcdefghij");
+  ring.Drain();
+  EXPECT_EQ(30u, ring.read);
+  ring.Log("ABCD");
+  // No room for the marker, the two bytes at the end are left as they were.
+  EXPECT_EQ('\x7f', ring.ring[30]);
+  EXPECT_EQ('\x7f', ring.ring[31]);
+  EXPECT_EQ(40u, ring.write);
+  ring.Drain();
+  EXPECT_EQ(std::vector<std::string>({"012345678901", "abcdefghij", "ABCD"}), ring.events);
+  EXPECT_EQ(40u, ring.read);
+}
+
+TEST(EventRing, WrapsAround) {
+  EventRing ring(64);
+  std::vector<std::string> expected;
+  for (int i = 0; i < 10000; ++i) {
+    expected.push_back(std::string(static_cast<size_t>(i * 7 % 41), static_cast<char>('a' + i % 26)));
+    ring.Log(expected.back());
+    if (i % 13 == 0) {
+      ring.Drain();
+    }
+  }
+  ring.Drain();
+  EXPECT_GT(ring.write, 100u * 64u);
+  EXPECT_EQ(expected, ring.events);
+}
+
+TEST(EventRing, SkipsTheRestOfACorruptedRing) {
+  for (std::int32_t corrupted : {-2, 28, 1000}) {
+    EventRing ring(64);
+    ring.Log("foo");
+    ring.Log("bar");
+    ring.Log("baz");
+    // The length of "bar" longer than what has been written, beyond the end of the ring, or negative.
+    ring.PutInt(7, corrupted);
+    ring.Drain();
+    EXPECT_EQ(std::vector<std::string>({"foo"}), ring.events) << corrupted;
+    EXPECT_EQ(ring.write, ring.read) << corrupted;
+    ring.Log("meh");
+    ring.Drain();
+    EXPECT_EQ(std::vector<std::string>({"foo", "meh"}), ring.events) << corrupted;
+  }
+}
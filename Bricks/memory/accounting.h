@@ -0,0 +1,139 @@
+// Accounting of the memory of the subsystems, to size the queues and the buffers by what they actually hold.
+//
+// `AccountedMemoryResource` forwards to its upstream resource and counts the bytes it has handed out, and not
+// returned yet, per subsystem, such as "mq_efficient", and, optionally, per instance of it, such as "uploads".
+// The counts are the metrics of `bricks::metrics::Registry::Singleton()`:
+// * `bricks_memory_<subsystem>_bytes`, the bytes in use by all the resources of the subsystem,
+// * `bricks_memory_<subsystem>_allocations_total`, the allocations made from them, and
+// * `bricks_memory_<subsystem>_<instance>_bytes`, the bytes in use by the resources of the instance,
+// with the characters not valid in the names of the metrics replaced by '_'.
+//
+//   bricks::memory::AccountedMemoryResource memory("mq_efficient", "uploads");
+//   EfficientMQ<Consumer> mq(consumer, kBufferSize, &memory);
+//
+// The subsystems of Bricks allocate from `SubsystemMemoryResource()`-s by default, which account for
+// the subsystem as a whole: `EfficientMQ` its circular buffer, FSQ the list of its finalized files,
+// `HTTPReceivedMessage` its buffer, and `CerealArena` its blocks. Each allocation costs a few relaxed
+// atomic increments on top of the upstream one. THREAD SAFE if the upstream resource is.
+
+#ifndef BRICKS_MEMORY_ACCOUNTING_H
+#define BRICKS_MEMORY_ACCOUNTING_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "memory_resource.h"
+
+#include "../metrics/metrics.h"
+
+namespace bricks {
+namespace memory {
+
+class AccountedMemoryResource final : public MemoryResource {
+ public:
+  explicit AccountedMemoryResource(const std::string& subsystem,
+                                   const std::string& instance = "",
+                                   MemoryResource* upstream = NewDeleteResource(),
+                                   metrics::Registry& registry = metrics::Registry::Singleton())
+      : upstream_(upstream),
+        subsystem_bytes_(registry.GetGauge(MetricName(subsystem, "", "bytes"),
+                                           "The bytes of memory in use by the " + subsystem + " subsystem.")),
+        subsystem_allocations_(registry.GetCounter(MetricName(subsystem, "", "allocations_total"),
+                                                   "The allocations made by the " + subsystem + " subsystem.")),
+        instance_bytes_(instance.empty() ? nullptr
+                                         : &registry.GetGauge(MetricName(subsystem, instance, "bytes"),
+                                                              "The bytes of memory in use by " + instance +
+                                                                  " of the " + subsystem + " subsystem.")) {}
+
+  // The memory still in use is no longer accounted for, though it should have been returned by now.
+  ~AccountedMemoryResource() {
+    const int64_t bytes = static_cast<int64_t>(bytes_in_use_.load(std::memory_order_relaxed));
+    subsystem_bytes_.Add(-bytes);
+    if (instance_bytes_) {
+      instance_bytes_->Add(-bytes);
+    }
+  }
+
+  MemoryResource* UpstreamResource() const { return upstream_; }
+
+  // The bytes handed out by this resource, and not returned yet, and the most there have been at once.
+  size_t BytesInUse() const { return bytes_in_use_.load(std::memory_order_relaxed); }
+  size_t PeakBytesInUse() const { return peak_bytes_in_use_.load(std::memory_order_relaxed); }
+  uint64_t Allocations() const { return allocations_.load(std::memory_order_relaxed); }
+
+  // "bricks_memory_<subsystem>[_<instance>]_<suffix>", with the invalid characters replaced.
+  static std::string MetricName(const std::string& subsystem,
+                                const std::string& instance,
+                                const std::string& suffix) {
+    std::string name = "bricks_memory_" + subsystem + (instance.empty() ? "" : "_" + instance) + '_' + suffix;
+    for (char& c : name) {
+      if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_')) {
+        c = '_';
+      }
+    }
+    return name;
+  }
+
+ private:
+  void* DoAllocate(size_t bytes, size_t alignment) override {
+    void* p = upstream_->Allocate(bytes, alignment);
+    const size_t in_use = bytes_in_use_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    size_t peak = peak_bytes_in_use_.load(std::memory_order_relaxed);
+    while (in_use > peak &&
+           !peak_bytes_in_use_.compare_exchange_weak(peak, in_use, std::memory_order_relaxed)) {
+    }
+    allocations_.fetch_add(1, std::memory_order_relaxed);
+    subsystem_bytes_.Add(static_cast<int64_t>(bytes));
+    subsystem_allocations_.Increment();
+    if (instance_bytes_) {
+      instance_bytes_->Add(static_cast<int64_t>(bytes));
+    }
+    return p;
+  }
+
+  void DoDeallocate(void* p, size_t bytes, size_t alignment) override {
+    upstream_->Deallocate(p, bytes, alignment);
+    bytes_in_use_.fetch_sub(bytes, std::memory_order_relaxed);
+    subsystem_bytes_.Add(-static_cast<int64_t>(bytes));
+    if (instance_bytes_) {
+      instance_bytes_->Add(-static_cast<int64_t>(bytes));
+    }
+  }
+
+  // Each resource accounts for the memory it has handed out itself.
+  bool DoIsEqual(const MemoryResource&) const override { return false; }
+
+  MemoryResource* const upstream_;
+  metrics::Gauge& subsystem_bytes_;
+  metrics::Counter& subsystem_allocations_;
+  metrics::Gauge* const instance_bytes_;
+  std::atomic_size_t bytes_in_use_{0};
+  std::atomic_size_t peak_bytes_in_use_{0};
+  std::atomic<uint64_t> allocations_{0};
+
+  AccountedMemoryResource(const AccountedMemoryResource&) = delete;
+  void operator=(const AccountedMemoryResource&) = delete;
+};
+
+// The resource of the subsystem as a whole, over `NewDeleteResource()`, created on the first call for it,
+// and never destructed, for the objects destructed at exit to still return their memory to it.
+// Takes a mutex: keep the pointer, as the subsystems of Bricks do in function-local statics.
+inline AccountedMemoryResource* SubsystemMemoryResource(const std::string& subsystem) {
+  static std::mutex* mutex = new std::mutex();
+  static std::map<std::string, AccountedMemoryResource*>* resources =
+      new std::map<std::string, AccountedMemoryResource*>();
+  std::lock_guard<std::mutex> lock(*mutex);
+  AccountedMemoryResource*& resource = (*resources)[subsystem];
+  if (!resource) {
+    resource = new AccountedMemoryResource(subsystem);
+  }
+  return resource;
+}
+
+}  // namespace memory
+}  // namespace bricks
+
+#endif  // BRICKS_MEMORY_ACCOUNTING_H
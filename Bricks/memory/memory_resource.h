@@ -0,0 +1,231 @@
+// Polymorphic memory resources, the C++11 counterpart of `std::pmr`: `MemoryResource` is where the memory
+// comes from, and `PolymorphicAllocator<T>` is the allocator that draws on the resource it was given.
+// The type of a container does not depend on the resource, so the same code serves the containers
+// backed by the global heap, by a per-request arena, or by a pool.
+//
+// The classes that take a `MemoryResource*` default to `NewDeleteResource()`, the global `operator new`.
+// `MonotonicBufferResource` is the arena: it hands out memory from the blocks it allocates upstream,
+// ignores deallocation, and frees all the blocks at once, which suits the memory of one request.
+//
+// As with `std::pmr`, the resource must outlive the containers using it, the copies of the containers
+// are backed by `NewDeleteResource()` unless given a resource explicitly, and the elements that are
+// allocator-aware themselves, such as `bricks::memory::String`, are constructed with the same resource.
+// The resources are not thread safe unless stated otherwise.
+
+#ifndef BRICKS_MEMORY_MEMORY_RESOURCE_H
+#define BRICKS_MEMORY_MEMORY_RESOURCE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace bricks {
+namespace memory {
+
+enum { kDefaultAlignment = alignof(std::max_align_t) };
+
+class MemoryResource {
+ public:
+  virtual ~MemoryResource() = default;
+
+  void* Allocate(size_t bytes, size_t alignment = kDefaultAlignment) { return DoAllocate(bytes, alignment); }
+  void Deallocate(void* p, size_t bytes, size_t alignment = kDefaultAlignment) {
+    DoDeallocate(p, bytes, alignment);
+  }
+  // Whether the memory allocated from one resource can be deallocated by the other.
+  bool IsEqual(const MemoryResource& other) const { return this == &other || DoIsEqual(other); }
+
+ private:
+  virtual void* DoAllocate(size_t bytes, size_t alignment) = 0;
+  virtual void DoDeallocate(void* p, size_t bytes, size_t alignment) = 0;
+  virtual bool DoIsEqual(const MemoryResource& other) const = 0;
+};
+
+// THREAD SAFE.
+class NewDeleteMemoryResource final : public MemoryResource {
+ private:
+  // The global `operator new` of C++11 takes no alignment, and aligns for any fundamental type.
+  void* DoAllocate(size_t bytes, size_t) override { return ::operator new(bytes); }
+  void DoDeallocate(void* p, size_t, size_t) override { ::operator delete(p); }
+  bool DoIsEqual(const MemoryResource& other) const override {
+    return dynamic_cast<const NewDeleteMemoryResource*>(&other) != nullptr;
+  }
+};
+
+inline MemoryResource* NewDeleteResource() {
+  static NewDeleteMemoryResource singleton;
+  return &singleton;
+}
+
+// Hands out the memory from `buffer`, if one is given, and then from the blocks allocated from `upstream`,
+// each twice the size of the previous one. `Deallocate()` is a no-op, the memory is reclaimed
+// by `Release()`, or by the destructor.
+class MonotonicBufferResource final : public MemoryResource {
+ public:
+  explicit MonotonicBufferResource(size_t initial_block_size = 1024,
+                                   MemoryResource* upstream = NewDeleteResource())
+      : upstream_(upstream), initial_block_size_(std::max(initial_block_size, static_cast<size_t>(64))) {
+    Release();
+  }
+
+  MonotonicBufferResource(void* buffer, size_t size, MemoryResource* upstream = NewDeleteResource())
+      : upstream_(upstream),
+        initial_buffer_(static_cast<char*>(buffer)),
+        initial_buffer_size_(size),
+        initial_block_size_(std::max(size, static_cast<size_t>(64))) {
+    Release();
+  }
+
+  ~MonotonicBufferResource() { Release(); }
+
+  // Frees the blocks allocated upstream, and starts over from the initial buffer, if any.
+  // Invalidates all the memory handed out by this resource.
+  void Release() {
+    while (blocks_) {
+      Block* next = blocks_->next;
+      upstream_->Deallocate(blocks_, blocks_->size, alignof(Block));
+      blocks_ = next;
+    }
+    current_ = initial_buffer_;
+    available_ = initial_buffer_size_;
+    next_block_size_ = initial_block_size_;
+    bytes_allocated_upstream_ = 0;
+  }
+
+  MemoryResource* UpstreamResource() const { return upstream_; }
+
+  // The total size of the blocks allocated from `upstream` since the last `Release()`.
+  size_t BytesAllocatedUpstream() const { return bytes_allocated_upstream_; }
+
+ private:
+  struct Block {
+    Block* next;
+    size_t size;
+  };
+
+  void* DoAllocate(size_t bytes, size_t alignment) override {
+    if (void* p = AllocateFromCurrent(bytes, alignment)) {
+      return p;
+    }
+    const size_t needed = sizeof(Block) + bytes + alignment;
+    while (next_block_size_ < needed) {
+      next_block_size_ *= 2;
+    }
+    Block* block = static_cast<Block*>(upstream_->Allocate(next_block_size_, alignof(Block)));
+    block->next = blocks_;
+    block->size = next_block_size_;
+    blocks_ = block;
+    bytes_allocated_upstream_ += next_block_size_;
+    current_ = reinterpret_cast<char*>(block + 1);
+    available_ = next_block_size_ - sizeof(Block);
+    next_block_size_ *= 2;
+    return AllocateFromCurrent(bytes, alignment);
+  }
+
+  void DoDeallocate(void*, size_t, size_t) override {}
+
+  bool DoIsEqual(const MemoryResource&) const override { return false; }
+
+  void* AllocateFromCurrent(size_t bytes, size_t alignment) {
+    void* p = current_;
+    if (current_ && std::align(alignment, bytes, p, available_)) {
+      current_ = static_cast<char*>(p) + bytes;
+      available_ -= bytes;
+      return p;
+    }
+    return nullptr;
+  }
+
+  MemoryResource* const upstream_;
+  char* const initial_buffer_ = nullptr;
+  const size_t initial_buffer_size_ = 0;
+  const size_t initial_block_size_;
+  Block* blocks_ = nullptr;
+  char* current_ = nullptr;
+  size_t available_ = 0;
+  size_t next_block_size_ = 0;
+  size_t bytes_allocated_upstream_ = 0;
+
+  MonotonicBufferResource(const MonotonicBufferResource&) = delete;
+  void operator=(const MonotonicBufferResource&) = delete;
+};
+
+template <typename T>
+class PolymorphicAllocator {
+ public:
+  typedef T value_type;
+
+  PolymorphicAllocator() : resource_(NewDeleteResource()) {}
+  // Implicit, for the containers to be constructed from the resource directly.
+  PolymorphicAllocator(MemoryResource* resource) : resource_(resource) {}
+  template <typename U>
+  PolymorphicAllocator(const PolymorphicAllocator<U>& other) : resource_(other.Resource()) {}
+
+  T* allocate(size_t n) { return static_cast<T*>(resource_->Allocate(n * sizeof(T), alignof(T))); }
+  void deallocate(T* p, size_t n) { resource_->Deallocate(p, n * sizeof(T), alignof(T)); }
+
+  // The allocator-aware elements get the same resource, the rest are constructed as usual.
+  template <typename U, typename... ARGS>
+  typename std::enable_if<std::uses_allocator<U, PolymorphicAllocator>::value &&
+                          std::is_constructible<U, ARGS..., const PolymorphicAllocator&>::value>::type
+  construct(U* p, ARGS&&... args) {
+    ::new (static_cast<void*>(p)) U(std::forward<ARGS>(args)..., *this);
+  }
+  template <typename U, typename... ARGS>
+  typename std::enable_if<!(std::uses_allocator<U, PolymorphicAllocator>::value &&
+                            std::is_constructible<U, ARGS..., const PolymorphicAllocator&>::value)>::type
+  construct(U* p, ARGS&&... args) {
+    ::new (static_cast<void*>(p)) U(std::forward<ARGS>(args)...);
+  }
+  template <typename U>
+  void destroy(U* p) {
+    p->~U();
+  }
+
+  // The pre-C++11 allocator interface, still expected by some implementations of `std::basic_string`.
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef std::ptrdiff_t difference_type;
+  template <typename U>
+  struct rebind {
+    typedef PolymorphicAllocator<U> other;
+  };
+  size_type max_size() const { return static_cast<size_type>(-1) / sizeof(T); }
+
+  // The copy of a container does not share the resource of the original, which may be short-lived.
+  PolymorphicAllocator select_on_container_copy_construction() const { return PolymorphicAllocator(); }
+
+  MemoryResource* Resource() const { return resource_; }
+
+ private:
+  MemoryResource* resource_;
+};
+
+template <typename T, typename U>
+inline bool operator==(const PolymorphicAllocator<T>& lhs, const PolymorphicAllocator<U>& rhs) {
+  return lhs.Resource()->IsEqual(*rhs.Resource());
+}
+
+template <typename T, typename U>
+inline bool operator!=(const PolymorphicAllocator<T>& lhs, const PolymorphicAllocator<U>& rhs) {
+  return !(lhs == rhs);
+}
+
+typedef std::basic_string<char, std::char_traits<char>, PolymorphicAllocator<char>> String;
+
+template <typename T>
+using Vector = std::vector<T, PolymorphicAllocator<T>>;
+
+}  // namespace memory
+}  // namespace bricks
+
+#endif  // BRICKS_MEMORY_MEMORY_RESOURCE_H
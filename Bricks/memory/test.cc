@@ -0,0 +1,154 @@
+#include "accounting.h"
+#include "memory_resource.h"
+
+#include <cstdint>
+#include <string>
+
+#include "../3party/gtest/gtest.h"
+#include "../3party/gtest/gtest-main.h"
+
+using bricks::memory::AccountedMemoryResource;
+using bricks::memory::MemoryResource;
+using bricks::memory::MonotonicBufferResource;
+using bricks::memory::NewDeleteResource;
+using bricks::memory::PolymorphicAllocator;
+using bricks::memory::String;
+using bricks::memory::Vector;
+
+// Counts the bytes allocated and not yet deallocated through it.
+class CountingResource final : public MemoryResource {
+ public:
+  size_t allocations = 0;
+  size_t bytes_in_use = 0;
+
+ private:
+  void* DoAllocate(size_t bytes, size_t alignment) override {
+    ++allocations;
+    bytes_in_use += bytes;
+    return NewDeleteResource()->Allocate(bytes, alignment);
+  }
+  void DoDeallocate(void* p, size_t bytes, size_t alignment) override {
+    bytes_in_use -= bytes;
+    NewDeleteResource()->Deallocate(p, bytes, alignment);
+  }
+  bool DoIsEqual(const MemoryResource&) const override { return false; }
+};
+
+TEST(Memory, MonotonicBufferResourceAlignsAndGrows) {
+  CountingResource upstream;
+  {
+    MonotonicBufferResource arena(256, &upstream);
+    EXPECT_EQ(0u, upstream.allocations);
+    for (size_t alignment : {1, 2, 8, 16}) {
+      void* p = arena.Allocate(3, alignment);
+      EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(p) % alignment);
+    }
+    EXPECT_EQ(1u, upstream.allocations);
+    EXPECT_EQ(256u, arena.BytesAllocatedUpstream());
+
+    // Larger than the next block: the block grows to fit it.
+    arena.Allocate(10000);
+    EXPECT_EQ(2u, upstream.allocations);
+    EXPECT_LE(10000u, arena.BytesAllocatedUpstream() - 256u);
+
+    arena.Release();
+    EXPECT_EQ(0u, upstream.bytes_in_use);
+    EXPECT_EQ(0u, arena.BytesAllocatedUpstream());
+    arena.Allocate(100);
+  }
+  EXPECT_EQ(3u, upstream.allocations);
+  EXPECT_EQ(0u, upstream.bytes_in_use);
+}
+
+TEST(Memory, MonotonicBufferResourceStartsWithTheBufferGiven) {
+  CountingResource upstream;
+  alignas(16) char buffer[1024];
+  MonotonicBufferResource arena(buffer, sizeof(buffer), &upstream);
+  for (int i = 0; i < 10; ++i) {
+    char* p = static_cast<char*>(arena.Allocate(50));
+    EXPECT_TRUE(p >= buffer && p + 50 <= buffer + sizeof(buffer));
+  }
+  EXPECT_EQ(0u, upstream.allocations);
+  arena.Allocate(1000);
+  EXPECT_EQ(1u, upstream.allocations);
+  arena.Release();
+  EXPECT_EQ(buffer, arena.Allocate(1, 1));
+}
+
+TEST(Memory, PolymorphicAllocatorPassesTheResourceToTheElements) {
+  CountingResource resource;
+  {
+    Vector<String> strings(&resource);
+    strings.emplace_back("a string long enough not to fit into the string object itself");
+    strings.resize(10);
+    strings[5] = strings[0];
+    for (const String& s : strings) {
+      EXPECT_EQ(&resource, s.get_allocator().Resource());
+    }
+    EXPECT_LT(0u, resource.bytes_in_use);
+
+    // The copy does not share the resource.
+    const size_t allocations = resource.allocations;
+    const Vector<String> copy(strings);
+    EXPECT_EQ(allocations, resource.allocations);
+    EXPECT_EQ(NewDeleteResource(), copy[0].get_allocator().Resource());
+    EXPECT_EQ(strings[0], copy[5]);
+  }
+  EXPECT_EQ(0u, resource.bytes_in_use);
+}
+
+TEST(Memory, PolymorphicAllocatorsCompareByResource) {
+  MonotonicBufferResource arena1;
+  MonotonicBufferResource arena2;
+  EXPECT_TRUE(PolymorphicAllocator<int>() == PolymorphicAllocator<char>(NewDeleteResource()));
+  EXPECT_TRUE(PolymorphicAllocator<int>(&arena1) == PolymorphicAllocator<char>(&arena1));
+  EXPECT_TRUE(PolymorphicAllocator<int>(&arena1) != PolymorphicAllocator<int>(&arena2));
+  EXPECT_TRUE(PolymorphicAllocator<int>(&arena1) != PolymorphicAllocator<int>());
+}
+
+TEST(Memory, AccountedMemoryResourceCountsPerSubsystemAndInstance) {
+  bricks::metrics::Registry registry;
+  CountingResource upstream;
+  void* leaked;
+  {
+    AccountedMemoryResource first("test", "first", &upstream, registry);
+    AccountedMemoryResource second("test", "second-one", &upstream, registry);
+    EXPECT_EQ("bricks_memory_test_second_one_bytes",
+              AccountedMemoryResource::MetricName("test", "second-one", "bytes"));
+    {
+      Vector<char> a(100, 'a', &first);
+      Vector<char> b(50, 'b', &second);
+      EXPECT_EQ(100u, first.BytesInUse());
+      EXPECT_EQ(150u, upstream.bytes_in_use);
+      EXPECT_EQ(150, registry.GetGauge("bricks_memory_test_bytes").Value());
+      EXPECT_EQ(100, registry.GetGauge("bricks_memory_test_first_bytes").Value());
+      EXPECT_EQ(50, registry.GetGauge("bricks_memory_test_second_one_bytes").Value());
+      EXPECT_EQ(2u, registry.GetCounter("bricks_memory_test_allocations_total").Value());
+    }
+    EXPECT_EQ(0u, first.BytesInUse());
+    EXPECT_EQ(100u, first.PeakBytesInUse());
+    EXPECT_EQ(1u, first.Allocations());
+    EXPECT_EQ(0, registry.GetGauge("bricks_memory_test_bytes").Value());
+    leaked = first.Allocate(10);
+    EXPECT_EQ(10, registry.GetGauge("bricks_memory_test_bytes").Value());
+  }
+  // The memory not returned by the time the resource is gone is no longer accounted for.
+  EXPECT_EQ(0, registry.GetGauge("bricks_memory_test_bytes").Value());
+  EXPECT_EQ(0, registry.GetGauge("bricks_memory_test_first_bytes").Value());
+  EXPECT_NE(std::string::npos, registry.ExportPrometheus().find("bricks_memory_test_bytes 0\n"));
+  upstream.Deallocate(leaked, 10);
+}
+
+TEST(Memory, SubsystemMemoryResourceIsOnePerSubsystem) {
+  AccountedMemoryResource* resource = bricks::memory::SubsystemMemoryResource("test_subsystem");
+  EXPECT_EQ(resource, bricks::memory::SubsystemMemoryResource("test_subsystem"));
+  EXPECT_NE(resource, bricks::memory::SubsystemMemoryResource("test_other_subsystem"));
+  const bricks::metrics::Gauge& bytes =
+      bricks::metrics::Registry::Singleton().GetGauge("bricks_memory_test_subsystem_bytes");
+  EXPECT_EQ(0, bytes.Value());
+  {
+    Vector<int> v(10, 0, resource);
+    EXPECT_EQ(static_cast<int64_t>(10 * sizeof(int)), bytes.Value());
+  }
+  EXPECT_EQ(0, bytes.Value());
+}
@@ -0,0 +1,352 @@
+// Counters, gauges and histograms for the subsystems of Bricks to expose the numbers to be scraped.
+//
+// The hot path only touches the memory of the metric itself, with relaxed atomic operations, and never locks:
+// * `Counter` is split into `kShards` cache-line-sized shards, each thread increments the shard of its own.
+// * `Gauge` is a single atomic value, to be set, or incremented and decremented.
+// * `Histogram` is log-linear, each power of two is split into `kHistogramSubBuckets` linear buckets, and is
+//   sharded the same way as `Counter`, with fewer shards. The shards are merged on read, see `Snapshot()`.
+//
+// The metrics are registered by name in `Registry`, usually `Registry::Singleton()`, which owns them, and
+// keeps them alive for as long as it lives. Registration takes a mutex: resolve the metric once and keep
+// the reference, instead of looking it up on each event. The registry exports all its metrics in the
+// Prometheus text format, with `ExportPrometheus()`, and as JSON, with `ExportJSON()`.
+
+#ifndef BRICKS_METRICS_METRICS_H
+#define BRICKS_METRICS_METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../exception.h"
+#include "../strings/printf.h"
+
+namespace bricks {
+namespace metrics {
+
+// The name is not a valid Prometheus metric name, `[a-zA-Z_:][a-zA-Z0-9_:]*`.
+struct InvalidMetricNameException : Exception {};
+// The name has been registered already, as a metric of another type.
+struct MetricTypeMismatchException : Exception {};
+
+enum { kShards = 16, kHistogramShards = 4 };
+enum { kHistogramSubBucketBits = 3, kHistogramSubBuckets = 1 << kHistogramSubBucketBits };
+enum { kHistogramBuckets = (64 - kHistogramSubBucketBits + 1) * kHistogramSubBuckets };
+
+// The shard of the calling thread, from zero to `kShards - 1`, assigned round robin on the first call.
+inline size_t ThisThreadShard() {
+  static std::atomic_size_t next_shard(0);
+  static thread_local size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % kShards;
+  return shard;
+}
+
+// THREAD SAFE.
+class Counter final {
+ public:
+  Counter() = default;
+
+  inline void Increment(uint64_t delta = 1) {
+    shards_[ThisThreadShard()].value.fetch_add(delta, std::memory_order_relaxed);
+  }
+
+  uint64_t Value() const {
+    uint64_t value = 0;
+    for (const Shard& shard : shards_) {
+      value += shard.value.load(std::memory_order_relaxed);
+    }
+    return value;
+  }
+
+ private:
+  // Padded to a cache line, for the threads not to invalidate the lines of each other. Not `alignas()`,
+  // which C++11 `new` does not respect.
+  struct Shard {
+    std::atomic<uint64_t> value{0};
+    char padding[64 - sizeof(std::atomic<uint64_t>)];
+  };
+  Shard shards_[kShards];
+
+  Counter(const Counter&) = delete;
+  void operator=(const Counter&) = delete;
+};
+
+// THREAD SAFE.
+class Gauge final {
+ public:
+  Gauge() = default;
+
+  inline void Set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+  inline void Add(int64_t delta) { value_.fetch_add(delta, std::memory_order_relaxed); }
+  inline void Increment() { Add(1); }
+  inline void Decrement() { Add(-1); }
+
+  int64_t Value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_{0};
+
+  Gauge(const Gauge&) = delete;
+  void operator=(const Gauge&) = delete;
+};
+
+// The merged state of a `Histogram`, or a standalone one, not thread safe, to merge others into.
+struct HistogramSnapshot {
+  std::vector<uint64_t> buckets = std::vector<uint64_t>(kHistogramBuckets);
+  uint64_t count = 0;
+  uint64_t sum = 0;
+
+  void Merge(const HistogramSnapshot& rhs) {
+    for (size_t i = 0; i < kHistogramBuckets; ++i) {
+      buckets[i] += rhs.buckets[i];
+    }
+    count += rhs.count;
+    sum += rhs.sum;
+  }
+
+  // Returns the upper bound of the bucket containing the `percentile` (0 to 100) of the recorded values.
+  uint64_t Percentile(double percentile) const {
+    if (!count) {
+      return 0;
+    }
+    const double rank = percentile * 1e-2 * static_cast<double>(count);
+    const uint64_t target = rank < 1 ? 1 : static_cast<uint64_t>(rank + 0.5);
+    uint64_t total = 0;
+    for (size_t i = 0; i < kHistogramBuckets; ++i) {
+      total += buckets[i];
+      if (total >= target) {
+        return BucketUpperBound(i);
+      }
+    }
+    return BucketUpperBound(kHistogramBuckets - 1);
+  }
+
+  // Values below `kHistogramSubBuckets` get a bucket each. Above that, the bucket is determined by
+  // the position of the most significant bit and the `kHistogramSubBucketBits` bits following it.
+  static inline size_t BucketIndex(uint64_t value) {
+    if (value < kHistogramSubBuckets) {
+      return static_cast<size_t>(value);
+    }
+    const int msb = 63 - __builtin_clzll(value);
+    const size_t sub_bucket =
+        static_cast<size_t>(value >> (msb - kHistogramSubBucketBits)) & (kHistogramSubBuckets - 1);
+    return static_cast<size_t>(msb - kHistogramSubBucketBits + 1) * kHistogramSubBuckets + sub_bucket;
+  }
+
+  // The largest value that goes into the bucket.
+  static uint64_t BucketUpperBound(size_t index) {
+    if (index < kHistogramSubBuckets) {
+      return index;
+    }
+    const int shift = static_cast<int>(index / kHistogramSubBuckets) - 1;
+    const uint64_t sub_bucket = index % kHistogramSubBuckets;
+    const uint64_t lower = (static_cast<uint64_t>(kHistogramSubBuckets) + sub_bucket) << shift;
+    return lower + ((static_cast<uint64_t>(1) << shift) - 1);
+  }
+};
+
+// THREAD SAFE.
+class Histogram final {
+ public:
+  Histogram() : shards_(new Shard[kHistogramShards]) {}
+
+  inline void Record(uint64_t value) {
+    Shard& shard = shards_[ThisThreadShard() % kHistogramShards];
+    shard.buckets[HistogramSnapshot::BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  // The buckets of all the shards, summed up. The values recorded concurrently may or may not be included.
+  HistogramSnapshot Snapshot() const {
+    HistogramSnapshot snapshot;
+    for (size_t s = 0; s < kHistogramShards; ++s) {
+      const Shard& shard = shards_[s];
+      for (size_t i = 0; i < kHistogramBuckets; ++i) {
+        const uint64_t count = shard.buckets[i].load(std::memory_order_relaxed);
+        snapshot.buckets[i] += count;
+        snapshot.count += count;
+      }
+      snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+    }
+    return snapshot;
+  }
+
+ private:
+  struct Shard {
+    std::atomic<uint64_t> buckets[kHistogramBuckets];
+    std::atomic<uint64_t> sum;
+    char padding[64];
+    Shard() : sum(0) {
+      for (std::atomic<uint64_t>& bucket : buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+      }
+    }
+  };
+  std::unique_ptr<Shard[]> shards_;
+
+  Histogram(const Histogram&) = delete;
+  void operator=(const Histogram&) = delete;
+};
+
+// THREAD SAFE.
+class Registry final {
+ public:
+  Registry() = default;
+
+  // Return the metric registered under `name`, registering it on the first call, with `help`
+  // as its description. Throw `InvalidMetricNameException` or `MetricTypeMismatchException`.
+  Counter& GetCounter(const std::string& name, const std::string& help = "") {
+    return *Get(name, help, Type::Counter).counter;
+  }
+  Gauge& GetGauge(const std::string& name, const std::string& help = "") {
+    return *Get(name, help, Type::Gauge).gauge;
+  }
+  Histogram& GetHistogram(const std::string& name, const std::string& help = "") {
+    return *Get(name, help, Type::Histogram).histogram;
+  }
+
+  // All the metrics, in the order of their names, in the Prometheus text exposition format.
+  // The histograms only list the buckets that are not empty, and "+Inf".
+  std::string ExportPrometheus() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string output;
+    for (const auto& cit : metrics_) {
+      const std::string& name = cit.first;
+      const Metric& metric = cit.second;
+      if (!metric.help.empty()) {
+        output += "# HELP " + name + ' ' + EscapeHelp(metric.help) + '\n';
+      }
+      if (metric.type == Type::Counter) {
+        output += "# TYPE " + name + " counter\n";
+        output += name + ' ' + std::to_string(metric.counter->Value()) + '\n';
+      } else if (metric.type == Type::Gauge) {
+        output += "# TYPE " + name + " gauge\n";
+        output += name + ' ' + std::to_string(metric.gauge->Value()) + '\n';
+      } else {
+        output += "# TYPE " + name + " histogram\n";
+        const HistogramSnapshot snapshot = metric.histogram->Snapshot();
+        uint64_t total = 0;
+        for (size_t i = 0; i < kHistogramBuckets; ++i) {
+          if (snapshot.buckets[i]) {
+            total += snapshot.buckets[i];
+            output += name + "_bucket{le=\"" + std::to_string(HistogramSnapshot::BucketUpperBound(i)) + "\"} " +
+                      std::to_string(total) + '\n';
+          }
+        }
+        output += name + "_bucket{le=\"+Inf\"} " + std::to_string(snapshot.count) + '\n';
+        output += name + "_sum " + std::to_string(snapshot.sum) + '\n';
+        output += name + "_count " + std::to_string(snapshot.count) + '\n';
+      }
+    }
+    return output;
+  }
+
+  // {"counters":{"name":value,...},"gauges":{...},"histograms":{"name":{"count":...,"sum":...,"p50":...},...}}.
+  std::string ExportJSON() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string counters;
+    std::string gauges;
+    std::string histograms;
+    for (const auto& cit : metrics_) {
+      const std::string key = '"' + cit.first + "\":";
+      const Metric& metric = cit.second;
+      if (metric.type == Type::Counter) {
+        counters += (counters.empty() ? "" : ",") + key + std::to_string(metric.counter->Value());
+      } else if (metric.type == Type::Gauge) {
+        gauges += (gauges.empty() ? "" : ",") + key + std::to_string(metric.gauge->Value());
+      } else {
+        const HistogramSnapshot snapshot = metric.histogram->Snapshot();
+        histograms += (histograms.empty() ? "" : ",") + key +
+                      strings::Printf("{\"count\":%llu,\"sum\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu}",
+                                      static_cast<unsigned long long>(snapshot.count),
+                                      static_cast<unsigned long long>(snapshot.sum),
+                                      static_cast<unsigned long long>(snapshot.Percentile(50)),
+                                      static_cast<unsigned long long>(snapshot.Percentile(90)),
+                                      static_cast<unsigned long long>(snapshot.Percentile(99)));
+      }
+    }
+    return "{\"counters\":{" + counters + "},\"gauges\":{" + gauges + "},\"histograms\":{" + histograms + "}}";
+  }
+
+  // The registry the subsystems of Bricks register their metrics in.
+  static Registry& Singleton() {
+    static Registry singleton;
+    return singleton;
+  }
+
+ private:
+  enum class Type { Counter, Gauge, Histogram };
+  struct Metric {
+    Type type;
+    std::string help;
+    std::unique_ptr<Counter> counter;
+    std::unique_ptr<Gauge> gauge;
+    std::unique_ptr<Histogram> histogram;
+  };
+
+  Metric& Get(const std::string& name, const std::string& help, Type type) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = metrics_.find(name);
+    if (it != metrics_.end()) {
+      if (it->second.type != type) {
+        throw MetricTypeMismatchException();
+      }
+      return it->second;
+    }
+    if (!IsValidName(name)) {
+      throw InvalidMetricNameException();
+    }
+    Metric& metric = metrics_[name];
+    metric.type = type;
+    metric.help = help;
+    if (type == Type::Counter) {
+      metric.counter.reset(new Counter());
+    } else if (type == Type::Gauge) {
+      metric.gauge.reset(new Gauge());
+    } else {
+      metric.histogram.reset(new Histogram());
+    }
+    return metric;
+  }
+
+  static bool IsValidName(const std::string& name) {
+    if (name.empty() || (name[0] >= '0' && name[0] <= '9')) {
+      return false;
+    }
+    for (const char c : name) {
+      if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' ||
+            c == ':')) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static std::string EscapeHelp(const std::string& help) {
+    std::string escaped;
+    for (const char c : help) {
+      if (c == '\\') {
+        escaped += "\\\\";
+      } else if (c == '\n') {
+        escaped += "\\n";
+      } else {
+        escaped += c;
+      }
+    }
+    return escaped;
+  }
+
+  mutable std::mutex mutex_;
+  std::map<std::string, Metric> metrics_;
+
+  Registry(const Registry&) = delete;
+  void operator=(const Registry&) = delete;
+};
+
+}  // namespace metrics
+}  // namespace bricks
+
+#endif  // BRICKS_METRICS_METRICS_H
@@ -0,0 +1,323 @@
+// Sampling CPU profiler, to see where a running server spends its CPU time without attaching `perf` to it.
+//
+// `CPUProfiler::Singleton().Profile(parameters)` samples the stacks of the threads of the process
+// `frequency_hz` times per second of the CPU time they consume, for `seconds` of wall time, and returns
+// the `CPUProfile`. It exports the stacks as folded ones, "main;Run;Process 42" per line, for `flamegraph.pl`
+// and speedscope, and as the legacy binary CPU profile of gperftools, which `pprof` reads.
+//
+// The samples are taken by the handler of `SIGPROF`, which `setitimer(ITIMER_PROF)` sends to the thread
+// running on the CPU once per period of process CPU time. The handler takes no locks and allocates nothing:
+// it calls `backtrace()`, warmed up beforehand for the unwinder to be loaded outside of the handler,
+// into the next slot of a buffer allocated before the timer is started, and counts the samples past its end
+// as dropped. The stacks are symbolized once sampling stops, with `backtrace_symbols()`, and the C++ names
+// demangled. The functions of the executable itself are only named if it is linked with `-rdynamic`,
+// and are "module+0x1f3" otherwise, for `addr2line`.
+//
+// One profile at a time, as the timer and the signal are per process: `Profile()` throws
+// `CPUProfilerBusyException` while another one is being taken. The handler is installed with `SA_RESTART`,
+// still, the calls that are never restarted, such as `epoll_wait()` and `poll()`, may return `EINTR` early
+// while profiling.
+
+#ifndef BRICKS_METRICS_PROFILER_H
+#define BRICKS_METRICS_PROFILER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <cxxabi.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "../exception.h"
+
+#include "../strings/printf.h"
+
+namespace bricks {
+namespace metrics {
+
+// Another profile is being taken.
+struct CPUProfilerBusyException : Exception {};
+// `sigaction()` or `setitimer()` has failed.
+struct CPUProfilerSetupException : Exception {};
+
+enum { kCPUProfilerMaxFrames = 64 };
+const size_t kCPUProfilerMaxSamples = 1 << 16;
+const size_t kCPUProfilerDefaultFrequencyHz = 100;
+const size_t kCPUProfilerMaxFrequencyHz = 1000;
+
+struct CPUProfileParameters {
+  double seconds = 1.0;
+  size_t frequency_hz = kCPUProfilerDefaultFrequencyHz;
+};
+
+// Returns the name of the frame from the line of `backtrace_symbols()`: the demangled function name,
+// or "module+0x1f3" for the functions not exported, or the line itself if it can not be parsed.
+inline std::string CPUProfileFrameName(const char* symbol) {
+  // glibc writes "path/module(function+0x1f) [0x4f3a1f]", or "path/module(+0x1f3) [0x4f3a1f]".
+  const char* open = std::strchr(symbol, '(');
+  const char* plus = open ? std::strchr(open, '+') : nullptr;
+  const char* close = plus ? std::strchr(plus, ')') : nullptr;
+  if (!close) {
+    return symbol;
+  }
+  if (plus == open + 1) {
+    const char* module = open;
+    while (module != symbol && module[-1] != '/') {
+      --module;
+    }
+    return std::string(module, open) + std::string(plus, close);
+  }
+  const std::string mangled(open + 1, plus);
+  int status = 0;
+  char* demangled = abi::__cxa_demangle(mangled.c_str(), nullptr, nullptr, &status);
+  std::string name = (status == 0 && demangled) ? demangled : mangled;
+  std::free(demangled);
+  // The folded format separates the frames with semicolons.
+  std::replace(name.begin(), name.end(), ';', ':');
+  return name;
+}
+
+// The stacks sampled, each with the number of times it has been, the innermost frame first.
+struct CPUProfile {
+  typedef std::vector<void*> Stack;
+
+  uint64_t period_us = 0;
+  std::map<Stack, size_t> stacks;
+  // The samples that did not fit into the buffer.
+  size_t dropped = 0;
+
+  size_t Samples() const {
+    size_t samples = 0;
+    for (const auto& stack : stacks) {
+      samples += stack.second;
+    }
+    return samples;
+  }
+
+  // One "outermost;...;innermost count" line per stack, ordered by the names of the frames.
+  std::string FoldedStacks() const {
+    std::vector<void*> addresses;
+    for (const auto& stack : stacks) {
+      addresses.insert(addresses.end(), stack.first.begin(), stack.first.end());
+    }
+    std::sort(addresses.begin(), addresses.end());
+    addresses.erase(std::unique(addresses.begin(), addresses.end()), addresses.end());
+    std::unordered_map<void*, std::string> names;
+    if (!addresses.empty()) {
+      char** symbols = ::backtrace_symbols(&addresses[0], static_cast<int>(addresses.size()));
+      for (size_t i = 0; i < addresses.size(); ++i) {
+        names[addresses[i]] = symbols ? CPUProfileFrameName(symbols[i]) : strings::Printf("%p", addresses[i]);
+      }
+      std::free(symbols);
+    }
+    // The stacks through different addresses of the same functions are merged.
+    std::map<std::string, size_t> folded;
+    for (const auto& stack : stacks) {
+      std::string line;
+      for (auto frame = stack.first.rbegin(); frame != stack.first.rend(); ++frame) {
+        if (!line.empty()) {
+          line += ';';
+        }
+        line += names[*frame];
+      }
+      folded[line] += stack.second;
+    }
+    std::string output;
+    for (const auto& line : folded) {
+      output += line.first + ' ' + std::to_string(line.second) + '\n';
+    }
+    return output;
+  }
+
+  // The legacy CPU profile format of gperftools: the words of the header, of each stack and of the trailer,
+  // native-endian and pointer-sized, followed by the memory map of the process, for `pprof` to symbolize
+  // the addresses with the binaries.
+  std::string Pprof() const {
+    std::vector<uintptr_t> words = {0, 3, 0, static_cast<uintptr_t>(period_us), 0};
+    for (const auto& stack : stacks) {
+      words.push_back(static_cast<uintptr_t>(stack.second));
+      words.push_back(static_cast<uintptr_t>(stack.first.size()));
+      for (void* frame : stack.first) {
+        words.push_back(reinterpret_cast<uintptr_t>(frame));
+      }
+    }
+    words.push_back(0);
+    words.push_back(1);
+    words.push_back(0);
+    std::string output(reinterpret_cast<const char*>(&words[0]), words.size() * sizeof(uintptr_t));
+    std::ifstream maps("/proc/self/maps");
+    if (maps) {
+      std::ostringstream os;
+      os << maps.rdbuf();
+      output += os.str();
+    }
+    return output;
+  }
+};
+
+// Constant-initialized, for the signal handler to never go through the guard of a function-local static.
+template <typename T = void>
+struct CPUProfilerSignalState {
+  static std::atomic<T*> active;
+  static std::atomic_int handlers;
+};
+template <typename T>
+std::atomic<T*> CPUProfilerSignalState<T>::active(nullptr);
+template <typename T>
+std::atomic_int CPUProfilerSignalState<T>::handlers(0);
+
+// THREAD SAFE.
+class CPUProfiler final {
+ public:
+  static CPUProfiler& Singleton() {
+    static CPUProfiler singleton;
+    return singleton;
+  }
+
+  // Samples the process for `parameters.seconds`, blocking the calling thread meanwhile. The frequency
+  // is capped at `kCPUProfilerMaxFrequencyHz`, and the buffer at `kCPUProfilerMaxSamples`, allocated
+  // on the first profile as large as needed to sample all the CPUs for the duration, and kept for the next ones.
+  CPUProfile Profile(const CPUProfileParameters& parameters) {
+    const size_t frequency_hz = std::max(std::min(parameters.frequency_hz, kCPUProfilerMaxFrequencyHz),
+                                         static_cast<size_t>(1));
+    const double seconds = std::max(parameters.seconds, 0.0);
+    const size_t cpus = std::max(std::thread::hardware_concurrency(), 1u);
+    Start(frequency_hz, static_cast<size_t>(seconds * static_cast<double>(frequency_hz * cpus)) + 1);
+    std::this_thread::sleep_for(std::chrono::microseconds(static_cast<int64_t>(seconds * 1e6)));
+    return Stop();
+  }
+
+  bool Running() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return running_;
+  }
+
+ private:
+  typedef CPUProfilerSignalState<CPUProfiler> State;
+
+  // The frames of the handler itself and of the signal trampoline, above the interrupted function.
+  enum { kSkippedFrames = 2 };
+
+  struct Sample {
+    int depth;
+    void* frames[kCPUProfilerMaxFrames + kSkippedFrames];
+  };
+
+  CPUProfiler() = default;
+
+  void Start(size_t frequency_hz, size_t samples) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_) {
+      throw CPUProfilerBusyException();
+    }
+    samples = std::min(samples, kCPUProfilerMaxSamples);
+    if (capacity_ < samples) {
+      // No handler is running, they are all done with the buffer by the end of the previous profile.
+      samples_.reset(new Sample[samples]);
+      capacity_ = samples;
+    }
+    limit_ = samples;
+    next_.store(0, std::memory_order_relaxed);
+    dropped_.store(0, std::memory_order_relaxed);
+    void* warm_up[1];
+    ::backtrace(warm_up, 1);
+    if (!handler_installed_) {
+      struct sigaction action;
+      std::memset(&action, 0, sizeof(action));
+      action.sa_handler = &CPUProfiler::OnSignal;
+      action.sa_flags = SA_RESTART;
+      sigemptyset(&action.sa_mask);
+      if (::sigaction(SIGPROF, &action, nullptr)) {
+        throw CPUProfilerSetupException();
+      }
+      handler_installed_ = true;
+    }
+    period_us_ = 1000000 / frequency_hz;
+    State::active.store(this);
+    struct itimerval timer;
+    timer.it_interval.tv_sec = static_cast<time_t>(period_us_ / 1000000);
+    timer.it_interval.tv_usec = static_cast<suseconds_t>(period_us_ % 1000000);
+    timer.it_value = timer.it_interval;
+    if (::setitimer(ITIMER_PROF, &timer, nullptr)) {
+      State::active.store(nullptr);
+      throw CPUProfilerSetupException();
+    }
+    running_ = true;
+  }
+
+  CPUProfile Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    struct itimerval timer;
+    std::memset(&timer, 0, sizeof(timer));
+    ::setitimer(ITIMER_PROF, &timer, nullptr);
+    // The handler counts itself in before it checks `active`, thus once `active` is cleared and there are
+    // no handlers counted in, none of them will touch the buffer.
+    State::active.store(nullptr);
+    while (State::handlers.load()) {
+      std::this_thread::yield();
+    }
+    running_ = false;
+    CPUProfile profile;
+    profile.period_us = period_us_;
+    const size_t taken = std::min(next_.load(std::memory_order_relaxed), limit_);
+    for (size_t i = 0; i < taken; ++i) {
+      const Sample& sample = samples_[i];
+      if (sample.depth > kSkippedFrames) {
+        ++profile.stacks[CPUProfile::Stack(sample.frames + kSkippedFrames, sample.frames + sample.depth)];
+      }
+    }
+    profile.dropped = dropped_.load(std::memory_order_relaxed);
+    return profile;
+  }
+
+  // Async-signal-safe, once `backtrace()` has been called outside of the handler.
+  static void OnSignal(int) {
+    const int saved_errno = errno;
+    State::handlers.fetch_add(1);
+    CPUProfiler* profiler = State::active.load();
+    if (profiler) {
+      const size_t index = profiler->next_.fetch_add(1, std::memory_order_relaxed);
+      if (index < profiler->limit_) {
+        Sample& sample = profiler->samples_[index];
+        sample.depth = ::backtrace(sample.frames, kCPUProfilerMaxFrames + kSkippedFrames);
+      } else {
+        profiler->dropped_.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    State::handlers.fetch_sub(1);
+    errno = saved_errno;
+  }
+
+  mutable std::mutex mutex_;
+  bool running_ = false;
+  bool handler_installed_ = false;
+  uint64_t period_us_ = 0;
+  std::unique_ptr<Sample[]> samples_;
+  size_t capacity_ = 0;
+  size_t limit_ = 0;
+  std::atomic_size_t next_{0};
+  std::atomic_size_t dropped_{0};
+
+  CPUProfiler(const CPUProfiler&) = delete;
+  void operator=(const CPUProfiler&) = delete;
+};
+
+}  // namespace metrics
+}  // namespace bricks
+
+#endif  // BRICKS_METRICS_PROFILER_H
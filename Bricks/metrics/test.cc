@@ -0,0 +1,227 @@
+#include "metrics.h"
+#include "profiler.h"
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../3party/gtest/gtest.h"
+#include "../3party/gtest/gtest-main.h"
+
+using bricks::metrics::Counter;
+using bricks::metrics::Gauge;
+using bricks::metrics::Histogram;
+using bricks::metrics::HistogramSnapshot;
+using bricks::metrics::Registry;
+
+TEST(Metrics, CounterSumsTheShardsOfAllThreads) {
+  Counter counter;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 20; ++t) {
+    threads.emplace_back([&counter]() {
+      for (int i = 0; i < 10000; ++i) {
+        counter.Increment();
+      }
+      counter.Increment(5);
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(20u * 10005u, counter.Value());
+}
+
+TEST(Metrics, Gauge) {
+  Gauge gauge;
+  EXPECT_EQ(0, gauge.Value());
+  gauge.Set(10);
+  gauge.Increment();
+  gauge.Add(-20);
+  EXPECT_EQ(-9, gauge.Value());
+  gauge.Decrement();
+  EXPECT_EQ(-10, gauge.Value());
+}
+
+TEST(Metrics, HistogramBuckets) {
+  for (uint64_t value : {0ull, 1ull, 7ull, 8ull, 9ull, 15ull, 16ull, 17ull, 1000ull, 123456789ull, ~0ull}) {
+    const size_t index = HistogramSnapshot::BucketIndex(value);
+    EXPECT_LE(value, HistogramSnapshot::BucketUpperBound(index)) << value;
+    if (index) {
+      EXPECT_GT(value, HistogramSnapshot::BucketUpperBound(index - 1)) << value;
+    }
+  }
+  EXPECT_EQ(static_cast<size_t>(bricks::metrics::kHistogramBuckets - 1), HistogramSnapshot::BucketIndex(~0ull));
+  // Within 1/8 of the value.
+  EXPECT_EQ(1023u, HistogramSnapshot::BucketUpperBound(HistogramSnapshot::BucketIndex(1000)));
+}
+
+TEST(Metrics, HistogramMergesShardsOnRead) {
+  Histogram histogram;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&histogram]() {
+      for (uint64_t i = 1; i <= 100; ++i) {
+        histogram.Record(i);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  const HistogramSnapshot snapshot = histogram.Snapshot();
+  EXPECT_EQ(800u, snapshot.count);
+  EXPECT_EQ(8u * 5050u, snapshot.sum);
+  EXPECT_EQ(1u, snapshot.Percentile(0));
+  EXPECT_EQ(51u, snapshot.Percentile(50));
+  EXPECT_EQ(103u, snapshot.Percentile(99));
+  EXPECT_EQ(103u, snapshot.Percentile(100));
+  HistogramSnapshot merged;
+  merged.Merge(snapshot);
+  merged.Merge(snapshot);
+  EXPECT_EQ(1600u, merged.count);
+  EXPECT_EQ(51u, merged.Percentile(50));
+}
+
+TEST(Metrics, Registry) {
+  Registry registry;
+  Counter& counter = registry.GetCounter("requests_total", "The number of requests.");
+  EXPECT_EQ(&counter, &registry.GetCounter("requests_total"));
+  counter.Increment(3);
+  registry.GetGauge("queue_depth").Set(-2);
+  Histogram& histogram = registry.GetHistogram("latency_ns", "Latency,\nin nanoseconds.");
+  histogram.Record(5);
+  histogram.Record(5);
+  histogram.Record(1000);
+
+  EXPECT_THROW(registry.GetGauge("requests_total"), bricks::metrics::MetricTypeMismatchException);
+  EXPECT_THROW(registry.GetCounter("0requests"), bricks::metrics::InvalidMetricNameException);
+  EXPECT_THROW(registry.GetCounter("requests-total"), bricks::metrics::InvalidMetricNameException);
+  EXPECT_THROW(registry.GetCounter(""), bricks::metrics::InvalidMetricNameException);
+
+  EXPECT_EQ(
+      "# HELP latency_ns Latency,\\nin nanoseconds.\n"
+      "# TYPE latency_ns histogram\n"
+      "latency_ns_bucket{le=\"5\"} 2\n"
+      "latency_ns_bucket{le=\"1023\"} 3\n"
+      "latency_ns_bucket{le=\"+Inf\"} 3\n"
+      "latency_ns_sum 1010\n"
+      "latency_ns_count 3\n"
+      "# TYPE queue_depth gauge\n"
+      "queue_depth -2\n"
+      "# HELP requests_total The number of requests.\n"
+      "# TYPE requests_total counter\n"
+      "requests_total 3\n",
+      registry.ExportPrometheus());
+  EXPECT_EQ(
+      "{\"counters\":{\"requests_total\":3},\"gauges\":{\"queue_depth\":-2},"
+      "\"histograms\":{\"latency_ns\":{\"count\":3,\"sum\":1010,\"p50\":5,\"p90\":1023,\"p99\":1023}}}",
+      registry.ExportJSON());
+}
+
+static size_t CountOccurrences(const std::string& haystack, const std::string& needle) {
+  size_t count = 0;
+  for (size_t i = haystack.find(needle); i != std::string::npos; i = haystack.find(needle, i + 1)) {
+    ++count;
+  }
+  return count;
+}
+
+TEST(Trace, RecordsNothingWhileDisabled) {
+  bricks::metrics::Tracer::Singleton().Clear();
+  bricks::metrics::EnableTracing(false);
+  { BRICKS_TRACE_SCOPE("Trace.Disabled"); }
+  EXPECT_EQ(0u, CountOccurrences(bricks::metrics::DumpChromeTrace(), "Trace.Disabled"));
+}
+
+TEST(Trace, DumpsTheScopesOfAllThreads) {
+  bricks::metrics::Tracer::Singleton().Clear();
+  bricks::metrics::EnableTracing();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([]() {
+      for (int i = 0; i < 10; ++i) {
+        BRICKS_TRACE_SCOPE("Trace.Outer");
+        { BRICKS_TRACE_SCOPE("Trace.\"Inner\""); }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  bricks::metrics::EnableTracing(false);
+  const std::string trace = bricks::metrics::DumpChromeTrace();
+  EXPECT_EQ(0u, trace.find("{\"traceEvents\":[{\"name\":"));
+  EXPECT_EQ(40u, CountOccurrences(trace, "{\"name\":\"Trace.Outer\",\"ph\":\"X\","));
+  EXPECT_EQ(40u, CountOccurrences(trace, "{\"name\":\"Trace.\\\"Inner\\\"\",\"ph\":\"X\","));
+}
+
+TEST(Trace, KeepsTheLastEventsOfEachThread) {
+  bricks::metrics::Tracer::Singleton().Clear();
+  bricks::metrics::EnableTracing();
+  std::thread([]() {
+    for (int i = 0; i < bricks::metrics::kTraceBufferEvents; ++i) {
+      BRICKS_TRACE_SCOPE("Trace.Old");
+    }
+    for (int i = 0; i < 100; ++i) {
+      BRICKS_TRACE_SCOPE("Trace.New");
+    }
+  }).join();
+  bricks::metrics::EnableTracing(false);
+  const std::string trace = bricks::metrics::DumpChromeTrace();
+  EXPECT_EQ(static_cast<size_t>(bricks::metrics::kTraceBufferEvents - 101),
+            CountOccurrences(trace, "Trace.Old"));
+  EXPECT_EQ(100u, CountOccurrences(trace, "Trace.New"));
+}
+
+TEST(Profiler, SamplesTheThreadsRunning) {
+  std::atomic_bool done(false);
+  std::thread spinning([&done]() {
+    volatile uint64_t x = 0;
+    while (!done) {
+      x = x + 1;
+    }
+  });
+  bricks::metrics::CPUProfileParameters parameters;
+  parameters.seconds = 0.5;
+  parameters.frequency_hz = 200;
+  std::thread profiling([&parameters]() {
+    const bricks::metrics::CPUProfile profile = bricks::metrics::CPUProfiler::Singleton().Profile(parameters);
+    EXPECT_LT(0u, profile.Samples());
+    EXPECT_EQ(5000u, profile.period_us);
+
+    // One "frame;...;frame count" line per stack, the counts adding up to the samples.
+    const std::string folded = profile.FoldedStacks();
+    size_t total = 0;
+    size_t begin = 0;
+    while (begin < folded.length()) {
+      const size_t end = folded.find('\n', begin);
+      ASSERT_NE(std::string::npos, end);
+      const size_t space = folded.rfind(' ', end);
+      ASSERT_LT(begin, space);
+      total += static_cast<size_t>(std::stoul(folded.substr(space + 1, end - space - 1)));
+      begin = end + 1;
+    }
+    EXPECT_EQ(profile.Samples(), total);
+
+    const std::string pprof = profile.Pprof();
+    ASSERT_LE(5 * sizeof(uintptr_t), pprof.length());
+    const uintptr_t* header = reinterpret_cast<const uintptr_t*>(pprof.data());
+    EXPECT_EQ(0u, header[0]);
+    EXPECT_EQ(3u, header[1]);
+    EXPECT_EQ(5000u, header[3]);
+  });
+  while (!bricks::metrics::CPUProfiler::Singleton().Running()) {
+    std::this_thread::yield();
+  }
+  // One profile at a time.
+  ASSERT_THROW(bricks::metrics::CPUProfiler::Singleton().Profile(parameters),
+               bricks::metrics::CPUProfilerBusyException);
+  profiling.join();
+  done = true;
+  spinning.join();
+  EXPECT_FALSE(bricks::metrics::CPUProfiler::Singleton().Running());
+}
@@ -0,0 +1,209 @@
+// Hot-path event tracing: `BRICKS_TRACE_SCOPE("name")` records when the enclosing scope was entered and left,
+// to see where a slow call has spent its time, and `DumpChromeTrace()` exports what has been recorded
+// as Chrome `trace_event` JSON, to be opened in chrome://tracing or Perfetto.
+//
+// Tracing is off by default, and is turned on and off at runtime with `EnableTracing()`. While it is off,
+// a scope costs one relaxed load and one predictable branch. While it is on, a scope reads
+// `HighResolutionClock` twice and writes one event into the ring buffer of the calling thread:
+// each thread has its own, and only that thread writes into it, with no locks. Once the ring buffer
+// is full, its oldest events are overwritten, thus the dump has the last `kTraceBufferEvents - 1` scopes
+// of each thread: the oldest slot is skipped, as the thread may be overwriting it while it is read.
+// The ring buffers are allocated on the first event of each thread and are kept for the lifetime
+// of the process, for the events of the threads that have exited to be dumped too.
+//
+// The names must be string literals, or otherwise outlive the tracer: only the pointers are stored.
+
+#ifndef BRICKS_METRICS_TRACE_H
+#define BRICKS_METRICS_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../strings/printf.h"
+#include "../time/tsc.h"
+
+namespace bricks {
+namespace metrics {
+
+enum { kTraceBufferEvents = 4096 };
+
+// Constant-initialized, for the check in each scope not to go through the guard of a function-local static.
+template <typename T = void>
+struct TracingFlag {
+  static std::atomic_bool enabled;
+};
+template <typename T>
+std::atomic_bool TracingFlag<T>::enabled(false);
+
+inline bool TracingEnabled() { return TracingFlag<>::enabled.load(std::memory_order_relaxed); }
+
+// The scopes of one thread. Written by that thread only, read by `DumpChromeTrace()` from any thread.
+class TraceBuffer final {
+ public:
+  explicit TraceBuffer(size_t thread_index)
+      : thread_index_(thread_index), events_(new Event[kTraceBufferEvents]) {}
+
+  inline void Record(const char* name, uint64_t begin_ns, uint64_t end_ns) {
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    Event& event = events_[head % kTraceBufferEvents];
+    event.name.store(name, std::memory_order_relaxed);
+    event.begin_ns.store(begin_ns, std::memory_order_relaxed);
+    event.end_ns.store(end_ns, std::memory_order_relaxed);
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  // Appends the events of this thread, oldest first, skipping the ones overwritten while being read.
+  void AppendChromeTraceEvents(std::string& output, bool& first) const {
+    struct Copy {
+      uint64_t index;
+      const char* name;
+      uint64_t begin_ns;
+      uint64_t end_ns;
+    };
+    const uint64_t head = head_.load(std::memory_order_acquire);
+    std::vector<Copy> copies;
+    for (uint64_t i = (head > kTraceBufferEvents ? head - kTraceBufferEvents : 0); i < head; ++i) {
+      const Event& event = events_[i % kTraceBufferEvents];
+      copies.push_back(Copy{i,
+                            event.name.load(std::memory_order_relaxed),
+                            event.begin_ns.load(std::memory_order_relaxed),
+                            event.end_ns.load(std::memory_order_relaxed)});
+    }
+    // The writer may have moved on meanwhile, and the slots it has reached, including the one
+    // it may be writing now, hold newer events than the copies of them.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const uint64_t head_after = head_.load(std::memory_order_relaxed);
+    const uint64_t valid_begin = head_after >= kTraceBufferEvents ? head_after - kTraceBufferEvents + 1 : 0;
+    for (const Copy& copy : copies) {
+      if (copy.index >= valid_begin) {
+        output += first ? "" : ",";
+        output += strings::Printf(
+            "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+            Escape(copy.name).c_str(),
+            static_cast<double>(copy.begin_ns) * 1e-3,
+            static_cast<double>(copy.end_ns - copy.begin_ns) * 1e-3,
+            static_cast<int>(thread_index_));
+        first = false;
+      }
+    }
+  }
+
+  void Clear() { head_.store(0, std::memory_order_relaxed); }
+
+ private:
+  struct Event {
+    std::atomic<const char*> name;
+    std::atomic<uint64_t> begin_ns;
+    std::atomic<uint64_t> end_ns;
+  };
+
+  static std::string Escape(const char* name) {
+    std::string escaped;
+    for (const char* p = name ? name : ""; *p; ++p) {
+      if (*p == '"' || *p == '\\') {
+        escaped += '\\';
+      }
+      escaped += *p;
+    }
+    return escaped;
+  }
+
+  const size_t thread_index_;
+  std::unique_ptr<Event[]> events_;
+  std::atomic<uint64_t> head_{0};
+
+  TraceBuffer(const TraceBuffer&) = delete;
+  void operator=(const TraceBuffer&) = delete;
+};
+
+// THREAD SAFE.
+class Tracer final {
+ public:
+  static Tracer& Singleton() {
+    static Tracer singleton;
+    return singleton;
+  }
+
+  inline TraceBuffer& ThisThreadBuffer() {
+    static thread_local TraceBuffer* buffer = nullptr;
+    if (!buffer) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      buffers_.emplace_back(new TraceBuffer(buffers_.size() + 1));
+      buffer = buffers_.back().get();
+    }
+    return *buffer;
+  }
+
+  // {"traceEvents":[{"name":...,"ph":"X","ts":...,"dur":...,"pid":1,"tid":...},...]},
+  // with the times in microseconds, and the threads numbered from one in the order of their first events.
+  std::string DumpChromeTrace() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string output = "{\"traceEvents\":[";
+    bool first = true;
+    for (const auto& buffer : buffers_) {
+      buffer->AppendChromeTraceEvents(output, first);
+    }
+    output += "],\"displayTimeUnit\":\"ns\"}";
+    return output;
+  }
+
+  // Forgets the events recorded so far. Should not be called while tracing is on.
+  void Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& buffer : buffers_) {
+      buffer->Clear();
+    }
+  }
+
+ private:
+  Tracer() = default;
+
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<TraceBuffer>> buffers_;
+};
+
+// Turns tracing on or off. The clock is calibrated before the first scope is recorded.
+inline void EnableTracing(bool enable = true) {
+  if (enable) {
+    time::HighResolutionClock::Singleton();
+  }
+  TracingFlag<>::enabled.store(enable, std::memory_order_relaxed);
+}
+
+inline std::string DumpChromeTrace() { return Tracer::Singleton().DumpChromeTrace(); }
+
+class ScopedTrace final {
+ public:
+  explicit ScopedTrace(const char* name) : name_(TracingEnabled() ? name : nullptr) {
+    if (name_) {
+      begin_ns_ = time::HighResolutionNowNanoseconds();
+    }
+  }
+  ~ScopedTrace() {
+    if (name_) {
+      const uint64_t end_ns = time::HighResolutionNowNanoseconds();
+      Tracer::Singleton().ThisThreadBuffer().Record(name_, begin_ns_, end_ns);
+    }
+  }
+
+ private:
+  const char* const name_;
+  uint64_t begin_ns_ = 0;
+
+  ScopedTrace(const ScopedTrace&) = delete;
+  void operator=(const ScopedTrace&) = delete;
+};
+
+}  // namespace metrics
+}  // namespace bricks
+
+#define BRICKS_TRACE_SCOPE_CONCAT2(a, b) a##b
+#define BRICKS_TRACE_SCOPE_CONCAT(a, b) BRICKS_TRACE_SCOPE_CONCAT2(a, b)
+#define BRICKS_TRACE_SCOPE(name) \
+  ::bricks::metrics::ScopedTrace BRICKS_TRACE_SCOPE_CONCAT(bricks_trace_scope_, __LINE__)(name)
+
+#endif  // BRICKS_METRICS_TRACE_H
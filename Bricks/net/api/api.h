@@ -33,4 +33,26 @@ struct HTTPSingleton {
 
 #define HTTP (HTTPSingleton::Get())
 
+// The asynchronous client, see `impl/posix_async.h`. Its event loop works on Linux, Mac and BSD.
+#if defined(BRICKS_POSIX) || defined(BRICKS_APPLE)
+#include "impl/posix_async.h"
+struct HTTPAsyncSingleton {
+  static bricks::net::api::HTTPAsyncClientPOSIX& Get() {
+    static bricks::net::api::HTTPAsyncClientPOSIX instance;
+    return instance;
+  }
+};
+#define HTTPAsync (HTTPAsyncSingleton::Get())
+
+// The batches of requests pipelined over one connection, see `impl/posix_batch.h`.
+#include "impl/posix_batch.h"
+struct HTTPBatchSingleton {
+  static const bricks::net::api::HTTPBatchClientPOSIX& Get() {
+    static bricks::net::api::HTTPBatchClientPOSIX instance;
+    return instance;
+  }
+};
+#define HTTPBatch (HTTPBatchSingleton::Get())
+#endif
+
 #endif  // BRICKS_NET_API_API_H
@@ -33,15 +33,31 @@ SOFTWARE.
 #import <Foundation/NSString.h>
 #import <Foundation/NSURL.h>
 #import <Foundation/NSData.h>
-#import <Foundation/NSStream.h>
 #import <Foundation/NSURLRequest.h>
 #import <Foundation/NSURLResponse.h>
-#import <Foundation/NSURLConnection.h>
+#import <Foundation/NSURLSession.h>
 #import <Foundation/NSError.h>
 #import <Foundation/NSFileManager.h>
 
+#include <dispatch/dispatch.h>
+
 #define TIMEOUT_IN_SECONDS 30.0
 
+// All the requests go through one session, for its connections to be reused, and, over HTTP/2, multiplexed.
+// `Go()` is synchronous, and waits for its task to complete; the session does the work on its own queue.
+static NSURLSession * BricksSharedURLSession() {
+  static NSURLSession * session = nil;
+  static dispatch_once_t once;
+  dispatch_once(&once, ^{
+    NSURLSessionConfiguration * configuration = [NSURLSessionConfiguration defaultSessionConfiguration];
+    configuration.requestCachePolicy = NSURLRequestReloadIgnoringLocalCacheData;
+    configuration.timeoutIntervalForRequest = TIMEOUT_IN_SECONDS;
+    configuration.URLCache = nil;
+    session = [NSURLSession sessionWithConfiguration:configuration];
+  });
+  return session;
+}
+
 bool bricks::net::api::HTTPClientApple::Go() {
   @autoreleasepool {
 
@@ -54,26 +70,55 @@ bool bricks::net::api::HTTPClientApple::Go() {
     if (!user_agent.empty())
       [request setValue:[NSString stringWithUTF8String:user_agent.c_str()] forHTTPHeaderField:@"User-Agent"];
 
+    NSURLSession * session = BricksSharedURLSession();
+    dispatch_semaphore_t done = dispatch_semaphore_create(0);
+    __block NSHTTPURLResponse * response = nil;
+    __block NSError * err = nil;
+    __block NSData * url_data = nil;
+    __block BOOL saved_to_file = NO;
+
+    void (^on_data)(NSData *, NSURLResponse *, NSError *) = ^(NSData * data, NSURLResponse * r, NSError * e) {
+      url_data = data;
+      response = (NSHTTPURLResponse *)r;
+      err = e;
+      dispatch_semaphore_signal(done);
+    };
+
+    const bool download = post_body.empty() && post_file.empty() && !received_file.empty();
+    NSURLSessionTask * task = nil;
     if (!post_body.empty()) {
-      request.HTTPBody = [NSData dataWithBytes:post_body.data() length:post_body.size()];
       request.HTTPMethod = @"POST";
+      task = [session uploadTaskWithRequest:request
+                                   fromData:[NSData dataWithBytes:post_body.data() length:post_body.size()]
+                          completionHandler:on_data];
     } else if (!post_file.empty()) {
-      NSError * err = nil;
+      // Streamed from disk by the session, with the Content-Length taken from the file.
       NSString * path = [NSString stringWithUTF8String:post_file.c_str()];
-      const unsigned long long file_size = [[NSFileManager defaultManager] attributesOfItemAtPath:path error:&err].fileSize;
-      if (err) {
-        error_code = err.code;
-        NSLog(@"Error %d %@", error_code, err.localizedDescription);
+      if (![[NSFileManager defaultManager] isReadableFileAtPath:path]) {
+        NSLog(@"ERROR: can not read %@ to POST it.", path);
         return false;
       }
-      request.HTTPBodyStream = [NSInputStream inputStreamWithFileAtPath:path];
       request.HTTPMethod = @"POST";
-      [request setValue:[NSString stringWithFormat:@"%llu", file_size] forHTTPHeaderField:@"Content-Length"];
+      task = [session uploadTaskWithRequest:request fromFile:[NSURL fileURLWithPath:path] completionHandler:on_data];
+    } else if (download) {
+      // Downloaded into a temporary file by the session, which is then moved into place.
+      NSURL * destination = [NSURL fileURLWithPath:[NSString stringWithUTF8String:received_file.c_str()]];
+      task = [session downloadTaskWithRequest:request
+                            completionHandler:^(NSURL * location, NSURLResponse * r, NSError * e) {
+        response = (NSHTTPURLResponse *)r;
+        err = e;
+        if (location) {
+          NSFileManager * manager = [NSFileManager defaultManager];
+          [manager removeItemAtURL:destination error:nil];
+          saved_to_file = [manager moveItemAtURL:location toURL:destination error:nil];
+        }
+        dispatch_semaphore_signal(done);
+      }];
+    } else {
+      task = [session dataTaskWithRequest:request completionHandler:on_data];
     }
-
-    NSHTTPURLResponse * response = nil;
-    NSError * err = nil;
-    NSData * url_data = [NSURLConnection sendSynchronousRequest:request returningResponse:&response error:&err];
+    [task resume];
+    dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
 
     if (response) {
       error_code = response.statusCode;
@@ -84,7 +129,11 @@ bool bricks::net::api::HTTPClientApple::Go() {
       NSLog(@"ERROR while connecting to %s: %@", url_requested.c_str(), err.localizedDescription);
     }
 
-    if (url_data) {
+    if (download) {
+      if (response && !saved_to_file) {
+        return false;
+      }
+    } else if (url_data) {
       if (received_file.empty()) {
         server_response.assign(reinterpret_cast<char const *>(url_data.bytes), url_data.length);
       } else {
@@ -0,0 +1,111 @@
+// The cancellation of a request of `HTTPClientPOSIX` in flight, from another thread: by the timer
+// of its deadline, or by the hedged attempt of the same request that has completed first.
+//
+// Whatever the request is blocked on registers a canceller for the time it is blocked: the connection
+// of HTTP/1.1 is shut down, for its reads and writes to fail right away, and the stream of HTTP/2 is woken up,
+// to reset itself, with the shared connection left alone. `Cancel()` runs the cancellers, and makes the ones
+// registered after it throw `HTTPRequestCancelledException` instead. The cancellations of the attempts of
+// a request are the cancellers of the cancellation of the request, for its deadline to cancel them all.
+//
+//   HTTPClientCancellation::Scope scope(cancellation, [fd]() { ::shutdown(fd, SHUT_RDWR); });
+//   ... blocking reads and writes of `fd` ...
+//   if (!scope.Release()) { /* Cancelled, the connection is not to be reused. */ }
+//
+// THREAD SAFE. The cancellers run with the lock held, and should be quick, and not use the cancellation.
+
+#ifndef BRICKS_NET_API_IMPL_CANCELLATION_H
+#define BRICKS_NET_API_IMPL_CANCELLATION_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include "../../exceptions.h"
+
+namespace bricks {
+namespace net {
+namespace api {
+
+class HTTPClientCancellation final {
+ public:
+  typedef uint64_t CancellerID;
+
+  HTTPClientCancellation() = default;
+
+  // Registers `canceller` to run on `Cancel()`. Throws `HTTPRequestCancelledException` if it has been called.
+  CancellerID Add(std::function<void()> canceller) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (cancelled_) {
+      throw HTTPRequestCancelledException();
+    }
+    cancellers_.emplace(++last_id_, std::move(canceller));
+    return last_id_;
+  }
+
+  // Unregisters the canceller, which does not run after that. Returns false if `Cancel()` has been called.
+  bool Remove(CancellerID id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancellers_.erase(id);
+    return !cancelled_;
+  }
+
+  void Cancel() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!cancelled_) {
+      cancelled_ = true;
+      for (auto& canceller : cancellers_) {
+        canceller.second();
+      }
+      cancellers_.clear();
+    }
+  }
+
+  bool Cancelled() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return cancelled_;
+  }
+
+  // The canceller registered for the lifetime of the scope, or until `Release()`.
+  class Scope final {
+   public:
+    Scope(HTTPClientCancellation& cancellation, std::function<void()> canceller)
+        : cancellation_(&cancellation), id_(cancellation.Add(std::move(canceller))) {}
+    Scope(Scope&& rhs) : cancellation_(rhs.cancellation_), id_(rhs.id_) { rhs.cancellation_ = nullptr; }
+    ~Scope() { Release(); }
+
+    // Returns false if the cancellation has been cancelled while the scope was in effect.
+    bool Release() {
+      if (!cancellation_) {
+        return true;
+      }
+      HTTPClientCancellation* const cancellation = cancellation_;
+      cancellation_ = nullptr;
+      return cancellation->Remove(id_);
+    }
+
+   private:
+    HTTPClientCancellation* cancellation_;
+    const CancellerID id_;
+
+    Scope(const Scope&) = delete;
+    void operator=(const Scope&) = delete;
+    void operator=(Scope&&) = delete;
+  };
+
+ private:
+  mutable std::mutex mutex_;
+  bool cancelled_ = false;
+  CancellerID last_id_ = 0;
+  std::map<CancellerID, std::function<void()>> cancellers_;
+
+  HTTPClientCancellation(const HTTPClientCancellation&) = delete;
+  void operator=(const HTTPClientCancellation&) = delete;
+};
+
+}  // namespace api
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_API_IMPL_CANCELLATION_H
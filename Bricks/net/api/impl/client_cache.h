@@ -0,0 +1,323 @@
+// The cache of the responses to the `GET` requests of the HTTP client, for the URLs polled again and again,
+// such as the configurations that rarely change, not to be downloaded in full each time.
+//
+//   HTTPClientCache cache(1024 * 1024, "/var/cache/device");
+//   const auto config = HTTP(GET(url).SetCache(cache));
+//
+// The responses with an `ETag` or a `Last-Modified` header are cached by their URLs. The next request
+// to the URL is sent with `If-None-Match` and `If-Modified-Since`, and, should the server respond with
+// "304 Not Modified", the cached body is returned, with the code of 200, in memory or in the file
+// of `SaveResponseToFile`. The responses with neither header are not cached, and drop the ones cached before.
+//
+// The bodies are kept in memory, up to `max_memory_bytes`, the least recently used ones evicted first.
+// With a `directory`, the responses are also written there, up to `max_disk_bytes`, and the bodies not
+// in memory are read from there. The responses written by a previous run are picked up on construction,
+// for the device to send the conditional requests from the first one on.
+//
+// `HTTP(...)` and `HTTPBatch(...)` use the cache, with the POSIX implementation; `HTTPAsync(...)` sends
+// the requests as they are. Thread safe. The files are read and written under the lock, which is fine
+// for the rarely changing responses it is meant for.
+
+#ifndef BRICKS_NET_API_IMPL_CLIENT_CACHE_H
+#define BRICKS_NET_API_IMPL_CLIENT_CACHE_H
+
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "../../../file/file.h"
+
+namespace bricks {
+namespace net {
+namespace api {
+
+const size_t kHTTPClientCacheDefaultMaxMemoryBytes = 4 * 1024 * 1024;
+const uint64_t kHTTPClientCacheDefaultMaxDiskBytes = 64 * 1024 * 1024;
+
+class HTTPClientCache final {
+ public:
+  // The validators of the cached response, to send the conditional request with.
+  struct Validators {
+    std::string etag;
+    std::string last_modified;
+  };
+
+  explicit HTTPClientCache(size_t max_memory_bytes = kHTTPClientCacheDefaultMaxMemoryBytes,
+                           const std::string& directory = "",
+                           uint64_t max_disk_bytes = kHTTPClientCacheDefaultMaxDiskBytes)
+      : max_memory_bytes_(max_memory_bytes), directory_(directory), max_disk_bytes_(max_disk_bytes) {
+    if (!directory_.empty()) {
+      FileSystem::CreateDirectory(directory_);
+      LoadDisk();
+    }
+  }
+
+  // Returns false if nothing is cached for the URL.
+  bool Find(const std::string& url, Validators& validators) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto memory = memory_index_.find(url);
+    if (memory != memory_index_.end()) {
+      validators = memory->second->validators;
+      return true;
+    }
+    const auto disk = disk_index_.find(url);
+    if (disk != disk_index_.end()) {
+      validators = disk->second->validators;
+      return true;
+    }
+    return false;
+  }
+
+  // Sets `body` to the cached one. Returns false if it is not cached, or its file can not be read.
+  bool ReadBody(const std::string& url, std::string& body) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto memory = memory_index_.find(url);
+    if (memory != memory_index_.end()) {
+      memory_lru_.splice(memory_lru_.begin(), memory_lru_, memory->second);
+      body = memory->second->body;
+      return true;
+    }
+    const auto disk = disk_index_.find(url);
+    if (disk == disk_index_.end()) {
+      return false;
+    }
+    try {
+      body = FileSystem::ReadFileAsString(BodyFileName(url));
+    } catch (const FileException&) {
+      EraseFromDisk(disk);
+      return false;
+    }
+    disk_lru_.splice(disk_lru_.begin(), disk_lru_, disk->second);
+    // Read once, the body is likely to be read again.
+    const Validators validators = disk->second->validators;
+    InsertIntoMemory(url, validators, body);
+    return true;
+  }
+
+  // Writes the cached body into the file. Returns false if it is not cached, or the files fail.
+  bool CopyBodyToFile(const std::string& url, const std::string& file_name) {
+    std::string body;
+    if (!ReadBody(url, body)) {
+      return false;
+    }
+    try {
+      FileSystem::WriteStringToFile(file_name, body);
+      return true;
+    } catch (const FileException&) {
+      return false;
+    }
+  }
+
+  // Caches the response, replacing the one cached for the URL before.
+  void Store(const std::string& url, const Validators& validators, const std::string& body) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    EraseUnlocked(url);
+    InsertIntoMemory(url, validators, body);
+    InsertIntoDisk(url, validators, body);
+  }
+
+  // Caches the response the body of which has been saved into the file.
+  void StoreFromFile(const std::string& url, const Validators& validators, const std::string& file_name) {
+    std::string body;
+    try {
+      body = FileSystem::ReadFileAsString(file_name);
+    } catch (const FileException&) {
+      Erase(url);
+      return;
+    }
+    Store(url, validators, body);
+  }
+
+  void Erase(const std::string& url) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    EraseUnlocked(url);
+  }
+
+  size_t MemoryBytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return memory_bytes_;
+  }
+
+  uint64_t DiskBytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return disk_bytes_;
+  }
+
+ private:
+  struct MemoryEntry {
+    std::string url;
+    Validators validators;
+    std::string body;
+    size_t Bytes() const {
+      return url.length() + validators.etag.length() + validators.last_modified.length() + body.length();
+    }
+  };
+
+  struct DiskEntry {
+    std::string url;
+    Validators validators;
+    uint64_t size;
+  };
+
+  typedef std::list<MemoryEntry> MemoryLRU;  // The most recently used first.
+  typedef std::list<DiskEntry> DiskLRU;
+
+  // The file names are the FNV-1a hashes of the URLs, which are kept in the metafiles next to the bodies.
+  std::string BaseFileName(const std::string& url) const {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : url) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    std::string name(16, '0');
+    for (size_t i = 16; i; --i, hash >>= 4) {
+      name[i - 1] = "0123456789abcdef"[hash & 15];
+    }
+    return FileSystem::JoinPath(directory_, name);
+  }
+  std::string BodyFileName(const std::string& url) const { return BaseFileName(url) + ".body"; }
+  std::string MetaFileName(const std::string& url) const { return BaseFileName(url) + ".meta"; }
+
+  void InsertIntoMemory(const std::string& url, const Validators& validators, const std::string& body) {
+    MemoryEntry entry{url, validators, body};
+    const size_t bytes = entry.Bytes();
+    if (bytes > max_memory_bytes_) {
+      return;
+    }
+    memory_lru_.push_front(std::move(entry));
+    memory_index_[url] = memory_lru_.begin();
+    memory_bytes_ += bytes;
+    while (memory_bytes_ > max_memory_bytes_) {
+      // The evicted bodies stay on disk, if there is a disk tier.
+      EraseFromMemory(memory_index_.find(memory_lru_.back().url));
+    }
+  }
+
+  void InsertIntoDisk(const std::string& url, const Validators& validators, const std::string& body) {
+    if (directory_.empty() || body.length() > max_disk_bytes_) {
+      return;
+    }
+    // Another URL of the same hash, unlikely as it is, would have its files overwritten.
+    for (auto it = disk_lru_.begin(); it != disk_lru_.end(); ++it) {
+      if (BaseFileName(it->url) == BaseFileName(url)) {
+        EraseFromDisk(disk_index_.find(it->url));
+        break;
+      }
+    }
+    try {
+      FileSystem::WriteFileAtomically(BodyFileName(url), body, WriteFileAtomicallyParameters::NoSync);
+      // The metafile goes last, for the body to be there once it is.
+      FileSystem::WriteFileAtomically(MetaFileName(url),
+                                      url + '\n' + validators.etag + '\n' + validators.last_modified + '\n',
+                                      WriteFileAtomicallyParameters::NoSync);
+    } catch (const FileException&) {
+      FileSystem::RemoveFile(BodyFileName(url), RemoveFileParameters::Silent);
+      return;
+    }
+    disk_lru_.push_front(DiskEntry{url, validators, body.length()});
+    disk_index_[url] = disk_lru_.begin();
+    disk_bytes_ += body.length();
+    TrimDisk();
+  }
+
+  void TrimDisk() {
+    while (disk_bytes_ > max_disk_bytes_) {
+      const std::string url = disk_lru_.back().url;
+      EraseFromDisk(disk_index_.find(url));
+      const auto memory = memory_index_.find(url);
+      if (memory != memory_index_.end()) {
+        EraseFromMemory(memory);
+      }
+    }
+  }
+
+  void EraseFromMemory(std::unordered_map<std::string, MemoryLRU::iterator>::iterator it) {
+    memory_bytes_ -= it->second->Bytes();
+    memory_lru_.erase(it->second);
+    memory_index_.erase(it);
+  }
+
+  void EraseFromDisk(std::unordered_map<std::string, DiskLRU::iterator>::iterator it) {
+    FileSystem::RemoveFile(MetaFileName(it->first), RemoveFileParameters::Silent);
+    FileSystem::RemoveFile(BodyFileName(it->first), RemoveFileParameters::Silent);
+    disk_bytes_ -= it->second->size;
+    disk_lru_.erase(it->second);
+    disk_index_.erase(it);
+  }
+
+  void EraseUnlocked(const std::string& url) {
+    const auto memory = memory_index_.find(url);
+    if (memory != memory_index_.end()) {
+      EraseFromMemory(memory);
+    }
+    const auto disk = disk_index_.find(url);
+    if (disk != disk_index_.end()) {
+      EraseFromDisk(disk);
+    }
+  }
+
+  // Picks up the responses written by the previous runs. The bodies with no metafile, the metafiles
+  // with no body and the temporary files are left from a crash in between, and are removed.
+  void LoadDisk() {
+    std::list<std::string> names;
+    FileSystem::ScanDir(directory_, [&names](const std::string& name) { names.push_back(name); });
+    for (const std::string& name : names) {
+      const std::string file_name = FileSystem::JoinPath(directory_, name);
+      const size_t dot = name.rfind('.');
+      const std::string extension = (dot == std::string::npos) ? "" : name.substr(dot);
+      if (extension == ".meta") {
+        std::ifstream fi(file_name);
+        DiskEntry entry;
+        const std::string body_file_name =
+            file_name.substr(0, file_name.length() - extension.length()) + ".body";
+        if (std::getline(fi, entry.url) && std::getline(fi, entry.validators.etag) &&
+            std::getline(fi, entry.validators.last_modified) && FileSystem::FileExists(body_file_name) &&
+            MetaFileName(entry.url) == file_name && !disk_index_.count(entry.url)) {
+          entry.size = FileSystem::GetFileSize(body_file_name);
+          disk_bytes_ += entry.size;
+          disk_lru_.push_back(std::move(entry));
+          disk_index_[disk_lru_.back().url] = std::prev(disk_lru_.end());
+        } else {
+          FileSystem::RemoveFile(file_name, RemoveFileParameters::Silent);
+        }
+      }
+    }
+    for (const std::string& name : names) {
+      const size_t dot = name.rfind('.');
+      const std::string extension = (dot == std::string::npos) ? "" : name.substr(dot);
+      if (extension == ".body" || extension == ".tmp") {
+        const std::string base_name = FileSystem::JoinPath(directory_, name.substr(0, dot));
+        if (!FileSystem::FileExists(base_name + ".meta")) {
+          FileSystem::RemoveFile(FileSystem::JoinPath(directory_, name), RemoveFileParameters::Silent);
+        }
+      }
+    }
+    TrimDisk();
+  }
+
+  mutable std::mutex mutex_;
+  const size_t max_memory_bytes_;
+  const std::string directory_;
+  const uint64_t max_disk_bytes_;
+
+  MemoryLRU memory_lru_;
+  std::unordered_map<std::string, MemoryLRU::iterator> memory_index_;
+  size_t memory_bytes_ = 0;
+
+  DiskLRU disk_lru_;
+  std::unordered_map<std::string, DiskLRU::iterator> disk_index_;
+  uint64_t disk_bytes_ = 0;
+
+  HTTPClientCache(const HTTPClientCache&) = delete;
+  void operator=(const HTTPClientCache&) = delete;
+};
+
+}  // namespace api
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_API_IMPL_CLIENT_CACHE_H
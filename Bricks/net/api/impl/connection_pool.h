@@ -0,0 +1,369 @@
+// The keep-alive connections and resolved addresses shared by the requests of `HTTPClientPOSIX`.
+//
+// Without it, each request, and each redirect, resolves the host and connects to it anew. With it,
+// the connection is returned to the pool once its response has been read in full, and the next request
+// to the same host and port takes it instead of connecting, while it has been idle for at most
+// `idle_timeout_ms`. At most `max_idle_connections_per_host` are kept per host and port. The resolved
+// addresses are cached for `dns_cache_ttl_ms`.
+//
+// The peer may close an idle connection at any time. The pooled connections are checked with `IsIdle()`
+// before they are reused, and the client retries the request once on a new connection if the reused one fails.
+//
+// With `tls`, the connections are made over TLS, with `TLSContext::DefaultClient()`, and are pooled apart
+// from the plaintext ones. Its cached sessions make the new connections to the same host and port resume
+// the TLS session instead of performing the full handshake. Without `BRICKS_NET_TLS`, `Connect()` throws
+// `TLSNotSupportedException` for them.
+//
+// With HTTP/2, see `EnableHTTP2()` and `SetHTTP2PriorKnowledge()`, there is a single connection per host and
+// port instead, shared by the concurrent requests, each one a stream of its own, see `impl/http2.h`.
+//
+// The latencies of the recent requests to each host and port are kept as well, for the hedged requests to be
+// sent once the first attempt has taken longer than most, see `HTTPRequestGET::SetHedging()`.
+//
+// Thread safe: the connections of HTTP/1.1 are taken out of the pool for the duration of the request.
+
+#ifndef BRICKS_NET_API_IMPL_CONNECTION_POOL_H
+#define BRICKS_NET_API_IMPL_CONNECTION_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "http2.h"
+
+#include "../../tcp/tcp.h"
+#include "../../../time/chrono.h"
+
+namespace bricks {
+namespace net {
+namespace api {
+
+const size_t kDefaultMaxIdleConnectionsPerHost = 4;
+// Below the 60 seconds or more after which most servers close the idle keep-alive connections.
+const uint64_t kDefaultIdleConnectionTimeoutMs = 30 * 1000;
+const uint64_t kDefaultDNSCacheTTLMs = 60 * 1000;
+// The latencies kept per host and port, and how many there should be for their percentiles to be of use.
+const size_t kLatencySamplesPerHost = 128;
+const size_t kMinLatencySamplesPerHost = 20;
+
+class HTTPClientConnectionPool final {
+ public:
+  HTTPClientConnectionPool() = default;
+
+  // Returns an idle connection to `host:port` if there is one, with `reused` set to true,
+  // or a new one otherwise, connected with `parameters`.
+  Connection Acquire(const std::string& host,
+                     int port,
+                     bool& reused,
+                     bool tls = false,
+                     const ClientSocketParameters& parameters = ClientSocketParameters()) {
+    const std::string key = Key(host, port, tls);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const uint64_t now = static_cast<uint64_t>(bricks::time::Now());
+      const auto cit = idle_.find(key);
+      if (cit != idle_.end()) {
+        std::deque<IdleConnection>& connections = cit->second;
+        // The most recently used connection is the least likely to have been closed by the peer.
+        while (!connections.empty()) {
+          IdleConnection idle = std::move(connections.back());
+          connections.pop_back();
+          if (now - idle.since_ms <= idle_timeout_ms_ && idle.connection.IsIdle()) {
+            reused = true;
+            return std::move(idle.connection);
+          }
+        }
+      }
+    }
+    reused = false;
+    return Connect(host, port, tls, parameters);
+  }
+
+  // Connects to `host:port` anew, to the cached addresses if they have been resolved recently.
+  Connection Connect(const std::string& host,
+                     int port,
+                     bool tls = false,
+                     const ClientSocketParameters& parameters = ClientSocketParameters()) {
+#if !defined(BRICKS_NET_TLS)
+    if (tls) {
+      throw TLSNotSupportedException();
+    }
+#endif
+    Connection connection = ClientSocket(Resolve(host, port), Key(host, port), parameters);
+#if defined(BRICKS_NET_TLS)
+    if (tls) {
+      connection.StartTLS(TLSContext::DefaultClient(), host, Key(host, port));
+    }
+#endif
+    return connection;
+  }
+
+  // Keeps the connection for the next request to `host:port`, unless there are enough idle ones already.
+  void Release(const std::string& host, int port, Connection&& connection) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::deque<IdleConnection>& connections = idle_[Key(host, port, connection.IsTLS())];
+    if (connections.size() >= max_idle_connections_per_host_) {
+      if (connections.empty()) {
+        return;
+      }
+      connections.pop_front();
+    }
+    connections.emplace_back(std::move(connection), static_cast<uint64_t>(bricks::time::Now()));
+  }
+
+  // The HTTP/2 connection to `host:port`, shared by the concurrent requests, or nullptr if the requests to it
+  // are to be sent over HTTP/1.1: unless HTTP/2 has been enabled for it, or if the server has chosen HTTP/1.1
+  // with ALPN, in which case the new connection is kept as an idle one, for the request to take it.
+  // `reused` is set to whether the connection has been established before. The concurrent requests wait
+  // for the one that is establishing the connection, to share it. It is connected with `parameters`.
+  std::shared_ptr<HTTP2ClientConnection> AcquireHTTP2(
+      const std::string& host,
+      int port,
+      bool tls,
+      bool& reused,
+      const ClientSocketParameters& parameters = ClientSocketParameters()) {
+    const std::string key = Key(host, port, tls);
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!(tls ? http2_alpn_ && !http1_only_.count(key) : http2_prior_knowledge_.count(key) > 0)) {
+      return nullptr;
+    }
+    http2_connecting_condition_.wait(lock, [this, &key]() { return !http2_connecting_.count(key); });
+    const auto cit = http2_.find(key);
+    if (cit != http2_.end()) {
+      if (cit->second->IsUsable()) {
+        reused = true;
+        return cit->second;
+      }
+      http2_.erase(cit);
+    }
+    http2_connecting_.insert(key);
+    lock.unlock();
+    std::shared_ptr<HTTP2ClientConnection> result;
+    try {
+      Connection connection = ConnectHTTP2(host, port, tls, parameters);
+      if (!tls || ALPNProtocol(connection) == "h2") {
+        std::string authority = (port == (tls ? 443 : 80)) ? host : host + ':' + std::to_string(port);
+        if (IsUnixSocketHost(host)) {
+          authority = "localhost";
+        }
+        const std::string scheme = tls ? "https" : "http";
+        result = std::make_shared<HTTP2ClientConnection>(std::move(connection), scheme, authority);
+      } else {
+        Release(host, port, std::move(connection));
+      }
+    } catch (...) {
+      lock.lock();
+      http2_connecting_.erase(key);
+      http2_connecting_condition_.notify_all();
+      throw;
+    }
+    lock.lock();
+    http2_connecting_.erase(key);
+    if (result) {
+      http2_[key] = result;
+    } else {
+      http1_only_.insert(key);
+    }
+    http2_connecting_condition_.notify_all();
+    reused = false;
+    return result;
+  }
+
+  // Forgets the HTTP/2 connection that has failed, for the next request to connect anew.
+  void DiscardHTTP2(const std::string& host,
+                    int port,
+                    bool tls,
+                    const std::shared_ptr<HTTP2ClientConnection>& connection) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto cit = http2_.find(Key(host, port, tls));
+    if (cit != http2_.end() && cit->second == connection) {
+      http2_.erase(cit);
+    }
+  }
+
+  // Offers "h2" with ALPN on the TLS connections, for the servers that support it to multiplex the requests
+  // over a single connection. Off by default.
+  void EnableHTTP2(bool enable = true) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    http2_alpn_ = enable;
+    http1_only_.clear();
+  }
+
+  // Sends the requests to `http://host:port` over HTTP/2 in cleartext right away, "h2c" with prior
+  // knowledge, for the servers known to support it.
+  void SetHTTP2PriorKnowledge(const std::string& host, int port, bool enable = true) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (enable) {
+      http2_prior_knowledge_.insert(Key(host, port));
+    } else {
+      http2_prior_knowledge_.erase(Key(host, port));
+    }
+  }
+
+  bool HasHTTP2Connection(const std::string& host, int port, bool tls = false) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return http2_.count(Key(host, port, tls)) > 0;
+  }
+
+  std::vector<SocketAddress> Resolve(const std::string& host, int port) {
+    const std::string key = Key(host, port);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const auto cit = addresses_.find(key);
+      if (cit != addresses_.end() && static_cast<uint64_t>(bricks::time::Now()) < cit->second.second) {
+        return cit->second.first;
+      }
+    }
+    // Resolve without holding the mutex, not to block the requests to other hosts.
+    const std::vector<SocketAddress> addresses = ResolveAddresses(host, port);
+    std::lock_guard<std::mutex> lock(mutex_);
+    addresses_[key] = std::make_pair(addresses, static_cast<uint64_t>(bricks::time::Now()) + dns_cache_ttl_ms_);
+    return addresses;
+  }
+
+  // Keeps the latency of a request to `host:port`, replacing the oldest one of the `kLatencySamplesPerHost`.
+  void RecordLatency(const std::string& host, int port, bool tls, uint64_t latency_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    LatencySamples& samples = latencies_[Key(host, port, tls)];
+    if (samples.ms.size() < kLatencySamplesPerHost) {
+      samples.ms.push_back(latency_ms);
+    } else {
+      samples.ms[samples.next] = latency_ms;
+      samples.next = (samples.next + 1) % kLatencySamplesPerHost;
+    }
+  }
+
+  // The `percentile` of the latencies recorded for `host:port`, or zero if there are fewer than
+  // `kMinLatencySamplesPerHost` of them.
+  uint64_t LatencyPercentileMs(const std::string& host, int port, bool tls, size_t percentile) const {
+    std::vector<uint64_t> ms;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const auto cit = latencies_.find(Key(host, port, tls));
+      if (cit == latencies_.end() || cit->second.ms.size() < kMinLatencySamplesPerHost) {
+        return 0;
+      }
+      ms = cit->second.ms;
+    }
+    const size_t index = std::min(ms.size() - 1, ms.size() * std::min<size_t>(percentile, 100) / 100);
+    std::nth_element(ms.begin(), ms.begin() + static_cast<std::ptrdiff_t>(index), ms.end());
+    return ms[index];
+  }
+
+  size_t IdleConnections(const std::string& host, int port, bool tls = false) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto cit = idle_.find(Key(host, port, tls));
+    return cit != idle_.end() ? cit->second.size() : 0;
+  }
+
+  // Closes the idle connections, lets go of the HTTP/2 ones, and forgets the resolved addresses
+  // and the latencies.
+  void Clear() {
+    std::map<std::string, std::shared_ptr<HTTP2ClientConnection>> http2;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      idle_.clear();
+      addresses_.clear();
+      latencies_.clear();
+      http2.swap(http2_);
+      http1_only_.clear();
+    }
+    // Closed outside the lock, as each one waits for its thread, once the requests in flight over it are done.
+  }
+
+  void SetMaxIdleConnectionsPerHost(size_t max_idle_connections_per_host) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_idle_connections_per_host_ = max_idle_connections_per_host;
+  }
+  void SetIdleConnectionTimeoutMs(uint64_t idle_timeout_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_timeout_ms_ = idle_timeout_ms;
+  }
+  void SetDNSCacheTTLMs(uint64_t dns_cache_ttl_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    dns_cache_ttl_ms_ = dns_cache_ttl_ms;
+  }
+
+ private:
+  struct IdleConnection {
+    Connection connection;
+    uint64_t since_ms;
+    IdleConnection(Connection&& connection, uint64_t since_ms)
+        : connection(std::move(connection)), since_ms(since_ms) {}
+    IdleConnection(IdleConnection&& rhs) : connection(std::move(rhs.connection)), since_ms(rhs.since_ms) {}
+    void operator=(IdleConnection&& rhs) {
+      connection = std::move(rhs.connection);
+      since_ms = rhs.since_ms;
+    }
+  };
+
+  // A ring of the latencies of the most recent requests.
+  struct LatencySamples {
+    std::vector<uint64_t> ms;
+    size_t next = 0;
+  };
+
+  Connection ConnectHTTP2(const std::string& host,
+                          int port,
+                          bool tls,
+                          const ClientSocketParameters& parameters) {
+#if defined(BRICKS_NET_TLS)
+    if (tls) {
+      Connection connection = ClientSocket(Resolve(host, port), Key(host, port), parameters);
+      connection.StartTLS(TLSContext::DefaultClient(), host, Key(host, port), {"h2", "http/1.1"});
+      return connection;
+    }
+#endif
+    return Connect(host, port, tls, parameters);
+  }
+
+  static std::string ALPNProtocol(Connection& connection) {
+#if defined(BRICKS_NET_TLS)
+    return connection.TLS() ? connection.TLS()->ALPNProtocol() : "";
+#else
+    static_cast<void>(connection);
+    return "";
+#endif
+  }
+
+  static std::string Key(const std::string& host, int port, bool tls = false) {
+    return (tls ? "tls:" : "") + host + ':' + std::to_string(port);
+  }
+
+  mutable std::mutex mutex_;
+  std::map<std::string, std::deque<IdleConnection>> idle_;
+  // The resolved addresses, with the times until which they are valid.
+  std::map<std::string, std::pair<std::vector<SocketAddress>, uint64_t>> addresses_;
+  std::map<std::string, LatencySamples> latencies_;
+
+  std::map<std::string, std::shared_ptr<HTTP2ClientConnection>> http2_;
+  // The keys being connected to by a request, for the others to wait for it and share its connection.
+  std::set<std::string> http2_connecting_;
+  std::condition_variable http2_connecting_condition_;
+  bool http2_alpn_ = false;
+  std::set<std::string> http2_prior_knowledge_;
+  // The servers that have chosen HTTP/1.1 with ALPN.
+  std::set<std::string> http1_only_;
+
+  size_t max_idle_connections_per_host_ = kDefaultMaxIdleConnectionsPerHost;
+  uint64_t idle_timeout_ms_ = kDefaultIdleConnectionTimeoutMs;
+  uint64_t dns_cache_ttl_ms_ = kDefaultDNSCacheTTLMs;
+
+  HTTPClientConnectionPool(const HTTPClientConnectionPool&) = delete;
+  void operator=(const HTTPClientConnectionPool&) = delete;
+};
+
+}  // namespace api
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_API_IMPL_CONNECTION_POOL_H
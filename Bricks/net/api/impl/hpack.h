@@ -0,0 +1,462 @@
+// HPACK, the compression of the headers of HTTP/2, RFC 7541, for `impl/http2.h`.
+//
+// Each end of the connection keeps a dynamic table of the header fields sent recently, besides the static
+// table of the common ones, and refers to the fields by their indexes in them instead of repeating them.
+// The strings are Huffman-coded where that makes them shorter.
+//
+// * `HPACKEncoder` indexes the fields that repeat from request to request, such as `:authority`,
+//   `user-agent` and `content-type`, for them to take a byte each in the subsequent requests.
+//   The ones that do not, such as `:path` and `content-length`, are sent as literals, not to evict the others,
+//   and the credentials are marked as never to be indexed by the intermediaries.
+// * `HPACKDecoder` decodes all the representations, within the size of the table this end has allowed.
+//
+// NOT THREAD SAFE: each encoder and decoder is used by one connection, in the order of its header blocks.
+
+#ifndef BRICKS_NET_API_IMPL_HPACK_H
+#define BRICKS_NET_API_IMPL_HPACK_H
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../../exceptions.h"
+
+namespace bricks {
+namespace net {
+namespace api {
+
+// The header fields, in order, with the names in lowercase.
+typedef std::vector<std::pair<std::string, std::string>> HPACKHeaders;
+
+// The size of the dynamic tables each end starts with, and the largest one the encoder uses.
+const size_t kHPACKDefaultTableSize = 4096;
+
+namespace hpack {
+
+struct StaticEntry {
+  const char* name;
+  const char* value;
+};
+
+enum { kStaticTableSize = 61 };
+
+// RFC 7541, Appendix A. The index of the first entry is 1.
+inline const StaticEntry* StaticTable() {
+  static const StaticEntry table[kStaticTableSize] = {
+      {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+      {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+      {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+      {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+      {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""}, {"authorization", ""},
+      {"cache-control", ""}, {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""},
+      {"content-length", ""}, {"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+      {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+      {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+      {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""}, {"location", ""}, {"max-forwards", ""},
+      {"proxy-authenticate", ""}, {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+      {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+      {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""}
+  };
+  return table;
+}
+
+struct HuffmanCode {
+  uint32_t code;
+  uint32_t length;
+};
+
+// RFC 7541, Appendix B, the codes of the octets, in their lowest bits. The end of string, with the code of 30
+// ones, is never sent, and the padding of the last octet is the prefix of it.
+inline const HuffmanCode* HuffmanCodes() {
+  static const HuffmanCode codes[256] = {
+      {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28},
+      {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+      {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28},
+      {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+      {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+      {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12}, {0x1ff9, 13},
+      {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6},
+      {0x17, 6}, {0x18, 6}, {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+      {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+      {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7}, {0x63, 7},
+      {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7},
+      {0x6d, 7}, {0x6e, 7}, {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7}, {0xfd, 8},
+      {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6}, {0x7ffd, 15}, {0x3, 5}, {0x23, 6},
+      {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7}, {0x28, 6},
+      {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7},
+      {0x78, 7}, {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13},
+      {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22},
+      {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23},
+      {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23}, {0xffffec, 24},
+      {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23},
+      {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22},
+      {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20},
+      {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21}, {0x7fffea, 23},
+      {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23},
+      {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23},
+      {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22},
+      {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23}, {0x3ffffe0, 26},
+      {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22},
+      {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27},
+      {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26},
+      {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24}, {0x1fffe4, 21},
+      {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27},
+      {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21}, {0x3fffe9, 22},
+      {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25},
+      {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23}, {0x3ffffeb, 26},
+      {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27},
+      {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27}, {0x7ffffee, 27},
+      {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}
+  };
+  return codes;
+}
+
+// The size of the entry in the dynamic table, with the overhead of 32 bytes RFC 7541 counts each one with.
+inline size_t EntrySize(const std::string& name, const std::string& value) {
+  return name.length() + value.length() + 32;
+}
+
+// The integer in the lowest `prefix_bits` bits of the first byte, the rest of which are `flags`,
+// followed by as many bytes of seven bits each as it takes.
+inline void EncodeInteger(uint64_t value, int prefix_bits, uint8_t flags, std::string& output) {
+  const uint64_t max_prefix = (static_cast<uint64_t>(1) << prefix_bits) - 1;
+  if (value < max_prefix) {
+    output += static_cast<char>(flags | value);
+    return;
+  }
+  output += static_cast<char>(flags | max_prefix);
+  value -= max_prefix;
+  while (value >= 0x80) {
+    output += static_cast<char>(0x80 | (value & 0x7f));
+    value >>= 7;
+  }
+  output += static_cast<char>(value);
+}
+
+// Throws `HPACKDecodingException` if the integer is cut short or does not fit.
+inline uint64_t DecodeInteger(const uint8_t*& p, const uint8_t* end, int prefix_bits) {
+  if (p == end) {
+    throw HPACKDecodingException();
+  }
+  const uint64_t max_prefix = (static_cast<uint64_t>(1) << prefix_bits) - 1;
+  uint64_t value = *p++ & max_prefix;
+  if (value < max_prefix) {
+    return value;
+  }
+  for (int shift = 0; shift <= 56; shift += 7) {
+    if (p == end) {
+      break;
+    }
+    const uint8_t byte = *p++;
+    value += static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+  throw HPACKDecodingException();
+}
+
+inline size_t HuffmanEncodedLength(const std::string& s) {
+  const HuffmanCode* codes = HuffmanCodes();
+  uint64_t bits = 0;
+  for (const char c : s) {
+    bits += codes[static_cast<uint8_t>(c)].length;
+  }
+  return static_cast<size_t>((bits + 7) / 8);
+}
+
+inline void HuffmanEncode(const std::string& s, std::string& output) {
+  const HuffmanCode* codes = HuffmanCodes();
+  uint64_t bits = 0;
+  uint32_t count = 0;
+  for (const char c : s) {
+    const HuffmanCode& code = codes[static_cast<uint8_t>(c)];
+    bits = (bits << code.length) | code.code;
+    count += code.length;
+    while (count >= 8) {
+      count -= 8;
+      output += static_cast<char>(bits >> count);
+    }
+    bits &= (static_cast<uint64_t>(1) << count) - 1;
+  }
+  if (count) {
+    output += static_cast<char>((bits << (8 - count)) | (0xff >> count));
+  }
+}
+
+// The binary tree of the codes, walked bit by bit.
+class HuffmanDecoder final {
+ public:
+  static const HuffmanDecoder& Singleton() {
+    static const HuffmanDecoder decoder;
+    return decoder;
+  }
+
+  // Appends the decoded string to `output`. Returns false if it is not a valid Huffman-coded string:
+  // with the end of string in it, or with the padding longer than seven bits or not of ones.
+  bool Decode(const uint8_t* data, size_t length, std::string& output) const {
+    int16_t node = 0;
+    uint32_t padding_bits = 0;
+    bool padding_of_ones = true;
+    for (size_t i = 0; i < length; ++i) {
+      for (int shift = 7; shift >= 0; --shift) {
+        const int bit = (data[i] >> shift) & 1;
+        node = nodes_[node].children[bit];
+        if (node < 0) {
+          return false;
+        }
+        if (nodes_[node].symbol >= 0) {
+          output += static_cast<char>(nodes_[node].symbol);
+          node = 0;
+          padding_bits = 0;
+          padding_of_ones = true;
+        } else {
+          ++padding_bits;
+          padding_of_ones = padding_of_ones && bit;
+        }
+      }
+    }
+    return padding_bits <= 7 && padding_of_ones;
+  }
+
+ private:
+  struct Node {
+    int16_t children[2] = {-1, -1};
+    int16_t symbol = -1;
+  };
+
+  HuffmanDecoder() : nodes_(1) {
+    const HuffmanCode* codes = HuffmanCodes();
+    for (int symbol = 0; symbol < 256; ++symbol) {
+      int16_t node = 0;
+      for (int bit = static_cast<int>(codes[symbol].length) - 1; bit >= 0; --bit) {
+        const int b = (codes[symbol].code >> bit) & 1;
+        if (nodes_[node].children[b] < 0) {
+          nodes_[node].children[b] = static_cast<int16_t>(nodes_.size());
+          nodes_.emplace_back();
+        }
+        node = nodes_[node].children[b];
+      }
+      nodes_[node].symbol = static_cast<int16_t>(symbol);
+    }
+  }
+
+  std::vector<Node> nodes_;
+};
+
+// The fields in the order of their indexes, from 62 on: the most recently added one first.
+class DynamicTable final {
+ public:
+  explicit DynamicTable(size_t max_size = kHPACKDefaultTableSize) : max_size_(max_size) {}
+
+  // Evicts the oldest entries for the rest to fit.
+  void SetMaxSize(size_t max_size) {
+    max_size_ = max_size;
+    Evict(0);
+  }
+
+  // An entry larger than the table empties it, and is not added.
+  void Add(const std::string& name, const std::string& value) {
+    const size_t size = EntrySize(name, value);
+    Evict(size);
+    if (size <= max_size_) {
+      entries_.emplace_front(name, value);
+      size_ += size;
+    }
+  }
+
+  size_t MaxSize() const { return max_size_; }
+  size_t Size() const { return size_; }
+  size_t Count() const { return entries_.size(); }
+  const std::pair<std::string, std::string>& Entry(size_t i) const { return entries_[i]; }
+
+ private:
+  void Evict(size_t room) {
+    while (!entries_.empty() && size_ + room > max_size_) {
+      size_ -= EntrySize(entries_.back().first, entries_.back().second);
+      entries_.pop_back();
+    }
+  }
+
+  std::deque<std::pair<std::string, std::string>> entries_;
+  size_t size_ = 0;
+  size_t max_size_;
+};
+
+}  // namespace hpack
+
+class HPACKEncoder final {
+ public:
+  // Follows the `SETTINGS_HEADER_TABLE_SIZE` of the peer, up to `kHPACKDefaultTableSize`. The change is sent
+  // at the beginning of the next header block, with the smallest size in between if it has shrunk and grown.
+  void SetPeerMaxTableSize(size_t peer_max_size) {
+    const size_t max_size = std::min(peer_max_size, kHPACKDefaultTableSize);
+    if (max_size != table_.MaxSize()) {
+      min_size_update_ = size_update_pending_ ? std::min(min_size_update_, max_size) : max_size;
+      size_update_pending_ = true;
+      table_.SetMaxSize(max_size);
+    }
+  }
+
+  // Appends the header block of `headers` to `output`.
+  void Encode(const HPACKHeaders& headers, std::string& output) {
+    if (size_update_pending_) {
+      if (min_size_update_ < table_.MaxSize()) {
+        hpack::EncodeInteger(min_size_update_, 5, 0x20, output);
+      }
+      hpack::EncodeInteger(table_.MaxSize(), 5, 0x20, output);
+      size_update_pending_ = false;
+    }
+    for (const auto& header : headers) {
+      const std::string& name = header.first;
+      const std::string& value = header.second;
+      uint64_t name_index = 0;
+      uint64_t index = 0;
+      const hpack::StaticEntry* static_table = hpack::StaticTable();
+      for (size_t i = 0; i < hpack::kStaticTableSize && !index; ++i) {
+        if (name == static_table[i].name) {
+          name_index = name_index ? name_index : i + 1;
+          index = (value == static_table[i].value) ? i + 1 : 0;
+        }
+      }
+      for (size_t i = 0; i < table_.Count() && !index; ++i) {
+        if (name == table_.Entry(i).first) {
+          name_index = name_index ? name_index : hpack::kStaticTableSize + 1 + i;
+          index = (value == table_.Entry(i).second) ? hpack::kStaticTableSize + 1 + i : 0;
+        }
+      }
+      if (index) {
+        hpack::EncodeInteger(index, 7, 0x80, output);
+        continue;
+      }
+      if (NeverIndexed(name)) {
+        hpack::EncodeInteger(name_index, 4, 0x10, output);
+      } else if (Indexed(name) && hpack::EntrySize(name, value) <= table_.MaxSize()) {
+        hpack::EncodeInteger(name_index, 6, 0x40, output);
+        table_.Add(name, value);
+      } else {
+        hpack::EncodeInteger(name_index, 4, 0x00, output);
+      }
+      if (!name_index) {
+        EncodeString(name, output);
+      }
+      EncodeString(value, output);
+    }
+  }
+
+ private:
+  static bool NeverIndexed(const std::string& name) {
+    return name == "authorization" || name == "proxy-authorization" || name == "cookie";
+  }
+
+  // The fields that differ from request to request would only evict the ones that repeat.
+  static bool Indexed(const std::string& name) {
+    return name != ":path" && name != "content-length" && name != "date" && name != "etag" &&
+           name != "if-modified-since" && name != "if-none-match";
+  }
+
+  static void EncodeString(const std::string& s, std::string& output) {
+    const size_t huffman_length = hpack::HuffmanEncodedLength(s);
+    if (huffman_length < s.length()) {
+      hpack::EncodeInteger(huffman_length, 7, 0x80, output);
+      hpack::HuffmanEncode(s, output);
+    } else {
+      hpack::EncodeInteger(s.length(), 7, 0x00, output);
+      output += s;
+    }
+  }
+
+  hpack::DynamicTable table_;
+  bool size_update_pending_ = false;
+  size_t min_size_update_ = 0;
+};
+
+class HPACKDecoder final {
+ public:
+  // `max_table_size` is the `SETTINGS_HEADER_TABLE_SIZE` this end has sent, the largest the peer may use.
+  explicit HPACKDecoder(size_t max_table_size = kHPACKDefaultTableSize)
+      : max_table_size_(max_table_size), table_(max_table_size) {}
+
+  // Appends the fields of the header block to `output`. Throws `HPACKDecodingException` if it is malformed,
+  // after which the connection can not be used, as the dynamic table of the peer is out of sync then.
+  void Decode(const char* data, size_t length, HPACKHeaders& output) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    const uint8_t* const end = p + length;
+    bool fields_started = false;
+    while (p < end) {
+      const uint8_t first_byte = *p;
+      if (first_byte & 0x80) {
+        output.push_back(Entry(hpack::DecodeInteger(p, end, 7)));
+      } else if ((first_byte & 0xe0) == 0x20) {
+        // The dynamic table size update, allowed only at the beginning of the block.
+        const uint64_t max_size = hpack::DecodeInteger(p, end, 5);
+        if (fields_started || max_size > max_table_size_) {
+          throw HPACKDecodingException();
+        }
+        table_.SetMaxSize(static_cast<size_t>(max_size));
+        continue;
+      } else {
+        // With incremental indexing, without indexing, or never indexed.
+        const bool indexed = (first_byte & 0x40) != 0;
+        const uint64_t name_index = hpack::DecodeInteger(p, end, indexed ? 6 : 4);
+        std::pair<std::string, std::string> field;
+        if (name_index) {
+          field.first = Entry(name_index).first;
+        } else {
+          field.first = DecodeString(p, end);
+        }
+        field.second = DecodeString(p, end);
+        if (indexed) {
+          table_.Add(field.first, field.second);
+        }
+        output.push_back(std::move(field));
+      }
+      fields_started = true;
+    }
+  }
+
+ private:
+  std::pair<std::string, std::string> Entry(uint64_t index) const {
+    if (index >= 1 && index <= hpack::kStaticTableSize) {
+      const hpack::StaticEntry& entry = hpack::StaticTable()[index - 1];
+      return std::make_pair(std::string(entry.name), std::string(entry.value));
+    } else if (index > hpack::kStaticTableSize && index - hpack::kStaticTableSize - 1 < table_.Count()) {
+      return table_.Entry(static_cast<size_t>(index - hpack::kStaticTableSize - 1));
+    } else {
+      throw HPACKDecodingException();
+    }
+  }
+
+  static std::string DecodeString(const uint8_t*& p, const uint8_t* end) {
+    if (p == end) {
+      throw HPACKDecodingException();
+    }
+    const bool huffman = (*p & 0x80) != 0;
+    const uint64_t length = hpack::DecodeInteger(p, end, 7);
+    if (length > static_cast<uint64_t>(end - p)) {
+      throw HPACKDecodingException();
+    }
+    std::string result;
+    if (huffman) {
+      if (!hpack::HuffmanDecoder::Singleton().Decode(p, static_cast<size_t>(length), result)) {
+        throw HPACKDecodingException();
+      }
+    } else {
+      result.assign(reinterpret_cast<const char*>(p), static_cast<size_t>(length));
+    }
+    p += length;
+    return result;
+  }
+
+  const size_t max_table_size_;
+  hpack::DynamicTable table_;
+};
+
+}  // namespace api
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_API_IMPL_HPACK_H
@@ -0,0 +1,838 @@
+// HTTP/2 for `HTTPClientPOSIX`, RFC 7540: the requests to the same host and port share a single connection,
+// each one a stream of its own, with the headers compressed by HPACK, see `impl/hpack.h`.
+//
+// `HTTP2ClientConnection` takes over the connection once it has been established: over TLS with "h2" agreed on
+// by ALPN, or in cleartext, as "h2c" with prior knowledge, see `HTTPClientConnectionPool::EnableHTTP2()`.
+// Any number of threads call `Exchange()` at once, each one blocking until its own response has been received,
+// while the streams of the others are in flight. Thus a slow response does not hold back the ones behind it,
+// as it does over a connection of HTTP/1.1, and the small requests take no connections, handshakes
+// or round trips of their own.
+//
+// The thread of the connection reads the frames and hands them over to the streams. The bodies of the responses
+// are passed on as the callers consume them, and the flow control windows are reopened by as much as has been
+// consumed. The bodies of the requests are sent within the windows the server allows.
+//
+// Not supported: the server push, which is disabled by the SETTINGS of the client, the priorities, which are
+// ignored, and the trailers, which are skipped.
+
+#ifndef BRICKS_NET_API_IMPL_HTTP2_H
+#define BRICKS_NET_API_IMPL_HTTP2_H
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "cancellation.h"
+#include "hpack.h"
+
+#include "../../tcp/tcp.h"
+
+namespace bricks {
+namespace net {
+namespace api {
+
+namespace http2 {
+
+// The client connection preface, followed by its SETTINGS frame.
+const char kConnectionPreface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+enum { kConnectionPrefaceLength = 24 };
+
+enum { kFrameHeaderLength = 9, kDefaultMaxFrameSize = 16384, kMaxMaxFrameSize = (1 << 24) - 1 };
+const int64_t kDefaultWindowSize = 65535;
+const int64_t kMaxWindowSize = 0x7fffffff;
+const uint32_t kMaxStreamID = 0x7fffffff;
+
+enum class FrameType : uint8_t {
+  Data = 0x0,
+  Headers = 0x1,
+  Priority = 0x2,
+  RSTStream = 0x3,
+  Settings = 0x4,
+  PushPromise = 0x5,
+  Ping = 0x6,
+  GoAway = 0x7,
+  WindowUpdate = 0x8,
+  Continuation = 0x9
+};
+
+enum : uint8_t {
+  kFlagEndStream = 0x1,
+  kFlagAck = 0x1,
+  kFlagEndHeaders = 0x4,
+  kFlagPadded = 0x8,
+  kFlagPriority = 0x20
+};
+
+enum class Setting : uint16_t {
+  HeaderTableSize = 0x1,
+  EnablePush = 0x2,
+  MaxConcurrentStreams = 0x3,
+  InitialWindowSize = 0x4,
+  MaxFrameSize = 0x5,
+  MaxHeaderListSize = 0x6
+};
+
+enum class ErrorCode : uint32_t {
+  NoError = 0x0,
+  ProtocolError = 0x1,
+  InternalError = 0x2,
+  FlowControlError = 0x3,
+  SettingsTimeout = 0x4,
+  StreamClosed = 0x5,
+  FrameSizeError = 0x6,
+  RefusedStream = 0x7,
+  Cancel = 0x8,
+  CompressionError = 0x9
+};
+
+struct Frame {
+  FrameType type = FrameType::Data;
+  uint8_t flags = 0;
+  uint32_t stream_id = 0;
+  std::string payload;
+};
+
+inline void AppendUInt16(std::string& output, uint16_t value) {
+  output += static_cast<char>(value >> 8);
+  output += static_cast<char>(value);
+}
+
+inline void AppendUInt32(std::string& output, uint32_t value) {
+  AppendUInt16(output, static_cast<uint16_t>(value >> 16));
+  AppendUInt16(output, static_cast<uint16_t>(value));
+}
+
+inline uint32_t ReadUInt32(const char* p) {
+  const uint8_t* u = reinterpret_cast<const uint8_t*>(p);
+  return (static_cast<uint32_t>(u[0]) << 24) | (static_cast<uint32_t>(u[1]) << 16) |
+         (static_cast<uint32_t>(u[2]) << 8) | u[3];
+}
+
+inline void AppendFrameHeader(
+    std::string& output, FrameType type, uint8_t flags, uint32_t stream_id, size_t length) {
+  output += static_cast<char>(length >> 16);
+  AppendUInt16(output, static_cast<uint16_t>(length));
+  output += static_cast<char>(type);
+  output += static_cast<char>(flags);
+  AppendUInt32(output, stream_id & kMaxStreamID);
+}
+
+inline void AppendFrame(std::string& output,
+                        FrameType type,
+                        uint8_t flags,
+                        uint32_t stream_id,
+                        const char* payload,
+                        size_t length) {
+  AppendFrameHeader(output, type, flags, stream_id, length);
+  output.append(payload, length);
+}
+
+inline void AppendFrame(
+    std::string& output, FrameType type, uint8_t flags, uint32_t stream_id, const std::string& payload) {
+  AppendFrame(output, type, flags, stream_id, payload.data(), payload.length());
+}
+
+// The HEADERS frame of the header block, followed by as many CONTINUATION frames as it takes.
+inline void AppendHeaderBlock(std::string& output,
+                              uint32_t stream_id,
+                              const std::string& block,
+                              bool end_stream,
+                              size_t max_frame_size) {
+  size_t offset = 0;
+  do {
+    const size_t length = std::min(block.length() - offset, max_frame_size);
+    const bool last = offset + length == block.length();
+    const uint8_t flags = (last ? kFlagEndHeaders : 0) | (!offset && end_stream ? kFlagEndStream : 0);
+    AppendFrame(output,
+                offset ? FrameType::Continuation : FrameType::Headers,
+                flags,
+                stream_id,
+                block.data() + offset,
+                length);
+    offset += length;
+  } while (offset < block.length());
+}
+
+inline void AppendSetting(std::string& payload, Setting setting, uint32_t value) {
+  AppendUInt16(payload, static_cast<uint16_t>(setting));
+  AppendUInt32(payload, value);
+}
+
+inline void AppendWindowUpdate(std::string& output, uint32_t stream_id, uint32_t increment) {
+  std::string payload;
+  AppendUInt32(payload, increment);
+  AppendFrame(output, FrameType::WindowUpdate, 0, stream_id, payload);
+}
+
+inline void AppendRSTStream(std::string& output, uint32_t stream_id, ErrorCode error) {
+  std::string payload;
+  AppendUInt32(payload, static_cast<uint32_t>(error));
+  AppendFrame(output, FrameType::RSTStream, 0, stream_id, payload);
+}
+
+inline void AppendGoAway(std::string& output, uint32_t last_stream_id, ErrorCode error) {
+  std::string payload;
+  AppendUInt32(payload, last_stream_id);
+  AppendUInt32(payload, static_cast<uint32_t>(error));
+  AppendFrame(output, FrameType::GoAway, 0, 0, payload);
+}
+
+// Reads the next frame. Returns false if the peer has closed the connection in between the frames.
+// Throws `HTTP2ProtocolException` if the frame is larger than `max_frame_size`,
+// `HTTP2ConnectionClosedException` if it is cut short, and the `SocketException`-s.
+inline bool ReadFrame(Connection& connection, Frame& frame, size_t max_frame_size = kDefaultMaxFrameSize) {
+  char header[kFrameHeaderLength];
+  const size_t read = connection.BlockingRead(header, sizeof(header), Connection::FillFullBuffer);
+  if (!read) {
+    return false;
+  } else if (read < sizeof(header)) {
+    throw HTTP2ConnectionClosedException();
+  }
+  const uint8_t* u = reinterpret_cast<const uint8_t*>(header);
+  const size_t length = (static_cast<size_t>(u[0]) << 16) | (static_cast<size_t>(u[1]) << 8) | u[2];
+  if (length > max_frame_size) {
+    throw HTTP2ProtocolException();
+  }
+  frame.type = static_cast<FrameType>(u[3]);
+  frame.flags = u[4];
+  frame.stream_id = ReadUInt32(header + 5) & kMaxStreamID;
+  frame.payload.resize(length);
+  if (length && connection.BlockingRead(&frame.payload[0], length, Connection::FillFullBuffer) < length) {
+    throw HTTP2ConnectionClosedException();
+  }
+  return true;
+}
+
+// Leaves the data of the DATA or the header block fragment of the HEADERS frame in its payload, without
+// the padding and the priority. Throws `HTTP2ProtocolException` if the padding is longer than the frame.
+inline void StripPaddingAndPriority(Frame& frame) {
+  size_t begin = 0;
+  size_t padding = 0;
+  if (frame.flags & kFlagPadded) {
+    if (frame.payload.empty()) {
+      throw HTTP2ProtocolException();
+    }
+    padding = static_cast<uint8_t>(frame.payload[0]);
+    begin = 1;
+  }
+  if (frame.type == FrameType::Headers && (frame.flags & kFlagPriority)) {
+    begin += 5;
+  }
+  if (begin + padding > frame.payload.length()) {
+    throw HTTP2ProtocolException();
+  }
+  frame.payload = frame.payload.substr(begin, frame.payload.length() - begin - padding);
+}
+
+}  // namespace http2
+
+// Over TLS, a single lock is held when reading and when writing, as OpenSSL does not allow doing both at once.
+// In cleartext, the reads do not hold it, for a blocking write to not keep the responses from being read.
+class HTTP2ClientConnection final {
+ public:
+  // Appends the next piece of the body of the request to the string, and returns false once there are no more.
+  typedef std::function<bool(std::string&)> BodySource;
+  typedef std::function<void(const char*, size_t)> BodySink;
+
+  // The windows the client allows the server to send the responses within.
+  enum : uint32_t { kStreamReceiveWindow = 1024 * 1024, kConnectionReceiveWindow = 4 * 1024 * 1024 };
+  // Until the server has sent its SETTINGS.
+  enum : uint32_t { kDefaultMaxConcurrentStreams = 100 };
+
+  // Sends the connection preface over the established connection, and starts reading the frames.
+  // `scheme` is "https" or "http", and `authority` is the "host:port" of the requests.
+  HTTP2ClientConnection(Connection&& connection, const std::string& scheme, const std::string& authority)
+      : connection_(std::move(connection)), tls_(connection_.IsTLS()), scheme_(scheme), authority_(authority) {
+    std::string preface(http2::kConnectionPreface, http2::kConnectionPrefaceLength);
+    std::string settings;
+    http2::AppendSetting(settings, http2::Setting::EnablePush, 0);
+    http2::AppendSetting(settings, http2::Setting::InitialWindowSize, kStreamReceiveWindow);
+    http2::AppendFrame(preface, http2::FrameType::Settings, 0, 0, settings);
+    http2::AppendWindowUpdate(
+        preface, 0, static_cast<uint32_t>(kConnectionReceiveWindow - http2::kDefaultWindowSize));
+    connection_.BlockingWrite(preface);
+    reader_ = std::thread(&HTTP2ClientConnection::ReadFrames, this);
+  }
+
+  // Lets the server know the connection is no longer used, and waits for the thread of the connection.
+  ~HTTP2ClientConnection() {
+    try {
+      std::string goaway;
+      http2::AppendGoAway(goaway, 0, http2::ErrorCode::NoError);
+      Write(goaway);
+    } catch (const Exception&) {
+    }
+    ::shutdown(connection_.socket, SHUT_RDWR);
+    reader_.join();
+  }
+
+  // Sends the request and receives its response: the headers into `response_headers`, with the lowercase names,
+  // and the body into `body_sink`, in pieces, as it arrives. `headers` follow the pseudo-headers, and should
+  // have the lowercase names as well. Returns the status code.
+  // Throws `HTTP2ConnectionClosedException` if the connection is gone, or goes away before the response
+  // has been received, `HTTP2StreamResetException` if the server resets the stream,
+  // and the `SocketException`-s. With `cancellation`, throws `HTTPRequestCancelledException` once it has been
+  // cancelled, resetting the stream, and leaving the connection to the other streams.
+  int Exchange(const std::string& method,
+               const std::string& path,
+               const HPACKHeaders& headers,
+               const BodySource& body,
+               HPACKHeaders& response_headers,
+               const BodySink& body_sink,
+               HTTPClientCancellation* cancellation = nullptr) {
+    Stream stream;
+    std::unique_ptr<HTTPClientCancellation::Scope> cancellation_scope;
+    if (cancellation) {
+      cancellation_scope.reset(new HTTPClientCancellation::Scope(*cancellation, [this, &stream]() {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          stream.cancelled = true;
+        }
+        condition_variable_.notify_all();
+      }));
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_variable_.wait(lock, [this, &stream]() {
+        return !Usable() || stream.cancelled || streams_.size() + opening_ < max_streams_;
+      });
+      if (stream.cancelled) {
+        throw HTTPRequestCancelledException();
+      } else if (!Usable()) {
+        throw HTTP2ConnectionClosedException();
+      }
+      ++opening_;
+    }
+    const auto scope = MakeStreamScope(stream);
+    std::string piece;
+    bool more = body(piece);
+    const bool empty_body = !more && piece.empty();
+    {
+      // The streams are opened in the order of their IDs, and the header blocks are encoded in the order sent.
+      std::lock_guard<std::mutex> write_lock(write_mutex_);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!Usable()) {
+          throw HTTP2ConnectionClosedException();
+        }
+        --opening_;
+        stream.id = next_stream_id_;
+        next_stream_id_ += 2;
+        stream.send_window = peer_initial_window_;
+        stream.local_closed = empty_body;
+        streams_[stream.id] = &stream;
+      }
+      HPACKHeaders all_headers;
+      all_headers.emplace_back(":method", method);
+      all_headers.emplace_back(":scheme", scheme_);
+      all_headers.emplace_back(":authority", authority_);
+      all_headers.emplace_back(":path", path.empty() ? "/" : path);
+      all_headers.insert(all_headers.end(), headers.begin(), headers.end());
+      std::string block;
+      encoder_.Encode(all_headers, block);
+      std::string frames;
+      http2::AppendHeaderBlock(frames, stream.id, block, empty_body, PeerMaxFrameSize());
+      connection_.BlockingWrite(frames);
+    }
+    if (!empty_body) {
+      while (SendData(stream, piece, !more) && more) {
+        piece.clear();
+        more = body(piece);
+      }
+    }
+    return ReceiveResponse(stream, response_headers, body_sink);
+  }
+
+  // Whether new streams can be opened: the connection is open, has not gone away, and has IDs left.
+  bool IsUsable() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return Usable();
+  }
+
+  size_t ActiveStreams() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return streams_.size();
+  }
+
+ private:
+  struct Stream {
+    uint32_t id = 0;
+    int64_t send_window = 0;
+    // The bytes of the body consumed since the window of the stream was last reopened.
+    uint32_t consumed = 0;
+    std::string header_block;
+    HPACKHeaders headers;
+    bool headers_received = false;
+    std::string data;
+    bool local_closed = false;
+    bool remote_closed = false;
+    bool reset = false;
+    // By the caller, see `HTTPClientCancellation`.
+    bool cancelled = false;
+  };
+
+  // Forgets the stream, resetting it if it is still open, such as once the caller has failed to consume
+  // its body, and returns the window of the connection its data has taken without having been consumed.
+  struct StreamScope {
+    HTTP2ClientConnection* self;
+    Stream* stream;
+    StreamScope(HTTP2ClientConnection* self, Stream* stream) : self(self), stream(stream) {}
+    StreamScope(StreamScope&& rhs) : self(rhs.self), stream(rhs.stream) { rhs.self = nullptr; }
+    ~StreamScope() {
+      if (self) {
+        self->CloseStream(*stream);
+      }
+    }
+  };
+  StreamScope MakeStreamScope(Stream& stream) { return StreamScope(this, &stream); }
+
+  void CloseStream(Stream& stream) {
+    std::string frames;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stream.id) {
+        streams_.erase(stream.id);
+        if (!closed_ && !stream.reset && !(stream.local_closed && stream.remote_closed)) {
+          http2::AppendRSTStream(frames, stream.id, http2::ErrorCode::Cancel);
+        }
+        ConsumeConnectionWindow(stream.data.length(), frames);
+      } else {
+        --opening_;
+      }
+    }
+    condition_variable_.notify_all();
+    if (!frames.empty()) {
+      try {
+        Write(frames);
+      } catch (const Exception&) {
+      }
+    }
+  }
+
+  bool Usable() const { return !closed_ && !goaway_ && next_stream_id_ <= http2::kMaxStreamID; }
+
+  size_t PeerMaxFrameSize() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return peer_max_frame_size_;
+  }
+
+  void Write(const std::string& frames) {
+    std::lock_guard<std::mutex> write_lock(write_mutex_);
+    connection_.BlockingWrite(frames);
+  }
+
+  // Sends the piece of the body in as many DATA frames as the windows and the frame size allow.
+  // Returns false if the server has responded in full already, and does not need the rest of the body.
+  bool SendData(Stream& stream, const std::string& piece, bool end_stream) {
+    size_t offset = 0;
+    do {
+      size_t length;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        const bool has_data = offset < piece.length();
+        condition_variable_.wait(lock, [this, &stream, has_data]() {
+          return closed_ || stream.reset || stream.cancelled || stream.remote_closed ||
+                 !has_data || std::min(send_window_, stream.send_window) > 0;
+        });
+        if (stream.cancelled) {
+          throw HTTPRequestCancelledException();
+        } else if (stream.reset) {
+          throw HTTP2StreamResetException();
+        } else if (closed_) {
+          throw HTTP2ConnectionClosedException();
+        } else if (stream.remote_closed) {
+          return false;
+        }
+        length = static_cast<size_t>(std::min(static_cast<int64_t>(piece.length() - offset),
+                                              std::min(send_window_, stream.send_window)));
+        length = std::min(length, peer_max_frame_size_);
+        send_window_ -= static_cast<int64_t>(length);
+        stream.send_window -= static_cast<int64_t>(length);
+        if (end_stream && offset + length == piece.length()) {
+          stream.local_closed = true;
+        }
+      }
+      const bool last = end_stream && offset + length == piece.length();
+      std::string frame;
+      http2::AppendFrameHeader(
+          frame, http2::FrameType::Data, last ? http2::kFlagEndStream : 0, stream.id, length);
+      frame.append(piece, offset, length);
+      Write(frame);
+      offset += length;
+    } while (offset < piece.length());
+    return true;
+  }
+
+  int ReceiveResponse(Stream& stream, HPACKHeaders& response_headers, const BodySink& body_sink) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    bool headers_passed = false;
+    while (true) {
+      condition_variable_.wait(lock, [this, &stream, headers_passed]() {
+        return closed_ || stream.reset || stream.cancelled || !stream.data.empty() || stream.remote_closed ||
+               (stream.headers_received && !headers_passed);
+      });
+      if (stream.cancelled) {
+        throw HTTPRequestCancelledException();
+      }
+      if (stream.headers_received && !headers_passed) {
+        response_headers = stream.headers;
+        headers_passed = true;
+      }
+      if (!stream.data.empty()) {
+        std::string data;
+        data.swap(stream.data);
+        lock.unlock();
+        body_sink(data.data(), data.length());
+        std::string frames;
+        lock.lock();
+        stream.consumed += static_cast<uint32_t>(data.length());
+        if (!stream.remote_closed && stream.consumed >= kStreamReceiveWindow / 2) {
+          http2::AppendWindowUpdate(frames, stream.id, stream.consumed);
+          stream.consumed = 0;
+        }
+        ConsumeConnectionWindow(data.length(), frames);
+        if (!frames.empty()) {
+          lock.unlock();
+          Write(frames);
+          lock.lock();
+        }
+      } else if (stream.remote_closed && headers_passed) {
+        break;
+      } else if (stream.reset) {
+        throw HTTP2StreamResetException();
+      } else if (closed_) {
+        throw HTTP2ConnectionClosedException();
+      } else if (stream.remote_closed) {
+        // The stream has ended without the headers of the response.
+        throw HTTP2StreamResetException();
+      }
+    }
+    for (const auto& header : response_headers) {
+      if (header.first == ":status") {
+        return atoi(header.second.c_str());
+      }
+    }
+    throw HTTP2StreamResetException();
+  }
+
+  // Reopens the window of the connection by the bytes of the bodies consumed, once it is half closed.
+  // Called with `mutex_` held.
+  void ConsumeConnectionWindow(size_t length, std::string& frames) {
+    connection_consumed_ += length;
+    if (connection_consumed_ >= kConnectionReceiveWindow / 2) {
+      http2::AppendWindowUpdate(frames, 0, static_cast<uint32_t>(connection_consumed_));
+      connection_consumed_ = 0;
+    }
+  }
+
+  // The thread of the connection.
+  void ReadFrames() {
+    http2::ErrorCode error = http2::ErrorCode::NoError;
+    try {
+      http2::Frame frame;
+      while (ReadFrame(frame)) {
+        HandleFrame(frame);
+      }
+    } catch (const HPACKDecodingException&) {
+      error = http2::ErrorCode::CompressionError;
+    } catch (const HTTP2ProtocolException&) {
+      error = http2::ErrorCode::ProtocolError;
+    } catch (const Exception&) {
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    condition_variable_.notify_all();
+    if (error != http2::ErrorCode::NoError) {
+      try {
+        std::string goaway;
+        http2::AppendGoAway(goaway, 0, error);
+        Write(goaway);
+      } catch (const Exception&) {
+      }
+    }
+  }
+
+  bool ReadFrame(http2::Frame& frame) {
+    if (tls_) {
+      // Wait for the frame without holding the lock, and read it with the lock held.
+      bool pending = false;
+#if defined(BRICKS_NET_TLS)
+      pending = connection_.TLS() && connection_.TLS()->Pending();
+#endif
+      if (!pending) {
+        struct pollfd pfd;
+        pfd.fd = connection_.socket;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        while (::poll(&pfd, 1, -1) < 0 && errno == EINTR) {
+        }
+      }
+      std::lock_guard<std::mutex> write_lock(write_mutex_);
+      return http2::ReadFrame(connection_, frame, http2::kDefaultMaxFrameSize);
+    } else {
+      return http2::ReadFrame(connection_, frame, http2::kDefaultMaxFrameSize);
+    }
+  }
+
+  void HandleFrame(http2::Frame& frame) {
+    if (continuation_stream_id_ &&
+        (frame.type != http2::FrameType::Continuation || frame.stream_id != continuation_stream_id_)) {
+      throw HTTP2ProtocolException();
+    }
+    std::string replies;
+    switch (frame.type) {
+      case http2::FrameType::Data:
+        OnData(frame, replies);
+        break;
+      case http2::FrameType::Headers:
+        if (!frame.stream_id) {
+          throw HTTP2ProtocolException();
+        }
+        http2::StripPaddingAndPriority(frame);
+        header_block_ = std::move(frame.payload);
+        header_block_end_stream_ = (frame.flags & http2::kFlagEndStream) != 0;
+        continuation_stream_id_ = frame.stream_id;
+        if (frame.flags & http2::kFlagEndHeaders) {
+          OnHeaderBlock();
+        }
+        break;
+      case http2::FrameType::Continuation:
+        if (!continuation_stream_id_) {
+          throw HTTP2ProtocolException();
+        }
+        header_block_ += frame.payload;
+        if (frame.flags & http2::kFlagEndHeaders) {
+          OnHeaderBlock();
+        }
+        break;
+      case http2::FrameType::RSTStream:
+        if (!frame.stream_id || frame.payload.length() != 4) {
+          throw HTTP2ProtocolException();
+        }
+        WithStream(frame.stream_id, [](Stream& stream) { stream.reset = true; });
+        break;
+      case http2::FrameType::Settings:
+        OnSettings(frame, replies);
+        break;
+      case http2::FrameType::Ping:
+        if (frame.stream_id || frame.payload.length() != 8) {
+          throw HTTP2ProtocolException();
+        }
+        if (!(frame.flags & http2::kFlagAck)) {
+          http2::AppendFrame(replies, http2::FrameType::Ping, http2::kFlagAck, 0, frame.payload);
+        }
+        break;
+      case http2::FrameType::GoAway:
+        OnGoAway(frame);
+        break;
+      case http2::FrameType::WindowUpdate:
+        OnWindowUpdate(frame);
+        break;
+      case http2::FrameType::PushPromise:
+        // Disabled by the SETTINGS of the client.
+        throw HTTP2ProtocolException();
+      default:
+        // PRIORITY, and the frames of the extensions, are ignored.
+        break;
+    }
+    if (!replies.empty()) {
+      Write(replies);
+    }
+  }
+
+  template <typename F>
+  void WithStream(uint32_t stream_id, F&& f) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const auto cit = streams_.find(stream_id);
+      if (cit != streams_.end()) {
+        f(*cit->second);
+      }
+    }
+    condition_variable_.notify_all();
+  }
+
+  void OnData(http2::Frame& frame, std::string& replies) {
+    if (!frame.stream_id) {
+      throw HTTP2ProtocolException();
+    }
+    // The padding counts towards the windows too, and is returned right away.
+    const size_t frame_length = frame.payload.length();
+    http2::StripPaddingAndPriority(frame);
+    const bool end_stream = (frame.flags & http2::kFlagEndStream) != 0;
+    bool delivered = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const auto cit = streams_.find(frame.stream_id);
+      if (cit != streams_.end() && !cit->second->reset && !cit->second->remote_closed) {
+        Stream& stream = *cit->second;
+        stream.data += frame.payload;
+        stream.consumed += static_cast<uint32_t>(frame_length - frame.payload.length());
+        stream.remote_closed = end_stream;
+        delivered = true;
+      }
+      ConsumeConnectionWindow(delivered ? frame_length - frame.payload.length() : frame_length, replies);
+    }
+    condition_variable_.notify_all();
+  }
+
+  void OnHeaderBlock() {
+    HPACKHeaders headers;
+    decoder_.Decode(header_block_.data(), header_block_.length(), headers);
+    header_block_.clear();
+    const uint32_t stream_id = continuation_stream_id_;
+    continuation_stream_id_ = 0;
+    const bool end_stream = header_block_end_stream_;
+    bool informational = false;
+    for (const auto& header : headers) {
+      if (header.first == ":status") {
+        informational = header.second.length() == 3 && header.second[0] == '1';
+      }
+    }
+    WithStream(stream_id, [&headers, end_stream, informational](Stream& stream) {
+      if (!stream.headers_received && !informational) {
+        stream.headers = std::move(headers);
+        stream.headers_received = true;
+      }
+      // The informational responses, such as "100 Continue", are skipped, and so are the trailers.
+      stream.remote_closed = stream.remote_closed || end_stream;
+    });
+  }
+
+  void OnSettings(const http2::Frame& frame, std::string& replies) {
+    if (frame.stream_id || frame.payload.length() % 6 ||
+        ((frame.flags & http2::kFlagAck) && !frame.payload.empty())) {
+      throw HTTP2ProtocolException();
+    }
+    if (frame.flags & http2::kFlagAck) {
+      return;
+    }
+    for (size_t offset = 0; offset < frame.payload.length(); offset += 6) {
+      const uint8_t* u = reinterpret_cast<const uint8_t*>(frame.payload.data() + offset);
+      const http2::Setting setting = static_cast<http2::Setting>((u[0] << 8) | u[1]);
+      const uint32_t value = http2::ReadUInt32(frame.payload.data() + offset + 2);
+      if (setting == http2::Setting::HeaderTableSize) {
+        std::lock_guard<std::mutex> write_lock(write_mutex_);
+        encoder_.SetPeerMaxTableSize(value);
+      } else if (setting == http2::Setting::MaxConcurrentStreams) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        max_streams_ = value;
+      } else if (setting == http2::Setting::InitialWindowSize) {
+        if (value > http2::kMaxWindowSize) {
+          throw HTTP2ProtocolException();
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        const int64_t delta = static_cast<int64_t>(value) - peer_initial_window_;
+        peer_initial_window_ = value;
+        for (auto& cit : streams_) {
+          cit.second->send_window += delta;
+        }
+      } else if (setting == http2::Setting::MaxFrameSize) {
+        if (value < http2::kDefaultMaxFrameSize || value > http2::kMaxMaxFrameSize) {
+          throw HTTP2ProtocolException();
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        peer_max_frame_size_ = value;
+      }
+    }
+    condition_variable_.notify_all();
+    http2::AppendFrame(replies, http2::FrameType::Settings, http2::kFlagAck, 0, "", 0);
+  }
+
+  // The streams the server has not processed, above the last one it has, are failed, for them to be retried.
+  void OnGoAway(const http2::Frame& frame) {
+    if (frame.stream_id || frame.payload.length() < 8) {
+      throw HTTP2ProtocolException();
+    }
+    const uint32_t last_stream_id = http2::ReadUInt32(frame.payload.data()) & http2::kMaxStreamID;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      goaway_ = true;
+      for (auto& cit : streams_) {
+        if (cit.first > last_stream_id) {
+          cit.second->reset = true;
+        }
+      }
+    }
+    condition_variable_.notify_all();
+  }
+
+  void OnWindowUpdate(const http2::Frame& frame) {
+    if (frame.payload.length() != 4) {
+      throw HTTP2ProtocolException();
+    }
+    const int64_t increment = http2::ReadUInt32(frame.payload.data()) & http2::kMaxStreamID;
+    if (!increment) {
+      throw HTTP2ProtocolException();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!frame.stream_id) {
+        send_window_ += increment;
+        if (send_window_ > http2::kMaxWindowSize) {
+          throw HTTP2ProtocolException();
+        }
+      } else {
+        const auto cit = streams_.find(frame.stream_id);
+        if (cit != streams_.end()) {
+          cit->second->send_window += increment;
+        }
+      }
+    }
+    condition_variable_.notify_all();
+  }
+
+  Connection connection_;
+  const bool tls_;
+  const std::string scheme_;
+  const std::string authority_;
+
+  // Held while writing, and, over TLS, while reading; taken before `mutex_` when both are.
+  std::mutex write_mutex_;
+  HPACKEncoder encoder_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable condition_variable_;
+  std::map<uint32_t, Stream*> streams_;
+  // The streams waiting for their IDs, counted towards the limit of the server.
+  size_t opening_ = 0;
+  uint32_t next_stream_id_ = 1;
+  size_t max_streams_ = kDefaultMaxConcurrentStreams;
+  int64_t send_window_ = http2::kDefaultWindowSize;
+  int64_t peer_initial_window_ = http2::kDefaultWindowSize;
+  size_t peer_max_frame_size_ = http2::kDefaultMaxFrameSize;
+  size_t connection_consumed_ = 0;
+  bool goaway_ = false;
+  bool closed_ = false;
+
+  // Used by the thread of the connection only.
+  HPACKDecoder decoder_;
+  std::string header_block_;
+  bool header_block_end_stream_ = false;
+  uint32_t continuation_stream_id_ = 0;
+
+  std::thread reader_;
+
+  HTTP2ClientConnection(const HTTP2ClientConnection&) = delete;
+  void operator=(const HTTP2ClientConnection&) = delete;
+};
+
+}  // namespace api
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_API_IMPL_HTTP2_H
@@ -76,7 +76,10 @@ class HTTPClientPlatformWrapper {
     using bricks::MakePointerScopeGuard;
     using bricks::java_wrapper::ToStdString;
 
-    auto JAVA = bricks::java_wrapper::JavaWrapper::Singleton();
+    const auto& JAVA = bricks::java_wrapper::JavaWrapper::Singleton();
+    if (!JAVA.httpParamsClass || !JAVA.httpTransportClass) {
+      return false;
+    }
 
     // Attaching multiple times from the same thread is a no-op, which only gets good env for us.
     JavaVM* jvm = JAVA.jvm;
@@ -100,63 +103,62 @@ class HTTPClientPlatformWrapper {
         env->NewObject(JAVA.httpParamsClass, JAVA.httpParamsConstructor, jniUrl.get()), deleteLocalRef);
     CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
 
-    // Cache it on the first call.
-    const static jfieldID dataField = env->GetFieldID(JAVA.httpParamsClass, "data", "[B");
+    // All the field IDs have been resolved in `JNI_OnLoad()`.
     if (!post_body_.empty()) {
-      const auto jniPostData = MakePointerScopeGuard(env->NewByteArray(post_body_.size()), deleteLocalRef);
-      CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
-
-      env->SetByteArrayRegion(
-          jniPostData.get(), 0, post_body_.size(), reinterpret_cast<const jbyte*>(post_body_.data()));
-      CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
-
-      env->SetObjectField(httpParamsObject.get(), dataField, jniPostData.get());
-      CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+      if (JAVA.dataBufferField) {
+        // The Java side reads the body right from `post_body_`, which outlives the call.
+        const auto jniPostData = MakePointerScopeGuard(
+            env->NewDirectByteBuffer(const_cast<char*>(post_body_.data()), post_body_.size()), deleteLocalRef);
+        CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+
+        env->SetObjectField(httpParamsObject.get(), JAVA.dataBufferField, jniPostData.get());
+        CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+      } else {
+        const auto jniPostData = MakePointerScopeGuard(env->NewByteArray(post_body_.size()), deleteLocalRef);
+        CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+
+        env->SetByteArrayRegion(
+            jniPostData.get(), 0, post_body_.size(), reinterpret_cast<const jbyte*>(post_body_.data()));
+        CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+
+        env->SetObjectField(httpParamsObject.get(), JAVA.dataField, jniPostData.get());
+        CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+      }
     }
 
-    const static jfieldID contentTypeField =
-        env->GetFieldID(JAVA.httpParamsClass, "contentType", "Ljava/lang/String;");
     if (!content_type_.empty()) {
       const auto jniContentType =
           MakePointerScopeGuard(env->NewStringUTF(content_type_.c_str()), deleteLocalRef);
       CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
 
-      env->SetObjectField(httpParamsObject.get(), contentTypeField, jniContentType.get());
+      env->SetObjectField(httpParamsObject.get(), JAVA.contentTypeField, jniContentType.get());
       CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
     }
 
     if (!user_agent_.empty()) {
-      const static jfieldID userAgentField =
-          env->GetFieldID(JAVA.httpParamsClass, "userAgent", "Ljava/lang/String;");
-
       const auto jniUserAgent = MakePointerScopeGuard(env->NewStringUTF(user_agent_.c_str()), deleteLocalRef);
       CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
 
-      env->SetObjectField(httpParamsObject.get(), userAgentField, jniUserAgent.get());
+      env->SetObjectField(httpParamsObject.get(), JAVA.userAgentField, jniUserAgent.get());
       CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
     }
 
+    // The files are passed by their paths, for the Java side to stream them, with no copies through JNI.
     if (!post_file_.empty()) {
-      const static jfieldID inputFilePathField =
-          env->GetFieldID(JAVA.httpParamsClass, "inputFilePath", "Ljava/lang/String;");
-
       const auto jniInputFilePath =
           MakePointerScopeGuard(env->NewStringUTF(post_file_.c_str()), deleteLocalRef);
       CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
 
-      env->SetObjectField(httpParamsObject.get(), inputFilePathField, jniInputFilePath.get());
+      env->SetObjectField(httpParamsObject.get(), JAVA.inputFilePathField, jniInputFilePath.get());
       CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
     }
 
     if (!received_file_.empty()) {
-      const static jfieldID outputFilePathField =
-          env->GetFieldID(JAVA.httpParamsClass, "outputFilePath", "Ljava/lang/String;");
-
       const auto jniOutputFilePath =
           MakePointerScopeGuard(env->NewStringUTF(received_file_.c_str()), deleteLocalRef);
       CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
 
-      env->SetObjectField(httpParamsObject.get(), outputFilePathField, jniOutputFilePath.get());
+      env->SetObjectField(httpParamsObject.get(), JAVA.outputFilePathField, jniOutputFilePath.get());
       CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
     }
 
@@ -172,37 +174,49 @@ class HTTPClientPlatformWrapper {
       return false;
     }
 
-    const static jfieldID httpResponseCodeField =
-        env->GetFieldID(JAVA.httpParamsClass, "httpResponseCode", "I");
-    error_code_ = env->GetIntField(response, httpResponseCodeField);
+    error_code_ = env->GetIntField(response, JAVA.httpResponseCodeField);
     CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
 
-    const static jfieldID receivedUrlField =
-        env->GetFieldID(JAVA.httpParamsClass, "receivedUrl", "Ljava/lang/String;");
     const auto jniReceivedUrl = MakePointerScopeGuard(
-        static_cast<jstring>(env->GetObjectField(response, receivedUrlField)), deleteLocalRef);
+        static_cast<jstring>(env->GetObjectField(response, JAVA.receivedUrlField)), deleteLocalRef);
     CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
     if (jniReceivedUrl) {
       url_received_ = std::move(ToStdString(env, jniReceivedUrl.get()));
     }
 
-    // contentTypeField is already cached above.
     const auto jniContentType = MakePointerScopeGuard(
-        static_cast<jstring>(env->GetObjectField(response, contentTypeField)), deleteLocalRef);
+        static_cast<jstring>(env->GetObjectField(response, JAVA.contentTypeField)), deleteLocalRef);
     CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
     if (jniContentType) {
       content_type_ = std::move(ToStdString(env, jniContentType.get()));
     }
 
-    // dataField is already cached above.
+    // The body is copied once, into `server_response_`: from the direct buffer the Java side has put it into,
+    // or from `byte[] data` with `GetByteArrayRegion()`, which, unlike `GetByteArrayElements()`, does not
+    // make a copy of its own first.
+    if (JAVA.dataBufferField) {
+      const auto jniDataBuffer =
+          MakePointerScopeGuard(env->GetObjectField(response, JAVA.dataBufferField), deleteLocalRef);
+      CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+      if (jniDataBuffer) {
+        const char* address = static_cast<const char*>(env->GetDirectBufferAddress(jniDataBuffer.get()));
+        if (address) {
+          const jint length = env->CallIntMethod(jniDataBuffer.get(), JAVA.byteBufferLimit);
+          CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
+          server_response_.assign(address, static_cast<size_t>(length));
+          return true;
+        }
+      }
+    }
     const auto jniData = MakePointerScopeGuard(
-        static_cast<jbyteArray>(env->GetObjectField(response, dataField)), deleteLocalRef);
+        static_cast<jbyteArray>(env->GetObjectField(response, JAVA.dataField)), deleteLocalRef);
     CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
     if (jniData) {
-      jbyte* buffer = env->GetByteArrayElements(jniData.get(), nullptr);
-      if (buffer) {
-        server_response_.assign(reinterpret_cast<const char*>(buffer), env->GetArrayLength(jniData.get()));
-        env->ReleaseByteArrayElements(jniData.get(), buffer, JNI_ABORT);
+      const jsize length = env->GetArrayLength(jniData.get());
+      server_response_.resize(static_cast<size_t>(length));
+      if (length) {
+        env->GetByteArrayRegion(jniData.get(), 0, length, reinterpret_cast<jbyte*>(&server_response_[0]));
+        CLEAR_AND_RETURN_FALSE_ON_EXCEPTION
       }
     }
     return true;
@@ -0,0 +1,602 @@
+// Asynchronous HTTP client: many requests in flight, multiplexed over one event loop thread.
+//
+// `HTTP(...)` blocks the calling thread until the response has been received. `HTTPAsync(...)` takes
+// the same request and response parameters, and returns a `std::future` of the same typed response instead,
+// or invokes the callbacks once it is ready:
+//
+//   std::future<HTTPResponseWithBuffer> f = HTTPAsync(GET(url));
+//   ...
+//   const auto response = f.get();
+//
+//   HTTPAsync(POSTFromFile(url, file_name, "text/plain"),
+//             KeepResponseInMemory(),
+//             [](HTTPResponseWithBuffer&& response) { ... },
+//             [](std::exception_ptr error) { ... });
+//
+// The requests are described by `ImplWrapper<HTTPClientPOSIX>::PrepareInput()` and the responses filled
+// by its `ParseOutput()`, as for `HTTP(...)`. The sockets are non-blocking, watched by the `EventPoller`
+// of the event loop HTTP server, the responses are parsed incrementally by `HTTPRequestParser`,
+// and the keep-alive connections are reused by the next requests to the same host and port.
+//
+// The callbacks are invoked on the thread of the event loop, and should not block. A request fails
+// with `HTTPClientTimeoutException` if it takes longer than `timeout_ms`, or than its own `SetTimeout()`,
+// if shorter, and with `HTTPClientException` if the client is destroyed before it completes.
+// The timeouts are the timers of the `bricks::time::TimerWheel` of the event loop.
+// The host names are resolved, and cached, by `HTTPClientPOSIX::ConnectionPool()`, on the calling thread.
+// Plaintext only: the "https://" requests fail with `TLSNotSupportedException`.
+
+#ifndef BRICKS_NET_API_IMPL_POSIX_ASYNC_H
+#define BRICKS_NET_API_IMPL_POSIX_ASYNC_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "posix.h"
+
+#include "../types.h"
+#include "../url.h"
+
+#include "../../http.h"
+
+#include "../../../time/timer_wheel.h"
+#include "../../../file/file.h"
+
+namespace bricks {
+namespace net {
+namespace api {
+
+const uint64_t kHTTPAsyncDefaultTimeoutMs = 60 * 1000;
+const size_t kHTTPAsyncMaxResponseBodySize = 1024 * 1024 * 1024;
+// The size of the pieces in which the bodies of the requests are read from their files.
+const size_t kHTTPAsyncFileReadSize = 64 * 1024;
+// The granularity of the timeouts of the requests.
+const uint64_t kHTTPAsyncTimerTickMs = 10;
+
+class HTTPAsyncClientPOSIX final {
+ public:
+  explicit HTTPAsyncClientPOSIX(uint64_t timeout_ms = kHTTPAsyncDefaultTimeoutMs)
+      : timeout_ms_(timeout_ms), stopping_(false), requests_in_flight_(0) {
+    if (::pipe(wake_pipe_)) {
+      throw SocketEventLoopException();
+    }
+    ::fcntl(wake_pipe_[0], F_SETFL, ::fcntl(wake_pipe_[0], F_GETFL, 0) | O_NONBLOCK);
+    poller_.Add(wake_pipe_[0]);
+    thread_ = std::thread(&HTTPAsyncClientPOSIX::Run, this);
+  }
+
+  // Fails the requests that have not completed yet.
+  ~HTTPAsyncClientPOSIX() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    Wake();
+    thread_.join();
+    ::close(wake_pipe_[0]);
+    ::close(wake_pipe_[1]);
+  }
+
+  template <typename T_REQUEST_PARAMS,
+            typename T_RESPONSE_PARAMS = KeepResponseInMemory,
+            typename T_RESPONSE = typename ResponseTypeFromRequestType<T_RESPONSE_PARAMS>::T_RESPONSE_TYPE>
+  std::future<T_RESPONSE> operator()(const T_REQUEST_PARAMS& request_params,
+                                     const T_RESPONSE_PARAMS& response_params = T_RESPONSE_PARAMS()) {
+    std::shared_ptr<std::promise<T_RESPONSE>> promise(new std::promise<T_RESPONSE>());
+    (*this)(request_params,
+            response_params,
+            [promise](T_RESPONSE&& response) { promise->set_value(std::move(response)); },
+            [promise](std::exception_ptr error) { promise->set_exception(error); });
+    return promise->get_future();
+  }
+
+  // Invokes `on_success(T_RESPONSE&&)` or `on_failure(std::exception_ptr)` once the request is done.
+  template <typename T_REQUEST_PARAMS, typename T_RESPONSE_PARAMS, typename F_SUCCESS, typename F_FAILURE>
+  void operator()(const T_REQUEST_PARAMS& request_params,
+                  const T_RESPONSE_PARAMS& response_params,
+                  F_SUCCESS&& on_success,
+                  F_FAILURE&& on_failure) {
+    typedef typename ResponseTypeFromRequestType<T_RESPONSE_PARAMS>::T_RESPONSE_TYPE T_RESPONSE;
+    typedef ImplWrapper<HTTPClientPOSIX> IMPL_HELPER;
+    std::unique_ptr<Request> request(new Request());
+    request->on_failure = on_failure;
+    try {
+      IMPL_HELPER::PrepareInput(request_params, request->client);
+      IMPL_HELPER::PrepareInput(response_params, request->client);
+      request->url = URLParser(request->client.request_url_);
+      HTTPClientPOSIX::ConnectionPool().Resolve(request->url.host, request->url.port);
+    } catch (...) {
+      on_failure(std::current_exception());
+      return;
+    }
+    request->on_success = [request_params, response_params, on_success](const HTTPClientPOSIX& client) {
+      T_RESPONSE output;
+      IMPL_HELPER::ParseOutput(request_params, response_params, client, output);
+      on_success(std::move(output));
+    };
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!stopping_) {
+        submitted_.push_back(std::move(request));
+        ++requests_in_flight_;
+      }
+    }
+    if (request) {
+      on_failure(std::make_exception_ptr(HTTPClientException()));
+    } else {
+      Wake();
+    }
+  }
+
+  // The number of requests submitted and not completed yet. THREAD SAFE.
+  size_t RequestsInFlight() const { return requests_in_flight_; }
+
+ private:
+  typedef std::chrono::steady_clock::time_point T_TIME_POINT;
+
+  struct Request {
+    HTTPClientPOSIX client;  // The parameters of the request, and the fields `ParseOutput()` reads.
+    std::function<void(const HTTPClientPOSIX&)> on_success;
+    std::function<void(std::exception_ptr)> on_failure;
+    URLParser url;
+    std::unordered_set<uint64_t> all_urls;
+    bricks::time::TimerWheel::TimerID timeout_timer = 0;
+    // The connection of the current hop of the request, with redirects.
+    int fd = -1;
+    std::string key;
+    bool connecting = false;
+    bool reused = false;
+    bool received_anything = false;
+    std::string output;
+    size_t output_offset = 0;
+    uint64_t file_offset = 0;
+    std::unique_ptr<HTTPRequestParser> parser;
+  };
+
+  struct IdleConnection {
+    int fd;
+    T_TIME_POINT since;
+  };
+
+  static T_TIME_POINT Now() { return std::chrono::steady_clock::now(); }
+
+  static uint64_t NowMs() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(Now().time_since_epoch()).count());
+  }
+
+  void Wake() {
+    const char c = 0;
+    if (::write(wake_pipe_[1], &c, 1) < 0) {
+      // The pipe is full, the loop is being woken up already.
+    }
+  }
+
+  void Run() {
+    std::vector<EventPoller::Event> events;
+    T_TIME_POINT last_sweep = Now();
+    while (true) {
+      std::deque<std::unique_ptr<Request>> submitted;
+      bool stopping;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        submitted.swap(submitted_);
+        stopping = stopping_;
+      }
+      for (auto& request : submitted) {
+        Request* raw = request.get();
+        const uint64_t request_timeout_ms = raw->client.request_timeout_ms_;
+        const uint64_t timeout_ms =
+            request_timeout_ms ? std::min(request_timeout_ms, timeout_ms_) : timeout_ms_;
+        // One millisecond later, as `NowMs()` is truncated, for the request to never time out early.
+        request->timeout_timer = timers_.Schedule(NowMs() + timeout_ms + 1, [this, raw]() {
+          Fail(*raw, std::make_exception_ptr(HTTPClientTimeoutException()));
+        });
+        in_flight_[raw] = std::move(request);
+        StartHop(*raw);
+      }
+      if (stopping) {
+        break;
+      }
+      poller_.Wait(events, static_cast<int>(timers_.MillisecondsUntilNextTimer(NowMs(), 100)));
+      for (const EventPoller::Event& event : events) {
+        if (event.fd == wake_pipe_[0]) {
+          char buffer[256];
+          while (::read(wake_pipe_[0], buffer, sizeof(buffer)) > 0) {
+          }
+          continue;
+        }
+        const auto cit = requests_by_fd_.find(event.fd);
+        if (cit == requests_by_fd_.end()) {
+          if (idle_by_fd_.count(event.fd) && !IsIdle(event.fd)) {
+            // An idle keep-alive connection, closed by the server or sending something unexpected.
+            DropIdleConnection(event.fd);
+          }
+          continue;
+        }
+        Request& request = *cit->second;
+        if (event.writable) {
+          OnWritable(request);
+        } else if (event.readable) {
+          OnReadable(request);
+        }
+      }
+      timers_.Advance(NowMs());
+      const T_TIME_POINT now = Now();
+      if (now - last_sweep >= std::chrono::milliseconds(100)) {
+        last_sweep = now;
+        Sweep(now);
+      }
+    }
+    while (!in_flight_.empty()) {
+      Fail(*in_flight_.begin()->first, std::make_exception_ptr(HTTPClientException()));
+    }
+    for (auto& cit : idle_) {
+      for (const IdleConnection& idle : cit.second) {
+        ::close(idle.fd);
+      }
+    }
+  }
+
+  void StartHop(Request& request) {
+    try {
+      if (!request.all_urls.insert(request.url.Hash()).second) {
+        throw HTTPRedirectLoopException();
+      }
+      if (request.url.protocol == "https") {
+        // The non-blocking TLS handshake is not implemented, use `HTTP(...)` for these.
+        throw TLSNotSupportedException();
+      }
+      request.key = request.url.host + ':' + std::to_string(request.url.port);
+      request.output = request.client.ComposeRequest(request.url);
+      request.output += request.client.request_body_contents_;
+      request.output_offset = 0;
+      request.file_offset = 0;
+      request.client.RewindGzippedRequestBody();
+      request.received_anything = false;
+      request.parser.reset(
+          new HTTPRequestParser(kHTTPRequestParserMaxHeaderSize, kHTTPAsyncMaxResponseBodySize));
+      request.reused = TakeIdleConnection(request);
+      if (!request.reused) {
+        Connect(request);
+      }
+      requests_by_fd_[request.fd] = &request;
+      poller_.Add(request.fd);
+      poller_.Watch(request.fd, false, true);
+    } catch (...) {
+      Fail(request, std::current_exception());
+    }
+  }
+
+  bool TakeIdleConnection(Request& request) {
+    const auto cit = idle_.find(request.key);
+    if (cit == idle_.end()) {
+      return false;
+    }
+    std::vector<IdleConnection>& connections = cit->second;
+    while (!connections.empty()) {
+      const int fd = connections.back().fd;
+      connections.pop_back();
+      idle_by_fd_.erase(fd);
+      poller_.Remove(fd);
+      if (IsIdle(fd)) {
+        request.fd = fd;
+        return true;
+      }
+      ::close(fd);
+    }
+    return false;
+  }
+
+  void Connect(Request& request) {
+    // Connects to the first address only, the one the blocking connections to the host have succeeded with,
+    // if any. `ClientSocket()` tries the others, but blocks.
+    std::vector<SocketAddress> addresses =
+        HTTPClientPOSIX::ConnectionPool().Resolve(request.url.host, request.url.port);
+    LastGoodAddresses::Singleton().Prefer(request.key, addresses);
+    const SocketAddress& address = addresses.front();
+    request.fd = ::socket(address.Family(), SOCK_STREAM, address.Family() == AF_UNIX ? 0 : IPPROTO_TCP);
+    if (request.fd < 0) {
+      throw SocketCreateException();
+    }
+    ::fcntl(request.fd, F_SETFL, ::fcntl(request.fd, F_GETFL, 0) | O_NONBLOCK);
+    ::fcntl(request.fd, F_SETFD, FD_CLOEXEC);
+#if defined(SO_NOSIGPIPE)
+    int just_one = 1;
+    ::setsockopt(request.fd, SOL_SOCKET, SO_NOSIGPIPE, &just_one, sizeof(int));
+#endif
+    if (::connect(request.fd, address.Get(), address.length) && errno != EINPROGRESS) {
+      ::close(request.fd);
+      request.fd = -1;
+      throw SocketConnectException();
+    }
+    request.connecting = true;
+  }
+
+  void OnWritable(Request& request) {
+    if (request.connecting) {
+      int error = 0;
+      socklen_t length = sizeof(error);
+      if (::getsockopt(request.fd, SOL_SOCKET, SO_ERROR, &error, &length) || error) {
+        Fail(request, std::make_exception_ptr(SocketConnectException()));
+        return;
+      }
+      request.connecting = false;
+    }
+    while (true) {
+      if (request.output_offset == request.output.length()) {
+        request.output.clear();
+        request.output_offset = 0;
+        try {
+          if (!ReadRequestBodyFile(request)) {
+            break;
+          }
+        } catch (const FileException&) {
+          Fail(request, std::current_exception());
+          return;
+        }
+      }
+#if defined(MSG_NOSIGNAL)
+      const int flags = MSG_NOSIGNAL;
+#else
+      const int flags = 0;
+#endif
+      const ssize_t length = ::send(request.fd,
+                                    request.output.data() + request.output_offset,
+                                    request.output.length() - request.output_offset,
+                                    flags);
+      if (length >= 0) {
+        request.output_offset += static_cast<size_t>(length);
+      } else if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      } else {
+        RetryOrFail(request, std::make_exception_ptr(SocketWriteException()));
+        return;
+      }
+    }
+    // The request has been sent, wait for the response.
+    poller_.Watch(request.fd, true, false);
+  }
+
+  // Reads the next piece of the body of the request from its file into `output`, compressed if it is sent
+  // compressed, see `HTTPClientPOSIX::ReadGzippedRequestBodyChunk()`. Returns false once done.
+  bool ReadRequestBodyFile(Request& request) {
+    const HTTPClientPOSIX::RequestBodyFile* file = request.client.request_body_file_.get();
+    if (file && !request.client.request_body_content_encoding_.empty()) {
+      return request.client.ReadGzippedRequestBodyChunk(request.file_offset, request.output);
+    }
+    if (!file || request.file_offset >= file->size) {
+      return false;
+    }
+    request.output.resize(static_cast<size_t>(std::min<uint64_t>(kHTTPAsyncFileReadSize,
+                                                                 file->size - request.file_offset)));
+    const ssize_t length =
+        ::pread(file->fd, &request.output[0], request.output.length(), static_cast<off_t>(request.file_offset));
+    if (length <= 0) {
+      throw FileException();
+    }
+    request.output.resize(static_cast<size_t>(length));
+    request.file_offset += static_cast<uint64_t>(length);
+    return true;
+  }
+
+  void OnReadable(Request& request) {
+    char buffer[16 * 1024];
+    while (true) {
+      const ssize_t length = ::read(request.fd, buffer, sizeof(buffer));
+      if (length > 0) {
+        request.received_anything = true;
+        request.parser->Feed(buffer, static_cast<size_t>(length));
+        HTTPRequest response;
+        if (request.parser->Next(response)) {
+          OnResponse(request, response);
+          return;
+        } else if (request.parser->Failed()) {
+          Fail(request, std::make_exception_ptr(HTTPClientException()));
+          return;
+        }
+      } else if (length == 0) {
+        RetryOrFail(request, std::make_exception_ptr(HTTPConnectionClosedByPeerException()));
+        return;
+      } else if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      } else {
+        RetryOrFail(request, std::make_exception_ptr(SocketReadException()));
+        return;
+      }
+    }
+  }
+
+  // `HTTPRequestParser` parses the status line "HTTP/1.1 200 OK" into `method`, `url` and `version`.
+  void OnResponse(Request& request, HTTPRequest& response) {
+    const bool keep_alive = response.method == kHTTP11Version &&
+                            strcasecmp(HeaderValue(response, kConnectionHeaderKey), kConnectionCloseValue) &&
+                            (*HeaderValue(response, kContentLengthHeaderKey) ||
+                             *HeaderValue(response, kTransferEncodingHeaderKey)) &&
+                            !request.parser->HasPartialRequest();
+    ReleaseConnection(request, keep_alive);
+    HTTPClientPOSIX& client = request.client;
+    client.response_code_ = atoi(response.url.c_str());
+    const char* location = HeaderValue(response, "Location");
+    if (client.response_code_ >= 300 && client.response_code_ <= 399 && *location) {
+      request.url = URLParser(location, request.url);
+      client.response_url_after_redirects_ = request.url.ComposeURL();
+      StartHop(request);
+      return;
+    }
+    if (client.response_code_ == static_cast<int>(HTTPResponseCode::UnsupportedMediaType) &&
+        client.FallBackToIdentityRequestBody()) {
+      // The server does not take compressed bodies, send the same request with the body as it is.
+      request.all_urls.erase(request.url.Hash());
+      StartHop(request);
+      return;
+    }
+    const std::unique_ptr<Request> done = Complete(request);
+    try {
+      client.response_body_ = std::move(response.body);
+      if (!client.response_body_file_name_.empty()) {
+        WriteStringToFile(client.response_body_file_name_, client.response_body_);
+        client.response_body_.clear();
+      }
+      done->on_success(client);
+    } catch (...) {
+      done->on_failure(std::current_exception());
+    }
+  }
+
+  // A reused keep-alive connection may have been closed by the server before it received the request.
+  // Retries on a new connection then, once.
+  void RetryOrFail(Request& request, std::exception_ptr error) {
+    if (request.reused && !request.received_anything) {
+      ReleaseConnection(request, false);
+      try {
+        request.output = request.client.ComposeRequest(request.url);
+        request.output += request.client.request_body_contents_;
+        request.output_offset = 0;
+        request.file_offset = 0;
+        request.client.RewindGzippedRequestBody();
+        request.reused = false;
+        Connect(request);
+        requests_by_fd_[request.fd] = &request;
+        poller_.Add(request.fd);
+        poller_.Watch(request.fd, false, true);
+      } catch (...) {
+        Fail(request, std::current_exception());
+      }
+    } else {
+      Fail(request, error);
+    }
+  }
+
+  void ReleaseConnection(Request& request, bool keep_alive) {
+    if (request.fd < 0) {
+      return;
+    }
+    requests_by_fd_.erase(request.fd);
+    std::vector<IdleConnection>& connections = idle_[request.key];
+    if (keep_alive && connections.size() < kDefaultMaxIdleConnectionsPerHost) {
+      // Keep watching for reads, to notice the server closing it.
+      poller_.Watch(request.fd, true, false);
+      connections.push_back(IdleConnection{request.fd, Now()});
+      idle_by_fd_[request.fd] = request.key;
+    } else {
+      poller_.Remove(request.fd);
+      ::close(request.fd);
+    }
+    request.fd = -1;
+  }
+
+  void DropIdleConnection(int fd) {
+    poller_.Remove(fd);
+    ::close(fd);
+    const auto cit = idle_by_fd_.find(fd);
+    if (cit != idle_by_fd_.end()) {
+      std::vector<IdleConnection>& connections = idle_[cit->second];
+      for (size_t i = 0; i < connections.size(); ++i) {
+        if (connections[i].fd == fd) {
+          connections.erase(connections.begin() + i);
+          break;
+        }
+      }
+      idle_by_fd_.erase(cit);
+    }
+  }
+
+  void Fail(Request& request, std::exception_ptr error) {
+    ReleaseConnection(request, false);
+    Complete(request)->on_failure(error);
+  }
+
+  // Takes the request out of the ones in flight, for its callback to be invoked.
+  std::unique_ptr<Request> Complete(Request& request) {
+    const auto cit = in_flight_.find(&request);
+    std::unique_ptr<Request> done(std::move(cit->second));
+    in_flight_.erase(cit);
+    timers_.Cancel(done->timeout_timer);
+    --requests_in_flight_;
+    return done;
+  }
+
+  // Closes the keep-alive connections idle for too long. There are at most
+  // `kDefaultMaxIdleConnectionsPerHost` of them per host, unlike the requests, which have timers of their own.
+  void Sweep(T_TIME_POINT now) {
+    std::vector<int> idle;
+    for (const auto& cit : idle_) {
+      for (const IdleConnection& connection : cit.second) {
+        if (now - connection.since > std::chrono::milliseconds(kDefaultIdleConnectionTimeoutMs)) {
+          idle.push_back(connection.fd);
+        }
+      }
+    }
+    for (int fd : idle) {
+      DropIdleConnection(fd);
+    }
+  }
+
+  // Same as `Connection::IsIdle()`, for the non-blocking sockets.
+  static bool IsIdle(int fd) {
+    char c;
+    const ssize_t result = ::recv(fd, &c, 1, MSG_PEEK);
+    return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  }
+
+  static const char* HeaderValue(const HTTPRequest& response, const char* name) {
+    for (const auto& cit : response.headers) {
+      if (!strcasecmp(cit.first.c_str(), name)) {
+        return cit.second.c_str();
+      }
+    }
+    return "";
+  }
+
+  const uint64_t timeout_ms_;
+
+  std::mutex mutex_;
+  std::deque<std::unique_ptr<Request>> submitted_;
+  bool stopping_;
+  std::atomic<size_t> requests_in_flight_;
+
+  // Owned by the thread of the event loop.
+  EventPoller poller_;
+  int wake_pipe_[2];
+  std::map<Request*, std::unique_ptr<Request>> in_flight_;
+  std::unordered_map<int, Request*> requests_by_fd_;
+  std::map<std::string, std::vector<IdleConnection>> idle_;
+  std::unordered_map<int, std::string> idle_by_fd_;
+  bricks::time::TimerWheel timers_{NowMs(), kHTTPAsyncTimerTickMs};
+
+  std::thread thread_;
+
+  HTTPAsyncClientPOSIX(const HTTPAsyncClientPOSIX&) = delete;
+  void operator=(const HTTPAsyncClientPOSIX&) = delete;
+};
+
+}  // namespace api
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_API_IMPL_POSIX_ASYNC_H
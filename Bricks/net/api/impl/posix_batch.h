@@ -0,0 +1,196 @@
+// Batches of HTTP/1.1 requests pipelined over one connection, for many small requests to the same host
+// to cost one round trip instead of one each.
+//
+//   const std::vector<HTTPResponseWithBuffer> responses =
+//       HTTPBatch({GET(url + "/a"), POST(url + "/b", "data", "text/plain"), GET(url + "/c")});
+//
+// The responses are returned in the order of the requests, typed as those of `HTTP(...)`, the bodies kept
+// in memory. The consecutive requests to the same host and port are written to a connection taken from
+// `HTTPClientPOSIX::ConnectionPool()` without waiting for the responses, up to `kHTTPBatchMaxPipelineDepth`
+// at a time, and the responses are parsed in order by `TemplatedHTTPReceivedMessage`, each starting with
+// the bytes the previous one has read past its end.
+//
+// Should the server close the connection early, with `Connection: close`, with a response of no length,
+// or by failing the connection, the requests left without responses are sent one by one, as `HTTP(...)`
+// does. So are the requests with the bodies from files, and those to the hosts that use HTTP/2.
+// The redirects, and the compressed bodies refused with "415 Unsupported Media Type", are followed
+// one by one as well. Throws what `HTTP(...)` throws, should a request fail for good.
+//
+// Pipelining is for the idempotent requests: a request the server has closed the connection without
+// responding to is sent again, and the server may have processed it already.
+
+#ifndef BRICKS_NET_API_IMPL_POSIX_BATCH_H
+#define BRICKS_NET_API_IMPL_POSIX_BATCH_H
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "posix.h"
+
+#include "../types.h"
+#include "../url.h"
+
+#include "../../http.h"
+
+namespace bricks {
+namespace net {
+namespace api {
+
+// The most requests in flight on one connection, for the server to not have to buffer more responses
+// than this before the client reads them.
+const size_t kHTTPBatchMaxPipelineDepth = 32;
+
+// Any of the requests `HTTP(...)` takes: `GET`, `POST` or `POSTFromFile`.
+class HTTPBatchRequest final {
+ public:
+  template <typename T_REQUEST_PARAMS>
+  HTTPBatchRequest(const T_REQUEST_PARAMS& request_params)
+      : prepare_([request_params](HTTPClientPOSIX& client) {
+          ImplWrapper<HTTPClientPOSIX>::PrepareInput(request_params, client);
+        }),
+        parse_([request_params](const HTTPClientPOSIX& client, HTTPResponseWithBuffer& output) {
+          ImplWrapper<HTTPClientPOSIX>::ParseOutput(request_params, KeepResponseInMemory(), client, output);
+        }) {}
+
+ private:
+  friend class HTTPBatchClientPOSIX;
+  std::function<void(HTTPClientPOSIX&)> prepare_;
+  std::function<void(const HTTPClientPOSIX&, HTTPResponseWithBuffer&)> parse_;
+};
+
+class HTTPBatchClientPOSIX final {
+ public:
+  std::vector<HTTPResponseWithBuffer> operator()(const std::vector<HTTPBatchRequest>& requests) const {
+    std::vector<std::unique_ptr<Exchange>> exchanges;
+    for (const HTTPBatchRequest& request : requests) {
+      exchanges.emplace_back(new Exchange());
+      request.prepare_(exchanges.back()->client);
+      exchanges.back()->url = URLParser(exchanges.back()->client.request_url_);
+    }
+
+    size_t i = 0;
+    while (i < exchanges.size()) {
+      if (!Pipelinable(*exchanges[i])) {
+        SendOnItsOwn(*exchanges[i++]);
+        continue;
+      }
+      size_t end = i + 1;
+      while (end < exchanges.size() && end - i < kHTTPBatchMaxPipelineDepth && Pipelinable(*exchanges[end]) &&
+             SameDestination(*exchanges[i], *exchanges[end])) {
+        ++end;
+      }
+      const size_t responded = Pipeline(exchanges, i, end);
+      for (size_t k = i; k < end; ++k) {
+        if (k < i + responded) {
+          FollowUp(*exchanges[k]);
+        } else {
+          SendOnItsOwn(*exchanges[k]);
+        }
+      }
+      i = end;
+    }
+
+    std::vector<HTTPResponseWithBuffer> responses(requests.size());
+    for (size_t k = 0; k < requests.size(); ++k) {
+      requests[k].parse_(exchanges[k]->client, responses[k]);
+    }
+    return responses;
+  }
+
+ private:
+  struct Exchange {
+    HTTPClientPOSIX client;
+    URLParser url;
+    std::string location;
+  };
+
+  static bool Tls(const Exchange& exchange) { return exchange.url.protocol == "https"; }
+
+  static bool SameDestination(const Exchange& a, const Exchange& b) {
+    return a.url.host == b.url.host && a.url.port == b.url.port && Tls(a) == Tls(b);
+  }
+
+  // The bodies from the files are streamed after the headers, and are left to `HTTPClientPOSIX::Go()`,
+  // as are the requests revalidating the cached responses.
+  static bool Pipelinable(const Exchange& exchange) {
+    bool reused;
+    return !exchange.client.request_body_file_ && !exchange.client.request_cache_ &&
+           !HTTPClientPOSIX::ConnectionPool().AcquireHTTP2(
+               exchange.url.host, exchange.url.port, Tls(exchange), reused);
+  }
+
+  static void SendOnItsOwn(Exchange& exchange) { exchange.client.Go(); }
+
+  // Writes the requests `[begin, end)` at once, and reads their responses in order. Returns how many
+  // of them have been responded to before the server closed the connection, if it did.
+  static size_t Pipeline(std::vector<std::unique_ptr<Exchange>>& exchanges, size_t begin, size_t end) {
+    const Exchange& first = *exchanges[begin];
+    std::string requests;
+    for (size_t k = begin; k < end; ++k) {
+      HTTPClientPOSIX& client = exchanges[k]->client;
+      client.response_url_after_redirects_ = client.request_url_;
+      requests += client.ComposeRequest(exchanges[k]->url);
+      requests += client.request_body_contents_;
+    }
+    HTTPClientConnectionPool& pool = HTTPClientPOSIX::ConnectionPool();
+    bool reused;
+    Connection connection = pool.Acquire(first.url.host, first.url.port, reused, Tls(first));
+    size_t responded = 0;
+    bool keep_alive = false;
+    std::vector<char> unparsed_bytes;
+    for (bool retry = reused; true; retry = false) {
+      try {
+        connection.BlockingWrite(requests);
+        while (responded < end - begin) {
+          Exchange& exchange = *exchanges[begin + responded];
+          typedef HTTPClientPOSIX::HTTPRedirectableReceivedMessage T_MESSAGE;
+          exchange.client.message_.reset(responded ? new T_MESSAGE(connection, std::move(unparsed_bytes))
+                                                   : new T_MESSAGE(connection));
+          keep_alive = exchange.client.ReceiveResponseBodyHTTP1(connection, exchange.location);
+          unparsed_bytes = exchange.client.message_->UnparsedBytes();
+          ++responded;
+          if (!keep_alive) {
+            break;
+          }
+        }
+        break;
+      } catch (const NetworkException&) {
+        keep_alive = false;
+        if (!retry || responded) {
+          break;
+        }
+        // The server has closed the idle connection before receiving the requests. Retry on a new one.
+        connection = pool.Connect(first.url.host, first.url.port, Tls(first));
+      }
+    }
+    if (keep_alive && responded == end - begin && unparsed_bytes.empty()) {
+      pool.Release(first.url.host, first.url.port, std::move(connection));
+    }
+    return responded;
+  }
+
+  // Follows the redirect, or sends the request with the body as it is once the compressed one has been refused,
+  // the way `HTTPClientPOSIX::Go()` does.
+  static void FollowUp(Exchange& exchange) {
+    HTTPClientPOSIX& client = exchange.client;
+    const int code = client.response_code_;
+    if (code >= 300 && code <= 399 && !exchange.location.empty()) {
+      const std::string original_url = client.request_url_;
+      client.request_url_ = URLParser(exchange.location, exchange.url).ComposeURL();
+      client.Go();
+      client.request_url_ = original_url;
+    } else if (code == static_cast<int>(HTTPResponseCode::UnsupportedMediaType) &&
+               client.FallBackToIdentityRequestBody()) {
+      client.Go();
+    }
+  }
+};
+
+}  // namespace api
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_API_IMPL_POSIX_BATCH_H
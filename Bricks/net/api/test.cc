@@ -4,12 +4,17 @@
 // Note that this test relies on HTTP server defined in Bricks.
 // Thus, it might have to be tweaked on Windows. TODO(dkorolev): Do it.
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <fstream>
 #include <functional>
+#include <future>
 #include <iostream>
+#include <map>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include "api.h"
 #include "url.h"
@@ -123,6 +128,81 @@ TEST(URLParserTest, RedirectPreservesProtocolHostAndPortTest) {
             URLParser("blah://new_host:6000/foo", URLParser("meh://localhost:5000")).ComposeURL());
 }
 
+TEST(URLParserTest, SlicesTest) {
+  const std::string url = "https://user.example.com:8443/a/b?x=1&y=2#top";
+  const bricks::net::api::URLSlices slices(url);
+  EXPECT_EQ("https", slices.protocol.ToString());
+  EXPECT_EQ("user.example.com", slices.host.ToString());
+  EXPECT_EQ("8443", slices.port.ToString());
+  EXPECT_EQ(8443, slices.PortNumber());
+  EXPECT_EQ("/a/b", slices.path.ToString());
+  EXPECT_EQ("x=1&y=2", slices.query.ToString());
+  EXPECT_EQ("top", slices.fragment.ToString());
+  // The slices point into the URL.
+  EXPECT_EQ(url.data() + 8, slices.host.data);
+
+  // The "://" in the query does not make the part before it a protocol.
+  const bricks::net::api::URLSlices redirect("localhost/redirect?to=http://example.com");
+  EXPECT_TRUE(redirect.protocol.empty());
+  EXPECT_TRUE(redirect.host == "localhost");
+  EXPECT_TRUE(redirect.path == "/redirect");
+  EXPECT_TRUE(redirect.query == "to=http://example.com");
+
+  URLParser u("www.google.com?q=bricks");
+  EXPECT_EQ("www.google.com", u.host);
+  EXPECT_EQ("/?q=bricks", u.path);
+  u = URLParser("http://localhost/redirect?to=http://example.com#x");
+  EXPECT_EQ("localhost", u.host);
+  EXPECT_EQ("/redirect?to=http://example.com#x", u.path);
+}
+
+TEST(URLParserTest, UnixSocketTest) {
+  URLParser u("http://unix:/var/run/app.sock:/status?x=1");
+  EXPECT_EQ("http", u.protocol);
+  EXPECT_EQ("unix:/var/run/app.sock", u.host);
+  EXPECT_EQ("/status?x=1", u.path);
+  EXPECT_TRUE(u.IsUnixSocket());
+  EXPECT_EQ("localhost", u.HostHeader());
+  EXPECT_EQ("http://unix:/var/run/app.sock:/status?x=1", u.ComposeURL());
+  EXPECT_EQ("http://unix:/var/run/app.sock:/", URLParser("unix:/var/run/app.sock").ComposeURL());
+  EXPECT_EQ("http://unix:@abstract:/next",
+            URLParser("/next", URLParser("http://unix:@abstract:/")).ComposeURL());
+  EXPECT_FALSE(URLParser("http://unix.example.com:8080/").IsUnixSocket());
+}
+
+TEST(URLParserTest, QueryParametersTest) {
+  const URLParser url("localhost/q?a=1&b=two+words;c=%41%2b%zz&&d&e=#f");
+  bricks::net::api::URLQueryParameters parameters = url.QueryParameters();
+  std::vector<std::pair<std::string, std::string>> decoded;
+  std::string key;
+  std::string value;
+  while (parameters.Next(key, value)) {
+    decoded.emplace_back(key, value);
+  }
+  ASSERT_EQ(5u, decoded.size());
+  EXPECT_EQ("a", decoded[0].first);
+  EXPECT_EQ("1", decoded[0].second);
+  EXPECT_EQ("b", decoded[1].first);
+  EXPECT_EQ("two words", decoded[1].second);
+  EXPECT_EQ("c", decoded[2].first);
+  EXPECT_EQ("A+%zz", decoded[2].second);
+  EXPECT_EQ("d", decoded[3].first);
+  EXPECT_EQ("", decoded[3].second);
+  EXPECT_EQ("e", decoded[4].first);
+  EXPECT_EQ("", decoded[4].second);
+  const URLParser no_query("localhost/");
+  EXPECT_FALSE(no_query.QueryParameters().Next(key, value));
+}
+
+TEST(URLParserTest, HashTest) {
+  EXPECT_EQ(URLParser("www.google.com").Hash(), URLParser("http://www.google.com:80/").Hash());
+  EXPECT_EQ(URLParser("/foo", URLParser("localhost:8080")).Hash(), URLParser("localhost:8080/foo").Hash());
+  EXPECT_NE(URLParser("localhost:8080/foo").Hash(), URLParser("localhost:8081/foo").Hash());
+  EXPECT_NE(URLParser("localhost/foo").Hash(), URLParser("localhost/fo").Hash());
+  EXPECT_NE(URLParser("https://localhost/").Hash(), URLParser("http://localhost/").Hash());
+  EXPECT_NE(URLParser("ab/c").Hash(), URLParser("a/bc").Hash());
+}
+
 // TODO(dkorolev): Migrate to a simpler HTTP server implementation that is to be added to api.h soon.
 // This would not require any of these headers.
 #include "../http.h"
@@ -384,3 +464,819 @@ TYPED_TEST(HTTPClientTemplatedTest, InvalidUrl) {
     }
   }
 }
+
+#if defined(BRICKS_POSIX)
+TEST(HTTPClientPOSIX, ReusesKeepAliveConnections) {
+  HTTPClientConnectionPool& pool = HTTPClientPOSIX::ConnectionPool();
+  pool.Clear();
+  int requests_served = 0;
+  // Accepts a single connection, and serves all the requests sent over it.
+  thread server([&requests_served](Socket socket) {
+    HTTPServerConnection connection(socket.Accept());
+    do {
+      ++requests_served;
+      const auto& message = connection.Message();
+      connection.SendHTTPResponse(message.Method() + ' ' + message.URL() +
+                                  (message.Method() == "POST" ? ' ' + message.Body() : ""));
+    } while (connection.NextRequest());
+  }, Socket(FLAGS_port));
+  const string url = "http://localhost:" + to_string(FLAGS_port);
+  EXPECT_EQ("GET /foo", HTTP(GET(url + "/foo")).body);
+  EXPECT_EQ(1u, pool.IdleConnections("localhost", FLAGS_port));
+  EXPECT_EQ("GET /bar", HTTP(GET(url + "/bar")).body);
+  EXPECT_EQ("POST /baz data", HTTP(POST(url + "/baz", "data", "text/plain")).body);
+  EXPECT_EQ(1u, pool.IdleConnections("localhost", FLAGS_port));
+  // Closing the idle connection lets the server know there will be no more requests.
+  pool.Clear();
+  server.join();
+  EXPECT_EQ(3, requests_served);
+}
+
+TEST(HTTPClientPOSIX, ReconnectsWhenIdleConnectionIsClosed) {
+  HTTPClientConnectionPool& pool = HTTPClientPOSIX::ConnectionPool();
+  pool.Clear();
+  // Closes each connection after one request, while it looks kept alive to the client.
+  thread server([](Socket socket) {
+    for (int i = 0; i < 3; ++i) {
+      HTTPServerConnection connection(socket.Accept());
+      connection.SendHTTPResponse("OK " + to_string(i));
+    }
+  }, Socket(FLAGS_port));
+  const string url = "http://localhost:" + to_string(FLAGS_port) + "/";
+  EXPECT_EQ("OK 0", HTTP(GET(url)).body);
+  EXPECT_EQ("OK 1", HTTP(GET(url)).body);
+  // Expired idle connections are not reused either.
+  pool.SetIdleConnectionTimeoutMs(0);
+  sleep_for(milliseconds(2));
+  EXPECT_EQ("OK 2", HTTP(GET(url)).body);
+  pool.SetIdleConnectionTimeoutMs(bricks::net::api::kDefaultIdleConnectionTimeoutMs);
+  server.join();
+  pool.Clear();
+}
+
+TEST(HTTPClientPOSIX, StreamsBodiesFromAndToFiles) {
+  const string request_file_name = FLAGS_test_tmpdir + "/large_request_test_file_for_http_post";
+  const string response_file_name = FLAGS_test_tmpdir + "/large_response_test_file_for_http_post";
+  const auto input_file_scope = ScopedRemoveFile(request_file_name);
+  const auto output_file_scope = ScopedRemoveFile(response_file_name);
+  string body;
+  for (int i = 0; body.length() < 3 * 1024 * 1024; ++i) {
+    body += to_string(i) + ' ';
+  }
+  WriteStringToFile(request_file_name, body);
+  // Echoes the body back, chunk-encoded.
+  thread server([](Socket socket) {
+    HTTPServerConnection connection(socket.Accept());
+    const string received = connection.Message().Body();
+    auto sender = connection.SendChunkedHTTPResponse();
+    for (size_t offset = 0; offset < received.length(); offset += 100000) {
+      sender.Send(received.substr(offset, 100000));
+    }
+  }, Socket(FLAGS_port));
+  const string url = "http://localhost:" + to_string(FLAGS_port) + "/echo";
+  const auto response =
+      HTTP(POSTFromFile(url, request_file_name, "text/plain"), SaveResponseToFile(response_file_name));
+  server.join();
+  EXPECT_EQ(200, response.code);
+  EXPECT_EQ(response_file_name, response.body_file_name);
+  EXPECT_TRUE(body == ReadFileAsString(response_file_name));
+  HTTPClientPOSIX::ConnectionPool().Clear();
+}
+
+static string Gunzip(const string& compressed) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  EXPECT_EQ(Z_OK, ::inflateInit2(&stream, 15 + 16));
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data()));
+  stream.avail_in = static_cast<uInt>(compressed.length());
+  string result;
+  int code;
+  do {
+    char buffer[64 * 1024];
+    stream.next_out = reinterpret_cast<Bytef*>(buffer);
+    stream.avail_out = sizeof(buffer);
+    code = ::inflate(&stream, Z_NO_FLUSH);
+    result.append(buffer, sizeof(buffer) - stream.avail_out);
+  } while (code == Z_OK);
+  EXPECT_EQ(Z_STREAM_END, code);
+  ::inflateEnd(&stream);
+  return result;
+}
+
+TEST(HTTPClientPOSIX, SendsGzippedBodiesAndFallsBackOn415) {
+  const string request_file_name = FLAGS_test_tmpdir + "/gzipped_request_test_file_for_http_post";
+  const auto input_file_scope = ScopedRemoveFile(request_file_name);
+  string body;
+  for (int i = 0; body.length() < 1024 * 1024; ++i) {
+    body += to_string(i) + ' ';
+  }
+  WriteStringToFile(request_file_name, body);
+  // Responds with how the body came, and with what it was once decompressed.
+  // Refuses the compressed bodies sent to "/identity_only".
+  bricks::net::HTTPServer server(FLAGS_port, [&body](const bricks::net::HTTPRequest& request,
+                                                     bricks::net::HTTPResponse& response) {
+    const auto& headers = request.headers;
+    const bool gzipped = headers.count("Content-Encoding") && headers.at("Content-Encoding") == "gzip";
+    if (gzipped && request.url == "/identity_only") {
+      response.code = bricks::net::HTTPResponseCode::UnsupportedMediaType;
+    } else {
+      const string received = gzipped ? Gunzip(request.body) : request.body;
+      response.body = string(gzipped ? "gzip" : "identity") +
+                      (headers.count("Transfer-Encoding") ? " chunked" : " ") +
+                      (received == body ? " OK" : " MISMATCH");
+    }
+  });
+  const string url = "http://localhost:" + to_string(FLAGS_port);
+  EXPECT_EQ("gzip  OK", HTTP(POST(url + "/buffer", body, "text/plain").SetGzipBody()).body);
+  EXPECT_EQ("gzip chunked OK",
+            HTTP(POSTFromFile(url + "/file", request_file_name, "text/plain").SetGzipBody()).body);
+  EXPECT_EQ("identity  OK", HTTP(POST(url + "/identity_only", body, "text/plain").SetGzipBody()).body);
+  EXPECT_EQ("identity  OK",
+            HTTP(POSTFromFile(url + "/identity_only", request_file_name, "text/plain").SetGzipBody()).body);
+  EXPECT_EQ("gzip chunked OK",
+            HTTPAsync(POSTFromFile(url + "/file", request_file_name, "text/plain").SetGzipBody()).get().body);
+  auto identity_only = POSTFromFile(url + "/identity_only", request_file_name, "text/plain").SetGzipBody();
+  EXPECT_EQ("identity  OK", HTTPAsync(identity_only).get().body);
+  HTTPClientPOSIX::ConnectionPool().Clear();
+}
+
+TEST(HTTPClientPOSIX, SendsLargeBodiesOnlyOnceTheServerSaysTo) {
+  HTTPClientConnectionPool& pool = HTTPClientPOSIX::ConnectionPool();
+  pool.Clear();
+  const string body(bricks::net::api::kHTTPClientExpectContinueMinBodySize, '.');
+  thread server([](Socket socket) {
+    {
+      bricks::net::HTTPStreamingServerConnection c(socket.Accept());
+      EXPECT_TRUE(c.Message().ExpectsContinue());
+      c.SendHTTPResponse(to_string(c.StreamRequestBody([](const char*, size_t) {})));
+      ASSERT_TRUE(c.NextRequest());
+      EXPECT_TRUE(c.Message().ExpectsContinue());
+      c.SendHTTPResponse("", bricks::net::HTTPResponseCode::ServiceUnavailable);
+      EXPECT_FALSE(c.NextRequest());
+      // The client closes the connection having sent nothing more.
+      EXPECT_EQ("", c.RawConnection().BlockingReadUntilEOF());
+    }
+    HTTPServerConnection c(socket.Accept());
+    EXPECT_FALSE(c.Message().ExpectsContinue());
+    c.SendHTTPResponse(c.Message().Body());
+  }, Socket(FLAGS_port));
+  const string url = "http://localhost:" + to_string(FLAGS_port);
+  EXPECT_EQ(to_string(body.length()), HTTP(POST(url + "/accepted", body, "text/plain")).body);
+  EXPECT_EQ(503, HTTP(POST(url + "/rejected", body, "text/plain")).code);
+  EXPECT_EQ(0u, pool.IdleConnections("localhost", FLAGS_port));
+  EXPECT_EQ("small", HTTP(POST(url + "/small", "small", "text/plain")).body);
+  pool.Clear();
+  server.join();
+}
+
+TEST(HTTPClientPOSIX, TimesOutRequestsThatTakeTooLong) {
+  HTTPClientConnectionPool& pool = HTTPClientPOSIX::ConnectionPool();
+  pool.Clear();
+  // Accepts the connection, and never responds.
+  thread server([](Socket socket) {
+    Connection connection(socket.Accept());
+    // The client shuts the connection down once the request is due.
+    connection.BlockingReadUntilEOF();
+  }, Socket(FLAGS_port));
+  const string url = "http://localhost:" + to_string(FLAGS_port);
+  const auto begin = std::chrono::steady_clock::now();
+  ASSERT_THROW(HTTP(GET(url + "/slow").SetTimeout(100)), HTTPClientTimeoutException);
+  const auto elapsed = std::chrono::steady_clock::now() - begin;
+  EXPECT_GE(elapsed, milliseconds(100));
+  EXPECT_LT(elapsed, milliseconds(1000));
+  server.join();
+  EXPECT_EQ(0u, pool.IdleConnections("localhost", FLAGS_port));
+}
+
+TEST(HTTPClientPOSIX, HedgesSlowRequests) {
+  HTTPClientConnectionPool& pool = HTTPClientPOSIX::ConnectionPool();
+  pool.Clear();
+  // Stalls on the first connection, and responds over the second one, the hedged request.
+  thread server([](Socket socket) {
+    Connection stalled(socket.Accept());
+    char buffer[1024];
+    EXPECT_LT(0u, stalled.BlockingRead(buffer, sizeof(buffer)));
+    {
+      HTTPServerConnection c(socket.Accept());
+      EXPECT_EQ("/hedged", c.Message().URL());
+      c.SendHTTPResponse("hedged");
+    }
+    // The client cancels the first request once the second one has been responded to.
+    stalled.BlockingReadUntilEOF();
+  }, Socket(FLAGS_port));
+  const string url = "http://localhost:" + to_string(FLAGS_port);
+  const auto begin = std::chrono::steady_clock::now();
+  EXPECT_EQ("hedged", HTTP(GET(url + "/hedged").SetHedging(50).SetTimeout(5000)).body);
+  EXPECT_LT(std::chrono::steady_clock::now() - begin, milliseconds(1000));
+  server.join();
+  pool.Clear();
+}
+
+TEST(HTTPClientPOSIX, PipelinesBatchesOverOneConnection) {
+  HTTPClientConnectionPool& pool = HTTPClientPOSIX::ConnectionPool();
+  pool.Clear();
+  const size_t n = 5;
+  // Accepts a single connection, and responds only once all the requests have arrived over it,
+  // which a client waiting for each response before sending the next request would never get to.
+  thread server([n](Socket socket) {
+    bricks::net::Connection connection(socket.Accept());
+    bricks::net::HTTPRequestParser parser;
+    std::vector<bricks::net::HTTPRequest> requests;
+    while (requests.size() < n) {
+      char buffer[1024];
+      parser.Feed(buffer, connection.BlockingRead(buffer, sizeof(buffer)));
+      bricks::net::HTTPRequest request;
+      while (parser.Next(request)) {
+        requests.push_back(std::move(request));
+      }
+    }
+    string responses;
+    for (const bricks::net::HTTPRequest& request : requests) {
+      const string body =
+          request.method + ' ' + request.url + (request.method == "POST" ? ' ' + request.body : "");
+      responses += "HTTP/1.1 200 OK\r\nContent-Length: " + to_string(body.length()) + "\r\n\r\n" + body;
+    }
+    connection.BlockingWrite(responses);
+  }, Socket(FLAGS_port));
+  const string url = "http://localhost:" + to_string(FLAGS_port);
+  const std::vector<HTTPResponseWithBuffer> responses = HTTPBatch({GET(url + "/0"),
+                                                                   POST(url + "/1", "one", "text/plain"),
+                                                                   GET(url + "/2"),
+                                                                   POST(url + "/3", "three", "text/plain"),
+                                                                   GET(url + "/4")});
+  server.join();
+  ASSERT_EQ(n, responses.size());
+  EXPECT_EQ("GET /0", responses[0].body);
+  EXPECT_EQ("POST /1 one", responses[1].body);
+  EXPECT_EQ("GET /2", responses[2].body);
+  EXPECT_EQ("POST /3 three", responses[3].body);
+  EXPECT_EQ("GET /4", responses[4].body);
+  for (size_t i = 0; i < n; ++i) {
+    EXPECT_EQ(200, responses[i].code);
+    EXPECT_EQ(url + "/" + to_string(i), responses[i].url);
+  }
+  EXPECT_EQ(1u, pool.IdleConnections("localhost", FLAGS_port));
+  pool.Clear();
+}
+
+TEST(HTTPClientPOSIX, BatchFallsBackToSequentialRequestsOnEarlyClose) {
+  HTTPClientConnectionPool& pool = HTTPClientPOSIX::ConnectionPool();
+  pool.Clear();
+  // Responds to the first of the requests pipelined over the first connection with `Connection: close`,
+  // then serves the rest over the next connection one by one, redirecting "/redirect".
+  thread server([](Socket socket) {
+    {
+      bricks::net::Connection connection(socket.Accept());
+      bricks::net::HTTPRequestParser parser;
+      size_t requests = 0;
+      while (requests < 4) {
+        char buffer[1024];
+        parser.Feed(buffer, connection.BlockingRead(buffer, sizeof(buffer)));
+        bricks::net::HTTPRequest request;
+        while (parser.Next(request)) {
+          ++requests;
+        }
+      }
+      connection.BlockingWrite("HTTP/1.1 200 OK\r\nContent-Length: 5\r\nConnection: close\r\n\r\nfirst");
+    }
+    HTTPServerConnection connection(socket.Accept());
+    do {
+      const string url = connection.Message().URL();
+      if (url == "/redirect") {
+        connection.SendHTTPResponse(
+            "", HTTPResponseCode::Found, "text/html", HTTPHeadersType({{"Location", "/target"}}));
+      } else {
+        connection.SendHTTPResponse("again " + url);
+      }
+    } while (connection.NextRequest());
+  }, Socket(FLAGS_port));
+  const string url = "http://localhost:" + to_string(FLAGS_port);
+  const std::vector<HTTPResponseWithBuffer> responses =
+      HTTPBatch({GET(url + "/a"), GET(url + "/b"), GET(url + "/redirect"), GET(url + "/c")});
+  ASSERT_EQ(4u, responses.size());
+  EXPECT_EQ("first", responses[0].body);
+  EXPECT_EQ("again /b", responses[1].body);
+  EXPECT_EQ("again /target", responses[2].body);
+  EXPECT_EQ(url + "/target", responses[2].url_after_redirects);
+  EXPECT_EQ("again /c", responses[3].body);
+  EXPECT_EQ(1u, pool.IdleConnections("localhost", FLAGS_port));
+  pool.Clear();
+  server.join();
+}
+
+TEST(HTTPClientPOSIX, RevalidatesCachedResponses) {
+  const string directory = FLAGS_test_tmpdir + "/http_client_cache";
+  const string response_file_name = FLAGS_test_tmpdir + "/cached_response_test_file";
+  const auto output_file_scope = ScopedRemoveFile(response_file_name);
+  const auto remove_directory = [&directory]() {
+    bricks::FileSystem::ScanDir(directory, [&directory](const string& name) {
+      bricks::FileSystem::RemoveFile(bricks::FileSystem::JoinPath(directory, name));
+    });
+    ::rmdir(directory.c_str());
+  };
+  remove_directory();
+  std::atomic_int version(1);
+  std::atomic_int full_responses(0);
+  std::atomic_int not_modified_responses(0);
+  bricks::net::HTTPServer server(FLAGS_port, [&](const bricks::net::HTTPRequest& request,
+                                                 bricks::net::HTTPResponse& response) {
+    const auto& headers = request.headers;
+    const string etag = "\"v" + to_string(version) + '"';
+    const string last_modified = "Wed, 14 Oct 2026 00:00:00 GMT";
+    if ((request.url == "/config" && headers.count("If-None-Match") && headers.at("If-None-Match") == etag) ||
+        (request.url == "/dated" && headers.count("If-Modified-Since") &&
+         headers.at("If-Modified-Since") == last_modified)) {
+      ++not_modified_responses;
+      response.code = HTTPResponseCode::NotModified;
+      return;
+    }
+    ++full_responses;
+    response.body = request.url + ' ' + to_string(version);
+    if (request.url == "/config") {
+      response.extra_headers.emplace_back("ETag", etag);
+    } else if (request.url == "/dated") {
+      response.extra_headers.emplace_back("Last-Modified", last_modified);
+    }
+  });
+  const string url = "http://localhost:" + to_string(FLAGS_port);
+  {
+    bricks::net::api::HTTPClientCache cache(1024 * 1024, directory);
+    EXPECT_EQ("/config 1", HTTP(GET(url + "/config").SetCache(cache)).body);
+    const auto revalidated = HTTP(GET(url + "/config").SetCache(cache));
+    EXPECT_EQ(200, revalidated.code);
+    EXPECT_EQ("/config 1", revalidated.body);
+    EXPECT_EQ(1, full_responses);
+    EXPECT_EQ(1, not_modified_responses);
+    EXPECT_EQ(200, HTTP(GET(url + "/config").SetCache(cache), SaveResponseToFile(response_file_name)).code);
+    EXPECT_EQ("/config 1", ReadFileAsString(response_file_name));
+    EXPECT_EQ(1, full_responses);
+    EXPECT_EQ(2, not_modified_responses);
+    // Without the cache, the request is sent unconditionally.
+    EXPECT_EQ("/config 1", HTTP(GET(url + "/config")).body);
+    EXPECT_EQ(2, full_responses);
+
+    version = 2;
+    EXPECT_EQ("/config 2", HTTP(GET(url + "/config").SetCache(cache)).body);
+    EXPECT_EQ("/config 2", HTTP(GET(url + "/config").SetCache(cache)).body);
+    EXPECT_EQ(3, full_responses);
+    EXPECT_EQ(3, not_modified_responses);
+
+    EXPECT_EQ("/dated 2", HTTP(GET(url + "/dated").SetCache(cache)).body);
+    EXPECT_EQ("/dated 2", HTTP(GET(url + "/dated").SetCache(cache)).body);
+    EXPECT_EQ(4, full_responses);
+    EXPECT_EQ(4, not_modified_responses);
+
+    // The responses with no validators are not cached.
+    EXPECT_EQ("/plain 2", HTTP(GET(url + "/plain").SetCache(cache)).body);
+    EXPECT_EQ("/plain 2", HTTP(GET(url + "/plain").SetCache(cache)).body);
+    EXPECT_EQ(6, full_responses);
+    EXPECT_LT(0u, cache.MemoryBytes());
+    EXPECT_EQ(string("/config 2/dated 2").length(), cache.DiskBytes());
+  }
+  {
+    // The next run revalidates the responses the previous one has written to disk, with no memory tier.
+    bricks::net::api::HTTPClientCache cache(0, directory);
+    EXPECT_EQ(string("/config 2/dated 2").length(), cache.DiskBytes());
+    EXPECT_EQ("/config 2", HTTP(GET(url + "/config").SetCache(cache)).body);
+    EXPECT_EQ(6, full_responses);
+    EXPECT_EQ(5, not_modified_responses);
+    EXPECT_EQ(0u, cache.MemoryBytes());
+  }
+  HTTPClientPOSIX::ConnectionPool().Clear();
+  remove_directory();
+}
+
+TEST(HTTPClientPOSIX, DownloadsInParallelRanges) {
+  const string response_file_name = FLAGS_test_tmpdir + "/ranged_response_test_file";
+  const auto output_file_scope = ScopedRemoveFile(response_file_name);
+  string body;
+  for (int i = 0; body.length() < 10000; ++i) {
+    body += to_string(i) + ' ';
+  }
+  body.resize(10000);
+  std::atomic_int requests(0);
+  std::atomic_int failing_range_attempts(0);
+  std::atomic_int ranges_without_validator(0);
+  bricks::net::HTTPServer server(FLAGS_port, [&](const bricks::net::HTTPRequest& request,
+                                                 bricks::net::HTTPResponse& response) {
+    ++requests;
+    const auto& headers = request.headers;
+    if (request.url != "/ranges" || !headers.count("Range")) {
+      response.body = body;
+      return;
+    }
+    unsigned long long first;
+    unsigned long long last;
+    ASSERT_EQ(2, sscanf(headers.at("Range").c_str(), "bytes=%llu-%llu", &first, &last));
+    if (first && (!headers.count("If-Range") || headers.at("If-Range") != "\"v1\"")) {
+      ++ranges_without_validator;
+    }
+    if (first == 3250 && !failing_range_attempts++) {
+      response.code = HTTPResponseCode::ServiceUnavailable;
+      return;
+    }
+    last = std::min<unsigned long long>(last, body.length() - 1);
+    response.code = HTTPResponseCode::PartialContent;
+    response.body = body.substr(first, last - first + 1);
+    response.extra_headers.emplace_back(
+        "Content-Range", "bytes " + to_string(first) + '-' + to_string(last) + '/' + to_string(body.length()));
+    response.extra_headers.emplace_back("ETag", "\"v1\"");
+  });
+  const string url = "http://localhost:" + to_string(FLAGS_port);
+
+  // The first 1000 bytes, then the other 9000 in four ranges, one of which fails once and is retried.
+  const auto response =
+      HTTP(GET(url + "/ranges"), SaveResponseToFile(response_file_name).SetParallelRanges(4, 1000));
+  EXPECT_EQ(200, response.code);
+  EXPECT_EQ(body, ReadFileAsString(response_file_name));
+  EXPECT_EQ(6, requests);
+  EXPECT_EQ(2, failing_range_attempts);
+  EXPECT_EQ(0, ranges_without_validator);
+
+  // The server with no support for the ranges sends the whole body in response to the first one.
+  requests = 0;
+  const auto whole =
+      HTTP(GET(url + "/whole"), SaveResponseToFile(response_file_name).SetParallelRanges(4, 1000));
+  EXPECT_EQ(200, whole.code);
+  EXPECT_EQ(body, ReadFileAsString(response_file_name));
+  EXPECT_EQ(1, requests);
+  HTTPClientPOSIX::ConnectionPool().Clear();
+}
+
+#if defined(BRICKS_NET_TLS)
+// The context of the TLS test servers, with its certificate trusted by the client. Shared by the tests,
+// as the client would otherwise look the certificate of the previous test up by the same name.
+static bricks::net::TLSContext& LocalhostTLSContext() {
+  using bricks::net::TLSContext;
+  static std::unique_ptr<TLSContext> context;
+  if (!context) {
+    context = TLSContext::ServerWithSelfSignedCertificate("localhost");
+    TLSContext::DefaultClient().TrustCertificatePEM(context->CertificatePEM());
+  }
+  return *context;
+}
+
+TEST(HTTPClientPOSIX, OverUnixDomainSocket) {
+  const string path = FLAGS_test_tmpdir + "/http_unix_socket_test";
+  bricks::net::HTTPServerParameters parameters;
+  parameters.unix_socket_path = path;
+  bricks::net::HTTPServer server(FLAGS_port, [](const bricks::net::HTTPRequest& request,
+                                                bricks::net::HTTPResponse& response) {
+    response.body = request.url + " of " + request.headers.at("Host");
+  }, parameters);
+  const string url = "http://unix:" + path + ':';
+  EXPECT_EQ("/a of localhost", HTTP(GET(url + "/a")).body);
+  // The keep-alive connection is pooled by the path.
+  EXPECT_EQ("/b of localhost", HTTP(GET(url + "/b")).body);
+  EXPECT_EQ(1u, HTTPClientPOSIX::ConnectionPool().IdleConnections("unix:" + path, 80));
+  HTTPClientPOSIX::ConnectionPool().Clear();
+  ::unlink(path.c_str());
+}
+
+TEST(HTTPClientPOSIX, HTTPSWithKeepAliveAndSessionResumption) {
+  bricks::net::TLSContext& server_context = LocalhostTLSContext();
+  std::vector<bool> reused;
+  std::vector<size_t> requests;
+  thread server([&server_context, &reused, &requests](Socket socket) {
+    for (int i = 0; i < 2; ++i) {
+      Connection connection(socket.Accept());
+      connection.StartTLS(server_context);
+      reused.push_back(connection.TLS()->SessionReused());
+      HTTPServerConnection c(std::move(connection));
+      size_t served = 0;
+      do {
+        c.SendHTTPResponse("Secure " + c.Message().URL());
+        ++served;
+      } while (c.NextRequest());
+      requests.push_back(served);
+    }
+  }, Socket(FLAGS_port));
+  const string url = "https://localhost:" + to_string(FLAGS_port);
+  EXPECT_EQ("Secure /one", HTTP(GET(url + "/one")).body);
+  EXPECT_EQ("Secure /two", HTTP(GET(url + "/two")).body);
+  EXPECT_EQ(1u, HTTPClientPOSIX::ConnectionPool().IdleConnections("localhost", FLAGS_port, true));
+  EXPECT_EQ(0u, HTTPClientPOSIX::ConnectionPool().IdleConnections("localhost", FLAGS_port));
+  // Closes the idle connection; the next one resumes the TLS session.
+  HTTPClientPOSIX::ConnectionPool().Clear();
+  const auto response = HTTP(GET(url + "/three"));
+  EXPECT_EQ(200, response.code);
+  EXPECT_EQ("Secure /three", response.body);
+  EXPECT_EQ(url + "/three", response.url);
+  HTTPClientPOSIX::ConnectionPool().Clear();
+  server.join();
+  ASSERT_EQ(2u, reused.size());
+  EXPECT_FALSE(reused[0]);
+  EXPECT_TRUE(reused[1]);
+  EXPECT_EQ(2u, requests[0]);
+  EXPECT_EQ(1u, requests[1]);
+}
+#endif  // defined(BRICKS_NET_TLS)
+
+TEST(HTTP2, HPACKMatchesTheExamplesOfRFC7541) {
+  // RFC 7541, Appendix C.4: three requests on the same connection, with Huffman coding.
+  const std::vector<HPACKHeaders> requests = {
+      {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}},
+      {{":method", "GET"},
+       {":scheme", "http"},
+       {":path", "/"},
+       {":authority", "www.example.com"},
+       {"cache-control", "no-cache"}},
+      {{":method", "GET"},
+       {":scheme", "https"},
+       {":path", "/index.html"},
+       {":authority", "www.example.com"},
+       {"custom-key", "custom-value"}}};
+  const std::vector<string> expected = {"828684418cf1e3c2e5f23a6ba0ab90f4ff",
+                                        "828684be5886a8eb10649cbf",
+                                        "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf"};
+  HPACKEncoder encoder;
+  HPACKDecoder decoder;
+  for (size_t i = 0; i < requests.size(); ++i) {
+    string block;
+    encoder.Encode(requests[i], block);
+    string hex;
+    for (const char c : block) {
+      hex += "0123456789abcdef"[static_cast<uint8_t>(c) >> 4];
+      hex += "0123456789abcdef"[static_cast<uint8_t>(c) & 0xf];
+    }
+    EXPECT_EQ(expected[i], hex);
+    HPACKHeaders decoded;
+    decoder.Decode(block.data(), block.length(), decoded);
+    EXPECT_TRUE(requests[i] == decoded);
+  }
+  // An index past the dynamic table, and the padding of zeros, are malformed.
+  HPACKHeaders decoded;
+  ASSERT_THROW(decoder.Decode("\xc5", 1, decoded), bricks::net::HPACKDecodingException);
+  ASSERT_THROW(HPACKDecoder().Decode("\x04\x81\x00", 3, decoded), bricks::net::HPACKDecodingException);
+}
+
+// A minimal HTTP/2 server over the accepted connection: responds to each request, once it has been received
+// in full, with its path and its body, decompressed. Holds the responses to the requests to "/together/..."
+// until `together` of them have been received, and then responds to them in the reverse order.
+static void ServeHTTP2(Connection& connection, size_t together) {
+  namespace http2 = bricks::net::api::http2;
+  char preface[http2::kConnectionPrefaceLength];
+  ASSERT_EQ(sizeof(preface), connection.BlockingRead(preface, sizeof(preface), Connection::FillFullBuffer));
+  ASSERT_EQ(string(http2::kConnectionPreface), string(preface, sizeof(preface)));
+  string settings;
+  http2::AppendSetting(settings, http2::Setting::MaxConcurrentStreams, 100);
+  string output;
+  http2::AppendFrame(output, http2::FrameType::Settings, 0, 0, settings);
+  connection.BlockingWrite(output);
+  HPACKEncoder encoder;
+  HPACKDecoder decoder;
+  std::map<uint32_t, std::pair<HPACKHeaders, string>> requests;
+  std::vector<uint32_t> held;
+  const auto respond = [&](uint32_t stream_id) {
+    const HPACKHeaders& headers = requests[stream_id].first;
+    string path;
+    bool gzipped = false;
+    for (const auto& header : headers) {
+      path = header.first == ":path" ? header.second : path;
+      gzipped = gzipped || (header.first == "content-encoding" && header.second == "gzip");
+    }
+    const string& body = requests[stream_id].second;
+    const string response = path + ':' + (gzipped ? Gunzip(body) : body);
+    string block;
+    encoder.Encode({{":status", "200"}, {"content-type", "text/plain"}}, block);
+    string frames;
+    http2::AppendHeaderBlock(frames, stream_id, block, false, http2::kDefaultMaxFrameSize);
+    for (size_t offset = 0; offset < response.length(); offset += http2::kDefaultMaxFrameSize) {
+      const size_t length =
+          std::min(response.length() - offset, static_cast<size_t>(http2::kDefaultMaxFrameSize));
+      const uint8_t flags = offset + length == response.length() ? http2::kFlagEndStream : 0;
+      http2::AppendFrame(frames, http2::FrameType::Data, flags, stream_id, response.data() + offset, length);
+    }
+    connection.BlockingWrite(frames);
+    requests.erase(stream_id);
+  };
+  http2::Frame frame;
+  while (http2::ReadFrame(connection, frame) && frame.type != http2::FrameType::GoAway) {
+    output.clear();
+    if (frame.type == http2::FrameType::Settings && !(frame.flags & http2::kFlagAck)) {
+      http2::AppendFrame(output, http2::FrameType::Settings, http2::kFlagAck, 0, "", 0);
+    } else if (frame.type == http2::FrameType::Headers) {
+      EXPECT_TRUE(frame.flags & http2::kFlagEndHeaders);
+      http2::StripPaddingAndPriority(frame);
+      decoder.Decode(frame.payload.data(), frame.payload.length(), requests[frame.stream_id].first);
+    } else if (frame.type == http2::FrameType::Data && !frame.payload.empty()) {
+      requests[frame.stream_id].second += frame.payload;
+      http2::AppendWindowUpdate(output, 0, static_cast<uint32_t>(frame.payload.length()));
+      http2::AppendWindowUpdate(output, frame.stream_id, static_cast<uint32_t>(frame.payload.length()));
+    }
+    if (!output.empty()) {
+      connection.BlockingWrite(output);
+    }
+    if ((frame.type == http2::FrameType::Headers || frame.type == http2::FrameType::Data) &&
+        (frame.flags & http2::kFlagEndStream)) {
+      const HPACKHeaders& headers = requests[frame.stream_id].first;
+      const bool hold = std::find_if(headers.begin(), headers.end(), [](const std::pair<string, string>& h) {
+        return h.first == ":path" && h.second.compare(0, 10, "/together/") == 0;
+      }) != headers.end();
+      if (!hold) {
+        respond(frame.stream_id);
+      } else {
+        held.push_back(frame.stream_id);
+        if (held.size() == together) {
+          for (auto rit = held.rbegin(); rit != held.rend(); ++rit) {
+            respond(*rit);
+          }
+          held.clear();
+        }
+      }
+    }
+  }
+}
+
+TEST(HTTPClientPOSIX, MultiplexesRequestsOverHTTP2WithPriorKnowledge) {
+  HTTPClientConnectionPool& pool = HTTPClientPOSIX::ConnectionPool();
+  pool.Clear();
+  pool.SetHTTP2PriorKnowledge("localhost", FLAGS_port);
+  const size_t n = 8;
+  // Accepts a single connection: the requests are in flight over it at once, as none is responded to
+  // before all of them have been received.
+  thread server([n](Socket socket) {
+    Connection connection(socket.Accept());
+    ServeHTTP2(connection, n);
+  }, Socket(FLAGS_port));
+  const string url = "http://localhost:" + to_string(FLAGS_port);
+  std::vector<string> bodies(n);
+  std::vector<string> results(n);
+  std::vector<thread> clients;
+  for (size_t i = 0; i < n; ++i) {
+    // The first body is larger than the initial flow control window.
+    bodies[i] = string(i ? 100 * i : 200000, static_cast<char>('a' + i));
+    clients.emplace_back([&url, &bodies, &results, i]() {
+      const string path = "/together/" + to_string(i);
+      results[i] = HTTP(POST(url + path, bodies[i], "text/plain").SetGzipBody(i % 2 == 1)).body;
+    });
+  }
+  for (thread& client : clients) {
+    client.join();
+  }
+  for (size_t i = 0; i < n; ++i) {
+    EXPECT_TRUE("/together/" + to_string(i) + ':' + bodies[i] == results[i]) << i;
+  }
+  EXPECT_TRUE(pool.HasHTTP2Connection("localhost", FLAGS_port));
+  EXPECT_EQ(0u, pool.IdleConnections("localhost", FLAGS_port));
+  // The same connection serves the subsequent requests, with the bodies from and to the files.
+  const string request_file_name = FLAGS_test_tmpdir + "/http2_request_test_file_for_http_post";
+  const string response_file_name = FLAGS_test_tmpdir + "/http2_response_test_file_for_http_post";
+  const auto input_file_scope = ScopedRemoveFile(request_file_name);
+  const auto output_file_scope = ScopedRemoveFile(response_file_name);
+  string body;
+  for (int i = 0; body.length() < 1024 * 1024; ++i) {
+    body += to_string(i) + ' ';
+  }
+  WriteStringToFile(request_file_name, body);
+  const auto response = HTTP(POSTFromFile(url + "/file", request_file_name, "text/plain").SetGzipBody(),
+                             SaveResponseToFile(response_file_name));
+  EXPECT_EQ(200, response.code);
+  EXPECT_TRUE("/file:" + body == ReadFileAsString(response_file_name));
+  EXPECT_EQ("/get:", HTTP(GET(url + "/get")).body);
+  // Lets the server know there will be no more requests.
+  pool.Clear();
+  server.join();
+  pool.SetHTTP2PriorKnowledge("localhost", FLAGS_port, false);
+}
+
+#if defined(BRICKS_NET_TLS)
+TEST(HTTPClientPOSIX, NegotiatesHTTP2WithALPN) {
+  bricks::net::TLSContext& server_context = LocalhostTLSContext();
+  server_context.SetALPNProtocols({"h2", "http/1.1"});
+  HTTPClientConnectionPool& pool = HTTPClientPOSIX::ConnectionPool();
+  pool.Clear();
+  pool.EnableHTTP2();
+  string protocol;
+  thread server([&server_context, &protocol](Socket socket) {
+    Connection connection(socket.Accept());
+    connection.StartTLS(server_context);
+    protocol = connection.TLS()->ALPNProtocol();
+    ServeHTTP2(connection, 2);
+  }, Socket(FLAGS_port));
+  const string url = "https://localhost:" + to_string(FLAGS_port);
+  string first;
+  thread client([&url, &first]() { first = HTTP(GET(url + "/together/one")).body; });
+  EXPECT_EQ("/together/two:", HTTP(GET(url + "/together/two")).body);
+  client.join();
+  EXPECT_EQ("/together/one:", first);
+  EXPECT_TRUE(pool.HasHTTP2Connection("localhost", FLAGS_port, true));
+  pool.Clear();
+  server.join();
+  pool.EnableHTTP2(false);
+  EXPECT_EQ("h2", protocol);
+}
+#endif  // defined(BRICKS_NET_TLS)
+
+TEST(HTTPAsyncClient, ManyRequestsInFlight) {
+  const int n = 8;
+  // Accepts all the connections before responding to any, in reverse order.
+  thread server([n](Socket socket) {
+    std::vector<std::unique_ptr<HTTPServerConnection>> connections;
+    for (int i = 0; i < n; ++i) {
+      connections.emplace_back(new HTTPServerConnection(socket.Accept()));
+    }
+    for (int i = n - 1; i >= 0; --i) {
+      connections[i]->SendHTTPResponse("Response to " + connections[i]->Message().URL());
+      connections[i].reset();
+    }
+  }, Socket(FLAGS_port));
+  const string url = "http://localhost:" + to_string(FLAGS_port);
+  std::vector<std::future<HTTPResponseWithBuffer>> responses;
+  for (int i = 0; i < n; ++i) {
+    responses.push_back(HTTPAsync(GET(url + "/" + to_string(i))));
+  }
+  for (int i = 0; i < n; ++i) {
+    const auto response = responses[i].get();
+    EXPECT_EQ(200, response.code);
+    EXPECT_EQ("Response to /" + to_string(i), response.body);
+    EXPECT_EQ(url + "/" + to_string(i), response.url);
+  }
+  server.join();
+}
+
+TEST(HTTPAsyncClient, KeepAliveConnectionsAndRedirects) {
+  const string request_file_name = FLAGS_test_tmpdir + "/async_request_test_file_for_http_post";
+  const string response_file_name = FLAGS_test_tmpdir + "/async_response_test_file_for_http_post";
+  const auto input_file_scope = ScopedRemoveFile(request_file_name);
+  const auto output_file_scope = ScopedRemoveFile(response_file_name);
+  string file_body;
+  for (int i = 0; file_body.length() < 200 * 1000; ++i) {
+    file_body += to_string(i) + ' ';
+  }
+  WriteStringToFile(request_file_name, file_body);
+  bricks::net::HTTPServer server(FLAGS_port, [](const bricks::net::HTTPRequest& request,
+                                                bricks::net::HTTPResponse& response) {
+    if (request.url == "/redirect") {
+      response.code = HTTPResponseCode::Found;
+      response.extra_headers.push_back(std::make_pair("Location", "/redirected"));
+    } else {
+      response.body = request.method + ' ' + request.url + (request.method == "POST" ? ' ' + request.body : "");
+    }
+  });
+  const string url = "http://localhost:" + to_string(FLAGS_port);
+  const int n = 100;
+  std::vector<std::future<HTTPResponseWithBuffer>> responses;
+  for (int i = 0; i < n; ++i) {
+    responses.push_back(HTTPAsync(POST(url + "/" + to_string(i), to_string(i * i), "text/plain")));
+  }
+  auto redirect = HTTPAsync(GET(url + "/redirect"));
+  auto file = HTTPAsync(POSTFromFile(url + "/file", request_file_name, "text/plain"),
+                        SaveResponseToFile(response_file_name));
+  std::promise<string> callback_body;
+  HTTPAsync(GET(url + "/callback"),
+            KeepResponseInMemory(),
+            [&callback_body](HTTPResponseWithBuffer&& response) { callback_body.set_value(response.body); },
+            [&callback_body](std::exception_ptr error) { callback_body.set_exception(error); });
+  for (int i = 0; i < n; ++i) {
+    EXPECT_EQ("POST /" + to_string(i) + ' ' + to_string(i * i), responses[i].get().body);
+  }
+  const auto redirected = redirect.get();
+  EXPECT_EQ(200, redirected.code);
+  EXPECT_EQ("GET /redirected", redirected.body);
+  EXPECT_EQ(url + "/redirected", redirected.url_after_redirects);
+  EXPECT_EQ(response_file_name, file.get().body_file_name);
+  EXPECT_TRUE("POST /file " + file_body == ReadFileAsString(response_file_name));
+  EXPECT_EQ("GET /callback", callback_body.get_future().get());
+  // The requests sent after the first ones have completed reuse their connections.
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ("GET /sequential", HTTPAsync(GET(url + "/sequential")).get().body);
+  }
+  // The rest are closed by the client, which the server notices on its own thread.
+  for (int i = 0; i < 1000 && server.NumberOfConnections() > kDefaultMaxIdleConnectionsPerHost; ++i) {
+    sleep_for(milliseconds(1));
+  }
+  EXPECT_GE(kDefaultMaxIdleConnectionsPerHost, server.NumberOfConnections());
+}
+
+TEST(HTTPAsyncClient, Failures) {
+  const string url = "http://localhost:" + to_string(FLAGS_port);
+  // Nothing is listening on the port.
+  ASSERT_THROW(HTTPAsync(GET(url + "/get")).get(), bricks::net::SocketException);
+  const string non_existent_file_name = FLAGS_test_tmpdir + "/non_existent_file";
+  ASSERT_THROW(HTTPAsync(POSTFromFile(url + "/post", non_existent_file_name, "text/plain")).get(),
+               HTTPClientException);
+  EXPECT_EQ(0u, HTTPAsync.RequestsInFlight());
+}
+
+TEST(HTTPAsyncClient, TimesOut) {
+  // Accepts the connection, and never responds.
+  Socket socket(FLAGS_port);
+  std::promise<void> done;
+  thread server([&socket, &done]() {
+    Connection connection(socket.Accept());
+    done.get_future().wait();
+  });
+  HTTPAsyncClientPOSIX client(100);
+  const string url = "http://localhost:" + to_string(FLAGS_port);
+  const auto begin = std::chrono::steady_clock::now();
+  auto slow = client(GET(url + "/slow"));
+  ASSERT_THROW(slow.get(), HTTPClientTimeoutException);
+  const auto elapsed = std::chrono::steady_clock::now() - begin;
+  EXPECT_GE(elapsed, milliseconds(100));
+  EXPECT_LT(elapsed, milliseconds(1000));
+  EXPECT_EQ(0u, client.RequestsInFlight());
+  done.set_value();
+  server.join();
+}
+#endif  // defined(BRICKS_POSIX)
@@ -17,8 +17,21 @@
 // ## const auto r = HTTP(GET(url), SaveResponseToFile(file_name)); DoWork(r.code, r.body_file_name);
 // ## const auto r = HTTP(POST(url, "data", "text/plain")); DoWork(r.code);
 // ## const auto r = HTTP(POSTFromFile(url, file_name, "text/plain")); DoWork(r.code);
+// ## const auto r = HTTP(GET(url).SetCache(cache)); sends a conditional request, and returns the cached body
+//                   should the server respond with "304 Not Modified", see `impl/client_cache.h`.
 //                   TODO(dkorolev): Hey Alex, do we support returned body from POST requests? :-)
 //
+// The POSIX implementation keeps the connections alive between the requests to the same host,
+// see `impl/connection_pool.h`. Where HTTP/2 has been enabled, the concurrent requests to the same host
+// share a single connection instead, see `impl/http2.h`.
+//
+// ## std::future<HTTPResponseWithBuffer> f = HTTPAsync(GET(url)); ... DoWork(f.get().body);
+//    sends the request on a shared event loop thread, for many requests to be in flight at once,
+//    see `impl/posix_async.h`.
+//
+// ## std::vector<HTTPResponseWithBuffer> r = HTTPBatch({GET(url1), POST(url2, "data", "text/plain")});
+//    pipelines the requests to the same host over one connection, see `impl/posix_batch.h`.
+//
 // # SERVER: TODO(dkorolev).
 //
 // Purpose of this file: To ensure that each header can compile on its own, thus passing the `make check`
@@ -29,6 +42,7 @@
 #ifndef BRICKS_NET_API_TYPES_H
 #define BRICKS_NET_API_TYPES_H
 
+#include <cstdint>
 #include <string>
 
 namespace bricks {
@@ -39,6 +53,11 @@ namespace api {
 // TODO(dkorolev): Structure the exceptions. Make them all eventually inherit from bricks::Exception.
 
 struct HTTPClientException : std::exception {};
+// The request has not completed within `SetTimeout()`.
+struct HTTPClientTimeoutException : HTTPClientException {};
+
+// The cache of the responses to `GET(url).SetCache(cache)`, see `impl/client_cache.h`.
+class HTTPClientCache;
 
 // Structures to define HTTP requests.
 // Support GET and POST.
@@ -46,10 +65,28 @@ struct HTTPClientException : std::exception {};
 // The syntax for creating an instance of a POST request is POST is `POST(url, data, content_type)`'.
 // Alternatively, `POSTFromFile(url, file_name, content_type)` is supported.
 // Both GET and two forms of POST allow `.SetUserAgent(custom_user_agent)`.
+// Both forms of POST allow `.SetGzipBody()`, to send the body gzip-compressed, with `Content-Encoding: gzip`.
+// The body from the file is compressed as it is sent, with `Transfer-Encoding: chunked`, and is never held
+// in memory. Should the server respond with "415 Unsupported Media Type", the request is sent again
+// with the body as it is. Only the POSIX implementation compresses the body, the others send it as it is.
+// The POSIX implementation sends the bodies of a megabyte and more with `Expect: 100-continue`, and does not
+// send them at all if the server responds before being sent one, see `kHTTPClientExpectContinueMinBodySize`.
+// GET allows `.SetCache(cache)`, to revalidate the response cached before. The cache must outlive the request.
+// Only the POSIX implementation uses the cache, the others send the request as it is.
+// All three allow `.SetTimeout(timeout_ms)`, to fail with `HTTPClientTimeoutException` should the request
+// not complete in time, connecting, sending and receiving included, with no limit by default. Only the POSIX
+// implementations honor it; the host names are resolved before the deadline is watched for.
+// GET allows `.SetHedging(after_ms)`, to send the request once more, on another connection, should the first
+// one take longer than `after_ms`, or, for zero, than most of the recent requests to the same host, and to take
+// whichever response comes first. The responses kept in memory only, and only by the POSIX `HTTP(...)`.
 
 struct HTTPRequestGET {
   std::string url;
   std::string custom_user_agent;
+  HTTPClientCache* cache = nullptr;
+  uint64_t timeout_ms = 0;
+  bool hedging = false;
+  uint64_t hedge_after_ms = 0;
 
   explicit HTTPRequestGET(const std::string& url) : url(url) {}
 
@@ -57,6 +94,22 @@ struct HTTPRequestGET {
     custom_user_agent = ua;
     return *this;
   }
+
+  HTTPRequestGET& SetCache(HTTPClientCache& c) {
+    cache = &c;
+    return *this;
+  }
+
+  HTTPRequestGET& SetTimeout(uint64_t ms) {
+    timeout_ms = ms;
+    return *this;
+  }
+
+  HTTPRequestGET& SetHedging(uint64_t after_ms = 0) {
+    hedging = true;
+    hedge_after_ms = after_ms;
+    return *this;
+  }
 };
 
 struct HTTPRequestPOST {
@@ -64,6 +117,8 @@ struct HTTPRequestPOST {
   std::string custom_user_agent;
   std::string body;
   std::string content_type;
+  bool gzip_body = false;
+  uint64_t timeout_ms = 0;
 
   explicit HTTPRequestPOST(const std::string& url, const std::string& body, const std::string& content_type)
       : url(url), body(body), content_type(content_type) {}
@@ -72,6 +127,16 @@ struct HTTPRequestPOST {
     custom_user_agent = ua;
     return *this;
   }
+
+  HTTPRequestPOST& SetGzipBody(bool gzip = true) {
+    gzip_body = gzip;
+    return *this;
+  }
+
+  HTTPRequestPOST& SetTimeout(uint64_t ms) {
+    timeout_ms = ms;
+    return *this;
+  }
 };
 
 struct HTTPRequestPOSTFromFile {
@@ -79,6 +144,8 @@ struct HTTPRequestPOSTFromFile {
   std::string custom_user_agent;
   std::string file_name;
   std::string content_type;
+  bool gzip_body = false;
+  uint64_t timeout_ms = 0;
 
   explicit HTTPRequestPOSTFromFile(const std::string& url,
                                    const std::string& file_name,
@@ -89,6 +156,16 @@ struct HTTPRequestPOSTFromFile {
     custom_user_agent = ua;
     return *this;
   }
+
+  HTTPRequestPOSTFromFile& SetGzipBody(bool gzip = true) {
+    gzip_body = gzip;
+    return *this;
+  }
+
+  HTTPRequestPOSTFromFile& SetTimeout(uint64_t ms) {
+    timeout_ms = ms;
+    return *this;
+  }
 };
 
 typedef HTTPRequestGET GET;
@@ -103,6 +180,10 @@ struct HTTPResponse {
   std::string url;                  // The original URL requested by the client.
   int code;                         // Response code. TODO(dkorolev): HTTPResponseCode from ../http/codes.h?
   std::string url_after_redirects;  // The final URL after all the redirects.
+  // The delay the server has asked for with `Retry-After`, such as with "503 Service Unavailable" while
+  // it sheds the load. Only the delays in seconds are honored, not the dates. Zero for none, and for
+  // the clients other than the POSIX one.
+  uint64_t retry_after_ms = 0;
 };
 
 struct HTTPResponseWithBuffer : HTTPResponse {
@@ -116,12 +197,25 @@ struct HTTPResponseWithResultingFileName : HTTPResponse {
 // Response storage policy.
 // The default one is `KeepResponseInMemory()`, which can be omitted.
 // The alternative one is `SaveResponseToFile(file_name)`.
+// `SaveResponseToFile(file_name).SetParallelRanges(n)` downloads the body of a `GET` in up to `n` byte ranges
+// at once, over as many connections, should the server support the ranges. Only `HTTP(...)` of the POSIX
+// implementation downloads the ranges in parallel, the others download the body as one stream.
 
 struct KeepResponseInMemory {};
 
 struct SaveResponseToFile {
   std::string file_name;
+  size_t parallel_ranges = 1;
+  uint64_t min_range_bytes = 0;
+
   explicit SaveResponseToFile(const std::string& file_name) : file_name(file_name) {}
+
+  // The ranges are no shorter than `min_range_bytes`, for the small downloads to not be split.
+  SaveResponseToFile& SetParallelRanges(size_t ranges, uint64_t min_range_bytes = 1024 * 1024) {
+    parallel_ranges = ranges;
+    this->min_range_bytes = min_range_bytes;
+    return *this;
+  }
 };
 
 // Template metaprogramming for selecting the right types at compile time,
@@ -1,20 +1,180 @@
 #ifndef BRICKS_NET_API_URL_H
 #define BRICKS_NET_API_URL_H
 
-#include <algorithm>
+#include <cctype>
+#include <cstdint>
 #include <cstring>
 #include <string>
-#include <sstream>
-#include <vector>
 
 namespace bricks {
 namespace net {
 namespace api {
 
+// A part of a string, valid while the string is.
+struct URLSlice {
+  const char* data = nullptr;
+  size_t length = 0;
+
+  URLSlice() = default;
+  URLSlice(const char* data, size_t length) : data(data), length(length) {}
+
+  bool empty() const { return length == 0; }
+  std::string ToString() const { return std::string(data, length); }
+  bool operator==(const char* rhs) const {
+    return std::strlen(rhs) == length && !std::memcmp(data, rhs, length);
+  }
+};
+
+// The parts of "protocol://host:port/path?query#fragment", each possibly empty, found in one pass
+// over the URL, without copying it. The delimiters are not included. The host may be the Unix domain socket,
+// "protocol://unix:/path/to.sock:/path?query#fragment", the way nginx names them, with no port.
+struct URLSlices {
+  URLSlice protocol;
+  URLSlice host;
+  URLSlice port;
+  URLSlice path;
+  URLSlice query;
+  URLSlice fragment;
+  bool has_query = false;
+  bool has_fragment = false;
+
+  URLSlices(const char* url, size_t length) {
+    const char* const end = url + length;
+    const char* p = url;
+    while (p != end && (std::isalnum(static_cast<unsigned char>(*p)) || *p == '+' || *p == '-' || *p == '.')) {
+      ++p;
+    }
+    if (p != url && end - p >= 3 && p[0] == ':' && p[1] == '/' && p[2] == '/') {
+      protocol = URLSlice(url, p - url);
+      p += 3;
+    } else {
+      p = url;
+    }
+    if (end - p > 5 && !std::memcmp(p, "unix:", 5)) {
+      p = Scan(p + 5, end, ":", host);
+      host = URLSlice(host.data - 5, host.length + 5);
+      if (p != end) {
+        ++p;
+      }
+    } else {
+      p = Scan(p, end, ":/?#", host);
+      if (p != end && *p == ':') {
+        p = Scan(p + 1, end, "/?#", port);
+      }
+    }
+    if (p != end && *p == '/') {
+      p = Scan(p, end, "?#", path);
+    }
+    if (p != end && *p == '?') {
+      has_query = true;
+      p = Scan(p + 1, end, "#", query);
+    }
+    if (p != end) {
+      has_fragment = true;
+      fragment = URLSlice(p + 1, end - p - 1);
+    }
+  }
+
+  explicit URLSlices(const std::string& url) : URLSlices(url.data(), url.length()) {}
+  explicit URLSlices(const char* url) : URLSlices(url, std::strlen(url)) {}
+
+  // The decimal port at the beginning of `port`, or zero, as `atoi()` would.
+  int PortNumber() const {
+    int result = 0;
+    for (size_t i = 0; i < port.length && port.data[i] >= '0' && port.data[i] <= '9'; ++i) {
+      result = result * 10 + (port.data[i] - '0');
+    }
+    return result;
+  }
+
+ private:
+  // Sets `output` to the characters before the first one from `delimiters`, and returns where it is.
+  static const char* Scan(const char* begin, const char* end, const char* delimiters, URLSlice& output) {
+    const char* p = begin;
+    while (p != end && !std::strchr(delimiters, *p)) {
+      ++p;
+    }
+    output = URLSlice(begin, p - begin);
+    return p;
+  }
+};
+
+// Appends the percent-decoded `[begin, end)` to `output`, with '+' decoded as a space, as in the query strings.
+// The malformed escapes are kept as they are.
+inline void AppendURLDecoded(const char* begin, const char* end, std::string& output) {
+  const auto hex = [](char c) -> int {
+    if (c >= '0' && c <= '9') {
+      return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      return c - 'A' + 10;
+    } else {
+      return -1;
+    }
+  };
+  for (const char* p = begin; p != end; ++p) {
+    if (*p == '+') {
+      output += ' ';
+    } else if (*p == '%' && end - p >= 3 && hex(p[1]) >= 0 && hex(p[2]) >= 0) {
+      output += static_cast<char>(hex(p[1]) * 16 + hex(p[2]));
+      p += 2;
+    } else {
+      output += *p;
+    }
+  }
+}
+
+// Iterates over the "key=value" pairs of a query string, separated by '&' or ';', percent-decoding them
+// into the strings provided by the caller, which keep their capacity from one pair to the next.
+//
+//   URLQueryParameters parameters(url);
+//   std::string key, value;
+//   while (parameters.Next(key, value)) { ... }
+class URLQueryParameters final {
+ public:
+  explicit URLQueryParameters(const URLSlice& query) : p_(query.data), end_(query.data + query.length) {}
+  // Takes the query of the URL, the part after the '?' and before the '#', if there is one.
+  // The URL must outlive the iterator.
+  explicit URLQueryParameters(const std::string& url) : URLQueryParameters(URLSlices(url).query) {}
+
+  bool Next(std::string& key, std::string& value) {
+    while (p_ != end_) {
+      const char* begin = p_;
+      while (p_ != end_ && *p_ != '&' && *p_ != ';') {
+        ++p_;
+      }
+      const char* const pair_end = p_;
+      if (p_ != end_) {
+        ++p_;
+      }
+      if (begin == pair_end) {
+        continue;
+      }
+      const char* equals = begin;
+      while (equals != pair_end && *equals != '=') {
+        ++equals;
+      }
+      key.clear();
+      value.clear();
+      AppendURLDecoded(begin, equals, key);
+      if (equals != pair_end) {
+        AppendURLDecoded(equals + 1, pair_end, value);
+      }
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  const char* p_;
+  const char* end_;
+};
+
 // Initialize or inherit from URLParser to be able to call `ParseURL(url)` and use:
 //
-// * host (defaults to "localhost", never empty).
-// * path (defaults to "/", never empty).
+// * host (defaults to "localhost", never empty), or "unix:/path/to.sock" for the Unix domain socket.
+// * path (defaults to "/", never empty), with the query and the fragment, if any.
 // * protocol (defaults to "http", never empty).
 // * port (defaults to the default port for supported protocols).
 //
@@ -37,44 +197,40 @@ struct URLParser {
             const std::string& previous_protocol = kDefaultProtocol,
             const std::string& previous_host = "",
             const int previous_port = 0) {
-    protocol = "";  //"http";
-    size_t offset_past_protocol = 0;
-    const size_t i = url.find("://");
-    if (i != std::string::npos) {
-      protocol = url.substr(0, i);
-      offset_past_protocol = i + 3;
-    }
-
-    const size_t colon = url.find(':', offset_past_protocol);
-    const size_t slash = url.find('/', offset_past_protocol);
-    host = url.substr(offset_past_protocol, std::min(colon, slash) - offset_past_protocol);
-    if (host.empty()) {
+    const URLSlices slices(url);
+
+    if (!slices.host.empty()) {
+      host.assign(slices.host.data, slices.host.length);
+    } else {
       host = previous_host;
     }
 
-    if (colon < slash) {
-      port = atoi(url.c_str() + colon + 1);
+    if (slices.port.data) {
+      port = slices.PortNumber();
     } else {
       port = previous_port;
     }
 
-    if (slash != std::string::npos) {
-      path = url.substr(slash);
-    } else {
-      path = "";
+    if (!slices.path.empty()) {
+      path.assign(slices.path.data, slices.path.length);
     }
-    if (path.empty()) {
-      path = "/";
+    if (slices.has_query) {
+      path += '?';
+      path.append(slices.query.data, slices.query.length);
+    }
+    if (slices.has_fragment) {
+      path += '#';
+      path.append(slices.fragment.data, slices.fragment.length);
     }
 
-    if (protocol.empty()) {
-      if (!previous_protocol.empty()) {
-        protocol = previous_protocol;
-      } else {
-        protocol = DefaultProtocolForPort(port);
-        if (protocol.empty()) {
-          protocol = kDefaultProtocol;
-        }
+    if (!slices.protocol.empty()) {
+      protocol.assign(slices.protocol.data, slices.protocol.length);
+    } else if (!previous_protocol.empty()) {
+      protocol = previous_protocol;
+    } else {
+      protocol = DefaultProtocolForPort(port);
+      if (protocol.empty()) {
+        protocol = kDefaultProtocol;
       }
     }
 
@@ -87,24 +243,66 @@ struct URLParser {
       : URLParser(url, previous.protocol, previous.host, previous.port) {}
 
   std::string ComposeURL() const {
-    std::ostringstream os;
+    std::string result;
+    result.reserve(protocol.length() + host.length() + path.length() + 10);
     if (!protocol.empty()) {
-      os << protocol << "://";
+      result.append(protocol).append("://");
     }
-    os << host;
-    if (port != DefaultPortForProtocol(protocol)) {
-      os << ':' << port;
+    result.append(host);
+    if (IsUnixSocket()) {
+      result += ':';
+    } else if (port != DefaultPortForProtocol(protocol)) {
+      result += ':';
+      result.append(std::to_string(port));
     }
-    os << path;
-    return os.str();
+    result.append(path);
+    return result;
+  }
+
+  bool IsUnixSocket() const { return !host.compare(0, 5, "unix:"); }
+
+  // The `Host` of the requests, "localhost" for the Unix domain sockets, as nginx sends.
+  std::string HostHeader() const { return IsUnixSocket() ? "localhost" : host; }
+
+  // The parameters of the query part of the path.
+  URLQueryParameters QueryParameters() const { return URLQueryParameters(path); }
+
+  // The 64-bit FNV-1a hash of the URL, equal for the URLs with equal `ComposeURL()`, without composing it.
+  // Used to detect the redirect loops.
+  uint64_t Hash() const {
+    uint64_t hash = 14695981039346656037ull;
+    const auto combine = [&hash](const char* data, size_t length) {
+      for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+      }
+    };
+    combine(protocol.data(), protocol.length() + 1);
+    combine(host.data(), host.length() + 1);
+    const int hashed_port = (port != DefaultPortForProtocol(protocol)) ? port : 0;
+    combine(reinterpret_cast<const char*>(&hashed_port), sizeof(hashed_port));
+    combine(path.data(), path.length());
+    return hash;
   }
 
   static int DefaultPortForProtocol(const std::string& protocol) {
-    // We don't really support HTTPS/SSL or any other protocols yet -- D.K. :-)
-    return protocol == "http" ? 80 : 0;
+    if (protocol == "http") {
+      return 80;
+    } else if (protocol == "https") {
+      return 443;
+    } else {
+      return 0;
+    }
   }
 
-  static std::string DefaultProtocolForPort(int port) { return port == 80 ? "http" : ""; }
+  static std::string DefaultProtocolForPort(int port) {
+    if (port == 80) {
+      return "http";
+    } else if (port == 443) {
+      return "https";
+    } else {
+      return "";
+    }
+  }
 };
 
 }  // namespace api
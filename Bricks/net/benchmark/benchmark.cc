@@ -0,0 +1,338 @@
+// A load generator for the Bricks HTTP servers and clients.
+//
+// Runs the --server, unless it is "none", on --port, and loads it from --threads client threads
+// for --seconds seconds, then reports the requests per second and the latency percentiles.
+//
+// The servers are:
+//
+//   1) "connection": `HTTPServerConnection`-s on --server_threads threads, each accepting and serving
+//      one connection at a time, parsing the requests with `TemplatedHTTPReceivedMessage`.
+//   2) "event_loop": `HTTPServer`, with --server_threads loops.
+//   3) "none": an external server, listening on --host:--port.
+//
+// Both respond with a body of --response_body_size bytes, with `Content-Length`, or, for "connection"
+// with --chunked, with `Transfer-Encoding: chunked` in chunks of --chunk_size bytes.
+//
+// The clients are:
+//
+//   1) "raw": a `Connection` per thread, writing the request prepared beforehand and parsing the responses
+//      with `HTTPReceivedMessage`. With --keep_alive, the connection is reused for all the requests,
+//      otherwise each request asks for `Connection: close` and goes over a new connection.
+//   2) "api": `HTTP(GET(...))` or `HTTP(POST(...))` of `HTTPClientPOSIX`, which pools the connections
+//      regardless of --keep_alive.
+//
+// With a --request_body_size above zero, the requests are POST-s, their bodies sent with `Content-Length`,
+// or, for the "raw" client with --chunked, with `Transfer-Encoding: chunked`. Otherwise they are GET-s.
+//
+// The load is closed-loop by default: each thread sends the next request as soon as it has received
+// the response to the previous one. With --rps, it is open-loop instead: the threads send the requests
+// on a fixed schedule, --rps requests per second in total, and the latency is measured from the time
+// each request was scheduled to be sent, so that a server falling behind the schedule is not flattered
+// by the client waiting for it.
+
+/*
+
+# The Makefile builds with optimizations.
+make
+
+# Keep-alive vs. a new connection per request, against the blocking and the event loop servers.
+./build/benchmark --server=connection --threads=4 --server_threads=4
+./build/benchmark --server=connection --threads=4 --server_threads=4 --keep_alive=false
+./build/benchmark --server=event_loop --threads=16 --server_threads=2
+
+# Large chunked request and response bodies.
+./build/benchmark --server=connection --request_body_size=100000 --response_body_size=1000000 --chunked=true
+
+# The latency at a fixed rate, below the throughput measured above.
+./build/benchmark --server=event_loop --threads=8 --rps=20000
+
+# HTTPClientPOSIX against the event loop server.
+./build/benchmark --server=event_loop --client=api --threads=4
+
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../api/api.h"
+#include "../http/http.h"
+
+#include "../../dflags/dflags.h"
+#include "../../strings/printf.h"
+#include "../../time/tsc.h"
+
+DEFINE_string(server, "connection", "The server to run: \"connection\", \"event_loop\" or \"none\".");
+DEFINE_string(client, "raw", "The client to load the server with: \"raw\" or \"api\".");
+DEFINE_string(host, "localhost", "The host to send the requests to.");
+DEFINE_int32(port, 8080, "The port to run the server on, and to send the requests to.");
+DEFINE_int32(server_threads, 4, "The number of threads of the server.");
+DEFINE_int32(threads, 4, "The number of client threads.");
+DEFINE_double(seconds, 5.0, "The time to run the load for, in seconds.");
+DEFINE_double(rps, 0.0, "The total requests per second to send, open-loop, or zero to run closed-loop.");
+DEFINE_bool(keep_alive, true, "Whether the \"raw\" client sends all its requests over the same connection.");
+DEFINE_int32(request_body_size, 0, "The size of the request body in bytes, zero for the GET requests.");
+DEFINE_int32(response_body_size, 100, "The size of the response body in bytes.");
+DEFINE_bool(chunked, false, "Send the request and response bodies with `Transfer-Encoding: chunked`.");
+DEFINE_int32(chunk_size, 16 * 1024, "The size of the chunks of the chunked bodies, in bytes.");
+
+using bricks::net::ClientSocket;
+using bricks::net::Connection;
+using bricks::net::HTTPReceivedMessage;
+using bricks::net::HTTPRequest;
+using bricks::net::HTTPResponse;
+using bricks::net::HTTPServer;
+using bricks::net::HTTPServerConnection;
+using bricks::net::HTTPServerParameters;
+using bricks::net::Socket;
+using bricks::net::api::GET;
+using bricks::net::api::POST;
+using bricks::strings::Printf;
+
+inline uint64_t now_ns() {
+  return bricks::time::HighResolutionNowNanoseconds();
+}
+
+// The blocking server: each thread accepts a connection and serves it until the client closes it,
+// or until it has been idle for a second, as the connections `HTTPClientPOSIX` keeps in its pool would
+// otherwise keep the threads from returning to `Accept()` once the load is over.
+class ConnectionServer final {
+ public:
+  ConnectionServer(int port, size_t threads, const std::string& body)
+      : socket_(port, IdleTimeoutOptions()), body_(body) {
+    for (size_t i = 0; i < threads; ++i) {
+      threads_.emplace_back(&ConnectionServer::Serve, this);
+    }
+  }
+
+  ~ConnectionServer() {
+    stop_ = true;
+    // Wake up the threads blocked in `Accept()`: each sees `stop_` once its connection is closed.
+    for (size_t i = 0; i < threads_.size(); ++i) {
+      try {
+        ClientSocket("localhost", FLAGS_port);
+      } catch (const bricks::net::NetworkException&) {
+      }
+    }
+    for (std::thread& thread : threads_) {
+      thread.join();
+    }
+  }
+
+ private:
+  static bricks::net::SocketOptions IdleTimeoutOptions() {
+    bricks::net::SocketOptions options;
+    options.read_timeout_ms = 1000;
+    return options;
+  }
+
+  void Serve() {
+    while (!stop_) {
+      try {
+        HTTPServerConnection connection(socket_.Accept());
+        do {
+          if (FLAGS_chunked) {
+            const size_t chunk_size = static_cast<size_t>(FLAGS_chunk_size);
+            auto sender = connection.SendChunkedHTTPResponse();
+            for (size_t offset = 0; offset < body_.length(); offset += FLAGS_chunk_size) {
+              sender.Send(body_.data() + offset, std::min(body_.length() - offset, chunk_size));
+            }
+          } else {
+            connection.SendHTTPResponse(body_);
+          }
+        } while (connection.NextRequest());
+      } catch (const bricks::net::NetworkException&) {
+        // The client has closed the connection, or has sent nothing for a second.
+      }
+    }
+  }
+
+  Socket socket_;
+  const std::string body_;
+  std::atomic_bool stop_{false};
+  std::vector<std::thread> threads_;
+};
+
+std::string MakeRequestBody() {
+  return std::string(FLAGS_request_body_size, 'x');
+}
+
+// The request of the "raw" client, prepared once.
+std::string MakeRawRequest() {
+  const std::string body = MakeRequestBody();
+  std::string request = body.empty() ? "GET /benchmark HTTP/1.1\r\n" : "POST /benchmark HTTP/1.1\r\n";
+  request += "Host: " + FLAGS_host + "\r\n";
+  if (!FLAGS_keep_alive) {
+    request += "Connection: close\r\n";
+  }
+  if (body.empty()) {
+    request += "\r\n";
+  } else if (FLAGS_chunked) {
+    request += "Transfer-Encoding: chunked\r\n\r\n";
+    for (size_t offset = 0; offset < body.length(); offset += FLAGS_chunk_size) {
+      const size_t length = std::min(body.length() - offset, static_cast<size_t>(FLAGS_chunk_size));
+      request += Printf("%zx\r\n", length) + body.substr(offset, length) + "\r\n";
+    }
+    request += "0\r\n\r\n";
+  } else {
+    request += Printf("Content-Length: %zu\r\n\r\n", body.length()) + body;
+  }
+  return request;
+}
+
+struct ThreadResults {
+  std::vector<uint64_t> latencies_ns;
+  size_t errors = 0;
+  size_t response_bytes = 0;
+};
+
+// Sends the requests with `send_one()`, which returns the size of the response body, closed-loop
+// or on the open-loop schedule of the thread, until `end_ns`.
+template <typename F>
+void RunLoad(ThreadResults& results, size_t thread_index, uint64_t end_ns, F&& send_one) {
+  const double thread_rps = FLAGS_rps / FLAGS_threads;
+  const uint64_t interval_ns = thread_rps > 0 ? static_cast<uint64_t>(1e9 / thread_rps) : 0;
+  // Spread the schedules of the threads over the interval, not to have them send the requests at once.
+  uint64_t scheduled_ns = now_ns() + interval_ns * thread_index / FLAGS_threads;
+  while (true) {
+    uint64_t begin_ns = now_ns();
+    if (interval_ns) {
+      while (begin_ns < scheduled_ns) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(scheduled_ns - begin_ns));
+        begin_ns = now_ns();
+      }
+      begin_ns = scheduled_ns;
+      scheduled_ns += interval_ns;
+    }
+    if (begin_ns >= end_ns) {
+      break;
+    }
+    try {
+      results.response_bytes += send_one();
+      results.latencies_ns.push_back(now_ns() - begin_ns);
+    } catch (const std::exception&) {
+      ++results.errors;
+    }
+  }
+}
+
+void RunRawClient(ThreadResults& results, size_t thread_index, uint64_t end_ns) {
+  const std::string request = MakeRawRequest();
+  std::unique_ptr<Connection> connection;
+  std::vector<char> unparsed_bytes;
+  RunLoad(results, thread_index, end_ns, [&]() -> size_t {
+    if (!connection) {
+      connection.reset(new Connection(ClientSocket(FLAGS_host, FLAGS_port)));
+    }
+    try {
+      connection->BlockingWrite(request);
+      HTTPReceivedMessage message(*connection, std::move(unparsed_bytes));
+      unparsed_bytes.clear();
+      if (FLAGS_keep_alive) {
+        unparsed_bytes = message.UnparsedBytes();
+      } else {
+        connection.reset();
+      }
+      return message.BodyLength();
+    } catch (...) {
+      connection.reset();
+      unparsed_bytes.clear();
+      throw;
+    }
+  });
+}
+
+void RunAPIClient(ThreadResults& results, size_t thread_index, uint64_t end_ns) {
+  const std::string url = Printf("http://%s:%d/benchmark", FLAGS_host.c_str(), FLAGS_port);
+  const std::string body = MakeRequestBody();
+  RunLoad(results, thread_index, end_ns, [&]() -> size_t {
+    const auto response = body.empty() ? HTTP(GET(url)) : HTTP(POST(url, body, "text/plain"));
+    if (response.code != 200) {
+      throw bricks::net::HTTPException();
+    }
+    return response.body.length();
+  });
+}
+
+void Report(std::vector<ThreadResults>& results, double elapsed_s) {
+  std::vector<uint64_t> latencies;
+  size_t errors = 0;
+  size_t response_bytes = 0;
+  for (ThreadResults& thread : results) {
+    latencies.insert(latencies.end(), thread.latencies_ns.begin(), thread.latencies_ns.end());
+    errors += thread.errors;
+    response_bytes += thread.response_bytes;
+  }
+  printf("%zu requests, %zu errors in %.1f seconds: %.0f requests/s, %.1f MB/s of response bodies.\n",
+         latencies.size(),
+         errors,
+         elapsed_s,
+         latencies.size() / elapsed_s,
+         1e-6 * response_bytes / elapsed_s);
+  if (latencies.empty()) {
+    return;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  const auto percentile = [&latencies](double p) {
+    const size_t index = std::min(latencies.size() - 1, static_cast<size_t>(p * 0.01 * latencies.size()));
+    return 1e-3 * latencies[index];
+  };
+  printf("Latency, us: p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f.\n",
+         percentile(50),
+         percentile(90),
+         percentile(99),
+         percentile(99.9),
+         1e-3 * latencies.back());
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+
+  const std::string response_body(FLAGS_response_body_size, 'y');
+  std::unique_ptr<ConnectionServer> connection_server;
+  std::unique_ptr<HTTPServer> event_loop_server;
+  if (FLAGS_server == "connection") {
+    connection_server.reset(new ConnectionServer(FLAGS_port, FLAGS_server_threads, response_body));
+  } else if (FLAGS_server == "event_loop") {
+    HTTPServerParameters parameters;
+    parameters.threads = FLAGS_server_threads;
+    event_loop_server.reset(new HTTPServer(FLAGS_port,
+                                           [&response_body](const HTTPRequest&, HTTPResponse& response) {
+                                             response.body = response_body;
+                                           },
+                                           parameters));
+  } else if (FLAGS_server != "none") {
+    fprintf(stderr, "Unknown --server=%s.\n", FLAGS_server.c_str());
+    return 1;
+  }
+  if (FLAGS_client != "raw" && FLAGS_client != "api") {
+    fprintf(stderr, "Unknown --client=%s.\n", FLAGS_client.c_str());
+    return 1;
+  }
+
+  printf("--server=%s --client=%s --threads=%d, %s, %s, %d byte request bodies%s, %d byte responses.\n",
+         FLAGS_server.c_str(),
+         FLAGS_client.c_str(),
+         FLAGS_threads,
+         FLAGS_rps > 0 ? Printf("open-loop at %.0f requests/s", FLAGS_rps).c_str() : "closed-loop",
+         FLAGS_keep_alive ? "keep-alive" : "a connection per request",
+         FLAGS_request_body_size,
+         FLAGS_chunked ? ", chunked" : "",
+         FLAGS_response_body_size);
+
+  std::vector<ThreadResults> results(FLAGS_threads);
+  std::vector<std::thread> threads;
+  const uint64_t begin_ns = now_ns();
+  const uint64_t end_ns = begin_ns + static_cast<uint64_t>(FLAGS_seconds * 1e9);
+  for (int i = 0; i < FLAGS_threads; ++i) {
+    threads.emplace_back(FLAGS_client == "raw" ? RunRawClient : RunAPIClient, std::ref(results[i]), i, end_ns);
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  Report(results, 1e-9 * (now_ns() - begin_ns));
+}
@@ -22,18 +22,43 @@ struct SocketAcceptException : ServerSocketException {};
 
 struct ClientSocketException : SocketException {};
 struct SocketConnectException : ClientSocketException {};
+struct SocketConnectTimeoutException : SocketConnectException {};
 struct SocketResolveAddressException : ClientSocketException {};
 
 struct SocketFcntlException : SocketException {};
+struct SocketOptionException : SocketException {};
+struct IOUringException : SocketException {};
+struct TLSException : SocketException {};
+struct TLSHandshakeException : TLSException {};
+// TLS has been requested, and Bricks has been built without `BRICKS_NET_TLS`.
+struct TLSNotSupportedException : TLSException {};
+struct SocketEventLoopException : SocketException {};
 struct SocketReadException : SocketException {};
 struct SocketReadMultibyteRecordEndedPrematurelyException : SocketReadException {};
+struct SocketReadTimeoutException : SocketReadException {};
 struct SocketWriteException : SocketException {};
 struct SocketCouldNotWriteEverythingException : SocketWriteException {};
+struct SocketWriteTimeoutException : SocketWriteException {};
 
 struct HTTPException : NetworkException {};
 struct HTTPConnectionClosedByPeerException : HTTPException {};
 struct HTTPNoBodyProvidedException : HTTPException {};
+struct HTTPMalformedBodyException : HTTPException {};
 struct HTTPRedirectLoopException : HTTPException {};
+struct HTTPRouteInvalidPatternException : HTTPException {};
+struct HTTPRouteConflictException : HTTPException {};
+struct HTTP2Exception : HTTPException {};
+// The peer has violated HTTP/2 or HPACK, the connection can not be used any more.
+struct HTTP2ProtocolException : HTTP2Exception {};
+struct HPACKDecodingException : HTTP2ProtocolException {};
+// The connection has been closed, or has gone away, before the response of the stream has been received.
+struct HTTP2ConnectionClosedException : HTTP2Exception {};
+// The peer has reset the stream before its response has been received.
+struct HTTP2StreamResetException : HTTP2Exception {};
+
+// The request has been cancelled, by its deadline, or by the hedged attempt that has completed first,
+// see `net/api/impl/cancellation.h`. Not a `NetworkException`, as the connection is not to blame.
+struct HTTPRequestCancelledException : Exception {};
 
 }  // namespace net
 }  // namespace bricks
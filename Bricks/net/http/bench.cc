@@ -0,0 +1,73 @@
+// The benchmarks of the parts of the HTTP server that run on each request, run with `make bench`.
+//
+// The parsing of a typical browser request, fed into `HTTPRequestParser` at once and in pieces
+// of 100 bytes, and the lookup of the handler in `HTTPRouter` with a hundred routes registered.
+// See `benchmark.cc` for the header scanning of `HTTPReceivedMessage` on large requests.
+
+#include <algorithm>
+#include <string>
+
+#include "http.h"
+
+#include "../../benchmark/benchmark.h"
+#include "../../strings/printf.h"
+
+using bricks::benchmark::DoNotOptimize;
+using bricks::net::GenericHTTPRouter;
+using bricks::net::HTTPRequest;
+using bricks::net::HTTPRequestParser;
+using bricks::net::HTTPRouteParameters;
+using bricks::strings::Printf;
+
+namespace {
+
+const char* const kRequest =
+    "GET /users/12345/posts/678?format=json HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/40.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, sdch\r\n"
+    "Accept-Language: en-US,en;q=0.8\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+void ParseRequest(bricks::benchmark::State& state, size_t piece) {
+  const std::string request(kRequest);
+  HTTPRequestParser parser;
+  HTTPRequest parsed;
+  while (state.KeepRunning()) {
+    for (size_t offset = 0; offset < request.length(); offset += piece) {
+      parser.Feed(request.data() + offset, std::min(piece, request.length() - offset));
+    }
+    parser.Next(parsed);
+    DoNotOptimize(parsed);
+  }
+}
+
+}  // namespace
+
+BRICKS_BENCHMARK(ParseRequest) {
+  ParseRequest(state, std::string(kRequest).length());
+}
+
+BRICKS_BENCHMARK(ParseRequestIn100BytePieces) {
+  ParseRequest(state, 100);
+}
+
+BRICKS_BENCHMARK(RouteAmong100Patterns) {
+  GenericHTTPRouter<int> router;
+  for (int i = 0; i < 25; ++i) {
+    router.Register("GET", Printf("/resource%d", i), i);
+    router.Register("POST", Printf("/resource%d", i), i);
+    router.Register("GET", Printf("/resource%d/:id", i), i);
+    router.Register("GET", Printf("/resource%d/:id/items/:item", i), i);
+  }
+  const std::string url = "/resource17/12345/items/678?format=json";
+  HTTPRouteParameters parameters;
+  while (state.KeepRunning()) {
+    DoNotOptimize(router.Find("GET", url, parameters));
+  }
+}
+
+BRICKS_BENCHMARK_MAIN();
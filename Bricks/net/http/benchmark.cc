@@ -0,0 +1,211 @@
+// A benchmark for the parsing of HTTP request headers.
+//
+// Parses a request with --headers headers of --header_value_length bytes each, received in pieces
+// of --read_size bytes, for --seconds seconds per parser, and reports the requests and MB parsed per second:
+//
+//   1) "strstr": the line and header scanning as it was done before `impl/scan.h`, which NUL-terminates
+//      the received data and looks for the next CRLF with `strstr()` from the beginning of the line
+//      after each read.
+//   2) "scan": the same loop with `scan::FindCRLF()` and `scan::FindChar()`, resuming where the previous
+//      read left off, and matching the known headers case-insensitively.
+//   3) "message": `HTTPReceivedMessage` itself, reading the requests back to back from a socket pair.
+//   4) "views": same with `HTTPHeaderViewReceivedMessage`, which allocates no strings for the headers.
+//
+// The first two run on the request in memory, to measure the scanning alone.
+
+/*
+
+# The Makefile builds without optimizations, build the benchmark with them.
+g++ -std=c++11 -O3 -o build/benchmark benchmark.cc -pthread
+
+# Typical browser requests vs. large header blocks.
+./build/benchmark --headers=10 --header_value_length=40
+./build/benchmark --headers=100 --header_value_length=1000
+
+# The rescanning of long lines received in small pieces.
+./build/benchmark --headers=4 --header_value_length=16000 --read_size=100
+
+*/
+
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "http.h"
+
+#include "../../dflags/dflags.h"
+#include "../../strings/printf.h"
+#include "../../time/tsc.h"
+
+DEFINE_int32(headers, 20, "The number of headers in the request.");
+DEFINE_int32(header_value_length, 100, "The length of the value of each header, in bytes.");
+DEFINE_int32(read_size, 0, "The size of the pieces in which the request is received, zero for all at once.");
+DEFINE_double(seconds, 1.0, "The time to run each parser for, in seconds.");
+
+using bricks::net::Connection;
+using bricks::net::HTTPReceivedMessage;
+using bricks::net::HTTPHeaderViewReceivedMessage;
+using bricks::net::SocketHandle;
+using bricks::strings::Printf;
+
+double time_s() {
+  return 1e-9 * static_cast<double>(bricks::time::HighResolutionNowNanoseconds());
+}
+
+std::string MakeRequest() {
+  std::string request = "POST /benchmark HTTP/1.1\r\nHost: localhost\r\n";
+  for (int i = 0; i < FLAGS_headers; ++i) {
+    request += Printf("X-Header-%d: ", i) + std::string(FLAGS_header_value_length, 'a' + i % 26) + "\r\n";
+  }
+  request += "Content-Length: 4\r\n\r\nBODY";
+  return request;
+}
+
+// Scans the header block of `buffer`, which has room for the extra '\0', as it is received in pieces
+// of `read_size` bytes from the beginning. Returns the number of headers, to not have it optimized away.
+struct StrstrScanner {
+  static size_t Scan(char* buffer, size_t length, size_t read_size) {
+    size_t headers = 0;
+    size_t current_line_offset = 0;
+    size_t body_length = 0;
+    for (size_t offset = 0; offset < length;) {
+      offset = std::min(offset + read_size, length);
+      const char next = buffer[offset];
+      buffer[offset] = '\0';
+      char* next_crlf_ptr;
+      while ((next_crlf_ptr = strstr(&buffer[current_line_offset], "\r\n"))) {
+        *next_crlf_ptr = '\0';
+        char* p = strstr(&buffer[current_line_offset], ": ");
+        if (p) {
+          *p = '\0';
+          if (!strcmp(&buffer[current_line_offset], "Content-Length")) {
+            body_length = static_cast<size_t>(atoi(p + 2));
+          }
+          ++headers;
+        }
+        current_line_offset = next_crlf_ptr + 2 - buffer;
+      }
+      buffer[offset] = next;
+    }
+    return headers + body_length;
+  }
+};
+
+struct VectorizedScanner {
+  static size_t Scan(char* buffer, size_t length, size_t read_size) {
+    using namespace bricks::net::scan;
+    size_t headers = 0;
+    size_t current_line_offset = 0;
+    size_t crlf_scan_offset = 0;
+    size_t body_length = 0;
+    for (size_t offset = 0; offset < length;) {
+      offset = std::min(offset + read_size, length);
+      while (true) {
+        const size_t scan_from = std::max(current_line_offset, crlf_scan_offset);
+        char* const next_crlf_ptr = FindCRLF(buffer + scan_from, buffer + offset);
+        if (!next_crlf_ptr) {
+          crlf_scan_offset = std::max(scan_from, offset - 1);
+          break;
+        }
+        char* const line = buffer + current_line_offset;
+        char* p = FindChar(line, next_crlf_ptr, ':');
+        if (p) {
+          if (EqualsIgnoreCase(line, p - line, "Content-Length")) {
+            *next_crlf_ptr = '\0';
+            body_length = static_cast<size_t>(atoi(p + 1));
+          }
+          ++headers;
+        }
+        current_line_offset = next_crlf_ptr + 2 - buffer;
+      }
+    }
+    return headers + body_length;
+  }
+};
+
+template <typename T_SCANNER>
+void RunScanner(const char* name, const std::string& request, size_t read_size) {
+  std::vector<char> buffer(request.length() + 1);
+  size_t iterations = 0;
+  size_t checksum = 0;
+  const double begin = time_s();
+  double end;
+  do {
+    for (int i = 0; i < 100; ++i) {
+      std::copy(request.begin(), request.end(), buffer.begin());
+      checksum += T_SCANNER::Scan(&buffer[0], request.length(), read_size);
+      ++iterations;
+    }
+    end = time_s();
+  } while (end - begin < FLAGS_seconds);
+  const double elapsed = end - begin;
+  printf("%-8s %10.0f requests/s %8.1f MB/s (%zu headers)\n",
+         name,
+         iterations / elapsed,
+         1e-6 * iterations * request.length() / elapsed,
+         checksum / iterations - 4);
+}
+
+template <typename T_MESSAGE>
+void RunMessage(const char* name, const std::string& request, size_t read_size) {
+  int fds[2];
+  if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+    fprintf(stderr, "socketpair() failed.\n");
+    return;
+  }
+  std::atomic_bool writing(true);
+  // Writes until the reading end is closed.
+  std::thread writer([&request, read_size, &writing](int fd) {
+    while (writing) {
+      for (size_t offset = 0; offset < request.length() && writing; offset += read_size) {
+        const size_t length = std::min(read_size, request.length() - offset);
+        if (::send(fd, request.data() + offset, length, MSG_NOSIGNAL) != static_cast<ssize_t>(length)) {
+          writing = false;
+        }
+      }
+    }
+    ::close(fd);
+  }, fds[1]);
+  size_t iterations = 0;
+  size_t body_bytes = 0;
+  double elapsed;
+  {
+    Connection connection((SocketHandle(SocketHandle::FromHandle(fds[0]))));
+    std::vector<char> unparsed_bytes;
+    const double begin = time_s();
+    do {
+      T_MESSAGE message(connection, std::move(unparsed_bytes));
+      body_bytes += message.BodyLength();
+      unparsed_bytes = message.UnparsedBytes();
+      ++iterations;
+    } while ((iterations % 100) || time_s() - begin < FLAGS_seconds);
+    elapsed = time_s() - begin;
+    writing = false;
+  }
+  writer.join();
+  printf("%-8s %10.0f requests/s %8.1f MB/s (%zu body bytes)\n",
+         name,
+         iterations / elapsed,
+         1e-6 * iterations * request.length() / elapsed,
+         body_bytes / iterations);
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  const std::string request = MakeRequest();
+  const size_t read_size = FLAGS_read_size > 0 ? static_cast<size_t>(FLAGS_read_size) : request.length();
+  printf("%zu bytes, %d headers, read in pieces of %zu bytes.\n",
+         request.length(),
+         FLAGS_headers + 2,
+         read_size);
+  RunScanner<StrstrScanner>("strstr", request, read_size);
+  RunScanner<VectorizedScanner>("scan", request, read_size);
+  RunMessage<HTTPReceivedMessage>("message", request, read_size);
+  RunMessage<HTTPHeaderViewReceivedMessage>("views", request, read_size);
+}
@@ -5,6 +5,7 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 namespace bricks {
 namespace net {
@@ -104,6 +105,35 @@ class HTTPResponseCodeAsStringGenerator {
       return "Unknown Code";
     }
   }
+
+  // The status line of the response, such as "HTTP/1.1 200 OK\r\n", formatted once per code.
+  static inline const std::string& StatusLine(HTTPResponseCode code) {
+    static const std::vector<std::string> lines = FormatStatusLines();
+    const int index = static_cast<int>(code) - kMinStatusCode;
+    if (index >= 0 && index < static_cast<int>(lines.size())) {
+      return lines[index];
+    } else {
+      // Not a three-digit code, hence not precomputed.
+      static thread_local std::string line;
+      line = FormatStatusLine(code);
+      return line;
+    }
+  }
+
+ private:
+  enum { kMinStatusCode = 100, kMaxStatusCode = 999 };
+
+  static inline std::string FormatStatusLine(HTTPResponseCode code) {
+    return "HTTP/1.1 " + std::to_string(static_cast<int>(code)) + ' ' + CodeAsString(code) + "\r\n";
+  }
+
+  static inline std::vector<std::string> FormatStatusLines() {
+    std::vector<std::string> lines;
+    for (int code = kMinStatusCode; code <= kMaxStatusCode; ++code) {
+      lines.push_back(FormatStatusLine(static_cast<HTTPResponseCode>(code)));
+    }
+    return lines;
+  }
 };
 
 }  // namespace net
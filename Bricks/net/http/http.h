@@ -9,4 +9,15 @@
 #error "No implementation for `net/http.h` is available for your system."
 #endif
 
+#if defined(BRICKS_POSIX) || defined(BRICKS_APPLE)
+#include "impl/event_loop_server.h"
+#include "impl/fiber_server.h"
+#include "impl/router.h"
+#include "impl/compression.h"
+#include "impl/response_cache.h"
+#include "impl/multipart.h"
+#include "impl/profile.h"
+#include "impl/event_stream.h"
+#endif
+
 #endif  // BRICKS_NET_HTTP_HTTP_H
@@ -0,0 +1,387 @@
+// Compression of the HTTP responses, negotiated with the `Accept-Encoding` header of the request.
+//
+// The bodies are compressed with gzip or deflate, whichever the client prefers, and are sent with
+// the `Content-Encoding` header, and with `Vary: Accept-Encoding` for the caches. The bodies of the content
+// types that are compressed already, such as images or archives, the bodies shorter than
+// `kHTTPCompressionMinBodyLength`, and the responses that have a `Content-Encoding` set are sent as they are.
+//
+// * `SendCompressedHTTPResponse()` is `SendHTTPResponse()` of `HTTPServerConnection` with the compression.
+// * `SendCompressedChunkedHTTPResponse()` returns `CompressedChunkedResponseSender`, which compresses the body
+//   as it is produced, with no more than a window of it in memory, and flushes the compressor on `Flush()`,
+//   so that what has been sent so far can be decompressed by the client right away.
+// * `CompressedHTTPRouteHandler()` wraps a route of `HTTPRouter`, for `HTTPServer`, with the compression level
+//   of that route, given that the routes differ in how large and how compressible their responses are.
+//
+// The compression level is that of zlib, from 1, the fastest, to 9, the smallest, with 0 for no compression.
+// `deflate` is the zlib format, as RFC 7230 defines it. Requires linking against zlib, `-lz`.
+
+#ifndef BRICKS_NET_HTTP_IMPL_COMPRESSION_H
+#define BRICKS_NET_HTTP_IMPL_COMPRESSION_H
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+
+#include <strings.h>
+#include <zlib.h>
+
+#include "event_loop_server.h"
+#include "router.h"
+#include "server.h"
+
+#include "../codes.h"
+
+namespace bricks {
+namespace net {
+
+const int kHTTPDefaultCompressionLevel = 6;
+const size_t kHTTPCompressionMinBodyLength = 256;
+const char* const kAcceptEncodingHeaderKey = "Accept-Encoding";
+const char* const kContentEncodingHeaderKey = "Content-Encoding";
+
+enum class HTTPContentEncoding { Identity, Gzip, Deflate };
+
+inline const char* HTTPContentEncodingName(HTTPContentEncoding encoding) {
+  return encoding == HTTPContentEncoding::Gzip ? "gzip" : encoding == HTTPContentEncoding::Deflate ? "deflate"
+                                                                                                   : "identity";
+}
+
+// Picks the encoding to respond with from the value of the `Accept-Encoding` header:
+// the one of gzip and deflate with the highest `q`, gzip if they are equal, and identity if neither
+// is acceptable. `*` stands for those not listed, and `q=0` excludes the encoding.
+inline HTTPContentEncoding NegotiateHTTPContentEncoding(const std::string& accept_encoding) {
+  double gzip = -1.0;
+  double deflate = -1.0;
+  double any = -1.0;
+  size_t begin = 0;
+  while (begin < accept_encoding.length()) {
+    const size_t end = std::min(accept_encoding.find(',', begin), accept_encoding.length());
+    const std::string item = accept_encoding.substr(begin, end - begin);
+    begin = end + 1;
+    const size_t semicolon = std::min(item.find(';'), item.length());
+    const size_t first = item.find_first_not_of(" \t");
+    if (first >= semicolon) {
+      continue;
+    }
+    const size_t last = item.find_last_not_of(" \t", semicolon - 1);
+    const std::string coding = item.substr(first, last - first + 1);
+    double q = 1.0;
+    const size_t q_position = item.find("q=", semicolon);
+    if (q_position != std::string::npos) {
+      q = std::strtod(item.c_str() + q_position + 2, nullptr);
+    }
+    if (!strcasecmp(coding.c_str(), "gzip") || !strcasecmp(coding.c_str(), "x-gzip")) {
+      gzip = q;
+    } else if (!strcasecmp(coding.c_str(), "deflate")) {
+      deflate = q;
+    } else if (coding == "*") {
+      any = q;
+    }
+  }
+  if (gzip < 0.0) {
+    gzip = any;
+  }
+  if (deflate < 0.0) {
+    deflate = any;
+  }
+  if (gzip > 0.0 && gzip >= deflate) {
+    return HTTPContentEncoding::Gzip;
+  } else if (deflate > 0.0) {
+    return HTTPContentEncoding::Deflate;
+  } else {
+    return HTTPContentEncoding::Identity;
+  }
+}
+
+// Whether the body of the content type is worth compressing: all but the formats that are compressed already.
+inline bool IsHTTPContentTypeCompressible(const std::string& content_type) {
+  std::string type = content_type.substr(0, content_type.find(';'));
+  type.erase(type.find_last_not_of(" \t") + 1);
+  std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+  if (type == "image/svg+xml") {
+    return true;
+  }
+  for (const char* prefix : {"image/", "video/", "audio/", "font/woff"}) {
+    if (!type.compare(0, strlen(prefix), prefix)) {
+      return false;
+    }
+  }
+  for (const char* compressed : {"application/gzip",
+                                 "application/x-gzip",
+                                 "application/zip",
+                                 "application/zstd",
+                                 "application/x-bzip2",
+                                 "application/x-xz",
+                                 "application/x-7z-compressed",
+                                 "application/x-rar-compressed",
+                                 "application/pdf"}) {
+    if (type == compressed) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The streaming compressor of the body. Appends the compressed bytes to the `output` of each call.
+// Not thread safe, and not movable, as zlib keeps a pointer to its stream.
+class HTTPBodyCompressor final {
+ public:
+  HTTPBodyCompressor(HTTPContentEncoding encoding, int level) {
+    std::memset(&stream_, 0, sizeof(stream_));
+    // 16 over the window bits of 15 selects the gzip wrapper, the zlib one is the default.
+    const int window_bits = (encoding == HTTPContentEncoding::Gzip) ? 15 + 16 : 15;
+    const int clamped_level = std::max(0, std::min(level, 9));
+    if (::deflateInit2(&stream_, clamped_level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      throw std::bad_alloc();
+    }
+  }
+
+  ~HTTPBodyCompressor() { ::deflateEnd(&stream_); }
+
+  inline void Compress(const char* data, size_t length, std::string& output) {
+    Deflate(data, length, Z_NO_FLUSH, output);
+  }
+
+  // Outputs all the compressed data so far, ending on a byte boundary, for the client to decompress it.
+  inline void Flush(std::string& output) { Deflate(nullptr, 0, Z_SYNC_FLUSH, output); }
+
+  // Outputs the rest of the compressed data and the trailer. No more data can be compressed after it.
+  inline void Finish(std::string& output) { Deflate(nullptr, 0, Z_FINISH, output); }
+
+ private:
+  inline void Deflate(const char* data, size_t length, int flush, std::string& output) {
+    char buffer[16 * 1024];
+    do {
+      // `avail_in` is `unsigned`, compress large inputs piece by piece.
+      const size_t piece = std::min(length, static_cast<size_t>(1u << 30));
+      stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+      stream_.avail_in = static_cast<uInt>(piece);
+      data += piece;
+      length -= piece;
+      const int piece_flush = length ? Z_NO_FLUSH : flush;
+      do {
+        stream_.next_out = reinterpret_cast<Bytef*>(buffer);
+        stream_.avail_out = sizeof(buffer);
+        ::deflate(&stream_, piece_flush);
+        output.append(buffer, sizeof(buffer) - stream_.avail_out);
+      } while (!stream_.avail_out);
+    } while (length);
+  }
+
+  z_stream stream_;
+
+  HTTPBodyCompressor(const HTTPBodyCompressor&) = delete;
+  void operator=(const HTTPBodyCompressor&) = delete;
+};
+
+inline std::string CompressHTTPBody(const char* data, size_t length, HTTPContentEncoding encoding, int level) {
+  std::string output;
+  HTTPBodyCompressor compressor(encoding, level);
+  compressor.Compress(data, length, output);
+  compressor.Finish(output);
+  return output;
+}
+
+namespace impl {
+
+inline bool HasHTTPHeader(const HTTPHeadersType& headers, const char* name) {
+  for (const auto& header : headers) {
+    if (!strcasecmp(header.first.c_str(), name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+inline std::string FindHTTPHeader(const std::map<std::string, std::string>& headers, const char* name) {
+  for (const auto& header : headers) {
+    if (!strcasecmp(header.first.c_str(), name)) {
+      return header.second;
+    }
+  }
+  return std::string();
+}
+
+inline std::string AcceptEncoding(const HTTPDefaultHelper& message) {
+  return FindHTTPHeader(message.headers(), kAcceptEncodingHeaderKey);
+}
+
+inline std::string AcceptEncoding(const HTTPHeaderViewHelper& message) {
+  HTTPHeaderViewHelper::Slice value;
+  return message.FindHeader(kAcceptEncodingHeaderKey, value) ? value.ToString() : std::string();
+}
+
+// The encoding to respond with, and, unless it is identity, the headers to add for it.
+inline HTTPContentEncoding NegotiateResponseEncoding(const std::string& accept_encoding,
+                                                     HTTPResponseCode code,
+                                                     const std::string& content_type,
+                                                     size_t length,
+                                                     int level,
+                                                     HTTPHeadersType& headers) {
+  if (!level || length < kHTTPCompressionMinBodyLength || code == HTTPResponseCode::NoContent ||
+      code == HTTPResponseCode::NotModified || !IsHTTPContentTypeCompressible(content_type) ||
+      HasHTTPHeader(headers, kContentEncodingHeaderKey)) {
+    return HTTPContentEncoding::Identity;
+  }
+  const HTTPContentEncoding encoding = NegotiateHTTPContentEncoding(accept_encoding);
+  if (encoding != HTTPContentEncoding::Identity) {
+    headers.emplace_back(kContentEncodingHeaderKey, HTTPContentEncodingName(encoding));
+    headers.emplace_back("Vary", kAcceptEncodingHeaderKey);
+  }
+  return encoding;
+}
+
+}  // namespace impl
+
+// Responds with the body compressed as negotiated with the client, see the header comment.
+template <class HELPER>
+inline void SendCompressedHTTPResponse(
+    TemplatedHTTPServerConnection<HELPER>& connection,
+    const std::string& body,
+    HTTPResponseCode code = HTTPResponseCode::OK,
+    const std::string& content_type = HTTPServerConnection::DefaultContentType(),
+    const HTTPHeadersType& extra_headers = HTTPHeadersType(),
+    int level = kHTTPDefaultCompressionLevel) {
+  HTTPHeadersType headers(extra_headers);
+  const HTTPContentEncoding encoding = impl::NegotiateResponseEncoding(
+      impl::AcceptEncoding(connection.Message()), code, content_type, body.length(), level, headers);
+  if (encoding == HTTPContentEncoding::Identity) {
+    connection.SendHTTPResponse(body, code, content_type, extra_headers);
+  } else {
+    connection.SendHTTPResponse(
+        CompressHTTPBody(body.data(), body.length(), encoding, level), code, content_type, headers);
+  }
+}
+
+// `ChunkedResponseSender` with the body compressed as negotiated with the client, if it was.
+// Obtained from `SendCompressedChunkedHTTPResponse()`. The compressor holds on to the data until it has
+// a block to output, `Flush()` also flushes the compressor, at the cost of a few bytes, for the client
+// to get all that has been sent so far.
+class CompressedChunkedResponseSender final {
+ public:
+  CompressedChunkedResponseSender(ChunkedResponseSender&& sender, HTTPContentEncoding encoding, int level)
+      : sender_(std::move(sender)),
+        compressor_(encoding == HTTPContentEncoding::Identity ? nullptr
+                                                              : new HTTPBodyCompressor(encoding, level)) {}
+
+  CompressedChunkedResponseSender(CompressedChunkedResponseSender&& rhs)
+      : sender_(std::move(rhs.sender_)),
+        compressor_(std::move(rhs.compressor_)),
+        finished_(rhs.finished_),
+        output_(std::move(rhs.output_)) {
+    rhs.finished_ = true;
+  }
+
+  ~CompressedChunkedResponseSender() {
+    try {
+      Finish();
+    } catch (const Exception&) {
+      // The peer has gone away, and there is no one to report it to.
+    }
+  }
+
+  // Whether the body is being compressed.
+  inline bool Compressed() const { return compressor_ != nullptr; }
+
+  inline void Send(const char* data, size_t length) {
+    if (!compressor_) {
+      sender_.Send(data, length);
+    } else {
+      output_.clear();
+      compressor_->Compress(data, length, output_);
+      sender_.Send(output_);
+    }
+  }
+
+  inline void Send(const std::string& data) { Send(data.data(), data.length()); }
+
+  inline void Flush() {
+    if (compressor_ && !finished_) {
+      output_.clear();
+      compressor_->Flush(output_);
+      sender_.Send(output_);
+    }
+    sender_.Flush();
+  }
+
+  // Sends the rest of the compressed body, and the last chunk. Does nothing if finished already.
+  inline void Finish() {
+    if (!finished_) {
+      finished_ = true;
+      if (compressor_) {
+        output_.clear();
+        compressor_->Finish(output_);
+        sender_.Send(output_);
+      }
+      sender_.Finish();
+    }
+  }
+
+ private:
+  ChunkedResponseSender sender_;
+  std::unique_ptr<HTTPBodyCompressor> compressor_;
+  bool finished_ = false;
+  std::string output_;  // The compressed bytes to send, reused.
+
+  CompressedChunkedResponseSender(const CompressedChunkedResponseSender&) = delete;
+  void operator=(const CompressedChunkedResponseSender&) = delete;
+  void operator=(CompressedChunkedResponseSender&&) = delete;
+};
+
+// Sends the headers of the response, with `Content-Encoding` if the body is to be compressed,
+// and returns the sender of the body. The length of the body is not known upfront,
+// thus it is compressed regardless of `kHTTPCompressionMinBodyLength`.
+template <class HELPER>
+inline CompressedChunkedResponseSender SendCompressedChunkedHTTPResponse(
+    TemplatedHTTPServerConnection<HELPER>& connection,
+    HTTPResponseCode code = HTTPResponseCode::OK,
+    const std::string& content_type = HTTPServerConnection::DefaultContentType(),
+    const HTTPHeadersType& extra_headers = HTTPHeadersType(),
+    int level = kHTTPDefaultCompressionLevel,
+    size_t max_buffer_size = kDefaultChunkedResponseBufferSize,
+    uint64_t flush_interval_ms = kDefaultChunkedResponseFlushIntervalMs) {
+  HTTPHeadersType headers(extra_headers);
+  const HTTPContentEncoding encoding = impl::NegotiateResponseEncoding(
+      impl::AcceptEncoding(connection.Message()), code, content_type, kHTTPCompressionMinBodyLength, level,
+      headers);
+  return CompressedChunkedResponseSender(
+      connection.SendChunkedHTTPResponse(code, content_type, headers, max_buffer_size, flush_interval_ms),
+      encoding,
+      level);
+}
+
+// Compresses the body of the response of `HTTPServer` in place, as negotiated with the client.
+inline void CompressHTTPResponse(const HTTPRequest& request,
+                                 HTTPResponse& response,
+                                 int level = kHTTPDefaultCompressionLevel) {
+  const HTTPContentEncoding encoding =
+      impl::NegotiateResponseEncoding(impl::FindHTTPHeader(request.headers, kAcceptEncodingHeaderKey),
+                                      response.code,
+                                      response.content_type,
+                                      response.body.length(),
+                                      level,
+                                      response.extra_headers);
+  if (encoding != HTTPContentEncoding::Identity) {
+    response.body = CompressHTTPBody(response.body.data(), response.body.length(), encoding, level);
+  }
+}
+
+// The route handler for `HTTPRouter` that runs `handler` and compresses its response with `level`.
+inline HTTPRouteHandler CompressedHTTPRouteHandler(HTTPRouteHandler handler,
+                                                   int level = kHTTPDefaultCompressionLevel) {
+  return [handler, level](
+      const HTTPRequest& request, const HTTPRouteParameters& parameters, HTTPResponse& response) {
+    handler(request, parameters, response);
+    CompressHTTPResponse(request, response, level);
+  };
+}
+
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_HTTP_IMPL_COMPRESSION_H
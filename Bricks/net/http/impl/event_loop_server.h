@@ -0,0 +1,843 @@
+// Event loop HTTP server: serves many concurrent connections from a few threads.
+//
+// `HTTPServerConnection` blocks its thread until the whole request has been read, so one slow client
+// holds up the server. `HTTPServer` instead puts the sockets into non-blocking mode and runs `threads` reactor
+// loops on epoll (Linux) or kqueue (macOS and BSD). Each loop accepts connections from the shared listening
+// socket, owns them from then on, and feeds the bytes read from them into per-connection `HTTPRequestParser`-s.
+// Complete requests are dispatched to the handler, and the responses are written out as the sockets allow.
+//
+// With `reuse_port`, each loop listens on a socket of its own instead, bound to the same port with
+// `SO_REUSEPORT`, and the kernel spreads the incoming connections across them: no loop contends with
+// the others for the accepts. The threads of the loops can also be pinned to CPUs, one per CPU.
+//
+// Connections are persistent unless the client asks otherwise, and pipelined requests are answered in order.
+// A connection with no traffic for `idle_timeout_ms`, even if stuck in the middle of a request, is closed.
+// The idle timeouts are the timers of the `bricks::time::TimerWheel` of the loop, one per connection.
+//
+// The handler runs on the thread of the loop that owns the connection: it should be thread safe
+// when `threads` is above one, and it should not block, as the other connections of the loop wait for it.
+// The handler throwing an exception results in a "500 Internal Server Error" response.
+//
+// The handlers that may block, such as the ones waiting for FSQ to accept a message, run on a pool instead,
+// with `handler_threads`: the loops only parse the requests and send the responses, and hand each request
+// over to a `bricks::Executor` of that many work-stealing threads. A connection has one request at a time
+// on the pool, and reads no more of its requests meanwhile, thus its responses are in order. The pool is
+// bounded: once `max_queued_requests` are on it, the loops stop reading the requests from the sockets,
+// for the clients to feel the backpressure, and resume as the handlers catch up. The handlers about to block
+// for long should say so with `bricks::Executor::ScopedBlocking`, for the pool to run another thread meanwhile.
+//
+// With `load_shedding_target_ms`, the server sheds the load it can not keep up with instead of queueing it
+// until every request is late: the time each request has waited in the loop, from the poller reporting its
+// bytes to the handler being called, drives an `HTTPLoadShedder`, and the requests it sheds are responded to
+// right away, with no handler call, by the prebuilt bytes of "503 Service Unavailable" with `Retry-After`.
+// The clients of `net/api` report `Retry-After`, and `fsq::processor::HTTPUploader` holds its queues off
+// for that long, see `HoldOffOn()` there. A request with `Expect: 100-continue` is sent "100 Continue" once
+// its headers are in, or, should it be shed, the 503 right then, before the client has sent the body.
+//
+// With `access_log`, the server passes the fixed-size `HTTPAccessLogRecord` of each request handled, or of one
+// out of every `access_log_sample_every` of them, to the callback, on the thread that has handled the request.
+// The callback should only hand the record over to be written out elsewhere, such as by `fsq::HTTPAccessLog`,
+// for the latency of the requests to include no logging I/O.
+
+#ifndef BRICKS_NET_HTTP_IMPL_EVENT_LOOP_SERVER_H
+#define BRICKS_NET_HTTP_IMPL_EVENT_LOOP_SERVER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#include "request_parser.h"
+#include "server.h"
+
+#include "../codes.h"
+
+#include "../../exceptions.h"
+
+#include "../../tcp/tcp.h"
+#include "../../tcp/impl/event_poller.h"
+
+#include "../../../executor/executor.h"
+#include "../../../metrics/metrics.h"
+#include "../../../time/timer_wheel.h"
+
+namespace bricks {
+namespace net {
+
+const uint64_t kHTTPServerDefaultIdleTimeoutMs = 60 * 1000;
+// The granularity of the idle timeouts.
+const uint64_t kHTTPServerTimerTickMs = 10;
+// Stop reading more requests from the connection while this many bytes of responses are waiting to be sent.
+const size_t kHTTPServerMaxPendingOutputSize = 1024 * 1024;
+const uint64_t kHTTPServerDefaultLoadSheddingIntervalMs = 100;
+const uint64_t kHTTPServerDefaultRetryAfterSeconds = 1;
+const size_t kHTTPServerDefaultMaxQueuedRequests = 1024;
+
+// The record of a request handled by `HTTPServer`, see `HTTPServerParameters::access_log`. Trivially copyable,
+// to be queued and written out as is. The method and the path, with no query, are truncated to fit,
+// and are zero-terminated unless they fill their arrays.
+struct HTTPAccessLogRecord {
+  // Unique per server: the index of the thread of the loop in the top byte, its number of requests below.
+  uint64_t request_id;
+  // The wall time the response has been made at, in microseconds since the epoch.
+  uint64_t timestamp_us;
+  // From the poller reporting the bytes of the request to the handler being called, then the handler itself.
+  uint32_t queueing_us;
+  uint32_t handler_us;
+  // The body of the request, and the whole response, headers included.
+  uint32_t request_bytes;
+  uint32_t response_bytes;
+  uint16_t status;
+  char method[8];
+  char path[64];
+};
+
+struct HTTPServerParameters {
+  size_t threads = 1;
+  uint64_t idle_timeout_ms = kHTTPServerDefaultIdleTimeoutMs;
+  // One `SO_REUSEPORT` listening socket per thread of the server, instead of one shared by all of them.
+  bool reuse_port = false;
+  // Pin the i-th thread to the `(first_cpu + i) % hardware_concurrency`-th CPU, on Linux.
+  bool pin_threads_to_cpus = false;
+  size_t first_cpu = 0;
+  // The options of the listening sockets and the accepted connections.
+  SocketOptions socket_options;
+  // Listen on this Unix domain socket instead of the port, shared by all the threads, see `UnixSocketPath`.
+  std::string unix_socket_path;
+  // Shed the requests once they wait in the loops for longer than this, see `HTTPLoadShedder`. Zero for never.
+  uint64_t load_shedding_target_ms = 0;
+  uint64_t load_shedding_interval_ms = kHTTPServerDefaultLoadSheddingIntervalMs;
+  // The `Retry-After` of the responses to the requests shed.
+  uint64_t load_shedding_retry_after_seconds = kHTTPServerDefaultRetryAfterSeconds;
+  // Run the handlers on a pool of this many threads instead of on the loops. Zero for the loops.
+  size_t handler_threads = 0;
+  // Stop reading the requests once this many are queued for the pool, or being handled by it.
+  size_t max_queued_requests = kHTTPServerDefaultMaxQueuedRequests;
+  // Called with the records of the requests handled, on the threads that have handled them. None if empty.
+  // It should neither block nor throw.
+  std::function<void(const HTTPAccessLogRecord&)> access_log;
+  // Log one request out of this many, by the number of the request among the ones of its loop.
+  uint32_t access_log_sample_every = 1;
+};
+
+// The metrics of the load shedding of all the `HTTPServer`-s, in `bricks::metrics::Registry::Singleton()`.
+struct HTTPLoadSheddingMetrics {
+  metrics::Counter& requests_shed;
+  metrics::Histogram& queueing_delay_us;
+
+  static HTTPLoadSheddingMetrics& Singleton() {
+    metrics::Registry& registry = metrics::Registry::Singleton();
+    static HTTPLoadSheddingMetrics singleton{
+        registry.GetCounter("bricks_http_server_requests_shed_total",
+                            "The requests responded to with \"503 Service Unavailable\" to shed the load."),
+        registry.GetHistogram("bricks_http_server_queueing_delay_us",
+                              "The microseconds the requests have waited for their handlers, if shedding.")};
+    return singleton;
+  }
+};
+
+// The admission control of a loop, CoDel-style: the queue is good while some requests get through it quickly,
+// and bad once even the quickest request of an interval has waited for longer than the target delay.
+// A good queue only sheds the requests that have waited for more than the whole interval, which absorbs
+// the bursts; a bad one sheds every request that has waited for more than the target, which drains it
+// to where the requests are served in time, rather than serving all of them too late. NOT THREAD SAFE.
+class HTTPLoadShedder final {
+ public:
+  typedef std::chrono::steady_clock::time_point TimePoint;
+  typedef std::chrono::steady_clock::duration Duration;
+
+  HTTPLoadShedder() = default;
+  HTTPLoadShedder(uint64_t target_ms, uint64_t interval_ms)
+      : target_(std::chrono::milliseconds(target_ms)),
+        interval_(std::chrono::milliseconds(std::max(interval_ms, target_ms))) {}
+
+  bool Enabled() const { return target_ != Duration::zero(); }
+
+  // Whether the queue has been bad over the previous interval.
+  bool Overloaded() const { return overloaded_; }
+
+  // Whether to shed the request that has waited for `delay` by `now`.
+  bool Shed(TimePoint now, Duration delay) {
+    if (now >= interval_end_) {
+      overloaded_ = min_delay_ > target_;
+      min_delay_ = delay;
+      interval_end_ = now + interval_;
+    } else if (delay < min_delay_) {
+      min_delay_ = delay;
+    }
+    return delay > (overloaded_ ? target_ : interval_);
+  }
+
+ private:
+  Duration target_ = Duration::zero();
+  Duration interval_ = Duration::zero();
+  TimePoint interval_end_;
+  Duration min_delay_ = Duration::zero();
+  bool overloaded_ = false;
+};
+
+struct HTTPResponse {
+  HTTPResponseCode code = HTTPResponseCode::OK;
+  std::string body;
+  std::string content_type = HTTPServerConnection::DefaultContentType();
+  HTTPHeadersType extra_headers;
+};
+
+class HTTPServer final {
+ public:
+  typedef std::function<void(const HTTPRequest&, HTTPResponse&)> HandlerType;
+
+  // Starts serving right away. Throws `SocketException`-s if the port can not be listened on.
+  inline HTTPServer(int port,
+                    HandlerType handler,
+                    size_t threads = 1,
+                    uint64_t idle_timeout_ms = kHTTPServerDefaultIdleTimeoutMs)
+      : HTTPServer(port, handler, Parameters(threads, idle_timeout_ms)) {}
+
+  inline HTTPServer(int port, HandlerType handler, const HTTPServerParameters& parameters)
+      : handler_(handler),
+        access_log_(parameters.access_log),
+        access_log_sample_every_(std::max(parameters.access_log_sample_every, static_cast<uint32_t>(1))),
+        idle_timeout_ms_(parameters.idle_timeout_ms),
+        max_queued_requests_(std::max(parameters.max_queued_requests, static_cast<size_t>(1))),
+        stopping_(false),
+        connections_(0),
+        queued_(0) {
+    if (parameters.load_shedding_target_ms) {
+      BuildShedResponses(parameters.load_shedding_retry_after_seconds);
+    }
+    SocketOptions socket_options = parameters.socket_options;
+    socket_options.reuse_port = socket_options.reuse_port || parameters.reuse_port;
+    // The connections are accepted in non-blocking mode, and the timeouts of the blocking reads
+    // and writes do not apply to them.
+    socket_options.read_timeout_ms = 0;
+    socket_options.write_timeout_ms = 0;
+    socket_options_ = socket_options;
+    if (::pipe(stop_pipe_)) {
+      throw SocketEventLoopException();
+    }
+    const size_t cpus = std::max(std::thread::hardware_concurrency(), 1u);
+    const bool unix_socket = !parameters.unix_socket_path.empty();
+    const bool reuse_port = parameters.reuse_port && !unix_socket;
+    for (size_t i = 0; i < std::max(parameters.threads, static_cast<size_t>(1)); ++i) {
+      loops_.emplace_back(new Loop());
+      Loop& loop = *loops_.back();
+      loop.index = i;
+      loop.shedder = HTTPLoadShedder(parameters.load_shedding_target_ms, parameters.load_shedding_interval_ms);
+      loop.cpu = parameters.pin_threads_to_cpus ? static_cast<int>((parameters.first_cpu + i) % cpus) : -1;
+      if (reuse_port || i == 0) {
+        loop.socket.reset(unix_socket ? new Socket(UnixSocketPath(parameters.unix_socket_path), socket_options)
+                                      : new Socket(port, socket_options));
+        loop.listen_fd = loop.socket->socket;
+        if (::fcntl(loop.listen_fd, F_SETFL, ::fcntl(loop.listen_fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+          throw SocketFcntlException();
+        }
+      } else {
+        loop.listen_fd = loops_.front()->listen_fd;
+      }
+      loop.poller.Add(stop_pipe_[0]);
+      loop.poller.Add(loop.listen_fd, !reuse_port);
+      if (parameters.handler_threads) {
+        if (::pipe(loop.wake_pipe)) {
+          throw SocketEventLoopException();
+        }
+        ::fcntl(loop.wake_pipe[0], F_SETFL, ::fcntl(loop.wake_pipe[0], F_GETFL, 0) | O_NONBLOCK);
+        ::fcntl(loop.wake_pipe[1], F_SETFL, ::fcntl(loop.wake_pipe[1], F_GETFL, 0) | O_NONBLOCK);
+        loop.poller.Add(loop.wake_pipe[0]);
+      }
+    }
+    if (parameters.handler_threads) {
+      handlers_.reset(new Executor(parameters.handler_threads, parameters.handler_threads));
+    }
+    for (auto& loop : loops_) {
+      loop->thread = std::thread(&HTTPServer::Run, this, std::ref(*loop));
+    }
+  }
+
+  // Closes all the connections, dropping the responses to the requests being processed.
+  inline ~HTTPServer() {
+    stopping_ = true;
+    const char c = 0;
+    if (::write(stop_pipe_[1], &c, 1) < 0) {
+      // Nothing to do, the loops will notice `stopping_` within a second.
+    }
+    for (auto& loop : loops_) {
+      loop->thread.join();
+    }
+    // Runs the handlers of the requests queued for the pool, with the loops still there to take the responses.
+    handlers_.reset();
+    ::close(stop_pipe_[0]);
+    ::close(stop_pipe_[1]);
+  }
+
+  // The number of client connections open. THREAD SAFE.
+  inline size_t NumberOfConnections() const { return connections_; }
+
+  // The number of requests queued for the pool of the handlers, or being handled by it. THREAD SAFE.
+  inline size_t NumberOfQueuedRequests() const { return queued_; }
+
+  // The number of connections each thread has accepted so far, to see how evenly they are spread. THREAD SAFE.
+  inline std::vector<size_t> NumberOfAcceptedConnectionsPerThread() const {
+    std::vector<size_t> result;
+    for (const auto& loop : loops_) {
+      result.push_back(loop->accepted);
+    }
+    return result;
+  }
+
+  // Appends the response to the request of `request_version`, with the headers telling whether the connection
+  // is kept alive. Also used by `FiberHTTPServer`.
+  static inline void AppendResponse(std::string& output,
+                                    const HTTPResponse& response,
+                                    const std::string& request_version,
+                                    bool keep_alive) {
+    const char* connection = nullptr;
+    if (!keep_alive) {
+      connection = kConnectionCloseValue;
+    } else if (request_version != kHTTP11Version) {
+      connection = kConnectionKeepAliveValue;
+    }
+    AppendHTTPResponseHeaders(output,
+                              response.code,
+                              response.content_type,
+                              response.body.length(),
+                              response.extra_headers,
+                              connection);
+    output.append(response.body);
+  }
+
+ private:
+  struct ClientConnection {
+    inline ClientConnection(int fd, uint64_t id)
+        : connection(SocketHandle(SocketHandle::FromHandle(fd))), fd(fd), id(id), last_activity(Now()) {}
+    Connection connection;  // Closes the socket on destruction.
+    const int fd;
+    // Tells the connection from the ones that had its `fd` before, for the responses of the pool.
+    const uint64_t id;
+    HTTPRequestParser parser;
+    std::string output;
+    size_t output_offset = 0;
+    bool watching_write = false;
+    bool watching_read = true;
+    // Set once no more requests should be read, the connection is closed once `output` is sent.
+    bool closing = false;
+    // Set while a request is on the pool of the handlers, and while the next one waits for the pool
+    // to have room, in `Loop::stalled`. The requests are not read from the socket meanwhile.
+    bool in_flight = false;
+    bool stalled = false;
+    std::chrono::steady_clock::time_point last_activity;
+    // When the poller has reported the bytes of the requests waiting in `parser`, for the load shedding.
+    std::chrono::steady_clock::time_point received;
+    bricks::time::TimerWheel::TimerID idle_timer = 0;
+  };
+
+  // The response of the pool of the handlers, for the loop to send.
+  struct HandledRequest {
+    int fd;
+    uint64_t id;
+    bool keep_alive;
+    std::string output;
+  };
+
+  struct Loop {
+    ~Loop() {
+      if (wake_pipe[0] >= 0) {
+        ::close(wake_pipe[0]);
+        ::close(wake_pipe[1]);
+      }
+    }
+    EventPoller poller;
+    // The listening socket of this loop with `reuse_port`; otherwise the first loop owns the shared one.
+    std::unique_ptr<Socket> socket;
+    int listen_fd = -1;
+    int cpu = -1;
+    size_t index = 0;
+    // The number of requests handled, for the ids and the sampling of the access log records.
+    uint64_t requests = 0;
+    std::atomic<size_t> accepted{0};
+    std::unordered_map<int, std::unique_ptr<ClientConnection>> connections;
+    uint64_t next_connection_id = 0;
+    bricks::time::TimerWheel timers{NowMs(), kHTTPServerTimerTickMs};
+    HTTPLoadShedder shedder;
+    // When `poller.Wait()` has last returned.
+    std::chrono::steady_clock::time_point woken;
+    // With the pool of the handlers: the responses it has made, and the pipe it wakes the loop up with
+    // once there are some, as well as the connections with requests waiting for the pool to have room.
+    std::mutex handled_mutex;
+    std::vector<HandledRequest> handled;
+    int wake_pipe[2] = {-1, -1};
+    std::vector<int> stalled;
+    std::thread thread;
+  };
+
+  static inline HTTPServerParameters Parameters(size_t threads, uint64_t idle_timeout_ms) {
+    HTTPServerParameters parameters;
+    parameters.threads = threads;
+    parameters.idle_timeout_ms = idle_timeout_ms;
+    return parameters;
+  }
+
+  static inline void PinCurrentThreadToCPU(int cpu) {
+#if defined(__linux__)
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    // Best effort: the CPU may be outside of the affinity mask the process was started with.
+    ::pthread_setaffinity_np(::pthread_self(), sizeof(cpus), &cpus);
+#else
+    static_cast<void>(cpu);
+#endif
+  }
+
+  static inline std::chrono::steady_clock::time_point Now() { return std::chrono::steady_clock::now(); }
+
+  // The milliseconds of `Now()`, which drive the timers of the loops.
+  static inline uint64_t MillisecondsOf(std::chrono::steady_clock::time_point t) {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count());
+  }
+  static inline uint64_t NowMs() { return MillisecondsOf(Now()); }
+
+  inline void Run(Loop& loop) {
+    if (loop.cpu >= 0) {
+      PinCurrentThreadToCPU(loop.cpu);
+    }
+    std::vector<EventPoller::Event> events;
+    while (!stopping_) {
+      // The room on the pool is made by the handlers of all the loops: the stalled connections check for it
+      // every tick, rather than each handler waking up every loop.
+      const uint64_t max_wait_ms = loop.stalled.empty() ? 1000 : kHTTPServerTimerTickMs;
+      loop.poller.Wait(events,
+                       static_cast<int>(loop.timers.MillisecondsUntilNextTimer(NowMs(), max_wait_ms)));
+      loop.woken = Now();
+      for (const EventPoller::Event& event : events) {
+        if (event.fd == stop_pipe_[0]) {
+          continue;
+        } else if (event.fd == loop.listen_fd) {
+          Accept(loop);
+          continue;
+        } else if (event.fd == loop.wake_pipe[0]) {
+          SendHandledRequests(loop);
+          continue;
+        }
+        const auto it = loop.connections.find(event.fd);
+        if (it == loop.connections.end()) {
+          continue;
+        }
+        ClientConnection& connection = *it->second;
+        bool keep = true;
+        if (event.readable && connection.watching_read) {
+          keep = Read(loop, connection);
+        }
+        if (keep && (event.writable || !connection.output.empty() || connection.closing || connection.in_flight ||
+                     connection.stalled)) {
+          keep = Write(loop, connection);
+        }
+        if (!keep) {
+          Close(loop, it->first);
+        }
+      }
+      if (!loop.stalled.empty()) {
+        ResumeStalled(loop);
+      }
+      loop.timers.Advance(NowMs());
+    }
+    while (!loop.connections.empty()) {
+      Close(loop, loop.connections.begin()->first);
+    }
+  }
+
+  inline void Accept(Loop& loop) {
+    while (true) {
+#if defined(__linux__)
+      const int fd = ::accept4(loop.listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+      const int fd = ::accept(loop.listen_fd, nullptr, nullptr);
+#endif
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        // `EAGAIN` once there are no more connections to accept, or out of file descriptors.
+        return;
+      }
+#if !defined(__linux__)
+      ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+      ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+#if defined(SO_NOSIGPIPE)
+      int just_one = 1;
+      ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &just_one, sizeof(int));
+#endif
+      std::unique_ptr<ClientConnection> connection(new ClientConnection(fd, loop.next_connection_id++));
+      try {
+        connection->connection.SetOptions(socket_options_);
+        loop.poller.Add(fd);
+      } catch (const SocketException&) {
+        continue;
+      }
+      ScheduleIdleTimeout(loop, *connection);
+      loop.connections[fd] = std::move(connection);
+      ++loop.accepted;
+      ++connections_;
+    }
+  }
+
+  // Reads what has arrived and responds to the complete requests. Returns false to close the connection.
+  inline bool Read(Loop& loop, ClientConnection& connection) {
+    char buffer[16 * 1024];
+    while (!connection.closing && !connection.in_flight && !connection.stalled &&
+           connection.output.length() < kHTTPServerMaxPendingOutputSize) {
+      const ssize_t length = ::read(connection.fd, buffer, sizeof(buffer));
+      if (length > 0) {
+        connection.last_activity = Now();
+        connection.received = loop.woken;
+        connection.parser.Feed(buffer, static_cast<size_t>(length));
+        Respond(loop, connection);
+      } else if (length == 0) {
+        // The client is done sending, possibly with `shutdown()`, yet it may be waiting for the responses.
+        connection.closing = true;
+      } else if (errno == EINTR) {
+        continue;
+      } else {
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+    }
+    return true;
+  }
+
+  inline void Respond(Loop& loop, ClientConnection& connection) {
+    HTTPRequest request;
+    while (!connection.closing && !connection.in_flight) {
+      if (handlers_ && queued_ >= max_queued_requests_) {
+        if (connection.parser.HasPartialRequest() && !connection.stalled) {
+          connection.stalled = true;
+          loop.stalled.push_back(connection.fd);
+        }
+        break;
+      }
+      if (!connection.parser.Next(request)) {
+        break;
+      }
+      if (loop.shedder.Enabled() && Shed(loop, connection)) {
+        connection.closing = !request.keep_alive;
+        connection.output.append(ShedResponse(request));
+        continue;
+      }
+      if (handlers_) {
+        Dispatch(loop, connection, request);
+        continue;
+      }
+      HTTPAccessLogRecord record;
+      const bool logged = SampleAccessLogRecord(loop, request, record);
+      connection.closing = !request.keep_alive;
+      HandleRequest(request, connection.output, logged ? &record : nullptr, connection.received);
+    }
+    if (!connection.closing && connection.parser.TakeContinue()) {
+      // The client waits for the go-ahead to send the body. A request to be shed is shed now, before the body
+      // is sent, and the connection is closed, as the client may or may not send the body after all.
+      if (loop.shedder.Enabled() && Shed(loop, connection)) {
+        connection.closing = true;
+        connection.output.append(shed_response_close_);
+      } else {
+        connection.output.append(kHTTPContinueResponse, CompileTimeStringLength(kHTTPContinueResponse));
+      }
+    }
+    if (!connection.closing && connection.parser.Failed()) {
+      HTTPResponse response;
+      response.code = connection.parser.ErrorCode();
+      response.body = HTTPResponseCodeAsStringGenerator::CodeAsString(response.code);
+      connection.closing = true;
+      AppendResponse(connection.output, response, "", false);
+    }
+  }
+
+  inline void CallHandler(const HTTPRequest& request, HTTPResponse& response) {
+    try {
+      handler_(request, response);
+    } catch (...) {
+      response = HTTPResponse();
+      response.code = HTTPResponseCode::InternalServerError;
+      response.body = "INTERNAL SERVER ERROR";
+    }
+  }
+
+  // Calls the handler and appends the response to `output`. With `record`, the one made by
+  // `SampleAccessLogRecord()`, also completes the record and passes it to `access_log_`.
+  // `received` is when the poller has reported the bytes of the request.
+  inline void HandleRequest(const HTTPRequest& request,
+                            std::string& output,
+                            HTTPAccessLogRecord* record,
+                            std::chrono::steady_clock::time_point received) {
+    const auto started = record ? Now() : received;
+    HTTPResponse response;
+    CallHandler(request, response);
+    const auto finished = record ? Now() : started;
+    const size_t offset = output.length();
+    AppendResponse(output, response, request.version, request.keep_alive);
+    if (record) {
+      const auto now = std::chrono::system_clock::now().time_since_epoch();
+      record->timestamp_us =
+          static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+      record->queueing_us = ClampedMicroseconds(started - received);
+      record->handler_us = ClampedMicroseconds(finished - started);
+      record->response_bytes = ClampedToUInt32(output.length() - offset);
+      record->status = static_cast<uint16_t>(response.code);
+      access_log_(*record);
+    }
+  }
+
+  // Fills in what the access log record of the request has before it is handled, and returns true,
+  // if the request is to be logged at all. Called by the loop, in the order of the requests.
+  inline bool SampleAccessLogRecord(Loop& loop, const HTTPRequest& request, HTTPAccessLogRecord& record) {
+    if (!access_log_) {
+      return false;
+    }
+    const uint64_t number = loop.requests++;
+    if (number % access_log_sample_every_) {
+      return false;
+    }
+    std::memset(&record, 0, sizeof(record));
+    record.request_id = (static_cast<uint64_t>(loop.index) << 56) | (number & ((1ull << 56) - 1));
+    record.request_bytes = ClampedToUInt32(request.body.length());
+    std::memcpy(record.method, request.method.data(), std::min(request.method.length(), sizeof(record.method)));
+    const size_t path_length = std::min(request.url.find('?'), request.url.length());
+    std::memcpy(record.path, request.url.data(), std::min(path_length, sizeof(record.path)));
+    return true;
+  }
+
+  static inline uint32_t ClampedToUInt32(uint64_t value) {
+    return static_cast<uint32_t>(std::min(value, static_cast<uint64_t>(0xFFFFFFFFu)));
+  }
+  static inline uint32_t ClampedMicroseconds(std::chrono::steady_clock::duration duration) {
+    const int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    return ClampedToUInt32(static_cast<uint64_t>(std::max(us, static_cast<int64_t>(0))));
+  }
+
+  // Hands the request over to the pool of the handlers, which passes the response back to the loop.
+  inline void Dispatch(Loop& loop, ClientConnection& connection, HTTPRequest& request) {
+    connection.in_flight = true;
+    ++queued_;
+    const int fd = connection.fd;
+    const uint64_t id = connection.id;
+    const std::shared_ptr<HTTPRequest> shared = std::make_shared<HTTPRequest>();
+    std::swap(*shared, request);
+    HTTPAccessLogRecord record;
+    const bool logged = SampleAccessLogRecord(loop, *shared, record);
+    const auto received = connection.received;
+    handlers_->Submit([this, &loop, fd, id, shared, logged, record, received]() {
+      HandledRequest handled{fd, id, shared->keep_alive, std::string()};
+      HTTPAccessLogRecord completed = record;
+      HandleRequest(*shared, handled.output, logged ? &completed : nullptr, received);
+      bool wake;
+      {
+        std::lock_guard<std::mutex> lock(loop.handled_mutex);
+        wake = loop.handled.empty();
+        loop.handled.push_back(std::move(handled));
+      }
+      --queued_;
+      const char c = 0;
+      if (wake && ::write(loop.wake_pipe[1], &c, 1) < 0) {
+        // The pipe is full of the wake-ups the loop has not read yet, which is just as well.
+      }
+    });
+  }
+
+  // Sends the responses the pool has made, and responds to the next requests of their connections.
+  inline void SendHandledRequests(Loop& loop) {
+    char buffer[64];
+    while (::read(loop.wake_pipe[0], buffer, sizeof(buffer)) > 0) {
+    }
+    std::vector<HandledRequest> handled;
+    {
+      std::lock_guard<std::mutex> lock(loop.handled_mutex);
+      handled.swap(loop.handled);
+    }
+    for (HandledRequest& response : handled) {
+      const auto it = loop.connections.find(response.fd);
+      if (it == loop.connections.end() || it->second->id != response.id) {
+        // Closed while its request was being handled.
+        continue;
+      }
+      ClientConnection& connection = *it->second;
+      connection.in_flight = false;
+      connection.closing = connection.closing || !response.keep_alive;
+      connection.output.append(response.output);
+      if (!Write(loop, connection)) {
+        Close(loop, response.fd);
+      }
+    }
+  }
+
+  // Has the stalled connections respond to their requests, if the pool has room for them now.
+  inline void ResumeStalled(Loop& loop) {
+    std::vector<int> stalled;
+    stalled.swap(loop.stalled);
+    for (const int fd : stalled) {
+      const auto it = loop.connections.find(fd);
+      if (it != loop.connections.end()) {
+        it->second->stalled = false;
+        if (!Write(loop, *it->second)) {
+          Close(loop, fd);
+        }
+      }
+    }
+  }
+
+  // Whether to shed the request about to be handled, by the time it has waited since its bytes were reported.
+  inline bool Shed(Loop& loop, const ClientConnection& connection) {
+    const auto now = Now();
+    const auto delay = now - connection.received;
+    HTTPLoadSheddingMetrics& metrics = HTTPLoadSheddingMetrics::Singleton();
+    metrics.queueing_delay_us.Record(
+        static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(delay).count()));
+    if (loop.shedder.Shed(now, delay)) {
+      metrics.requests_shed.Increment();
+      return true;
+    }
+    return false;
+  }
+
+  // The responses to the requests shed, built once, for the shedding to cost next to nothing per request.
+  inline void BuildShedResponses(uint64_t retry_after_seconds) {
+    HTTPResponse response;
+    response.code = HTTPResponseCode::ServiceUnavailable;
+    response.body = HTTPResponseCodeAsStringGenerator::CodeAsString(response.code);
+    response.extra_headers.emplace_back("Retry-After", std::to_string(retry_after_seconds));
+    AppendResponse(shed_response_, response, kHTTP11Version, true);
+    AppendResponse(shed_response_keep_alive_, response, "", true);
+    AppendResponse(shed_response_close_, response, "", false);
+  }
+
+  inline const std::string& ShedResponse(const HTTPRequest& request) const {
+    if (!request.keep_alive) {
+      return shed_response_close_;
+    }
+    return request.version == kHTTP11Version ? shed_response_ : shed_response_keep_alive_;
+  }
+
+  // Sends what it can of the pending output. Returns false to close the connection.
+  inline bool Write(Loop& loop, ClientConnection& connection) {
+    if (!connection.closing && connection.output.length() < kHTTPServerMaxPendingOutputSize) {
+      // Respond to the requests read while too many responses were waiting to be sent, if any.
+      Respond(loop, connection);
+    }
+    while (connection.output_offset < connection.output.length()) {
+#if defined(MSG_NOSIGNAL)
+      const int flags = MSG_NOSIGNAL;
+#else
+      const int flags = 0;
+#endif
+      const ssize_t length = ::send(connection.fd,
+                                    connection.output.data() + connection.output_offset,
+                                    connection.output.length() - connection.output_offset,
+                                    flags);
+      if (length >= 0) {
+        connection.output_offset += static_cast<size_t>(length);
+        connection.last_activity = Now();
+      } else if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      } else {
+        return false;
+      }
+    }
+    if (connection.output_offset == connection.output.length()) {
+      connection.output.clear();
+      connection.output_offset = 0;
+      if (connection.closing && !connection.in_flight) {
+        return false;
+      }
+    }
+    // Wait for the socket to be writable while there is output pending, and keep reading requests
+    // unless too many responses are waiting already, or the pool of the handlers is busy with them.
+    const bool write = !connection.output.empty();
+    const bool read = !connection.closing && !connection.in_flight && !connection.stalled &&
+                      connection.output.length() < kHTTPServerMaxPendingOutputSize;
+    if (write != connection.watching_write || read != connection.watching_read) {
+      loop.poller.Watch(connection.fd, read, write);
+      connection.watching_write = write;
+      connection.watching_read = read;
+    }
+    return true;
+  }
+
+  inline void Close(Loop& loop, int fd) {
+    const auto it = loop.connections.find(fd);
+    if (it != loop.connections.end()) {
+      loop.timers.Cancel(it->second->idle_timer);
+      loop.poller.Remove(fd);
+      loop.connections.erase(it);
+      --connections_;
+    }
+  }
+
+  // The traffic does not touch the timer: once it fires, it is scheduled again for the rest of the timeout
+  // since the last activity, if any, which costs a timer per timeout instead of one per read or write.
+  inline void ScheduleIdleTimeout(Loop& loop, ClientConnection& connection) {
+    const int fd = connection.fd;
+    connection.idle_timer = loop.timers.Schedule(MillisecondsOf(connection.last_activity) + idle_timeout_ms_,
+                                                 [this, &loop, fd]() { OnIdleTimeout(loop, fd); });
+  }
+
+  inline void OnIdleTimeout(Loop& loop, int fd) {
+    const auto it = loop.connections.find(fd);
+    if (it != loop.connections.end()) {
+      if (it->second->in_flight) {
+        // Waiting for the handler is not being idle.
+        it->second->last_activity = Now();
+        ScheduleIdleTimeout(loop, *it->second);
+      } else if (Now() - it->second->last_activity >= std::chrono::milliseconds(idle_timeout_ms_)) {
+        Close(loop, fd);
+      } else {
+        ScheduleIdleTimeout(loop, *it->second);
+      }
+    }
+  }
+
+  const HandlerType handler_;
+  const std::function<void(const HTTPAccessLogRecord&)> access_log_;
+  const uint64_t access_log_sample_every_;
+  const uint64_t idle_timeout_ms_;
+  const size_t max_queued_requests_;
+  SocketOptions socket_options_;
+  // The responses to the requests shed: of HTTP/1.1, of HTTP/1.0 kept alive, and closing the connection.
+  std::string shed_response_;
+  std::string shed_response_keep_alive_;
+  std::string shed_response_close_;
+  std::atomic_bool stopping_;
+  std::atomic<size_t> connections_;
+  std::atomic<size_t> queued_;
+  int stop_pipe_[2];
+  std::vector<std::unique_ptr<Loop>> loops_;
+  // The pool of the handlers, with `handler_threads`.
+  std::unique_ptr<Executor> handlers_;
+
+  HTTPServer(const HTTPServer&) = delete;
+  void operator=(const HTTPServer&) = delete;
+};
+
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_HTTP_IMPL_EVENT_LOOP_SERVER_H
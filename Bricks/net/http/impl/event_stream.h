@@ -0,0 +1,448 @@
+// Server-Sent Events: the `text/event-stream` responses that stay open, for the clients to tail the events
+// as they are published instead of polling for them.
+//
+// `HTTPEventStream` fans each published event out to all of its subscribers. The event is encoded once,
+// into a frame shared by all the subscribers, which is freed once the last of them has written it out.
+// The subscribers are the connections handed over to the stream once their requests have been received,
+// see `Subscribe()`. They are written to by the one thread of the stream, in non-blocking mode, with as many
+// pending frames per `writev()` as there are, up to `kHTTPEventStreamMaxFramesPerWrite`.
+//
+// The publisher only appends the frame to the ring of the recent frames, and wakes the thread up: it never
+// waits for the subscribers. The ring keeps up to `max_buffered_frames` frames and up to `max_buffered_bytes`
+// bytes of them, always the latest frame. The subscriber the ring has moved past, one which has not even
+// started on the oldest frame kept, is too slow, and the overflow policy is applied to it alone:
+// * `HTTPEventStreamOverflowPolicy::DropOldest`: It skips the frames it has missed, once it can be written to
+//   again, counted in `NumberOfDroppedFrames()`. The frame it is in the middle of is completed first,
+//   for the clients to only ever see whole events.
+// * `HTTPEventStreamOverflowPolicy::Disconnect`: It is disconnected right away, counted
+//   in `NumberOfDisconnectedSubscribers()`, for its client to reconnect, with `Last-Event-ID` if the events
+//   have ids, and catch up from its own source.
+//
+//   HTTPEventStream stream;
+//   ...
+//   HTTPServerConnection c(socket.Accept());
+//   if (c.Message().URL() == "/events") {
+//     stream.Subscribe(c);
+//   }
+//   ...
+//   stream.Publish("{\"x\":1}");
+//
+// Only the plain connections can subscribe, not the TLS ones. THREAD SAFE.
+
+#ifndef BRICKS_NET_HTTP_IMPL_EVENT_STREAM_H
+#define BRICKS_NET_HTTP_IMPL_EVENT_STREAM_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "server.h"
+
+#include "../codes.h"
+
+#include "../../exceptions.h"
+
+#include "../../tcp/tcp.h"
+#include "../../tcp/impl/event_poller.h"
+
+namespace bricks {
+namespace net {
+
+const size_t kHTTPEventStreamDefaultMaxBufferedFrames = 1024;
+const size_t kHTTPEventStreamDefaultMaxBufferedBytes = 4 * 1024 * 1024;
+// The frames gathered into one `writev()`, well within `IOV_MAX`.
+const int kHTTPEventStreamMaxFramesPerWrite = 64;
+
+enum class HTTPEventStreamOverflowPolicy { DropOldest, Disconnect };
+
+struct HTTPEventStreamParameters {
+  size_t max_buffered_frames = kHTTPEventStreamDefaultMaxBufferedFrames;
+  size_t max_buffered_bytes = kHTTPEventStreamDefaultMaxBufferedBytes;
+  HTTPEventStreamOverflowPolicy overflow_policy = HTTPEventStreamOverflowPolicy::DropOldest;
+};
+
+class HTTPEventStream final {
+ public:
+  typedef std::shared_ptr<const std::string> Frame;
+
+  explicit HTTPEventStream(const HTTPEventStreamParameters& parameters = HTTPEventStreamParameters())
+      : max_buffered_frames_(std::max(parameters.max_buffered_frames, static_cast<size_t>(1))),
+        max_buffered_bytes_(parameters.max_buffered_bytes),
+        overflow_policy_(parameters.overflow_policy),
+        headers_(std::make_shared<const std::string>(
+            HTTPResponseCodeAsStringGenerator::StatusLine(HTTPResponseCode::OK) +
+            "Content-Type: text/event-stream\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Connection: close\r\n"
+            "\r\n")) {
+    if (::pipe(wake_pipe_)) {
+      throw SocketEventLoopException();
+    }
+    ::fcntl(wake_pipe_[0], F_SETFL, ::fcntl(wake_pipe_[0], F_GETFL, 0) | O_NONBLOCK);
+    ::fcntl(wake_pipe_[1], F_SETFL, ::fcntl(wake_pipe_[1], F_GETFL, 0) | O_NONBLOCK);
+    poller_.Add(wake_pipe_[0]);
+    thread_ = std::thread(&HTTPEventStream::Run, this);
+  }
+
+  // Closes the connections of the subscribers, dropping the frames they have not been sent yet.
+  ~HTTPEventStream() {
+    stopping_ = true;
+    const char c = 0;
+    if (::write(wake_pipe_[1], &c, 1) < 0) {
+      // The pipe is full of the wake-ups the thread has not read yet, which is just as well.
+    }
+    thread_.join();
+    subscribers_.clear();
+    ::close(wake_pipe_[0]);
+    ::close(wake_pipe_[1]);
+  }
+
+  // The frame of the event, with the lines of `data` on `data:` lines of their own, as the clients join
+  // them back with newlines. The `event:` and `id:` lines are only there if non-empty.
+  static std::string EncodeEvent(const std::string& data,
+                                 const std::string& event = "",
+                                 const std::string& id = "") {
+    std::string frame;
+    frame.reserve(data.length() + event.length() + id.length() + 32);
+    if (!event.empty()) {
+      frame.append("event: ").append(event).append(1, '\n');
+    }
+    if (!id.empty()) {
+      frame.append("id: ").append(id).append(1, '\n');
+    }
+    size_t begin = 0;
+    while (true) {
+      const size_t end = data.find('\n', begin);
+      size_t line_end = (end == std::string::npos) ? data.length() : end;
+      if (line_end > begin && data[line_end - 1] == '\r') {
+        --line_end;
+      }
+      frame.append("data: ").append(data, begin, line_end - begin).append(1, '\n');
+      if (end == std::string::npos) {
+        break;
+      }
+      begin = end + 1;
+    }
+    frame.append(1, '\n');
+    return frame;
+  }
+
+  // The frame of the comment, which the clients ignore, such as to keep the idle connections alive.
+  static std::string EncodeComment(const std::string& text) { return ": " + text + "\n\n"; }
+
+  void Publish(const std::string& data, const std::string& event = "", const std::string& id = "") {
+    PublishFrame(std::make_shared<const std::string>(EncodeEvent(data, event, id)));
+  }
+
+  // Sends the frame, encoded already, to every subscriber. Does not wait for any of them.
+  void PublishFrame(Frame frame) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      buffered_bytes_ += frame->length();
+      frames_.push_back(std::move(frame));
+      while (frames_.size() > max_buffered_frames_ ||
+             (buffered_bytes_ > max_buffered_bytes_ && frames_.size() > 1)) {
+        buffered_bytes_ -= frames_.front()->length();
+        frames_.pop_front();
+        ++first_sequence_;
+      }
+    }
+    Wake();
+  }
+
+  // Responds to the request received by `connection` with the headers of the event stream, and takes over
+  // its socket. The subscriber gets the events published from then on. `connection` must not be used after
+  // this call, other than to be destructed.
+  template <class HELPER>
+  void Subscribe(TemplatedHTTPServerConnection<HELPER>& connection) {
+    Subscribe(std::move(connection.RawConnection()));
+  }
+
+  // Same as above, for the connection the request of which has been received by other means.
+  void Subscribe(Connection&& connection) {
+    assert(!connection.IsTLS());
+    std::unique_ptr<Subscriber> subscriber(new Subscriber(std::move(connection)));
+    const int fd = subscriber->fd;
+    if (::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+      throw SocketFcntlException();
+    }
+#if defined(SO_NOSIGPIPE)
+    int just_one = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &just_one, sizeof(int));
+#endif
+    subscriber->partial = headers_;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      subscriber->next = first_sequence_ + frames_.size();
+      new_subscribers_.push_back(std::move(subscriber));
+    }
+    ++number_of_subscribers_;
+    Wake();
+  }
+
+  size_t NumberOfSubscribers() const { return number_of_subscribers_; }
+  uint64_t NumberOfDroppedFrames() const { return number_of_dropped_frames_; }
+  uint64_t NumberOfDisconnectedSubscribers() const { return number_of_disconnected_subscribers_; }
+
+ private:
+  struct Subscriber {
+    explicit Subscriber(Connection&& c) : connection(std::move(c)), fd(connection.socket) {}
+    Connection connection;  // Closes the socket on destruction.
+    const int fd;
+    // The sequence number of the next frame to start writing.
+    uint64_t next = 0;
+    // The frame being written, with the bytes of it written so far, which the subscriber keeps a reference to,
+    // as the ring may drop it meanwhile. The headers of the response to begin with.
+    Frame partial;
+    size_t partial_offset = 0;
+    // Set while the socket is full, until the poller reports it writable.
+    bool blocked = false;
+    bool watching_write = false;
+  };
+
+  void Wake() {
+    if (!wake_pending_.exchange(true)) {
+      const char c = 0;
+      if (::write(wake_pipe_[1], &c, 1) < 0) {
+        // The pipe is full of the wake-ups the thread has not read yet, which is just as well.
+      }
+    }
+  }
+
+  void Run() {
+    std::vector<EventPoller::Event> events;
+    while (!stopping_) {
+      poller_.Wait(events, 1000);
+      for (const EventPoller::Event& event : events) {
+        if (event.fd == wake_pipe_[0]) {
+          char buffer[64];
+          while (::read(wake_pipe_[0], buffer, sizeof(buffer)) > 0) {
+          }
+          continue;
+        }
+        const auto it = subscribers_.find(event.fd);
+        if (it == subscribers_.end()) {
+          continue;
+        }
+        if (event.readable && !Drain(*it->second)) {
+          Close(it);
+          continue;
+        }
+        if (event.writable) {
+          it->second->blocked = false;
+        }
+      }
+      // Cleared before the ring is looked at, for the frames published from now on to wake the thread again.
+      wake_pending_ = false;
+      UpdateWindow();
+      for (auto it = subscribers_.begin(); it != subscribers_.end();) {
+        Subscriber& subscriber = *it->second;
+        if (subscriber.next < window_first_ && overflow_policy_ == HTTPEventStreamOverflowPolicy::Disconnect) {
+          ++number_of_disconnected_subscribers_;
+          it = Close(it);
+        } else if (!subscriber.blocked && !Write(subscriber)) {
+          it = Close(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+  }
+
+  // Takes over the new subscribers, and brings `window_` up to date with the ring: the thread writes
+  // the frames from its own copy of the references to them, with no lock held.
+  void UpdateWindow() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::unique_ptr<Subscriber>& subscriber : new_subscribers_) {
+      const int fd = subscriber->fd;
+      try {
+        poller_.Add(fd);
+      } catch (const SocketException&) {
+        --number_of_subscribers_;
+        continue;
+      }
+      subscribers_[fd] = std::move(subscriber);
+    }
+    new_subscribers_.clear();
+    if (window_first_ + window_.size() < first_sequence_) {
+      window_.clear();
+      window_first_ = first_sequence_;
+    }
+    for (uint64_t i = window_first_ + window_.size() - first_sequence_; i < frames_.size(); ++i) {
+      window_.push_back(frames_[i]);
+    }
+    while (window_first_ < first_sequence_) {
+      window_.pop_front();
+      ++window_first_;
+    }
+  }
+
+  // Writes what the socket takes of the frames pending for the subscriber. Returns false to disconnect it.
+  bool Write(Subscriber& subscriber) {
+    const uint64_t end = window_first_ + window_.size();
+    while (true) {
+      if (!subscriber.partial && subscriber.next < window_first_) {
+        // Only with `HTTPEventStreamOverflowPolicy::DropOldest`, once the frame in progress is complete.
+        number_of_dropped_frames_ += window_first_ - subscriber.next;
+        subscriber.next = window_first_;
+      }
+      struct iovec iov[kHTTPEventStreamMaxFramesPerWrite];
+      int count = 0;
+      if (subscriber.partial) {
+        iov[count].iov_base = const_cast<char*>(subscriber.partial->data()) + subscriber.partial_offset;
+        iov[count].iov_len = subscriber.partial->length() - subscriber.partial_offset;
+        ++count;
+      }
+      // The frames the subscriber has missed are only skipped past the frame in progress.
+      if (subscriber.next >= window_first_) {
+        for (uint64_t i = subscriber.next; i < end && count < kHTTPEventStreamMaxFramesPerWrite; ++i) {
+          const std::string& frame = *window_[i - window_first_];
+          iov[count].iov_base = const_cast<char*>(frame.data());
+          iov[count].iov_len = frame.length();
+          ++count;
+        }
+      }
+      if (!count) {
+        break;
+      }
+      size_t total = 0;
+      for (int i = 0; i < count; ++i) {
+        total += iov[i].iov_len;
+      }
+      struct msghdr message;
+      std::memset(&message, 0, sizeof(message));
+      message.msg_iov = iov;
+      message.msg_iovlen = count;
+#if defined(MSG_NOSIGNAL)
+      const int flags = MSG_NOSIGNAL;
+#else
+      const int flags = 0;
+#endif
+      const ssize_t result = ::sendmsg(subscriber.fd, &message, flags);
+      if (result < 0) {
+        if (errno == EINTR) {
+          continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          Block(subscriber);
+          return true;
+        } else {
+          return false;
+        }
+      }
+      size_t written = static_cast<size_t>(result);
+      if (subscriber.partial) {
+        const size_t rest = subscriber.partial->length() - subscriber.partial_offset;
+        if (written < rest) {
+          subscriber.partial_offset += written;
+          Block(subscriber);
+          return true;
+        }
+        written -= rest;
+        subscriber.partial.reset();
+        subscriber.partial_offset = 0;
+      }
+      while (written) {
+        const Frame& frame = window_[subscriber.next - window_first_];
+        ++subscriber.next;
+        if (written < frame->length()) {
+          subscriber.partial = frame;
+          subscriber.partial_offset = written;
+          break;
+        }
+        written -= frame->length();
+      }
+      if (static_cast<size_t>(result) < total) {
+        Block(subscriber);
+        return true;
+      }
+    }
+    if (subscriber.watching_write) {
+      poller_.Watch(subscriber.fd, true, false);
+      subscriber.watching_write = false;
+    }
+    return true;
+  }
+
+  // Has the poller report the socket once it can take more.
+  void Block(Subscriber& subscriber) {
+    subscriber.blocked = true;
+    if (!subscriber.watching_write) {
+      poller_.Watch(subscriber.fd, true, true);
+      subscriber.watching_write = true;
+    }
+  }
+
+  // Reads and discards what the client sends. Returns false once it has closed the connection.
+  static bool Drain(Subscriber& subscriber) {
+    char buffer[1024];
+    while (true) {
+      const ssize_t length = ::read(subscriber.fd, buffer, sizeof(buffer));
+      if (length > 0) {
+        continue;
+      } else if (length < 0 && errno == EINTR) {
+        continue;
+      } else {
+        return length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+      }
+    }
+  }
+
+  typedef std::unordered_map<int, std::unique_ptr<Subscriber>>::iterator SubscriberIterator;
+
+  SubscriberIterator Close(SubscriberIterator it) {
+    poller_.Remove(it->first);
+    --number_of_subscribers_;
+    return subscribers_.erase(it);
+  }
+
+  const size_t max_buffered_frames_;
+  const size_t max_buffered_bytes_;
+  const HTTPEventStreamOverflowPolicy overflow_policy_;
+  const Frame headers_;
+
+  // The ring of the recent frames, the first of which has the sequence number `first_sequence_`,
+  // and the subscribers the thread is yet to take over. Guarded by `mutex_`.
+  std::mutex mutex_;
+  std::deque<Frame> frames_;
+  uint64_t first_sequence_ = 0;
+  size_t buffered_bytes_ = 0;
+  std::vector<std::unique_ptr<Subscriber>> new_subscribers_;
+
+  // The copy of the ring, and the subscribers by their sockets. Only accessed by the thread.
+  std::deque<Frame> window_;
+  uint64_t window_first_ = 0;
+  std::unordered_map<int, std::unique_ptr<Subscriber>> subscribers_;
+
+  std::atomic<size_t> number_of_subscribers_{0};
+  std::atomic<uint64_t> number_of_dropped_frames_{0};
+  std::atomic<uint64_t> number_of_disconnected_subscribers_{0};
+
+  EventPoller poller_;
+  int wake_pipe_[2];
+  std::atomic_bool wake_pending_{false};
+  std::atomic_bool stopping_{false};
+  std::thread thread_;
+
+  HTTPEventStream(const HTTPEventStream&) = delete;
+  void operator=(const HTTPEventStream&) = delete;
+};
+
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_HTTP_IMPL_EVENT_STREAM_H
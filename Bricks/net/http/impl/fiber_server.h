@@ -0,0 +1,140 @@
+// HTTP server on fibers: each connection is served by straight-line code on a fiber of its own.
+//
+// Same as with `HTTPServer`, a few threads serve many concurrent connections. Yet the handler runs
+// on the fiber of the connection, see `../../tcp/impl/fiber.h`, and may suspend it: sleep with
+// `FiberLoop::Current()->Sleep()`, or read from and write to other `FiberConnection`-s, such as to call
+// a backend, as if the calls were blocking, while the other connections are served meanwhile.
+// The handler that blocks its thread for real still holds up the other connections of its loop.
+//
+// One fiber accepts the connections, and hands them over to the loops round-robin. The requests
+// of a connection are read and answered in order, persistent and pipelined connections included.
+// A connection with nothing read from it within `idle_timeout_ms` is closed.
+// The handler throwing an exception results in a "500 Internal Server Error" response.
+// The destructor closes all the connections, unwinding the handlers suspended in the middle of the requests.
+
+#ifndef BRICKS_NET_HTTP_IMPL_FIBER_SERVER_H
+#define BRICKS_NET_HTTP_IMPL_FIBER_SERVER_H
+
+#include "../../tcp/fiber.h"
+
+#if defined(BRICKS_NET_HAS_FIBERS)
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "event_loop_server.h"
+#include "request_parser.h"
+
+#include "../codes.h"
+
+#include "../../exceptions.h"
+
+namespace bricks {
+namespace net {
+
+class FiberHTTPServer final {
+ public:
+  typedef HTTPServer::HandlerType HandlerType;
+
+  // Starts serving right away. Throws `SocketException`-s if the port can not be listened on.
+  inline FiberHTTPServer(int port,
+                         HandlerType handler,
+                         size_t threads = 1,
+                         uint64_t idle_timeout_ms = kHTTPServerDefaultIdleTimeoutMs)
+      : handler_(handler), idle_timeout_ms_(idle_timeout_ms), connections_(0), next_loop_(0) {
+    for (size_t i = 0; i < std::max(threads, static_cast<size_t>(1)); ++i) {
+      loops_.emplace_back(new FiberLoop());
+    }
+    // `std::function` is copyable, thus the listening socket is passed to the acceptor by pointer.
+    std::shared_ptr<Socket> socket(new Socket(port));
+    loops_.front()->Spawn([this, socket]() {
+      FiberSocket listener(std::move(*socket));
+      while (true) {
+        std::shared_ptr<Connection> connection(new Connection(listener.AcceptConnection()));
+        loops_[next_loop_++ % loops_.size()]->Spawn([this, connection]() {
+          FiberConnection fiber_connection(std::move(*connection));
+          Serve(fiber_connection);
+        });
+      }
+    });
+  }
+
+  inline ~FiberHTTPServer() {
+    // The connections are closed by the destructors of the loops, the acceptor with the first one.
+    loops_.clear();
+  }
+
+  // The number of client connections open. THREAD SAFE.
+  inline size_t NumberOfConnections() const { return connections_; }
+
+ private:
+  struct ScopedCount final {
+    inline explicit ScopedCount(std::atomic<size_t>& count) : count(count) { ++count; }
+    inline ~ScopedCount() { --count; }
+    std::atomic<size_t>& count;
+  };
+
+  inline void Serve(FiberConnection& connection) {
+    const ScopedCount count(connections_);
+    HTTPRequestParser parser;
+    std::string output;
+    char buffer[16 * 1024];
+    while (true) {
+      HTTPRequest request;
+      while (parser.Next(request)) {
+        HTTPResponse response;
+        try {
+          handler_(request, response);
+        } catch (const FiberLoopStoppedException&) {
+          throw;
+        } catch (...) {
+          response = HTTPResponse();
+          response.code = HTTPResponseCode::InternalServerError;
+          response.body = "INTERNAL SERVER ERROR";
+        }
+        output.clear();
+        HTTPServer::AppendResponse(output, response, request.version, request.keep_alive);
+        connection.Write(output);
+        if (!request.keep_alive) {
+          return;
+        }
+      }
+      if (parser.Failed()) {
+        HTTPResponse response;
+        response.code = parser.ErrorCode();
+        response.body = HTTPResponseCodeAsStringGenerator::CodeAsString(response.code);
+        output.clear();
+        HTTPServer::AppendResponse(output, response, "", false);
+        connection.Write(output);
+        return;
+      }
+      // Throws `SocketReadTimeoutException` once the connection has been idle for too long.
+      const size_t length = connection.Read(buffer, sizeof(buffer), idle_timeout_ms_);
+      if (!length) {
+        // The client is done sending, and all of its complete requests have been answered.
+        return;
+      }
+      parser.Feed(buffer, length);
+    }
+  }
+
+  const HandlerType handler_;
+  const uint64_t idle_timeout_ms_;
+  std::atomic<size_t> connections_;
+  std::atomic<size_t> next_loop_;
+  std::vector<std::unique_ptr<FiberLoop>> loops_;
+
+  FiberHTTPServer(const FiberHTTPServer&) = delete;
+  void operator=(const FiberHTTPServer&) = delete;
+};
+
+}  // namespace net
+}  // namespace bricks
+
+#endif  // defined(BRICKS_NET_HAS_FIBERS)
+
+#endif  // BRICKS_NET_HTTP_IMPL_FIBER_SERVER_H
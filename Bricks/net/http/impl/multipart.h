@@ -0,0 +1,356 @@
+// The streaming parser of the `multipart/form-data` bodies, the file uploads of the browsers and of the
+// HTTP client libraries, RFC 7578.
+//
+// `HTTPMultipartParser` is fed the body piece by piece, as `StreamBody()` passes it on, and calls the handler
+// as the parts go by, without ever holding more than the headers of one part and a delimiter's worth of
+// its data:
+// * `OnPartBegin(const HTTPMultipartPart& part)`, with the headers of the part parsed,
+// * `OnPartData(const char* data, size_t length)`, any number of times, with the pieces of its data, and
+// * `OnPartEnd()`, once the delimiter after it has been seen.
+//
+//   struct Saver {
+//     void OnPartBegin(const HTTPMultipartPart& part) { file = Open(part.filename); }
+//     void OnPartData(const char* data, size_t length) { Write(file, data, length); }
+//     void OnPartEnd() { Close(file); }
+//   };
+//   Saver saver;
+//   StreamMultipartRequestBody(connection, saver);  // For `HTTPStreamingServerConnection`.
+//
+// The delimiters are found with the Boyer-Moore-Horspool search, which skips up to the length of the delimiter,
+// around 40 bytes with the boundaries of the browsers, at a time. The preamble and the epilogue are ignored.
+//
+// Exceptions:
+// * HTTPMalformedBodyException : When the body is not `multipart/form-data`, the headers of a part
+//                                are malformed or longer than `kHTTPMultipartMaxHeadersLength`,
+//                                or the body ends early.
+
+#ifndef BRICKS_NET_HTTP_IMPL_MULTIPART_H
+#define BRICKS_NET_HTTP_IMPL_MULTIPART_H
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "scan.h"
+#include "server.h"
+
+#include "../../exceptions.h"
+
+namespace bricks {
+namespace net {
+
+const size_t kHTTPMultipartMaxBoundaryLength = 70;
+const size_t kHTTPMultipartMaxHeadersLength = 16 * 1024;
+
+// A part of the body, as its headers describe it.
+struct HTTPMultipartPart {
+  // The `name` and the `filename` of the `Content-Disposition` header, the latter empty for the form fields.
+  std::string name;
+  std::string filename;
+  std::string content_type;
+  // All the headers of the part, as they came.
+  std::vector<std::pair<std::string, std::string>> headers;
+};
+
+namespace impl {
+
+inline bool HTTPMultipartIsSpace(char c) { return c == ' ' || c == '\t'; }
+
+inline void HTTPMultipartTrim(const char*& begin, const char*& end) {
+  while (begin != end && HTTPMultipartIsSpace(*begin)) {
+    ++begin;
+  }
+  while (end != begin && HTTPMultipartIsSpace(end[-1])) {
+    --end;
+  }
+}
+
+// Finds the parameter `name` among the `; name=value` ones of the header value, quoted or not.
+inline bool HTTPMultipartParameter(const std::string& header, const char* name, std::string& value) {
+  size_t i = header.find(';');
+  while (i != std::string::npos) {
+    const char* key = header.data() + i + 1;
+    const char* const end = header.data() + header.length();
+    while (key != end && HTTPMultipartIsSpace(*key)) {
+      ++key;
+    }
+    const char* key_end = key;
+    while (key_end != end && *key_end != '=' && *key_end != ';') {
+      ++key_end;
+    }
+    const char* trimmed_key_end = key_end;
+    HTTPMultipartTrim(key, trimmed_key_end);
+    if (key_end != end && *key_end == '=' &&
+        scan::EqualsIgnoreCase(key, static_cast<size_t>(trimmed_key_end - key), name)) {
+      const char* p = key_end + 1;
+      while (p != end && HTTPMultipartIsSpace(*p)) {
+        ++p;
+      }
+      value.clear();
+      if (p != end && *p == '"') {
+        for (++p; p != end && *p != '"'; ++p) {
+          if (*p == '\\' && p + 1 != end) {
+            ++p;
+          }
+          value += *p;
+        }
+      } else {
+        const char* value_end = p;
+        while (value_end != end && *value_end != ';') {
+          ++value_end;
+        }
+        HTTPMultipartTrim(p, value_end);
+        value.assign(p, value_end);
+      }
+      return true;
+    }
+    i = header.find(';', static_cast<size_t>(key_end - header.data()));
+  }
+  return false;
+}
+
+}  // namespace impl
+
+// Extracts the boundary from the value of the `Content-Type` header. Returns false if it is not
+// `multipart/form-data`, or has no valid boundary.
+inline bool HTTPMultipartBoundary(const std::string& content_type, std::string& boundary) {
+  const char* type = content_type.data();
+  const char* type_end = content_type.data() + std::min(content_type.find(';'), content_type.length());
+  impl::HTTPMultipartTrim(type, type_end);
+  return scan::EqualsIgnoreCase(type, static_cast<size_t>(type_end - type), "multipart/form-data") &&
+         impl::HTTPMultipartParameter(content_type, "boundary", boundary) && !boundary.empty() &&
+         boundary.length() <= kHTTPMultipartMaxBoundaryLength;
+}
+
+class HTTPMultipartParser final {
+ public:
+  explicit HTTPMultipartParser(const std::string& boundary)
+      : delimiter_(std::string(kCRLF) + "--" + boundary), carry_(kCRLF) {
+    // The first delimiter may come with no CRLF before it, as the body is pretended to begin with one.
+    const size_t m = delimiter_.length();
+    std::fill(skip_, skip_ + 256, static_cast<unsigned char>(m));
+    for (size_t i = 0; i + 1 < m; ++i) {
+      skip_[static_cast<unsigned char>(delimiter_[i])] = static_cast<unsigned char>(m - 1 - i);
+    }
+    carry_.reserve(m * 2);
+  }
+
+  // Parses the next piece of the body, calling the handler for the parts it completes or continues.
+  template <class HANDLER>
+  void Feed(const char* data, size_t length, HANDLER& handler) {
+    const char* p = data;
+    const char* const end = data + length;
+    while (p != end) {
+      switch (state_) {
+        case State::Preamble:
+        case State::Data:
+          p = FeedData(p, end, handler);
+          break;
+        case State::Boundary:
+          // The transport padding, the whitespace after the delimiter, is skipped.
+          if (*p == '-') {
+            state_ = State::BoundaryDash;
+          } else if (*p == '\r') {
+            state_ = State::BoundaryCR;
+          } else if (!impl::HTTPMultipartIsSpace(*p)) {
+            throw HTTPMalformedBodyException();
+          }
+          ++p;
+          break;
+        case State::BoundaryDash:
+          if (*p++ != '-') {
+            throw HTTPMalformedBodyException();
+          }
+          state_ = State::Epilogue;
+          break;
+        case State::BoundaryCR:
+          if (*p++ != '\n') {
+            throw HTTPMalformedBodyException();
+          }
+          // The CRLF of the delimiter line, for the headers to end with the first "\r\n\r\n", even if empty.
+          headers_.assign(kCRLF);
+          state_ = State::Headers;
+          break;
+        case State::Headers:
+          p = FeedHeaders(p, end, handler);
+          break;
+        case State::Epilogue:
+          return;
+      }
+    }
+  }
+
+  // Whether the closing delimiter has been seen. The body is complete only then.
+  bool Done() const { return state_ == State::Epilogue; }
+
+ private:
+  enum class State { Preamble, Boundary, BoundaryDash, BoundaryCR, Headers, Data, Epilogue };
+
+  // The first occurrence of the delimiter in `[p, end)`, or `nullptr`.
+  const char* Find(const char* p, const char* end) const {
+    const size_t m = delimiter_.length();
+    const char* const delimiter = delimiter_.data();
+    while (static_cast<size_t>(end - p) >= m) {
+      const unsigned char c = static_cast<unsigned char>(p[m - 1]);
+      if (c == static_cast<unsigned char>(delimiter[m - 1]) && !memcmp(p, delimiter, m - 1)) {
+        return p;
+      }
+      p += skip_[c];
+    }
+    return nullptr;
+  }
+
+  // The length of the longest suffix of `[p, end)` the delimiter may begin with, to hold it back
+  // until the next piece tells whether it does.
+  size_t PartialDelimiterLength(const char* p, const char* end) const {
+    for (size_t k = std::min(delimiter_.length() - 1, static_cast<size_t>(end - p)); k; --k) {
+      if (end[-static_cast<ptrdiff_t>(k)] == '\r' && !memcmp(end - k, delimiter_.data(), k)) {
+        return k;
+      }
+    }
+    return 0;
+  }
+
+  template <class HANDLER>
+  void Emit(const char* data, size_t length, HANDLER& handler) {
+    if (state_ == State::Data && length) {
+      handler.OnPartData(data, length);
+    }
+  }
+
+  template <class HANDLER>
+  void OnDelimiter(HANDLER& handler) {
+    if (state_ == State::Data) {
+      handler.OnPartEnd();
+    }
+    state_ = State::Boundary;
+  }
+
+  template <class HANDLER>
+  const char* FeedData(const char* p, const char* end, HANDLER& handler) {
+    const size_t m = delimiter_.length();
+    if (!carry_.empty()) {
+      // The bytes held back from the previous piece, with enough of this one for a delimiter beginning
+      // in them to be complete.
+      const size_t carried = carry_.length();
+      const size_t taken = std::min(static_cast<size_t>(end - p), m);
+      carry_.append(p, taken);
+      const char* const found = Find(carry_.data(), carry_.data() + carry_.length());
+      if (found) {
+        const size_t before = static_cast<size_t>(found - carry_.data());
+        Emit(carry_.data(), before, handler);
+        carry_.clear();
+        OnDelimiter(handler);
+        return p + (before + m - carried);
+      }
+      if (taken < m) {
+        const size_t kept = PartialDelimiterLength(carry_.data(), carry_.data() + carry_.length());
+        Emit(carry_.data(), carry_.length() - kept, handler);
+        carry_.erase(0, carry_.length() - kept);
+        return end;
+      }
+      Emit(carry_.data(), carried, handler);
+      carry_.clear();
+    }
+    const char* const found = Find(p, end);
+    if (found) {
+      Emit(p, static_cast<size_t>(found - p), handler);
+      OnDelimiter(handler);
+      return found + m;
+    }
+    const size_t kept = PartialDelimiterLength(p, end);
+    Emit(p, static_cast<size_t>(end - p) - kept, handler);
+    carry_.assign(end - kept, kept);
+    return end;
+  }
+
+  template <class HANDLER>
+  const char* FeedHeaders(const char* p, const char* end, HANDLER& handler) {
+    const size_t previous = headers_.length();
+    headers_.append(p, end);
+    const size_t found = headers_.find("\r\n\r\n", previous >= 3 ? previous - 3 : 0);
+    if (found == std::string::npos) {
+      if (headers_.length() > kHTTPMultipartMaxHeadersLength) {
+        throw HTTPMalformedBodyException();
+      }
+      return end;
+    }
+    headers_.resize(found);
+    ParseHeaders();
+    state_ = State::Data;
+    handler.OnPartBegin(part_);
+    return p + (found + 4 - previous);
+  }
+
+  void ParseHeaders() {
+    part_.name.clear();
+    part_.filename.clear();
+    part_.content_type.clear();
+    part_.headers.clear();
+    size_t begin = kCRLFLength;
+    while (begin < headers_.length()) {
+      const size_t line_end = std::min(headers_.find(kCRLF, begin), headers_.length());
+      const char* key = headers_.data() + begin;
+      const char* const line = headers_.data() + line_end;
+      const char* colon = std::find(key, line, ':');
+      if (colon == line) {
+        throw HTTPMalformedBodyException();
+      }
+      const char* key_end = colon;
+      const char* value = colon + 1;
+      const char* value_end = line;
+      impl::HTTPMultipartTrim(key, key_end);
+      impl::HTTPMultipartTrim(value, value_end);
+      part_.headers.emplace_back(std::string(key, key_end), std::string(value, value_end));
+      const std::string& header = part_.headers.back().second;
+      const size_t key_length = static_cast<size_t>(key_end - key);
+      if (scan::EqualsIgnoreCase(key, key_length, "Content-Disposition")) {
+        impl::HTTPMultipartParameter(header, "name", part_.name);
+        impl::HTTPMultipartParameter(header, "filename", part_.filename);
+      } else if (scan::EqualsIgnoreCase(key, key_length, "Content-Type")) {
+        part_.content_type = header;
+      }
+      begin = line_end + kCRLFLength;
+    }
+  }
+
+  const std::string delimiter_;
+  unsigned char skip_[256];
+  State state_ = State::Preamble;
+  // The end of the previous piece, held back as the delimiter may begin in it.
+  std::string carry_;
+  std::string headers_;
+  HTTPMultipartPart part_;
+
+  HTTPMultipartParser(const HTTPMultipartParser&) = delete;
+  void operator=(const HTTPMultipartParser&) = delete;
+};
+
+// Streams the `multipart/form-data` body of the request of `connection` through `handler`, see above.
+// Returns the length of the body.
+template <class HELPER, class HANDLER>
+inline size_t StreamMultipartRequestBody(TemplatedHTTPServerConnection<HELPER>& connection,
+                                         HANDLER& handler,
+                                         size_t buffer_size = kDefaultStreamingBufferSize) {
+  HTTPHeaderViewHelper::Slice content_type;
+  std::string boundary;
+  if (!connection.Message().FindHeader("Content-Type", content_type) ||
+      !HTTPMultipartBoundary(content_type.ToString(), boundary)) {
+    throw HTTPMalformedBodyException();
+  }
+  HTTPMultipartParser parser(boundary);
+  const size_t length = connection.StreamRequestBody(
+      [&parser, &handler](const char* data, size_t length) { parser.Feed(data, length, handler); },
+      buffer_size);
+  if (!parser.Done()) {
+    throw HTTPMalformedBodyException();
+  }
+  return length;
+}
+
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_HTTP_IMPL_MULTIPART_H
@@ -0,0 +1,109 @@
+// The `/debug/profile` endpoint, to profile the CPU of a running server over HTTP, see `metrics/profiler.h`.
+//
+// The query sets the duration, `seconds`, one by default and up to `kHTTPProfileMaxSeconds`, the samples
+// per second of CPU time, `hz`, and the format, `format=folded`, the default, for `flamegraph.pl`,
+// or `format=pprof`, the binary CPU profile for `pprof`:
+//
+//   router.Register("GET", "/debug/profile", CPUProfileHTTPRouteHandler());  // For `HTTPServer`.
+//   SendCPUProfileHTTPResponse(connection);  // For `HTTPServerConnection`, on the URL of its request.
+//
+//   curl -s 'localhost:8080/debug/profile?seconds=10' | flamegraph.pl > profile.svg
+//   curl -s 'localhost:8080/debug/profile?seconds=10&format=pprof' > cpu.prof && pprof --text ./server cpu.prof
+//
+// The request blocks the thread serving it for the duration of the profile: mount the endpoint on an
+// `HTTPServer` with more than one thread, or on a port of its own. While one profile is being taken,
+// the other requests for it are responded to with "409 Conflict", and the malformed ones
+// with "400 Bad Request".
+
+#ifndef BRICKS_NET_HTTP_IMPL_PROFILE_H
+#define BRICKS_NET_HTTP_IMPL_PROFILE_H
+
+#include <cstdlib>
+#include <string>
+
+#include "event_loop_server.h"
+#include "router.h"
+#include "server.h"
+
+#include "../codes.h"
+
+#include "../../api/url.h"
+
+#include "../../../metrics/profiler.h"
+
+namespace bricks {
+namespace net {
+
+const double kHTTPProfileMaxSeconds = 60.0;
+const char* const kHTTPProfileFoldedContentType = "text/plain; charset=utf-8";
+const char* const kHTTPProfilePprofContentType = "application/octet-stream";
+
+// Profiles the process as the query of `url` tells, and makes the response with the profile.
+inline void MakeCPUProfileHTTPResponse(const std::string& url, HTTPResponse& response) {
+  metrics::CPUProfileParameters parameters;
+  bool pprof = false;
+  api::URLQueryParameters query(url);
+  std::string key;
+  std::string value;
+  while (query.Next(key, value)) {
+    char* end = nullptr;
+    if (key == "seconds") {
+      parameters.seconds = std::strtod(value.c_str(), &end);
+      if (value.empty() || *end ||
+          !(parameters.seconds > 0.0 && parameters.seconds <= kHTTPProfileMaxSeconds)) {
+        response.code = HTTPResponseCode::BadRequest;
+        response.body = "`seconds` should be greater than zero and at most " +
+                        std::to_string(static_cast<int>(kHTTPProfileMaxSeconds)) + ".\n";
+        return;
+      }
+    } else if (key == "hz") {
+      parameters.frequency_hz = static_cast<size_t>(std::strtoul(value.c_str(), &end, 10));
+      if (value.empty() || *end || !parameters.frequency_hz ||
+          parameters.frequency_hz > metrics::kCPUProfilerMaxFrequencyHz) {
+        response.code = HTTPResponseCode::BadRequest;
+        response.body =
+            "`hz` should be from 1 to " + std::to_string(metrics::kCPUProfilerMaxFrequencyHz) + ".\n";
+        return;
+      }
+    } else if (key == "format") {
+      if (value != "folded" && value != "pprof") {
+        response.code = HTTPResponseCode::BadRequest;
+        response.body = "`format` should be `folded` or `pprof`.\n";
+        return;
+      }
+      pprof = (value == "pprof");
+    }
+  }
+  try {
+    const metrics::CPUProfile profile = metrics::CPUProfiler::Singleton().Profile(parameters);
+    response.code = HTTPResponseCode::OK;
+    response.body = pprof ? profile.Pprof() : profile.FoldedStacks();
+    response.content_type = pprof ? kHTTPProfilePprofContentType : kHTTPProfileFoldedContentType;
+  } catch (const metrics::CPUProfilerBusyException&) {
+    response.code = HTTPResponseCode::Conflict;
+    response.body = "Another profile is being taken.\n";
+  } catch (const metrics::CPUProfilerSetupException&) {
+    response.code = HTTPResponseCode::InternalServerError;
+    response.body = "The CPU profiler could not be started.\n";
+  }
+}
+
+// The route handler for `HTTPRouter`, for `HTTPServer`.
+inline HTTPRouteHandler CPUProfileHTTPRouteHandler() {
+  return [](const HTTPRequest& request, const HTTPRouteParameters&, HTTPResponse& response) {
+    MakeCPUProfileHTTPResponse(request.url, response);
+  };
+}
+
+// Responds to the request of `connection` with the profile.
+template <class HELPER>
+inline void SendCPUProfileHTTPResponse(TemplatedHTTPServerConnection<HELPER>& connection) {
+  HTTPResponse response;
+  MakeCPUProfileHTTPResponse(connection.Message().URL(), response);
+  connection.SendHTTPResponse(response.body, response.code, response.content_type, response.extra_headers);
+}
+
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_HTTP_IMPL_PROFILE_H
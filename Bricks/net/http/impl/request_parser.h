@@ -0,0 +1,321 @@
+// Incremental HTTP request parser, for the servers that read from non-blocking sockets.
+//
+// `TemplatedHTTPReceivedMessage` reads the request from a blocking `Connection` in its constructor.
+// `HTTPRequestParser` is fed whatever bytes have arrived instead, and hands out the requests as they complete.
+// It is a state machine over the request line, the headers, and the body, which is either of `Content-Length`
+// bytes or chunk-encoded. The bytes past the end of one request are kept as the beginning of the next one,
+// so that pipelined requests are parsed in order.
+//
+// Usage:
+//   parser.Feed(data, length);
+//   HTTPRequest request;
+//   while (parser.Next(request)) {
+//     ...
+//   }
+//   if (parser.Failed()) {
+//     // Respond with `parser.ErrorCode()` and close the connection.
+//   }
+//   if (parser.TakeContinue()) {
+//     // Respond with "100 Continue", for the client to send the body, or reject the request right away.
+//   }
+
+#ifndef BRICKS_NET_HTTP_IMPL_REQUEST_PARSER_H
+#define BRICKS_NET_HTTP_IMPL_REQUEST_PARSER_H
+
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+
+#include <strings.h>
+
+#include "../codes.h"
+
+namespace bricks {
+namespace net {
+
+const size_t kHTTPRequestParserMaxHeaderSize = 64 * 1024;
+const size_t kHTTPRequestParserMaxBodySize = 16 * 1024 * 1024;
+
+struct HTTPRequest {
+  typedef std::map<std::string, std::string> HeadersType;
+  std::string method;
+  std::string url;
+  std::string version;  // "HTTP/1.1", or empty if not provided in the request line.
+  HeadersType headers;
+  std::string body;
+  // Whether the client expects the connection to stay open after the response.
+  // The default for HTTP/1.1, unless it sent `Connection: close`, and an opt-in with `Connection: keep-alive`
+  // for older versions.
+  bool keep_alive = false;
+};
+
+class HTTPRequestParser {
+ public:
+  explicit HTTPRequestParser(size_t max_header_size = kHTTPRequestParserMaxHeaderSize,
+                             size_t max_body_size = kHTTPRequestParserMaxBodySize)
+      : max_header_size_(max_header_size), max_body_size_(max_body_size) {}
+
+  inline void Feed(const char* data, size_t length) {
+    if (offset_ && offset_ == buffer_.length()) {
+      buffer_.clear();
+      offset_ = 0;
+    }
+    buffer_.append(data, length);
+  }
+
+  // Moves the next complete request into `output` and returns true, or returns false
+  // if more data is needed or the request is malformed, see `Failed()`.
+  inline bool Next(HTTPRequest& output) {
+    while (state_ != State::Error) {
+      if (state_ == State::Body) {
+        if (buffer_.length() - offset_ < remaining_body_length_) {
+          return false;
+        }
+        request_.body.append(buffer_, offset_, remaining_body_length_);
+        offset_ += remaining_body_length_;
+        return Complete(output);
+      } else if (state_ == State::ChunkData) {
+        if (buffer_.length() - offset_ < remaining_body_length_) {
+          const size_t available = buffer_.length() - offset_;
+          request_.body.append(buffer_, offset_, available);
+          offset_ += available;
+          remaining_body_length_ -= available;
+          Compact();
+          return false;
+        }
+        request_.body.append(buffer_, offset_, remaining_body_length_);
+        offset_ += remaining_body_length_;
+        state_ = State::ChunkDataEnd;
+      } else {
+        if (!NextLine(line_)) {
+          return false;
+        }
+        if (OnLine(line_)) {
+          return Complete(output);
+        }
+      }
+    }
+    return false;
+  }
+
+  // Whether the data fed is not a valid HTTP request. The parser accepts no more requests then.
+  inline bool Failed() const { return state_ == State::Error; }
+
+  // The code to respond with when `Failed()`.
+  inline HTTPResponseCode ErrorCode() const { return error_code_; }
+
+  // Whether the headers of the request in progress have `Expect: 100-continue`, and its body is yet to come.
+  // True once per request, for the server to tell the client to send the body, or to reject the request
+  // with the body unsent. Not once the body has been received along with the headers.
+  inline bool TakeContinue() {
+    const bool result = continue_pending_;
+    continue_pending_ = false;
+    return result;
+  }
+
+  // Whether a request has been started, but not yet completed.
+  inline bool HasPartialRequest() const {
+    return state_ != State::RequestLine || offset_ < buffer_.length();
+  }
+
+ private:
+  enum class State { RequestLine, Headers, Body, ChunkSize, ChunkData, ChunkDataEnd, ChunkTrailer, Error };
+
+  // Extracts the next line, without its CRLF or LF, into `line`. Returns false if it has not fully arrived yet.
+  inline bool NextLine(std::string& line) {
+    const size_t end = buffer_.find('\n', offset_);
+    if (end == std::string::npos) {
+      if (buffer_.length() - offset_ > max_header_size_) {
+        Fail(HTTPResponseCode::RequestEntityTooLarge);
+      }
+      Compact();
+      return false;
+    }
+    size_t line_end = end;
+    if (line_end > offset_ && buffer_[line_end - 1] == '\r') {
+      --line_end;
+    }
+    line.assign(buffer_, offset_, line_end - offset_);
+    offset_ = end + 1;
+    return true;
+  }
+
+  // Returns true if the request is complete after this line.
+  inline bool OnLine(const std::string& line) {
+    switch (state_) {
+      case State::RequestLine:
+        // It's recommended by W3 to wait for the first line ignoring prior CRLF-s.
+        if (!line.empty()) {
+          ParseRequestLine(line);
+        }
+        return false;
+      case State::Headers:
+        if (!line.empty()) {
+          header_size_ += line.length();
+          if (header_size_ > max_header_size_) {
+            Fail(HTTPResponseCode::RequestEntityTooLarge);
+          } else {
+            ParseHeader(line);
+          }
+          return false;
+        } else if (chunked_) {
+          state_ = State::ChunkSize;
+          continue_pending_ = expect_continue_;
+          return false;
+        } else if (content_length_) {
+          state_ = State::Body;
+          remaining_body_length_ = content_length_;
+          continue_pending_ = expect_continue_;
+          return false;
+        } else {
+          return true;
+        }
+      case State::ChunkSize:
+        if (!line.empty()) {
+          char* end;
+          const unsigned long long length = std::strtoull(line.c_str(), &end, 16);
+          if (end == line.c_str() || (*end && *end != ';' && *end != ' ')) {
+            Fail(HTTPResponseCode::BadRequest);
+          } else if (length > max_body_size_ - request_.body.length()) {
+            Fail(HTTPResponseCode::RequestEntityTooLarge);
+          } else if (length) {
+            state_ = State::ChunkData;
+            remaining_body_length_ = static_cast<size_t>(length);
+          } else {
+            state_ = State::ChunkTrailer;
+          }
+        }
+        return false;
+      case State::ChunkDataEnd:
+        // The CRLF after the chunk.
+        state_ = State::ChunkSize;
+        if (!line.empty()) {
+          Fail(HTTPResponseCode::BadRequest);
+        }
+        return false;
+      case State::ChunkTrailer:
+        // Trailing headers, if any, are ignored.
+        return line.empty();
+      default:
+        return false;
+    }
+  }
+
+  inline void ParseRequestLine(const std::string& line) {
+    const size_t p1 = line.find(' ');
+    if (p1 == std::string::npos || !p1) {
+      Fail(HTTPResponseCode::BadRequest);
+      return;
+    }
+    request_.method.assign(line, 0, p1);
+    const size_t p2 = line.find(' ', p1 + 1);
+    if (p2 == std::string::npos) {
+      request_.url.assign(line, p1 + 1, std::string::npos);
+    } else {
+      request_.url.assign(line, p1 + 1, p2 - p1 - 1);
+      request_.version.assign(line, p2 + 1, std::string::npos);
+    }
+    request_.keep_alive = (request_.version == "HTTP/1.1");
+    state_ = State::Headers;
+  }
+
+  inline void ParseHeader(const std::string& line) {
+    const size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      // Ignore malformed headers, as `TemplatedHTTPReceivedMessage` does.
+      return;
+    }
+    size_t value_begin = colon + 1;
+    while (value_begin < line.length() && (line[value_begin] == ' ' || line[value_begin] == '\t')) {
+      ++value_begin;
+    }
+    size_t value_end = line.length();
+    while (value_end > value_begin && (line[value_end - 1] == ' ' || line[value_end - 1] == '\t')) {
+      --value_end;
+    }
+    // The key is moved into the map and the value is assigned in place, instead of copying both into it.
+    const HTTPRequest::HeadersType::iterator it =
+        request_.headers.insert(std::make_pair(std::string(line, 0, colon), std::string())).first;
+    const std::string& key = it->first;
+    std::string& value = it->second;
+    value.assign(line, value_begin, value_end - value_begin);
+    if (EqualsIgnoreCase(key, "Content-Length")) {
+      char* end;
+      const unsigned long long length = std::strtoull(value.c_str(), &end, 10);
+      if (end == value.c_str() || *end) {
+        Fail(HTTPResponseCode::BadRequest);
+      } else if (length > max_body_size_) {
+        Fail(HTTPResponseCode::RequestEntityTooLarge);
+      } else {
+        content_length_ = static_cast<size_t>(length);
+      }
+    } else if (EqualsIgnoreCase(key, "Transfer-Encoding")) {
+      chunked_ = EqualsIgnoreCase(value, "chunked");
+    } else if (EqualsIgnoreCase(key, "Expect")) {
+      // Only the HTTP/1.1 clients know to wait for, and to skip, "100 Continue".
+      expect_continue_ = request_.version == "HTTP/1.1" && EqualsIgnoreCase(value, "100-continue");
+    } else if (EqualsIgnoreCase(key, "Connection")) {
+      if (EqualsIgnoreCase(value, "close")) {
+        request_.keep_alive = false;
+      } else if (EqualsIgnoreCase(value, "keep-alive")) {
+        request_.keep_alive = true;
+      }
+    }
+  }
+
+  inline bool Complete(HTTPRequest& output) {
+    output = std::move(request_);
+    request_ = HTTPRequest();
+    state_ = State::RequestLine;
+    header_size_ = 0;
+    content_length_ = 0;
+    remaining_body_length_ = 0;
+    chunked_ = false;
+    expect_continue_ = false;
+    continue_pending_ = false;
+    Compact();
+    return true;
+  }
+
+  inline void Fail(HTTPResponseCode code) {
+    state_ = State::Error;
+    error_code_ = code;
+  }
+
+  // Drops the consumed bytes, once they make up most of the buffer.
+  inline void Compact() {
+    if (offset_ && offset_ * 2 >= buffer_.length()) {
+      buffer_.erase(0, offset_);
+      offset_ = 0;
+    }
+  }
+
+  static inline bool EqualsIgnoreCase(const std::string& a, const char* b) {
+    return a.length() == strlen(b) && !strncasecmp(a.c_str(), b, a.length());
+  }
+
+  const size_t max_header_size_;
+  const size_t max_body_size_;
+
+  std::string buffer_;
+  size_t offset_ = 0;
+  // The line being parsed, kept for its capacity to be reused across the lines and the requests.
+  std::string line_;
+
+  State state_ = State::RequestLine;
+  HTTPResponseCode error_code_ = HTTPResponseCode::BadRequest;
+  HTTPRequest request_;
+  size_t header_size_ = 0;
+  size_t content_length_ = 0;
+  size_t remaining_body_length_ = 0;
+  bool chunked_ = false;
+  bool expect_continue_ = false;
+  bool continue_pending_ = false;
+};
+
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_HTTP_IMPL_REQUEST_PARSER_H
@@ -0,0 +1,396 @@
+// In-memory cache of the HTTP responses, for the routes that respond with the same body to the same URL
+// for a while, such as the status pages polled by the dashboards, not to run their handlers on each request.
+//
+// The responses to the `GET` requests are cached by their URLs, the query included, for the time-to-live
+// of the route. Only the "200 OK" responses are cached, and only those without a `Content-Encoding` set.
+// Each cached response gets an `ETag`, the FNV-1a hash of its body, and the requests with a matching
+// `If-None-Match` are responded to with "304 Not Modified" and no body. The compressed variants of the body,
+// negotiated with `Accept-Encoding` as in `compression.h`, are made on the first request for each of them,
+// and are cached along with the body, with the `ETag`-s of their own.
+//
+// The cache is split into shards by the hash of the URL, each with a mutex of its own, for the requests
+// served by the threads of `HTTPServer` not to contend for one lock. Each shard holds its share of the bytes
+// the cache is bounded by, and evicts the least recently used responses once it is over it. The responses
+// larger than the share of one shard are not cached.
+//
+// * `CachedHTTPRouteHandler()` wraps a route of `HTTPRouter`, for `HTTPServer`.
+// * `SendCachedHTTPResponse()` responds on `HTTPServerConnection`, with the response made by `produce`
+//   on a miss.
+//
+// The concurrent requests for a URL that is not in the cache each run the handler, and the last response wins.
+
+#ifndef BRICKS_NET_HTTP_IMPL_RESPONSE_CACHE_H
+#define BRICKS_NET_HTTP_IMPL_RESPONSE_CACHE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "compression.h"
+#include "event_loop_server.h"
+#include "router.h"
+#include "server.h"
+
+#include "../codes.h"
+
+namespace bricks {
+namespace net {
+
+const size_t kHTTPResponseCacheDefaultMaxBytes = 64 * 1024 * 1024;
+const size_t kHTTPResponseCacheDefaultShards = 16;
+const char* const kETagHeaderKey = "ETag";
+const char* const kIfNoneMatchHeaderKey = "If-None-Match";
+
+namespace impl {
+
+inline std::string FindRequestHeader(const HTTPDefaultHelper& message, const char* name) {
+  return FindHTTPHeader(message.headers(), name);
+}
+
+inline std::string FindRequestHeader(const HTTPHeaderViewHelper& message, const char* name) {
+  HTTPHeaderViewHelper::Slice value;
+  return message.FindHeader(name, value) ? value.ToString() : std::string();
+}
+
+// The strong entity tag of the body, quoted.
+inline std::string HTTPETag(const std::string& body) {
+  uint64_t hash = 14695981039346656037ull;
+  for (char c : body) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+  }
+  std::string result(18, '"');
+  for (size_t i = 16; i; --i, hash >>= 4) {
+    result[i] = "0123456789abcdef"[hash & 15];
+  }
+  return result;
+}
+
+// Whether the value of `If-None-Match`, a comma-separated list of the entity tags or `*`, matches `etag`.
+// Compares the tags the weak way, as RFC 7232 requires for `If-None-Match`, ignoring the `W/` prefixes.
+inline bool HTTPETagMatches(const std::string& if_none_match, const std::string& etag) {
+  size_t begin = 0;
+  while (begin < if_none_match.length()) {
+    const size_t end = std::min(if_none_match.find(',', begin), if_none_match.length());
+    size_t first = if_none_match.find_first_not_of(" \t", begin);
+    if (first < end) {
+      const size_t last = if_none_match.find_last_not_of(" \t", end - 1);
+      if (!if_none_match.compare(first, 2, "W/")) {
+        first += 2;
+      }
+      if (!if_none_match.compare(first, last - first + 1, "*") ||
+          !if_none_match.compare(first, last - first + 1, etag)) {
+        return true;
+      }
+    }
+    begin = end + 1;
+  }
+  return false;
+}
+
+}  // namespace impl
+
+class HTTPResponseCache final {
+ public:
+  // The response to send, taken from the cache. `body` is null for "304 Not Modified".
+  struct Hit {
+    HTTPResponseCode code = HTTPResponseCode::OK;
+    std::string content_type;
+    HTTPHeadersType headers;
+    std::shared_ptr<const std::string> body;
+  };
+
+  explicit HTTPResponseCache(size_t max_bytes = kHTTPResponseCacheDefaultMaxBytes,
+                             size_t shards = kHTTPResponseCacheDefaultShards)
+      : shard_max_bytes_(max_bytes / std::max(shards, static_cast<size_t>(1))) {
+    for (size_t i = 0; i < std::max(shards, static_cast<size_t>(1)); ++i) {
+      shards_.emplace_back(new Shard());
+    }
+  }
+
+  // Returns true and fills `hit` if the response to `url` is in the cache and has not expired. Compresses
+  // the body and caches its compressed variant if the client accepts one that has not been made yet.
+  bool Lookup(const std::string& url,
+              const std::string& if_none_match,
+              const std::string& accept_encoding,
+              Hit& hit) {
+    Shard& shard = ShardOf(url);
+    std::shared_ptr<Entry> entry;
+    std::shared_ptr<const std::string> identity;
+    HTTPHeadersType headers;
+    HTTPContentEncoding encoding;
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      const auto cit = shard.index.find(url);
+      if (cit == shard.index.end()) {
+        return false;
+      }
+      entry = *cit->second;
+      if (std::chrono::steady_clock::now() >= entry->expires) {
+        shard.Erase(cit);
+        return false;
+      }
+      shard.lru.splice(shard.lru.begin(), shard.lru, cit->second);
+      headers = entry->headers;
+      encoding = impl::NegotiateResponseEncoding(accept_encoding,
+                                                 HTTPResponseCode::OK,
+                                                 entry->content_type,
+                                                 entry->Body(HTTPContentEncoding::Identity).length(),
+                                                 entry->level,
+                                                 headers);
+      if (encoding == HTTPContentEncoding::Identity && entry->Compressible()) {
+        // For the caches down the way to know the other clients may get the compressed variants.
+        headers.emplace_back("Vary", kAcceptEncodingHeaderKey);
+      }
+      const std::string etag = entry->ETag(encoding);
+      if (!if_none_match.empty() && impl::HTTPETagMatches(if_none_match, etag)) {
+        hit.code = HTTPResponseCode::NotModified;
+        hit.content_type = entry->content_type;
+        hit.headers.clear();
+        hit.headers.emplace_back(kETagHeaderKey, etag);
+        if (entry->Compressible()) {
+          hit.headers.emplace_back("Vary", kAcceptEncodingHeaderKey);
+        }
+        hit.body.reset();
+        return true;
+      }
+      hit.body = entry->bodies[static_cast<size_t>(encoding)];
+      identity = entry->bodies[static_cast<size_t>(HTTPContentEncoding::Identity)];
+    }
+    if (!hit.body) {
+      // Compressed outside of the lock, not to block the other requests to the shard meanwhile.
+      hit.body = std::make_shared<const std::string>(
+          CompressHTTPBody(identity->data(), identity->length(), encoding, entry->level));
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      const auto cit = shard.index.find(url);
+      if (cit != shard.index.end() && *cit->second == entry && !entry->bodies[static_cast<size_t>(encoding)]) {
+        entry->bodies[static_cast<size_t>(encoding)] = hit.body;
+        entry->bytes += hit.body->length();
+        shard.bytes += hit.body->length();
+        shard.Evict(shard_max_bytes_, entry.get());
+      }
+    }
+    hit.code = HTTPResponseCode::OK;
+    hit.content_type = entry->content_type;
+    hit.headers = std::move(headers);
+    hit.headers.emplace_back(kETagHeaderKey, entry->ETag(encoding));
+    return true;
+  }
+
+  // Caches the response to `url` for `ttl_ms`, with its compressed variants made with `level`, replacing
+  // the one cached before. Returns false if the response is not cacheable, or is too large to be cached.
+  bool Insert(const std::string& url,
+              const HTTPResponse& response,
+              uint64_t ttl_ms,
+              int level = kHTTPDefaultCompressionLevel) {
+    if (response.code != HTTPResponseCode::OK || !ttl_ms ||
+        impl::HasHTTPHeader(response.extra_headers, kContentEncodingHeaderKey)) {
+      return false;
+    }
+    std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+    entry->url = url;
+    entry->content_type = response.content_type;
+    entry->headers = response.extra_headers;
+    entry->etag = impl::HTTPETag(response.body);
+    entry->level = level;
+    entry->expires = std::chrono::steady_clock::now() + std::chrono::milliseconds(ttl_ms);
+    entry->bodies[static_cast<size_t>(HTTPContentEncoding::Identity)] =
+        std::make_shared<const std::string>(response.body);
+    entry->bytes = sizeof(Entry) + url.length() + entry->content_type.length() + entry->etag.length() +
+                   response.body.length();
+    for (const auto& header : entry->headers) {
+      entry->bytes += header.first.length() + header.second.length();
+    }
+    if (entry->bytes > shard_max_bytes_) {
+      return false;
+    }
+    Shard& shard = ShardOf(url);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto cit = shard.index.find(url);
+    if (cit != shard.index.end()) {
+      shard.Erase(cit);
+    }
+    shard.lru.push_front(entry);
+    shard.index[url] = shard.lru.begin();
+    shard.bytes += entry->bytes;
+    shard.Evict(shard_max_bytes_, entry.get());
+    return true;
+  }
+
+  void Erase(const std::string& url) {
+    Shard& shard = ShardOf(url);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto cit = shard.index.find(url);
+    if (cit != shard.index.end()) {
+      shard.Erase(cit);
+    }
+  }
+
+  void Clear() {
+    for (const auto& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      shard->lru.clear();
+      shard->index.clear();
+      shard->bytes = 0;
+    }
+  }
+
+  size_t Entries() const {
+    size_t result = 0;
+    for (const auto& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      result += shard->index.size();
+    }
+    return result;
+  }
+
+  // The bytes the cached responses take, their bodies, the compressed variants and the headers included.
+  size_t Bytes() const {
+    size_t result = 0;
+    for (const auto& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      result += shard->bytes;
+    }
+    return result;
+  }
+
+ private:
+  struct Entry {
+    std::string url;
+    std::string content_type;
+    HTTPHeadersType headers;
+    std::string etag;
+    int level;
+    std::chrono::steady_clock::time_point expires;
+    // By `HTTPContentEncoding`, the compressed ones made on the first request for them.
+    std::shared_ptr<const std::string> bodies[3];
+    size_t bytes;
+
+    const std::string& Body(HTTPContentEncoding encoding) const {
+      return *bodies[static_cast<size_t>(encoding)];
+    }
+
+    bool Compressible() const {
+      return level && Body(HTTPContentEncoding::Identity).length() >= kHTTPCompressionMinBodyLength &&
+             IsHTTPContentTypeCompressible(content_type);
+    }
+
+    // The variants are different representations, and have different entity tags.
+    std::string ETag(HTTPContentEncoding encoding) const {
+      return encoding == HTTPContentEncoding::Identity
+                 ? etag
+                 : etag.substr(0, etag.length() - 1) + '-' + HTTPContentEncodingName(encoding) + '"';
+    }
+  };
+
+  struct Shard {
+    typedef std::list<std::shared_ptr<Entry>> LRU;
+    typedef std::unordered_map<std::string, LRU::iterator> Index;
+
+    std::mutex mutex;
+    LRU lru;  // The most recently used first.
+    Index index;
+    size_t bytes = 0;
+
+    void Erase(Index::const_iterator cit) {
+      bytes -= (*cit->second)->bytes;
+      lru.erase(cit->second);
+      index.erase(cit);
+    }
+
+    // Evicts the least recently used responses but `keep` until the shard fits into `max_bytes`.
+    void Evict(size_t max_bytes, const Entry* keep) {
+      while (bytes > max_bytes && lru.back().get() != keep) {
+        Erase(index.find(lru.back()->url));
+      }
+    }
+  };
+
+  Shard& ShardOf(const std::string& url) { return *shards_[std::hash<std::string>()(url) % shards_.size()]; }
+
+  const size_t shard_max_bytes_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  HTTPResponseCache(const HTTPResponseCache&) = delete;
+  void operator=(const HTTPResponseCache&) = delete;
+};
+
+// The route handler for `HTTPRouter` that responds from `cache`, and runs `handler` on a miss, caching
+// its response for `ttl_ms`. The cache must outlive the router.
+inline HTTPRouteHandler CachedHTTPRouteHandler(HTTPResponseCache& cache,
+                                               HTTPRouteHandler handler,
+                                               uint64_t ttl_ms,
+                                               int level = kHTTPDefaultCompressionLevel) {
+  return [&cache, handler, ttl_ms, level](
+      const HTTPRequest& request, const HTTPRouteParameters& parameters, HTTPResponse& response) {
+    if (request.method != "GET") {
+      handler(request, parameters, response);
+      return;
+    }
+    const std::string if_none_match = impl::FindHTTPHeader(request.headers, kIfNoneMatchHeaderKey);
+    const std::string accept_encoding = impl::FindHTTPHeader(request.headers, kAcceptEncodingHeaderKey);
+    HTTPResponseCache::Hit hit;
+    if (!cache.Lookup(request.url, if_none_match, accept_encoding, hit)) {
+      handler(request, parameters, response);
+      if (!cache.Insert(request.url, response, ttl_ms, level) ||
+          !cache.Lookup(request.url, if_none_match, accept_encoding, hit)) {
+        CompressHTTPResponse(request, response, level);
+        return;
+      }
+    }
+    response.code = hit.code;
+    response.content_type = hit.content_type;
+    response.extra_headers = std::move(hit.headers);
+    if (hit.body) {
+      response.body = *hit.body;
+    } else {
+      response.body.clear();
+    }
+  };
+}
+
+// Responds to the request of `connection` from `cache`, and with the response made by `produce` on a miss,
+// caching it for `ttl_ms`. The cached bodies are sent as they are, with no copies.
+template <class HELPER>
+inline void SendCachedHTTPResponse(TemplatedHTTPServerConnection<HELPER>& connection,
+                                   HTTPResponseCache& cache,
+                                   uint64_t ttl_ms,
+                                   const std::function<void(HTTPResponse&)>& produce,
+                                   int level = kHTTPDefaultCompressionLevel) {
+  const auto& message = connection.Message();
+  HTTPResponse response;
+  if (message.Method() != "GET") {
+    produce(response);
+    connection.SendHTTPResponse(response.body, response.code, response.content_type, response.extra_headers);
+    return;
+  }
+  const std::string if_none_match = impl::FindRequestHeader(message, kIfNoneMatchHeaderKey);
+  const std::string accept_encoding = impl::FindRequestHeader(message, kAcceptEncodingHeaderKey);
+  HTTPResponseCache::Hit hit;
+  if (!cache.Lookup(message.URL(), if_none_match, accept_encoding, hit)) {
+    produce(response);
+    if (!cache.Insert(message.URL(), response, ttl_ms, level) ||
+        !cache.Lookup(message.URL(), if_none_match, accept_encoding, hit)) {
+      SendCompressedHTTPResponse(
+          connection, response.body, response.code, response.content_type, response.extra_headers, level);
+      return;
+    }
+  }
+  if (hit.body) {
+    connection.SendHTTPResponse(*hit.body, hit.code, hit.content_type, hit.headers);
+  } else {
+    connection.SendHTTPResponse(std::string(), hit.code, hit.content_type, hit.headers);
+  }
+}
+
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_HTTP_IMPL_RESPONSE_CACHE_H
@@ -0,0 +1,287 @@
+// HTTP request router: dispatches the requests to the handlers registered by method and path pattern.
+//
+// The patterns are the literal paths, such as "/healthz", the paths with parameters, which match one
+// path segment each, such as "/users/:id/posts", and the prefixes, which end with a catch-all parameter
+// matching the rest of the path, possibly empty, such as "/static/*file". The parameters take whole
+// path segments: ':' and '*' must follow a '/'.
+//
+// The patterns are compiled into a radix trie as they are registered, with the literal parts of the patterns
+// on its edges. Dispatching walks the trie along the path of the URL, the query and fragment excluded, and
+// prefers the literal edges to the parameters and the parameters to the catch-alls, backtracking if needed.
+// It does not allocate: the values of the parameters point into the URL, and are valid while it is.
+//
+// `GenericHTTPRouter<T_HANDLER>` keeps the handlers of any type, for the servers on `HTTPServerConnection`.
+// `HTTPRouter` is the one for `HTTPServer`, and responds with "404 Not Found" and "405 Method Not Allowed"
+// to the requests it has no handler for.
+
+#ifndef BRICKS_NET_HTTP_IMPL_ROUTER_H
+#define BRICKS_NET_HTTP_IMPL_ROUTER_H
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "event_loop_server.h"
+#include "request_parser.h"
+
+#include "../codes.h"
+
+#include "../../exceptions.h"
+
+namespace bricks {
+namespace net {
+
+const size_t kHTTPRouterMaxParameters = 8;
+
+// The values of the parameters of the matched pattern, in the order they appear in it.
+class HTTPRouteParameters final {
+ public:
+  struct Parameter {
+    const std::string* name;
+    const char* value;
+    size_t length;
+  };
+
+  size_t Size() const { return size_; }
+  const Parameter& operator[](size_t index) const { return parameters_[index]; }
+
+  bool Has(const std::string& name) const { return Find(name) != nullptr; }
+
+  // Returns the value of the parameter, or an empty string if the pattern has no such parameter.
+  std::string Get(const std::string& name) const {
+    const Parameter* parameter = Find(name);
+    return parameter ? std::string(parameter->value, parameter->length) : std::string();
+  }
+
+ private:
+  template <typename T_HANDLER>
+  friend class GenericHTTPRouter;
+
+  const Parameter* Find(const std::string& name) const {
+    for (size_t i = 0; i < size_; ++i) {
+      if (*parameters_[i].name == name) {
+        return &parameters_[i];
+      }
+    }
+    return nullptr;
+  }
+
+  Parameter parameters_[kHTTPRouterMaxParameters];
+  size_t size_ = 0;
+};
+
+template <typename T_HANDLER>
+class GenericHTTPRouter {
+ public:
+  typedef T_HANDLER HandlerType;
+
+  GenericHTTPRouter() : root_(new Node()) {}
+
+  // Throws `HTTPRouteInvalidPatternException` for the malformed patterns, and `HTTPRouteConflictException`
+  // if the method and the pattern are registered already, or if a parameter is named differently
+  // than the one at the same place in a pattern registered before.
+  void Register(const std::string& method, const std::string& pattern, T_HANDLER handler) {
+    if (pattern.empty() || pattern[0] != '/') {
+      throw HTTPRouteInvalidPatternException();
+    }
+    size_t parameters = 0;
+    Node* node = root_.get();
+    size_t i = 0;
+    while (i < pattern.length()) {
+      const char c = pattern[i];
+      if (c == ':' || c == '*') {
+        if (pattern[i - 1] != '/' || ++parameters > kHTTPRouterMaxParameters) {
+          throw HTTPRouteInvalidPatternException();
+        }
+        const size_t end = std::min(pattern.find('/', i), pattern.length());
+        const std::string name = pattern.substr(i + 1, end - i - 1);
+        if (name.empty() || (c == '*' && end != pattern.length())) {
+          throw HTTPRouteInvalidPatternException();
+        }
+        std::unique_ptr<Node>& child = (c == ':') ? node->parameter : node->catch_all;
+        if (!child) {
+          child.reset(new Node());
+          child->name = name;
+        } else if (child->name != name) {
+          throw HTTPRouteConflictException();
+        }
+        node = child.get();
+        i = end;
+      } else {
+        const size_t end = std::min(pattern.find_first_of(":*", i), pattern.length());
+        node = InsertLiteral(node, pattern.substr(i, end - i));
+        i = end;
+      }
+    }
+    for (const auto& route : node->routes) {
+      if (route.first == method) {
+        throw HTTPRouteConflictException();
+      }
+    }
+    node->routes.emplace_back(method, std::move(handler));
+  }
+
+  // Returns the handler for the method and the URL, with their parameters in `parameters`, or null.
+  // Sets `path_found`, if provided, to whether the path matches a pattern, for whichever methods.
+  const T_HANDLER* Find(const std::string& method,
+                        const std::string& url,
+                        HTTPRouteParameters& parameters,
+                        bool* path_found = nullptr) const {
+    parameters.size_ = 0;
+    const Node* node = Match(root_.get(), url.c_str(), url.c_str() + PathLength(url), parameters);
+    if (path_found) {
+      *path_found = (node != nullptr);
+    }
+    if (node) {
+      for (const auto& route : node->routes) {
+        if (route.first == method) {
+          return &route.second;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  // The methods registered for the path of the URL, comma-separated, for the "Allow" header.
+  std::string AllowedMethods(const std::string& url) const {
+    HTTPRouteParameters parameters;
+    const Node* node = Match(root_.get(), url.c_str(), url.c_str() + PathLength(url), parameters);
+    std::string result;
+    if (node) {
+      for (const auto& route : node->routes) {
+        result += (result.empty() ? "" : ", ") + route.first;
+      }
+    }
+    return result;
+  }
+
+ private:
+  struct Node {
+    // The literal part of the path on the edge to this node, for the literal children.
+    std::string label;
+    // The name of the parameter, for the parameter and the catch-all children.
+    std::string name;
+    // The first characters of the labels of the literal children, for the lookup not to compare them all.
+    std::string first_characters;
+    std::vector<std::unique_ptr<Node>> children;
+    std::unique_ptr<Node> parameter;
+    std::unique_ptr<Node> catch_all;
+    std::vector<std::pair<std::string, T_HANDLER>> routes;
+  };
+
+  static size_t PathLength(const std::string& url) { return std::min(url.find_first_of("?#"), url.length()); }
+
+  // Returns the node at the end of the literal path from `node`, splitting the edges as necessary.
+  static Node* InsertLiteral(Node* node, const std::string& literal) {
+    size_t i = 0;
+    while (i < literal.length()) {
+      const size_t index = node->first_characters.find(literal[i]);
+      if (index == std::string::npos) {
+        std::unique_ptr<Node> child(new Node());
+        child->label = literal.substr(i);
+        node->first_characters += literal[i];
+        node->children.push_back(std::move(child));
+        return node->children.back().get();
+      }
+      std::unique_ptr<Node>& child = node->children[index];
+      const std::string& label = child->label;
+      size_t common = 0;
+      while (common < label.length() && i + common < literal.length() && label[common] == literal[i + common]) {
+        ++common;
+      }
+      if (common < label.length()) {
+        std::unique_ptr<Node> split(new Node());
+        split->label = label.substr(0, common);
+        child->label.erase(0, common);
+        split->first_characters += child->label[0];
+        split->children.push_back(std::move(child));
+        child = std::move(split);
+      }
+      node = child.get();
+      i += common;
+    }
+    return node;
+  }
+
+  static const Node* Match(const Node* node,
+                           const char* begin,
+                           const char* end,
+                           HTTPRouteParameters& parameters) {
+    if (begin == end && !node->routes.empty()) {
+      return node;
+    }
+    if (begin != end) {
+      const size_t index = node->first_characters.find(*begin);
+      if (index != std::string::npos) {
+        const Node* child = node->children[index].get();
+        const size_t length = child->label.length();
+        if (static_cast<size_t>(end - begin) >= length && !std::memcmp(begin, child->label.data(), length)) {
+          const Node* result = Match(child, begin + length, end, parameters);
+          if (result) {
+            return result;
+          }
+        }
+      }
+      if (node->parameter && *begin != '/') {
+        const char* segment_end = begin;
+        while (segment_end != end && *segment_end != '/') {
+          ++segment_end;
+        }
+        const size_t size = parameters.size_;
+        const size_t length = static_cast<size_t>(segment_end - begin);
+        parameters.parameters_[parameters.size_++] = {&node->parameter->name, begin, length};
+        const Node* result = Match(node->parameter.get(), segment_end, end, parameters);
+        if (result) {
+          return result;
+        }
+        parameters.size_ = size;
+      }
+    }
+    if (node->catch_all && !node->catch_all->routes.empty()) {
+      const size_t length = static_cast<size_t>(end - begin);
+      parameters.parameters_[parameters.size_++] = {&node->catch_all->name, begin, length};
+      return node->catch_all.get();
+    }
+    return nullptr;
+  }
+
+  std::unique_ptr<Node> root_;
+
+  GenericHTTPRouter(const GenericHTTPRouter&) = delete;
+  void operator=(const GenericHTTPRouter&) = delete;
+};
+
+typedef std::function<void(const HTTPRequest&, const HTTPRouteParameters&, HTTPResponse&)> HTTPRouteHandler;
+
+class HTTPRouter final : public GenericHTTPRouter<HTTPRouteHandler> {
+ public:
+  void operator()(const HTTPRequest& request, HTTPResponse& response) const {
+    HTTPRouteParameters parameters;
+    bool path_found;
+    const HTTPRouteHandler* handler = Find(request.method, request.url, parameters, &path_found);
+    if (handler) {
+      (*handler)(request, parameters, response);
+    } else if (path_found) {
+      response.code = HTTPResponseCode::MethodNotAllowed;
+      response.body = HTTPResponseCodeAsStringGenerator::CodeAsString(response.code);
+      response.extra_headers.push_back(std::make_pair("Allow", AllowedMethods(request.url)));
+    } else {
+      response.code = HTTPResponseCode::NotFound;
+      response.body = HTTPResponseCodeAsStringGenerator::CodeAsString(response.code);
+    }
+  }
+
+  // The handler for `HTTPServer`. The router must outlive the server.
+  HTTPServer::HandlerType Handler() const {
+    return [this](const HTTPRequest& request, HTTPResponse& response) { (*this)(request, response); };
+  }
+};
+
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_HTTP_IMPL_ROUTER_H
@@ -0,0 +1,116 @@
+// Vectorized byte scanning for the HTTP parsers: finding CRLF, ':' and ' ' in the received data.
+//
+// Compares 32 bytes at a time with AVX2, when compiled for it, `-mavx2`, 16 bytes at a time with SSE2,
+// which every x86-64 CPU has, or with NEON on ARM. Falls back to `memchr()` otherwise.
+// All scans are bounded by an explicit end pointer: the data does not have to be NUL-terminated,
+// and nothing past `end` is read.
+
+#ifndef BRICKS_NET_HTTP_IMPL_SCAN_H
+#define BRICKS_NET_HTTP_IMPL_SCAN_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace bricks {
+namespace net {
+namespace scan {
+
+// Returns the pointer to the first occurrence of `c` in `[begin, end)`, or `nullptr`.
+inline const char* FindChar(const char* begin, const char* end, char c) {
+  const char* p = begin;
+#if defined(__AVX2__)
+  const __m256i needle = _mm256_set1_epi8(c);
+  for (; end - p >= 32; p += 32) {
+    const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    const uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle)));
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i needle = _mm_set1_epi8(c);
+  // Skip 64 bytes at a time while there is no match, for long lines.
+  for (; end - p >= 64; p += 64) {
+    const __m128i* block = reinterpret_cast<const __m128i*>(p);
+    const __m128i eq = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(_mm_loadu_si128(block), needle),
+                                                 _mm_cmpeq_epi8(_mm_loadu_si128(block + 1), needle)),
+                                    _mm_or_si128(_mm_cmpeq_epi8(_mm_loadu_si128(block + 2), needle),
+                                                 _mm_cmpeq_epi8(_mm_loadu_si128(block + 3), needle)));
+    if (_mm_movemask_epi8(eq)) {
+      break;
+    }
+  }
+  for (; end - p >= 16; p += 16) {
+    const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    const uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)));
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t needle = vdupq_n_u8(static_cast<uint8_t>(c));
+  for (; end - p >= 16; p += 16) {
+    const uint8x16_t eq = vceqq_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(p)), needle);
+    // Narrow each byte of the comparison result to four bits, as NEON has no `movemask`.
+    const uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+    if (mask) {
+      return p + (__builtin_ctzll(mask) >> 2);
+    }
+  }
+#endif
+  return p < end ? static_cast<const char*>(memchr(p, c, static_cast<size_t>(end - p))) : nullptr;
+}
+
+inline char* FindChar(char* begin, char* end, char c) {
+  return const_cast<char*>(FindChar(static_cast<const char*>(begin), static_cast<const char*>(end), c));
+}
+
+// Returns the pointer to the '\r' of the first CRLF in `[begin, end)`, or `nullptr`.
+// Scans for the '\n'-s, which are rarer than the '\r'-s in binary data, and checks the byte before each.
+inline const char* FindCRLF(const char* begin, const char* end) {
+  if (end - begin < 2) {
+    return nullptr;
+  }
+  const char* p = begin + 1;
+  while ((p = FindChar(p, end, '\n'))) {
+    if (p[-1] == '\r') {
+      return p - 1;
+    }
+    ++p;
+  }
+  return nullptr;
+}
+
+inline char* FindCRLF(char* begin, char* end) {
+  return const_cast<char*>(FindCRLF(static_cast<const char*>(begin), static_cast<const char*>(end)));
+}
+
+inline char ToLowerASCII(char c) {
+  return (c >= 'A' && c <= 'Z') ? static_cast<char>(c + ('a' - 'A')) : c;
+}
+
+// Case-insensitive comparison of `[s, s + length)` to a known NUL-terminated token, such as a header name.
+// Stops at the first mismatch, which, for header names, is most often the first character or the length.
+inline bool EqualsIgnoreCase(const char* s, size_t length, const char* known) {
+  for (size_t i = 0; i < length; ++i) {
+    if (!known[i] || ToLowerASCII(s[i]) != ToLowerASCII(known[i])) {
+      return false;
+    }
+  }
+  return !known[length];
+}
+
+}  // namespace scan
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_HTTP_IMPL_SCAN_H
@@ -8,15 +8,35 @@
 
 // HTTP message: http://www.w3.org/Protocols/rfc2616/rfc2616.html
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <map>
-#include <sstream>
+#include <memory>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "scan.h"
+
 #include "../codes.h"
 
 #include "../../exceptions.h"
 
+#include "../../../file/exceptions.h"
+#include "../../../memory/accounting.h"
+#include "../../../memory/memory_resource.h"
+#include "../../../metrics/metrics.h"
+
 #include "../../tcp/tcp.h"
 
 #include "../../../util/util.h"
@@ -26,6 +46,16 @@ namespace net {
 
 typedef std::vector<std::pair<std::string, std::string>> HTTPHeadersType;
 
+// The buffer a message is received into, allocated from the `memory::MemoryResource` given to the message.
+typedef memory::Vector<char> HTTPMessageBuffer;
+
+// The default resource of the buffers of the messages, accounted for as "net_http_messages",
+// see `memory/accounting.h`.
+inline memory::MemoryResource* HTTPMessageMemoryResource() {
+  static memory::MemoryResource* resource = memory::SubsystemMemoryResource("net_http_messages");
+  return resource;
+}
+
 // HTTP constants to parse the header and extract method, URL, headers and body.
 namespace {
 
@@ -36,9 +66,76 @@ const size_t kHeaderKeyValueSeparatorLength = CompileTimeStringLength(kHeaderKey
 const char* const kContentLengthHeaderKey = "Content-Length";
 const char* const kTransferEncodingHeaderKey = "Transfer-Encoding";
 const char* const kTransferEncodingChunkedValue = "chunked";
+const char* const kConnectionHeaderKey = "Connection";
+const char* const kConnectionKeepAliveValue = "keep-alive";
+const char* const kConnectionCloseValue = "close";
+const char* const kHTTP11Version = "HTTP/1.1";
+const char* const kRangeHeaderKey = "Range";
+const char* const kExpectHeaderKey = "Expect";
+const char* const kExpectContinueValue = "100-continue";
+const char kHTTPContinueResponse[] = "HTTP/1.1 100 Continue\r\n\r\n";
+const int kDefaultInitialMessageBufferSize = 1600;
+const double kDefaultMessageBufferGrowthK = 1.95;
+const size_t kDefaultMessageBufferMaxGrowthDueToContentLength = 1024 * 1024;
+const size_t kDefaultStreamingBufferSize = 64 * 1024;
+const size_t kMinStreamingBufferSize = 1024;
+// The buffers of the messages are recycled, see `RecycledHTTPMessageBuffers`, unless they have grown past this,
+// such as to receive a large body, for the idle connections to not hold on to the memory.
+const size_t kMaxRecycledMessageBufferSize = 2 * kDefaultStreamingBufferSize + kDefaultInitialMessageBufferSize;
+const size_t kMaxRecycledMessageBuffersPerThread = 8;
+const size_t kDefaultChunkedResponseBufferSize = 16 * 1024;
+const uint64_t kDefaultChunkedResponseFlushIntervalMs = 100;
+const size_t kChunkedContentLength = static_cast<size_t>(-1);
+
+// The metrics of all the HTTP messages received, in `bricks::metrics::Registry::Singleton()`.
+struct HTTPMessageMetrics {
+  metrics::Counter& messages_received;
+  metrics::Histogram& message_bytes;
+
+  static HTTPMessageMetrics& Singleton() {
+    metrics::Registry& registry = metrics::Registry::Singleton();
+    static HTTPMessageMetrics singleton{
+        registry.GetCounter("bricks_http_messages_received_total", "The HTTP messages received and parsed."),
+        registry.GetHistogram("bricks_http_message_bytes",
+                              "The sizes of the HTTP messages received, without the streamed bodies.")};
+    return singleton;
+  }
+};
 
 }  // namespace constants
 
+// The buffers of the messages destroyed on this thread, for the next messages, such as those of the new
+// connections, to take instead of allocating their own. Only the buffers of `HTTPMessageMemoryResource()` are
+// kept, as the other resources, such as a per-request arena, may not outlive them.
+struct RecycledHTTPMessageBuffers {
+  // A buffer of `size` bytes, recycled if there is one.
+  static HTTPMessageBuffer Take(size_t size, memory::MemoryResource* resource) {
+    std::vector<HTTPMessageBuffer>& buffers = Buffers();
+    if (resource == HTTPMessageMemoryResource() && !buffers.empty()) {
+      HTTPMessageBuffer buffer(std::move(buffers.back()));
+      buffers.pop_back();
+      buffer.resize(size);
+      return buffer;
+    }
+    return HTTPMessageBuffer(size, resource);
+  }
+
+  static void Give(HTTPMessageBuffer&& buffer) {
+    std::vector<HTTPMessageBuffer>& buffers = Buffers();
+    if (buffer.get_allocator().Resource() == HTTPMessageMemoryResource() && buffer.capacity() &&
+        buffer.capacity() <= kMaxRecycledMessageBufferSize &&
+        buffers.size() < kMaxRecycledMessageBuffersPerThread) {
+      buffers.push_back(std::move(buffer));
+    }
+  }
+
+ private:
+  static std::vector<HTTPMessageBuffer>& Buffers() {
+    static thread_local std::vector<HTTPMessageBuffer> buffers;
+    return buffers;
+  }
+};
+
 // HTTPDefaultHelper handles headers and chunked transfers.
 // One can inject a custom implementaion of it to avoid keeping all HTTP body in memory.
 // TODO(dkorolev): This is not yet the case, but will be soon once I fix HTTP parse code.
@@ -48,6 +145,16 @@ class HTTPDefaultHelper {
   const HeadersType& headers() const { return headers_; }
 
  protected:
+  // Called before parsing, with the buffer into which the keys and values passed to `OnHeader()` point.
+  // The buffer may be reallocated as more data is read, so the pointers are only valid during the call.
+  inline void OnBuffer(const HTTPMessageBuffer&) {}
+
+  // Called before the next message is received in place of this one, see `ReceiveNext()`.
+  inline void OnReset() {
+    headers_.clear();
+    body_.clear();
+  }
+
   inline void OnHeader(const char* key, const char* value) { headers_[key] = value; }
 
   inline void OnChunk(const char* chunk, size_t length) { body_.append(chunk, length); }
@@ -62,34 +169,419 @@ class HTTPDefaultHelper {
   std::string body_;
 };
 
+// HTTPHeaderViewHelper keeps the headers in place, as offsets into the buffer of the message,
+// to not allocate two strings and a map node per header. The first `kInlineHeaders` headers are stored
+// within the helper itself, and the rest in a flat vector.
+//
+// Getters, all valid for the lifetime of the message:
+// * size_t NumberOfHeaders(), HTTPHeaderViewHelper::Slice HeaderName(i), HeaderValue(i).
+// * bool FindHeader(name, Slice& value), case-insensitive. The last one wins if the header is repeated.
+class HTTPHeaderViewHelper {
+ public:
+  HTTPHeaderViewHelper() = default;
+  // `length` bytes at `data`, followed by a '\0'.
+  struct Slice {
+    const char* data;
+    size_t length;
+    inline std::string ToString() const { return std::string(data, length); }
+  };
+
+  inline size_t NumberOfHeaders() const { return number_of_headers_; }
+  inline Slice HeaderName(size_t index) const { return MakeSlice(Header(index).key); }
+  inline Slice HeaderValue(size_t index) const { return MakeSlice(Header(index).value); }
+
+  inline bool FindHeader(const char* name, Slice& value) const {
+    for (size_t i = number_of_headers_; i--;) {
+      const HeaderOffsets& header = Header(i);
+      if (scan::EqualsIgnoreCase(&(*buffer_)[header.key.offset], header.key.length, name)) {
+        value = MakeSlice(header.value);
+        return true;
+      }
+    }
+    return false;
+  }
+  inline bool HasHeader(const char* name) const {
+    Slice unused;
+    return FindHeader(name, unused);
+  }
+
+ protected:
+  inline void OnBuffer(const HTTPMessageBuffer& buffer) { buffer_ = &buffer; }
+
+  inline void OnReset() {
+    number_of_headers_ = 0;
+    more_headers_.clear();
+    body_.clear();
+  }
+
+  inline void OnHeader(const char* key, const char* value) {
+    const char* const base = &(*buffer_)[0];
+    const HeaderOffsets header{{static_cast<size_t>(key - base), strlen(key)},
+                               {static_cast<size_t>(value - base), strlen(value)}};
+    if (number_of_headers_ < kInlineHeaders) {
+      inline_headers_[number_of_headers_] = header;
+    } else {
+      more_headers_.push_back(header);
+    }
+    ++number_of_headers_;
+  }
+
+  inline void OnChunk(const char* chunk, size_t length) { body_.append(chunk, length); }
+
+  inline void OnChunkedBodyDone(const char*& begin, const char*& end) {
+    begin = body_.data();
+    end = begin + body_.length();
+  }
+
+ private:
+  enum { kInlineHeaders = 16 };
+  struct OffsetAndLength {
+    size_t offset;
+    size_t length;
+  };
+  struct HeaderOffsets {
+    OffsetAndLength key;
+    OffsetAndLength value;
+  };
+
+  inline const HeaderOffsets& Header(size_t index) const {
+    return index < kInlineHeaders ? inline_headers_[index] : more_headers_[index - kInlineHeaders];
+  }
+  inline Slice MakeSlice(const OffsetAndLength& x) const { return Slice{&(*buffer_)[x.offset], x.length}; }
+
+  // Non-copyable, as `buffer_` belongs to the message.
+  HTTPHeaderViewHelper(const HTTPHeaderViewHelper&) = delete;
+  void operator=(const HTTPHeaderViewHelper&) = delete;
+
+  const HTTPMessageBuffer* buffer_ = nullptr;
+  size_t number_of_headers_ = 0;
+  HeaderOffsets inline_headers_[kInlineHeaders];
+  std::vector<HeaderOffsets> more_headers_;
+  std::string body_;
+};
+
+// HTTPStreamingBodyHelper makes TemplatedHTTPReceivedMessage stop reading once the headers are parsed,
+// for the body to be passed to a callback with `StreamBody()`, through a buffer of a bounded size,
+// instead of being kept in memory. The headers are kept as with HTTPHeaderViewHelper.
+class HTTPStreamingBodyHelper : public HTTPHeaderViewHelper {};
+
 // In constructor, TemplatedHTTPReceivedMessage parses HTTP response from `Connection&` is was provided with.
 // Extracts method, URL, and, if provided, the body.
 //
 // Getters:
 // * std::string URL().
 // * std::string Method().
+// * std::string Version(), such as "HTTP/1.1", empty if not provided.
+// * bool KeepAlive(), whether the peer expects the connection to stay open after this message.
+// * std::string RangeHeader(), the value of the `Range` header, empty if not provided.
+// * bool ExpectsContinue(), whether the peer has sent `Expect: 100-continue`, to wait for "100 Continue"
+//   before sending the body.
 // * bool HasBody(), std::string Body(), size_t BodyLength(), const char* Body{Begin,End}().
 //
+// The bytes read past the end of this message, the beginning of the next one sent on the same connection,
+// are returned by `UnparsedBytes()`, to construct the next message from.
+//
+// With HTTPStreamingBodyHelper, `HasBody()` is false, and the body is read by `StreamBody()` instead.
+//
+// A request with `Expect: 100-continue` is sent "100 Continue" before its body is read: right away, or,
+// with HTTPStreamingBodyHelper, by `StreamBody()`, for the handler to respond before the client has sent
+// the body it does not want, see `BodyAwaitsContinue()`.
+//
+// The buffer of the message, which holds the headers and the body, unless it is chunked, is allocated
+// from `resource`, such as a `memory::MonotonicBufferResource` arena per request. The resource must outlive
+// the message. The buffers of the default resource are recycled, see `RecycledHTTPMessageBuffers`.
+// `ReceiveNext()` receives the next message on the same connection into the same buffer.
+//
 // Exceptions:
 // * HTTPNoBodyProvidedException         : When attempting to access body when HasBody() is false.
 // * HTTPConnectionClosedByPeerException : When the server is using chunked transfer and doesn't fully send one.
+// * HTTPMalformedBodyException          : When `StreamBody()` can not parse the chunked body.
 template <class HELPER>
 class TemplatedHTTPReceivedMessage : public HELPER {
  public:
-  inline TemplatedHTTPReceivedMessage(Connection& c,
-                                      const int intial_buffer_size = 1600,
-                                      const double buffer_growth_k = 1.95,
-                                      const size_t buffer_max_growth_due_to_content_length = 1024 * 1024)
-      : buffer_(intial_buffer_size) {
+  inline TemplatedHTTPReceivedMessage(
+      Connection& c,
+      const int intial_buffer_size = kDefaultInitialMessageBufferSize,
+      const double buffer_growth_k = kDefaultMessageBufferGrowthK,
+      const size_t buffer_max_growth_due_to_content_length = kDefaultMessageBufferMaxGrowthDueToContentLength,
+      memory::MemoryResource* resource = HTTPMessageMemoryResource())
+      : buffer_(RecycledHTTPMessageBuffers::Take(intial_buffer_size, resource)) {
+    HELPER::OnBuffer(buffer_);
+    Receive(c, 0, buffer_growth_k, buffer_max_growth_due_to_content_length);
+  }
+
+  // Constructs the message from the `UnparsedBytes()` of the previous one, reading the rest of it, if any.
+  inline TemplatedHTTPReceivedMessage(
+      Connection& c,
+      std::vector<char>&& unparsed_bytes,
+      const int intial_buffer_size = kDefaultInitialMessageBufferSize,
+      const double buffer_growth_k = kDefaultMessageBufferGrowthK,
+      const size_t buffer_max_growth_due_to_content_length = kDefaultMessageBufferMaxGrowthDueToContentLength,
+      memory::MemoryResource* resource = HTTPMessageMemoryResource())
+      : buffer_(RecycledHTTPMessageBuffers::Take(
+            std::max(unparsed_bytes.size() + 1, static_cast<size_t>(intial_buffer_size)), resource)) {
+    std::copy(unparsed_bytes.begin(), unparsed_bytes.end(), buffer_.begin());
+    HELPER::OnBuffer(buffer_);
+    Receive(c, unparsed_bytes.size(), buffer_growth_k, buffer_max_growth_due_to_content_length);
+  }
+
+  // Reads the message through `c`, starting with the bytes buffered in it, and leaves in it the bytes
+  // received past the end of the message, for whatever reads the connection next.
+  inline TemplatedHTTPReceivedMessage(
+      BufferedConnection& c,
+      const int intial_buffer_size = kDefaultInitialMessageBufferSize,
+      const double buffer_growth_k = kDefaultMessageBufferGrowthK,
+      const size_t buffer_max_growth_due_to_content_length = kDefaultMessageBufferMaxGrowthDueToContentLength,
+      memory::MemoryResource* resource = HTTPMessageMemoryResource())
+      : TemplatedHTTPReceivedMessage(c.GetConnection(),
+                                     c.TakeBuffered(),
+                                     intial_buffer_size,
+                                     buffer_growth_k,
+                                     buffer_max_growth_due_to_content_length,
+                                     resource) {
+    static_assert(!std::is_base_of<HTTPStreamingBodyHelper, HELPER>::value,
+                  "The streamed body is read past the bytes buffered, use the `Connection` instead.");
+    c.Unread(&buffer_[0] + message_end_offset_, received_length_ - message_end_offset_);
+  }
+
+  ~TemplatedHTTPReceivedMessage() { RecycledHTTPMessageBuffers::Give(std::move(buffer_)); }
+
+  // Receives the next message sent on the same connection in place of this one, starting with the bytes
+  // received past its end. The buffer is reused, unless it has grown past `kMaxRecycledMessageBufferSize`,
+  // and so is the capacity of the strings, thus the keep-alive requests are parsed with no allocations,
+  // with the helpers that keep the headers in place. Calls `HELPER::OnReset()` first.
+  inline void ReceiveNext(
+      Connection& c,
+      const int intial_buffer_size = kDefaultInitialMessageBufferSize,
+      const double buffer_growth_k = kDefaultMessageBufferGrowthK,
+      const size_t buffer_max_growth_due_to_content_length = kDefaultMessageBufferMaxGrowthDueToContentLength) {
+    const size_t length = received_length_ - message_end_offset_;
+    const size_t size = std::max(length + 1, static_cast<size_t>(intial_buffer_size));
+    if (buffer_.size() > kMaxRecycledMessageBufferSize && size <= kMaxRecycledMessageBufferSize) {
+      HTTPMessageBuffer smaller(size, buffer_.get_allocator());
+      std::copy(buffer_.begin() + message_end_offset_, buffer_.begin() + received_length_, smaller.begin());
+      buffer_.swap(smaller);
+    } else {
+      if (length) {
+        memmove(&buffer_[0], &buffer_[message_end_offset_], length);
+      }
+      buffer_.resize(std::max(buffer_.size(), size));
+    }
+    method_.clear();
+    url_.clear();
+    version_.clear();
+    keep_alive_ = false;
+    range_header_.clear();
+    expect_continue_ = false;
+    continue_sent_ = false;
+    body_buffer_begin_ = nullptr;
+    body_buffer_end_ = nullptr;
+    message_end_offset_ = 0;
+    received_length_ = 0;
+    body_to_stream_ = false;
+    stream_chunked_body_ = false;
+    stream_body_length_ = 0;
+    HELPER::OnReset();
+    HELPER::OnBuffer(buffer_);
+    Receive(c, length, buffer_growth_k, buffer_max_growth_due_to_content_length);
+  }
+
+  inline const std::string& Method() const { return method_; }
+
+  inline const std::string& URL() const { return url_; }
+
+  inline const std::string& Version() const { return version_; }
+
+  // The default for HTTP/1.1 unless the peer sent `Connection: close`, and opt-in with `Connection: keep-alive`
+  // for HTTP/1.0.
+  inline bool KeepAlive() const { return keep_alive_; }
+
+  inline const std::string& RangeHeader() const { return range_header_; }
+
+  inline bool ExpectsContinue() const { return expect_continue_; }
+
+  // Whether the body is yet to be streamed, and the peer is yet to be told to send it. The connection is then
+  // not reused past the response, as the peer may or may not send the body after it.
+  inline bool BodyAwaitsContinue() const { return expect_continue_ && body_to_stream_ && !continue_sent_; }
+
+  // The bytes received after the end of this message.
+  inline std::vector<char> UnparsedBytes() const {
+    return std::vector<char>(buffer_.begin() + message_end_offset_, buffer_.begin() + received_length_);
+  }
+
+  // With HTTPStreamingBodyHelper, reads the body from `c`, passing it piece by piece, as it arrives,
+  // to `callback(const char* data, size_t length)`. The pieces are read into the same region of `buffer_`,
+  // past the headers, of at most `buffer_size` bytes, and are only valid for the duration of the call.
+  // Returns the length of the body. Does nothing if there is no body, or if it has been streamed already.
+  template <typename F>
+  inline size_t StreamBody(Connection& c, F&& callback, size_t buffer_size = kDefaultStreamingBufferSize) {
+    if (!body_to_stream_) {
+      return 0;
+    }
+    SendContinue(c);
+    body_to_stream_ = false;
+    // `[begin, end)` are the bytes received but not yet parsed, first the ones read along with the headers.
+    const size_t base = message_end_offset_;
+    size_t begin = base;
+    size_t end = received_length_;
+    buffer_size = std::max(buffer_size, kMinStreamingBufferSize);
+    if (buffer_.size() < base + buffer_size + 1) {
+      buffer_.resize(base + buffer_size + 1);
+    }
+    size_t total = 0;
+    // Passes `length` bytes of the body to `callback`, reading them as needed.
+    const auto pass = [&](size_t length) {
+      while (length) {
+        if (begin == end) {
+          begin = end = base;
+          ReadIntoStreamingBuffer(c, end, std::min(length, buffer_size));
+        }
+        const size_t n = std::min(std::min(length, end - begin), buffer_size);
+        callback(static_cast<const char*>(&buffer_[begin]), n);
+        begin += n;
+        length -= n;
+        total += n;
+      }
+    };
+    if (!stream_chunked_body_) {
+      pass(stream_body_length_);
+    } else {
+      while (true) {
+        char* crlf;
+        while (!(crlf = scan::FindCRLF(&buffer_[0] + begin, &buffer_[0] + end))) {
+          // Move the incomplete line to the beginning of the buffer, and read more.
+          std::copy(buffer_.begin() + begin, buffer_.begin() + end, buffer_.begin() + base);
+          end -= begin - base;
+          begin = base;
+          if (end - base >= buffer_size) {
+            throw HTTPMalformedBodyException();
+          }
+          ReadIntoStreamingBuffer(c, end, base + buffer_size - end);
+        }
+        const size_t line = begin;
+        begin = crlf + kCRLFLength - &buffer_[0];
+        // Blank lines, such as the CRLF after the previous chunk, are skipped.
+        if (crlf != &buffer_[line]) {
+          *crlf = '\0';
+          char* chunk_length_end;
+          const size_t chunk_length = static_cast<size_t>(strtoull(&buffer_[line], &chunk_length_end, 16));
+          if (chunk_length_end == &buffer_[line]) {
+            throw HTTPMalformedBodyException();
+          }
+          if (!chunk_length) {
+            // As in the non-streaming case, the final CRLF is skipped if it has been received already.
+            if (end - begin >= kCRLFLength && !strncmp(&buffer_[begin], kCRLF, kCRLFLength)) {
+              begin += kCRLFLength;
+            }
+            break;
+          }
+          pass(chunk_length);
+        }
+      }
+    }
+    message_end_offset_ = begin;
+    received_length_ = end;
+    return total;
+  }
+
+  // With HTTPStreamingBodyHelper, writes the body into the file `fd`, from its beginning, and returns
+  // its length. A `Content-Length` body goes from the socket to the file with `BlockingReceiveToFile()`,
+  // past the bytes received along with the headers; a chunked one is streamed through the buffer and written.
+  inline uint64_t StreamBodyToFile(Connection& c, int fd) {
+    if (!body_to_stream_) {
+      return 0;
+    }
+    uint64_t offset = 0;
+    const auto write = [fd, &offset](const char* data, size_t length) {
+      while (length) {
+        const ssize_t written = ::pwrite(fd, data, length, static_cast<off_t>(offset));
+        if (written < 0 && errno == EINTR) {
+          continue;
+        } else if (written <= 0) {
+          throw FileException();
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
+        offset += static_cast<uint64_t>(written);
+      }
+    };
+    if (stream_chunked_body_) {
+      return StreamBody(c, write);
+    }
+    SendContinue(c);
+    body_to_stream_ = false;
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+    ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(stream_body_length_));
+#endif
+    const size_t received = std::min(received_length_ - message_end_offset_, stream_body_length_);
+    write(&buffer_[message_end_offset_], received);
+    c.BlockingReceiveToFile(fd, received, stream_body_length_ - received);
+    message_end_offset_ += received;
+    return stream_body_length_;
+  }
+
+  // Note that `Body*()` methods assume that the body was fully read into memory.
+  // If other means of reading the body, for example, event-based chunk parsing, is used,
+  // then `HasBody()` will be false and all other `Body*()` methods wil throw.
+  inline bool HasBody() const { return body_buffer_begin_ != nullptr; }
+
+  inline const std::string Body() const {
+    if (body_buffer_begin_) {
+      return std::string(body_buffer_begin_, body_buffer_end_);
+    } else {
+      throw HTTPNoBodyProvidedException();
+    }
+  }
+
+  inline const char* BodyBegin() const {
+    if (body_buffer_begin_) {
+      return body_buffer_begin_;
+    } else {
+      throw HTTPNoBodyProvidedException();
+    }
+  }
+
+  inline const char* BodyEnd() const {
+    if (body_buffer_begin_) {
+      assert(body_buffer_end_);
+      return body_buffer_end_;
+    } else {
+      throw HTTPNoBodyProvidedException();
+    }
+  }
+
+  inline size_t BodyLength() const {
+    if (body_buffer_begin_) {
+      assert(body_buffer_end_);
+      return body_buffer_end_ - body_buffer_begin_;
+    } else {
+      throw HTTPNoBodyProvidedException();
+    }
+  }
+
+ private:
+  // Reads and parses the message, the first `received` bytes of which are in `buffer_` already.
+  inline void Receive(Connection& c,
+                      const size_t received,
+                      const double buffer_growth_k,
+                      const size_t buffer_max_growth_due_to_content_length) {
     // `offset` is the number of bytes read into `buffer_` so far.
     // `length_cap` is infinity first (size_t is unsigned), and it changes/ to the absolute offset
     // of the end of HTTP body in the buffer_, once `Content-Length` and two consecutive CRLS have been seen.
-    size_t offset = 0;
+    size_t offset = received;
     size_t length_cap = static_cast<size_t>(-1);
 
+    // `parse_received_first` is set when the bytes received already should be parsed before reading more,
+    // as they may contain the whole message.
+    bool parse_received_first = (received > 0);
+
     // `current_line_offset` is the index of the first character after CRLF in `buffer_`.
     size_t current_line_offset = 0;
 
+    // `crlf_scan_offset` is where to resume looking for the next CRLF once more data has been read,
+    // so that the incomplete line is not rescanned from its beginning after each read.
+    size_t crlf_scan_offset = 0;
+
     // `body_offset` and `body_length` describe the position of HTTP body, if it's not chunk-encoded.
     size_t body_offset = static_cast<size_t>(-1);
     size_t body_length = static_cast<size_t>(-1);
@@ -104,25 +596,43 @@ class TemplatedHTTPReceivedMessage : public HELPER {
     bool receiving_body_in_chunks = false;
 
     while (offset < length_cap) {
-      size_t chunk;
-      size_t read_count;
-      // Use `- offset - 1` instead of just `- offset` to leave room for the '\0'.
-      while (chunk = buffer_.size() - offset - 1,
-             read_count = c.BlockingRead(&buffer_[offset], chunk),
-             offset += read_count,
-             read_count == chunk) {
-        buffer_.resize(buffer_.size() * buffer_growth_k);
-      }
-      if (!read_count) {
-        // This is worth re-checking, but as for 2014/12/06 the concensus of reading through man
-        // and StackOverflow is that a return value of zero from read() from a socket indicates
-        // that the socket has been closed by the peer.
-        throw HTTPConnectionClosedByPeerException();
+      if (!parse_received_first) {
+        size_t chunk;
+        size_t read_count;
+        // Use `- offset - 1` instead of just `- offset` to leave room for the '\0'.
+        if (std::is_base_of<HTTPStreamingBodyHelper, HELPER>::value) {
+          // Parse after each read, and only grow the buffer once it is full, to not read ahead into the body.
+          if (offset + 1 >= buffer_.size()) {
+            buffer_.resize(buffer_.size() * buffer_growth_k);
+          }
+          chunk = buffer_.size() - offset - 1;
+          read_count = c.BlockingRead(&buffer_[offset], chunk);
+          offset += read_count;
+        } else {
+          while (chunk = buffer_.size() - offset - 1,
+                 read_count = c.BlockingRead(&buffer_[offset], chunk),
+                 offset += read_count,
+                 read_count == chunk) {
+            buffer_.resize(buffer_.size() * buffer_growth_k);
+          }
+        }
+        if (!read_count) {
+          // This is worth re-checking, but as for 2014/12/06 the concensus of reading through man
+          // and StackOverflow is that a return value of zero from read() from a socket indicates
+          // that the socket has been closed by the peer.
+          throw HTTPConnectionClosedByPeerException();
+        }
       }
+      parse_received_first = false;
       buffer_[offset] = '\0';
-      char* next_crlf_ptr;
-      while ((body_offset == static_cast<size_t>(-1) || offset < body_offset) &&
-             (next_crlf_ptr = strstr(&buffer_[current_line_offset], kCRLF))) {
+      while (body_offset == static_cast<size_t>(-1) || offset < body_offset) {
+        const size_t scan_from = std::max(current_line_offset, crlf_scan_offset);
+        char* const next_crlf_ptr = scan::FindCRLF(&buffer_[0] + scan_from, &buffer_[0] + offset);
+        if (!next_crlf_ptr) {
+          // The last byte may be the '\r' of a CRLF to be completed by the next read.
+          crlf_scan_offset = std::max(scan_from, offset - 1);
+          break;
+        }
         const bool line_is_blank = (next_crlf_ptr == &buffer_[current_line_offset]);
         *next_crlf_ptr = '\0';
         // `next_line_offset` is mutable since reading chunked body will change it.
@@ -131,25 +641,35 @@ class TemplatedHTTPReceivedMessage : public HELPER {
           if (!line_is_blank) {
             // It's recommended by W3 to wait for the first line ignoring prior CRLF-s.
             char* p1 = &buffer_[current_line_offset];
-            char* p2 = strstr(p1, " ");
+            char* p2 = scan::FindChar(p1, next_crlf_ptr, ' ');
             if (p2) {
               *p2 = '\0';
               ++p2;
               method_ = p1;
-              char* p3 = strstr(p2, " ");
+              char* p3 = scan::FindChar(p2, next_crlf_ptr, ' ');
               if (p3) {
                 *p3 = '\0';
+                version_ = p3 + 1;
               }
               url_ = p2;
             }
+            keep_alive_ = (version_ == kHTTP11Version);
             first_line_parsed = true;
           }
         } else if (receiving_body_in_chunks) {
           // Ignore blank lines.
           if (!line_is_blank) {
-            const size_t chunk_length = static_cast<size_t>(atoi(&buffer_[current_line_offset]));
+            const size_t chunk_length =
+                static_cast<size_t>(strtoull(&buffer_[current_line_offset], nullptr, 16));
             if (chunk_length == 0) {
-              // Done with the body.
+              // Done with the body, and with the message, unless the final CRLF has not been received yet.
+              // If so, the next message starts with a blank line, which is ignored.
+              message_end_offset_ = next_line_offset;
+              if (offset >= message_end_offset_ + kCRLFLength &&
+                  !strncmp(&buffer_[message_end_offset_], kCRLF, kCRLFLength)) {
+                message_end_offset_ += kCRLFLength;
+              }
+              received_length_ = offset;
               HELPER::OnChunkedBodyDone(body_buffer_begin_, body_buffer_end_);
               return;
             } else {
@@ -159,8 +679,9 @@ class TemplatedHTTPReceivedMessage : public HELPER {
               const size_t next_offset = chunk_offset + chunk_length;
               if (offset < next_offset) {
                 const size_t bytes_to_read = next_offset - offset;
-                if (buffer_.size() < next_offset) {
-                  buffer_.resize(next_offset);
+                // Keep the room for the '\0' after the chunk.
+                if (buffer_.size() < next_offset + 1) {
+                  buffer_.resize(next_offset + 1);
                 }
                 if (bytes_to_read != c.BlockingRead(&buffer_[offset], bytes_to_read)) {
                   throw HTTPConnectionClosedByPeerException();
@@ -176,21 +697,52 @@ class TemplatedHTTPReceivedMessage : public HELPER {
             }
           }
         } else if (!line_is_blank) {
-          char* p = strstr(&buffer_[current_line_offset], kHeaderKeyValueSeparator);
+          char* p = scan::FindChar(&buffer_[current_line_offset], next_crlf_ptr, ':');
           if (p) {
             *p = '\0';
             const char* const key = &buffer_[current_line_offset];
-            const char* const value = p + kHeaderKeyValueSeparatorLength;
+            const size_t key_length = p - key;
+            const char* value = p + 1;
+            while (*value == ' ' || *value == '\t') {
+              ++value;
+            }
             HELPER::OnHeader(key, value);
-            if (!strcmp(key, kContentLengthHeaderKey)) {
+            // Header names are case-insensitive, and most of them are none of the below,
+            // which `EqualsIgnoreCase()` tells by their first character or length.
+            if (scan::EqualsIgnoreCase(key, key_length, kContentLengthHeaderKey)) {
               body_length = static_cast<size_t>(atoi(value));
-            } else if (!strcmp(key, kTransferEncodingHeaderKey)) {
-              if (!strcmp(value, kTransferEncodingChunkedValue)) {
+            } else if (scan::EqualsIgnoreCase(key, key_length, kTransferEncodingHeaderKey)) {
+              if (!strcasecmp(value, kTransferEncodingChunkedValue)) {
                 chunked_transfer_encoding = true;
               }
+            } else if (scan::EqualsIgnoreCase(key, key_length, kRangeHeaderKey)) {
+              range_header_ = value;
+            } else if (scan::EqualsIgnoreCase(key, key_length, kExpectHeaderKey)) {
+              // Only the HTTP/1.1 clients know to wait for, and to skip, "100 Continue".
+              expect_continue_ = (version_ == kHTTP11Version) && !strcasecmp(value, kExpectContinueValue);
+            } else if (scan::EqualsIgnoreCase(key, key_length, kConnectionHeaderKey)) {
+              if (!strcasecmp(value, kConnectionCloseValue)) {
+                keep_alive_ = false;
+              } else if (!strcasecmp(value, kConnectionKeepAliveValue)) {
+                keep_alive_ = true;
+              }
             }
           }
+        } else if (std::is_base_of<HTTPStreamingBodyHelper, HELPER>::value) {
+          // Leave the body to `StreamBody()`.
+          body_offset = next_line_offset;
+          length_cap = body_offset;
+          stream_chunked_body_ = chunked_transfer_encoding;
+          stream_body_length_ = chunked_transfer_encoding ? 0 : body_length;
+          body_to_stream_ =
+              chunked_transfer_encoding || (body_length != static_cast<size_t>(-1) && body_length > 0);
         } else {
+          if (expect_continue_ && (chunked_transfer_encoding ||
+                                   (body_length != static_cast<size_t>(-1) && body_length > 0 &&
+                                    offset < next_line_offset + body_length))) {
+            // The body is read right away, the peer waits for the go-ahead to send it.
+            SendContinue(c);
+          }
           if (!chunked_transfer_encoding) {
             // HTTP body starts right after this last CRLF.
             body_offset = next_line_offset;
@@ -218,73 +770,280 @@ class TemplatedHTTPReceivedMessage : public HELPER {
         current_line_offset = next_line_offset;
       }
     }
-    if (body_length != static_cast<size_t>(-1)) {
+    message_end_offset_ = length_cap;
+    received_length_ = offset;
+    if (body_length != static_cast<size_t>(-1) && !std::is_base_of<HTTPStreamingBodyHelper, HELPER>::value) {
       // Initialize pointers pair to point to the BODY to be read.
       body_buffer_begin_ = &buffer_[body_offset];
       body_buffer_end_ = body_buffer_begin_ + body_length;
     }
+    HTTPMessageMetrics& metrics = HTTPMessageMetrics::Singleton();
+    metrics.messages_received.Increment();
+    metrics.message_bytes.Record(length_cap);
   }
 
-  inline const std::string& Method() const { return method_; }
+  inline void SendContinue(Connection& c) {
+    if (expect_continue_ && !continue_sent_) {
+      continue_sent_ = true;
+      c.BlockingWrite(kHTTPContinueResponse, CompileTimeStringLength(kHTTPContinueResponse));
+    }
+  }
 
-  inline const std::string& URL() const { return url_; }
+  inline void ReadIntoStreamingBuffer(Connection& c, size_t& end, size_t length) {
+    const size_t read_count = c.BlockingRead(&buffer_[end], length);
+    if (!read_count) {
+      throw HTTPConnectionClosedByPeerException();
+    }
+    end += read_count;
+  }
 
-  // Note that `Body*()` methods assume that the body was fully read into memory.
-  // If other means of reading the body, for example, event-based chunk parsing, is used,
-  // then `HasBody()` will be false and all other `Body*()` methods wil throw.
-  inline bool HasBody() const { return body_buffer_begin_ != nullptr; }
+  // Fields available to the user via getters.
+  std::string method_;
+  std::string url_;
+  std::string version_;
+  bool keep_alive_ = false;
+  std::string range_header_;
+  bool expect_continue_ = false;
+  bool continue_sent_ = false;
 
-  inline const std::string Body() const {
-    if (body_buffer_begin_) {
-      return std::string(body_buffer_begin_, body_buffer_end_);
-    } else {
-      throw HTTPNoBodyProvidedException();
+  // HTTP parsing fields that have to be caried out of the parsing routine.
+  HTTPMessageBuffer buffer_;  // The buffer into which data has been read, except for chunked case.
+  const char* body_buffer_begin_ = nullptr;  // If BODY has been provided, pointer pair to it.
+  const char* body_buffer_end_ = nullptr;    // Will not be nullptr if body_buffer_begin_ is not nullptr.
+  size_t message_end_offset_ = 0;            // The offset in `buffer_` past the end of this message.
+  size_t received_length_ = 0;               // The number of bytes read into `buffer_`.
+
+  // The body left to `StreamBody()`, which starts at `message_end_offset_` until it is streamed.
+  bool body_to_stream_ = false;
+  bool stream_chunked_body_ = false;
+  size_t stream_body_length_ = 0;
+};
+
+// The default implementation is exposed under the name HTTPReceivedMessage.
+typedef TemplatedHTTPReceivedMessage<HTTPDefaultHelper> HTTPReceivedMessage;
+typedef TemplatedHTTPReceivedMessage<HTTPHeaderViewHelper> HTTPHeaderViewReceivedMessage;
+typedef TemplatedHTTPReceivedMessage<HTTPStreamingBodyHelper> HTTPStreamingReceivedMessage;
+
+// Appends the status line and the headers of the response, up to and including the blank line, to `output`.
+// `connection` is the value of the `Connection` header, or `nullptr` to not send one.
+// With `content_length` of `kChunkedContentLength`, sends `Transfer-Encoding: chunked` instead.
+inline void AppendHTTPResponseHeaders(std::string& output,
+                                      HTTPResponseCode code,
+                                      const std::string& content_type,
+                                      size_t content_length,
+                                      const HTTPHeadersType& extra_headers,
+                                      const char* connection) {
+  output.append(HTTPResponseCodeAsStringGenerator::StatusLine(code));
+  output.append("Content-Type: ").append(content_type).append(kCRLF, kCRLFLength);
+  if (content_length != kChunkedContentLength) {
+    output.append("Content-Length: ").append(std::to_string(content_length)).append(kCRLF, kCRLFLength);
+  } else {
+    output.append(kTransferEncodingHeaderKey).append(kHeaderKeyValueSeparator, kHeaderKeyValueSeparatorLength);
+    output.append(kTransferEncodingChunkedValue).append(kCRLF, kCRLFLength);
+  }
+  for (const auto& cit : extra_headers) {
+    output.append(cit.first).append(kHeaderKeyValueSeparator, kHeaderKeyValueSeparatorLength);
+    output.append(cit.second).append(kCRLF, kCRLFLength);
+  }
+  if (connection) {
+    output.append(kConnectionHeaderKey).append(kHeaderKeyValueSeparator, kHeaderKeyValueSeparatorLength);
+    output.append(connection).append(kCRLF, kCRLFLength);
+  }
+  output.append(kCRLF, kCRLFLength);
+}
+
+// ChunkedResponseSender sends the body of the response as it is produced, with `Transfer-Encoding: chunked`.
+// Obtained from `HTTPServerConnection::SendChunkedHTTPResponse()`, which sends the headers.
+//
+// The first `Send()` goes out right away, for the client to get the first bytes immediately.
+// The data sent after it is coalesced into chunks of up to `max_buffer_size` bytes, which are flushed
+// once full, or by the first `Send()` after `flush_interval_ms` since the previous flush, or by `Flush()`.
+// Larger pieces are sent as they are, with no copies.
+// `Finish()`, also invoked by the destructor, sends the rest and the last chunk.
+//
+// Not thread safe. Must not outlive the connection, and must be finished before the next response is sent.
+class ChunkedResponseSender final {
+ public:
+  ChunkedResponseSender(Connection& connection, size_t max_buffer_size, uint64_t flush_interval_ms)
+      : connection_(&connection),
+        max_buffer_size_(max_buffer_size),
+        flush_interval_(std::chrono::milliseconds(flush_interval_ms)) {
+    buffer_.reserve(max_buffer_size_);
+  }
+
+  ChunkedResponseSender(ChunkedResponseSender&& rhs)
+      : connection_(rhs.connection_),
+        max_buffer_size_(rhs.max_buffer_size_),
+        flush_interval_(rhs.flush_interval_),
+        buffer_(std::move(rhs.buffer_)),
+        first_send_(rhs.first_send_),
+        last_flush_(rhs.last_flush_) {
+    rhs.connection_ = nullptr;
+  }
+
+  ~ChunkedResponseSender() {
+    try {
+      Finish();
+    } catch (const Exception&) {
+      // The peer has gone away, and there is no one to report it to.
     }
   }
 
-  inline const char* BodyBegin() const {
-    if (body_buffer_begin_) {
-      return body_buffer_begin_;
+  inline void Send(const char* data, size_t length) {
+    assert(connection_);
+    if (!length) {
+      // A zero-length chunk would end the response.
+      return;
+    }
+    if (length >= max_buffer_size_) {
+      Flush();
+      WriteChunk(data, length);
     } else {
-      throw HTTPNoBodyProvidedException();
+      if (buffer_.length() + length > max_buffer_size_) {
+        Flush();
+      }
+      buffer_.append(data, length);
+      if (first_send_ || buffer_.length() >= max_buffer_size_ ||
+          std::chrono::steady_clock::now() - last_flush_ >= flush_interval_) {
+        Flush();
+      }
     }
+    first_send_ = false;
   }
 
-  inline const char* BodyEnd() const {
-    if (body_buffer_begin_) {
-      assert(body_buffer_end_);
-      return body_buffer_end_;
-    } else {
-      throw HTTPNoBodyProvidedException();
+  inline void Send(const std::string& data) { Send(data.data(), data.length()); }
+
+  inline void Flush() {
+    if (connection_ && !buffer_.empty()) {
+      WriteChunk(buffer_.data(), buffer_.length());
+      buffer_.clear();
     }
   }
 
-  inline size_t BodyLength() const {
-    if (body_buffer_begin_) {
-      assert(body_buffer_end_);
-      return body_buffer_end_ - body_buffer_begin_;
-    } else {
-      throw HTTPNoBodyProvidedException();
+  // Sends the buffered data and the last chunk. Does nothing if the response has been finished already.
+  inline void Finish() {
+    if (connection_) {
+      Flush();
+      connection_->BlockingWrite("0\r\n\r\n");
+      connection_ = nullptr;
     }
   }
 
  private:
-  // Fields available to the user via getters.
-  std::string method_;
-  std::string url_;
+  inline void WriteChunk(const char* data, size_t length) {
+    char size_line[20];
+    const int size_line_length = snprintf(size_line, sizeof(size_line), "%zx\r\n", length);
+    struct iovec iov[3];
+    iov[0].iov_base = size_line;
+    iov[0].iov_len = static_cast<size_t>(size_line_length);
+    iov[1].iov_base = const_cast<char*>(data);
+    iov[1].iov_len = length;
+    iov[2].iov_base = const_cast<char*>(kCRLF);
+    iov[2].iov_len = kCRLFLength;
+    connection_->BlockingWritev(iov, 3);
+    last_flush_ = std::chrono::steady_clock::now();
+  }
 
-  // HTTP parsing fields that have to be caried out of the parsing routine.
-  std::vector<char> buffer_;  // The buffer into which data has been read, except for chunked case.
-  const char* body_buffer_begin_ = nullptr;  // If BODY has been provided, pointer pair to it.
-  const char* body_buffer_end_ = nullptr;    // Will not be nullptr if body_buffer_begin_ is not nullptr.
+  Connection* connection_;  // `nullptr` once finished.
+  const size_t max_buffer_size_;
+  const std::chrono::steady_clock::duration flush_interval_;
+  std::string buffer_;
+  bool first_send_ = true;
+  std::chrono::steady_clock::time_point last_flush_ = std::chrono::steady_clock::now();
+
+  ChunkedResponseSender(const ChunkedResponseSender&) = delete;
+  void operator=(const ChunkedResponseSender&) = delete;
+  void operator=(ChunkedResponseSender&&) = delete;
 };
 
-// The default implementation is exposed under the name HTTPReceivedMessage.
-typedef TemplatedHTTPReceivedMessage<HTTPDefaultHelper> HTTPReceivedMessage;
+enum class HTTPByteRange { Whole, Partial, Unsatisfiable };
 
-class HTTPServerConnection {
+// Parses the `Range` header, `bytes=first-last`, `bytes=first-` or `bytes=-suffix_length`, for the resource
+// of `size` bytes, into `[first, first + length)`. Multiple ranges and malformed headers are ignored,
+// as RFC 7233 allows, and result in `Whole`, with `first` and `length` unchanged.
+inline HTTPByteRange ParseHTTPByteRange(const std::string& header,
+                                        uint64_t size,
+                                        uint64_t& first,
+                                        uint64_t& length) {
+  const char* const kPrefix = "bytes=";
+  const size_t kPrefixLength = 6;
+  // Digits only, no sign or whitespace, as `strtoull()` would allow.
+  const auto parse = [](const std::string& s, uint64_t& value) {
+    if (s.empty() || s.find_first_not_of("0123456789") != std::string::npos) {
+      return false;
+    }
+    value = static_cast<uint64_t>(strtoull(s.c_str(), nullptr, 10));
+    return true;
+  };
+  if (header.compare(0, kPrefixLength, kPrefix) || header.find(',') != std::string::npos) {
+    return HTTPByteRange::Whole;
+  }
+  const size_t dash = header.find('-', kPrefixLength);
+  if (dash == std::string::npos) {
+    return HTTPByteRange::Whole;
+  }
+  const std::string from = header.substr(kPrefixLength, dash - kPrefixLength);
+  const std::string to = header.substr(dash + 1);
+  uint64_t a;
+  uint64_t b;
+  if (from.empty()) {
+    if (!parse(to, b)) {
+      return HTTPByteRange::Whole;
+    } else if (!b || !size) {
+      return HTTPByteRange::Unsatisfiable;
+    }
+    a = size > b ? size - b : 0;
+    b = size - 1;
+  } else {
+    if (!parse(from, a) || (!to.empty() && !parse(to, b))) {
+      return HTTPByteRange::Whole;
+    }
+    if (to.empty()) {
+      b = size ? size - 1 : 0;
+    } else if (b < a) {
+      return HTTPByteRange::Whole;
+    }
+    if (a >= size) {
+      return HTTPByteRange::Unsatisfiable;
+    }
+    b = std::min(b, size - 1);
+  }
+  first = a;
+  length = b - a + 1;
+  return HTTPByteRange::Partial;
+}
+
+// HTTPServerConnection parses the first request from the connection in its constructor.
+// With HTTP/1.1 keep-alive, the client may send more requests over the same connection, possibly pipelined,
+// without waiting for the responses: `NextRequest()` parses the next one once the current one is responded to.
+//
+//   HTTPServerConnection c(socket.Accept());
+//   do {
+//     c.SendHTTPResponse(Process(c.Message()));
+//   } while (c.NextRequest());
+//
+// `HTTPHeaderViewServerConnection` parses the requests with `HTTPHeaderViewHelper`, for the handlers
+// to read the headers with no allocations. With `HTTPStreamingServerConnection`, the handlers read the body
+// with `StreamRequestBody()`, and `NextRequest()` skips whatever part of it has not been read.
+// Responding to a request with `Expect: 100-continue` before streaming its body rejects it:
+// the client is not told to send the body, and the connection is closed after the response.
+template <class HELPER>
+class TemplatedHTTPServerConnection {
  public:
-  HTTPServerConnection(Connection&& c) : connection_(std::move(c)), message_(connection_) {}
+  typedef TemplatedHTTPReceivedMessage<HELPER> MessageType;
+
+  // The messages of all the requests on this connection are received into the same buffer, allocated
+  // from `resource`, see `TemplatedHTTPReceivedMessage::ReceiveNext()`. With the default resource, the buffer
+  // of a new connection is one recycled from a connection closed on the same thread, if there is one,
+  // see `RecycledHTTPMessageBuffers`. With an arena, which does not reclaim memory, the buffer is only
+  // reallocated from it as it grows.
+  TemplatedHTTPServerConnection(Connection&& c, memory::MemoryResource* resource = HTTPMessageMemoryResource())
+      : connection_(std::move(c)),
+        message_(new MessageType(connection_,
+                                 kDefaultInitialMessageBufferSize,
+                                 kDefaultMessageBufferGrowthK,
+                                 kDefaultMessageBufferMaxGrowthDueToContentLength,
+                                 resource)) {}
 
   inline static const std::string DefaultContentType() { return "text/plain"; }
 
@@ -295,18 +1054,34 @@ class HTTPServerConnection {
       HTTPResponseCode code = HTTPResponseCode::OK,
       const std::string& content_type = DefaultContentType(),
       const HTTPHeadersType& extra_headers = HTTPHeadersType()) {
-    std::ostringstream os;
-    os << "HTTP/1.1 " << static_cast<int>(code);
-    os << " " << HTTPResponseCodeAsStringGenerator::CodeAsString(code) << kCRLF;
-    os << "Content-Type: " << content_type << kCRLF;
-    os << "Content-Length: " << (end - begin) << kCRLF;
-    for (const auto cit : extra_headers) {
-      os << cit.first << ": " << cit.second << kCRLF;
-    }
-    os << kCRLF;
-    connection_.BlockingWrite(os.str());
-    connection_.BlockingWrite(begin, end);
-    connection_.BlockingWrite(kCRLF);
+    const size_t length = end - begin;
+    SendHTTPResponse(length ? reinterpret_cast<const char*>(&(*begin)) : nullptr,
+                     length,
+                     code,
+                     content_type,
+                     extra_headers);
+  }
+
+  // The body in a buffer of its own, such as that of `CerealJSONWriter`.
+  inline void SendHTTPResponse(const char* data,
+                               size_t length,
+                               HTTPResponseCode code = HTTPResponseCode::OK,
+                               const std::string& content_type = DefaultContentType(),
+                               const HTTPHeadersType& extra_headers = HTTPHeadersType()) {
+    const bool keep_alive = KeepAlive();
+    response_headers_.clear();
+    AppendHTTPResponseHeaders(response_headers_, code, content_type, length, extra_headers, ConnectionHeader());
+    // The headers, the body and the CRLF in one `writev()`, not to have the body wait for the ACK
+    // of the headers with Nagle's algorithm on. The CRLF after the body is not part of the response,
+    // and would precede the next one if the connection is kept alive.
+    struct iovec iov[3];
+    iov[0].iov_base = const_cast<char*>(response_headers_.data());
+    iov[0].iov_len = response_headers_.length();
+    iov[1].iov_base = const_cast<char*>(data);
+    iov[1].iov_len = length;
+    iov[2].iov_base = const_cast<char*>(kCRLF);
+    iov[2].iov_len = kCRLFLength;
+    connection_.BlockingWritev(iov, keep_alive ? 2 : 3);
   }
 
   template <typename T>
@@ -325,20 +1100,149 @@ class HTTPServerConnection {
     SendHTTPResponse(container.begin(), container.end(), code, content_type, extra_headers);
   }
 
-  const HTTPReceivedMessage& Message() const { return message_; }
+  const MessageType& Message() const { return *message_; }
+
+  template <typename F>
+  inline size_t StreamRequestBody(F&& callback, size_t buffer_size = kDefaultStreamingBufferSize) {
+    return message_->StreamBody(connection_, std::forward<F>(callback), buffer_size);
+  }
+
+  // Saves the body of the request, with `HTTPStreamingBodyHelper`, into the file, and returns its length.
+  // On Linux, the disk space for a `Content-Length` body is preallocated, and the body is spliced
+  // from the socket.
+  // Throws `FileException` if the file can not be written.
+  inline uint64_t SaveRequestBodyToFile(const std::string& file_name) {
+    const int fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      throw FileException();
+    }
+    try {
+      const uint64_t length = message_->StreamBodyToFile(connection_, fd);
+      ::close(fd);
+      return length;
+    } catch (...) {
+      ::close(fd);
+      throw;
+    }
+  }
+
+  // Waits for the next request on this connection and parses it, if the client has asked to keep it alive.
+  // Returns false if it has not, or if the client has closed the connection instead of sending one.
+  // The next request may have been received already, along with the current one.
+  inline bool NextRequest() {
+    if (!KeepAlive()) {
+      return false;
+    }
+    try {
+      message_->StreamBody(connection_, [](const char*, size_t) {});
+      message_->ReceiveNext(connection_);
+      return true;
+    } catch (const HTTPConnectionClosedByPeerException&) {
+      return false;
+    }
+  }
+
+  // Sends the headers of the response, and returns the sender of its body, see `ChunkedResponseSender`.
+  // HTTP/1.0 clients do not support chunked transfer encoding.
+  inline ChunkedResponseSender SendChunkedHTTPResponse(
+      HTTPResponseCode code = HTTPResponseCode::OK,
+      const std::string& content_type = DefaultContentType(),
+      const HTTPHeadersType& extra_headers = HTTPHeadersType(),
+      size_t max_buffer_size = kDefaultChunkedResponseBufferSize,
+      uint64_t flush_interval_ms = kDefaultChunkedResponseFlushIntervalMs) {
+    response_headers_.clear();
+    AppendHTTPResponseHeaders(
+        response_headers_, code, content_type, kChunkedContentLength, extra_headers, ConnectionHeader());
+    connection_.BlockingWrite(response_headers_);
+    return ChunkedResponseSender(connection_, max_buffer_size, flush_interval_ms);
+  }
+
+  // Responds with the contents of the file, sent with `sendfile()`, with no copies through the user space.
+  // Honors a single byte range requested with the `Range` header with `206 Partial Content`, and responds
+  // with `416 Requested Range Not Satisfiable` if it is past the end of the file. Serves the whole file
+  // for other ranges. Throws `FileException` if the file can not be opened.
+  inline void SendFileResponse(const std::string& file_name,
+                               const std::string& content_type = DefaultContentType(),
+                               const HTTPHeadersType& extra_headers = HTTPHeadersType()) {
+    const int fd = ::open(file_name.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw FileException();
+    }
+    const FileDescriptorCloser closer(fd);
+    struct stat file_stat;
+    if (::fstat(fd, &file_stat)) {
+      throw FileException();
+    }
+    const uint64_t size = static_cast<uint64_t>(file_stat.st_size);
+    uint64_t first = 0;
+    uint64_t length = size;
+    HTTPResponseCode code = HTTPResponseCode::OK;
+    HTTPHeadersType headers(extra_headers);
+    headers.emplace_back("Accept-Ranges", "bytes");
+    switch (ParseHTTPByteRange(message_->RangeHeader(), size, first, length)) {
+      case HTTPByteRange::Whole:
+        break;
+      case HTTPByteRange::Partial:
+        code = HTTPResponseCode::PartialContent;
+        headers.emplace_back("Content-Range",
+                             "bytes " + std::to_string(first) + '-' + std::to_string(first + length - 1) + '/' +
+                                 std::to_string(size));
+        break;
+      case HTTPByteRange::Unsatisfiable:
+        headers.emplace_back("Content-Range", "bytes */" + std::to_string(size));
+        SendHTTPResponse(std::string(), HTTPResponseCode::RequestedRangeNotSatisfiable, content_type, headers);
+        return;
+    }
+    // The headers and the beginning of the file in the same frame.
+    const ScopedCork cork(connection_);
+    response_headers_.clear();
+    AppendHTTPResponseHeaders(response_headers_, code, content_type, length, headers, ConnectionHeader());
+    connection_.BlockingWrite(response_headers_);
+    connection_.BlockingSendFile(fd, first, length);
+    if (!KeepAlive()) {
+      connection_.BlockingWrite(kCRLF);
+    }
+  }
 
   Connection& RawConnection() { return connection_; }
 
  private:
   Connection connection_;
-  HTTPReceivedMessage message_;
+  std::unique_ptr<MessageType> message_;
+  std::string response_headers_;  // Reused from one response to the next.
+
+  struct FileDescriptorCloser {
+    const int fd;
+    explicit FileDescriptorCloser(int fd) : fd(fd) {}
+    ~FileDescriptorCloser() { ::close(fd); }
+  };
+
+  // Whether the connection stays open past the response. It does not once the handler has responded
+  // to `Expect: 100-continue` without streaming the body, which the client then does not send.
+  inline bool KeepAlive() const { return message_->KeepAlive() && !message_->BodyAwaitsContinue(); }
+
+  // The value of the `Connection` header to respond with, if it differs from the default for the HTTP version.
+  inline const char* ConnectionHeader() const {
+    const bool http11 = (message_->Version() == kHTTP11Version);
+    if (KeepAlive() && !http11) {
+      return kConnectionKeepAliveValue;
+    } else if (!KeepAlive() && http11) {
+      return kConnectionCloseValue;
+    } else {
+      return nullptr;
+    }
+  }
 
-  HTTPServerConnection(const HTTPServerConnection&) = delete;
-  void operator=(const HTTPServerConnection&) = delete;
-  HTTPServerConnection(HTTPServerConnection&&) = delete;
-  void operator=(HTTPServerConnection&&) = delete;
+  TemplatedHTTPServerConnection(const TemplatedHTTPServerConnection&) = delete;
+  void operator=(const TemplatedHTTPServerConnection&) = delete;
+  TemplatedHTTPServerConnection(TemplatedHTTPServerConnection&&) = delete;
+  void operator=(TemplatedHTTPServerConnection&&) = delete;
 };
 
+typedef TemplatedHTTPServerConnection<HTTPDefaultHelper> HTTPServerConnection;
+typedef TemplatedHTTPServerConnection<HTTPHeaderViewHelper> HTTPHeaderViewServerConnection;
+typedef TemplatedHTTPServerConnection<HTTPStreamingBodyHelper> HTTPStreamingServerConnection;
+
 }  // namespace net
 }  // namespace bricks
 
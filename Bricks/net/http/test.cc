@@ -1,13 +1,27 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
 #include <thread>
+#include <vector>
 
 #include "http.h"
 
 #include "../../dflags/dflags.h"
+#include "../../file/file.h"
 
 #include "../../3party/gtest/gtest.h"
 #include "../../3party/gtest/gtest-main-with-dflags.h"
 
 #include "../../strings/printf.h"
+#include "../../util/allocation_counter.h"
+
+BRICKS_COUNT_ALLOCATIONS();
 
 DEFINE_int32(port, 8080, "Local port to use for the test server.");
 
@@ -132,3 +146,1466 @@ TYPED_TEST(HTTPTest, NoBodyPOST) {
            Socket(FLAGS_port));
   EXPECT_EQ("ALMOST_POSTED", TypeParam::Fetch(t, "/unittest_empty_post", "POST"));
 }
+
+TEST(HTTPCodes, StatusLines) {
+  using bricks::net::HTTPResponseCode;
+  using bricks::net::HTTPResponseCodeAsStringGenerator;
+  EXPECT_EQ("HTTP/1.1 200 OK\r\n", HTTPResponseCodeAsStringGenerator::StatusLine(HTTPResponseCode::OK));
+  EXPECT_EQ("HTTP/1.1 404 Not Found\r\n",
+            HTTPResponseCodeAsStringGenerator::StatusLine(HTTPResponseCode::NotFound));
+  EXPECT_EQ("HTTP/1.1 299 Unknown Code\r\n",
+            HTTPResponseCodeAsStringGenerator::StatusLine(static_cast<HTTPResponseCode>(299)));
+  EXPECT_EQ("HTTP/1.1 1234 Unknown Code\r\n",
+            HTTPResponseCodeAsStringGenerator::StatusLine(static_cast<HTTPResponseCode>(1234)));
+}
+
+TEST(HTTPServerConnection, KeepAliveAndPipelining) {
+  thread t([](Socket s) {
+             HTTPServerConnection c(s.Accept());
+             std::vector<string> urls;
+             do {
+               urls.push_back(c.Message().URL());
+               c.SendHTTPResponse(c.Message().Method() + ' ' + c.Message().URL() +
+                                  (c.Message().HasBody() ? ' ' + c.Message().Body() : ""));
+             } while (c.NextRequest());
+             EXPECT_EQ(4u, urls.size());
+           },
+           Socket(FLAGS_port));
+  Connection connection(ClientSocket("localhost", FLAGS_port));
+  // Three pipelined requests in one write, then one more on the same connection, which closes it.
+  connection.BlockingWrite(
+      "GET /one HTTP/1.1\r\n\r\n"
+      "POST /two HTTP/1.1\r\nContent-Length: 3\r\n\r\nfoo"
+      "POST /three HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nbar\r\n0\r\n\r\n");
+  HTTPReceivedMessage first(connection);
+  EXPECT_EQ("GET /one", first.Body());
+  connection.BlockingWrite("GET /four HTTP/1.1\r\nConnection: close\r\n\r\n");
+  // The responses received along with the first one are in its `UnparsedBytes()`.
+  const std::vector<char> unparsed = first.UnparsedBytes();
+  const string rest = string(unparsed.begin(), unparsed.end()) + connection.BlockingReadUntilEOF();
+  t.join();
+  const size_t two = rest.find("\r\n\r\nPOST /two foo");
+  const size_t three = rest.find("\r\n\r\nPOST /three bar");
+  const size_t four = rest.find("Connection: close\r\n\r\nGET /four");
+  ASSERT_NE(string::npos, two);
+  ASSERT_NE(string::npos, three);
+  ASSERT_NE(string::npos, four);
+  EXPECT_LT(two, three);
+  EXPECT_LT(three, four);
+}
+
+TEST(HTTPReceivedMessage, ParsesHeadersArrivingInPieces) {
+  int fds[2];
+  ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Connection server((net::SocketHandle(net::SocketHandle::FromHandle(fds[0]))));
+  Connection client((net::SocketHandle(net::SocketHandle::FromHandle(fds[1]))));
+  const string long_value(1000, 'x');
+  const string request = "POST /pieces HTTP/1.1\r\ncontent-LENGTH:3\r\nX-Long: " + long_value +
+                         "\r\nX-Empty:\r\nTransfer-Encoding-Not: chunked\r\n\r\nabc";
+  // Split the request into pieces of different sizes, for some of them to end between the CR and the LF.
+  thread t([&client, &request]() {
+    size_t piece = 1;
+    for (size_t offset = 0; offset < request.length(); offset += piece, piece = piece % 13 + 1) {
+      client.BlockingWrite(request.substr(offset, piece));
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  HTTPReceivedMessage message(server);
+  t.join();
+  EXPECT_EQ("POST", message.Method());
+  EXPECT_EQ("/pieces", message.URL());
+  ASSERT_TRUE(message.HasBody());
+  EXPECT_EQ("abc", message.Body());
+  EXPECT_EQ(long_value, message.headers().at("X-Long"));
+  EXPECT_EQ("", message.headers().at("X-Empty"));
+  EXPECT_EQ("3", message.headers().at("content-LENGTH"));
+}
+
+TEST(HTTPReceivedMessage, ReceivesIntoMemoryResource) {
+  int fds[2];
+  ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Connection server((net::SocketHandle(net::SocketHandle::FromHandle(fds[0]))));
+  Connection client((net::SocketHandle(net::SocketHandle::FromHandle(fds[1]))));
+  const string body(10000, 'x');
+  client.BlockingWrite("POST /arena HTTP/1.1\r\nContent-Length: 10000\r\n\r\n" + body);
+  char initial_buffer[256];
+  memory::MonotonicBufferResource arena(initial_buffer, sizeof(initial_buffer));
+  {
+    HTTPReceivedMessage message(server,
+                                net::kDefaultInitialMessageBufferSize,
+                                net::kDefaultMessageBufferGrowthK,
+                                net::kDefaultMessageBufferMaxGrowthDueToContentLength,
+                                &arena);
+    EXPECT_EQ("/arena", message.URL());
+    EXPECT_EQ(body, message.Body());
+  }
+  // The buffer has grown past the initial buffer of the arena, into the blocks of its own.
+  EXPECT_LE(10000u, arena.BytesAllocatedUpstream());
+}
+
+TEST(HTTPHeaderViewServerConnection, ReadsHeadersInPlace) {
+  int fds[2];
+  ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Connection client((net::SocketHandle(net::SocketHandle::FromHandle(fds[1]))));
+  // More headers than are stored inline, larger than the initial buffer, to have it reallocated.
+  string request = "POST /views HTTP/1.1\r\nX-Repeated: first\r\nContent-Length: 4\r\n";
+  for (int i = 0; i < 40; ++i) {
+    request += strings::Printf("X-Header-%d: %s\r\n", i, string(100, 'a' + i % 26).c_str());
+  }
+  request += "x-repeated: last\r\nConnection: close\r\n\r\nBODY";
+  client.BlockingWrite(request);
+  {
+    Connection server((net::SocketHandle(net::SocketHandle::FromHandle(fds[0]))));
+    net::HTTPHeaderViewServerConnection c(std::move(server));
+    const net::HTTPHeaderViewReceivedMessage& message = c.Message();
+    EXPECT_EQ("/views", message.URL());
+    EXPECT_EQ("BODY", string(message.BodyBegin(), message.BodyEnd()));
+    ASSERT_EQ(44u, message.NumberOfHeaders());
+    EXPECT_EQ("X-Repeated", message.HeaderName(0).ToString());
+    EXPECT_EQ("first", message.HeaderValue(0).ToString());
+    EXPECT_EQ("X-Header-39", message.HeaderName(41).ToString());
+    net::HTTPHeaderViewHelper::Slice value;
+    ASSERT_TRUE(message.FindHeader("x-header-20", value));
+    EXPECT_EQ(string(100, 'u'), value.ToString());
+    EXPECT_EQ('\0', value.data[value.length]);
+    ASSERT_TRUE(message.FindHeader("X-REPEATED", value));
+    EXPECT_EQ("last", value.ToString());
+    EXPECT_TRUE(message.HasHeader("content-length"));
+    EXPECT_FALSE(message.HasHeader("X-Header"));
+    EXPECT_FALSE(message.HasHeader("X-Header-400"));
+    c.SendHTTPResponse("OK");
+  }
+  EXPECT_NE(string::npos, client.BlockingReadUntilEOF().find("\r\n\r\nOK"));
+}
+
+TEST(HTTPHeaderViewServerConnection, ReusesTheBufferOfTheMessages) {
+  // The URLs do not fit the short string optimization.
+  string requests;
+  for (int i = 0; i < 3; ++i) {
+    requests += strings::Printf("GET /keep-alive/request/%d HTTP/1.1\r\nHost: localhost\r\n\r\n", i);
+  }
+  requests += "GET /keep-alive/request/3 HTTP/1.1\r\nConnection: close\r\n\r\n";
+  for (int i = 0; i < 2; ++i) {
+    int fds[2];
+    ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    Connection client((net::SocketHandle(net::SocketHandle::FromHandle(fds[1]))));
+    client.BlockingWrite(requests);
+    Connection server((net::SocketHandle(net::SocketHandle::FromHandle(fds[0]))));
+    std::unique_ptr<net::HTTPHeaderViewServerConnection> c;
+    if (i) {
+      // The buffer of the message of the first connection is recycled. The connection, the message
+      // and its URL are allocated.
+      EXPECT_ALLOCATIONS_AT_MOST(3, c.reset(new net::HTTPHeaderViewServerConnection(std::move(server))));
+    } else {
+      c.reset(new net::HTTPHeaderViewServerConnection(std::move(server)));
+    }
+    // The next requests are received into the same buffer, and the same strings.
+    EXPECT_NO_ALLOCATIONS(ASSERT_TRUE(c->NextRequest()));
+    EXPECT_NO_ALLOCATIONS(ASSERT_TRUE(c->NextRequest()));
+    EXPECT_NO_ALLOCATIONS(ASSERT_TRUE(c->NextRequest()));
+    EXPECT_EQ("/keep-alive/request/3", c->Message().URL());
+    EXPECT_FALSE(c->Message().KeepAlive());
+    EXPECT_FALSE(c->NextRequest());
+  }
+}
+
+TEST(HTTPStreamingServerConnection, StreamsBodyThroughBoundedBuffer) {
+  int fds[2];
+  ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Connection client((net::SocketHandle(net::SocketHandle::FromHandle(fds[1]))));
+  string body(3 * 1000 * 1000, ' ');
+  for (size_t i = 0; i < body.length(); ++i) {
+    body[i] = 'a' + i % 26;
+  }
+  thread writer([&client, &body]() {
+    client.BlockingWrite(strings::Printf("POST /plain HTTP/1.1\r\nContent-Length: %d\r\n\r\n",
+                                         static_cast<int>(body.length())));
+    client.BlockingWrite(body);
+    // Chunks of 0x1a bytes and of 1MB, split between the reads.
+    client.BlockingWrite("POST /chunked HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n1a\r\n");
+    client.BlockingWrite(body.substr(0, 0x1a) + "\r\n100000\r\n" + body.substr(0x1a, 0x100000));
+    client.BlockingWrite("\r\n0\r\n\r\n");
+    // The body of this one is not read by the handler, and is skipped.
+    client.BlockingWrite("POST /skipped HTTP/1.1\r\nContent-Length: 100000\r\n\r\n" + body.substr(0, 100000));
+    client.BlockingWrite("GET /last HTTP/1.1\r\nConnection: close\r\n\r\n");
+  });
+  string urls;
+  {
+    Connection server((net::SocketHandle(net::SocketHandle::FromHandle(fds[0]))));
+    net::HTTPStreamingServerConnection c(std::move(server));
+    do {
+      const string url = c.Message().URL();
+      EXPECT_FALSE(c.Message().HasBody());
+      string streamed;
+      size_t max_piece = 0;
+      if (url != "/skipped") {
+        const size_t length = c.StreamRequestBody([&streamed, &max_piece](const char* data, size_t length) {
+          streamed.append(data, length);
+          max_piece = std::max(max_piece, length);
+        }, 4096);
+        EXPECT_EQ(streamed.length(), length);
+      }
+      EXPECT_LE(max_piece, 4096u) << url;
+      if (url == "/plain") {
+        EXPECT_EQ(body, streamed);
+      } else if (url == "/chunked") {
+        EXPECT_EQ(body.substr(0, 0x1a + 0x100000), streamed);
+      } else {
+        EXPECT_EQ("", streamed);
+      }
+      urls += url + ' ';
+      c.SendHTTPResponse(url);
+    } while (c.NextRequest());
+  }
+  writer.join();
+  EXPECT_EQ("/plain /chunked /skipped /last ", urls);
+  EXPECT_NE(string::npos, client.BlockingReadUntilEOF().find("\r\n\r\n/last"));
+}
+
+TEST(HTTPStreamingServerConnection, SavesBodyToFile) {
+  const string file_name = "build/saved_body.bin";
+  int fds[2];
+  ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Connection client((net::SocketHandle(net::SocketHandle::FromHandle(fds[1]))));
+  string body(3 * 1000 * 1000, ' ');
+  for (size_t i = 0; i < body.length(); ++i) {
+    body[i] = 'a' + i % 26;
+  }
+  thread writer([&client, &body]() {
+    client.BlockingWrite(strings::Printf("POST /plain HTTP/1.1\r\nContent-Length: %d\r\n\r\n",
+                                         static_cast<int>(body.length())));
+    client.BlockingWrite(body);
+    client.BlockingWrite("POST /chunked HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n1a\r\n");
+    client.BlockingWrite(body.substr(0, 0x1a) + "\r\n100000\r\n" + body.substr(0x1a, 0x100000));
+    client.BlockingWrite("\r\n0\r\n\r\n");
+    client.BlockingWrite("POST /short HTTP/1.1\r\nContent-Length: 5\r\n\r\nshort");
+    client.BlockingWrite("GET /last HTTP/1.1\r\nConnection: close\r\n\r\n");
+  });
+  string urls;
+  {
+    Connection server((net::SocketHandle(net::SocketHandle::FromHandle(fds[0]))));
+    net::HTTPStreamingServerConnection c(std::move(server));
+    do {
+      const string url = c.Message().URL();
+      const uint64_t length = c.SaveRequestBodyToFile(file_name);
+      const string saved = FileSystem::ReadFileAsString(file_name);
+      EXPECT_EQ(saved.length(), length);
+      if (url == "/plain") {
+        EXPECT_EQ(body, saved);
+      } else if (url == "/chunked") {
+        EXPECT_EQ(body.substr(0, 0x1a + 0x100000), saved);
+      } else if (url == "/short") {
+        EXPECT_EQ("short", saved);
+      } else {
+        EXPECT_EQ("", saved);
+      }
+      urls += url + ' ';
+      c.SendHTTPResponse(url);
+    } while (c.NextRequest());
+  }
+  writer.join();
+  EXPECT_EQ("/plain /chunked /short /last ", urls);
+  EXPECT_NE(string::npos, client.BlockingReadUntilEOF().find("\r\n\r\n/last"));
+  FileSystem::RemoveFile(file_name);
+}
+
+struct MultipartCollector {
+  string parts;
+  std::vector<net::HTTPMultipartPart> headers;
+  void OnPartBegin(const net::HTTPMultipartPart& part) {
+    headers.push_back(part);
+    parts += '[';
+  }
+  void OnPartData(const char* data, size_t length) { parts.append(data, length); }
+  void OnPartEnd() { parts += ']'; }
+};
+
+TEST(HTTPMultipartParser, ParsesPartsSplitAnywhere) {
+  string boundary;
+  EXPECT_TRUE(net::HTTPMultipartBoundary("multipart/form-data; boundary=----x42", boundary));
+  EXPECT_EQ("----x42", boundary);
+  EXPECT_TRUE(net::HTTPMultipartBoundary("Multipart/Form-Data; charset=utf-8; Boundary=\"a b\"", boundary));
+  EXPECT_EQ("a b", boundary);
+  EXPECT_FALSE(net::HTTPMultipartBoundary("multipart/form-data", boundary));
+  EXPECT_FALSE(net::HTTPMultipartBoundary("text/plain; boundary=x", boundary));
+  EXPECT_FALSE(net::HTTPMultipartBoundary("multipart/form-data; boundary=" + string(71, 'x'), boundary));
+
+  // The data of the second part begins as the delimiter does, but is not one.
+  const string body =
+      "--xyz\r\n"
+      "Content-Disposition: form-data; name=\"field\"\r\n"
+      "\r\n"
+      "value\r\n"
+      "--xyz\r\n"
+      "Content-Disposition: form-data; name=\"file\"; filename=\"a.txt\"\r\n"
+      "Content-Type: text/plain\r\n"
+      "\r\n"
+      "\r\n--xy\r\n-\r--xyz\r\n"
+      "--xyz\r\n"
+      "\r\n"
+      "\r\n"
+      "--xyz--\r\n"
+      "The epilogue.";
+  const string expected = "[value][\r\n--xy\r\n-\r--xyz][]";
+  for (size_t piece = 1; piece <= body.length(); ++piece) {
+    net::HTTPMultipartParser parser("xyz");
+    MultipartCollector collector;
+    for (size_t i = 0; i < body.length(); i += piece) {
+      parser.Feed(body.data() + i, std::min(piece, body.length() - i), collector);
+    }
+    EXPECT_TRUE(parser.Done());
+    ASSERT_EQ(expected, collector.parts) << piece;
+    ASSERT_EQ(3u, collector.headers.size());
+    EXPECT_EQ("field", collector.headers[0].name);
+    EXPECT_EQ("", collector.headers[0].filename);
+    EXPECT_EQ("file", collector.headers[1].name);
+    EXPECT_EQ("a.txt", collector.headers[1].filename);
+    EXPECT_EQ("text/plain", collector.headers[1].content_type);
+    EXPECT_EQ(2u, collector.headers[1].headers.size());
+    EXPECT_EQ(0u, collector.headers[2].headers.size());
+  }
+
+  net::HTTPMultipartParser parser("xyz");
+  MultipartCollector collector;
+  const string malformed = "--xyz\r\nNo colon\r\n\r\n";
+  ASSERT_THROW(parser.Feed(malformed.data(), malformed.length(), collector), net::HTTPMalformedBodyException);
+}
+
+TEST(HTTPStreamingServerConnection, StreamsMultipartBody) {
+  int fds[2];
+  ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Connection client((net::SocketHandle(net::SocketHandle::FromHandle(fds[1]))));
+  string file(1000 * 1000, ' ');
+  for (size_t i = 0; i < file.length(); ++i) {
+    file[i] = 'a' + i % 26;
+  }
+  const string body =
+      "--boundary\r\nContent-Disposition: form-data; name=\"upload\"; filename=\"big.bin\"\r\n\r\n" + file +
+      "\r\n--boundary--\r\n";
+  thread writer([&client, &body]() {
+    client.BlockingWrite(strings::Printf(
+        "POST /upload HTTP/1.1\r\nContent-Type: multipart/form-data; boundary=boundary\r\n"
+        "Content-Length: %d\r\nConnection: close\r\n\r\n",
+        static_cast<int>(body.length())));
+    client.BlockingWrite(body);
+  });
+  {
+    Connection server((net::SocketHandle(net::SocketHandle::FromHandle(fds[0]))));
+    net::HTTPStreamingServerConnection c(std::move(server));
+    MultipartCollector collector;
+    EXPECT_EQ(body.length(), net::StreamMultipartRequestBody(c, collector, 4096));
+    ASSERT_EQ(1u, collector.headers.size());
+    EXPECT_EQ("big.bin", collector.headers[0].filename);
+    EXPECT_EQ('[' + file + ']', collector.parts);
+    c.SendHTTPResponse("OK");
+  }
+  writer.join();
+}
+
+TEST(HTTPServerConnection, SendsContinueBeforeReadingTheBody) {
+  const string kContinue = "HTTP/1.1 100 Continue\r\n\r\n";
+  int fds[2];
+  ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Connection client((net::SocketHandle(net::SocketHandle::FromHandle(fds[1]))));
+  thread server([&fds]() {
+    Connection connection((net::SocketHandle(net::SocketHandle::FromHandle(fds[0]))));
+    HTTPServerConnection c(std::move(connection));
+    EXPECT_TRUE(c.Message().ExpectsContinue());
+    c.SendHTTPResponse(c.Message().Body());
+  });
+  client.BlockingWrite(
+      "POST / HTTP/1.1\r\nExpect: 100-continue\r\nContent-Length: 5\r\nConnection: close\r\n\r\n");
+  string interim(kContinue.length(), ' ');
+  ASSERT_EQ(interim.length(), client.BlockingRead(&interim[0], interim.length(), Connection::FillFullBuffer));
+  EXPECT_EQ(kContinue, interim);
+  client.BlockingWrite("hello");
+  EXPECT_NE(string::npos, client.BlockingReadUntilEOF().find("\r\n\r\nhello"));
+  server.join();
+}
+
+TEST(HTTPStreamingServerConnection, RejectsTheBodyBeforeItIsSent) {
+  const string kContinue = "HTTP/1.1 100 Continue\r\n\r\n";
+  int fds[2];
+  ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Connection client((net::SocketHandle(net::SocketHandle::FromHandle(fds[1]))));
+  string responses;
+  thread writer([&client, &kContinue, &responses]() {
+    client.BlockingWrite("POST /accepted HTTP/1.1\r\nExpect: 100-continue\r\nContent-Length: 5\r\n\r\n");
+    string interim(kContinue.length(), ' ');
+    client.BlockingRead(&interim[0], interim.length(), Connection::FillFullBuffer);
+    EXPECT_EQ(kContinue, interim);
+    client.BlockingWrite("hello");
+    // The body of this one is never sent, as the server does not say to.
+    client.BlockingWrite("POST /rejected HTTP/1.1\r\nExpect: 100-continue\r\nContent-Length: 100000\r\n\r\n");
+    responses = client.BlockingReadUntilEOF();
+  });
+  {
+    Connection server((net::SocketHandle(net::SocketHandle::FromHandle(fds[0]))));
+    net::HTTPStreamingServerConnection c(std::move(server));
+    string body;
+    c.StreamRequestBody([&body](const char* data, size_t length) { body.append(data, length); });
+    EXPECT_EQ("hello", body);
+    c.SendHTTPResponse("accepted");
+    ASSERT_TRUE(c.NextRequest());
+    EXPECT_EQ("/rejected", c.Message().URL());
+    EXPECT_TRUE(c.Message().BodyAwaitsContinue());
+    c.SendHTTPResponse("rejected", net::HTTPResponseCode::RequestEntityTooLarge);
+    EXPECT_FALSE(c.NextRequest());
+  }
+  writer.join();
+  EXPECT_EQ(string::npos, responses.find("100 Continue"));
+  EXPECT_NE(string::npos, responses.find("\r\n\r\naccepted"));
+  EXPECT_NE(string::npos, responses.find("Connection: close\r\n"));
+  EXPECT_NE(string::npos, responses.find("\r\n\r\nrejected"));
+}
+
+TEST(HTTPServerConnection, PipelinedResponsesThroughBufferedConnection) {
+  thread t([](Socket s) {
+             HTTPServerConnection c(s.Accept());
+             do {
+               c.SendHTTPResponse(c.Message().URL());
+             } while (c.NextRequest());
+           },
+           Socket(FLAGS_port));
+  Connection connection(ClientSocket("localhost", FLAGS_port));
+  connection.BlockingWrite(
+      "GET /one HTTP/1.1\r\n\r\n"
+      "GET /two HTTP/1.1\r\n\r\n"
+      "GET /three HTTP/1.1\r\nConnection: close\r\n\r\n");
+  // Each message leaves the bytes of the next ones in `buffered`, to read them from.
+  bricks::net::BufferedConnection buffered(connection);
+  EXPECT_EQ("/one", HTTPReceivedMessage(buffered).Body());
+  EXPECT_EQ("/two", HTTPReceivedMessage(buffered).Body());
+  EXPECT_EQ("/three", HTTPReceivedMessage(buffered).Body());
+  // `SendHTTPResponse()` follows each body with a CRLF, which the next message would skip.
+  EXPECT_EQ("\r\n", buffered.ReadUntilEOF());
+  t.join();
+}
+
+TEST(HTTPServerConnection, SendFileResponse) {
+  const string file_name = "build/send_file_response.txt";
+  FileSystem::WriteStringToFile(file_name, "0123456789");
+  int fds[2];
+  ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Connection client((net::SocketHandle(net::SocketHandle::FromHandle(fds[1]))));
+  client.BlockingWrite(
+      "GET /whole HTTP/1.1\r\n\r\n"
+      "GET /range HTTP/1.1\r\nRange: bytes=2-5\r\n\r\n"
+      "GET /suffix HTTP/1.1\r\nrange: bytes=-3\r\n\r\n"
+      "GET /open HTTP/1.1\r\nRange: bytes=7-100\r\n\r\n"
+      "GET /unsatisfiable HTTP/1.1\r\nRange: bytes=10-\r\n\r\n"
+      "GET /multiple HTTP/1.1\r\nRange: bytes=0-1,3-4\r\nConnection: close\r\n\r\n");
+  {
+    Connection server((net::SocketHandle(net::SocketHandle::FromHandle(fds[0]))));
+    HTTPServerConnection c(std::move(server));
+    ASSERT_THROW(c.SendFileResponse("build/does_not_exist.txt"), FileException);
+    do {
+      c.SendFileResponse(file_name, "text/plain", {{"X-URL", c.Message().URL()}});
+    } while (c.NextRequest());
+  }
+  const string response = client.BlockingReadUntilEOF();
+  FileSystem::RemoveFile(file_name);
+  size_t offset = 0;
+  for (const string& expected : {string("HTTP/1.1 200 OK\r\n"),
+                                 string("X-URL: /whole\r\nAccept-Ranges: bytes\r\n\r\n0123456789"),
+                                 string("HTTP/1.1 206 Partial Content\r\n"),
+                                 string("Content-Length: 4\r\n"),
+                                 string("Content-Range: bytes 2-5/10\r\n\r\n2345"),
+                                 string("Content-Range: bytes 7-9/10\r\n\r\n789"),
+                                 string("Content-Range: bytes 7-9/10\r\n\r\n789"),
+                                 string("HTTP/1.1 416 Requested range not satisfiable\r\n"),
+                                 string("Content-Range: bytes */10\r\n\r\n"),
+                                 string("HTTP/1.1 200 OK\r\n"),
+                                 string("X-URL: /multiple\r\nAccept-Ranges: bytes\r\n"),
+                                 string("Connection: close\r\n\r\n")}) {
+    const size_t position = response.find(expected, offset);
+    ASSERT_NE(string::npos, position) << expected;
+    offset = position + expected.length();
+  }
+  EXPECT_EQ("0123456789\r\n", response.substr(offset));
+}
+
+TEST(HTTPServerConnection, ChunkedResponse) {
+  int fds[2];
+  ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Connection client((net::SocketHandle(net::SocketHandle::FromHandle(fds[1]))));
+  client.BlockingWrite("GET /chunked HTTP/1.1\r\n\r\nGET /next HTTP/1.1\r\nConnection: close\r\n\r\n");
+  // Returns what the client has received since the previous call, and keeps all of it in `response`.
+  string response;
+  const auto received = [fds, &response]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    char buffer[1024];
+    const ssize_t length = ::recv(fds[1], buffer, sizeof(buffer), MSG_DONTWAIT);
+    const string result = length > 0 ? string(buffer, length) : string();
+    response += result;
+    return result;
+  };
+  {
+    Connection server((net::SocketHandle(net::SocketHandle::FromHandle(fds[0]))));
+    HTTPServerConnection c(std::move(server));
+    {
+      net::ChunkedResponseSender sender =
+          c.SendChunkedHTTPResponse(net::HTTPResponseCode::OK, "text/plain", {}, 10, 50);
+      // The first bytes go out right away.
+      sender.Send("first");
+      const string first = received();
+      EXPECT_EQ(0u, first.find("HTTP/1.1 200 OK\r\n"));
+      EXPECT_NE(string::npos, first.find("\r\nTransfer-Encoding: chunked\r\n"));
+      EXPECT_EQ(string::npos, first.find("Content-Length"));
+      EXPECT_EQ(first.length() - 14, first.find("\r\n\r\n5\r\nfirst\r\n"));
+      // The next ones are coalesced, until the buffer is full or the flush interval has passed.
+      sender.Send("a");
+      sender.Send("b");
+      EXPECT_EQ("", received());
+      for (int i = 0; i < 5; ++i) {
+        sender.Send("cd");
+      }
+      EXPECT_EQ("a\r\nabcdcdcdcd\r\n", received());
+      std::this_thread::sleep_for(std::chrono::milliseconds(60));
+      sender.Send("e");
+      EXPECT_EQ("3\r\ncde\r\n", received());
+      // Large pieces are sent as they are.
+      sender.Send(string(100, 'f'));
+    }
+    ASSERT_TRUE(c.NextRequest());
+    EXPECT_EQ("/next", c.Message().URL());
+    c.SendHTTPResponse("next");
+  }
+  response += client.BlockingReadUntilEOF();
+  // Parse the response back.
+  ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Connection parser_input((net::SocketHandle(net::SocketHandle::FromHandle(fds[1]))));
+  Connection parser_output((net::SocketHandle(net::SocketHandle::FromHandle(fds[0]))));
+  parser_input.BlockingWrite(response);
+  parser_input.SendEOF();
+  HTTPReceivedMessage message(parser_output);
+  EXPECT_EQ("firstabcdcdcdcdcde" + string(100, 'f'), message.Body());
+  const std::vector<char> unparsed = message.UnparsedBytes();
+  const string rest = string(unparsed.begin(), unparsed.end()) + parser_output.BlockingReadUntilEOF();
+  EXPECT_EQ(0u, rest.find("HTTP/1.1 200 OK\r\n")) << rest;
+  EXPECT_NE(string::npos, rest.find("\r\n\r\nnext"));
+}
+
+
+using bricks::net::HTTPRequest;
+using bricks::net::HTTPRequestParser;
+using bricks::net::HTTPResponse;
+using bricks::net::HTTPServer;
+
+TEST(HTTPRequestParser, ParsesIncrementally) {
+  const string requests =
+      "POST /chunked HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+      "3\r\nfoo\r\n4\r\nbarz\r\n0\r\n\r\n"
+      "GET /next HTTP/1.1\r\nConnection: close\r\n\r\n"
+      "PUT /raw HTTP/1.0\r\nContent-Length: 5\r\n\r\nhello";
+  HTTPRequestParser parser;
+  std::vector<HTTPRequest> parsed;
+  HTTPRequest request;
+  // Feed one byte at a time, to confirm requests split at any point are parsed.
+  for (const char c : requests) {
+    parser.Feed(&c, 1);
+    while (parser.Next(request)) {
+      parsed.push_back(request);
+    }
+  }
+  EXPECT_FALSE(parser.Failed());
+  EXPECT_FALSE(parser.HasPartialRequest());
+  ASSERT_EQ(3u, parsed.size());
+  EXPECT_EQ("POST", parsed[0].method);
+  EXPECT_EQ("/chunked", parsed[0].url);
+  EXPECT_EQ("foobarz", parsed[0].body);
+  EXPECT_TRUE(parsed[0].keep_alive);
+  EXPECT_EQ("GET", parsed[1].method);
+  EXPECT_EQ("/next", parsed[1].url);
+  EXPECT_EQ("", parsed[1].body);
+  EXPECT_FALSE(parsed[1].keep_alive);
+  EXPECT_EQ("PUT", parsed[2].method);
+  EXPECT_EQ("hello", parsed[2].body);
+  EXPECT_EQ("5", parsed[2].headers["Content-Length"]);
+  EXPECT_FALSE(parsed[2].keep_alive);
+}
+
+TEST(HTTPRequestParser, TellsToContinueOnlyBeforeTheBody) {
+  HTTPRequestParser parser;
+  HTTPRequest request;
+  const string headers = "PUT /a HTTP/1.1\r\nExpect: 100-continue\r\nContent-Length: 5\r\n\r\n";
+  parser.Feed(headers.data(), headers.length());
+  EXPECT_FALSE(parser.Next(request));
+  EXPECT_TRUE(parser.TakeContinue());
+  EXPECT_FALSE(parser.TakeContinue());
+  parser.Feed("hello", 5);
+  ASSERT_TRUE(parser.Next(request));
+  EXPECT_EQ("hello", request.body);
+  // The body has arrived along with the headers, and an HTTP/1.0 client does not wait for "100 Continue".
+  const string requests =
+      "PUT /b HTTP/1.1\r\nExpect: 100-continue\r\nContent-Length: 2\r\n\r\nok"
+      "PUT /c HTTP/1.0\r\nExpect: 100-continue\r\nContent-Length: 2\r\n\r\n";
+  parser.Feed(requests.data(), requests.length());
+  ASSERT_TRUE(parser.Next(request));
+  EXPECT_EQ("ok", request.body);
+  EXPECT_FALSE(parser.Next(request));
+  EXPECT_FALSE(parser.TakeContinue());
+}
+
+TEST(HTTPRequestParser, RejectsMalformedRequests) {
+  HTTPRequestParser parser(1024, 1024);
+  HTTPRequest request;
+  const string too_large = "POST / HTTP/1.1\r\nContent-Length: 100000\r\n\r\n";
+  parser.Feed(too_large.data(), too_large.length());
+  EXPECT_FALSE(parser.Next(request));
+  EXPECT_TRUE(parser.Failed());
+  EXPECT_EQ(bricks::net::HTTPResponseCode::RequestEntityTooLarge, parser.ErrorCode());
+}
+
+TEST(HTTPRequestParser, AllocatesOnlyForTheHeaders) {
+  // The method, the URL and the version fit the short string optimization, and one of the values does not.
+  const string text =
+      "GET /path HTTP/1.1\r\nHost: localhost\r\nUser-Agent: bricks-allocation-budget-test/1.0\r\n"
+      "Accept: */*\r\n\r\n";
+  HTTPRequestParser parser;
+  HTTPRequest request;
+  // The first request grows the buffers of the parser, which are then reused.
+  parser.Feed(text.data(), text.length());
+  ASSERT_TRUE(parser.Next(request));
+  // One map node per header, and one long value.
+  EXPECT_ALLOCATIONS_AT_MOST(4, {
+    parser.Feed(text.data(), text.length());
+    ASSERT_TRUE(parser.Next(request));
+  });
+  EXPECT_EQ("bricks-allocation-budget-test/1.0", request.headers["User-Agent"]);
+}
+
+// Sends `request` over a new connection, half-closes it, and returns everything the server sends back.
+static string RawHTTPExchange(const string& request) {
+  Connection connection(ClientSocket("localhost", FLAGS_port));
+  connection.BlockingWrite(request);
+  connection.SendEOF();
+  return connection.BlockingReadUntilEOF();
+}
+
+static void EchoHandler(const HTTPRequest& request, HTTPResponse& response) {
+  response.body = request.method + ' ' + request.url + (request.body.empty() ? "" : ' ' + request.body);
+}
+
+TEST(HTTPServer, ServesRequests) {
+  HTTPServer server(FLAGS_port, EchoHandler);
+  {
+    Connection connection(ClientSocket("localhost", FLAGS_port));
+    connection.BlockingWrite("POST /unittest_post\r\nContent-Length: 7\r\n\r\nBAZINGA");
+    connection.SendEOF();
+    HTTPReceivedMessage message(connection);
+    EXPECT_EQ("POST /unittest_post BAZINGA", message.Body());
+  }
+  EXPECT_EQ(
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: text/plain\r\n"
+      "Content-Length: 13\r\n"
+      "Connection: close\r\n"
+      "\r\n"
+      "GET /unittest",
+      RawHTTPExchange("GET /unittest HTTP/1.0\r\n\r\n"));
+  EXPECT_EQ(
+      "HTTP/1.1 400 Bad Request\r\n"
+      "Content-Type: text/plain\r\n"
+      "Content-Length: 11\r\n"
+      "Connection: close\r\n"
+      "\r\n"
+      "Bad Request",
+      RawHTTPExchange("NOT_HTTP\r\n\r\n"));
+}
+
+TEST(HTTPServer, KeepAliveAndPipelining) {
+  HTTPServer server(FLAGS_port, EchoHandler);
+  // Two requests in one write, then one more on the same connection, the last one closing it.
+  Connection connection(ClientSocket("localhost", FLAGS_port));
+  connection.BlockingWrite("GET /one HTTP/1.1\r\n\r\nGET /two HTTP/1.1\r\n\r\n");
+  connection.BlockingWrite("POST /three HTTP/1.1\r\nContent-Length: 3\r\nConnection: close\r\n\r\nfoo");
+  const string response = connection.BlockingReadUntilEOF();
+  const size_t one = response.find("\r\n\r\nGET /one");
+  const size_t two = response.find("\r\n\r\nGET /two");
+  const size_t three = response.find("\r\n\r\nPOST /three foo");
+  ASSERT_NE(string::npos, one);
+  ASSERT_NE(string::npos, two);
+  ASSERT_NE(string::npos, three);
+  EXPECT_LT(one, two);
+  EXPECT_LT(two, three);
+  // Only the last response closes the connection.
+  EXPECT_GT(response.find("Connection: close"), two);
+  EXPECT_EQ(response.find("Connection: close"), response.rfind("Connection: close"));
+}
+
+TEST(HTTPServer, SlowClientDoesNotBlockOthers) {
+  HTTPServer server(FLAGS_port, EchoHandler);
+  // The slow client sends half of its request, and the server keeps serving the others meanwhile.
+  Connection slow(ClientSocket("localhost", FLAGS_port));
+  slow.BlockingWrite("GET /slow HTTP/1.1\r\n");
+  for (int i = 0; i < 3; ++i) {
+    const string response = RawHTTPExchange("GET /fast HTTP/1.1\r\n\r\n");
+    EXPECT_EQ("GET /fast", response.substr(response.length() - 9));
+  }
+  slow.BlockingWrite("Connection: close\r\n\r\n");
+  const string response = slow.BlockingReadUntilEOF();
+  EXPECT_EQ("GET /slow", response.substr(response.length() - 9));
+}
+
+TEST(HTTPServer, ClosesIdleConnections) {
+  HTTPServer server(FLAGS_port, EchoHandler, 1, 200);
+  // The stuck client never completes its request, the active one keeps sending its requests.
+  Connection stuck(ClientSocket("localhost", FLAGS_port));
+  stuck.BlockingWrite("GET /stuck HTTP/1.1\r\n");
+  Connection active(ClientSocket("localhost", FLAGS_port));
+  for (int i = 0; i < 6; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    active.BlockingWrite("GET /active HTTP/1.1\r\n\r\n");
+  }
+  active.BlockingWrite("GET /last HTTP/1.1\r\nConnection: close\r\n\r\n");
+  const string response = active.BlockingReadUntilEOF();
+  EXPECT_EQ("GET /last", response.substr(response.length() - 9));
+  // Closed by the server long before, while the active one has outlived the timeout.
+  EXPECT_EQ("", stuck.BlockingReadUntilEOF());
+  while (server.NumberOfConnections()) {
+    std::this_thread::yield();
+  }
+}
+
+TEST(HTTPServer, ServesManyConcurrentConnections) {
+  const size_t kConnections = 200;
+  HTTPServer server(FLAGS_port, EchoHandler, 2);
+  std::vector<std::unique_ptr<Connection>> connections;
+  for (size_t i = 0; i < kConnections; ++i) {
+    connections.emplace_back(new Connection(ClientSocket("localhost", FLAGS_port)));
+  }
+  while (server.NumberOfConnections() != kConnections) {
+    std::this_thread::yield();
+  }
+  for (size_t i = 0; i < kConnections; ++i) {
+    connections[i]->BlockingWrite("GET /" + to_string(i) + " HTTP/1.1\r\nConnection: close\r\n\r\n");
+  }
+  for (size_t i = 0; i < kConnections; ++i) {
+    const string response = connections[i]->BlockingReadUntilEOF();
+    const string expected = "GET /" + to_string(i);
+    EXPECT_EQ(expected, response.substr(response.length() - expected.length()));
+  }
+  connections.clear();
+  while (server.NumberOfConnections()) {
+    std::this_thread::yield();
+  }
+}
+
+TEST(HTTPServer, ListenerPerThreadWithReusePort) {
+  const size_t kConnections = 200;
+  bricks::net::HTTPServerParameters parameters;
+  parameters.threads = 4;
+  parameters.reuse_port = true;
+  parameters.pin_threads_to_cpus = true;
+  HTTPServer server(FLAGS_port, EchoHandler, parameters);
+  for (size_t i = 0; i < kConnections; ++i) {
+    const string response = RawHTTPExchange("GET /" + to_string(i) + " HTTP/1.1\r\nConnection: close\r\n\r\n");
+    const string expected = "GET /" + to_string(i);
+    EXPECT_EQ(expected, response.substr(response.length() - expected.length()));
+  }
+  // Each thread accepts from its own socket, and the kernel spreads the connections by their source ports.
+  const std::vector<size_t> accepted = server.NumberOfAcceptedConnectionsPerThread();
+  ASSERT_EQ(4u, accepted.size());
+  EXPECT_EQ(kConnections, std::accumulate(accepted.begin(), accepted.end(), static_cast<size_t>(0)));
+  EXPECT_GT(std::count_if(accepted.begin(), accepted.end(), [](size_t n) { return n > 0; }), 1);
+}
+
+TEST(HTTPServer, LoadShedderDrainsTheQueueOnceOverloaded) {
+  using std::chrono::milliseconds;
+  bricks::net::HTTPLoadShedder shedder(10, 100);
+  const auto t = std::chrono::steady_clock::now();
+  // A good queue absorbs a burst of up to the interval.
+  EXPECT_FALSE(shedder.Shed(t, milliseconds(0)));
+  EXPECT_TRUE(shedder.Shed(t, milliseconds(150)));
+  EXPECT_FALSE(shedder.Overloaded());
+  // Once even the quickest request of the interval has waited for longer than the target, the queue is bad.
+  EXPECT_FALSE(shedder.Shed(t + milliseconds(100), milliseconds(20)));
+  EXPECT_FALSE(shedder.Shed(t + milliseconds(150), milliseconds(30)));
+  EXPECT_TRUE(shedder.Shed(t + milliseconds(200), milliseconds(20)));
+  EXPECT_TRUE(shedder.Overloaded());
+  EXPECT_FALSE(shedder.Shed(t + milliseconds(250), milliseconds(5)));
+  // And good again after an interval with a request served in time.
+  EXPECT_FALSE(shedder.Shed(t + milliseconds(300), milliseconds(20)));
+  EXPECT_FALSE(shedder.Overloaded());
+}
+
+TEST(HTTPServer, ShedsTheRequestsThatHaveWaitedTooLong) {
+  bricks::net::HTTPServerParameters parameters;
+  parameters.load_shedding_target_ms = 1;
+  parameters.load_shedding_interval_ms = 10;
+  parameters.load_shedding_retry_after_seconds = 3;
+  std::atomic_size_t handled(0);
+  HTTPServer server(FLAGS_port, [&handled](const HTTPRequest& request, HTTPResponse& response) {
+    ++handled;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EchoHandler(request, response);
+  }, parameters);
+  bricks::metrics::Counter& shed =
+      bricks::metrics::Registry::Singleton().GetCounter("bricks_http_server_requests_shed_total", "");
+  const uint64_t shed_before = shed.Value();
+  // The requests of one write wait for the slow ones before them: all but the first have waited too long.
+  const string response = RawHTTPExchange(
+      "GET /one HTTP/1.1\r\n\r\nGET /two HTTP/1.1\r\n\r\nGET /three HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"
+      "GET /four HTTP/1.1\r\nConnection: close\r\n\r\n");
+  EXPECT_EQ(1u, handled);
+  EXPECT_EQ(3u, shed.Value() - shed_before);
+  const string unavailable =
+      "HTTP/1.1 503 Service Unavailable\r\n"
+      "Content-Type: text/plain\r\n"
+      "Content-Length: 19\r\n"
+      "Retry-After: 3\r\n";
+  EXPECT_EQ("GET /one" + unavailable + "\r\nService Unavailable" + unavailable +
+                "Connection: keep-alive\r\n\r\nService Unavailable" + unavailable +
+                "Connection: close\r\n\r\nService Unavailable",
+            response.substr(response.find("GET /one")));
+}
+
+TEST(HTTPServer, HandlersOnThePoolDoNotBlockTheLoop) {
+  bricks::net::HTTPServerParameters parameters;
+  parameters.handler_threads = 2;
+  HTTPServer server(FLAGS_port, [](const HTTPRequest& request, HTTPResponse& response) {
+    if (request.url == "/slow") {
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    EchoHandler(request, response);
+  }, parameters);
+  Connection slow(ClientSocket("localhost", FLAGS_port));
+  slow.BlockingWrite("GET /slow HTTP/1.1\r\n\r\nGET /after HTTP/1.1\r\nConnection: close\r\n\r\n");
+  const auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < 3; ++i) {
+    const string response = RawHTTPExchange("GET /fast HTTP/1.1\r\n\r\n");
+    EXPECT_EQ("GET /fast", response.substr(response.length() - 9));
+  }
+  EXPECT_LT(std::chrono::steady_clock::now() - begin, std::chrono::milliseconds(200));
+  // The pipelined requests are responded to in order, each once the one before it has been.
+  const string response = slow.BlockingReadUntilEOF();
+  ASSERT_NE(string::npos, response.find("\r\n\r\nGET /slowHTTP/1.1 200 OK"));
+  EXPECT_EQ("GET /after", response.substr(response.length() - 10));
+  EXPECT_EQ(0u, server.NumberOfQueuedRequests());
+}
+
+TEST(HTTPServer, StopsReadingOnceThePoolIsFull) {
+  bricks::net::HTTPServerParameters parameters;
+  parameters.handler_threads = 1;
+  parameters.max_queued_requests = 1;
+  std::atomic_bool release(false);
+  std::atomic_size_t handled(0);
+  HTTPServer server(FLAGS_port, [&release, &handled](const HTTPRequest& request, HTTPResponse& response) {
+    ++handled;
+    while (request.url == "/block" && !release) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EchoHandler(request, response);
+  }, parameters);
+  Connection blocked(ClientSocket("localhost", FLAGS_port));
+  blocked.BlockingWrite("GET /block HTTP/1.1\r\nConnection: close\r\n\r\n");
+  while (server.NumberOfQueuedRequests() != 1) {
+    std::this_thread::yield();
+  }
+  Connection next(ClientSocket("localhost", FLAGS_port));
+  next.BlockingWrite("GET /next HTTP/1.1\r\nConnection: close\r\n\r\n");
+  // The request waits for the pool to have room, rather than piling up on it.
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_EQ(1u, handled);
+  EXPECT_EQ(1u, server.NumberOfQueuedRequests());
+  release = true;
+  const string response = next.BlockingReadUntilEOF();
+  EXPECT_EQ("GET /next", response.substr(response.length() - 9));
+  EXPECT_EQ(2u, handled);
+  const string blocked_response = blocked.BlockingReadUntilEOF();
+  EXPECT_EQ("GET /block", blocked_response.substr(blocked_response.length() - 10));
+}
+
+TEST(HTTPServer, LogsSampledRequests) {
+  std::mutex mutex;
+  std::vector<bricks::net::HTTPAccessLogRecord> records;
+  bricks::net::HTTPServerParameters parameters;
+  parameters.access_log = [&mutex, &records](const bricks::net::HTTPAccessLogRecord& record) {
+    std::lock_guard<std::mutex> lock(mutex);
+    records.push_back(record);
+  };
+  parameters.access_log_sample_every = 2;
+  HTTPServer server(FLAGS_port, EchoHandler, parameters);
+  Connection connection(ClientSocket("localhost", FLAGS_port));
+  connection.BlockingWrite("GET /one HTTP/1.1\r\n\r\nGET /two HTTP/1.1\r\n\r\n");
+  connection.BlockingWrite("POST /three?secret=42 HTTP/1.1\r\nContent-Length: 3\r\n\r\nfoo");
+  connection.BlockingWrite("GET /four HTTP/1.1\r\nConnection: close\r\n\r\n");
+  const string response = connection.BlockingReadUntilEOF();
+  // The records are passed on before the responses are sent.
+  std::lock_guard<std::mutex> lock(mutex);
+  ASSERT_EQ(2u, records.size());
+  EXPECT_EQ(0u, records[0].request_id);
+  EXPECT_EQ("GET", string(records[0].method));
+  EXPECT_EQ("/one", string(records[0].path));
+  EXPECT_EQ(0u, records[0].request_bytes);
+  EXPECT_EQ(2u, records[1].request_id);
+  EXPECT_EQ("POST", string(records[1].method));
+  EXPECT_EQ("/three", string(records[1].path));
+  EXPECT_EQ(3u, records[1].request_bytes);
+  EXPECT_EQ(200u, records[1].status);
+  // The first response, headers included, is the start of what has been received.
+  EXPECT_EQ(response.find("GET /one") + 8, records[0].response_bytes);
+  EXPECT_LE(records[0].timestamp_us, records[1].timestamp_us);
+}
+
+#if defined(BRICKS_NET_HAS_FIBERS)
+TEST(FiberHTTPServer, HandlersSuspendWithoutBlockingOthers) {
+  using bricks::net::FiberLoop;
+  bricks::net::FiberHTTPServer server(FLAGS_port, [](const HTTPRequest& request, HTTPResponse& response) {
+    if (request.url == "/slow") {
+      // Straight-line code, with the fiber suspended and the thread serving the others meanwhile.
+      FiberLoop::Current()->Sleep(200);
+    }
+    EchoHandler(request, response);
+  });
+  Connection slow(ClientSocket("localhost", FLAGS_port));
+  slow.BlockingWrite("GET /slow HTTP/1.1\r\nConnection: close\r\n\r\n");
+  const auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < 3; ++i) {
+    const string response = RawHTTPExchange("GET /fast HTTP/1.1\r\n\r\n");
+    EXPECT_EQ("GET /fast", response.substr(response.length() - 9));
+  }
+  EXPECT_LT(std::chrono::steady_clock::now() - begin, std::chrono::milliseconds(200));
+  const string response = slow.BlockingReadUntilEOF();
+  EXPECT_EQ("GET /slow", response.substr(response.length() - 9));
+  EXPECT_EQ(
+      "HTTP/1.1 400 Bad Request\r\n"
+      "Content-Type: text/plain\r\n"
+      "Content-Length: 11\r\n"
+      "Connection: close\r\n"
+      "\r\n"
+      "Bad Request",
+      RawHTTPExchange("NOT_HTTP\r\n\r\n"));
+}
+
+TEST(FiberHTTPServer, ServesManyConcurrentConnections) {
+  const size_t kConnections = 200;
+  bricks::net::FiberHTTPServer server(FLAGS_port, EchoHandler, 2);
+  std::vector<std::unique_ptr<Connection>> connections;
+  for (size_t i = 0; i < kConnections; ++i) {
+    connections.emplace_back(new Connection(ClientSocket("localhost", FLAGS_port)));
+  }
+  while (server.NumberOfConnections() != kConnections) {
+    std::this_thread::yield();
+  }
+  for (size_t i = 0; i < kConnections; ++i) {
+    connections[i]->BlockingWrite("GET /" + to_string(i) + " HTTP/1.1\r\n\r\nGET /again HTTP/1.1\r\n");
+  }
+  for (size_t i = 0; i < kConnections; ++i) {
+    connections[i]->BlockingWrite("Connection: close\r\n\r\n");
+    const string response = connections[i]->BlockingReadUntilEOF();
+    const string expected = "GET /" + to_string(i);
+    EXPECT_NE(string::npos, response.find("\r\n\r\n" + expected + "HTTP/1.1 200 OK"));
+    EXPECT_EQ("GET /again", response.substr(response.length() - 10));
+  }
+  connections.clear();
+  while (server.NumberOfConnections()) {
+    std::this_thread::yield();
+  }
+}
+#endif  // defined(BRICKS_NET_HAS_FIBERS)
+
+using bricks::net::GenericHTTPRouter;
+using bricks::net::HTTPRouteParameters;
+using bricks::net::HTTPRouter;
+
+TEST(HTTPRouter, MatchesLiteralsParametersAndPrefixes) {
+  GenericHTTPRouter<string> router;
+  router.Register("GET", "/", "root");
+  router.Register("GET", "/users", "users");
+  router.Register("POST", "/users", "new user");
+  router.Register("GET", "/users/new", "new user form");
+  router.Register("GET", "/users/:id", "user");
+  router.Register("GET", "/users/:id/posts/:post", "post");
+  router.Register("GET", "/user_count", "user count");
+  router.Register("GET", "/static/*file", "static");
+  router.Register("GET", "/static/index.html", "index");
+
+  const auto find = [&router](const string& method, const string& url) -> string {
+    HTTPRouteParameters parameters;
+    const string* handler = router.Find(method, url, parameters);
+    if (!handler) {
+      return "NONE";
+    }
+    string result = *handler;
+    for (size_t i = 0; i < parameters.Size(); ++i) {
+      result += ' ' + *parameters[i].name + '=' + string(parameters[i].value, parameters[i].length);
+    }
+    return result;
+  };
+
+  EXPECT_EQ("root", find("GET", "/"));
+  EXPECT_EQ("users", find("GET", "/users"));
+  EXPECT_EQ("new user", find("POST", "/users"));
+  EXPECT_EQ("users", find("GET", "/users?limit=10"));
+  EXPECT_EQ("user count", find("GET", "/user_count"));
+  // The literal edges take precedence, and the parameters match what the literal ones do not.
+  EXPECT_EQ("new user form", find("GET", "/users/new"));
+  EXPECT_EQ("user id=newton", find("GET", "/users/newton"));
+  EXPECT_EQ("user id=42", find("GET", "/users/42#top"));
+  EXPECT_EQ("post id=42 post=7", find("GET", "/users/42/posts/7"));
+  EXPECT_EQ("NONE", find("GET", "/users/42/posts"));
+  EXPECT_EQ("NONE", find("GET", "/users/"));
+  EXPECT_EQ("NONE", find("GET", "/userz"));
+  EXPECT_EQ("index", find("GET", "/static/index.html"));
+  EXPECT_EQ("static file=css/main.css", find("GET", "/static/css/main.css"));
+  EXPECT_EQ("static file=", find("GET", "/static/"));
+  EXPECT_EQ("NONE", find("GET", "/static"));
+  EXPECT_EQ("NONE", find("DELETE", "/users/42"));
+
+  HTTPRouteParameters parameters;
+  bool path_found;
+  EXPECT_TRUE(router.Find("GET", "/users/42/posts/7", parameters, &path_found) != nullptr);
+  EXPECT_TRUE(path_found);
+  EXPECT_EQ("7", parameters.Get("post"));
+  EXPECT_FALSE(parameters.Has("file"));
+  EXPECT_TRUE(router.Find("PUT", "/users", parameters, &path_found) == nullptr);
+  EXPECT_TRUE(path_found);
+  EXPECT_EQ("GET, POST", router.AllowedMethods("/users"));
+  EXPECT_TRUE(router.Find("GET", "/nope", parameters, &path_found) == nullptr);
+  EXPECT_FALSE(path_found);
+}
+
+TEST(HTTPRouter, RejectsInvalidAndConflictingPatterns) {
+  GenericHTTPRouter<int> router;
+  router.Register("GET", "/users/:id", 1);
+  ASSERT_THROW(router.Register("GET", "users", 2), bricks::net::HTTPRouteInvalidPatternException);
+  ASSERT_THROW(router.Register("GET", "/users:id", 2), bricks::net::HTTPRouteInvalidPatternException);
+  ASSERT_THROW(router.Register("GET", "/users/:", 2), bricks::net::HTTPRouteInvalidPatternException);
+  ASSERT_THROW(router.Register("GET", "/files/*path/more", 2), bricks::net::HTTPRouteInvalidPatternException);
+  ASSERT_THROW(router.Register("GET", "/users/:id", 2), bricks::net::HTTPRouteConflictException);
+  ASSERT_THROW(router.Register("GET", "/users/:name/posts", 2), bricks::net::HTTPRouteConflictException);
+  router.Register("PUT", "/users/:id", 2);
+}
+
+TEST(HTTPRouter, DispatchesHTTPServerRequests) {
+  HTTPRouter router;
+  router.Register("GET",
+                  "/hello/:name",
+                  [](const HTTPRequest&, const HTTPRouteParameters& parameters, HTTPResponse& response) {
+    response.body = "Hello, " + parameters.Get("name") + '!';
+  });
+  router.Register("POST",
+                  "/echo",
+                  [](const HTTPRequest& request, const HTTPRouteParameters&, HTTPResponse& response) {
+    response.body = request.body;
+  });
+  HTTPServer server(FLAGS_port, router.Handler());
+  const string hello = RawHTTPExchange("GET /hello/world HTTP/1.1\r\nConnection: close\r\n\r\n");
+  EXPECT_EQ("Hello, world!", hello.substr(hello.find("\r\n\r\n") + 4));
+  const string echo =
+      RawHTTPExchange("POST /echo HTTP/1.1\r\nContent-Length: 3\r\nConnection: close\r\n\r\nfoo");
+  EXPECT_EQ("foo", echo.substr(echo.find("\r\n\r\n") + 4));
+  const string not_allowed = RawHTTPExchange("GET /echo HTTP/1.1\r\nConnection: close\r\n\r\n");
+  EXPECT_EQ(0u, not_allowed.find("HTTP/1.1 405 Method Not Allowed\r\n"));
+  EXPECT_NE(string::npos, not_allowed.find("Allow: POST\r\n"));
+  const string not_found = RawHTTPExchange("GET /missing HTTP/1.1\r\nConnection: close\r\n\r\n");
+  EXPECT_EQ(0u, not_found.find("HTTP/1.1 404 Not Found\r\n"));
+}
+
+TEST(HTTPRouter, ServesTheCPUProfile) {
+  HTTPRouter router;
+  router.Register("GET", "/debug/profile", bricks::net::CPUProfileHTTPRouteHandler());
+  HTTPServer server(FLAGS_port, router.Handler(), 2);
+  std::atomic_bool done(false);
+  thread spinning([&done]() {
+    volatile uint64_t x = 0;
+    while (!done) {
+      x = x + 1;
+    }
+  });
+  const string folded =
+      RawHTTPExchange("GET /debug/profile?seconds=0.3&hz=200 HTTP/1.1\r\nConnection: close\r\n\r\n");
+  EXPECT_EQ(0u, folded.find("HTTP/1.1 200 OK\r\n"));
+  EXPECT_NE(string::npos, folded.find("Content-Type: text/plain; charset=utf-8\r\n"));
+  const string stacks = folded.substr(folded.find("\r\n\r\n") + 4);
+  ASSERT_FALSE(stacks.empty());
+  EXPECT_EQ('\n', stacks.back());
+  const string pprof =
+      RawHTTPExchange("GET /debug/profile?seconds=0.1&format=pprof HTTP/1.1\r\nConnection: close\r\n\r\n");
+  const string profile = pprof.substr(pprof.find("\r\n\r\n") + 4);
+  ASSERT_LE(5 * sizeof(uintptr_t), profile.length());
+  EXPECT_EQ(3u, reinterpret_cast<const uintptr_t*>(profile.data())[1]);
+  done = true;
+  spinning.join();
+  const string malformed =
+      RawHTTPExchange("GET /debug/profile?seconds=forever HTTP/1.1\r\nConnection: close\r\n\r\n");
+  EXPECT_EQ(0u, malformed.find("HTTP/1.1 400 Bad Request\r\n"));
+}
+
+// Decompresses gzip or zlib, detected by the header, for the tests of the compressed responses.
+static string Inflate(const string& compressed) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  EXPECT_EQ(Z_OK, ::inflateInit2(&stream, 15 + 32));
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data()));
+  stream.avail_in = static_cast<uInt>(compressed.length());
+  string result;
+  int code;
+  do {
+    char buffer[4096];
+    stream.next_out = reinterpret_cast<Bytef*>(buffer);
+    stream.avail_out = sizeof(buffer);
+    code = ::inflate(&stream, Z_NO_FLUSH);
+    result.append(buffer, sizeof(buffer) - stream.avail_out);
+  } while (code == Z_OK);
+  EXPECT_EQ(Z_STREAM_END, code);
+  ::inflateEnd(&stream);
+  return result;
+}
+
+TEST(HTTPCompression, NegotiatesEncodingAndContentType) {
+  using net::HTTPContentEncoding;
+  using net::NegotiateHTTPContentEncoding;
+  EXPECT_EQ(HTTPContentEncoding::Identity, NegotiateHTTPContentEncoding(""));
+  EXPECT_EQ(HTTPContentEncoding::Identity, NegotiateHTTPContentEncoding("br, identity"));
+  EXPECT_EQ(HTTPContentEncoding::Gzip, NegotiateHTTPContentEncoding("gzip, deflate, br"));
+  EXPECT_EQ(HTTPContentEncoding::Gzip, NegotiateHTTPContentEncoding("X-GZIP"));
+  EXPECT_EQ(HTTPContentEncoding::Deflate, NegotiateHTTPContentEncoding("gzip;q=0.5, deflate"));
+  EXPECT_EQ(HTTPContentEncoding::Deflate, NegotiateHTTPContentEncoding("gzip; q=0, *"));
+  EXPECT_EQ(HTTPContentEncoding::Gzip, NegotiateHTTPContentEncoding("*;q=0.1"));
+  EXPECT_EQ(HTTPContentEncoding::Identity, NegotiateHTTPContentEncoding("*;q=0"));
+  EXPECT_TRUE(net::IsHTTPContentTypeCompressible("text/html; charset=utf-8"));
+  EXPECT_TRUE(net::IsHTTPContentTypeCompressible("application/json"));
+  EXPECT_TRUE(net::IsHTTPContentTypeCompressible("image/svg+xml"));
+  EXPECT_FALSE(net::IsHTTPContentTypeCompressible("image/png"));
+  EXPECT_FALSE(net::IsHTTPContentTypeCompressible("Video/MP4"));
+  EXPECT_FALSE(net::IsHTTPContentTypeCompressible("application/zip"));
+  EXPECT_FALSE(net::IsHTTPContentTypeCompressible("font/woff2"));
+}
+
+// Has `respond` answer a request with the `Accept-Encoding` header, returns the headers and the body received.
+static std::pair<std::map<string, string>, string> CompressedExchange(
+    const string& accept_encoding, const std::function<void(HTTPServerConnection&)>& respond) {
+  int fds[2];
+  EXPECT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Connection client((net::SocketHandle(net::SocketHandle::FromHandle(fds[1]))));
+  client.BlockingWrite("GET / HTTP/1.1\r\nAccept-Encoding: " + accept_encoding + "\r\n\r\n");
+  {
+    Connection server((net::SocketHandle(net::SocketHandle::FromHandle(fds[0]))));
+    HTTPServerConnection c(std::move(server));
+    respond(c);
+  }
+  HTTPReceivedMessage message(client);
+  return std::make_pair(message.headers(), message.Body());
+}
+
+TEST(HTTPCompression, CompressesPlainAndChunkedResponses) {
+  string body;
+  for (int i = 0; i < 10000; ++i) {
+    body += to_string(i) + ' ';
+  }
+  const auto plain = CompressedExchange("deflate;q=0.5, gzip", [&body](HTTPServerConnection& c) {
+    net::SendCompressedHTTPResponse(c, body);
+  });
+  EXPECT_EQ("gzip", plain.first.at("Content-Encoding"));
+  EXPECT_EQ("Accept-Encoding", plain.first.at("Vary"));
+  EXPECT_GT(body.length() / 2, plain.second.length());
+  EXPECT_EQ(body, Inflate(plain.second));
+
+  const auto too_short = CompressedExchange("gzip", [](HTTPServerConnection& c) {
+    net::SendCompressedHTTPResponse(c, "short");
+  });
+  EXPECT_EQ(0u, too_short.first.count("Content-Encoding"));
+  EXPECT_EQ("short", too_short.second);
+
+  const auto png = CompressedExchange("gzip", [&body](HTTPServerConnection& c) {
+    net::SendCompressedHTTPResponse(c, body, net::HTTPResponseCode::OK, "image/png");
+  });
+  EXPECT_EQ(0u, png.first.count("Content-Encoding"));
+  EXPECT_EQ(body, png.second);
+
+  const auto chunked = CompressedExchange("deflate", [&body](HTTPServerConnection& c) {
+    net::CompressedChunkedResponseSender sender = net::SendCompressedChunkedHTTPResponse(c);
+    EXPECT_TRUE(sender.Compressed());
+    for (size_t offset = 0; offset < body.length(); offset += 1000) {
+      sender.Send(body.substr(offset, 1000));
+    }
+  });
+  EXPECT_EQ("deflate", chunked.first.at("Content-Encoding"));
+  EXPECT_EQ(body, Inflate(chunked.second));
+}
+
+TEST(HTTPCompression, CompressesRoutesWithTheirLevels) {
+  HTTPRouter router;
+  const string body(10000, 'x');
+  router.Register("GET",
+                  "/compressed",
+                  net::CompressedHTTPRouteHandler(
+                      [&body](const HTTPRequest&, const HTTPRouteParameters&, HTTPResponse& response) {
+                        response.body = body;
+                      },
+                      9));
+  router.Register("GET",
+                  "/uncompressed",
+                  net::CompressedHTTPRouteHandler(
+                      [&body](const HTTPRequest&, const HTTPRouteParameters&, HTTPResponse& response) {
+                        response.body = body;
+                      },
+                      0));
+  HTTPServer server(FLAGS_port, router.Handler());
+  const string compressed =
+      RawHTTPExchange("GET /compressed HTTP/1.1\r\nAccept-Encoding: gzip\r\nConnection: close\r\n\r\n");
+  EXPECT_NE(string::npos, compressed.find("\r\nContent-Encoding: gzip\r\n"));
+  EXPECT_EQ(body, Inflate(compressed.substr(compressed.find("\r\n\r\n") + 4)));
+  const string uncompressed =
+      RawHTTPExchange("GET /uncompressed HTTP/1.1\r\nAccept-Encoding: gzip\r\nConnection: close\r\n\r\n");
+  EXPECT_EQ(string::npos, uncompressed.find("Content-Encoding"));
+  EXPECT_EQ(body, uncompressed.substr(uncompressed.find("\r\n\r\n") + 4));
+  const string not_accepted = RawHTTPExchange("GET /compressed HTTP/1.1\r\nConnection: close\r\n\r\n");
+  EXPECT_EQ(body, not_accepted.substr(not_accepted.find("\r\n\r\n") + 4));
+}
+
+// Returns the value of the header in the raw response, or an empty string.
+static string RawHTTPHeader(const string& response, const string& name) {
+  const size_t begin = response.find("\r\n" + name + ": ");
+  if (begin == string::npos) {
+    return "";
+  }
+  const size_t value = begin + name.length() + 4;
+  return response.substr(value, response.find("\r\n", value) - value);
+}
+
+TEST(HTTPResponseCache, ServesRoutesFromCacheWithETags) {
+  net::HTTPResponseCache cache;
+  HTTPRouter router;
+  int status_calls = 0;
+  int volatile_calls = 0;
+  router.Register("GET",
+                  "/status",
+                  net::CachedHTTPRouteHandler(
+                      cache,
+                      [&status_calls](
+                          const HTTPRequest& request, const HTTPRouteParameters&, HTTPResponse& response) {
+                        ++status_calls;
+                        response.body = request.url + string(1000, 'x');
+                        response.content_type = "application/json";
+                      },
+                      60 * 1000));
+  router.Register("GET",
+                  "/volatile",
+                  net::CachedHTTPRouteHandler(
+                      cache,
+                      [&volatile_calls](
+                          const HTTPRequest&, const HTTPRouteParameters&, HTTPResponse& response) {
+                        response.body = to_string(++volatile_calls);
+                      },
+                      20));
+  HTTPServer server(FLAGS_port, router.Handler());
+  const string body = "/status" + string(1000, 'x');
+
+  const string first = RawHTTPExchange("GET /status HTTP/1.1\r\nConnection: close\r\n\r\n");
+  EXPECT_EQ(0u, first.find("HTTP/1.1 200 OK\r\n"));
+  EXPECT_EQ(body, first.substr(first.find("\r\n\r\n") + 4));
+  const string etag = RawHTTPHeader(first, "ETag");
+  EXPECT_EQ(18u, etag.length());
+  EXPECT_EQ("Accept-Encoding", RawHTTPHeader(first, "Vary"));
+  const string second = RawHTTPExchange("GET /status HTTP/1.1\r\nConnection: close\r\n\r\n");
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(1, status_calls);
+
+  const string not_modified = RawHTTPExchange("GET /status HTTP/1.1\r\nIf-None-Match: \"other\", W/" + etag +
+                                              "\r\nConnection: close\r\n\r\n");
+  EXPECT_EQ(0u, not_modified.find("HTTP/1.1 304 Not Modified\r\n"));
+  EXPECT_EQ(etag, RawHTTPHeader(not_modified, "ETag"));
+  EXPECT_EQ("", not_modified.substr(not_modified.find("\r\n\r\n") + 4));
+  const string modified =
+      RawHTTPExchange("GET /status HTTP/1.1\r\nIf-None-Match: \"other\"\r\nConnection: close\r\n\r\n");
+  EXPECT_EQ(0u, modified.find("HTTP/1.1 200 OK\r\n"));
+
+  // The compressed variant is made once, and has an entity tag of its own.
+  for (int i = 0; i < 2; ++i) {
+    const string gzipped =
+        RawHTTPExchange("GET /status HTTP/1.1\r\nAccept-Encoding: gzip\r\nConnection: close\r\n\r\n");
+    EXPECT_EQ("gzip", RawHTTPHeader(gzipped, "Content-Encoding"));
+    EXPECT_NE(etag, RawHTTPHeader(gzipped, "ETag"));
+    EXPECT_EQ(body, Inflate(gzipped.substr(gzipped.find("\r\n\r\n") + 4)));
+  }
+  EXPECT_EQ(1, status_calls);
+
+  // Each URL is cached on its own.
+  const string query = RawHTTPExchange("GET /status?verbose HTTP/1.1\r\nConnection: close\r\n\r\n");
+  EXPECT_EQ("/status?verbose" + string(1000, 'x'), query.substr(query.find("\r\n\r\n") + 4));
+  EXPECT_EQ(2, status_calls);
+  EXPECT_EQ(2u, cache.Entries());
+
+  // The responses expire after the time-to-live of their route.
+  const string v1 = RawHTTPExchange("GET /volatile HTTP/1.1\r\nConnection: close\r\n\r\n");
+  EXPECT_EQ("1", v1.substr(v1.find("\r\n\r\n") + 4));
+  const string v2 = RawHTTPExchange("GET /volatile HTTP/1.1\r\nConnection: close\r\n\r\n");
+  EXPECT_EQ("1", v2.substr(v2.find("\r\n\r\n") + 4));
+  std::this_thread::sleep_for(std::chrono::milliseconds(40));
+  const string v3 = RawHTTPExchange("GET /volatile HTTP/1.1\r\nConnection: close\r\n\r\n");
+  EXPECT_EQ("2", v3.substr(v3.find("\r\n\r\n") + 4));
+}
+
+TEST(HTTPResponseCache, EvictsLeastRecentlyUsedWithinItsBytes) {
+  net::HTTPResponseCache cache(3500, 1);
+  net::HTTPResponseCache::Hit hit;
+  HTTPResponse response;
+  response.body = string(1000, 'a');
+  EXPECT_TRUE(cache.Insert("/a", response, 60 * 1000));
+  response.body = string(1000, 'b');
+  EXPECT_TRUE(cache.Insert("/b", response, 60 * 1000));
+  EXPECT_EQ(2u, cache.Entries());
+  EXPECT_TRUE(cache.Lookup("/a", "", "", hit));
+  EXPECT_EQ(string(1000, 'a'), *hit.body);
+  response.body = string(1000, 'c');
+  EXPECT_TRUE(cache.Insert("/c", response, 60 * 1000));
+  EXPECT_EQ(2u, cache.Entries());
+  EXPECT_GE(3500u, cache.Bytes());
+  EXPECT_TRUE(cache.Lookup("/a", "", "", hit));
+  EXPECT_FALSE(cache.Lookup("/b", "", "", hit));
+  EXPECT_TRUE(cache.Lookup("/c", "", "", hit));
+
+  // Too large, and not cacheable.
+  response.body = string(5000, 'd');
+  EXPECT_FALSE(cache.Insert("/d", response, 60 * 1000));
+  response.body = "not found";
+  response.code = net::HTTPResponseCode::NotFound;
+  EXPECT_FALSE(cache.Insert("/e", response, 60 * 1000));
+  EXPECT_EQ(2u, cache.Entries());
+  cache.Clear();
+  EXPECT_EQ(0u, cache.Entries());
+  EXPECT_EQ(0u, cache.Bytes());
+}
+
+TEST(HTTPResponseCache, SendsCachedResponsesOnHTTPServerConnection) {
+  net::HTTPResponseCache cache;
+  int calls = 0;
+  const auto produce = [&calls](HTTPResponse& response) {
+    ++calls;
+    response.body = string(1000, 'x');
+  };
+  for (int i = 0; i < 3; ++i) {
+    const auto exchange = CompressedExchange("deflate", [&cache, &produce](HTTPServerConnection& c) {
+      net::SendCachedHTTPResponse(c, cache, 60 * 1000, produce);
+    });
+    EXPECT_EQ("deflate", exchange.first.at("Content-Encoding"));
+    EXPECT_EQ(1u, exchange.first.count("ETag"));
+    EXPECT_EQ(string(1000, 'x'), Inflate(exchange.second));
+  }
+  EXPECT_EQ(1, calls);
+}
+
+using bricks::net::HTTPEventStream;
+using bricks::net::HTTPEventStreamOverflowPolicy;
+using bricks::net::HTTPEventStreamParameters;
+
+// The client of a subscriber of the stream, over a socket pair.
+static Connection SubscribeToEventStream(HTTPEventStream& stream) {
+  int fds[2];
+  EXPECT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Connection client((net::SocketHandle(net::SocketHandle::FromHandle(fds[1]))));
+  client.BlockingWrite("GET /events HTTP/1.1\r\n\r\n");
+  Connection server((net::SocketHandle(net::SocketHandle::FromHandle(fds[0]))));
+  HTTPServerConnection c(std::move(server));
+  EXPECT_EQ("/events", c.Message().URL());
+  stream.Subscribe(c);
+  return client;
+}
+
+static string ReadExactly(Connection& connection, size_t length) {
+  string result(length, '\0');
+  result.resize(connection.BlockingRead(&result[0], length, Connection::FillFullBuffer));
+  return result;
+}
+
+static const string kEventStreamHeaders =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/event-stream\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+TEST(HTTPEventStream, EncodesEvents) {
+  EXPECT_EQ("data: foo\n\n", HTTPEventStream::EncodeEvent("foo"));
+  EXPECT_EQ("data: \n\n", HTTPEventStream::EncodeEvent(""));
+  EXPECT_EQ("event: update\nid: 42\ndata: one\ndata: two\ndata: \n\n",
+            HTTPEventStream::EncodeEvent("one\r\ntwo\n", "update", "42"));
+  EXPECT_EQ(": keep-alive\n\n", HTTPEventStream::EncodeComment("keep-alive"));
+}
+
+TEST(HTTPEventStream, FansOutEachEventToTheSubscribers) {
+  HTTPEventStream stream;
+  stream.Publish("before");
+  std::vector<Connection> clients;
+  for (int i = 0; i < 3; ++i) {
+    clients.push_back(SubscribeToEventStream(stream));
+  }
+  EXPECT_EQ(3u, stream.NumberOfSubscribers());
+  stream.Publish("one");
+  stream.Publish("two\nlines", "update", "2");
+  const string expected = kEventStreamHeaders + "data: one\n\nevent: update\nid: 2\ndata: two\ndata: lines\n\n";
+  for (Connection& client : clients) {
+    EXPECT_EQ(expected, ReadExactly(client, expected.length()));
+  }
+  // The subscriber that has gone away is let go of.
+  clients.pop_back();
+  while (stream.NumberOfSubscribers() != 2u) {
+    std::this_thread::yield();
+  }
+  stream.Publish("three");
+  for (Connection& client : clients) {
+    EXPECT_EQ("data: three\n\n", ReadExactly(client, 13));
+  }
+  EXPECT_EQ(0u, stream.NumberOfDroppedFrames());
+}
+
+// The frames of the same length, numbered, to tell which ones the slow subscriber has received.
+static string NumberedEvent(int i) { return strings::Printf("%05d", i) + string(16 * 1024, 'x'); }
+
+TEST(HTTPEventStream, SlowSubscribersSkipTheFramesTheyHaveMissed) {
+  HTTPEventStreamParameters parameters;
+  parameters.max_buffered_frames = 16;
+  HTTPEventStream stream(parameters);
+  Connection fast(SubscribeToEventStream(stream));
+  Connection slow(SubscribeToEventStream(stream));
+  EXPECT_EQ(kEventStreamHeaders, ReadExactly(fast, kEventStreamHeaders.length()));
+  const size_t frame_length = HTTPEventStream::EncodeEvent(NumberedEvent(0)).length();
+  const int n = 200;
+  // The fast subscriber keeps up with the publisher, the slow one does not read until the end.
+  for (int i = 0; i < n; ++i) {
+    stream.Publish(NumberedEvent(i));
+    EXPECT_EQ(HTTPEventStream::EncodeEvent(NumberedEvent(i)), ReadExactly(fast, frame_length));
+  }
+  string received = ReadExactly(slow, kEventStreamHeaders.length());
+  EXPECT_EQ(kEventStreamHeaders, received);
+  // Whole frames only, in order, down to the last one.
+  int previous = -1;
+  while (previous != n - 1) {
+    const string frame = ReadExactly(slow, frame_length);
+    ASSERT_EQ(frame_length, frame.length());
+    ASSERT_EQ("data: ", frame.substr(0, 6));
+    const int i = std::atoi(frame.substr(6, 5).c_str());
+    ASSERT_EQ(HTTPEventStream::EncodeEvent(NumberedEvent(i)), frame);
+    ASSERT_GT(i, previous);
+    previous = i;
+  }
+  EXPECT_GT(stream.NumberOfDroppedFrames(), 0u);
+  EXPECT_EQ(2u, stream.NumberOfSubscribers());
+}
+
+TEST(HTTPEventStream, DisconnectsSlowSubscribers) {
+  HTTPEventStreamParameters parameters;
+  parameters.max_buffered_frames = 16;
+  parameters.overflow_policy = HTTPEventStreamOverflowPolicy::Disconnect;
+  HTTPEventStream stream(parameters);
+  Connection fast(SubscribeToEventStream(stream));
+  Connection slow(SubscribeToEventStream(stream));
+  EXPECT_EQ(kEventStreamHeaders, ReadExactly(fast, kEventStreamHeaders.length()));
+  const size_t frame_length = HTTPEventStream::EncodeEvent(NumberedEvent(0)).length();
+  int i = 0;
+  while (!stream.NumberOfDisconnectedSubscribers()) {
+    stream.Publish(NumberedEvent(i));
+    EXPECT_EQ(HTTPEventStream::EncodeEvent(NumberedEvent(i)), ReadExactly(fast, frame_length));
+    ++i;
+  }
+  EXPECT_EQ(1u, stream.NumberOfDisconnectedSubscribers());
+  EXPECT_GT(static_cast<size_t>(i) * frame_length, slow.BlockingReadUntilEOF().length());
+  EXPECT_EQ(1u, stream.NumberOfSubscribers());
+  stream.Publish("still there");
+  EXPECT_EQ("data: still there\n\n", ReadExactly(fast, 19));
+  EXPECT_EQ(0u, stream.NumberOfDroppedFrames());
+}
@@ -0,0 +1,14 @@
+// Fibers over the event loop, see `impl/fiber.h`. Linux only, for the stackful fibers are switched with
+// `swapcontext()`, deprecated elsewhere: `BRICKS_NET_HAS_FIBERS` is defined where they are available.
+
+#ifndef BRICKS_NET_TCP_FIBER_H
+#define BRICKS_NET_TCP_FIBER_H
+
+#include "../../port.h"
+
+#if defined(BRICKS_POSIX) && defined(__linux__)
+#define BRICKS_NET_HAS_FIBERS
+#include "impl/fiber.h"
+#endif
+
+#endif  // BRICKS_NET_TCP_FIBER_H
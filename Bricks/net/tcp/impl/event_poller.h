@@ -0,0 +1,147 @@
+// The readiness notification mechanism of the platform, epoll or kqueue, for the event loops
+// of `HTTPServer` and `FiberLoop`.
+
+#ifndef BRICKS_NET_TCP_IMPL_EVENT_POLLER_H
+#define BRICKS_NET_TCP_IMPL_EVENT_POLLER_H
+
+#include <vector>
+
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#define BRICKS_NET_KQUEUE
+#include <sys/event.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#else
+#error "No event loop implementation is available for your system."
+#endif
+
+#include "../../exceptions.h"
+
+namespace bricks {
+namespace net {
+
+// The readiness notification mechanism of the platform: epoll or kqueue, level-triggered.
+class EventPoller final {
+ public:
+  struct Event {
+    int fd;
+    bool readable;
+    bool writable;
+  };
+
+  EventPoller() {
+#if defined(BRICKS_NET_KQUEUE)
+    fd_ = ::kqueue();
+#else
+    fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+#endif
+    if (fd_ < 0) {
+      throw SocketEventLoopException();
+    }
+  }
+
+  ~EventPoller() { ::close(fd_); }
+
+  // Starts watching `fd` for reads. With `exclusive`, a shared file descriptor wakes up
+  // one of the pollers only, where supported.
+  void Add(int fd, bool exclusive = false) {
+#if defined(BRICKS_NET_KQUEUE)
+    static_cast<void>(exclusive);
+    struct kevent changes[2];
+    EV_SET(&changes[0], fd, EVFILT_READ, EV_ADD, 0, 0, nullptr);
+    EV_SET(&changes[1], fd, EVFILT_WRITE, EV_ADD | EV_DISABLE, 0, 0, nullptr);
+    if (::kevent(fd_, changes, 2, nullptr, 0, nullptr) < 0) {
+      throw SocketEventLoopException();
+    }
+#else
+    struct epoll_event event;
+    event.events = EPOLLIN;
+#if defined(EPOLLEXCLUSIVE)
+    if (exclusive) {
+      event.events |= EPOLLEXCLUSIVE;
+    }
+#else
+    static_cast<void>(exclusive);
+#endif
+    event.data.fd = fd;
+    if (::epoll_ctl(fd_, EPOLL_CTL_ADD, fd, &event) < 0) {
+      throw SocketEventLoopException();
+    }
+#endif
+  }
+
+  // Changes the events `fd` is watched for.
+  void Watch(int fd, bool read, bool write) {
+#if defined(BRICKS_NET_KQUEUE)
+    struct kevent changes[2];
+    EV_SET(&changes[0], fd, EVFILT_READ, read ? EV_ENABLE : EV_DISABLE, 0, 0, nullptr);
+    EV_SET(&changes[1], fd, EVFILT_WRITE, write ? EV_ENABLE : EV_DISABLE, 0, 0, nullptr);
+    ::kevent(fd_, changes, 2, nullptr, 0, nullptr);
+#else
+    struct epoll_event event;
+    event.events = 0;
+    if (read) {
+      event.events |= EPOLLIN;
+    }
+    if (write) {
+      event.events |= EPOLLOUT;
+    }
+    event.data.fd = fd;
+    ::epoll_ctl(fd_, EPOLL_CTL_MOD, fd, &event);
+#endif
+  }
+
+  // Stops watching `fd`, before it is closed.
+  void Remove(int fd) {
+#if defined(BRICKS_NET_KQUEUE)
+    // Closing the file descriptor removes its events from the kqueue.
+    static_cast<void>(fd);
+#else
+    struct epoll_event event;
+    ::epoll_ctl(fd_, EPOLL_CTL_DEL, fd, &event);
+#endif
+  }
+
+  // Waits for up to `timeout_ms` for the watched file descriptors to become ready, and fills in `events`.
+  void Wait(std::vector<Event>& events, int timeout_ms) {
+    events.clear();
+#if defined(BRICKS_NET_KQUEUE)
+    struct kevent ready[kMaxEvents];
+    struct timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+    const int n = ::kevent(fd_, nullptr, 0, ready, kMaxEvents, &timeout);
+    for (int i = 0; i < n; ++i) {
+      const bool eof = (ready[i].flags & (EV_EOF | EV_ERROR)) != 0;
+      events.push_back(Event{static_cast<int>(ready[i].ident),
+                             ready[i].filter == EVFILT_READ || eof,
+                             ready[i].filter == EVFILT_WRITE && !eof});
+    }
+#else
+    struct epoll_event ready[kMaxEvents];
+    const int n = ::epoll_wait(fd_, ready, kMaxEvents, timeout_ms);
+    for (int i = 0; i < n; ++i) {
+      // Errors and hangups are discovered by reading.
+      events.push_back(Event{ready[i].data.fd,
+                             (ready[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0,
+                             (ready[i].events & EPOLLOUT) != 0});
+    }
+#endif
+  }
+
+ private:
+  enum { kMaxEvents = 256 };
+  int fd_;
+
+  EventPoller(const EventPoller&) = delete;
+  void operator=(const EventPoller&) = delete;
+};
+
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_TCP_IMPL_EVENT_POLLER_H
@@ -0,0 +1,533 @@
+// Fibers over the event loop: straight-line socket code, run on a few threads for many connections.
+//
+// A server on top of `Connection::BlockingRead()` and `BlockingWrite()` spends a thread per connection,
+// and one on top of `EventPoller` turns the handling of each connection into a state machine of callbacks.
+// `FiberLoop` runs each connection on a fiber of its own instead: a function with its own stack, which reads
+// and writes as if the calls were blocking, while under the hood they suspend the fiber until the socket is
+// ready, and the thread of the loop runs the other fibers meanwhile. The fibers switch only at those calls.
+//
+// Usage:
+//   bricks::net::FiberLoop loop;
+//   loop.Spawn([]() {
+//     bricks::net::FiberSocket socket((Socket(port)));
+//     while (true) {
+//       std::shared_ptr<FiberConnection> connection(new FiberConnection(socket.Accept()));
+//       FiberLoop::Current()->Spawn([connection]() {
+//         char buffer[1024];
+//         while (const size_t length = connection->Read(buffer, sizeof(buffer))) {
+//           connection->Write(buffer, length);
+//         }
+//       });
+//     }
+//   });
+//
+// A loop is one thread. Several loops make use of several cores, with one fiber accepting the connections
+// and handing them over to the loops, see `FiberSocket::AcceptConnection()` and `FiberHTTPServer`.
+// The fibers are the C++11 counterpart of the coroutines of C++20: stackful, switched with `swapcontext()`,
+// each on a stack of `stack_size` bytes, allocated with a guard page, of which only the touched pages are
+// backed by memory. Linux only, see `../fiber.h`.
+//
+// A fiber should not suspend within a `catch` block, as the exception being handled is per thread.
+// The destructor of the loop resumes the suspended fibers with `FiberLoopStoppedException` thrown from
+// the calls they are suspended in, and by any such calls they make from then on, for their stacks to unwind.
+// The exceptions escaping the body of the fiber end it, and are otherwise ignored.
+
+#ifndef BRICKS_NET_TCP_IMPL_FIBER_H
+#define BRICKS_NET_TCP_IMPL_FIBER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "event_poller.h"
+#include "posix.h"
+
+#include "../../exceptions.h"
+
+#include "../../../time/timer_wheel.h"
+
+namespace bricks {
+namespace net {
+
+const size_t kFiberDefaultStackSize = 256 * 1024;
+
+// Thrown by the calls that suspend the fiber once its loop is being destroyed.
+struct FiberLoopStoppedException : SocketException {};
+
+class FiberLoop final {
+ public:
+  explicit FiberLoop(size_t stack_size = kFiberDefaultStackSize)
+      : stack_size_(RoundUpToPages(stack_size)), stopping_(false), fibers_count_(0) {
+    if (::pipe(wake_pipe_)) {
+      throw SocketEventLoopException();
+    }
+    ::fcntl(wake_pipe_[0], F_SETFL, ::fcntl(wake_pipe_[0], F_GETFL, 0) | O_NONBLOCK);
+    ::fcntl(wake_pipe_[1], F_SETFL, ::fcntl(wake_pipe_[1], F_GETFL, 0) | O_NONBLOCK);
+    poller_.Add(wake_pipe_[0]);
+    thread_ = std::thread(&FiberLoop::Run, this);
+  }
+
+  // Unwinds the fibers, see above, and joins the thread. The bodies spawned and not yet started are dropped.
+  ~FiberLoop() {
+    stopping_ = true;
+    Notify();
+    thread_.join();
+    ::close(wake_pipe_[0]);
+    ::close(wake_pipe_[1]);
+  }
+
+  // Runs `body` on a new fiber of this loop. THREAD SAFE.
+  void Spawn(std::function<void()> body) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      spawned_.push_back(std::move(body));
+    }
+    Notify();
+  }
+
+  // The loop of the fiber calling it, nullptr if not called from a fiber.
+  static FiberLoop* Current() { return CurrentLoop(); }
+
+  // The number of the fibers started and not yet ended. THREAD SAFE.
+  size_t NumberOfFibers() const { return fibers_count_; }
+
+  // Suspends the current fiber until `fd` is readable, or writable, with `write`. Returns false
+  // if `timeout_ms`, unless zero, has passed first. Should be called from the fibers of this loop.
+  bool WaitForSocket(int fd, bool write, uint64_t timeout_ms = 0) {
+    Fiber& fiber = CurrentFiber();
+    Watched& watched = watched_[fd];
+    (write ? watched.writer : watched.reader) = &fiber;
+    if (!watched.registered) {
+      poller_.Add(fd);
+      watched.registered = true;
+    }
+    poller_.Watch(fd, watched.reader != nullptr, watched.writer != nullptr);
+    fiber.wait_fd = fd;
+    fiber.wait_write = write;
+    fiber.timed_out = false;
+    if (timeout_ms) {
+      Fiber* self = &fiber;
+      fiber.timer = timers_.Schedule(NowMs() + timeout_ms, [this, self]() {
+        self->timer = 0;
+        self->timed_out = true;
+        StopWaitingForSocket(*self);
+        runnable_.push_back(self);
+      });
+    }
+    Suspend(fiber);
+    return !fiber.timed_out;
+  }
+
+  // Suspends the current fiber for at least `ms` milliseconds. Should be called from the fibers of this loop.
+  void Sleep(uint64_t ms) {
+    Fiber& fiber = CurrentFiber();
+    Fiber* self = &fiber;
+    // Plus one, as the milliseconds of now are rounded down.
+    fiber.timer = timers_.Schedule(NowMs() + ms + 1, [this, self]() {
+      self->timer = 0;
+      runnable_.push_back(self);
+    });
+    Suspend(fiber);
+  }
+
+  // Lets the other runnable fibers of this loop run. Should be called from the fibers of this loop.
+  void Yield() {
+    Fiber& fiber = CurrentFiber();
+    runnable_.push_back(&fiber);
+    Suspend(fiber);
+  }
+
+  // Stops watching `fd`, before it is closed. Should be called from the thread of this loop.
+  void ForgetSocket(int fd) {
+    const auto it = watched_.find(fd);
+    if (it != watched_.end()) {
+      if (it->second.registered) {
+        poller_.Remove(fd);
+      }
+      watched_.erase(it);
+    }
+  }
+
+ private:
+  struct Fiber {
+    std::function<void()> body;
+    ucontext_t context;
+    char* stack = nullptr;
+    size_t stack_size = 0;
+    bool ended = false;
+    // What the suspended fiber waits for: the socket, the timer, or both.
+    int wait_fd = -1;
+    bool wait_write = false;
+    bool timed_out = false;
+    bricks::time::TimerWheel::TimerID timer = 0;
+
+    ~Fiber() {
+      if (stack) {
+        ::munmap(stack, stack_size);
+      }
+    }
+  };
+
+  // The fibers waiting for the socket to be readable and writable. The socket stays in the poller
+  // for as long as it is in use, and is only taken out of it once it has an event with no fiber waiting.
+  struct Watched {
+    Fiber* reader = nullptr;
+    Fiber* writer = nullptr;
+    bool registered = false;
+  };
+
+  static FiberLoop*& CurrentLoop() {
+    static thread_local FiberLoop* loop = nullptr;
+    return loop;
+  }
+
+  static size_t RoundUpToPages(size_t size) {
+    const size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    return (std::max(size, 4 * page) + page - 1) / page * page;
+  }
+
+  static uint64_t NowMs() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch()).count());
+  }
+
+  Fiber& CurrentFiber() {
+    if (stopping_) {
+      throw FiberLoopStoppedException();
+    }
+    return *current_;
+  }
+
+  void Notify() {
+    const char c = 0;
+    if (::write(wake_pipe_[1], &c, 1) < 0) {
+      // The pipe is full, thus the loop is about to wake up anyway.
+    }
+  }
+
+  // Switches from the fiber to the loop, and back once the fiber is resumed.
+  void Suspend(Fiber& fiber) {
+    ::swapcontext(&fiber.context, &loop_context_);
+    if (stopping_) {
+      throw FiberLoopStoppedException();
+    }
+  }
+
+  void Resume(Fiber* fiber) {
+    current_ = fiber;
+    ::swapcontext(&loop_context_, &fiber->context);
+    current_ = nullptr;
+    if (fiber->ended) {
+      fibers_.erase(fiber);
+      delete fiber;
+      --fibers_count_;
+    }
+  }
+
+  static void FiberEntry() {
+    FiberLoop* loop = CurrentLoop();
+    Fiber* fiber = loop->current_;
+    try {
+      fiber->body();
+    } catch (...) {
+    }
+    // The captures of the body, such as the connections, are destroyed on the fiber.
+    fiber->body = nullptr;
+    fiber->ended = true;
+    // Returns to `loop_context_`, via `uc_link`.
+  }
+
+  void Start(std::function<void()> body) {
+    std::unique_ptr<Fiber> fiber(new Fiber());
+    fiber->body = std::move(body);
+    void* stack = ::mmap(nullptr, stack_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stack == MAP_FAILED) {
+      return;
+    }
+    fiber->stack = static_cast<char*>(stack);
+    fiber->stack_size = stack_size_;
+    // The guard page, for the overflow of the stack, which grows down, to crash instead of corrupting memory.
+    ::mprotect(fiber->stack, static_cast<size_t>(::sysconf(_SC_PAGESIZE)), PROT_NONE);
+    ::getcontext(&fiber->context);
+    fiber->context.uc_stack.ss_sp = fiber->stack;
+    fiber->context.uc_stack.ss_size = fiber->stack_size;
+    fiber->context.uc_link = &loop_context_;
+    ::makecontext(&fiber->context, &FiberLoop::FiberEntry, 0);
+    Fiber* started = fiber.release();
+    fibers_.insert(started);
+    ++fibers_count_;
+    Resume(started);
+  }
+
+  void StopWaitingForSocket(Fiber& fiber) {
+    if (fiber.wait_fd < 0) {
+      return;
+    }
+    const auto it = watched_.find(fiber.wait_fd);
+    if (it != watched_.end()) {
+      (fiber.wait_write ? it->second.writer : it->second.reader) = nullptr;
+    }
+    fiber.wait_fd = -1;
+  }
+
+  void OnEvent(const EventPoller::Event& event) {
+    const auto it = watched_.find(event.fd);
+    if (it == watched_.end()) {
+      return;
+    }
+    Watched& watched = it->second;
+    bool woken = false;
+    // A socket with an error or hung up is readable, and the writer finds it out by writing.
+    if ((event.readable || event.writable) && watched.writer && (event.writable || !watched.reader)) {
+      Wake(*watched.writer);
+      woken = true;
+    }
+    if (event.readable && watched.reader) {
+      Wake(*watched.reader);
+      woken = true;
+    }
+    if (!watched.reader && !watched.writer && !woken) {
+      // Level-triggered hangups are reported with no events asked for, thus the socket is taken out.
+      poller_.Remove(event.fd);
+      watched.registered = false;
+    } else if (watched.registered) {
+      poller_.Watch(event.fd, watched.reader != nullptr, watched.writer != nullptr);
+    }
+  }
+
+  void Wake(Fiber& fiber) {
+    StopWaitingForSocket(fiber);
+    if (fiber.timer) {
+      timers_.Cancel(fiber.timer);
+      fiber.timer = 0;
+    }
+    runnable_.push_back(&fiber);
+  }
+
+  void Run() {
+    CurrentLoop() = this;
+    std::vector<EventPoller::Event> events;
+    while (!stopping_) {
+      std::deque<std::function<void()>> spawned;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        spawned.swap(spawned_);
+      }
+      for (std::function<void()>& body : spawned) {
+        Start(std::move(body));
+      }
+      RunRunnable();
+      const uint64_t timeout_ms = runnable_.empty() ? timers_.MillisecondsUntilNextTimer(NowMs(), 1000) : 0;
+      poller_.Wait(events, static_cast<int>(timeout_ms));
+      for (const EventPoller::Event& event : events) {
+        if (event.fd == wake_pipe_[0]) {
+          char buffer[256];
+          while (::read(wake_pipe_[0], buffer, sizeof(buffer)) > 0) {
+          }
+        } else {
+          OnEvent(event);
+        }
+      }
+      timers_.Advance(NowMs());
+    }
+    // Unwind the fibers: each suspended one throws from where it is suspended, and from any call
+    // that would suspend it again, until it ends.
+    while (!fibers_.empty()) {
+      std::vector<Fiber*> suspended(fibers_.begin(), fibers_.end());
+      for (Fiber* fiber : suspended) {
+        StopWaitingForSocket(*fiber);
+        if (fiber->timer) {
+          timers_.Cancel(fiber->timer);
+          fiber->timer = 0;
+        }
+        Resume(fiber);
+      }
+    }
+    runnable_.clear();
+  }
+
+  // Runs the fibers made runnable so far, and not the ones they make runnable, such as by `Yield()`.
+  void RunRunnable() {
+    for (size_t n = runnable_.size(); n && !runnable_.empty(); --n) {
+      Fiber* fiber = runnable_.front();
+      runnable_.pop_front();
+      Resume(fiber);
+    }
+  }
+
+  const size_t stack_size_;
+  std::atomic_bool stopping_;
+  std::atomic<size_t> fibers_count_;
+
+  // `spawned_` and `wake_pipe_` are thread safe, everything else is accessed by the thread of the loop only.
+  std::mutex mutex_;
+  std::deque<std::function<void()>> spawned_;
+  int wake_pipe_[2];
+
+  EventPoller poller_;
+  bricks::time::TimerWheel timers_{NowMs(), 1};
+  std::unordered_set<Fiber*> fibers_;
+  std::deque<Fiber*> runnable_;
+  std::unordered_map<int, Watched> watched_;
+  ucontext_t loop_context_;
+  Fiber* current_ = nullptr;
+
+  std::thread thread_;
+
+  FiberLoop(const FiberLoop&) = delete;
+  void operator=(const FiberLoop&) = delete;
+};
+
+// The connection read from and written to by a fiber, suspending it while the socket is not ready.
+// Should be used from the fibers of one loop, and destroyed on the thread of that loop. Plain TCP only.
+class FiberConnection final {
+ public:
+  // Takes over the connection, and puts its socket into non-blocking mode.
+  inline explicit FiberConnection(Connection&& connection) : connection_(std::move(connection)) {
+    const int fd = connection_.socket;
+    if (::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+      throw SocketFcntlException();
+    }
+  }
+
+  inline FiberConnection(FiberConnection&& rhs) : connection_(std::move(rhs.connection_)) {}
+
+  inline ~FiberConnection() {
+    if (FiberLoop* loop = FiberLoop::Current()) {
+      loop->ForgetSocket(connection_.socket);
+    }
+  }
+
+  // Reads what has arrived, up to `max_length` bytes, suspending the fiber until something has.
+  // Returns zero once the peer has closed its side. Throws `SocketReadTimeoutException` if nothing
+  // has arrived within `timeout_ms`, unless it is zero.
+  inline size_t Read(void* buffer, size_t max_length, uint64_t timeout_ms = 0) {
+    while (true) {
+      const ssize_t result = ::read(connection_.socket, buffer, max_length);
+      if (result >= 0) {
+        return static_cast<size_t>(result);
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (!Loop().WaitForSocket(connection_.socket, false, timeout_ms)) {
+          throw SocketReadTimeoutException();
+        }
+      } else if (errno != EINTR) {
+        throw SocketReadException();
+      }
+    }
+  }
+
+  // Writes all of `buffer`, suspending the fiber while the socket can take no more.
+  inline void Write(const void* buffer, size_t length) {
+    const char* data = static_cast<const char*>(buffer);
+    while (length) {
+#if defined(MSG_NOSIGNAL)
+      const ssize_t result = ::send(connection_.socket, data, length, MSG_NOSIGNAL);
+#else
+      const ssize_t result = ::write(connection_.socket, data, length);
+#endif
+      if (result > 0) {
+        data += result;
+        length -= static_cast<size_t>(result);
+      } else if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        Loop().WaitForSocket(connection_.socket, true);
+      } else if (result == 0 || errno != EINTR) {
+        throw SocketWriteException();
+      }
+    }
+  }
+
+  inline void Write(const std::string& data) { Write(data.data(), data.length()); }
+
+  inline void SendEOF() { connection_.SendEOF(); }
+
+  inline Connection& GetConnection() { return connection_; }
+
+ private:
+  static inline FiberLoop& Loop() {
+    FiberLoop* loop = FiberLoop::Current();
+    if (!loop) {
+      // Not called from a fiber.
+      throw SocketEventLoopException();
+    }
+    return *loop;
+  }
+
+  Connection connection_;
+
+  FiberConnection(const FiberConnection&) = delete;
+  void operator=(const FiberConnection&) = delete;
+};
+
+// The listening socket accepted from by a fiber, suspending it until there is a connection to accept.
+// Should be used from the fibers of one loop, and destroyed on the thread of that loop.
+class FiberSocket final {
+ public:
+  // Takes over the listening socket, and puts it into non-blocking mode.
+  inline explicit FiberSocket(Socket&& socket) : socket_(std::move(socket)) {
+    const int fd = socket_.socket;
+    if (::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+      throw SocketFcntlException();
+    }
+  }
+
+  inline ~FiberSocket() {
+    if (FiberLoop* loop = FiberLoop::Current()) {
+      loop->ForgetSocket(socket_.socket);
+    }
+  }
+
+  // Accepts the next connection, suspending the fiber until there is one. With the listening socket shared
+  // by several loops, only one of them accepts each connection, the others keep waiting.
+  inline FiberConnection Accept() { return FiberConnection(AcceptConnection()); }
+
+  // Accepts the next connection, for it to be handed over to a fiber of another loop.
+  inline Connection AcceptConnection() {
+    while (true) {
+      const int fd = ::accept(socket_.socket, nullptr, nullptr);
+      if (fd >= 0) {
+        Connection connection((SocketHandle(SocketHandle::FromHandle(fd))));
+        connection.SetOptions(socket_.Options());
+        ConnectionMetrics::Singleton().connections_accepted.Increment();
+        return connection;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        FiberLoop* loop = FiberLoop::Current();
+        if (!loop) {
+          throw SocketEventLoopException();
+        }
+        loop->WaitForSocket(socket_.socket, false);
+      } else if (errno != EINTR && errno != ECONNABORTED) {
+        throw SocketAcceptException();
+      }
+    }
+  }
+
+ private:
+  Socket socket_;
+
+  FiberSocket(const FiberSocket&) = delete;
+  void operator=(const FiberSocket&) = delete;
+};
+
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_TCP_IMPL_FIBER_H
@@ -0,0 +1,392 @@
+// An io_uring backend for the socket I/O on Linux: accept, recv, send and sendfile as asynchronous operations
+// on the same file descriptors `Socket` and `Connection` hold, with a single `io_uring_enter()`
+// to submit a batch of them and to collect their completions.
+//
+// The operations are queued with a `token` each, passed back along with the result upon their completion:
+// the number of bytes or the accepted file descriptor, or `-errno`. The tokens are the user's, except for
+// their top bit, which is reserved. `Complete()` submits the queued operations and invokes
+// `f(token, result, more)` for each completed one; `more` is set while a multishot accept keeps accepting.
+// The buffers passed to `Recv()` and `Send()` should stay valid until their operations have completed.
+//
+// * `Accept(socket, token)` is multishot on kernels 5.19+, one submission for all the connections to come.
+// * `RegisterBuffers()` pins the buffers once, for `ReadFixed()` and `WriteFixed()` to skip mapping them
+//   on every operation.
+// * `SendFile()` splices the file into the socket through a pipe, and completes once all of `length` is sent.
+//
+// `IOUring::IsSupported()` tells whether the kernel, and the seccomp policy, allow io_uring.
+// Requires the kernel 5.7+ for the splice and close operations. Not thread safe: one ring per thread.
+
+#ifndef BRICKS_NET_TCP_IMPL_IO_URING_H
+#define BRICKS_NET_TCP_IMPL_IO_URING_H
+
+#include "../../exceptions.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace bricks {
+namespace net {
+
+const unsigned kIOUringDefaultEntries = 256;
+// The most bytes moved by each splice of `SendFile()`, the default capacity of a pipe.
+const size_t kIOUringSpliceChunkSize = 64 * 1024;
+
+class IOUring final {
+ public:
+  // The tokens with this bit set are of the operations `SendFile()` issues on the user's behalf.
+  static constexpr uint64_t kInternalTokenBit = static_cast<uint64_t>(1) << 63;
+
+  explicit IOUring(unsigned entries = kIOUringDefaultEntries) {
+    struct io_uring_params params;
+    ::memset(&params, 0, sizeof(params));
+    fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    if (fd_ < 0) {
+      throw IOUringException();
+    }
+    sq_entries_ = params.sq_entries;
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = Map(sq_ring_size_, IORING_OFF_SQ_RING);
+    cq_ring_ = single_mmap ? sq_ring_ : Map(cq_ring_size_, IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = static_cast<struct io_uring_sqe*>(Map(sqes_size_, IORING_OFF_SQES));
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    char* cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+    sq_local_tail_ = *sq_tail_;
+  }
+
+  ~IOUring() {
+    for (auto& cit : send_files_) {
+      if (cit.second.pipe.fd[0] >= 0) {
+        ClosePipe(cit.second.pipe);
+      }
+    }
+    for (auto& pipe : free_pipes_) {
+      ClosePipe(pipe);
+    }
+    Unmap();
+  }
+
+  static bool IsSupported() {
+    static const bool supported = []() {
+      try {
+        IOUring probe(1);
+        return true;
+      } catch (const IOUringException&) {
+        return false;
+      }
+    }();
+    return supported;
+  }
+
+  // The operations of the sockets. `Accept()` completes with the file descriptor of each accepted
+  // connection, to construct the `Connection` from with `SocketHandle::FromHandle()`.
+  void Accept(int listen_fd, uint64_t token, bool multishot = true) {
+    struct io_uring_sqe* sqe = Queue(IORING_OP_ACCEPT, listen_fd, token);
+    sqe->accept_flags = SOCK_CLOEXEC;
+#if defined(IORING_ACCEPT_MULTISHOT)
+    if (multishot) {
+      sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+    }
+#else
+    static_cast<void>(multishot);
+#endif
+  }
+
+  void Recv(int fd, void* buffer, size_t length, uint64_t token) {
+    struct io_uring_sqe* sqe = Queue(IORING_OP_RECV, fd, token);
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = static_cast<uint32_t>(length);
+  }
+
+  void Send(int fd, const void* buffer, size_t length, uint64_t token) {
+    struct io_uring_sqe* sqe = Queue(IORING_OP_SEND, fd, token);
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = static_cast<uint32_t>(length);
+    sqe->msg_flags = MSG_NOSIGNAL;
+  }
+
+  void Close(int fd, uint64_t token) { Queue(IORING_OP_CLOSE, fd, token); }
+
+  // Registers the buffers for `ReadFixed()` and `WriteFixed()`, which refer to them by their index.
+  void RegisterBuffers(const std::vector<struct iovec>& buffers) {
+    if (::syscall(__NR_io_uring_register,
+                  fd_,
+                  IORING_REGISTER_BUFFERS,
+                  buffers.data(),
+                  static_cast<unsigned>(buffers.size())) < 0) {
+      throw IOUringException();
+    }
+  }
+
+  void ReadFixed(int fd, size_t buffer_index, void* buffer, size_t length, uint64_t token) {
+    struct io_uring_sqe* sqe = Queue(IORING_OP_READ_FIXED, fd, token);
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = static_cast<uint32_t>(length);
+    sqe->buf_index = static_cast<uint16_t>(buffer_index);
+  }
+
+  void WriteFixed(int fd, size_t buffer_index, const void* buffer, size_t length, uint64_t token) {
+    struct io_uring_sqe* sqe = Queue(IORING_OP_WRITE_FIXED, fd, token);
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = static_cast<uint32_t>(length);
+    sqe->buf_index = static_cast<uint16_t>(buffer_index);
+  }
+
+  // Sends `length` bytes of `file_fd` from `offset`. Completes with the number of bytes sent, which is less
+  // than `length` if the file ends first, or with `-errno`. At most one `SendFile()` per socket at a time.
+  void SendFile(int socket_fd, int file_fd, off_t offset, size_t length, uint64_t token) {
+    const uint64_t id = next_send_file_id_++;
+    SendFileState& state = send_files_[id];
+    state.socket_fd = socket_fd;
+    state.file_fd = file_fd;
+    state.offset = offset;
+    state.remaining = length;
+    state.token = token;
+    if (!free_pipes_.empty()) {
+      state.pipe = free_pipes_.back();
+      free_pipes_.pop_back();
+    } else if (::pipe2(state.pipe.fd, O_CLOEXEC)) {
+      send_files_.erase(id);
+      throw IOUringException();
+    }
+    ContinueSendFile(id, state);
+  }
+
+  // The number of operations queued, not submitted yet.
+  size_t Queued() const { return sq_local_tail_ - *sq_tail_; }
+
+  // Submits the queued operations, waits for at least `wait_for` of them to complete, and invokes
+  // `f(uint64_t token, int result, bool more)` for each completed one. `f` may queue more operations.
+  // Returns the number of completions passed to `f`.
+  template <typename F>
+  size_t Complete(F&& f, unsigned wait_for = 1) {
+    size_t completed = 0;
+    Enter(wait_for);
+    while (true) {
+      unsigned head = *cq_head_;
+      if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+        if (completed || !wait_for || !Queued()) {
+          return completed;
+        }
+        // Only the operations `SendFile()` issues have completed until now, and it has queued more of them.
+        Enter(wait_for);
+        continue;
+      }
+      const struct io_uring_cqe cqe = cqes_[head & cq_mask_];
+      __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+      if (cqe.user_data & kInternalTokenBit) {
+        const auto it = send_files_.find(cqe.user_data & ~kInternalTokenBit);
+        if (it != send_files_.end() && OnSendFileCompletion(it->first, it->second, cqe.res)) {
+          const uint64_t token = it->second.token;
+          const int result = it->second.error ? it->second.error : static_cast<int>(it->second.sent);
+          if (it->second.pipe.fd[0] >= 0) {
+            free_pipes_.push_back(it->second.pipe);
+          }
+          send_files_.erase(it);
+          ++completed;
+          f(token, result, false);
+        }
+      } else {
+#if defined(IORING_CQE_F_MORE)
+        const bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+#else
+        const bool more = false;
+#endif
+        ++completed;
+        f(cqe.user_data, cqe.res, more);
+      }
+    }
+  }
+
+ private:
+  struct Pipe {
+    int fd[2] = {-1, -1};
+  };
+
+  struct SendFileState {
+    int socket_fd;
+    int file_fd;
+    off_t offset;
+    size_t remaining;
+    size_t in_pipe = 0;
+    size_t sent = 0;
+    int error = 0;
+    bool splicing_in = false;
+    uint64_t token;
+    Pipe pipe;
+  };
+
+  void* Map(size_t size, off_t offset) {
+    void* result = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+    if (result == MAP_FAILED) {
+      Unmap();
+      throw IOUringException();
+    }
+    return result;
+  }
+
+  void Unmap() {
+    if (sqes_) {
+      ::munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ && cq_ring_ != sq_ring_) {
+      ::munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_) {
+      ::munmap(sq_ring_, sq_ring_size_);
+    }
+    ::close(fd_);
+  }
+
+  static void ClosePipe(Pipe& pipe) {
+    ::close(pipe.fd[0]);
+    ::close(pipe.fd[1]);
+  }
+
+  // Returns the zeroed submission queue entry for the next operation, submitting the queued ones if it is full.
+  struct io_uring_sqe* Queue(uint8_t opcode, int fd, uint64_t token) {
+    if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+      Enter(0);
+      if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+        throw IOUringException();
+      }
+    }
+    const unsigned index = sq_local_tail_ & sq_mask_;
+    struct io_uring_sqe* sqe = &sqes_[index];
+    ::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = token;
+    sq_array_[index] = index;
+    ++sq_local_tail_;
+    return sqe;
+  }
+
+  // Submits the queued operations, and waits for `wait_for` completions.
+  void Enter(unsigned wait_for) {
+    const unsigned to_submit = static_cast<unsigned>(Queued());
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    if (!to_submit && !wait_for) {
+      return;
+    }
+    const unsigned flags = wait_for ? IORING_ENTER_GETEVENTS : 0;
+    while (::syscall(__NR_io_uring_enter, fd_, to_submit, wait_for, flags, nullptr, 0) < 0) {
+      if (errno != EINTR) {
+        throw IOUringException();
+      }
+    }
+  }
+
+  struct io_uring_sqe* QueueSplice(int fd_in, uint64_t offset_in, int fd_out, size_t length, uint64_t id) {
+    struct io_uring_sqe* sqe = Queue(IORING_OP_SPLICE, fd_out, id | kInternalTokenBit);
+    sqe->off = static_cast<uint64_t>(-1);
+    sqe->splice_fd_in = fd_in;
+    sqe->splice_off_in = offset_in;
+    sqe->len = static_cast<uint32_t>(length);
+    sqe->splice_flags = SPLICE_F_MOVE;
+    return sqe;
+  }
+
+  // Moves the next piece of the file into the pipe, or what is in the pipe into the socket.
+  void ContinueSendFile(uint64_t id, SendFileState& state) {
+    state.splicing_in = !state.in_pipe;
+    if (state.splicing_in) {
+      const size_t length = std::min(state.remaining, kIOUringSpliceChunkSize);
+      QueueSplice(state.file_fd, static_cast<uint64_t>(state.offset), state.pipe.fd[1], length, id);
+    } else {
+      QueueSplice(state.pipe.fd[0], static_cast<uint64_t>(-1), state.socket_fd, state.in_pipe, id);
+    }
+  }
+
+  // Returns true once the whole `SendFile()` is done.
+  bool OnSendFileCompletion(uint64_t id, SendFileState& state, int result) {
+    if (result < 0) {
+      state.error = result;
+      // The bytes left in the pipe would be sent ahead of the next `SendFile()`, so the pipe is not reused.
+      if (state.in_pipe) {
+        ClosePipe(state.pipe);
+        if (::pipe2(state.pipe.fd, O_CLOEXEC)) {
+          state.pipe = Pipe();
+        }
+      }
+      return true;
+    }
+    const size_t moved = static_cast<size_t>(result);
+    if (state.splicing_in) {
+      if (!moved) {
+        // The file has ended before `length`.
+        return true;
+      }
+      state.in_pipe = moved;
+      state.offset += static_cast<off_t>(moved);
+      state.remaining -= moved;
+    } else {
+      state.in_pipe -= moved;
+      state.sent += moved;
+      if (!state.in_pipe && !state.remaining) {
+        return true;
+      }
+    }
+    ContinueSendFile(id, state);
+    return false;
+  }
+
+  int fd_ = -1;
+  void* sq_ring_ = nullptr;
+  void* cq_ring_ = nullptr;
+  struct io_uring_sqe* sqes_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  size_t cq_ring_size_ = 0;
+  size_t sqes_size_ = 0;
+
+  unsigned sq_entries_ = 0;
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned* sq_array_ = nullptr;
+  // The tail of the submission queue with the operations queued since the last submission.
+  unsigned sq_local_tail_ = 0;
+
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  struct io_uring_cqe* cqes_ = nullptr;
+
+  std::map<uint64_t, SendFileState> send_files_;
+  uint64_t next_send_file_id_ = 0;
+  std::vector<Pipe> free_pipes_;
+
+  IOUring(const IOUring&) = delete;
+  void operator=(const IOUring&) = delete;
+};
+
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_TCP_IMPL_IO_URING_H
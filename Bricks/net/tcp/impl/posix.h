@@ -4,31 +4,132 @@
 #define BRICKS_NET_TCP_IMPL_POSIX_H
 
 #include "../../exceptions.h"
+#include "../../../metrics/metrics.h"
+#include "../../../metrics/trace.h"
 
+#if defined(BRICKS_NET_TLS)
+#include "tls.h"
+#endif
+
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#include <sys/sendfile.h>
+#elif defined(__APPLE__)
+#include <sys/types.h>
+#endif
+
 namespace bricks {
 namespace net {
 
+// The metrics of all the connections, in `bricks::metrics::Registry::Singleton()`.
+struct ConnectionMetrics {
+  metrics::Counter& bytes_read;
+  metrics::Counter& bytes_written;
+  metrics::Counter& connections_accepted;
+
+  static ConnectionMetrics& Singleton() {
+    metrics::Registry& registry = metrics::Registry::Singleton();
+    static ConnectionMetrics singleton{
+        registry.GetCounter("bricks_net_bytes_read_total", "The bytes read from the connections."),
+        registry.GetCounter("bricks_net_bytes_written_total", "The bytes written to the connections."),
+        registry.GetCounter("bricks_net_connections_accepted_total", "The connections accepted.")};
+    return singleton;
+  }
+};
+
 const size_t kMaxServerQueuedConnections = 1024;
 const bool kDisableNagleAlgorithmByDefault = false;
 const size_t kReadTillEOFInitialBufferSize = 128;
 const double kReadTillEOFBufferGrowthK = 1.95;
+// The bytes past the free space of the buffer of `BlockingReadUntilEOF()` that each read accepts, on the stack.
+const size_t kReadTillEOFSlabSize = 16 * 1024;
+// The most `BlockingReceiveToFile()` moves through its pipe at once, the default capacity of a pipe on Linux.
+const size_t kSpliceChunkSize = 64 * 1024;
+const size_t kBufferedConnectionDefaultBufferSize = 64 * 1024;
+
+// The options of the sockets. The zeros keep the system defaults.
+struct SocketOptions {
+  bool disable_nagle_algorithm = kDisableNagleAlgorithmByDefault;  // `TCP_NODELAY`.
+  int receive_buffer_size = 0;                                     // `SO_RCVBUF`.
+  int send_buffer_size = 0;                                        // `SO_SNDBUF`.
+  // `SO_KEEPALIVE`, with the idle time before the first probe, the interval between the probes,
+  // and the number of probes before the connection is dropped, where supported.
+  bool keepalive = false;
+  int keepalive_idle_s = 0;
+  int keepalive_interval_s = 0;
+  int keepalive_probes = 0;
+  // The longest each read and each write may block for, with `SO_RCVTIMEO` and `SO_SNDTIMEO`.
+  // Past it, `BlockingRead()` throws `SocketReadTimeoutException`,
+  // and the writes throw `SocketWriteTimeoutException`.
+  uint64_t read_timeout_ms = 0;
+  uint64_t write_timeout_ms = 0;
+  // The writes of at least this many bytes are sent with `MSG_ZEROCOPY` on Linux, for the kernel to transmit
+  // the pages of the buffer instead of copying it, see `Connection::BlockingWrite()`. Worth it for the buffers
+  // of hundreds of kilobytes and more. Best effort: ignored where the kernel does not support it, and over TLS.
+  size_t zero_copy_threshold = 0;
+
+  // For the listening sockets, the backlog of `listen()`, and:
+  int max_connections = static_cast<int>(kMaxServerQueuedConnections);
+  bool reuse_port = false;         // `SO_REUSEPORT`, for several sockets to listen on the same port.
+  int fast_open_queue_length = 0;  // `TCP_FASTOPEN`, where supported.
+  int defer_accept_s = 0;          // `TCP_DEFER_ACCEPT` on Linux: wake up `accept()` once the data has arrived.
+};
+
+// The path of a Unix domain socket, for the local connections to skip the TCP stack. On Linux, the path
+// starting with '@' is in the abstract namespace, with no file behind it.
+struct UnixSocketPath final {
+  std::string path;
+  explicit UnixSocketPath(const std::string& path) : path(path) {}
+  inline bool IsAbstract() const { return !path.empty() && path[0] == '@'; }
+
+  // Fills `address`, and returns its length, zero if the path does not fit.
+  inline socklen_t ToAddress(sockaddr_un& address) const {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.length() >= sizeof(address.sun_path)) {
+      return 0;
+    }
+    memcpy(address.sun_path, path.data(), path.length());
+    if (IsAbstract()) {
+      // The abstract names are not null terminated, and may have the trailing zeros of their own.
+      address.sun_path[0] = '\0';
+      return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.length());
+    }
+    return static_cast<socklen_t>(sizeof(address));
+  }
+};
 
 class SocketHandle {
  public:
-  // Two ways to construct SocketHandle: via NewHandle() or FromHandle(int handle).
+  // Three ways to construct SocketHandle: via NewHandle(), NewUnixHandle() or FromHandle(int handle).
   struct NewHandle final {};
+  struct NewUnixHandle final {};
   struct FromHandle final {
     int handle;
     FromHandle(int handle) : handle(handle) {}
@@ -40,6 +141,12 @@ class SocketHandle {
     }
   }
 
+  inline SocketHandle(NewUnixHandle) : socket_(::socket(AF_UNIX, SOCK_STREAM, 0)) {
+    if (socket_ < 0) {
+      throw SocketCreateException();
+    }
+  }
+
   inline SocketHandle(FromHandle from) : socket_(from.handle) {
     if (socket_ < 0) {
       throw InvalidSocketException();
@@ -90,12 +197,147 @@ class Connection : public SocketHandle {
  public:
   inline Connection(SocketHandle&& rhs) : SocketHandle(std::move(rhs)) {}
 
-  inline Connection(Connection&& rhs) : SocketHandle(std::move(rhs)) {}
+#if defined(BRICKS_NET_TLS)
+  inline Connection(Connection&& rhs)
+      : SocketHandle(std::move(rhs)),
+        zero_copy_threshold_(rhs.zero_copy_threshold_),
+        zero_copy_pending_(rhs.zero_copy_pending_),
+        tls_(std::move(rhs.tls_)) {}
+
+  inline void operator=(Connection&& rhs) {
+    zero_copy_threshold_ = rhs.zero_copy_threshold_;
+    zero_copy_pending_ = rhs.zero_copy_pending_;
+    tls_ = std::move(rhs.tls_);
+    SocketHandle::operator=(std::move(rhs));
+  }
+
+  // Performs the TLS handshake over the connection, after which its reads and writes are encrypted,
+  // see `impl/tls.h`. The client verifies the certificate against `host`, and resumes the session
+  // the previous connection for the same `session_key` has received, if any, and offers `alpn_protocols`.
+  // Throws `TLSException`-s.
+  inline void StartTLS(TLSContext& context,
+                       const std::string& host = "",
+                       const std::string& session_key = "",
+                       const std::vector<std::string>& alpn_protocols = std::vector<std::string>()) {
+    tls_.reset(new TLSSession(context, socket, host, session_key, alpn_protocols));
+  }
+
+  inline bool IsTLS() const { return tls_ != nullptr; }
+  inline TLSSession* TLS() { return tls_.get(); }
+#else
+  inline Connection(Connection&& rhs)
+      : SocketHandle(std::move(rhs)),
+        zero_copy_threshold_(rhs.zero_copy_threshold_),
+        zero_copy_pending_(rhs.zero_copy_pending_) {}
+
+  inline void operator=(Connection&& rhs) {
+    zero_copy_threshold_ = rhs.zero_copy_threshold_;
+    zero_copy_pending_ = rhs.zero_copy_pending_;
+    SocketHandle::operator=(std::move(rhs));
+  }
 
-  inline void operator=(Connection&& rhs) { SocketHandle::operator=(std::move(rhs)); }
+  inline bool IsTLS() const { return false; }
+#endif
+
+  // Applies the options of the connected socket, see `SocketOptions`. Throws `SocketOptionException`.
+  // The TCP ones are skipped for the Unix domain sockets.
+  inline void SetOptions(const SocketOptions& options) {
+    if ((options.disable_nagle_algorithm || options.keepalive) && IsUnixDomain()) {
+      SocketOptions local_options = options;
+      local_options.disable_nagle_algorithm = false;
+      local_options.keepalive = false;
+      SetOptions(local_options);
+      return;
+    }
+    if (options.disable_nagle_algorithm) {
+      SetOption(IPPROTO_TCP, TCP_NODELAY, 1);
+    }
+    if (options.receive_buffer_size) {
+      SetOption(SOL_SOCKET, SO_RCVBUF, options.receive_buffer_size);
+    }
+    if (options.send_buffer_size) {
+      SetOption(SOL_SOCKET, SO_SNDBUF, options.send_buffer_size);
+    }
+    if (options.keepalive) {
+      SetOption(SOL_SOCKET, SO_KEEPALIVE, 1);
+#if defined(TCP_KEEPIDLE)
+      if (options.keepalive_idle_s) {
+        SetOption(IPPROTO_TCP, TCP_KEEPIDLE, options.keepalive_idle_s);
+      }
+#elif defined(TCP_KEEPALIVE)
+      if (options.keepalive_idle_s) {
+        SetOption(IPPROTO_TCP, TCP_KEEPALIVE, options.keepalive_idle_s);
+      }
+#endif
+#if defined(TCP_KEEPINTVL)
+      if (options.keepalive_interval_s) {
+        SetOption(IPPROTO_TCP, TCP_KEEPINTVL, options.keepalive_interval_s);
+      }
+#endif
+#if defined(TCP_KEEPCNT)
+      if (options.keepalive_probes) {
+        SetOption(IPPROTO_TCP, TCP_KEEPCNT, options.keepalive_probes);
+      }
+#endif
+    }
+    if (options.read_timeout_ms) {
+      SetTimeout(SO_RCVTIMEO, options.read_timeout_ms);
+    }
+    if (options.write_timeout_ms) {
+      SetTimeout(SO_SNDTIMEO, options.write_timeout_ms);
+    }
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    if (options.zero_copy_threshold) {
+      int one = 1;
+      if (!::setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one))) {
+        zero_copy_threshold_ = options.zero_copy_threshold;
+      }
+    }
+#endif
+  }
+
+  inline bool IsUnixDomain() {
+    sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    return !::getsockname(socket, reinterpret_cast<sockaddr*>(&address), &length) &&
+           address.ss_family == AF_UNIX;
+  }
+
+  // The timeouts of each blocking read and write, zero for none.
+  inline void SetReadTimeout(uint64_t timeout_ms) { SetTimeout(SO_RCVTIMEO, timeout_ms); }
+  inline void SetWriteTimeout(uint64_t timeout_ms) { SetTimeout(SO_SNDTIMEO, timeout_ms); }
+
+  // Waits up to `timeout_ms` for something to read, or for the peer to close the connection.
+  // Returns false if there is still nothing by then.
+  inline bool WaitForInput(int timeout_ms) {
+#if defined(BRICKS_NET_TLS)
+    if (tls_ && tls_->Pending()) {
+      return true;
+    }
+#endif
+    struct pollfd fd;
+    fd.fd = socket;
+    fd.events = POLLIN;
+    fd.revents = 0;
+    int result;
+    do {
+      result = ::poll(&fd, 1, timeout_ms);
+    } while (result < 0 && errno == EINTR);
+    if (result < 0) {
+      throw SocketReadException();
+    }
+    return result > 0;
+  }
 
   // Closes the outbound side of the socket and notifies the other party that no more data will be sent.
-  inline void SendEOF() { ::shutdown(socket, SHUT_WR); }
+  inline void SendEOF() {
+#if defined(BRICKS_NET_TLS)
+    if (tls_) {
+      tls_->Shutdown();
+    }
+#endif
+    ::shutdown(socket, SHUT_WR);
+  }
 
   // By default, BlockingRead() will return as soon as some data has been read,
   // with the exception being multibyte records (sizeof(T) > 1), where it will keep reading
@@ -107,12 +349,19 @@ class Connection : public SocketHandle {
   inline size_t BlockingRead(T* buffer,
                              size_t max_length,
                              BlockingReadPolicy policy = BlockingReadPolicy::ReturnASAP) {
+    BRICKS_TRACE_SCOPE("Connection::BlockingRead");
     uint8_t* raw_buffer = reinterpret_cast<uint8_t*>(buffer);
     uint8_t* raw_ptr = raw_buffer;
     const size_t max_length_in_bytes = max_length * sizeof(T);
     do {
-      const ssize_t retval = ::read(socket, raw_ptr, max_length_in_bytes - (raw_ptr - raw_buffer));
+      ssize_t retval;
+      do {
+        retval = RawRead(raw_ptr, max_length_in_bytes - (raw_ptr - raw_buffer));
+      } while (retval < 0 && errno == EINTR);
       if (retval < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          throw SocketReadTimeoutException();
+        }
         throw SocketReadException();
       } else if (retval == 0) {
         // This is worth re-checking, but as for 2014/12/06 the concensus of reading through man
@@ -126,26 +375,78 @@ class Connection : public SocketHandle {
       } else {
         raw_ptr += retval;
       }
-    } while (policy == BlockingReadPolicy::FillFullBuffer || ((raw_ptr - raw_buffer) % sizeof(T)) > 0);
+      // Stops once the buffer is full, rather than on a read of zero bytes, which waits for the next record
+      // over TLS.
+    } while ((policy == BlockingReadPolicy::FillFullBuffer &&
+              static_cast<size_t>(raw_ptr - raw_buffer) < max_length_in_bytes) ||
+             ((raw_ptr - raw_buffer) % sizeof(T)) > 0);
+    ConnectionMetrics::Singleton().bytes_read.Increment(static_cast<uint64_t>(raw_ptr - raw_buffer));
     return (raw_ptr - raw_buffer) / sizeof(T);
   }
 
+  // Reads into the buffers of `iov` in order, with a single `readv()`. Returns the number of bytes read,
+  // zero once the peer has closed the connection.
+  inline size_t BlockingReadv(const struct iovec* iov, int count) {
+    ssize_t result;
+    do {
+#if defined(BRICKS_NET_TLS)
+      if (tls_) {
+        result = TLSReadv(iov, count);
+        continue;
+      }
+#endif
+      result = ::readv(socket, iov, count);
+    } while (result < 0 && errno == EINTR);
+    if (result < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        throw SocketReadTimeoutException();
+      }
+      throw SocketReadException();
+    }
+    ConnectionMetrics::Singleton().bytes_read.Increment(static_cast<uint64_t>(result));
+    return static_cast<size_t>(result);
+  }
+
+  // Each read fills the free space of `container`, and up to `kReadTillEOFSlabSize` bytes more go to a slab
+  // on the stack, appended once the container has grown. Thus large responses take few reads and few
+  // reallocations even with the small `initial_size`.
   template <typename T>
   inline typename std::enable_if<sizeof(typename T::value_type) != 0, const T&>::type BlockingReadUntilEOF(
       T& container,
       const size_t initial_size = kReadTillEOFInitialBufferSize,
       const double growth_k = kReadTillEOFBufferGrowthK) {
-    container.resize(initial_size);
-    size_t offset = 0;
-    size_t desired;
-    size_t actual;
-    while (desired = container.size() - offset,
-           actual = BlockingRead(&container[offset], desired, BlockingReadPolicy::FillFullBuffer),
-           actual == desired) {
-      offset += desired;
-      container.resize(static_cast<size_t>(container.size() * growth_k));
-    }
-    container.resize(offset + actual);
+    typedef typename T::value_type value_type;
+    container.resize(std::max(initial_size, static_cast<size_t>(1)));
+    char slab[kReadTillEOFSlabSize];
+    size_t bytes = 0;
+    while (true) {
+      if (bytes == container.size() * sizeof(value_type)) {
+        container.resize(std::max(container.size() + 1, static_cast<size_t>(container.size() * growth_k)));
+      }
+      struct iovec iov[2];
+      iov[0].iov_base = reinterpret_cast<char*>(&container[0]) + bytes;
+      iov[0].iov_len = container.size() * sizeof(value_type) - bytes;
+      iov[1].iov_base = slab;
+      iov[1].iov_len = sizeof(slab);
+      const size_t read_count = BlockingReadv(iov, 2);
+      if (!read_count) {
+        break;
+      }
+      if (read_count <= iov[0].iov_len) {
+        bytes += read_count;
+      } else {
+        bytes += iov[0].iov_len;
+        const size_t extra = read_count - iov[0].iov_len;
+        const size_t required = (bytes + extra) / sizeof(value_type) + 1;
+        container.resize(std::max(required, static_cast<size_t>(container.size() * growth_k)));
+        ::memcpy(reinterpret_cast<char*>(&container[0]) + bytes, slab, extra);
+        bytes += extra;
+      }
+    }
+    if (bytes % sizeof(value_type)) {
+      throw SocketReadMultibyteRecordEndedPrematurelyException();
+    }
+    container.resize(bytes / sizeof(value_type));
     return container;
   }
 
@@ -156,13 +457,37 @@ class Connection : public SocketHandle {
     return container;
   }
 
+  // Keeps writing the rest if the kernel has accepted only a part of the buffer, as it does
+  // when interrupted by a signal, or on a timeout after some of the data has been sent.
+  //
+  // The buffers of at least `SocketOptions::zero_copy_threshold` bytes are sent with `MSG_ZEROCOPY`,
+  // and the write returns once the kernel has reported it is done with all of their pages, for the caller
+  // to reuse the buffer right away, as after any other write. The kernel is done once the data is acknowledged,
+  // thus such a write takes a round trip longer, and saves copying the buffer. Should the kernel report
+  // it has copied the data after all, as it does over the loopback, the connection goes back to the copies.
   inline void BlockingWrite(const void* buffer, size_t write_length) {
     assert(buffer);
-    const ssize_t result = ::write(socket, buffer, write_length);
-    if (result < 0) {
-      throw SocketWriteException();
-    } else if (static_cast<size_t>(result) != write_length) {
-      throw SocketCouldNotWriteEverythingException();
+    ConnectionMetrics::Singleton().bytes_written.Increment(write_length);
+    const char* ptr = static_cast<const char*>(buffer);
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    if (zero_copy_threshold_ && write_length >= zero_copy_threshold_ && !IsTLS()) {
+      const size_t sent = BlockingWriteZeroCopy(ptr, write_length);
+      ptr += sent;
+      write_length -= sent;
+    }
+#endif
+    while (write_length) {
+      const ssize_t result = RawWrite(ptr, write_length);
+      if (result < 0) {
+        if (errno != EINTR) {
+          ThrowWriteException();
+        }
+      } else if (result == 0) {
+        throw SocketCouldNotWriteEverythingException();
+      } else {
+        ptr += result;
+        write_length -= static_cast<size_t>(result);
+      }
     }
   }
 
@@ -171,6 +496,251 @@ class Connection : public SocketHandle {
     BlockingWrite(s, strlen(s));
   }
 
+  // Writes `count` buffers with a single `writev()`, so that they leave in as few packets as possible.
+  // Keeps writing the rest if the kernel has accepted only a part of them. Modifies `iov`.
+  inline void BlockingWritev(struct iovec* iov, int count) {
+#if defined(BRICKS_NET_TLS)
+    if (tls_) {
+      // One TLS record per buffer, as long as the buffers are below the record size of 16KB.
+      for (int i = 0; i < count; ++i) {
+        if (iov[i].iov_len) {
+          BlockingWrite(iov[i].iov_base, iov[i].iov_len);
+        }
+      }
+      return;
+    }
+#endif
+    uint64_t total = 0;
+    for (int i = 0; i < count; ++i) {
+      total += iov[i].iov_len;
+    }
+    ConnectionMetrics::Singleton().bytes_written.Increment(total);
+    size_t written = 0;
+    while (true) {
+      while (count && written >= iov->iov_len) {
+        written -= iov->iov_len;
+        ++iov;
+        --count;
+      }
+      if (!count) {
+        return;
+      }
+      iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+      iov->iov_len -= written;
+      const ssize_t result = ::writev(socket, iov, count);
+      if (result < 0 && errno == EINTR) {
+        written = 0;
+        continue;
+      } else if (result <= 0) {
+        ThrowWriteException();
+      }
+      written = static_cast<size_t>(result);
+    }
+  }
+
+  // Writes `length` bytes of the file `file_descriptor`, starting at `offset`, with `sendfile()`,
+  // so that the contents of the file do not go through the user space. Falls back to `pread()` and `write()`
+  // on the platforms without `sendfile()`. Throws `SocketWriteException` if the file ends prematurely.
+  inline void BlockingSendFile(int file_descriptor, uint64_t offset, uint64_t length) {
+    while (length) {
+#if defined(BRICKS_NET_TLS)
+      if (tls_) {
+        const size_t chunk = static_cast<size_t>(std::min(length, static_cast<uint64_t>(1024 * 1024)));
+        const ssize_t result = tls_->SendFile(file_descriptor, offset, chunk);
+        if (result < 0 && errno == EINTR) {
+          continue;
+        } else if (result <= 0) {
+          ThrowWriteException();
+        }
+        offset += static_cast<uint64_t>(result);
+        length -= static_cast<uint64_t>(result);
+        ConnectionMetrics::Singleton().bytes_written.Increment(static_cast<uint64_t>(result));
+        continue;
+      }
+#endif
+#if defined(__linux__)
+      off_t file_offset = static_cast<off_t>(offset);
+      const ssize_t result = ::sendfile(socket, file_descriptor, &file_offset, static_cast<size_t>(length));
+      if (result < 0 && errno == EINTR) {
+        continue;
+      } else if (result <= 0) {
+        ThrowWriteException();
+      }
+      const uint64_t sent = static_cast<uint64_t>(result);
+      ConnectionMetrics::Singleton().bytes_written.Increment(sent);
+#elif defined(__APPLE__)
+      // On Mac, `sent_length` is the number of bytes sent even if `sendfile()` was interrupted.
+      off_t sent_length = static_cast<off_t>(length);
+      const int result =
+          ::sendfile(file_descriptor, socket, static_cast<off_t>(offset), &sent_length, nullptr, 0);
+      if ((result && errno != EAGAIN && errno != EINTR) || (!result && !sent_length)) {
+        throw SocketWriteException();
+      }
+      const uint64_t sent = static_cast<uint64_t>(sent_length);
+      ConnectionMetrics::Singleton().bytes_written.Increment(sent);
+#else
+      char buffer[64 * 1024];
+      const size_t chunk = static_cast<size_t>(std::min(length, static_cast<uint64_t>(sizeof(buffer))));
+      const ssize_t result = ::pread(file_descriptor, buffer, chunk, static_cast<off_t>(offset));
+      if (result <= 0) {
+        throw SocketWriteException();
+      }
+      BlockingWrite(buffer, static_cast<size_t>(result));
+      const uint64_t sent = static_cast<uint64_t>(result);
+#endif
+      offset += sent;
+      length -= sent;
+    }
+  }
+
+  // Reads `length` bytes from the connection into the file `file_descriptor`, starting at `offset`, the reverse
+  // of `BlockingSendFile()`. On Linux, moves them with `splice()` through a pipe, so that they do not go
+  // through the user space either. Falls back to `read()` and `pwrite()` elsewhere and over TLS.
+  // Throws `SocketReadMultibyteRecordEndedPrematurelyException` if the peer closes the connection first,
+  // and `SocketReadException` if the file can not be written.
+  inline void BlockingReceiveToFile(int file_descriptor, uint64_t offset, uint64_t length) {
+#if defined(__linux__) && defined(SPLICE_F_MOVE)
+    if (!IsTLS() && length) {
+      int pipe_fds[2];
+      if (!::pipe(pipe_fds)) {
+        const ScopedPipe pipe(pipe_fds);
+        while (length) {
+          const size_t chunk = static_cast<size_t>(std::min(length, static_cast<uint64_t>(kSpliceChunkSize)));
+          const ssize_t received = ::splice(socket, nullptr, pipe_fds[1], nullptr, chunk, SPLICE_F_MOVE);
+          if (received < 0 && errno == EINTR) {
+            continue;
+          } else if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+              throw SocketReadTimeoutException();
+            }
+            throw SocketReadException();
+          } else if (!received) {
+            throw SocketReadMultibyteRecordEndedPrematurelyException();
+          }
+          for (size_t left = static_cast<size_t>(received); left;) {
+            loff_t file_offset = static_cast<loff_t>(offset);
+            const ssize_t written =
+                ::splice(pipe_fds[0], nullptr, file_descriptor, &file_offset, left, SPLICE_F_MOVE);
+            if (written < 0 && errno == EINTR) {
+              continue;
+            } else if (written <= 0) {
+              throw SocketReadException();
+            }
+            offset += static_cast<uint64_t>(written);
+            left -= static_cast<size_t>(written);
+          }
+          length -= static_cast<uint64_t>(received);
+          ConnectionMetrics::Singleton().bytes_read.Increment(static_cast<uint64_t>(received));
+        }
+        return;
+      }
+    }
+#endif
+    char buffer[64 * 1024];
+    while (length) {
+      const size_t chunk = static_cast<size_t>(std::min(length, static_cast<uint64_t>(sizeof(buffer))));
+      const size_t received = BlockingRead(buffer, chunk);
+      if (!received) {
+        throw SocketReadMultibyteRecordEndedPrematurelyException();
+      }
+      for (size_t done = 0; done < received;) {
+        const ssize_t written =
+            ::pwrite(file_descriptor, buffer + done, received - done, static_cast<off_t>(offset + done));
+        if (written < 0 && errno == EINTR) {
+          continue;
+        } else if (written <= 0) {
+          throw SocketReadException();
+        }
+        done += static_cast<size_t>(written);
+      }
+      offset += received;
+      length -= received;
+    }
+  }
+
+  // Forwards `length` bytes read from the connection to the connection `destination`, as a proxy does with
+  // the bodies it passes on to another backend. On Linux, moves them with `splice()` through a pipe, as
+  // `BlockingReceiveToFile()` does, so that they are not copied through the user space. Falls back to
+  // `BlockingRead()` and `BlockingWrite()` of `destination` elsewhere and if either connection is over TLS.
+  // Throws `SocketReadMultibyteRecordEndedPrematurelyException` if the peer closes the connection first,
+  // and the write exceptions of `destination` if it can not be written.
+  inline void BlockingForwardTo(Connection& destination, uint64_t length) {
+#if defined(__linux__) && defined(SPLICE_F_MOVE)
+    if (!IsTLS() && !destination.IsTLS() && length) {
+      int pipe_fds[2];
+      if (!::pipe(pipe_fds)) {
+        const ScopedPipe pipe(pipe_fds);
+        while (length) {
+          const size_t chunk = static_cast<size_t>(std::min(length, static_cast<uint64_t>(kSpliceChunkSize)));
+          const ssize_t received = ::splice(socket, nullptr, pipe_fds[1], nullptr, chunk, SPLICE_F_MOVE);
+          if (received < 0 && errno == EINTR) {
+            continue;
+          } else if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+              throw SocketReadTimeoutException();
+            }
+            throw SocketReadException();
+          } else if (!received) {
+            throw SocketReadMultibyteRecordEndedPrematurelyException();
+          }
+          length -= static_cast<uint64_t>(received);
+          ConnectionMetrics::Singleton().bytes_read.Increment(static_cast<uint64_t>(received));
+          // `SPLICE_F_MORE` holds back the partial frames while the rest of the body is on its way.
+          const unsigned int flags = SPLICE_F_MOVE | (length ? SPLICE_F_MORE : 0);
+          for (size_t left = static_cast<size_t>(received); left;) {
+            const ssize_t written = ::splice(pipe_fds[0], nullptr, destination.socket, nullptr, left, flags);
+            if (written < 0 && errno == EINTR) {
+              continue;
+            } else if (written <= 0) {
+              ThrowWriteException();
+            }
+            left -= static_cast<size_t>(written);
+            ConnectionMetrics::Singleton().bytes_written.Increment(static_cast<uint64_t>(written));
+          }
+        }
+        return;
+      }
+    }
+#endif
+    char buffer[64 * 1024];
+    while (length) {
+      const size_t chunk = static_cast<size_t>(std::min(length, static_cast<uint64_t>(sizeof(buffer))));
+      const size_t received = BlockingRead(buffer, chunk);
+      if (!received) {
+        throw SocketReadMultibyteRecordEndedPrematurelyException();
+      }
+      destination.BlockingWrite(buffer, received);
+      length -= received;
+    }
+  }
+
+  // While corked, partial frames are held back until uncorking, for a message written in several parts,
+  // such as headers followed by the contents of a file, to leave in full frames. Uses `TCP_CORK` on Linux
+  // and `TCP_NOPUSH` on BSD and Mac. Best effort: does nothing for non-TCP sockets.
+  inline void SetCorked(bool corked) {
+    int value = corked ? 1 : 0;
+#if defined(TCP_CORK)
+    ::setsockopt(socket, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+#elif defined(TCP_NOPUSH)
+    ::setsockopt(socket, IPPROTO_TCP, TCP_NOPUSH, &value, sizeof(value));
+#else
+    static_cast<void>(value);
+#endif
+  }
+
+  // Whether the connection is still open and has nothing to be read, without blocking.
+  // For the idle keep-alive connections to be checked before they are reused: the peer may have closed them.
+  inline bool IsIdle() {
+#if defined(BRICKS_NET_TLS)
+    if (tls_ && tls_->Pending()) {
+      return false;
+    }
+#endif
+    char c;
+    const ssize_t result = ::recv(socket, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  }
+
   template <typename T>
   inline void BlockingWrite(const T begin, const T end) {
     BlockingWrite(&(*begin), (end - begin) * sizeof(typename T::value_type));
@@ -184,19 +754,347 @@ class Connection : public SocketHandle {
   }
 
  private:
+  struct ScopedPipe {
+    const int* fds;
+    explicit ScopedPipe(const int* fds) : fds(fds) {}
+    ~ScopedPipe() {
+      ::close(fds[0]);
+      ::close(fds[1]);
+    }
+  };
+
+  inline ssize_t RawRead(void* buffer, size_t length) {
+#if defined(BRICKS_NET_TLS)
+    if (tls_) {
+      return tls_->Read(buffer, length);
+    }
+#endif
+    return ::read(socket, buffer, length);
+  }
+
+  inline ssize_t RawWrite(const void* buffer, size_t length) {
+#if defined(BRICKS_NET_TLS)
+    if (tls_) {
+      return tls_->Write(buffer, length);
+    }
+#endif
+    return ::write(socket, buffer, length);
+  }
+
+#if defined(BRICKS_NET_TLS)
+  // Reads into the first buffer, and into the next ones what has been decrypted already.
+  inline ssize_t TLSReadv(const struct iovec* iov, int count) {
+    ssize_t total = 0;
+    for (int i = 0; i < count; ++i) {
+      if (!iov[i].iov_len) {
+        continue;
+      }
+      if (total && !tls_->Pending()) {
+        break;
+      }
+      const ssize_t result = tls_->Read(iov[i].iov_base, iov[i].iov_len);
+      if (result <= 0) {
+        return total ? total : result;
+      }
+      total += result;
+      if (static_cast<size_t>(result) < iov[i].iov_len) {
+        break;
+      }
+    }
+    return total;
+  }
+#endif
+
+  inline void SetOption(int level, int name, int value) {
+    if (::setsockopt(socket, level, name, &value, sizeof(value))) {
+      throw SocketOptionException();
+    }
+  }
+
+  inline void SetTimeout(int name, uint64_t timeout_ms) {
+    struct timeval timeout;
+    timeout.tv_sec = static_cast<time_t>(timeout_ms / 1000);
+    timeout.tv_usec = static_cast<suseconds_t>((timeout_ms % 1000) * 1000);
+    if (::setsockopt(socket, SOL_SOCKET, name, &timeout, sizeof(timeout))) {
+      throw SocketOptionException();
+    }
+  }
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+  // Sends with `MSG_ZEROCOPY`, and waits for the completions of all the sends. Returns the number of bytes
+  // sent, fewer than `length` if the kernel has run out of the memory to pin the pages with, for the rest
+  // to be written the regular way.
+  inline size_t BlockingWriteZeroCopy(const char* ptr, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+      const ssize_t result = ::send(socket, ptr + sent, length - sent, MSG_ZEROCOPY);
+      if (result < 0 && errno == EINTR) {
+        continue;
+      } else if (result < 0 && errno == ENOBUFS) {
+        if (!zero_copy_pending_) {
+          break;
+        }
+        ReadZeroCopyCompletions(true);
+        continue;
+      } else if (result <= 0) {
+        ThrowWriteException();
+      }
+      // Each successful send is reported as completed once, maybe in a range with the others.
+      ++zero_copy_pending_;
+      sent += static_cast<size_t>(result);
+      ReadZeroCopyCompletions(false);
+    }
+    while (zero_copy_pending_) {
+      ReadZeroCopyCompletions(true);
+    }
+    return sent;
+  }
+
+  // Reads the completions of the zero copy sends from the error queue of the socket, if any, or, if `block`,
+  // waits for at least one, for no longer than the write timeout.
+  inline void ReadZeroCopyCompletions(bool block) {
+    while (zero_copy_pending_) {
+      char control[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_storage))];
+      struct msghdr message;
+      ::memset(&message, 0, sizeof(message));
+      message.msg_control = control;
+      message.msg_controllen = sizeof(control);
+      // The reads from the error queue never block.
+      if (::recvmsg(socket, &message, MSG_ERRQUEUE) < 0) {
+        if (errno == EINTR) {
+          continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          ThrowWriteException();
+        } else if (!block) {
+          return;
+        }
+        WaitForZeroCopyCompletions();
+        continue;
+      }
+      for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+        if ((header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR) ||
+            (header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR)) {
+          const sock_extended_err* error = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(header));
+          if (error->ee_origin == SO_EE_ORIGIN_ZEROCOPY && !error->ee_errno) {
+            // The sends from `ee_info` to `ee_data` inclusive, the counter of the sends wrapping around.
+            const uint32_t completed = error->ee_data - error->ee_info + 1;
+            zero_copy_pending_ -= std::min(zero_copy_pending_, completed);
+            if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+              zero_copy_threshold_ = 0;
+            }
+          }
+        }
+      }
+      block = false;
+    }
+  }
+
+  // The error queue signals `POLLERR` once it has something to read.
+  inline void WaitForZeroCopyCompletions() {
+    struct timeval timeout;
+    socklen_t timeout_length = sizeof(timeout);
+    int timeout_ms = -1;
+    if (!::getsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, &timeout_length) &&
+        (timeout.tv_sec || timeout.tv_usec)) {
+      timeout_ms = static_cast<int>(timeout.tv_sec * 1000 + timeout.tv_usec / 1000);
+    }
+    struct pollfd fd;
+    fd.fd = socket;
+    fd.events = 0;
+    fd.revents = 0;
+    const int result = ::poll(&fd, 1, timeout_ms);
+    if (!result) {
+      throw SocketWriteTimeoutException();
+    } else if (result < 0 && errno != EINTR) {
+      throw SocketWriteException();
+    }
+  }
+#endif
+
+  // A blocking socket fails with `EAGAIN` once its `SO_SNDTIMEO` has passed.
+  static inline void ThrowWriteException() {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      throw SocketWriteTimeoutException();
+    }
+    throw SocketWriteException();
+  }
+
+  // The zero copy sends, see `BlockingWrite()`, and those of them not reported as completed yet.
+  size_t zero_copy_threshold_ = 0;
+  uint32_t zero_copy_pending_ = 0;
+
+#if defined(BRICKS_NET_TLS)
+  std::unique_ptr<TLSSession> tls_;
+#endif
+
   Connection() = delete;
   Connection(const Connection&) = delete;
   void operator=(const Connection&) = delete;
 };
 
+// Keeps the connection corked for the duration of its scope.
+class ScopedCork final {
+ public:
+  explicit ScopedCork(Connection& connection) : connection_(connection) { connection_.SetCorked(true); }
+  ~ScopedCork() { connection_.SetCorked(false); }
+
+ private:
+  Connection& connection_;
+
+  ScopedCork(const ScopedCork&) = delete;
+  void operator=(const ScopedCork&) = delete;
+};
+
+// Reads from the connection through a buffer, for the many small reads of a protocol parser,
+// such as reading it line by line, to take few `read()`-s, each of as much as has arrived.
+//
+// `Fill()`, `Data()` and `Consume()` look at the buffered bytes in place, with no copies. The reads larger than
+// what is buffered go straight into the destination, with the read-ahead into the buffer in the same `readv()`.
+// The buffer grows if need be to hold what `Fill()` and `ReadUntil()` are asked for, and is reused otherwise.
+//
+// Not thread safe. The connection should not be read from other than through this object while it is used.
+class BufferedConnection final {
+ public:
+  explicit BufferedConnection(Connection& connection,
+                              size_t buffer_size = kBufferedConnectionDefaultBufferSize)
+      : connection_(connection), buffer_(std::max(buffer_size, static_cast<size_t>(1))) {}
+
+  inline Connection& GetConnection() { return connection_; }
+
+  // The bytes buffered, not consumed yet.
+  inline const char* Data() const { return buffer_.data() + begin_; }
+  inline size_t Available() const { return end_ - begin_; }
+
+  inline void Consume(size_t length) {
+    assert(length <= Available());
+    begin_ += length;
+  }
+
+  // Reads until at least `length` bytes are buffered, or until the peer has closed the connection.
+  // Returns `Available()`.
+  inline size_t Fill(size_t length) {
+    while (Available() < length && ReadMore()) {
+    }
+    return Available();
+  }
+
+  // Returns as soon as some data has been read, zero once the peer has closed the connection.
+  inline size_t Read(void* destination, size_t length) {
+    if (Available()) {
+      const size_t result = std::min(length, Available());
+      ::memcpy(destination, Data(), result);
+      Consume(result);
+      return result;
+    }
+    begin_ = end_ = 0;
+    struct iovec iov[2];
+    iov[0].iov_base = destination;
+    iov[0].iov_len = length;
+    iov[1].iov_base = &buffer_[0];
+    iov[1].iov_len = buffer_.size();
+    const size_t read_count = connection_.BlockingReadv(iov, 2);
+    if (read_count > length) {
+      end_ = read_count - length;
+      return length;
+    } else {
+      return read_count;
+    }
+  }
+
+  // Sets `output` to the bytes up to and including the first occurrence of `delimiter`, and returns true.
+  // If the peer closes the connection before sending `delimiter`, sets `output` to the rest and returns false.
+  inline bool ReadUntil(const std::string& delimiter, std::string& output) {
+    assert(!delimiter.empty());
+    // The number of the buffered bytes known not to start the delimiter, not to scan them again.
+    size_t scanned = 0;
+    while (true) {
+      const char* const begin = Data();
+      const char* const end = begin + Available();
+      const char* const found = std::search(begin + scanned, end, delimiter.begin(), delimiter.end());
+      if (found != end) {
+        const size_t length = static_cast<size_t>(found - begin) + delimiter.length();
+        output.assign(begin, length);
+        Consume(length);
+        return true;
+      }
+      scanned = Available() >= delimiter.length() ? Available() - delimiter.length() + 1 : 0;
+      if (!ReadMore()) {
+        output.assign(Data(), Available());
+        Consume(Available());
+        return false;
+      }
+    }
+  }
+
+  inline std::string ReadUntilEOF() {
+    while (ReadMore()) {
+    }
+    std::string result(Data(), Available());
+    Consume(Available());
+    return result;
+  }
+
+  // Returns the bytes read ahead to the front of the buffer, for them to be read again next.
+  inline void Unread(const char* data, size_t length) {
+    if (length <= begin_) {
+      begin_ -= length;
+    } else {
+      buffer_.erase(buffer_.begin(), buffer_.begin() + begin_);
+      buffer_.insert(buffer_.begin(), length, '\0');
+      end_ += length - begin_;
+      begin_ = 0;
+    }
+    ::memcpy(&buffer_[begin_], data, length);
+  }
+
+  // Moves the buffered bytes out, such as to construct an `HTTPReceivedMessage` from.
+  inline std::vector<char> TakeBuffered() {
+    std::vector<char> result(Data(), Data() + Available());
+    begin_ = end_ = 0;
+    return result;
+  }
+
+ private:
+  // Reads once into the free space at the end of the buffer, making room first by moving the buffered bytes
+  // to its beginning, or by growing it. Returns false once the peer has closed the connection.
+  inline bool ReadMore() {
+    if (begin_ == end_) {
+      begin_ = end_ = 0;
+    } else if (end_ == buffer_.size()) {
+      if (begin_) {
+        ::memmove(&buffer_[0], &buffer_[begin_], end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+      } else {
+        buffer_.resize(buffer_.size() * 2);
+      }
+    }
+    const size_t read_count = connection_.BlockingRead(&buffer_[end_], buffer_.size() - end_);
+    end_ += read_count;
+    return read_count > 0;
+  }
+
+  Connection& connection_;
+  std::vector<char> buffer_;
+  size_t begin_ = 0;
+  size_t end_ = 0;
+
+  BufferedConnection(const BufferedConnection&) = delete;
+  void operator=(const BufferedConnection&) = delete;
+};
+
 class Socket final : public SocketHandle {
  public:
   inline explicit Socket(const int port,
                          const int max_connections = kMaxServerQueuedConnections,
                          const bool disable_nagle_algorithm = kDisableNagleAlgorithmByDefault)
-      : SocketHandle(SocketHandle::NewHandle()) {
+      : Socket(port, MakeOptions(max_connections, disable_nagle_algorithm)) {}
+
+  // The options of the connections are applied to each accepted one.
+  inline Socket(const int port, const SocketOptions& options)
+      : SocketHandle(SocketHandle::NewHandle()), options_(options) {
     int just_one = 1;
-    if (disable_nagle_algorithm) {
+    if (options.disable_nagle_algorithm) {
       if (::setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &just_one, sizeof(int))) {
         throw SocketCreateException();
       }
@@ -204,6 +1102,37 @@ class Socket final : public SocketHandle {
     if (::setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, &just_one, sizeof(int))) {
       throw SocketCreateException();
     }
+    if (options.reuse_port) {
+#if defined(SO_REUSEPORT)
+      if (::setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, &just_one, sizeof(int))) {
+        throw SocketOptionException();
+      }
+#else
+      throw SocketOptionException();
+#endif
+    }
+    // Set on the listening socket, the buffer sizes apply to the accepted connections from the start,
+    // for the TCP window to be negotiated accordingly.
+    if (options.receive_buffer_size &&
+        ::setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &options.receive_buffer_size, sizeof(int))) {
+      throw SocketOptionException();
+    }
+    if (options.send_buffer_size &&
+        ::setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &options.send_buffer_size, sizeof(int))) {
+      throw SocketOptionException();
+    }
+#if defined(TCP_FASTOPEN)
+    if (options.fast_open_queue_length &&
+        ::setsockopt(socket, IPPROTO_TCP, TCP_FASTOPEN, &options.fast_open_queue_length, sizeof(int))) {
+      throw SocketOptionException();
+    }
+#endif
+#if defined(TCP_DEFER_ACCEPT)
+    if (options.defer_accept_s &&
+        ::setsockopt(socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &options.defer_accept_s, sizeof(int))) {
+      throw SocketOptionException();
+    }
+#endif
 
     sockaddr_in addr_server;
     memset(&addr_server, 0, sizeof(addr_server));  // Demote the warning.
@@ -215,7 +1144,38 @@ class Socket final : public SocketHandle {
       throw SocketBindException();
     }
 
-    if (::listen(socket, max_connections)) {
+    if (::listen(socket, options.max_connections)) {
+      throw SocketListenException();
+    }
+  }
+
+  // Listens on the Unix domain socket. The socket file left at the path by a previous run is replaced,
+  // and the one of this one is left in place once closed. The TCP options do not apply.
+  inline Socket(const UnixSocketPath& path, const SocketOptions& options = SocketOptions())
+      : SocketHandle(SocketHandle::NewUnixHandle()), options_(options) {
+    sockaddr_un address;
+    const socklen_t length = path.ToAddress(address);
+    if (!length) {
+      throw SocketBindException();
+    }
+    if (!path.IsAbstract()) {
+      struct stat info;
+      if (!::lstat(path.path.c_str(), &info) && S_ISSOCK(info.st_mode)) {
+        ::unlink(path.path.c_str());
+      }
+    }
+    if (options.receive_buffer_size &&
+        ::setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &options.receive_buffer_size, sizeof(int))) {
+      throw SocketOptionException();
+    }
+    if (options.send_buffer_size &&
+        ::setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &options.send_buffer_size, sizeof(int))) {
+      throw SocketOptionException();
+    }
+    if (::bind(socket, reinterpret_cast<sockaddr*>(&address), length) == -1) {
+      throw SocketBindException();
+    }
+    if (::listen(socket, options.max_connections)) {
       throw SocketListenException();
     }
   }
@@ -223,59 +1183,279 @@ class Socket final : public SocketHandle {
   Socket(Socket&&) = default;
 
   inline Connection Accept() {
-    sockaddr_in addr_client;
+    sockaddr_storage addr_client;
     memset(&addr_client, 0, sizeof(addr_client));
-    socklen_t addr_client_length = sizeof(sockaddr_in);
+    socklen_t addr_client_length = sizeof(addr_client);
     const int fd = ::accept(socket, reinterpret_cast<struct sockaddr*>(&addr_client), &addr_client_length);
     if (fd == -1) {
       throw SocketAcceptException();
     }
-    return Connection(SocketHandle::FromHandle(fd));
+    Connection connection((SocketHandle(SocketHandle::FromHandle(fd))));
+    connection.SetOptions(options_);
+    ConnectionMetrics::Singleton().connections_accepted.Increment();
+    return connection;
   }
 
+  inline const SocketOptions& Options() const { return options_; }
+
  private:
+  static inline SocketOptions MakeOptions(int max_connections, bool disable_nagle_algorithm) {
+    SocketOptions options;
+    options.max_connections = max_connections;
+    options.disable_nagle_algorithm = disable_nagle_algorithm;
+    return options;
+  }
+
+  SocketOptions options_;
+
   Socket() = delete;
   Socket(const Socket&) = delete;
   void operator=(const Socket&) = delete;
   void operator=(Socket&&) = delete;
 };
 
-// POSIX allows numeric ports, as well as strings like "http".
+const uint64_t kDefaultConnectTimeoutMs = 30 * 1000;
+// The delay before the next address is tried while the previous attempts are still pending, per RFC 8305.
+const uint64_t kDefaultConnectionAttemptDelayMs = 250;
+
+struct ClientSocketParameters {
+  uint64_t connect_timeout_ms = kDefaultConnectTimeoutMs;
+  uint64_t connection_attempt_delay_ms = kDefaultConnectionAttemptDelayMs;
+  // Try the last good address for the key last instead of first, such as for a hedged request to not go
+  // to the server the first attempt is stalled on.
+  bool avoid_last_good_address = false;
+  SocketOptions options;  // Applied once connected.
+};
+
+// An IPv4 or IPv6 address to connect to, with the port, or the path of a Unix domain socket.
+struct SocketAddress {
+  sockaddr_storage address;
+  socklen_t length;
+  inline int Family() const { return address.ss_family; }
+  inline const sockaddr* Get() const { return reinterpret_cast<const sockaddr*>(&address); }
+  inline bool operator==(const SocketAddress& rhs) const {
+    return length == rhs.length && !memcmp(&address, &rhs.address, length);
+  }
+};
+
+// The prefix of the hosts that are the paths of the Unix domain sockets, as in "unix:/var/run/app.sock",
+// the way nginx names them.
+const char* const kUnixSocketHostPrefix = "unix:";
+
+inline bool IsUnixSocketHost(const std::string& host) { return !host.compare(0, 5, kUnixSocketHostPrefix); }
+
+inline SocketAddress UnixSocketAddress(const UnixSocketPath& path) {
+  SocketAddress address;
+  memset(&address.address, 0, sizeof(address.address));
+  address.length = path.ToAddress(*reinterpret_cast<sockaddr_un*>(&address.address));
+  if (!address.length) {
+    throw SocketResolveAddressException();
+  }
+  return address;
+}
+
+// Resolves `host` into the IPv6 and IPv4 addresses to connect to, as `getaddrinfo()` does,
+// interleaving the two families per RFC 8305, starting with the one `getaddrinfo()` prefers.
+// POSIX allows numeric ports, as well as strings like "http". The "unix:/path" hosts resolve into
+// the Unix domain socket, with no port.
+inline std::vector<SocketAddress> ResolveAddresses(const std::string& host, const std::string& serv) {
+  if (IsUnixSocketHost(host)) {
+    return std::vector<SocketAddress>(1, UnixSocketAddress(UnixSocketPath(host.substr(5))));
+  }
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  struct addrinfo* servinfo;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  const int retval = ::getaddrinfo(host.c_str(), serv.c_str(), &hints, &servinfo);
+  if (retval) {
+    // TODO(dkorolev): LOG(somewhere, strings::Printf("Error in getaddrinfo: %s\n", gai_strerror(retval)));
+    throw SocketResolveAddressException();
+  }
+  std::vector<SocketAddress> by_family[2];
+  int first_family = AF_UNSPEC;
+  for (struct addrinfo* p = servinfo; p; p = p->ai_next) {
+    if ((p->ai_family == AF_INET || p->ai_family == AF_INET6) && p->ai_addrlen <= sizeof(sockaddr_storage)) {
+      if (first_family == AF_UNSPEC) {
+        first_family = p->ai_family;
+      }
+      SocketAddress address;
+      memset(&address.address, 0, sizeof(address.address));
+      memcpy(&address.address, p->ai_addr, p->ai_addrlen);
+      address.length = p->ai_addrlen;
+      std::vector<SocketAddress>& addresses = by_family[p->ai_family == first_family ? 0 : 1];
+      if (std::find(addresses.begin(), addresses.end(), address) == addresses.end()) {
+        addresses.push_back(address);
+      }
+    }
+  }
+  ::freeaddrinfo(servinfo);
+  std::vector<SocketAddress> result;
+  for (size_t i = 0; i < std::max(by_family[0].size(), by_family[1].size()); ++i) {
+    for (const auto& addresses : by_family) {
+      if (i < addresses.size()) {
+        result.push_back(addresses[i]);
+      }
+    }
+  }
+  if (result.empty()) {
+    throw SocketResolveAddressException();
+  }
+  return result;
+}
+
 template <typename T>
-inline Connection ClientSocket(const std::string& host, T port_or_serv) {
-  class ClientSocket final : public SocketHandle {
-   public:
-    inline explicit ClientSocket(const std::string& host, const std::string& serv)
-        : SocketHandle(SocketHandle::NewHandle()) {
-      struct addrinfo hints;
-      memset(&hints, 0, sizeof(hints));
-      struct addrinfo* servinfo;
-      hints.ai_family = AF_INET;
-      hints.ai_socktype = SOCK_STREAM;
-      hints.ai_protocol = IPPROTO_TCP;
-      const int retval = ::getaddrinfo(host.c_str(), serv.c_str(), &hints, &servinfo);
-      if (retval) {
-        // TODO(dkorolev): LOG(somewhere, strings::Printf("Error in getaddrinfo: %s\n", gai_strerror(retval)));
-        throw SocketResolveAddressException();
-      }
-      if (!servinfo) {
-        throw SocketResolveAddressException();
-      }
-      struct sockaddr* p_addr = servinfo->ai_addr;
-      // TODO(dkorolev): Use a random address, not the first one. Ref. iteration:
-      // for (struct addrinfo* p = servinfo; p != NULL; p = p->ai_next) {
-      //   p->ai_addr;
-      // }
-      const int retval2 = ::connect(socket, p_addr, sizeof(*p_addr));
-      if (retval2) {
-        throw SocketConnectException();
-      }
-      // TODO(dkorolev): Free this one, make use of Alex's ScopeGuard.
-      ::freeaddrinfo(servinfo);
+inline std::vector<SocketAddress> ResolveAddresses(const std::string& host, T port) {
+  return ResolveAddresses(host, std::to_string(port));
+}
+
+// The address to which the last connection with the same key, such as "host:port", was established.
+// Connecting to it first saves waiting for the dead addresses before it on each connection.
+class LastGoodAddresses final {
+ public:
+  static LastGoodAddresses& Singleton() {
+    static LastGoodAddresses singleton;
+    return singleton;
+  }
+  // Moves the last good address for `key` to the front of `addresses`, if it is there.
+  inline void Prefer(const std::string& key, std::vector<SocketAddress>& addresses) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto cit = addresses_.find(key);
+    if (cit != addresses_.end()) {
+      const auto it = std::find(addresses.begin(), addresses.end(), cit->second);
+      if (it != addresses.end()) {
+        std::rotate(addresses.begin(), it, it + 1);
+      }
     }
-  };
+  }
+  // Moves the last good address for `key` to the back of `addresses`, if it is there.
+  inline void Avoid(const std::string& key, std::vector<SocketAddress>& addresses) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto cit = addresses_.find(key);
+    if (cit != addresses_.end()) {
+      const auto it = std::find(addresses.begin(), addresses.end(), cit->second);
+      if (it != addresses.end()) {
+        std::rotate(it, it + 1, addresses.end());
+      }
+    }
+  }
+  inline void Remember(const std::string& key, const SocketAddress& address) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    addresses_[key] = address;
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  std::map<std::string, SocketAddress> addresses_;
+};
+
+// Connects to the first of `addresses` to accept the connection, "Happy Eyeballs" style, per RFC 8305:
+// the next address is tried if the previous ones have failed, or have not connected within
+// `connection_attempt_delay_ms`, with the earlier attempts still pending. Gives up after `connect_timeout_ms`,
+// with `SocketConnectTimeoutException`. With a non-empty `key`, the address the previous connection
+// with the same key was established to is tried first, or last, with `avoid_last_good_address`.
+inline Connection ClientSocket(std::vector<SocketAddress> addresses,
+                               const std::string& key = "",
+                               const ClientSocketParameters& parameters = ClientSocketParameters()) {
+  typedef std::chrono::steady_clock clock;
+  if (!key.empty()) {
+    if (parameters.avoid_last_good_address) {
+      LastGoodAddresses::Singleton().Avoid(key, addresses);
+    } else {
+      LastGoodAddresses::Singleton().Prefer(key, addresses);
+    }
+  }
+  const clock::time_point deadline = clock::now() + std::chrono::milliseconds(parameters.connect_timeout_ms);
+  clock::time_point next_attempt = clock::now();
+  std::vector<struct pollfd> pending;
+  std::vector<size_t> pending_index;
+  size_t next = 0;
+  int fd = -1;
+  size_t index = 0;
+  bool timed_out = false;
+  while (fd < 0) {
+    const clock::time_point now = clock::now();
+    if (next < addresses.size() && (now >= next_attempt || pending.empty())) {
+      const int family = addresses[next].Family();
+      const int attempt = ::socket(family, SOCK_STREAM, family == AF_UNIX ? 0 : IPPROTO_TCP);
+      if (attempt >= 0) {
+        ::fcntl(attempt, F_SETFL, ::fcntl(attempt, F_GETFL, 0) | O_NONBLOCK);
+        if (!::connect(attempt, addresses[next].Get(), addresses[next].length)) {
+          fd = attempt;
+          index = next;
+        } else if (errno == EINPROGRESS) {
+          pending.push_back(pollfd{attempt, POLLOUT, 0});
+          pending_index.push_back(next);
+        } else {
+          ::close(attempt);
+        }
+      }
+      ++next;
+      next_attempt = now + std::chrono::milliseconds(parameters.connection_attempt_delay_ms);
+      continue;
+    }
+    if (pending.empty()) {
+      break;
+    }
+    if (now >= deadline) {
+      timed_out = true;
+      break;
+    }
+    const clock::time_point wake_up = (next < addresses.size()) ? std::min(deadline, next_attempt) : deadline;
+    const int timeout_ms =
+        static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(wake_up - now).count()) + 1;
+    if (::poll(&pending[0], pending.size(), timeout_ms) < 0 && errno != EINTR) {
+      break;
+    }
+    for (size_t i = 0; i < pending.size();) {
+      if (pending[i].revents) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (fd < 0 && !::getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &error, &length) && !error) {
+          fd = pending[i].fd;
+          index = pending_index[i];
+        } else {
+          ::close(pending[i].fd);
+          // Try the next address right away instead of waiting for the delay.
+          next_attempt = clock::now();
+        }
+        pending.erase(pending.begin() + i);
+        pending_index.erase(pending_index.begin() + i);
+      } else {
+        ++i;
+      }
+    }
+  }
+  for (const struct pollfd& attempt : pending) {
+    ::close(attempt.fd);
+  }
+  if (fd < 0) {
+    if (timed_out) {
+      throw SocketConnectTimeoutException();
+    }
+    throw SocketConnectException();
+  }
+  ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+  if (!key.empty()) {
+    LastGoodAddresses::Singleton().Remember(key, addresses[index]);
+  }
+  Connection connection((SocketHandle(SocketHandle::FromHandle(fd))));
+  connection.SetOptions(parameters.options);
+  return connection;
+}
+
+template <typename T>
+inline Connection ClientSocket(const std::string& host,
+                               T port_or_serv,
+                               const ClientSocketParameters& parameters = ClientSocketParameters()) {
+  return ClientSocket(
+      ResolveAddresses(host, port_or_serv), host + ':' + std::to_string(port_or_serv), parameters);
+}
 
-  return Connection(ClientSocket(host, std::to_string(port_or_serv)));
+inline Connection ClientSocket(const UnixSocketPath& path,
+                               const ClientSocketParameters& parameters = ClientSocketParameters()) {
+  return ClientSocket(std::vector<SocketAddress>(1, UnixSocketAddress(path)), "", parameters);
 }
 
 }  // namespace net
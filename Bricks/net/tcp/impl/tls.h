@@ -0,0 +1,448 @@
+// TLS for `Connection`, with OpenSSL 1.1.1+ or BoringSSL. Compiled in with `-DBRICKS_NET_TLS`,
+// and linked with `-lssl -lcrypto`.
+//
+// `Connection::StartTLS(context, ...)` performs the handshake over the connected socket, after which
+// the reads and writes of the connection are encrypted. `TLSContext` holds the configuration:
+// * `TLSContext::DefaultClient()` verifies the peers against the trusted certificates of the system,
+//   and the host name against the certificate.
+// * `TLSContext(certificate_chain_file, private_key_file)` is for the servers.
+//
+// The client contexts keep the session of each `session_key`, such as "host:port", to resume the next
+// handshake with it: one round trip and no key exchange instead of the full handshake. The servers issue
+// the stateless session tickets for it, which OpenSSL does by default.
+//
+// The clients may offer the application protocols with ALPN, such as "h2" and "http/1.1", and the servers
+// select the first of theirs the client has offered, see `TLSContext::SetALPNProtocols()`. The protocol agreed
+// on is `TLSSession::ALPNProtocol()`, empty if there is none.
+//
+// Where the kernel and OpenSSL 3 support kTLS, the records are encrypted by the kernel, and
+// `BlockingSendFile()` sends the files with `SSL_sendfile()`, without them going through the user space.
+
+#ifndef BRICKS_NET_TCP_IMPL_TLS_H
+#define BRICKS_NET_TCP_IMPL_TLS_H
+
+#include "../../exceptions.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+namespace bricks {
+namespace net {
+
+enum class TLSRole { Client, Server };
+
+class TLSContext final {
+ public:
+  // The client context shared by all the TLS connections made by `HTTPClientPOSIX`.
+  static TLSContext& DefaultClient() {
+    static TLSContext context(TLSRole::Client);
+    return context;
+  }
+
+  // A client context verifies the peer against the trusted certificates of the system.
+  explicit TLSContext(TLSRole role) : role_(role) {
+    Create();
+    if (role_ == TLSRole::Client) {
+      SSL_CTX_set_default_verify_paths(ctx_);
+      SSL_CTX_set_verify(ctx_, SSL_VERIFY_PEER, nullptr);
+      // Keep the sessions in `sessions_`, by the keys of the connections, rather than by the session IDs.
+      SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+      SSL_CTX_sess_set_new_cb(ctx_, OnNewSession);
+    }
+  }
+
+  // A server context, with the certificate chain and the private key in PEM files.
+  TLSContext(const std::string& certificate_chain_file, const std::string& private_key_file)
+      : role_(TLSRole::Server) {
+    Create();
+    if (SSL_CTX_use_certificate_chain_file(ctx_, certificate_chain_file.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx_, private_key_file.c_str(), SSL_FILETYPE_PEM) != 1) {
+      SSL_CTX_free(ctx_);
+      throw TLSException();
+    }
+  }
+
+  // A server context with a new self-signed certificate for `common_name`, for the tests and development.
+  static std::unique_ptr<TLSContext> ServerWithSelfSignedCertificate(const std::string& common_name) {
+    std::unique_ptr<TLSContext> context(new TLSContext(TLSRole::Server));
+    EVP_PKEY* key = GenerateKey();
+    X509* certificate = X509_new();
+    bool ok = key && certificate;
+    if (ok) {
+      X509_set_version(certificate, 2);
+      ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+      X509_gmtime_adj(X509_getm_notBefore(certificate), -60);
+      X509_gmtime_adj(X509_getm_notAfter(certificate), 365 * 24 * 3600);
+      X509_set_pubkey(certificate, key);
+      X509_NAME* name = X509_get_subject_name(certificate);
+      X509_NAME_add_entry_by_txt(name,
+                                 "CN",
+                                 MBSTRING_ASC,
+                                 reinterpret_cast<const unsigned char*>(common_name.c_str()),
+                                 -1,
+                                 -1,
+                                 0);
+      X509_set_issuer_name(certificate, name);
+      ok = X509_sign(certificate, key, EVP_sha256()) > 0 &&
+           SSL_CTX_use_certificate(context->ctx_, certificate) == 1 &&
+           SSL_CTX_use_PrivateKey(context->ctx_, key) == 1;
+    }
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    if (!ok) {
+      throw TLSException();
+    }
+    return context;
+  }
+
+  ~TLSContext() {
+    for (auto& cit : sessions_) {
+      SSL_SESSION_free(cit.second);
+    }
+    SSL_CTX_free(ctx_);
+  }
+
+  // The certificate of the server context, in PEM, for the clients to trust it with `TrustCertificatePEM()`.
+  std::string CertificatePEM() const {
+    X509* certificate = SSL_CTX_get0_certificate(ctx_);
+    BIO* bio = BIO_new(BIO_s_mem());
+    std::string result;
+    if (certificate && bio && PEM_write_bio_X509(bio, certificate)) {
+      char* data;
+      const long length = BIO_get_mem_data(bio, &data);
+      result.assign(data, static_cast<size_t>(length));
+    }
+    BIO_free(bio);
+    return result;
+  }
+
+  // Trusts the certificate, in PEM, in addition to the ones of the system.
+  void TrustCertificatePEM(const std::string& pem) {
+    BIO* bio = BIO_new_mem_buf(pem.data(), static_cast<int>(pem.length()));
+    X509* certificate = bio ? PEM_read_bio_X509(bio, nullptr, nullptr, nullptr) : nullptr;
+    const bool ok = certificate && X509_STORE_add_cert(SSL_CTX_get_cert_store(ctx_), certificate) == 1;
+    X509_free(certificate);
+    BIO_free(bio);
+    if (!ok) {
+      throw TLSException();
+    }
+  }
+
+  // Whether the clients check the certificates of the servers. On by default.
+  void SetVerifyPeer(bool verify_peer) {
+    verify_peer_ = verify_peer;
+    SSL_CTX_set_verify(ctx_, verify_peer ? SSL_VERIFY_PEER : SSL_VERIFY_NONE, nullptr);
+  }
+
+  // The application protocols the server selects from, in the order of its preference. Server contexts only.
+  void SetALPNProtocols(const std::vector<std::string>& protocols) {
+    alpn_protocols_ = EncodeALPNProtocols(protocols);
+    SSL_CTX_set_alpn_select_cb(ctx_, OnSelectALPNProtocol, this);
+  }
+
+  // The protocols in the wire format of ALPN, each prefixed by its length.
+  static std::string EncodeALPNProtocols(const std::vector<std::string>& protocols) {
+    std::string result;
+    for (const std::string& protocol : protocols) {
+      if (!protocol.empty() && protocol.length() < 256) {
+        result += static_cast<char>(protocol.length());
+        result += protocol;
+      }
+    }
+    return result;
+  }
+
+  TLSRole Role() const { return role_; }
+  bool VerifyPeer() const { return role_ == TLSRole::Client && verify_peer_; }
+  SSL_CTX* Get() { return ctx_; }
+
+  // The session the last connection for `session_key` has received, with its reference count incremented,
+  // or nullptr.
+  SSL_SESSION* CachedSession(const std::string& session_key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto cit = sessions_.find(session_key);
+    if (cit == sessions_.end()) {
+      return nullptr;
+    }
+    SSL_SESSION_up_ref(cit->second);
+    return cit->second;
+  }
+
+  void ForgetSessions() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& cit : sessions_) {
+      SSL_SESSION_free(cit.second);
+    }
+    sessions_.clear();
+  }
+
+ private:
+  void Create() {
+    ctx_ = SSL_CTX_new(role_ == TLSRole::Client ? TLS_client_method() : TLS_server_method());
+    if (!ctx_) {
+      throw TLSException();
+    }
+    SSL_CTX_set_app_data(ctx_, this);
+    SSL_CTX_set_min_proto_version(ctx_, TLS1_2_VERSION);
+#if defined(SSL_OP_ENABLE_KTLS)
+    SSL_CTX_set_options(ctx_, SSL_OP_ENABLE_KTLS);
+#endif
+#if defined(SSL_OP_IGNORE_UNEXPECTED_EOF)
+    // Many servers close the connection without the `close_notify` alert, as HTTP delimits the messages itself.
+    SSL_CTX_set_options(ctx_, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+  }
+
+  static EVP_PKEY* GenerateKey() {
+    EVP_PKEY* key = nullptr;
+    EVP_PKEY_CTX* keygen = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+    if (keygen && EVP_PKEY_keygen_init(keygen) > 0 &&
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keygen, NID_X9_62_prime256v1) > 0) {
+      EVP_PKEY_keygen(keygen, &key);
+    }
+    EVP_PKEY_CTX_free(keygen);
+    return key;
+  }
+
+  // The application data of each client `SSL` is the `std::string` key to keep its session by.
+  static int OnNewSession(SSL* ssl, SSL_SESSION* session) {
+    TLSContext* context = static_cast<TLSContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    const std::string* session_key = static_cast<const std::string*>(SSL_get_app_data(ssl));
+    if (!context || !session_key || session_key->empty()) {
+      return 0;
+    }
+    std::lock_guard<std::mutex> lock(context->mutex_);
+    SSL_SESSION*& stored = context->sessions_[*session_key];
+    if (stored) {
+      SSL_SESSION_free(stored);
+    }
+    stored = session;
+    // Keeps the reference.
+    return 1;
+  }
+
+  static int OnSelectALPNProtocol(SSL*,
+                                  const unsigned char** out,
+                                  unsigned char* out_length,
+                                  const unsigned char* in,
+                                  unsigned int in_length,
+                                  void* arg) {
+    const std::string& preferred = static_cast<TLSContext*>(arg)->alpn_protocols_;
+    unsigned char* selected;
+    if (SSL_select_next_proto(&selected,
+                              out_length,
+                              reinterpret_cast<const unsigned char*>(preferred.data()),
+                              static_cast<unsigned int>(preferred.length()),
+                              in,
+                              in_length) != OPENSSL_NPN_NEGOTIATED) {
+      return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+  }
+
+  const TLSRole role_;
+  SSL_CTX* ctx_ = nullptr;
+  std::string alpn_protocols_;
+  bool verify_peer_ = true;
+  std::mutex mutex_;
+  std::map<std::string, SSL_SESSION*> sessions_;
+
+  TLSContext(const TLSContext&) = delete;
+  void operator=(const TLSContext&) = delete;
+};
+
+// The TLS state of a connection. `Read()`, `Write()` and `SendFile()` follow the conventions of `read()`
+// and `write()`: the number of bytes, or -1 with `errno` set, `EAGAIN` on a timeout of the socket.
+class TLSSession final {
+ public:
+  // Performs the handshake over the connected socket `fd`, the client offering `alpn_protocols`, if any.
+  // Throws `TLSHandshakeException`.
+  TLSSession(TLSContext& context,
+             int fd,
+             const std::string& host,
+             const std::string& session_key,
+             const std::vector<std::string>& alpn_protocols = std::vector<std::string>())
+      : session_key_(session_key) {
+    ssl_ = SSL_new(context.Get());
+    if (!ssl_ || SSL_set_fd(ssl_, fd) != 1) {
+      SSL_free(ssl_);
+      throw TLSException();
+    }
+    int result;
+    if (context.Role() == TLSRole::Client) {
+      if (!host.empty()) {
+        in6_addr address;
+        const bool ip = ::inet_pton(AF_INET, host.c_str(), &address) == 1 ||
+                        ::inet_pton(AF_INET6, host.c_str(), &address) == 1;
+        if (!ip) {
+          // Server Name Indication, for the servers of several domains to present the matching certificate.
+          SSL_set_tlsext_host_name(ssl_, host.c_str());
+        }
+        if (context.VerifyPeer()) {
+          X509_VERIFY_PARAM* param = SSL_get0_param(ssl_);
+          if (ip) {
+            X509_VERIFY_PARAM_set1_ip_asc(param, host.c_str());
+          } else {
+            X509_VERIFY_PARAM_set1_host(param, host.c_str(), 0);
+          }
+        }
+      }
+      if (!alpn_protocols.empty()) {
+        const std::string wire = TLSContext::EncodeALPNProtocols(alpn_protocols);
+        SSL_set_alpn_protos(ssl_,
+                            reinterpret_cast<const unsigned char*>(wire.data()),
+                            static_cast<unsigned int>(wire.length()));
+      }
+      SSL_set_app_data(ssl_, &session_key_);
+      if (!session_key_.empty()) {
+        SSL_SESSION* session = context.CachedSession(session_key_);
+        if (session) {
+          SSL_set_session(ssl_, session);
+          SSL_SESSION_free(session);
+        }
+      }
+      do {
+        ERR_clear_error();
+        result = SSL_connect(ssl_);
+      } while (result <= 0 && Interrupted(result));
+    } else {
+      do {
+        ERR_clear_error();
+        result = SSL_accept(ssl_);
+      } while (result <= 0 && Interrupted(result));
+    }
+    if (result != 1) {
+      SSL_free(ssl_);
+      throw TLSHandshakeException();
+    }
+  }
+
+  // Marks the connection as shut down without sending anything, as OpenSSL would not resume the session
+  // of a connection freed otherwise, and the peer may be gone already.
+  ~TLSSession() {
+    SSL_set_quiet_shutdown(ssl_, 1);
+    SSL_shutdown(ssl_);
+    SSL_free(ssl_);
+  }
+
+  ssize_t Read(void* buffer, size_t length) {
+    errno = 0;
+    ERR_clear_error();
+    const int result = SSL_read(ssl_, buffer, Length(length));
+    return result > 0 ? result : Failed(result);
+  }
+
+  ssize_t Write(const void* buffer, size_t length) {
+    errno = 0;
+    ERR_clear_error();
+    const int result = SSL_write(ssl_, buffer, Length(length));
+    return result > 0 ? result : Failed(result);
+  }
+
+  // Sends up to `length` bytes of the file from `offset`: with `SSL_sendfile()` over kTLS,
+  // or by reading a piece of it and encrypting it otherwise.
+  ssize_t SendFile(int file_descriptor, uint64_t offset, size_t length) {
+#if defined(BIO_get_ktls_send) && OPENSSL_VERSION_NUMBER >= 0x30000000L
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl_))) {
+      errno = 0;
+      ERR_clear_error();
+      const ossl_ssize_t result = SSL_sendfile(ssl_, file_descriptor, static_cast<off_t>(offset), length, 0);
+      return result > 0 ? static_cast<ssize_t>(result) : Failed(static_cast<int>(result));
+    }
+#endif
+    char buffer[16 * 1024];
+    const ssize_t read_count =
+        ::pread(file_descriptor, buffer, std::min(length, sizeof(buffer)), static_cast<off_t>(offset));
+    if (read_count <= 0) {
+      errno = EIO;
+      return -1;
+    }
+    // The blocking `SSL_write()` writes all of it, or fails.
+    return Write(buffer, static_cast<size_t>(read_count));
+  }
+
+  // Sends the `close_notify` alert.
+  void Shutdown() { SSL_shutdown(ssl_); }
+
+  // The bytes decrypted already, not read yet.
+  size_t Pending() const { return static_cast<size_t>(SSL_pending(ssl_)); }
+
+  bool SessionReused() const { return SSL_session_reused(ssl_) == 1; }
+
+  // The application protocol agreed on with ALPN, empty if none has been.
+  std::string ALPNProtocol() const {
+    const unsigned char* protocol = nullptr;
+    unsigned int length = 0;
+    SSL_get0_alpn_selected(ssl_, &protocol, &length);
+    return protocol ? std::string(reinterpret_cast<const char*>(protocol), length) : std::string();
+  }
+
+  bool KernelTLSSend() const {
+#if defined(BIO_get_ktls_send)
+    return BIO_get_ktls_send(SSL_get_wbio(ssl_)) != 0;
+#else
+    return false;
+#endif
+  }
+
+ private:
+  static int Length(size_t length) { return static_cast<int>(std::min(length, static_cast<size_t>(INT_MAX))); }
+
+  bool Interrupted(int result) const {
+    const int error = SSL_get_error(ssl_, result);
+    return (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_SYSCALL) &&
+           errno == EINTR;
+  }
+
+  ssize_t Failed(int result) {
+    const int saved_errno = errno;
+    switch (SSL_get_error(ssl_, result)) {
+      case SSL_ERROR_ZERO_RETURN:
+        return 0;
+      case SSL_ERROR_WANT_READ:
+      case SSL_ERROR_WANT_WRITE:
+        errno = (saved_errno == EINTR) ? EINTR : EAGAIN;
+        return -1;
+      case SSL_ERROR_SYSCALL:
+        if (!saved_errno && !result) {
+          // The peer has closed the connection without `close_notify`, with OpenSSL 1.1.1.
+          return 0;
+        }
+        errno = saved_errno ? saved_errno : EIO;
+        return -1;
+      default:
+        errno = EIO;
+        return -1;
+    }
+  }
+
+  SSL* ssl_ = nullptr;
+  // The address of this string is the application data of `ssl_`, see `TLSContext::OnNewSession()`.
+  const std::string session_key_;
+
+  TLSSession(const TLSSession&) = delete;
+  void operator=(const TLSSession&) = delete;
+};
+
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_TCP_IMPL_TLS_H
@@ -0,0 +1,14 @@
+// The io_uring backend of the socket I/O, see `impl/io_uring.h`. Linux only:
+// `BRICKS_NET_HAS_IO_URING` is defined where it is available.
+
+#ifndef BRICKS_NET_TCP_IO_URING_H
+#define BRICKS_NET_TCP_IO_URING_H
+
+#include "../../port.h"
+
+#if defined(BRICKS_POSIX) && defined(__linux__)
+#define BRICKS_NET_HAS_IO_URING
+#include "impl/io_uring.h"
+#endif
+
+#endif  // BRICKS_NET_TCP_IO_URING_H
@@ -1,10 +1,16 @@
+#include <atomic>
 #include <chrono>
 #include <functional>
+#include <map>
+#include <memory>
 #include <thread>
 
 #include "tcp.h"
+#include "io_uring.h"
+#include "fiber.h"
 
 #include "../../dflags/dflags.h"
+#include "../../file/file.h"
 
 #include "../../strings/printf.h"
 
@@ -12,6 +18,7 @@
 #include "../../3party/gtest/gtest-main-with-dflags.h"
 
 DEFINE_int32(port, 8081, "Port to use for the test.");
+DEFINE_string(tcp_test_tmpdir, "build", "Directory to create temporary files in.");
 
 using std::function;
 using std::move;
@@ -82,6 +89,31 @@ TYPED_TEST(TCPTest, ReceiveMessageOfTwoUInt16) {
   EXPECT_EQ("1032", TypeParam::ReadFromSocket(server_thread));
 }
 
+TYPED_TEST(TCPTest, WritevAndCork) {
+  const string body(1000000, '.');
+  thread server([&body](Socket socket) {
+                  Connection connection(socket.Accept());
+                  bricks::net::ScopedCork cork(connection);
+                  struct iovec iov[4];
+                  iov[0].iov_base = const_cast<char*>("HEAD:");
+                  iov[0].iov_len = 5;
+                  iov[1].iov_base = nullptr;
+                  iov[1].iov_len = 0;
+                  iov[2].iov_base = const_cast<char*>(body.data());
+                  iov[2].iov_len = body.length();
+                  iov[3].iov_base = const_cast<char*>(":TAIL");
+                  iov[3].iov_len = 5;
+                  connection.BlockingWritev(iov, 4);
+                },
+                move(Socket(FLAGS_port)));
+  // Read on the client side before the server thread is joined, as the body may not fit the socket buffers.
+  string received;
+  TypeParam::ReadFromSocket(server, [&received](Connection& connection) {
+    received = connection.BlockingReadUntilEOF();
+  });
+  EXPECT_EQ("HEAD:" + body + ":TAIL", received);
+}
+
 TYPED_TEST(TCPTest, EchoMessage) {
   thread server_thread([](Socket socket) {
                          Connection connection(socket.Accept());
@@ -151,3 +183,490 @@ TYPED_TEST(TCPTest, PrematureMessageEndingException) {
   EXPECT_EQ('F', big_struct.first_byte);
   EXPECT_EQ('U', big_struct.second_byte);
 }
+
+TEST(TCPClientSocket, TriesAllAddresses) {
+  using bricks::net::ClientSocketParameters;
+  using bricks::net::LastGoodAddresses;
+  using bricks::net::ResolveAddresses;
+  using bricks::net::SocketAddress;
+  thread server_thread([](Socket socket) {
+                         Connection connection(socket.Accept());
+                         connection.BlockingWrite("ECHO: " + connection.BlockingReadUntilEOF());
+                       },
+                       move(Socket(FLAGS_port)));
+  const SocketAddress good = ResolveAddresses("127.0.0.1", FLAGS_port).front();
+  // No one listens on the next port, and the connection is refused right away.
+  const SocketAddress refused = ResolveAddresses("127.0.0.1", FLAGS_port + 1).front();
+  // A non-routable address, to which the connection either fails right away or never completes.
+  const SocketAddress black_hole = ResolveAddresses("10.255.255.1", FLAGS_port).front();
+  ClientSocketParameters parameters;
+  parameters.connection_attempt_delay_ms = 50;
+  const auto begin = std::chrono::steady_clock::now();
+  {
+    Connection connection(ClientSocket(vector<SocketAddress>{refused, black_hole, good}, "test", parameters));
+    connection.BlockingWrite("OK");
+    connection.SendEOF();
+    server_thread.join();
+    EXPECT_EQ("ECHO: OK", connection.BlockingReadUntilEOF());
+  }
+  EXPECT_LT(std::chrono::steady_clock::now() - begin, std::chrono::seconds(5));
+  // The address that has worked is tried first the next time.
+  vector<SocketAddress> addresses{refused, black_hole, good};
+  LastGoodAddresses::Singleton().Prefer("test", addresses);
+  EXPECT_TRUE(addresses[0] == good);
+  EXPECT_TRUE(addresses[1] == refused);
+  EXPECT_TRUE(addresses[2] == black_hole);
+}
+
+TEST(TCPClientSocket, ConnectTimeout) {
+  using bricks::net::ClientSocketParameters;
+  using bricks::net::ResolveAddresses;
+  ClientSocketParameters parameters;
+  parameters.connect_timeout_ms = 100;
+  const auto begin = std::chrono::steady_clock::now();
+  ASSERT_THROW(ClientSocket(ResolveAddresses("10.255.255.1", FLAGS_port), "", parameters),
+               bricks::net::SocketConnectException);
+  EXPECT_LT(std::chrono::steady_clock::now() - begin, std::chrono::seconds(5));
+  ASSERT_THROW(ClientSocket("127.0.0.1", FLAGS_port + 1), bricks::net::SocketConnectException);
+}
+
+TEST(TCPSocketOptions, AppliedToListeningAndAcceptedSockets) {
+  using bricks::net::SocketOptions;
+  SocketOptions options;
+  options.receive_buffer_size = 64 * 1024;
+  options.keepalive = true;
+  options.keepalive_idle_s = 42;
+  options.read_timeout_ms = 1500;
+  options.reuse_port = true;
+  const auto get = [](int fd, int level, int name) {
+    int value = 0;
+    socklen_t length = sizeof(value);
+    EXPECT_EQ(0, ::getsockopt(fd, level, name, &value, &length));
+    return value;
+  };
+  Socket socket(FLAGS_port, options);
+  {
+    // With `SO_REUSEPORT`, another socket can listen on the same port.
+    Socket same_port_socket(FLAGS_port, options);
+    EXPECT_EQ(1, get(same_port_socket.socket, SOL_SOCKET, SO_REUSEPORT));
+  }
+  // Linux doubles the requested buffer sizes, for its bookkeeping.
+  EXPECT_GE(get(socket.socket, SOL_SOCKET, SO_RCVBUF), options.receive_buffer_size);
+  Connection client(ClientSocket("127.0.0.1", FLAGS_port));
+  Connection connection(socket.Accept());
+  EXPECT_EQ(1, get(connection.socket, SOL_SOCKET, SO_KEEPALIVE));
+#if defined(TCP_KEEPIDLE)
+  EXPECT_EQ(42, get(connection.socket, IPPROTO_TCP, TCP_KEEPIDLE));
+#endif
+  struct timeval timeout;
+  socklen_t length = sizeof(timeout);
+  ASSERT_EQ(0, ::getsockopt(connection.socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, &length));
+  EXPECT_EQ(1, timeout.tv_sec);
+  EXPECT_EQ(500000, timeout.tv_usec);
+  EXPECT_EQ(0, get(client.socket, SOL_SOCKET, SO_KEEPALIVE));
+}
+
+TEST(TCPSocketOptions, ReadAndWriteTimeouts) {
+  std::atomic_bool done(false);
+  thread server_thread([&done](Socket socket) {
+                         Connection connection(socket.Accept());
+                         // Neither reads nor writes until the client is done.
+                         while (!done) {
+                           sleep_for(milliseconds(1));
+                         }
+                       },
+                       move(Socket(FLAGS_port)));
+  Connection connection(ClientSocket("127.0.0.1", FLAGS_port));
+  connection.SetReadTimeout(50);
+  char buffer[10];
+  const auto begin = std::chrono::steady_clock::now();
+  ASSERT_THROW(connection.BlockingRead(buffer, sizeof(buffer)), bricks::net::SocketReadTimeoutException);
+  EXPECT_GE(std::chrono::steady_clock::now() - begin, milliseconds(40));
+  // The peer does not read, and the write blocks once the socket buffers are full.
+  connection.SetWriteTimeout(50);
+  const string chunk(1000000, '.');
+  ASSERT_THROW(
+      {
+        for (int i = 0; i < 1000; ++i) {
+          connection.BlockingWrite(chunk);
+        }
+      },
+      bricks::net::SocketWriteTimeoutException);
+  done = true;
+  server_thread.join();
+}
+
+TEST(TCPSocketOptions, WritesEverythingInPieces) {
+  using bricks::net::SocketOptions;
+  SocketOptions options;
+  options.send_buffer_size = 4096;
+  options.receive_buffer_size = 4096;
+  const string body(1000000, 'x');
+  thread server([&body](Socket socket) { socket.Accept().BlockingWrite(body); },
+                move(Socket(FLAGS_port, options)));
+  // With the small buffers, a single `write()` may accept only a part of the body.
+  Connection connection(ClientSocket("127.0.0.1", FLAGS_port));
+  EXPECT_EQ(body, connection.BlockingReadUntilEOF());
+  server.join();
+}
+
+TEST(TCPSocketOptions, ZeroCopyWrites) {
+  using bricks::net::SocketOptions;
+  SocketOptions options;
+  options.zero_copy_threshold = 64 * 1024;
+  string body(4 * 1024 * 1024, ' ');
+  for (size_t i = 0; i < body.length(); ++i) {
+    body[i] = static_cast<char>('a' + i % 26);
+  }
+  thread server([&body](Socket socket) {
+    Connection connection(socket.Accept());
+    // Over the loopback, the kernel copies the first one after all, and the second one is written as usual.
+    connection.BlockingWrite(body);
+    connection.BlockingWrite(body);
+    connection.BlockingWrite("small");
+  }, move(Socket(FLAGS_port, options)));
+  Connection connection(ClientSocket("127.0.0.1", FLAGS_port));
+  EXPECT_EQ(body + body + "small", connection.BlockingReadUntilEOF());
+  server.join();
+}
+
+TEST(TCPUnixSocket, EchoesOverPathAndAbstractSockets) {
+  using bricks::net::UnixSocketPath;
+  using bricks::net::SocketOptions;
+  // The TCP options are skipped for the Unix domain sockets.
+  SocketOptions options;
+  options.disable_nagle_algorithm = true;
+  options.keepalive = true;
+  vector<string> paths{FLAGS_tcp_test_tmpdir + "/tcp_unix_socket_test"};
+#if defined(__linux__)
+  paths.push_back("@bricks_tcp_unix_socket_test_" + to_string(::getpid()));
+#endif
+  for (const string& path : paths) {
+    for (int run = 0; run < 2; ++run) {
+      // The second run replaces the socket file the first one has left.
+      thread server([](Socket socket) {
+        Connection connection(socket.Accept());
+        char buffer[5];
+        connection.BlockingRead(buffer, sizeof(buffer), Connection::FillFullBuffer);
+        connection.BlockingWrite(string(buffer, sizeof(buffer)) + " back");
+      }, move(Socket(UnixSocketPath(path), options)));
+      Connection connection(ClientSocket(UnixSocketPath(path)));
+      connection.BlockingWrite("hello");
+      connection.SendEOF();
+      EXPECT_EQ("hello back", connection.BlockingReadUntilEOF());
+      server.join();
+    }
+    // Resolved from the host of the nginx style URL, with the port ignored.
+    thread server([](Socket socket) { socket.Accept().BlockingWrite("resolved"); },
+                  move(Socket(UnixSocketPath(path))));
+    EXPECT_EQ("resolved", ClientSocket("unix:" + path, 80).BlockingReadUntilEOF());
+    server.join();
+  }
+  ::unlink(paths.front().c_str());
+}
+
+TEST(TCPBufferedConnection, ReadsLinesAndBlocks) {
+  using bricks::net::BufferedConnection;
+  const string block(100000, 'x');
+  thread server_thread([&block](Socket socket) {
+                         Connection connection(socket.Accept());
+                         connection.BlockingWrite("HELLO\r\nWOR");
+                         sleep_for(milliseconds(1));
+                         connection.BlockingWrite("LD\r\n4:ABCD");
+                         connection.BlockingWrite(block);
+                         connection.BlockingWrite("TAIL");
+                       },
+                       move(Socket(FLAGS_port)));
+  Connection connection(ClientSocket("localhost", FLAGS_port));
+  // The small buffer grows to hold what is asked for.
+  BufferedConnection buffered(connection, 4);
+  string line;
+  ASSERT_TRUE(buffered.ReadUntil("\r\n", line));
+  EXPECT_EQ("HELLO\r\n", line);
+  ASSERT_TRUE(buffered.ReadUntil("\r\n", line));
+  EXPECT_EQ("WORLD\r\n", line);
+  ASSERT_GE(buffered.Fill(2), 2u);
+  EXPECT_EQ("4:", string(buffered.Data(), 2));
+  buffered.Consume(2);
+  char abcd[4];
+  ASSERT_GE(buffered.Fill(4), 4u);
+  ASSERT_EQ(4u, buffered.Read(abcd, 4));
+  EXPECT_EQ("ABCD", string(abcd, 4));
+  buffered.Unread("AB", 2);
+  string received(block.length() + 2, ' ');
+  size_t offset = 0;
+  while (offset < received.length()) {
+    const size_t read_count = buffered.Read(&received[offset], received.length() - offset);
+    ASSERT_GT(read_count, 0u);
+    offset += read_count;
+  }
+  EXPECT_EQ("AB" + block, received);
+  EXPECT_FALSE(buffered.ReadUntil("\r\n", line));
+  EXPECT_EQ("TAIL", line);
+  EXPECT_EQ("", buffered.ReadUntilEOF());
+  server_thread.join();
+}
+
+TEST(TCPForwarding, ForwardsTheBodyToAnotherConnection) {
+  string body(1000000, ' ');
+  for (size_t i = 0; i < body.length(); ++i) {
+    body[i] = static_cast<char>('a' + i % 26);
+  }
+  thread backend([](Socket socket) {
+    Connection connection(socket.Accept());
+    connection.BlockingWrite(connection.BlockingReadUntilEOF() + " received");
+  }, move(Socket(FLAGS_port + 1)));
+  // The proxy forwards the body only, and the request and the response around it go through it as usual.
+  thread proxy([&body](Socket socket) {
+    Connection upstream(socket.Accept());
+    Connection backend_connection(ClientSocket("127.0.0.1", FLAGS_port + 1));
+    char header[5];
+    upstream.BlockingRead(header, sizeof(header), Connection::FillFullBuffer);
+    EXPECT_EQ("BODY:", string(header, sizeof(header)));
+    upstream.BlockingForwardTo(backend_connection, body.length());
+    backend_connection.SendEOF();
+    EXPECT_EQ("TAIL", upstream.BlockingReadUntilEOF());
+    backend_connection.BlockingForwardTo(upstream, body.length() + 9);
+    EXPECT_THROW(backend_connection.BlockingForwardTo(upstream, 1),
+                 SocketReadMultibyteRecordEndedPrematurelyException);
+  }, move(Socket(FLAGS_port)));
+  Connection connection(ClientSocket("127.0.0.1", FLAGS_port));
+  connection.BlockingWrite("BODY:" + body + "TAIL");
+  connection.SendEOF();
+  EXPECT_EQ(body + " received", connection.BlockingReadUntilEOF());
+  proxy.join();
+  backend.join();
+}
+
+#if defined(BRICKS_NET_HAS_IO_URING)
+TEST(TCPIOUring, AcceptRecvSendAndSendFile) {
+  using bricks::net::IOUring;
+  if (!IOUring::IsSupported()) {
+    // Not available with this kernel, or disabled by its seccomp policy.
+    return;
+  }
+  const string file_name = bricks::FileSystem::JoinPath(FLAGS_tcp_test_tmpdir, "sendfile");
+  const bricks::ScopedRemoveFile file_remover(file_name);
+  string contents;
+  for (int i = 0; contents.length() < 300000; ++i) {
+    contents += to_string(i) + ' ';
+  }
+  bricks::FileSystem::WriteStringToFile(file_name, contents);
+  const int file_fd = ::open(file_name.c_str(), O_RDONLY);
+  ASSERT_GE(file_fd, 0);
+  const size_t kClients = 3;
+  // Each client sends a message, which is echoed back, then receives the file once it has closed its side.
+  thread server_thread([file_fd, &contents, kClients](Socket socket) {
+                         enum { kAccept = 1, kRecv, kSend, kSendFile };
+                         IOUring ring;
+                         std::map<int, std::unique_ptr<Connection>> connections;
+                         std::map<int, std::vector<char>> buffers;
+                         size_t done = 0;
+                         ring.Accept(socket.socket, kAccept);
+                         while (done < kClients) {
+                           ring.Complete([&](uint64_t token, int result, bool) {
+                             const int fd = static_cast<int>(token >> 8);
+                             switch (token & 0xff) {
+                               case kAccept:
+                                 ASSERT_GE(result, 0);
+                                 connections[result].reset(new Connection(
+                                     bricks::net::SocketHandle(bricks::net::SocketHandle::FromHandle(result))));
+                                 buffers[result].resize(1000);
+                                 ring.Recv(result, buffers[result].data(), 1000, (result << 8) | kRecv);
+                                 break;
+                               case kRecv:
+                                 ASSERT_GE(result, 0);
+                                 if (result) {
+                                   ring.Send(fd, buffers[fd].data(), result, (fd << 8) | kSend);
+                                 } else {
+                                   ring.SendFile(fd, file_fd, 0, contents.length(), (fd << 8) | kSendFile);
+                                 }
+                                 break;
+                               case kSend:
+                                 ASSERT_GT(result, 0);
+                                 ring.Recv(fd, buffers[fd].data(), 1000, (fd << 8) | kRecv);
+                                 break;
+                               case kSendFile:
+                                 EXPECT_EQ(static_cast<int>(contents.length()), result);
+                                 connections.erase(fd);
+                                 ++done;
+                                 break;
+                             }
+                           });
+                         }
+                       },
+                       move(Socket(FLAGS_port)));
+  for (size_t i = 0; i < kClients; ++i) {
+    Connection connection(ClientSocket("localhost", FLAGS_port));
+    const string message = "HELLO " + to_string(i);
+    connection.BlockingWrite(message);
+    string echo(message.length(), ' ');
+    ASSERT_EQ(message.length(), connection.BlockingRead(&echo[0], echo.length(), Connection::FillFullBuffer));
+    EXPECT_EQ(message, echo);
+    connection.SendEOF();
+    EXPECT_EQ(contents, connection.BlockingReadUntilEOF());
+  }
+  server_thread.join();
+  ::close(file_fd);
+}
+#endif  // defined(BRICKS_NET_HAS_IO_URING)
+
+#if defined(BRICKS_NET_HAS_FIBERS)
+TEST(TCPFibers, EchoesOnManyConnections) {
+  using bricks::net::FiberLoop;
+  using bricks::net::FiberSocket;
+  using bricks::net::FiberConnection;
+  const size_t kClients = 100;
+  std::unique_ptr<FiberLoop> loop(new FiberLoop());
+  loop->Spawn([]() {
+    FiberSocket socket((Socket(FLAGS_port)));
+    while (true) {
+      std::shared_ptr<FiberConnection> connection(new FiberConnection(socket.Accept()));
+      FiberLoop::Current()->Spawn([connection]() {
+        char buffer[100];
+        while (const size_t length = connection->Read(buffer, sizeof(buffer))) {
+          connection->Write(buffer, length);
+        }
+      });
+    }
+  });
+  // All the connections are open at once, served by the one thread of the loop.
+  vector<std::unique_ptr<Connection>> connections;
+  while (connections.size() < kClients) {
+    try {
+      connections.emplace_back(new Connection(ClientSocket("localhost", FLAGS_port)));
+    } catch (const bricks::net::SocketConnectException&) {
+      // The socket is not listening yet.
+      sleep_for(milliseconds(1));
+    }
+  }
+  for (size_t i = 0; i < kClients; ++i) {
+    connections[i]->BlockingWrite("HELLO " + to_string(i));
+  }
+  for (size_t i = 0; i < kClients; ++i) {
+    const string expected = "HELLO " + to_string(i);
+    string echo(expected.length(), ' ');
+    ASSERT_EQ(expected.length(),
+              connections[i]->BlockingRead(&echo[0], echo.length(), Connection::FillFullBuffer));
+    EXPECT_EQ(expected, echo);
+  }
+  EXPECT_EQ(kClients + 1, loop->NumberOfFibers());
+  connections.resize(kClients / 2);
+  while (loop->NumberOfFibers() != kClients / 2 + 1) {
+    std::this_thread::yield();
+  }
+  // The fibers still suspended, in `Accept()` and in `Read()`, are unwound by the destructor.
+  loop.reset();
+  EXPECT_EQ("", connections.front()->BlockingReadUntilEOF());
+}
+
+TEST(TCPFibers, SleepsTimesOutAndUnwinds) {
+  using bricks::net::FiberLoop;
+  using bricks::net::FiberSocket;
+  using bricks::net::FiberConnection;
+  std::atomic_int slept_ms(-1);
+  std::atomic_bool timed_out(false);
+  std::atomic_bool unwound(false);
+  std::atomic_bool accepted(false);
+  std::unique_ptr<FiberLoop> loop(new FiberLoop());
+  loop->Spawn([&slept_ms]() {
+    const auto begin = std::chrono::steady_clock::now();
+    FiberLoop::Current()->Sleep(50);
+    slept_ms = static_cast<int>(
+        std::chrono::duration_cast<milliseconds>(std::chrono::steady_clock::now() - begin).count());
+  });
+  loop->Spawn([&timed_out, &unwound, &accepted]() {
+    FiberSocket socket((Socket(FLAGS_port)));
+    FiberConnection connection(socket.Accept());
+    accepted = true;
+    char c;
+    try {
+      connection.Read(&c, 1, 50);
+    } catch (const bricks::net::SocketReadTimeoutException&) {
+      timed_out = true;
+    }
+    try {
+      connection.Read(&c, 1);
+    } catch (const bricks::net::FiberLoopStoppedException&) {
+      unwound = true;
+      throw;
+    }
+  });
+  std::unique_ptr<Connection> client;
+  while (!client) {
+    try {
+      client.reset(new Connection(ClientSocket("localhost", FLAGS_port)));
+    } catch (const bricks::net::SocketConnectException&) {
+      sleep_for(milliseconds(1));
+    }
+  }
+  while (!accepted || !timed_out || slept_ms < 0) {
+    std::this_thread::yield();
+  }
+  EXPECT_GE(slept_ms, 50);
+  EXPECT_EQ(1u, loop->NumberOfFibers());
+  loop.reset();
+  EXPECT_TRUE(unwound);
+}
+#endif  // defined(BRICKS_NET_HAS_FIBERS)
+
+#if defined(BRICKS_NET_TLS)
+TEST(TCPTLS, EncryptsAndResumesSessions) {
+  using bricks::net::TLSContext;
+  using bricks::net::TLSRole;
+  const std::unique_ptr<TLSContext> server_context = TLSContext::ServerWithSelfSignedCertificate("localhost");
+  TLSContext client_context(TLSRole::Client);
+  client_context.TrustCertificatePEM(server_context->CertificatePEM());
+  const string file_name = bricks::FileSystem::JoinPath(FLAGS_tcp_test_tmpdir, "tls_sendfile");
+  const bricks::ScopedRemoveFile file_remover(file_name);
+  const string contents(100000, 'z');
+  bricks::FileSystem::WriteStringToFile(file_name, contents);
+  const size_t kConnections = 3;
+  std::vector<bool> reused;
+  thread server_thread([&server_context, &file_name, &reused, kConnections](Socket socket) {
+                         for (size_t i = 0; i < kConnections; ++i) {
+                           Connection connection(socket.Accept());
+                           connection.StartTLS(*server_context);
+                           reused.push_back(connection.TLS()->SessionReused());
+                           const string message = connection.BlockingReadUntilEOF();
+                           connection.BlockingWrite("ECHO: " + message + ',');
+                           const int fd = ::open(file_name.c_str(), O_RDONLY);
+                           connection.BlockingSendFile(fd, 1, 99999);
+                           ::close(fd);
+                           connection.SendEOF();
+                         }
+                       },
+                       move(Socket(FLAGS_port)));
+  for (size_t i = 0; i < kConnections; ++i) {
+    Connection connection(ClientSocket("localhost", FLAGS_port));
+    connection.StartTLS(client_context, "localhost", "localhost:" + to_string(FLAGS_port));
+    EXPECT_TRUE(connection.IsTLS());
+    connection.BlockingWrite("TLS " + to_string(i));
+    connection.SendEOF();
+    EXPECT_EQ("ECHO: TLS " + to_string(i) + ',' + contents.substr(1), connection.BlockingReadUntilEOF());
+  }
+  server_thread.join();
+  // The first handshake is a full one, and the next ones resume the session from it.
+  ASSERT_EQ(kConnections, reused.size());
+  EXPECT_FALSE(reused[0]);
+  EXPECT_TRUE(reused[1]);
+  EXPECT_TRUE(reused[2]);
+}
+
+TEST(TCPTLS, VerifiesTheCertificate) {
+  using bricks::net::TLSContext;
+  using bricks::net::TLSRole;
+  const std::unique_ptr<TLSContext> server_context = TLSContext::ServerWithSelfSignedCertificate("localhost");
+  thread server_thread([&server_context](Socket socket) {
+                         Connection connection(socket.Accept());
+                         ASSERT_THROW(connection.StartTLS(*server_context), bricks::net::TLSHandshakeException);
+                       },
+                       move(Socket(FLAGS_port)));
+  // The self-signed certificate is not trusted by default.
+  TLSContext client_context(TLSRole::Client);
+  Connection connection(ClientSocket("localhost", FLAGS_port));
+  ASSERT_THROW(connection.StartTLS(client_context, "localhost"), bricks::net::TLSHandshakeException);
+  EXPECT_FALSE(connection.IsTLS());
+  server_thread.join();
+}
+#endif  // defined(BRICKS_NET_TLS)
@@ -0,0 +1,383 @@
+// The UDP sockets, for the fire-and-forget events, such as those of statsd, to be received with no HTTP
+// on top, and `UDPListener`, which pushes the datagrams into a message queue.
+//
+//   EfficientMQ<Consumer> mq(consumer);
+//   UDPListener<EfficientMQ<Consumer>> listener(mq, 8125, 4);
+//
+// The datagrams are read in batches into the buffers the socket reuses from batch to batch, with one
+// `recvmmsg()` per batch on Linux, and one `recvmsg()` per datagram elsewhere. Each datagram is copied once,
+// from the batch straight into the slot of the queue, with `EmplaceMessage()`.
+//
+// With more than one socket, they are bound to the same port with `SO_REUSEPORT`, for the kernel
+// to spread the senders across them, and across the threads receiving from them, one per socket.
+// A datagram may be lost on the way, and is counted per socket: dropped by the kernel when the receive buffer
+// is full, where the kernel reports it, with `SO_RXQ_OVFL` on Linux; truncated, if it does not fit
+// `max_datagram_size`; or dropped by the queue, if it does not accept it.
+
+#ifndef BRICKS_NET_UDP_IMPL_POSIX_H
+#define BRICKS_NET_UDP_IMPL_POSIX_H
+
+#include "../../exceptions.h"
+#include "../../tcp/impl/posix.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace bricks {
+namespace net {
+
+// The largest payload of a UDP datagram over IPv4.
+const size_t kUDPMaxDatagramSize = 65507;
+const size_t kUDPDefaultBatchSize = 32;
+// The statsd-style events fit one Ethernet frame.
+const size_t kUDPDefaultMaxDatagramSize = 1500;
+// How often the threads of `UDPListener` check whether it is being destructed, while there are no datagrams.
+const int kUDPListenerPollIntervalMs = 50;
+
+struct UDPSocketOptions {
+  int receive_buffer_size = 0;  // `SO_RCVBUF`, zero for the system default.
+  bool reuse_port = false;      // `SO_REUSEPORT`, for several sockets to receive on the same port.
+};
+
+// The buffers of a batch of datagrams, reused from one `UDPSocket::ReceiveBatch()` to the next.
+class UDPBatch final {
+ public:
+  explicit UDPBatch(size_t max_datagrams = kUDPDefaultBatchSize,
+                    size_t max_datagram_size = kUDPDefaultMaxDatagramSize)
+      : max_datagram_size_(std::min(std::max(max_datagram_size, static_cast<size_t>(1)), kUDPMaxDatagramSize)),
+        buffer_(std::max(max_datagrams, static_cast<size_t>(1)) * max_datagram_size_),
+        datagrams_(std::max(max_datagrams, static_cast<size_t>(1))) {
+    for (size_t i = 0; i < datagrams_.size(); ++i) {
+      datagrams_[i].iov.iov_base = &buffer_[i * max_datagram_size_];
+      datagrams_[i].iov.iov_len = max_datagram_size_;
+    }
+  }
+
+  // The datagrams of the last batch received.
+  size_t Size() const { return size_; }
+  const char* Data(size_t i) const { return static_cast<const char*>(datagrams_[i].iov.iov_base); }
+  size_t Length(size_t i) const { return datagrams_[i].length; }
+  // The datagram was longer than `max_datagram_size`, and only its beginning has been received.
+  bool Truncated(size_t i) const { return datagrams_[i].truncated; }
+
+  size_t Capacity() const { return datagrams_.size(); }
+  size_t MaxDatagramSize() const { return max_datagram_size_; }
+
+ private:
+  friend class UDPSocket;
+
+  struct Datagram {
+    struct iovec iov;
+    size_t length = 0;
+    bool truncated = false;
+    // Room for the `SO_RXQ_OVFL` counter.
+    char control[CMSG_SPACE(sizeof(uint32_t))];
+  };
+
+  const size_t max_datagram_size_;
+  std::vector<char> buffer_;
+  std::vector<Datagram> datagrams_;
+  size_t size_ = 0;
+#if defined(__linux__)
+  std::vector<struct mmsghdr> headers_;
+#endif
+};
+
+class UDPSocket final : public SocketHandle {
+ public:
+  inline explicit UDPSocket(int port, const UDPSocketOptions& options = UDPSocketOptions())
+      : SocketHandle(SocketHandle::FromHandle(NewUDPHandle())) {
+    int just_one = 1;
+    if (::setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, &just_one, sizeof(int))) {
+      throw SocketCreateException();
+    }
+    if (options.reuse_port) {
+#if defined(SO_REUSEPORT)
+      if (::setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, &just_one, sizeof(int))) {
+        throw SocketOptionException();
+      }
+#else
+      throw SocketOptionException();
+#endif
+    }
+    if (options.receive_buffer_size &&
+        ::setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &options.receive_buffer_size, sizeof(int))) {
+      throw SocketOptionException();
+    }
+#if defined(SO_RXQ_OVFL)
+    // Best effort: without it, the datagrams dropped by the kernel are not counted.
+    ::setsockopt(socket, SOL_SOCKET, SO_RXQ_OVFL, &just_one, sizeof(int));
+#endif
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if (::bind(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1) {
+      throw SocketBindException();
+    }
+  }
+
+  UDPSocket(UDPSocket&&) = default;
+
+  // Waits for up to `timeout_ms` for a datagram to arrive. Returns false on timeout.
+  inline bool WaitForDatagrams(int timeout_ms) {
+    struct pollfd fd;
+    fd.fd = socket;
+    fd.events = POLLIN;
+    fd.revents = 0;
+    const int result = ::poll(&fd, 1, timeout_ms);
+    if (result < 0 && errno != EINTR) {
+      throw SocketReadException();
+    }
+    return result > 0;
+  }
+
+  // Receives the datagrams that have arrived, up to the capacity of the batch, without blocking.
+  // Returns the number of them, zero if there were none.
+  inline size_t ReceiveBatch(UDPBatch& batch) {
+    batch.size_ = 0;
+#if defined(__linux__)
+    batch.headers_.resize(batch.datagrams_.size());
+    for (size_t i = 0; i < batch.datagrams_.size(); ++i) {
+      PrepareHeader(batch.datagrams_[i], batch.headers_[i].msg_hdr);
+      batch.headers_[i].msg_len = 0;
+    }
+    int received;
+    do {
+      received = ::recvmmsg(
+          socket, &batch.headers_[0], static_cast<unsigned int>(batch.headers_.size()), MSG_DONTWAIT, nullptr);
+    } while (received < 0 && errno == EINTR);
+    if (received < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      throw SocketReadException();
+    }
+    for (int i = 0; i < received; ++i) {
+      OnReceived(batch.headers_[i].msg_hdr, batch.headers_[i].msg_len, batch.datagrams_[i]);
+    }
+    batch.size_ = static_cast<size_t>(received);
+#else
+    while (batch.size_ < batch.datagrams_.size()) {
+      UDPBatch::Datagram& datagram = batch.datagrams_[batch.size_];
+      struct msghdr header;
+      PrepareHeader(datagram, header);
+      const ssize_t received = ::recvmsg(socket, &header, MSG_DONTWAIT);
+      if (received < 0) {
+        if (errno == EINTR) {
+          continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          break;
+        }
+        throw SocketReadException();
+      }
+      OnReceived(header, static_cast<size_t>(received), datagram);
+      ++batch.size_;
+    }
+#endif
+    return batch.size_;
+  }
+
+  // The datagrams the kernel has dropped since the socket has been created, as their receive buffer was full,
+  // as of the last datagram received. Zero where the kernel does not report them.
+  inline uint64_t KernelDropped() const { return kernel_dropped_; }
+
+ private:
+  static inline int NewUDPHandle() {
+    const int fd = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0) {
+      throw SocketCreateException();
+    }
+    return fd;
+  }
+
+  static inline void PrepareHeader(UDPBatch::Datagram& datagram, struct msghdr& header) {
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &datagram.iov;
+    header.msg_iovlen = 1;
+    header.msg_control = datagram.control;
+    header.msg_controllen = sizeof(datagram.control);
+  }
+
+  inline void OnReceived(struct msghdr& header, size_t length, UDPBatch::Datagram& datagram) {
+    datagram.length = std::min(length, datagram.iov.iov_len);
+    datagram.truncated = (header.msg_flags & MSG_TRUNC) != 0;
+#if defined(SO_RXQ_OVFL)
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&header); c; c = CMSG_NXTHDR(&header, c)) {
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+        uint32_t dropped;
+        memcpy(&dropped, CMSG_DATA(c), sizeof(dropped));
+        kernel_dropped_ = dropped;
+      }
+    }
+#endif
+  }
+
+  uint64_t kernel_dropped_ = 0;
+
+  UDPSocket() = delete;
+  UDPSocket(const UDPSocket&) = delete;
+  void operator=(const UDPSocket&) = delete;
+  void operator=(UDPSocket&&) = delete;
+};
+
+struct UDPListenerParameters {
+  // The sockets bound to the same port, each with a thread of its own. More than one needs `SO_REUSEPORT`.
+  size_t sockets = 1;
+  size_t batch_size = kUDPDefaultBatchSize;
+  size_t max_datagram_size = kUDPDefaultMaxDatagramSize;
+  int receive_buffer_size = 0;
+};
+
+// The counters of one socket of `UDPListener`, or of all of them.
+struct UDPListenerCounters {
+  uint64_t received = 0;           // Received and pushed into the queue.
+  uint64_t dropped_by_queue = 0;   // Received, and not accepted by the queue.
+  uint64_t truncated = 0;          // Longer than `max_datagram_size`, and not pushed.
+  uint64_t dropped_by_kernel = 0;  // Dropped before having been received, as the receive buffer was full.
+
+  UDPListenerCounters& operator+=(const UDPListenerCounters& rhs) {
+    received += rhs.received;
+    dropped_by_queue += rhs.dropped_by_queue;
+    truncated += rhs.truncated;
+    dropped_by_kernel += rhs.dropped_by_kernel;
+    return *this;
+  }
+};
+
+// Receives the datagrams sent to the port, and pushes each one into `mq` as a message of its own, with
+// `mq.EmplaceMessage(length, writer)`, as `EfficientMQ` has, for `T_MQ::T_MESSAGE`, such as `std::string`,
+// that is resized to the length of the datagram and filled in place. The queue must outlive the listener.
+// Starts receiving right away, and stops on destruction.
+// Throws `SocketException`-s if the port can not be bound.
+template <typename T_MQ>
+class UDPListener final {
+ public:
+  typedef typename T_MQ::T_MESSAGE T_MESSAGE;
+
+  UDPListener(T_MQ& mq, int port, const UDPListenerParameters& parameters = UDPListenerParameters())
+      : mq_(mq), stopping_(false) {
+    const size_t sockets = std::max(parameters.sockets, static_cast<size_t>(1));
+    UDPSocketOptions options;
+    options.receive_buffer_size = parameters.receive_buffer_size;
+    options.reuse_port = sockets > 1;
+    for (size_t i = 0; i < sockets; ++i) {
+      receivers_.emplace_back(new Receiver(port, options, parameters));
+    }
+    for (auto& receiver : receivers_) {
+      receiver->thread = std::thread(&UDPListener::Run, this, std::ref(*receiver));
+    }
+  }
+
+  UDPListener(T_MQ& mq, int port, size_t sockets) : UDPListener(mq, port, Parameters(sockets)) {}
+
+  // Stops receiving, pushing the datagrams received already.
+  ~UDPListener() {
+    stopping_ = true;
+    for (auto& receiver : receivers_) {
+      receiver->thread.join();
+    }
+  }
+
+  size_t Sockets() const { return receivers_.size(); }
+
+  // THREAD SAFE.
+  UDPListenerCounters SocketCounters(size_t i) const {
+    const Receiver& receiver = *receivers_[i];
+    UDPListenerCounters counters;
+    counters.received = receiver.received;
+    counters.dropped_by_queue = receiver.dropped_by_queue;
+    counters.truncated = receiver.truncated;
+    counters.dropped_by_kernel = receiver.dropped_by_kernel;
+    return counters;
+  }
+
+  UDPListenerCounters Counters() const {
+    UDPListenerCounters counters;
+    for (size_t i = 0; i < receivers_.size(); ++i) {
+      counters += SocketCounters(i);
+    }
+    return counters;
+  }
+
+ private:
+  struct Receiver {
+    UDPSocket socket;
+    UDPBatch batch;
+    std::thread thread;
+    std::atomic<uint64_t> received;
+    std::atomic<uint64_t> dropped_by_queue;
+    std::atomic<uint64_t> truncated;
+    std::atomic<uint64_t> dropped_by_kernel;
+
+    Receiver(int port, const UDPSocketOptions& options, const UDPListenerParameters& parameters)
+        : socket(port, options),
+          batch(parameters.batch_size, parameters.max_datagram_size),
+          received(0),
+          dropped_by_queue(0),
+          truncated(0),
+          dropped_by_kernel(0) {}
+  };
+
+  static UDPListenerParameters Parameters(size_t sockets) {
+    UDPListenerParameters parameters;
+    parameters.sockets = sockets;
+    return parameters;
+  }
+
+  void Run(Receiver& receiver) {
+    UDPBatch& batch = receiver.batch;
+    while (!stopping_) {
+      if (!receiver.socket.WaitForDatagrams(kUDPListenerPollIntervalMs)) {
+        continue;
+      }
+      // Keep receiving while the batches come full, for the burst to be drained before the next `poll()`.
+      while (receiver.socket.ReceiveBatch(batch)) {
+        for (size_t i = 0; i < batch.Size(); ++i) {
+          if (batch.Truncated(i)) {
+            ++receiver.truncated;
+            continue;
+          }
+          const char* data = batch.Data(i);
+          const size_t length = batch.Length(i);
+          if (mq_.EmplaceMessage(length, [data, length](T_MESSAGE& message) {
+                if (length) {
+                  ::memcpy(&message[0], data, length);
+                }
+              })) {
+            ++receiver.received;
+          } else {
+            ++receiver.dropped_by_queue;
+          }
+        }
+        receiver.dropped_by_kernel = receiver.socket.KernelDropped();
+        if (batch.Size() < batch.Capacity()) {
+          break;
+        }
+      }
+    }
+  }
+
+  T_MQ& mq_;
+  std::atomic_bool stopping_;
+  std::vector<std::unique_ptr<Receiver>> receivers_;
+
+  UDPListener(const UDPListener&) = delete;
+  void operator=(const UDPListener&) = delete;
+};
+
+}  // namespace net
+}  // namespace bricks
+
+#endif  // BRICKS_NET_UDP_IMPL_POSIX_H
@@ -0,0 +1,136 @@
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "udp.h"
+
+#include "../../dflags/dflags.h"
+
+#include "../../3party/gtest/gtest.h"
+#include "../../3party/gtest/gtest-main-with-dflags.h"
+
+#include <arpa/inet.h>
+
+DEFINE_int32(udp_port, 8125, "Port to use for the test.");
+
+using std::string;
+using std::vector;
+
+using bricks::net::UDPBatch;
+using bricks::net::UDPListener;
+using bricks::net::UDPListenerParameters;
+using bricks::net::UDPSocket;
+
+static void SendDatagram(const string& datagram) {
+  const int fd = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  ASSERT_LE(0, fd);
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(FLAGS_udp_port);
+  EXPECT_EQ(static_cast<ssize_t>(datagram.length()),
+            ::sendto(fd, datagram.data(), datagram.length(), 0, reinterpret_cast<sockaddr*>(&address),
+                     sizeof(address)));
+  ::close(fd);
+}
+
+// The queue with the `EmplaceMessage()` of `EfficientMQ`, accepting up to `capacity` messages.
+struct TestMQ {
+  typedef string T_MESSAGE;
+  std::mutex mutex;
+  vector<string> messages;
+  size_t capacity = 1000;
+
+  template <typename F>
+  bool EmplaceMessage(size_t length, F&& writer) {
+    string message;
+    message.resize(length);
+    writer(message);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (messages.size() >= capacity) {
+      return false;
+    }
+    messages.push_back(message);
+    return true;
+  }
+
+  size_t Size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return messages.size();
+  }
+};
+
+template <typename F>
+static void WaitUntil(F&& predicate) {
+  while (!predicate()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+TEST(UDPSocket, ReceivesBatchesIntoReusedBuffers) {
+  UDPSocket socket(FLAGS_udp_port);
+  UDPBatch batch(4, 16);
+  EXPECT_EQ(0u, socket.ReceiveBatch(batch));
+  for (int i = 0; i < 6; ++i) {
+    SendDatagram("datagram " + std::to_string(i));
+  }
+  SendDatagram("longer than sixteen bytes");
+  const char* const buffer = batch.Data(0);
+  vector<string> received;
+  while (received.size() < 7 && socket.WaitForDatagrams(1000)) {
+    const size_t count = socket.ReceiveBatch(batch);
+    EXPECT_GE(4u, count);
+    for (size_t i = 0; i < count; ++i) {
+      received.push_back(string(batch.Data(i), batch.Length(i)) + (batch.Truncated(i) ? "..." : ""));
+    }
+  }
+  ASSERT_EQ(7u, received.size());
+  EXPECT_EQ("datagram 0", received[0]);
+  EXPECT_EQ("datagram 5", received[5]);
+  EXPECT_EQ("longer than sixt...", received[6]);
+  // The buffers of the batch are reused.
+  EXPECT_EQ(buffer, batch.Data(0));
+}
+
+TEST(UDPListener, PushesIntoTheQueueAndCountsDrops) {
+  TestMQ mq;
+  mq.capacity = 3;
+  UDPListenerParameters parameters;
+  parameters.max_datagram_size = 8;
+  {
+    UDPListener<TestMQ> listener(mq, FLAGS_udp_port, parameters);
+    for (int i = 0; i < 5; ++i) {
+      SendDatagram("event:" + std::to_string(i));
+    }
+    SendDatagram("");
+    SendDatagram("too long to fit");
+    WaitUntil([&listener]() {
+      const auto counters = listener.Counters();
+      return counters.received + counters.dropped_by_queue + counters.truncated == 7;
+    });
+    const auto counters = listener.SocketCounters(0);
+    EXPECT_EQ(3u, counters.received);
+    EXPECT_EQ(3u, counters.dropped_by_queue);
+    EXPECT_EQ(1u, counters.truncated);
+  }
+  ASSERT_EQ(3u, mq.messages.size());
+  EXPECT_EQ("event:0", mq.messages[0]);
+  EXPECT_EQ("event:2", mq.messages[2]);
+}
+
+#if defined(SO_REUSEPORT)
+TEST(UDPListener, SeveralSocketsOnOnePort) {
+  TestMQ mq;
+  UDPListener<TestMQ> listener(mq, FLAGS_udp_port, 4);
+  EXPECT_EQ(4u, listener.Sockets());
+  // Each sender is a socket of its own, with a port of its own, which the kernel hashes to one of the sockets.
+  for (int i = 0; i < 100; ++i) {
+    SendDatagram("event " + std::to_string(i));
+  }
+  WaitUntil([&mq]() { return mq.Size() == 100; });
+  EXPECT_EQ(100u, listener.Counters().received);
+}
+#endif
@@ -0,0 +1,14 @@
+#ifndef BRICKS_NET_UDP_UDP_H
+#define BRICKS_NET_UDP_UDP_H
+
+#include "../../port.h"
+
+#if defined(BRICKS_POSIX) || defined(BRICKS_APPLE) || defined(BRICKS_JAVA)
+#include "impl/posix.h"
+#elif defined(BRICKS_ANDROID)
+#error "bricks/port.h should not be included in ANDROID builds."
+#else
+#error "No implementation for `net/udp.h` is available for your system."
+#endif
+
+#endif  // BRICKS_NET_UDP_UDP_H
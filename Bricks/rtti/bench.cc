@@ -0,0 +1,143 @@
+// The benchmarks of the runtime dispatchers, run with `make bench`.
+//
+// Each dispatches a batch of objects of eight types, the last of the list of types being the most frequent,
+// as it is the slowest to reach through the chain of `dynamic_cast`-s of `RuntimeDispatcher`.
+
+#include "dispatcher.h"
+#include "variant.h"
+
+#include <memory>
+#include <vector>
+
+#include "../benchmark/benchmark.h"
+
+using bricks::benchmark::DoNotOptimize;
+
+namespace {
+
+struct Base {
+  virtual ~Base() = default;
+};
+template <int N>
+struct Derived : Base {};
+
+typedef std::tuple<Derived<0>, Derived<1>, Derived<2>, Derived<3>, Derived<4>, Derived<5>, Derived<6>,
+                   Derived<7>> T_TYPES;
+
+struct Counter {
+  size_t total = 0;
+  void operator()(const Base&) { ++total; }
+  template <int N>
+  void operator()(const Derived<N>&) {
+    total += N;
+  }
+  template <typename T>
+  void operator()(const std::vector<const T*>& batch) {
+    for (const T* x : batch) {
+      (*this)(*x);
+    }
+  }
+};
+
+struct Objects {
+  std::vector<std::unique_ptr<Base>> owned;
+  std::vector<const Base*> batch;
+  Objects() {
+    for (int i = 0; i < 1000; ++i) {
+      switch (i % 4 ? 7 : i % 7) {
+        case 0:
+          owned.emplace_back(new Derived<0>());
+          break;
+        case 1:
+          owned.emplace_back(new Derived<1>());
+          break;
+        case 2:
+          owned.emplace_back(new Derived<2>());
+          break;
+        case 3:
+          owned.emplace_back(new Derived<3>());
+          break;
+        case 4:
+          owned.emplace_back(new Derived<4>());
+          break;
+        case 5:
+          owned.emplace_back(new Derived<5>());
+          break;
+        case 6:
+          owned.emplace_back(new Derived<6>());
+          break;
+        default:
+          owned.emplace_back(new Derived<7>());
+      }
+      batch.push_back(owned.back().get());
+    }
+  }
+};
+
+typedef bricks::rtti::TupleVariant<T_TYPES>::type Variant;
+
+struct VariantCopier {
+  std::vector<Variant> variants;
+  void operator()(const Base&) {}
+  template <int N>
+  void operator()(const Derived<N>& x) {
+    variants.emplace_back(x);
+  }
+};
+
+const Objects& TheObjects() {
+  static Objects objects;
+  return objects;
+}
+
+}  // namespace
+
+BRICKS_BENCHMARK(RuntimeDispatcher1000) {
+  const Objects& objects = TheObjects();
+  Counter counter;
+  while (state.KeepRunning()) {
+    for (const Base* x : objects.batch) {
+      bricks::rtti::RuntimeTupleDispatcher<Base, T_TYPES>::DispatchCall(*x, counter);
+    }
+  }
+  DoNotOptimize(counter.total);
+}
+
+BRICKS_BENCHMARK(RuntimeTableDispatcher1000) {
+  const Objects& objects = TheObjects();
+  Counter counter;
+  while (state.KeepRunning()) {
+    for (const Base* x : objects.batch) {
+      bricks::rtti::RuntimeTupleTableDispatcher<Base, T_TYPES>::DispatchCall(*x, counter);
+    }
+  }
+  DoNotOptimize(counter.total);
+}
+
+BRICKS_BENCHMARK(RuntimeBatchDispatcher1000) {
+  const Objects& objects = TheObjects();
+  bricks::rtti::RuntimeTupleBatchDispatcher<Base, T_TYPES> dispatcher;
+  Counter counter;
+  while (state.KeepRunning()) {
+    dispatcher.DispatchBatch(objects.batch, counter);
+  }
+  DoNotOptimize(counter.total);
+}
+
+// The same objects, held in place by the variants, with no `dynamic_cast` to find their types.
+BRICKS_BENCHMARK(VariantVisit1000) {
+  VariantCopier copier;
+  for (const Base* x : TheObjects().batch) {
+    bricks::rtti::RuntimeTupleTableDispatcher<Base, T_TYPES>::DispatchCall(*x, copier);
+  }
+  const std::vector<Variant>& variants = copier.variants;
+  Counter counter;
+  while (state.KeepRunning()) {
+    for (const Variant& x : variants) {
+      x.Visit(counter);
+    }
+  }
+  DoNotOptimize(counter.total);
+}
+
+BRICKS_BENCHMARK_MAIN();
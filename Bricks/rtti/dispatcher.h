@@ -3,7 +3,12 @@
 
 #include "exceptions.h"
 
+#include <cstddef>
 #include <tuple>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
 
 namespace bricks {
 namespace rtti {
@@ -68,6 +73,178 @@ struct RuntimeTupleDispatcher {};
 template <typename BASE, typename... TUPLE_TYPES>
 struct RuntimeTupleDispatcher<BASE, std::tuple<TUPLE_TYPES...>> : RuntimeDispatcher<BASE, TUPLE_TYPES...> {};
 
+// `RuntimeTypeTable` finds the position of the first type of the list the object is an instance of, or
+// the number of the types for `BASE`, with one lookup in a table. The table maps the `typeid` of the actual
+// type of the object to the position, and is filled on the first call for each actual type, on each thread,
+// for no locking, by trying a `dynamic_cast` to each type in turn.
+template <typename BASE, typename... TYPES>
+struct RuntimeTypeTable {
+  static constexpr size_t kBaseIndex = sizeof...(TYPES);
+
+  template <typename T, typename TYPE>
+  using WithConstOf = typename std::conditional<std::is_const<TYPE>::value, const T, T>::type;
+
+  // Casts with `static_cast` where it is allowed, which is whenever `TYPE` is a non-virtual base of `T`.
+  // Call as `Cast<T>(x, 0)`.
+  template <typename T, typename TYPE>
+  static auto Cast(TYPE &x, int) -> decltype(static_cast<WithConstOf<T, TYPE> &>(x)) {
+    return static_cast<WithConstOf<T, TYPE> &>(x);
+  }
+  template <typename T, typename TYPE>
+  static WithConstOf<T, TYPE> &Cast(TYPE &x, ...) {
+    return dynamic_cast<WithConstOf<T, TYPE> &>(x);
+  }
+
+  template <typename TYPE>
+  static size_t Index(const TYPE &x) {
+    static thread_local std::unordered_map<const std::type_info *, size_t> table;
+    const std::type_info *type = &typeid(x);
+    const auto cit = table.find(type);
+    if (cit != table.end()) {
+      return cit->second;
+    }
+    const size_t index = Resolve<TYPE, TYPES...>(x, 0);
+    table.emplace(type, index);
+    return index;
+  }
+
+ private:
+  template <typename TYPE>
+  static size_t Resolve(const TYPE &x, size_t index) {
+    const BASE *b = dynamic_cast<const BASE *>(&x);
+    if (b) {
+      return index;
+    } else {
+      throw UnrecognizedPolymorphicType();
+    }
+  }
+  template <typename TYPE, typename T, typename... TAIL>
+  static size_t Resolve(const TYPE &x, size_t index) {
+    return dynamic_cast<const T *>(&x) ? index : Resolve<TYPE, TAIL...>(x, index + 1);
+  }
+};
+
+// `RuntimeTableDispatcher` dispatches the calls the same way as `RuntimeDispatcher`, to the first type
+// of the list the object is an instance of, or to `BASE`, with a lookup in `RuntimeTypeTable` instead of
+// a `dynamic_cast` for each type in turn.
+template <typename BASE, typename... TYPES>
+struct RuntimeTableDispatcher {
+  typedef BASE T_BASE;
+  template <typename TYPE, typename PROCESSOR>
+  static void DispatchCall(const TYPE &x, PROCESSOR &c) {
+    Dispatch<const TYPE>(x, c);
+  }
+  template <typename TYPE, typename PROCESSOR>
+  static void DispatchCall(TYPE &x, PROCESSOR &c) {
+    Dispatch<TYPE>(x, c);
+  }
+
+ private:
+  typedef RuntimeTypeTable<BASE, TYPES...> Table;
+
+  template <typename TYPE, typename PROCESSOR, typename T>
+  static void Call(TYPE &x, PROCESSOR &c) {
+    c(Table::template Cast<T>(x, 0));
+  }
+
+  template <typename TYPE, typename PROCESSOR>
+  static void Dispatch(TYPE &x, PROCESSOR &c) {
+    typedef void (*Caller)(TYPE &, PROCESSOR &);
+    static const Caller callers[] = {&Call<TYPE, PROCESSOR, TYPES>..., &Call<TYPE, PROCESSOR, BASE>};
+    callers[Table::Index(x)](x, c);
+  }
+};
+
+template <typename BASE, typename... TUPLE_TYPES>
+struct RuntimeTupleTableDispatcher {};
+
+template <typename BASE, typename... TUPLE_TYPES>
+struct RuntimeTupleTableDispatcher<BASE, std::tuple<TUPLE_TYPES...>>
+    : RuntimeTableDispatcher<BASE, TUPLE_TYPES...> {};
+
+// `RuntimeBatchDispatcher` dispatches a batch of objects by their types at once: it puts each into the bucket
+// of the first type of the list it is an instance of, or of `BASE`, in one pass and in order, then calls
+// `PROCESSOR::operator()(const std::vector<const T*>&)` once for each non-empty bucket, in the order
+// of the list, with `BASE` last. For the code of each type to run over its objects in one go.
+// `Indices()` are the positions in the batch of the objects passed in the current call.
+//
+// The buckets are kept from one batch to the next, not to allocate memory for each.
+template <typename BASE, typename... TYPES>
+class RuntimeBatchDispatcher {
+ public:
+  template <typename PROCESSOR>
+  void DispatchBatch(const BASE *const *begin, const BASE *const *end, PROCESSOR &c) {
+    Clear(std::integral_constant<size_t, 0>());
+    typedef void (*Pusher)(Buckets &, const BASE &, size_t);
+    static const Pusher pushers[] = {&Push<TYPES>..., &Push<BASE>};
+    for (const BASE *const *it = begin; it != end; ++it) {
+      pushers[Table::Index(**it)](buckets_, **it, static_cast<size_t>(it - begin));
+    }
+    Call(c, std::integral_constant<size_t, 0>());
+  }
+
+  template <typename PROCESSOR>
+  void DispatchBatch(const std::vector<const BASE *> &batch, PROCESSOR &c) {
+    DispatchBatch(batch.data(), batch.data() + batch.size(), c);
+  }
+
+  const std::vector<size_t> &Indices() const { return *indices_; }
+
+ private:
+  typedef RuntimeTypeTable<BASE, TYPES...> Table;
+
+  template <typename T>
+  struct Bucket {
+    std::vector<const T *> entries;
+    std::vector<size_t> indices;
+  };
+  typedef std::tuple<Bucket<TYPES>..., Bucket<BASE>> Buckets;
+  static constexpr size_t kBuckets = sizeof...(TYPES) + 1;
+
+  template <typename T>
+  static void Push(Buckets &buckets, const BASE &x, size_t index) {
+    Bucket<T> &bucket = std::get<Position<T, TYPES..., BASE>::value>(buckets);
+    bucket.entries.push_back(&Table::template Cast<T>(x, 0));
+    bucket.indices.push_back(index);
+  }
+
+  // The position of `T` in the list, counting from the first occurrence, as `Table::Index()` does.
+  template <typename T, typename HEAD, typename... TAIL>
+  struct Position : std::integral_constant<size_t, 1 + Position<T, TAIL...>::value> {};
+  template <typename T, typename... TAIL>
+  struct Position<T, T, TAIL...> : std::integral_constant<size_t, 0> {};
+
+  template <size_t I>
+  void Clear(std::integral_constant<size_t, I>) {
+    std::get<I>(buckets_).entries.clear();
+    std::get<I>(buckets_).indices.clear();
+    Clear(std::integral_constant<size_t, I + 1>());
+  }
+  void Clear(std::integral_constant<size_t, kBuckets>) {}
+
+  template <typename PROCESSOR, size_t I>
+  void Call(PROCESSOR &c, std::integral_constant<size_t, I>) {
+    const auto &bucket = std::get<I>(buckets_);
+    if (!bucket.entries.empty()) {
+      indices_ = &bucket.indices;
+      c(bucket.entries);
+    }
+    Call(c, std::integral_constant<size_t, I + 1>());
+  }
+  template <typename PROCESSOR>
+  void Call(PROCESSOR &, std::integral_constant<size_t, kBuckets>) {}
+
+  Buckets buckets_;
+  const std::vector<size_t> *indices_ = nullptr;
+};
+
+template <typename BASE, typename... TUPLE_TYPES>
+class RuntimeTupleBatchDispatcher {};
+
+template <typename BASE, typename... TUPLE_TYPES>
+class RuntimeTupleBatchDispatcher<BASE, std::tuple<TUPLE_TYPES...>>
+    : public RuntimeBatchDispatcher<BASE, TUPLE_TYPES...> {};
+
 }  // namespace rtti
 }  // namespace bricks
 
@@ -7,6 +7,8 @@ namespace bricks {
 namespace rtti {
 
 struct UnrecognizedPolymorphicType : Exception {};
+// Thrown by `Variant` for a type, or an index of a type, that it does not hold.
+struct IncompatibleVariantType : Exception {};
 
 }  // namespace rtti
 }  // namespace bricks
@@ -1,6 +1,7 @@
 // TODO(dkorolev): Add a test that throws UnrecognizedPolymorphicTypeException.
 
 #include "dispatcher.h"
+#include "variant.h"
 
 #include <string>
 #include <tuple>
@@ -216,3 +217,162 @@ TEST(RuntimeDispatcher, MutableWithTupleTypeListDispatching) {
   bricks::rtti::RuntimeTupleDispatcher<Base, tuple<Foo, Bar, Baz>>::DispatchCall(rbaz, p);
   EXPECT_EQ("Baz&", p.s);
 }
+
+struct FooDerived : Foo {
+  FooDerived() {}
+};
+
+TEST(RuntimeDispatcher, ImmutableWithTableDispatching) {
+  const Base base;
+  const Foo foo;
+  const Bar bar;
+  const Baz baz;
+  const FooDerived foo_derived;
+  const Base& rbase = base;
+  const Base& rfoo = foo;
+  const Base& rbar = bar;
+  const Base& rbaz = baz;
+  const Base& rfoo_derived = foo_derived;
+  Processor p;
+  EXPECT_EQ("", p.s);
+  // Twice, for the second call to go by the table.
+  for (int i = 0; i < 2; ++i) {
+    bricks::rtti::RuntimeTableDispatcher<Base, Foo, Bar, Baz>::DispatchCall(rbase, p);
+    EXPECT_EQ("const Base&", p.s);
+    bricks::rtti::RuntimeTableDispatcher<Base, Foo, Bar, Baz>::DispatchCall(rfoo, p);
+    EXPECT_EQ("const Foo&", p.s);
+    bricks::rtti::RuntimeTableDispatcher<Base, Foo, Bar, Baz>::DispatchCall(rbar, p);
+    EXPECT_EQ("const Bar&", p.s);
+    bricks::rtti::RuntimeTableDispatcher<Base, Foo, Bar, Baz>::DispatchCall(rbaz, p);
+    EXPECT_EQ("const Baz&", p.s);
+    // The derived types go to the first of their bases in the list.
+    bricks::rtti::RuntimeTableDispatcher<Base, Foo, Bar, Baz>::DispatchCall(rfoo_derived, p);
+    EXPECT_EQ("const Foo&", p.s);
+    bricks::rtti::RuntimeTableDispatcher<Base, Bar, Baz>::DispatchCall(rfoo_derived, p);
+    EXPECT_EQ("const Base&", p.s);
+  }
+}
+
+TEST(RuntimeDispatcher, MutableWithTupleTypeListTableDispatching) {
+  Base base;
+  Foo foo;
+  Bar bar;
+  Baz baz;
+  Base& rbase = base;
+  Base& rfoo = foo;
+  Base& rbar = bar;
+  Base& rbaz = baz;
+  Processor p;
+  EXPECT_EQ("", p.s);
+  for (int i = 0; i < 2; ++i) {
+    bricks::rtti::RuntimeTupleTableDispatcher<Base, tuple<Foo, Bar, Baz>>::DispatchCall(rbase, p);
+    EXPECT_EQ("Base&", p.s);
+    bricks::rtti::RuntimeTupleTableDispatcher<Base, tuple<Foo, Bar, Baz>>::DispatchCall(rfoo, p);
+    EXPECT_EQ("Foo&", p.s);
+    bricks::rtti::RuntimeTupleTableDispatcher<Base, tuple<Foo, Bar, Baz>>::DispatchCall(rbar, p);
+    EXPECT_EQ("Bar&", p.s);
+    bricks::rtti::RuntimeTupleTableDispatcher<Base, tuple<Foo, Bar, Baz>>::DispatchCall(rbaz, p);
+    EXPECT_EQ("Baz&", p.s);
+  }
+}
+
+TEST(RuntimeDispatcher, TableDispatchingThrowsForUnrecognizedTypes) {
+  const Baz baz;
+  const Base& rbaz = baz;
+  Processor p;
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_THROW((bricks::rtti::RuntimeTableDispatcher<Foo, Bar>::DispatchCall(rbaz, p)),
+                 bricks::rtti::UnrecognizedPolymorphicType);
+  }
+}
+
+struct BatchProcessor {
+  const bricks::rtti::RuntimeBatchDispatcher<Base, Foo, Bar, Baz>* dispatcher = nullptr;
+  string s;
+  template <typename T>
+  void Append(const string& name, const std::vector<const T*>& entries) {
+    s += name + ":" + std::to_string(entries.size()) + "@";
+    for (size_t i : dispatcher->Indices()) {
+      s += std::to_string(i);
+    }
+    s += ' ';
+  }
+  void operator()(const std::vector<const Base*>& entries) { Append("Base", entries); }
+  void operator()(const std::vector<const Foo*>& entries) { Append("Foo", entries); }
+  void operator()(const std::vector<const Bar*>& entries) { Append("Bar", entries); }
+  void operator()(const std::vector<const Baz*>& entries) { Append("Baz", entries); }
+};
+
+TEST(RuntimeDispatcher, BatchDispatching) {
+  const Base base;
+  const Foo foo;
+  const Bar bar;
+  const Baz baz;
+  const FooDerived foo_derived;
+  bricks::rtti::RuntimeBatchDispatcher<Base, Foo, Bar, Baz> dispatcher;
+  BatchProcessor p;
+  p.dispatcher = &dispatcher;
+
+  dispatcher.DispatchBatch({&foo, &bar, &foo_derived, &base, &baz, &foo, &bar}, p);
+  EXPECT_EQ("Foo:3@025 Bar:2@16 Baz:1@4 Base:1@3 ", p.s);
+
+  // The buckets are cleared from one batch to the next, and the empty ones are skipped.
+  p.s.clear();
+  dispatcher.DispatchBatch({&baz, &baz}, p);
+  EXPECT_EQ("Baz:2@01 ", p.s);
+
+  p.s.clear();
+  dispatcher.DispatchBatch(std::vector<const Base*>(), p);
+  EXPECT_EQ("", p.s);
+}
+
+struct VariantProcessor {
+  string s;
+  void operator()(const Foo&) { s += "const Foo& "; }
+  void operator()(const string& x) { s += "const string& " + x + ' '; }
+  void operator()(const int x) { s += "int " + std::to_string(x) + ' '; }
+  void operator()(Foo&) { s += "Foo& "; }
+  void operator()(string& x) {
+    s += "string& " + x + ' ';
+    x += '!';
+  }
+};
+
+TEST(Variant, HoldsValuesInPlaceAndDispatchesTheCalls) {
+  typedef bricks::rtti::TupleVariant<tuple<Foo, string, int>>::type Variant;
+  static_assert(std::is_same<Variant, bricks::rtti::Variant<Foo, string, int>>::value, "");
+  VariantProcessor p;
+
+  Variant v;
+  EXPECT_EQ(0u, v.Index());
+  EXPECT_TRUE(v.Is<Foo>());
+  v.Visit(p);
+  v = string("foo");
+  EXPECT_EQ(1u, v.Index());
+  v.Visit(p);
+  static_cast<const Variant&>(v).Visit(p);
+  EXPECT_EQ("Foo& string& foo const string& foo! ", p.s);
+
+  p.s.clear();
+  const Variant copy(v);
+  v.Emplace<int>(42);
+  EXPECT_EQ(42, v.Get<int>());
+  copy.Visit(p);
+  v.Visit(p);
+  Variant moved(std::move(v));
+  moved.Visit(p);
+  EXPECT_EQ("const string& foo! int 42 int 42 ", p.s);
+
+  EXPECT_EQ("foo!", copy.Get<string>());
+  ASSERT_THROW(copy.Get<int>(), bricks::rtti::IncompatibleVariantType);
+
+  // The value of the same type is kept, for it to be reused, and the others are default-constructed.
+  Variant w(string("bar"));
+  w.EmplaceIndex(1);
+  EXPECT_EQ("bar", w.Get<string>());
+  w.EmplaceIndex(2);
+  EXPECT_EQ(0, w.Get<int>());
+  ASSERT_THROW(w.EmplaceIndex(3), bricks::rtti::IncompatibleVariantType);
+  // The temporary processors are accepted as well.
+  w.Visit(VariantProcessor());
+}
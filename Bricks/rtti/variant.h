@@ -0,0 +1,237 @@
+// `Variant` holds a value of one of a closed list of types, in place, and dispatches calls by the type
+// of the value with a jump table, with neither a heap allocation nor a `dynamic_cast` per value.
+//
+// For the events of a closed hierarchy, it is the alternative to `std::unique_ptr<BASE>` and the runtime
+// dispatchers of `dispatcher.h`: `TupleVariant<DERIVED_TYPE_LIST>::type` is the variant of the same tuple
+// of types the processors of `NextWithDispatching()` list. `Visit(processor)` calls `processor(T&)`,
+// or `processor(const T&)` for a const variant, with the type of the value held:
+//
+//   typedef bricks::rtti::TupleVariant<std::tuple<EventAppStart, EventAppResume>>::type Event;
+//   Event event(EventAppStart());
+//   event.Visit(processor);
+//   event.Emplace<EventAppResume>();
+//   event.Get<EventAppResume>();  // Throws `IncompatibleVariantType` unless `event.Is<EventAppResume>()`.
+//
+// A default-constructed variant holds the default-constructed value of the first type. The types should be
+// nothrow move constructible, and the first one default constructible. `cerealize.h` writes and parses
+// the variants as the index of the type of the value followed by the value, see `NextVariant()` there.
+
+#ifndef BRICKS_RTTI_VARIANT_H
+#define BRICKS_RTTI_VARIANT_H
+
+#include "exceptions.h"
+
+#include <cstddef>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace bricks {
+namespace rtti {
+
+namespace impl {
+
+template <size_t N, size_t... TAIL>
+struct VariantMax
+    : std::integral_constant<size_t, (N > VariantMax<TAIL...>::value ? N : VariantMax<TAIL...>::value)> {};
+template <size_t N>
+struct VariantMax<N> : std::integral_constant<size_t, N> {};
+
+// The position of the first occurrence of `T` in the list, or the size of the list if it is not there.
+template <typename T, typename... TYPES>
+struct VariantIndexOf : std::integral_constant<size_t, 0> {};
+template <typename T, typename HEAD, typename... TAIL>
+struct VariantIndexOf<T, HEAD, TAIL...>
+    : std::integral_constant<size_t,
+                             std::is_same<T, HEAD>::value ? 0 : 1 + VariantIndexOf<T, TAIL...>::value> {};
+
+template <typename HEAD, typename... TAIL>
+struct VariantFirst {
+  typedef HEAD type;
+};
+
+}  // namespace impl
+
+template <typename... TYPES>
+class Variant {
+ public:
+  static constexpr size_t kSize = sizeof...(TYPES);
+
+  template <typename T>
+  struct IndexOf : impl::VariantIndexOf<typename std::decay<T>::type, TYPES...> {};
+  template <typename T>
+  struct Holds : std::integral_constant<bool, (IndexOf<T>::value < kSize)> {};
+
+  Variant() : index_(0) { new (&storage_) typename impl::VariantFirst<TYPES...>::type(); }
+
+  template <typename T, typename = typename std::enable_if<Holds<T>::value>::type>
+  Variant(T &&value) : index_(IndexOf<T>::value) {
+    new (&storage_) typename std::decay<T>::type(std::forward<T>(value));
+  }
+
+  Variant(const Variant &rhs) : index_(rhs.index_) { CopyConstructors()[index_](&storage_, &rhs.storage_); }
+  Variant(Variant &&rhs) : index_(rhs.index_) { MoveConstructors()[index_](&storage_, &rhs.storage_); }
+
+  Variant &operator=(const Variant &rhs) {
+    if (this != &rhs) {
+      Variant copy(rhs);
+      *this = std::move(copy);
+    }
+    return *this;
+  }
+  Variant &operator=(Variant &&rhs) {
+    if (this != &rhs) {
+      Destructors()[index_](&storage_);
+      index_ = rhs.index_;
+      MoveConstructors()[index_](&storage_, &rhs.storage_);
+    }
+    return *this;
+  }
+
+  ~Variant() { Destructors()[index_](&storage_); }
+
+  // The position in the list of the type of the value held.
+  size_t Index() const { return index_; }
+
+  template <typename T>
+  bool Is() const {
+    static_assert(Holds<T>::value, "The type is not one of the variant.");
+    return index_ == IndexOf<T>::value;
+  }
+
+  template <typename T>
+  T &Get() {
+    if (!Is<T>()) {
+      throw IncompatibleVariantType();
+    }
+    return *reinterpret_cast<T *>(&storage_);
+  }
+  template <typename T>
+  const T &Get() const {
+    if (!Is<T>()) {
+      throw IncompatibleVariantType();
+    }
+    return *reinterpret_cast<const T *>(&storage_);
+  }
+
+  // Replaces the value with the `T` constructed from `args`. Should it throw, the variant holds
+  // the default-constructed value of the first type.
+  template <typename T, typename... ARGS>
+  T &Emplace(ARGS &&... args) {
+    static_assert(Holds<T>::value, "The type is not one of the variant.");
+    Destructors()[index_](&storage_);
+    try {
+      new (&storage_) T(std::forward<ARGS>(args)...);
+    } catch (...) {
+      index_ = 0;
+      DefaultConstructors()[0](&storage_);
+      throw;
+    }
+    index_ = IndexOf<T>::value;
+    return *reinterpret_cast<T *>(&storage_);
+  }
+
+  // Has the variant hold a value of the `index`-th type, default-constructed unless it holds one already,
+  // for the parsers to parse into the value in place, reusing it from one record to the next.
+  void EmplaceIndex(size_t index) {
+    if (index >= kSize) {
+      throw IncompatibleVariantType();
+    }
+    if (index != index_) {
+      Destructors()[index_](&storage_);
+      try {
+        DefaultConstructors()[index](&storage_);
+      } catch (...) {
+        index_ = 0;
+        DefaultConstructors()[0](&storage_);
+        throw;
+      }
+      index_ = index;
+    }
+  }
+
+  // Calls `processor(T&)`, or `processor(const T&)`, for the value held, of type `T`.
+  template <typename PROCESSOR>
+  void Visit(PROCESSOR &&processor) {
+    typedef typename std::remove_reference<PROCESSOR>::type T_PROCESSOR;
+    typedef void (*Caller)(void *, T_PROCESSOR &);
+    static const Caller callers[] = {&Call<T_PROCESSOR, TYPES>...};
+    callers[index_](&storage_, processor);
+  }
+  template <typename PROCESSOR>
+  void Visit(PROCESSOR &&processor) const {
+    typedef typename std::remove_reference<PROCESSOR>::type T_PROCESSOR;
+    typedef void (*Caller)(const void *, T_PROCESSOR &);
+    static const Caller callers[] = {&ConstCall<T_PROCESSOR, TYPES>...};
+    callers[index_](&storage_, processor);
+  }
+
+ private:
+  typedef void (*Destructor)(void *);
+  typedef void (*DefaultConstructor)(void *);
+  typedef void (*CopyConstructor)(void *, const void *);
+  typedef void (*MoveConstructor)(void *, void *);
+
+  template <typename T>
+  static void Destruct(void *p) {
+    static_cast<T *>(p)->~T();
+  }
+  template <typename T>
+  static void DefaultConstruct(void *p) {
+    new (p) T();
+  }
+  template <typename T>
+  static void CopyConstruct(void *p, const void *rhs) {
+    new (p) T(*static_cast<const T *>(rhs));
+  }
+  template <typename T>
+  static void MoveConstruct(void *p, void *rhs) {
+    new (p) T(std::move(*static_cast<T *>(rhs)));
+  }
+  template <typename PROCESSOR, typename T>
+  static void Call(void *p, PROCESSOR &c) {
+    c(*static_cast<T *>(p));
+  }
+  template <typename PROCESSOR, typename T>
+  static void ConstCall(const void *p, PROCESSOR &c) {
+    c(*static_cast<const T *>(p));
+  }
+
+  static const Destructor *Destructors() {
+    static const Destructor table[] = {&Destruct<TYPES>...};
+    return table;
+  }
+  static const DefaultConstructor *DefaultConstructors() {
+    static const DefaultConstructor table[] = {&DefaultConstruct<TYPES>...};
+    return table;
+  }
+  static const CopyConstructor *CopyConstructors() {
+    static const CopyConstructor table[] = {&CopyConstruct<TYPES>...};
+    return table;
+  }
+  static const MoveConstructor *MoveConstructors() {
+    static const MoveConstructor table[] = {&MoveConstruct<TYPES>...};
+    return table;
+  }
+
+  typename std::aligned_storage<impl::VariantMax<sizeof(TYPES)...>::value,
+                                impl::VariantMax<alignof(TYPES)...>::value>::type storage_;
+  size_t index_;
+};
+
+template <typename... TYPES>
+constexpr size_t Variant<TYPES...>::kSize;
+
+template <typename... TUPLE_TYPES>
+struct TupleVariant {};
+
+template <typename... TUPLE_TYPES>
+struct TupleVariant<std::tuple<TUPLE_TYPES...>> {
+  typedef Variant<TUPLE_TYPES...> type;
+};
+
+}  // namespace rtti
+}  // namespace bricks
+
+#endif  // BRICKS_RTTI_VARIANT_H
@@ -0,0 +1,103 @@
+// A microbenchmark of the ways to format a log line.
+//
+// Formats the same line, with an integer, a string and a floating point value, --iterations times
+// on each of --threads threads, and reports the nanoseconds per line for:
+//
+//   1) "vsnprintf_static": `vsnprintf()` into a static buffer, copied into a new `std::string`, the way
+//      `Printf()` used to. Not thread safe, thus run on one thread only.
+//   2) "snprintf_stack": `snprintf()` into a buffer on the stack, with no `std::string` at all.
+//   3) "Printf": `bricks::strings::Printf()`, returning a new `std::string`.
+//   4) "AppendPrintf": `bricks::strings::AppendPrintf()`, appending to a `std::string` cleared once per line.
+
+/*
+
+# The Makefile builds with optimizations.
+make
+
+./build/benchmark
+./build/benchmark --threads=8
+
+*/
+
+#include <cstdarg>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../printf.h"
+
+#include "../../dflags/dflags.h"
+#include "../../time/tsc.h"
+
+DEFINE_int32(iterations, 1000000, "The number of lines to format on each thread.");
+DEFINE_int32(threads, 1, "The number of threads to format the lines on concurrently.");
+
+using bricks::strings::AppendPrintf;
+using bricks::strings::Printf;
+using bricks::time::HighResolutionNowNanoseconds;
+
+static std::string StaticBufferPrintf(const char* format, ...) {
+  static char buffer[1024 * 1024 + 1];
+  va_list ap;
+  va_start(ap, format);
+  vsnprintf(buffer, sizeof(buffer) - 1, format, ap);
+  va_end(ap);
+  return buffer;
+}
+
+// Keeps the compiler from optimizing the formatting away.
+static size_t total_length;
+
+template <typename F>
+void Run(const char* name, int threads, F&& f) {
+  std::vector<size_t> lengths(threads);
+  const uint64_t begin = HighResolutionNowNanoseconds();
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([t, &f, &lengths]() {
+      size_t length = 0;
+      for (int i = 0; i < FLAGS_iterations; ++i) {
+        length += f(i);
+      }
+      lengths[t] = length;
+    });
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  const uint64_t end = HighResolutionNowNanoseconds();
+  for (size_t length : lengths) {
+    total_length += length;
+  }
+  printf("%-20s %2d thread(s): %7.1f ns per line on each\n",
+         name,
+         threads,
+         static_cast<double>(end - begin) / FLAGS_iterations);
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+
+  const char* format = "[%d] Request '%s' served in %.3f ms.";
+  const char* path = "/api/v1/users/12345/profile";
+
+  Run("vsnprintf_static", 1, [format, path](int i) {
+    return StaticBufferPrintf(format, i, path, i * 0.001).length();
+  });
+  Run("snprintf_stack", FLAGS_threads, [format, path](int i) {
+    char buffer[256];
+    return static_cast<size_t>(snprintf(buffer, sizeof(buffer), format, i, path, i * 0.001));
+  });
+  Run("Printf", FLAGS_threads, [format, path](int i) {
+    return Printf(format, i, path, i * 0.001).length();
+  });
+  Run("AppendPrintf", FLAGS_threads, [format, path](int i) {
+    static thread_local std::string line;
+    line.clear();
+    AppendPrintf(line, format, i, path, i * 0.001);
+    return line.length();
+  });
+
+  printf("(%zu bytes formatted in total.)\n", total_length);
+}
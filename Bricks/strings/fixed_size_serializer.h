@@ -1,38 +1,111 @@
 // Fixed-sized, zero-padded serialization and de-serialization for unsigned types of two or more bytes.
 //
 // Ported into Bricks from TailProduce.
+//
+// `Pack()` and `Unpack()` work on the fixed-size character buffers, two digits at a time with a table,
+// without `std::string`-s or streams. `PackToString()` and `UnpackFromString()` are built on top of them.
 
 #ifndef BRICKS_STRINGS_FIXED_SIZE_SERIALIZER_H
 #define BRICKS_STRINGS_FIXED_SIZE_SERIALIZER_H
 
-#include <iomanip>
+#include <cstdint>
 #include <limits>
-#include <sstream>
 #include <string>
 #include <type_traits>
 
 namespace bricks {
 namespace strings {
 
+// The decimal representations of 00 to 99.
+inline const char* FixedSizeSerializerDigitPairs() {
+  static const char digit_pairs[] =
+      "00010203040506070809"
+      "10111213141516171819"
+      "20212223242526272829"
+      "30313233343536373839"
+      "40414243444546474849"
+      "50515253545556575859"
+      "60616263646566676869"
+      "70717273747576777879"
+      "80818283848586878889"
+      "90919293949596979899";
+  return digit_pairs;
+}
+
 struct FixedSizeSerializerEnabler {};
 template <typename T>
 struct FixedSizeSerializer
     : std::enable_if<std::is_unsigned<T>::value && std::is_integral<T>::value&&(sizeof(T) > 1),
                      FixedSizeSerializerEnabler>::type {
   static constexpr size_t size_in_bytes = std::numeric_limits<T>::digits10 + 1;
+
+  // Writes exactly `size_in_bytes` characters, zero-padded, with no terminating zero.
+  static void Pack(T x, char* output) {
+    const char* digit_pairs = FixedSizeSerializerDigitPairs();
+    char* p = output + size_in_bytes;
+    while (x >= 100) {
+      const char* pair = digit_pairs + (x % 100) * 2;
+      x /= 100;
+      *--p = pair[1];
+      *--p = pair[0];
+    }
+    const char* pair = digit_pairs + x * 2;
+    *--p = pair[1];
+    if (p != output) {
+      *--p = pair[0];
+    }
+    while (p != output) {
+      *--p = '0';
+    }
+  }
+
+  // Reads exactly `size_in_bytes` decimal digits. Returns false if there are other characters among them,
+  // or if the value does not fit `T`, which are the cases when `Pack()` would not produce them.
+  static bool Unpack(const char* input, T& x) {
+    // The first `size_in_bytes - 1` digits, which is `digits10`, always fit.
+    T value = 0;
+    unsigned invalid = 0;
+    for (size_t i = 0; i + 1 < size_in_bytes; ++i) {
+      const unsigned digit = static_cast<unsigned char>(input[i]) - static_cast<unsigned>('0');
+      invalid |= (digit > 9);
+      value = static_cast<T>(value * 10 + digit);
+    }
+    const unsigned digit = static_cast<unsigned char>(input[size_in_bytes - 1]) - static_cast<unsigned>('0');
+    if (invalid || digit > 9 || value > (std::numeric_limits<T>::max() - digit) / 10) {
+      return false;
+    }
+    x = static_cast<T>(value * 10 + digit);
+    return true;
+  }
+
   static std::string PackToString(T x) {
-    std::ostringstream os;
-    os << std::setfill('0') << std::setw(size_in_bytes) << x;
-    return os.str();
+    std::string result(size_in_bytes, '0');
+    Pack(x, &result[0]);
+    return result;
   }
+
+  // Reads the leading decimal digits, after the leading whitespace, if any, as `std::istream` would.
+  // Returns the maximum value of `T` if they do not fit it, and zero if there are none.
   static T UnpackFromString(std::string const& s) {
-    T x;
-    std::istringstream is(s);
-    is >> x;
+    size_t i = 0;
+    while (i < s.length() && (s[i] == ' ' || (s[i] >= '\t' && s[i] <= '\r'))) {
+      ++i;
+    }
+    T x = 0;
+    for (; i < s.length() && s[i] >= '0' && s[i] <= '9'; ++i) {
+      const unsigned digit = static_cast<unsigned>(s[i] - '0');
+      if (x > (std::numeric_limits<T>::max() - digit) / 10) {
+        return std::numeric_limits<T>::max();
+      }
+      x = static_cast<T>(x * 10 + digit);
+    }
     return x;
   }
 };
 
+template <typename T>
+constexpr size_t FixedSizeSerializer<T>::size_in_bytes;
+
 // To allow implicit type specialization wherever possible.
 template <typename T>
 inline std::string PackToString(T x) {
@@ -44,7 +117,7 @@ inline const T& UnpackFromString(std::string const& s, T& x) {
   return x;
 }
 
-}  // namespace string
+}  // namespace strings
 }  // namespace bricks
 
 #endif  // BRICKS_STRINGS_FIXED_SIZE_SERIALIZER_H
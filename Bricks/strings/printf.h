@@ -1,23 +1,83 @@
 #ifndef BRICKS_STRINGS_PRINTF_H
 #define BRICKS_STRINGS_PRINTF_H
 
-#include <string>
 #include <cstdarg>
+#include <cstdio>
+#include <string>
+
+// The format strings are checked against the arguments at compile time, with `-Wformat`, by the compilers
+// that support it.
+#if defined(__GNUC__)
+#define BRICKS_PRINTF_FORMAT(format_index, first_argument_index) \
+  __attribute__((format(printf, format_index, first_argument_index)))
+#else
+#define BRICKS_PRINTF_FORMAT(format_index, first_argument_index)
+#endif
 
 namespace bricks {
 namespace strings {
 
-std::string Printf(const char *fmt, ...) {
-  const int max_formatted_output_length = 1024 * 1024;
-  static char buf[max_formatted_output_length + 1];
+// The output of that many bytes or less is formatted on the stack first.
+const size_t kPrintfStackBufferSize = 1024;
+
+// Appends the formatted output to `output`, writing into its spare capacity directly, thus not reallocating it
+// if the output fits. The output is never truncated. Thread safe, as is `vsnprintf()`.
+inline void AppendVPrintf(std::string& output, const char* format, va_list ap) {
+  const size_t size = output.size();
+  va_list retry;
+  va_copy(retry, ap);
+  output.resize(output.capacity());
+  const int length = vsnprintf(&output[size], output.size() - size + 1, format, ap);
+  if (length < 0) {
+    output.resize(size);
+  } else {
+    const size_t formatted_size = size + static_cast<size_t>(length);
+    if (formatted_size > output.size()) {
+      output.resize(formatted_size);
+      vsnprintf(&output[size], static_cast<size_t>(length) + 1, format, retry);
+    }
+    output.resize(formatted_size);
+  }
+  va_end(retry);
+}
+
+inline void AppendPrintf(std::string& output, const char* format, ...) BRICKS_PRINTF_FORMAT(2, 3);
+inline void AppendPrintf(std::string& output, const char* format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  AppendVPrintf(output, format, ap);
+  va_end(ap);
+}
+
+// Returns the formatted output, allocating the string of its size once. Thread safe, and never truncates.
+inline std::string VPrintf(const char* format, va_list ap) {
+  char buffer[kPrintfStackBufferSize];
+  va_list retry;
+  va_copy(retry, ap);
+  const int length = vsnprintf(buffer, sizeof(buffer), format, ap);
+  std::string result;
+  if (length >= 0) {
+    if (static_cast<size_t>(length) < sizeof(buffer)) {
+      result.assign(buffer, static_cast<size_t>(length));
+    } else {
+      result.resize(static_cast<size_t>(length));
+      vsnprintf(&result[0], static_cast<size_t>(length) + 1, format, retry);
+    }
+  }
+  va_end(retry);
+  return result;
+}
+
+inline std::string Printf(const char* format, ...) BRICKS_PRINTF_FORMAT(1, 2);
+inline std::string Printf(const char* format, ...) {
   va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(buf, max_formatted_output_length, fmt, ap);
+  va_start(ap, format);
+  std::string result = VPrintf(format, ap);
   va_end(ap);
-  return buf;
+  return result;
 }
 
-}  // namespace string
+}  // namespace strings
 }  // namespace bricks
 
 #endif  // BRICKS_STRINGS_PRINTF_H
@@ -0,0 +1,177 @@
+// Splitting the buffers of separator-delimited records, such as the files of FSQ appended to
+// by `AppendToFileWithSeparator`, into the slices of the records, with no data copied.
+//
+//   const bricks::MemoryMappedFile file(file_name);
+//   for (const SeparatedRecord& record : SeparatedRecords(file.data(), file.size(), "\n")) {
+//     Process(record.data, record.length);
+//   }
+//
+// The separator is found 32 bytes at a time with AVX2, when compiled for it, `-mavx2`, 16 bytes at a time
+// with SSE2, which every x86-64 CPU has, or with NEON on ARM, and with `memchr()` otherwise. For the separators
+// of several bytes, the blocks are compared to both their first and their last byte, and only the positions
+// where both match are compared in full. Nothing past the end of the buffer is read.
+
+#ifndef BRICKS_STRINGS_RECORDS_H
+#define BRICKS_STRINGS_RECORDS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace bricks {
+namespace strings {
+
+// Returns the pointer to the first occurrence of the separator in `[begin, end)`, or `nullptr`.
+// An empty separator is never found.
+inline const char* FindSeparator(const char* begin, const char* end, const char* separator, size_t length) {
+  if (!length) {
+    return nullptr;
+  }
+  const char* p = begin;
+  const size_t last = length - 1;
+#if defined(__AVX2__)
+  const __m256i first_byte = _mm256_set1_epi8(separator[0]);
+  const __m256i last_byte = _mm256_set1_epi8(separator[last]);
+  for (; static_cast<size_t>(end - p) >= 32 + last; p += 32) {
+    const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + last));
+    const __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(a, first_byte), _mm256_cmpeq_epi8(b, last_byte));
+    uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(eq));
+    for (; mask; mask &= mask - 1) {
+      const char* candidate = p + __builtin_ctz(mask);
+      if (length <= 2 || !memcmp(candidate + 1, separator + 1, length - 2)) {
+        return candidate;
+      }
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i first_byte = _mm_set1_epi8(separator[0]);
+  const __m128i last_byte = _mm_set1_epi8(separator[last]);
+  for (; static_cast<size_t>(end - p) >= 16 + last; p += 16) {
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + last));
+    uint32_t mask = static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first_byte), _mm_cmpeq_epi8(b, last_byte))));
+    for (; mask; mask &= mask - 1) {
+      const char* candidate = p + __builtin_ctz(mask);
+      if (length <= 2 || !memcmp(candidate + 1, separator + 1, length - 2)) {
+        return candidate;
+      }
+    }
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t first_byte = vdupq_n_u8(static_cast<uint8_t>(separator[0]));
+  const uint8x16_t last_byte = vdupq_n_u8(static_cast<uint8_t>(separator[last]));
+  for (; static_cast<size_t>(end - p) >= 16 + last; p += 16) {
+    const uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(p)), first_byte),
+                                   vceqq_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(p + last)), last_byte));
+    // Narrow each byte of the comparison result to four bits, as NEON has no `movemask`.
+    uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+    for (; mask; mask &= ~(0xFull << (__builtin_ctzll(mask) & ~3))) {
+      const char* candidate = p + (__builtin_ctzll(mask) >> 2);
+      if (length <= 2 || !memcmp(candidate + 1, separator + 1, length - 2)) {
+        return candidate;
+      }
+    }
+  }
+#endif
+  while (static_cast<size_t>(end - p) >= length) {
+    p = static_cast<const char*>(memchr(p, separator[0], static_cast<size_t>(end - p) - last));
+    if (!p) {
+      return nullptr;
+    }
+    if (!memcmp(p + 1, separator + 1, last)) {
+      return p;
+    }
+    ++p;
+  }
+  return nullptr;
+}
+
+inline const char* FindSeparator(const char* begin, const char* end, const std::string& separator) {
+  return FindSeparator(begin, end, separator.data(), separator.length());
+}
+
+// A view of one record, pointing into the buffer split, normally a memory-mapped file.
+struct SeparatedRecord {
+  const char* data;
+  size_t length;
+  std::string ToString() const { return std::string(data, length); }
+};
+
+// The range of the records in `[data, data + length)`, each followed by the separator, except, possibly,
+// the last one. The empty records in between two separators are included, the empty one past the last
+// separator is not. With an empty separator, the whole buffer, unless empty, is the only record.
+// The buffer, and the range itself, must outlive the iterators.
+class SeparatedRecords {
+ public:
+  SeparatedRecords(const char* data, size_t length, const std::string& separator)
+      : data_(data), length_(length), separator_(separator) {}
+
+  // Any buffer with `data()` and `size()`, such as `bricks::MemoryMappedFile`.
+  template <typename T_BUFFER>
+  SeparatedRecords(const T_BUFFER& buffer, const std::string& separator)
+      : SeparatedRecords(buffer.data(), buffer.size(), separator) {}
+
+  class Iterator : public std::iterator<std::forward_iterator_tag, SeparatedRecord> {
+   public:
+    Iterator(const char* position, const char* end, const std::string& separator)
+        : position_(position), end_(end), separator_(&separator) {
+      Split();
+    }
+    const SeparatedRecord& operator*() const { return record_; }
+    const SeparatedRecord* operator->() const { return &record_; }
+    Iterator& operator++() {
+      position_ = next_;
+      Split();
+      return *this;
+    }
+    bool operator==(const Iterator& rhs) const { return position_ == rhs.position_; }
+    bool operator!=(const Iterator& rhs) const { return !operator==(rhs); }
+
+   private:
+    void Split() {
+      if (position_ == end_) {
+        return;
+      }
+      const char* separator = FindSeparator(position_, end_, *separator_);
+      record_.data = position_;
+      if (separator) {
+        record_.length = static_cast<size_t>(separator - position_);
+        next_ = separator + separator_->length();
+      } else {
+        record_.length = static_cast<size_t>(end_ - position_);
+        next_ = end_;
+      }
+    }
+
+    const char* position_;
+    const char* end_;
+    const std::string* separator_;
+    const char* next_ = nullptr;
+    SeparatedRecord record_ = SeparatedRecord{nullptr, 0};
+  };
+
+  Iterator begin() const { return Iterator(data_, data_ + length_, separator_); }
+  Iterator end() const { return Iterator(data_ + length_, data_ + length_, separator_); }
+
+ private:
+  const char* data_;
+  size_t length_;
+  const std::string separator_;
+};
+
+}  // namespace strings
+}  // namespace bricks
+
+#endif  // BRICKS_STRINGS_RECORDS_H
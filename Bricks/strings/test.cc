@@ -1,18 +1,80 @@
 #include "printf.h"
 #include "fixed_size_serializer.h"
+#include "records.h"
+
+#include "../util/allocation_counter.h"
+
+#include <thread>
+#include <vector>
 
 #include "../3party/gtest/gtest.h"
 #include "../3party/gtest/gtest-main.h"
 
 using bricks::strings::Printf;
+using bricks::strings::AppendPrintf;
 using bricks::strings::FixedSizeSerializer;
 using bricks::strings::PackToString;
 using bricks::strings::UnpackFromString;
+using bricks::strings::FindSeparator;
+using bricks::strings::SeparatedRecord;
+using bricks::strings::SeparatedRecords;
+
+BRICKS_COUNT_ALLOCATIONS();
 
 TEST(StringPrintf, SmokeTest) {
   EXPECT_EQ("Test: 42, 'Hello', 0000ABBA", Printf("Test: %d, '%s', %08X", 42, "Hello", 0xabba));
 }
 
+TEST(StringPrintf, DoesNotTruncate) {
+  const std::string long_string(3 * 1024 * 1024, 'x');
+  const std::string result = Printf("[%s]", long_string.c_str());
+  ASSERT_EQ(long_string.length() + 2, result.length());
+  EXPECT_EQ('[', result.front());
+  EXPECT_EQ(']', result.back());
+  EXPECT_EQ("", Printf("%s", ""));
+}
+
+TEST(StringPrintf, AppendsInPlace) {
+  std::string s = "Test:";
+  AppendPrintf(s, " %d", 42);
+  AppendPrintf(s, ", '%s'", "Hello");
+  EXPECT_EQ("Test: 42, 'Hello'", s);
+
+  // Does not reallocate the string while the output fits into its capacity.
+  s.reserve(1000);
+  const char* data = s.data();
+  for (int i = 0; i < 100; ++i) {
+    AppendPrintf(s, "%d", i % 10);
+  }
+  EXPECT_EQ(data, s.data());
+  EXPECT_EQ(17u + 100u, s.length());
+  EXPECT_EQ("0123456789", s.substr(17, 10));
+
+  // And grows it when it does not.
+  AppendPrintf(s, "%s", std::string(2000, 'y').c_str());
+  EXPECT_EQ(17u + 100u + 2000u, s.length());
+  EXPECT_EQ('y', s.back());
+}
+
+TEST(StringPrintf, ThreadSafe) {
+  std::vector<std::thread> threads;
+  std::vector<bool> ok(8, true);
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([t, &ok]() {
+      const std::string expected = std::string(t + 1, static_cast<char>('a' + t)) + std::to_string(t);
+      for (int i = 0; i < 10000; ++i) {
+        if (Printf("%s%d", std::string(t + 1, static_cast<char>('a' + t)).c_str(), t) != expected) {
+          ok[t] = false;
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(std::vector<bool>(8, true), ok);
+}
+
 TEST(FixedSizeSerializer, UInt16) {
   EXPECT_EQ(5, FixedSizeSerializer<uint16_t>::size_in_bytes);
   // Does not fit signed 16-bit, requires unsigned.
@@ -54,3 +116,111 @@ TEST(FixedSizeSerializer, ImplicitSyntax) {
     EXPECT_EQ("01000000000000000000", PackToString(x));
   }
 }
+
+TEST(FixedSizeSerializer, DoesNotAllocate) {
+  char buffer[FixedSizeSerializer<uint64_t>::size_in_bytes];
+  uint64_t x = 0;
+  EXPECT_NO_ALLOCATIONS(FixedSizeSerializer<uint64_t>::Pack(1234567ull, buffer));
+  EXPECT_NO_ALLOCATIONS(FixedSizeSerializer<uint64_t>::Unpack(buffer, x));
+  EXPECT_EQ(1234567ull, x);
+  const std::string s = "00000000000001234567";
+  EXPECT_NO_ALLOCATIONS(x = FixedSizeSerializer<uint64_t>::UnpackFromString(s));
+  EXPECT_EQ(1234567ull, x);
+  // The string itself is the only allocation, and none for the values within the short string optimization.
+  EXPECT_ALLOCATIONS_AT_MOST(1, FixedSizeSerializer<uint64_t>::PackToString(x));
+  EXPECT_NO_ALLOCATIONS(FixedSizeSerializer<uint16_t>::PackToString(42));
+}
+
+TEST(FixedSizeSerializer, PacksAndUnpacksBuffers) {
+  char buffer[FixedSizeSerializer<uint64_t>::size_in_bytes + 1];
+  buffer[FixedSizeSerializer<uint64_t>::size_in_bytes] = '!';
+  const uint64_t values[] = {0ull, 7ull, 42ull, 100ull, 1234567ull, 1000000000000000000ull,
+                             std::numeric_limits<uint64_t>::max()};
+  for (uint64_t x : values) {
+    FixedSizeSerializer<uint64_t>::Pack(x, buffer);
+    EXPECT_EQ(FixedSizeSerializer<uint64_t>::PackToString(x), std::string(buffer, 20));
+    EXPECT_EQ('!', buffer[20]);
+    uint64_t y = 1;
+    ASSERT_TRUE(FixedSizeSerializer<uint64_t>::Unpack(buffer, y));
+    EXPECT_EQ(x, y);
+  }
+  EXPECT_EQ("18446744073709551615", std::string(buffer, 20));
+  EXPECT_EQ("00000000000001234567", PackToString(static_cast<uint64_t>(1234567)));
+
+  for (uint32_t x = 0; x < 100000; x += 7) {
+    uint16_t y;
+    const std::string s = PackToString(static_cast<uint16_t>(x));
+    ASSERT_EQ(x <= 65535, FixedSizeSerializer<uint16_t>::Unpack(Printf("%05u", x).c_str(), y)) << x;
+    if (x <= 65535) {
+      EXPECT_EQ(x, y);
+      EXPECT_EQ(Printf("%05u", x), s);
+    }
+  }
+
+  // Only the exact output of `Pack()` is accepted.
+  uint32_t x;
+  EXPECT_TRUE(FixedSizeSerializer<uint32_t>::Unpack("4294967295", x));
+  EXPECT_EQ(4294967295u, x);
+  EXPECT_FALSE(FixedSizeSerializer<uint32_t>::Unpack("4294967296", x));
+  EXPECT_FALSE(FixedSizeSerializer<uint32_t>::Unpack("00000/0001", x));
+  EXPECT_FALSE(FixedSizeSerializer<uint32_t>::Unpack("0000000:01", x));
+  EXPECT_FALSE(FixedSizeSerializer<uint32_t>::Unpack(" 000000001", x));
+  EXPECT_EQ(4294967295u, x);
+
+  // As `std::istream` does, parses the leading digits, and saturates.
+  EXPECT_EQ(123u, FixedSizeSerializer<uint32_t>::UnpackFromString(" 123abc"));
+  EXPECT_EQ(0u, FixedSizeSerializer<uint32_t>::UnpackFromString("abc"));
+  EXPECT_EQ(4294967295u, FixedSizeSerializer<uint32_t>::UnpackFromString("99999999999"));
+}
+
+static std::string JoinRecords(const std::string& data, const std::string& separator) {
+  std::string result;
+  for (const SeparatedRecord& record : SeparatedRecords(data, separator)) {
+    result += "[" + record.ToString() + "]";
+  }
+  return result;
+}
+
+TEST(SeparatedRecords, SplitsWithoutCopying) {
+  EXPECT_EQ("[a][bc][][d]", JoinRecords("a\nbc\n\nd\n", "\n"));
+  EXPECT_EQ("[a][unterminated]", JoinRecords("a\nunterminated", "\n"));
+  EXPECT_EQ("[one][two][-|-]", JoinRecords("one-||-two-||--|-", "-||-"));
+  EXPECT_EQ("[no separator]", JoinRecords("no separator", ""));
+  EXPECT_EQ("", JoinRecords("", "\n"));
+
+  const std::string data = "first\r\nsecond\r\n";
+  SeparatedRecords records(data.data(), data.length(), "\r\n");
+  auto it = records.begin();
+  EXPECT_EQ(data.data(), it->data);
+  EXPECT_EQ(5u, it->length);
+  ++it;
+  EXPECT_EQ(data.data() + 7, it->data);
+  ++it;
+  EXPECT_TRUE(it == records.end());
+}
+
+// The separators within, across and past the end of the vectorized blocks, for each length and offset.
+TEST(SeparatedRecords, FindsSeparatorsEverywhere) {
+  for (const std::string separator : {"\n", "\r\n", "|&|", "<<SEPARATOR>>"}) {
+    for (size_t length = 0; length < 100; ++length) {
+      for (size_t offset = 0; offset + separator.length() <= length; ++offset) {
+        std::string data(length, separator[0]);
+        data.replace(offset, separator.length(), separator);
+        // Make the separator the only match: the bytes around it only share its first byte when it is alone.
+        for (size_t i = 0; i < length; ++i) {
+          if (i < offset || i >= offset + separator.length()) {
+            data[i] = 'x';
+          }
+        }
+        const char* found = FindSeparator(data.data(), data.data() + data.length(), separator);
+        ASSERT_EQ(data.data() + offset, found) << separator << " " << length << " " << offset;
+        // Nothing is found in the bytes before the separator ends.
+        EXPECT_EQ(nullptr,
+                  FindSeparator(data.data(), data.data() + offset + separator.length() - 1, separator));
+      }
+    }
+  }
+  // The partial matches, the first and the last byte in place, are not mistaken for the separator.
+  const std::string data = std::string(40, 'x') + "<<SEPARxxxx>>" + std::string(40, 'x') + "<<SEPARATOR>>";
+  EXPECT_EQ(data.data() + 93, FindSeparator(data.data(), data.data() + data.length(), "<<SEPARATOR>>"));
+}
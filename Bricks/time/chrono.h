@@ -3,7 +3,11 @@
 #ifndef BRICKS_TIME_CHRONO_H
 #define BRICKS_TIME_CHRONO_H
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <ctime>
 
 #include "../port.h"
 #include "../strings/fixed_size_serializer.h"
@@ -20,35 +24,57 @@ enum class MILLISECONDS_INTERVAL : uint64_t {};
 #ifndef BRICKS_ANDROID
 
 // Since chrono::system_clock is not monotonic, and chrono::steady_clock is not guaranteed to be Epoch,
-// use a simple wrapper around chrono::system_clock to make it non-decreasing.
+// make the values returned by `Now()` and `CoarseNow()` non-decreasing, across all the threads of the process.
+// Once the clock has not moved since the previous call, this costs one relaxed atomic load.
 struct EpochClockGuaranteeingMonotonicity {
-  struct Impl {
-    mutable uint64_t monotonic_now = 0ull;
-    inline uint64_t Now() const {
-      const uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
-                               std::chrono::system_clock::now().time_since_epoch()).count();
-      monotonic_now = std::max(monotonic_now, now);
-      return monotonic_now;
+  static inline uint64_t Monotonic(uint64_t now) {
+    static std::atomic<uint64_t> monotonic_now(0ull);
+    uint64_t previous = monotonic_now.load(std::memory_order_relaxed);
+    while (previous < now && !monotonic_now.compare_exchange_weak(previous, now, std::memory_order_relaxed)) {
     }
-  };
-  static const Impl& Singleton() {
-    static thread_local Impl singleton;
-    return singleton;
+    return std::max(previous, now);
+  }
+  static inline uint64_t SystemClockNow() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+  // `CLOCK_REALTIME_COARSE` is updated once per kernel tick, a few milliseconds at most, and reading it
+  // does not touch the hardware clock. Elsewhere, the coarse clock is the regular one.
+  static inline uint64_t CoarseClockNow() {
+#if defined(BRICKS_POSIX) && defined(CLOCK_REALTIME_COARSE)
+    struct timespec ts;
+    if (!::clock_gettime(CLOCK_REALTIME_COARSE, &ts)) {
+      return static_cast<uint64_t>(ts.tv_sec) * 1000ull + static_cast<uint64_t>(ts.tv_nsec) / 1000000ull;
+    }
+#endif
+    return SystemClockNow();
   }
 };
 
 inline EPOCH_MILLISECONDS Now() {
-  return static_cast<EPOCH_MILLISECONDS>(EpochClockGuaranteeingMonotonicity::Singleton().Now());
+  return static_cast<EPOCH_MILLISECONDS>(
+      EpochClockGuaranteeingMonotonicity::Monotonic(EpochClockGuaranteeingMonotonicity::SystemClockNow()));
+}
+
+// Cheaper than `Now()`, and behind it by up to the kernel tick. Never goes back compared to `Now()` though,
+// since both share the same monotonicity guarantee.
+inline EPOCH_MILLISECONDS CoarseNow() {
+  return static_cast<EPOCH_MILLISECONDS>(
+      EpochClockGuaranteeingMonotonicity::Monotonic(EpochClockGuaranteeingMonotonicity::CoarseClockNow()));
 }
 
 #else
 
-// Android C++ compiler doesn't support `thread_local`, fall back to the naive implementation.
+// Android toolchains do not always provide lock-free 64-bit atomics, keep the naive implementation there.
 inline EPOCH_MILLISECONDS Now() {
   return static_cast<EPOCH_MILLISECONDS>(std::chrono::duration_cast<std::chrono::milliseconds>(
                                              std::chrono::system_clock::now().time_since_epoch()).count());
 }
 
+inline EPOCH_MILLISECONDS CoarseNow() {
+  return Now();
+}
+
 #endif
 
 }  // namespace time
@@ -57,17 +83,24 @@ namespace strings {
 
 template <>
 struct FixedSizeSerializer<bricks::time::EPOCH_MILLISECONDS> {
-  enum { size_in_bytes = std::numeric_limits<uint64_t>::digits10 + 1 };
+  typedef FixedSizeSerializer<uint64_t> Impl;
+  enum { size_in_bytes = Impl::size_in_bytes };
+  static void Pack(bricks::time::EPOCH_MILLISECONDS x, char* output) {
+    Impl::Pack(static_cast<uint64_t>(x), output);
+  }
+  static bool Unpack(const char* input, bricks::time::EPOCH_MILLISECONDS& x) {
+    uint64_t value;
+    if (!Impl::Unpack(input, value)) {
+      return false;
+    }
+    x = static_cast<bricks::time::EPOCH_MILLISECONDS>(value);
+    return true;
+  }
   static std::string PackToString(bricks::time::EPOCH_MILLISECONDS x) {
-    std::ostringstream os;
-    os << std::setfill('0') << std::setw(size_in_bytes) << static_cast<uint64_t>(x);
-    return os.str();
+    return Impl::PackToString(static_cast<uint64_t>(x));
   }
   static bricks::time::EPOCH_MILLISECONDS UnpackFromString(std::string const& s) {
-    uint64_t x;
-    std::istringstream is(s);
-    is >> x;
-    return static_cast<bricks::time::EPOCH_MILLISECONDS>(x);
+    return static_cast<bricks::time::EPOCH_MILLISECONDS>(Impl::UnpackFromString(s));
   }
 };
 
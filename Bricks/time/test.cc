@@ -0,0 +1,213 @@
+#include "chrono.h"
+#include "timer_wheel.h"
+#include "tsc.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../3party/gtest/gtest.h"
+#include "../3party/gtest/gtest-main.h"
+
+using bricks::time::HighResolutionClock;
+using bricks::time::TimerWheel;
+
+// The wheel is driven by the times passed to `Advance()`, so the tests are the clock.
+TEST(TimerWheel, RunsAtTheTickBoundary) {
+  TimerWheel wheel(0, 10);
+  std::vector<int> ran;
+  wheel.Schedule(25, [&ran]() { ran.push_back(25); });
+  wheel.Schedule(30, [&ran]() { ran.push_back(30); });
+  wheel.Schedule(31, [&ran]() { ran.push_back(31); });
+  EXPECT_EQ(3u, wheel.Size());
+  EXPECT_EQ(0u, wheel.Advance(29));
+  EXPECT_TRUE(ran.empty());
+  EXPECT_EQ(2u, wheel.Advance(30));
+  ASSERT_EQ(2u, ran.size());
+  EXPECT_EQ(55, ran[0] + ran[1]);
+  EXPECT_EQ(0u, wheel.Advance(39));
+  EXPECT_EQ(1u, wheel.Advance(40));
+  ASSERT_EQ(3u, ran.size());
+  EXPECT_EQ(31, ran[2]);
+  EXPECT_EQ(0u, wheel.Size());
+}
+
+TEST(TimerWheel, RunsThePastDeadlinesOnTheNextTick) {
+  TimerWheel wheel(1000);
+  size_t ran = 0;
+  wheel.Schedule(0, [&ran]() { ++ran; });
+  wheel.Schedule(1000, [&ran]() { ++ran; });
+  EXPECT_EQ(0u, wheel.Advance(1000));
+  EXPECT_EQ(2u, wheel.Advance(1001));
+  EXPECT_EQ(2u, ran);
+}
+
+TEST(TimerWheel, CascadesFromTheHigherLevels) {
+  TimerWheel wheel;
+  // Levels 1, 2 and 3, off the slot boundaries of the level, for the cascade to place them exactly.
+  const std::vector<uint64_t> deadlines = {TimerWheel::kSlots + 44,
+                                           TimerWheel::kSlots * TimerWheel::kSlots + 3 * TimerWheel::kSlots + 7,
+                                           (static_cast<uint64_t>(1) << 24) + TimerWheel::kSlots + 5};
+  std::vector<uint64_t> ran;
+  for (uint64_t deadline : deadlines) {
+    wheel.Schedule(deadline, [&ran, deadline]() { ran.push_back(deadline); });
+  }
+  for (size_t i = 0; i < deadlines.size(); ++i) {
+    EXPECT_EQ(0u, wheel.Advance(deadlines[i] - 1)) << deadlines[i];
+    EXPECT_EQ(i, ran.size());
+    EXPECT_EQ(1u, wheel.Advance(deadlines[i])) << deadlines[i];
+    ASSERT_EQ(i + 1, ran.size());
+    EXPECT_EQ(deadlines[i], ran[i]);
+    EXPECT_EQ(deadlines.size() - i - 1, wheel.Size());
+  }
+}
+
+TEST(TimerWheel, CascadesWhenAdvancedPastTheDeadline) {
+  TimerWheel wheel;
+  size_t ran = 0;
+  wheel.Schedule(TimerWheel::kSlots * TimerWheel::kSlots + 1, [&ran]() { ++ran; });
+  wheel.Schedule(TimerWheel::kSlots + 1, [&ran]() { ++ran; });
+  EXPECT_EQ(2u, wheel.Advance(10 * TimerWheel::kSlots * TimerWheel::kSlots));
+  EXPECT_EQ(2u, ran);
+  EXPECT_EQ(0u, wheel.Size());
+}
+
+TEST(TimerWheel, Cancels) {
+  TimerWheel wheel;
+  std::vector<int> ran;
+  const TimerWheel::TimerID a = wheel.Schedule(10, [&ran]() { ran.push_back(1); });
+  const TimerWheel::TimerID b = wheel.Schedule(10, [&ran]() { ran.push_back(2); });
+  const TimerWheel::TimerID c = wheel.Schedule(1000, [&ran]() { ran.push_back(3); });
+  EXPECT_NE(0u, a);
+  EXPECT_TRUE(wheel.Cancel(a));
+  EXPECT_FALSE(wheel.Cancel(a));
+  EXPECT_TRUE(wheel.Cancel(c));
+  EXPECT_EQ(1u, wheel.Size());
+  EXPECT_EQ(1u, wheel.Advance(2000));
+  EXPECT_EQ(std::vector<int>({2}), ran);
+  EXPECT_FALSE(wheel.Cancel(b));
+  EXPECT_EQ(0u, wheel.Size());
+}
+
+TEST(TimerWheel, DoesNotCancelTheTimerReusingTheSlot) {
+  TimerWheel wheel;
+  size_t ran = 0;
+  const TimerWheel::TimerID stale = wheel.Schedule(10, [&ran]() { ++ran; });
+  EXPECT_TRUE(wheel.Cancel(stale));
+  const TimerWheel::TimerID fresh = wheel.Schedule(10, [&ran]() { ++ran; });
+  EXPECT_NE(stale, fresh);
+  EXPECT_FALSE(wheel.Cancel(stale));
+  EXPECT_EQ(1u, wheel.Advance(10));
+  EXPECT_EQ(1u, ran);
+}
+
+TEST(TimerWheel, RunsTheTimersScheduledByTheCallbacks) {
+  TimerWheel wheel;
+  std::vector<uint64_t> ran;
+  std::function<void()> every_100ms;
+  uint64_t next = 100;
+  every_100ms = [&]() {
+    ran.push_back(next);
+    next += 100;
+    if (next <= 500) {
+      wheel.Schedule(next, every_100ms);
+    }
+  };
+  wheel.Schedule(next, every_100ms);
+  for (uint64_t t = 1; t <= 1000; ++t) {
+    wheel.Advance(t);
+  }
+  EXPECT_EQ(std::vector<uint64_t>({100, 200, 300, 400, 500}), ran);
+}
+
+TEST(TimerWheel, MillisecondsUntilNextTimer) {
+  TimerWheel wheel(0, 10);
+  EXPECT_EQ(1000u, wheel.MillisecondsUntilNextTimer(0, 1000));
+  wheel.Schedule(45, []() {});
+  EXPECT_EQ(50u, wheel.MillisecondsUntilNextTimer(0, 1000));
+  EXPECT_EQ(20u, wheel.MillisecondsUntilNextTimer(0, 20));
+  EXPECT_EQ(45u, wheel.MillisecondsUntilNextTimer(5, 1000));
+  TimerWheel far;
+  far.Schedule(100000, []() {});
+  // Waits no further than the wraparound of level 0, to cascade.
+  EXPECT_EQ(static_cast<uint64_t>(TimerWheel::kSlots), far.MillisecondsUntilNextTimer(0, 1000000));
+}
+
+// Whichever fraction of the millisecond `TimerWheelThread::NowMs()` is at, the timers do not run early,
+// including when the thread is woken up by the other timers, here by the one running every millisecond.
+TEST(TimerWheelThread, NeverRunsEarly) {
+  // Declared first, for the thread running it to be joined before it is destroyed.
+  std::function<void()> tick;
+  bricks::time::TimerWheelThread timers;
+  tick = [&timers, &tick]() { timers.ScheduleIn(1, tick); };
+  timers.ScheduleIn(1, tick);
+  for (uint64_t delay_ms = 1; delay_ms <= 50; ++delay_ms) {
+    std::mutex mutex;
+    std::condition_variable condition_variable;
+    bool ran = false;
+    const std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point end;
+    timers.ScheduleIn(delay_ms, [&]() {
+      std::lock_guard<std::mutex> lock(mutex);
+      end = std::chrono::steady_clock::now();
+      ran = true;
+      condition_variable.notify_one();
+    });
+    std::unique_lock<std::mutex> lock(mutex);
+    condition_variable.wait(lock, [&ran]() { return ran; });
+    EXPECT_GE(end - begin, std::chrono::milliseconds(delay_ms)) << delay_ms;
+  }
+}
+
+static void ExpectMonotonic(const HighResolutionClock& clock) {
+  uint64_t previous = clock.Now();
+  for (int i = 0; i < 1000000; ++i) {
+    const uint64_t now = clock.Now();
+    ASSERT_GE(now, previous);
+    previous = now;
+  }
+}
+
+// Within 5% plus the millisecond of the resolution of `bricks::time::Now()`, over a sleep of 200ms.
+static void ExpectCalibratedAgainstNow(const HighResolutionClock& clock) {
+  const bricks::time::EPOCH_MILLISECONDS begin_ms = bricks::time::Now();
+  const uint64_t begin_ns = clock.Now();
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  const uint64_t end_ns = clock.Now();
+  const bricks::time::EPOCH_MILLISECONDS end_ms = bricks::time::Now();
+  const double clock_ms = static_cast<double>(end_ns - begin_ns) * 1e-6;
+  const double now_ms = static_cast<double>(static_cast<uint64_t>(end_ms) - static_cast<uint64_t>(begin_ms));
+  EXPECT_GE(now_ms, 200.0);
+  EXPECT_NEAR(now_ms, clock_ms, now_ms * 0.05 + 2.0);
+}
+
+TEST(HighResolutionClock, CycleCounter) {
+  const HighResolutionClock& clock = HighResolutionClock::Singleton();
+  if (clock.UsesCycleCounter()) {
+    EXPECT_GT(clock.TicksPerSecond(), 0.0);
+    EXPECT_NE(0u, HighResolutionClock::ReadCycleCounter());
+  } else {
+    EXPECT_EQ(0.0, clock.TicksPerSecond());
+  }
+  ExpectMonotonic(clock);
+  ExpectCalibratedAgainstNow(clock);
+}
+
+TEST(HighResolutionClock, SteadyClockFallback) {
+  const HighResolutionClock clock(HighResolutionClock::Source::SteadyClock);
+  EXPECT_FALSE(clock.UsesCycleCounter());
+  EXPECT_EQ(0.0, clock.TicksPerSecond());
+  ExpectMonotonic(clock);
+  ExpectCalibratedAgainstNow(clock);
+}
+
+TEST(HighResolutionClock, NowNanoseconds) {
+  const uint64_t a = bricks::time::HighResolutionNowNanoseconds();
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  const uint64_t b = bricks::time::HighResolutionNowNanoseconds();
+  EXPECT_GE(b - a, 10u * 1000000u);
+}
@@ -0,0 +1,296 @@
+// Hierarchical timer wheel: schedules and cancels timers in O(1), for the timeouts of many connections.
+//
+// The time is in milliseconds of whichever clock the owner drives the wheel with, quantized into ticks
+// of `tick_ms`. The wheel has `kLevels` levels of `kSlots` slots each: level 0 holds the timers due within
+// `kSlots` ticks, one slot per tick, level 1 those due within `kSlots^2` ticks, one slot per `kSlots` ticks,
+// and so on up. `Advance()` moves the wheel forward tick by tick and runs the timers of the slots of level 0
+// it passes. Each time a level wraps around, the next slot of the level above is spread over the level below,
+// thus a timer is moved at most `kLevels - 1` times over its lifetime, regardless of how many there are.
+// The timers are never run early, and are run up to a tick late, plus however late `Advance()` is called.
+//
+// * `TimerWheel` is NOT THREAD SAFE, it is meant to be owned by an event loop, which calls `Advance()` once it
+//   wakes up, and waits for its events for no longer than `MillisecondsUntilNextTimer()`.
+// * `TimerWheelThread` drives a `TimerWheel` from a dedicated thread, on `std::chrono::steady_clock`,
+//   for the timers to be scheduled and cancelled from any thread.
+
+#ifndef BRICKS_TIME_TIMER_WHEEL_H
+#define BRICKS_TIME_TIMER_WHEEL_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace bricks {
+
+namespace time {
+
+class TimerWheel final {
+ public:
+  // Identifies the scheduled timer for `Cancel()`. Never zero, which can thus stand for "no timer".
+  typedef uint64_t TimerID;
+
+  enum { kSlotBits = 8, kSlots = 1 << kSlotBits, kLevels = 4 };
+
+  explicit TimerWheel(uint64_t now_ms = 0, uint64_t tick_ms = 1)
+      : tick_ms_(std::max(tick_ms, static_cast<uint64_t>(1))),
+        now_tick_(now_ms / tick_ms_),
+        slots_(kLevels * kSlots, kNone) {}
+
+  // Schedules `callback` to be run by `Advance()` once the time reaches `deadline_ms`.
+  // A deadline that has passed already is run by the next `Advance()` that moves the wheel by a tick.
+  TimerID Schedule(uint64_t deadline_ms, std::function<void()> callback) {
+    uint32_t index;
+    if (free_ != kNone) {
+      index = free_;
+      free_ = timers_[index].next;
+    } else {
+      index = static_cast<uint32_t>(timers_.size());
+      timers_.emplace_back();
+    }
+    Timer& timer = timers_[index];
+    timer.callback = std::move(callback);
+    // Rounded up, for the timer to not run early.
+    timer.deadline_tick = std::max((deadline_ms + tick_ms_ - 1) / tick_ms_, now_tick_ + 1);
+    timer.scheduled = true;
+    Link(index);
+    ++size_;
+    return (static_cast<uint64_t>(timer.generation) << 32) | index;
+  }
+
+  // Returns false if the timer has run or has been cancelled already.
+  bool Cancel(TimerID id) {
+    const uint32_t index = static_cast<uint32_t>(id);
+    if (index >= timers_.size() || timers_[index].generation != static_cast<uint32_t>(id >> 32) ||
+        !timers_[index].scheduled) {
+      return false;
+    }
+    Unlink(index);
+    Free(index);
+    return true;
+  }
+
+  // Moves the wheel to `now_ms` and runs the timers due by then, passing each callback to `run`,
+  // which takes `std::function<void()>&`. The callbacks may schedule and cancel the timers.
+  // Costs a step per tick passed while there are timers scheduled. Returns the number of timers run.
+  template <typename F>
+  size_t Advance(uint64_t now_ms, F&& run) {
+    const uint64_t target_tick = now_ms / tick_ms_;
+    size_t ran = 0;
+    while (now_tick_ < target_tick) {
+      if (!size_) {
+        now_tick_ = target_tick;
+        break;
+      }
+      ++now_tick_;
+      Cascade();
+      uint32_t& head = slots_[now_tick_ & (kSlots - 1)];
+      while (head != kNone) {
+        const uint32_t index = head;
+        Unlink(index);
+        std::function<void()> callback = std::move(timers_[index].callback);
+        Free(index);
+        run(callback);
+        ++ran;
+      }
+    }
+    return ran;
+  }
+
+  size_t Advance(uint64_t now_ms) {
+    return Advance(now_ms, [](std::function<void()>& callback) { callback(); });
+  }
+
+  // How long `Advance()` can wait, from `now_ms`, before the next timer is due or the wheel is to cascade,
+  // but no longer than `max_ms`.
+  uint64_t MillisecondsUntilNextTimer(uint64_t now_ms, uint64_t max_ms) const {
+    if (!size_) {
+      return max_ms;
+    }
+    uint64_t next_tick = (now_tick_ | (kSlots - 1)) + 1;
+    for (uint64_t tick = now_tick_ + 1; tick < next_tick; ++tick) {
+      if (slots_[tick & (kSlots - 1)] != kNone) {
+        next_tick = tick;
+        break;
+      }
+    }
+    const uint64_t next_ms = next_tick * tick_ms_;
+    return next_ms > now_ms ? std::min(next_ms - now_ms, max_ms) : 0;
+  }
+
+  // The number of timers scheduled.
+  size_t Size() const { return size_; }
+
+ private:
+  enum : uint32_t { kNone = 0xffffffffu };
+
+  struct Timer {
+    std::function<void()> callback;
+    uint64_t deadline_tick = 0;
+    // The doubly linked list of the timers of the slot while scheduled, the singly linked free list otherwise.
+    uint32_t prev = kNone;
+    uint32_t next = kNone;
+    uint32_t slot = 0;
+    uint32_t generation = 1;
+    bool scheduled = false;
+  };
+
+  void Link(uint32_t index) {
+    Timer& timer = timers_[index];
+    const uint64_t max_delta = (static_cast<uint64_t>(1) << (kSlotBits * kLevels)) - 1;
+    // The timers beyond the reach of the top level wait in its farthest slot, and are placed again from there.
+    const uint64_t tick = now_tick_ + std::min(timer.deadline_tick - std::min(timer.deadline_tick, now_tick_),
+                                               max_delta);
+    const uint64_t delta = tick - now_tick_;
+    size_t level = 0;
+    while (level + 1 < kLevels && delta >= (static_cast<uint64_t>(1) << (kSlotBits * (level + 1)))) {
+      ++level;
+    }
+    timer.slot = static_cast<uint32_t>(level * kSlots + ((tick >> (kSlotBits * level)) & (kSlots - 1)));
+    timer.prev = kNone;
+    timer.next = slots_[timer.slot];
+    if (timer.next != kNone) {
+      timers_[timer.next].prev = index;
+    }
+    slots_[timer.slot] = index;
+  }
+
+  void Unlink(uint32_t index) {
+    Timer& timer = timers_[index];
+    if (timer.prev != kNone) {
+      timers_[timer.prev].next = timer.next;
+    } else {
+      slots_[timer.slot] = timer.next;
+    }
+    if (timer.next != kNone) {
+      timers_[timer.next].prev = timer.prev;
+    }
+  }
+
+  void Free(uint32_t index) {
+    Timer& timer = timers_[index];
+    timer.callback = nullptr;
+    timer.scheduled = false;
+    if (!++timer.generation) {
+      timer.generation = 1;
+    }
+    timer.next = free_;
+    free_ = index;
+    --size_;
+  }
+
+  // Once the lower levels have wrapped around, spreads the current slots of the levels above over them,
+  // the top one first, for its timers to reach level 0 within the same tick if they are due.
+  void Cascade() {
+    size_t levels = 1;
+    while (levels < kLevels && !(now_tick_ & ((static_cast<uint64_t>(1) << (kSlotBits * levels)) - 1))) {
+      ++levels;
+    }
+    for (size_t level = levels; --level > 0;) {
+      uint32_t& head = slots_[level * kSlots + ((now_tick_ >> (kSlotBits * level)) & (kSlots - 1))];
+      uint32_t index = head;
+      head = kNone;
+      while (index != kNone) {
+        const uint32_t next = timers_[index].next;
+        Link(index);
+        index = next;
+      }
+    }
+  }
+
+  const uint64_t tick_ms_;
+  uint64_t now_tick_;
+  std::vector<uint32_t> slots_;
+  std::vector<Timer> timers_;
+  uint32_t free_ = kNone;
+  size_t size_ = 0;
+
+  TimerWheel(const TimerWheel&) = delete;
+  void operator=(const TimerWheel&) = delete;
+};
+
+class TimerWheelThread final {
+ public:
+  typedef TimerWheel::TimerID TimerID;
+
+  // The longest the thread sleeps for, to not depend on the notifications alone.
+  enum { kMaxWaitMs = 1000 };
+
+  explicit TimerWheelThread(uint64_t tick_ms = 1)
+      : wheel_(NowMs(), tick_ms), thread_(&TimerWheelThread::Run, this) {}
+
+  // The timers that have not run yet are dropped.
+  ~TimerWheelThread() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    condition_variable_.notify_one();
+    thread_.join();
+  }
+
+  // Runs `callback` on the thread of the wheel in `delay_ms`, never earlier. THREAD SAFE.
+  // `NowMs()` is truncated to the millisecond, thus the deadline is one millisecond later, for the up to
+  // a millisecond into the current one that has passed already.
+  TimerID ScheduleIn(uint64_t delay_ms, std::function<void()> callback) {
+    TimerID id;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      id = wheel_.Schedule(NowMs() + delay_ms + 1, std::move(callback));
+    }
+    condition_variable_.notify_one();
+    return id;
+  }
+
+  // Returns false if the timer has run, is about to run, or has been cancelled already. THREAD SAFE.
+  bool Cancel(TimerID id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return wheel_.Cancel(id);
+  }
+
+  static uint64_t NowMs() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch()).count());
+  }
+
+ private:
+  // Runs the callbacks with the mutex released, for them to be able to schedule more timers.
+  void Run() {
+    std::vector<std::function<void()>> due;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+      wheel_.Advance(NowMs(), [&due](std::function<void()>& callback) { due.push_back(std::move(callback)); });
+      if (!due.empty()) {
+        lock.unlock();
+        for (std::function<void()>& callback : due) {
+          callback();
+        }
+        due.clear();
+        lock.lock();
+      } else {
+        const uint64_t wait_ms = wheel_.MillisecondsUntilNextTimer(NowMs(), kMaxWaitMs);
+        condition_variable_.wait_for(lock, std::chrono::milliseconds(wait_ms));
+      }
+    }
+  }
+
+  TimerWheel wheel_;
+  std::mutex mutex_;
+  std::condition_variable condition_variable_;
+  bool stopping_ = false;
+  std::thread thread_;
+
+  TimerWheelThread(const TimerWheelThread&) = delete;
+  void operator=(const TimerWheelThread&) = delete;
+};
+
+}  // namespace time
+
+}  // namespace bricks
+
+#endif  // BRICKS_TIME_TIMER_WHEEL_H
@@ -0,0 +1,100 @@
+// Counts the heap allocations, for the tests to hold the hot paths to their allocation budgets,
+// and for the benchmarks to report the allocations per operation.
+//
+// `BRICKS_COUNT_ALLOCATIONS()`, at namespace scope in exactly one translation unit of the binary, replaces
+// the global `operator new` and `operator delete` with the ones that count the allocations, both process-wide
+// and per thread. Without it nothing is counted, and `AllocationCountingInstalled()` returns false.
+//
+// ScopedAllocationCounter counter;
+// queue.PushMessage(message);
+// EXPECT_EQ(0u, counter.Allocations());
+//
+// In the tests, `EXPECT_ALLOCATIONS_AT_MOST(budget, statement)` runs the statement and expects it to allocate
+// no more than `budget` times on the calling thread, and `EXPECT_NO_ALLOCATIONS(statement)` not at all.
+// Both fail if `BRICKS_COUNT_ALLOCATIONS()` is missing, for the budgets to not pass by not being checked.
+
+#ifndef BRICKS_UTIL_ALLOCATION_COUNTER_H
+#define BRICKS_UTIL_ALLOCATION_COUNTER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace bricks {
+
+struct AllocationCounters {
+  // Constant-initialized, thus safe to increment from the allocations made before `main()`.
+  static std::atomic<uint64_t>& Process() {
+    static std::atomic<uint64_t> counter(0);
+    return counter;
+  }
+  static uint64_t& Thread() {
+    static thread_local uint64_t counter = 0;
+    return counter;
+  }
+  static bool& Installed() {
+    static bool installed = false;
+    return installed;
+  }
+  static void OnAllocation() {
+    Process().fetch_add(1, std::memory_order_relaxed);
+    ++Thread();
+  }
+};
+
+inline bool AllocationCountingInstalled() {
+  return AllocationCounters::Installed();
+}
+
+struct AllocationCountingInstaller {
+  AllocationCountingInstaller() { AllocationCounters::Installed() = true; }
+};
+
+// Counts the allocations since its construction, of the calling thread only by default. The process-wide
+// count includes the allocations of the background threads, such as the processing thread of FSQ.
+class ScopedAllocationCounter final {
+ public:
+  enum class Scope { Thread, Process };
+
+  explicit ScopedAllocationCounter(Scope scope = Scope::Thread) : scope_(scope), begin_(Current()) {}
+
+  uint64_t Allocations() const { return Current() - begin_; }
+
+  void Reset() { begin_ = Current(); }
+
+ private:
+  uint64_t Current() const {
+    return scope_ == Scope::Thread ? AllocationCounters::Thread()
+                                   : AllocationCounters::Process().load(std::memory_order_relaxed);
+  }
+
+  const Scope scope_;
+  uint64_t begin_;
+};
+
+}  // namespace bricks
+
+// Not inlined, for the compiler to not pair `malloc()` and `free()` with the new and delete expressions.
+#define BRICKS_COUNT_ALLOCATIONS()                                                   \
+  static ::bricks::AllocationCountingInstaller bricks_allocation_counting_installer; \
+  __attribute__((noinline)) void* operator new(size_t size) {                        \
+    ::bricks::AllocationCounters::OnAllocation();                                    \
+    if (void* p = std::malloc(size ? size : 1)) {                                    \
+      return p;                                                                      \
+    }                                                                                \
+    throw std::bad_alloc();                                                          \
+  }                                                                                  \
+  __attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+
+#define EXPECT_ALLOCATIONS_AT_MOST(budget, statement)                                                   \
+  do {                                                                                                  \
+    EXPECT_TRUE(::bricks::AllocationCountingInstalled()) << "`BRICKS_COUNT_ALLOCATIONS()` is missing."; \
+    ::bricks::ScopedAllocationCounter bricks_allocation_counter;                                        \
+    statement;                                                                                          \
+    EXPECT_LE(bricks_allocation_counter.Allocations(), static_cast<uint64_t>(budget)) << #statement;    \
+  } while (false)
+
+#define EXPECT_NO_ALLOCATIONS(statement) EXPECT_ALLOCATIONS_AT_MOST(0, statement)
+
+#endif  // BRICKS_UTIL_ALLOCATION_COUNTER_H
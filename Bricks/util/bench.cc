@@ -0,0 +1,356 @@
+// The benchmarks of the concurrent containers, run with `make bench`.
+//
+// `ConcurrentHashMap` against `std::unordered_map` guarded by one `std::mutex`: each looks up a batch of keys,
+// by itself, and then with three more threads running the lookups, one in ten of them replaced by an update,
+// on the same map all along, as the threads of a server would.
+//
+// The lock-free queues against `std::deque` guarded by one `std::mutex`: each passes a batch of objects
+// through the queue, one by one, and in batches of `kQueueBatch`, in one thread, for the cost of the operations
+// themselves, and then from a producer thread, for the cost of moving the objects across the cores.
+//
+// The checksums and the hashes of `hash.h` over `kHashInputSize` bytes each: `CRC32C()` as dispatched
+// on this CPU, its slicing-by-8 fallback, and `XXHash64()`, for the throughput of each.
+
+#include "concurrent_hash_map.h"
+#include "hash.h"
+#include "lockfree_queue.h"
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../benchmark/benchmark.h"
+
+using bricks::benchmark::DoNotOptimize;
+
+namespace {
+
+const int kKeys = 10000;
+const int kBatch = 1000;
+const int kOtherThreads = 3;
+const size_t kQueueBatch = 32;
+
+struct MutexMap {
+  std::mutex mutex;
+  std::unordered_map<int, int> map;
+
+  bool Get(int key, int& value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto it = map.find(key);
+    if (it == map.end()) {
+      return false;
+    }
+    value = it->second;
+    return true;
+  }
+  void Set(int key, int value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    map[key] = value;
+  }
+};
+
+template <typename T_MAP>
+T_MAP& Populated() {
+  static T_MAP* map = []() {
+    T_MAP* map = new T_MAP();
+    for (int i = 0; i < kKeys; ++i) {
+      map->Set(i, i);
+    }
+    return map;
+  }();
+  return *map;
+}
+
+// The keys of the batches, pseudo-random, the same ones on each run.
+inline int Key(uint32_t& seed) {
+  seed = seed * 1664525u + 1013904223u;
+  return static_cast<int>((seed >> 8) % kKeys);
+}
+
+template <typename T_MAP>
+int LookUpBatch(T_MAP& map, uint32_t& seed) {
+  int total = 0;
+  for (int i = 0; i < kBatch; ++i) {
+    int value = 0;
+    map.Get(Key(seed), value);
+    total += value;
+  }
+  return total;
+}
+
+// The other threads, looking up and updating the keys of the map until destructed.
+template <typename T_MAP>
+class OtherThreads final {
+ public:
+  explicit OtherThreads(T_MAP& map) {
+    for (int t = 0; t < kOtherThreads; ++t) {
+      threads_.emplace_back([this, &map, t]() {
+        uint32_t seed = static_cast<uint32_t>(t) + 1;
+        while (!stop_) {
+          for (int i = 0; i < kBatch; ++i) {
+            const int key = Key(seed);
+            if (i % 10) {
+              int value = 0;
+              map.Get(key, value);
+              DoNotOptimize(value);
+            } else {
+              map.Set(key, key);
+            }
+          }
+        }
+      });
+    }
+  }
+  ~OtherThreads() {
+    stop_ = true;
+    for (std::thread& thread : threads_) {
+      thread.join();
+    }
+  }
+
+ private:
+  std::atomic_bool stop_{false};
+  std::vector<std::thread> threads_;
+};
+
+struct MutexDeque {
+  std::mutex mutex;
+  std::deque<int> deque;
+
+  bool TryPush(int value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    deque.push_back(value);
+    return true;
+  }
+  bool TryPop(int& value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (deque.empty()) {
+      return false;
+    }
+    value = deque.front();
+    deque.pop_front();
+    return true;
+  }
+};
+
+template <typename T_QUEUE>
+int PushPopBatch(T_QUEUE& queue) {
+  int total = 0;
+  for (int i = 0; i < kBatch; ++i) {
+    queue.TryPush(i);
+    int value = 0;
+    queue.TryPop(value);
+    total += value;
+  }
+  return total;
+}
+
+template <typename T_QUEUE>
+int PushPopInBatches(T_QUEUE& queue) {
+  int input[kQueueBatch];
+  int output[kQueueBatch];
+  int total = 0;
+  for (int i = 0; i < kBatch; i += static_cast<int>(kQueueBatch)) {
+    for (size_t j = 0; j < kQueueBatch; ++j) {
+      input[j] = i + static_cast<int>(j);
+    }
+    queue.TryPushBatch(input, input + kQueueBatch);
+    total += static_cast<int>(queue.TryPopBatch(output, kQueueBatch));
+  }
+  return total;
+}
+
+// The producer thread, pushing into the queue until destructed.
+template <typename T_QUEUE>
+class ProducerThread final {
+ public:
+  explicit ProducerThread(T_QUEUE& queue)
+      : thread_([this, &queue]() {
+          int i = 0;
+          while (!stop_) {
+            if (queue.TryPush(i)) {
+              ++i;
+            } else {
+              std::this_thread::yield();
+            }
+          }
+        }) {}
+  ~ProducerThread() {
+    stop_ = true;
+    thread_.join();
+  }
+
+ private:
+  std::atomic_bool stop_{false};
+  std::thread thread_;
+};
+
+template <typename T_QUEUE>
+int PopBatch(T_QUEUE& queue) {
+  int total = 0;
+  for (int i = 0; i < kBatch;) {
+    int value = 0;
+    if (queue.TryPop(value)) {
+      total += value;
+      ++i;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  return total;
+}
+
+}  // namespace
+
+BRICKS_BENCHMARK(MutexUnorderedMapGet1000) {
+  MutexMap& map = Populated<MutexMap>();
+  uint32_t seed = 0;
+  while (state.KeepRunning()) {
+    DoNotOptimize(LookUpBatch(map, seed));
+  }
+}
+
+BRICKS_BENCHMARK(ConcurrentHashMapGet1000) {
+  bricks::ConcurrentHashMap<int, int>& map = Populated<bricks::ConcurrentHashMap<int, int>>();
+  uint32_t seed = 0;
+  while (state.KeepRunning()) {
+    DoNotOptimize(LookUpBatch(map, seed));
+  }
+}
+
+BRICKS_BENCHMARK(MutexUnorderedMapGet1000With3Threads) {
+  MutexMap& map = Populated<MutexMap>();
+  OtherThreads<MutexMap> other_threads(map);
+  uint32_t seed = 0;
+  while (state.KeepRunning()) {
+    DoNotOptimize(LookUpBatch(map, seed));
+  }
+}
+
+BRICKS_BENCHMARK(ConcurrentHashMapGet1000With3Threads) {
+  bricks::ConcurrentHashMap<int, int>& map = Populated<bricks::ConcurrentHashMap<int, int>>();
+  OtherThreads<bricks::ConcurrentHashMap<int, int>> other_threads(map);
+  uint32_t seed = 0;
+  while (state.KeepRunning()) {
+    DoNotOptimize(LookUpBatch(map, seed));
+  }
+}
+
+BRICKS_BENCHMARK(MutexDequePushPop1000) {
+  MutexDeque queue;
+  while (state.KeepRunning()) {
+    DoNotOptimize(PushPopBatch(queue));
+  }
+}
+
+BRICKS_BENCHMARK(SPSCQueuePushPop1000) {
+  bricks::SPSCQueue<int> queue(1024);
+  while (state.KeepRunning()) {
+    DoNotOptimize(PushPopBatch(queue));
+  }
+}
+
+BRICKS_BENCHMARK(SPSCQueuePushPop1000InBatches) {
+  bricks::SPSCQueue<int> queue(1024);
+  while (state.KeepRunning()) {
+    DoNotOptimize(PushPopInBatches(queue));
+  }
+}
+
+BRICKS_BENCHMARK(MPSCQueuePushPop1000) {
+  bricks::MPSCQueue<int> queue(1024);
+  while (state.KeepRunning()) {
+    DoNotOptimize(PushPopBatch(queue));
+  }
+}
+
+BRICKS_BENCHMARK(MPSCQueuePushPop1000InBatches) {
+  bricks::MPSCQueue<int> queue(1024);
+  while (state.KeepRunning()) {
+    DoNotOptimize(PushPopInBatches(queue));
+  }
+}
+
+BRICKS_BENCHMARK(IntrusiveMPSCQueuePushPop1000) {
+  struct Node : bricks::IntrusiveMPSCQueueNode {};
+  bricks::IntrusiveMPSCQueue<Node> queue;
+  Node nodes[16];
+  while (state.KeepRunning()) {
+    size_t total = 0;
+    for (int i = 0; i < kBatch; ++i) {
+      queue.Push(&nodes[i % 16]);
+      total += (queue.TryPop() != nullptr);
+    }
+    DoNotOptimize(total);
+  }
+}
+
+BRICKS_BENCHMARK(MutexDequePop1000FromProducerThread) {
+  MutexDeque queue;
+  ProducerThread<MutexDeque> producer(queue);
+  while (state.KeepRunning()) {
+    DoNotOptimize(PopBatch(queue));
+  }
+}
+
+BRICKS_BENCHMARK(SPSCQueuePop1000FromProducerThread) {
+  bricks::SPSCQueue<int> queue(1024);
+  ProducerThread<bricks::SPSCQueue<int>> producer(queue);
+  while (state.KeepRunning()) {
+    DoNotOptimize(PopBatch(queue));
+  }
+}
+
+BRICKS_BENCHMARK(MPSCQueuePop1000FromProducerThread) {
+  bricks::MPSCQueue<int> queue(1024);
+  ProducerThread<bricks::MPSCQueue<int>> producer(queue);
+  while (state.KeepRunning()) {
+    DoNotOptimize(PopBatch(queue));
+  }
+}
+
+namespace {
+
+const size_t kHashInputSize = 64 * 1024;
+
+const std::string& HashInput() {
+  static const std::string input = []() {
+    std::string input(kHashInputSize, ' ');
+    for (size_t i = 0; i < kHashInputSize; ++i) {
+      input[i] = static_cast<char>(i * 131 + (i >> 8));
+    }
+    return input;
+  }();
+  return input;
+}
+
+}  // namespace
+
+BRICKS_BENCHMARK(CRC32C64KB) {
+  const std::string& input = HashInput();
+  while (state.KeepRunning()) {
+    DoNotOptimize(bricks::CRC32C(input.data(), input.length()));
+  }
+}
+
+BRICKS_BENCHMARK(CRC32CSlicingBy864KB) {
+  const uint8_t* input = reinterpret_cast<const uint8_t*>(HashInput().data());
+  while (state.KeepRunning()) {
+    DoNotOptimize(~bricks::impl::CRC32CSlicingBy8(input, kHashInputSize, ~0u));
+  }
+}
+
+BRICKS_BENCHMARK(XXHash6464KB) {
+  const std::string& input = HashInput();
+  while (state.KeepRunning()) {
+    DoNotOptimize(bricks::XXHash64(input.data(), input.length()));
+  }
+}
+
+BRICKS_BENCHMARK_MAIN();
@@ -0,0 +1,245 @@
+// `ConcurrentHashMap` is the hash map for the lookup tables shared by the threads of the process,
+// such as the connections by host, the cached responses, and the state kept by destination.
+//
+// The keys are spread over `shards` independent `std::unordered_map`-s by their hashes, each guarded by
+// a mutex of its own, on a cache line of its own: the threads only contend when their keys are in the same
+// shard, and for no longer than one lookup. The lookups copy the value out, or call a function on it
+// under the lock, with no allocations; only inserting a key allocates.
+//
+// With `max_entries`, the map holds that many entries at most: each shard holds its share,
+// and inserting into a full shard evicts its least recently used entry, which `Get()`, `With()` and `Set()`
+// count as a use. The lookups of an unbounded map leave the order of the entries alone.
+//
+//   bricks::ConcurrentHashMap<std::string, Address> dns(10000);
+//   dns.Set("example.com", address);
+//   Address cached;
+//   if (dns.Get("example.com", cached)) { ... }
+//
+// The functions given to `With()` and `GetOrInsert()` run with the lock of the shard held: they should be
+// quick, and should not use the map. THREAD SAFE.
+
+#ifndef BRICKS_UTIL_CONCURRENT_HASH_MAP_H
+#define BRICKS_UTIL_CONCURRENT_HASH_MAP_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+namespace bricks {
+
+const size_t kConcurrentHashMapDefaultShards = 64;
+
+template <typename K, typename V, typename HASH = std::hash<K>>
+class ConcurrentHashMap final {
+ public:
+  // Zero `max_entries` for no bound. The number of shards is rounded up to a power of two,
+  // and halved while there would be more of them than `max_entries`.
+  explicit ConcurrentHashMap(size_t max_entries = 0, size_t shards = kConcurrentHashMapDefaultShards)
+      : shards_count_(ShardsCount(max_entries, shards)),
+        shards_(new Shard[shards_count_]) {
+    if (max_entries) {
+      // The shares of the shards add up to `max_entries`, rounded down to a multiple of the shards.
+      const size_t share = max_entries / shards_count_;
+      for (size_t i = 0; i < shards_count_; ++i) {
+        shards_[i].max_entries = share;
+      }
+    }
+  }
+
+  // Copies the value of `key` into `output`, and returns true, or returns false if there is none.
+  bool Get(const K& key, V& output) {
+    return With(key, [&output](V& value) { output = value; });
+  }
+
+  // Calls `f(V&)` for the value of `key`, and returns true, or returns false if there is none.
+  template <typename F>
+  bool With(const K& key, F&& f) {
+    Shard& shard = ShardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+      return false;
+    }
+    shard.Touch(it->second);
+    f(it->second.value);
+    return true;
+  }
+
+  bool Contains(const K& key) {
+    Shard& shard = ShardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.index.count(key) != 0;
+  }
+
+  // Sets the value of `key`, inserting it or replacing the one there was.
+  void Set(const K& key, V value) {
+    Shard& shard = ShardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+      shard.Touch(it->second);
+      it->second.value = std::move(value);
+    } else {
+      shard.Insert(key, std::move(value));
+    }
+  }
+
+  // Inserts the value of `key` unless there is one already. Returns whether it has.
+  bool Insert(const K& key, V value) {
+    Shard& shard = ShardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.index.count(key)) {
+      return false;
+    }
+    shard.Insert(key, std::move(value));
+    return true;
+  }
+
+  // Returns a copy of the value of `key`, inserting `make()` first if there is none, all in one lookup.
+  template <typename F>
+  V GetOrInsert(const K& key, F&& make) {
+    Shard& shard = ShardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+      shard.Touch(it->second);
+      return it->second.value;
+    }
+    return shard.Insert(key, make());
+  }
+
+  // Removes the value of `key`. Returns whether there was one.
+  bool Erase(const K& key) {
+    Shard& shard = ShardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+      return false;
+    }
+    shard.Unlink(it->second);
+    shard.index.erase(it);
+    return true;
+  }
+
+  void Clear() {
+    for (size_t i = 0; i < shards_count_; ++i) {
+      std::lock_guard<std::mutex> lock(shards_[i].mutex);
+      shards_[i].index.clear();
+      shards_[i].newest = shards_[i].oldest = nullptr;
+    }
+  }
+
+  // The number of entries, locking the shards in turn: the map may have changed by the time it returns.
+  size_t Size() const {
+    size_t size = 0;
+    for (size_t i = 0; i < shards_count_; ++i) {
+      std::lock_guard<std::mutex> lock(shards_[i].mutex);
+      size += shards_[i].index.size();
+    }
+    return size;
+  }
+
+  // The number of entries evicted to keep the map within `max_entries`.
+  uint64_t Evictions() const {
+    uint64_t evictions = 0;
+    for (size_t i = 0; i < shards_count_; ++i) {
+      evictions += shards_[i].evictions.load(std::memory_order_relaxed);
+    }
+    return evictions;
+  }
+
+  size_t Shards() const { return shards_count_; }
+
+ private:
+  // The value, and, when the map is bounded, the links of the list of the entries by their last use,
+  // in the nodes of the hash map, which stay where they are until erased.
+  struct Entry {
+    explicit Entry(V value) : value(std::move(value)) {}
+    V value;
+    const K* key = nullptr;
+    Entry* newer = nullptr;
+    Entry* older = nullptr;
+  };
+
+  // The entries of the keys of one shard, and the list of them, the most recently used first.
+  // Padded for the mutexes of the shards next to each other to not share a cache line.
+  struct Shard {
+    mutable std::mutex mutex;
+    std::unordered_map<K, Entry, HASH> index;
+    Entry* newest = nullptr;
+    Entry* oldest = nullptr;
+    size_t max_entries = 0;
+    std::atomic<uint64_t> evictions{0};
+    char padding[64];
+
+    void Touch(Entry& entry) {
+      if (max_entries && newest != &entry) {
+        Unlink(entry);
+        Link(entry);
+      }
+    }
+
+    void Link(Entry& entry) {
+      entry.newer = nullptr;
+      entry.older = newest;
+      (newest ? newest->newer : oldest) = &entry;
+      newest = &entry;
+    }
+
+    void Unlink(Entry& entry) {
+      if (max_entries) {
+        (entry.newer ? entry.newer->older : newest) = entry.older;
+        (entry.older ? entry.older->newer : oldest) = entry.newer;
+      }
+    }
+
+    V& Insert(const K& key, V value) {
+      if (max_entries && index.size() >= max_entries) {
+        const auto it = index.find(*oldest->key);
+        Unlink(it->second);
+        index.erase(it);
+        evictions.fetch_add(1, std::memory_order_relaxed);
+      }
+      const auto it = index.emplace(key, Entry(std::move(value))).first;
+      if (max_entries) {
+        it->second.key = &it->first;
+        Link(it->second);
+      }
+      return it->second.value;
+    }
+  };
+
+  static size_t ShardsCount(size_t max_entries, size_t shards) {
+    size_t result = 1;
+    while (result < shards) {
+      result <<= 1;
+    }
+    while (max_entries && result > max_entries) {
+      result >>= 1;
+    }
+    return result;
+  }
+
+  // The high bits of the mixed hash, for the shard to not correlate with the bucket within it,
+  // which `std::unordered_map` takes from the low bits of the very same hash.
+  Shard& ShardOf(const K& key) {
+    const uint64_t hash = static_cast<uint64_t>(hasher_(key)) * 0x9E3779B97F4A7C15ull;
+    return shards_[static_cast<size_t>(hash >> 32) & (shards_count_ - 1)];
+  }
+
+  const size_t shards_count_;
+  std::unique_ptr<Shard[]> shards_;
+  HASH hasher_;
+
+  ConcurrentHashMap(const ConcurrentHashMap&) = delete;
+  void operator=(const ConcurrentHashMap&) = delete;
+};
+
+}  // namespace bricks
+
+#endif  // BRICKS_UTIL_CONCURRENT_HASH_MAP_H
@@ -0,0 +1,138 @@
+#ifndef BRICKS_UTIL_CRC32C_H
+#define BRICKS_UTIL_CRC32C_H
+
+// CRC32C, the Castagnoli polynomial CRC used by iSCSI, ext4 and most storage formats.
+// Uses the SSE4.2 `crc32` instruction on x86-64, either when compiled for it, `-msse4.2`, or once the CPU
+// is found to have it at runtime, the ARMv8 CRC instructions when compiled for them, `-march=armv8-a+crc`,
+// and slicing-by-8, with eight lookup tables, otherwise.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#define BRICKS_CRC32C_SSE42
+#elif defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define BRICKS_CRC32C_SSE42
+#define BRICKS_CRC32C_SSE42_AT_RUNTIME
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define BRICKS_CRC32C_ARMV8
+#endif
+
+namespace bricks {
+
+namespace impl {
+
+struct CRC32CTable {
+  uint32_t table[8][256];
+  CRC32CTable() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int j = 0; j < 8; ++j) {
+        crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78u : 0u);
+      }
+      table[0][i] = crc;
+    }
+    // The entry of the table `k` is the CRC of the byte followed by `k` zero bytes.
+    for (int k = 1; k < 8; ++k) {
+      for (uint32_t i = 0; i < 256; ++i) {
+        table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+      }
+    }
+  }
+  static const CRC32CTable& Singleton() {
+    static const CRC32CTable singleton;
+    return singleton;
+  }
+};
+
+// Slicing-by-8: eight bytes per step, with a lookup in each of the tables, rather than one byte per lookup.
+// Takes and returns the inverted CRC.
+inline uint32_t CRC32CSlicingBy8(const uint8_t* p, size_t length, uint32_t crc) {
+  const CRC32CTable& tables = CRC32CTable::Singleton();
+  const uint32_t(&t)[8][256] = tables.table;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for (; length >= 8; length -= 8, p += 8) {
+    uint32_t low;
+    uint32_t high;
+    std::memcpy(&low, p, 4);
+    std::memcpy(&high, p + 4, 4);
+    low ^= crc;
+    crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+          t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+  }
+#endif
+  for (; length; --length, ++p) {
+    crc = t[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(BRICKS_CRC32C_SSE42)
+#if defined(BRICKS_CRC32C_SSE42_AT_RUNTIME)
+__attribute__((target("sse4.2")))
+#endif
+inline uint32_t CRC32CSSE42(const uint8_t* p, size_t length, uint32_t crc) {
+#if defined(__x86_64__)
+  uint64_t crc64 = crc;
+  for (; length >= 8; length -= 8, p += 8) {
+    uint64_t word;
+    std::memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = static_cast<uint32_t>(crc64);
+#endif
+  for (; length; --length, ++p) {
+    crc = _mm_crc32_u8(crc, *p);
+  }
+  return crc;
+}
+#endif
+
+#if defined(BRICKS_CRC32C_ARMV8)
+inline uint32_t CRC32CARMv8(const uint8_t* p, size_t length, uint32_t crc) {
+  for (; length >= 8; length -= 8, p += 8) {
+    uint64_t word;
+    std::memcpy(&word, p, 8);
+    crc = __crc32cd(crc, word);
+  }
+  for (; length; --length, ++p) {
+    crc = __crc32cb(crc, *p);
+  }
+  return crc;
+}
+#endif
+
+// Whether `CRC32C()` uses the CRC instructions of the CPU, rather than the lookup tables.
+inline bool CRC32CIsHardwareAccelerated() {
+#if defined(BRICKS_CRC32C_SSE42_AT_RUNTIME)
+  static const bool supported = __builtin_cpu_supports("sse4.2");
+  return supported;
+#elif defined(BRICKS_CRC32C_SSE42) || defined(BRICKS_CRC32C_ARMV8)
+  return true;
+#else
+  return false;
+#endif
+}
+
+}  // namespace impl
+
+// Pass the previous result as `crc` to checksum the data in chunks.
+inline uint32_t CRC32C(const void* data, size_t length, uint32_t crc = 0) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+#if defined(BRICKS_CRC32C_SSE42)
+  if (impl::CRC32CIsHardwareAccelerated()) {
+    return ~impl::CRC32CSSE42(p, length, ~crc);
+  }
+#elif defined(BRICKS_CRC32C_ARMV8)
+  return ~impl::CRC32CARMv8(p, length, ~crc);
+#endif
+  return ~impl::CRC32CSlicingBy8(p, length, ~crc);
+}
+
+}  // namespace bricks
+
+#endif  // BRICKS_UTIL_CRC32C_H
@@ -0,0 +1,179 @@
+// The checksums and the hashes of the bytes: `CRC32C()`, see `crc32c.h`, for the data to be stored and sent
+// with, and `XXHash64()`, the 64-bit xxHash, for the hash tables, sharding and deduplication, where the speed
+// is all that matters, and the CRC instructions may not be there.
+//
+// Both are streaming: `CRC32C()` takes the previous result to go on from, and `XXHash64Stream` is updated
+// with the chunks, and yields the hash of all of them, the same as `XXHash64()` of the whole data.
+
+#ifndef BRICKS_UTIL_HASH_H
+#define BRICKS_UTIL_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "crc32c.h"
+
+namespace bricks {
+
+namespace impl {
+
+const uint64_t kXXHash64Prime1 = 11400714785074694791ull;
+const uint64_t kXXHash64Prime2 = 14029467366897019727ull;
+const uint64_t kXXHash64Prime3 = 1609587929392839161ull;
+const uint64_t kXXHash64Prime4 = 9650029242287828579ull;
+const uint64_t kXXHash64Prime5 = 2870177450012600261ull;
+
+inline uint64_t XXHash64RotateLeft(uint64_t x, int bits) { return (x << bits) | (x >> (64 - bits)); }
+
+inline uint64_t XXHash64Read64(const uint8_t* p) {
+  uint64_t value;
+  std::memcpy(&value, p, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  value = __builtin_bswap64(value);
+#endif
+  return value;
+}
+
+inline uint32_t XXHash64Read32(const uint8_t* p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  value = __builtin_bswap32(value);
+#endif
+  return value;
+}
+
+inline uint64_t XXHash64Round(uint64_t accumulator, uint64_t input) {
+  accumulator += input * kXXHash64Prime2;
+  accumulator = XXHash64RotateLeft(accumulator, 31);
+  return accumulator * kXXHash64Prime1;
+}
+
+inline uint64_t XXHash64MergeRound(uint64_t hash, uint64_t accumulator) {
+  hash ^= XXHash64Round(0, accumulator);
+  return hash * kXXHash64Prime1 + kXXHash64Prime4;
+}
+
+// The four accumulators, each of which takes in one of the four 8-byte lanes of every 32-byte stripe.
+struct XXHash64State {
+  uint64_t v[4];
+  explicit XXHash64State(uint64_t seed) {
+    v[0] = seed + kXXHash64Prime1 + kXXHash64Prime2;
+    v[1] = seed + kXXHash64Prime2;
+    v[2] = seed;
+    v[3] = seed - kXXHash64Prime1;
+  }
+  // Returns the pointer past the last full stripe.
+  const uint8_t* Consume(const uint8_t* p, const uint8_t* end) {
+    for (; end - p >= 32; p += 32) {
+      v[0] = XXHash64Round(v[0], XXHash64Read64(p));
+      v[1] = XXHash64Round(v[1], XXHash64Read64(p + 8));
+      v[2] = XXHash64Round(v[2], XXHash64Read64(p + 16));
+      v[3] = XXHash64Round(v[3], XXHash64Read64(p + 24));
+    }
+    return p;
+  }
+  uint64_t Merge() const {
+    uint64_t hash = XXHash64RotateLeft(v[0], 1) + XXHash64RotateLeft(v[1], 7) + XXHash64RotateLeft(v[2], 12) +
+                    XXHash64RotateLeft(v[3], 18);
+    for (int i = 0; i < 4; ++i) {
+      hash = XXHash64MergeRound(hash, v[i]);
+    }
+    return hash;
+  }
+};
+
+// Mixes in the last, under 32, bytes, and the total length, and avalanches the result.
+inline uint64_t XXHash64Finalize(uint64_t hash, uint64_t total_length, const uint8_t* p, const uint8_t* end) {
+  hash += total_length;
+  for (; end - p >= 8; p += 8) {
+    hash ^= XXHash64Round(0, XXHash64Read64(p));
+    hash = XXHash64RotateLeft(hash, 27) * kXXHash64Prime1 + kXXHash64Prime4;
+  }
+  if (end - p >= 4) {
+    hash ^= static_cast<uint64_t>(XXHash64Read32(p)) * kXXHash64Prime1;
+    hash = XXHash64RotateLeft(hash, 23) * kXXHash64Prime2 + kXXHash64Prime3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    hash ^= (*p) * kXXHash64Prime5;
+    hash = XXHash64RotateLeft(hash, 11) * kXXHash64Prime1;
+  }
+  hash ^= hash >> 33;
+  hash *= kXXHash64Prime2;
+  hash ^= hash >> 29;
+  hash *= kXXHash64Prime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+}  // namespace impl
+
+inline uint64_t XXHash64(const void* data, size_t length, uint64_t seed = 0) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  const uint8_t* const end = p + length;
+  uint64_t hash;
+  if (length >= 32) {
+    impl::XXHash64State state(seed);
+    p = state.Consume(p, end);
+    hash = state.Merge();
+  } else {
+    hash = seed + impl::kXXHash64Prime5;
+  }
+  return impl::XXHash64Finalize(hash, length, p, end);
+}
+
+inline uint64_t XXHash64(const std::string& s, uint64_t seed = 0) {
+  return XXHash64(s.data(), s.length(), seed);
+}
+
+// `XXHash64()` of the data given in chunks. Keeps the up to 31 bytes of the last stripe not yet complete.
+class XXHash64Stream final {
+ public:
+  explicit XXHash64Stream(uint64_t seed = 0) : seed_(seed), state_(seed) {}
+
+  XXHash64Stream& Update(const void* data, size_t length) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const uint8_t* const end = p + length;
+    total_length_ += length;
+    if (!length) {
+      return *this;
+    }
+    if (buffered_ + length < sizeof(buffer_)) {
+      std::memcpy(buffer_ + buffered_, p, length);
+      buffered_ += length;
+      return *this;
+    }
+    if (buffered_) {
+      const size_t missing = sizeof(buffer_) - buffered_;
+      std::memcpy(buffer_ + buffered_, p, missing);
+      state_.Consume(buffer_, buffer_ + sizeof(buffer_));
+      p += missing;
+      buffered_ = 0;
+    }
+    p = state_.Consume(p, end);
+    buffered_ = static_cast<size_t>(end - p);
+    std::memcpy(buffer_, p, buffered_);
+    return *this;
+  }
+  XXHash64Stream& Update(const std::string& s) { return Update(s.data(), s.length()); }
+
+  // The hash of all the data so far; the stream may be updated further.
+  uint64_t Digest() const {
+    const uint64_t hash = (total_length_ >= sizeof(buffer_)) ? state_.Merge() : seed_ + impl::kXXHash64Prime5;
+    return impl::XXHash64Finalize(hash, total_length_, buffer_, buffer_ + buffered_);
+  }
+
+ private:
+  const uint64_t seed_;
+  impl::XXHash64State state_;
+  uint64_t total_length_ = 0;
+  uint8_t buffer_[32];
+  size_t buffered_ = 0;
+};
+
+}  // namespace bricks
+
+#endif  // BRICKS_UTIL_HASH_H
@@ -0,0 +1,337 @@
+// The lock-free queues to pass the objects between the threads with, the building blocks of the message queues,
+// the executors, and the ingestion paths.
+//
+// * `SPSCQueue<T>`, the bounded ring of one producer and one consumer thread: one release store per push
+//   and per pop, and, as each side keeps its own copy of the position of the other one, the cache line
+//   of the other side is only read once the ring looks full, or empty.
+// * `MPSCQueue<T>`, the bounded ring of any number of producer threads and one consumer thread: a producer
+//   claims its slots, one or a batch of them, with a compare-and-swap, and each slot carries a sequence
+//   number telling the consumer whether its object is there yet.
+// * `IntrusiveMPSCQueue<T>`, the unbounded linked queue of any number of producer threads and one consumer
+//   thread, of the objects deriving from `IntrusiveMPSCQueueNode`: a push, of one object or a chain of them,
+//   is one atomic exchange, and never fails nor allocates. The queue does not own the objects.
+//
+//   bricks::SPSCQueue<Message> queue(1024);
+//   if (!queue.TryPush(std::move(message))) { /* Full. */ }
+//   Message received;
+//   while (queue.TryPop(received)) { ... }
+//
+// `TryPush()` and `TryPop()` return false right away if the ring is full, or empty, for the caller to
+// spin, yield or park as it sees fit. The rings hold a power of two of default-constructed objects,
+// which are moved in and out. The positions of the producers and of the consumer are on cache lines
+// of their own.
+
+#ifndef BRICKS_UTIL_LOCKFREE_QUEUE_H
+#define BRICKS_UTIL_LOCKFREE_QUEUE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace bricks {
+
+const size_t kLockFreeQueueCacheLineSize = 64;
+
+namespace impl {
+
+inline size_t LockFreeQueueCapacity(size_t capacity) {
+  size_t result = 2;
+  while (result < capacity) {
+    result <<= 1;
+  }
+  return result;
+}
+
+}  // namespace impl
+
+template <typename T>
+class SPSCQueue final {
+ public:
+  // The capacity is rounded up to a power of two.
+  explicit SPSCQueue(size_t capacity)
+      : mask_(impl::LockFreeQueueCapacity(capacity) - 1), slots_(mask_ + 1) {}
+
+  size_t Capacity() const { return mask_ + 1; }
+
+  // The number of objects in the queue, as of some moment during the call.
+  size_t Size() const {
+    const size_t tail = tail_.load(std::memory_order_acquire);
+    return head_.load(std::memory_order_acquire) - tail;
+  }
+
+  // The producer thread only.
+  bool TryPush(const T& object) {
+    T copy(object);
+    return TryPush(std::move(copy));
+  }
+  bool TryPush(T&& object) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head - consumer_tail_ > mask_) {
+      consumer_tail_ = tail_.load(std::memory_order_acquire);
+      if (head - consumer_tail_ > mask_) {
+        return false;
+      }
+    }
+    slots_[head & mask_] = std::move(object);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Moves in as many objects from the random access range `[begin, end)` as there is room for,
+  // with one release store. Returns the number of objects moved in. The producer thread only.
+  template <typename IT>
+  size_t TryPushBatch(IT begin, IT end) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    size_t room = Capacity() - (head - consumer_tail_);
+    if (room < static_cast<size_t>(end - begin)) {
+      consumer_tail_ = tail_.load(std::memory_order_acquire);
+      room = Capacity() - (head - consumer_tail_);
+    }
+    size_t pushed = 0;
+    for (; begin != end && pushed < room; ++begin, ++pushed) {
+      slots_[(head + pushed) & mask_] = std::move(*begin);
+    }
+    if (pushed) {
+      head_.store(head + pushed, std::memory_order_release);
+    }
+    return pushed;
+  }
+
+  // The consumer thread only.
+  bool TryPop(T& object) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == producer_head_) {
+      producer_head_ = head_.load(std::memory_order_acquire);
+      if (tail == producer_head_) {
+        return false;
+      }
+    }
+    object = std::move(slots_[tail & mask_]);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Moves out up to `max` objects into `output`, with one release store. Returns the number of them.
+  // The consumer thread only.
+  template <typename IT>
+  size_t TryPopBatch(IT output, size_t max) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (producer_head_ - tail < max) {
+      producer_head_ = head_.load(std::memory_order_acquire);
+    }
+    const size_t popped = std::min(max, producer_head_ - tail);
+    for (size_t i = 0; i < popped; ++i, ++output) {
+      *output = std::move(slots_[(tail + i) & mask_]);
+    }
+    if (popped) {
+      tail_.store(tail + popped, std::memory_order_release);
+    }
+    return popped;
+  }
+
+ private:
+  const size_t mask_;
+  std::vector<T> slots_;
+
+  // The position of the next push, and the position of the consumer as the producer last saw it.
+  char producer_padding_[kLockFreeQueueCacheLineSize];
+  std::atomic_size_t head_{0};
+  size_t consumer_tail_ = 0;
+
+  // The position of the next pop, and the position of the producer as the consumer last saw it.
+  char consumer_padding_[kLockFreeQueueCacheLineSize];
+  std::atomic_size_t tail_{0};
+  size_t producer_head_ = 0;
+  char padding_[kLockFreeQueueCacheLineSize];
+
+  SPSCQueue(const SPSCQueue&) = delete;
+  void operator=(const SPSCQueue&) = delete;
+};
+
+template <typename T>
+class MPSCQueue final {
+ public:
+  // The capacity is rounded up to a power of two.
+  explicit MPSCQueue(size_t capacity)
+      : mask_(impl::LockFreeQueueCapacity(capacity) - 1), slots_(mask_ + 1) {
+    for (size_t i = 0; i <= mask_; ++i) {
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  size_t Capacity() const { return mask_ + 1; }
+
+  // The number of objects claimed by the producers and not yet popped, as of some moment during the call.
+  size_t Size() const {
+    const size_t tail = tail_.load(std::memory_order_acquire);
+    return head_.load(std::memory_order_acquire) - tail;
+  }
+
+  // Any thread.
+  bool TryPush(const T& object) {
+    T copy(object);
+    return TryPush(std::move(copy));
+  }
+  bool TryPush(T&& object) { return TryPushBatch(&object, &object + 1) == 1; }
+
+  // Moves in as many objects from the random access range `[begin, end)` as there is room for,
+  // claiming their slots at once. Returns the number of objects moved in. Any thread.
+  template <typename IT>
+  size_t TryPushBatch(IT begin, IT end) {
+    const size_t count = static_cast<size_t>(end - begin);
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t claimed;
+    do {
+      // The slots up to the position of the consumer, one lap ahead of it, are free:
+      // the consumer frees them in order, before it moves on.
+      const size_t room = Capacity() - (head - tail_.load(std::memory_order_acquire));
+      claimed = std::min(count, room);
+      if (!claimed) {
+        return 0;
+      }
+    } while (!head_.compare_exchange_weak(head, head + claimed, std::memory_order_relaxed));
+    for (size_t i = 0; i < claimed; ++i, ++begin) {
+      Slot& slot = slots_[(head + i) & mask_];
+      slot.object = std::move(*begin);
+      slot.sequence.store(head + i + 1, std::memory_order_release);
+    }
+    return claimed;
+  }
+
+  // Returns false if the queue is empty, or if the producer of the next object is still moving it in.
+  // The consumer thread only.
+  bool TryPop(T& object) { return TryPopBatch(&object, 1) == 1; }
+
+  // Moves out up to `max` consecutive objects into `output`. Returns the number of them.
+  // The consumer thread only.
+  template <typename IT>
+  size_t TryPopBatch(IT output, size_t max) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t popped = 0;
+    for (; popped < max; ++popped, ++output) {
+      Slot& slot = slots_[(tail + popped) & mask_];
+      if (slot.sequence.load(std::memory_order_acquire) != tail + popped + 1) {
+        break;
+      }
+      *output = std::move(slot.object);
+      slot.sequence.store(tail + popped + Capacity(), std::memory_order_relaxed);
+    }
+    if (popped) {
+      tail_.store(tail + popped, std::memory_order_release);
+    }
+    return popped;
+  }
+
+ private:
+  // The sequence number is the position the slot is free for, or that position plus one once the object
+  // for it is there.
+  struct Slot {
+    std::atomic_size_t sequence;
+    T object;
+  };
+
+  const size_t mask_;
+  std::vector<Slot> slots_;
+
+  char producers_padding_[kLockFreeQueueCacheLineSize];
+  std::atomic_size_t head_{0};
+
+  char consumer_padding_[kLockFreeQueueCacheLineSize];
+  std::atomic_size_t tail_{0};
+  char padding_[kLockFreeQueueCacheLineSize];
+
+  MPSCQueue(const MPSCQueue&) = delete;
+  void operator=(const MPSCQueue&) = delete;
+};
+
+struct IntrusiveMPSCQueueNode {
+  std::atomic<IntrusiveMPSCQueueNode*> next{nullptr};
+};
+
+template <typename T>
+class IntrusiveMPSCQueue final {
+ public:
+  IntrusiveMPSCQueue() : head_(&stub_), tail_(&stub_) {}
+
+  // Any thread.
+  void Push(T* object) { PushNodes(object, object); }
+
+  // Pushes the objects from `first` to `last`, linked through their `next`-s by the caller, at once.
+  // Any thread.
+  void PushChain(T* first, T* last) { PushNodes(first, last); }
+
+  // Links `objects[0 .. count)` into a chain, and pushes it. Any thread.
+  void PushBatch(T* const* objects, size_t count) {
+    if (count) {
+      for (size_t i = 1; i < count; ++i) {
+        static_cast<IntrusiveMPSCQueueNode*>(objects[i - 1])->next.store(objects[i], std::memory_order_relaxed);
+      }
+      PushChain(objects[0], objects[count - 1]);
+    }
+  }
+
+  // Returns null if the queue is empty, or if the producer of the next object is still linking it in.
+  // The consumer thread only.
+  T* TryPop() {
+    IntrusiveMPSCQueueNode* tail = tail_;
+    IntrusiveMPSCQueueNode* next = tail->next.load(std::memory_order_acquire);
+    if (tail == &stub_) {
+      if (!next) {
+        return nullptr;
+      }
+      tail_ = tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+      tail_ = next;
+      return static_cast<T*>(tail);
+    }
+    if (tail != head_.load(std::memory_order_acquire)) {
+      // A producer has swapped the head, and is yet to link its object to `tail`.
+      return nullptr;
+    }
+    // The last object is only popped with the stub behind it, for the producers to have a node to link to.
+    PushNodes(&stub_, &stub_);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next) {
+      tail_ = next;
+      return static_cast<T*>(tail);
+    }
+    return nullptr;
+  }
+
+  // Pops up to `max` objects into `output`. Returns the number of them. The consumer thread only.
+  size_t TryPopBatch(T** output, size_t max) {
+    size_t popped = 0;
+    while (popped < max && (output[popped] = TryPop())) {
+      ++popped;
+    }
+    return popped;
+  }
+
+ private:
+  void PushNodes(IntrusiveMPSCQueueNode* first, IntrusiveMPSCQueueNode* last) {
+    last->next.store(nullptr, std::memory_order_relaxed);
+    IntrusiveMPSCQueueNode* const previous = head_.exchange(last, std::memory_order_acq_rel);
+    previous->next.store(first, std::memory_order_release);
+  }
+
+  // The stub is pushed as the objects are, and skipped over by `TryPop()`, for the queue to never be
+  // without a node, and for the producers to not contend with the consumer on the last one.
+
+  char producers_padding_[kLockFreeQueueCacheLineSize];
+  std::atomic<IntrusiveMPSCQueueNode*> head_;
+  char consumer_padding_[kLockFreeQueueCacheLineSize];
+  IntrusiveMPSCQueueNode* tail_;
+  IntrusiveMPSCQueueNode stub_;
+  char padding_[kLockFreeQueueCacheLineSize];
+
+  IntrusiveMPSCQueue(const IntrusiveMPSCQueue&) = delete;
+  void operator=(const IntrusiveMPSCQueue&) = delete;
+};
+
+}  // namespace bricks
+
+#endif  // BRICKS_UTIL_LOCKFREE_QUEUE_H
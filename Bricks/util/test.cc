@@ -1,6 +1,18 @@
 // TODO(dkorolev): Test ScopeGuard and MakeScopeGuard as well.
 
 #include "util.h"
+#include "allocation_counter.h"
+#include "crc32c.h"
+#include "hash.h"
+#include "concurrent_hash_map.h"
+#include "lockfree_queue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "../3party/gtest/gtest.h"
 #include "../3party/gtest/gtest-main.h"
@@ -14,3 +26,313 @@ TEST(Util, CompileTimeStringLength) {
   EXPECT_EQ(4u, bricks::CompileTimeStringLength(local_static_string));
   EXPECT_EQ(5u, bricks::CompileTimeStringLength(global_string));
 }
+
+TEST(Util, CRC32C) {
+  EXPECT_EQ(0u, bricks::CRC32C("", 0));
+  EXPECT_EQ(0xE3069283u, bricks::CRC32C("123456789", 9));
+  EXPECT_EQ(0xE3069283u, bricks::CRC32C("6789", 4, bricks::CRC32C("12345", 5)));
+  const char zeros[32] = {0};
+  EXPECT_EQ(0x8A9136AAu, bricks::CRC32C(zeros, sizeof(zeros)));
+}
+
+TEST(Util, CRC32CSlicingBy8MatchesCRC32C) {
+  std::string data;
+  for (int i = 0; i < 300; ++i) {
+    data += static_cast<char>(i * 37 + 11);
+  }
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data.data());
+  const uint8_t* digits = reinterpret_cast<const uint8_t*>("123456789");
+  EXPECT_EQ(0xE3069283u, ~bricks::impl::CRC32CSlicingBy8(digits, 9, ~0u));
+  for (size_t offset = 0; offset < 8; ++offset) {
+    for (size_t length = 0; length + offset <= data.length(); length += 13) {
+      EXPECT_EQ(bricks::CRC32C(bytes + offset, length),
+                ~bricks::impl::CRC32CSlicingBy8(bytes + offset, length, ~0u));
+    }
+  }
+}
+
+TEST(Util, XXHash64) {
+  EXPECT_EQ(0xEF46DB3751D8E999ull, bricks::XXHash64("", 0));
+  EXPECT_EQ(0xD24EC4F1A98C6E5Bull, bricks::XXHash64("a", 1));
+  EXPECT_EQ(0x44BC2CF5AD770999ull, bricks::XXHash64(std::string("abc")));
+  EXPECT_EQ(0xFBCEA83C8A378BF1ull, bricks::XXHash64(std::string("Nobody inspects the spammish repetition")));
+  EXPECT_NE(bricks::XXHash64(std::string("abc")), bricks::XXHash64(std::string("abc"), 1));
+}
+
+TEST(Util, XXHash64Stream) {
+  std::string data;
+  for (int i = 0; i < 200; ++i) {
+    data += static_cast<char>(i * 31 + 7);
+  }
+  for (size_t length = 0; length <= data.length(); length += 7) {
+    const uint64_t expected = bricks::XXHash64(data.data(), length, 42);
+    for (size_t chunk = 1; chunk <= 40; chunk += 3) {
+      bricks::XXHash64Stream stream(42);
+      for (size_t i = 0; i < length; i += chunk) {
+        stream.Update(data.data() + i, std::min(chunk, length - i));
+      }
+      EXPECT_EQ(expected, stream.Digest()) << length << ' ' << chunk;
+    }
+  }
+  bricks::XXHash64Stream stream;
+  stream.Update("Nobody inspects ").Update(std::string("the spammish repetition"));
+  EXPECT_EQ(0xFBCEA83C8A378BF1ull, stream.Digest());
+}
+
+BRICKS_COUNT_ALLOCATIONS();
+
+TEST(Util, ScopedAllocationCounter) {
+  EXPECT_TRUE(bricks::AllocationCountingInstalled());
+  bricks::ScopedAllocationCounter counter;
+  bricks::ScopedAllocationCounter process_counter(bricks::ScopedAllocationCounter::Scope::Process);
+  EXPECT_EQ(0u, counter.Allocations());
+  std::unique_ptr<std::vector<int>> v(new std::vector<int>(100));
+  EXPECT_EQ(2u, counter.Allocations());
+  EXPECT_GE(process_counter.Allocations(), 2u);
+
+  // The allocations of other threads are only counted process-wide.
+  std::atomic_bool go(false);
+  uint64_t allocations_in_thread = 0;
+  std::thread thread([&go, &allocations_in_thread]() {
+    while (!go) {
+      ;  // Spin lock.
+    }
+    bricks::ScopedAllocationCounter counter_in_thread;
+    std::unique_ptr<int> unused(new int(42));
+    allocations_in_thread = counter_in_thread.Allocations();
+  });
+  counter.Reset();
+  process_counter.Reset();
+  go = true;
+  thread.join();
+  EXPECT_EQ(1u, allocations_in_thread);
+  EXPECT_EQ(0u, counter.Allocations());
+  EXPECT_GE(process_counter.Allocations(), 1u);
+
+  EXPECT_NO_ALLOCATIONS(v->assign(50, 1));
+  EXPECT_ALLOCATIONS_AT_MOST(1, v->resize(1000));
+}
+
+TEST(Util, ConcurrentHashMap) {
+  bricks::ConcurrentHashMap<std::string, int> map;
+  EXPECT_EQ(bricks::kConcurrentHashMapDefaultShards, map.Shards());
+  int value = 0;
+  EXPECT_FALSE(map.Get("one", value));
+  map.Set("one", 1);
+  EXPECT_TRUE(map.Get("one", value));
+  EXPECT_EQ(1, value);
+  EXPECT_FALSE(map.Insert("one", 100));
+  EXPECT_TRUE(map.Insert("two", 2));
+  EXPECT_TRUE(map.With("two", [](int& v) { ++v; }));
+  EXPECT_EQ(3, map.GetOrInsert("two", []() { return 100; }));
+  EXPECT_EQ(4, map.GetOrInsert("four", []() { return 4; }));
+  EXPECT_EQ(3u, map.Size());
+  EXPECT_TRUE(map.Erase("one"));
+  EXPECT_FALSE(map.Erase("one"));
+  EXPECT_FALSE(map.Contains("one"));
+  EXPECT_TRUE(map.Contains("four"));
+  EXPECT_NO_ALLOCATIONS(map.Get("four", value));
+  EXPECT_EQ(4, value);
+  map.Clear();
+  EXPECT_EQ(0u, map.Size());
+  EXPECT_EQ(0u, map.Evictions());
+
+  // Each shard evicts its least recently used entry once full.
+  bricks::ConcurrentHashMap<int, int> lru(2, 1);
+  EXPECT_EQ(1u, lru.Shards());
+  lru.Set(1, 1);
+  lru.Set(2, 2);
+  EXPECT_TRUE(lru.Get(1, value));
+  lru.Set(3, 3);
+  EXPECT_EQ(2u, lru.Size());
+  EXPECT_EQ(1u, lru.Evictions());
+  EXPECT_TRUE(lru.Contains(1));
+  EXPECT_FALSE(lru.Contains(2));
+  EXPECT_TRUE(lru.Contains(3));
+
+  bricks::ConcurrentHashMap<int, int> bounded(1000);
+  for (int i = 0; i < 10000; ++i) {
+    bounded.Set(i, i);
+  }
+  EXPECT_LE(bounded.Size(), 1000u);
+  EXPECT_EQ(10000u, bounded.Size() + bounded.Evictions());
+}
+
+TEST(Util, ConcurrentHashMapFromManyThreads) {
+  const int kThreads = 8;
+  const int kKeys = 1000;
+  bricks::ConcurrentHashMap<int, int> map;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&map]() {
+      for (int i = 0; i < kKeys; ++i) {
+        map.Insert(i, 0);
+        map.With(i, [](int& v) { ++v; });
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(static_cast<size_t>(kKeys), map.Size());
+  for (int i = 0; i < kKeys; ++i) {
+    int value = 0;
+    ASSERT_TRUE(map.Get(i, value));
+    EXPECT_EQ(kThreads, value);
+  }
+}
+
+struct QueuedNumber : bricks::IntrusiveMPSCQueueNode {
+  int producer = 0;
+  int number = 0;
+};
+
+TEST(Util, LockFreeQueues) {
+  bricks::SPSCQueue<std::string> spsc(3);
+  EXPECT_EQ(4u, spsc.Capacity());
+  std::string value;
+  EXPECT_FALSE(spsc.TryPop(value));
+  EXPECT_TRUE(spsc.TryPush("one"));
+  std::vector<std::string> batch{"two", "three", "four", "five"};
+  EXPECT_EQ(3u, spsc.TryPushBatch(batch.begin(), batch.end()));
+  EXPECT_FALSE(spsc.TryPush("five"));
+  EXPECT_EQ(4u, spsc.Size());
+  EXPECT_TRUE(spsc.TryPop(value));
+  EXPECT_EQ("one", value);
+  EXPECT_TRUE(spsc.TryPush("five"));
+  std::vector<std::string> popped(10);
+  EXPECT_EQ(4u, spsc.TryPopBatch(popped.begin(), popped.size()));
+  EXPECT_EQ("two", popped[0]);
+  EXPECT_EQ("five", popped[3]);
+  EXPECT_EQ(0u, spsc.Size());
+
+  bricks::MPSCQueue<int> mpsc(4);
+  int number = 0;
+  EXPECT_FALSE(mpsc.TryPop(number));
+  const int numbers[] = {1, 2, 3, 4, 5};
+  EXPECT_EQ(4u, mpsc.TryPushBatch(numbers, numbers + 5));
+  EXPECT_FALSE(mpsc.TryPush(5));
+  EXPECT_TRUE(mpsc.TryPop(number));
+  EXPECT_EQ(1, number);
+  EXPECT_TRUE(mpsc.TryPush(5));
+  int output[10];
+  EXPECT_EQ(4u, mpsc.TryPopBatch(output, 10));
+  EXPECT_EQ(2, output[0]);
+  EXPECT_EQ(5, output[3]);
+  EXPECT_EQ(0u, mpsc.Size());
+
+  bricks::IntrusiveMPSCQueue<QueuedNumber> intrusive;
+  EXPECT_EQ(nullptr, intrusive.TryPop());
+  QueuedNumber objects[3];
+  objects[0].number = 1;
+  objects[1].number = 2;
+  objects[2].number = 3;
+  intrusive.Push(&objects[0]);
+  QueuedNumber* chain[] = {&objects[1], &objects[2]};
+  intrusive.PushBatch(chain, 2);
+  QueuedNumber* received[10];
+  EXPECT_EQ(3u, intrusive.TryPopBatch(received, 10));
+  EXPECT_EQ(1, received[0]->number);
+  EXPECT_EQ(3, received[2]->number);
+  EXPECT_EQ(nullptr, intrusive.TryPop());
+  intrusive.Push(&objects[0]);
+  EXPECT_EQ(&objects[0], intrusive.TryPop());
+  EXPECT_EQ(nullptr, intrusive.TryPop());
+}
+
+TEST(Util, LockFreeQueuesFromManyThreads) {
+  const int kNumbers = 100000;
+  const int kProducers = 4;
+
+  // Each consumer checks that the numbers of each producer come in order.
+  {
+    bricks::SPSCQueue<int> queue(64);
+    std::thread producer([&queue]() {
+      for (int i = 0; i < kNumbers;) {
+        if (queue.TryPush(i)) {
+          ++i;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+    int expected = 0;
+    int batch[16];
+    while (expected < kNumbers) {
+      const size_t popped = queue.TryPopBatch(batch, 16);
+      for (size_t i = 0; i < popped; ++i) {
+        ASSERT_EQ(expected++, batch[i]);
+      }
+      if (!popped) {
+        std::this_thread::yield();
+      }
+    }
+    producer.join();
+  }
+
+  {
+    bricks::MPSCQueue<std::pair<int, int>> queue(64);
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; ++p) {
+      producers.emplace_back([&queue, p]() {
+        std::vector<std::pair<int, int>> batch;
+        for (int i = 0; i < kNumbers; i += 10) {
+          batch.clear();
+          for (int j = i; j < i + 10; ++j) {
+            batch.emplace_back(p, j);
+          }
+          size_t pushed = 0;
+          while (pushed < batch.size()) {
+            const size_t n = queue.TryPushBatch(batch.begin() + pushed, batch.end());
+            pushed += n;
+            if (!n) {
+              std::this_thread::yield();
+            }
+          }
+        }
+      });
+    }
+    std::vector<int> expected(kProducers);
+    std::pair<int, int> received;
+    for (int total = 0; total < kProducers * kNumbers;) {
+      if (queue.TryPop(received)) {
+        ASSERT_EQ(expected[received.first]++, received.second);
+        ++total;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+    for (std::thread& producer : producers) {
+      producer.join();
+    }
+  }
+
+  {
+    bricks::IntrusiveMPSCQueue<QueuedNumber> queue;
+    std::vector<QueuedNumber> objects(kProducers * kNumbers);
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; ++p) {
+      producers.emplace_back([&queue, &objects, p]() {
+        for (int i = 0; i < kNumbers; ++i) {
+          QueuedNumber& object = objects[p * kNumbers + i];
+          object.producer = p;
+          object.number = i;
+          queue.Push(&object);
+        }
+      });
+    }
+    std::vector<int> expected(kProducers);
+    for (int total = 0; total < kProducers * kNumbers;) {
+      const QueuedNumber* object = queue.TryPop();
+      if (object) {
+        ASSERT_EQ(expected[object->producer]++, object->number);
+        ++total;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+    for (std::thread& producer : producers) {
+      producer.join();
+    }
+  }
+}
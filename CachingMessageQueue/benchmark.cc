@@ -1,6 +1,18 @@
 // A benchmark for the FIFO message queue.
 //
-// Benchmarks the --queue implemention: "EfficientMQ", "SimpleMQ" or "DummyMQ".
+// Benchmarks the --queue implemention: "ShardedMQ", "ShardedMQOrdered", "LockFreeMQ", "EfficientMQ",
+// "EfficientMQBatch", "ArenaMQ", "MultiConsumerMQ", "MultiConsumerMQKeyed", "BroadcastMQ", "PriorityMQ",
+// "DoubleBufferMQ", "ConflatingMQ", "SimpleMQ" or "DummyMQ".
+// ("EfficientMQBatch" is `EfficientMQ` with the consumer exposing the batch `OnMessages()` method.)
+// ("PriorityMQ" gives the messages of each producer the priority of its index modulo three.)
+// ("MultiConsumerMQ" runs --consumers consumer threads, "MultiConsumerMQKeyed" keeps the order per producer.)
+// ("BroadcastMQ" delivers each message to each of the --consumers, thus the messages parsed and dropped
+//  are the totals over all of them.)
+// ("ConflatingMQ" keeps the latest pending message per producer, thus parses fewer messages than are pushed.)
+// For "EfficientMQ", "EfficientMQBatch", "ArenaMQ" and the multi-consumer ones,
+// --overflow_policy is one of "DropOldest", "BlockProducer" or "RejectNewest".
+// For those, "DoubleBufferMQ", "ConflatingMQ" and "SimpleMQ", --wait_strategy is one of "Adaptive", "Park"
+// or "Spin".
 //
 // Measures:
 //
@@ -9,7 +21,17 @@
 //      and a non-blocking queue of limited size is used.
 //
 //   2) Thread lock time.
-//      The time for which the thread pushing events is blocked when pushing an event.
+//      The time for which the thread pushing events is blocked when pushing an event,
+//      both as a histogram and as the total and maximum time spent inside `PushMessage()`.
+//
+//   3) Latency percentiles.
+//      Of the push time, and of the end-to-end time from the message being pushed to it being consumed.
+//      With --json, the results are also saved into the file, in JSON format.
+//
+//   4) Allocations per message.
+//      The heap allocations made by the whole process while the benchmark runs, per message pushed,
+//      counted by the replaced global `operator new`. With --recycle, the producers use
+//      `PushMessageRecycling()` of EfficientMQ, and refill the buffers of the slots in place.
 //
 // Entries pushing side is:
 //
@@ -19,8 +41,37 @@
 //      exponentially distributed with the mean of --min_message_length.
 //
 // Entries receiving side emulates processing messages at --process_mbps rate, exponentialy distributed as well.
+// For the multi-consumer queues, each of the --consumers consumers processes at this rate.
+//
+// With --linger_ms, EfficientMQ and EfficientMQBatch hold the messages back for up to that many milliseconds,
+// or until --max_batch_bytes of them are pending, to export them in larger batches, see `SetLinger()`.
+// For EfficientMQBatch, the number of the `OnMessages()` calls is reported as the number of batches.
+//
+// With --spill_file, EfficientMQ and EfficientMQBatch write the messages that do not fit into the buffer
+// into that file, of up to --spill_mb MB, instead of applying --overflow_policy, see `SetSpillFile()`.
+//
+// With --consumer_executor_threads, the consumer of EfficientMQ and EfficientMQBatch is run by an
+// `MQConsumerExecutor` of that many threads, instead of by a thread of its own.
 //
-// The test runs for --seconds seconds.
+// With --pin, the consumer thread of EfficientMQ and ShardedMQ runs on CPU 0, the producers on the next ones.
+// With --numa, the ring buffers are allocated NUMA-locally: on the node of each producer for ShardedMQ,
+// and on the node of the consumer thread for EfficientMQ.
+//
+// With --record_trace, the messages pushed are saved into that file, as (thread, timestamp, size),
+// see `mq_trace.h`. With --replay_trace, the producers replay such a trace instead, recorded by the benchmark
+// or captured in production by `MQTraceRecorder`, one producer per thread of the trace, each message pushed
+// at its timestamp, --time_compression times faster, and of its size. The bursts and the heavy tails
+// of the real traffic are then replayed as is, and the drops and the latency percentiles reported are those
+// of each queue under it. --push_threads, --push_mbps_per_thread and the message lengths are then ignored.
+//
+// With --perf_counters, the cycles, the instructions, the last level cache misses and the context switches
+// of the producing threads are counted, with `perf_event_open()`, over their calls into the queue only,
+// the same region as the push time, and reported per message, see `Bricks/benchmark/perf_counters.h`.
+// Only the counters the host has are reported, and starting and stopping them is a system call each,
+// thus the push time grows with them.
+//
+// The test runs for --seconds seconds, or, with --replay_trace, until the trace is over,
+// plus --replay_drain_seconds for the queue to catch up.
 
 /*
 
@@ -33,7 +84,7 @@
   --push_mbps_per_thread=0.00001
 
 # Load test, mid-sized messages from several threads.
-for q in DummyMQ SimpleMQ EfficientMQ ; do \
+for q in DummyMQ SimpleMQ DoubleBufferMQ EfficientMQ LockFreeMQ ShardedMQ ; do \
   ./build/benchmark \
   --queue=$q \
   --average_message_length=1000 \
@@ -42,7 +93,7 @@ for q in DummyMQ SimpleMQ EfficientMQ ; do \
 done
 
 # Heavy load test, large messages from many threads.
-for q in DummyMQ SimpleMQ EfficientMQ ; do \
+for q in DummyMQ SimpleMQ DoubleBufferMQ EfficientMQ LockFreeMQ ShardedMQ ; do \
   ./build/benchmark \
   --queue=$q \
   --average_message_length=1000000 \
@@ -53,7 +104,7 @@ done
 # Consumer slow relative to producers.
 # Observe produce speed adjusted to the consumer rate and/or messages dropped.
 # Need more time and smaller packets, otherwith most of them end up in the circular buffer of EfficientMQ.
-for q in DummyMQ SimpleMQ EfficientMQ ; do \
+for q in DummyMQ SimpleMQ DoubleBufferMQ EfficientMQ LockFreeMQ ShardedMQ ; do \
   ./build/benchmark \
   --queue=$q \
   --average_message_length=100 \
@@ -63,24 +114,177 @@ for q in DummyMQ SimpleMQ EfficientMQ ; do \
   --seconds=15 ; \
 done
 
+# Same, comparing the overflow policies of EfficientMQ.
+# Observe messages dropped vs. the time producers spent blocked in `PushMessage()`.
+for p in DropOldest BlockProducer RejectNewest ; do \
+  ./build/benchmark \
+  --queue=EfficientMQ \
+  --overflow_policy=$p \
+  --average_message_length=100 \
+  --push_threads=4 \
+  --push_mbps_per_thread=1 \
+  --process_mbps=5 \
+  --seconds=15 ; \
+done
+
+# Comparing the wait strategies of the consumer thread, with the producers pushing at a low rate.
+# Observe the end-to-end latency vs. the CPU usage of the consumer thread.
+for w in Park Adaptive Spin ; do \
+  ./build/benchmark \
+  --queue=EfficientMQ \
+  --wait_strategy=$w \
+  --average_message_length=100 \
+  --push_threads=2 \
+  --push_mbps_per_thread=0.1 ; \
+done
+
+# Scaling of the multi-consumer queue with the number of consumer threads, when processing is the bottleneck.
+for c in 1 2 4 8 ; do \
+  ./build/benchmark \
+  --queue=MultiConsumerMQ \
+  --consumers=$c \
+  --average_message_length=1000 \
+  --push_threads=8 \
+  --push_mbps_per_thread=5 \
+  --process_mbps=10 ; \
+done
+
+# Fan-out of one stream to several consumers, with the drops counted per consumer.
+for c in 1 2 4 ; do \
+  ./build/benchmark \
+  --queue=BroadcastMQ \
+  --consumers=$c \
+  --average_message_length=1000 \
+  --push_threads=4 \
+  --push_mbps_per_thread=1 \
+  --process_mbps=10 ; \
+done
+
+# Allocations per message of EfficientMQ, before and after recycling the buffers of the messages.
+for r in false true ; do \
+  ./build/benchmark \
+  --queue=EfficientMQ \
+  --recycle=$r \
+  --average_message_length=1000 \
+  --push_threads=4 \
+  --push_mbps_per_thread=5 \
+  --process_mbps=100 ; \
+done
+
+# Overload of the priority queue: the drops should come from the lowest priority first.
+./build/benchmark \
+  --queue=PriorityMQ \
+  --average_message_length=100 \
+  --push_threads=6 \
+  --push_mbps_per_thread=0.2 \
+  --process_mbps=1 \
+  --seconds=10
+
+# Batching of the trickling messages by the linger, observe the messages per batch vs. the end-to-end latency.
+for l in 0 1 10 ; do \
+  ./build/benchmark \
+  --queue=EfficientMQBatch \
+  --linger_ms=$l \
+  --average_message_length=100 \
+  --push_threads=4 \
+  --push_mbps_per_thread=0.1 ; \
+done
+
+# Spilling the overflow to disk, observe no drops until the spill file of --spill_mb fills up.
+for f in "" build/spill ; do \
+  ./build/benchmark \
+  --queue=EfficientMQ \
+  --spill_file=$f \
+  --average_message_length=100 \
+  --push_threads=4 \
+  --push_mbps_per_thread=1 \
+  --process_mbps=5 ; \
+done
+
+# Thread and NUMA placement, on a multi-socket host.
+for q in EfficientMQ ShardedMQ ; do \
+  for p in "--pin=false --numa=false" "--pin=true --numa=false" "--pin=true --numa=true" ; do \
+    ./build/benchmark \
+    --queue=$q \
+    $p \
+    --average_message_length=1000 \
+    --push_threads=16 \
+    --push_mbps_per_thread=20 \
+    --process_mbps=1000 ; \
+  done ; \
+done
+
+# Record a trace, then replay it at ten times the speed against several queues.
+./build/benchmark \
+  --record_trace=build/trace \
+  --average_message_length=1000 \
+  --push_threads=4 \
+  --process_mbps=100
+for q in DummyMQ SimpleMQ EfficientMQ ShardedMQ ; do \
+  ./build/benchmark \
+  --queue=$q \
+  --replay_trace=build/trace \
+  --time_compression=10 \
+  --process_mbps=100 ; \
+done
+
 */
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <new>
 #include <random>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
 #include <gflags/gflags.h>
 
+#include "../Bricks/benchmark/perf_counters.h"
+#include "../Bricks/cerealize/cerealize.h"
+#include "../Bricks/time/tsc.h"
+
+#include "latency_histogram.h"
+#include "mq_affinity.h"
+#include "mq_arena.h"
+#include "mq_broadcast.h"
+#include "mq_conflating.h"
+#include "mq_double_buffer.h"
 #include "mq_efficient.h"
+#include "mq_lockfree.h"
+#include "mq_multi_consumer.h"
+#include "mq_priority.h"
+#include "mq_sharded.h"
 #include "mq_simple.h"
 #include "mq_dummy.h"
+#include "mq_trace.h"
+
+DEFINE_string(queue,
+              "DummyMQ",
+              "ShardedMQ / ShardedMQOrdered / LockFreeMQ / EfficientMQ / EfficientMQBatch / ArenaMQ / "
+              "MultiConsumerMQ / MultiConsumerMQKeyed / BroadcastMQ / PriorityMQ / DoubleBufferMQ / "
+              "ConflatingMQ / SimpleMQ / DummyMQ");
 
-DEFINE_string(queue, "DummyMQ", "EfficientMQ / SimpleMQ / DummyMQ");
+DEFINE_string(overflow_policy,
+              "DropOldest",
+              "For EfficientMQ, ArenaMQ, MultiConsumerMQ and BroadcastMQ: "
+              "DropOldest / BlockProducer / RejectNewest");
+DEFINE_string(wait_strategy,
+              "Adaptive",
+              "For all the queues with a consumer thread but LockFreeMQ and ShardedMQ: Adaptive / Park / Spin");
+DEFINE_int32(arena_kb, 1024, "For ArenaMQ: the capacity of the arena, in kilobytes.");
+DEFINE_int32(consumers,
+             1,
+             "For MultiConsumerMQ, MultiConsumerMQKeyed and BroadcastMQ: the number of consumer threads.");
 
 DEFINE_int32(push_threads, 8, "The number of threads that push in messages.");
 DEFINE_double(push_mbps_per_thread,
@@ -98,15 +302,127 @@ DEFINE_double(process_mbps,
 
 DEFINE_double(seconds, 3.0, "The time to run the benchmark for, in seconds.");
 
+DEFINE_bool(emplace,
+            false,
+            "Set to true to construct messages in place via `EmplaceMessage()`, for the queues that support it. "
+            "The push time then includes the time to populate the message.");
+
+DEFINE_bool(recycle,
+            false,
+            "Set to true to push via `PushMessageRecycling()`, for the queues that support it, refilling "
+            "the buffer handed back by the queue instead of allocating a new message each time.");
+
+DEFINE_int32(linger_ms,
+             0,
+             "For EfficientMQ and EfficientMQBatch: how long the consumer holds the messages back, in ms.");
+DEFINE_int32(max_batch_bytes,
+             64 * 1024,
+             "For EfficientMQ and EfficientMQBatch with --linger_ms: the bytes to export right away.");
+DEFINE_string(spill_file, "", "For EfficientMQ and EfficientMQBatch: the file to spill the overflow into.");
+DEFINE_int32(spill_mb, 100, "For EfficientMQ and EfficientMQBatch with --spill_file: its size, in MB.");
+DEFINE_int32(consumer_executor_threads,
+             0,
+             "For EfficientMQ and EfficientMQBatch: if positive, the consumer is run by an `MQConsumerExecutor` "
+             "of that many threads.");
+DEFINE_bool(pin,
+            false,
+            "Set to true to pin the consumer thread of EfficientMQ and ShardedMQ to CPU 0, "
+            "and the producing threads to the next CPUs, wrapping around.");
+DEFINE_bool(numa,
+            false,
+            "Set to true to allocate the ring buffers of EfficientMQ and ShardedMQ on the NUMA nodes "
+            "of the consumer thread and of each producer, respectively.");
+
+DEFINE_string(record_trace, "", "If set, the name of the file to save the trace of the messages pushed into.");
+DEFINE_string(replay_trace, "", "If set, the name of the trace file to replay instead of generating messages.");
+DEFINE_double(time_compression, 1.0, "With --replay_trace, how many times faster to replay the trace.");
+DEFINE_double(replay_drain_seconds,
+              1.0,
+              "With --replay_trace, the time to keep consuming for once the trace is over, in seconds.");
+
+DEFINE_bool(perf_counters,
+            false,
+            "Set to true to report the hardware performance counters of the producers per message pushed.");
+
+DEFINE_string(json, "", "If set, the name of the file to save the results into, in JSON format.");
+
 DEFINE_bool(log, false, "When debugging, set to true to output more information on the progress of the test.");
 DEFINE_bool(dump, false, "When debugging or reading the code, set to true to log all the events.");
 
-// Use wall time in nanoseconds.
-double wall_time_ns() {
-  return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(
-                                 std::chrono::system_clock::now().time_since_epoch()).count());
+// The number of heap allocations made by the process, to report the allocations per message.
+std::atomic<uint64_t> g_allocations(0);
+
+// Not inlined, for the compiler to not pair `malloc()` and `free()` with the new and delete expressions.
+__attribute__((noinline)) void* operator new(size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+  std::free(p);
 }
 
+// Use the calibrated cycle counter clock, in nanoseconds. It is cheap enough to be called in spin loops.
+double time_ns() {
+  return static_cast<double>(bricks::time::HighResolutionNowNanoseconds());
+}
+
+// The message carries the time it was pushed at, to measure the end-to-end latency.
+// `resize()` is what `EmplaceMessage()` uses to prepare the slot for in-place construction.
+struct Message {
+  std::string body;
+  double pushed_ns;
+
+  void resize(size_t length) {
+    body.resize(length);
+  }
+  // For the linger of `EfficientMQ`, see `MQMessageBytes`.
+  size_t size() const {
+    return body.size();
+  }
+};
+
+// For --spill_file: the push timestamp followed by the body.
+template <>
+struct MQSpillCodec<Message> {
+  enum { kSupported = true };
+  static void Encode(const Message& message, std::string& record) {
+    record.assign(reinterpret_cast<const char*>(&message.pushed_ns), sizeof(double));
+    record.append(message.body);
+  }
+  static void Decode(const char* data, size_t length, Message& message) {
+    ::memcpy(&message.pushed_ns, data, sizeof(double));
+    message.body.assign(data + sizeof(double), length - sizeof(double));
+  }
+};
+
+// Compile-time detection of whether the queue supports `EmplaceMessage()`.
+template <typename T_MESSAGE_QUEUE>
+struct QueueSupportsEmplace {
+  struct Writer {
+    void operator()(Message&) const {
+    }
+  };
+  template <typename U>
+  static auto Test(U* queue) -> decltype(queue->EmplaceMessage(static_cast<size_t>(0), Writer()), std::true_type());
+  template <typename U>
+  static std::false_type Test(...);
+  typedef decltype(Test<T_MESSAGE_QUEUE>(nullptr)) type;
+};
+
+// Compile-time detection of whether the queue supports `PushMessageRecycling()`.
+template <typename T_MESSAGE_QUEUE>
+struct QueueSupportsRecycling {
+  template <typename U>
+  static auto Test(U* queue) -> decltype(queue->PushMessageRecycling(std::declval<Message&>()), std::true_type());
+  template <typename U>
+  static std::false_type Test(...);
+  typedef decltype(Test<T_MESSAGE_QUEUE>(nullptr)) type;
+};
+
 // The producer pushes the messages, of messages averaging --average_message_length bytes,
 // at the rate averaging --push_mbps.
 // The producing speed is stateful, an error is auto-corrected on sending the future events.
@@ -132,6 +448,20 @@ struct Producer {
   int total_pushes_above_1ms_ = 0;
   int total_pushes_above_10ms_ = 0;
   int total_pushes_above_100ms_ = 0;
+  double total_push_ns_ = 0.0;
+  double max_push_ns_ = 0.0;
+  LatencyHistogram push_latency_ns_;
+
+  // With --recycle, the message pushed, and the buffer handed back by the queue, to be refilled.
+  Message recycled_message_;
+
+  // With --record_trace, the messages pushed, timestamped relative to `trace_begin_ns_`.
+  std::vector<MQTraceEvent> trace_;
+  double trace_begin_ns_ = 0.0;
+
+  // With --perf_counters, the counters of the producing thread, opened by it, and their values once done.
+  std::unique_ptr<bricks::benchmark::PerfCounters> perf_counters_;
+  bricks::benchmark::PerfCounterValues perf_counter_values_;
 
   Producer(T_MESSAGE_QUEUE& message_queue,
            int thread_index,
@@ -149,11 +479,110 @@ struct Producer {
     assert(average_message_length > min_message_length);
   }
 
+  // Populates the message of the already set length.
+  void FillMessage(Message& full_message) {
+    std::string& message = full_message.body;
+    message[0] = '0' + ((thread_index_ / 10) % 10);
+    message[1] = '0' + (thread_index_ % 10);
+    message[2] = ' ';
+    for (size_t i = 3; i < message.length(); ++i) {
+      message[i] = d_random_letter_(rng_);
+    }
+    if (FLAGS_dump) {
+      printf("SEND: %s\n", message.c_str());
+    }
+    full_message.pushed_ns = time_ns();
+  }
+
+  struct FillMessageWriter {
+    Producer& producer;
+    void operator()(Message& message) const {
+      producer.FillMessage(message);
+    }
+  };
+
+  void Emplace(size_t message_length, std::true_type) {
+    message_queue_.EmplaceMessage(message_length, FillMessageWriter{*this});
+  }
+
+  void Emplace(size_t message_length, std::false_type) {
+    // The queue does not support `EmplaceMessage()`, fall back to `PushMessage()`.
+    Message message;
+    message.body.assign(message_length, ' ');
+    FillMessage(message);
+    message_queue_.PushMessage(message);
+  }
+
+  // The time and, with --perf_counters, the counters are measured from `StartPush()` to `EndPush()`.
+  double StartPush() {
+    if (perf_counters_) {
+      perf_counters_->Resume();
+    }
+    return time_ns();
+  }
+  double EndPush() {
+    const double ns = time_ns();
+    if (perf_counters_) {
+      perf_counters_->Pause();
+    }
+    return ns;
+  }
+
+  // Returns the timestamp the push started at, as the time to populate the message is not included.
+  double Recycle(size_t message_length, std::true_type) {
+    recycled_message_.body.assign(message_length, ' ');
+    FillMessage(recycled_message_);
+    const double ns_before = StartPush();
+    message_queue_.PushMessageRecycling(recycled_message_);
+    return ns_before;
+  }
+
+  double Recycle(size_t message_length, std::false_type) {
+    // The queue does not support `PushMessageRecycling()`, fall back to `PushMessage()`.
+    Message message;
+    message.body.assign(message_length, ' ');
+    FillMessage(message);
+    const double ns_before = StartPush();
+    message_queue_.PushMessage(message);
+    return ns_before;
+  }
+
   void RunProducingThread(std::atomic_bool& done) {
-    double last_ns = wall_time_ns();
+    StartThread();
+    Produce(done);
+    FinishThread();
+  }
+
+  void RunReplayingThread(std::atomic_bool& done,
+                          const std::vector<MQTraceEvent>& events,
+                          double begin_ns,
+                          double time_compression) {
+    StartThread();
+    Replay(done, events, begin_ns, time_compression);
+    FinishThread();
+  }
+
+  void StartThread() {
+    if (FLAGS_pin) {
+      MQPinThisThreadToCPU(thread_index_ % std::max(1u, std::thread::hardware_concurrency()));
+    }
+    if (FLAGS_perf_counters) {
+      perf_counters_.reset(new bricks::benchmark::PerfCounters());
+    }
+  }
+
+  void FinishThread() {
+    if (perf_counters_) {
+      perf_counter_values_ = perf_counters_->Read();
+      perf_counters_.reset();
+    }
+  }
+
+  void Produce(std::atomic_bool& done) {
+    double last_ns = time_ns();
     double next_cutoff_ns = last_ns;
     while (!done) {
-      while (wall_time_ns() < next_cutoff_ns) {
+      while (time_ns() < next_cutoff_ns) {
         // Spin lock.
         if (done) {
           return;
@@ -168,36 +597,66 @@ struct Producer {
 
       next_cutoff_ns += send_time_in_ns;
 
-      std::string message(message_length_in_b, ' ');
-      message[0] = '0' + ((thread_index_ / 10) % 10);
-      message[1] = '0' + (thread_index_ % 10);
-      for (size_t i = 3; i < message.length(); ++i) {
-        message[i] = d_random_letter_(rng_);
-      }
+      PushAndMeasure(message_length_in_b);
+    }
+  }
 
-      if (FLAGS_dump) {
-        printf("SEND: %s\n", message.c_str());
+  // With --replay_trace: pushes the messages of one thread of the trace, each at its timestamp,
+  // `time_compression` times faster, counted from `begin_ns`.
+  void Replay(std::atomic_bool& done,
+              const std::vector<MQTraceEvent>& events,
+              double begin_ns,
+              double time_compression) {
+    for (const MQTraceEvent& e : events) {
+      const double cutoff_ns = begin_ns + 1e3 * e.timestamp_us / time_compression;
+      while (time_ns() < cutoff_ns) {
+        // Spin lock.
+        if (done) {
+          return;
+        }
       }
+      // The producer index takes the first three characters of the message, see `FillMessage()`.
+      PushAndMeasure(std::max(static_cast<size_t>(e.size), static_cast<size_t>(3)));
+    }
+  }
 
-      {
-        // Send this message and measure the time it took.
-        const double ns_before = wall_time_ns();
-        message_queue_.PushMessage(message);
-        const double ns_after = wall_time_ns();
-        const double push_ns = ns_after - ns_before;
-        ++number_of_messages_pushed_;
-        total_bytes_pushed_ += message.length();
-        if (push_ns >= 1e6) {
-          ++total_pushes_above_1ms_;
-          if (push_ns >= 1e7) {
-            ++total_pushes_above_10ms_;
-            if (push_ns >= 1e8) {
-              ++total_pushes_above_100ms_;
-            }
-          }
+  // Sends one message and measures the time it took.
+  // With --emplace, the time to populate the message is included, since it is done in place.
+  void PushAndMeasure(size_t message_length_in_b) {
+    double ns_before;
+    if (FLAGS_emplace) {
+      ns_before = StartPush();
+      Emplace(message_length_in_b, typename QueueSupportsEmplace<T_MESSAGE_QUEUE>::type());
+    } else if (FLAGS_recycle) {
+      ns_before = Recycle(message_length_in_b, typename QueueSupportsRecycling<T_MESSAGE_QUEUE>::type());
+    } else {
+      Message message;
+      message.body.assign(message_length_in_b, ' ');
+      FillMessage(message);
+      ns_before = StartPush();
+      message_queue_.PushMessage(message);
+    }
+    const double ns_after = EndPush();
+    const double push_ns = ns_after - ns_before;
+    ++number_of_messages_pushed_;
+    total_bytes_pushed_ += message_length_in_b;
+    total_push_ns_ += push_ns;
+    max_push_ns_ = std::max(max_push_ns_, push_ns);
+    push_latency_ns_.Record(static_cast<uint64_t>(push_ns));
+    if (push_ns >= 1e6) {
+      ++total_pushes_above_1ms_;
+      if (push_ns >= 1e7) {
+        ++total_pushes_above_10ms_;
+        if (push_ns >= 1e8) {
+          ++total_pushes_above_100ms_;
         }
       }
     }
+    if (!FLAGS_record_trace.empty()) {
+      trace_.push_back(MQTraceEvent{static_cast<uint32_t>(thread_index_),
+                                    static_cast<uint64_t>(std::max(0.0, 1e-3 * (ns_before - trace_begin_ns_))),
+                                    static_cast<uint32_t>(message_length_in_b)});
+    }
   }
 };
 
@@ -208,6 +667,8 @@ struct Consumer {
   int total_messages_processed_ = 0;
   uint64_t total_bytes_processed_ = 0;
   size_t total_messages_dropped_ = 0;
+  int total_batches_processed_ = 0;
+  LatencyHistogram end_to_end_latency_ns_;
 
   std::mt19937 rng_;
   std::exponential_distribution<> process_mbps_distribution_;
@@ -216,9 +677,11 @@ struct Consumer {
       : done_(done), rng_(random_seed), process_mbps_distribution_(1.0 / process_mbps) {
   }
 
-  void OnMessage(const std::string& message, size_t dropped_count) {
+  void OnMessage(const Message& full_message, size_t dropped_count) {
     if (!done_) {
-      const double timestamp_ns = wall_time_ns();
+      const double timestamp_ns = time_ns();
+      const std::string& message = full_message.body;
+      end_to_end_latency_ns_.Record(static_cast<uint64_t>(std::max(0.0, timestamp_ns - full_message.pushed_ns)));
 
       ++total_messages_processed_;
       total_bytes_processed_ += message.length();
@@ -235,7 +698,7 @@ struct Consumer {
       const double processing_time_in_s = size_in_mb / rate_in_mbps;
 
       const double wait_end_ns = timestamp_ns + 1e9 * processing_time_in_s;
-      while (wall_time_ns() < wait_end_ns) {
+      while (time_ns() < wait_end_ns) {
         if (done_) {
           return;
         }
@@ -244,33 +707,314 @@ struct Consumer {
   }
 };
 
+// The consumer that accepts the messages in batches, to benchmark the `OnMessages()` code path.
+struct BatchConsumer : Consumer {
+  using Consumer::Consumer;
+
+  void OnMessages(const Message* begin, const Message* end, size_t dropped_count) {
+    if (!done_) {
+      ++total_batches_processed_;
+    }
+    for (const Message* it = begin; it != end; ++it) {
+      OnMessage(*it, dropped_count);
+      dropped_count = 0;
+    }
+  }
+};
+
+// `ArenaMQ` stores raw bytes, so for the benchmark the push timestamp is stored in front of the message body.
+template <typename T_CONSUMER>
+struct ArenaConsumerAdapter {
+  T_CONSUMER& consumer;
+  // Reused, so that after the first few messages its `body` does not need to allocate.
+  Message message;
+
+  void OnMessage(const char* data, size_t length, size_t dropped_count) {
+    ::memcpy(&message.pushed_ns, data, sizeof(double));
+    message.body.assign(data + sizeof(double), length - sizeof(double));
+    consumer.OnMessage(message, dropped_count);
+  }
+};
+
+template <typename CONSUMER, MQOverflowPolicy OVERFLOW_POLICY, MQWaitStrategy WAIT_STRATEGY>
+class ArenaMQForBenchmark final {
+ public:
+  typedef CONSUMER T_CONSUMER;
+
+  explicit ArenaMQForBenchmark(T_CONSUMER& consumer)
+      : adapter_{consumer, Message()}, queue_(adapter_, static_cast<size_t>(FLAGS_arena_kb) * 1024) {
+  }
+
+  void PushMessage(const Message& message) {
+    queue_.EmplaceMessage(sizeof(double) + message.body.length(), [&message](char* destination) {
+      ::memcpy(destination, &message.pushed_ns, sizeof(double));
+      ::memcpy(destination + sizeof(double), message.body.data(), message.body.length());
+    });
+  }
+
+ private:
+  ArenaConsumerAdapter<T_CONSUMER> adapter_;
+  ArenaMQ<ArenaConsumerAdapter<T_CONSUMER>, (1 << 20), OVERFLOW_POLICY, WAIT_STRATEGY> queue_;
+};
+
+// `PriorityMQ` takes the priority of each message, which for the benchmark is the index of its producer
+// modulo the number of priorities, and reports the drops per priority, which are printed at the end.
+template <typename T_CONSUMER>
+struct PriorityConsumerAdapter {
+  T_CONSUMER& consumer;
+  std::vector<size_t> dropped_by_priority;
+
+  void OnMessage(const Message& message, size_t priority, size_t dropped_count) {
+    dropped_by_priority[priority] += dropped_count;
+    consumer.OnMessage(message, dropped_count);
+  }
+};
+
+template <typename CONSUMER>
+class PriorityMQForBenchmark final {
+ public:
+  typedef CONSUMER T_CONSUMER;
+  typedef PriorityMQ<PriorityConsumerAdapter<T_CONSUMER>, Message> T_QUEUE;
+
+  explicit PriorityMQForBenchmark(T_CONSUMER& consumer)
+      : adapter_{consumer, std::vector<size_t>(T_QUEUE::kLevels)}, queue_(new T_QUEUE(adapter_)) {
+  }
+
+  // Flushes the queue first, for all the drops to be reported.
+  ~PriorityMQForBenchmark() {
+    queue_.reset();
+    printf("Dropped by priority:");
+    for (size_t dropped : adapter_.dropped_by_priority) {
+      printf(" %d", static_cast<int>(dropped));
+    }
+    printf("\n");
+  }
+
+  void PushMessage(const Message& message) {
+    queue_->PushMessage(message, PriorityOf(message));
+  }
+
+ private:
+  // The producer index is in the first two characters of the message, see `Producer::FillMessage()`.
+  static size_t PriorityOf(const Message& message) {
+    return static_cast<size_t>((message.body[0] - '0') * 10 + (message.body[1] - '0')) % T_QUEUE::kLevels;
+  }
+
+  PriorityConsumerAdapter<T_CONSUMER> adapter_;
+  std::unique_ptr<T_QUEUE> queue_;
+};
+
+// For "MultiConsumerMQKeyed": the messages from the same producer go to the same consumer, in order.
+// The producer index is in the first two characters of the message, see `Producer::FillMessage()`.
+struct ProducerIndexHasher {
+  size_t operator()(const Message& message) const {
+    return static_cast<size_t>((message.body[0] - '0') * 10 + (message.body[1] - '0'));
+  }
+};
+
+// How many consumers the queue needs, and how to construct it with them.
+// All the queues but `MultiConsumerMQ` have exactly one consumer.
+template <typename T_MESSAGE_QUEUE>
+struct QueueFactory {
+  static size_t NumberOfConsumers() {
+    return 1;
+  }
+  template <typename T_CONSUMER>
+  static T_MESSAGE_QUEUE* Create(std::vector<T_CONSUMER>& consumers) {
+    return new T_MESSAGE_QUEUE(consumers.front());
+  }
+};
+
+// With --spill_file, --linger_ms, --consumer_executor_threads, --pin and --numa, the queues that support those
+// are configured accordingly.
+template <typename C, typename M, size_t S, MQOverflowPolicy P, MQWaitStrategy W>
+struct QueueFactory<EfficientMQ<C, M, S, P, W>> {
+  static size_t NumberOfConsumers() {
+    return 1;
+  }
+  template <typename T_CONSUMER>
+  static EfficientMQ<C, M, S, P, W>* Create(std::vector<T_CONSUMER>& consumers) {
+    EfficientMQ<C, M, S, P, W>* queue =
+        FLAGS_consumer_executor_threads > 0
+            ? new EfficientMQ<C, M, S, P, W>(consumers.front(), Executor(), S, RingResource())
+            : new EfficientMQ<C, M, S, P, W>(consumers.front(), S, RingResource());
+    if (!FLAGS_spill_file.empty() &&
+        !queue->SetSpillFile(FLAGS_spill_file, static_cast<uint64_t>(FLAGS_spill_mb) * 1024 * 1024)) {
+      printf("Can not create the spill file '%s'.\n", FLAGS_spill_file.c_str());
+    }
+    if (FLAGS_linger_ms > 0) {
+      queue->SetLinger(std::chrono::milliseconds(FLAGS_linger_ms), static_cast<size_t>(FLAGS_max_batch_bytes));
+    }
+    if (FLAGS_pin) {
+      queue->PinConsumerThreadToCPU(0);
+    }
+    return queue;
+  }
+  static MQConsumerExecutor& Executor() {
+    static MQConsumerExecutor executor(static_cast<size_t>(FLAGS_consumer_executor_threads));
+    return executor;
+  }
+  static bricks::memory::MemoryResource* RingResource() {
+    if (!FLAGS_numa) {
+      return bricks::memory::NewDeleteResource();
+    }
+    static MQNUMANodeMemoryResource resource(FLAGS_pin ? MQNUMANodeOfCPU(0) : MQNUMANodeOfThisThread());
+    return &resource;
+  }
+};
+
+template <typename C, typename M, size_t S, ShardedMQMergeOrder O>
+struct QueueFactory<ShardedMQ<C, M, S, O>> {
+  static size_t NumberOfConsumers() {
+    return 1;
+  }
+  template <typename T_CONSUMER>
+  static ShardedMQ<C, M, S, O>* Create(std::vector<T_CONSUMER>& consumers) {
+    ShardedMQ<C, M, S, O>* queue = new ShardedMQ<C, M, S, O>(consumers.front(), S, FLAGS_numa);
+    if (FLAGS_pin) {
+      queue->PinConsumerThreadToCPU(0);
+    }
+    return queue;
+  }
+};
+
+template <typename C, typename M, typename H, size_t S, MQOverflowPolicy P, MQWaitStrategy W>
+struct QueueFactory<MultiConsumerMQ<C, M, H, S, P, W>> {
+  static size_t NumberOfConsumers() {
+    return static_cast<size_t>(std::max(1, FLAGS_consumers));
+  }
+  template <typename T_CONSUMER>
+  static MultiConsumerMQ<C, M, H, S, P, W>* Create(std::vector<T_CONSUMER>& consumers) {
+    return new MultiConsumerMQ<C, M, H, S, P, W>(consumers.data(), consumers.size());
+  }
+};
+
+template <typename C, typename M, size_t S, MQOverflowPolicy P, MQWaitStrategy W>
+struct QueueFactory<BroadcastMQ<C, M, S, P, W>> {
+  static size_t NumberOfConsumers() {
+    return static_cast<size_t>(std::max(1, FLAGS_consumers));
+  }
+  template <typename T_CONSUMER>
+  static BroadcastMQ<C, M, S, P, W>* Create(std::vector<T_CONSUMER>& consumers) {
+    return new BroadcastMQ<C, M, S, P, W>(consumers.data(), consumers.size());
+  }
+};
+
+// The results of the benchmark, for the --json output.
+struct BenchmarkResult {
+  std::string queue;
+  // With --replay_trace, the trace replayed, and how many times faster.
+  std::string trace;
+  double time_compression;
+  int push_threads;
+  int consumers;
+  bool pin;
+  bool numa;
+  double seconds;
+  uint64_t messages_pushed;
+  uint64_t bytes_pushed;
+  uint64_t messages_processed;
+  uint64_t bytes_processed;
+  uint64_t messages_dropped;
+  double allocations_per_message;
+  // With --perf_counters, those the host has.
+  std::map<std::string, double> perf_counters_per_message;
+  LatencyHistogram::Summary push_latency_ns;
+  LatencyHistogram::Summary end_to_end_latency_ns;
+
+  template <class A>
+  void serialize(A& ar) {
+    ar(CEREAL_NVP(queue),
+       CEREAL_NVP(trace),
+       CEREAL_NVP(time_compression),
+       CEREAL_NVP(push_threads),
+       CEREAL_NVP(consumers),
+       CEREAL_NVP(pin),
+       CEREAL_NVP(numa),
+       CEREAL_NVP(seconds),
+       CEREAL_NVP(messages_pushed),
+       CEREAL_NVP(bytes_pushed),
+       CEREAL_NVP(messages_processed),
+       CEREAL_NVP(bytes_processed),
+       CEREAL_NVP(messages_dropped),
+       CEREAL_NVP(allocations_per_message),
+       CEREAL_NVP(perf_counters_per_message),
+       CEREAL_NVP(push_latency_ns),
+       CEREAL_NVP(end_to_end_latency_ns));
+  }
+};
+
+// With --replay_trace, the events of each thread of the trace, loaded by `main()`.
+std::vector<std::vector<MQTraceEvent>> g_replay_trace;
+
+// The time the replay of the trace takes, in seconds.
+double ReplayTraceSeconds() {
+  uint64_t end_us = 0;
+  for (const std::vector<MQTraceEvent>& events : g_replay_trace) {
+    end_us = std::max(end_us, events.back().timestamp_us);
+  }
+  return 1e-6 * end_us / FLAGS_time_compression;
+}
+
 template <typename T_MESSAGE_QUEUE>
 void RunBenchmark(const std::string& queue_name) {
-  const int number_of_threads = FLAGS_push_threads;
-  const double benchmark_seconds = FLAGS_seconds;
-
-  printf(
-      "Benchmarking on %.2lf seconds:\n"
-      "  Queue %s\n"
-      "  %d threads pushing events at %.2lf MBPS each\n"
-      "  events being processed at %.2lf MBPS\n"
-      "  messages of average size %d bytes (%.2lf MB), with the minimum of %d bytes (%.2lf MB)\n",
-      benchmark_seconds,
-      queue_name.c_str(),
-      number_of_threads,
-      FLAGS_push_mbps_per_thread,
-      FLAGS_process_mbps,
-      FLAGS_average_message_length,
-      1e-6 * FLAGS_average_message_length,
-      FLAGS_min_message_length,
-      1e-6 * FLAGS_min_message_length);
+  typedef typename T_MESSAGE_QUEUE::T_CONSUMER T_CONSUMER;
+
+  const bool replay = !g_replay_trace.empty();
+  const int number_of_threads = replay ? static_cast<int>(g_replay_trace.size()) : FLAGS_push_threads;
+  const size_t number_of_consumers = QueueFactory<T_MESSAGE_QUEUE>::NumberOfConsumers();
+  const double benchmark_seconds = replay ? ReplayTraceSeconds() : FLAGS_seconds;
+
+  if (replay) {
+    printf(
+        "Replaying the trace '%s' on %.2lf seconds, %.2lf times faster than recorded:\n"
+        "  Queue %s\n"
+        "  %d threads pushing events\n"
+        "  events being processed by %d consumer(s) at %.2lf MBPS each\n"
+        "  threads %s, ring buffers %s\n",
+        FLAGS_replay_trace.c_str(),
+        benchmark_seconds,
+        FLAGS_time_compression,
+        queue_name.c_str(),
+        number_of_threads,
+        static_cast<int>(number_of_consumers),
+        FLAGS_process_mbps,
+        FLAGS_pin ? "pinned" : "not pinned",
+        FLAGS_numa ? "NUMA-local" : "placed by the allocator");
+  } else {
+    printf(
+        "Benchmarking on %.2lf seconds:\n"
+        "  Queue %s\n"
+        "  %d threads pushing events at %.2lf MBPS each\n"
+        "  events being processed by %d consumer(s) at %.2lf MBPS each\n"
+        "  messages of average size %d bytes (%.2lf MB), with the minimum of %d bytes (%.2lf MB)\n"
+        "  threads %s, ring buffers %s\n",
+        benchmark_seconds,
+        queue_name.c_str(),
+        number_of_threads,
+        FLAGS_push_mbps_per_thread,
+        static_cast<int>(number_of_consumers),
+        FLAGS_process_mbps,
+        FLAGS_average_message_length,
+        1e-6 * FLAGS_average_message_length,
+        FLAGS_min_message_length,
+        1e-6 * FLAGS_min_message_length,
+        FLAGS_pin ? "pinned" : "not pinned",
+        FLAGS_numa ? "NUMA-local" : "placed by the allocator");
+  }
 
   std::atomic_bool done(false);
 
-  Consumer consumer(done, FLAGS_process_mbps);
+  // Reserved upfront, since the queue keeps references to the consumers.
+  std::vector<T_CONSUMER> consumers;
+  consumers.reserve(number_of_consumers);
+  for (size_t i = 0; i < number_of_consumers; ++i) {
+    consumers.emplace_back(done, FLAGS_process_mbps, static_cast<int>(i));
+  }
 
   {
-    T_MESSAGE_QUEUE queue(consumer);
+    std::unique_ptr<T_MESSAGE_QUEUE> queue_holder(QueueFactory<T_MESSAGE_QUEUE>::Create(consumers));
+    T_MESSAGE_QUEUE& queue = *queue_holder;
 
     std::vector<std::unique_ptr<Producer<T_MESSAGE_QUEUE>>> producers(number_of_threads);
     for (size_t i = 0; i < number_of_threads; ++i) {
@@ -283,19 +1027,56 @@ void RunBenchmark(const std::string& queue_name) {
     }
 
     std::vector<std::thread> threads(number_of_threads);
+    const uint64_t allocations_before = g_allocations;
+    // Leave the producers some time to start, for the first events of the trace to be replayed on time.
+    const double begin_ns = time_ns() + (replay ? 1e7 : 0.0);
     for (size_t i = 0; i < number_of_threads; ++i) {
-      threads[i] =
-          std::thread(&Producer<T_MESSAGE_QUEUE>::RunProducingThread, producers[i].get(), std::ref(done));
+      producers[i]->trace_begin_ns_ = begin_ns;
+      if (replay) {
+        threads[i] = std::thread(&Producer<T_MESSAGE_QUEUE>::RunReplayingThread,
+                                 producers[i].get(),
+                                 std::ref(done),
+                                 std::cref(g_replay_trace[i]),
+                                 begin_ns,
+                                 FLAGS_time_compression);
+      } else {
+        threads[i] =
+            std::thread(&Producer<T_MESSAGE_QUEUE>::RunProducingThread, producers[i].get(), std::ref(done));
+      }
     }
 
-    std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<uint64_t>(1e3 * benchmark_seconds)));
-    if (FLAGS_log) {
-      printf("Finalizing the benchmark.\n");
+    if (replay) {
+      // The producers are done once the trace is over, then the queue has some time to catch up.
+      for (size_t i = 0; i < number_of_threads; ++i) {
+        threads[i].join();
+      }
+      std::this_thread::sleep_for(
+          std::chrono::milliseconds(static_cast<uint64_t>(1e3 * FLAGS_replay_drain_seconds)));
+      if (FLAGS_log) {
+        printf("Finalizing the benchmark.\n");
+      }
+      done = true;
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<uint64_t>(1e3 * benchmark_seconds)));
+      if (FLAGS_log) {
+        printf("Finalizing the benchmark.\n");
+      }
+      done = true;
+
+      for (size_t i = 0; i < number_of_threads; ++i) {
+        threads[i].join();
+      }
     }
-    done = true;
+    const uint64_t allocations = g_allocations - allocations_before;
 
-    for (size_t i = 0; i < number_of_threads; ++i) {
-      threads[i].join();
+    if (!FLAGS_record_trace.empty()) {
+      std::vector<MQTraceEvent> trace;
+      for (size_t i = 0; i < number_of_threads; ++i) {
+        trace.insert(trace.end(), producers[i]->trace_.begin(), producers[i]->trace_.end());
+      }
+      if (!SaveMQTrace(FLAGS_record_trace, std::move(trace))) {
+        printf("Can not save the trace into '%s'.\n", FLAGS_record_trace.c_str());
+      }
     }
 
     if (FLAGS_log) {
@@ -307,8 +1088,11 @@ void RunBenchmark(const std::string& queue_name) {
     uint64_t B = 0;                            // Total bytes pushed.
     int N2 = 0;                                // Total messages processed.
     uint64_t B2 = 0;                           // Total bytes processed.
-    int M = consumer.total_messages_dropped_;  // Messages dropped.
+    int M = 0;                                 // Messages dropped.
+    int NB = 0;                                // Batches processed, if the consumer takes batches.
     int C1ms = 0, C10ms = 0, C100ms = 0;       // Total messages that took longer than { 1ms, 10ms, 100ms }.
+    double T = 0.0;                            // Total time spent in `PushMessage()`, in nanoseconds.
+    double Tmax = 0.0;                         // Maximum time spent in one `PushMessage()`, in nanoseconds.
 
     for (size_t i = 0; i < number_of_threads; ++i) {
       N += producers[i]->number_of_messages_pushed_;
@@ -316,19 +1100,109 @@ void RunBenchmark(const std::string& queue_name) {
       C1ms += producers[i]->total_pushes_above_1ms_;
       C10ms += producers[i]->total_pushes_above_10ms_;
       C100ms += producers[i]->total_pushes_above_100ms_;
+      T += producers[i]->total_push_ns_;
+      Tmax = std::max(Tmax, producers[i]->max_push_ns_);
     }
 
-    N2 = consumer.total_messages_processed_;
-    B2 = consumer.total_bytes_processed_;
+    LatencyHistogram end_to_end_latency_ns;
+    for (const T_CONSUMER& consumer : consumers) {
+      N2 += consumer.total_messages_processed_;
+      B2 += consumer.total_bytes_processed_;
+      M += consumer.total_messages_dropped_;
+      NB += consumer.total_batches_processed_;
+      end_to_end_latency_ns.Merge(consumer.end_to_end_latency_ns_);
+    }
 
     printf("Total messages pushed:  %14d (%.3lf GB, %.3lf MB/s)\n", N, 1e-9 * B, 1e-6 * B / benchmark_seconds);
     printf(
         "Total messages parsed:  %14d (%.3lf GB, %.3lf MB/s)\n", N2, 1e-9 * B2, 1e-6 * B2 / benchmark_seconds);
     printf("Total messages dropped: %14d (%.2lf%%)\n", M, 100.0 * M / N);
+    if (NB) {
+      printf("Total batches parsed:   %14d (%.2lf messages per batch)\n", NB, static_cast<double>(N2) / NB);
+    }
 
     printf("Push time >= 1ms:   %18d (%.2lf%%)\n", C1ms, 100.0 * C1ms / N);
     printf("Push time >= 10ms:  %18d (%.2lf%%)\n", C10ms, 100.0 * C10ms / N);
     printf("Push time >= 100ms: %18d (%.2lf%%)\n", C100ms, 100.0 * C100ms / N);
+    printf("Push time total:    %15.3lfms (%.2lf%% of producers time)\n",
+           1e-6 * T,
+           100.0 * 1e-9 * T / (benchmark_seconds * number_of_threads));
+    printf("Push time average:  %15.3lfus\n", 1e-3 * T / N);
+    printf("Push time max:      %15.3lfms\n", 1e-6 * Tmax);
+    printf("Allocations:        %18llu (%.3lf per message)\n",
+           static_cast<unsigned long long>(allocations),
+           static_cast<double>(allocations) / N);
+
+    // The counters the host has, per message, keyed by their names.
+    std::map<std::string, double> perf_counters_per_message;
+    if (FLAGS_perf_counters) {
+      bricks::benchmark::PerfCounterValues perf_counter_values;
+      for (size_t i = 0; i < number_of_threads; ++i) {
+        perf_counter_values += producers[i]->perf_counter_values_;
+      }
+      for (size_t c = 0; c < bricks::benchmark::kNumberOfPerfCounters; ++c) {
+        if (perf_counter_values.available[c]) {
+          perf_counters_per_message[bricks::benchmark::PerfCounterName(c)] =
+              static_cast<double>(perf_counter_values.values[c]) / N;
+        }
+      }
+      if (perf_counters_per_message.empty()) {
+        printf("Performance counters: none available.\n");
+      }
+      for (const auto& counter : perf_counters_per_message) {
+        printf("Per message pushed, %-16s %15.3lf\n", (counter.first + ':').c_str(), counter.second);
+      }
+      const auto cycles = perf_counters_per_message.find("cycles");
+      const auto instructions = perf_counters_per_message.find("instructions");
+      if (cycles != perf_counters_per_message.end() && instructions != perf_counters_per_message.end() &&
+          cycles->second > 0) {
+        printf("Instructions per cycle:             %15.3lf\n", instructions->second / cycles->second);
+      }
+    }
+
+    LatencyHistogram push_latency_ns;
+    for (size_t i = 0; i < number_of_threads; ++i) {
+      push_latency_ns.Merge(producers[i]->push_latency_ns_);
+    }
+    const LatencyHistogram::Summary push = push_latency_ns.GetSummary();
+    const LatencyHistogram::Summary end_to_end = end_to_end_latency_ns.GetSummary();
+    printf("Latency, us:              p50          p90          p99        p99.9          max\n");
+    printf("  Push:        %12.3lf %12.3lf %12.3lf %12.3lf %12.3lf\n",
+           1e-3 * push.p50,
+           1e-3 * push.p90,
+           1e-3 * push.p99,
+           1e-3 * push.p999,
+           1e-3 * push.max);
+    printf("  End-to-end:  %12.3lf %12.3lf %12.3lf %12.3lf %12.3lf\n",
+           1e-3 * end_to_end.p50,
+           1e-3 * end_to_end.p90,
+           1e-3 * end_to_end.p99,
+           1e-3 * end_to_end.p999,
+           1e-3 * end_to_end.max);
+
+    if (!FLAGS_json.empty()) {
+      BenchmarkResult result;
+      result.queue = queue_name;
+      result.trace = FLAGS_replay_trace;
+      result.time_compression = replay ? FLAGS_time_compression : 1.0;
+      result.push_threads = number_of_threads;
+      result.consumers = static_cast<int>(number_of_consumers);
+      result.pin = FLAGS_pin;
+      result.numa = FLAGS_numa;
+      result.seconds = benchmark_seconds;
+      result.messages_pushed = N;
+      result.bytes_pushed = B;
+      result.messages_processed = N2;
+      result.bytes_processed = B2;
+      result.messages_dropped = M;
+      result.allocations_per_message = static_cast<double>(allocations) / N;
+      result.perf_counters_per_message = perf_counters_per_message;
+      result.push_latency_ns = push;
+      result.end_to_end_latency_ns = end_to_end;
+      std::ofstream fo(FLAGS_json);
+      cereal::JSONOutputArchive so(fo);
+      so(cereal::make_nvp("benchmark", result));
+    }
 
     if (FLAGS_log) {
       printf("\n");
@@ -341,16 +1215,125 @@ void RunBenchmark(const std::string& queue_name) {
   }
 }
 
+// The queues to benchmark with each --overflow_policy and --wait_strategy.
+template <MQOverflowPolicy P, MQWaitStrategy W>
+using EfficientMQForBenchmark = EfficientMQ<Consumer, Message, 1024, P, W>;
+template <MQOverflowPolicy P, MQWaitStrategy W>
+using EfficientMQBatchForBenchmark = EfficientMQ<BatchConsumer, Message, 1024, P, W>;
+template <MQOverflowPolicy P, MQWaitStrategy W>
+using MultiConsumerMQForBenchmark = MultiConsumerMQ<Consumer, Message, MQUnorderedDelivery, 1024, P, W>;
+template <MQOverflowPolicy P, MQWaitStrategy W>
+using MultiConsumerMQKeyedForBenchmark = MultiConsumerMQ<Consumer, Message, ProducerIndexHasher, 1024, P, W>;
+template <MQOverflowPolicy P, MQWaitStrategy W>
+using BroadcastMQForBenchmark = BroadcastMQ<Consumer, Message, 1024, P, W>;
+template <MQOverflowPolicy P, MQWaitStrategy W>
+using ArenaMQForBenchmarkWithConsumer = ArenaMQForBenchmark<Consumer, P, W>;
+// `SimpleMQ` has no overflow: it grows unbounded.
+template <MQOverflowPolicy, MQWaitStrategy W>
+using SimpleMQForBenchmark = SimpleMQ<Consumer, Message, W>;
+// Neither does `DoubleBufferMQ`.
+template <MQOverflowPolicy, MQWaitStrategy W>
+using DoubleBufferMQForBenchmark = DoubleBufferMQ<Consumer, Message, W>;
+// `ConflatingMQ` only overflows past 1024 keys, and there is one key per producer.
+template <MQOverflowPolicy, MQWaitStrategy W>
+using ConflatingMQForBenchmark =
+    ConflatingMQ<Consumer, Message, ProducerIndexHasher, 1024, MQOverflowPolicy::RejectNewest, W>;
+
+template <template <MQOverflowPolicy, MQWaitStrategy> class T_MESSAGE_QUEUE, MQOverflowPolicy P>
+bool RunBenchmarkWithWaitStrategy(const std::string& queue_name) {
+  const std::string name = queue_name + ", " + FLAGS_wait_strategy;
+  if (FLAGS_wait_strategy == "Adaptive") {
+    RunBenchmark<T_MESSAGE_QUEUE<P, MQWaitStrategy::Adaptive>>(name);
+  } else if (FLAGS_wait_strategy == "Park") {
+    RunBenchmark<T_MESSAGE_QUEUE<P, MQWaitStrategy::Park>>(name);
+  } else if (FLAGS_wait_strategy == "Spin") {
+    RunBenchmark<T_MESSAGE_QUEUE<P, MQWaitStrategy::Spin>>(name);
+  } else {
+    printf("Undefined wait strategy: '%s'.\n", FLAGS_wait_strategy.c_str());
+    return false;
+  }
+  return true;
+}
+
+template <template <MQOverflowPolicy, MQWaitStrategy> class T_MESSAGE_QUEUE>
+bool RunBenchmarkWithOverflowPolicy(const std::string& queue_name) {
+  const std::string name = queue_name + ", " + FLAGS_overflow_policy;
+  if (FLAGS_overflow_policy == "DropOldest") {
+    return RunBenchmarkWithWaitStrategy<T_MESSAGE_QUEUE, MQOverflowPolicy::DropOldest>(name);
+  } else if (FLAGS_overflow_policy == "BlockProducer") {
+    return RunBenchmarkWithWaitStrategy<T_MESSAGE_QUEUE, MQOverflowPolicy::BlockProducer>(name);
+  } else if (FLAGS_overflow_policy == "RejectNewest") {
+    return RunBenchmarkWithWaitStrategy<T_MESSAGE_QUEUE, MQOverflowPolicy::RejectNewest>(name);
+  } else {
+    printf("Undefined overflow policy: '%s'.\n", FLAGS_overflow_policy.c_str());
+    return false;
+  }
+}
+
 int main(int argc, char** argv) {
   if (!google::ParseCommandLineFlags(&argc, &argv, true)) {
     return -1;
   }
-  if (FLAGS_queue == "EfficientMQ") {
-    RunBenchmark<EfficientMQ<Consumer>>(FLAGS_queue);
+  if (!FLAGS_replay_trace.empty()) {
+    std::vector<MQTraceEvent> events;
+    if (!LoadMQTrace(FLAGS_replay_trace, events) || events.empty()) {
+      printf("Can not load the trace from '%s'.\n", FLAGS_replay_trace.c_str());
+      return -1;
+    }
+    if (!(FLAGS_time_compression > 0.0)) {
+      printf("--time_compression should be positive.\n");
+      return -1;
+    }
+    g_replay_trace = SplitMQTraceByThread(events);
+  }
+  // Calibrate the clock before the benchmark starts.
+  bricks::time::HighResolutionClock::Singleton();
+  if (FLAGS_queue == "ShardedMQ") {
+    RunBenchmark<ShardedMQ<Consumer, Message>>(FLAGS_queue);
+  } else if (FLAGS_queue == "ShardedMQOrdered") {
+    RunBenchmark<ShardedMQ<Consumer, Message, 1024, ShardedMQMergeOrder::BySequence>>(FLAGS_queue);
+  } else if (FLAGS_queue == "LockFreeMQ") {
+    RunBenchmark<LockFreeMQ<Consumer, Message>>(FLAGS_queue);
+  } else if (FLAGS_queue == "EfficientMQ") {
+    if (!RunBenchmarkWithOverflowPolicy<EfficientMQForBenchmark>(FLAGS_queue)) {
+      return -1;
+    }
+  } else if (FLAGS_queue == "EfficientMQBatch") {
+    if (!RunBenchmarkWithOverflowPolicy<EfficientMQBatchForBenchmark>(FLAGS_queue)) {
+      return -1;
+    }
+  } else if (FLAGS_queue == "ArenaMQ") {
+    if (!RunBenchmarkWithOverflowPolicy<ArenaMQForBenchmarkWithConsumer>(FLAGS_queue)) {
+      return -1;
+    }
+  } else if (FLAGS_queue == "MultiConsumerMQ") {
+    if (!RunBenchmarkWithOverflowPolicy<MultiConsumerMQForBenchmark>(FLAGS_queue)) {
+      return -1;
+    }
+  } else if (FLAGS_queue == "MultiConsumerMQKeyed") {
+    if (!RunBenchmarkWithOverflowPolicy<MultiConsumerMQKeyedForBenchmark>(FLAGS_queue)) {
+      return -1;
+    }
+  } else if (FLAGS_queue == "BroadcastMQ") {
+    if (!RunBenchmarkWithOverflowPolicy<BroadcastMQForBenchmark>(FLAGS_queue)) {
+      return -1;
+    }
+  } else if (FLAGS_queue == "PriorityMQ") {
+    RunBenchmark<PriorityMQForBenchmark<Consumer>>(FLAGS_queue);
+  } else if (FLAGS_queue == "DoubleBufferMQ") {
+    if (!RunBenchmarkWithWaitStrategy<DoubleBufferMQForBenchmark, MQOverflowPolicy::DropOldest>(FLAGS_queue)) {
+      return -1;
+    }
+  } else if (FLAGS_queue == "ConflatingMQ") {
+    if (!RunBenchmarkWithWaitStrategy<ConflatingMQForBenchmark, MQOverflowPolicy::RejectNewest>(FLAGS_queue)) {
+      return -1;
+    }
   } else if (FLAGS_queue == "SimpleMQ") {
-    RunBenchmark<SimpleMQ<Consumer>>(FLAGS_queue);
+    if (!RunBenchmarkWithWaitStrategy<SimpleMQForBenchmark, MQOverflowPolicy::DropOldest>(FLAGS_queue)) {
+      return -1;
+    }
   } else if (FLAGS_queue == "DummyMQ") {
-    RunBenchmark<DummyMQ<Consumer>>(FLAGS_queue);
+    RunBenchmark<DummyMQ<Consumer, Message>>(FLAGS_queue);
   } else {
     printf("Undefined queue implementation: '%s'.\n", FLAGS_queue.c_str());
     return -1;
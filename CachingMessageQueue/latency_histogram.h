@@ -0,0 +1,121 @@
+#ifndef SANDBOX_MQ_LATENCY_HISTOGRAM_H
+#define SANDBOX_MQ_LATENCY_HISTOGRAM_H
+
+// LatencyHistogram is a log-linear histogram of latencies, in nanoseconds, for the benchmark.
+// Each power of two is split into `kSubBuckets` linear buckets, so the relative error is under 1/kSubBuckets.
+// Recording is a few arithmetic operations and one increment, with no allocations.
+// Not thread safe: keep one instance per thread and `Merge()` them once done.
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "../Bricks/3party/cereal/include/cereal.hpp"
+
+class LatencyHistogram final {
+ public:
+  enum { kSubBucketBits = 4, kSubBuckets = 1 << kSubBucketBits };
+  enum { kNumberOfBuckets = (64 - kSubBucketBits + 1) * kSubBuckets };
+
+  LatencyHistogram() : buckets_(kNumberOfBuckets) {
+  }
+
+  void Record(uint64_t value) {
+    ++buckets_[BucketIndex(value)];
+    ++count_;
+    max_ = std::max(max_, value);
+  }
+
+  void Merge(const LatencyHistogram& rhs) {
+    for (size_t i = 0; i < kNumberOfBuckets; ++i) {
+      buckets_[i] += rhs.buckets_[i];
+    }
+    count_ += rhs.count_;
+    max_ = std::max(max_, rhs.max_);
+  }
+
+  uint64_t Count() const {
+    return count_;
+  }
+
+  uint64_t Max() const {
+    return max_;
+  }
+
+  // Returns the value below which the `percentile` (0 to 100) of the recorded values lie.
+  // The returned value is the upper bound of the respective bucket, capped by the maximum value seen.
+  uint64_t Percentile(double percentile) const {
+    if (!count_) {
+      return 0;
+    }
+    const uint64_t rank = std::max(static_cast<uint64_t>(1),
+                                   static_cast<uint64_t>(percentile * 1e-2 * static_cast<double>(count_) + 0.5));
+    uint64_t total = 0;
+    for (size_t i = 0; i < kNumberOfBuckets; ++i) {
+      total += buckets_[i];
+      if (total >= rank) {
+        return std::min(max_, BucketUpperBound(i));
+      }
+    }
+    return max_;
+  }
+
+  // The summary to report, in nanoseconds.
+  struct Summary {
+    uint64_t count;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+
+    template <class A>
+    void serialize(A& ar) {
+      ar(CEREAL_NVP(count),
+         CEREAL_NVP(p50),
+         CEREAL_NVP(p90),
+         CEREAL_NVP(p99),
+         CEREAL_NVP(p999),
+         CEREAL_NVP(max));
+    }
+  };
+
+  Summary GetSummary() const {
+    Summary summary;
+    summary.count = count_;
+    summary.p50 = Percentile(50);
+    summary.p90 = Percentile(90);
+    summary.p99 = Percentile(99);
+    summary.p999 = Percentile(99.9);
+    summary.max = max_;
+    return summary;
+  }
+
+ private:
+  // Values below `kSubBuckets` get a bucket each. Above that, the bucket is determined by the position
+  // of the most significant bit and the `kSubBucketBits` bits following it.
+  static size_t BucketIndex(uint64_t value) {
+    if (value < kSubBuckets) {
+      return static_cast<size_t>(value);
+    }
+    const int msb = 63 - __builtin_clzll(value);
+    const size_t sub_bucket = static_cast<size_t>(value >> (msb - kSubBucketBits)) & (kSubBuckets - 1);
+    return static_cast<size_t>(msb - kSubBucketBits + 1) * kSubBuckets + sub_bucket;
+  }
+
+  static uint64_t BucketUpperBound(size_t index) {
+    if (index < kSubBuckets) {
+      return index;
+    }
+    const int msb = static_cast<int>(index / kSubBuckets) + kSubBucketBits - 1;
+    const uint64_t sub_bucket = index % kSubBuckets;
+    const uint64_t lower = (static_cast<uint64_t>(kSubBuckets) + sub_bucket) << (msb - kSubBucketBits);
+    return lower + ((static_cast<uint64_t>(1) << (msb - kSubBucketBits)) - 1);
+  }
+
+  std::vector<uint64_t> buckets_;
+  uint64_t count_ = 0;
+  uint64_t max_ = 0;
+};
+
+#endif  // SANDBOX_MQ_LATENCY_HISTOGRAM_H
@@ -0,0 +1,151 @@
+#ifndef SANDBOX_MQ_AFFINITY_H
+#define SANDBOX_MQ_AFFINITY_H
+
+// CPU and NUMA placement for the message queues, on multi-socket hosts.
+// * `MQPinThreadToCPU()` pins a thread, such as the consumer thread of a queue, to one CPU.
+// * `MQNUMANodeOfCPU()` and `MQNUMANodeOfThisThread()` tell which NUMA node the memory should be local to.
+// * `MQNUMANodeMemoryResource` allocates the memory on the given node, for the ring buffers of the queues
+//   to be passed to their constructors, see `EfficientMQ`, and `ShardedMQ` with `numa_local_shards`.
+//
+// All of it is best effort, with no dependency on libnuma: on a single-node host, on a kernel without
+// NUMA support, or outside of Linux, the threads stay where they are and the memory is allocated as usual.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <thread>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "../Bricks/memory/memory_resource.h"
+
+// Returns false if the thread could not be pinned, such as when the CPU is outside of the affinity mask
+// the process was started with.
+inline bool MQPinThreadToCPU(std::thread::native_handle_type thread, int cpu) {
+#if defined(__linux__)
+  if (cpu < 0 || cpu >= CPU_SETSIZE) {
+    return false;
+  }
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  return !::pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+#else
+  static_cast<void>(thread);
+  static_cast<void>(cpu);
+  return false;
+#endif
+}
+
+inline bool MQPinThisThreadToCPU(int cpu) {
+#if defined(__linux__)
+  return MQPinThreadToCPU(::pthread_self(), cpu);
+#else
+  static_cast<void>(cpu);
+  return false;
+#endif
+}
+
+// The NUMA node of the CPU, from `/sys/devices/system/cpu/cpu{cpu}/node{node}`, or -1 if unknown.
+inline int MQNUMANodeOfCPU(int cpu) {
+  int node = -1;
+#if defined(__linux__)
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  if (DIR* dir = ::opendir(path)) {
+    while (const struct dirent* entry = ::readdir(dir)) {
+      int n;
+      char c;
+      if (sscanf(entry->d_name, "node%d%c", &n, &c) == 1) {
+        node = n;
+        break;
+      }
+    }
+    ::closedir(dir);
+  }
+#else
+  static_cast<void>(cpu);
+#endif
+  return node;
+}
+
+// The NUMA node of the CPU the calling thread is running on, or -1 if unknown.
+// Unless the thread is pinned, it may be on a different node by the time the call returns.
+inline int MQNUMANodeOfThisThread() {
+#if defined(__linux__) && defined(SYS_getcpu)
+  unsigned cpu;
+  unsigned node;
+  if (!::syscall(SYS_getcpu, &cpu, &node, nullptr)) {
+    return static_cast<int>(node);
+  }
+#endif
+  return -1;
+}
+
+// Maps each allocation separately, with `mmap()`, and binds it to `node` with `mbind(MPOL_PREFERRED)`,
+// so that the pages come from that node if it has free memory, regardless of which thread touches them first.
+// Meant for the ring buffers, allocated once per queue or per shard: each allocation costs a system call
+// and takes whole pages. With `node` of -1, or if `mbind()` fails, the pages are placed by the kernel.
+// THREAD SAFE.
+class MQNUMANodeMemoryResource final : public bricks::memory::MemoryResource {
+ public:
+  explicit MQNUMANodeMemoryResource(int node) : node_(node) {}
+
+  int Node() const { return node_; }
+
+ private:
+  void* DoAllocate(size_t bytes, size_t alignment) override {
+#if defined(__linux__)
+    static_cast<void>(alignment);  // The pages are aligned enough.
+    const size_t length = PageAlignedLength(bytes);
+    void* p = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+#if defined(SYS_mbind)
+    if (node_ >= 0 && node_ < static_cast<int>(8 * sizeof(unsigned long))) {
+      const int kMPOLPreferred = 1;
+      const unsigned long nodemask = 1ul << node_;
+      // The kernel expects one more than the number of bits in the mask.
+      ::syscall(SYS_mbind, p, length, kMPOLPreferred, &nodemask, 8 * sizeof(nodemask) + 1, 0);
+    }
+#endif
+    return p;
+#else
+    return bricks::memory::NewDeleteResource()->Allocate(bytes, alignment);
+#endif
+  }
+
+  void DoDeallocate(void* p, size_t bytes, size_t alignment) override {
+#if defined(__linux__)
+    static_cast<void>(alignment);
+    ::munmap(p, PageAlignedLength(bytes));
+#else
+    bricks::memory::NewDeleteResource()->Deallocate(p, bytes, alignment);
+#endif
+  }
+
+  bool DoIsEqual(const bricks::memory::MemoryResource& other) const override {
+    return dynamic_cast<const MQNUMANodeMemoryResource*>(&other) != nullptr;
+  }
+
+#if defined(__linux__)
+  static size_t PageAlignedLength(size_t bytes) {
+    static const size_t page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    return (std::max(bytes, static_cast<size_t>(1)) + page_size - 1) / page_size * page_size;
+  }
+#endif
+
+  const int node_;
+};
+
+#endif  // SANDBOX_MQ_AFFINITY_H
@@ -0,0 +1,322 @@
+#ifndef SANDBOX_MQ_ARENA_H
+#define SANDBOX_MQ_ARENA_H
+
+// ArenaMQ is the EfficientMQ whose capacity is set in bytes, not in messages.
+// Intent:    To have the memory footprint of the queue fixed and known upfront, regardless of message sizes.
+// Objective: Messages are stored back-to-back in one preallocated byte ring, no per-message heap allocations.
+//
+// Each message is stored as an 8-byte record header, followed by the message bytes, padded to 8 bytes.
+// A record never wraps around the end of the ring: if it does not fit, a padding record fills the rest of it.
+//
+// The overflow is accounted for in bytes: a message is accepted iff its record fits into the free space.
+// With `MQOverflowPolicy::DropOldest`, the oldest messages are dropped to make room for the new one, unless
+// they are being exported by the consumer at the moment, in which case the new message is rejected instead.
+// A message larger than the whole ring is always rejected.
+//
+// Since the messages are raw bytes in the arena, the consumer gets pointers into it, valid for the duration
+// of the call, instead of `std::string`-s.
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mq_overflow_policy.h"
+#include "mq_wait_strategy.h"
+
+template <typename CONSUMER,
+          size_t DEFAULT_CAPACITY_IN_BYTES = (1 << 20),
+          MQOverflowPolicy OVERFLOW_POLICY = MQOverflowPolicy::DropOldest,
+          MQWaitStrategy WAIT_STRATEGY = MQWaitStrategy::Adaptive>
+class ArenaMQ final {
+ public:
+  // Type of the processor of the entries.
+  // It should expose one method,
+  // void OnMessage(const char* data, size_t length, size_t number_of_dropped_events_if_any);
+  // This method will be called from one thread, which is spawned and owned by an instance of ArenaMQ.
+  typedef CONSUMER T_CONSUMER;
+
+  // The number of times a blocked producer re-checks for room before waiting on the condition variable.
+  enum { kBlockedProducerSpinIterations = 64 };
+
+  // The only constructor requires the refence to the instance of the consumer of entries.
+  // The capacity is rounded up to a multiple of 8 bytes.
+  explicit ArenaMQ(T_CONSUMER& consumer, size_t capacity_in_bytes = DEFAULT_CAPACITY_IN_BYTES)
+      : consumer_(consumer),
+        capacity_((capacity_in_bytes + kAlignment - 1) & ~static_cast<size_t>(kAlignment - 1)),
+        arena_(capacity_ / sizeof(uint64_t)),
+        consumer_thread_(&ArenaMQ::ConsumerThread, this) {
+  }
+
+  // Destructor waits for the consumer thread to terminate, which implies committing all the queued events.
+  ~ArenaMQ() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      destructing_ = true;
+      ++version_;
+    }
+    condition_variable_.notify_all();
+    consumer_thread_.join();
+  }
+
+  // Adds an message to the arena.
+  // Returns false if the message was rejected.
+  // THREAD SAFE. Blocks the calling thread for as short period of time as possible,
+  // unless `MQOverflowPolicy::BlockProducer` is used and the arena is full.
+  bool PushMessage(const std::string& message) {
+    return PushMessage(message.data(), message.length());
+  }
+  bool PushMessage(const char* data, size_t length) {
+    return EmplaceMessage(length, [data, length](char* destination) { ::memcpy(destination, data, length); });
+  }
+
+  // Reserves `length` bytes in the arena and calls `writer(char* destination)` to populate them in place.
+  // The writer should not throw, as the record would then never be committed.
+  // Returns false if the message was rejected; the writer is not called then.
+  // THREAD SAFE.
+  template <typename F>
+  bool EmplaceMessage(size_t length, F&& writer) {
+    uint64_t position;
+    if (!PushEventAllocate(length, position)) {
+      return false;
+    }
+    writer(Data(position));
+    PushEventCommit(position);
+    return true;
+  }
+
+  // The total number of bytes of the messages that have been dropped or rejected. THREAD SAFE.
+  uint64_t TotalBytesDropped() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return total_bytes_dropped_;
+  }
+
+ private:
+  ArenaMQ(const ArenaMQ&) = delete;
+  ArenaMQ(ArenaMQ&&) = delete;
+  void operator=(const ArenaMQ&) = delete;
+  void operator=(ArenaMQ&&) = delete;
+
+  enum { kAlignment = 8 };
+  enum class RecordState : uint32_t { Allocated = 0, Finalized = 1, Padding = 2 };
+
+  struct RecordHeader {
+    uint32_t length;
+    RecordState state;
+  };
+  static_assert(sizeof(RecordHeader) == kAlignment, "The record header should be exactly 8 bytes.");
+
+  static uint64_t RecordSize(size_t length) {
+    return (sizeof(RecordHeader) + length + kAlignment - 1) & ~static_cast<uint64_t>(kAlignment - 1);
+  }
+
+  // The positions are ever-increasing byte offsets. The offset in the arena is taken modulo its capacity.
+  RecordHeader& Header(uint64_t position) {
+    return *reinterpret_cast<RecordHeader*>(reinterpret_cast<char*>(arena_.data()) + position % capacity_);
+  }
+  char* Data(uint64_t position) {
+    return reinterpret_cast<char*>(&Header(position)) + sizeof(RecordHeader);
+  }
+
+  // The number of bytes to allocate for the record at the head, including the padding before it, if any.
+  uint64_t BytesNeeded(uint64_t record_size) const {
+    const uint64_t offset = head_allocated_ % capacity_;
+    return (offset + record_size <= capacity_) ? record_size : (capacity_ - offset) + record_size;
+  }
+
+  // Drops the record at the tail, if it is finalized and is not being exported. MUTEX-LOCKED.
+  bool DropOldestRecord() {
+    if (tail_ != export_end_ || tail_ == head_ready_) {
+      return false;
+    }
+    const RecordHeader& header = Header(tail_);
+    if (header.state != RecordState::Padding) {
+      ++number_of_dropped_events_;
+      total_bytes_dropped_ += header.length;
+    }
+    tail_ += RecordSize(header.length);
+    export_end_ = tail_;
+    return true;
+  }
+
+  bool PushEventAllocate(size_t length, uint64_t& position) {
+    // First, allocate room in the arena for this message.
+    // Handle the overflow according to the policy.
+    // MUTEX-LOCKED.
+    std::unique_lock<std::mutex> lock(mutex_);
+    const uint64_t record_size = RecordSize(length);
+    if (record_size > capacity_ || length > UINT32_MAX) {
+      ++number_of_dropped_events_;
+      total_bytes_dropped_ += length;
+      return false;
+    }
+    size_t spin = 0;
+    while (head_allocated_ + BytesNeeded(record_size) - tail_ > capacity_) {
+      if (OVERFLOW_POLICY == MQOverflowPolicy::DropOldest && DropOldestRecord()) {
+        continue;
+      }
+      if (OVERFLOW_POLICY == MQOverflowPolicy::BlockProducer) {
+        if (spin < kBlockedProducerSpinIterations) {
+          ++spin;
+          lock.unlock();
+          std::this_thread::yield();
+          lock.lock();
+        } else {
+          ++number_of_blocked_producers_;
+          producers_condition_variable_.wait(lock);
+          --number_of_blocked_producers_;
+        }
+        continue;
+      }
+      ++number_of_dropped_events_;
+      total_bytes_dropped_ += length;
+      return false;
+    }
+    const uint64_t padding = BytesNeeded(record_size) - record_size;
+    if (padding) {
+      RecordHeader& header = Header(head_allocated_);
+      header.length = static_cast<uint32_t>(padding - sizeof(RecordHeader));
+      header.state = RecordState::Padding;
+      head_allocated_ += padding;
+    }
+    position = head_allocated_;
+    RecordHeader& header = Header(position);
+    header.length = static_cast<uint32_t>(length);
+    // Mark this message as incomplete, not yet ready to be sent over to the consumer.
+    header.state = RecordState::Allocated;
+    head_allocated_ += record_size;
+    return true;
+  }
+
+  void PushEventCommit(const uint64_t position) {
+    // After the message has been copied over, mark it as finalized and advance `head_ready_`.
+    // MUTEX-LOCKED, except for the notification, which is only needed if the consumer is parked.
+    bool notify;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Header(position).state = RecordState::Finalized;
+      while (head_ready_ != head_allocated_ && Header(head_ready_).state != RecordState::Allocated) {
+        head_ready_ += RecordSize(Header(head_ready_).length);
+      }
+      ++version_;
+      notify = consumer_parked_;
+    }
+    if (notify) {
+      condition_variable_.notify_one();
+    }
+  }
+
+  // Spins and/or yields with the mutex released, as long as the wait strategy permits, then parks.
+  // MUTEX-LOCKED on entry and on exit.
+  void WaitForRecords(std::unique_lock<std::mutex>& lock) {
+    const size_t seen = version_;
+    lock.unlock();
+    const bool changed = MQConsumerWait<WAIT_STRATEGY>::WaitForChange(version_, seen);
+    lock.lock();
+    if (!changed && head_ready_ == tail_ && !destructing_) {
+      consumer_parked_ = true;
+      condition_variable_.wait(lock, [this] { return head_ready_ != tail_ || destructing_; });
+      consumer_parked_ = false;
+    }
+  }
+
+  // The thread which extracts fully populated records from the tail of the arena and exports them.
+  // All the records ready by the time the consumer thread wakes up are exported as one batch.
+  void ConsumerThread() {
+    while (true) {
+      uint64_t begin;
+      uint64_t end;
+      size_t this_time_dropped_events;
+      {
+        // First, get the range of records to export. Wait until at least one is finalized.
+        // MUTEX-LOCKED, except for the waiting part.
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (head_ready_ == tail_) {
+          if (destructing_) {
+            // Nothing left to export.
+            return;
+          }
+          WaitForRecords(lock);
+        }
+        begin = tail_;
+        end = head_ready_;
+        export_end_ = end;
+        this_time_dropped_events = number_of_dropped_events_;
+        number_of_dropped_events_ = 0;
+      }
+
+      {
+        // Then, export the records.
+        // NO MUTEX REQUIRED, the records in [tail_, export_end_) are not touched by the producers.
+        for (uint64_t position = begin; position != end;) {
+          const RecordHeader& header = Header(position);
+          if (header.state != RecordState::Padding) {
+            consumer_.OnMessage(Data(position), header.length, this_time_dropped_events);
+            this_time_dropped_events = 0;
+          }
+          position += RecordSize(header.length);
+        }
+      }
+
+      {
+        // Finally, release the exported records.
+        // MUTEX-LOCKED.
+        std::lock_guard<std::mutex> lock(mutex_);
+        tail_ = end;
+        number_of_dropped_events_ += this_time_dropped_events;
+        if (OVERFLOW_POLICY == MQOverflowPolicy::BlockProducer && number_of_blocked_producers_) {
+          producers_condition_variable_.notify_all();
+        }
+      }
+    }
+  }
+
+  // The instance of the consuming side of the FIFO buffer.
+  T_CONSUMER& consumer_;
+
+  // The capacity of the arena, in bytes, a multiple of 8.
+  const uint64_t capacity_;
+
+  // The arena, as 64-bit words, to have the record headers aligned.
+  std::vector<uint64_t> arena_;
+
+  // The byte positions:
+  // 1) `tail_`: The first record not yet released by the consumer.
+  // 2) `export_end_`: The end of the range being exported by the consumer, equals `tail_` when it is idle.
+  // 3) `head_ready_`: The end of the range of finalized records.
+  // 4) `head_allocated_`: The end of the allocated records.
+  // The order is always tail_ <= export_end_ <= head_ready_ <= head_allocated_ <= tail_ + capacity_.
+  // All of them, and the record headers past `export_end_`, are guarded by one mutex.
+  uint64_t tail_ = 0;
+  uint64_t export_end_ = 0;
+  uint64_t head_ready_ = 0;
+  uint64_t head_allocated_ = 0;
+
+  // The number of messages dropped or rejected since the last export, and the total size of all dropped ones.
+  size_t number_of_dropped_events_ = 0;
+  uint64_t total_bytes_dropped_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable condition_variable_;
+
+  // Waiting of the consumer thread, see `MQWaitStrategy` and `EfficientMQ`. Both are updated under `mutex_`.
+  std::atomic_size_t version_{0};
+  bool consumer_parked_ = false;
+
+  // For `MQOverflowPolicy::BlockProducer`, the producers waiting for room in the arena.
+  size_t number_of_blocked_producers_ = 0;
+  std::condition_variable producers_condition_variable_;
+
+  // For safe thread destruction.
+  bool destructing_ = false;
+
+  // The thread in which the consuming process is running.
+  // Declared last, since it should only be started once all the other members have been initialized.
+  std::thread consumer_thread_;
+};
+
+#endif  // SANDBOX_MQ_ARENA_H
@@ -0,0 +1,391 @@
+#ifndef SANDBOX_MQ_BROADCAST_H
+#define SANDBOX_MQ_BROADCAST_H
+
+// BroadcastMQ delivers every message to each of its consumers, from one shared circular buffer.
+// Intent:    To feed the same stream of events into several sinks without a queue and a copy per sink.
+// Objective: Each message is stored once, and each consumer thread advances its own cursor over it.
+//
+// The producers claim the positions in the buffer one at a time, populate the slots concurrently, and publish
+// them in order. Each consumer has a dedicated thread, which exports the published messages one by one,
+// with no lock held. A slot is only reused once every cursor has passed it, thus when the producers
+// catch up with the slowest consumer, the overflow policy is applied per that consumer:
+// * `MQOverflowPolicy::DropOldest`: The cursors of the lagging consumers are moved forward, and the messages
+//   skipped are reported to each of them as its own `number_of_dropped_events`. The other consumers lose
+//   nothing. Never blocks: if a lagging consumer is in the middle of exporting the message being overwritten,
+//   the slot gets a spare message object, and the one being exported is reused once it has been exported.
+// * `MQOverflowPolicy::BlockProducer`: The producers wait for the slowest consumer. Lossless.
+// * `MQOverflowPolicy::RejectNewest`: The message is not added, and is reported as dropped to every consumer.
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "mq_overflow_policy.h"
+#include "mq_wait_strategy.h"
+
+template <typename CONSUMER,
+          typename MESSAGE = std::string,
+          size_t DEFAULT_BUFFER_SIZE = 1024,
+          MQOverflowPolicy OVERFLOW_POLICY = MQOverflowPolicy::DropOldest,
+          MQWaitStrategy WAIT_STRATEGY = MQWaitStrategy::Adaptive>
+class BroadcastMQ final {
+ public:
+  // Type of entries to store, defaults to `std::string`.
+  typedef MESSAGE T_MESSAGE;
+
+  // Type of the processor of the entries.
+  // It should expose one method, void OnMessage(const T_MESSAGE&, size_t number_of_dropped_events_if_any);
+  // Each consumer is called from its own thread, which is spawned and owned by an instance of BroadcastMQ.
+  typedef CONSUMER T_CONSUMER;
+
+  // The consumers can be added later on with `AddConsumer()`.
+  explicit BroadcastMQ(size_t buffer_size = DEFAULT_BUFFER_SIZE)
+      : circular_buffer_size_(buffer_size), circular_buffer_(buffer_size), finalized_(buffer_size) {
+    for (std::atomic<T_MESSAGE*>& slot : circular_buffer_) {
+      slot = NewMessage();
+    }
+  }
+
+  BroadcastMQ(T_CONSUMER* consumers, size_t number_of_consumers, size_t buffer_size = DEFAULT_BUFFER_SIZE)
+      : BroadcastMQ(buffer_size) {
+    for (size_t i = 0; i < number_of_consumers; ++i) {
+      AddConsumer(consumers[i]);
+    }
+  }
+
+  // Destructor waits for the consumer threads to terminate, which implies each of them exporting
+  // all the messages queued for it.
+  ~BroadcastMQ() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      destructing_ = true;
+      ++version_;
+    }
+    condition_variable_.notify_all();
+    for (std::unique_ptr<Cursor>& cursor : cursors_) {
+      cursor->thread.join();
+    }
+  }
+
+  // Registers one more consumer, which gets the messages pushed after this call returns.
+  // Returns its index. THREAD SAFE.
+  size_t AddConsumer(T_CONSUMER& consumer) {
+    std::lock_guard<std::mutex> lock(allocate_mutex_);
+    cursors_.emplace_back(new Cursor(consumer, head_allocated_));
+    Cursor& cursor = *cursors_.back();
+    cursor.thread = std::thread(&BroadcastMQ::ConsumerThread, this, std::ref(cursor));
+    return cursors_.size() - 1;
+  }
+
+  size_t NumberOfConsumers() const {
+    std::lock_guard<std::mutex> lock(allocate_mutex_);
+    return cursors_.size();
+  }
+
+  // Adds an message to the buffer, for each consumer to export it.
+  // Supports both copy and move semantics.
+  // Returns false if the message was rejected, which only happens with `MQOverflowPolicy::RejectNewest`.
+  // THREAD SAFE. Blocks the calling thread for as short period of time as possible,
+  // unless `MQOverflowPolicy::BlockProducer` is used and the slowest consumer is a buffer behind.
+  bool PushMessage(const T_MESSAGE& message) {
+    size_t position;
+    T_MESSAGE* slot;
+    if (!PushEventAllocate(position, slot)) {
+      return false;
+    }
+    *slot = message;
+    PushEventCommit(position);
+    return true;
+  }
+  bool PushMessage(T_MESSAGE&& message) {
+    size_t position;
+    T_MESSAGE* slot;
+    if (!PushEventAllocate(position, slot)) {
+      return false;
+    }
+    *slot = std::move(message);
+    PushEventCommit(position);
+    return true;
+  }
+
+  // Adds a message to the buffer by constructing it in place, in the storage of the slot,
+  // see `EfficientMQ::EmplaceMessage()`.
+  // The writer should not throw, as the slot would then never be published.
+  // Returns false if the message was rejected, which only happens with `MQOverflowPolicy::RejectNewest`.
+  // THREAD SAFE.
+  template <typename F>
+  bool EmplaceMessage(size_t length, F&& writer) {
+    size_t position;
+    T_MESSAGE* slot;
+    if (!PushEventAllocate(position, slot)) {
+      return false;
+    }
+    slot->resize(length);
+    writer(*slot);
+    PushEventCommit(position);
+    return true;
+  }
+
+ private:
+  BroadcastMQ(const BroadcastMQ&) = delete;
+  BroadcastMQ(BroadcastMQ&&) = delete;
+  void operator=(const BroadcastMQ&) = delete;
+  void operator=(BroadcastMQ&&) = delete;
+
+  // The number of `yield()`-s a producer blocked on the slowest consumer makes before waiting.
+  enum { kBlockedProducerSpinIterations = 64 };
+
+  // The state of the cursor is `(position << 1) | reading`, where `position` is the logical, ever-increasing,
+  // index of the next message for the consumer to export, and `reading` is set while the consumer is exporting
+  // the message at `reading_position`, which is then before `position`.
+  // The consumer thread sets `reading` along with moving `position` forward, and then clears it.
+  // With `MQOverflowPolicy::DropOldest`, the producers move `position` forward too, keeping `reading` as is.
+  struct Cursor {
+    T_CONSUMER& consumer;
+    std::atomic_size_t state;
+    std::atomic_size_t reading_position{0};
+    // With `MQOverflowPolicy::RejectNewest`, the messages rejected since the consumer has last been called.
+    std::atomic_size_t number_of_dropped_events{0};
+    // The position of the next message, unless the producers have moved the cursor past it.
+    // Only accessed by the consumer thread.
+    size_t expected_position;
+    std::thread thread;
+
+    Cursor(T_CONSUMER& consumer, size_t position)
+        : consumer(consumer), state(position << 1), expected_position(position) {}
+  };
+
+  static size_t PositionOf(size_t state) {
+    return state >> 1;
+  }
+  static bool Reading(size_t state) {
+    return state & 1;
+  }
+
+  // Whether the consumer may be exporting the message at `position`.
+  // No false negatives, since `reading_position` is only updated before `reading` is set.
+  static bool ReadingMessage(const Cursor& cursor, size_t position) {
+    return Reading(cursor.state.load()) && cursor.reading_position.load() == position;
+  }
+
+  // Whether the slot holding the message at `victim` can not be reused yet, as far as this cursor is concerned.
+  static bool Lagging(const Cursor& cursor, size_t victim) {
+    return PositionOf(cursor.state.load()) <= victim || ReadingMessage(cursor, victim);
+  }
+
+  // The thread which exports the messages to one consumer, following its cursor.
+  void ConsumerThread(Cursor& cursor) {
+    while (true) {
+      // Only this thread sets `reading`, thus it is not set here.
+      size_t state = cursor.state.load();
+      const size_t position = PositionOf(state);
+      if (position >= head_ready_.load(std::memory_order_acquire)) {
+        // Nothing to export. Spin or wait, depending on the strategy, and park if it is taking too long.
+        const size_t seen = version_.load(std::memory_order_acquire);
+        if (position < head_ready_.load(std::memory_order_acquire)) {
+          continue;
+        }
+        if (destructing_) {
+          // Nothing left to export.
+          return;
+        }
+        if (!MQConsumerWait<WAIT_STRATEGY>::WaitForChange(version_, seen)) {
+          std::unique_lock<std::mutex> lock(mutex_);
+          ++number_of_parked_consumers_;
+          condition_variable_.wait(lock, [this, &cursor] {
+            return PositionOf(cursor.state.load()) < head_ready_.load() || destructing_;
+          });
+          --number_of_parked_consumers_;
+        }
+        continue;
+      }
+      // Claim the message, unless a producer has just moved the cursor past it.
+      // The slot is read first, since a producer only swaps it for a spare once it sees `reading` set.
+      const T_MESSAGE* message = circular_buffer_[position % circular_buffer_size_].load();
+      cursor.reading_position = position;
+      if (!cursor.state.compare_exchange_strong(state, ((position + 1) << 1) | 1)) {
+        continue;
+      }
+      // The messages skipped by the producers, plus those rejected.
+      const size_t dropped = (position - cursor.expected_position) + cursor.number_of_dropped_events.exchange(0);
+      cursor.expected_position = position + 1;
+      // NO MUTEX REQUIRED: the message is not overwritten while the cursor is reading it.
+      cursor.consumer.OnMessage(*message, dropped);
+      cursor.state.fetch_and(~static_cast<size_t>(1));
+      if (OVERFLOW_POLICY == MQOverflowPolicy::BlockProducer && number_of_blocked_producers_.load()) {
+        std::lock_guard<std::mutex> lock(producers_mutex_);
+        producers_condition_variable_.notify_all();
+      }
+    }
+  }
+
+  // Claims the next position in the buffer, once the slot for it has been passed by every cursor.
+  // Handles the overflow according to the policy. Returns false if the message has been rejected.
+  // Locks `allocate_mutex_`, the producers are serialized until they have claimed their positions,
+  // and `mutex_` only to mark the position claimed, for the consumers to never wait for a blocked producer.
+  bool PushEventAllocate(size_t& position, T_MESSAGE*& slot) {
+    std::lock_guard<std::mutex> allocate_lock(allocate_mutex_);
+    position = head_allocated_;
+    const size_t index = position % circular_buffer_size_;
+    if (position >= circular_buffer_size_) {
+      const size_t victim = position - circular_buffer_size_;
+      // The message in the slot may still be being populated by the producer that has claimed it a lap ago.
+      while (head_ready_.load() <= victim) {
+        std::this_thread::yield();
+      }
+      if (OVERFLOW_POLICY == MQOverflowPolicy::RejectNewest) {
+        for (const std::unique_ptr<Cursor>& cursor : cursors_) {
+          if (Lagging(*cursor, victim)) {
+            for (const std::unique_ptr<Cursor>& c : cursors_) {
+              ++c->number_of_dropped_events;
+            }
+            return false;
+          }
+        }
+      } else {
+        bool being_read = false;
+        for (const std::unique_ptr<Cursor>& cursor : cursors_) {
+          being_read |= PassSlowConsumer(*cursor, victim);
+        }
+        if (being_read) {
+          // Only done once no cursor can claim `victim` any more, see `ConsumerThread()`.
+          retired_.emplace_back(circular_buffer_[index].load(), victim);
+          circular_buffer_[index] = SpareMessage();
+        }
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++head_allocated_;
+      // Mark this message as incomplete, not yet ready to be sent over to the consumers.
+      finalized_[index] = false;
+    }
+    slot = circular_buffer_[index].load();
+    return true;
+  }
+
+  // With `MQOverflowPolicy::DropOldest`, moves the lagging cursor past `victim`.
+  // Returns true if the consumer may still be exporting `victim` itself.
+  // With `MQOverflowPolicy::BlockProducer`, spin-then-waits until the consumer has exported `victim`.
+  bool PassSlowConsumer(Cursor& cursor, size_t victim) {
+    size_t i = 0;
+    while (Lagging(cursor, victim)) {
+      if (OVERFLOW_POLICY == MQOverflowPolicy::DropOldest) {
+        size_t state = cursor.state.load();
+        const size_t position = PositionOf(state);
+        if (position > victim) {
+          return ReadingMessage(cursor, victim);
+        }
+        // The consumer counts the messages skipped as dropped.
+        cursor.state.compare_exchange_strong(state, ((victim + 1) << 1) | (state & 1));
+      } else if (i < kBlockedProducerSpinIterations) {
+        // The consumer may well be about to export it.
+        ++i;
+        std::this_thread::yield();
+      } else {
+        std::unique_lock<std::mutex> lock(producers_mutex_);
+        ++number_of_blocked_producers_;
+        producers_condition_variable_.wait(lock, [&cursor, victim] { return !Lagging(cursor, victim); });
+        --number_of_blocked_producers_;
+      }
+    }
+    return false;
+  }
+
+  // Returns a message object no consumer is exporting, to become the storage of the slot.
+  // Under `allocate_mutex_`.
+  T_MESSAGE* SpareMessage() {
+    for (size_t i = 0; i < retired_.size(); ++i) {
+      bool being_read = false;
+      for (const std::unique_ptr<Cursor>& cursor : cursors_) {
+        being_read |= ReadingMessage(*cursor, retired_[i].second);
+      }
+      if (!being_read) {
+        T_MESSAGE* message = retired_[i].first;
+        retired_[i] = retired_.back();
+        retired_.pop_back();
+        return message;
+      }
+    }
+    return NewMessage();
+  }
+
+  T_MESSAGE* NewMessage() {
+    messages_.emplace_back(new T_MESSAGE());
+    return messages_.back().get();
+  }
+
+  void PushEventCommit(const size_t position) {
+    // After the message has been copied over, mark it as finalized and advance `head_ready_`.
+    // MUTEX-LOCKED, except for the notification, which is only needed if some consumer is parked.
+    bool notify;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      finalized_[position % circular_buffer_size_] = true;
+      size_t head_ready = head_ready_.load();
+      while (head_ready != head_allocated_ && finalized_[head_ready % circular_buffer_size_]) {
+        ++head_ready;
+      }
+      head_ready_.store(head_ready, std::memory_order_release);
+      ++version_;
+      notify = number_of_parked_consumers_ > 0;
+    }
+    if (notify) {
+      condition_variable_.notify_all();
+    }
+  }
+
+  // The capacity of the circular buffer, shared by all the consumers.
+  const size_t circular_buffer_size_;
+
+  // The circular buffer, of size `circular_buffer_size_`. The message at logical position `i`
+  // is stored in the object `circular_buffer_[i % circular_buffer_size_]` points to.
+  // The objects are only swapped for spare ones by the producers, under `allocate_mutex_`.
+  std::vector<std::atomic<T_MESSAGE*>> circular_buffer_;
+
+  // Whether the message is done being populated, see `EfficientMQ`. Guarded by `mutex_`.
+  std::vector<char> finalized_;
+
+  // All the message objects, and those taken out of the buffer while being exported, along with the position
+  // of the message each of them holds. There are more of them than the slots only as long as some consumer
+  // gets lapped in the middle of exporting a message. Guarded by `allocate_mutex_`.
+  std::vector<std::unique_ptr<T_MESSAGE>> messages_;
+  std::vector<std::pair<T_MESSAGE*, size_t>> retired_;
+
+  // The logical positions, only ever incremented, both updated under `mutex_`, and `head_allocated_`
+  // also under `allocate_mutex_`:
+  // 1) `head_ready_`: The successor of the last message published to the consumers.
+  // 2) `head_allocated_`: The first position not yet claimed by a producer.
+  // The range [head_ready_, head_allocated_) is being populated by the producers.
+  // Each cursor is at or past `head_ready_ - circular_buffer_size_`, and, unless it has been added
+  // while some messages were being populated, at or before `head_ready_`.
+  std::atomic_size_t head_ready_{0};
+  size_t head_allocated_ = 0;
+  std::mutex mutex_;
+  mutable std::mutex allocate_mutex_;
+
+  // The consumers. Only added, under `allocate_mutex_`. Each consumer thread only accesses its own cursor.
+  std::vector<std::unique_ptr<Cursor>> cursors_;
+
+  // Waiting of the consumer threads, see `MQWaitStrategy`.
+  // `version_` is bumped on each commit and on destruction, and is what the consumers spin on.
+  std::atomic_size_t version_{0};
+  size_t number_of_parked_consumers_ = 0;
+  std::condition_variable condition_variable_;
+
+  // For `MQOverflowPolicy::BlockProducer`, the producer waiting for the slowest consumer.
+  // It waits holding `allocate_mutex_`, which the consumers never lock.
+  std::atomic_size_t number_of_blocked_producers_{0};
+  std::mutex producers_mutex_;
+  std::condition_variable producers_condition_variable_;
+
+  // For safe thread destruction. Set under `mutex_`, before `version_` is bumped.
+  std::atomic_bool destructing_{false};
+};
+
+#endif  // SANDBOX_MQ_BROADCAST_H
@@ -0,0 +1,215 @@
+#ifndef SANDBOX_MQ_CONFLATING_H
+#define SANDBOX_MQ_CONFLATING_H
+
+// ConflatingMQ keeps only the latest pending message per key, for the updates of which only the newest matters.
+// Intent:    To have the gauges and the device states published in storms cost the consumer one message per key
+//            per batch, instead of every intermediate update, and to not have them crowd the other keys out.
+// Objective: An update to a key already pending overwrites its message in place, with no extra slot taken.
+//
+// The key of a message is `KEY_OF()(message)`, and the index from the keys to the slots of the pending messages
+// is a hash map, cleared, but not deallocated, as the consumer takes the batch. The pending messages are
+// exported in the order their keys have first been pushed since the previous batch, each with the latest
+// value for that key. As `DoubleBufferMQ` does, the consumer swaps the buffer for the one it has exported
+// under the lock, and exports with the lock released, while the producers fill the other one.
+//
+// The queue holds up to `max_keys` pending keys. The message of a key not yet pending is then rejected, with
+// `MQOverflowPolicy::RejectNewest`, and reported as dropped, or waits for the consumer to take the batch, with
+// `MQOverflowPolicy::BlockProducer`. The updates to the pending keys always go through. The messages replaced
+// by newer ones are not dropped, they are counted by `NumberOfConflatedMessages()`.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "mq_overflow_policy.h"
+#include "mq_wait_strategy.h"
+
+template <typename CONSUMER,
+          typename MESSAGE,
+          typename KEY_OF,
+          size_t DEFAULT_MAX_KEYS = 1024,
+          MQOverflowPolicy OVERFLOW_POLICY = MQOverflowPolicy::RejectNewest,
+          MQWaitStrategy WAIT_STRATEGY = MQWaitStrategy::Adaptive>
+class ConflatingMQ final {
+ public:
+  static_assert(OVERFLOW_POLICY != MQOverflowPolicy::DropOldest,
+                "ConflatingMQ has no oldest message to drop: each pending key holds its own latest update.");
+
+  typedef MESSAGE T_MESSAGE;
+  typedef CONSUMER T_CONSUMER;
+  typedef KEY_OF T_KEY_OF;
+  typedef typename std::decay<decltype(std::declval<const T_KEY_OF&>()(std::declval<const T_MESSAGE&>()))>::type
+      T_KEY;
+
+  explicit ConflatingMQ(T_CONSUMER& consumer, size_t max_keys = DEFAULT_MAX_KEYS, T_KEY_OF key_of = T_KEY_OF())
+      : consumer_(consumer),
+        max_keys_(std::max(max_keys, static_cast<size_t>(1))),
+        key_of_(key_of),
+        consumer_thread_(&ConflatingMQ::ConsumerThread, this) {
+  }
+
+  // Waits for the consumer to export all the pending messages.
+  ~ConflatingMQ() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      destructing_ = true;
+      ++version_;
+    }
+    condition_variable_.notify_all();
+    consumer_thread_.join();
+  }
+
+  // Adds the message, or replaces the pending message of the same key with it.
+  // Returns false if the message was rejected, which only happens with `MQOverflowPolicy::RejectNewest`.
+  // THREAD SAFE.
+  bool PushMessage(const T_MESSAGE& message) {
+    return Push(message);
+  }
+  bool PushMessage(T_MESSAGE&& message) {
+    return Push(std::move(message));
+  }
+
+  // The number of the messages replaced by a newer message of the same key before being exported. THREAD SAFE.
+  size_t NumberOfConflatedMessages() const {
+    return number_of_conflated_messages_;
+  }
+
+ private:
+  ConflatingMQ(const ConflatingMQ&) = delete;
+  ConflatingMQ(ConflatingMQ&&) = delete;
+  void operator=(const ConflatingMQ&) = delete;
+  void operator=(ConflatingMQ&&) = delete;
+
+  // The messages are assigned over the ones left in the slots from the batch before, for their capacity.
+  template <typename T>
+  bool Push(T&& message) {
+    T_KEY key = key_of_(message);
+    std::unique_lock<std::mutex> lock(mutex_);
+    size_t slot;
+    if (!SlotOf(lock, std::move(key), slot)) {
+      return false;
+    }
+    if (slot < active_.size()) {
+      active_[slot] = std::forward<T>(message);
+    } else {
+      active_.push_back(std::forward<T>(message));
+    }
+    if (slot == active_size_) {
+      ++active_size_;
+    }
+    Committed(lock);
+    return true;
+  }
+
+  // Finds the slot of the key, `active_size_` for a new key, and returns true, or returns false if the message
+  // is rejected. MUTEX-LOCKED, unlocked while waiting for room with `MQOverflowPolicy::BlockProducer`.
+  bool SlotOf(std::unique_lock<std::mutex>& lock, T_KEY&& key, size_t& slot) {
+    while (true) {
+      const auto it = index_.find(key);
+      if (it != index_.end()) {
+        ++number_of_conflated_messages_;
+        slot = it->second;
+        return true;
+      }
+      if (active_size_ < max_keys_) {
+        index_.emplace(std::move(key), active_size_);
+        slot = active_size_;
+        return true;
+      }
+      if (OVERFLOW_POLICY == MQOverflowPolicy::RejectNewest) {
+        ++number_of_dropped_messages_;
+        return false;
+      }
+      if (consumer_parked_) {
+        condition_variable_.notify_one();
+      }
+      producers_condition_variable_.wait(lock, [this] { return active_size_ < max_keys_; });
+    }
+  }
+
+  // Only notifies the consumer if it is parked, see `MQWaitStrategy`.
+  void Committed(std::unique_lock<std::mutex>& lock) {
+    ++version_;
+    const bool notify = consumer_parked_;
+    lock.unlock();
+    if (notify) {
+      condition_variable_.notify_one();
+    }
+  }
+
+  void ConsumerThread() {
+    // The buffer being exported, the first `size` messages of which are the batch. Only used by this thread.
+    std::vector<T_MESSAGE> batch;
+    size_t size = 0;
+    while (true) {
+      size_t dropped;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!active_size_) {
+          if (destructing_) {
+            return;
+          }
+          const size_t seen = version_;
+          lock.unlock();
+          const bool changed = MQConsumerWait<WAIT_STRATEGY>::WaitForChange(version_, seen);
+          lock.lock();
+          if (!changed && !active_size_ && !destructing_) {
+            consumer_parked_ = true;
+            condition_variable_.wait(lock, [this] { return active_size_ || destructing_; });
+            consumer_parked_ = false;
+          }
+        }
+        batch.swap(active_);
+        size = active_size_;
+        active_size_ = 0;
+        index_.clear();
+        dropped = number_of_dropped_messages_;
+        number_of_dropped_messages_ = 0;
+      }
+      if (OVERFLOW_POLICY == MQOverflowPolicy::BlockProducer) {
+        producers_condition_variable_.notify_all();
+      }
+      // NO MUTEX REQUIRED: the producers are appending to the other buffer meanwhile.
+      for (size_t i = 0; i < size; ++i) {
+        consumer_.OnMessage(batch[i], dropped);
+        dropped = 0;
+      }
+    }
+  }
+
+  T_CONSUMER& consumer_;
+  const size_t max_keys_;
+  const T_KEY_OF key_of_;
+
+  // The buffer the producers write into, of which the first `active_size_` messages are pending, one per key,
+  // and the index of the slots of the keys in it. Guarded by `mutex_`. Both keep their capacity from one batch
+  // to the next.
+  std::vector<T_MESSAGE> active_;
+  size_t active_size_ = 0;
+  std::unordered_map<T_KEY, size_t> index_;
+  // The messages rejected since the previous batch, reported along with the first message of the next one.
+  size_t number_of_dropped_messages_ = 0;
+  std::atomic_size_t number_of_conflated_messages_{0};
+  bool destructing_ = false;
+  std::mutex mutex_;
+  std::condition_variable condition_variable_;
+  // For `MQOverflowPolicy::BlockProducer`, the producers of the new keys waiting for the next batch.
+  std::condition_variable producers_condition_variable_;
+
+  // Bumped on each push and on destruction, for the consumer to spin on. Guarded by `mutex_` for writes.
+  std::atomic_size_t version_{0};
+  // Set while the consumer is waiting on `condition_variable_`. Guarded by `mutex_`.
+  bool consumer_parked_ = false;
+
+  // Declared last, since it should only be started once all the other members have been initialized.
+  std::thread consumer_thread_;
+};
+
+#endif  // SANDBOX_MQ_CONFLATING_H
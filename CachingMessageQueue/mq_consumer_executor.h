@@ -0,0 +1,171 @@
+#ifndef SANDBOX_MQ_CONSUMER_EXECUTOR_H
+#define SANDBOX_MQ_CONSUMER_EXECUTOR_H
+
+// MQConsumerExecutor drives the consumers of many `EfficientMQ`-s from a shared pool of threads.
+// Intent:    To run hundreds of queues, each with a mostly idle consumer, on the number of threads
+//            of our choice, instead of on a consumer thread per queue.
+// Objective: To keep each queue exporting its messages in order, from one thread at a time, as on its own.
+//
+// Each registered consumer is run in rounds. A round exports one batch, and the consumer is put back at the end
+// of the queue of the ready ones if there is more to export, for a busy queue not to starve the others.
+// A consumer with nothing to export is not run until woken up by a producer, and a lingering one,
+// see `EfficientMQ::SetLinger()`, is run again once its linger expires, off the timer of the executor.
+// A round runs for as long as the consumer takes with its batch, occupying one thread of the pool all along.
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "../Bricks/executor/executor.h"
+#include "../Bricks/time/timer_wheel.h"
+
+// What the round of a consumer run by `MQConsumerExecutor` asks for next.
+struct MQConsumerRound {
+  enum class Next { More, Idle, Wait, Done };
+  Next next;
+  uint64_t delay_ms;
+
+  // There is more to export, the next round runs once the other ready consumers have had theirs.
+  static MQConsumerRound More() {
+    return MQConsumerRound{Next::More, 0};
+  }
+  // Nothing to export, the next round runs once woken up.
+  static MQConsumerRound Idle() {
+    return MQConsumerRound{Next::Idle, 0};
+  }
+  // The next round runs once the delay has passed, or once woken up, whichever comes first.
+  static MQConsumerRound Wait(uint64_t delay_ms) {
+    return MQConsumerRound{Next::Wait, delay_ms};
+  }
+  // The queue is destructing and has exported everything, the consumer is never run again.
+  static MQConsumerRound Done() {
+    return MQConsumerRound{Next::Done, 0};
+  }
+};
+
+class MQConsumerExecutor final {
+ public:
+  // Identifies the registered consumer. Never zero.
+  typedef uint64_t ConsumerID;
+
+  explicit MQConsumerExecutor(size_t threads = 1) : executor_(threads, 0) {}
+
+  // All the consumers should have been unregistered by now, by the destructors of their queues.
+  ~MQConsumerExecutor() = default;
+
+  size_t Threads() const {
+    return executor_.Threads();
+  }
+
+  // Registers the consumer run by the rounds `round`. It is not run until woken up with `Wake()`. THREAD SAFE.
+  ConsumerID Register(std::function<MQConsumerRound()> round) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const ConsumerID id = ++last_consumer_id_;
+    consumers_.emplace(id, std::unique_ptr<Consumer>(new Consumer(std::move(round))));
+    return id;
+  }
+
+  // Has the next round of the consumer run as soon as possible: once the consumers ready before it have had
+  // theirs, or once its current round is over. No-op if the consumer is done or unregistered. THREAD SAFE.
+  void Wake(ConsumerID id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = consumers_.find(id);
+    if (it == consumers_.end() || it->second->done) {
+      return;
+    }
+    Consumer& consumer = *it->second;
+    if (consumer.scheduled) {
+      consumer.woken = true;
+    } else {
+      ScheduleRound(id, consumer);
+    }
+  }
+
+  // Waits until the consumer is done, with its round not running, and unregisters it.
+  // No-op if the consumer is unregistered already. Should not be called from a round. THREAD SAFE.
+  void Unregister(ConsumerID id) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const auto it = consumers_.find(id);
+    if (it == consumers_.end()) {
+      return;
+    }
+    Consumer& consumer = *it->second;
+    condition_variable_.wait(lock, [&consumer]() { return consumer.done && !consumer.scheduled; });
+    if (consumer.timer) {
+      timers_.Cancel(consumer.timer);
+    }
+    consumers_.erase(it);
+  }
+
+ private:
+  struct Consumer {
+    const std::function<MQConsumerRound()> round;
+    // Set from the moment the round is queued until it is over, for the rounds to never overlap.
+    bool scheduled = false;
+    // Set by `Wake()` while the round is scheduled, for the next one to follow right away.
+    bool woken = false;
+    bool done = false;
+    bricks::time::TimerWheelThread::TimerID timer = 0;
+
+    explicit Consumer(std::function<MQConsumerRound()> round) : round(std::move(round)) {}
+  };
+
+  // Each task submitted to the executor runs the round of the consumer at the front of `ready_`,
+  // whichever consumer that is, thus the ready consumers take turns, first come, first served. MUTEX-LOCKED.
+  void ScheduleRound(ConsumerID id, Consumer& consumer) {
+    if (consumer.timer) {
+      timers_.Cancel(consumer.timer);
+      consumer.timer = 0;
+    }
+    consumer.scheduled = true;
+    ready_.push_back(id);
+    executor_.Submit([this]() { RunNextRound(); });
+  }
+
+  // The consumer is not unregistered while its round is scheduled, thus is safe to refer to without the lock.
+  void RunNextRound() {
+    ConsumerID id;
+    Consumer* consumer;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      id = ready_.front();
+      ready_.pop_front();
+      consumer = consumers_.at(id).get();
+    }
+    const MQConsumerRound result = consumer->round();
+    std::lock_guard<std::mutex> lock(mutex_);
+    consumer->scheduled = false;
+    if (result.next == MQConsumerRound::Next::Done) {
+      consumer->done = true;
+      condition_variable_.notify_all();
+    } else if (result.next == MQConsumerRound::Next::More || consumer->woken) {
+      consumer->woken = false;
+      ScheduleRound(id, *consumer);
+    } else if (result.next == MQConsumerRound::Next::Wait) {
+      if (consumer->timer) {
+        timers_.Cancel(consumer->timer);
+      }
+      consumer->timer = timers_.ScheduleIn(result.delay_ms, [this, id]() { Wake(id); });
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable condition_variable_;
+  std::map<ConsumerID, std::unique_ptr<Consumer>> consumers_;
+  std::deque<ConsumerID> ready_;
+  ConsumerID last_consumer_id_ = 0;
+
+  // Destroyed before the consumers, the timers first, for neither to run anything past the destructor.
+  bricks::Executor executor_;
+  bricks::time::TimerWheelThread timers_;
+
+  MQConsumerExecutor(const MQConsumerExecutor&) = delete;
+  void operator=(const MQConsumerExecutor&) = delete;
+};
+
+#endif  // SANDBOX_MQ_CONSUMER_EXECUTOR_H
@@ -0,0 +1,135 @@
+#ifndef SANDBOX_MQ_DOUBLE_BUFFER_H
+#define SANDBOX_MQ_DOUBLE_BUFFER_H
+
+// DoubleBufferMQ is the lossless queue of `SimpleMQ`, with its consumer not holding the lock while exporting.
+// Intent:    To block the producers for the time of one copy into a vector only, never for the time
+//            the consumer takes to process the messages, without bounding the queue and dropping any of them.
+// Objective: One brief lock per batch on the consumer side, and no allocations once the buffers have grown.
+//
+// The producers append to the active buffer under the lock. The consumer swaps it for the one it has exported,
+// under the same lock, and exports the whole batch with the lock released, while the producers fill the other.
+// The messages are assigned over the ones left in the buffer from the batch before instead of being destroyed
+// and constructed again, thus both the buffers and the messages, such as the `std::string`-s, keep their
+// capacity from one swap to the next. The memory is that of the largest batch so far, and is not released.
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "mq_wait_strategy.h"
+
+template <typename CONSUMER, typename MESSAGE = std::string, MQWaitStrategy WAIT_STRATEGY = MQWaitStrategy::Adaptive>
+class DoubleBufferMQ final {
+ public:
+  typedef MESSAGE T_MESSAGE;
+  typedef CONSUMER T_CONSUMER;
+
+  explicit DoubleBufferMQ(T_CONSUMER& consumer)
+      : consumer_(consumer), consumer_thread_(&DoubleBufferMQ::ConsumerThread, this) {
+  }
+
+  // Waits for the consumer to export all the messages pushed.
+  ~DoubleBufferMQ() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      destructing_ = true;
+      ++version_;
+    }
+    condition_variable_.notify_all();
+    consumer_thread_.join();
+  }
+
+  void PushMessage(const T_MESSAGE& message) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (active_size_ < active_.size()) {
+      active_[active_size_] = message;
+    } else {
+      active_.push_back(message);
+    }
+    ++active_size_;
+    Committed(lock);
+  }
+
+  void PushMessage(T_MESSAGE&& message) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (active_size_ < active_.size()) {
+      active_[active_size_] = std::move(message);
+    } else {
+      active_.push_back(std::move(message));
+    }
+    ++active_size_;
+    Committed(lock);
+  }
+
+ private:
+  DoubleBufferMQ(const DoubleBufferMQ&) = delete;
+  DoubleBufferMQ(DoubleBufferMQ&&) = delete;
+  void operator=(const DoubleBufferMQ&) = delete;
+  void operator=(DoubleBufferMQ&&) = delete;
+
+  // Only notifies the consumer if it is parked, see `MQWaitStrategy`.
+  void Committed(std::unique_lock<std::mutex>& lock) {
+    ++version_;
+    const bool notify = consumer_parked_;
+    lock.unlock();
+    if (notify) {
+      condition_variable_.notify_one();
+    }
+  }
+
+  void ConsumerThread() {
+    // The buffer being exported, the first `size` messages of which are the batch. Only used by this thread.
+    std::vector<T_MESSAGE> batch;
+    size_t size = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!active_size_) {
+          if (destructing_) {
+            return;
+          }
+          const size_t seen = version_;
+          lock.unlock();
+          const bool changed = MQConsumerWait<WAIT_STRATEGY>::WaitForChange(version_, seen);
+          lock.lock();
+          if (!changed && !active_size_ && !destructing_) {
+            consumer_parked_ = true;
+            condition_variable_.wait(lock, [this] { return active_size_ || destructing_; });
+            consumer_parked_ = false;
+          }
+        }
+        batch.swap(active_);
+        size = active_size_;
+        active_size_ = 0;
+      }
+      // NO MUTEX REQUIRED: the producers are appending to the other buffer meanwhile.
+      for (size_t i = 0; i < size; ++i) {
+        consumer_.OnMessage(batch[i], 0);
+      }
+    }
+  }
+
+  T_CONSUMER& consumer_;
+
+  // The buffer the producers append to, of which the first `active_size_` messages are pushed, and the rest
+  // are kept from the batch before for their capacity. Guarded by `mutex_`.
+  std::vector<T_MESSAGE> active_;
+  size_t active_size_ = 0;
+  bool destructing_ = false;
+  std::mutex mutex_;
+  std::condition_variable condition_variable_;
+
+  // Bumped on each push and on destruction, for the consumer to spin on. Guarded by `mutex_` for writes.
+  std::atomic_size_t version_{0};
+  // Set while the consumer is waiting on `condition_variable_`. Guarded by `mutex_`.
+  bool consumer_parked_ = false;
+
+  // Declared last, since it should only be started once all the other members have been initialized.
+  std::thread consumer_thread_;
+};
+
+#endif  // SANDBOX_MQ_DOUBLE_BUFFER_H
@@ -5,13 +5,85 @@
 // Intent:    To buffer events before they get to be send over the network or appended to a log file.
 // Objective: To miminize the time during which the thread that emits the message to be logged is blocked.
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstring>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
-template <typename CONSUMER, typename MESSAGE = std::string, size_t DEFAULT_BUFFER_SIZE = 1024>
+#include "mq_affinity.h"
+#include "mq_consumer_executor.h"
+#include "mq_overflow_policy.h"
+#include "mq_spill.h"
+#include "mq_wait_strategy.h"
+
+#include "../Bricks/memory/accounting.h"
+#include "../Bricks/memory/memory_resource.h"
+#include "../Bricks/metrics/metrics.h"
+#include "../Bricks/metrics/trace.h"
+
+// The size of the message in bytes, for the linger of `EfficientMQ`: its `size()` if it has one,
+// otherwise `sizeof()` of it.
+template <typename T_MESSAGE>
+struct MQMessageBytes {
+  template <typename U>
+  static auto Size(const U& message, int) -> decltype(static_cast<size_t>(message.size())) {
+    return static_cast<size_t>(message.size());
+  }
+  template <typename U>
+  static size_t Size(const U&, long) {
+    return sizeof(U);
+  }
+  static size_t Of(const T_MESSAGE& message) {
+    return Size(message, 0);
+  }
+};
+
+// The default resource of the circular buffers of `EfficientMQ`-s, accounted for as "mq_efficient",
+// see `Bricks/memory/accounting.h`.
+inline bricks::memory::MemoryResource* EfficientMQMemoryResource() {
+  static bricks::memory::MemoryResource* resource = bricks::memory::SubsystemMemoryResource("mq_efficient");
+  return resource;
+}
+
+// The metrics of all the instances of EfficientMQ, in `bricks::metrics::Registry::Singleton()`.
+struct EfficientMQMetrics {
+  bricks::metrics::Counter& pushed;
+  bricks::metrics::Counter& dropped;
+  bricks::metrics::Counter& exported;
+  bricks::metrics::Counter& spilled;
+  bricks::metrics::Counter& expired;
+  bricks::metrics::Histogram& batch_size;
+
+  static EfficientMQMetrics& Singleton() {
+    bricks::metrics::Registry& registry = bricks::metrics::Registry::Singleton();
+    static EfficientMQMetrics singleton{
+        registry.GetCounter("mq_efficient_messages_pushed_total", "The messages pushed into EfficientMQ-s."),
+        registry.GetCounter("mq_efficient_messages_dropped_total",
+                            "The messages dropped or rejected by EfficientMQ-s, as their buffers were full."),
+        registry.GetCounter("mq_efficient_messages_exported_total",
+                            "The messages passed to the consumers of EfficientMQ-s."),
+        registry.GetCounter("mq_efficient_messages_spilled_total",
+                            "The messages written into the spill files of EfficientMQ-s."),
+        registry.GetCounter("mq_efficient_messages_expired_total",
+                            "The messages skipped by EfficientMQ-s as older than their max age."),
+        registry.GetHistogram("mq_efficient_export_batch_size",
+                              "The number of messages exported by EfficientMQ-s at once.")};
+    return singleton;
+  }
+};
+
+template <typename CONSUMER,
+          typename MESSAGE = std::string,
+          size_t DEFAULT_BUFFER_SIZE = 1024,
+          MQOverflowPolicy OVERFLOW_POLICY = MQOverflowPolicy::DropOldest,
+          MQWaitStrategy WAIT_STRATEGY = MQWaitStrategy::Adaptive>
 class EfficientMQ final {
  public:
   // Type of entries to store, defaults to `std::string`.
@@ -19,39 +91,228 @@ class EfficientMQ final {
 
   // Type of the processor of the entries.
   // It should expose one method, void OnMessage(const T_MESSAGE&, size_t number_of_dropped_events_if_any);
-  // This method will be called from one thread, which is spawned and owned by an instance of EfficientMQ.
+  // This method will be called from one thread at a time: the one spawned and owned by an instance
+  // of EfficientMQ, or, if the instance is constructed with an `MQConsumerExecutor`, one of the threads of it.
+  // Optionally, it can also expose
+  // void OnMessages(const T_MESSAGE* begin, const T_MESSAGE* end, size_t number_of_dropped_events_if_any);
+  // in which case all the entries ready to be exported are passed to it as up to two contiguous ranges,
+  // instead of calling OnMessage() for each of them.
+  // With `SetMaxAge()`, it can also expose void OnExpiredMessages(size_t number_of_expired_messages);
+  // to be told of the messages skipped as too old, which are not counted as dropped.
   typedef CONSUMER T_CONSUMER;
 
-  // The only constructor requires the refence to the instance of the consumer of entries.
-  explicit EfficientMQ(T_CONSUMER& consumer, size_t buffer_size = DEFAULT_BUFFER_SIZE)
+  // The constructors require the refence to the instance of the consumer of entries.
+  // The circular buffer is allocated from `resource`, and so are the messages in it if `T_MESSAGE`
+  // is allocator-aware, such as `bricks::memory::String`. The messages are then allocated by the threads
+  // pushing them, and the resource must be thread safe, unless there is only one producer.
+  // On a multi-socket host, `MQNUMANodeMemoryResource` places the buffer on the node of the consumer thread,
+  // see `PinConsumerThreadToCPU()`.
+  explicit EfficientMQ(T_CONSUMER& consumer,
+                       size_t buffer_size = DEFAULT_BUFFER_SIZE,
+                       bricks::memory::MemoryResource* resource = EfficientMQMemoryResource())
       : consumer_(consumer),
         circular_buffer_size_(buffer_size),
-        circular_buffer_(circular_buffer_size_),
+        circular_buffer_(circular_buffer_size_, resource),
+        finalized_(circular_buffer_size_),
         consumer_thread_(&EfficientMQ::ConsumerThread, this) {
   }
 
-  // Destructor waits for the consumer thread to terminate, which implies committing all the queued events.
+  // Has the consumer run by `executor`, shared with other queues, instead of by a thread of its own.
+  // The messages are exported in rounds, one batch per round, and the wait strategy does not apply:
+  // the consumer with nothing to export is simply not run until a producer wakes it up.
+  // The executor must outlive the queue.
+  EfficientMQ(T_CONSUMER& consumer,
+              MQConsumerExecutor& executor,
+              size_t buffer_size = DEFAULT_BUFFER_SIZE,
+              bricks::memory::MemoryResource* resource = EfficientMQMemoryResource())
+      : consumer_(consumer),
+        circular_buffer_size_(buffer_size),
+        circular_buffer_(circular_buffer_size_, resource),
+        finalized_(circular_buffer_size_),
+        executor_(&executor) {
+    consumer_parked_ = true;
+    consumer_id_ = executor_->Register([this]() { return ConsumerRound(); });
+  }
+
+  // Destructor waits for the consumer thread, or the consumer rounds, to terminate,
+  // which implies committing all the queued events.
   ~EfficientMQ() {
     {
       std::unique_lock<std::mutex> lock(mutex_);
       destructing_ = true;
+      ++version_;
+    }
+    if (executor_) {
+      executor_->Wake(consumer_id_);
+      executor_->Unregister(consumer_id_);
+    } else {
+      condition_variable_.notify_all();
+      consumer_thread_.join();
+    }
+  }
+
+  // What happens when the buffer is full.
+  static constexpr MQOverflowPolicy overflow_policy = OVERFLOW_POLICY;
+
+  // How the consumer thread waits for messages.
+  static constexpr MQWaitStrategy wait_strategy = WAIT_STRATEGY;
+
+  // The number of times a blocked producer re-checks for room before waiting on the condition variable.
+  enum { kBlockedProducerSpinIterations = 64 };
+
+  // The trivially copyable messages of up to this size, such as the counters and the samples of fixed size,
+  // are copied into their slots with the mutex held, and committed right away, see `PushMessage()`.
+  enum { kCopyUnderLockMaxBytes = 256 };
+  static constexpr bool copy_under_lock =
+      std::is_trivially_copyable<T_MESSAGE>::value && sizeof(T_MESSAGE) <= kCopyUnderLockMaxBytes;
+
+  // Has the consumer thread hold the messages back, for up to `linger` since the first one not yet exported
+  // was pushed, unless `max_batch_bytes` of them accumulate before then, or the buffer gets full.
+  // The messages are then exported in one go, as one `OnMessages()` call, or fewer `OnMessage()` wakeups,
+  // which, for a consumer sending them over the network, means fewer and larger packets when the producers
+  // trickle, at the cost of the delay of up to `linger`. The bytes are counted by `MQMessageBytes`.
+  // The zero `linger`, the default, exports the messages as soon as they are ready.
+  // THREAD SAFE.
+  void SetLinger(std::chrono::milliseconds linger, size_t max_batch_bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    linger_ = linger;
+    max_batch_bytes_ = max_batch_bytes;
+  }
+
+  // Has the consumer skip the messages pushed longer than `max_age` ago, such as the live metrics that are
+  // of no use once the consumer recovers from a stall, without passing them to `OnMessage()`,
+  // to get to the fresh ones sooner. Each message is timestamped as it is pushed, and, since the timestamps
+  // are taken in the order of the slots, the expired messages of a batch are the first ones of it,
+  // skipped at once, and reported with `OnExpiredMessages()`, if the consumer has it, and as the metric
+  // "mq_efficient_messages_expired_total". The messages read back from the spill file do not expire.
+  // The zero `max_age`, the default, has the messages never expire, and takes no timestamps.
+  // THREAD SAFE.
+  void SetMaxAge(std::chrono::milliseconds max_age) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (max_age.count() && pushed_at_.empty()) {
+      // The messages already in the buffer are only as old as `max_age_` itself.
+      pushed_at_.assign(circular_buffer_size_, std::chrono::steady_clock::now());
+    }
+    max_age_ = max_age;
+  }
+
+  // Has the messages that do not fit into the buffer written into the file at `path`, instead of applying
+  // the overflow policy to them, for as long as the file stays within `max_bytes`.
+  // Once a message is spilled, the following ones are spilled too, until the consumer has caught up:
+  // it exports what is in the buffer first, then reads the file back, in order, and truncates it.
+  // Thus nothing is lost to a short stall of the consumer, and the producers only append to the buffer
+  // of the file, which is written out in large chunks. Once `max_bytes` is exhausted, the overflow policy
+  // applies, and the order of the messages pushed then relative to the ones in the file is not kept.
+  // The messages are written with `MQSpillCodec<T_MESSAGE>`. The file is removed by the destructor.
+  // Returns false if the file could not be created, or if another spill file is still being read.
+  // THREAD SAFE.
+  bool SetSpillFile(const std::string& path, uint64_t max_bytes) {
+    static_assert(MQSpillCodec<T_MESSAGE>::kSupported, "Specialize `MQSpillCodec` for the message type.");
+    std::unique_ptr<MQSpillFile> spill(new MQSpillFile(path, max_bytes));
+    if (!spill->IsOpen()) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (number_of_spilled_events_) {
+      return false;
+    }
+    spill_ = std::move(spill);
+    spill_set_ = true;
+    return true;
+  }
+
+  // Pins the consumer thread to the CPU. Returns false if it could not be pinned, see mq_affinity.h,
+  // or if the consumer is run by an `MQConsumerExecutor`, thus has no thread of its own.
+  bool PinConsumerThreadToCPU(int cpu) {
+    if (executor_) {
+      return false;
     }
-    condition_variable_.notify_all();
-    consumer_thread_.join();
+    return MQPinThreadToCPU(consumer_thread_.native_handle(), cpu);
   }
 
   // Adds an message to the buffer.
   // Supports both copy and move semantics.
-  // THREAD SAFE. Blocks the calling thread for as short period of time as possible.
-  void PushMessage(const T_MESSAGE& message) {
-    const size_t index = PushEventAllocate();
-    circular_buffer_[index].message_body = message;
+  // Returns false if the message was rejected, which happens with `MQOverflowPolicy::RejectNewest`,
+  // and with `MQOverflowPolicy::DropOldest` while the oldest messages are being exported, see `exporting_`.
+  // THREAD SAFE. Blocks the calling thread for as short period of time as possible,
+  // unless `MQOverflowPolicy::BlockProducer` is used and the buffer is full.
+  // The messages are copied into the buffer with the mutex released, in between allocating the slot and
+  // committing it, for the large ones not to hold the other producers back. The small trivially copyable
+  // ones, see `copy_under_lock`, are `memcpy()`-d with the mutex held instead, and the mutex is taken
+  // once per message instead of twice.
+  bool PushMessage(const T_MESSAGE& message) {
+    if (copy_under_lock) {
+      return PushMessageUnderLock(message);
+    }
+    size_t index;
+    const Allocation allocation = PushEventAllocate(index, &message);
+    if (allocation != Allocation::Slot) {
+      return allocation == Allocation::Spilled;
+    }
+    circular_buffer_[index] = message;
+    PushEventCommit(index);
+    return true;
+  }
+  bool PushMessage(T_MESSAGE&& message) {
+    if (copy_under_lock) {
+      return PushMessageUnderLock(message);
+    }
+    size_t index;
+    const Allocation allocation = PushEventAllocate(index, &message);
+    if (allocation != Allocation::Slot) {
+      return allocation == Allocation::Spilled;
+    }
+    circular_buffer_[index] = std::move(message);
+    PushEventCommit(index);
+    return true;
+  }
+
+  // Adds a message to the buffer by constructing it in place, in the storage of the slot.
+  // The message in the slot is resized to `length`, reusing the memory it already holds,
+  // and then `writer(T_MESSAGE& message)` is called to populate it.
+  // With `T_MESSAGE = std::string`, this saves the caller one allocation and one copy per message.
+  // The writer should not throw, as the slot would then never be committed.
+  // With the spill file set, the message is constructed outside of the buffer, as it may go to the file.
+  // Returns false if the message was rejected, as with `PushMessage()`.
+  // THREAD SAFE.
+  template <typename F>
+  bool EmplaceMessage(size_t length, F&& writer) {
+    if (spill_set_) {
+      T_MESSAGE message;
+      message.resize(length);
+      writer(message);
+      return PushMessage(std::move(message));
+    }
+    size_t index;
+    if (PushEventAllocate(index, nullptr) != Allocation::Slot) {
+      return false;
+    }
+    T_MESSAGE& message = circular_buffer_[index];
+    message.resize(length);
+    writer(message);
     PushEventCommit(index);
+    return true;
   }
-  void PushMessage(T_MESSAGE&& message) {
-    const size_t index = PushEventAllocate(message);
-    circular_buffer_[index].message_body = std::move(message);
+
+  // Adds a message to the buffer by swapping it into the slot, and hands the memory of the slot back.
+  // After the call `message` holds what the slot held: a message the consumer is done with, to be refilled
+  // in place by the caller, which reuses its buffer. A producer that keeps pushing the same `message` object
+  // thus cycles through the buffers of the slots, and, once they have grown to the size of the messages,
+  // pushes with no allocations at all, while `PushMessage(T_MESSAGE&&)` frees the buffer of the slot
+  // and leaves the caller to allocate a new one for every message.
+  // Returns false if the message was rejected, as with `PushMessage()`, in which case `message` is left intact,
+  // or if the message was spilled, in which case it is, too.
+  // THREAD SAFE.
+  bool PushMessageRecycling(T_MESSAGE& message) {
+    size_t index;
+    const Allocation allocation = PushEventAllocate(index, &message);
+    if (allocation != Allocation::Slot) {
+      return allocation == Allocation::Spilled;
+    }
+    using std::swap;
+    swap(circular_buffer_[index], message);
     PushEventCommit(index);
+    return true;
   }
 
  private:
@@ -60,104 +321,433 @@ class EfficientMQ final {
   void operator=(const EfficientMQ&) = delete;
   void operator=(EfficientMQ&&) = delete;
 
+  // Allocates the slot, copies the message into it, and commits it, all with the mutex held.
+  bool PushMessageUnderLock(const T_MESSAGE& message) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    size_t index;
+    const Allocation allocation = PushEventAllocate(lock, index, &message);
+    if (allocation != Allocation::Slot) {
+      return allocation == Allocation::Spilled;
+    }
+    std::memcpy(static_cast<void*>(&circular_buffer_[index]), &message, sizeof(T_MESSAGE));
+    const bool notify = PushEventCommit(lock, index);
+    lock.unlock();
+    if (notify) {
+      NotifyConsumer();
+    }
+    return true;
+  }
+
   // Increment the index respecting the circular nature of the buffer.
   void Increment(size_t& i) const {
     i = (i + 1) % circular_buffer_size_;
   }
 
   // The thread which extracts fully populated events from the tail of the buffer and exports them.
+  // All the entries ready by the time the consumer thread wakes up are exported as one batch.
   void ConsumerThread() {
+    // Wait until at least one message is finalized, then export.
+    // MUTEX-LOCKED, except for the waiting and the exporting parts.
+    std::unique_lock<std::mutex> lock(mutex_);
     while (true) {
-      size_t index;
-      size_t this_time_dropped_events;
-      {
-        // First, get an message to export. Wait until it's finalized and ready to be exported.
-        // MUTEX-LOCKED, except for the conditional variable part.
-        index = tail_;
-        std::unique_lock<std::mutex> lock(mutex_);
-        if (head_ready_ == tail_) {
-          if (destructing_) {
-            return;
-          }
-          condition_variable_.wait(lock, [this] { return head_ready_ != tail_ || destructing_; });
-          if (destructing_) {
-            return;
-          }
+      while (head_ready_ == tail_ && !SpillReady()) {
+        if (destructing_ && !number_of_spilled_events_) {
+          return;
         }
-        this_time_dropped_events = number_of_dropped_events_;
-        number_of_dropped_events_ = 0;
+        WaitForMessages(lock);
       }
-
-      {
-        // Then, export the message.
-        // NO MUTEX REQUIRED.
-        consumer_.OnMessage(circular_buffer_[index].message_body, this_time_dropped_events);
+      if (head_ready_ != tail_ && linger_.count()) {
+        Linger(lock);
       }
+      ExportBatch(lock);
+    }
+  }
 
-      {
-        // Finally, mark the message as successfully exported.
-        // MUTEX-LOCKED.
-        std::lock_guard<std::mutex> lock(mutex_);
-        Increment(tail_);
+  // One round of the consumer run by `MQConsumerExecutor`: what `ConsumerThread()` does in one iteration,
+  // with the waits handed over to the executor. Parks or lingers by setting the flags the producers check.
+  MQConsumerRound ConsumerRound() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    consumer_parked_ = false;
+    consumer_lingering_ = false;
+    if (head_ready_ == tail_ && !SpillReady()) {
+      if (destructing_ && !number_of_spilled_events_) {
+        return MQConsumerRound::Done();
       }
+      consumer_parked_ = true;
+      return MQConsumerRound::Idle();
     }
+    if (head_ready_ != tail_ && linger_.count() && first_pending_time_set_ && !destructing_ &&
+        pending_bytes_ < max_batch_bytes_ && !Full()) {
+      const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      if (now < first_pending_time_ + linger_) {
+        consumer_lingering_ = true;
+        const std::chrono::milliseconds remaining =
+            std::chrono::duration_cast<std::chrono::milliseconds>(first_pending_time_ + linger_ - now);
+        return MQConsumerRound::Wait(static_cast<uint64_t>(remaining.count()) + 1);
+      }
+    }
+    ExportBatch(lock);
+    return MQConsumerRound::More();
   }
 
-  size_t PushEventAllocate() {
-    // First, allocate room in the buffer for this message.
-    // Overwrite the oldest message if have to.
+  // Exports the spilled messages if they are next, otherwise all the messages ready in the buffer,
+  // as one batch. MUTEX-LOCKED on entry and on exit, with the mutex released for the export itself.
+  void ExportBatch(std::unique_lock<std::mutex>& lock) {
+    if (head_ready_ == tail_ && !SpillReady()) {
+      return;
+    }
+    const size_t this_time_dropped_events = number_of_dropped_events_;
+    number_of_dropped_events_ = 0;
+    pending_bytes_ = 0;
+    first_pending_time_set_ = false;
+
+    if (head_ready_ == tail_) {
+      // The buffer is empty, and what was spilled is newer than anything that was in it.
+      spill_->Flush();
+      const uint64_t spill_end = spill_->BytesFlushed();
+      lock.unlock();
+      // NO MUTEX REQUIRED for the export, MUTEX-LOCKED for the bookkeeping.
+      const size_t exported =
+          ExportSpilled(spill_end, this_time_dropped_events, std::integral_constant<bool, kSpillSupported>());
+      lock.lock();
+      number_of_spilled_events_ -= std::min(exported, number_of_spilled_events_);
+      if (spill_read_offset_ >= spill_->BytesFlushed() && !spill_->BufferedRecords()) {
+        // Everything in the file has been read. What is still counted, if anything, was lost
+        // to the errors writing or reading the file.
+        number_of_dropped_events_ += number_of_spilled_events_;
+        number_of_spilled_events_ = 0;
+        spill_->Reset();
+        spill_read_offset_ = 0;
+      }
+      return;
+    }
+
+    const size_t batch_begin = tail_;
+    const size_t end = head_ready_;
+    size_t begin = batch_begin;
+    const std::chrono::milliseconds max_age = max_age_;
+    exporting_ = true;
+    lock.unlock();
+    // Skip the expired messages, if any, then export the rest.
+    // NO MUTEX REQUIRED.
+    size_t expired = 0;
+    if (max_age.count()) {
+      const std::chrono::steady_clock::time_point oldest = std::chrono::steady_clock::now() - max_age;
+      while (begin != end && pushed_at_[begin] < oldest) {
+        Increment(begin);
+        ++expired;
+      }
+      if (expired) {
+        ReportExpired(expired, typename ConsumerHasOnExpiredMessages<T_CONSUMER>::type());
+        metrics_.expired.Increment(expired);
+      }
+    }
+    if (begin != end) {
+      const T_MESSAGE* data = circular_buffer_.data();
+      if (begin < end) {
+        ExportRange(data + begin, data + end, this_time_dropped_events);
+      } else {
+        ExportRange(data + begin, data + circular_buffer_size_, this_time_dropped_events);
+        if (end) {
+          ExportRange(data, data + end, 0);
+        }
+      }
+      const size_t count = (end + circular_buffer_size_ - begin) % circular_buffer_size_;
+      metrics_.exported.Increment(count);
+      metrics_.batch_size.Record(count);
+    }
+    lock.lock();
+    exporting_ = false;
+    if (begin == end) {
+      // All of the batch has expired: the drops are reported along with the next message exported.
+      number_of_dropped_events_ += this_time_dropped_events;
+    }
+
+    // Then, mark the messages of the batch as successfully exported, or expired, rather than count them off
+    // the current `tail_`. The producers leave `tail_` be while the batch is exported, see `exporting_`,
+    // thus it is not past the end of the batch.
     // MUTEX-LOCKED.
-    std::lock_guard<std::mutex> lock(mutex_);
-    const size_t index = head_allocated_;
-    Increment(head_allocated_);
-    if (head_allocated_ == tail_) {
-      // Buffer overflow, must drop the least recent element and keep the count of those.
-      ++number_of_dropped_events_;
-      if (tail_ == head_ready_) {
-        Increment(head_ready_);
+    const size_t batch_size = (end + circular_buffer_size_ - batch_begin) % circular_buffer_size_;
+    if ((tail_ + circular_buffer_size_ - batch_begin) % circular_buffer_size_ <= batch_size) {
+      tail_ = end;
+    }
+    if (OVERFLOW_POLICY == MQOverflowPolicy::BlockProducer && number_of_blocked_producers_) {
+      producers_condition_variable_.notify_all();
+    }
+  }
+
+  // Spins and/or yields with the mutex released, as long as the wait strategy permits, then parks.
+  // Only the parked consumer has to be notified by the producers. MUTEX-LOCKED on entry and on exit.
+  void WaitForMessages(std::unique_lock<std::mutex>& lock) {
+    const size_t seen = version_;
+    lock.unlock();
+    const bool changed = MQConsumerWait<WAIT_STRATEGY>::WaitForChange(version_, seen);
+    lock.lock();
+    if (!changed && head_ready_ == tail_ && !SpillReady() && !destructing_) {
+      consumer_parked_ = true;
+      condition_variable_.wait(lock, [this] { return head_ready_ != tail_ || SpillReady() || destructing_; });
+      consumer_parked_ = false;
+    }
+  }
+
+  enum { kSpillSupported = MQSpillCodec<T_MESSAGE>::kSupported };
+
+  // Whether the spilled messages are next to export: there are some, and nothing is left in the buffer,
+  // including the messages allocated but not yet committed, as those are older. MUTEX-LOCKED.
+  bool SpillReady() const {
+    return number_of_spilled_events_ && tail_ == head_allocated_;
+  }
+
+  // Reads the spilled messages back, up to `spill_end`, and exports them, in batches.
+  // Returns the number of them exported. NO MUTEX REQUIRED, only the consumer thread reads the file.
+  size_t ExportSpilled(uint64_t spill_end, size_t dropped, std::true_type) {
+    size_t exported = 0;
+    while (true) {
+      size_t count = 0;
+      const size_t read = spill_->ReadRecords(
+          spill_read_offset_, spill_end, spill_read_buffer_, [this, &count](const char* data, size_t length) {
+            if (count == spill_batch_.size()) {
+              spill_batch_.emplace_back();
+            }
+            MQSpillCodec<T_MESSAGE>::Decode(data, length, spill_batch_[count++]);
+          });
+      if (!read) {
+        break;
+      }
+      ExportRange(spill_batch_.data(), spill_batch_.data() + count, dropped);
+      dropped = 0;
+      metrics_.exported.Increment(count);
+      metrics_.batch_size.Record(count);
+      exported += count;
+    }
+    // If the file could not be read, the rest of it is skipped.
+    spill_read_offset_ = spill_end;
+    return exported;
+  }
+
+  size_t ExportSpilled(uint64_t, size_t, std::false_type) {
+    return 0;
+  }
+
+  // Writes the message into the spill file. MUTEX-LOCKED.
+  bool Spill(const T_MESSAGE& message, std::true_type) {
+    MQSpillCodec<T_MESSAGE>::Encode(message, spill_record_);
+    return spill_->Append(spill_record_.data(), spill_record_.size());
+  }
+
+  bool Spill(const T_MESSAGE&, std::false_type) {
+    return false;
+  }
+
+  // Waits, with the mutex released, until the linger since the first pending message expires, or until
+  // `max_batch_bytes_` are pending, or the buffer is full. MUTEX-LOCKED on entry and on exit.
+  void Linger(std::unique_lock<std::mutex>& lock) {
+    if (!first_pending_time_set_) {
+      // The messages were pushed before the linger was set.
+      return;
+    }
+    consumer_lingering_ = true;
+    condition_variable_.wait_until(lock, first_pending_time_ + linger_, [this] {
+      return destructing_ || pending_bytes_ >= max_batch_bytes_ || Full();
+    });
+    consumer_lingering_ = false;
+  }
+
+  // Whether the lingering consumer should be woken up now. MUTEX-LOCKED.
+  bool LingerIsOver() const {
+    return consumer_lingering_ && (pending_bytes_ >= max_batch_bytes_ || Full());
+  }
+
+  // Compile-time detection of the optional `OnMessages()` method of the consumer.
+  template <typename T>
+  struct ConsumerHasOnMessages {
+    template <typename U>
+    static auto Test(U* consumer)
+        -> decltype(consumer->OnMessages(static_cast<const T_MESSAGE*>(nullptr),
+                                         static_cast<const T_MESSAGE*>(nullptr),
+                                         static_cast<size_t>(0)),
+                    std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+
+  // Compile-time detection of the optional `OnExpiredMessages()` method of the consumer.
+  template <typename T>
+  struct ConsumerHasOnExpiredMessages {
+    template <typename U>
+    static auto Test(U* consumer)
+        -> decltype(consumer->OnExpiredMessages(static_cast<size_t>(0)), std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+
+  void ReportExpired(size_t expired, std::true_type) {
+    consumer_.OnExpiredMessages(expired);
+  }
+  void ReportExpired(size_t, std::false_type) {
+  }
+
+  void ExportRange(const T_MESSAGE* begin, const T_MESSAGE* end, size_t dropped) {
+    BRICKS_TRACE_SCOPE("EfficientMQ::ExportRange");
+    ExportRange(begin, end, dropped, typename ConsumerHasOnMessages<T_CONSUMER>::type());
+  }
+
+  void ExportRange(const T_MESSAGE* begin, const T_MESSAGE* end, size_t dropped, std::true_type) {
+    consumer_.OnMessages(begin, end, dropped);
+  }
+
+  void ExportRange(const T_MESSAGE* begin, const T_MESSAGE* end, size_t dropped, std::false_type) {
+    for (const T_MESSAGE* it = begin; it != end; ++it) {
+      consumer_.OnMessage(*it, dropped);
+      dropped = 0;
+    }
+  }
+
+  // Returns true if there is no room in the buffer for one more message.
+  bool Full() const {
+    return (head_allocated_ + 1) % circular_buffer_size_ == tail_;
+  }
+
+  // Where the message being pushed goes.
+  enum class Allocation { Slot, Spilled, Rejected };
+
+  // `message` is what may be spilled, if the spill file is set, and nullptr if it is constructed in place.
+  Allocation PushEventAllocate(size_t& index, const T_MESSAGE* message) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return PushEventAllocate(lock, index, message);
+  }
+
+  // Returns with `lock` held if the slot has been allocated.
+  Allocation PushEventAllocate(std::unique_lock<std::mutex>& lock, size_t& index, const T_MESSAGE* message) {
+    // First, allocate room in the buffer for this message, or spill it, if the buffer is full
+    // or the messages pushed before it are in the spill file.
+    // Handle the overflow according to the policy.
+    // MUTEX-LOCKED, except for the notification of the consumer thread about the spilled message.
+    BRICKS_TRACE_SCOPE("EfficientMQ::PushEventAllocate");
+    if (spill_ && message && (Full() || number_of_spilled_events_) &&
+        Spill(*message, std::integral_constant<bool, kSpillSupported>())) {
+      ++number_of_spilled_events_;
+      metrics_.pushed.Increment();
+      metrics_.spilled.Increment();
+      ++version_;
+      const bool notify = consumer_parked_ || consumer_lingering_;
+      lock.unlock();
+      if (notify) {
+        NotifyConsumer();
+      }
+      return Allocation::Spilled;
+    }
+    if (Full()) {
+      if (OVERFLOW_POLICY == MQOverflowPolicy::DropOldest) {
+        // Buffer overflow, must drop the least recent element and keep the count of those.
+        ++number_of_dropped_events_;
+        metrics_.dropped.Increment();
+        if (exporting_) {
+          // The least recent element is being read by the consumer, with the mutex released,
+          // thus its slot can not be handed over. The newest one is dropped instead.
+          return Allocation::Rejected;
+        }
+        if (tail_ == head_ready_) {
+          Increment(head_ready_);
+        }
+        Increment(tail_);
+      } else if (OVERFLOW_POLICY == MQOverflowPolicy::RejectNewest) {
+        ++number_of_dropped_events_;
+        metrics_.dropped.Increment();
+        return Allocation::Rejected;
+      } else {
+        WaitUntilNotFull(lock);
       }
-      Increment(tail_);
     }
+    index = head_allocated_;
+    Increment(head_allocated_);
+    if (max_age_.count()) {
+      pushed_at_[index] = std::chrono::steady_clock::now();
+    }
+    metrics_.pushed.Increment();
     // Mark this message as incomplete, not yet ready to be sent over to the consumer.
-    circular_buffer_[index].finalized = false;
-    return index;
+    finalized_[index] = false;
+    return Allocation::Slot;
+  }
+
+  // Spin-then-wait until the consumer frees up room in the buffer.
+  void WaitUntilNotFull(std::unique_lock<std::mutex>& lock) {
+    for (size_t i = 0; i < kBlockedProducerSpinIterations && Full(); ++i) {
+      lock.unlock();
+      std::this_thread::yield();
+      lock.lock();
+    }
+    if (Full()) {
+      if (consumer_lingering_) {
+        NotifyConsumer();
+      }
+      ++number_of_blocked_producers_;
+      producers_condition_variable_.wait(lock, [this] { return !Full(); });
+      --number_of_blocked_producers_;
+    }
   }
 
   void PushEventCommit(const size_t index) {
     // After the message has been copied over, mark it as finalized and advance `head_ready_`.
-    // MUTEX-LOCKED.
-    std::lock_guard<std::mutex> lock(mutex_);
-    circular_buffer_[index].finalized = true;
-    while (head_ready_ != head_allocated_ && circular_buffer_[head_ready_].finalized) {
+    // MUTEX-LOCKED, except for the notification, which is only needed if the consumer is parked,
+    // or if it is lingering, and the batch is now large enough.
+    bool notify;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      notify = PushEventCommit(lock, index);
+    }
+    if (notify) {
+      NotifyConsumer();
+    }
+  }
+
+  // Returns whether the consumer is to be notified. MUTEX-LOCKED.
+  bool PushEventCommit(std::unique_lock<std::mutex>&, const size_t index) {
+    finalized_[index] = true;
+    if (linger_.count()) {
+      if (!first_pending_time_set_) {
+        first_pending_time_ = std::chrono::steady_clock::now();
+        first_pending_time_set_ = true;
+      }
+      pending_bytes_ += MQMessageBytes<T_MESSAGE>::Of(circular_buffer_[index]);
+    }
+    while (head_ready_ != head_allocated_ && finalized_[head_ready_]) {
       Increment(head_ready_);
     }
-    condition_variable_.notify_all();
+    ++version_;
+    return consumer_parked_ || LingerIsOver();
+  }
+
+  // Wakes the consumer up: its thread, or, with `MQConsumerExecutor`, its next round.
+  void NotifyConsumer() {
+    if (executor_) {
+      executor_->Wake(consumer_id_);
+    } else {
+      condition_variable_.notify_one();
+    }
   }
 
   // The instance of the consuming side of the FIFO buffer.
   T_CONSUMER& consumer_;
 
   // The capacity of the circular buffer for intermediate events.
-  // Events beyond it will be dropped.
+  // Events beyond it will be dropped, rejected or will block the producer, depending on the policy.
   const size_t circular_buffer_size_;
 
-  // The `Entry` struct keeps the entries along with the flag describing whether the message is done being
-  // populated and thus is ready to be exported. The flag is neccesary, since the message at index `i+1` might
-  // chronologically get finalized before the message at index `i` does.
-  struct Entry {
-    T_MESSAGE message_body;
-    bool finalized;
-  };
-
   // The circular buffer, of size `circular_buffer_size_`.
-  std::vector<Entry> circular_buffer_;
+  // Messages are stored contiguously, so that ranges of them can be handed over to `OnMessages()`.
+  bricks::memory::Vector<T_MESSAGE> circular_buffer_;
+
+  // The flags describing whether the message is done being populated and thus is ready to be exported.
+  // The flag is neccesary, since the message at index `i+1` might chronologically get finalized
+  // before the message at index `i` does. Guarded by `mutex_`.
+  std::vector<char> finalized_;
 
   // The number of events that have been overwritten due to buffer overflow.
   size_t number_of_dropped_events_ = 0;
 
-  // The thread in which the consuming process is running.
-  std::thread consumer_thread_;
-
   // To minimize the time for which the message emitting thread is blocked for,
   // the buffer uses three "pointers":
   // 1) `tail_`: The index of the next element to be exported and removed from the buffer.
@@ -172,11 +762,62 @@ class EfficientMQ final {
   size_t tail_ = 0;
   size_t head_ready_ = 0;
   size_t head_allocated_ = 0;
+  // Set while the consumer exports the range from `tail_` with the mutex released. `tail_` then stays put,
+  // and `MQOverflowPolicy::DropOldest` drops the message being pushed instead of the oldest one.
+  bool exporting_ = false;
   std::mutex mutex_;
   std::condition_variable condition_variable_;
 
+  // Waiting of the consumer thread, see `MQWaitStrategy`.
+  // `version_` is bumped on each commit and on destruction, and is what the consumer spins on.
+  // `consumer_parked_` is set while the consumer waits on `condition_variable_`. Both are updated under `mutex_`.
+  std::atomic_size_t version_{0};
+  bool consumer_parked_ = false;
+
+  // The linger, see `SetLinger()`, and the state of it. Guarded by `mutex_`.
+  // `pending_bytes_` and `first_pending_time_` are of the messages committed since the consumer
+  // has last taken the messages to export.
+  std::chrono::milliseconds linger_{0};
+  size_t max_batch_bytes_ = 0;
+  size_t pending_bytes_ = 0;
+  std::chrono::steady_clock::time_point first_pending_time_;
+  bool first_pending_time_set_ = false;
+  bool consumer_lingering_ = false;
+
+  // The max age, see `SetMaxAge()`, guarded by `mutex_`, and the time each message has been pushed at,
+  // by slot, set with the slot allocated and read by the consumer for the slots ready to be exported.
+  std::chrono::milliseconds max_age_{0};
+  std::vector<std::chrono::steady_clock::time_point> pushed_at_;
+
+  // The spill file, see `SetSpillFile()`, guarded by `mutex_`, except for reading it back, and the number
+  // of the messages in it. `spill_set_` is for `EmplaceMessage()` to check without locking.
+  std::unique_ptr<MQSpillFile> spill_;
+  std::atomic_bool spill_set_{false};
+  size_t number_of_spilled_events_ = 0;
+  std::string spill_record_;
+  // Only accessed by the consumer thread: what of the spill file it has read, and what it reads into.
+  uint64_t spill_read_offset_ = 0;
+  std::string spill_read_buffer_;
+  std::vector<T_MESSAGE> spill_batch_;
+
+  // For `MQOverflowPolicy::BlockProducer`, the producers waiting for room in the buffer.
+  size_t number_of_blocked_producers_ = 0;
+  std::condition_variable producers_condition_variable_;
+
   // For safe thread destruction.
   bool destructing_ = false;
+
+  // Shared by all the instances, resolved once, for the hot path to not look them up.
+  EfficientMQMetrics& metrics_ = EfficientMQMetrics::Singleton();
+
+  // The executor running the consumer rounds, see `ConsumerRound()`, if the queue has been given one,
+  // in which case there is no consumer thread.
+  MQConsumerExecutor* const executor_ = nullptr;
+  MQConsumerExecutor::ConsumerID consumer_id_ = 0;
+
+  // The thread in which the consuming process is running.
+  // Declared last, since it should only be started once all the other members have been initialized.
+  std::thread consumer_thread_;
 };
 
 #endif  // SANDBOX_MQ_EFFICIENT_H
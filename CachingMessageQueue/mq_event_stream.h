@@ -0,0 +1,45 @@
+#ifndef SANDBOX_MQ_EVENT_STREAM_H
+#define SANDBOX_MQ_EVENT_STREAM_H
+
+// MQEventStreamConsumer publishes the messages of a `BroadcastMQ` to the subscribers of an `HTTPEventStream`.
+// Intent:    To have the operators tail the live events over a `text/event-stream` endpoint instead of polling.
+// Objective: To keep the queue unaffected by the subscribers, however many and however slow.
+//
+// Each message becomes the data of an event, encoded once for all the subscribers, see
+// `Bricks/net/http/impl/event_stream.h`. The consumer thread of the queue only hands the frame over to the
+// stream, which writes it out on its own thread, and drops or disconnects the subscribers that fall behind.
+// The messages the queue has dropped for the consumer are reported to the subscribers as a comment, which
+// the clients ignore, and which shows up where a stream is being looked at with `curl`.
+//
+//   HTTPEventStream stream;
+//   MQEventStreamConsumer consumer(stream);
+//   BroadcastMQ<MQEventStreamConsumer> mq;
+//   mq.AddConsumer(consumer);
+//   ...
+//   stream.Subscribe(connection);
+
+#include <memory>
+#include <string>
+
+#include "../Bricks/net/http/impl/event_stream.h"
+
+class MQEventStreamConsumer final {
+ public:
+  // The `event:` of each event, none if empty.
+  explicit MQEventStreamConsumer(bricks::net::HTTPEventStream& stream, const std::string& event = "")
+      : stream_(stream), event_(event) {}
+
+  void OnMessage(const std::string& message, size_t number_of_dropped_events_if_any) {
+    if (number_of_dropped_events_if_any) {
+      stream_.PublishFrame(std::make_shared<const std::string>(bricks::net::HTTPEventStream::EncodeComment(
+          "dropped " + std::to_string(number_of_dropped_events_if_any))));
+    }
+    stream_.Publish(message, event_);
+  }
+
+ private:
+  bricks::net::HTTPEventStream& stream_;
+  const std::string event_;
+};
+
+#endif  // SANDBOX_MQ_EVENT_STREAM_H
@@ -0,0 +1,208 @@
+#ifndef SANDBOX_MQ_LOCKFREE_H
+#define SANDBOX_MQ_LOCKFREE_H
+
+// LockFreeMQ is the lock-free counterpart of EfficientMQ.
+// Same contract: a circular buffer of limited size, the oldest messages are dropped on overflow,
+// and the consumer is called from a dedicated thread as `OnMessage(message, number_of_dropped_events)`.
+//
+// The difference is that no mutex is held on the `PushMessage()` path.
+// A producer claims its slot via one atomic fetch-add on `head_`, and each slot carries its own sequence number
+// that encodes the logical position the slot currently belongs to, along with its state.
+// The mutex and the condition variable are only used to park the consumer thread when the queue is empty.
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+template <typename CONSUMER, typename MESSAGE = std::string, size_t DEFAULT_BUFFER_SIZE = 1024>
+class LockFreeMQ final {
+ public:
+  // Type of entries to store, defaults to `std::string`.
+  typedef MESSAGE T_MESSAGE;
+
+  // Type of the processor of the entries.
+  // It should expose one method, void OnMessage(const T_MESSAGE&, size_t number_of_dropped_events_if_any);
+  // This method will be called from one thread, which is spawned and owned by an instance of LockFreeMQ.
+  typedef CONSUMER T_CONSUMER;
+
+  // The only constructor requires the refence to the instance of the consumer of entries.
+  explicit LockFreeMQ(T_CONSUMER& consumer, size_t buffer_size = DEFAULT_BUFFER_SIZE)
+      : consumer_(consumer), circular_buffer_size_(buffer_size), circular_buffer_(circular_buffer_size_) {
+    for (size_t i = 0; i < circular_buffer_size_; ++i) {
+      circular_buffer_[i].sequence = Sequence(i, SlotState::Free);
+    }
+    consumer_thread_ = std::thread(&LockFreeMQ::ConsumerThread, this);
+  }
+
+  // Destructor waits for the consumer thread to terminate, which implies committing all the queued events.
+  ~LockFreeMQ() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      destructing_ = true;
+    }
+    condition_variable_.notify_all();
+    consumer_thread_.join();
+  }
+
+  // Adds an message to the buffer.
+  // Supports both copy and move semantics.
+  // THREAD SAFE. Lock-free, unless the slot is being read by the consumer, or written by a lagging producer.
+  void PushMessage(const T_MESSAGE& message) {
+    const size_t position = PushEventAllocate();
+    circular_buffer_[position % circular_buffer_size_].message_body = message;
+    PushEventCommit(position);
+  }
+  void PushMessage(T_MESSAGE&& message) {
+    const size_t position = PushEventAllocate();
+    circular_buffer_[position % circular_buffer_size_].message_body = std::move(message);
+    PushEventCommit(position);
+  }
+
+  // Adds a message to the buffer by constructing it in place, in the storage of the slot.
+  // The message in the slot is resized to `length`, reusing the memory it already holds,
+  // and then `writer(T_MESSAGE& message)` is called to populate it.
+  // With `T_MESSAGE = std::string`, this saves the caller one allocation and one copy per message.
+  // The writer should not throw, as the slot would then never be committed.
+  // THREAD SAFE.
+  template <typename F>
+  void EmplaceMessage(size_t length, F&& writer) {
+    const size_t position = PushEventAllocate();
+    T_MESSAGE& message = circular_buffer_[position % circular_buffer_size_].message_body;
+    message.resize(length);
+    writer(message);
+    PushEventCommit(position);
+  }
+
+ private:
+  LockFreeMQ(const LockFreeMQ&) = delete;
+  LockFreeMQ(LockFreeMQ&&) = delete;
+  void operator=(const LockFreeMQ&) = delete;
+  void operator=(LockFreeMQ&&) = delete;
+
+  // The state of the slot, stored in the two least significant bits of its sequence number.
+  enum class SlotState : size_t { Free = 0, Writing = 1, Ready = 2, Reading = 3 };
+
+  static size_t Sequence(size_t position, SlotState state) {
+    return (position << 2) | static_cast<size_t>(state);
+  }
+  static size_t PositionOf(size_t sequence) {
+    return sequence >> 2;
+  }
+  static SlotState StateOf(size_t sequence) {
+    return static_cast<SlotState>(sequence & 3);
+  }
+
+  // Returns true if the consumer, waiting on logical position `tail`, has something to do:
+  // either the message is ready, or it has been overwritten by a more recent one and should be skipped.
+  bool ConsumerCanProceed(size_t tail) const {
+    const size_t sequence = circular_buffer_[tail % circular_buffer_size_].sequence;
+    return PositionOf(sequence) > tail || sequence == Sequence(tail, SlotState::Ready);
+  }
+
+  // The thread which extracts fully populated events from the tail of the buffer and exports them.
+  void ConsumerThread() {
+    size_t tail = 0;
+    while (true) {
+      if (!ConsumerCanProceed(tail)) {
+        // Park until a producer commits the message at `tail`.
+        // The `consumer_waiting_` flag tells producers the notification is needed.
+        std::unique_lock<std::mutex> lock(mutex_);
+        consumer_waiting_ = true;
+        condition_variable_.wait(lock, [this, tail] { return ConsumerCanProceed(tail) || destructing_; });
+        consumer_waiting_ = false;
+        if (!ConsumerCanProceed(tail)) {
+          // Destructing and nothing left to export.
+          return;
+        }
+      }
+
+      Entry& entry = circular_buffer_[tail % circular_buffer_size_];
+      size_t expected = Sequence(tail, SlotState::Ready);
+      if (entry.sequence.compare_exchange_strong(expected, Sequence(tail, SlotState::Reading))) {
+        // Export the message. The slot is exclusively owned by the consumer while in the `Reading` state.
+        consumer_.OnMessage(entry.message_body, number_of_dropped_events_.exchange(0));
+        entry.sequence = Sequence(tail + circular_buffer_size_, SlotState::Free);
+      }
+      // Either the message has been exported, or a producer has overwritten it; move on in both cases.
+      ++tail;
+    }
+  }
+
+  size_t PushEventAllocate() {
+    // First, claim the logical position for this message.
+    const size_t position = head_.fetch_add(1);
+    Entry& entry = circular_buffer_[position % circular_buffer_size_];
+    const size_t free_sequence = Sequence(position, SlotState::Free);
+    const size_t overwritable_sequence =
+        position >= circular_buffer_size_ ? Sequence(position - circular_buffer_size_, SlotState::Ready)
+                                          : free_sequence;
+    const size_t writing_sequence = Sequence(position, SlotState::Writing);
+    while (true) {
+      size_t expected = entry.sequence;
+      if (expected == free_sequence) {
+        if (entry.sequence.compare_exchange_weak(expected, writing_sequence)) {
+          return position;
+        }
+      } else if (expected == overwritable_sequence) {
+        // Buffer overflow, must drop the least recent element and keep the count of those.
+        if (entry.sequence.compare_exchange_weak(expected, writing_sequence)) {
+          ++number_of_dropped_events_;
+          return position;
+        }
+      } else {
+        // The slot is being exported by the consumer, or is still being populated by the producer
+        // that claimed it one lap ago. Either is short-lived, so yield and retry.
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  void PushEventCommit(const size_t position) {
+    // After the message has been copied over, mark it as ready to be exported.
+    circular_buffer_[position % circular_buffer_size_].sequence = Sequence(position, SlotState::Ready);
+    if (consumer_waiting_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      condition_variable_.notify_all();
+    }
+  }
+
+  // The instance of the consuming side of the FIFO buffer.
+  T_CONSUMER& consumer_;
+
+  // The capacity of the circular buffer for intermediate events.
+  // Events beyond it will be dropped.
+  const size_t circular_buffer_size_;
+
+  // The `Entry` struct keeps the message along with its sequence number.
+  // The sequence number is `(position << 2) | state`, where `position` is the logical, ever-increasing,
+  // index of the message this slot is holding or is about to hold.
+  struct Entry {
+    std::atomic_size_t sequence;
+    T_MESSAGE message_body;
+  };
+
+  // The circular buffer, of size `circular_buffer_size_`.
+  std::vector<Entry> circular_buffer_;
+
+  // The logical index of the next message to be pushed. Only ever incremented.
+  std::atomic_size_t head_{0};
+
+  // The number of events that have been overwritten due to buffer overflow.
+  std::atomic_size_t number_of_dropped_events_{0};
+
+  // Parking of the consumer thread when there is nothing to export.
+  std::atomic_bool consumer_waiting_{false};
+  std::mutex mutex_;
+  std::condition_variable condition_variable_;
+
+  // For safe thread destruction.
+  bool destructing_ = false;
+
+  // The thread in which the consuming process is running.
+  std::thread consumer_thread_;
+};
+
+#endif  // SANDBOX_MQ_LOCKFREE_H
@@ -0,0 +1,113 @@
+#ifndef SANDBOX_MQ_MULTI_CONSUMER_H
+#define SANDBOX_MQ_MULTI_CONSUMER_H
+
+// MultiConsumerMQ is a pool of `EfficientMQ`-s, each with its own consumer thread.
+// Intent:    To not have one consumer thread be the throughput ceiling when processing messages is CPU-heavy.
+// Objective: N consumer threads process messages in parallel, optionally keeping the order per key.
+//
+// Each message goes to one of the N partitions:
+// * With `MQUnorderedDelivery`, the default, each producer thread spreads its messages round-robin.
+//   There is no order guarantee across partitions, and no shared state between the producers.
+// * With a user-provided `KEY_HASHER`, `size_t operator()(const T_MESSAGE&) const`, the partition is
+//   the hash modulo N. Messages with the same hash are delivered in order, by the same consumer thread.
+//
+// Each consumer thread calls its own consumer, from the array passed to the constructor,
+// or one shared consumer, which then has to be thread safe.
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "mq_efficient.h"
+
+// The tag to use as `KEY_HASHER` for unordered delivery.
+struct MQUnorderedDelivery {};
+
+template <typename CONSUMER,
+          typename MESSAGE = std::string,
+          typename KEY_HASHER = MQUnorderedDelivery,
+          size_t DEFAULT_BUFFER_SIZE = 1024,
+          MQOverflowPolicy OVERFLOW_POLICY = MQOverflowPolicy::DropOldest,
+          MQWaitStrategy WAIT_STRATEGY = MQWaitStrategy::Adaptive>
+class MultiConsumerMQ final {
+ public:
+  typedef MESSAGE T_MESSAGE;
+  typedef CONSUMER T_CONSUMER;
+  typedef KEY_HASHER T_KEY_HASHER;
+  typedef EfficientMQ<T_CONSUMER, T_MESSAGE, DEFAULT_BUFFER_SIZE, OVERFLOW_POLICY, WAIT_STRATEGY> T_PARTITION;
+
+  // One consumer per consumer thread: `consumers[i]` is only called from the i-th thread.
+  // The buffer size is per partition.
+  MultiConsumerMQ(T_CONSUMER* consumers,
+                  size_t number_of_consumers,
+                  size_t buffer_size = DEFAULT_BUFFER_SIZE,
+                  T_KEY_HASHER hasher = T_KEY_HASHER())
+      : hasher_(hasher) {
+    for (size_t i = 0; i < number_of_consumers; ++i) {
+      partitions_.emplace_back(new T_PARTITION(consumers[i], buffer_size));
+    }
+  }
+
+  // One shared consumer, called concurrently from all the consumer threads. It should be thread safe.
+  MultiConsumerMQ(T_CONSUMER& shared_consumer,
+                  size_t number_of_consumers,
+                  size_t buffer_size = DEFAULT_BUFFER_SIZE,
+                  T_KEY_HASHER hasher = T_KEY_HASHER())
+      : hasher_(hasher) {
+    for (size_t i = 0; i < number_of_consumers; ++i) {
+      partitions_.emplace_back(new T_PARTITION(shared_consumer, buffer_size));
+    }
+  }
+
+  size_t NumberOfConsumers() const {
+    return partitions_.size();
+  }
+
+  // Adds an message to one of the partitions.
+  // Returns false if the message was rejected, which only happens with `MQOverflowPolicy::RejectNewest`.
+  // THREAD SAFE.
+  bool PushMessage(const T_MESSAGE& message) {
+    return partitions_[Partition(message, hasher_)]->PushMessage(message);
+  }
+  bool PushMessage(T_MESSAGE&& message) {
+    T_PARTITION& partition = *partitions_[Partition(message, hasher_)];
+    return partition.PushMessage(std::move(message));
+  }
+
+  // In-place construction, see `EfficientMQ::EmplaceMessage()`.
+  // Only available for unordered delivery, since with a key hasher the message is needed to pick the partition.
+  template <typename F, typename H = T_KEY_HASHER>
+  typename std::enable_if<std::is_same<H, MQUnorderedDelivery>::value, bool>::type EmplaceMessage(size_t length,
+                                                                                                  F&& writer) {
+    return partitions_[NextRoundRobinPartition()]->EmplaceMessage(length, std::forward<F>(writer));
+  }
+
+ private:
+  MultiConsumerMQ(const MultiConsumerMQ&) = delete;
+  MultiConsumerMQ(MultiConsumerMQ&&) = delete;
+  void operator=(const MultiConsumerMQ&) = delete;
+  void operator=(MultiConsumerMQ&&) = delete;
+
+  size_t NextRoundRobinPartition() const {
+    // Per producer thread, starting from a thread-specific offset, so that the threads do not move in lockstep.
+    static thread_local size_t counter = std::hash<std::thread::id>()(std::this_thread::get_id());
+    return (counter++) % partitions_.size();
+  }
+
+  template <typename H>
+  size_t Partition(const T_MESSAGE& message, const H&) const {
+    return hasher_(message) % partitions_.size();
+  }
+  size_t Partition(const T_MESSAGE&, const MQUnorderedDelivery&) const {
+    return NextRoundRobinPartition();
+  }
+
+  const T_KEY_HASHER hasher_;
+  std::vector<std::unique_ptr<T_PARTITION>> partitions_;
+};
+
+#endif  // SANDBOX_MQ_MULTI_CONSUMER_H
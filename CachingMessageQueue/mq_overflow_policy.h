@@ -0,0 +1,13 @@
+#ifndef SANDBOX_MQ_OVERFLOW_POLICY_H
+#define SANDBOX_MQ_OVERFLOW_POLICY_H
+
+// What to do when a message is pushed into a full buffer.
+// DropOldest:    Overwrite the least recent message not yet exported. Never blocks. The queues exporting
+//                the messages in place, such as EfficientMQ and ArenaMQ, reject the new one instead
+//                while the least recent one is being exported.
+// BlockProducer: Wait until the consumer frees up room. Lossless. Spins briefly before waiting.
+// RejectNewest:  Do not add the message, `PushMessage()` returns false. Never blocks.
+// Both dropped and rejected messages are reported to the consumer as `number_of_dropped_events`.
+enum class MQOverflowPolicy { DropOldest, BlockProducer, RejectNewest };
+
+#endif  // SANDBOX_MQ_OVERFLOW_POLICY_H
@@ -0,0 +1,317 @@
+#ifndef SANDBOX_MQ_PRIORITY_H
+#define SANDBOX_MQ_PRIORITY_H
+
+// PriorityMQ buffers the messages of several priorities for one consumer, dropping the low priority ones first.
+// Intent:    To not lose a critical error message to a flood of debug events when the consumer falls behind.
+// Objective: A message is only ever dropped to make room for a message of the same or of a higher priority.
+//
+// The priorities are from 0 to `LEVELS - 1`, the higher the more important.
+// The buffer of `buffer_size` messages is split into the capacity reserved for each priority,
+// and the shared rest. A priority always has room for its reserved number of messages,
+// and beyond that it takes from the shared capacity.
+// Once the shared capacity is exhausted, a new message evicts the oldest message of the lowest priority
+// that uses the shared capacity, as long as that priority is not higher than its own. Otherwise it evicts
+// the oldest message of its own priority, and is itself dropped only if its priority has no capacity reserved
+// and no messages buffered.
+//
+// The consumer thread exports the higher priorities first, within the fairness bound: a non-empty priority
+// waits for at most `fairness_bound` messages of the higher priorities to be exported before one of its own is.
+// With `fairness_bound` of zero the order is strictly by priority, and the low priorities may starve.
+// The messages of one priority are exported in the order they were pushed.
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+template <typename CONSUMER,
+          typename MESSAGE = std::string,
+          size_t LEVELS = 3,
+          size_t DEFAULT_BUFFER_SIZE = 1024>
+class PriorityMQ final {
+  static_assert(LEVELS > 0, "PriorityMQ needs at least one priority.");
+
+ public:
+  // Type of entries to store, defaults to `std::string`.
+  typedef MESSAGE T_MESSAGE;
+
+  // Type of the processor of the entries.
+  // It should expose one method,
+  // void OnMessage(const T_MESSAGE&, size_t priority, size_t number_of_dropped_events_of_this_priority_if_any);
+  // The dropped messages are counted per priority, and reported along with the next message of that priority.
+  // This method will be called from one thread, which is spawned and owned by an instance of PriorityMQ.
+  typedef CONSUMER T_CONSUMER;
+
+  // The number of priorities.
+  enum { kLevels = LEVELS };
+
+  // The default fairness bound, see the header comment.
+  enum { kDefaultFairnessBound = 64 };
+
+  // The maximum number of messages the consumer thread takes from the buffer at once.
+  enum { kMaxExportBatchSize = 32 };
+
+  // Reserves half of the buffer, split evenly between the priorities.
+  explicit PriorityMQ(T_CONSUMER& consumer,
+                      size_t buffer_size = DEFAULT_BUFFER_SIZE,
+                      size_t fairness_bound = kDefaultFairnessBound)
+      : PriorityMQ(consumer, buffer_size, EvenlyReserved(buffer_size), fairness_bound) {
+  }
+
+  // Reserves `reserved_capacity[priority]` messages for each priority.
+  // If they add up to more than `buffer_size`, the buffer is their sum, with no shared capacity.
+  PriorityMQ(T_CONSUMER& consumer,
+             size_t buffer_size,
+             const std::array<size_t, LEVELS>& reserved_capacity,
+             size_t fairness_bound = kDefaultFairnessBound)
+      : consumer_(consumer),
+        shared_capacity_(SharedCapacity(buffer_size, reserved_capacity)),
+        fairness_bound_(fairness_bound),
+        levels_(MakeLevels(reserved_capacity, shared_capacity_)),
+        batch_(kMaxExportBatchSize),
+        consumer_thread_(&PriorityMQ::ConsumerThread, this) {
+  }
+
+  // Destructor waits for the consumer thread to terminate, which implies committing all the queued events.
+  ~PriorityMQ() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      destructing_ = true;
+    }
+    condition_variable_.notify_all();
+    consumer_thread_.join();
+  }
+
+  // Adds a message of the priority to the buffer. The priorities above `LEVELS - 1` are taken as `LEVELS - 1`.
+  // Supports both copy and move semantics. The message is copied into the slot under the mutex,
+  // reusing the memory the slot already holds.
+  // Returns false if the message itself was dropped, see the header comment.
+  // THREAD SAFE.
+  bool PushMessage(const T_MESSAGE& message, size_t priority) {
+    return Push(message, priority);
+  }
+  bool PushMessage(T_MESSAGE&& message, size_t priority) {
+    return Push(std::move(message), priority);
+  }
+
+ private:
+  PriorityMQ(const PriorityMQ&) = delete;
+  PriorityMQ(PriorityMQ&&) = delete;
+  void operator=(const PriorityMQ&) = delete;
+  void operator=(PriorityMQ&&) = delete;
+
+  // The ring buffer of one priority, of its reserved capacity plus the shared capacity.
+  // `head` and `tail` are ever-increasing, the index in the buffer is taken modulo its size.
+  struct Level {
+    std::vector<T_MESSAGE> circular_buffer;
+    size_t reserved = 0;
+    size_t head = 0;
+    size_t tail = 0;
+    // The messages of this priority dropped since the last one exported.
+    size_t number_of_dropped_events = 0;
+    // The messages of the higher priorities exported since the last one of this one, while it was non-empty.
+    size_t waited = 0;
+
+    size_t Size() const {
+      return head - tail;
+    }
+    T_MESSAGE& Slot(size_t i) {
+      return circular_buffer[i % circular_buffer.size()];
+    }
+  };
+
+  // What the consumer thread has taken from the buffer, to export with the mutex released.
+  struct Exported {
+    T_MESSAGE message;
+    size_t priority;
+    size_t number_of_dropped_events;
+  };
+
+  static std::array<size_t, LEVELS> EvenlyReserved(size_t buffer_size) {
+    std::array<size_t, LEVELS> reserved;
+    reserved.fill(buffer_size / (2 * LEVELS));
+    return reserved;
+  }
+
+  static std::array<Level, LEVELS> MakeLevels(const std::array<size_t, LEVELS>& reserved_capacity,
+                                              size_t shared_capacity) {
+    std::array<Level, LEVELS> levels;
+    for (size_t priority = 0; priority < LEVELS; ++priority) {
+      levels[priority].reserved = reserved_capacity[priority];
+      levels[priority].circular_buffer.resize(std::max(reserved_capacity[priority] + shared_capacity,
+                                                       static_cast<size_t>(1)));
+    }
+    return levels;
+  }
+
+  static size_t SharedCapacity(size_t buffer_size, const std::array<size_t, LEVELS>& reserved_capacity) {
+    size_t total_reserved = 0;
+    for (size_t reserved : reserved_capacity) {
+      total_reserved += reserved;
+    }
+    return buffer_size > total_reserved ? buffer_size - total_reserved : 0;
+  }
+
+  template <typename T>
+  bool Push(T&& message, size_t priority) {
+    priority = std::min(priority, static_cast<size_t>(LEVELS - 1));
+    bool pushed;
+    bool notify;
+    {
+      // MUTEX-LOCKED.
+      std::lock_guard<std::mutex> lock(mutex_);
+      Level& level = levels_[priority];
+      pushed = MakeRoom(priority);
+      if (pushed) {
+        level.Slot(level.head) = std::forward<T>(message);
+        ++level.head;
+      } else {
+        ++level.number_of_dropped_events;
+      }
+      notify = consumer_parked_;
+    }
+    if (notify) {
+      condition_variable_.notify_one();
+    }
+    return pushed;
+  }
+
+  size_t SharedInUse() const {
+    size_t shared = 0;
+    for (const Level& level : levels_) {
+      shared += level.Size() > level.reserved ? level.Size() - level.reserved : 0;
+    }
+    return shared;
+  }
+
+  // Makes room for one more message of the priority, evicting a message if needed. MUTEX-LOCKED.
+  bool MakeRoom(size_t priority) {
+    Level& level = levels_[priority];
+    if (level.Size() < level.reserved || SharedInUse() < shared_capacity_) {
+      return true;
+    }
+    for (size_t lower = 0; lower <= priority; ++lower) {
+      if (levels_[lower].Size() > levels_[lower].reserved) {
+        DropOldest(levels_[lower]);
+        return true;
+      }
+    }
+    // This priority uses exactly its reserved capacity.
+    if (level.Size()) {
+      DropOldest(level);
+      return true;
+    }
+    return false;
+  }
+
+  static void DropOldest(Level& level) {
+    ++level.tail;
+    ++level.number_of_dropped_events;
+    if (!level.Size()) {
+      level.waited = 0;
+    }
+  }
+
+  bool AllEmpty() const {
+    for (const Level& level : levels_) {
+      if (level.Size()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // The priority to export the next message of: the highest non-empty one, unless a lower non-empty one
+  // has waited for `fairness_bound_` messages, in which case the highest of those. MUTEX-LOCKED.
+  size_t NextPriority() {
+    size_t next = LEVELS;
+    bool starving = false;
+    for (size_t priority = LEVELS; priority-- > 0;) {
+      if (levels_[priority].Size()) {
+        if (next == LEVELS) {
+          next = priority;
+        } else if (!starving && fairness_bound_ && levels_[priority].waited >= fairness_bound_) {
+          next = priority;
+          starving = true;
+        }
+      }
+    }
+    for (size_t lower = 0; lower < next; ++lower) {
+      if (levels_[lower].Size()) {
+        ++levels_[lower].waited;
+      }
+    }
+    levels_[next].waited = 0;
+    return next;
+  }
+
+  // The thread which takes batches of messages from the buffer, in the order of priorities, and exports them.
+  void ConsumerThread() {
+    while (true) {
+      size_t count = 0;
+      {
+        // First, take the messages to export. Wait until there is at least one.
+        // MUTEX-LOCKED, except for the waiting part.
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (AllEmpty()) {
+          if (destructing_) {
+            return;
+          }
+          consumer_parked_ = true;
+          condition_variable_.wait(lock, [this] { return !AllEmpty() || destructing_; });
+          consumer_parked_ = false;
+        }
+        while (count < batch_.size() && !AllEmpty()) {
+          const size_t priority = NextPriority();
+          Level& level = levels_[priority];
+          Exported& exported = batch_[count++];
+          // Swapped, not moved, for the slot to get the memory of an already exported message back.
+          using std::swap;
+          swap(exported.message, level.Slot(level.tail));
+          exported.priority = priority;
+          exported.number_of_dropped_events = level.number_of_dropped_events;
+          level.number_of_dropped_events = 0;
+          ++level.tail;
+        }
+      }
+
+      // Then, export them.
+      // NO MUTEX REQUIRED.
+      for (size_t i = 0; i < count; ++i) {
+        consumer_.OnMessage(batch_[i].message, batch_[i].priority, batch_[i].number_of_dropped_events);
+      }
+    }
+  }
+
+  // The instance of the consuming side of the buffer.
+  T_CONSUMER& consumer_;
+
+  // The capacity shared by all the priorities, beyond the reserved ones.
+  const size_t shared_capacity_;
+
+  // See the header comment.
+  const size_t fairness_bound_;
+
+  // The rings of the priorities, guarded by `mutex_`.
+  std::array<Level, LEVELS> levels_;
+
+  // Only accessed by the consumer thread.
+  std::vector<Exported> batch_;
+
+  std::mutex mutex_;
+  std::condition_variable condition_variable_;
+  bool consumer_parked_ = false;
+
+  // For safe thread destruction.
+  bool destructing_ = false;
+
+  // The thread in which the consuming process is running.
+  // Declared last, since it should only be started once all the other members have been initialized.
+  std::thread consumer_thread_;
+};
+
+#endif  // SANDBOX_MQ_PRIORITY_H
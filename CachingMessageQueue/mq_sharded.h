@@ -0,0 +1,333 @@
+#ifndef SANDBOX_MQ_SHARDED_H
+#define SANDBOX_MQ_SHARDED_H
+
+// ShardedMQ gives each producer thread its own single-producer single-consumer ring buffer.
+// Intent:    To not have the producer threads contend on one head index when there are many of them.
+// Objective: Producers never share a cache line on the hot path, one consumer thread merges the rings.
+//
+// The shard of the calling thread is registered lazily, on its first `PushMessage()` to this instance,
+// and is cached in a `thread_local`. The registration takes a mutex, the subsequent pushes are lock-free.
+// A thread that alternates between several ShardedMQ instances of the same type hits the mutex more often,
+// since the thread-local cache only remembers the most recently used instance.
+//
+// Since a shard has exactly one producer and one consumer, and the consumer may be reading the oldest entry,
+// the overflow of a shard drops the newest message instead of the oldest one.
+// The number of dropped messages is kept per shard and is reported along with the next message of that shard.
+//
+// With `numa_local_shards`, the ring buffer of each shard is allocated on the NUMA node of its producer thread
+// at the time of registration, so that, with the producers pinned, each of them writes into local memory,
+// and only the consumer thread reads across the nodes.
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mq_affinity.h"
+
+// The order in which the consumer thread merges the shards.
+// RoundRobin: One message from each non-empty shard in turn. No shared state between producers.
+// BySequence: The message with the smallest global sequence number among the ones already pushed.
+//             Costs one shared atomic increment per message. The order is best-effort: a message
+//             that has been assigned a sequence number but is not yet published does not hold back the others.
+enum class ShardedMQMergeOrder { RoundRobin, BySequence };
+
+template <typename CONSUMER,
+          typename MESSAGE = std::string,
+          size_t DEFAULT_SHARD_BUFFER_SIZE = 1024,
+          ShardedMQMergeOrder MERGE_ORDER = ShardedMQMergeOrder::RoundRobin>
+class ShardedMQ final {
+ public:
+  // Type of entries to store, defaults to `std::string`.
+  typedef MESSAGE T_MESSAGE;
+
+  // Type of the processor of the entries.
+  // It should expose one method, void OnMessage(const T_MESSAGE&, size_t number_of_dropped_events_if_any);
+  // This method will be called from one thread, which is spawned and owned by an instance of ShardedMQ.
+  typedef CONSUMER T_CONSUMER;
+
+  // The only constructor requires the refence to the instance of the consumer of entries.
+  // The buffer size is per shard, i.e. per producer thread.
+  explicit ShardedMQ(T_CONSUMER& consumer,
+                     size_t shard_buffer_size = DEFAULT_SHARD_BUFFER_SIZE,
+                     bool numa_local_shards = false)
+      : consumer_(consumer),
+        shard_buffer_size_(shard_buffer_size),
+        numa_local_shards_(numa_local_shards),
+        instance_id_(NextInstanceId()),
+        consumer_thread_(&ShardedMQ::ConsumerThread, this) {
+  }
+
+  // Destructor waits for the consumer thread to terminate, which implies committing all the queued events.
+  ~ShardedMQ() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      destructing_ = true;
+    }
+    condition_variable_.notify_all();
+    consumer_thread_.join();
+    Shard* shard = shards_.load();
+    while (shard) {
+      Shard* next = shard->next;
+      delete shard;
+      shard = next;
+    }
+  }
+
+  // Pins the consumer thread to the CPU. Returns false if it could not be pinned, see mq_affinity.h.
+  bool PinConsumerThreadToCPU(int cpu) {
+    return MQPinThreadToCPU(consumer_thread_.native_handle(), cpu);
+  }
+
+  // Adds an message to the shard of the calling thread.
+  // Supports both copy and move semantics.
+  // Returns false if the message was dropped since the shard is full.
+  // THREAD SAFE. Lock-free, except for the very first call from each thread.
+  bool PushMessage(const T_MESSAGE& message) {
+    Shard& shard = ShardOfThisThread();
+    size_t index;
+    if (!PushEventAllocate(shard, index)) {
+      return false;
+    }
+    shard.circular_buffer[index].message_body = message;
+    PushEventCommit(shard);
+    return true;
+  }
+  bool PushMessage(T_MESSAGE&& message) {
+    Shard& shard = ShardOfThisThread();
+    size_t index;
+    if (!PushEventAllocate(shard, index)) {
+      return false;
+    }
+    shard.circular_buffer[index].message_body = std::move(message);
+    PushEventCommit(shard);
+    return true;
+  }
+
+  // Adds a message to the buffer by constructing it in place, in the storage of the slot.
+  // The message in the slot is resized to `length`, reusing the memory it already holds,
+  // and then `writer(T_MESSAGE& message)` is called to populate it.
+  // With `T_MESSAGE = std::string`, this saves the caller one allocation and one copy per message.
+  // The writer should not throw, as the slot would then never be committed.
+  // Returns false if the message was dropped since the shard is full; the writer is not called then.
+  // THREAD SAFE.
+  template <typename F>
+  bool EmplaceMessage(size_t length, F&& writer) {
+    Shard& shard = ShardOfThisThread();
+    size_t index;
+    if (!PushEventAllocate(shard, index)) {
+      return false;
+    }
+    T_MESSAGE& message = shard.circular_buffer[index].message_body;
+    message.resize(length);
+    writer(message);
+    PushEventCommit(shard);
+    return true;
+  }
+
+ private:
+  ShardedMQ(const ShardedMQ&) = delete;
+  ShardedMQ(ShardedMQ&&) = delete;
+  void operator=(const ShardedMQ&) = delete;
+  void operator=(ShardedMQ&&) = delete;
+
+  struct Entry {
+    uint64_t sequence;
+    T_MESSAGE message_body;
+  };
+
+  // A single-producer single-consumer ring buffer.
+  // `head` and `tail` are ever-increasing, the index in the buffer is taken modulo its size.
+  // The producer owns `head`, the consumer owns `tail`. They are kept on separate cache lines by padding,
+  // since `new` does not honor `alignas(64)` before C++17.
+  struct Shard {
+    Shard(size_t size, bricks::memory::MemoryResource* resource, Shard* next)
+        : circular_buffer(size, resource), next(next) {
+    }
+    bricks::memory::Vector<Entry> circular_buffer;
+    char padding_before_head[64];
+    std::atomic_size_t head{0};
+    char padding_before_tail[64 - sizeof(std::atomic_size_t)];
+    std::atomic_size_t tail{0};
+    char padding_after_tail[64 - sizeof(std::atomic_size_t)];
+    std::atomic_size_t number_of_dropped_events{0};
+    // The shards form a singly linked list, new shards are prepended.
+    Shard* const next;
+  };
+
+  static uint64_t NextInstanceId() {
+    static std::atomic<uint64_t> next_instance_id(0);
+    return ++next_instance_id;
+  }
+
+  Shard& ShardOfThisThread() {
+    // The instance ID, not the pointer, is what is cached, so that a new instance
+    // allocated at the same address as a destructed one does not pick up a dangling shard.
+    struct ThreadLocalCache {
+      uint64_t instance_id;
+      Shard* shard;
+    };
+    static thread_local ThreadLocalCache cache{0, nullptr};
+    if (cache.instance_id != instance_id_) {
+      cache.shard = RegisterThisThread();
+      cache.instance_id = instance_id_;
+    }
+    return *cache.shard;
+  }
+
+  Shard* RegisterThisThread() {
+    // MUTEX-LOCKED. Only happens once per producer thread, or on alternating between instances.
+    std::lock_guard<std::mutex> lock(mutex_);
+    Shard*& shard = shards_by_thread_[std::this_thread::get_id()];
+    if (!shard) {
+      bricks::memory::MemoryResource* resource = bricks::memory::NewDeleteResource();
+      if (numa_local_shards_) {
+        std::unique_ptr<MQNUMANodeMemoryResource>& node_resource = numa_resources_[MQNUMANodeOfThisThread()];
+        if (!node_resource) {
+          node_resource.reset(new MQNUMANodeMemoryResource(MQNUMANodeOfThisThread()));
+        }
+        resource = node_resource.get();
+      }
+      shard = new Shard(shard_buffer_size_, resource, shards_.load(std::memory_order_relaxed));
+      shards_.store(shard, std::memory_order_release);
+    }
+    return shard;
+  }
+
+  bool PushEventAllocate(Shard& shard, size_t& index) {
+    const size_t head = shard.head.load(std::memory_order_relaxed);
+    if (head - shard.tail.load(std::memory_order_acquire) >= shard_buffer_size_) {
+      // Shard overflow, drop this message and keep the count of those.
+      ++shard.number_of_dropped_events;
+      return false;
+    }
+    index = head % shard_buffer_size_;
+    shard.circular_buffer[index].sequence =
+        (MERGE_ORDER == ShardedMQMergeOrder::BySequence) ? next_sequence_.fetch_add(1) : 0;
+    return true;
+  }
+
+  void PushEventCommit(Shard& shard) {
+    // Sequentially consistent, so that either this thread sees `consumer_waiting_`,
+    // or the consumer thread, having set it, sees the new `head`.
+    shard.head.store(shard.head.load(std::memory_order_relaxed) + 1);
+    // Only bother the consumer thread if it is parked.
+    if (consumer_waiting_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      condition_variable_.notify_all();
+    }
+  }
+
+  static bool Empty(const Shard& shard) {
+    return shard.tail.load(std::memory_order_relaxed) == shard.head.load();
+  }
+
+  bool AllShardsEmpty() const {
+    for (const Shard* shard = shards_.load(std::memory_order_acquire); shard; shard = shard->next) {
+      if (!Empty(*shard)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Exports the oldest message of the shard, which must not be empty.
+  void ExportOne(Shard& shard) {
+    const size_t tail = shard.tail.load(std::memory_order_relaxed);
+    consumer_.OnMessage(shard.circular_buffer[tail % shard_buffer_size_].message_body,
+                        shard.number_of_dropped_events.exchange(0));
+    shard.tail.store(tail + 1, std::memory_order_release);
+  }
+
+  // Exports at least one message if there is one. Returns false if all the shards are empty.
+  bool ExportSome() {
+    Shard* const shards = shards_.load(std::memory_order_acquire);
+    bool exported = false;
+    if (MERGE_ORDER == ShardedMQMergeOrder::BySequence) {
+      Shard* best = nullptr;
+      uint64_t best_sequence = 0;
+      for (Shard* shard = shards; shard; shard = shard->next) {
+        if (!Empty(*shard)) {
+          const uint64_t sequence =
+              shard->circular_buffer[shard->tail.load(std::memory_order_relaxed) % shard_buffer_size_].sequence;
+          if (!best || sequence < best_sequence) {
+            best = shard;
+            best_sequence = sequence;
+          }
+        }
+      }
+      if (best) {
+        ExportOne(*best);
+        exported = true;
+      }
+    } else {
+      for (Shard* shard = shards; shard; shard = shard->next) {
+        if (!Empty(*shard)) {
+          ExportOne(*shard);
+          exported = true;
+        }
+      }
+    }
+    return exported;
+  }
+
+  // The thread which extracts messages from the shards and exports them.
+  void ConsumerThread() {
+    while (true) {
+      if (!ExportSome()) {
+        // Park until a producer commits a message.
+        // The `consumer_waiting_` flag tells producers the notification is needed.
+        std::unique_lock<std::mutex> lock(mutex_);
+        consumer_waiting_ = true;
+        condition_variable_.wait(lock, [this] { return !AllShardsEmpty() || destructing_; });
+        consumer_waiting_ = false;
+        if (AllShardsEmpty()) {
+          // Destructing and nothing left to export.
+          return;
+        }
+      }
+    }
+  }
+
+  // The instance of the consuming side of the FIFO buffer.
+  T_CONSUMER& consumer_;
+
+  // The capacity of the ring buffer of each shard.
+  const size_t shard_buffer_size_;
+
+  // Whether the ring buffers are allocated on the NUMA nodes of the producers, from `numa_resources_`,
+  // one resource per node, which are only modified under `mutex_`.
+  const bool numa_local_shards_;
+  std::map<int, std::unique_ptr<MQNUMANodeMemoryResource>> numa_resources_;
+
+  // The unique ID of this instance, for the thread-local shard cache.
+  const uint64_t instance_id_;
+
+  // The shards, as a linked list, and the index of them by the producer thread.
+  // Both are only modified under `mutex_`. The list is read by the consumer thread without locking:
+  // new shards are only ever prepended, and the shards are never removed until destruction.
+  std::atomic<Shard*> shards_{nullptr};
+  std::map<std::thread::id, Shard*> shards_by_thread_;
+
+  // The global sequence number, only used with `ShardedMQMergeOrder::BySequence`.
+  alignas(64) std::atomic<uint64_t> next_sequence_{0};
+
+  // Parking of the consumer thread when there is nothing to export.
+  std::atomic_bool consumer_waiting_{false};
+  std::mutex mutex_;
+  std::condition_variable condition_variable_;
+
+  // For safe thread destruction.
+  bool destructing_ = false;
+
+  // The thread in which the consuming process is running.
+  // Declared last, since it should only be started once all the other members have been initialized.
+  std::thread consumer_thread_;
+};
+
+#endif  // SANDBOX_MQ_SHARDED_H
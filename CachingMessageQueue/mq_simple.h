@@ -5,13 +5,16 @@
 // Used by the benchmark as an example of the queue that blocks the thread for the entire data copy operation,
 // but does not drop any messages.
 
+#include <atomic>
 #include <condition_variable>
 #include <deque>
 #include <mutex>
 #include <string>
 #include <thread>
 
-template <typename CONSUMER, typename MESSAGE = std::string>
+#include "mq_wait_strategy.h"
+
+template <typename CONSUMER, typename MESSAGE = std::string, MQWaitStrategy WAIT_STRATEGY = MQWaitStrategy::Adaptive>
 class SimpleMQ final {
  public:
   typedef MESSAGE T_MESSAGE;
@@ -25,34 +28,50 @@ class SimpleMQ final {
     {
       std::unique_lock<std::mutex> lock(mutex_);
       destructing_ = true;
+      ++version_;
     }
     condition_variable_.notify_all();
     consumer_thread_.join();
   }
 
   void PushMessage(const T_MESSAGE& message) {
-    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_lock<std::mutex> lock(mutex_);
     deque_.push_back(message);
-    condition_variable_.notify_all();
+    Committed(lock);
   }
 
   void PushMessage(T_MESSAGE&& message) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    deque_.emplace_back(message);
-    condition_variable_.notify_all();
+    std::unique_lock<std::mutex> lock(mutex_);
+    deque_.push_back(std::move(message));
+    Committed(lock);
   }
 
  private:
+  // Only notifies the consumer if it is parked, see `MQWaitStrategy`.
+  void Committed(std::unique_lock<std::mutex>& lock) {
+    ++version_;
+    const bool notify = consumer_parked_;
+    lock.unlock();
+    if (notify) {
+      condition_variable_.notify_one();
+    }
+  }
+
   void ConsumerThread() {
     std::unique_lock<std::mutex> lock(mutex_);
     while (true) {
-      if (deque_.empty()) {
+      while (deque_.empty()) {
         if (destructing_) {
           return;
         }
-        condition_variable_.wait(lock, [this] { return !deque_.empty() || destructing_; });
-        if (destructing_) {
-          return;
+        const size_t seen = version_;
+        lock.unlock();
+        const bool changed = MQConsumerWait<WAIT_STRATEGY>::WaitForChange(version_, seen);
+        lock.lock();
+        if (!changed && deque_.empty() && !destructing_) {
+          consumer_parked_ = true;
+          condition_variable_.wait(lock, [this] { return !deque_.empty() || destructing_; });
+          consumer_parked_ = false;
         }
       }
       consumer_.OnMessage(deque_.front(), 0);
@@ -61,11 +80,18 @@ class SimpleMQ final {
   }
 
   T_CONSUMER& consumer_;
-  std::thread consumer_thread_;
   std::deque<T_MESSAGE> deque_;
   bool destructing_ = false;
   std::mutex mutex_;
   std::condition_variable condition_variable_;
+
+  // Bumped on each push and on destruction, for the consumer to spin on. Guarded by `mutex_` for writes.
+  std::atomic_size_t version_{0};
+  // Set while the consumer is waiting on `condition_variable_`. Guarded by `mutex_`.
+  bool consumer_parked_ = false;
+
+  // Declared last, since it should only be started once all the other members have been initialized.
+  std::thread consumer_thread_;
 };
 
 #endif  // SANDBOX_MQ_SIMPLE_H
@@ -0,0 +1,201 @@
+#ifndef SANDBOX_MQ_SPILL_H
+#define SANDBOX_MQ_SPILL_H
+
+// The spill file of `EfficientMQ`: where the messages that do not fit into the buffer go,
+// instead of being dropped, for the consumer to read them back once it has caught up.
+// See `EfficientMQ::SetSpillFile()`.
+//
+// `MQSpillCodec<T_MESSAGE>` turns the message into the bytes of the record in the file and back.
+// It is provided for `std::string`, and is to be specialized for the other types of messages to spill.
+//
+// `MQSpillFile` is the append-only file of length-prefixed records. The appended records are buffered
+// in memory and written out in large chunks, as the producers append them with the mutex of the queue held.
+// The file is truncated once the consumer has read everything in it.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+template <typename T_MESSAGE>
+struct MQSpillCodec {
+  enum { kSupported = false };
+};
+
+template <>
+struct MQSpillCodec<std::string> {
+  enum { kSupported = true };
+  static void Encode(const std::string& message, std::string& record) {
+    record.assign(message);
+  }
+  static void Decode(const char* data, size_t length, std::string& message) {
+    message.assign(data, length);
+  }
+};
+
+// NOT THREAD SAFE, except for `ReadRecords()`, which only touches what has been flushed,
+// and thus can run concurrently with `Append()`.
+class MQSpillFile final {
+ public:
+  // The records are four bytes of length, in the host byte order, followed by the bytes of the record.
+  enum { kHeaderSize = 4 };
+
+  // The appended records are written out once this many bytes are buffered, or on `Flush()`.
+  enum { kWriteBufferSize = 64 * 1024 };
+
+  // The chunk `ReadRecords()` reads at once, unless a single record is larger.
+  enum { kReadChunkSize = 1024 * 1024 };
+
+  // Creates the file at `path`, truncating it. The records past `max_bytes` are not appended.
+  MQSpillFile(const std::string& path, uint64_t max_bytes)
+      : path_(path), max_bytes_(max_bytes), fd_(::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)) {
+  }
+
+  // Removes the file: what is left in it is not read back by anyone.
+  ~MQSpillFile() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+      ::unlink(path_.c_str());
+    }
+  }
+
+  bool IsOpen() const {
+    return fd_ >= 0;
+  }
+
+  // Returns false if the record would not fit into `max_bytes`, or if the file could not be written to.
+  bool Append(const char* data, size_t length) {
+    const uint64_t bytes = kHeaderSize + length;
+    if (failed_ || length > UINT32_MAX || bytes_flushed_ + buffer_.size() + bytes > max_bytes_) {
+      return false;
+    }
+    const uint32_t header = static_cast<uint32_t>(length);
+    buffer_.append(reinterpret_cast<const char*>(&header), kHeaderSize);
+    buffer_.append(data, length);
+    ++buffered_records_;
+    if (buffer_.size() >= kWriteBufferSize) {
+      Flush();
+    }
+    return true;
+  }
+
+  // Writes out the buffered records. If the file can not be written to, they are lost,
+  // and the further records are not appended until `Reset()`.
+  void Flush() {
+    size_t written = 0;
+    while (!failed_ && written < buffer_.size()) {
+      const ssize_t result = ::pwrite(fd_, buffer_.data() + written, buffer_.size() - written, bytes_flushed_);
+      if (result > 0) {
+        written += static_cast<size_t>(result);
+        bytes_flushed_ += static_cast<uint64_t>(result);
+      } else if (!(result < 0 && errno == EINTR)) {
+        failed_ = true;
+      }
+    }
+    if (failed_ && written < buffer_.size()) {
+      // Roll back to the last complete record, for the reader to not see the incomplete one.
+      bytes_flushed_ -= written;
+      size_t offset = 0;
+      while (offset + kHeaderSize <= written) {
+        const size_t record_end = offset + kHeaderSize + Length(buffer_.data() + offset);
+        if (record_end > written) {
+          break;
+        }
+        offset = record_end;
+      }
+      bytes_flushed_ += offset;
+    }
+    buffer_.clear();
+    buffered_records_ = 0;
+  }
+
+  // The number of the records appended, but not yet written out.
+  size_t BufferedRecords() const {
+    return buffered_records_;
+  }
+
+  // The bytes written out, for the reader to read the records up to.
+  uint64_t BytesFlushed() const {
+    return bytes_flushed_;
+  }
+
+  // Reads the complete records from `[offset, end)`, up to `kReadChunkSize` bytes of them or one record,
+  // calling `on_record(const char* data, size_t length)` for each, and advances `offset` past them.
+  // `scratch` is the buffer to read into, reused across the calls. Returns the number of the records read.
+  template <typename F>
+  size_t ReadRecords(uint64_t& offset, uint64_t end, std::string& scratch, F&& on_record) const {
+    if (offset + kHeaderSize > end) {
+      return 0;
+    }
+    uint32_t header;
+    if (!ReadFully(reinterpret_cast<char*>(&header), kHeaderSize, offset)) {
+      return 0;
+    }
+    const uint64_t chunk = std::min(end - offset, std::max(static_cast<uint64_t>(kReadChunkSize),
+                                                           static_cast<uint64_t>(kHeaderSize) + header));
+    scratch.resize(static_cast<size_t>(chunk));
+    if (!ReadFully(&scratch[0], scratch.size(), offset)) {
+      return 0;
+    }
+    size_t records = 0;
+    size_t position = 0;
+    while (position + kHeaderSize <= scratch.size()) {
+      const size_t length = Length(scratch.data() + position);
+      if (position + kHeaderSize + length > scratch.size()) {
+        break;
+      }
+      on_record(scratch.data() + position + kHeaderSize, length);
+      position += kHeaderSize + length;
+      ++records;
+    }
+    offset += position;
+    return records;
+  }
+
+  // Truncates the file, once everything in it has been read, and retries writing to it if it has failed.
+  void Reset() {
+    if (::ftruncate(fd_, 0)) {
+      // Best effort, the stale bytes past `bytes_flushed_` are never read.
+    }
+    bytes_flushed_ = 0;
+    failed_ = false;
+  }
+
+ private:
+  MQSpillFile(const MQSpillFile&) = delete;
+  void operator=(const MQSpillFile&) = delete;
+
+  static size_t Length(const char* header) {
+    uint32_t length;
+    ::memcpy(&length, header, kHeaderSize);
+    return length;
+  }
+
+  bool ReadFully(char* data, size_t length, uint64_t offset) const {
+    while (length) {
+      const ssize_t result = ::pread(fd_, data, length, offset);
+      if (result > 0) {
+        data += result;
+        length -= static_cast<size_t>(result);
+        offset += static_cast<uint64_t>(result);
+      } else if (!(result < 0 && errno == EINTR)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const std::string path_;
+  const uint64_t max_bytes_;
+  const int fd_;
+  std::string buffer_;
+  size_t buffered_records_ = 0;
+  uint64_t bytes_flushed_ = 0;
+  bool failed_ = false;
+};
+
+#endif  // SANDBOX_MQ_SPILL_H
@@ -0,0 +1,106 @@
+#ifndef SANDBOX_MQ_TRACE_H
+#define SANDBOX_MQ_TRACE_H
+
+// The trace of the messages pushed into a queue, for the benchmark to replay the real traffic against the queues.
+// One event per message: the index of the pushing thread, the time it was pushed at, and its size.
+//
+// The trace file is text, one event per line, "<thread> <timestamp_us> <size>", ordered by the timestamp,
+// for the production code to record it with `MQTraceRecorder` or with any tool of its own.
+// The timestamps are relative, only the differences between them matter.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct MQTraceEvent {
+  uint32_t thread;
+  uint64_t timestamp_us;
+  uint32_t size;
+};
+
+inline bool SaveMQTrace(const std::string& file_name, std::vector<MQTraceEvent> events) {
+  std::stable_sort(events.begin(), events.end(), [](const MQTraceEvent& lhs, const MQTraceEvent& rhs) {
+    return lhs.timestamp_us < rhs.timestamp_us;
+  });
+  std::ofstream fo(file_name);
+  for (const MQTraceEvent& e : events) {
+    fo << e.thread << ' ' << e.timestamp_us << ' ' << e.size << '\n';
+  }
+  return static_cast<bool>(fo);
+}
+
+// Returns false if the file can not be read or is malformed.
+inline bool LoadMQTrace(const std::string& file_name, std::vector<MQTraceEvent>& events) {
+  std::ifstream fi(file_name);
+  if (!fi) {
+    return false;
+  }
+  events.clear();
+  MQTraceEvent e;
+  while (fi >> e.thread >> e.timestamp_us >> e.size) {
+    events.push_back(e);
+  }
+  return fi.eof();
+}
+
+// Splits the events by thread, in the order the threads first appear in the trace, and makes the timestamps
+// relative to the first event of the whole trace.
+inline std::vector<std::vector<MQTraceEvent>> SplitMQTraceByThread(const std::vector<MQTraceEvent>& events) {
+  std::vector<std::vector<MQTraceEvent>> result;
+  if (events.empty()) {
+    return result;
+  }
+  uint64_t begin_us = events.front().timestamp_us;
+  for (const MQTraceEvent& e : events) {
+    begin_us = std::min(begin_us, e.timestamp_us);
+  }
+  std::map<uint32_t, size_t> index;
+  for (const MQTraceEvent& e : events) {
+    const auto it = index.insert(std::make_pair(e.thread, result.size())).first;
+    if (it->second == result.size()) {
+      result.emplace_back();
+    }
+    MQTraceEvent relative = e;
+    relative.timestamp_us -= begin_us;
+    result[it->second].push_back(relative);
+  }
+  return result;
+}
+
+// Records the events into memory, to `Save()` them once done. THREAD SAFE.
+// Costs a lock and an append per message, thus is meant to be enabled for the duration of the capture only.
+class MQTraceRecorder final {
+ public:
+  MQTraceRecorder() : begin_(std::chrono::steady_clock::now()) {
+  }
+
+  void Record(uint32_t thread, size_t size) {
+    const std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - begin_;
+    const uint64_t timestamp_us =
+        static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_.push_back(MQTraceEvent{thread, timestamp_us, static_cast<uint32_t>(size)});
+  }
+
+  bool Save(const std::string& file_name) const {
+    std::vector<MQTraceEvent> events;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      events = events_;
+    }
+    return SaveMQTrace(file_name, std::move(events));
+  }
+
+ private:
+  const std::chrono::steady_clock::time_point begin_;
+  mutable std::mutex mutex_;
+  std::vector<MQTraceEvent> events_;
+};
+
+#endif  // SANDBOX_MQ_TRACE_H
@@ -0,0 +1,58 @@
+#ifndef SANDBOX_MQ_WAIT_STRATEGY_H
+#define SANDBOX_MQ_WAIT_STRATEGY_H
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+
+// How the consumer thread waits for messages when there is nothing to export.
+// Park:     Wait on the condition variable right away. Lowest CPU usage, a wakeup per idle period.
+// Adaptive: Spin briefly, then yield, then park. The default.
+// Spin:     Never park, keep spinning. For latency-critical deployments with the consumer on a dedicated core.
+// Either way, the producers only notify the condition variable when the consumer is actually parked.
+enum class MQWaitStrategy { Park, Adaptive, Spin };
+
+template <MQWaitStrategy WAIT_STRATEGY>
+struct MQConsumerWait {
+  // The number of busy-wait and `yield()` iterations before parking, for `MQWaitStrategy::Adaptive`.
+  enum { kSpinIterations = 256, kYieldIterations = 64 };
+
+  // Waits, with no lock held, until `version` changes from `seen`.
+  // Returns true if it did, false if it is time to park the consumer thread.
+  static bool WaitForChange(const std::atomic_size_t& version, size_t seen) {
+    if (WAIT_STRATEGY == MQWaitStrategy::Park) {
+      return false;
+    }
+    if (WAIT_STRATEGY == MQWaitStrategy::Adaptive && SingleCPU()) {
+      // Spinning on a single CPU only delays the producer that would end the wait.
+      return false;
+    }
+    for (size_t i = 0; WAIT_STRATEGY == MQWaitStrategy::Spin || i < kSpinIterations + kYieldIterations; ++i) {
+      if (version.load(std::memory_order_acquire) != seen) {
+        return true;
+      }
+      if (i < kSpinIterations) {
+        CpuRelax();
+      } else {
+        std::this_thread::yield();
+      }
+    }
+    return false;
+  }
+
+  static bool SingleCPU() {
+    static const bool single_cpu = (std::thread::hardware_concurrency() == 1);
+    return single_cpu;
+  }
+
+  // Tells the CPU this is a spin loop, to save power and to not starve the hyper-threaded sibling.
+  static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+  }
+};
+
+#endif  // SANDBOX_MQ_WAIT_STRATEGY_H
@@ -0,0 +1,1192 @@
+// The behavior tests of the message queues. The consumers record what they get, and hold the first message
+// at the gate, if given one, for the tests to fill the buffers up while the consumer is stalled.
+
+#include "mq_arena.h"
+#include "mq_broadcast.h"
+#include "mq_conflating.h"
+#include "mq_double_buffer.h"
+#include "mq_efficient.h"
+#include "mq_lockfree.h"
+#include "mq_multi_consumer.h"
+#include "mq_priority.h"
+#include "mq_sharded.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../Bricks/util/allocation_counter.h"
+
+#include "../Bricks/3party/gtest/gtest.h"
+#include "../Bricks/3party/gtest/gtest-main.h"
+
+BRICKS_COUNT_ALLOCATIONS();
+
+namespace {
+
+// Holds the consumer thread until opened, and tells the test once the consumer is waiting at it.
+class Gate {
+ public:
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    waiting_ = true;
+    condition_variable_.notify_all();
+    condition_variable_.wait(lock, [this] { return open_; });
+  }
+  void WaitUntilWaiting() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    condition_variable_.wait(lock, [this] { return waiting_; });
+  }
+  void Open() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    open_ = true;
+    condition_variable_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable condition_variable_;
+  bool waiting_ = false;
+  bool open_ = false;
+};
+
+struct Recorded {
+  std::string message;
+  size_t dropped;
+  size_t priority;
+};
+
+struct RecordingConsumer {
+  Gate* gate = nullptr;
+  std::mutex mutex;
+  std::vector<Recorded> messages;
+  std::atomic_size_t count{0};
+  std::atomic_size_t dropped{0};
+
+  explicit RecordingConsumer(Gate* gate = nullptr) : gate(gate) {}
+
+  void OnMessage(const std::string& message, size_t number_of_dropped_events) {
+    HoldTheFirstMessage();
+    Record(message, number_of_dropped_events);
+  }
+  // As `PriorityMQ` calls it.
+  void OnMessage(const std::string& message, size_t priority, size_t number_of_dropped_events) {
+    HoldTheFirstMessage();
+    Record(message, number_of_dropped_events, priority);
+  }
+  // As `ArenaMQ` calls it.
+  void OnMessage(const char* data, size_t length, size_t number_of_dropped_events) {
+    HoldTheFirstMessage();
+    Record(std::string(data, length), number_of_dropped_events);
+  }
+
+  void HoldTheFirstMessage() {
+    if (gate && !count) {
+      gate->Wait();
+    }
+  }
+
+  void Record(const std::string& message, size_t number_of_dropped_events, size_t priority = 0) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      messages.push_back(Recorded{message, number_of_dropped_events, priority});
+    }
+    dropped += number_of_dropped_events;
+    ++count;
+  }
+
+  void WaitFor(size_t n) const {
+    while (count < n) {
+      std::this_thread::yield();
+    }
+  }
+
+  std::vector<std::string> Messages() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::string> result;
+    for (const Recorded& recorded : messages) {
+      result.push_back(recorded.message);
+    }
+    return result;
+  }
+};
+
+// The message `index` of the producer `producer`, as "producer:index".
+std::string Message(size_t producer, size_t index) {
+  return std::to_string(producer) + ':' + std::to_string(index);
+}
+
+// Checks that the messages of each of the producers are in the order they were pushed, and returns how many
+// of them there are, per producer.
+std::vector<size_t> CheckOrderPerProducer(const std::vector<std::string>& messages, size_t producers) {
+  std::vector<size_t> next(producers, 0);
+  std::vector<size_t> counts(producers, 0);
+  for (const std::string& message : messages) {
+    const size_t colon = message.find(':');
+    const size_t producer = std::stoul(message.substr(0, colon));
+    const size_t index = std::stoul(message.substr(colon + 1));
+    EXPECT_GE(index, next[producer]) << message;
+    next[producer] = index + 1;
+    ++counts[producer];
+  }
+  return counts;
+}
+
+}  // namespace
+
+TEST(LockFreeMQ, KeepsTheOrderOfEachProducer) {
+  const size_t kProducers = 4;
+  const size_t kMessages = 1000;
+  RecordingConsumer consumer;
+  {
+    LockFreeMQ<RecordingConsumer> mq(consumer, kProducers * kMessages);
+    std::vector<std::thread> producers;
+    for (size_t producer = 0; producer < kProducers; ++producer) {
+      producers.emplace_back([&mq, producer]() {
+        for (size_t i = 0; i < kMessages; ++i) {
+          mq.PushMessage(Message(producer, i));
+        }
+      });
+    }
+    for (std::thread& thread : producers) {
+      thread.join();
+    }
+  }
+  EXPECT_EQ(0u, consumer.dropped);
+  const std::vector<std::string> messages = consumer.Messages();
+  ASSERT_EQ(kProducers * kMessages, messages.size());
+  for (size_t count : CheckOrderPerProducer(messages, kProducers)) {
+    EXPECT_EQ(kMessages, count);
+  }
+}
+
+// A stalled consumer has the oldest messages overwritten, never the producer blocked for long,
+// and every message is either exported or counted as dropped.
+TEST(LockFreeMQ, DropsTheOldestMessagesOnOverflow) {
+  const size_t kMessages = 1000;
+  Gate gate;
+  RecordingConsumer consumer(&gate);
+  {
+    LockFreeMQ<RecordingConsumer> mq(consumer, 4);
+    mq.PushMessage(Message(0, 0));
+    gate.WaitUntilWaiting();
+    // With the consumer exporting the first message, the next three fill the buffer up.
+    for (size_t i = 1; i < 4; ++i) {
+      mq.PushMessage(Message(0, i));
+    }
+    // The fifth one waits for the slot of the first one, thus is pushed with the consumer running.
+    std::thread producer([&mq]() {
+      for (size_t i = 4; i < kMessages; ++i) {
+        mq.PushMessage(Message(0, i));
+      }
+    });
+    gate.Open();
+    producer.join();
+  }
+  const std::vector<std::string> messages = consumer.Messages();
+  EXPECT_EQ(kMessages, messages.size() + consumer.dropped);
+  EXPECT_GT(consumer.dropped, 0u);
+  CheckOrderPerProducer(messages, 1);
+  EXPECT_EQ(Message(0, kMessages - 1), messages.back());
+}
+
+// The destructor returns only once everything pushed has been exported.
+TEST(LockFreeMQ, ExportsEverythingBeforeDestruction) {
+  Gate gate;
+  RecordingConsumer consumer(&gate);
+  {
+    LockFreeMQ<RecordingConsumer> mq(consumer, 100);
+    for (size_t i = 0; i < 100; ++i) {
+      mq.PushMessage(Message(0, i));
+    }
+    gate.WaitUntilWaiting();
+    gate.Open();
+  }
+  EXPECT_EQ(100u, consumer.count);
+  EXPECT_EQ(0u, consumer.dropped);
+  EXPECT_EQ(Message(0, 99), consumer.Messages().back());
+}
+
+TEST(ShardedMQ, KeepsTheOrderOfEachProducer) {
+  const size_t kProducers = 4;
+  const size_t kMessages = 1000;
+  RecordingConsumer consumer;
+  {
+    ShardedMQ<RecordingConsumer> mq(consumer, kMessages);
+    std::vector<std::thread> producers;
+    for (size_t producer = 0; producer < kProducers; ++producer) {
+      producers.emplace_back([&mq, producer]() {
+        for (size_t i = 0; i < kMessages; ++i) {
+          EXPECT_TRUE(mq.PushMessage(Message(producer, i)));
+        }
+      });
+    }
+    for (std::thread& thread : producers) {
+      thread.join();
+    }
+  }
+  EXPECT_EQ(0u, consumer.dropped);
+  const std::vector<std::string> messages = consumer.Messages();
+  ASSERT_EQ(kProducers * kMessages, messages.size());
+  for (size_t count : CheckOrderPerProducer(messages, kProducers)) {
+    EXPECT_EQ(kMessages, count);
+  }
+}
+
+// The full shard rejects the newest messages, and reports them along with the next message it exports.
+TEST(ShardedMQ, DropsTheNewestMessagesOnOverflow) {
+  Gate gate;
+  RecordingConsumer consumer(&gate);
+  {
+    ShardedMQ<RecordingConsumer> mq(consumer, 4);
+    EXPECT_TRUE(mq.PushMessage("0"));
+    gate.WaitUntilWaiting();
+    // The first message stays in the shard until it has been exported.
+    EXPECT_TRUE(mq.PushMessage("1"));
+    EXPECT_TRUE(mq.PushMessage("2"));
+    EXPECT_TRUE(mq.PushMessage("3"));
+    EXPECT_FALSE(mq.PushMessage("4"));
+    EXPECT_FALSE(mq.PushMessage("5"));
+    gate.Open();
+    consumer.WaitFor(4);
+    EXPECT_TRUE(mq.PushMessage("6"));
+  }
+  EXPECT_EQ(std::vector<std::string>({"0", "1", "2", "3", "6"}), consumer.Messages());
+  ASSERT_EQ(5u, consumer.messages.size());
+  EXPECT_EQ(0u, consumer.messages[0].dropped);
+  EXPECT_EQ(2u, consumer.messages[1].dropped);
+  EXPECT_EQ(2u, consumer.dropped);
+}
+
+// With `ShardedMQMergeOrder::BySequence`, the messages of the producers taking turns are merged
+// in the order they were pushed in.
+TEST(ShardedMQ, MergesTheShardsBySequence) {
+  const size_t kProducers = 3;
+  const size_t kMessages = 20;
+  Gate gate;
+  RecordingConsumer consumer(&gate);
+  std::vector<std::string> expected;
+  {
+    ShardedMQ<RecordingConsumer, std::string, 1024, ShardedMQMergeOrder::BySequence> mq(consumer);
+    mq.PushMessage("first");
+    expected.push_back("first");
+    gate.WaitUntilWaiting();
+    std::atomic_size_t turn(0);
+    std::vector<std::thread> producers;
+    for (size_t producer = 0; producer < kProducers; ++producer) {
+      producers.emplace_back([&mq, &turn, producer]() {
+        for (size_t i = 0; i < kMessages; ++i) {
+          while (turn % kProducers != producer) {
+            std::this_thread::yield();
+          }
+          mq.PushMessage(Message(producer, i));
+          ++turn;
+        }
+      });
+    }
+    for (std::thread& thread : producers) {
+      thread.join();
+    }
+    for (size_t i = 0; i < kMessages; ++i) {
+      for (size_t producer = 0; producer < kProducers; ++producer) {
+        expected.push_back(Message(producer, i));
+      }
+    }
+    gate.Open();
+  }
+  EXPECT_EQ(expected, consumer.Messages());
+}
+
+// A message is accepted iff its record, eight bytes of the header and the message padded to eight bytes,
+// fits into the free space. The capacity of 60 bytes is rounded up to 64.
+TEST(ArenaMQ, AccountsForTheBytesExactly) {
+  Gate gate;
+  RecordingConsumer consumer(&gate);
+  {
+    ArenaMQ<RecordingConsumer, 1024, MQOverflowPolicy::RejectNewest> mq(consumer, 60);
+    EXPECT_TRUE(mq.PushMessage("00000000"));
+    gate.WaitUntilWaiting();
+    // The sixteen bytes of the record being exported are still taken, the remaining 48 fit three more.
+    EXPECT_TRUE(mq.PushMessage("11111111"));
+    EXPECT_TRUE(mq.PushMessage("22222222"));
+    EXPECT_TRUE(mq.PushMessage("3333333"));
+    EXPECT_FALSE(mq.PushMessage(""));
+    EXPECT_FALSE(mq.PushMessage("4"));
+    EXPECT_EQ(1u, mq.TotalBytesDropped());
+    // The message larger than the whole arena is rejected regardless.
+    EXPECT_FALSE(mq.PushMessage(std::string(57, '5')));
+    EXPECT_EQ(58u, mq.TotalBytesDropped());
+    gate.Open();
+    consumer.WaitFor(4);
+  }
+  EXPECT_EQ(std::vector<std::string>({"00000000", "11111111", "22222222", "3333333"}), consumer.Messages());
+  EXPECT_EQ(0u, consumer.messages[0].dropped);
+  EXPECT_EQ(3u, consumer.messages[1].dropped);
+  EXPECT_EQ(3u, consumer.dropped);
+}
+
+// The record that does not fit before the end of the arena goes to its beginning, after a padding record.
+TEST(ArenaMQ, WrapsTheRecordsAround) {
+  RecordingConsumer consumer;
+  const std::string a(32, 'a');
+  const std::string b(24, 'b');
+  const std::string c(24, 'c');
+  {
+    // Blocking, for each message to wait for the previous ones to be released rather than be rejected.
+    ArenaMQ<RecordingConsumer, 1024, MQOverflowPolicy::BlockProducer> mq(consumer, 64);
+    // 40 bytes, then 32 bytes, which only fit from the beginning, past 24 bytes of padding.
+    EXPECT_TRUE(mq.PushMessage(a));
+    EXPECT_TRUE(mq.PushMessage(b));
+    // Up to the end of the arena exactly, and then from its beginning again.
+    EXPECT_TRUE(mq.PushMessage(c));
+    EXPECT_TRUE(mq.PushMessage("d"));
+    EXPECT_EQ(0u, mq.TotalBytesDropped());
+  }
+  EXPECT_EQ(std::vector<std::string>({a, b, c, "d"}), consumer.Messages());
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+// The oldest record can not be dropped while being exported, thus the newest message is rejected instead.
+TEST(ArenaMQ, DropsTheOldestRecordsUnlessBeingExported) {
+  Gate gate;
+  RecordingConsumer consumer(&gate);
+  {
+    ArenaMQ<RecordingConsumer, 1024, MQOverflowPolicy::DropOldest> mq(consumer, 64);
+    EXPECT_TRUE(mq.PushMessage(Message(0, 0)));
+    gate.WaitUntilWaiting();
+    EXPECT_TRUE(mq.PushMessage(Message(0, 1)));
+    EXPECT_TRUE(mq.PushMessage(Message(0, 2)));
+    EXPECT_TRUE(mq.PushMessage(Message(0, 3)));
+    EXPECT_FALSE(mq.PushMessage(Message(0, 4)));
+    EXPECT_EQ(3u, mq.TotalBytesDropped());
+    gate.Open();
+    // With the consumer running, the oldest records are dropped, or, while being exported, the newest ones.
+    for (size_t i = 5; i < 1000; ++i) {
+      mq.PushMessage(Message(0, i));
+    }
+  }
+  const std::vector<std::string> messages = consumer.Messages();
+  EXPECT_EQ(1000u, messages.size() + consumer.dropped);
+  CheckOrderPerProducer(messages, 1);
+  EXPECT_EQ(Message(0, 0), messages.front());
+}
+
+// The producer waits for the consumer to release the records, and nothing is dropped.
+TEST(ArenaMQ, BlocksTheProducerWhenFull) {
+  Gate gate;
+  RecordingConsumer consumer(&gate);
+  {
+    ArenaMQ<RecordingConsumer, 1024, MQOverflowPolicy::BlockProducer> mq(consumer, 64);
+    EXPECT_TRUE(mq.PushMessage(Message(0, 0)));
+    gate.WaitUntilWaiting();
+    EXPECT_TRUE(mq.PushMessage(Message(0, 1)));
+    EXPECT_TRUE(mq.PushMessage(Message(0, 2)));
+    EXPECT_TRUE(mq.PushMessage(Message(0, 3)));
+    std::atomic_bool pushed(false);
+    std::thread producer([&mq, &pushed]() {
+      EXPECT_TRUE(mq.PushMessage(Message(0, 4)));
+      pushed = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_FALSE(pushed);
+    gate.Open();
+    producer.join();
+    EXPECT_EQ(0u, mq.TotalBytesDropped());
+  }
+  EXPECT_EQ(5u, consumer.Messages().size());
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+// The partition of the message is the producer, as a number, modulo the number of consumers.
+struct ProducerOfMessage {
+  size_t operator()(const std::string& message) const {
+    return std::stoul(message.substr(0, message.find(':')));
+  }
+};
+
+// Each key goes to one consumer, and its messages come in the order they were pushed.
+TEST(MultiConsumerMQ, PartitionsByTheKey) {
+  const size_t kConsumers = 3;
+  const size_t kProducers = 5;
+  const size_t kMessages = 500;
+  RecordingConsumer consumers[kConsumers];
+  {
+    MultiConsumerMQ<RecordingConsumer, std::string, ProducerOfMessage> mq(consumers, kConsumers, 4096);
+    EXPECT_EQ(kConsumers, mq.NumberOfConsumers());
+    std::vector<std::thread> producers;
+    for (size_t producer = 0; producer < kProducers; ++producer) {
+      producers.emplace_back([&mq, producer]() {
+        for (size_t i = 0; i < kMessages; ++i) {
+          EXPECT_TRUE(mq.PushMessage(Message(producer, i)));
+        }
+      });
+    }
+    for (std::thread& thread : producers) {
+      thread.join();
+    }
+  }
+  for (size_t consumer = 0; consumer < kConsumers; ++consumer) {
+    EXPECT_EQ(0u, consumers[consumer].dropped);
+    const std::vector<size_t> counts = CheckOrderPerProducer(consumers[consumer].Messages(), kProducers);
+    for (size_t producer = 0; producer < kProducers; ++producer) {
+      EXPECT_EQ(producer % kConsumers == consumer ? kMessages : 0u, counts[producer])
+          << consumer << ' ' << producer;
+    }
+  }
+}
+
+// With no key, the messages of one producer are spread across all the consumers.
+TEST(MultiConsumerMQ, SpreadsTheMessagesWithNoKey) {
+  const size_t kConsumers = 3;
+  const size_t kMessages = 300;
+  RecordingConsumer consumers[kConsumers];
+  {
+    MultiConsumerMQ<RecordingConsumer> mq(consumers, kConsumers, 4096);
+    for (size_t i = 0; i < kMessages; ++i) {
+      EXPECT_TRUE(mq.PushMessage(Message(0, i)));
+    }
+  }
+  size_t total = 0;
+  for (RecordingConsumer& consumer : consumers) {
+    EXPECT_EQ(kMessages / kConsumers, consumer.count);
+    total += consumer.count;
+  }
+  EXPECT_EQ(kMessages, total);
+}
+
+// Beyond the reserved capacity, a message evicts the oldest one of the lowest priority using the shared
+// capacity, and, with no fairness bound, the higher priorities are exported first.
+TEST(PriorityMQ, DropsTheLowPrioritiesFirst) {
+  Gate gate;
+  RecordingConsumer consumer(&gate);
+  {
+    // Six messages: one reserved for each of the three priorities, and three shared.
+    PriorityMQ<RecordingConsumer> mq(consumer, 6, {{1, 1, 1}}, 0);
+    EXPECT_TRUE(mq.PushMessage("first", 0));
+    gate.WaitUntilWaiting();
+    EXPECT_TRUE(mq.PushMessage("low0", 0));
+    EXPECT_TRUE(mq.PushMessage("low1", 0));
+    EXPECT_TRUE(mq.PushMessage("low2", 0));
+    EXPECT_TRUE(mq.PushMessage("low3", 0));
+    EXPECT_TRUE(mq.PushMessage("high0", 2));
+    // Evicts "low0", the oldest message taking the shared capacity.
+    EXPECT_TRUE(mq.PushMessage("high1", 2));
+    // Into the reserved capacity of its own.
+    EXPECT_TRUE(mq.PushMessage("mid0", 1));
+    gate.Open();
+    consumer.WaitFor(7);
+  }
+  EXPECT_EQ(std::vector<std::string>({"first", "high0", "high1", "mid0", "low1", "low2", "low3"}),
+            consumer.Messages());
+  EXPECT_EQ(2u, consumer.messages[1].priority);
+  EXPECT_EQ(1u, consumer.messages[3].priority);
+  EXPECT_EQ(0u, consumer.messages[4].priority);
+  EXPECT_EQ(1u, consumer.messages[4].dropped);
+  EXPECT_EQ(1u, consumer.dropped);
+}
+
+// A message only ever evicts the ones of its own or of the lower priorities.
+TEST(PriorityMQ, NeverEvictsForALowerPriority) {
+  Gate gate;
+  RecordingConsumer consumer(&gate);
+  {
+    PriorityMQ<RecordingConsumer, std::string, 2> mq(consumer, 2, {{0, 1}}, 0);
+    EXPECT_TRUE(mq.PushMessage("first", 1));
+    gate.WaitUntilWaiting();
+    EXPECT_TRUE(mq.PushMessage("high", 1));
+    EXPECT_TRUE(mq.PushMessage("low0", 0));
+    // The shared capacity is taken by the low priority, which has none reserved, thus it evicts its own.
+    EXPECT_TRUE(mq.PushMessage("low1", 0));
+    // The high priority takes the shared capacity back from the low one.
+    EXPECT_TRUE(mq.PushMessage("high1", 1));
+    // With the low priority evicted, and no capacity reserved for it, the message itself is dropped.
+    EXPECT_FALSE(mq.PushMessage("low2", 0));
+    gate.Open();
+    consumer.WaitFor(3);
+  }
+  EXPECT_EQ(std::vector<std::string>({"first", "high", "high1"}), consumer.Messages());
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+// The lagging consumer has its cursor moved past the messages overwritten, and is told of them,
+// while the other one loses nothing.
+TEST(BroadcastMQ, DropsTheOldestMessagesOfTheLaggingConsumerOnly) {
+  Gate gate;
+  RecordingConsumer consumers[2];
+  consumers[0].gate = &gate;
+  {
+    BroadcastMQ<RecordingConsumer> mq(consumers, 2, 4);
+    EXPECT_TRUE(mq.PushMessage("0"));
+    gate.WaitUntilWaiting();
+    consumers[1].WaitFor(1);
+    // The first message is being exported by the lagging consumer, and is moved to a spare object
+    // once its slot is reused, by the fifth message. The next three messages are skipped for it.
+    for (size_t i = 1; i < 8; ++i) {
+      EXPECT_TRUE(mq.PushMessage(std::to_string(i)));
+      consumers[1].WaitFor(i + 1);
+    }
+    gate.Open();
+    consumers[0].WaitFor(5);
+  }
+  EXPECT_EQ(std::vector<std::string>({"0", "1", "2", "3", "4", "5", "6", "7"}), consumers[1].Messages());
+  EXPECT_EQ(0u, consumers[1].dropped);
+  EXPECT_EQ(std::vector<std::string>({"0", "4", "5", "6", "7"}), consumers[0].Messages());
+  EXPECT_EQ(3u, consumers[0].messages[1].dropped);
+  EXPECT_EQ(3u, consumers[0].dropped);
+}
+
+// With `MQOverflowPolicy::BlockProducer`, each consumer gets every message, in order.
+TEST(BroadcastMQ, DeliversEveryMessageToEachConsumer) {
+  const size_t kConsumers = 3;
+  const size_t kMessages = 1000;
+  RecordingConsumer consumers[kConsumers];
+  {
+    typedef BroadcastMQ<RecordingConsumer, std::string, 1024, MQOverflowPolicy::BlockProducer> BlockingMQ;
+    BlockingMQ mq(consumers, kConsumers, 16);
+    EXPECT_EQ(kConsumers, mq.NumberOfConsumers());
+    for (size_t i = 0; i < kMessages; ++i) {
+      EXPECT_TRUE(mq.PushMessage(Message(0, i)));
+    }
+  }
+  for (RecordingConsumer& consumer : consumers) {
+    const std::vector<std::string> messages = consumer.Messages();
+    ASSERT_EQ(kMessages, messages.size());
+    EXPECT_EQ(kMessages, CheckOrderPerProducer(messages, 1)[0]);
+    EXPECT_EQ(Message(0, kMessages - 1), messages.back());
+    EXPECT_EQ(0u, consumer.dropped);
+  }
+}
+
+// The messages pushed while the consumer is exporting a batch make up the next one, with none of them lost.
+TEST(DoubleBufferMQ, LosesNothingWhileTheConsumerIsStalled) {
+  Gate gate;
+  RecordingConsumer consumer(&gate);
+  std::vector<std::string> expected;
+  {
+    DoubleBufferMQ<RecordingConsumer> mq(consumer);
+    mq.PushMessage(Message(0, 0));
+    expected.push_back(Message(0, 0));
+    gate.WaitUntilWaiting();
+    for (size_t i = 1; i <= 1000; ++i) {
+      mq.PushMessage(Message(0, i));
+      expected.push_back(Message(0, i));
+    }
+    gate.Open();
+    consumer.WaitFor(1001);
+    // The buffers swapped back and forth keep the messages of the earlier batches for their capacity.
+    for (size_t i = 1001; i <= 1010; ++i) {
+      std::string message = Message(0, i);
+      mq.PushMessage(std::move(message));
+      expected.push_back(Message(0, i));
+    }
+  }
+  EXPECT_EQ(expected, consumer.Messages());
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+TEST(DoubleBufferMQ, KeepsTheOrderOfEachProducer) {
+  const size_t kProducers = 4;
+  const size_t kMessages = 1000;
+  RecordingConsumer consumer;
+  {
+    DoubleBufferMQ<RecordingConsumer> mq(consumer);
+    std::vector<std::thread> producers;
+    for (size_t producer = 0; producer < kProducers; ++producer) {
+      producers.emplace_back([&mq, producer]() {
+        for (size_t i = 0; i < kMessages; ++i) {
+          mq.PushMessage(Message(producer, i));
+        }
+      });
+    }
+    for (std::thread& thread : producers) {
+      thread.join();
+    }
+  }
+  const std::vector<std::string> messages = consumer.Messages();
+  ASSERT_EQ(kProducers * kMessages, messages.size());
+  for (size_t count : CheckOrderPerProducer(messages, kProducers)) {
+    EXPECT_EQ(kMessages, count);
+  }
+}
+
+// The key of the message "key=value".
+struct KeyOfMessage {
+  std::string operator()(const std::string& message) const {
+    return message.substr(0, message.find('='));
+  }
+};
+
+// The pending keys keep their latest values, in the order the keys were first pushed, and the new keys
+// beyond `max_keys` are rejected, and reported along with the next batch.
+TEST(ConflatingMQ, KeepsTheLatestMessagePerKey) {
+  Gate gate;
+  RecordingConsumer consumer(&gate);
+  {
+    ConflatingMQ<RecordingConsumer, std::string, KeyOfMessage> mq(consumer, 3);
+    EXPECT_TRUE(mq.PushMessage("first=0"));
+    gate.WaitUntilWaiting();
+    EXPECT_TRUE(mq.PushMessage("a=1"));
+    EXPECT_TRUE(mq.PushMessage("b=1"));
+    EXPECT_TRUE(mq.PushMessage("a=2"));
+    EXPECT_TRUE(mq.PushMessage("c=1"));
+    EXPECT_FALSE(mq.PushMessage("d=1"));
+    EXPECT_TRUE(mq.PushMessage("b=2"));
+    EXPECT_EQ(2u, mq.NumberOfConflatedMessages());
+    gate.Open();
+    consumer.WaitFor(4);
+    // The keys exported are no longer pending.
+    EXPECT_TRUE(mq.PushMessage("a=3"));
+  }
+  EXPECT_EQ(std::vector<std::string>({"first=0", "a=2", "b=2", "c=1", "a=3"}), consumer.Messages());
+  EXPECT_EQ(1u, consumer.messages[1].dropped);
+  EXPECT_EQ(1u, consumer.dropped);
+}
+
+// With `MQOverflowPolicy::BlockProducer`, the new key waits for the pending ones to be taken by the consumer.
+TEST(ConflatingMQ, BlocksTheNewKeysWhenFull) {
+  Gate gate;
+  RecordingConsumer consumer(&gate);
+  {
+    typedef ConflatingMQ<RecordingConsumer, std::string, KeyOfMessage, 1024, MQOverflowPolicy::BlockProducer>
+        BlockingMQ;
+    BlockingMQ mq(consumer, 2);
+    EXPECT_TRUE(mq.PushMessage("first=0"));
+    gate.WaitUntilWaiting();
+    EXPECT_TRUE(mq.PushMessage("a=1"));
+    EXPECT_TRUE(mq.PushMessage("b=1"));
+    std::atomic_bool pushed(false);
+    std::thread producer([&mq, &pushed]() {
+      EXPECT_TRUE(mq.PushMessage("c=1"));
+      pushed = true;
+    });
+    // The updates to the pending keys still go through.
+    EXPECT_TRUE(mq.PushMessage("a=2"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_FALSE(pushed);
+    gate.Open();
+    producer.join();
+  }
+  EXPECT_EQ(std::vector<std::string>({"first=0", "a=2", "b=1", "c=1"}), consumer.Messages());
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+struct ExpiringConsumer : RecordingConsumer {
+  std::atomic_size_t expired{0};
+  explicit ExpiringConsumer(Gate* gate) : RecordingConsumer(gate) {}
+  void OnExpiredMessages(size_t number_of_expired_messages) { expired += number_of_expired_messages; }
+};
+
+// The messages older than the max age by the time the consumer gets to them are skipped, and reported
+// as expired rather than as dropped.
+TEST(EfficientMQ, SkipsTheExpiredMessages) {
+  Gate gate;
+  ExpiringConsumer consumer(&gate);
+  {
+    EfficientMQ<ExpiringConsumer> mq(consumer, 16);
+    EXPECT_TRUE(mq.PushMessage("0"));
+    gate.WaitUntilWaiting();
+    mq.SetMaxAge(std::chrono::milliseconds(100));
+    EXPECT_TRUE(mq.PushMessage("1"));
+    EXPECT_TRUE(mq.PushMessage("2"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    EXPECT_TRUE(mq.PushMessage("3"));
+    gate.Open();
+    consumer.WaitFor(2);
+  }
+  EXPECT_EQ(std::vector<std::string>({"0", "3"}), consumer.Messages());
+  EXPECT_EQ(2u, consumer.expired);
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+// With the one thread of the executor held by the consumer of another queue, the consumer of this one is not
+// exporting anything, thus the oldest messages are dropped to make room.
+TEST(EfficientMQ, DropsTheOldestMessages) {
+  MQConsumerExecutor executor(1);
+  Gate gate;
+  RecordingConsumer blocker(&gate);
+  RecordingConsumer consumer;
+  {
+    EfficientMQ<RecordingConsumer> blocking(blocker, executor, 4);
+    EfficientMQ<RecordingConsumer> mq(consumer, executor, 4);
+    EXPECT_TRUE(blocking.PushMessage("blocker"));
+    gate.WaitUntilWaiting();
+    // Three messages fit into the buffer of four.
+    for (size_t i = 0; i < 6; ++i) {
+      EXPECT_TRUE(mq.PushMessage(Message(0, i)));
+    }
+    gate.Open();
+    consumer.WaitFor(3);
+  }
+  EXPECT_EQ(std::vector<std::string>({Message(0, 3), Message(0, 4), Message(0, 5)}), consumer.Messages());
+  EXPECT_EQ(3u, consumer.messages[0].dropped);
+  EXPECT_EQ(3u, consumer.dropped);
+}
+
+// The oldest message can not be dropped while being exported, thus the newest one is rejected instead.
+TEST(EfficientMQ, DropsTheNewestMessagesWhileTheOldestAreBeingExported) {
+  Gate gate;
+  RecordingConsumer consumer(&gate);
+  {
+    EfficientMQ<RecordingConsumer> mq(consumer, 4);
+    EXPECT_TRUE(mq.PushMessage(Message(0, 0)));
+    gate.WaitUntilWaiting();
+    EXPECT_TRUE(mq.PushMessage(Message(0, 1)));
+    EXPECT_TRUE(mq.PushMessage(Message(0, 2)));
+    EXPECT_FALSE(mq.PushMessage(Message(0, 3)));
+    EXPECT_FALSE(mq.PushMessage(Message(0, 4)));
+    gate.Open();
+    consumer.WaitFor(3);
+  }
+  EXPECT_EQ(std::vector<std::string>({Message(0, 0), Message(0, 1), Message(0, 2)}), consumer.Messages());
+  EXPECT_EQ(0u, consumer.messages[0].dropped);
+  EXPECT_EQ(2u, consumer.messages[1].dropped);
+  EXPECT_EQ(2u, consumer.dropped);
+}
+
+TEST(EfficientMQ, RejectsTheNewestMessages) {
+  typedef EfficientMQ<RecordingConsumer, std::string, 1024, MQOverflowPolicy::RejectNewest> RejectingMQ;
+  MQConsumerExecutor executor(1);
+  Gate gate;
+  RecordingConsumer blocker(&gate);
+  RecordingConsumer consumer;
+  {
+    EfficientMQ<RecordingConsumer> blocking(blocker, executor, 4);
+    RejectingMQ mq(consumer, executor, 4);
+    EXPECT_TRUE(blocking.PushMessage("blocker"));
+    gate.WaitUntilWaiting();
+    EXPECT_TRUE(mq.PushMessage(Message(0, 0)));
+    EXPECT_TRUE(mq.PushMessage(Message(0, 1)));
+    EXPECT_TRUE(mq.PushMessage(Message(0, 2)));
+    EXPECT_FALSE(mq.PushMessage(Message(0, 3)));
+    EXPECT_FALSE(mq.PushMessage(Message(0, 4)));
+    gate.Open();
+    consumer.WaitFor(3);
+    EXPECT_TRUE(mq.PushMessage(Message(0, 5)));
+    consumer.WaitFor(4);
+  }
+  EXPECT_EQ(std::vector<std::string>({Message(0, 0), Message(0, 1), Message(0, 2), Message(0, 5)}),
+            consumer.Messages());
+  EXPECT_EQ(2u, consumer.messages[0].dropped);
+  EXPECT_EQ(2u, consumer.dropped);
+}
+
+// The producer waits for the consumer to export the messages, and nothing is dropped.
+TEST(EfficientMQ, BlocksTheProducerWhenFull) {
+  typedef EfficientMQ<RecordingConsumer, std::string, 1024, MQOverflowPolicy::BlockProducer> BlockingMQ;
+  Gate gate;
+  RecordingConsumer consumer(&gate);
+  {
+    BlockingMQ mq(consumer, 4);
+    EXPECT_TRUE(mq.PushMessage(Message(0, 0)));
+    gate.WaitUntilWaiting();
+    EXPECT_TRUE(mq.PushMessage(Message(0, 1)));
+    EXPECT_TRUE(mq.PushMessage(Message(0, 2)));
+    std::atomic_bool pushed(false);
+    std::thread producer([&mq, &pushed]() {
+      EXPECT_TRUE(mq.PushMessage(Message(0, 3)));
+      pushed = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_FALSE(pushed);
+    gate.Open();
+    producer.join();
+  }
+  EXPECT_EQ(std::vector<std::string>({Message(0, 0), Message(0, 1), Message(0, 2), Message(0, 3)}),
+            consumer.Messages());
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+// The messages pushed while a batch of ten is being exported are dropped once the buffer is full, and each
+// one pushed is either delivered, in order, or counted as dropped.
+TEST(EfficientMQ, DropsWhileABatchIsBeingExported) {
+  MQConsumerExecutor executor(1);
+  Gate blocker_gate;
+  Gate gate;
+  RecordingConsumer blocker(&blocker_gate);
+  RecordingConsumer consumer(&gate);
+  std::vector<std::string> expected;
+  {
+    EfficientMQ<RecordingConsumer> blocking(blocker, executor, 4);
+    EfficientMQ<RecordingConsumer> mq(consumer, executor, 16);
+    EXPECT_TRUE(blocking.PushMessage("blocker"));
+    blocker_gate.WaitUntilWaiting();
+    for (size_t i = 0; i < 10; ++i) {
+      expected.push_back(Message(0, i));
+      EXPECT_TRUE(mq.PushMessage(expected.back()));
+    }
+    blocker_gate.Open();
+    gate.WaitUntilWaiting();
+    // The batch of the ten messages is being exported, five more fit into the buffer of sixteen.
+    for (size_t i = 10; i < 20; ++i) {
+      if (i < 15) {
+        expected.push_back(Message(0, i));
+      }
+      EXPECT_EQ(i < 15, mq.PushMessage(Message(0, i))) << i;
+    }
+    gate.Open();
+    consumer.WaitFor(15);
+  }
+  EXPECT_EQ(expected, consumer.Messages());
+  EXPECT_EQ(5u, consumer.dropped);
+  EXPECT_EQ(5u, consumer.messages[10].dropped);
+}
+
+TEST(EfficientMQ, DeliversOrDropsEachMessage) {
+  const size_t kProducers = 4;
+  const size_t kMessages = 10000;
+  RecordingConsumer consumer;
+  {
+    EfficientMQ<RecordingConsumer> mq(consumer, 16);
+    std::vector<std::thread> producers;
+    for (size_t producer = 0; producer < kProducers; ++producer) {
+      producers.emplace_back([&mq, producer]() {
+        for (size_t i = 0; i < kMessages; ++i) {
+          mq.PushMessage(Message(producer, i));
+        }
+      });
+    }
+    for (std::thread& producer : producers) {
+      producer.join();
+    }
+  }
+  const std::vector<std::string> messages = consumer.Messages();
+  CheckOrderPerProducer(messages, kProducers);
+  EXPECT_EQ(kProducers * kMessages, messages.size() + consumer.dropped);
+}
+
+// Tells if the executor has ever run the consumer on two threads at once.
+struct ExclusiveConsumer : RecordingConsumer {
+  std::atomic_int inside{0};
+  std::atomic_bool overlapped{false};
+  void OnMessage(const std::string& message, size_t number_of_dropped_events) {
+    if (inside++) {
+      overlapped = true;
+    }
+    Record(message, number_of_dropped_events);
+    --inside;
+  }
+};
+
+// The queues sharing the threads of the executor each get all of their messages, once, in the order
+// of each producer, from one thread at a time.
+TEST(MQConsumerExecutor, DrivesManyEfficientMQs) {
+  typedef EfficientMQ<ExclusiveConsumer, std::string, 1024, MQOverflowPolicy::BlockProducer> BlockingMQ;
+  const size_t kQueues = 8;
+  const size_t kProducersPerQueue = 2;
+  const size_t kMessages = 2000;
+  MQConsumerExecutor executor(3);
+  std::vector<std::unique_ptr<ExclusiveConsumer>> consumers;
+  for (size_t i = 0; i < kQueues; ++i) {
+    consumers.emplace_back(new ExclusiveConsumer());
+  }
+  {
+    std::vector<std::unique_ptr<BlockingMQ>> queues;
+    for (size_t i = 0; i < kQueues; ++i) {
+      queues.emplace_back(new BlockingMQ(*consumers[i], executor, 16));
+    }
+    std::vector<std::thread> producers;
+    for (size_t i = 0; i < kQueues; ++i) {
+      for (size_t producer = 0; producer < kProducersPerQueue; ++producer) {
+        producers.emplace_back([&queues, i, producer]() {
+          for (size_t message = 0; message < kMessages; ++message) {
+            EXPECT_TRUE(queues[i]->PushMessage(Message(producer, message)));
+          }
+        });
+      }
+    }
+    for (std::thread& producer : producers) {
+      producer.join();
+    }
+  }
+  for (size_t i = 0; i < kQueues; ++i) {
+    const std::vector<std::string> messages = consumers[i]->Messages();
+    std::set<std::string> unique(messages.begin(), messages.end());
+    EXPECT_EQ(kProducersPerQueue * kMessages, unique.size()) << i;
+    const std::vector<size_t> counts = CheckOrderPerProducer(messages, kProducersPerQueue);
+    EXPECT_EQ(std::vector<size_t>(kProducersPerQueue, kMessages), counts) << i;
+    EXPECT_EQ(0u, consumers[i]->dropped) << i;
+    EXPECT_FALSE(consumers[i]->overlapped) << i;
+  }
+}
+
+// Tells where the messages it has been passed are, to compare to where they have been constructed.
+struct AddressRecordingConsumer : RecordingConsumer {
+  std::vector<const std::string*> addresses;
+  void OnMessage(const std::string& message, size_t number_of_dropped_events) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      addresses.push_back(&message);
+    }
+    Record(message, number_of_dropped_events);
+  }
+};
+
+// The writer populates the message in the slot, which the consumer is then passed, and, once the slots
+// have grown to the length of the messages, no allocations are made.
+TEST(EfficientMQ, EmplacesTheMessagesInPlace) {
+  typedef EfficientMQ<AddressRecordingConsumer, std::string, 1024, MQOverflowPolicy::BlockProducer>
+      BlockingMQ;
+  const std::string long_message(100, 'x');
+  AddressRecordingConsumer consumer;
+  std::vector<const std::string*> written;
+  std::vector<std::string> expected;
+  {
+    BlockingMQ mq(consumer, 4);
+    for (size_t i = 0; i < 20; ++i) {
+      expected.push_back(Message(0, i));
+      EXPECT_TRUE(mq.EmplaceMessage(expected.back().length(), [&written, &expected](std::string& message) {
+        EXPECT_EQ(expected.back().length(), message.length());
+        written.push_back(&message);
+        message.replace(0, message.length(), expected.back());
+      }));
+    }
+    consumer.WaitFor(20);
+    // Grows the messages in all the slots.
+    for (size_t i = 0; i < 10; ++i) {
+      mq.EmplaceMessage(long_message.length(), [](std::string& message) { message.assign(100, 'x'); });
+    }
+    for (size_t i = 0; i < 100; ++i) {
+      EXPECT_NO_ALLOCATIONS(mq.EmplaceMessage(long_message.length(), [&long_message](std::string& message) {
+        std::memcpy(&message[0], long_message.data(), long_message.length());
+      }));
+    }
+    consumer.WaitFor(130);
+  }
+  std::vector<std::string> messages = consumer.Messages();
+  ASSERT_EQ(130u, messages.size());
+  for (size_t i = 20; i < 130; ++i) {
+    EXPECT_EQ(long_message, messages[i]) << i;
+  }
+  messages.resize(20);
+  EXPECT_EQ(expected, messages);
+  consumer.addresses.resize(20);
+  EXPECT_EQ(written, consumer.addresses);
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+// The producers pause every hundred messages, for the consumer to run out of them, and to spin, yield,
+// or park, as the wait strategy has it, and then to be woken up again.
+template <MQWaitStrategy WAIT_STRATEGY>
+void RunWaitStrategyTest() {
+  typedef EfficientMQ<RecordingConsumer, std::string, 1024, MQOverflowPolicy::BlockProducer, WAIT_STRATEGY>
+      WaitingMQ;
+  const size_t kProducers = 2;
+  const size_t kMessages = 1000;
+  RecordingConsumer consumer;
+  {
+    WaitingMQ mq(consumer, 16);
+    std::vector<std::thread> producers;
+    for (size_t producer = 0; producer < kProducers; ++producer) {
+      producers.emplace_back([&mq, producer]() {
+        for (size_t i = 0; i < kMessages; ++i) {
+          if (i % 100 == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+          }
+          EXPECT_TRUE(mq.PushMessage(Message(producer, i)));
+        }
+      });
+    }
+    for (std::thread& producer : producers) {
+      producer.join();
+    }
+  }
+  EXPECT_EQ(std::vector<size_t>(kProducers, kMessages), CheckOrderPerProducer(consumer.Messages(), kProducers));
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+TEST(EfficientMQ, ParkingConsumerDeliversEverything) {
+  RunWaitStrategyTest<MQWaitStrategy::Park>();
+}
+
+TEST(EfficientMQ, AdaptiveConsumerDeliversEverything) {
+  RunWaitStrategyTest<MQWaitStrategy::Adaptive>();
+}
+
+TEST(EfficientMQ, SpinningConsumerDeliversEverything) {
+  RunWaitStrategyTest<MQWaitStrategy::Spin>();
+}
+
+// The pushed message is swapped with what its slot held, an exported message, the buffer of which is reused.
+// Once all the buffers in circulation have grown to the length of the messages, no allocations are made.
+TEST(EfficientMQ, RecyclesTheMessages) {
+  typedef EfficientMQ<RecordingConsumer, std::string, 1024, MQOverflowPolicy::BlockProducer> BlockingMQ;
+  RecordingConsumer consumer;
+  {
+    BlockingMQ mq(consumer, 4);
+    std::string message;
+    const auto push = [&mq, &message](size_t i) {
+      message.assign(100, static_cast<char>('a' + i % 26));
+      return mq.PushMessageRecycling(message);
+    };
+    EXPECT_TRUE(push(0));
+    // The slot held no message yet.
+    EXPECT_TRUE(message.empty());
+    for (size_t i = 1; i < 10; ++i) {
+      EXPECT_TRUE(push(i));
+    }
+    consumer.WaitFor(10);
+    for (size_t i = 10; i < 500; ++i) {
+      EXPECT_NO_ALLOCATIONS(EXPECT_TRUE(push(i)));
+    }
+  }
+  std::vector<std::string> expected;
+  for (size_t i = 0; i < 500; ++i) {
+    expected.push_back(std::string(100, static_cast<char>('a' + i % 26)));
+  }
+  EXPECT_EQ(expected, consumer.Messages());
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+// Is passed all the messages ready at once, and tells how many there were each time.
+struct BatchRecordingConsumer : RecordingConsumer {
+  std::vector<size_t> batches;
+  void OnMessages(const std::string* begin, const std::string* end, size_t number_of_dropped_events) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      batches.push_back(static_cast<size_t>(end - begin));
+    }
+    for (const std::string* it = begin; it != end; ++it) {
+      Record(*it, number_of_dropped_events);
+      number_of_dropped_events = 0;
+    }
+  }
+};
+
+// The messages pushed within the linger arrive together, once it is over.
+TEST(EfficientMQ, LingersToExportTheMessagesTogether) {
+  BatchRecordingConsumer consumer;
+  std::chrono::steady_clock::duration elapsed;
+  {
+    EfficientMQ<BatchRecordingConsumer> mq(consumer, 16);
+    mq.SetLinger(std::chrono::milliseconds(200), 1000);
+    const std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < 5; ++i) {
+      EXPECT_TRUE(mq.PushMessage(Message(0, i)));
+    }
+    consumer.WaitFor(5);
+    elapsed = std::chrono::steady_clock::now() - begin;
+  }
+  EXPECT_GE(elapsed, std::chrono::milliseconds(200));
+  EXPECT_EQ(std::vector<size_t>({5}), consumer.batches);
+  EXPECT_EQ(5u, consumer.Messages().size());
+}
+
+// The linger is cut short once `max_batch_bytes` of the messages are pending.
+TEST(EfficientMQ, ExportsTheLingeringMessagesOnceTheBatchIsLargeEnough) {
+  BatchRecordingConsumer consumer;
+  std::chrono::steady_clock::duration elapsed;
+  {
+    EfficientMQ<BatchRecordingConsumer> mq(consumer, 16);
+    mq.SetLinger(std::chrono::milliseconds(60 * 1000), 30);
+    const std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < 3; ++i) {
+      EXPECT_TRUE(mq.PushMessage("0123456789"));
+    }
+    consumer.WaitFor(3);
+    elapsed = std::chrono::steady_clock::now() - begin;
+  }
+  EXPECT_LT(elapsed, std::chrono::milliseconds(10 * 1000));
+  EXPECT_EQ(std::vector<size_t>({3}), consumer.batches);
+}
+
+// With the consumer stalled, the messages that do not fit into the buffer go to the file, and are exported
+// once the buffer is, in the order they were pushed.
+TEST(EfficientMQ, ReplaysTheSpilledMessagesInOrder) {
+  Gate gate;
+  RecordingConsumer consumer(&gate);
+  std::vector<std::string> expected;
+  {
+    EfficientMQ<RecordingConsumer> mq(consumer, 4);
+    ASSERT_TRUE(mq.SetSpillFile("build/efficient_mq_spill", 1 << 20));
+    expected.push_back(Message(0, 0));
+    EXPECT_TRUE(mq.PushMessage(expected.back()));
+    gate.WaitUntilWaiting();
+    for (size_t i = 1; i < 100; ++i) {
+      expected.push_back(Message(0, i));
+      EXPECT_TRUE(mq.PushMessage(expected.back()));
+    }
+    gate.Open();
+    consumer.WaitFor(100);
+    // The file has been read back, the buffer is used again.
+    expected.push_back(Message(0, 100));
+    EXPECT_TRUE(mq.PushMessage(expected.back()));
+    consumer.WaitFor(101);
+  }
+  EXPECT_EQ(expected, consumer.Messages());
+  EXPECT_EQ(0u, consumer.dropped);
+}
+
+// Once the file is full, the overflow policy applies, and every message is still either delivered or dropped.
+TEST(EfficientMQ, DropsOnceTheSpillFileIsFull) {
+  Gate gate;
+  RecordingConsumer consumer(&gate);
+  {
+    EfficientMQ<RecordingConsumer> mq(consumer, 4);
+    // Room for the records of "0:3" to "0:9", of seven bytes with the length, and of "0:10" to "0:12".
+    ASSERT_TRUE(mq.SetSpillFile("build/efficient_mq_spill", 80));
+    EXPECT_TRUE(mq.PushMessage(Message(0, 0)));
+    gate.WaitUntilWaiting();
+    for (size_t i = 1; i < 100; ++i) {
+      mq.PushMessage(Message(0, i));
+    }
+    gate.Open();
+  }
+  const std::vector<std::string> messages = consumer.Messages();
+  EXPECT_EQ(100u, messages.size() + consumer.dropped);
+  // The one being exported, the two in the buffer, and the ten in the file.
+  EXPECT_EQ(13u, messages.size());
+}
+
+// A small trivially copyable message, copied into its slot with the mutex held.
+struct Sample {
+  size_t producer;
+  size_t index;
+};
+
+struct SampleConsumer {
+  std::vector<Sample> samples;
+  size_t dropped = 0;
+  void OnMessage(const Sample& sample, size_t number_of_dropped_events) {
+    samples.push_back(sample);
+    dropped += number_of_dropped_events;
+  }
+};
+
+// Each sample arrives once, in the order of its producer, and the producers make no allocations.
+TEST(EfficientMQ, CopiesTheSmallMessagesUnderTheLock) {
+  typedef EfficientMQ<SampleConsumer, Sample, 1024, MQOverflowPolicy::BlockProducer> SampleMQ;
+  static_assert(SampleMQ::copy_under_lock, "");
+  static_assert(!EfficientMQ<RecordingConsumer>::copy_under_lock, "");
+  const size_t kProducers = 4;
+  const size_t kMessages = 10000;
+  SampleConsumer consumer;
+  {
+    SampleMQ mq(consumer, 16);
+    std::vector<std::thread> producers;
+    for (size_t producer = 0; producer < kProducers; ++producer) {
+      producers.emplace_back([&mq, producer]() {
+        for (size_t i = 0; i < kMessages; ++i) {
+          EXPECT_NO_ALLOCATIONS(EXPECT_TRUE(mq.PushMessage(Sample{producer, i})));
+        }
+      });
+    }
+    for (std::thread& producer : producers) {
+      producer.join();
+    }
+  }
+  std::vector<size_t> next(kProducers, 0);
+  for (const Sample& sample : consumer.samples) {
+    ASSERT_LT(sample.producer, kProducers);
+    EXPECT_EQ(next[sample.producer], sample.index);
+    next[sample.producer] = sample.index + 1;
+  }
+  EXPECT_EQ(std::vector<size_t>(kProducers, kMessages), next);
+  EXPECT_EQ(0u, consumer.dropped);
+}
@@ -0,0 +1,192 @@
+// Content hashing and the index of recently processed contents, for `FileReceiver` to drop duplicate uploads:
+// the devices that retry after a timeout upload the same payload several times.
+//
+// `ContentHash` is a streaming 64-bit hash, MurmurHash64A-style mixing of 8-byte words, fed the contents
+// in chunks of any size as they are read. Together with the size of the contents, it identifies them.
+//
+// `RecentContentHashes` keeps the keys of the last `capacity` processed contents in memory. With a file name,
+// it also appends them to that file, one "${hash} ${size}" line of `FixedSizeSerializer`-s per key, and reads
+// them back on construction, for the duplicates to be detected across restarts. The file is rewritten
+// with the `capacity` most recent keys once it holds twice as many.
+
+#ifndef FILE_RECEIVER_CONTENT_DEDUPE_H
+#define FILE_RECEIVER_CONTENT_DEDUPE_H
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <unordered_set>
+
+#include "../Bricks/file/file.h"
+#include "../Bricks/strings/fixed_size_serializer.h"
+
+namespace file_receiver {
+
+class ContentHash final {
+ public:
+  explicit ContentHash(uint64_t seed = 0) : hash_(seed) {}
+
+  void Update(const char* data, size_t length) {
+    size_ += length;
+    if (tail_length_) {
+      const size_t n = std::min(length, sizeof(uint64_t) - tail_length_);
+      std::memcpy(tail_ + tail_length_, data, n);
+      tail_length_ += n;
+      data += n;
+      length -= n;
+      if (tail_length_ < sizeof(uint64_t)) {
+        return;
+      }
+      MixWord(tail_);
+      tail_length_ = 0;
+    }
+    for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+      MixWord(data);
+    }
+    std::memcpy(tail_, data, length);
+    tail_length_ = length;
+  }
+
+  uint64_t Hash() const {
+    uint64_t hash = hash_ ^ (size_ * kMultiplier);
+    if (tail_length_) {
+      uint64_t word = 0;
+      std::memcpy(&word, tail_, tail_length_);
+      hash = (hash ^ word) * kMultiplier;
+    }
+    hash ^= hash >> kShift;
+    hash *= kMultiplier;
+    hash ^= hash >> kShift;
+    return hash;
+  }
+
+  uint64_t Size() const { return size_; }
+
+  static uint64_t Of(const char* data, size_t length) {
+    ContentHash hash;
+    hash.Update(data, length);
+    return hash.Hash();
+  }
+
+ private:
+  static constexpr uint64_t kMultiplier = 0xc6a4a7935bd1e995ull;
+  static constexpr int kShift = 47;
+
+  void MixWord(const char* data) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    word *= kMultiplier;
+    word ^= word >> kShift;
+    word *= kMultiplier;
+    hash_ = (hash_ ^ word) * kMultiplier;
+  }
+
+  uint64_t hash_;
+  uint64_t size_ = 0;
+  char tail_[sizeof(uint64_t)];
+  size_t tail_length_ = 0;
+};
+
+struct ContentKey {
+  uint64_t hash;
+  uint64_t size;
+  bool operator==(const ContentKey& rhs) const { return hash == rhs.hash && size == rhs.size; }
+  struct Hasher {
+    size_t operator()(const ContentKey& key) const { return static_cast<size_t>(key.hash ^ key.size); }
+  };
+};
+
+// NOT THREAD SAFE.
+class RecentContentHashes final {
+ public:
+  explicit RecentContentHashes(size_t capacity, const std::string& file_name = "")
+      : capacity_(std::max(capacity, static_cast<size_t>(1))), file_name_(file_name) {
+    if (!file_name_.empty()) {
+      try {
+        const std::string contents = bricks::ReadFileAsString(file_name_);
+        for (size_t i = 0; i + kLineLength <= contents.length(); i += kLineLength) {
+          ContentKey key;
+          if (Serializer::Unpack(&contents[i], key.hash) && contents[i + kWidth] == ' ' &&
+              Serializer::Unpack(&contents[i + kWidth + 1], key.size) &&
+              contents[i + kLineLength - 1] == '\n') {
+            Add(key);
+          }
+        }
+      } catch (const bricks::FileException&) {
+        // No index yet.
+      }
+      Compact();
+    }
+  }
+
+  bool Contains(const ContentKey& key) const { return keys_.count(key) != 0; }
+
+  // Adds the key, evicting the oldest one if full, and appends it to the file.
+  void Insert(const ContentKey& key) {
+    if (Contains(key)) {
+      return;
+    }
+    Add(key);
+    if (!file_name_.empty()) {
+      if (++lines_in_file_ >= capacity_ * 2) {
+        Compact();
+      } else {
+        try {
+          bricks::WriteStringToFile(file_name_, Line(key), true);
+        } catch (const bricks::FileException&) {
+          // TODO(dkorolev): Log an error message, could not write the file.
+        }
+      }
+    }
+  }
+
+  size_t size() const { return order_.size(); }
+
+ private:
+  typedef bricks::strings::FixedSizeSerializer<uint64_t> Serializer;
+  enum { kWidth = Serializer::size_in_bytes, kLineLength = kWidth * 2 + 2 };
+
+  void Add(const ContentKey& key) {
+    if (keys_.insert(key).second) {
+      order_.push_back(key);
+      if (order_.size() > capacity_) {
+        keys_.erase(order_.front());
+        order_.pop_front();
+      }
+    }
+  }
+
+  static std::string Line(const ContentKey& key) {
+    std::string line(kLineLength, ' ');
+    Serializer::Pack(key.hash, &line[0]);
+    Serializer::Pack(key.size, &line[kWidth + 1]);
+    line[kLineLength - 1] = '\n';
+    return line;
+  }
+
+  // Rewrites the file with the keys in memory.
+  void Compact() {
+    std::string contents;
+    contents.reserve(order_.size() * kLineLength);
+    for (const ContentKey& key : order_) {
+      contents += Line(key);
+    }
+    try {
+      bricks::WriteFileAtomically(file_name_, contents, bricks::WriteFileAtomicallyParameters::NoSync);
+    } catch (const bricks::FileException&) {
+      // TODO(dkorolev): Log an error message, could not write the file.
+    }
+    lines_in_file_ = order_.size();
+  }
+
+  const size_t capacity_;
+  const std::string file_name_;
+  std::unordered_set<ContentKey, ContentKey::Hasher> keys_;
+  std::deque<ContentKey> order_;
+  size_t lines_in_file_ = 0;
+};
+
+}  // namespace file_receiver
+
+#endif  // FILE_RECEIVER_CONTENT_DEDUPE_H
@@ -0,0 +1,509 @@
+// `FileReceiver` hands the files uploaded to nginx over to the processor, as soon as each of them is complete.
+//
+// nginx is expected to save the body of each upload into `uploads_directory` and to notify this server
+// with a POST to `http_path` carrying the full name of the file in the `file_name_http_header` header,
+// see the configuration in test.cc. The notifications are served by the event loop `HTTPServer`, and,
+// for the files that arrive with no notification, the directory is watched with `DirectoryWatcher`:
+// a file is picked up once it has been closed after writing or moved into the directory, whichever of
+// the two comes first. The files present in the directory at startup are picked up too. Nothing is polled.
+//
+// The files are processed by a pool of `processing_threads` threads, the same way FSQ processes its
+// finalized files: `processor.OnFileReceived(file)` returns a `fsq::FileProcessingResult`. With more than
+// one thread, the processor is called concurrently, and should be thread safe.
+// On `Success` the file is removed, on `SuccessAndMoved` it is left to the processor, and on `Unavailable`
+// or `FailureNeedRetry` it is retried after `retry_delay_ms`. Each file is queued once, however many times
+// it is reported, until its processing is done; the reports of the files that no longer exist are ignored.
+//
+// Each file is memory-mapped, and its `ContentHash` is computed as it is read, before the processor is called
+// with the contents mapped already. With `drop_duplicates`, the files with the same size and hash as one
+// of the `recent_contents` last processed successfully are removed without being processed, and the ones
+// whose contents are being processed by another thread are retried after it. With `recent_contents_file_name`,
+// the recent contents are kept on disk too, to be known after a restart, see content_dedupe.h.
+//
+// With a non-zero `upload_port`, the files can also be uploaded directly, with no nginx in front: the body
+// of each POST to `upload_path` is saved by `HTTPStreamingServerConnection::SaveRequestBodyToFile()`,
+// which preallocates the file and, on Linux, splices the body from the socket into it, with no copies
+// through the user space. The bodies are written into `partial_uploads_directory`, and are moved into
+// `uploads_directory` once complete, for the watcher to never see a partial file. The two directories should
+// be on the same file system; the default is `uploads_directory` with the ".partial" suffix, next to it.
+// The `multipart/form-data` uploads of the browsers are parsed as they stream in, and each of their files
+// is written into a partial file of its own, and handed over, with the content type of its part, as soon as
+// its part is complete. The response lists the names of the files, one per line.
+// The uploads are served by `upload_threads` threads, one connection at a time each.
+
+#ifndef FILE_RECEIVER_FILE_RECEIVER_H
+#define FILE_RECEIVER_FILE_RECEIVER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "content_dedupe.h"
+
+#include "../FileStorageQueue/fsq.h"
+
+#include "../Bricks/file/directory_watcher.h"
+#include "../Bricks/file/file.h"
+#include "../Bricks/net/http/http.h"
+#include "../Bricks/strings/printf.h"
+#include "../Bricks/time/chrono.h"
+
+namespace file_receiver {
+
+struct FileReceiverParameters {
+  int port = 8089;
+  // The path nginx notifies of the uploaded files on.
+  std::string http_path = "/file_uploaded";
+  std::string uploads_directory;
+  // The HTTP header nginx passes the full name of the uploaded file in.
+  std::string file_name_http_header = "X-FILE";
+  std::string content_type_http_header = "Content-Type";
+  size_t http_threads = 1;
+  size_t processing_threads = 1;
+  uint64_t retry_delay_ms = 1000;
+  bool drop_duplicates = false;
+  size_t recent_contents = 100000;
+  std::string recent_contents_file_name;
+  // The direct uploads, off with the port of zero.
+  int upload_port = 0;
+  std::string upload_path = "/upload";
+  std::string partial_uploads_directory;
+  size_t upload_threads = 1;
+};
+
+struct ReceivedFile {
+  std::string name;
+  std::string full_path_name;
+  uint64_t size;
+  // From the notification of nginx or the direct upload, empty if the file has been picked up from
+  // the directory before it.
+  std::string content_type;
+  // The contents of the file, mapped into memory for the duration of the call, null if it is empty.
+  const char* contents;
+  uint64_t content_hash;
+};
+
+template <typename PROCESSOR>
+class FileReceiver final {
+ public:
+  typedef PROCESSOR T_PROCESSOR;
+
+  // Throws `bricks::FileException` if the directory can not be watched, and `bricks::net::SocketException`-s
+  // if the port can not be listened on.
+  FileReceiver(T_PROCESSOR& processor, const FileReceiverParameters& parameters)
+      : processor_(processor),
+        parameters_(parameters),
+        prefix_(bricks::FileSystem::JoinPath(parameters.uploads_directory, "")),
+        partial_uploads_directory_(parameters.partial_uploads_directory.empty()
+                                       ? parameters.uploads_directory + ".partial"
+                                       : parameters.partial_uploads_directory),
+        watcher_(parameters.uploads_directory),
+        recent_contents_(parameters.drop_duplicates
+                             ? new RecentContentHashes(parameters.recent_contents,
+                                                       parameters.recent_contents_file_name)
+                             : nullptr),
+        watcher_thread_(&FileReceiver::WatcherThread, this) {
+    for (size_t i = 0; i < std::max(parameters_.processing_threads, static_cast<size_t>(1)); ++i) {
+      processing_threads_.emplace_back(&FileReceiver::ProcessingThread, this);
+    }
+    // The directory is watched already, none of the files to appear in it from now on can be missed.
+    bricks::FileSystem::ScanDir(parameters_.uploads_directory,
+                                [this](const std::string& name) { Enqueue(name, std::string()); });
+    router_.Register("GET", "/healthz", [](bricks::net::HTTPResponse& response) { response.body = "OK\n"; });
+    router_.Register("POST", parameters_.http_path, [](bricks::net::HTTPResponse& response) {
+      response.code = bricks::net::HTTPResponseCode::Accepted;
+      response.body = "RECEIVED\n";
+    });
+    bricks::net::HTTPServerParameters http_parameters;
+    http_parameters.threads = parameters_.http_threads;
+    server_.reset(new bricks::net::HTTPServer(
+        parameters_.port,
+        [this](const bricks::net::HTTPRequest& request, bricks::net::HTTPResponse& response) {
+          ServeHTTP(request, response);
+        },
+        http_parameters));
+    if (parameters_.upload_port) {
+      bricks::FileSystem::CreateDirectory(partial_uploads_directory_);
+      upload_socket_.reset(new bricks::net::Socket(parameters_.upload_port));
+      for (size_t i = 0; i < std::max(parameters_.upload_threads, static_cast<size_t>(1)); ++i) {
+        upload_threads_.emplace_back(&FileReceiver::UploadThread, this);
+      }
+    }
+  }
+
+  ~FileReceiver() {
+    if (upload_socket_) {
+      // Wake up each of the threads waiting in `accept()` with a connection of its own.
+      uploads_stopping_ = true;
+      for (size_t i = 0; i < upload_threads_.size(); ++i) {
+        try {
+          bricks::net::ClientSocket("localhost", parameters_.upload_port);
+        } catch (const bricks::net::SocketException&) {
+        }
+      }
+      for (std::thread& thread : upload_threads_) {
+        thread.join();
+      }
+    }
+    server_.reset();
+    watcher_.Interrupt();
+    watcher_thread_.join();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      destructing_ = true;
+    }
+    condition_.notify_all();
+    for (std::thread& thread : processing_threads_) {
+      thread.join();
+    }
+  }
+
+  // The number of upload notifications received from nginx. THREAD SAFE.
+  size_t NumberOfNotificationsReceived() const { return notifications_received_; }
+
+  // The number of files uploaded directly, to `upload_port`. THREAD SAFE.
+  size_t NumberOfFilesUploaded() const { return files_uploaded_; }
+
+  // The number of files processed successfully. THREAD SAFE.
+  size_t NumberOfFilesProcessed() const { return files_processed_; }
+
+  // The number of files removed as duplicates, without being processed. THREAD SAFE.
+  size_t NumberOfDuplicatesDropped() const { return duplicates_dropped_; }
+
+ private:
+  typedef std::function<void(bricks::net::HTTPResponse&)> T_HANDLER;
+
+  // Hash the mapped file in chunks, for the pages to stay in the cache for the processor to read them again.
+  static constexpr size_t kHashChunkSize = 1024 * 1024;
+
+  void ServeHTTP(const bricks::net::HTTPRequest& request, bricks::net::HTTPResponse& response) {
+    bricks::net::HTTPRouteParameters route_parameters;
+    const T_HANDLER* handler = router_.Find(request.method, request.url, route_parameters);
+    if (!handler) {
+      response.code = bricks::net::HTTPResponseCode::NotFound;
+      response.body = "ERROR\n";
+      return;
+    }
+    if (request.method == "POST") {
+      ++notifications_received_;
+      const auto cit = request.headers.find(parameters_.file_name_http_header);
+      std::string name;
+      if (cit == request.headers.end() || !FileNameInUploadsDirectory(cit->second, name)) {
+        response.code = bricks::net::HTTPResponseCode::BadRequest;
+        response.body = "ERROR\n";
+        return;
+      }
+      const auto cit_content_type = request.headers.find(parameters_.content_type_http_header);
+      Enqueue(name, cit_content_type != request.headers.end() ? cit_content_type->second : std::string());
+    }
+    (*handler)(response);
+  }
+
+  // Returns false if the file is not in the uploads directory.
+  bool FileNameInUploadsDirectory(const std::string& full_path_name, std::string& name) const {
+    if (full_path_name.length() > prefix_.length() && !full_path_name.compare(0, prefix_.length(), prefix_) &&
+        full_path_name.find('/', prefix_.length()) == std::string::npos) {
+      name = full_path_name.substr(prefix_.length());
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  void WatcherThread() {
+    while (watcher_.WaitForFiles([this](const std::string& name) { Enqueue(name, std::string()); })) {
+    }
+  }
+
+  void UploadThread() {
+    while (!uploads_stopping_) {
+      try {
+        bricks::net::HTTPStreamingServerConnection connection(upload_socket_->Accept());
+        if (uploads_stopping_) {
+          return;
+        }
+        do {
+          ServeUpload(connection);
+        } while (connection.NextRequest());
+      } catch (const bricks::Exception&) {
+        // The client has gone away, or has sent a malformed request.
+        // TODO(dkorolev): Log an error message.
+      }
+    }
+  }
+
+  void ServeUpload(bricks::net::HTTPStreamingServerConnection& connection) {
+    const auto& message = connection.Message();
+    if (message.Method() != "POST" || message.URL() != parameters_.upload_path) {
+      connection.SendHTTPResponse("ERROR\n", bricks::net::HTTPResponseCode::NotFound);
+      return;
+    }
+    bricks::net::HTTPHeaderViewHelper::Slice header;
+    std::string boundary;
+    if (message.FindHeader("Content-Type", header) &&
+        bricks::net::HTTPMultipartBoundary(header.ToString(), boundary)) {
+      MultipartUpload upload(*this);
+      try {
+        bricks::net::StreamMultipartRequestBody(connection, upload);
+      } catch (...) {
+        upload.Abort();
+        throw;
+      }
+      connection.SendHTTPResponse(upload.names, bricks::net::HTTPResponseCode::Accepted);
+      return;
+    }
+    const std::string name = NextUploadName();
+    const std::string partial_file_name = BeginUpload(
+        name,
+        message.FindHeader(parameters_.content_type_http_header.c_str(), header) ? header.ToString()
+                                                                                 : std::string());
+    try {
+      connection.SaveRequestBodyToFile(partial_file_name);
+    } catch (...) {
+      AbortUpload(name);
+      throw;
+    }
+    CompleteUpload(name);
+    connection.SendHTTPResponse(name + '\n', bricks::net::HTTPResponseCode::Accepted);
+  }
+
+  // Writes each file of a `multipart/form-data` upload into a partial file of its own as its part arrives,
+  // and hands it over as soon as the part is complete, with the content type of the part.
+  // The form fields, the parts with no `filename`, are skipped.
+  struct MultipartUpload {
+    explicit MultipartUpload(FileReceiver& receiver) : receiver(receiver) {}
+
+    void OnPartBegin(const bricks::net::HTTPMultipartPart& part) {
+      if (!part.filename.empty()) {
+        name = receiver.NextUploadName();
+        file.reset(new bricks::PosixOutputFile(receiver.BeginUpload(name, part.content_type)));
+        if (file->bad()) {
+          throw bricks::FileException();
+        }
+      }
+    }
+    void OnPartData(const char* data, size_t length) {
+      if (file) {
+        file->write(data, static_cast<std::streamsize>(length));
+      }
+    }
+    void OnPartEnd() {
+      if (file) {
+        file->flush();
+        const bool bad = file->bad();
+        file.reset();
+        if (bad) {
+          receiver.AbortUpload(name);
+          throw bricks::FileException();
+        }
+        receiver.CompleteUpload(name);
+        names += name + '\n';
+      }
+    }
+    // The files completed already are kept.
+    void Abort() {
+      if (file) {
+        file.reset();
+        receiver.AbortUpload(name);
+      }
+    }
+
+    FileReceiver& receiver;
+    std::unique_ptr<bricks::PosixOutputFile> file;
+    std::string name;
+    std::string names;
+  };
+
+  std::string NextUploadName() {
+    return bricks::strings::Printf("upload.%llu.%llu",
+                                   static_cast<unsigned long long>(bricks::time::Now()),
+                                   static_cast<unsigned long long>(++upload_counter_));
+  }
+
+  // Returns the name of the partial file to write the upload into.
+  std::string BeginUpload(const std::string& name, const std::string& content_type) {
+    // Pending before it is moved into the directory, for the report of the watcher to not race with this one.
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_[name] = content_type;
+    return bricks::FileSystem::JoinPath(partial_uploads_directory_, name);
+  }
+
+  void CompleteUpload(const std::string& name) {
+    const std::string partial_file_name = bricks::FileSystem::JoinPath(partial_uploads_directory_, name);
+    try {
+      bricks::FileSystem::RenameFile(partial_file_name,
+                                     bricks::FileSystem::JoinPath(parameters_.uploads_directory, name));
+    } catch (...) {
+      AbortUpload(name);
+      throw;
+    }
+    ++files_uploaded_;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ready_.push_back(name);
+    }
+    condition_.notify_one();
+  }
+
+  void AbortUpload(const std::string& name) {
+    bricks::FileSystem::RemoveFile(bricks::FileSystem::JoinPath(partial_uploads_directory_, name),
+                                   bricks::RemoveFileParameters::Silent);
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.erase(name);
+  }
+
+  void Enqueue(const std::string& name, const std::string& content_type) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const auto it = pending_.find(name);
+      if (it != pending_.end()) {
+        if (!content_type.empty()) {
+          it->second = content_type;
+        }
+        return;
+      }
+      pending_[name] = content_type;
+      ready_.push_back(name);
+    }
+    condition_.notify_one();
+  }
+
+  void ProcessingThread() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      const auto now = std::chrono::steady_clock::now();
+      while (!retries_.empty() && retries_.begin()->first <= now) {
+        ready_.push_back(retries_.begin()->second);
+        retries_.erase(retries_.begin());
+      }
+      if (destructing_) {
+        return;
+      }
+      if (ready_.empty()) {
+        if (retries_.empty()) {
+          condition_.wait(lock);
+        } else {
+          condition_.wait_until(lock, retries_.begin()->first);
+        }
+        continue;
+      }
+      ReceivedFile file;
+      file.name = std::move(ready_.front());
+      ready_.pop_front();
+      file.content_type = pending_[file.name];
+      lock.unlock();
+      const bool retry = ProcessFile(file);
+      lock.lock();
+      if (retry) {
+        const auto retry_time =
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(parameters_.retry_delay_ms);
+        retries_.emplace(retry_time, file.name);
+      } else {
+        pending_.erase(file.name);
+      }
+    }
+  }
+
+  // Returns true if the file should be retried.
+  bool ProcessFile(ReceivedFile& file) {
+    file.full_path_name = bricks::FileSystem::JoinPath(parameters_.uploads_directory, file.name);
+    std::unique_ptr<bricks::MemoryMappedFile> mapped_file;
+    try {
+      mapped_file.reset(new bricks::MemoryMappedFile(file.full_path_name));
+    } catch (const bricks::FileException&) {
+      // Reported once more after having been processed, or removed by someone else.
+      return false;
+    }
+    file.contents = mapped_file->data();
+    file.size = mapped_file->size();
+    ContentHash hash;
+    for (size_t offset = 0; offset < file.size; offset += kHashChunkSize) {
+      hash.Update(file.contents + offset, std::min(kHashChunkSize, static_cast<size_t>(file.size - offset)));
+    }
+    file.content_hash = hash.Hash();
+    const ContentKey key{file.content_hash, file.size};
+    if (recent_contents_) {
+      std::lock_guard<std::mutex> lock(recent_contents_mutex_);
+      if (recent_contents_->Contains(key)) {
+        bricks::FileSystem::RemoveFile(file.full_path_name, bricks::RemoveFileParameters::Silent);
+        ++duplicates_dropped_;
+        return false;
+      }
+      if (!contents_in_progress_.insert(key).second) {
+        return true;
+      }
+    }
+    const fsq::FileProcessingResult result = processor_.OnFileReceived(file);
+    mapped_file.reset();
+    const bool ok =
+        (result == fsq::FileProcessingResult::Success || result == fsq::FileProcessingResult::SuccessAndMoved);
+    if (ok) {
+      if (result == fsq::FileProcessingResult::Success) {
+        bricks::FileSystem::RemoveFile(file.full_path_name, bricks::RemoveFileParameters::Silent);
+      }
+      ++files_processed_;
+    }
+    if (recent_contents_) {
+      std::lock_guard<std::mutex> lock(recent_contents_mutex_);
+      contents_in_progress_.erase(key);
+      if (ok) {
+        recent_contents_->Insert(key);
+      }
+    }
+    return !ok;
+  }
+
+  T_PROCESSOR& processor_;
+  const FileReceiverParameters parameters_;
+  const std::string prefix_;
+  const std::string partial_uploads_directory_;
+  bricks::DirectoryWatcher watcher_;
+  bricks::net::GenericHTTPRouter<T_HANDLER> router_;
+
+  std::mutex recent_contents_mutex_;
+  std::unique_ptr<RecentContentHashes> recent_contents_;
+  std::unordered_set<ContentKey, ContentKey::Hasher> contents_in_progress_;
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  // The files queued or being processed, with their content types.
+  std::unordered_map<std::string, std::string> pending_;
+  std::deque<std::string> ready_;
+  std::multimap<std::chrono::steady_clock::time_point, std::string> retries_;
+  bool destructing_ = false;
+
+  std::atomic_size_t notifications_received_{0};
+  std::atomic_size_t files_processed_{0};
+  std::atomic_size_t duplicates_dropped_{0};
+  std::atomic_size_t files_uploaded_{0};
+
+  std::vector<std::thread> processing_threads_;
+  std::thread watcher_thread_;
+  std::unique_ptr<bricks::net::HTTPServer> server_;
+
+  std::unique_ptr<bricks::net::Socket> upload_socket_;
+  std::atomic_bool uploads_stopping_{false};
+  std::atomic_size_t upload_counter_{0};
+  std::vector<std::thread> upload_threads_;
+
+  FileReceiver(const FileReceiver&) = delete;
+  void operator=(const FileReceiver&) = delete;
+};
+
+template <typename PROCESSOR>
+constexpr size_t FileReceiver<PROCESSOR>::kHashChunkSize;
+
+}  // namespace file_receiver
+
+#endif  // FILE_RECEIVER_FILE_RECEIVER_H
@@ -39,14 +39,13 @@ curl -s --url localhost:8088/upload --data-binary @<(echo "Hello, World.") >/dev
 (cd /home/www-data/uploads ; ls -t | head -n 1 | xargs rm)
 */
 
-// TODO(dkorolev): Migrate to a simpler HTTP server implementation
-//                 that is to be added to Bricks' net/api.h soon.
-
-#include <chrono>
 #include <condition_variable>
-#include <functional>
 #include <mutex>
-#include <thread>
+#include <string>
+#include <vector>
+
+#include "content_dedupe.h"
+#include "file_receiver.h"
 
 #include "../Bricks/dflags/dflags.h"
 #include "../Bricks/file/file.h"
@@ -56,138 +55,327 @@ curl -s --url localhost:8088/upload --data-binary @<(echo "Hello, World.") >/dev
 #include "../Bricks/3party/gtest/gtest.h"
 #include "../Bricks/3party/gtest/gtest-main-with-dflags.h"
 
-using namespace bricks::net;       // Socket, HTTPResponseCode.
+using namespace bricks::net;       // Connection, HTTPResponseCode.
 using namespace bricks::net::api;  // GET, POST.
 
+using file_receiver::ContentHash;
+using file_receiver::ContentKey;
+using file_receiver::FileReceiver;
+using file_receiver::FileReceiverParameters;
+using file_receiver::ReceivedFile;
+using file_receiver::RecentContentHashes;
+
 DEFINE_string(expected_arch, "", "The expected architecture to run on, `uname` on *nix systems.");
 DEFINE_string(upload_url, "http://localhost:8088/upload", "Path to upload test data to.");
 DEFINE_int32(local_port, 8089, "Local port to listen to uploaded file events on.");
 DEFINE_string(local_http_path, "/file_uploaded", "Local HTTP path triggered as a new file is uploaded.");
 DEFINE_string(uploads_directory, "/home/www-data/uploads", "Local directory where uploaded files will appear.");
-DEFINE_int64(dir_poll_period_ms, 100, "Number of milliseconds between explicit directory polling.");
 DEFINE_string(full_file_name_http_header, "X-FILE", "The name of HTTP header nginx uses for file name.");
 DEFINE_string(content_type_http_header, "Content-Type", "The name of HTTP header content type is passed in.");
+DEFINE_string(test_uploads_directory, ".uploads", "Local directory for the tests that do not need nginx.");
+DEFINE_int32(local_upload_port, 8090, "Local port to upload files to directly, with no nginx.");
 
 TEST(ArchitectureTest, BRICKS_ARCH_UNAME_AS_IDENTIFIER) {
   ASSERT_EQ(BRICKS_ARCH_UNAME, FLAGS_expected_arch);
 }
 
-class FileReceiveServer final {
- public:
-  FileReceiveServer()
-      : web_thread_(&FileReceiveServer::ThreadWeb, this, Socket(FLAGS_local_port)),
-        dir_thread_(&FileReceiveServer::ThreadDir, this) {
-    // FOR THE TEST ONLY: REMOVE ALL PREVIOUSLY UPLOADED FILES.
-    bricks::FileSystem::ScanDir(FLAGS_uploads_directory, [](const std::string& filename) {
-      bricks::RemoveFile(bricks::FileSystem::JoinPath(FLAGS_uploads_directory, filename));
-    });
+struct MockProcessor final {
+  fsq::FileProcessingResult OnFileReceived(const ReceivedFile& file) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (failures_to_inject) {
+      --failures_to_inject;
+      return fsq::FileProcessingResult::FailureNeedRetry;
+    }
+    names.push_back(file.name);
+    contents.push_back(file.contents ? std::string(file.contents, file.size) : std::string());
+    content_types.push_back(file.content_type);
+    content_hashes.push_back(file.content_hash);
+    condition.notify_all();
+    return fsq::FileProcessingResult::Success;
   }
 
-  ~FileReceiveServer() {
-    const auto response = HTTP(GET(bricks::strings::Printf("http://localhost:%d/stop", FLAGS_local_port)));
-    assert(response.code == 200);
-    assert(response.body == "TERMINATING\n");
-    web_thread_.join();
-    dir_thread_.join();
+  void WaitForFiles(size_t count) {
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [this, count]() { return names.size() >= count; });
   }
 
-  size_t NumberOfFilesScanned() const {
-    return number_of_files_scanned_;
-  }
+  std::mutex mutex;
+  std::condition_variable condition;
+  size_t failures_to_inject = 0;
+  std::vector<std::string> names;
+  std::vector<std::string> contents;
+  std::vector<std::string> content_types;
+  std::vector<uint64_t> content_hashes;
+};
 
-  size_t NumberOfUploadRequestsReceived() const {
-    return number_of_upload_requests_received_;
-  }
+// FOR THE TEST ONLY: REMOVE ALL PREVIOUSLY UPLOADED FILES.
+static void RemoveAllFiles(const std::string& directory) {
+  bricks::FileSystem::CreateDirectory(directory);
+  bricks::FileSystem::ScanDir(directory, [&directory](const std::string& filename) {
+    bricks::RemoveFile(bricks::FileSystem::JoinPath(directory, filename));
+  });
+}
+
+static FileReceiverParameters Parameters(const std::string& uploads_directory) {
+  FileReceiverParameters parameters;
+  parameters.port = FLAGS_local_port;
+  parameters.http_path = FLAGS_local_http_path;
+  parameters.uploads_directory = uploads_directory;
+  parameters.file_name_http_header = FLAGS_full_file_name_http_header;
+  parameters.content_type_http_header = FLAGS_content_type_http_header;
+  return parameters;
+}
+
+// Sends the notification nginx would send for the uploaded file, and returns the HTTP response code.
+static int NotifyOfUploadedFile(const std::string& full_file_name) {
+  Connection connection(ClientSocket("localhost", FLAGS_local_port));
+  connection.BlockingWrite("POST " + FLAGS_local_http_path + " HTTP/1.1\r\n" +
+                           FLAGS_full_file_name_http_header + ": " + full_file_name + "\r\n" +
+                           FLAGS_content_type_http_header + ": application/some-magic-type\r\n" +
+                           "Content-Length: 0\r\nConnection: close\r\n\r\n");
+  connection.SendEOF();
+  // "HTTP/1.1 202 Accepted\r\n...".
+  const std::string response = connection.BlockingReadUntilEOF();
+  return response.length() > 9 ? atoi(response.c_str() + 9) : 0;
+}
+
+TEST(FileReceiverTest, UploadFileViaNginx) {
+  RemoveAllFiles(FLAGS_uploads_directory);
+  MockProcessor processor;
+  FileReceiver<MockProcessor> receiver(processor, Parameters(FLAGS_uploads_directory));
+
+  EXPECT_EQ(0u, receiver.NumberOfNotificationsReceived());
+  const auto response = HTTP(POST(FLAGS_upload_url, "UploadedViaNginx\n", "application/some-magic-type"));
+  EXPECT_EQ(202, response.code);
+  EXPECT_EQ(1u, receiver.NumberOfNotificationsReceived());
+  processor.WaitForFiles(1u);
+  EXPECT_EQ("UploadedViaNginx\n", processor.contents[0]);
+}
+
+TEST(FileReceiverTest, PicksUpNotifiedFiles) {
+  RemoveAllFiles(FLAGS_test_uploads_directory);
+  MockProcessor processor;
+  FileReceiver<MockProcessor> receiver(processor, Parameters(FLAGS_test_uploads_directory));
+
+  const std::string file_name = bricks::FileSystem::JoinPath(FLAGS_test_uploads_directory, "0000000001");
+  bricks::WriteStringToFile(file_name, "Notified");
+  EXPECT_EQ(202, NotifyOfUploadedFile(file_name));
+  EXPECT_EQ(1u, receiver.NumberOfNotificationsReceived());
+  processor.WaitForFiles(1u);
+  EXPECT_EQ("0000000001", processor.names[0]);
+  EXPECT_EQ("Notified", processor.contents[0]);
+  // Reported by both the notification and the directory watcher, the file is processed once, and removed.
+  EXPECT_EQ(1u, receiver.NumberOfFilesProcessed());
+  EXPECT_FALSE(bricks::FileSystem::FileExists(file_name));
+
+  EXPECT_EQ(400, NotifyOfUploadedFile("/tmp/0000000002"));
+}
+
+TEST(FileReceiverTest, PicksUpFilesFromTheDirectory) {
+  RemoveAllFiles(FLAGS_test_uploads_directory);
+  bricks::WriteStringToFile(bricks::FileSystem::JoinPath(FLAGS_test_uploads_directory, "before"), "Before");
+  MockProcessor processor;
+  FileReceiver<MockProcessor> receiver(processor, Parameters(FLAGS_test_uploads_directory));
 
- private:
-  void ThreadWeb(Socket socket) {
-    while (!terminate_) {
-      HTTPServerConnection connection(socket.Accept());
-      const auto& message = connection.Message();
-      const std::string method = message.Method();
-      const std::string url = message.URL();
-      if (url == "/healthz") {
-        connection.SendHTTPResponse("OK\n");
-      } else if (url == "/stop") {
-        connection.SendHTTPResponse("TERMINATING\n");
-        terminate_ = true;
-        cv_.notify_all();
-      } else if (url == FLAGS_local_http_path) {
-        ++number_of_upload_requests_received_;
-        const std::map<std::string, std::string>& headers = message.headers();
-        auto cit_full_file_name = headers.find(FLAGS_full_file_name_http_header);
-        auto cit_content_type = headers.find(FLAGS_content_type_http_header);
-        if (cit_full_file_name != headers.end() && cit_content_type != headers.end()) {
-          std::cerr << "RECEIVED: " << cit_full_file_name->second << ' ' << cit_content_type->second
-                    << std::endl;
-        }
-        connection.SendHTTPResponse("RECEIVED\n", HTTPResponseCode::Accepted);
-        // TODO(dkorolev) + TODO(deathbaba): See whether newly uploaded file name can be extracted.
-        cv_.notify_all();
-      } else {
-        connection.SendHTTPResponse("ERROR\n", HTTPResponseCode::NotFound);
-      }
+  processor.WaitForFiles(1u);
+  bricks::WriteStringToFile(bricks::FileSystem::JoinPath(FLAGS_test_uploads_directory, "testfile"), "MammaMia");
+  processor.WaitForFiles(2u);
+  EXPECT_EQ(0u, receiver.NumberOfNotificationsReceived());
+  EXPECT_EQ("Before", processor.contents[0]);
+  EXPECT_EQ("MammaMia", processor.contents[1]);
+  EXPECT_EQ("", processor.content_types[1]);
+}
+
+TEST(FileReceiverTest, RetriesFailedFiles) {
+  RemoveAllFiles(FLAGS_test_uploads_directory);
+  MockProcessor processor;
+  processor.failures_to_inject = 2;
+  FileReceiverParameters parameters = Parameters(FLAGS_test_uploads_directory);
+  parameters.retry_delay_ms = 10;
+  FileReceiver<MockProcessor> receiver(processor, parameters);
+
+  bricks::WriteStringToFile(bricks::FileSystem::JoinPath(FLAGS_test_uploads_directory, "retried"), "Retried");
+  processor.WaitForFiles(1u);
+  EXPECT_EQ(0u, processor.failures_to_inject);
+  EXPECT_EQ("Retried", processor.contents[0]);
+}
+
+TEST(FileReceiverTest, ProcessesFilesConcurrently) {
+  struct ConcurrencyCheckingProcessor final {
+    fsq::FileProcessingResult OnFileReceived(const ReceivedFile&) {
+      std::unique_lock<std::mutex> lock(mutex);
+      ++in_flight;
+      condition.notify_all();
+      // All the four files are being processed at the same time.
+      condition.wait(lock, [this]() { return in_flight == 4u || processed; });
+      ++processed;
+      return fsq::FileProcessingResult::Success;
     }
+    std::mutex mutex;
+    std::condition_variable condition;
+    size_t in_flight = 0;
+    size_t processed = 0;
+  };
+  RemoveAllFiles(FLAGS_test_uploads_directory);
+  ConcurrencyCheckingProcessor processor;
+  FileReceiverParameters parameters = Parameters(FLAGS_test_uploads_directory);
+  parameters.processing_threads = 4;
+  FileReceiver<ConcurrencyCheckingProcessor> receiver(processor, parameters);
+
+  for (int i = 0; i < 4; ++i) {
+    bricks::WriteStringToFile(bricks::FileSystem::JoinPath(FLAGS_test_uploads_directory, std::to_string(i)),
+                              std::to_string(i));
   }
+  while (receiver.NumberOfFilesProcessed() != 4u) {
+    ;  // Spin lock.
+  }
+}
 
-  void ThreadDir() {
-    while (!terminate_) {
-      // Wait for the next file. Scan the directory periodically regardless.
-      {
-        std::unique_lock<std::mutex> lock(mutex_);
-        cv_.wait_for(lock, std::chrono::milliseconds(FLAGS_dir_poll_period_ms));
-      }
-      std::string filename;
-      bricks::FileSystem::ScanDirUntil(FLAGS_uploads_directory, [&filename](const std::string& fn) {
-        filename = fn;
-        return false;
-      });
-      if (!filename.empty()) {
-        std::cerr << "SCANNED: " << filename << std::endl;
-        filename = bricks::FileSystem::JoinPath(FLAGS_uploads_directory, filename);
-        std::cerr << "SCANNED FULL PATH: " << filename << std::endl;
-        std::cerr << "CONENTS: " << bricks::ReadFileAsString(filename) << std::endl;
-        ++number_of_files_scanned_;
-        bricks::RemoveFile(filename);
-      }
+TEST(FileReceiverTest, DropsDuplicates) {
+  RemoveAllFiles(FLAGS_test_uploads_directory);
+  const std::string index_file_name = ".recent_contents";
+  const bricks::ScopedRemoveFile remove_index_file(index_file_name);
+  FileReceiverParameters parameters = Parameters(FLAGS_test_uploads_directory);
+  parameters.drop_duplicates = true;
+  parameters.recent_contents_file_name = index_file_name;
+  {
+    MockProcessor processor;
+    FileReceiver<MockProcessor> receiver(processor, parameters);
+    bricks::WriteStringToFile(bricks::FileSystem::JoinPath(FLAGS_test_uploads_directory, "first"), "Payload");
+    processor.WaitForFiles(1u);
+    bricks::WriteStringToFile(bricks::FileSystem::JoinPath(FLAGS_test_uploads_directory, "retry"), "Payload");
+    while (receiver.NumberOfDuplicatesDropped() != 1u) {
+      ;  // Spin lock.
+    }
+    EXPECT_FALSE(bricks::FileSystem::FileExists(
+        bricks::FileSystem::JoinPath(FLAGS_test_uploads_directory, "retry")));
+    bricks::WriteStringToFile(bricks::FileSystem::JoinPath(FLAGS_test_uploads_directory, "other"), "Other");
+    processor.WaitForFiles(2u);
+    EXPECT_EQ("Other", processor.contents[1]);
+    EXPECT_EQ(ContentHash::Of("Other", 5), processor.content_hashes[1]);
+  }
+  {
+    // The recent contents are known after a restart.
+    MockProcessor processor;
+    FileReceiver<MockProcessor> receiver(processor, parameters);
+    bricks::WriteStringToFile(bricks::FileSystem::JoinPath(FLAGS_test_uploads_directory, "late"), "Payload");
+    while (receiver.NumberOfDuplicatesDropped() != 1u) {
+      ;  // Spin lock.
     }
+    EXPECT_EQ(0u, processor.names.size());
   }
+}
 
-  size_t number_of_files_scanned_ = 0;
-  size_t number_of_upload_requests_received_ = 0;
+TEST(FileReceiverTest, UploadsFilesDirectly) {
+  RemoveAllFiles(FLAGS_test_uploads_directory);
+  MockProcessor processor;
+  FileReceiverParameters parameters = Parameters(FLAGS_test_uploads_directory);
+  parameters.upload_port = FLAGS_local_upload_port;
+  parameters.upload_threads = 2;
+  FileReceiver<MockProcessor> receiver(processor, parameters);
 
-  std::mutex mutex_;
-  std::condition_variable cv_;
+  std::string body(1000 * 1000, ' ');
+  for (size_t i = 0; i < body.length(); ++i) {
+    body[i] = 'a' + i % 26;
+  }
+  Connection connection(ClientSocket("localhost", FLAGS_local_upload_port));
+  connection.BlockingWrite(bricks::strings::Printf(
+      "POST /upload HTTP/1.1\r\nContent-Type: application/some-magic-type\r\nContent-Length: %d\r\n\r\n",
+      static_cast<int>(body.length())));
+  connection.BlockingWrite(body);
+  connection.BlockingWrite("POST /foo HTTP/1.1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+  connection.SendEOF();
+  const std::string response = connection.BlockingReadUntilEOF();
+  EXPECT_EQ(0u, response.find("HTTP/1.1 202 "));
+  EXPECT_NE(std::string::npos, response.find("\r\n\r\nupload."));
+  EXPECT_NE(std::string::npos, response.find("HTTP/1.1 404 "));
 
-  std::thread web_thread_;
-  std::thread dir_thread_;
-  bool terminate_ = false;
-};
+  processor.WaitForFiles(1u);
+  EXPECT_EQ(1u, receiver.NumberOfFilesUploaded());
+  EXPECT_EQ(0u, receiver.NumberOfNotificationsReceived());
+  EXPECT_EQ(0u, processor.names[0].find("upload."));
+  EXPECT_EQ(body, processor.contents[0]);
+  EXPECT_EQ("application/some-magic-type", processor.content_types[0]);
+}
 
-TEST(FileReceiverTest, UploadFileViaNginx) {
-  FileReceiveServer scoped_server;
+TEST(FileReceiverTest, UploadsMultipartFilesDirectly) {
+  RemoveAllFiles(FLAGS_test_uploads_directory);
+  MockProcessor processor;
+  FileReceiverParameters parameters = Parameters(FLAGS_test_uploads_directory);
+  parameters.upload_port = FLAGS_local_upload_port;
+  FileReceiver<MockProcessor> receiver(processor, parameters);
 
-  EXPECT_EQ(0u, scoped_server.NumberOfUploadRequestsReceived());
-  const auto response = HTTP(POST(FLAGS_upload_url, "UploadedViaNginx\n", "application/some-magic-type"));
-  EXPECT_EQ(202, response.code);
-  EXPECT_EQ(1u, scoped_server.NumberOfUploadRequestsReceived());
-  while (scoped_server.NumberOfFilesScanned() != 1u) {
-    ;  // Spin lock;
+  std::string file(1000 * 1000, ' ');
+  for (size_t i = 0; i < file.length(); ++i) {
+    file[i] = 'a' + i % 26;
   }
+  const std::string body =
+      "--B\r\nContent-Disposition: form-data; name=\"comment\"\r\n\r\nNot a file.\r\n"
+      "--B\r\nContent-Disposition: form-data; name=\"file\"; filename=\"a.bin\"\r\n"
+      "Content-Type: application/some-magic-type\r\n\r\n" +
+      file + "\r\n--B--\r\n";
+  Connection connection(ClientSocket("localhost", FLAGS_local_upload_port));
+  connection.BlockingWrite(bricks::strings::Printf(
+      "POST /upload HTTP/1.1\r\nContent-Type: multipart/form-data; boundary=B\r\nContent-Length: %d\r\n"
+      "Connection: close\r\n\r\n",
+      static_cast<int>(body.length())));
+  connection.BlockingWrite(body);
+  const std::string response = connection.BlockingReadUntilEOF();
+  EXPECT_EQ(0u, response.find("HTTP/1.1 202 "));
+  EXPECT_NE(std::string::npos, response.find("\r\n\r\nupload."));
+
+  processor.WaitForFiles(1u);
+  EXPECT_EQ(1u, receiver.NumberOfFilesUploaded());
+  EXPECT_EQ(file, processor.contents[0]);
+  EXPECT_EQ("application/some-magic-type", processor.content_types[0]);
 }
 
-TEST(FileReceiverTest, DirectoryIsAlsoScannedIndependently) {
-  FileReceiveServer scoped_server;
+TEST(FileReceiverTest, ContentHash) {
+  const std::string data = "The quick brown fox jumps over the lazy dog.";
+  const uint64_t hash = ContentHash::Of(data.data(), data.length());
+  for (size_t chunk = 1; chunk <= data.length(); ++chunk) {
+    ContentHash streaming;
+    for (size_t i = 0; i < data.length(); i += chunk) {
+      streaming.Update(data.data() + i, std::min(chunk, data.length() - i));
+    }
+    EXPECT_EQ(hash, streaming.Hash()) << chunk;
+    EXPECT_EQ(data.length(), streaming.Size());
+  }
+  EXPECT_NE(hash, ContentHash::Of(data.data(), data.length() - 1));
+  EXPECT_NE(ContentHash::Of("", 0), ContentHash::Of("\0", 1));
+  EXPECT_NE(ContentHash::Of("ab", 2), ContentHash::Of("ba", 2));
+}
 
-  bricks::WriteStringToFile(bricks::FileSystem::JoinPath(FLAGS_uploads_directory, "testfile"), "MammaMia");
-  EXPECT_EQ(0u, scoped_server.NumberOfUploadRequestsReceived());
-  while (scoped_server.NumberOfFilesScanned() != 1u) {
-    ;  // Spin lock;
+TEST(FileReceiverTest, RecentContentHashes) {
+  const std::string file_name = ".recent_contents";
+  const bricks::ScopedRemoveFile remove_file(file_name);
+  {
+    RecentContentHashes recent(3, file_name);
+    for (uint64_t i = 1; i <= 10; ++i) {
+      recent.Insert(ContentKey{i, i * 100});
+    }
+    EXPECT_EQ(3u, recent.size());
+    EXPECT_FALSE(recent.Contains(ContentKey{7, 700}));
+    EXPECT_TRUE(recent.Contains(ContentKey{8, 800}));
+    EXPECT_FALSE(recent.Contains(ContentKey{8, 801}));
+    EXPECT_TRUE(recent.Contains(ContentKey{10, 1000}));
+    // Compacted once it has reached twice the capacity: 6 lines, then the 4 appended since.
+    EXPECT_EQ(42u * 4, bricks::FileSystem::GetFileSize(file_name));
+  }
+  {
+    RecentContentHashes recent(3, file_name);
+    EXPECT_EQ(3u, recent.size());
+    EXPECT_TRUE(recent.Contains(ContentKey{8, 800}));
+    EXPECT_TRUE(recent.Contains(ContentKey{10, 1000}));
+    EXPECT_FALSE(recent.Contains(ContentKey{7, 700}));
+    EXPECT_EQ(42u * 3, bricks::FileSystem::GetFileSize(file_name));
   }
 }
 
 TEST(FileReceiverTest, Healthz) {
-  FileReceiveServer scoped_server;
+  RemoveAllFiles(FLAGS_test_uploads_directory);
+  MockProcessor processor;
+  FileReceiver<MockProcessor> receiver(processor, Parameters(FLAGS_test_uploads_directory));
 
   const auto response = HTTP(GET(bricks::strings::Printf("http://localhost:%d/healthz", FLAGS_local_port)));
   EXPECT_EQ(200, response.code);
@@ -195,8 +383,9 @@ TEST(FileReceiverTest, Healthz) {
 }
 
 TEST(FileReceiverTest, FourOhFour) {
-  FileReceiveServer scoped_server;
-  static_cast<void>(scoped_server);
+  RemoveAllFiles(FLAGS_test_uploads_directory);
+  MockProcessor processor;
+  FileReceiver<MockProcessor> receiver(processor, Parameters(FLAGS_test_uploads_directory));
 
   const auto response = HTTP(GET(bricks::strings::Printf("http://localhost:%d/foo", FLAGS_local_port)));
   EXPECT_EQ(404, response.code);
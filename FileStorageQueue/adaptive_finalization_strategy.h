@@ -0,0 +1,166 @@
+// Adaptive file finalization strategy, to be used as `T_FINALIZE_STRATEGY`.
+//
+// `SimpleFinalizationStrategy` finalizes files at compile-time sizes and ages. When each file costs
+// the processor a fixed overhead, for example, an HTTP request to upload it, small files waste the throughput
+// at high rates, while large files hold the messages back for too long at trickle rates.
+//
+// This strategy learns the cost of processing a file from the files processed so far, as a linear model
+// of `processing time = per-file overhead + size * per-byte time`. The model is fitted by least squares,
+// weighted exponentially towards the recent files. With no backlog, the current file is finalized once:
+//
+//   1) It is large enough for the per-file overhead to be at most `max_overhead_share` of the processing time,
+//   2) It is large enough for the processor to keep up with the rate at which the messages are being appended,
+//   3) Or if it is old enough for the end-to-end delay, its age plus its predicted processing time,
+//      to reach `max_delay`.
+//
+// The target size is kept within `[min_file_size, max_file_size]`, and starts at `min_file_size` until
+// a few files have been processed. While there is a backlog, the files are coalesced up to `max_file_size`,
+// or `max_backlog_file_age`, same as the simple strategy does.
+//
+// FSQ reports each successfully processed file via `OnFileProcessed(file, started, completed)`,
+// with the timestamps of its time manager, under the same mutex under which it calls `ShouldFinalize()`.
+
+#ifndef FSQ_ADAPTIVE_FINALIZATION_STRATEGY_H
+#define FSQ_ADAPTIVE_FINALIZATION_STRATEGY_H
+
+#include <algorithm>
+#include <cstdint>
+
+#include "status.h"
+
+#include "../Bricks/time/chrono.h"
+
+namespace fsq {
+namespace strategy {
+
+template <typename TIMESTAMP = bricks::time::EPOCH_MILLISECONDS,
+          typename TIME_SPAN = bricks::time::MILLISECONDS_INTERVAL>
+class AdaptiveFinalizationStrategy {
+ public:
+  typedef TIMESTAMP T_TIMESTAMP;
+  typedef TIME_SPAN T_TIME_SPAN;
+
+  bool ShouldFinalize(const QueueStatus<T_TIMESTAMP>& status, const T_TIMESTAMP now) const {
+    const uint64_t age_ms = static_cast<uint64_t>(now - status.appended_file_timestamp);
+    if (status.appended_file_size >= max_file_size_ || age_ms > max_backlog_file_age_ms_) {
+      return true;
+    } else if (!status.finalized.queue.empty()) {
+      // The queued files hold the messages back anyway, so make the most of each processed file.
+      return false;
+    } else {
+      const double rate = age_ms ? static_cast<double>(status.appended_file_size) / age_ms : 0.0;
+      const double delay_ms = age_ms + PredictedProcessingMs(status.appended_file_size);
+      return status.appended_file_size >= TargetFileSize(rate) || delay_ms > static_cast<double>(max_delay_ms_);
+    }
+  }
+
+  // Invoked by FSQ once the file has been processed successfully.
+  template <typename T_FILE_INFO>
+  void OnFileProcessed(const T_FILE_INFO& file, const T_TIMESTAMP started, const T_TIMESTAMP completed) {
+    const double x = static_cast<double>(file.size);
+    const double y = std::max(static_cast<double>(static_cast<int64_t>(completed - started)), 0.0);
+    const double decay = 1.0 - smoothing_;
+    sum_w_ = sum_w_ * decay + 1.0;
+    sum_x_ = sum_x_ * decay + x;
+    sum_y_ = sum_y_ * decay + y;
+    sum_xx_ = sum_xx_ * decay + x * x;
+    sum_xy_ = sum_xy_ * decay + x * y;
+    ++files_processed_;
+    FitModel();
+  }
+
+  // The size at which the current file is finalized when there is no backlog, not taking into account
+  // the rate at which the messages are appended.
+  uint64_t TargetFileSize() const {
+    return TargetFileSize(0.0);
+  }
+  // The estimates of the processing time of a file, in milliseconds, as `overhead + size * per-byte time`.
+  double EstimatedPerFileOverheadMs() const {
+    return overhead_ms_;
+  }
+  double EstimatedPerByteMs() const {
+    return per_byte_ms_;
+  }
+
+  void SetFinalizedFileSizeBounds(uint64_t min_file_size, uint64_t max_file_size) {
+    min_file_size_ = min_file_size;
+    max_file_size_ = std::max(min_file_size, max_file_size);
+  }
+  void SetMaxFinalizationDelay(T_TIME_SPAN max_delay) {
+    max_delay_ms_ = static_cast<uint64_t>(max_delay);
+  }
+  void SetMaxBacklogFileAge(T_TIME_SPAN max_backlog_file_age) {
+    max_backlog_file_age_ms_ = static_cast<uint64_t>(max_backlog_file_age);
+  }
+  void SetMaxProcessingOverheadShare(double max_overhead_share) {
+    max_overhead_share_ = std::min(std::max(max_overhead_share, 1e-6), 1.0);
+  }
+  // The weight of the most recently processed file in the model, from zero to one.
+  void SetProcessingCostSmoothing(double smoothing) {
+    smoothing_ = std::min(std::max(smoothing, 1e-6), 1.0);
+  }
+
+ private:
+  enum { kMinFilesProcessedToAdapt = 3 };
+
+  double PredictedProcessingMs(uint64_t size) const {
+    return overhead_ms_ + per_byte_ms_ * static_cast<double>(size);
+  }
+
+  // The target size given the rate, in bytes per millisecond, at which the messages are being appended.
+  // Makes it `max_file_size` when no finite size satisfies the respective condition.
+  uint64_t TargetFileSize(double rate) const {
+    if (files_processed_ < kMinFilesProcessedToAdapt || overhead_ms_ <= 0) {
+      return min_file_size_;
+    }
+    const double max_size = static_cast<double>(max_file_size_);
+    // 1) overhead <= max_overhead_share * (overhead + size * per_byte).
+    const double share = max_overhead_share_;
+    double size = per_byte_ms_ > 0 ? overhead_ms_ * (1.0 - share) / (share * per_byte_ms_) : max_size;
+    // 2) overhead + size * per_byte <= size / rate.
+    if (rate > 0) {
+      const double keep_up_size =
+          rate * per_byte_ms_ < 1.0 ? overhead_ms_ * rate / (1.0 - rate * per_byte_ms_) : max_size;
+      size = std::max(size, keep_up_size);
+    }
+    return static_cast<uint64_t>(std::min(std::max(size, static_cast<double>(min_file_size_)), max_size));
+  }
+
+  // Weighted least squares fit of the processing time. While the sizes of the processed files are too close
+  // to tell the overhead from the per-byte time, all of the processing time is attributed to the overhead.
+  void FitModel() {
+    const double variance = sum_w_ * sum_xx_ - sum_x_ * sum_x_;
+    if (variance > 1e-9 * sum_w_ * sum_xx_) {
+      const double slope = (sum_w_ * sum_xy_ - sum_x_ * sum_y_) / variance;
+      per_byte_ms_ = std::max(slope, 0.0);
+      overhead_ms_ = std::max((sum_y_ - per_byte_ms_ * sum_x_) / sum_w_, 0.0);
+    } else if (per_byte_ms_ == 0) {
+      overhead_ms_ = sum_y_ / sum_w_;
+    }
+  }
+
+  uint64_t min_file_size_ = 10 * 1024;
+  uint64_t max_file_size_ = 10 * 1024 * 1024;
+  uint64_t max_delay_ms_ = 10 * 60 * 1000;
+  uint64_t max_backlog_file_age_ms_ = 24 * 60 * 60 * 1000;
+  double max_overhead_share_ = 0.1;
+  double smoothing_ = 0.1;
+
+  // The exponentially weighted sums of the sizes `x` and processing times `y` of the processed files.
+  double sum_w_ = 0;
+  double sum_x_ = 0;
+  double sum_y_ = 0;
+  double sum_xx_ = 0;
+  double sum_xy_ = 0;
+  uint64_t files_processed_ = 0;
+
+  double overhead_ms_ = 0;
+  double per_byte_ms_ = 0;
+};
+
+typedef AdaptiveFinalizationStrategy<> AdaptiveFinalization;
+
+}  // namespace strategy
+}  // namespace fsq
+
+#endif  // FSQ_ADAPTIVE_FINALIZATION_STRATEGY_H
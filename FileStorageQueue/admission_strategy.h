@@ -0,0 +1,180 @@
+// Message admission strategies: which of the messages pushed are appended, once the queue falls behind.
+//
+// FSQ consults `T_ADMISSION_STRATEGY::AdmitMessage(message, counters, now, markers)`, if the strategy
+// defines it, for each message pushed, under its append mutex, with the lock-free counters of the queue,
+// see `FSQ::GetQueueCounters()`, and the timestamp of the push. The messages it returns false for
+// are not appended. The messages the strategy adds to `markers` are appended before the message, whether
+// it is admitted or not, as regular messages, for the downstream to learn what has been left out.
+// The default `AdmitAllMessages` defines no `AdmitMessage()`, and costs nothing.
+//
+// `SampleUnderBacklog` keeps every message while the queue keeps up. Once both the backlog of the finalized
+// files reaches `SetBacklogThreshold()` and the throughput reaches `SetThroughputThreshold()`, it samples
+// the messages of each category, as named by `SetMessageCategory()`, to the rate and the cap of that category:
+//
+//   struct SampledConfig : fsq::Config<Processor> {
+//     typedef fsq::strategy::SampleUnderBacklog T_ADMISSION_STRATEGY;
+//   };
+//   fsq::FSQ<SampledConfig> fsq(processor, "/var/log/events");
+//   fsq.SetMessageCategory([](const std::string& message) { return message.substr(0, message.find(' ')); });
+//   fsq.SetBacklogThreshold(50 * 1024 * 1024);
+//   fsq.SetThroughputThreshold(10000);
+//   fsq.SetCategorySampling("debug", 0.01, 0);   // One in a hundred.
+//   fsq.SetCategorySampling("click", 0.5, 1000);  // Every other one, up to 1000 per window.
+//
+// The time is split into windows of `SetWindowMs()`, one second by default. The throughput is the number
+// of messages pushed within the current window so far, or within the previous one, whichever is higher.
+// Within the current window, a category with the rate `r` has every `1/r`-th of its messages appended,
+// evenly spread, rather than a random subset, and no more of them than its cap, unless the cap is zero.
+// Once a window in which some of the messages of a category were left out is over, the marker
+// `"#SAMPLED <admitted>/<pushed> <category>"`, see `SetSamplingMarker()`, goes before the next message,
+// for the downstream to reweight the messages of that window. The markers of the last window are only
+// appended once the next message is pushed.
+
+#ifndef FSQ_ADMISSION_STRATEGY_H
+#define FSQ_ADMISSION_STRATEGY_H
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace fsq {
+namespace strategy {
+
+// Admission strategy sampling the messages once the queue falls behind, see the top of this file.
+// The setters should be called before the messages are pushed.
+class SampleUnderBacklog {
+ public:
+  typedef std::function<std::string(const std::string& message)> T_MESSAGE_CATEGORY;
+  typedef std::function<std::string(const std::string& category, size_t admitted, size_t pushed)>
+      T_SAMPLING_MARKER;
+
+  // Returns whether to append the message, adding the markers of the window just over, if any, to `markers`.
+  template <typename T_COUNTERS, typename T_TIMESTAMP>
+  bool AdmitMessage(const std::string& message,
+                    const T_COUNTERS& counters,
+                    T_TIMESTAMP now,
+                    std::vector<std::string>& markers) {
+    const uint64_t now_ms = static_cast<uint64_t>(now);
+    if (now_ms >= window_begin_ms_ + window_ms_ || now_ms < window_begin_ms_) {
+      CloseWindow(now_ms, markers);
+    }
+    ++window_pushed_;
+    Category& category = CategoryOf(message_category_ ? message_category_(message) : std::string());
+    ++category.pushed;
+    if (!(counters.finalized_total_size >= backlog_threshold_ &&
+          std::max(window_pushed_, previous_window_pushed_) >= throughput_threshold_)) {
+      ++category.admitted;
+      return true;
+    }
+    const Sampling& sampling = category.sampling ? *category.sampling : default_sampling_;
+    category.credit += sampling.rate;
+    if (category.credit < 1.0 || (sampling.cap && category.admitted >= sampling.cap)) {
+      return false;
+    }
+    category.credit -= 1.0;
+    ++category.admitted;
+    return true;
+  }
+
+  // The category of a message, to be sampled on its own. All the messages are of the category "" by default.
+  void SetMessageCategory(T_MESSAGE_CATEGORY message_category) {
+    message_category_ = message_category;
+  }
+  // The finalized bytes queued, and the messages pushed per window, from which on the messages are sampled.
+  void SetBacklogThreshold(uint64_t finalized_total_size) {
+    backlog_threshold_ = finalized_total_size;
+  }
+  void SetThroughputThreshold(size_t messages_per_window) {
+    throughput_threshold_ = messages_per_window;
+  }
+  void SetWindowMs(uint64_t window_ms) {
+    window_ms_ = std::max(window_ms, static_cast<uint64_t>(1));
+  }
+  // The share of the messages of the category to keep, from zero to one, and the most of them to keep
+  // per window, zero for no cap, once sampling. The categories not set are sampled as `SetDefaultSampling()`
+  // says, which, unless called, keeps them all.
+  void SetCategorySampling(const std::string& category, double rate, size_t cap) {
+    Sampling& sampling = category_sampling_[category];
+    sampling.rate = rate;
+    sampling.cap = cap;
+    auto it = categories_.find(category);
+    if (it != categories_.end()) {
+      it->second.sampling = &sampling;
+    }
+  }
+  void SetDefaultSampling(double rate, size_t cap) {
+    default_sampling_.rate = rate;
+    default_sampling_.cap = cap;
+  }
+  void SetSamplingMarker(T_SAMPLING_MARKER sampling_marker) {
+    sampling_marker_ = sampling_marker;
+  }
+
+ private:
+  struct Sampling {
+    double rate = 1.0;
+    size_t cap = 0;
+  };
+  // The counts of the category within the current window, and the share of the next message it has earned.
+  struct Category {
+    const Sampling* sampling = nullptr;
+    size_t pushed = 0;
+    size_t admitted = 0;
+    double credit = 0.0;
+  };
+
+  void CloseWindow(uint64_t now_ms, std::vector<std::string>& markers) {
+    for (auto& it : categories_) {
+      Category& category = it.second;
+      if (category.admitted < category.pushed) {
+        markers.push_back(sampling_marker_ ? sampling_marker_(it.first, category.admitted, category.pushed)
+                                           : DefaultMarker(it.first, category.admitted, category.pushed));
+      }
+      category.pushed = 0;
+      category.admitted = 0;
+      category.credit = 0.0;
+    }
+    previous_window_pushed_ = (now_ms < window_begin_ms_ + 2 * window_ms_) ? window_pushed_ : 0;
+    window_pushed_ = 0;
+    window_begin_ms_ = now_ms;
+  }
+
+  // Adds the sampling of the category, if set, to a category seen for the first time.
+  Category& CategoryOf(const std::string& name) {
+    auto it = categories_.find(name);
+    if (it == categories_.end()) {
+      it = categories_.emplace(name, Category()).first;
+      const auto sampling = category_sampling_.find(name);
+      if (sampling != category_sampling_.end()) {
+        it->second.sampling = &sampling->second;
+      }
+    }
+    return it->second;
+  }
+
+  static std::string DefaultMarker(const std::string& category, size_t admitted, size_t pushed) {
+    return "#SAMPLED " + std::to_string(admitted) + '/' + std::to_string(pushed) +
+           (category.empty() ? "" : ' ' + category);
+  }
+
+  T_MESSAGE_CATEGORY message_category_;
+  T_SAMPLING_MARKER sampling_marker_;
+  uint64_t backlog_threshold_ = 0;
+  size_t throughput_threshold_ = 0;
+  uint64_t window_ms_ = 1000;
+  Sampling default_sampling_;
+  // Keyed by the name of the category, with the pointers to the elements of `category_sampling_` in
+  // `categories_`, which outlive them, as neither map ever erases anything.
+  std::map<std::string, Sampling> category_sampling_;
+  std::map<std::string, Category> categories_;
+  uint64_t window_begin_ms_ = 0;
+  size_t window_pushed_ = 0;
+  size_t previous_window_pushed_ = 0;
+};
+
+}  // namespace strategy
+}  // namespace fsq
+
+#endif  // FSQ_ADMISSION_STRATEGY_H
@@ -0,0 +1,67 @@
+// The benchmarks of appending messages to FSQ, run with `make bench`.
+//
+// The messages are 100 bytes each, pushed from one thread, with the default finalization and purge strategies,
+// and a processor that does nothing with the files. On `bricks::InMemoryFileSystem`, to measure the overhead
+// of FSQ itself, and on disk, in the `build/` directory. See `benchmark.cc` for the latency percentiles
+// and the throughput with several producers.
+
+#include <string>
+#include <vector>
+
+#include "fsq.h"
+
+#include "../Bricks/benchmark/benchmark.h"
+#include "../Bricks/file/file.h"
+#include "../Bricks/file/in_memory_file_system.h"
+
+namespace {
+
+struct NullProcessor {
+  template <typename T_TIMESTAMP>
+  fsq::FileProcessingResult OnFileReady(const fsq::FileInfo<T_TIMESTAMP>&, T_TIMESTAMP) {
+    return fsq::FileProcessingResult::Success;
+  }
+};
+
+struct InMemoryConfig : fsq::Config<NullProcessor> {
+  typedef bricks::InMemoryFileSystem T_FILE_SYSTEM;
+};
+
+const char* const kDiskDir = "build/bench_dir";
+
+}  // namespace
+
+BRICKS_BENCHMARK(PushMessageInMemory) {
+  NullProcessor processor;
+  bricks::InMemoryFileSystem::RemoveAllFiles();
+  fsq::FSQ<InMemoryConfig> queue(processor, kDiskDir);
+  const std::string message(100, '.');
+  while (state.KeepRunning()) {
+    queue.PushMessage(message);
+  }
+  queue.ShutdownAndRemoveAllFSQFiles();
+}
+
+BRICKS_BENCHMARK(PushMessagesOf100InMemory) {
+  NullProcessor processor;
+  bricks::InMemoryFileSystem::RemoveAllFiles();
+  fsq::FSQ<InMemoryConfig> queue(processor, kDiskDir);
+  const std::vector<std::string> messages(100, std::string(100, '.'));
+  while (state.KeepRunning()) {
+    queue.PushMessages(messages.begin(), messages.end());
+  }
+  queue.ShutdownAndRemoveAllFSQFiles();
+}
+
+BRICKS_BENCHMARK(PushMessageOnDisk) {
+  NullProcessor processor;
+  bricks::FileSystem::CreateDirectory(kDiskDir);
+  fsq::FSQ<fsq::Config<NullProcessor>> queue(processor, kDiskDir);
+  const std::string message(100, '.');
+  while (state.KeepRunning()) {
+    queue.PushMessage(message);
+  }
+  queue.ShutdownAndRemoveAllFSQFiles();
+}
+
+BRICKS_BENCHMARK_MAIN();
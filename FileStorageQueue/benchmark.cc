@@ -0,0 +1,345 @@
+// A benchmark for FSQ.
+//
+// Measures:
+//
+//   1) Startup scan time.
+//      The time it takes FSQ to scan the working directory with --existing_files finalized files in it,
+//      from the constructor to the queue status being ready.
+//
+//   2) Push latency percentiles.
+//      The time for which the thread pushing messages is blocked in `PushMessage()`, which includes
+//      the finalization of the current file and the purge of the old ones when they happen.
+//
+//   3) Throughput.
+//      The MB/s appended by the producers, and the MB/s read back by the (fake) processor.
+//
+// Messages are pushed:
+//
+//   1) Using --push_threads threads,
+//   2) At --push_mbps_per_thread rate each, or as fast as possible if it is zero,
+//   3) With messages of --average_message_length bytes on average,
+//      exponentially distributed with the minimum of --min_message_length.
+//
+// Files are finalized once they reach --finalize_kb or --finalize_ms, and purged beyond --purge_mb or
+// --purge_files. The processor reads each finalized file and emulates processing at --process_mbps,
+// zero for no delay.
+//
+// The working directory is --dir, to compare file systems, e.g., --dir=/dev/shm/fsq for tmpfs.
+// The directory is created if needed, and emptied of FSQ files before and after the run.
+// With --file_system=memory, FSQ runs on `bricks::InMemoryFileSystem` instead, to measure its own CPU overhead.
+//
+// The test runs for --seconds seconds.
+
+/*
+
+# Push latency and throughput on disk vs. tmpfs.
+mkdir -p /dev/shm/fsq
+for d in build /dev/shm/fsq ; do \
+  ./build/benchmark --dir=$d --push_threads=4 --average_message_length=1000 ; \
+done
+
+# The finalization stall: observe the push latency tail grow with the file size.
+for kb in 100 1000 10000 ; do \
+  ./build/benchmark --finalize_kb=$kb --push_threads=1 ; \
+done
+
+# The overhead of FSQ itself, with no disk involved.
+./build/benchmark --file_system=memory --push_threads=1
+
+# Slow processor, observe the purge kick in.
+./build/benchmark --process_mbps=1 --purge_mb=10
+
+# Startup scan time.
+for n in 1000 10000 100000 ; do \
+  ./build/benchmark --existing_files=$n --seconds=0 ; \
+done
+
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fsq.h"
+
+#include "../Bricks/dflags/dflags.h"
+#include "../Bricks/file/file.h"
+#include "../Bricks/file/in_memory_file_system.h"
+#include "../Bricks/strings/printf.h"
+#include "../Bricks/time/tsc.h"
+
+DEFINE_string(dir, "build/benchmark_dir", "The working directory of FSQ.");
+DEFINE_string(file_system, "disk", "The file system to run FSQ on, 'disk' or 'memory'.");
+
+DEFINE_int32(push_threads, 4, "The number of threads that push in messages.");
+DEFINE_double(push_mbps_per_thread,
+              0.0,
+              "The rate, in MBPS, at which each thread pushes in the messages, zero for as fast as possible.");
+DEFINE_int32(min_message_length, 16, "The minimum size of message to push.");
+DEFINE_int32(average_message_length,
+             256,
+             "The average size of the message, assuming --min_message_length and exponential distribution.");
+
+DEFINE_uint64(finalize_kb, 1024, "Finalize the current file once it reaches this size, in KB.");
+DEFINE_uint64(finalize_ms, 1000, "Finalize the current file once it gets this old, in milliseconds.");
+DEFINE_uint64(purge_mb, 1024, "Purge the oldest files once the queue exceeds this size, in MB.");
+DEFINE_uint64(purge_files, 10000, "Purge the oldest files once the queue exceeds this number of files.");
+
+DEFINE_double(process_mbps, 0.0, "The rate, in MBPS, at which the files are processed, zero for no delay.");
+
+DEFINE_int32(existing_files, 0, "The number of finalized files to create before measuring the startup scan.");
+DEFINE_int32(existing_file_size, 1024, "The size of each of the --existing_files files, in bytes.");
+
+DEFINE_double(seconds, 3.0, "The time to run the benchmark for, in seconds.");
+
+double time_ns() {
+  return static_cast<double>(bricks::time::HighResolutionNowNanoseconds());
+}
+
+// The value below which the `percentile` (0 to 100) of the sorted values lie.
+double Percentile(const std::vector<double>& sorted, double percentile) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  const size_t index = static_cast<size_t>(percentile * 1e-2 * static_cast<double>(sorted.size() - 1) + 0.5);
+  return sorted[std::min(index, sorted.size() - 1)];
+}
+
+// Finalizes and purges files based on the flags, as opposed to the compile-time thresholds of the default ones.
+struct FlagsFinalizationStrategy {
+  bool ShouldFinalize(const fsq::QueueStatus<bricks::time::EPOCH_MILLISECONDS>& status,
+                      const bricks::time::EPOCH_MILLISECONDS now) const {
+    return status.appended_file_size >= FLAGS_finalize_kb * 1024 ||
+           static_cast<uint64_t>(now - status.appended_file_timestamp) > FLAGS_finalize_ms;
+  }
+};
+
+struct FlagsPurgeStrategy {
+  template <typename T_TIMESTAMP>
+  bool ShouldPurge(const fsq::QueueStatus<T_TIMESTAMP>& status) const {
+    return status.finalized.total_size + status.appended_file_size > FLAGS_purge_mb * 1024 * 1024 ||
+           status.finalized.queue.size() > FLAGS_purge_files;
+  }
+};
+
+// The processor reads the file back, and emulates processing it at the rate averaging --process_mbps.
+// Files are not processed while `suspended`, to measure the startup scan of the existing files alone.
+template <typename T_FILE_SYSTEM>
+struct Processor {
+  std::atomic_bool suspended;
+  std::atomic<uint64_t> files_processed;
+  std::atomic<uint64_t> bytes_processed;
+  std::mt19937 rng;
+  std::exponential_distribution<> process_mbps_distribution;
+
+  Processor()
+      : suspended(false),
+        files_processed(0),
+        bytes_processed(0),
+        process_mbps_distribution(1.0 / std::max(FLAGS_process_mbps, 1e-9)) {
+  }
+
+  fsq::FileProcessingResult OnFileReady(const fsq::FileInfo<bricks::time::EPOCH_MILLISECONDS>& file,
+                                        bricks::time::EPOCH_MILLISECONDS) {
+    if (suspended) {
+      return fsq::FileProcessingResult::Unavailable;
+    }
+    const std::string contents = T_FILE_SYSTEM::ReadFileAsString(file.full_path_name);
+    if (FLAGS_process_mbps > 0) {
+      const double processing_time_in_s = 1e-6 * contents.length() / process_mbps_distribution(rng);
+      std::this_thread::sleep_for(std::chrono::microseconds(static_cast<uint64_t>(1e6 * processing_time_in_s)));
+    }
+    ++files_processed;
+    bytes_processed += contents.length();
+    return fsq::FileProcessingResult::Success;
+  }
+};
+
+template <typename FILE_SYSTEM>
+struct BenchmarkConfig : fsq::Config<Processor<FILE_SYSTEM>> {
+  typedef FlagsFinalizationStrategy T_FINALIZE_STRATEGY;
+  typedef FlagsPurgeStrategy T_PURGE_STRATEGY;
+  typedef FILE_SYSTEM T_FILE_SYSTEM;
+};
+
+// The producer pushes the messages at the rate averaging --push_mbps_per_thread, recording the push times.
+template <typename T_FSQ>
+struct Producer {
+  T_FSQ& fsq;
+  std::mt19937 rng;
+  std::exponential_distribution<> d_message_length;
+  std::exponential_distribution<> d_rate_in_mbps;
+  std::vector<double> push_ns;
+  uint64_t bytes_pushed = 0;
+
+  Producer(T_FSQ& fsq, int thread_index)
+      : fsq(fsq),
+        rng(thread_index),
+        d_message_length(1.0 / (FLAGS_average_message_length - FLAGS_min_message_length)),
+        d_rate_in_mbps(1.0 / std::max(FLAGS_push_mbps_per_thread, 1e-9)) {
+  }
+
+  void Run(const std::atomic_bool& done) {
+    double next_cutoff_ns = time_ns();
+    std::string message;
+    while (!done) {
+      const size_t length = static_cast<size_t>(d_message_length(rng) + FLAGS_min_message_length + 0.5);
+      if (FLAGS_push_mbps_per_thread > 0) {
+        while (time_ns() < next_cutoff_ns) {
+          if (done) {
+            return;
+          }
+          std::this_thread::yield();
+        }
+        next_cutoff_ns += 1e3 * length / d_rate_in_mbps(rng);
+      }
+      message.assign(length - 1, 'x');
+      message += '\n';
+      const double ns_before = time_ns();
+      fsq.PushMessage(message);
+      push_ns.push_back(time_ns() - ns_before);
+      bytes_pushed += length;
+    }
+  }
+};
+
+template <typename T_FILE_SYSTEM>
+void RemoveAllFSQFiles(Processor<T_FILE_SYSTEM>& processor) {
+  processor.suspended = true;
+  fsq::FSQ<BenchmarkConfig<T_FILE_SYSTEM>>(processor, FLAGS_dir).ShutdownAndRemoveAllFSQFiles();
+  processor.suspended = false;
+}
+
+template <typename T_FILE_SYSTEM>
+void BenchmarkStartupScan(Processor<T_FILE_SYSTEM>& processor) {
+  processor.suspended = true;
+  for (int i = 0; i < FLAGS_existing_files; ++i) {
+    const std::string file_name = bricks::strings::Printf("finalized-%020d.bin", i + 1);
+    T_FILE_SYSTEM::WriteStringToFile(T_FILE_SYSTEM::JoinPath(FLAGS_dir, file_name),
+                                     std::string(FLAGS_existing_file_size, 'x'));
+  }
+  const double begin_ns = time_ns();
+  fsq::FSQ<BenchmarkConfig<T_FILE_SYSTEM>> fsq(processor, FLAGS_dir);
+  const size_t files = fsq.GetQueueStatus().finalized.queue.size();
+  const double end_ns = time_ns();
+  printf("Startup scan:       %15.3lfms (%d files present, %d queued)\n",
+         1e-6 * (end_ns - begin_ns),
+         FLAGS_existing_files,
+         static_cast<int>(files));
+  fsq.ShutdownAndRemoveAllFSQFiles();
+  processor.suspended = false;
+}
+
+template <typename T_FILE_SYSTEM>
+void Run() {
+  typedef fsq::FSQ<BenchmarkConfig<T_FILE_SYSTEM>> BenchmarkFSQ;
+  T_FILE_SYSTEM::CreateDirectory(FLAGS_dir);
+  Processor<T_FILE_SYSTEM> processor;
+  RemoveAllFSQFiles(processor);
+
+  if (FLAGS_existing_files) {
+    BenchmarkStartupScan(processor);
+  }
+
+  if (FLAGS_seconds <= 0) {
+    return;
+  }
+
+  std::vector<std::unique_ptr<Producer<BenchmarkFSQ>>> producers;
+  {
+    BenchmarkFSQ fsq(processor, FLAGS_dir);
+    fsq.GetQueueStatus();  // Wait for the startup scan to complete.
+
+    std::atomic_bool done(false);
+    for (int i = 0; i < FLAGS_push_threads; ++i) {
+      producers.emplace_back(new Producer<BenchmarkFSQ>(fsq, i + 1));
+    }
+    std::vector<std::thread> threads;
+    const uint64_t files_processed_before = processor.files_processed;
+    const uint64_t bytes_processed_before = processor.bytes_processed;
+    for (auto& producer : producers) {
+      threads.emplace_back(&Producer<BenchmarkFSQ>::Run, producer.get(), std::cref(done));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<uint64_t>(1e3 * FLAGS_seconds)));
+    done = true;
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    const uint64_t files_processed = processor.files_processed - files_processed_before;
+    const uint64_t bytes_processed = processor.bytes_processed - bytes_processed_before;
+
+    std::vector<double> push_ns;
+    uint64_t bytes_pushed = 0;
+    for (const auto& producer : producers) {
+      push_ns.insert(push_ns.end(), producer->push_ns.begin(), producer->push_ns.end());
+      bytes_pushed += producer->bytes_pushed;
+    }
+    std::sort(push_ns.begin(), push_ns.end());
+
+    const fsq::QueueStatus<bricks::time::EPOCH_MILLISECONDS> status = fsq.GetQueueStatus();
+    printf("Messages pushed:    %15d (%.3lf MB, %.3lf MB/s)\n",
+           static_cast<int>(push_ns.size()),
+           1e-6 * bytes_pushed,
+           1e-6 * bytes_pushed / FLAGS_seconds);
+    printf("Files processed:    %15d (%.3lf MB, %.3lf MB/s)\n",
+           static_cast<int>(files_processed),
+           1e-6 * bytes_processed,
+           1e-6 * bytes_processed / FLAGS_seconds);
+    printf("Files still queued: %15d (%.3lf MB)\n",
+           static_cast<int>(status.finalized.queue.size()),
+           1e-6 * status.finalized.total_size);
+    printf("Push latency, us:         p50          p90          p99        p99.9          max\n");
+    printf("               %12.3lf %12.3lf %12.3lf %12.3lf %12.3lf\n",
+           1e-3 * Percentile(push_ns, 50),
+           1e-3 * Percentile(push_ns, 90),
+           1e-3 * Percentile(push_ns, 99),
+           1e-3 * Percentile(push_ns, 99.9),
+           1e-3 * (push_ns.empty() ? 0.0 : push_ns.back()));
+
+    processor.suspended = true;
+    fsq.ShutdownAndRemoveAllFSQFiles();
+  }
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+
+  const std::string push_rate =
+      FLAGS_push_mbps_per_thread > 0 ? bricks::strings::Printf("%.2lf MBPS each", FLAGS_push_mbps_per_thread)
+                                     : "full speed";
+  const std::string process_rate =
+      FLAGS_process_mbps > 0 ? bricks::strings::Printf("%.2lf MBPS", FLAGS_process_mbps) : "full speed";
+  printf(
+      "Benchmarking on %.2lf seconds in '%s', on %s:\n"
+      "  %d threads pushing messages at %s\n"
+      "  messages of average size %d bytes, with the minimum of %d bytes\n"
+      "  files finalized at %d KB or %d ms, purged beyond %d MB or %d files\n"
+      "  files processed at %s\n",
+      FLAGS_seconds,
+      FLAGS_dir.c_str(),
+      FLAGS_file_system.c_str(),
+      FLAGS_push_threads,
+      push_rate.c_str(),
+      FLAGS_average_message_length,
+      FLAGS_min_message_length,
+      static_cast<int>(FLAGS_finalize_kb),
+      static_cast<int>(FLAGS_finalize_ms),
+      static_cast<int>(FLAGS_purge_mb),
+      static_cast<int>(FLAGS_purge_files),
+      process_rate.c_str());
+
+  if (FLAGS_file_system == "disk") {
+    Run<bricks::FileSystem>();
+  } else if (FLAGS_file_system == "memory") {
+    Run<bricks::InMemoryFileSystem>();
+  } else {
+    fprintf(stderr, "--file_system should be 'disk' or 'memory'.\n");
+    return 1;
+  }
+}
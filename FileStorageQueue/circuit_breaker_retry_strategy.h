@@ -0,0 +1,239 @@
+// A circuit breaker shared by all the FSQ-s of the process sending to the same destination,
+// to be used as `T_RETRY_STRATEGY` in place of the per-queue `ExponentialDelayRetryStrategy`.
+//
+// The breaker is closed while the destination works. After `failures_to_open` failures in a row,
+// reported by any of the queues, it opens, and none of them processes files for `open_ms`. Then it is
+// half-open: the first queue to ask becomes the only one to probe the destination, with one file,
+// while the others keep waiting. A success closes the breaker, and all the queues attached to it are resumed
+// with `ResumeProcessing()`, instead of each of them waking up on its own retry delay; a failure opens
+// it again. A probe that does not report back within `probe_timeout_ms`, for example, because the queue
+// that took it has nothing to process, is handed over to the next queue to ask.
+//
+// The destination may also ask to be left alone for a while, such as with `Retry-After` while it sheds
+// the load, see `HTTPUploader::HoldOffOn()`: `HoldOff()` has all the queues wait at least for as long,
+// whatever the state of the breaker.
+//
+// The breakers are kept by destination, with `CircuitBreaker::ForDestination()`, for the lifetime
+// of the process. The resumption is broadcast by FSQ with no locks of its own held.
+
+#ifndef FSQ_CIRCUIT_BREAKER_RETRY_STRATEGY_H
+#define FSQ_CIRCUIT_BREAKER_RETRY_STRATEGY_H
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../Bricks/time/chrono.h"
+
+namespace fsq {
+namespace strategy {
+
+class CircuitBreaker final {
+ public:
+  enum class State { Closed, Open, HalfOpen };
+
+  struct Params {
+    size_t failures_to_open = 3;
+    uint64_t open_ms = 30 * 1000;
+    uint64_t probe_timeout_ms = 60 * 1000;
+    Params() = default;
+    Params(size_t failures_to_open, uint64_t open_ms, uint64_t probe_timeout_ms)
+        : failures_to_open(failures_to_open), open_ms(open_ms), probe_timeout_ms(probe_timeout_ms) {
+    }
+  };
+
+  // The subscription of one queue to the resumption, called with no locks of the breaker held.
+  // Cleared under its own mutex, for the queue to not be called once unsubscribed.
+  struct Subscriber {
+    std::mutex mutex;
+    std::function<void()> resume;
+  };
+
+  // The breaker of the destination, created with the default parameters on first use. THREAD SAFE.
+  static CircuitBreaker& ForDestination(const std::string& destination) {
+    static std::mutex mutex;
+    static std::map<std::string, std::unique_ptr<CircuitBreaker>> breakers;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<CircuitBreaker>& breaker = breakers[destination];
+    if (!breaker) {
+      breaker.reset(new CircuitBreaker());
+    }
+    return *breaker;
+  }
+
+  void SetParams(const Params& params) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    params_ = params;
+  }
+
+  State GetState() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return state_;
+  }
+
+  // Returns false for the breaker closed, and for the queue that becomes the one to probe the destination.
+  bool ShouldWait(bricks::time::MILLISECONDS_INTERVAL* output_wait_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const bricks::time::EPOCH_MILLISECONDS now = bricks::time::Now();
+    if (now < hold_off_until_) {
+      *output_wait_ms = hold_off_until_ - now;
+      return true;
+    }
+    if (state_ == State::Closed) {
+      return false;
+    }
+    const uint64_t span_ms = state_ == State::Open ? params_.open_ms : params_.probe_timeout_ms;
+    const bricks::time::EPOCH_MILLISECONDS until =
+        since_ + static_cast<bricks::time::MILLISECONDS_INTERVAL>(span_ms);
+    if (now < until) {
+      *output_wait_ms = until - now;
+      return true;
+    }
+    state_ = State::HalfOpen;
+    since_ = now;
+    return false;
+  }
+
+  void OnSuccess() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    failures_ = 0;
+    if (state_ != State::Closed) {
+      state_ = State::Closed;
+      resumption_pending_ = true;
+    }
+  }
+
+  void OnFailure() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state_ == State::HalfOpen || (state_ == State::Closed && ++failures_ >= params_.failures_to_open)) {
+      state_ = State::Open;
+      since_ = bricks::time::Now();
+      failures_ = 0;
+    }
+  }
+
+  // Has all the queues wait for at least `wait_ms` from now, as the destination has asked.
+  void HoldOff(uint64_t wait_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const bricks::time::EPOCH_MILLISECONDS until =
+        bricks::time::Now() + static_cast<bricks::time::MILLISECONDS_INTERVAL>(wait_ms);
+    if (until > hold_off_until_) {
+      hold_off_until_ = until;
+    }
+  }
+
+  std::shared_ptr<Subscriber> Subscribe(std::function<void()> resume) {
+    std::shared_ptr<Subscriber> subscriber = std::make_shared<Subscriber>();
+    subscriber->resume = resume;
+    std::lock_guard<std::mutex> lock(mutex_);
+    subscribers_.push_back(subscriber);
+    return subscriber;
+  }
+
+  // Once this returns, the subscriber is not called any more.
+  void Unsubscribe(const std::shared_ptr<Subscriber>& subscriber) {
+    {
+      std::lock_guard<std::mutex> lock(subscriber->mutex);
+      subscriber->resume = nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = subscribers_.begin(); it != subscribers_.end(); ++it) {
+      if (it->lock() == subscriber) {
+        subscribers_.erase(it);
+        break;
+      }
+    }
+  }
+
+  // Resumes all the subscribers if the breaker has closed since the previous call.
+  // Should be called with no locks held that the subscribers take.
+  void BroadcastPendingResumption() {
+    std::vector<std::shared_ptr<Subscriber>> subscribers;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!resumption_pending_) {
+        return;
+      }
+      resumption_pending_ = false;
+      for (const std::weak_ptr<Subscriber>& subscriber : subscribers_) {
+        if (std::shared_ptr<Subscriber> locked = subscriber.lock()) {
+          subscribers.push_back(locked);
+        }
+      }
+    }
+    for (const std::shared_ptr<Subscriber>& subscriber : subscribers) {
+      std::lock_guard<std::mutex> lock(subscriber->mutex);
+      if (subscriber->resume) {
+        subscriber->resume();
+      }
+    }
+  }
+
+ private:
+  CircuitBreaker() = default;
+
+  mutable std::mutex mutex_;
+  Params params_;
+  State state_ = State::Closed;
+  size_t failures_ = 0;
+  // When the breaker has opened, or when the probe has started.
+  bricks::time::EPOCH_MILLISECONDS since_ = bricks::time::EPOCH_MILLISECONDS(0);
+  // Until when the destination has asked to be left alone, see `HoldOff()`.
+  bricks::time::EPOCH_MILLISECONDS hold_off_until_ = bricks::time::EPOCH_MILLISECONDS(0);
+  bool resumption_pending_ = false;
+  std::vector<std::weak_ptr<Subscriber>> subscribers_;
+
+  CircuitBreaker(const CircuitBreaker&) = delete;
+  void operator=(const CircuitBreaker&) = delete;
+};
+
+template <typename FILE_SYSTEM_FOR_RETRY_STRATEGY>
+class CircuitBreakerRetryStrategy {
+ public:
+  typedef FILE_SYSTEM_FOR_RETRY_STRATEGY T_FILE_SYSTEM;
+
+  explicit CircuitBreakerRetryStrategy(const T_FILE_SYSTEM&, const std::string& destination = "")
+      : breaker_(&CircuitBreaker::ForDestination(destination)) {
+  }
+
+  CircuitBreaker& Breaker() {
+    return *breaker_;
+  }
+
+  void OnSuccess() {
+    breaker_->OnSuccess();
+  }
+  void OnFailure() {
+    breaker_->OnFailure();
+  }
+  bool ShouldWait(bricks::time::MILLISECONDS_INTERVAL* output_wait_ms) {
+    return breaker_->ShouldWait(output_wait_ms);
+  }
+
+  // Called by FSQ, with `ResumeProcessing()` of its own, on construction and on destruction.
+  void SubscribeToResumption(std::function<void()> resume) {
+    subscriber_ = breaker_->Subscribe(resume);
+  }
+  void UnsubscribeFromResumption() {
+    if (subscriber_) {
+      breaker_->Unsubscribe(subscriber_);
+      subscriber_.reset();
+    }
+  }
+  // Called by FSQ after the processing step, with no locks held.
+  void BroadcastPendingResumption() {
+    breaker_->BroadcastPendingResumption();
+  }
+
+ private:
+  CircuitBreaker* breaker_;
+  std::shared_ptr<CircuitBreaker::Subscriber> subscriber_;
+};
+
+}  // namespace strategy
+}  // namespace fsq
+
+#endif  // FSQ_CIRCUIT_BREAKER_RETRY_STRATEGY_H
@@ -0,0 +1,68 @@
+// Compression of finalized files, to be used as `T_FINALIZED_FILE_TRANSFORM_STRATEGY`.
+//
+// The messages in finalized files are mostly text, which compresses well. Compressing finalized files
+// cuts both the disk footprint, as the purge strategy sees compressed sizes, and the upload bandwidth.
+//
+// Requires linking against zlib, `-lz`. Use together with `GzippedFileNaming`,
+// so that the finalized files are named "finalized-{timestamp}.bin.gz".
+
+#ifndef FSQ_COMPRESSION_H
+#define FSQ_COMPRESSION_H
+
+#include <algorithm>
+#include <string>
+
+#include <zlib.h>
+
+#include "strategies.h"
+
+#include "../Bricks/file/file.h"
+
+namespace fsq {
+namespace strategy {
+
+// Gzip-compresses each finalized file, with the compression level defaulting to zlib's default of 6.
+class GzipFinalizedFiles {
+ public:
+  inline static bool TransformsFinalizedFiles() {
+    return true;
+  }
+  bool TransformFinalizedFile(const std::string& input_file_name, const std::string& output_file_name) const {
+    try {
+      const bricks::MemoryMappedFile input(input_file_name);
+      const std::string mode = "wb" + std::to_string(compression_level_);
+      gzFile output = ::gzopen(output_file_name.c_str(), mode.c_str());
+      if (!output) {
+        return false;
+      }
+      bool ok = true;
+      // `gzwrite()` takes the length as `unsigned`, write large files in chunks.
+      const size_t kChunkSize = 1024 * 1024;
+      for (size_t offset = 0; ok && offset < input.size(); offset += kChunkSize) {
+        const unsigned length = static_cast<unsigned>(std::min(kChunkSize, input.size() - offset));
+        ok = (::gzwrite(output, input.data() + offset, length) == static_cast<int>(length));
+      }
+      return (::gzclose(output) == Z_OK) && ok;
+    } catch (const bricks::FileException&) {
+      return false;
+    }
+  }
+  void SetCompressionLevel(int compression_level) {
+    compression_level_ = compression_level;
+  }
+
+ private:
+  int compression_level_ = 6;
+};
+
+// The default file naming strategy, with compressed finalized files named "finalized-{timestamp}.bin.gz".
+struct GzippedFileNaming : DummyFileNamingToUnblockAlexFromMinsk {
+  GzippedFileNaming() {
+    finalized = FileNamingSchema("finalized-", ".bin.gz");
+  }
+};
+
+}  // namespace strategy
+}  // namespace fsq
+
+#endif  // FSQ_COMPRESSION_H
@@ -3,10 +3,14 @@
 
 #include <string>
 
+#include "../Bricks/memory/accounting.h"
+#include "../Bricks/memory/memory_resource.h"
 #include "../Bricks/time/chrono.h"
 
 #include "strategies.h"
+#include "admission_strategy.h"
 #include "exponential_retry_strategy.h"
+#include "scheduler.h"
 
 namespace fsq {
 
@@ -18,11 +22,18 @@ namespace fsq {
 // FSQ derives itself from all strategy classes except T_PROCESSOR, T_TIME_MANAGER and T_FILE_MANAGER,
 // thus allowing calling member setters for other policies directly on itself.
 
+// `T_MESSAGE` is what `PushMessage()` takes, and what `T_FILE_APPEND_STRATEGY` writes and sizes. It can be
+// a typed event instead of a string, with `AppendFlatEventRecords` as the strategy, see `flat_event_records.h`.
+
+// `T_ADMISSION_STRATEGY` is consulted on each message pushed, and may leave some of them out, such as
+// `SampleUnderBacklog` does once the queue falls behind, see `admission_strategy.h`.
+
 template <typename PROCESSOR>
 struct Config {
   typedef PROCESSOR T_PROCESSOR;
   typedef std::string T_MESSAGE;
   typedef strategy::JustAppendToFile T_FILE_APPEND_STRATEGY;
+  typedef strategy::KeepFinalizedFilesAsIs T_FINALIZED_FILE_TRANSFORM_STRATEGY;
   typedef strategy::AlwaysResume T_FILE_RESUME_STRATEGY;
   typedef strategy::DummyFileNamingToUnblockAlexFromMinsk T_FILE_NAMING_STRATEGY;
   typedef strategy::DefaultErrorHandling T_ERROR_HANDLING_STRATEGY;
@@ -32,6 +43,8 @@ struct Config {
   typedef strategy::UseEpochMilliseconds T_TIME_MANAGER;
   typedef strategy::KeepFilesAround100KBUnlessNoBacklog T_FINALIZE_STRATEGY;
   typedef strategy::KeepUnder20MBAndUnder1KFiles T_PURGE_STRATEGY;
+  typedef strategy::StrictLanePriority T_LANE_SCHEDULING_STRATEGY;
+  typedef strategy::AdmitAllMessages T_ADMISSION_STRATEGY;
 
   // Set to true to have FSQ detach the processing thread instead of joining it in destructor.
   inline static bool DetachProcessingThreadOnTermination() {
@@ -48,6 +61,124 @@ struct Config {
     return false;
   }
 
+  // Set to a non-zero value to have `PushMessage()` not wait for the startup scan of the working directory.
+  // Up to this many messages are then kept in memory and appended once the scan is complete.
+  // Beyond that, `PushMessage()` waits for the scan as it does by default.
+  inline static size_t MaxMessagesBufferedUntilReady() {
+    return 0;
+  }
+
+  // Set to true to have FSQ watch the working directory, with inotify or kqueue, and queue up the files
+  // named as finalized ones that other processes move into it, in the order they appear.
+  // Without it, such files are only picked up by the scan of the working directory on startup.
+  inline static bool WatchWorkingDirectory() {
+    return false;
+  }
+
+  // Set to true to have FSQ save the queue into a manifest file on shutdown,
+  // and load it on startup instead of scanning the working directory.
+  inline static bool KeepQueueManifest() {
+    return false;
+  }
+
+  // Set to true to have the files purged by `T_PURGE_STRATEGY` removed from disk by a dedicated thread,
+  // so that the producer finalizing a file does not wait for them. The purged files leave the queue at once,
+  // and are accounted for in `QueueStatus::pending_reclaim_size` until removed.
+  inline static bool ReclaimPurgedFilesInBackground() {
+    return false;
+  }
+
+  // With an `OutputFile` that supports it, see `bricks::PosixFileSystem`: The disk space to reserve
+  // for each new current file, zero for none, and whether to drop finalized files from the page cache.
+  inline static uint64_t PreallocatedFileSize() {
+    return 0;
+  }
+  inline static bool DropFinalizedFilesFromPageCache() {
+    return false;
+  }
+  // With an `OutputFile` that supports it: Set to a non-zero number of bytes to have the current files
+  // dropped from the page cache as they grow, in batches of that size, see `bricks::PosixOutputFile`.
+  // For the large backlogs that are written and read once, to not evict the hot pages of other processes.
+  inline static uint64_t DropAppendedDataFromPageCacheEvery() {
+    return 0;
+  }
+
+  // With a file system that supports it, see `bricks::PosixFileSystem`: The number of processed files
+  // to keep around, empty but with their disk space reserved, to be reused as the next current files.
+  inline static size_t RecycledFilesPoolSize() {
+    return 0;
+  }
+
+  // With a file system that supports it, see `bricks::PosixFileSystem`: The number of the finalized files
+  // next in the queue to have read ahead into the page cache as the processor is handed the current ones,
+  // for the disk to not sit idle while the processor waits on the network, and the next files to not be read
+  // cold once their turn comes. Zero for none.
+  inline static size_t PrefetchedFilesAhead() {
+    return 0;
+  }
+
+  // The number of threads calling the processor concurrently, each on its own finalized file.
+  // The default of one keeps the strict FIFO order: the next file is passed on once the previous one is done.
+  // With more threads, the files are still passed on oldest first, but may complete out of order,
+  // and the processor should be thread safe.
+  inline static size_t NumberOfProcessingThreads() {
+    return 1;
+  }
+
+  // The limits on a batch of files passed to the processor that defines `OnFilesReady(files, now)`:
+  // the oldest files of a lane, up to this many files, and up to this many bytes in total, except for
+  // a single file larger than that, which makes a batch of its own.
+  inline static size_t MaxFilesPerBatch() {
+    return 100;
+  }
+  inline static uint64_t MaxBytesPerBatch() {
+    return 10 * 1024 * 1024;
+  }
+
+  // The number of priority lanes, each with its own current file, see `FSQ::PushMessageToLane()`.
+  // The lanes share the processing threads, the retry strategy and the purge strategy. The finalized files
+  // are taken from the lanes as `T_LANE_SCHEDULING_STRATEGY` dictates, and purged from the lane with
+  // the highest number, the lowest priority one, first.
+  inline static size_t NumberOfLanes() {
+    return 1;
+  }
+
+  // The memory resource for the list of the finalized files, `QueueStatus::finalized.queue`, which outlives
+  // all the other containers of FSQ, and, with many small files queued, is the largest of them.
+  // It is only used under the mutex of FSQ, thus does not have to be thread safe, unless shared by FSQ-s.
+  // The default one is shared by all the FSQ-s, and accounted for as "fsq_status", see `memory/accounting.h`.
+  inline static bricks::memory::MemoryResource* StatusMemoryResource() {
+    static bricks::memory::MemoryResource* resource = bricks::memory::SubsystemMemoryResource("fsq_status");
+    return resource;
+  }
+
+  // Set to a scheduler shared by many FSQ-s to have it run the startup scan and the processing of this one,
+  // with `NumberOfProcessingThreads()` being how many of its workers may process the files of this FSQ
+  // at a time, instead of dedicated threads, see `scheduler.h`. The scheduler should outlive the FSQ.
+  // With it, the destructor always waits for the files being processed, whatever
+  // `DetachProcessingThreadOnTermination()` says.
+  inline static Scheduler* SharedScheduler() {
+    return nullptr;
+  }
+
+  // Set to a name unique among the processes sharing the working directory, such as the process id, to have
+  // several processes push into one queue. Each process appends to current files of its own, named with
+  // this prefix, and finalizes them into the shared queue with atomic renames, while one of the processes,
+  // the one holding the `flock()` on the lease file, processes and purges the files of all of them.
+  // The others do not queue the finalized files, and try to take the lease over every
+  // `SharedWorkingDirectoryLeasePollMs()`, for one of them to take over the processing, along with the current
+  // files left behind by the processes that have exited, once the holder of the lease exits.
+  // `WatchWorkingDirectory()` has the holder of the lease queue the files of the others as they are finalized,
+  // not only when it takes the lease over. The manifest and the recycled files are for the directories
+  // of one process only. Throws `bricks::FileException` if the lock files can not be created, and waits
+  // for the process with the same name, if any, to exit.
+  inline static std::string SharedWorkingDirectoryWriterName() {
+    return "";
+  }
+  inline static uint64_t SharedWorkingDirectoryLeasePollMs() {
+    return 1000;
+  }
+
   template <typename T_FSQ_INSTANCE>
   inline static void Initialize(T_FSQ_INSTANCE&) {
     // `T_CONFIG::Initialize(*this)` is invoked from FSQ's constructor
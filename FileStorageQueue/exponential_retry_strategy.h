@@ -5,9 +5,12 @@
 
 #include <string>
 #include <atomic>
+#include <memory>
 #include <random>
 
 #include "exception.h"
+#include "../Bricks/file/file.h"
+#include "../Bricks/strings/fixed_size_serializer.h"
 #include "../Bricks/time/chrono.h"
 
 namespace fsq {
@@ -26,6 +29,10 @@ struct StatefulRandSeed {
 // On `Success`, processes files as they arrive without any delays.
 // On `Unavaliable`, retries after an amount of time drawn from an exponential distribution
 // with the mean defaulting to 15 minutes, min defaulting to 1 minute and max defaulting to 24 hours.
+//
+// With `AttachToFile()`, the state is persisted, and only rewritten when it changes: a success following
+// another success, the common case when draining a backlog, does not touch the file.
+// The state file is text by default, see `PersistenceParams` for the binary one and for fsync batching.
 template <typename FILE_SYSTEM_FOR_RETRY_STRATEGY, typename ERROR_HANDLING_STRATEGY = DefaultErrorHandling>
 class ExponentialDelayRetryStrategy {
  public:
@@ -39,6 +46,18 @@ class ExponentialDelayRetryStrategy {
     DistributionParams(const DistributionParams&) = default;
     DistributionParams& operator=(const DistributionParams&) = default;
   };
+  struct PersistenceParams {
+    // The text state file is replaced via `T_FILE_SYSTEM::WriteFileAtomically()` on each update.
+    // The binary one, two little-endian 64-bit timestamps, is overwritten in place with `pwrite()`,
+    // bypassing `T_FILE_SYSTEM`. Either is read back regardless of this setting.
+    bool binary = false;
+    // The number of updates to `fdatasync()` the state file after, zero for never.
+    size_t sync_every_n_updates = 0;
+    PersistenceParams() = default;
+    PersistenceParams(bool binary, size_t sync_every_n_updates = 0)
+        : binary(binary), sync_every_n_updates(sync_every_n_updates) {
+    }
+  };
   explicit ExponentialDelayRetryStrategy(const T_FILE_SYSTEM& file_system, const DistributionParams& params)
       : file_system_(file_system),
         last_update_time_(bricks::time::Now()),
@@ -53,9 +72,11 @@ class ExponentialDelayRetryStrategy {
                                          const double max = 24 * 60 * 60 * 1e3)
       : ExponentialDelayRetryStrategy(file_system, DistributionParams(mean, min, max)) {
   }
-  void AttachToFile(const std::string& filename) {
+  void AttachToFile(const std::string& filename, const PersistenceParams& params = PersistenceParams()) {
     if (!filename.empty()) {
       persistence_filename_ = filename;
+      persistence_params_ = params;
+      binary_file_.reset();
       // First, resume delay, is possible.
       // Then, save it to a) ensure the file exists, and b) update its timestamp.
       ResumeStateFromFile();
@@ -68,7 +89,8 @@ class ExponentialDelayRetryStrategy {
   void OnSuccess() {
     last_update_time_ = bricks::time::Now();
     time_to_be_ready_to_process_ = last_update_time_;
-    if (!persistence_filename_.empty()) {
+    // The state saved with no delay stays valid, no matter how old its update time is.
+    if (!persistence_filename_.empty() && !saved_without_delay_) {
       SaveStateToFile();
     }
   }
@@ -103,12 +125,21 @@ class ExponentialDelayRetryStrategy {
     try {
       const std::string contents = std::move(file_system_.ReadFileAsString(persistence_filename_));
       constexpr size_t w = bricks::strings::FixedSizeSerializer<EPOCH_MILLISECONDS>::size_in_bytes;
-      // File format is "${update_time} ${time_to_be_ready_to_process}".
+      EPOCH_MILLISECONDS last_update_time;
+      EPOCH_MILLISECONDS time_to_be_ready_to_process;
+      bool parsed = true;
+      // Text file format is "${update_time} ${time_to_be_ready_to_process}".
       if (contents.length() == w * 2 + 1 && contents[w] == ' ') {
-        EPOCH_MILLISECONDS last_update_time;
-        EPOCH_MILLISECONDS time_to_be_ready_to_process;
-        bricks::strings::UnpackFromString(contents.substr(0, w), last_update_time);
-        bricks::strings::UnpackFromString(contents.substr(w + 1, w), time_to_be_ready_to_process);
+        typedef bricks::strings::FixedSizeSerializer<EPOCH_MILLISECONDS> Serializer;
+        parsed = Serializer::Unpack(contents.data(), last_update_time) &&
+                 Serializer::Unpack(contents.data() + w + 1, time_to_be_ready_to_process);
+      } else if (contents.length() == kBinaryStateSize) {
+        last_update_time = static_cast<EPOCH_MILLISECONDS>(DecodeUInt64(contents.data()));
+        time_to_be_ready_to_process = static_cast<EPOCH_MILLISECONDS>(DecodeUInt64(contents.data() + 8));
+      } else {
+        parsed = false;
+      }
+      if (parsed) {
         if (last_update_time <= now) {
           last_update_time_ = now;
           time_to_be_ready_to_process_ = std::max(time_to_be_ready_to_process_, time_to_be_ready_to_process);
@@ -124,22 +155,75 @@ class ExponentialDelayRetryStrategy {
     }
   }
   void SaveStateToFile() const {
-    using bricks::strings::PackToString;
+    typedef bricks::strings::FixedSizeSerializer<bricks::time::EPOCH_MILLISECONDS> Serializer;
+    constexpr size_t w = Serializer::size_in_bytes;
     try {
-      file_system_.WriteStringToFile(
-          persistence_filename_.c_str(),
-          PackToString(last_update_time_) + ' ' + PackToString(time_to_be_ready_to_process_));
+      if (persistence_params_.binary) {
+        SaveStateToBinaryFile();
+      } else {
+        std::string contents(w * 2 + 1, ' ');
+        Serializer::Pack(last_update_time_, &contents[0]);
+        Serializer::Pack(time_to_be_ready_to_process_, &contents[w + 1]);
+        const size_t n = persistence_params_.sync_every_n_updates;
+        const bool sync = n && ++updates_since_sync_ >= n;
+        file_system_.WriteFileAtomically(persistence_filename_,
+                                         contents,
+                                         sync ? bricks::WriteFileAtomicallyParameters::Durable
+                                              : bricks::WriteFileAtomicallyParameters::NoSync);
+        if (sync) {
+          updates_since_sync_ = 0;
+        }
+      }
+      saved_without_delay_ = (time_to_be_ready_to_process_ <= last_update_time_);
     } catch (const bricks::FileException&) {
       // TODO(dkorolev): Log an error message, could not read the file.
     }
   }
 
  private:
+  enum { kBinaryStateSize = 16 };
+  static void EncodeUInt64(uint64_t value, char* output) {
+    for (int i = 0; i < 8; ++i) {
+      output[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+    }
+  }
+  static uint64_t DecodeUInt64(const char* input) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+      value |= static_cast<uint64_t>(static_cast<uint8_t>(input[i])) << (8 * i);
+    }
+    return value;
+  }
+  // Throws `bricks::FileException`.
+  void SaveStateToBinaryFile() const {
+    if (!binary_file_) {
+      // Also truncates the text state file, if any, to the binary size.
+      binary_file_ = std::make_shared<bricks::FixedSizeFile>(persistence_filename_, kBinaryStateSize);
+      updates_since_sync_ = 0;
+    }
+    char buffer[kBinaryStateSize];
+    EncodeUInt64(static_cast<uint64_t>(last_update_time_), buffer);
+    EncodeUInt64(static_cast<uint64_t>(time_to_be_ready_to_process_), buffer + 8);
+    if (!binary_file_->Write(buffer)) {
+      throw bricks::FileException();
+    }
+    const size_t n = persistence_params_.sync_every_n_updates;
+    if (n && ++updates_since_sync_ >= n) {
+      binary_file_->Sync();
+      updates_since_sync_ = 0;
+    }
+  }
+
   const T_FILE_SYSTEM& file_system_;
   mutable typename bricks::time::EPOCH_MILLISECONDS last_update_time_;
   mutable typename bricks::time::EPOCH_MILLISECONDS time_to_be_ready_to_process_;
   const DistributionParams params_;
   std::string persistence_filename_;
+  PersistenceParams persistence_params_;
+  // Shared, as the strategy is copied into FSQ. Opened on the first binary save.
+  mutable std::shared_ptr<bricks::FixedSizeFile> binary_file_;
+  mutable size_t updates_since_sync_ = 0;
+  mutable bool saved_without_delay_ = false;
   std::mt19937 rng_;
   std::exponential_distribution<double> distribution_;
 };
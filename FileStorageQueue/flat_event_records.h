@@ -0,0 +1,112 @@
+// Typed FSQ messages: events appended as framed records, encoded straight into the write buffer.
+//
+// With `T_MESSAGE` being an event type with `BRICKS_FLAT_FIELDS`, see `Bricks/cerealize/flat.h`, and
+// `AppendFlatEventRecords<T_MESSAGE>` as `T_FILE_APPEND_STRATEGY`, `FSQ::PushMessage()` takes the event itself.
+// Each event is written as a framed record, see `framed_records.h`, the payload of which is the flat record
+// of the event: the four-byte flat header followed by the fields. The header, the fields and the checksum
+// are all computed into one buffer, which is then written into the file, with no `std::string` made per event,
+// and the size of each message is the compile-time size of the record, with nothing encoded to learn it.
+//
+//   struct Click {
+//     uint64_t timestamp;
+//     int32_t x, y;
+//     BRICKS_FLAT_FIELDS(1, timestamp, x, y);
+//   };
+//   struct ClickConfig : fsq::Config<ClickProcessor> {
+//     typedef Click T_MESSAGE;
+//     typedef fsq::strategy::AppendFlatEventRecords<Click> T_FILE_APPEND_STRATEGY;
+//     typedef fsq::strategy::ResumeTruncatingToLastValidRecord T_FILE_RESUME_STRATEGY;
+//   };
+//
+// The files are the framed ones, thus `FramedRecords(data, length)`, `FSQ::ReplayMessages()`, the torn tail
+// recovery and `IngestServer` work as they do with `AppendFramedRecords`. The processors decode the events
+// of the records with `DecodeFlatEventRecord()`. The events are read back on the architecture they were
+// written on, see `Bricks/cerealize/flat.h`.
+
+#ifndef FSQ_FLAT_EVENT_RECORDS_H
+#define FSQ_FLAT_EVENT_RECORDS_H
+
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+#include "framed_records.h"
+
+#include "../Bricks/cerealize/flat.h"
+
+namespace fsq {
+
+namespace flat_event_records {
+
+// Encodes the framed record of `event` into `framed_records::kHeaderSize + FlatCodec<T>::kRecordSize` bytes.
+template <typename T_EVENT>
+inline void EncodeRecord(const T_EVENT& event, char* output) {
+  typedef bricks::cerealize::FlatCodec<T_EVENT> Codec;
+  char* payload = output + framed_records::kHeaderSize;
+  Codec::EncodeRecord(event, payload);
+  framed_records::EncodeHeader(payload, Codec::kRecordSize, output);
+}
+
+}  // namespace flat_event_records
+
+// Decodes the event of the framed record `record` into `event`, see the top of this file.
+// Returns false, leaving `event` as is, if the record is not the flat record of an event of type `T_EVENT`.
+template <typename T_EVENT>
+inline bool DecodeFlatEventRecord(const FramedRecord& record, T_EVENT& event) {
+  typedef bricks::cerealize::FlatCodec<T_EVENT> Codec;
+  std::uint32_t tag;
+  if (record.length != Codec::kRecordSize || !bricks::cerealize::IsFlatRecordHeader(record.data, tag) ||
+      tag != static_cast<std::uint32_t>(T_EVENT::BRICKS_FLAT_TAG)) {
+    return false;
+  }
+  Codec::Decode(record.data + bricks::cerealize::kFlatRecordHeaderSize, event);
+  return true;
+}
+
+namespace strategy {
+
+// File append strategy writing each event as the framed flat record of it, see the top of this file.
+// A single event is encoded on the stack, and a range of them, from `FSQ::PushMessages()`, into a buffer
+// kept by the strategy, to be written into the file at once. FSQ only appends under its append mutex,
+// thus the buffer is not shared by the threads pushing.
+template <typename T_EVENT>
+class AppendFlatEventRecords {
+ public:
+  enum : size_t {
+    kFramedRecordSize = framed_records::kHeaderSize + bricks::cerealize::FlatCodec<T_EVENT>::kRecordSize
+  };
+
+  template <typename T_OUTPUT_FILE>
+  void AppendToFile(T_OUTPUT_FILE& fo, const T_EVENT& event) const {
+    char record[kFramedRecordSize];
+    flat_event_records::EncodeRecord(event, record);
+    fo.write(record, kFramedRecordSize);
+    fo.flush();
+  }
+  template <typename T_OUTPUT_FILE, typename ITERATOR>
+  void AppendToFile(T_OUTPUT_FILE& fo, ITERATOR begin, ITERATOR end) const {
+    buffer_.resize(static_cast<size_t>(std::distance(begin, end)) * kFramedRecordSize);
+    char* output = buffer_.data();
+    for (ITERATOR it = begin; it != end; ++it) {
+      flat_event_records::EncodeRecord(*it, output);
+      output += kFramedRecordSize;
+    }
+    fo.write(buffer_.data(), buffer_.size());
+    fo.flush();
+  }
+  uint64_t MessageSizeInBytes(const T_EVENT&) const {
+    return kFramedRecordSize;
+  }
+  // The records of a file appended to, see `FSQ::ReplayMessages()` and `DecodeFlatEventRecord()`.
+  FramedRecords Records(const char* data, size_t length) const {
+    return FramedRecords(data, length);
+  }
+
+ private:
+  mutable std::vector<char> buffer_;
+};
+
+}  // namespace strategy
+}  // namespace fsq
+
+#endif  // FSQ_FLAT_EVENT_RECORDS_H
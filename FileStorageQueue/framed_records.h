@@ -0,0 +1,201 @@
+// Record-framed FSQ file format, with a checksum per record and crash-safe recovery of the torn tail.
+//
+// Each message is written as a 12-byte header followed by the message itself:
+//   [uint32 magic] [uint32 length] [uint32 CRC32C of the length and the message], all little-endian.
+// Every header starts with the magic, so a reader can resynchronize after a corrupted record
+// by scanning forward for the next header with a valid checksum.
+//
+// Use `AppendFramedRecords` as `T_FILE_APPEND_STRATEGY` and `ResumeTruncatingToLastValidRecord`
+// as `T_FILE_RESUME_STRATEGY`: on startup, FSQ then truncates each current file to its last complete record,
+// dropping whatever partial record has been written by the time the process crashed.
+// Processors walk the records of an mmapped finalized file with `FramedRecords(data, length)`.
+
+#ifndef FSQ_FRAMED_RECORDS_H
+#define FSQ_FRAMED_RECORDS_H
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+
+#include "../Bricks/util/crc32c.h"
+
+namespace fsq {
+
+namespace framed_records {
+
+const uint32_t kMagic = 0x46535131;  // "FSQ1".
+const size_t kHeaderSize = 12;
+
+inline void EncodeUInt32(uint32_t value, char* output) {
+  for (int i = 0; i < 4; ++i) {
+    output[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+  }
+}
+
+inline uint32_t DecodeUInt32(const char* input) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; ++i) {
+    value |= static_cast<uint32_t>(static_cast<uint8_t>(input[i])) << (8 * i);
+  }
+  return value;
+}
+
+// Fills in the header to write before a message of `length` bytes.
+inline void EncodeHeader(const char* data, size_t length, char* header) {
+  EncodeUInt32(kMagic, header);
+  EncodeUInt32(static_cast<uint32_t>(length), header + 4);
+  EncodeUInt32(bricks::CRC32C(data, length, bricks::CRC32C(header + 4, 4)), header + 8);
+}
+
+// Returns the total size of the valid record starting at `data`, header included, or 0 if there is none.
+inline size_t ValidRecordSize(const char* data, size_t length) {
+  if (length < kHeaderSize || DecodeUInt32(data) != kMagic) {
+    return 0;
+  }
+  const uint32_t record_length = DecodeUInt32(data + 4);
+  if (record_length > length - kHeaderSize) {
+    return 0;
+  }
+  const uint32_t crc = bricks::CRC32C(data + kHeaderSize, record_length, bricks::CRC32C(data + 4, 4));
+  return (crc == DecodeUInt32(data + 8)) ? kHeaderSize + record_length : 0;
+}
+
+// Returns the length of the longest prefix of `data` made of valid records only.
+inline size_t ValidPrefixLength(const char* data, size_t length) {
+  size_t offset = 0;
+  while (const size_t record_size = ValidRecordSize(data + offset, length - offset)) {
+    offset += record_size;
+  }
+  return offset;
+}
+
+}  // namespace framed_records
+
+// A view of one record of a framed file, pointing into the underlying, normally mmapped, memory.
+struct FramedRecord {
+  const char* data;
+  size_t length;
+  std::string ToString() const {
+    return std::string(data, length);
+  }
+};
+
+// The range of valid records in a framed file, skipping over corrupted bytes.
+// No parsing beyond header validation happens, and no data is copied.
+class FramedRecords {
+ public:
+  FramedRecords(const char* data, size_t length) : data_(data), length_(length) {
+  }
+
+  class Iterator : public std::iterator<std::forward_iterator_tag, FramedRecord> {
+   public:
+    Iterator(const char* data, size_t length, size_t offset) : data_(data), length_(length), offset_(offset) {
+      Resynchronize();
+    }
+    const FramedRecord& operator*() const {
+      return record_;
+    }
+    const FramedRecord* operator->() const {
+      return &record_;
+    }
+    Iterator& operator++() {
+      offset_ += framed_records::kHeaderSize + record_.length;
+      Resynchronize();
+      return *this;
+    }
+    bool operator==(const Iterator& rhs) const {
+      return data_ == rhs.data_ && offset_ == rhs.offset_;
+    }
+    bool operator!=(const Iterator& rhs) const {
+      return !operator==(rhs);
+    }
+    // The number of bytes skipped so far as corrupted.
+    size_t skipped_bytes() const {
+      return skipped_bytes_;
+    }
+
+   private:
+    // Advances `offset_` to the next valid record, or to the end of the data.
+    void Resynchronize() {
+      while (offset_ < length_) {
+        const size_t record_size = framed_records::ValidRecordSize(data_ + offset_, length_ - offset_);
+        if (record_size) {
+          record_.data = data_ + offset_ + framed_records::kHeaderSize;
+          record_.length = record_size - framed_records::kHeaderSize;
+          return;
+        }
+        ++offset_;
+        ++skipped_bytes_;
+      }
+      offset_ = length_;
+    }
+
+    const char* data_;
+    size_t length_;
+    size_t offset_;
+    size_t skipped_bytes_ = 0;
+    FramedRecord record_ = FramedRecord{nullptr, 0};
+  };
+
+  Iterator begin() const {
+    return Iterator(data_, length_, 0);
+  }
+  Iterator end() const {
+    return Iterator(data_, length_, length_);
+  }
+
+ private:
+  const char* data_;
+  size_t length_;
+};
+
+namespace strategy {
+
+// File append strategy writing each message as a checksummed record, see the top of this file.
+struct AppendFramedRecords {
+  template <typename T_OUTPUT_FILE>
+  void AppendToFile(T_OUTPUT_FILE& fo, const std::string& message) const {
+    WriteRecord(fo, message);
+    fo.flush();
+  }
+  template <typename T_OUTPUT_FILE, typename ITERATOR>
+  void AppendToFile(T_OUTPUT_FILE& fo, ITERATOR begin, ITERATOR end) const {
+    for (ITERATOR it = begin; it != end; ++it) {
+      WriteRecord(fo, *it);
+    }
+    fo.flush();
+  }
+  uint64_t MessageSizeInBytes(const std::string& message) const {
+    return framed_records::kHeaderSize + message.length();
+  }
+  // The messages of a file appended to, see `FSQ::ReplayMessages()`.
+  FramedRecords Records(const char* data, size_t length) const {
+    return FramedRecords(data, length);
+  }
+
+ private:
+  template <typename T_OUTPUT_FILE>
+  static void WriteRecord(T_OUTPUT_FILE& fo, const std::string& message) {
+    char header[framed_records::kHeaderSize];
+    framed_records::EncodeHeader(message.data(), message.length(), header);
+    fo.write(header, framed_records::kHeaderSize);
+    fo.write(message.data(), message.length());
+  }
+};
+
+// Resume strategy for framed files: Always resume, truncating current files to their last valid record.
+// Requires the file system to provide `MappedFile` and `TruncateFile()`.
+struct ResumeTruncatingToLastValidRecord {
+  inline static bool ShouldResume() {
+    return true;
+  }
+  inline static size_t ValidPrefixLength(const char* data, size_t length) {
+    return framed_records::ValidPrefixLength(data, length);
+  }
+};
+
+}  // namespace strategy
+}  // namespace fsq
+
+#endif  // FSQ_FRAMED_RECORDS_H
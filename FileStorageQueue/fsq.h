@@ -6,24 +6,101 @@
 //
 // The processor runs in a dedicated thread. Thus, it is guaranteed to process at most one file at a time.
 // It can take as long as it needs to process the file. Files are guaranteed to be passed in the FIFO order.
+// To drain a large backlog faster, `CONFIG::NumberOfProcessingThreads()` can allow several files in flight,
+// see `config.h`. A file leaves the queue once processed, and is not purged while being processed.
+// With `CONFIG::SharedScheduler()`, the startup scan and the processing run on the workers of a scheduler
+// shared by many FSQ-s instead, with the same guarantees, see `scheduler.h`.
 //
 // Once a file is ready, which translates to "on startup" if there are pending files,
 // the user handler in PROCESSOR::OnFileReady(file_name) is invoked.
 // When a retry strategy is active, further logic depends on the return value of this method,
 // see the description of the `FileProcessingResult` enum below for more details.
+// To have the FSQ-s of the process sending to one destination back off and recover together, use
+// `CircuitBreakerRetryStrategy` from `circuit_breaker_retry_strategy.h`.
+//
+// Alternatively, the processor can define `OnMappedFileReady(file_info, data, length, now)`, with the same
+// return value. Then FSQ maps the finalized file into memory, read-only, and passes the processor a view
+// of its contents, which is only valid until the method returns. This saves the processor re-reading
+// the file into its own buffer. If the file can not be mapped, it is treated as `FailureNeedRetry`.
+// The messages of the view are walked with `SeparatedRecords(data, length, separator)`, from
+// `Bricks/strings/records.h`, or with `FramedRecords(data, length)`, depending on the append strategy.
+//
+// For large files over flaky links, the processor can define `OnFileReadyFromOffset(file_info, offset, now)`
+// instead, with `offset`, a `uint64_t&`, being where the previous attempts stopped, zero at first, and
+// advanced by the processor as the bytes are acknowledged. If the file is not done with, the offset reached
+// is saved next to it, in "{file name}.offset", and the next attempt, after a restart too, starts from there.
+//
+// Or the processor can define `OnFilesReady(files, now)`, taking a `std::vector<FileInfo>` of the oldest files
+// of a lane, up to `CONFIG::MaxFilesPerBatch()` files and `CONFIG::MaxBytesPerBatch()` bytes, and returning
+// a `std::vector<FileProcessingResult>` with the result for each of them, to pay the per-call overhead,
+// such as a request to a server, once per batch of small files. The files that succeeded leave the queue,
+// the rest stay in it. A single `Unavailable` suspends the processing, and the retry strategy is told
+// of one failure per batch.
+//
+// The finalization strategy can learn from the processor: if it defines `OnFileProcessed()`, it is told
+// how long each processed file took to process, see `adaptive_finalization_strategy.h`.
 //
 // On top of the above FSQ keeps an eye on the size it occupies on disk and purges the oldest data files
-// if the specified purge strategy dictates so.
+// if the specified purge strategy dictates so. With `CONFIG::ReclaimPurgedFilesInBackground()`,
+// the purged files are removed from disk by a dedicated thread, instead of by whoever triggered the purge.
+// Rather than purging the old data, `T_ADMISSION_STRATEGY` can have FSQ take in less of the new data
+// once the queue falls behind, recording in the stream what it has left out, see `admission_strategy.h`.
+//
+// With `CONFIG::RecycledFilesPoolSize()` and a file system that supports it, see `bricks::PosixFileSystem`,
+// processed files are not removed, but emptied, with their disk space kept reserved, and renamed
+// into a pool of "spare" files, to become the next current files. This way the storage is not fragmented
+// by files growing and getting removed all the time. With `CONFIG::PrefetchedFilesAhead()` and such a file
+// system, the next finalized files are read ahead into the page cache as the current ones are processed.
+//
+// With `CONFIG::KeepQueueManifest()`, the queue of finalized files is saved into the manifest file on shutdown,
+// and loaded from it on startup, instead of scanning the working directory and getting the size of each file.
+// The manifest is removed once loaded, so that after a crash FSQ falls back to the full scan. The entries
+// of the manifest are validated lazily: a file that is missing or of a different size by the time
+// it is to be processed is dropped from the queue.
+//
+// Optionally, finalized files can be transformed, for example, compressed, before being queued for processing.
+// See `T_FINALIZED_FILE_TRANSFORM_STRATEGY` and `compression.h`. The transform runs in a dedicated thread,
+// on the file moved under its intermediate, "finalizing", name. If FSQ is terminated before the transform
+// is complete, it is redone on the next startup. The processor and the purge strategy only see
+// the transformed files, and their sizes.
+//
+// With `CONFIG::NumberOfLanes()` above one, messages can be pushed into priority lanes, for example, to have
+// crash reports go out before bulk metrics. Each lane has its own current file, and the finalized files
+// of all the lanes form one queue, with its disk budget, drained by the processing threads in the order
+// of `T_LANE_SCHEDULING_STRATEGY`. Purging evicts the files of the lowest priority lanes first.
+//
+// With `CONFIG::WatchWorkingDirectory()`, the finalized files other processes move into the working directory,
+// for example, the uploads received by a web server, are queued as soon as they appear, see `DirectoryWatcher`.
+//
+// With `CONFIG::SharedWorkingDirectoryWriterName()`, several processes, each with an FSQ of its own, push into
+// one working directory. Each appends to current files of its own, and finalizes them by atomic renames that
+// never overwrite the files of the others. One process at a time, the holder of an `flock()`-ed lease,
+// processes and purges the files of all of them, and the others take the lease over once it exits.
+//
+// `Replay(from, to, f)` passes the finalized files still queued that hold the messages pushed within
+// a range of time to a callback of its own, alongside the processing, and with the files left in the queue.
+//
+// `PushMessage()` can be called from multiple threads, the appends are serialized by a mutex.
+// To have the producers only pay the cost of an in-memory enqueue, use `MultiWriterFSQ` from
+// `multi_writer_fsq.h`, where one writer thread owns the file, and appends the enqueued messages in batches.
+// It can also be made to never block the producers, recording the number of the dropped messages in the file.
 
 #ifndef FSQ_H
 #define FSQ_H
 
 #include <algorithm>
+#include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <functional>
+#include <iterator>
+#include <memory>
 #include <mutex>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include "status.h"
@@ -31,7 +108,11 @@
 #include "config.h"
 #include "strategies.h"
 
+#include "../Bricks/file/directory_watcher.h"
 #include "../Bricks/file/file.h"
+#include "../Bricks/file/file_lock.h"
+#include "../Bricks/metrics/metrics.h"
+#include "../Bricks/metrics/trace.h"
 #include "../Bricks/time/chrono.h"
 
 namespace fsq {
@@ -52,11 +133,41 @@ namespace fsq {
 // with respect to the retry strategy specified as the template parameter to FSQ.
 enum class FileProcessingResult { Success, SuccessAndMoved, Unavailable, FailureNeedRetry };
 
+// The metrics of all the instances of FSQ, in `bricks::metrics::Registry::Singleton()`.
+// `GetQueueStatus()` remains the way to inspect one queue.
+struct FSQMetrics {
+  bricks::metrics::Counter& messages_appended;
+  bricks::metrics::Counter& bytes_appended;
+  bricks::metrics::Counter& files_finalized;
+  bricks::metrics::Counter& files_processed;
+  bricks::metrics::Counter& processing_failures;
+  bricks::metrics::Counter& messages_not_admitted;
+
+  static FSQMetrics& Singleton() {
+    bricks::metrics::Registry& registry = bricks::metrics::Registry::Singleton();
+    static FSQMetrics singleton{
+        registry.GetCounter("fsq_messages_appended_total",
+                            "The messages appended to the current files of FSQ-s."),
+        registry.GetCounter("fsq_bytes_appended_total",
+                            "The bytes appended to the current files of FSQ-s."),
+        registry.GetCounter("fsq_files_finalized_total", "The files finalized by FSQ-s."),
+        registry.GetCounter("fsq_files_processed_total", "The files processed successfully by FSQ-s."),
+        registry.GetCounter("fsq_processing_failures_total",
+                            "The files reported by the processors of FSQ-s as unavailable or to retry."),
+        registry.GetCounter("fsq_messages_not_admitted_total",
+                            "The messages pushed into FSQ-s and left out by their admission strategies.")};
+    return singleton;
+  }
+};
+
 template <class CONFIG>
 class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
                   public CONFIG::T_FINALIZE_STRATEGY,
                   public CONFIG::T_PURGE_STRATEGY,
                   public CONFIG::T_FILE_APPEND_STRATEGY,
+                  public CONFIG::T_FINALIZED_FILE_TRANSFORM_STRATEGY,
+                  public CONFIG::T_LANE_SCHEDULING_STRATEGY,
+                  public CONFIG::T_ADMISSION_STRATEGY,
                   public CONFIG::template T_RETRY_STRATEGY<typename CONFIG::T_FILE_SYSTEM> {
  public:
   typedef CONFIG T_CONFIG;
@@ -64,6 +175,7 @@ class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
   typedef typename T_CONFIG::T_PROCESSOR T_PROCESSOR;
   typedef typename T_CONFIG::T_MESSAGE T_MESSAGE;
   typedef typename T_CONFIG::T_FILE_APPEND_STRATEGY T_FILE_APPEND_STRATEGY;
+  typedef typename T_CONFIG::T_FINALIZED_FILE_TRANSFORM_STRATEGY T_FINALIZED_FILE_TRANSFORM_STRATEGY;
   typedef typename T_CONFIG::T_FILE_RESUME_STRATEGY T_FILE_RESUME_STRATEGY;
   typedef typename T_CONFIG::T_FILE_NAMING_STRATEGY T_FILE_NAMING_STRATEGY;
   typedef typename T_CONFIG::T_ERROR_HANDLING_STRATEGY T_ERROR_HANDLING_STRATEGY;
@@ -74,12 +186,15 @@ class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
   typedef typename T_CONFIG::T_TIME_MANAGER T_TIME_MANAGER;
   typedef typename T_CONFIG::T_FINALIZE_STRATEGY T_FINALIZE_STRATEGY;
   typedef typename T_CONFIG::T_PURGE_STRATEGY T_PURGE_STRATEGY;
+  typedef typename T_CONFIG::T_LANE_SCHEDULING_STRATEGY T_LANE_SCHEDULING_STRATEGY;
+  typedef typename T_CONFIG::T_ADMISSION_STRATEGY T_ADMISSION_STRATEGY;
 
   typedef typename T_TIME_MANAGER::T_TIMESTAMP T_TIMESTAMP;
   typedef typename T_TIME_MANAGER::T_TIME_SPAN T_TIME_SPAN;
 
   typedef QueueFinalizedFilesStatus<T_TIMESTAMP> FinalizedFilesStatus;
   typedef QueueStatus<T_TIMESTAMP> Status;
+  typedef QueueCounters<T_TIMESTAMP> Counters;
 
   // The constructor initializes all the parameters and starts the worker thread.
   FSQ(T_PROCESSOR& processor,
@@ -88,12 +203,51 @@ class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
       const T_FILE_SYSTEM& file_system,
       const T_RETRY_STRATEGY_INSTANCE& retry_strategy)
       : T_RETRY_STRATEGY_INSTANCE(retry_strategy),
+        status_(T_CONFIG::StatusMemoryResource()),
         processor_(processor),
         working_directory_(working_directory),
         time_manager_(time_manager),
         file_system_(file_system) {
     T_CONFIG::Initialize(*this);
-    worker_thread_ = std::thread(&FSQ::WorkerThread, this);
+    // The file names of the lanes are only known once the naming strategy is initialized.
+    for (size_t i = 0; i < std::max(T_CONFIG::NumberOfLanes(), static_cast<size_t>(1)); ++i) {
+      lanes_.emplace_back(*this, i, writer_name_);
+    }
+    // In a shared working directory, the process holds the lock of its name for as long as it runs,
+    // and starts off as the one processing the queue if no other process is.
+    if (!writer_name_.empty()) {
+      writer_lock_.reset(new bricks::FileLock(WriterLockFileName(writer_name_)));
+      writer_lock_->Lock();
+      lease_.reset(new bricks::FileLock(
+          T_FILE_SYSTEM::JoinPath(working_directory_, T_FILE_NAMING_STRATEGY::lease_file_name)));
+      holds_lease_ = lease_->TryLock();
+    }
+    // The watch is set up before the startup scan, for the files moved in during the scan not to be missed.
+    if (T_CONFIG::WatchWorkingDirectory()) {
+      try {
+        directory_watcher_.reset(new bricks::DirectoryWatcher(working_directory_));
+        watch_thread_ = std::thread(&FSQ::WatchThread, this);
+      } catch (const bricks::FileException&) {
+        T_ERROR_HANDLING_STRATEGY::HandleError();
+      }
+    }
+    if (scheduler_) {
+      scheduler_task_ = scheduler_->Register([this]() { return ScheduledStep(); },
+                                             T_CONFIG::NumberOfProcessingThreads());
+      scheduler_->Wake(scheduler_task_);
+    } else {
+      worker_thread_ = std::thread(&FSQ::WorkerThread, this);
+      for (size_t i = 1; i < T_CONFIG::NumberOfProcessingThreads(); ++i) {
+        processing_threads_.emplace_back(&FSQ::AdditionalProcessingThread, this);
+      }
+    }
+    if (T_FINALIZED_FILE_TRANSFORM_STRATEGY::TransformsFinalizedFiles()) {
+      transform_thread_ = std::thread(&FSQ::TransformThread, this);
+    }
+    if (T_CONFIG::ReclaimPurgedFilesInBackground()) {
+      reclaim_thread_ = std::thread(&FSQ::ReclaimThread, this);
+    }
+    SubscribeToResumption(typename RetryStrategyResumesQueues<T_RETRY_STRATEGY_INSTANCE>::type());
   }
   FSQ(T_PROCESSOR& processor,
       const std::string& working_directory,
@@ -104,22 +258,27 @@ class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
 
   // Destructor gracefully terminates worker thread and optionally joins it.
   ~FSQ() {
+    // Not to be resumed by the other queues sharing the retry strategy from now on.
+    UnsubscribeFromResumption(typename RetryStrategyResumesQueues<T_RETRY_STRATEGY_INSTANCE>::type());
     // Notify the worker thread that it's time to wrap up.
     {
       std::unique_lock<std::mutex> lock(status_mutex_);
       force_worker_thread_shutdown_ = true;
-      queue_status_condition_variable_.notify_all();
+      NotifyQueueStatusChanged();
     }
-    // Close the current file. `current_file_.reset(nullptr);` is always safe especially in destructor.
-    current_file_.reset(nullptr);
-    // Either wait for the processor thread to terminate or detach it, unless it's already done.
-    if (worker_thread_.joinable()) {
-      if (T_CONFIG::DetachProcessingThreadOnTermination()) {
-        worker_thread_.detach();
-      } else {
-        worker_thread_.join();
+    // Close the current files. `CloseCurrentFile()` is always safe especially in destructor.
+    {
+      std::lock_guard<std::mutex> append_lock(append_mutex_);
+      for (Lane& lane : lanes_) {
+        CloseCurrentFile(lane);
       }
     }
+    // Either wait for the processor threads to terminate or detach them, unless they are already done.
+    JoinOrDetachThreads(T_CONFIG::DetachProcessingThreadOnTermination());
+    // The queue is only final once the threads are done with it.
+    if (T_CONFIG::KeepQueueManifest() && !T_CONFIG::DetachProcessingThreadOnTermination()) {
+      SaveQueueManifest();
+    }
   }
 
   // Getters.
@@ -127,25 +286,128 @@ class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
     return working_directory_;
   }
 
+  // `GetQueueStatus()` waits for the startup scan and returns the full status, with the list of queued files.
+  // EXPENSIVE: Copies the whole queue while holding the mutex the processing threads and producers use.
+  // For metrics, use `GetQueueCounters()`.
   const Status GetQueueStatus() const {
-    if (!status_ready_) {
-      std::unique_lock<std::mutex> lock(status_mutex_);
-      while (!status_ready_) {
-        queue_status_condition_variable_.wait(lock);
-        if (force_worker_thread_shutdown_) {
-          T_ERROR_HANDLING_STRATEGY::HandleError();
-        }
+    std::unique_lock<std::mutex> lock(status_mutex_);
+    while (!status_ready_) {
+      queue_status_condition_variable_.wait(lock);
+      if (force_worker_thread_shutdown_) {
+        T_ERROR_HANDLING_STRATEGY::HandleError();
       }
     }
     // Returning `status_` by const reference is not thread-safe, return a copy from a locked section.
     return status_;
   }
 
-  // `PushMessage()` appends data to the queue.
+  // `GetQueueCounters()` returns the counters of the status, without taking any locks. THREAD SAFE.
+  // The counters are published by whoever changes the status, and are read as a consistent snapshot,
+  // seqlock-style.
+  // Until the startup scan of the working directory is complete, all the counters are zero.
+  const Counters GetQueueCounters() const {
+    Counters counters;
+    uint64_t version;
+    do {
+      version = counters_version_.load(std::memory_order_acquire);
+      counters.finalized_files = finalized_files_counter_.load(std::memory_order_relaxed);
+      counters.finalized_total_size = finalized_total_size_counter_.load(std::memory_order_relaxed);
+      counters.oldest_finalized_file_timestamp =
+          oldest_finalized_file_timestamp_counter_.load(std::memory_order_relaxed);
+      counters.appended_file_size = appended_file_size_counter_.load(std::memory_order_relaxed);
+      counters.pending_reclaim_size = pending_reclaim_size_counter_.load(std::memory_order_relaxed);
+      counters.files_in_process = files_in_process_counter_.load(std::memory_order_relaxed);
+      counters.processing_suspended = processing_suspended_counter_.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((version & 1u) || version != counters_version_.load(std::memory_order_relaxed));
+    return counters;
+  }
+
+  // `Replay()` calls `f(file_info, data, length)` for each finalized file in the queue that may hold messages
+  // pushed within [from, to), with the contents of the file mapped into memory, read-only, and returns
+  // the number of files replayed. A file holds the messages pushed from its timestamp up to that of the next
+  // file of its lane, thus the file the range starts within is replayed along with those that start within it.
+  // The messages themselves carry no timestamps, so each file is replayed in full, and the current files
+  // are not replayed; `FinalizeCurrentFile()` first to have the most recent messages replayed too.
+  //
+  // The files are found under the mutex, by binary search in the queue, which is sorted by timestamp, or,
+  // with more than one lane or in a shared working directory, in one pass over it, as the lanes,
+  // or the processes, are interleaved. They are then mapped and
+  // passed to `f` with no lock held, in the order of the queue, while the producers and the processing go on.
+  // The files are not taken out of the queue: a file processed and removed by the time it is to be mapped
+  // is skipped. Waits for the startup scan. Requires `T_FILE_SYSTEM::MappedFile`. THREAD SAFE.
+  template <typename F>
+  size_t Replay(T_TIMESTAMP from, T_TIMESTAMP to, F&& f) const {
+    const std::vector<FileInfo<T_TIMESTAMP>> files = FilesToReplay(from, to);
+    size_t replayed = 0;
+    for (const FileInfo<T_TIMESTAMP>& file : files) {
+      std::unique_ptr<typename T_FILE_SYSTEM::MappedFile> mapped_file;
+      try {
+        mapped_file.reset(new typename T_FILE_SYSTEM::MappedFile(file.full_path_name));
+      } catch (const bricks::FileException&) {
+        continue;
+      }
+      f(file, mapped_file->data(), mapped_file->size());
+      ++replayed;
+    }
+    return replayed;
+  }
+
+  // `ReplayMessages()` is `Replay()` that calls `f(file_info, data, length)` for each message of the files,
+  // as split by `T_FILE_APPEND_STRATEGY::Records(data, length)`, with no copies made. Returns the number
+  // of messages replayed. Requires the append strategy to define `Records()`, as `AppendToFileWithSeparator`,
+  // `BufferedAppendToFile` and `AppendFramedRecords` do. THREAD SAFE.
+  template <typename F>
+  size_t ReplayMessages(T_TIMESTAMP from, T_TIMESTAMP to, F&& f) const {
+    size_t replayed = 0;
+    Replay(from, to, [this, &f, &replayed](const FileInfo<T_TIMESTAMP>& file, const char* data, size_t length) {
+      for (const auto& record : T_FILE_APPEND_STRATEGY::Records(data, length)) {
+        f(file, record.data, record.length);
+        ++replayed;
+      }
+    });
+    return replayed;
+  }
+
+  // `PushMessage()` appends data to the queue. THREAD SAFE.
+  // The message is not retained by FSQ, so the rvalue overload is the same as the const reference one.
   void PushMessage(const T_MESSAGE& message) {
+    PushMessages(&message, &message + 1);
+  }
+  void PushMessage(T_MESSAGE&& message) {
+    PushMessages(&message, &message + 1);
+  }
+
+  // `PushMessageToLane()` appends data to the queue via the priority lane `lane`, with zero being
+  // the default lane `PushMessage()` appends to, up to `CONFIG::NumberOfLanes() - 1`. THREAD SAFE.
+  void PushMessageToLane(size_t lane, const T_MESSAGE& message) {
+    PushMessagesToLane(lane, &message, &message + 1);
+  }
+
+  // `PushMessages()` appends a range of messages to the queue, with the same result as pushing them one by one
+  // at the same moment of time: the batch is split across files exactly where `PushMessage()` would split it.
+  // The timestamp is taken once, and each part of the batch that goes into one file is appended in one call
+  // to the file append strategy. THREAD SAFE.
+  template <typename ITERATOR>
+  void PushMessages(ITERATOR begin, ITERATOR end) {
+    PushMessagesToLane(0u, begin, end);
+  }
+  template <typename ITERATOR>
+  void PushMessagesToLane(size_t lane, ITERATOR begin, ITERATOR end) {
+    if (lane >= lanes_.size()) {
+      T_ERROR_HANDLING_STRATEGY::HandleError();
+      return;
+    }
+    if (begin == end) {
+      return;
+    }
     if (!status_ready_) {
       // Need to wait for the status to be ready, otherwise current file resume might not happen.
+      // Unless the messages can be kept in memory until then, see `CONFIG::MaxMessagesBufferedUntilReady()`.
       std::unique_lock<std::mutex> lock(status_mutex_);
+      if (BufferMessagesUntilReady(lock, lane, begin, end)) {
+        return;
+      }
       while (!status_ready_) {
         queue_status_condition_variable_.wait(lock);
       }
@@ -158,26 +420,21 @@ class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
         T_ERROR_HANDLING_STRATEGY::HandleError();
       }
     } else {
-      const T_TIMESTAMP now = time_manager_.Now();
-      const uint64_t message_size_in_bytes = T_FILE_APPEND_STRATEGY::MessageSizeInBytes(message);
-      {
-        // Take current message size into consideration when making file finalization decision.
-        status_.appended_file_size += message_size_in_bytes;
-        const bool should_finalize = T_FINALIZE_STRATEGY::ShouldFinalize(status_, now);
-        status_.appended_file_size -= message_size_in_bytes;
-        if (should_finalize) {
-          FinalizeCurrentFile();
-        }
-      }
-      EnsureCurrentFileIsOpen(now);
-      if (!current_file_ || current_file_->bad()) {
-        T_ERROR_HANDLING_STRATEGY::HandleError();
-      }
-      T_FILE_APPEND_STRATEGY::AppendToFile(*current_file_.get(), message);
-      status_.appended_file_size += message_size_in_bytes;
-      if (T_FINALIZE_STRATEGY::ShouldFinalize(status_, now)) {
-        FinalizeCurrentFile();
-      }
+      std::lock_guard<std::mutex> append_lock(append_mutex_);
+      AdmitAndAppendMessages(lanes_[lane],
+                             begin,
+                             end,
+                             time_manager_.Now(),
+                             typename AdmissionStrategyIsSelective<T_ADMISSION_STRATEGY>::type());
+    }
+  }
+
+  // `Flush()` writes out the messages buffered by the file append strategy, if it buffers them.
+  // See `strategy::BufferedAppendToFile`. THREAD SAFE.
+  void Flush() {
+    std::lock_guard<std::mutex> append_lock(append_mutex_);
+    for (Lane& lane : lanes_) {
+      FlushAppendBuffer(lane, true);
     }
   }
 
@@ -190,8 +447,10 @@ class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
   // for a while,
   // `ResumeProcessing()` would not override that wait. Use `ForceProcessing()` for those forced overrides.
   void ResumeProcessing() {
+    std::unique_lock<std::mutex> lock(status_mutex_);
     processing_suspended_ = false;
-    queue_status_condition_variable_.notify_all();
+    PublishQueueCounters();
+    NotifyQueueStatusChanged();
   }
 
   // `ForceProcessing()` initiates processing of finalized files, if any.
@@ -205,23 +464,52 @@ class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
   //
   // Use `ResumeProcessing()` in other cases.
   void ForceProcessing(bool force_finalize_current_file = false) {
+    std::lock_guard<std::mutex> append_lock(append_mutex_);
     std::unique_lock<std::mutex> lock(status_mutex_);
     if (force_finalize_current_file || status_.finalized.queue.empty()) {
-      if (current_file_) {
-        FinalizeCurrentFile(lock);
-      }
+      FinalizeCurrentFiles(lock);
     }
     processing_suspended_ = false;
     force_processing_ = true;
-    queue_status_condition_variable_.notify_all();
+    PublishQueueCounters();
+    NotifyQueueStatusChanged();
   }
 
-  // `FinalizeCurrentFile()` forces the finalization of the currently appended file.
-  void FinalizeCurrentFile() {
-    if (current_file_) {
-      std::unique_lock<std::mutex> lock(status_mutex_);
-      FinalizeCurrentFile(lock);
+  // `AdoptFile()` queues a complete file written elsewhere, for example, received over the network,
+  // as if it was a file of the lane finalized now: the file is renamed into the working directory,
+  // thus should be on the same file system, and is then transformed, processed and purged as any other one.
+  // Returns false if FSQ is shutting down. Throws `bricks::FileException` if the file can not be renamed.
+  // THREAD SAFE.
+  bool AdoptFile(const std::string& full_path_name, size_t lane = 0) {
+    if (lane >= lanes_.size()) {
+      T_ERROR_HANDLING_STRATEGY::HandleError();
+      return false;
     }
+    std::unique_lock<std::mutex> lock(status_mutex_);
+    const auto predicate = [this]() { return status_ready_ || force_worker_thread_shutdown_; };
+    queue_status_condition_variable_.wait(lock, predicate);
+    if (force_worker_thread_shutdown_) {
+      return false;
+    }
+    Lane& adopting_lane = lanes_[lane];
+    T_TIMESTAMP timestamp = time_manager_.Now();
+    if (adopting_lane.has_last_finalized_file_timestamp &&
+        !(adopting_lane.last_finalized_file_timestamp < timestamp)) {
+      timestamp = adopting_lane.last_finalized_file_timestamp + T_TIME_SPAN(1);
+    }
+    adopting_lane.OnFileFinalized(
+        MoveToFinalized(adopting_lane, full_path_name, timestamp, T_FILE_SYSTEM::GetFileSize(full_path_name)));
+    metrics_.files_finalized.Increment();
+    PurgeFilesAsNecessary(lock);
+    NotifyQueueStatusChanged();
+    return true;
+  }
+
+  // `FinalizeCurrentFile()` forces the finalization of the currently appended file, of each lane.
+  void FinalizeCurrentFile() {
+    std::lock_guard<std::mutex> append_lock(append_mutex_);
+    std::unique_lock<std::mutex> lock(status_mutex_);
+    FinalizeCurrentFiles(lock);
   }
 
   // Removes all finalized and current files from disk.
@@ -232,166 +520,1527 @@ class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
     {
       std::unique_lock<std::mutex> lock(status_mutex_);
       force_worker_thread_shutdown_ = true;
-      queue_status_condition_variable_.notify_all();
+      NotifyQueueStatusChanged();
     }
-    current_file_.reset(nullptr);
-    worker_thread_.join();
+    {
+      std::lock_guard<std::mutex> append_lock(append_mutex_);
+      for (Lane& lane : lanes_) {
+        lane.current_file.reset(nullptr);
+      }
+    }
+    JoinOrDetachThreads(false);
+    {
+      std::unique_lock<std::mutex> lock(status_mutex_);
+      status_.finalized.queue.clear();
+      status_.finalized.total_size = 0;
+      files_to_transform_.clear();
+      spare_files_.clear();
+      files_to_reclaim_.clear();
+      status_.pending_reclaim_size = 0;
+      PublishQueueCounters();
+    }
+    T_FILE_SYSTEM::RemoveFile(QueueManifestFileName(), bricks::RemoveFileParameters::Silent);
     // Scan the directory and remove the files.
     for (const auto& file : ScanDir([this](const std::string& s, T_TIMESTAMP* t) {
-           return T_FILE_NAMING_STRATEGY::finalized.ParseFileName(s, t) ||
-                  T_FILE_NAMING_STRATEGY::current.ParseFileName(s, t);
+           for (const Lane& lane : lanes_) {
+             if (lane.finalized.ParseFileName(s, t) || lane.finalizing.ParseFileName(s, t) ||
+                 lane.current.ParseFileName(s, t)) {
+               return true;
+             }
+           }
+           return T_FILE_NAMING_STRATEGY::spare.ParseFileName(s, t);
          })) {
       T_FILE_SYSTEM::RemoveFile(file.full_path_name);
+      RemoveOffsetFile(file.full_path_name);
     }
   }
 
  private:
-  // If the current file exists, declare it finalized, rename it under a permanent name
+  typedef typename T_FILE_NAMING_STRATEGY::FileNamingSchema FileNamingSchema;
+
+  // The current file of a priority lane, and the naming of its files.
+  // The file is guarded by `append_mutex_`, its size and timestamp are guarded by `status_mutex_`.
+  // In a shared working directory, the current and the finalizing files are named with the name
+  // of the process prepended, for example, "p123-current-{timestamp}.bin", while the finalized ones are shared.
+  struct Lane {
+    Lane(const T_FILE_NAMING_STRATEGY& naming, size_t index, const std::string& writer)
+        : index(index),
+          current(Prefixed(naming.current, naming, index, writer)),
+          finalized(Prefixed(naming.finalized, naming, index)),
+          finalizing(Prefixed(naming.finalizing, naming, index, writer)) {
+    }
+    static FileNamingSchema Prefixed(const FileNamingSchema& schema,
+                                     const T_FILE_NAMING_STRATEGY& naming,
+                                     size_t index,
+                                     const std::string& writer = "") {
+      return FileNamingSchema((writer.empty() ? "" : writer + '-') + (index ? naming.LanePrefix(index) : "") +
+                                  schema.prefix_,
+                              schema.suffix_);
+    }
+
+    size_t index;
+    FileNamingSchema current;
+    FileNamingSchema finalized;
+    FileNamingSchema finalizing;
+    std::unique_ptr<typename T_FILE_SYSTEM::OutputFile> current_file;
+    std::string current_file_name;
+    uint64_t appended_file_size = 0;
+    T_TIMESTAMP appended_file_timestamp = T_TIMESTAMP(0);
+
+    // The timestamp of the most recently finalized file, to keep the names of finalized files unique.
+    // Guarded by `status_mutex_`, set when the first file is finalized or found on disk.
+    bool has_last_finalized_file_timestamp = false;
+    T_TIMESTAMP last_finalized_file_timestamp = T_TIMESTAMP(0);
+    void OnFileFinalized(const T_TIMESTAMP timestamp) {
+      if (!has_last_finalized_file_timestamp || last_finalized_file_timestamp < timestamp) {
+        has_last_finalized_file_timestamp = true;
+        last_finalized_file_timestamp = timestamp;
+      }
+    }
+  };
+
+  // Reflects the current files of the lanes in `status_`, see `QueueStatus`.
+  // MUTEX-LOCKED on `status_mutex_`.
+  void UpdateAppendedFileStatus() {
+    status_.appended_file_size = 0;
+    for (const Lane& lane : lanes_) {
+      status_.appended_file_size += lane.appended_file_size;
+    }
+    status_.appended_file_timestamp = lanes_.front().appended_file_timestamp;
+    PublishQueueCounters();
+  }
+
+  // Makes the counters of the status available to `GetQueueCounters()`. Once the status is ready,
+  // called after each change to it. MUTEX-LOCKED on `status_mutex_`, which makes it the only writer.
+  void PublishQueueCounters() {
+    if (!status_ready_) {
+      return;
+    }
+    T_TIMESTAMP oldest_timestamp = T_TIMESTAMP(0);
+    if (!status_.finalized.queue.empty()) {
+      // The queue is in the FIFO order within each lane, with more lanes the oldest file can be anywhere.
+      oldest_timestamp = status_.finalized.queue.front().timestamp;
+      if (lanes_.size() > 1u) {
+        for (const auto& file : status_.finalized.queue) {
+          oldest_timestamp = std::min(oldest_timestamp, file.timestamp);
+        }
+      }
+    }
+    const uint64_t version = counters_version_.load(std::memory_order_relaxed);
+    counters_version_.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    finalized_files_counter_.store(status_.finalized.queue.size(), std::memory_order_relaxed);
+    finalized_total_size_counter_.store(status_.finalized.total_size, std::memory_order_relaxed);
+    oldest_finalized_file_timestamp_counter_.store(oldest_timestamp, std::memory_order_relaxed);
+    appended_file_size_counter_.store(status_.appended_file_size, std::memory_order_relaxed);
+    pending_reclaim_size_counter_.store(status_.pending_reclaim_size, std::memory_order_relaxed);
+    files_in_process_counter_.store(files_in_process_.size(), std::memory_order_relaxed);
+    processing_suspended_counter_.store(processing_suspended_, std::memory_order_relaxed);
+    counters_version_.store(version + 2, std::memory_order_release);
+  }
+
+  // Wakes up the threads waiting for the status to change, or the task of the shared scheduler.
+  // MUTEX-LOCKED on `status_mutex_`.
+  void NotifyQueueStatusChanged() {
+    queue_status_condition_variable_.notify_all();
+    if (scheduler_) {
+      scheduler_->Wake(scheduler_task_);
+    }
+  }
+
+  // Appends the messages to the lane, splitting them into files as the finalization strategy dictates.
+  // Requires `append_mutex_` to be locked.
+  template <typename ITERATOR>
+  void AppendMessages(Lane& lane, ITERATOR begin, ITERATOR end, const T_TIMESTAMP now) {
+    uint64_t next_message_size_in_bytes = T_FILE_APPEND_STRATEGY::MessageSizeInBytes(*begin);
+    while (begin != end) {
+      // The range [begin, run_end) of messages to append to the current file, of `run_size_in_bytes` total.
+      ITERATOR run_end = begin;
+      uint64_t run_size_in_bytes = 0;
+      {
+        std::unique_lock<std::mutex> lock(status_mutex_);
+        // Take the size of the first message into consideration when making file finalization decision.
+        if (WouldFinalizeWith(lane, next_message_size_in_bytes, now)) {
+          FinalizeCurrentFile(lane, lock);
+        }
+        EnsureCurrentFileIsOpen(lane, now);
+        // Extend the run while the messages go into the same file: until the file should be finalized
+        // after the last message of the run, or before the next one.
+        while (run_end != end) {
+          run_size_in_bytes += next_message_size_in_bytes;
+          ++run_end;
+          if (run_end != end) {
+            next_message_size_in_bytes = T_FILE_APPEND_STRATEGY::MessageSizeInBytes(*run_end);
+          }
+          if (WouldFinalizeWith(lane, run_size_in_bytes, now) ||
+              (run_end != end &&
+               WouldFinalizeWith(lane, run_size_in_bytes + next_message_size_in_bytes, now))) {
+            break;
+          }
+        }
+      }
+      if (!lane.current_file || lane.current_file->bad()) {
+        T_ERROR_HANDLING_STRATEGY::HandleError();
+      }
+      // The file itself is only guarded by `append_mutex_`, the status is not locked while writing to it.
+      AppendRangeToFile(
+          lane, begin, run_end, typename AppendStrategyAppendsRanges<T_FILE_APPEND_STRATEGY>::type());
+      FlushAppendBuffer(lane, false);
+      {
+        std::unique_lock<std::mutex> lock(status_mutex_);
+        metrics_.messages_appended.Increment(static_cast<uint64_t>(std::distance(begin, run_end)));
+        metrics_.bytes_appended.Increment(run_size_in_bytes);
+        lane.appended_file_size += run_size_in_bytes;
+        UpdateAppendedFileStatus();
+        if (WouldFinalizeWith(lane, 0, now)) {
+          FinalizeCurrentFile(lane, lock);
+        }
+      }
+      begin = run_end;
+    }
+  }
+
+  // Compile-time detection of the optional `AdmitMessage()` method of the admission strategy,
+  // see `admission_strategy.h`. Without it, all the messages are appended, and none are copied.
+  template <typename T>
+  struct AdmissionStrategyIsSelective {
+    template <typename U>
+    static auto Test(U* strategy)
+        -> decltype(strategy->AdmitMessage(std::declval<const T_MESSAGE&>(),
+                                           std::declval<const Counters&>(),
+                                           std::declval<T_TIMESTAMP>(),
+                                           std::declval<std::vector<T_MESSAGE>&>()),
+                    std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+
+  // Appends the messages admitted by the admission strategy, preceded by the markers it adds, if any.
+  // Requires `append_mutex_` to be locked, which also guards the admission strategy and `admitted_messages_`.
+  template <typename ITERATOR>
+  void AdmitAndAppendMessages(
+      Lane& lane, ITERATOR begin, ITERATOR end, const T_TIMESTAMP now, std::false_type) {
+    AppendMessages(lane, begin, end, now);
+  }
+  template <typename ITERATOR>
+  void AdmitAndAppendMessages(
+      Lane& lane, ITERATOR begin, ITERATOR end, const T_TIMESTAMP now, std::true_type) {
+    const Counters counters = GetQueueCounters();
+    admitted_messages_.clear();
+    uint64_t rejected = 0;
+    for (ITERATOR it = begin; it != end; ++it) {
+      if (T_ADMISSION_STRATEGY::AdmitMessage(*it, counters, now, admitted_messages_)) {
+        admitted_messages_.push_back(*it);
+      } else {
+        ++rejected;
+      }
+    }
+    if (rejected) {
+      metrics_.messages_not_admitted.Increment(rejected);
+    }
+    if (!admitted_messages_.empty()) {
+      AppendMessages(lane, admitted_messages_.begin(), admitted_messages_.end(), now);
+    }
+  }
+
+  // Keeps the messages pushed before the startup scan is complete in memory,
+  // as long as there is room for them within `CONFIG::MaxMessagesBufferedUntilReady()`.
+  // Returns false if the messages should be appended once the status is ready instead.
+  // MUTEX-LOCKED on `status_mutex_`.
+  template <typename ITERATOR>
+  bool BufferMessagesUntilReady(std::unique_lock<std::mutex>& already_acquired_status_mutex_lock,
+                                size_t lane,
+                                ITERATOR begin,
+                                ITERATOR end) {
+    static_cast<void>(already_acquired_status_mutex_lock);
+    const size_t count = static_cast<size_t>(std::distance(begin, end));
+    if (status_ready_ || force_worker_thread_shutdown_ ||
+        buffered_until_ready_.size() + count > T_CONFIG::MaxMessagesBufferedUntilReady()) {
+      return false;
+    }
+    const T_TIMESTAMP now = time_manager_.Now();
+    for (ITERATOR it = begin; it != end; ++it) {
+      buffered_until_ready_.push_back(*it);
+      buffered_until_ready_timestamps_.push_back(now);
+      buffered_until_ready_lanes_.push_back(lane);
+    }
+    return true;
+  }
+
+  void JoinOrDetachThreads(bool detach) {
+    if (directory_watcher_) {
+      directory_watcher_->Interrupt();
+    }
+    if (watch_thread_.joinable()) {
+      detach ? watch_thread_.detach() : watch_thread_.join();
+    }
+    if (scheduler_) {
+      // The steps refer to this FSQ, thus are always waited for.
+      scheduler_->Unregister(scheduler_task_);
+    }
+    if (worker_thread_.joinable()) {
+      detach ? worker_thread_.detach() : worker_thread_.join();
+    }
+    for (auto& thread : processing_threads_) {
+      if (thread.joinable()) {
+        detach ? thread.detach() : thread.join();
+      }
+    }
+    if (transform_thread_.joinable()) {
+      detach ? transform_thread_.detach() : transform_thread_.join();
+    }
+    if (reclaim_thread_.joinable()) {
+      detach ? reclaim_thread_.detach() : reclaim_thread_.join();
+    }
+  }
+
+  // If the current file of the lane exists, declare it finalized, rename it under a permanent name
   // and notify the worker thread that a new file is available.
-  void FinalizeCurrentFile(std::unique_lock<std::mutex>& already_acquired_status_mutex_lock) {
-    if (current_file_) {
-      current_file_.reset(nullptr);
-      const std::string finalized_file_name =
-          T_FILE_NAMING_STRATEGY::finalized.GenerateFileName(status_.appended_file_timestamp);
-      FileInfo<T_TIMESTAMP> finalized_file_info(
-          finalized_file_name,
-          T_FILE_SYSTEM::JoinPath(working_directory_, finalized_file_name),
-          status_.appended_file_timestamp,
-          status_.appended_file_size);
-      T_FILE_SYSTEM::RenameFile(current_file_name_, finalized_file_info.full_path_name);
-      status_.finalized.queue.push_back(finalized_file_info);
-      status_.finalized.total_size += status_.appended_file_size;
-      status_.appended_file_size = 0;
-      status_.appended_file_timestamp = T_TIMESTAMP(0);
-      current_file_name_.clear();
+  // Requires both `append_mutex_` and `status_mutex_` to be locked.
+  void FinalizeCurrentFile(Lane& lane, std::unique_lock<std::mutex>& already_acquired_status_mutex_lock) {
+    if (lane.current_file) {
+      BRICKS_TRACE_SCOPE("FSQ::FinalizeCurrentFile");
+      CloseCurrentFile(lane, true);
+      T_TIMESTAMP timestamp = lane.appended_file_timestamp;
+      if (lane.has_last_finalized_file_timestamp && !(lane.last_finalized_file_timestamp < timestamp)) {
+        // Keep the names of finalized files unique, even if more than one is finalized within one time unit.
+        timestamp = lane.last_finalized_file_timestamp + T_TIME_SPAN(1);
+      }
+      lane.OnFileFinalized(MoveToFinalized(lane, lane.current_file_name, timestamp, lane.appended_file_size));
+      metrics_.files_finalized.Increment();
+      lane.appended_file_size = 0;
+      lane.appended_file_timestamp = T_TIMESTAMP(0);
+      lane.current_file_name.clear();
+      UpdateAppendedFileStatus();
       PurgeFilesAsNecessary(already_acquired_status_mutex_lock);
-      queue_status_condition_variable_.notify_all();
+      NotifyQueueStatusChanged();
+    }
+  }
+  void FinalizeCurrentFiles(std::unique_lock<std::mutex>& already_acquired_status_mutex_lock) {
+    for (Lane& lane : lanes_) {
+      FinalizeCurrentFile(lane, already_acquired_status_mutex_lock);
+    }
+  }
+
+  // Renames the file that is no longer appended to under its finalized name and queues it for processing.
+  // If finalized files are transformed, renames it under its intermediate name and queues it for the transform.
+  // Returns the timestamp of the file, later than `timestamp` if another process has taken the name already.
+  // MUTEX-LOCKED on `status_mutex_`, or called by the worker thread before the status is ready.
+  T_TIMESTAMP MoveToFinalized(const Lane& lane,
+                              const std::string& file_name,
+                              T_TIMESTAMP timestamp,
+                              uint64_t size) {
+    const bool transform = T_FINALIZED_FILE_TRANSFORM_STRATEGY::TransformsFinalizedFiles();
+    std::string finalized_file_name;
+    std::string finalized_full_path_name;
+    if (transform) {
+      // The finalizing files are of this process only.
+      finalized_file_name = lane.finalizing.GenerateFileName(timestamp);
+      finalized_full_path_name = FullPathName(finalized_file_name);
+      T_FILE_SYSTEM::RenameFile(file_name, finalized_full_path_name);
+    } else {
+      timestamp = RenameToFinalized(lane, file_name, timestamp, finalized_file_name, finalized_full_path_name);
+    }
+    FileInfo<T_TIMESTAMP> finalized_file_info(
+        std::move(finalized_file_name), std::move(finalized_full_path_name), timestamp, size);
+    finalized_file_info.lane = lane.index;
+    if (transform) {
+      files_to_transform_.push_back(std::move(finalized_file_info));
+    } else if (QueuesFinalizedFiles()) {
+      status_.finalized.queue.push_back(std::move(finalized_file_info));
+      status_.finalized.total_size += size;
+    }
+    return timestamp;
+  }
+
+  // Renames the file under the finalized name of the lane for `timestamp`, or, in a shared working directory,
+  // for the first timestamp from `timestamp` on no other process has taken yet. Returns the timestamp used,
+  // with the name and the full path name of the file in `output_file_name` and `output_full_path_name`.
+  T_TIMESTAMP RenameToFinalized(const Lane& lane,
+                                const std::string& file_name,
+                                T_TIMESTAMP timestamp,
+                                std::string& output_file_name,
+                                std::string& output_full_path_name) {
+    output_file_name = lane.finalized.GenerateFileName(timestamp);
+    output_full_path_name = FullPathName(output_file_name);
+    if (writer_name_.empty()) {
+      T_FILE_SYSTEM::RenameFile(file_name, output_full_path_name);
+    } else {
+      while (!RenameFileUnlessExists(file_name,
+                                     output_full_path_name,
+                                     typename FileSystemRenamesUnlessExists<T_FILE_SYSTEM>::type())) {
+        timestamp = timestamp + T_TIME_SPAN(1);
+        output_file_name = lane.finalized.GenerateFileName(timestamp);
+        output_full_path_name = FullPathName(output_file_name);
+      }
+    }
+    return timestamp;
+  }
+
+  std::string FullPathName(const std::string& file_name) const {
+    return T_FILE_SYSTEM::JoinPath(working_directory_, file_name);
+  }
+
+  // Compile-time detection of the optional `RenameFileUnlessExists()` of the file system.
+  template <typename T>
+  struct FileSystemRenamesUnlessExists {
+    template <typename U>
+    static auto Test(U*) -> decltype(static_cast<bool>(U::RenameFileUnlessExists(std::string(), std::string())),
+                                     std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+  static bool RenameFileUnlessExists(const std::string& old_name,
+                                     const std::string& new_name,
+                                     std::true_type) {
+    return T_FILE_SYSTEM::RenameFileUnlessExists(old_name, new_name);
+  }
+  static bool RenameFileUnlessExists(const std::string& old_name,
+                                     const std::string& new_name,
+                                     std::false_type) {
+    if (T_FILE_SYSTEM::FileExists(new_name)) {
+      return false;
+    }
+    T_FILE_SYSTEM::RenameFile(old_name, new_name);
+    return true;
+  }
+
+  // Whether the finalized files are queued: always, but in a shared working directory, where only the holder
+  // of the lease queues them, those of all the processes. MUTEX-LOCKED on `status_mutex_`.
+  bool QueuesFinalizedFiles() const {
+    return writer_name_.empty() || holds_lease_;
+  }
+
+  std::string WriterLockFileName(const std::string& writer) const {
+    return T_FILE_SYSTEM::JoinPath(working_directory_,
+                                   T_FILE_NAMING_STRATEGY::writer_lock_file_prefix + writer +
+                                       T_FILE_NAMING_STRATEGY::writer_lock_file_suffix);
+  }
+
+  // The thread transforming finalized files, if `T_FINALIZED_FILE_TRANSFORM_STRATEGY` does, in the FIFO order.
+  // The transform is written into a temporary file, which is then atomically renamed under the finalized name.
+  // Once the transformed file is queued for processing, the intermediate file is removed.
+  void TransformThread() {
+    while (true) {
+      FileInfo<T_TIMESTAMP> input_file("", "", T_TIMESTAMP(0), 0);
+      {
+        std::unique_lock<std::mutex> lock(status_mutex_);
+        const auto predicate = [this]() {
+          return force_worker_thread_shutdown_ || (status_ready_ && !files_to_transform_.empty());
+        };
+        queue_status_condition_variable_.wait(lock, predicate);
+        if (force_worker_thread_shutdown_) {
+          // The files not yet transformed are kept under their intermediate names, to be picked up on startup.
+          return;
+        }
+        input_file = std::move(files_to_transform_.front());
+        files_to_transform_.pop_front();
+      }
+      // Named after the intermediate file, which is of this process only in a shared working directory.
+      const std::string temporary_full_path_name = input_file.full_path_name + ".tmp";
+      if (T_FINALIZED_FILE_TRANSFORM_STRATEGY::TransformFinalizedFile(input_file.full_path_name,
+                                                                       temporary_full_path_name)) {
+        const Lane& lane = lanes_[input_file.lane];
+        const uint64_t size = T_FILE_SYSTEM::GetFileSize(temporary_full_path_name);
+        {
+          std::unique_lock<std::mutex> lock(status_mutex_);
+          // Renamed within the locked section, for `OnFileAppeared()` to find the file queued already.
+          std::string output_file_name;
+          std::string output_full_path_name;
+          const T_TIMESTAMP timestamp = RenameToFinalized(
+              lane, temporary_full_path_name, input_file.timestamp, output_file_name, output_full_path_name);
+          FileInfo<T_TIMESTAMP> output_file(
+              std::move(output_file_name), std::move(output_full_path_name), timestamp, size);
+          output_file.lane = lane.index;
+          if (QueuesFinalizedFiles()) {
+            status_.finalized.queue.push_back(std::move(output_file));
+            status_.finalized.total_size += size;
+            PurgeFilesAsNecessary(lock);
+          }
+          NotifyQueueStatusChanged();
+        }
+        T_FILE_SYSTEM::RemoveFile(input_file.full_path_name, bricks::RemoveFileParameters::Silent);
+      } else {
+        // Keep the intermediate file, the transform is re-attempted on the next startup.
+        T_FILE_SYSTEM::RemoveFile(temporary_full_path_name, bricks::RemoveFileParameters::Silent);
+      }
+    }
+  }
+
+  // Whether the finalization strategy would finalize the current file of the lane
+  // if it had `extra_size_in_bytes` more. The strategy sees the status with the current file of this lane.
+  // MUTEX-LOCKED on `status_mutex_`.
+  bool WouldFinalizeWith(const Lane& lane, uint64_t extra_size_in_bytes, const T_TIMESTAMP now) {
+    const uint64_t save_appended_file_size = status_.appended_file_size;
+    const T_TIMESTAMP save_appended_file_timestamp = status_.appended_file_timestamp;
+    status_.appended_file_size = lane.appended_file_size + extra_size_in_bytes;
+    status_.appended_file_timestamp = lane.appended_file_timestamp;
+    const bool should_finalize = T_FINALIZE_STRATEGY::ShouldFinalize(status_, now);
+    status_.appended_file_size = save_appended_file_size;
+    status_.appended_file_timestamp = save_appended_file_timestamp;
+    return should_finalize;
+  }
+
+  // Compile-time detection of the optional `AppendToFile(file, begin, end)` method of the file append strategy.
+  template <typename T>
+  struct AppendStrategyAppendsRanges {
+    template <typename U>
+    static auto Test(const U* strategy)
+        -> decltype(strategy->AppendToFile(std::declval<typename T_FILE_SYSTEM::OutputFile&>(),
+                                           static_cast<const T_MESSAGE*>(nullptr),
+                                           static_cast<const T_MESSAGE*>(nullptr)),
+                    std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+
+  template <typename ITERATOR>
+  void AppendRangeToFile(Lane& lane, ITERATOR begin, ITERATOR end, std::true_type) {
+    T_FILE_APPEND_STRATEGY::AppendToFile(*lane.current_file.get(), begin, end);
+  }
+  template <typename ITERATOR>
+  void AppendRangeToFile(Lane& lane, ITERATOR begin, ITERATOR end, std::false_type) {
+    for (ITERATOR it = begin; it != end; ++it) {
+      T_FILE_APPEND_STRATEGY::AppendToFile(*lane.current_file.get(), *it);
+    }
+  }
+
+  // Compile-time detection of the optional `FlushAppendBuffer()` method of the file append strategy.
+  template <typename T>
+  struct AppendStrategyIsBuffered {
+    template <typename U>
+    static auto Test(const U* strategy)
+        -> decltype(strategy->FlushAppendBuffer(std::declval<typename T_FILE_SYSTEM::OutputFile&>(),
+                                                std::declval<const std::string&>(),
+                                                false),
+                    std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+
+  void FlushAppendBuffer(Lane& lane, bool force) {
+    if (lane.current_file) {
+      FlushAppendBuffer(lane, force, typename AppendStrategyIsBuffered<T_FILE_APPEND_STRATEGY>::type());
+    }
+  }
+  void FlushAppendBuffer(Lane& lane, bool force, std::true_type) {
+    T_FILE_APPEND_STRATEGY::FlushAppendBuffer(*lane.current_file.get(), lane.current_file_name, force);
+  }
+  void FlushAppendBuffer(Lane&, bool, std::false_type) {
+  }
+
+  // Compile-time detection of the optional `Preallocate()`, `DropFromPageCache()`
+  // and `DropFromPageCacheEvery()` of the output file, see `bricks::PosixOutputFile`.
+  template <typename T>
+  struct OutputFileCanBePreallocated {
+    template <typename U>
+    static auto Test(U* file) -> decltype(file->Preallocate(static_cast<uint64_t>(0)), std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+  template <typename T>
+  struct OutputFileCanBeDroppedFromPageCache {
+    template <typename U>
+    static auto Test(U* file) -> decltype(file->DropFromPageCache(), std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+
+  template <typename T>
+  struct OutputFileCanBeDroppedFromPageCacheAsItGrows {
+    template <typename U>
+    static auto Test(U* file)
+        -> decltype(file->DropFromPageCacheEvery(static_cast<uint64_t>(0)), std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+
+  void DropCurrentFileFromPageCacheAsItGrows(Lane& lane, std::true_type) {
+    if (T_CONFIG::DropAppendedDataFromPageCacheEvery()) {
+      lane.current_file->DropFromPageCacheEvery(T_CONFIG::DropAppendedDataFromPageCacheEvery());
+    }
+  }
+  void DropCurrentFileFromPageCacheAsItGrows(Lane&, std::false_type) {
+  }
+
+  void PreallocateCurrentFile(Lane& lane, std::true_type) {
+    if (T_CONFIG::PreallocatedFileSize()) {
+      lane.current_file->Preallocate(T_CONFIG::PreallocatedFileSize());
+    }
+  }
+  void PreallocateCurrentFile(Lane&, std::false_type) {
+  }
+
+  void DropCurrentFileFromPageCache(Lane& lane, std::true_type) {
+    if (T_CONFIG::DropFinalizedFilesFromPageCache()) {
+      lane.current_file->DropFromPageCache();
+    }
+  }
+  void DropCurrentFileFromPageCache(Lane&, std::false_type) {
+  }
+
+  // Writes out what the append strategy may have buffered, and closes the current file of the lane, if any.
+  // The file that is being finalized may also be dropped from the page cache.
+  void CloseCurrentFile(Lane& lane, bool finalizing = false) {
+    FlushAppendBuffer(lane, true);
+    if (finalizing && lane.current_file) {
+      DropCurrentFileFromPageCache(
+          lane, typename OutputFileCanBeDroppedFromPageCache<typename T_FILE_SYSTEM::OutputFile>::type());
+    }
+    lane.current_file.reset(nullptr);
+  }
+
+  // Compile-time detection of the optional `OnMappedFileReady()` method of the processor.
+  template <typename T>
+  struct ProcessorAcceptsMappedFiles {
+    template <typename U>
+    static auto Test(U* processor)
+        -> decltype(static_cast<FileProcessingResult>(
+                        processor->OnMappedFileReady(std::declval<const FileInfo<T_TIMESTAMP>&>(),
+                                                     static_cast<const char*>(nullptr),
+                                                     static_cast<size_t>(0),
+                                                     std::declval<T_TIMESTAMP>())),
+                    std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+
+  FileProcessingResult ProcessFile(const FileInfo<T_TIMESTAMP>& file_info, std::false_type) {
+    return processor_.OnFileReady(file_info, time_manager_.Now());
+  }
+  FileProcessingResult ProcessFile(const FileInfo<T_TIMESTAMP>& file_info, std::true_type) {
+    std::unique_ptr<typename T_FILE_SYSTEM::MappedFile> mapped_file;
+    try {
+      mapped_file.reset(new typename T_FILE_SYSTEM::MappedFile(file_info.full_path_name));
+    } catch (const bricks::FileException&) {
+      return FileProcessingResult::FailureNeedRetry;
+    }
+    // The mapping is released as `mapped_file` goes out of scope, right after the processor returns.
+    return processor_.OnMappedFileReady(
+        file_info, mapped_file->data(), mapped_file->size(), time_manager_.Now());
+  }
+
+  // Compile-time detection of the optional `OnFileReadyFromOffset()` method of the processor.
+  template <typename T>
+  struct ProcessorResumesFromOffset {
+    template <typename U>
+    static auto Test(U* processor)
+        -> decltype(static_cast<FileProcessingResult>(processor->OnFileReadyFromOffset(
+                        std::declval<const FileInfo<T_TIMESTAMP>&>(), std::declval<uint64_t&>(),
+                        std::declval<T_TIMESTAMP>())),
+                    std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+
+  FileProcessingResult ProcessFileFromOffset(const FileInfo<T_TIMESTAMP>& file_info, std::false_type) {
+    return ProcessFile(file_info, typename ProcessorAcceptsMappedFiles<T_PROCESSOR>::type());
+  }
+  // Only called by the thread processing the file, thus the offset file is not guarded by the mutex.
+  FileProcessingResult ProcessFileFromOffset(const FileInfo<T_TIMESTAMP>& file_info, std::true_type) {
+    const std::string offset_file_name = OffsetFileName(file_info.full_path_name);
+    uint64_t saved_offset = 0;
+    if (T_FILE_SYSTEM::FileExists(offset_file_name)) {
+      try {
+        saved_offset = bricks::strings::FixedSizeSerializer<uint64_t>::UnpackFromString(
+            T_FILE_SYSTEM::ReadFileAsString(offset_file_name));
+      } catch (const bricks::FileException&) {
+      }
+      if (saved_offset > file_info.size) {
+        // Not the file the offset was saved for, start over.
+        saved_offset = 0;
+      }
+    }
+    uint64_t offset = saved_offset;
+    const FileProcessingResult result =
+        processor_.OnFileReadyFromOffset(file_info, offset, time_manager_.Now());
+    if (result == FileProcessingResult::Success || result == FileProcessingResult::SuccessAndMoved) {
+      if (saved_offset) {
+        T_FILE_SYSTEM::RemoveFile(offset_file_name, bricks::RemoveFileParameters::Silent);
+      }
+    } else if (offset > saved_offset && offset <= file_info.size) {
+      try {
+        // Losing the offset only costs re-sending the bytes, thus it is not synced to disk.
+        T_FILE_SYSTEM::WriteFileAtomically(offset_file_name,
+                                           bricks::strings::PackToString(offset),
+                                           bricks::WriteFileAtomicallyParameters::NoSync);
+      } catch (const bricks::FileException&) {
+      }
+    }
+    return result;
+  }
+
+  std::string OffsetFileName(const std::string& full_path_name) const {
+    return full_path_name + T_FILE_NAMING_STRATEGY::offset_file_suffix;
+  }
+
+  // Removes the offset saved for the file, if the processor saves them.
+  void RemoveOffsetFile(const std::string& full_path_name) {
+    if (ProcessorResumesFromOffset<T_PROCESSOR>::type::value) {
+      T_FILE_SYSTEM::RemoveFile(OffsetFileName(full_path_name), bricks::RemoveFileParameters::Silent);
     }
   }
 
+  // Compile-time detection of the optional `OnFilesReady()` method of the processor.
+  template <typename T>
+  struct ProcessorAcceptsBatches {
+    template <typename U>
+    static auto Test(U* processor)
+        -> decltype(static_cast<std::vector<FileProcessingResult>>(
+                        processor->OnFilesReady(std::declval<const std::vector<FileInfo<T_TIMESTAMP>>&>(),
+                                                std::declval<T_TIMESTAMP>())),
+                    std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+
+  // Without `OnFilesReady()`, the batch is always of one file.
+  std::vector<FileProcessingResult> ProcessFiles(const std::vector<FileInfo<T_TIMESTAMP>>& files,
+                                                 std::false_type) {
+    return std::vector<FileProcessingResult>(
+        1, ProcessFileFromOffset(files.front(), typename ProcessorResumesFromOffset<T_PROCESSOR>::type()));
+  }
+  std::vector<FileProcessingResult> ProcessFiles(const std::vector<FileInfo<T_TIMESTAMP>>& files,
+                                                 std::true_type) {
+    std::vector<FileProcessingResult> results = processor_.OnFilesReady(files, time_manager_.Now());
+    if (results.size() != files.size()) {
+      T_ERROR_HANDLING_STRATEGY::HandleError();
+    }
+    return results;
+  }
+
   // Scans the directory for the files that match certain predicate.
-  // Gets their sized and and extracts timestamps from their names along the way.
+  // Gets their sizes and extracts timestamps from their names along the way.
+  // The entries other than regular files, such as directories named as the files of the queue, are skipped.
   template <typename F>
   std::vector<FileInfo<T_TIMESTAMP>> ScanDir(F f) const {
     std::vector<FileInfo<T_TIMESTAMP>> matched_files_list;
-    const auto& dir = working_directory_;
-    T_FILE_SYSTEM::ScanDir(working_directory_,
-                           [this, &matched_files_list, &f, dir](const std::string& file_name) {
-      // if (T_FILE_NAMING_STRATEGY::template IsFinalizedFileName<T_TIMESTAMP>(file_name)) {
-      T_TIMESTAMP timestamp;
-      if (f(file_name, &timestamp)) {
-        matched_files_list.emplace_back(file_name,
-                                        T_FILE_SYSTEM::JoinPath(working_directory_, file_name),
-                                        timestamp,
-                                        T_FILE_SYSTEM::GetFileSize(T_FILE_SYSTEM::JoinPath(dir, file_name)));
-      }
-    });
+    std::string file_name;
+    T_FILE_SYSTEM::ScanDirEntriesUntil(
+        working_directory_,
+        [this, &matched_files_list, &f, &file_name](const typename T_FILE_SYSTEM::DirectoryEntry& entry) {
+          file_name.assign(entry.name, entry.name_length);
+          T_TIMESTAMP timestamp;
+          if (f(file_name, &timestamp) && entry.IsRegularFile()) {
+            matched_files_list.emplace_back(
+                file_name, T_FILE_SYSTEM::JoinPath(working_directory_, file_name), timestamp, entry.Size());
+          }
+          return true;
+        });
     std::sort(matched_files_list.begin(), matched_files_list.end());
     return matched_files_list;
   }
 
-  // EnsureCurrentFileIsOpen() expires the current file and/or creates the new one as necessary.
-  void EnsureCurrentFileIsOpen(const T_TIMESTAMP now) {
-    if (!current_file_) {
-      current_file_name_ =
-          T_FILE_SYSTEM::JoinPath(working_directory_, T_FILE_NAMING_STRATEGY::current.GenerateFileName(now));
-      // TODO(dkorolev): This relies on OutputFile being std::ofstream. Fine for now anyway.
-      current_file_.reset(new typename T_FILE_SYSTEM::OutputFile(current_file_name_,
-                                                                 std::ofstream::trunc | std::ofstream::binary));
-      status_.appended_file_timestamp = now;
+  // EnsureCurrentFileIsOpen() expires the current file of the lane and/or creates the new one as necessary.
+  // MUTEX-LOCKED on `status_mutex_`, as well as `append_mutex_`.
+  void EnsureCurrentFileIsOpen(Lane& lane, const T_TIMESTAMP now) {
+    if (!lane.current_file) {
+      lane.current_file_name = T_FILE_SYSTEM::JoinPath(working_directory_, lane.current.GenerateFileName(now));
+      // A spare file is empty, and opening it for appending keeps the disk space reserved for it.
+      const bool recycled = !spare_files_.empty();
+      if (recycled) {
+        T_FILE_SYSTEM::RenameFile(spare_files_.front().full_path_name, lane.current_file_name);
+        spare_files_.pop_front();
+      }
+      // `OutputFile` is constructed from the file name and the `std::ios_base` open mode, as `std::ofstream`.
+      lane.current_file.reset(new typename T_FILE_SYSTEM::OutputFile(
+          lane.current_file_name,
+          (recycled ? std::ofstream::app : std::ofstream::trunc) | std::ofstream::binary));
+      if (!recycled) {
+        PreallocateCurrentFile(
+            lane, typename OutputFileCanBePreallocated<typename T_FILE_SYSTEM::OutputFile>::type());
+      }
+      typedef typename OutputFileCanBeDroppedFromPageCacheAsItGrows<typename T_FILE_SYSTEM::OutputFile>::type
+          T_CAN_DROP_AS_IT_GROWS;
+      DropCurrentFileFromPageCacheAsItGrows(lane, T_CAN_DROP_AS_IT_GROWS());
+      lane.appended_file_timestamp = now;
+      UpdateAppendedFileStatus();
     }
   }
 
-  // Purges the old files as necessary.
+  // Rate-limiting retry strategies are told the size of each processed file, via `OnSuccess(size)`.
+  template <typename T>
+  struct RetryStrategyAccountsProcessedBytes {
+    template <typename U>
+    static auto Test(U* strategy) -> decltype(strategy->OnSuccess(uint64_t(0)), std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+  void OnProcessingSuccess(const FileInfo<T_TIMESTAMP>&, std::false_type) {
+    T_RETRY_STRATEGY_INSTANCE::OnSuccess();
+  }
+  void OnProcessingSuccess(const FileInfo<T_TIMESTAMP>& file, std::true_type) {
+    T_RETRY_STRATEGY_INSTANCE::OnSuccess(file.size);
+  }
+
+  // Retry strategies shared by several FSQ-s, such as `CircuitBreakerRetryStrategy`, resume all of them
+  // once the destination is back, via `SubscribeToResumption()` and `BroadcastPendingResumption()`.
+  template <typename T>
+  struct RetryStrategyResumesQueues {
+    template <typename U>
+    static auto Test(U* strategy)
+        -> decltype(strategy->SubscribeToResumption(std::function<void()>()), std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+  void SubscribeToResumption(std::true_type) {
+    T_RETRY_STRATEGY_INSTANCE::SubscribeToResumption([this]() { ResumeProcessing(); });
+  }
+  void SubscribeToResumption(std::false_type) {
+  }
+  void UnsubscribeFromResumption(std::true_type) {
+    T_RETRY_STRATEGY_INSTANCE::UnsubscribeFromResumption();
+  }
+  void UnsubscribeFromResumption(std::false_type) {
+  }
+  // Not MUTEX-LOCKED: the other queues are resumed with their own mutexes, this one included.
+  void BroadcastPendingResumption(std::true_type) {
+    T_RETRY_STRATEGY_INSTANCE::BroadcastPendingResumption();
+  }
+  void BroadcastPendingResumption(std::false_type) {
+  }
+
+  // Adaptive finalization strategies are told how long each successfully processed file took to process,
+  // via `OnFileProcessed(file, started, completed)`. See `adaptive_finalization_strategy.h`.
+  template <typename T>
+  struct FinalizeStrategyObservesProcessing {
+    template <typename U>
+    static auto Test(U* strategy)
+        -> decltype(strategy->OnFileProcessed(std::declval<const FileInfo<T_TIMESTAMP>&>(),
+                                              std::declval<T_TIMESTAMP>(),
+                                              std::declval<T_TIMESTAMP>()),
+                    std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+  // MUTEX-LOCKED on `status_mutex_`.
+  void OnFileProcessed(const FileInfo<T_TIMESTAMP>&, const T_TIMESTAMP, const T_TIMESTAMP, std::false_type) {
+  }
+  void OnFileProcessed(const FileInfo<T_TIMESTAMP>& file,
+                       const T_TIMESTAMP started,
+                       const T_TIMESTAMP completed,
+                       std::true_type) {
+    T_FINALIZE_STRATEGY::OnFileProcessed(file, started, completed);
+  }
+
+  // Compile-time detection of the optional `ValidPrefixLength(data, length)` of the resume strategy,
+  // used to truncate the current files found on disk to their last valid record. See `framed_records.h`.
+  template <typename T>
+  struct ResumeStrategyRecoversCurrentFiles {
+    template <typename U>
+    static auto Test(U*) -> decltype(U::ValidPrefixLength(static_cast<const char*>(nullptr), size_t(0)),
+                                     std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+  void RecoverCurrentFile(FileInfo<T_TIMESTAMP>&, std::false_type) {
+  }
+  void RecoverCurrentFile(FileInfo<T_TIMESTAMP>& file, std::true_type) {
+    uint64_t valid_size = 0;
+    try {
+      const typename T_FILE_SYSTEM::MappedFile mapped(file.full_path_name);
+      valid_size = T_FILE_RESUME_STRATEGY::ValidPrefixLength(mapped.data(), mapped.size());
+    } catch (const bricks::FileException&) {
+      return;
+    }
+    if (valid_size < file.size) {
+      T_FILE_SYSTEM::TruncateFile(file.full_path_name, valid_size);
+      file.size = valid_size;
+    }
+  }
+
+  // Compile-time detection of the optional `RecycleFile(file_name, new_file_name)` of the file system.
+  template <typename T>
+  struct FileSystemRecyclesFiles {
+    template <typename U>
+    static auto Test(U*) -> decltype(U::RecycleFile(std::string(), std::string()), std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+
+  static bool RecyclesFiles() {
+    return T_CONFIG::RecycledFilesPoolSize() && FileSystemRecyclesFiles<T_FILE_SYSTEM>::type::value;
+  }
+
+  // Removes the processed file, or turns it into a spare one, if the pool of spare files is not full.
+  // MUTEX-LOCKED on `status_mutex_`.
+  void RemoveOrRecycleFile(const FileInfo<T_TIMESTAMP>& file) {
+    if (RecyclesFiles() && spare_files_.size() < T_CONFIG::RecycledFilesPoolSize()) {
+      const std::string spare_file_name = T_FILE_NAMING_STRATEGY::spare.GenerateFileName(file.timestamp);
+      const FileInfo<T_TIMESTAMP> spare_file(
+          spare_file_name, T_FILE_SYSTEM::JoinPath(working_directory_, spare_file_name), file.timestamp, 0);
+      RecycleFile(file.full_path_name,
+                  spare_file.full_path_name,
+                  typename FileSystemRecyclesFiles<T_FILE_SYSTEM>::type());
+      spare_files_.push_back(spare_file);
+    } else {
+      T_FILE_SYSTEM::RemoveFile(file.full_path_name);
+    }
+  }
+  void RecycleFile(const std::string& file_name, const std::string& spare_file_name, std::true_type) {
+    T_FILE_SYSTEM::RecycleFile(file_name, spare_file_name);
+  }
+  void RecycleFile(const std::string&, const std::string&, std::false_type) {
+  }
+
+  // Compile-time detection of the optional `PrefetchFile(file_name)` of the file system.
+  template <typename T>
+  struct FileSystemPrefetchesFiles {
+    template <typename U>
+    static auto Test(U*) -> decltype(U::PrefetchFile(std::string()), std::true_type());
+    template <typename U>
+    static std::false_type Test(...);
+    typedef decltype(Test<T>(nullptr)) type;
+  };
+
+  // The names of up to `CONFIG::PrefetchedFilesAhead()` oldest finalized files not being processed,
+  // the ones likely to be processed next. MUTEX-LOCKED on `status_mutex_`.
+  std::vector<std::string> FilesToPrefetch() const {
+    std::vector<std::string> files;
+    if (FileSystemPrefetchesFiles<T_FILE_SYSTEM>::type::value) {
+      for (auto it = status_.finalized.queue.begin();
+           it != status_.finalized.queue.end() && files.size() < T_CONFIG::PrefetchedFilesAhead();
+           ++it) {
+        if (!IsInProcess(*it)) {
+          files.push_back(it->full_path_name);
+        }
+      }
+    }
+    return files;
+  }
+  void PrefetchFiles(const std::vector<std::string>& files, std::true_type) {
+    for (const std::string& file : files) {
+      T_FILE_SYSTEM::PrefetchFile(file);
+    }
+  }
+  void PrefetchFiles(const std::vector<std::string>&, std::false_type) {
+  }
+
+  // Purges the old files as necessary, those of the lowest priority lane first.
+  // The files being processed are left alone.
   void PurgeFilesAsNecessary(std::unique_lock<std::mutex>& already_acquired_status_mutex_lock) {
     static_cast<void>(already_acquired_status_mutex_lock);
-    while (!status_.finalized.queue.empty() && T_PURGE_STRATEGY::ShouldPurge(status_)) {
-      const std::string filename = status_.finalized.queue.front().full_path_name;
-      status_.finalized.total_size -= status_.finalized.queue.front().size;
-      status_.finalized.queue.pop_front();
-      T_FILE_SYSTEM::RemoveFile(filename);
+    while (T_PURGE_STRATEGY::ShouldPurge(status_)) {
+      const auto oldest = NextFileToPurge();
+      if (oldest == status_.finalized.queue.end()) {
+        break;
+      }
+      status_.finalized.total_size -= oldest->size;
+      if (T_CONFIG::ReclaimPurgedFilesInBackground()) {
+        status_.pending_reclaim_size += oldest->size;
+        files_to_reclaim_.push_back(*oldest);
+        status_.finalized.queue.erase(oldest);
+        NotifyQueueStatusChanged();
+      } else {
+        const std::string filename = oldest->full_path_name;
+        status_.finalized.queue.erase(oldest);
+        T_FILE_SYSTEM::RemoveFile(filename);
+        RemoveOffsetFile(filename);
+      }
     }
+    PublishQueueCounters();
   }
 
-  // The worker thread first scans the directory for present finalized and current files.
+  // The thread removing purged files from disk, if `CONFIG::ReclaimPurgedFilesInBackground()`.
+  // On shutdown, the files purged so far are removed before the thread terminates.
+  void ReclaimThread() {
+    while (true) {
+      // Only the name is needed, the file stays in the queue to be reclaimed until it is removed.
+      std::string full_path_name;
+      {
+        std::unique_lock<std::mutex> lock(status_mutex_);
+        const auto predicate = [this]() { return force_worker_thread_shutdown_ || !files_to_reclaim_.empty(); };
+        queue_status_condition_variable_.wait(lock, predicate);
+        if (files_to_reclaim_.empty()) {
+          return;
+        }
+        full_path_name = files_to_reclaim_.front().full_path_name;
+      }
+      T_FILE_SYSTEM::RemoveFile(full_path_name, bricks::RemoveFileParameters::Silent);
+      RemoveOffsetFile(full_path_name);
+      {
+        std::unique_lock<std::mutex> lock(status_mutex_);
+        if (!files_to_reclaim_.empty()) {
+          status_.pending_reclaim_size -= files_to_reclaim_.front().size;
+          files_to_reclaim_.pop_front();
+          PublishQueueCounters();
+        }
+      }
+    }
+  }
+
+  typedef typename FinalizedFilesStatus::T_QUEUE::iterator QueueIterator;
+
+  // The finalized files `Replay()` goes over, see above. Waits for the startup scan.
+  std::vector<FileInfo<T_TIMESTAMP>> FilesToReplay(T_TIMESTAMP from, T_TIMESTAMP to) const {
+    std::unique_lock<std::mutex> lock(status_mutex_);
+    while (!status_ready_) {
+      queue_status_condition_variable_.wait(lock);
+      if (force_worker_thread_shutdown_) {
+        T_ERROR_HANDLING_STRATEGY::HandleError();
+      }
+    }
+    const typename FinalizedFilesStatus::T_QUEUE& queue = status_.finalized.queue;
+    std::vector<FileInfo<T_TIMESTAMP>> files;
+    if (!(from < to)) {
+      return files;
+    }
+    if (lanes_.size() == 1 && writer_name_.empty()) {
+      const auto end = std::lower_bound(
+          queue.begin(), queue.end(), to, [](const FileInfo<T_TIMESTAMP>& file, const T_TIMESTAMP timestamp) {
+            return file.timestamp < timestamp;
+          });
+      auto begin = std::upper_bound(
+          queue.begin(), end, from, [](const T_TIMESTAMP timestamp, const FileInfo<T_TIMESTAMP>& file) {
+            return timestamp < file.timestamp;
+          });
+      if (begin != queue.begin()) {
+        --begin;
+      }
+      files.assign(begin, end);
+    } else {
+      // The file of each lane the range starts within is the last one with a timestamp not after `from`.
+      std::vector<const FileInfo<T_TIMESTAMP>*> first(lanes_.size(), nullptr);
+      for (const FileInfo<T_TIMESTAMP>& file : queue) {
+        if (!(from < file.timestamp) && (!first[file.lane] || first[file.lane]->timestamp < file.timestamp)) {
+          first[file.lane] = &file;
+        }
+      }
+      for (const FileInfo<T_TIMESTAMP>& file : queue) {
+        if (file.timestamp < to && (from < file.timestamp || first[file.lane] == &file)) {
+          files.push_back(file);
+        }
+      }
+    }
+    return files;
+  }
+
+  // MUTEX-LOCKED on `status_mutex_`.
+  bool IsInProcess(const FileInfo<T_TIMESTAMP>& file) const {
+    return std::find(files_in_process_.begin(), files_in_process_.end(), file) != files_in_process_.end();
+  }
+
+  // The next finalized file to process, the oldest one of the lane picked by `T_LANE_SCHEDULING_STRATEGY`
+  // out of the files not being processed by another thread, or `queue.end()` if there is none.
+  // MUTEX-LOCKED on `status_mutex_`.
+  QueueIterator NextFileToProcess() {
+    const QueueIterator end = status_.finalized.queue.end();
+    std::vector<QueueIterator> oldest(lanes_.size(), end);
+    std::vector<bool> lane_has_files(lanes_.size(), false);
+    bool has_files = false;
+    for (QueueIterator it = status_.finalized.queue.begin(); it != end; ++it) {
+      if (!lane_has_files[it->lane] && !IsInProcess(*it)) {
+        oldest[it->lane] = it;
+        lane_has_files[it->lane] = true;
+        has_files = true;
+        if (lanes_.size() == 1u) {
+          break;
+        }
+      }
+    }
+    return has_files ? oldest[T_LANE_SCHEDULING_STRATEGY::PickLane(lane_has_files)] : end;
+  }
+
+  // The batch of files to process starting from `first`: with `OnFilesReady()`, the files of its lane
+  // not being processed, in the order of the queue, within the limits of `CONFIG::MaxFilesPerBatch()`
+  // and `CONFIG::MaxBytesPerBatch()`, otherwise `first` alone. MUTEX-LOCKED on `status_mutex_`.
+  std::vector<FileInfo<T_TIMESTAMP>> NextBatchToProcess(QueueIterator first) {
+    std::vector<FileInfo<T_TIMESTAMP>> batch(1, *first);
+    if (ProcessorAcceptsBatches<T_PROCESSOR>::type::value) {
+      uint64_t total_size = first->size;
+      for (QueueIterator it = std::next(first);
+           it != status_.finalized.queue.end() && batch.size() < T_CONFIG::MaxFilesPerBatch();
+           ++it) {
+        if (it->lane == first->lane && !IsInProcess(*it)) {
+          if (total_size + it->size > T_CONFIG::MaxBytesPerBatch()) {
+            break;
+          }
+          total_size += it->size;
+          batch.push_back(*it);
+        }
+      }
+    }
+    return batch;
+  }
+
+  // The oldest finalized file of the lowest priority lane, out of the files not being processed,
+  // or `queue.end()` if there is none. MUTEX-LOCKED on `status_mutex_`.
+  QueueIterator NextFileToPurge() {
+    const QueueIterator end = status_.finalized.queue.end();
+    QueueIterator result = end;
+    for (QueueIterator it = status_.finalized.queue.begin(); it != end; ++it) {
+      if ((result == end || result->lane < it->lane) && !IsInProcess(*it)) {
+        result = it;
+        if (lanes_.size() == 1u) {
+          break;
+        }
+      }
+    }
+    return result;
+  }
+
+  typedef std::vector<FileInfo<T_TIMESTAMP>> FileInfoVector;
+
+  // Parses the name of a file of any lane, given the member of `Lane` with the naming schema of such files.
+  bool ParseFileNameOfAnyLane(FileNamingSchema Lane::*schema,
+                              const std::string& file_name,
+                              T_TIMESTAMP* output_timestamp,
+                              size_t* output_lane) const {
+    for (const Lane& lane : lanes_) {
+      if ((lane.*schema).ParseFileName(file_name, output_timestamp)) {
+        *output_lane = lane.index;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Scans the directory for the files of all the lanes named as per `schema`, see `ScanDir()`.
+  FileInfoVector ScanDirForFilesOfAllLanes(FileNamingSchema Lane::*schema) const {
+    FileInfoVector files = ScanDir([this, schema](const std::string& s, T_TIMESTAMP* t) {
+      size_t lane;
+      return ParseFileNameOfAnyLane(schema, s, t, &lane);
+    });
+    for (auto& file : files) {
+      T_TIMESTAMP timestamp;
+      ParseFileNameOfAnyLane(schema, file.name, &timestamp, &file.lane);
+    }
+    return files;
+  }
+
+  std::string QueueManifestFileName() const {
+    return T_FILE_SYSTEM::JoinPath(working_directory_, T_FILE_NAMING_STRATEGY::manifest_file_name);
+  }
+
+  // The manifest lists the queued files, one per line, as "F {size} {name}" for the finalized ones,
+  // as "T {size} {name}" for the ones waiting to be transformed, and as "S 0 {name}" for the spare ones.
+  // The last line is "END".
+  void SaveQueueManifest() const {
+    std::ostringstream os;
+    for (const auto& file : status_.finalized.queue) {
+      os << "F " << file.size << ' ' << file.name << '\n';
+    }
+    for (const auto& file : files_to_transform_) {
+      os << "T " << file.size << ' ' << file.name << '\n';
+    }
+    for (const auto& file : spare_files_) {
+      os << "S 0 " << file.name << '\n';
+    }
+    os << "END\n";
+    const std::string manifest_file_name = QueueManifestFileName();
+    try {
+      T_FILE_SYSTEM::WriteFileAtomically(manifest_file_name, os.str());
+    } catch (const bricks::FileException&) {
+      // No manifest, the next startup scans the working directory.
+    }
+  }
+
+  // Loads the queue saved by `SaveQueueManifest()`, and removes the manifest.
+  // Returns false if the manifest is turned off, absent, or malformed.
+  bool LoadQueueManifest(FileInfoVector& finalized_files,
+                         FileInfoVector& finalizing_files,
+                         FileInfoVector& spare_files) const {
+    if (!T_CONFIG::KeepQueueManifest()) {
+      return false;
+    }
+    const std::string manifest_file_name = QueueManifestFileName();
+    std::string contents;
+    try {
+      contents = T_FILE_SYSTEM::ReadFileAsString(manifest_file_name);
+    } catch (const bricks::FileException&) {
+      return false;
+    }
+    T_FILE_SYSTEM::RemoveFile(manifest_file_name, bricks::RemoveFileParameters::Silent);
+    std::istringstream is(contents);
+    std::string line;
+    bool complete = false;
+    while (std::getline(is, line)) {
+      if (complete) {
+        return false;
+      } else if (line == "END") {
+        complete = true;
+      } else {
+        std::istringstream ls(line);
+        char kind;
+        uint64_t size;
+        std::string name;
+        T_TIMESTAMP timestamp;
+        size_t lane = 0;
+        if (!(ls >> kind >> size >> name)) {
+          return false;
+        }
+        const std::string full_path_name = T_FILE_SYSTEM::JoinPath(working_directory_, name);
+        if (kind == 'F' && ParseFileNameOfAnyLane(&Lane::finalized, name, &timestamp, &lane)) {
+          finalized_files.emplace_back(name, full_path_name, timestamp, size);
+          finalized_files.back().lane = lane;
+        } else if (kind == 'T' && ParseFileNameOfAnyLane(&Lane::finalizing, name, &timestamp, &lane)) {
+          finalizing_files.emplace_back(name, full_path_name, timestamp, size);
+          finalizing_files.back().lane = lane;
+        } else if (kind == 'S' && T_FILE_NAMING_STRATEGY::spare.ParseFileName(name, &timestamp)) {
+          spare_files.emplace_back(name, full_path_name, timestamp, size);
+        } else {
+          return false;
+        }
+      }
+    }
+    return complete;
+  }
+
+  // The worker thread first scans the directory, then processes the finalized files.
+  void WorkerThread() {
+    ScanWorkingDirectory();
+    ProcessFinalizedFiles();
+  }
+
+  // The startup scan of the directory for present finalized and current files.
   // Present finalized files are queued up.
   // If more than one present current files is available, all but one are finalized on the spot.
   // The one remaining current file can be appended to or finalized depending on the strategy.
-  void WorkerThread() {
-    // Step 1/4: Get the list of finalized files.
-    typedef std::vector<FileInfo<T_TIMESTAMP>> FileInfoVector;
-    const FileInfoVector& finalized_files_on_disk = ScanDir([this](const std::string& s, T_TIMESTAMP* t) {
-      return T_FILE_NAMING_STRATEGY::finalized.ParseFileName(s, t);
-    });
-    status_.finalized.queue.assign(finalized_files_on_disk.begin(), finalized_files_on_disk.end());
+  void ScanWorkingDirectory() {
+    // Step 1/3: Get the list of finalized files, from the queue manifest if there is a valid one.
+    FileInfoVector finalized_files_on_disk;
+    FileInfoVector finalizing_files_on_disk;
+    FileInfoVector spare_files_on_disk;
+    if (!LoadQueueManifest(finalized_files_on_disk, finalizing_files_on_disk, spare_files_on_disk)) {
+      finalized_files_on_disk = ScanDirForFilesOfAllLanes(&Lane::finalized);
+      finalizing_files_on_disk.clear();
+      if (T_FINALIZED_FILE_TRANSFORM_STRATEGY::TransformsFinalizedFiles()) {
+        finalizing_files_on_disk = ScanDirForFilesOfAllLanes(&Lane::finalizing);
+      }
+      if (RecyclesFiles()) {
+        spare_files_on_disk = ScanDir([this](const std::string& s, T_TIMESTAMP* t) {
+          return T_FILE_NAMING_STRATEGY::spare.ParseFileName(s, t);
+        });
+      }
+    }
+    // The spare files beyond what the pool can hold are removed.
+    for (const auto& file : spare_files_on_disk) {
+      if (RecyclesFiles() && spare_files_.size() < T_CONFIG::RecycledFilesPoolSize()) {
+        spare_files_.push_back(file);
+      } else {
+        T_FILE_SYSTEM::RemoveFile(file.full_path_name, bricks::RemoveFileParameters::Silent);
+      }
+    }
+    // In a shared working directory, the files of all the processes are only queued by the holder of the lease.
+    const bool queue_finalized_files = QueuesFinalizedFiles();
+    if (queue_finalized_files) {
+      status_.finalized.queue.assign(finalized_files_on_disk.begin(), finalized_files_on_disk.end());
+    }
     status_.finalized.total_size = 0;
     for (const auto& file : finalized_files_on_disk) {
-      status_.finalized.total_size += file.size;
-    }
-
-    // Step 2/4: Get the list of current files.
-    const FileInfoVector& current_files_on_disk = ScanDir([this](
-        const std::string& s, T_TIMESTAMP* t) { return T_FILE_NAMING_STRATEGY::current.ParseFileName(s, t); });
-    if (!current_files_on_disk.empty()) {
-      const bool resume = T_FILE_RESUME_STRATEGY::ShouldResume();
-      const size_t number_of_files_to_finalize = current_files_on_disk.size() - (resume ? 1u : 0u);
-      for (size_t i = 0; i < number_of_files_to_finalize; ++i) {
-        const FileInfo<T_TIMESTAMP>& f = current_files_on_disk[i];
-        const std::string finalized_file_name = T_FILE_NAMING_STRATEGY::finalized.GenerateFileName(f.timestamp);
-        FileInfo<T_TIMESTAMP> finalized_file_info(
-            finalized_file_name,
-            T_FILE_SYSTEM::JoinPath(working_directory_, finalized_file_name),
-            f.timestamp,
-            f.size);
-        T_FILE_SYSTEM::RenameFile(f.full_path_name, finalized_file_info.full_path_name);
-        status_.finalized.queue.push_back(finalized_file_info);
-        status_.finalized.total_size += f.size;
-      }
-      if (resume) {
-        const FileInfo<T_TIMESTAMP>& c = current_files_on_disk.back();
-        status_.appended_file_timestamp = c.timestamp;
-        status_.appended_file_size = c.size;
-        current_file_name_ = c.full_path_name;
-        // TODO(dkorolev): This relies on OutputFile being std::ofstream. Fine for now anyway.
-        current_file_.reset(new typename T_FILE_SYSTEM::OutputFile(current_file_name_,
-                                                                   std::ofstream::app | std::ofstream::binary));
+      if (queue_finalized_files) {
+        status_.finalized.total_size += file.size;
+      }
+      lanes_[file.lane].OnFileFinalized(file.timestamp);
+    }
+    if (T_FINALIZED_FILE_TRANSFORM_STRATEGY::TransformsFinalizedFiles()) {
+      // The files finalized but not yet transformed before the previous termination are transformed now,
+      // unless the transformed file has been queued already, and only the intermediate one was not yet removed.
+      for (const auto& file : finalizing_files_on_disk) {
+        const bool already_transformed =
+            std::find_if(finalized_files_on_disk.begin(),
+                         finalized_files_on_disk.end(),
+                         [&file](const FileInfo<T_TIMESTAMP>& f) {
+              return f.timestamp == file.timestamp && f.lane == file.lane;
+            }) != finalized_files_on_disk.end();
+        if (already_transformed) {
+          T_FILE_SYSTEM::RemoveFile(file.full_path_name, bricks::RemoveFileParameters::Silent);
+        } else {
+          files_to_transform_.push_back(file);
+          lanes_[file.lane].OnFileFinalized(file.timestamp);
+        }
+      }
+    }
+
+    // Step 2/3: Get the list of current files, of each lane.
+    for (Lane& lane : lanes_) {
+      FileInfoVector current_files_on_disk = ScanDir([&lane](const std::string& s, T_TIMESTAMP* t) {
+        return lane.current.ParseFileName(s, t);
+      });
+      for (FileInfo<T_TIMESTAMP>& f : current_files_on_disk) {
+        RecoverCurrentFile(f, typename ResumeStrategyRecoversCurrentFiles<T_FILE_RESUME_STRATEGY>::type());
+      }
+      if (!current_files_on_disk.empty()) {
+        std::lock_guard<std::mutex> append_lock(append_mutex_);
+        const bool resume = T_FILE_RESUME_STRATEGY::ShouldResume();
+        const size_t number_of_files_to_finalize = current_files_on_disk.size() - (resume ? 1u : 0u);
+        for (size_t i = 0; i < number_of_files_to_finalize; ++i) {
+          const FileInfo<T_TIMESTAMP>& f = current_files_on_disk[i];
+          lane.OnFileFinalized(MoveToFinalized(lane, f.full_path_name, f.timestamp, f.size));
+        }
+        std::unique_lock<std::mutex> lock(status_mutex_);
+        if (resume) {
+          const FileInfo<T_TIMESTAMP>& c = current_files_on_disk.back();
+          lane.appended_file_timestamp = c.timestamp;
+          lane.appended_file_size = c.size;
+          lane.current_file_name = c.full_path_name;
+          lane.current_file.reset(new typename T_FILE_SYSTEM::OutputFile(
+              lane.current_file_name, std::ofstream::app | std::ofstream::binary));
+          UpdateAppendedFileStatus();
+        }
+        PurgeFilesAsNecessary(lock);
+      }
+    }
+
+    // The holder of the lease also picks up the current files left behind by the processes that have exited.
+    if (!writer_name_.empty() && queue_finalized_files) {
+      RecoverFilesOfExitedWriters();
+    }
+
+    // Step 3/3: Signal that FSQ's status has been successfully parsed from disk and FSQ is ready to go.
+    // The messages buffered in the meantime are appended first, before any message pushed from now on.
+    {
+      std::lock_guard<std::mutex> append_lock(append_mutex_);
+      std::vector<T_MESSAGE> buffered;
+      std::vector<T_TIMESTAMP> buffered_timestamps;
+      std::vector<size_t> buffered_lanes;
+      {
+        std::unique_lock<std::mutex> lock(status_mutex_);
+        status_ready_ = true;
+        PublishQueueCounters();
+        buffered.swap(buffered_until_ready_);
+        buffered_timestamps.swap(buffered_until_ready_timestamps_);
+        buffered_lanes.swap(buffered_until_ready_lanes_);
+        NotifyQueueStatusChanged();
+      }
+      for (size_t i = 0; i < buffered.size();) {
+        size_t j = i + 1;
+        while (j < buffered.size() && buffered_timestamps[j] == buffered_timestamps[i] &&
+               buffered_lanes[j] == buffered_lanes[i]) {
+          ++j;
+        }
+        AppendMessages(
+            lanes_[buffered_lanes[i]], buffered.begin() + i, buffered.begin() + j, buffered_timestamps[i]);
+        i = j;
+      }
+      if (!buffered.empty() && force_worker_thread_shutdown_) {
+        // The destructor may have closed the current files already.
+        for (Lane& lane : lanes_) {
+          CloseCurrentFile(lane);
+        }
       }
+    }
+  }
+
+  // The step of the task of `CONFIG::SharedScheduler()`: the startup scan by the first step,
+  // then one finalized file per step, with the steps run meanwhile waiting to be woken up by the scan.
+  SchedulerStep ScheduledStep() {
+    {
       std::unique_lock<std::mutex> lock(status_mutex_);
-      PurgeFilesAsNecessary(lock);
+      if (!status_ready_) {
+        if (startup_scan_started_) {
+          return SchedulerStep::RunWhenWoken();
+        }
+        startup_scan_started_ = true;
+        lock.unlock();
+        ScanWorkingDirectory();
+        return SchedulerStep::RunAgain();
+      }
     }
+    return ProcessNextFinalizedFile(false);
+  }
 
-    // Step 3/4: Signal that FSQ's status has been successfully parsed from disk and FSQ is ready to go.
+  // The thread queuing the finalized files that appear in the working directory, if
+  // `CONFIG::WatchWorkingDirectory()`. Starts once the startup scan has queued the files present on disk.
+  void WatchThread() {
     {
       std::unique_lock<std::mutex> lock(status_mutex_);
-      status_ready_ = true;
-      queue_status_condition_variable_.notify_all();
+      const auto predicate = [this]() { return status_ready_ || force_worker_thread_shutdown_; };
+      queue_status_condition_variable_.wait(lock, predicate);
+      if (!status_ready_) {
+        return;
+      }
     }
+    const auto on_file = [this](const std::string& file_name) { OnFileAppeared(file_name); };
+    while (directory_watcher_->WaitForFiles(on_file)) {
+    }
+  }
 
-    // Step 4/4: Start processing finalized files via T_PROCESSOR, respecting retry strategy.
-    while (true) {
+  // Queues the finalized file that has appeared in the working directory, unless it is known to FSQ already.
+  // FSQ itself moves files under their finalized names within the section locked on `status_mutex_`,
+  // as it queues them, and the processed and purged files are gone by the time they leave the queue.
+  void OnFileAppeared(const std::string& file_name) {
+    FileInfo<T_TIMESTAMP> file(
+        file_name, T_FILE_SYSTEM::JoinPath(working_directory_, file_name), T_TIMESTAMP(0), 0);
+    if (!ParseFileNameOfAnyLane(&Lane::finalized, file_name, &file.timestamp, &file.lane)) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(status_mutex_);
+    // The timestamp is implied by the name, and tells most of the files apart without comparing the names.
+    const auto same_name = [&file](const FileInfo<T_TIMESTAMP>& f) {
+      return f.timestamp == file.timestamp && f.name == file.name;
+    };
+    if (force_worker_thread_shutdown_ || !QueuesFinalizedFiles() ||
+        std::any_of(status_.finalized.queue.begin(), status_.finalized.queue.end(), same_name) ||
+        std::any_of(files_to_reclaim_.begin(), files_to_reclaim_.end(), same_name) ||
+        !T_FILE_SYSTEM::FileExists(file.full_path_name)) {
+      return;
+    }
+    file.size = T_FILE_SYSTEM::GetFileSize(file.full_path_name);
+    status_.finalized.queue.push_back(file);
+    status_.finalized.total_size += file.size;
+    lanes_[file.lane].OnFileFinalized(file.timestamp);
+    PurgeFilesAsNecessary(lock);
+    NotifyQueueStatusChanged();
+  }
+
+  // Whether this process holds the lease on the shared working directory, taking it over if it is free.
+  // The process taking the lease over queues the finalized files of all the processes, and picks up
+  // the current files left behind by the processes that have exited.
+  bool AcquireLease() {
+    {
+      std::unique_lock<std::mutex> lock(status_mutex_);
+      if (holds_lease_) {
+        return true;
+      } else if (force_worker_thread_shutdown_ || !lease_->TryLock()) {
+        return false;
+      }
+      holds_lease_ = true;
+    }
+    for (const FileInfo<T_TIMESTAMP>& file : ScanDirForFilesOfAllLanes(&Lane::finalized)) {
+      OnFileAppeared(file.name);
+    }
+    RecoverFilesOfExitedWriters();
+    return true;
+  }
+
+  // Finalizes the current files, and the finalizing ones, of the processes that have exited, known by
+  // their locks no longer being held, and removes their locks. Called by the holder of the lease.
+  void RecoverFilesOfExitedWriters() {
+    const std::string& prefix = T_FILE_NAMING_STRATEGY::writer_lock_file_prefix;
+    const std::string& suffix = T_FILE_NAMING_STRATEGY::writer_lock_file_suffix;
+    std::vector<std::string> writers;
+    typedef typename T_FILE_SYSTEM::DirectoryEntry DirectoryEntry;
+    T_FILE_SYSTEM::ScanDirEntriesUntil(working_directory_, [&](const DirectoryEntry& e) {
+      const std::string name(e.name, e.name_length);
+      if (name.length() > prefix.length() + suffix.length() && !name.compare(0, prefix.length(), prefix) &&
+          !name.compare(name.length() - suffix.length(), suffix.length(), suffix)) {
+        const std::string writer(name, prefix.length(), name.length() - prefix.length() - suffix.length());
+        if (writer != writer_name_) {
+          writers.push_back(writer);
+        }
+      }
+      return true;
+    });
+    for (const std::string& writer : writers) {
+      std::unique_ptr<bricks::FileLock> writer_lock;
+      try {
+        writer_lock.reset(new bricks::FileLock(WriterLockFileName(writer)));
+      } catch (const bricks::FileException&) {
+        continue;
+      }
+      if (!writer_lock->TryLock()) {
+        continue;
+      }
+      for (Lane& lane : lanes_) {
+        for (const FileNamingSchema& schema :
+             {T_FILE_NAMING_STRATEGY::current, T_FILE_NAMING_STRATEGY::finalizing}) {
+          const FileNamingSchema names = Lane::Prefixed(schema, *this, lane.index, writer);
+          const FileInfoVector files =
+              ScanDir([&names](const std::string& s, T_TIMESTAMP* t) { return names.ParseFileName(s, t); });
+          std::unique_lock<std::mutex> lock(status_mutex_);
+          for (const FileInfo<T_TIMESTAMP>& f : files) {
+            // Named as the next files of this process, for the queue of the lane to stay in the order.
+            T_TIMESTAMP timestamp = f.timestamp;
+            if (lane.has_last_finalized_file_timestamp && !(lane.last_finalized_file_timestamp < timestamp)) {
+              timestamp = lane.last_finalized_file_timestamp + T_TIME_SPAN(1);
+            }
+            lane.OnFileFinalized(MoveToFinalized(lane, f.full_path_name, timestamp, f.size));
+            metrics_.files_finalized.Increment();
+          }
+          if (!files.empty()) {
+            PurgeFilesAsNecessary(lock);
+            NotifyQueueStatusChanged();
+          }
+        }
+      }
+      T_FILE_SYSTEM::RemoveFile(WriterLockFileName(writer), bricks::RemoveFileParameters::Silent);
+    }
+  }
+
+  // Processing threads beyond the first one wait for the worker thread to have scanned the directory.
+  void AdditionalProcessingThread() {
+    {
+      std::unique_lock<std::mutex> lock(status_mutex_);
+      const auto predicate = [this]() { return status_ready_ || force_worker_thread_shutdown_; };
+      queue_status_condition_variable_.wait(lock, predicate);
+      if (!status_ready_) {
+        return;
+      }
+    }
+    ProcessFinalizedFiles();
+  }
+
+  // The processing loop, run by each processing thread.
+  // The files are taken from the queue oldest first, skipping the ones already being processed,
+  // and removed from the queue when done. The retry strategy is shared by all the processing threads.
+  void ProcessFinalizedFiles() {
+    while (ProcessNextFinalizedFile(true).next != SchedulerStep::Next::Done) {
+    }
+  }
+
+  // Processes the next finalized file via T_PROCESSOR, respecting the retry strategy. With `wait`,
+  // waits for the file to arrive or for the retry delay to pass, otherwise returns what it would wait for,
+  // for the shared scheduler to run the next step then. Returns `Done` once the processing should stop.
+  SchedulerStep ProcessNextFinalizedFile(bool wait) {
+    if (!writer_name_.empty() && !AcquireLease()) {
+      // Another process is processing the shared working directory, check whether it still is later.
+      const uint64_t poll_ms = T_CONFIG::SharedWorkingDirectoryLeasePollMs();
+      std::unique_lock<std::mutex> lock(status_mutex_);
+      const auto predicate = [this]() { return force_worker_thread_shutdown_; };
+      if (predicate()) {
+        return SchedulerStep::Done();
+      } else if (!wait) {
+        return SchedulerStep::RunAfterDelay(poll_ms);
+      }
+      queue_status_condition_variable_.wait_for(lock, std::chrono::milliseconds(poll_ms), predicate);
+      return predicate() ? SchedulerStep::Done() : SchedulerStep::RunAgain();
+    }
+    {
       // Wait for a newly arrived file or another event to happen.
-      std::unique_ptr<FileInfo<T_TIMESTAMP>> next_file;
+      std::vector<FileInfo<T_TIMESTAMP>> batch;
+      std::vector<std::string> files_to_prefetch;
       {
         std::unique_lock<std::mutex> lock(status_mutex_);
-        const bricks::time::EPOCH_MILLISECONDS begin_ms = bricks::time::Now();
         bricks::time::MILLISECONDS_INTERVAL wait_ms;
         const bool should_wait = T_RETRY_STRATEGY_INSTANCE::ShouldWait(&wait_ms);
-        const auto predicate = [this, should_wait, begin_ms, wait_ms]() {
+        // The retry strategy is asked again on each wake up, as a shared one may be done waiting early.
+        const auto predicate = [this, should_wait]() {
+          bricks::time::MILLISECONDS_INTERVAL remaining_wait_ms;
           if (force_worker_thread_shutdown_) {
             return true;
           } else if (force_processing_) {
             return true;
           } else if (processing_suspended_) {
             return false;
-          } else if (should_wait && bricks::time::Now() - begin_ms < wait_ms) {
+          } else if (should_wait && T_RETRY_STRATEGY_INSTANCE::ShouldWait(&remaining_wait_ms)) {
             return false;
-          } else if (!status_.finalized.queue.empty()) {
+          } else if (NextFileToProcess() != status_.finalized.queue.end()) {
             return true;
           } else {
             return false;
           }
         };
         if (!predicate()) {
+          if (!wait) {
+            return should_wait ? SchedulerStep::RunAfterDelay(static_cast<uint64_t>(wait_ms) + 1)
+                               : SchedulerStep::RunWhenWoken();
+          }
           if (should_wait) {
             // Add one millisecond to avoid multiple runs of this loop when `wait_ms` is close to zero.
             queue_status_condition_variable_.wait_for(
@@ -399,57 +2048,134 @@ class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
           } else {
             queue_status_condition_variable_.wait(lock, predicate);
           }
+          if (!predicate()) {
+            // Still to wait, for example, for the probe another queue sharing the retry strategy is running.
+            return SchedulerStep::RunAgain();
+          }
         }
-        if (!status_.finalized.queue.empty()) {
-          next_file.reset(new FileInfo<T_TIMESTAMP>(status_.finalized.queue.front()));
+        const auto next = NextFileToProcess();
+        if (next != status_.finalized.queue.end()) {
+          batch = NextBatchToProcess(next);
+          T_LANE_SCHEDULING_STRATEGY::OnLanePicked(next->lane);
+        } else {
+          // Nothing to force the processing of, do not keep waking up for it.
+          force_processing_ = false;
         }
         if (force_worker_thread_shutdown_) {
           // By default, terminate immediately.
           // However, allow the user to override this setting and have the queue
           // processed in full before returning from FSQ's destructor.
-          if (!T_CONFIG::ProcessQueueToTheEndOnShutdown() || !next_file) {
-            return;
+          if (!T_CONFIG::ProcessQueueToTheEndOnShutdown() || batch.empty()) {
+            return SchedulerStep::Done();
           }
         }
+        if (!batch.empty()) {
+          files_in_process_.insert(files_in_process_.end(), batch.begin(), batch.end());
+          PublishQueueCounters();
+          files_to_prefetch = FilesToPrefetch();
+        }
       }
 
-      // Process the file, if available.
-      if (next_file) {
-        const FileProcessingResult result = processor_.OnFileReady(*next_file.get(), time_manager_.Now());
-        // Important to clear force_processing_, in a locked way.
-        {
-          std::unique_lock<std::mutex> lock(status_mutex_);
-          force_processing_ = false;
+      // Validate the files lazily, if they may have come from the queue manifest.
+      if (!batch.empty() && T_CONFIG::KeepQueueManifest()) {
+        bool has_stale_files = false;
+        for (const FileInfo<T_TIMESTAMP>& file : batch) {
+          has_stale_files = has_stale_files || T_FILE_SYSTEM::GetFileSize(file.full_path_name) != file.size;
         }
-        if (result == FileProcessingResult::Success || result == FileProcessingResult::SuccessAndMoved) {
+        if (has_stale_files) {
           std::unique_lock<std::mutex> lock(status_mutex_);
-          processing_suspended_ = false;
-          if (*next_file.get() == status_.finalized.queue.front()) {
-            status_.finalized.total_size -= status_.finalized.queue.front().size;
-            status_.finalized.queue.pop_front();
+          for (const FileInfo<T_TIMESTAMP>& file : batch) {
+            files_in_process_.erase(std::find(files_in_process_.begin(), files_in_process_.end(), file));
+            if (T_FILE_SYSTEM::GetFileSize(file.full_path_name) != file.size) {
+              const auto stale =
+                  std::find(status_.finalized.queue.begin(), status_.finalized.queue.end(), file);
+              if (stale != status_.finalized.queue.end()) {
+                status_.finalized.total_size -= stale->size;
+                status_.finalized.queue.erase(stale);
+              }
+            }
+          }
+          PublishQueueCounters();
+          NotifyQueueStatusChanged();
+          return SchedulerStep::RunAgain();
+        }
+      }
+
+      // Process the files, if available, with the next ones read ahead meanwhile. The files read ahead
+      // already, such as on the retries, are in the page cache, and cost next to nothing to read ahead again.
+      if (!batch.empty()) {
+        PrefetchFiles(files_to_prefetch, typename FileSystemPrefetchesFiles<T_FILE_SYSTEM>::type());
+        const T_TIMESTAMP processing_started = time_manager_.Now();
+        const std::vector<FileProcessingResult> results =
+            ProcessFiles(batch, typename ProcessorAcceptsBatches<T_PROCESSOR>::type());
+        const T_TIMESTAMP processing_completed = time_manager_.Now();
+        std::unique_lock<std::mutex> lock(status_mutex_);
+        // Important to clear force_processing_, in a locked way.
+        force_processing_ = false;
+        bool succeeded = false;
+        bool unavailable = false;
+        bool failed = false;
+        for (size_t i = 0; i < batch.size(); ++i) {
+          const FileInfo<T_TIMESTAMP>& file = batch[i];
+          const FileProcessingResult result = results[i];
+          files_in_process_.erase(std::find(files_in_process_.begin(), files_in_process_.end(), file));
+          if (result == FileProcessingResult::Success || result == FileProcessingResult::SuccessAndMoved) {
+            succeeded = true;
+            const auto processed =
+                std::find(status_.finalized.queue.begin(), status_.finalized.queue.end(), file);
+            if (processed != status_.finalized.queue.end()) {
+              status_.finalized.total_size -= processed->size;
+              status_.finalized.queue.erase(processed);
+            } else {
+              // The files being processed should only be removed from the queue by their thread.
+              T_ERROR_HANDLING_STRATEGY::HandleError();
+            }
+            if (result == FileProcessingResult::Success) {
+              RemoveOrRecycleFile(file);
+            }
+            metrics_.files_processed.Increment();
+            OnProcessingSuccess(
+                file, typename RetryStrategyAccountsProcessedBytes<T_RETRY_STRATEGY_INSTANCE>::type());
+            OnFileProcessed(file,
+                            processing_started,
+                            processing_completed,
+                            typename FinalizeStrategyObservesProcessing<T_FINALIZE_STRATEGY>::type());
+          } else if (result == FileProcessingResult::Unavailable) {
+            unavailable = true;
+            metrics_.processing_failures.Increment();
+          } else if (result == FileProcessingResult::FailureNeedRetry) {
+            failed = true;
+            metrics_.processing_failures.Increment();
           } else {
-            // The `front()` part of the queue should only be altered by this worker thread.
             T_ERROR_HANDLING_STRATEGY::HandleError();
           }
-          if (result == FileProcessingResult::Success) {
-            T_FILE_SYSTEM::RemoveFile(next_file->full_path_name);
-          }
-          T_RETRY_STRATEGY_INSTANCE::OnSuccess();
-        } else if (result == FileProcessingResult::Unavailable) {
-          std::unique_lock<std::mutex> lock(status_mutex_);
+        }
+        // A file of the batch the processor is unavailable for suspends the processing, whatever the others.
+        if (unavailable) {
           processing_suspended_ = true;
-        } else if (result == FileProcessingResult::FailureNeedRetry) {
+        } else if (succeeded) {
+          processing_suspended_ = false;
+        }
+        if (failed) {
           T_RETRY_STRATEGY_INSTANCE::OnFailure();
-        } else {
-          T_ERROR_HANDLING_STRATEGY::HandleError();
         }
+        PublishQueueCounters();
+        // Let the other processing threads re-evaluate the queue and the retry delay.
+        NotifyQueueStatusChanged();
+        lock.unlock();
+        BroadcastPendingResumption(typename RetryStrategyResumesQueues<T_RETRY_STRATEGY_INSTANCE>::type());
       }
     }
+    return SchedulerStep::RunAgain();
   }
 
   Status status_;
-  // Appending messages is single-threaded and thus lock-free.
-  // The status of the processing queue, on the other hand, should be guarded.
+  // Appending messages is serialized by `append_mutex_`, which guards the current file.
+  // The status, including the size of the current file, is guarded by `status_mutex_`.
+  // When both are needed, `append_mutex_` is locked first.
+  std::mutex append_mutex_;
+  // The messages admitted by a selective `T_ADMISSION_STRATEGY`, and its markers. Guarded by `append_mutex_`.
+  std::vector<T_MESSAGE> admitted_messages_;
   mutable std::mutex status_mutex_;
   // Set to true and pings the variable once the initial directory scan is completed.
   bool status_ready_ = false;
@@ -460,11 +2186,62 @@ class FSQ final : public CONFIG::T_FILE_NAMING_STRATEGY,
   const T_TIME_MANAGER& time_manager_;
   const T_FILE_SYSTEM& file_system_;
 
-  std::unique_ptr<typename T_FILE_SYSTEM::OutputFile> current_file_;
-  std::string current_file_name_;
+  // The name of this process in the shared working directory, empty if the directory is not shared,
+  // the lock on the name, held for as long as FSQ runs, and the lease on processing the shared queue.
+  // The lease, once taken, is held for as long as FSQ runs too. `holds_lease_` is guarded by `status_mutex_`.
+  const std::string writer_name_ = T_CONFIG::SharedWorkingDirectoryWriterName();
+  std::unique_ptr<bricks::FileLock> writer_lock_;
+  std::unique_ptr<bricks::FileLock> lease_;
+  bool holds_lease_ = false;
+
+  // The priority lanes, at least one, each with its current file. Only modified by the constructor.
+  std::vector<Lane> lanes_;
+
+  // The files currently being processed, by this or other processing threads. Guarded by `status_mutex_`.
+  std::vector<FileInfo<T_TIMESTAMP>> files_in_process_;
+
+  // The messages pushed before the status is ready, with their timestamps and lanes.
+  // Guarded by `status_mutex_`.
+  std::vector<T_MESSAGE> buffered_until_ready_;
+  std::vector<T_TIMESTAMP> buffered_until_ready_timestamps_;
+  std::vector<size_t> buffered_until_ready_lanes_;
+
+  // The finalized files waiting for `T_FINALIZED_FILE_TRANSFORM_STRATEGY`. Guarded by `status_mutex_`.
+  std::deque<FileInfo<T_TIMESTAMP>> files_to_transform_;
+
+  // The processed files emptied to become the next current files. Guarded by `status_mutex_`.
+  std::deque<FileInfo<T_TIMESTAMP>> spare_files_;
+
+  // The purged files waiting to be removed by `reclaim_thread_`. Guarded by `status_mutex_`.
+  std::deque<FileInfo<T_TIMESTAMP>> files_to_reclaim_;
+
+  // Shared by all the instances, resolved once.
+  FSQMetrics& metrics_ = FSQMetrics::Singleton();
+
+  // The shared scheduler, if any, which then runs `ScheduledStep()` instead of the worker
+  // and processing threads.
+  Scheduler* const scheduler_ = T_CONFIG::SharedScheduler();
+  Scheduler::TaskID scheduler_task_ = 0;
+  // Set by the step that runs the startup scan. Guarded by `status_mutex_`.
+  bool startup_scan_started_ = false;
 
   std::thread worker_thread_;
+  std::vector<std::thread> processing_threads_;
+  std::thread transform_thread_;
+  std::unique_ptr<bricks::DirectoryWatcher> directory_watcher_;
+  std::thread watch_thread_;
+  std::thread reclaim_thread_;
   bool processing_suspended_ = false;
+
+  // The counters published by `PublishQueueCounters()`, with the version odd while they are being updated.
+  std::atomic<uint64_t> counters_version_{0};
+  std::atomic<size_t> finalized_files_counter_{0};
+  std::atomic<uint64_t> finalized_total_size_counter_{0};
+  std::atomic<T_TIMESTAMP> oldest_finalized_file_timestamp_counter_{T_TIMESTAMP(0)};
+  std::atomic<uint64_t> appended_file_size_counter_{0};
+  std::atomic<uint64_t> pending_reclaim_size_counter_{0};
+  std::atomic<size_t> files_in_process_counter_{0};
+  std::atomic<bool> processing_suspended_counter_{false};
   bool force_processing_ = false;
   bool force_worker_thread_shutdown_ = false;
 
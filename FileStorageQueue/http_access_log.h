@@ -0,0 +1,121 @@
+// Class HTTPAccessLog is the asynchronous access log of `bricks::net::HTTPServer`, kept in an FSQ.
+//
+// The server passes the `HTTPAccessLogRecord` of each request it handles, or of the sampled ones, see
+// `HTTPServerParameters::access_log_sample_every`, to `Callback()`, which pushes it into the shard
+// of the calling thread of a `ShardedMQ`: the loops and the handler threads of the server never contend
+// on the queue, and never wait for the disk. The only consumer thread of the queue appends the records
+// to the FSQ as `HTTPAccessLogEvent`-s, the framed flat records of `flat_event_records.h`, and the finalized
+// files of the FSQ are the rotated logs, passed on to `CONFIG::T_PROCESSOR`.
+//
+//   fsq::HTTPAccessLog<fsq::HTTPAccessLogConfig<Processor>> access_log(processor, "/var/log/http");
+//   bricks::net::HTTPServerParameters parameters;
+//   parameters.access_log = access_log.Callback();
+//   bricks::net::HTTPServer server(port, handler, parameters);
+//
+// The server should be destructed before the log. The records that do not fit the shard of their thread,
+// as the writer falls behind, are dropped, and counted by `NumberOfDroppedRecords()`.
+// The destructor writes out all the records pushed so far.
+
+#ifndef FSQ_HTTP_ACCESS_LOG_H
+#define FSQ_HTTP_ACCESS_LOG_H
+
+#include <atomic>
+#include <functional>
+#include <utility>
+
+#include "config.h"
+#include "flat_event_records.h"
+#include "fsq.h"
+
+#include "../Bricks/net/http/http.h"
+
+#include "../CachingMessageQueue/mq_sharded.h"
+
+namespace fsq {
+
+// The access log record as the typed message of the FSQ of `HTTPAccessLog`.
+struct HTTPAccessLogEvent : bricks::net::HTTPAccessLogRecord {
+  HTTPAccessLogEvent() = default;
+  explicit HTTPAccessLogEvent(const bricks::net::HTTPAccessLogRecord& record)
+      : bricks::net::HTTPAccessLogRecord(record) {
+  }
+  BRICKS_FLAT_FIELDS(1,
+                     request_id,
+                     timestamp_us,
+                     queueing_us,
+                     handler_us,
+                     request_bytes,
+                     response_bytes,
+                     status,
+                     method,
+                     path);
+};
+
+// The configuration of the FSQ of `HTTPAccessLog`, the rest of it as in `Config`.
+template <typename PROCESSOR>
+struct HTTPAccessLogConfig : Config<PROCESSOR> {
+  typedef HTTPAccessLogEvent T_MESSAGE;
+  typedef strategy::AppendFlatEventRecords<HTTPAccessLogEvent> T_FILE_APPEND_STRATEGY;
+  typedef strategy::ResumeTruncatingToLastValidRecord T_FILE_RESUME_STRATEGY;
+};
+
+template <class CONFIG, size_t SHARD_BUFFER_SIZE = 4096>
+class HTTPAccessLog final {
+ public:
+  typedef CONFIG T_CONFIG;
+  typedef FSQ<T_CONFIG> T_FSQ;
+
+  // Takes the same parameters as the constructor of FSQ.
+  template <typename... ARGS>
+  explicit HTTPAccessLog(ARGS&&... args)
+      : fsq_(std::forward<ARGS>(args)...), writer_(fsq_), message_queue_(writer_, SHARD_BUFFER_SIZE) {
+  }
+
+  // Enqueues the record to be appended to the FSQ. THREAD SAFE.
+  // Returns false if the record was dropped, as the shard of the calling thread is full.
+  bool Log(const bricks::net::HTTPAccessLogRecord& record) {
+    return message_queue_.PushMessage(HTTPAccessLogEvent(record));
+  }
+
+  // The `HTTPServerParameters::access_log` to log the requests of the server into this access log.
+  std::function<void(const bricks::net::HTTPAccessLogRecord&)> Callback() {
+    return [this](const bricks::net::HTTPAccessLogRecord& record) { Log(record); };
+  }
+
+  // The number of records dropped so far, as reported by the queue along with the records after them.
+  size_t NumberOfDroppedRecords() const {
+    return writer_.dropped;
+  }
+
+  // The FSQ itself, for the rest of its methods, including the setters of the strategies.
+  T_FSQ& UnderlyingFSQ() {
+    return fsq_;
+  }
+
+ private:
+  // The consumer of the queue, called from its only thread.
+  struct Writer {
+    explicit Writer(T_FSQ& queue) : queue(queue), dropped(0) {
+    }
+    void OnMessage(const HTTPAccessLogEvent& event, size_t number_of_dropped_events_if_any) {
+      dropped += number_of_dropped_events_if_any;
+      queue.PushMessage(event);
+    }
+    T_FSQ& queue;
+    std::atomic<size_t> dropped;
+  };
+
+  // The order matters: the queue is destructed, and thus flushed into the FSQ, first.
+  T_FSQ fsq_;
+  Writer writer_;
+  ShardedMQ<Writer, HTTPAccessLogEvent, SHARD_BUFFER_SIZE> message_queue_;
+
+  HTTPAccessLog(const HTTPAccessLog&) = delete;
+  HTTPAccessLog(HTTPAccessLog&&) = delete;
+  void operator=(const HTTPAccessLog&) = delete;
+  void operator=(HTTPAccessLog&&) = delete;
+};
+
+}  // namespace fsq
+
+#endif  // FSQ_HTTP_ACCESS_LOG_H
@@ -0,0 +1,271 @@
+// `fsq::processor::HTTPUploader` is a ready-made FSQ processor that POSTs each finalized file to a URL.
+//
+// The file is streamed from disk with `POSTFromFile()`, over the keep-alive connections of the HTTP client,
+// so that neither a new connection per file nor a copy of the file in memory is paid for.
+// It is safe to use with `CONFIG::NumberOfProcessingThreads()` above one, for several uploads to be in flight.
+//
+// The HTTP response codes map onto `FileProcessingResult` as follows:
+// * 2xx: `Success`, the file is removed by FSQ.
+// * 408, 429 and 5xx: `FailureNeedRetry`, the server is overloaded or broken, and may recover,
+//   thus the upload is retried later according to the retry strategy of FSQ.
+// * Any other code, such as 400 or 413: `Success` as well, the server has rejected the file itself,
+//   and re-sending it would block the queue forever. Such files are counted as rejected.
+// * No response, for example, when the device is offline: `Unavailable`, processing is suspended
+//   until `FSQ::ResumeProcessing()` is called.
+//
+// A server shedding the load, such as `bricks::net::HTTPServer` with `load_shedding_target_ms`, responds
+// with `Retry-After`. Given the circuit breaker of the queues with `HoldOffOn()`, the uploader has all of them
+// wait for as long as the server has asked before the next attempt, instead of retrying on their own delays:
+//
+//   typedef fsq::strategy::CircuitBreakerRetryStrategy<T_FILE_SYSTEM> T_RETRY_STRATEGY;  // With "uploads".
+//   uploader.HoldOffOn(fsq::strategy::CircuitBreaker::ForDestination("uploads"));
+//
+// To have the files sent compressed, use `GzipFinalizedFiles` from `compression.h` with the content type
+// of "application/gzip": the compression then runs on the transform thread of FSQ once per file,
+// not on every retry of the upload. To have fewer, larger requests, finalize larger files, for example,
+// with the adaptive finalization strategy, which grows the files when each of them is costly to process.
+//
+// A file the upload of which has failed ambiguously, such as with a timeout after the server has stored it,
+// would be sent again in full. With `UseContentIDs()`, each file is POSTed to `url/{content_id}`, named by
+// its contents, see `ContentID()`, which `IngestServer` acknowledges without queueing it twice. The retries
+// of such a file first ask `GET url/{content_id}`, and skip the upload if the server answers "200 OK",
+// as it does for the segments it already has. The first attempts are not prechecked, as the server is unlikely
+// to have the file then. The content ID is computed once per file, over its memory-mapped contents,
+// and is kept until the upload succeeds or is rejected.
+//
+// To upload to a cluster of ingest servers, see `upload_cluster.h`, construct the uploader with the path
+// on the nodes, and have it shard across the cluster with the affinity key of the files it uploads:
+//
+//   fsq::processor::UploadCluster cluster("http://discovery/ingest-nodes");
+//   fsq::processor::HTTPUploader uploader("/segments");
+//   uploader.ShardAcross(cluster, device_id);
+//
+// Each upload then goes to the node the key maps to, and reports its outcome to the cluster for the failing
+// nodes to be ejected. With a cluster, a node that can not be reached is a failure to retry, on another node
+// once it is ejected, rather than `Unavailable`, which would suspend the queue for the whole cluster.
+// So is the upload before the nodes are discovered, for the discovery to be retried with the upload.
+
+#ifndef FSQ_HTTP_UPLOADER_H
+#define FSQ_HTTP_UPLOADER_H
+
+#include <exception>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "circuit_breaker_retry_strategy.h"
+#include "fsq.h"
+#include "upload_cluster.h"
+
+#include "../Bricks/file/file.h"
+#include "../Bricks/metrics/metrics.h"
+#include "../Bricks/net/api/api.h"
+#include "../Bricks/strings/printf.h"
+#include "../Bricks/util/crc32c.h"
+
+namespace fsq {
+namespace processor {
+
+// The metrics of all the instances of HTTPUploader, in `bricks::metrics::Registry::Singleton()`.
+struct HTTPUploaderMetrics {
+  bricks::metrics::Counter& files_uploaded;
+  bricks::metrics::Counter& bytes_uploaded;
+  bricks::metrics::Counter& files_rejected;
+  bricks::metrics::Counter& failures;
+  bricks::metrics::Counter& files_skipped;
+
+  static HTTPUploaderMetrics& Singleton() {
+    bricks::metrics::Registry& registry = bricks::metrics::Registry::Singleton();
+    static HTTPUploaderMetrics singleton{
+        registry.GetCounter("fsq_http_uploader_files_uploaded_total", "The files accepted by the server."),
+        registry.GetCounter("fsq_http_uploader_bytes_uploaded_total",
+                            "The bytes of the files accepted by the server."),
+        registry.GetCounter("fsq_http_uploader_files_rejected_total",
+                            "The files rejected by the server, and dropped without being retried."),
+        registry.GetCounter("fsq_http_uploader_failures_total",
+                            "The uploads to be retried, or given up on as the server could not be reached."),
+        registry.GetCounter("fsq_http_uploader_files_skipped_total",
+                            "The retried files not sent again, as the server already had them.")};
+    return singleton;
+  }
+};
+
+class HTTPUploader final {
+ public:
+  explicit HTTPUploader(const std::string& url,
+                        const std::string& content_type = "application/octet-stream",
+                        const std::string& user_agent = "")
+      : url_(url), content_type_(content_type), user_agent_(user_agent) {
+  }
+
+  template <typename T_TIMESTAMP>
+  FileProcessingResult OnFileReady(const FileInfo<T_TIMESTAMP>& file_info, T_TIMESTAMP) {
+    const std::string node = cluster_ ? cluster_->NodeFor(affinity_key_) : "";
+    if (cluster_ && node.empty()) {
+      // The nodes are yet to be discovered: retried, as suspending the queue would never have them fetched.
+      metrics_.failures.Increment();
+      return FileProcessingResult::FailureNeedRetry;
+    }
+    std::string url = node + url_;
+    bool retried = false;
+    if (use_content_ids_) {
+      const std::string content_id = ContentIDOf(file_info, retried);
+      if (!content_id.empty()) {
+        url += '/' + content_id;
+      }
+    }
+    int code;
+    uint64_t retry_after_ms;
+    try {
+      if (retried && HTTP(bricks::net::api::GET(url)).code == 200) {
+        metrics_.files_skipped.Increment();
+        ForgetContentID(file_info);
+        if (cluster_) {
+          cluster_->ReportSuccess(node);
+        }
+        return FileProcessingResult::Success;
+      }
+      auto request = bricks::net::api::POSTFromFile(url, file_info.full_path_name, content_type_);
+      if (!user_agent_.empty()) {
+        request.SetUserAgent(user_agent_);
+      }
+      const auto response = HTTP(request);
+      code = response.code;
+      retry_after_ms = response.retry_after_ms;
+    } catch (const std::exception&) {
+      // Network errors, and, depending on the implementation of the client, `HTTPClientException`.
+      metrics_.failures.Increment();
+      if (cluster_) {
+        cluster_->ReportFailure(node);
+        return FileProcessingResult::FailureNeedRetry;
+      }
+      return FileProcessingResult::Unavailable;
+    }
+    const FileProcessingResult result = ResultFromHTTPResponseCode(code);
+    if (cluster_) {
+      if (result == FileProcessingResult::FailureNeedRetry) {
+        cluster_->ReportFailure(node);
+      } else {
+        cluster_->ReportSuccess(node);
+      }
+    }
+    if (result == FileProcessingResult::Success) {
+      ForgetContentID(file_info);
+    }
+    if (result == FileProcessingResult::FailureNeedRetry) {
+      metrics_.failures.Increment();
+      if (breaker_ && retry_after_ms) {
+        breaker_->HoldOff(retry_after_ms);
+      }
+    } else if (code >= 200 && code <= 299) {
+      metrics_.files_uploaded.Increment();
+      metrics_.bytes_uploaded.Increment(file_info.size);
+    } else {
+      metrics_.files_rejected.Increment();
+    }
+    return result;
+  }
+
+  // See the header comment.
+  static FileProcessingResult ResultFromHTTPResponseCode(int code) {
+    if (code == 408 || code == 429 || (code >= 500 && code <= 599)) {
+      return FileProcessingResult::FailureNeedRetry;
+    } else {
+      return FileProcessingResult::Success;
+    }
+  }
+
+  // Honors the `Retry-After` of the responses to be retried by holding the queues of `breaker` off.
+  HTTPUploader& HoldOffOn(strategy::CircuitBreaker& breaker) {
+    breaker_ = &breaker;
+    return *this;
+  }
+
+  // Names the files by their contents, for the server to tell the retries apart, see the header comment.
+  HTTPUploader& UseContentIDs(bool use_content_ids = true) {
+    use_content_ids_ = use_content_ids;
+    return *this;
+  }
+
+  // Uploads to the node of `cluster` that `affinity_key` maps to, with the URL of the uploader as the path
+  // on the node, see the header comment. The cluster should outlive the uploader.
+  HTTPUploader& ShardAcross(UploadCluster& cluster, const std::string& affinity_key) {
+    cluster_ = &cluster;
+    affinity_key_ = affinity_key;
+    return *this;
+  }
+
+  // The content ID of the data: the CRC32C-s of its first and its second half, and its size, in hex.
+  // The halves are checksummed on their own for the ID to have 64 bits of the checksum rather than 32.
+  static std::string ContentID(const char* data, size_t size) {
+    const size_t half = size / 2;
+    return bricks::strings::Printf("%08x%08x-%llx",
+                                   static_cast<unsigned>(bricks::CRC32C(data, half)),
+                                   static_cast<unsigned>(bricks::CRC32C(data + half, size - half)),
+                                   static_cast<unsigned long long>(size));
+  }
+
+  const std::string& URL() const {
+    return url_;
+  }
+
+ private:
+  // The content ID of the file, computed on its first attempt, with `retried` set on the attempts after it.
+  // Empty for the files that can not be read, which are then uploaded with no ID.
+  template <typename T_TIMESTAMP>
+  std::string ContentIDOf(const FileInfo<T_TIMESTAMP>& file_info, bool& retried) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const auto it = content_ids_.find(file_info.full_path_name);
+      if (it != content_ids_.end()) {
+        retried = true;
+        return it->second;
+      }
+    }
+    std::string content_id;
+    try {
+      const bricks::MemoryMappedFile file(file_info.full_path_name);
+      content_id = ContentID(file.data(), file.size());
+    } catch (const bricks::FileException&) {
+      return "";
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The files removed from the queue by other means than the upload, such as by the purge strategy,
+    // are never forgotten, thus the IDs are dropped altogether once there are too many of them.
+    if (content_ids_.size() >= kMaxContentIDsKept) {
+      content_ids_.clear();
+    }
+    content_ids_[file_info.full_path_name] = content_id;
+    return content_id;
+  }
+
+  template <typename T_TIMESTAMP>
+  void ForgetContentID(const FileInfo<T_TIMESTAMP>& file_info) {
+    if (use_content_ids_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      content_ids_.erase(file_info.full_path_name);
+    }
+  }
+
+  static const size_t kMaxContentIDsKept = 100000;
+
+  const std::string url_;
+  const std::string content_type_;
+  const std::string user_agent_;
+  strategy::CircuitBreaker* breaker_ = nullptr;
+  bool use_content_ids_ = false;
+  UploadCluster* cluster_ = nullptr;
+  std::string affinity_key_;
+  // The content IDs of the files attempted, keyed by their full path names. Guarded by `mutex_`.
+  std::unordered_map<std::string, std::string> content_ids_;
+  std::mutex mutex_;
+  HTTPUploaderMetrics& metrics_ = HTTPUploaderMetrics::Singleton();
+
+  HTTPUploader(const HTTPUploader&) = delete;
+  void operator=(const HTTPUploader&) = delete;
+};
+
+}  // namespace processor
+}  // namespace fsq
+
+#endif  // FSQ_HTTP_UPLOADER_H
@@ -0,0 +1,134 @@
+// A benchmark for `fsq::IngestServer`.
+//
+// Measures the ingestion throughput, in MB/s, and in MB/s per core: the MB ingested per second of the CPU time
+// of the process. The clients are --client_threads threads of the same process, each uploading segments
+// of --segment_kb KB of framed records of --record_length bytes over its own keep-alive connection,
+// every segment with an ID of its own. The server receives them with --server_threads threads.
+// The CPU time includes the clients, thus the per core figure is the lower bound of that of the server alone.
+//
+// The working directory is --dir, to compare file systems, e.g., --dir=/dev/shm/fsq for tmpfs.
+// The files are removed by the processor as soon as they are queued.
+//
+// The test runs for --seconds seconds.
+
+/*
+
+for d in build /dev/shm/fsq ; do \
+  mkdir -p $d ; \
+  ./build/ingest_benchmark --dir=$d ; \
+done
+
+for kb in 4 64 1024 ; do \
+  ./build/ingest_benchmark --segment_kb=$kb ; \
+done
+
+*/
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "fsq.h"
+#include "framed_records.h"
+#include "ingest_server.h"
+
+#include "../Bricks/dflags/dflags.h"
+#include "../Bricks/file/file.h"
+#include "../Bricks/net/api/api.h"
+#include "../Bricks/strings/printf.h"
+
+DEFINE_string(dir, "build/ingest_benchmark_dir", "The working directory of FSQ.");
+DEFINE_int32(port, 8099, "The local port for the ingest server to listen on.");
+DEFINE_int32(server_threads, 4, "The number of threads receiving the segments.");
+DEFINE_int32(client_threads, 4, "The number of threads uploading the segments.");
+DEFINE_int32(segment_kb, 64, "The size of each segment, in KB.");
+DEFINE_int32(record_length, 100, "The length of each framed record of the segments.");
+DEFINE_double(seconds, 3.0, "The time to run the benchmark for, in seconds.");
+
+double CPUSeconds() {
+  struct rusage usage;
+  ::getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         1e-6 * (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+// Removes the queued segments right away, for the benchmark to measure the ingestion alone.
+struct Processor {
+  std::atomic<uint64_t> files_processed{0};
+  fsq::FileProcessingResult OnFileReady(const fsq::FileInfo<bricks::time::EPOCH_MILLISECONDS>&,
+                                        bricks::time::EPOCH_MILLISECONDS) {
+    ++files_processed;
+    return fsq::FileProcessingResult::Success;
+  }
+};
+
+typedef fsq::FSQ<fsq::Config<Processor>> BenchmarkFSQ;
+
+std::string Segment() {
+  const std::string record(FLAGS_record_length, 'x');
+  char header[fsq::framed_records::kHeaderSize];
+  fsq::framed_records::EncodeHeader(record.data(), record.length(), header);
+  std::string segment;
+  while (segment.length() < static_cast<size_t>(FLAGS_segment_kb) * 1024) {
+    segment.append(header, fsq::framed_records::kHeaderSize);
+    segment += record;
+  }
+  return segment;
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+
+  bricks::FileSystem::CreateDirectory(FLAGS_dir);
+  Processor processor;
+  BenchmarkFSQ fsq(processor, FLAGS_dir);
+  fsq::IngestServerParameters parameters;
+  parameters.port = FLAGS_port;
+  parameters.threads = FLAGS_server_threads;
+  fsq::IngestServer<BenchmarkFSQ> server(fsq, parameters);
+
+  const std::string segment = Segment();
+  const std::string url = "http://localhost:" + std::to_string(FLAGS_port) + parameters.path + '/';
+  std::atomic_bool done(false);
+  std::atomic<uint64_t> failed_uploads(0);
+  std::vector<std::thread> threads;
+  const double cpu_seconds_before = CPUSeconds();
+  for (int i = 0; i < FLAGS_client_threads; ++i) {
+    threads.emplace_back([&, i]() {
+      for (uint64_t j = 0; !done; ++j) {
+        const std::string id = bricks::strings::Printf("%d-%llu", i, static_cast<unsigned long long>(j));
+        if (HTTP(bricks::net::api::POST(url + id, segment, "application/octet-stream")).code != 200) {
+          ++failed_uploads;
+        }
+      }
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<uint64_t>(1e3 * FLAGS_seconds)));
+  done = true;
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  const double cpu_seconds = CPUSeconds() - cpu_seconds_before;
+  const double mb = 1e-6 * server.NumberOfBytesAccepted();
+
+  printf("Ingesting %d KB segments on %d server threads from %d client threads into '%s'.\n",
+         FLAGS_segment_kb,
+         FLAGS_server_threads,
+         FLAGS_client_threads,
+         FLAGS_dir.c_str());
+  printf("Segments accepted:  %15d (%.3lf MB, %d failed uploads)\n",
+         static_cast<int>(server.NumberOfSegmentsAccepted()),
+         mb,
+         static_cast<int>(failed_uploads));
+  printf("Throughput:         %15.3lf MB/s\n", mb / FLAGS_seconds);
+  printf("Per core:           %15.3lf MB/s (%.3lf CPU seconds)\n", mb / cpu_seconds, cpu_seconds);
+
+  // Closing the idle connections lets the server threads serving them stop.
+  bricks::net::api::HTTPClientPOSIX::ConnectionPool().Clear();
+  return 0;
+}
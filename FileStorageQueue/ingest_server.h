@@ -0,0 +1,260 @@
+// `fsq::IngestServer` is the receiving end of the uploads of many FSQ-s: the aggregation tier, which accepts
+// the finalized files of the clients over HTTP and queues them into its own, local FSQ, for downstream
+// processing in batches.
+//
+// Each `POST` to `path`, or to `path/{segment_id}`, carries one segment, the contents of a finalized file.
+// Its body is saved by `HTTPStreamingServerConnection::SaveRequestBodyToFile()`, which, on Linux, splices it
+// from the socket into the file with no copies through the user space, into `partial_directory`,
+// by default a subdirectory of the working directory of the FSQ, so that it is on the same file system.
+// With `validate_framed_records`, the segment has to consist of valid framed records only, see
+// framed_records.h, and is rejected with "400 Bad Request" otherwise. The valid segment is then handed over
+// to the FSQ with `FSQ::AdoptFile()`, which renames it into the queue without copying its contents.
+//
+// The acknowledgements are idempotent: the segments with the ID of one of the `recent_segment_ids` last
+// accepted ones are acknowledged with "200 OK" again, without being queued twice, so that a client
+// can safely retry an upload whose acknowledgement it has not received. The upload of a segment with
+// the same ID as the one being received at the moment is answered with "503 Service Unavailable",
+// to be retried. The segments posted with no ID are queued as they come. A `GET` of `path/{segment_id}`
+// is the cheap precheck of whether the segment has been accepted already: it is answered with "200 OK"
+// if it is one of the recent ones, and with "404 Not Found" otherwise, for the client to skip uploading
+// the body of the segment the server has, see `HTTPUploader::UseContentIDs()`.
+//
+// The segments are received by `threads` threads, one connection at a time each, which bounds
+// both the concurrency and the number of open files. The connections are kept alive between the requests.
+
+#ifndef FSQ_INGEST_SERVER_H
+#define FSQ_INGEST_SERVER_H
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "framed_records.h"
+
+#include "../Bricks/file/file.h"
+#include "../Bricks/net/http/http.h"
+#include "../Bricks/strings/printf.h"
+#include "../Bricks/time/chrono.h"
+
+namespace fsq {
+
+struct IngestServerParameters {
+  int port = 8095;
+  std::string path = "/segments";
+  // Empty for the "ingest.partial" subdirectory of the working directory of the FSQ.
+  std::string partial_directory;
+  size_t threads = 4;
+  size_t recent_segment_ids = 100000;
+  bool validate_framed_records = true;
+  // The lane of the FSQ to queue the segments into.
+  size_t lane = 0;
+};
+
+template <class T_FSQ>
+class IngestServer final {
+ public:
+  // Throws `bricks::net::SocketException`-s if the port can not be listened on.
+  IngestServer(T_FSQ& fsq, const IngestServerParameters& parameters)
+      : fsq_(fsq),
+        parameters_(parameters),
+        partial_directory_(parameters.partial_directory.empty()
+                               ? bricks::FileSystem::JoinPath(fsq.WorkingDirectory(), "ingest.partial")
+                               : parameters.partial_directory),
+        socket_(parameters.port) {
+    bricks::FileSystem::CreateDirectory(partial_directory_);
+    for (size_t i = 0; i < std::max(parameters_.threads, static_cast<size_t>(1)); ++i) {
+      threads_.emplace_back(&IngestServer::ServingThread, this);
+    }
+  }
+
+  ~IngestServer() {
+    // Wake up each of the threads waiting in `accept()` with a connection of its own.
+    stopping_ = true;
+    for (size_t i = 0; i < threads_.size(); ++i) {
+      try {
+        bricks::net::ClientSocket("localhost", parameters_.port);
+      } catch (const bricks::net::SocketException&) {
+      }
+    }
+    for (std::thread& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  // The number of segments queued into the FSQ, and their total size. THREAD SAFE.
+  size_t NumberOfSegmentsAccepted() const { return segments_accepted_; }
+  uint64_t NumberOfBytesAccepted() const { return bytes_accepted_; }
+
+  // The number of uploads of the segments accepted already, acknowledged without being queued. THREAD SAFE.
+  size_t NumberOfDuplicatesAcknowledged() const { return duplicates_acknowledged_; }
+
+  // The number of segments rejected as malformed. THREAD SAFE.
+  size_t NumberOfSegmentsRejected() const { return segments_rejected_; }
+
+  // The number of prechecks answered with the segment being accepted already. THREAD SAFE.
+  size_t NumberOfKnownSegmentsPrechecked() const { return known_segments_prechecked_; }
+
+ private:
+  void ServingThread() {
+    while (!stopping_) {
+      try {
+        bricks::net::HTTPStreamingServerConnection connection(socket_.Accept());
+        if (stopping_) {
+          return;
+        }
+        do {
+          ServeSegment(connection);
+        } while (connection.NextRequest());
+      } catch (const bricks::Exception&) {
+        // The client has gone away, or has sent a malformed request.
+        // TODO(dkorolev): Log an error message.
+      }
+    }
+  }
+
+  void ServeSegment(bricks::net::HTTPStreamingServerConnection& connection) {
+    const std::string& url = connection.Message().URL();
+    const std::string& method = connection.Message().Method();
+    std::string segment_id;
+    if ((method != "POST" && method != "GET") || !SegmentIDFromURL(url, segment_id) ||
+        (method == "GET" && segment_id.empty())) {
+      connection.SendHTTPResponse("ERROR\n", bricks::net::HTTPResponseCode::NotFound);
+      return;
+    }
+    if (method == "GET") {
+      ServePrecheck(connection, segment_id);
+      return;
+    }
+    if (!segment_id.empty()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (recent_segment_ids_.count(segment_id)) {
+        ++duplicates_acknowledged_;
+        connection.SendHTTPResponse("OK\n");
+        return;
+      }
+      if (!segments_in_progress_.insert(segment_id).second) {
+        connection.SendHTTPResponse("IN PROGRESS\n", bricks::net::HTTPResponseCode::ServiceUnavailable);
+        return;
+      }
+    }
+    const std::string partial_file_name = bricks::FileSystem::JoinPath(
+        partial_directory_,
+        bricks::strings::Printf("segment.%llu.%llu",
+                                static_cast<unsigned long long>(bricks::time::Now()),
+                                static_cast<unsigned long long>(++segment_counter_)));
+    bool accepted = false;
+    bool valid = false;
+    try {
+      connection.SaveRequestBodyToFile(partial_file_name);
+      const uint64_t size = bricks::FileSystem::GetFileSize(partial_file_name);
+      valid = (size > 0) && (!parameters_.validate_framed_records || IsFramedRecords(partial_file_name));
+      if (valid) {
+        accepted = fsq_.AdoptFile(partial_file_name, parameters_.lane);
+        if (accepted) {
+          ++segments_accepted_;
+          bytes_accepted_ += size;
+        }
+      }
+    } catch (...) {
+      OnSegmentDone(segment_id, false, partial_file_name);
+      throw;
+    }
+    OnSegmentDone(segment_id, accepted, partial_file_name);
+    if (accepted) {
+      connection.SendHTTPResponse("OK\n");
+    } else if (!valid) {
+      ++segments_rejected_;
+      connection.SendHTTPResponse("MALFORMED\n", bricks::net::HTTPResponseCode::BadRequest);
+    } else {
+      // The FSQ is shutting down.
+      connection.SendHTTPResponse("SHUTTING DOWN\n", bricks::net::HTTPResponseCode::ServiceUnavailable);
+    }
+  }
+
+  // The segments being received are not known yet: their uploads are answered with "503" until they are done.
+  void ServePrecheck(bricks::net::HTTPStreamingServerConnection& connection, const std::string& segment_id) {
+    bool known;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      known = recent_segment_ids_.count(segment_id) > 0;
+    }
+    if (known) {
+      ++known_segments_prechecked_;
+      connection.SendHTTPResponse("OK\n");
+    } else {
+      connection.SendHTTPResponse("UNKNOWN\n", bricks::net::HTTPResponseCode::NotFound);
+    }
+  }
+
+  // Accepts `path` and `path/{segment_id}`, with the ID of the segment returned in `segment_id`.
+  bool SegmentIDFromURL(const std::string& url, std::string& segment_id) const {
+    const std::string& path = parameters_.path;
+    if (url == path) {
+      segment_id.clear();
+      return true;
+    } else if (url.length() > path.length() + 1 && !url.compare(0, path.length(), path) &&
+               url[path.length()] == '/') {
+      segment_id = url.substr(path.length() + 1);
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  static bool IsFramedRecords(const std::string& file_name) {
+    const bricks::MemoryMappedFile mapped_file(file_name);
+    return framed_records::ValidPrefixLength(mapped_file.data(), mapped_file.size()) == mapped_file.size();
+  }
+
+  // Remembers the ID of the accepted segment, and removes the file of the segment not handed over to the FSQ.
+  void OnSegmentDone(const std::string& segment_id, bool accepted, const std::string& partial_file_name) {
+    if (!accepted) {
+      bricks::FileSystem::RemoveFile(partial_file_name, bricks::RemoveFileParameters::Silent);
+    }
+    if (!segment_id.empty()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      segments_in_progress_.erase(segment_id);
+      if (accepted && parameters_.recent_segment_ids) {
+        recent_segment_ids_.insert(segment_id);
+        recent_segment_ids_order_.push_back(segment_id);
+        if (recent_segment_ids_order_.size() > parameters_.recent_segment_ids) {
+          recent_segment_ids_.erase(recent_segment_ids_order_.front());
+          recent_segment_ids_order_.pop_front();
+        }
+      }
+    }
+  }
+
+  T_FSQ& fsq_;
+  const IngestServerParameters parameters_;
+  const std::string partial_directory_;
+  bricks::net::Socket socket_;
+
+  std::mutex mutex_;
+  std::unordered_set<std::string> recent_segment_ids_;
+  std::deque<std::string> recent_segment_ids_order_;
+  std::unordered_set<std::string> segments_in_progress_;
+
+  std::atomic_size_t segment_counter_{0};
+  std::atomic_size_t segments_accepted_{0};
+  std::atomic<uint64_t> bytes_accepted_{0};
+  std::atomic_size_t duplicates_acknowledged_{0};
+  std::atomic_size_t segments_rejected_{0};
+  std::atomic_size_t known_segments_prechecked_{0};
+  std::atomic_bool stopping_{false};
+
+  std::vector<std::thread> threads_;
+
+  IngestServer(const IngestServer&) = delete;
+  void operator=(const IngestServer&) = delete;
+};
+
+}  // namespace fsq
+
+#endif  // FSQ_INGEST_SERVER_H
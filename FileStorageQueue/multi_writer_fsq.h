@@ -0,0 +1,120 @@
+// Class MultiWriterFSQ is the front end to FSQ for many concurrent producers.
+//
+// Messages are first pushed into an in-memory `EfficientMQ`, and a single writer thread, owned by that queue,
+// appends them to the FSQ. This way the producers only pay the cost of an in-memory enqueue,
+// while the file is only ever written into from one thread.
+//
+// By default, the in-memory stage is lossless: if the writer falls behind by more than `BUFFER_SIZE`
+// messages, the producers block until it catches up. With `MQOverflowPolicy::DropOldest` or
+// `MQOverflowPolicy::RejectNewest` the producers never block, and the messages lost to the overflow
+// are accounted for in the file itself: before the next batch, the writer appends the marker record
+// `DROPPED_MESSAGES_MARKER::Marker(n)`, which is a regular message to the FSQ, separated as any other one.
+// The destructor writes out all the messages pushed so far.
+//
+// Keep in mind that messages are appended to the file asynchronously: a message that has just been pushed
+// may not yet be accounted for by `GetQueueStatus()` or become part of a file finalized by `ForceProcessing()`.
+
+#ifndef FSQ_MULTI_WRITER_FSQ_H
+#define FSQ_MULTI_WRITER_FSQ_H
+
+#include <string>
+#include <utility>
+
+#include "fsq.h"
+
+#include "../CachingMessageQueue/mq_efficient.h"
+
+namespace fsq {
+
+// The default marker record for the messages dropped by the in-memory stage of `MultiWriterFSQ`.
+struct DroppedMessagesMarker {
+  static std::string Marker(size_t number_of_dropped_messages) {
+    return "#DROPPED " + std::to_string(number_of_dropped_messages);
+  }
+};
+
+template <class CONFIG,
+          size_t BUFFER_SIZE = 1024,
+          MQOverflowPolicy OVERFLOW_POLICY = MQOverflowPolicy::BlockProducer,
+          class DROPPED_MESSAGES_MARKER = DroppedMessagesMarker>
+class MultiWriterFSQ final {
+ public:
+  typedef CONFIG T_CONFIG;
+  typedef FSQ<T_CONFIG> T_FSQ;
+  typedef typename T_FSQ::T_MESSAGE T_MESSAGE;
+  typedef typename T_FSQ::Status Status;
+
+  // Takes the same parameters as the constructor of FSQ.
+  template <typename... ARGS>
+  explicit MultiWriterFSQ(ARGS&&... args)
+      : fsq_(std::forward<ARGS>(args)...), writer_(fsq_), message_queue_(writer_, BUFFER_SIZE) {
+  }
+
+  // Enqueues the message to be appended to the FSQ by the writer thread. THREAD SAFE.
+  // Returns false if the message was rejected, which only happens with `MQOverflowPolicy::RejectNewest`.
+  bool PushMessage(const T_MESSAGE& message) {
+    return message_queue_.PushMessage(message);
+  }
+  bool PushMessage(T_MESSAGE&& message) {
+    return message_queue_.PushMessage(std::move(message));
+  }
+  template <typename ITERATOR>
+  void PushMessages(ITERATOR begin, ITERATOR end) {
+    for (ITERATOR it = begin; it != end; ++it) {
+      message_queue_.PushMessage(*it);
+    }
+  }
+
+  // The most commonly used methods of FSQ, forwarded for convenience.
+  const Status GetQueueStatus() const {
+    return fsq_.GetQueueStatus();
+  }
+  void ResumeProcessing() {
+    fsq_.ResumeProcessing();
+  }
+  void ForceProcessing(bool force_finalize_current_file = false) {
+    fsq_.ForceProcessing(force_finalize_current_file);
+  }
+
+  // The FSQ itself, for the rest of its methods, including the setters of the strategies.
+  T_FSQ& UnderlyingFSQ() {
+    return fsq_;
+  }
+
+ private:
+  // The consumer of the in-memory stage, called from its only thread.
+  // Takes whatever has been enqueued by the time it wakes up, and appends it to the FSQ as one batch,
+  // preceded by the marker record if any messages have been dropped since the previous batch.
+  struct Writer {
+    explicit Writer(T_FSQ& queue) : queue(queue) {
+    }
+    void OnMessage(const T_MESSAGE& message, size_t dropped) {
+      MarkDropped(dropped);
+      queue.PushMessage(message);
+    }
+    void OnMessages(const T_MESSAGE* begin, const T_MESSAGE* end, size_t dropped) {
+      MarkDropped(dropped);
+      queue.PushMessages(begin, end);
+    }
+    void MarkDropped(size_t dropped) {
+      if (dropped) {
+        queue.PushMessage(DROPPED_MESSAGES_MARKER::Marker(dropped));
+      }
+    }
+    T_FSQ& queue;
+  };
+
+  // The order matters: the in-memory stage is destructed, and thus flushed into the FSQ, first.
+  T_FSQ fsq_;
+  Writer writer_;
+  EfficientMQ<Writer, T_MESSAGE, BUFFER_SIZE, OVERFLOW_POLICY> message_queue_;
+
+  MultiWriterFSQ(const MultiWriterFSQ&) = delete;
+  MultiWriterFSQ(MultiWriterFSQ&&) = delete;
+  void operator=(const MultiWriterFSQ&) = delete;
+  void operator=(MultiWriterFSQ&&) = delete;
+};
+
+}  // namespace fsq
+
+#endif  // FSQ_MULTI_WRITER_FSQ_H
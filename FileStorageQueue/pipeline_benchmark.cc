@@ -0,0 +1,454 @@
+// A soak benchmark of the whole pipeline:
+// producers -> `EfficientMQ` -> FSQ -> `HTTPUploader` -> `IngestServer`.
+//
+// The benchmarks of the pieces miss how they interact: the finalization of a file stalling the consumer
+// of the in-memory queue, the uploads competing with the appends for the disk, the ingestion pushing back.
+// Here, --producers threads push --event_length byte events, each stamped with the time it was produced,
+// at --events_per_second_per_producer each, or as fast as they can if it is zero, into an `EfficientMQ`
+// of --mq_buffer events, which rejects the events once it is full. Its consumer thread appends them
+// to the client FSQ in --dir, as framed records, finalized at --finalize_kb or --finalize_ms and purged
+// beyond --purge_mb. The finalized files are POSTed by --upload_threads `HTTPUploader`-s to an `IngestServer`
+// with --server_threads threads on --port, which queues them into the ingest FSQ in --ingest_dir, whose
+// processor reads the events back, and deletes the files.
+//
+// Every --report_seconds, the benchmark prints the events produced and ingested per second so far, the events
+// rejected by the in-memory queue, and the disk used by each of the two FSQ-s, the finalized files
+// and the current one. Once --seconds are over, the producers stop, the pipeline is given up to
+// --drain_seconds to deliver what has been accepted, and the benchmark prints the sustained throughput,
+// the end-to-end latency percentiles of one in --latency_sample_every events, from being produced
+// to being read back, the events lost, and the CPU time of each component: of the producers, of the thread
+// appending to the client FSQ, of the upload threads, of the processing threads of the ingest FSQ, and of
+// the rest of the process, mostly the threads of the ingest server. The CPU times are those of the threads
+// as reported by themselves from within each component.
+//
+// For the two ends to run on different hosts, use --role=server on the receiving one, and --role=client
+// --upload_url=http://host:port/segments on the sending one. The latencies are then measured by the server,
+// against the wall clocks of the two hosts, thus only as precise as those are in sync.
+
+/*
+
+# The default soak, on one host.
+./build/pipeline_benchmark --seconds=60
+
+# Find the sustained rate: the events produced per second at which nothing is rejected or lost.
+for rate in 10000 50000 200000 ; do \
+  ./build/pipeline_benchmark --events_per_second_per_producer=$rate --seconds=30 ; \
+done
+
+# Larger files: fewer uploads, longer latencies.
+for kb in 64 1024 8192 ; do \
+  ./build/pipeline_benchmark --finalize_kb=$kb --finalize_ms=10000 ; \
+done
+
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include "fsq.h"
+#include "framed_records.h"
+#include "http_uploader.h"
+#include "ingest_server.h"
+
+#include "../Bricks/dflags/dflags.h"
+#include "../Bricks/file/file.h"
+#include "../Bricks/net/api/api.h"
+#include "../Bricks/strings/printf.h"
+
+#include "../CachingMessageQueue/mq_efficient.h"
+
+DEFINE_string(role, "all", "'all' for the whole pipeline, 'client' or 'server' for one end of it.");
+DEFINE_string(dir, "build/pipeline_benchmark_client", "The working directory of the client FSQ.");
+DEFINE_string(ingest_dir, "build/pipeline_benchmark_ingest", "The working directory of the ingest FSQ.");
+DEFINE_int32(port, 8097, "The local port for the ingest server to listen on.");
+DEFINE_string(upload_url, "", "For --role=client, the URL of the ingest server to upload the files to.");
+
+DEFINE_int32(producers, 4, "The number of threads producing the events.");
+DEFINE_double(events_per_second_per_producer, 0.0, "The rate of each producer, zero for as fast as possible.");
+DEFINE_int32(event_length, 100, "The size of each event, in bytes, including its timestamp.");
+DEFINE_uint64(mq_buffer, 65536, "The events the in-memory queue holds before rejecting the new ones.");
+
+DEFINE_uint64(finalize_kb, 256, "Finalize the current file of the client FSQ once it reaches this size, KB.");
+DEFINE_uint64(finalize_ms, 1000, "Finalize the current file of the client FSQ once it gets this old, in ms.");
+DEFINE_uint64(purge_mb, 1024, "Purge the oldest files once the client FSQ exceeds this size, in MB.");
+DEFINE_int32(upload_threads, 2, "The number of threads of the client FSQ uploading the files.");
+DEFINE_int32(server_threads, 4, "The number of threads of the ingest server receiving the files.");
+
+DEFINE_int32(latency_sample_every, 16, "Measure the end-to-end latency of one in this many events.");
+DEFINE_double(report_seconds, 1.0, "The time between the progress reports, in seconds.");
+DEFINE_double(seconds, 10.0, "The time to produce the events for, in seconds.");
+DEFINE_double(drain_seconds, 10.0, "The time to wait for the accepted events to be ingested, in seconds.");
+
+// The wall clock, for the events to be stamped on one host and read back on another.
+uint64_t NowMicroseconds() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch())
+          .count());
+}
+
+// The moment `seconds` from now, and the seconds since `begin`.
+std::chrono::steady_clock::time_point SecondsFromNow(double seconds) {
+  return std::chrono::steady_clock::now() + std::chrono::microseconds(static_cast<uint64_t>(1e6 * seconds));
+}
+double SecondsSince(std::chrono::steady_clock::time_point begin) {
+  return 1e-6 * static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(
+                                         std::chrono::steady_clock::now() - begin).count());
+}
+
+double CPUSeconds() {
+  struct rusage usage;
+  ::getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         1e-6 * (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+double ThreadCPUSeconds() {
+  struct timespec ts;
+  ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// The value below which the `percentile` (0 to 100) of the sorted values lie.
+double Percentile(const std::vector<double>& sorted, double percentile) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  const size_t index = static_cast<size_t>(percentile * 1e-2 * static_cast<double>(sorted.size() - 1) + 0.5);
+  return sorted[std::min(index, sorted.size() - 1)];
+}
+
+// The CPU time of the threads of one component, each as it has last reported from within the component.
+class ComponentCPU {
+ public:
+  void Report() {
+    const double seconds = ThreadCPUSeconds();
+    std::lock_guard<std::mutex> lock(mutex_);
+    seconds_[std::this_thread::get_id()] = seconds;
+  }
+  double Seconds() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    double total = 0.0;
+    for (const auto& it : seconds_) {
+      total += it.second;
+    }
+    return total;
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  std::map<std::thread::id, double> seconds_;
+};
+
+// The event: the time it was produced, in microseconds, padded to --event_length bytes.
+std::string Event(uint64_t produced_us) {
+  std::string event = std::to_string(produced_us);
+  event.resize(std::max(event.length(), static_cast<size_t>(FLAGS_event_length)), ' ');
+  return event;
+}
+
+uint64_t ProducedMicroseconds(const char* data, size_t length) {
+  uint64_t us = 0;
+  for (size_t i = 0; i < length && data[i] >= '0' && data[i] <= '9'; ++i) {
+    us = us * 10 + static_cast<uint64_t>(data[i] - '0');
+  }
+  return us;
+}
+
+struct FlagsFinalizationStrategy {
+  bool ShouldFinalize(const fsq::QueueStatus<bricks::time::EPOCH_MILLISECONDS>& status,
+                      const bricks::time::EPOCH_MILLISECONDS now) const {
+    return status.appended_file_size >= FLAGS_finalize_kb * 1024 ||
+           static_cast<uint64_t>(now - status.appended_file_timestamp) > FLAGS_finalize_ms;
+  }
+};
+
+struct FlagsPurgeStrategy {
+  template <typename T_TIMESTAMP>
+  bool ShouldPurge(const fsq::QueueStatus<T_TIMESTAMP>& status) const {
+    return status.finalized.total_size + status.appended_file_size > FLAGS_purge_mb * 1024 * 1024;
+  }
+};
+
+// The processor of the client FSQ: the uploader, with the CPU time of its threads accounted for.
+struct UploadingProcessor {
+  fsq::processor::HTTPUploader uploader;
+  ComponentCPU cpu;
+
+  explicit UploadingProcessor(const std::string& url) : uploader(url) {
+  }
+  fsq::FileProcessingResult OnFileReady(const fsq::FileInfo<bricks::time::EPOCH_MILLISECONDS>& file_info,
+                                        bricks::time::EPOCH_MILLISECONDS now) {
+    const fsq::FileProcessingResult result = uploader.OnFileReady(file_info, now);
+    cpu.Report();
+    return result;
+  }
+};
+
+struct ClientConfig : fsq::Config<UploadingProcessor> {
+  typedef fsq::strategy::AppendFramedRecords T_FILE_APPEND_STRATEGY;
+  typedef FlagsFinalizationStrategy T_FINALIZE_STRATEGY;
+  typedef FlagsPurgeStrategy T_PURGE_STRATEGY;
+  inline static size_t NumberOfProcessingThreads() {
+    return static_cast<size_t>(std::max(FLAGS_upload_threads, 1));
+  }
+};
+typedef fsq::FSQ<ClientConfig> ClientFSQ;
+
+// The consumer of the in-memory queue, appending the events to the client FSQ in batches.
+struct Writer {
+  ClientFSQ& fsq;
+  ComponentCPU cpu;
+
+  explicit Writer(ClientFSQ& fsq) : fsq(fsq) {
+  }
+  void OnMessages(const std::string* begin, const std::string* end, size_t) {
+    fsq.PushMessages(begin, end);
+    cpu.Report();
+  }
+};
+
+typedef EfficientMQ<Writer, std::string, 65536, MQOverflowPolicy::RejectNewest> PipelineMQ;
+
+// The processor of the ingest FSQ: reads the events back, sampling their end-to-end latencies.
+struct IngestProcessor {
+  std::atomic<uint64_t> events_ingested{0};
+  ComponentCPU cpu;
+  std::mutex mutex;
+  std::vector<double> latencies_us;
+
+  fsq::FileProcessingResult OnFileReady(const fsq::FileInfo<bricks::time::EPOCH_MILLISECONDS>& file_info,
+                                        bricks::time::EPOCH_MILLISECONDS) {
+    const std::string contents = bricks::FileSystem::ReadFileAsString(file_info.full_path_name);
+    const uint64_t now_us = NowMicroseconds();
+    const uint64_t sample_every = static_cast<uint64_t>(std::max(FLAGS_latency_sample_every, 1));
+    uint64_t events = 0;
+    std::vector<double> sampled;
+    for (const fsq::FramedRecord& record : fsq::FramedRecords(contents.data(), contents.length())) {
+      if ((events_ingested + events) % sample_every == 0) {
+        const uint64_t produced_us = ProducedMicroseconds(record.data, record.length);
+        sampled.push_back(now_us > produced_us ? static_cast<double>(now_us - produced_us) : 0.0);
+      }
+      ++events;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      latencies_us.insert(latencies_us.end(), sampled.begin(), sampled.end());
+    }
+    events_ingested += events;
+    cpu.Report();
+    return fsq::FileProcessingResult::Success;
+  }
+};
+typedef fsq::FSQ<fsq::Config<IngestProcessor>> IngestFSQ;
+
+// The producer pushes the events at the rate of --events_per_second_per_producer, if it is set.
+void Produce(PipelineMQ& mq,
+             const std::atomic_bool& done,
+             std::atomic<uint64_t>& produced,
+             std::atomic<uint64_t>& rejected,
+             ComponentCPU& cpu) {
+  const auto begin = std::chrono::steady_clock::now();
+  uint64_t events = 0;
+  while (!done) {
+    if (FLAGS_events_per_second_per_producer > 0) {
+      const auto due = begin + std::chrono::microseconds(static_cast<uint64_t>(
+                                   1e6 * static_cast<double>(events) / FLAGS_events_per_second_per_producer));
+      while (std::chrono::steady_clock::now() < due) {
+        if (done) {
+          break;
+        }
+        std::this_thread::yield();
+      }
+    }
+    if (!mq.PushMessage(Event(NowMicroseconds()))) {
+      ++rejected;
+    }
+    ++produced;
+    if (!(++events % 1024)) {
+      cpu.Report();
+    }
+  }
+  cpu.Report();
+}
+
+uint64_t DiskUsage(const fsq::QueueCounters<bricks::time::EPOCH_MILLISECONDS>& counters) {
+  return counters.finalized_total_size + counters.appended_file_size;
+}
+
+void PrintLatencies(IngestProcessor& processor) {
+  std::vector<double> latencies_us;
+  {
+    std::lock_guard<std::mutex> lock(processor.mutex);
+    latencies_us = processor.latencies_us;
+  }
+  std::sort(latencies_us.begin(), latencies_us.end());
+  printf("End-to-end latency, ms:   p50          p90          p99        p99.9          max  (%d sampled)\n",
+         static_cast<int>(latencies_us.size()));
+  printf("               %12.3lf %12.3lf %12.3lf %12.3lf %12.3lf\n",
+         1e-3 * Percentile(latencies_us, 50),
+         1e-3 * Percentile(latencies_us, 90),
+         1e-3 * Percentile(latencies_us, 99),
+         1e-3 * Percentile(latencies_us, 99.9),
+         1e-3 * (latencies_us.empty() ? 0.0 : latencies_us.back()));
+}
+
+// Runs the ingest end alone, reporting what it receives, until --seconds and --drain_seconds are over.
+void RunServer() {
+  bricks::FileSystem::CreateDirectory(FLAGS_ingest_dir);
+  IngestProcessor processor;
+  IngestFSQ ingest_fsq(processor, FLAGS_ingest_dir);
+  fsq::IngestServerParameters parameters;
+  parameters.port = FLAGS_port;
+  parameters.threads = static_cast<size_t>(FLAGS_server_threads);
+  fsq::IngestServer<IngestFSQ> server(ingest_fsq, parameters);
+  const auto begin = std::chrono::steady_clock::now();
+  const auto end = SecondsFromNow(FLAGS_seconds + FLAGS_drain_seconds);
+  printf("        t  events ingested/s  ingest MB on disk\n");
+  while (std::chrono::steady_clock::now() < end) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<uint64_t>(1e3 * FLAGS_report_seconds)));
+    const double t = SecondsSince(begin);
+    printf("%9.1lf  %17.0lf  %17.3lf\n",
+           t,
+           processor.events_ingested / t,
+           1e-6 * DiskUsage(ingest_fsq.GetQueueCounters()));
+  }
+  printf("Events ingested:    %15llu\n", static_cast<unsigned long long>(processor.events_ingested));
+  PrintLatencies(processor);
+  bricks::net::api::HTTPClientPOSIX::ConnectionPool().Clear();
+}
+
+// Runs the producers and the client FSQ, along with the ingest end, unless it runs on another host.
+void RunClient(bool with_server) {
+  std::unique_ptr<IngestProcessor> ingest_processor;
+  std::unique_ptr<IngestFSQ> ingest_fsq;
+  std::unique_ptr<fsq::IngestServer<IngestFSQ>> server;
+  fsq::IngestServerParameters parameters;
+  parameters.port = FLAGS_port;
+  parameters.threads = static_cast<size_t>(FLAGS_server_threads);
+  if (with_server) {
+    bricks::FileSystem::CreateDirectory(FLAGS_ingest_dir);
+    ingest_processor.reset(new IngestProcessor());
+    ingest_fsq.reset(new IngestFSQ(*ingest_processor, FLAGS_ingest_dir));
+    server.reset(new fsq::IngestServer<IngestFSQ>(*ingest_fsq, parameters));
+  }
+  const std::string url =
+      with_server ? "http://localhost:" + std::to_string(FLAGS_port) + parameters.path : FLAGS_upload_url;
+
+  bricks::FileSystem::CreateDirectory(FLAGS_dir);
+  UploadingProcessor uploader(url);
+  ClientFSQ client_fsq(uploader, FLAGS_dir);
+  Writer writer(client_fsq);
+  std::atomic<uint64_t> produced(0);
+  std::atomic<uint64_t> rejected(0);
+  ComponentCPU producers_cpu;
+  const double cpu_seconds_before = CPUSeconds();
+  const auto begin = std::chrono::steady_clock::now();
+  {
+    PipelineMQ mq(writer, static_cast<size_t>(FLAGS_mq_buffer));
+    std::atomic_bool done(false);
+    std::vector<std::thread> producers;
+    for (int i = 0; i < FLAGS_producers; ++i) {
+      producers.emplace_back(Produce,
+                             std::ref(mq),
+                             std::cref(done),
+                             std::ref(produced),
+                             std::ref(rejected),
+                             std::ref(producers_cpu));
+    }
+
+    const auto end = SecondsFromNow(FLAGS_seconds);
+    printf(
+        "        t  events produced/s  events ingested/s     rejected  client MB on disk  ingest MB on disk\n");
+    while (std::chrono::steady_clock::now() < end) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<uint64_t>(1e3 * FLAGS_report_seconds)));
+      // Have the uploads go on once the ingest server is reachable again.
+      client_fsq.ResumeProcessing();
+      const double t = SecondsSince(begin);
+      printf("%9.1lf  %17.0lf  %17.0lf  %11llu  %17.3lf  %17.3lf\n",
+             t,
+             produced / t,
+             ingest_processor ? ingest_processor->events_ingested / t : 0.0,
+             static_cast<unsigned long long>(rejected),
+             1e-6 * DiskUsage(client_fsq.GetQueueCounters()),
+             ingest_fsq ? 1e-6 * DiskUsage(ingest_fsq->GetQueueCounters()) : 0.0);
+    }
+    done = true;
+    for (std::thread& thread : producers) {
+      thread.join();
+    }
+    // The destructor of the queue has the writer append all the events accepted.
+  }
+  const double seconds = SecondsSince(begin);
+  const uint64_t accepted = produced - rejected;
+
+  // Give the pipeline the time to deliver the events accepted.
+  const auto drain_end = SecondsFromNow(FLAGS_drain_seconds);
+  while (ingest_processor && ingest_processor->events_ingested < accepted &&
+         std::chrono::steady_clock::now() < drain_end) {
+    client_fsq.ResumeProcessing();
+    client_fsq.ForceProcessing();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  const double cpu_seconds = CPUSeconds() - cpu_seconds_before;
+
+  printf("Events produced:    %15llu (%.0lf per second)\n",
+         static_cast<unsigned long long>(produced),
+         produced / seconds);
+  printf("Rejected by the MQ: %15llu\n", static_cast<unsigned long long>(rejected));
+  if (ingest_processor) {
+    const uint64_t ingested = ingest_processor->events_ingested;
+    printf("Events ingested:    %15llu (%.0lf per second sustained)\n",
+           static_cast<unsigned long long>(ingested),
+           ingested / seconds);
+    printf("Lost or in flight:  %15llu\n",
+           static_cast<unsigned long long>(accepted > ingested ? accepted - ingested : 0));
+    PrintLatencies(*ingest_processor);
+  }
+  const double producers_cpu_seconds = producers_cpu.Seconds();
+  const double writer_cpu_seconds = writer.cpu.Seconds();
+  const double uploader_cpu_seconds = uploader.cpu.Seconds();
+  const double ingest_cpu_seconds = ingest_processor ? ingest_processor->cpu.Seconds() : 0.0;
+  printf("CPU seconds:  producers %.3lf, MQ -> FSQ %.3lf, uploads %.3lf, ingest FSQ %.3lf, the rest %.3lf\n",
+         producers_cpu_seconds,
+         writer_cpu_seconds,
+         uploader_cpu_seconds,
+         ingest_cpu_seconds,
+         std::max(cpu_seconds - producers_cpu_seconds - writer_cpu_seconds - uploader_cpu_seconds -
+                      ingest_cpu_seconds,
+                  0.0));
+
+  client_fsq.ShutdownAndRemoveAllFSQFiles();
+  // Closing the idle connections lets the server threads serving them stop.
+  bricks::net::api::HTTPClientPOSIX::ConnectionPool().Clear();
+  server.reset();
+  if (ingest_fsq) {
+    ingest_fsq->ShutdownAndRemoveAllFSQFiles();
+  }
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+
+  if (FLAGS_role == "server") {
+    RunServer();
+  } else if (FLAGS_role == "client" && !FLAGS_upload_url.empty()) {
+    RunClient(false);
+  } else if (FLAGS_role == "all") {
+    RunClient(true);
+  } else {
+    fprintf(stderr, "Use --role=all, --role=server, or --role=client with --upload_url.\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,176 @@
+// Rate-limited processing of finalized files, to be used as `T_RETRY_STRATEGY`.
+//
+// Caps the number of files and the number of bytes processed per second with two token buckets,
+// on top of another retry strategy, the exponential one by default, which keeps handling the failures.
+// Each bucket refills at its rate up to its burst size; a file is processed when the files bucket holds
+// at least one token and the bytes bucket is not in debt. The bytes bucket is charged after the fact,
+// with the size of each processed file, as the size of the next file is not known when deciding to wait.
+//
+// Each bucket is kept as the time at which it would be full again, which makes its state a timestamp,
+// persisted with `FixedSizeSerializer`, same as the one of `ExponentialDelayRetryStrategy`.
+// With `AttachToFile(filename)`, the buckets are saved to "${filename}.rate_limit", for the limits
+// to hold across restarts.
+
+#ifndef FSQ_RATE_LIMITED_RETRY_STRATEGY_H
+#define FSQ_RATE_LIMITED_RETRY_STRATEGY_H
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+#include "exponential_retry_strategy.h"
+
+#include "../Bricks/file/file.h"
+#include "../Bricks/strings/fixed_size_serializer.h"
+#include "../Bricks/time/chrono.h"
+
+namespace fsq {
+namespace strategy {
+
+template <typename FILE_SYSTEM_FOR_RETRY_STRATEGY,
+          typename RETRY_STRATEGY = ExponentialDelayRetryStrategy<FILE_SYSTEM_FOR_RETRY_STRATEGY>>
+class TokenBucketRateLimitedRetryStrategy : public RETRY_STRATEGY {
+ public:
+  typedef FILE_SYSTEM_FOR_RETRY_STRATEGY T_FILE_SYSTEM;
+  typedef RETRY_STRATEGY T_BASE_RETRY_STRATEGY;
+  // Zero rate stands for no limit.
+  struct RateLimits {
+    double files_per_second = 0;
+    double bytes_per_second = 0;
+    double burst_files = 1;
+    double burst_bytes = 0;
+    RateLimits() = default;
+    RateLimits(double files_per_second, double bytes_per_second, double burst_files = 1, double burst_bytes = 0)
+        : files_per_second(files_per_second),
+          bytes_per_second(bytes_per_second),
+          burst_files(std::max(burst_files, 1.0)),
+          burst_bytes(burst_bytes) {
+    }
+  };
+  TokenBucketRateLimitedRetryStrategy(const T_FILE_SYSTEM& file_system,
+                                      const RateLimits& limits,
+                                      const T_BASE_RETRY_STRATEGY& retry_strategy)
+      : T_BASE_RETRY_STRATEGY(retry_strategy),
+        file_system_(file_system),
+        limits_(limits),
+        files_full_time_(NowMs()),
+        bytes_full_time_(files_full_time_) {
+  }
+  explicit TokenBucketRateLimitedRetryStrategy(const T_FILE_SYSTEM& file_system,
+                                               const RateLimits& limits = RateLimits())
+      : TokenBucketRateLimitedRetryStrategy(file_system, limits, T_BASE_RETRY_STRATEGY(file_system)) {
+  }
+  void SetRateLimits(const RateLimits& limits) {
+    limits_ = limits;
+  }
+  void AttachToFile(const std::string& filename) {
+    T_BASE_RETRY_STRATEGY::AttachToFile(filename);
+    if (!filename.empty()) {
+      persistence_filename_ = filename + ".rate_limit";
+      ResumeStateFromFile();
+      SaveStateToFile();
+    }
+  }
+  // OnSuccess(size): Take one token from the files bucket and `size` tokens from the bytes one.
+  // FSQ calls this form, rather than the argument-less one, for the strategies that provide it.
+  void OnSuccess(uint64_t processed_file_size) {
+    const double now = NowMs();
+    Take(limits_.files_per_second, 1.0, now, files_full_time_);
+    Take(limits_.bytes_per_second, static_cast<double>(processed_file_size), now, bytes_full_time_);
+    T_BASE_RETRY_STRATEGY::OnSuccess();
+    if (!persistence_filename_.empty()) {
+      SaveStateToFile();
+    }
+  }
+  void OnSuccess() {
+    OnSuccess(0u);
+  }
+  bool ShouldWait(bricks::time::MILLISECONDS_INTERVAL* output_wait_ms) {
+    if (T_BASE_RETRY_STRATEGY::ShouldWait(output_wait_ms)) {
+      return true;
+    }
+    const double now = NowMs();
+    const double wait_ms =
+        std::max(WaitMs(limits_.files_per_second, limits_.burst_files, 1.0, now, files_full_time_),
+                 WaitMs(limits_.bytes_per_second, limits_.burst_bytes, 0.0, now, bytes_full_time_));
+    if (wait_ms > 0) {
+      *output_wait_ms =
+          static_cast<bricks::time::MILLISECONDS_INTERVAL>(static_cast<uint64_t>(std::ceil(wait_ms)));
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+ protected:
+  // File format is "${files_full_time} ${bytes_full_time}".
+  void ResumeStateFromFile() {
+    using typename bricks::time::EPOCH_MILLISECONDS;
+    try {
+      const std::string contents = std::move(file_system_.ReadFileAsString(persistence_filename_));
+      constexpr size_t w = bricks::strings::FixedSizeSerializer<EPOCH_MILLISECONDS>::size_in_bytes;
+      typedef bricks::strings::FixedSizeSerializer<EPOCH_MILLISECONDS> Serializer;
+      EPOCH_MILLISECONDS files_full_time;
+      EPOCH_MILLISECONDS bytes_full_time;
+      if (contents.length() == w * 2 + 1 && contents[w] == ' ' &&
+          Serializer::Unpack(contents.data(), files_full_time) &&
+          Serializer::Unpack(contents.data() + w + 1, bytes_full_time)) {
+        files_full_time_ = std::max(files_full_time_, FromEpochMilliseconds(files_full_time));
+        bytes_full_time_ = std::max(bytes_full_time_, FromEpochMilliseconds(bytes_full_time));
+      } else {
+        // TODO(dkorolev): Log an error message, file format is incorrect.
+      }
+    } catch (const bricks::FileException&) {
+      // TODO(dkorolev): Log an error message, could not read the file.
+    }
+  }
+  void SaveStateToFile() const {
+    typedef bricks::strings::FixedSizeSerializer<bricks::time::EPOCH_MILLISECONDS> Serializer;
+    constexpr size_t w = Serializer::size_in_bytes;
+    try {
+      std::string contents(w * 2 + 1, ' ');
+      Serializer::Pack(ToEpochMilliseconds(files_full_time_), &contents[0]);
+      Serializer::Pack(ToEpochMilliseconds(bytes_full_time_), &contents[w + 1]);
+      file_system_.WriteFileAtomically(
+          persistence_filename_, contents, bricks::WriteFileAtomicallyParameters::NoSync);
+    } catch (const bricks::FileException&) {
+      // TODO(dkorolev): Log an error message, could not write the file.
+    }
+  }
+
+ private:
+  static double NowMs() {
+    return FromEpochMilliseconds(bricks::time::Now());
+  }
+  static double FromEpochMilliseconds(bricks::time::EPOCH_MILLISECONDS ms) {
+    return static_cast<double>(static_cast<uint64_t>(ms));
+  }
+  static bricks::time::EPOCH_MILLISECONDS ToEpochMilliseconds(double ms) {
+    return static_cast<bricks::time::EPOCH_MILLISECONDS>(static_cast<uint64_t>(std::ceil(ms)));
+  }
+  // The time, in milliseconds, it takes for an empty bucket to refill.
+  static double RefillMs(double rate, double burst) {
+    return rate > 0 ? burst * 1e3 / rate : 0;
+  }
+  static void Take(double rate, double tokens, double now, double& full_time) {
+    if (rate > 0) {
+      full_time = std::max(full_time, now) + tokens * 1e3 / rate;
+    }
+  }
+  // How long to wait for the bucket to hold `required` tokens. The bucket holds
+  // `burst - (full_time - now) * rate` tokens when `full_time` is in the future, and `burst` otherwise.
+  static double WaitMs(double rate, double burst, double required, double now, double full_time) {
+    return rate > 0 ? (full_time - now) - RefillMs(rate, burst - required) : 0;
+  }
+
+  const T_FILE_SYSTEM& file_system_;
+  RateLimits limits_;
+  double files_full_time_;
+  double bytes_full_time_;
+  std::string persistence_filename_;
+};
+
+}  // namespace strategy
+}  // namespace fsq
+
+#endif  // FSQ_RATE_LIMITED_RETRY_STRATEGY_H
@@ -0,0 +1,174 @@
+// The scheduler shared by many FSQ-s, to run their processing on a small pool of threads, see `config.h`.
+//
+// Without one, each FSQ has a worker thread of its own, which spends most of its life waiting for the next file
+// or for the retry delay to pass. With `CONFIG::SharedScheduler()`, the startup scan and the processing of each
+// FSQ are instead broken into steps, run by the workers of the scheduler, and the waits become the timers
+// and the wake-ups of the scheduler. The steps of a task are run one at a time, or by up to the number of
+// the processing threads of the FSQ at a time, so the FIFO order and the retry strategy of each FSQ are kept.
+//
+// A step runs for as long as the processor takes with the file, occupying one worker of the pool all along.
+// The pool should thus be sized for the number of files expected to be processed at the same time.
+
+#ifndef FSQ_SCHEDULER_H
+#define FSQ_SCHEDULER_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "../Bricks/executor/executor.h"
+#include "../Bricks/time/timer_wheel.h"
+
+namespace fsq {
+
+// What the step of a task run by `Scheduler` asks for next.
+struct SchedulerStep {
+  enum class Next { RunAgain, RunWhenWoken, RunAfterDelay, Done };
+  Next next;
+  uint64_t delay_ms;
+
+  static SchedulerStep RunAgain() {
+    return SchedulerStep{Next::RunAgain, 0};
+  }
+  static SchedulerStep RunWhenWoken() {
+    return SchedulerStep{Next::RunWhenWoken, 0};
+  }
+  // The next step runs once the delay has passed, or once the task is woken up, whichever comes first.
+  static SchedulerStep RunAfterDelay(uint64_t delay_ms) {
+    return SchedulerStep{Next::RunAfterDelay, delay_ms};
+  }
+  // The task is done, and is only run again if woken up while another step of it is still running.
+  static SchedulerStep Done() {
+    return SchedulerStep{Next::Done, 0};
+  }
+};
+
+class Scheduler final {
+ public:
+  // Identifies the registered task. Never zero.
+  typedef uint64_t TaskID;
+
+  explicit Scheduler(size_t threads = 2) : executor_(threads, 0) {}
+
+  // All the tasks should have been unregistered by now.
+  ~Scheduler() = default;
+
+  size_t Threads() const {
+    return executor_.Threads();
+  }
+
+  // Registers the task made of the steps `step`, run by up to `concurrency` workers at a time.
+  // The task is not run until woken up with `Wake()`. THREAD SAFE.
+  TaskID Register(std::function<SchedulerStep()> step, size_t concurrency = 1) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const TaskID id = ++last_task_id_;
+    std::unique_ptr<Task> task(new Task(std::move(step), std::max(concurrency, static_cast<size_t>(1))));
+    tasks_.emplace(id, std::move(task));
+    return id;
+  }
+
+  // Has the next step of the task run as soon as possible: right away if fewer than `concurrency` of its steps
+  // are running, otherwise once one of them is done. No-op if the task is done or unregistered. THREAD SAFE.
+  void Wake(TaskID id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = tasks_.find(id);
+    if (it == tasks_.end() || it->second->done) {
+      return;
+    }
+    Task& task = *it->second;
+    if (task.scheduled < task.concurrency) {
+      ScheduleStep(id, task);
+    } else {
+      task.woken = true;
+    }
+  }
+
+  // Waits until the task is done, with none of its steps running, and unregisters it.
+  // No-op if the task is unregistered already. Should not be called from a step. THREAD SAFE.
+  void Unregister(TaskID id) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const auto it = tasks_.find(id);
+    if (it == tasks_.end()) {
+      return;
+    }
+    Task& task = *it->second;
+    condition_variable_.wait(lock, [&task]() { return task.done && !task.scheduled; });
+    if (task.timer) {
+      timers_.Cancel(task.timer);
+    }
+    tasks_.erase(it);
+  }
+
+ private:
+  struct Task {
+    const std::function<SchedulerStep()> step;
+    const size_t concurrency;
+    // The number of the steps submitted to the executor and not yet done.
+    size_t scheduled = 0;
+    // Set by `Wake()` while `concurrency` steps are running, for the one done first to run again.
+    bool woken = false;
+    bool done = false;
+    bricks::time::TimerWheelThread::TimerID timer = 0;
+
+    Task(std::function<SchedulerStep()> step, size_t concurrency)
+        : step(std::move(step)), concurrency(concurrency) {}
+  };
+
+  // MUTEX-LOCKED.
+  void ScheduleStep(TaskID id, Task& task) {
+    if (task.timer) {
+      timers_.Cancel(task.timer);
+      task.timer = 0;
+    }
+    ++task.scheduled;
+    executor_.Submit([this, id]() { RunStep(id); });
+  }
+
+  // The task is not unregistered while its steps are scheduled, thus is safe to refer to without the lock.
+  void RunStep(TaskID id) {
+    Task* task;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task = tasks_.at(id).get();
+    }
+    const SchedulerStep result = task->step();
+    std::lock_guard<std::mutex> lock(mutex_);
+    --task->scheduled;
+    if (result.next == SchedulerStep::Next::Done) {
+      task->done = true;
+    }
+    if (result.next == SchedulerStep::Next::RunAgain || task->woken) {
+      task->woken = false;
+      ScheduleStep(id, *task);
+    } else if (result.next == SchedulerStep::Next::RunAfterDelay) {
+      if (task->timer) {
+        timers_.Cancel(task->timer);
+      }
+      task->timer = timers_.ScheduleIn(result.delay_ms, [this, id]() { Wake(id); });
+    }
+    if (task->done && !task->scheduled) {
+      condition_variable_.notify_all();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable condition_variable_;
+  std::map<TaskID, std::unique_ptr<Task>> tasks_;
+  TaskID last_task_id_ = 0;
+
+  // Destroyed before the tasks, the timers first, for neither to run anything past the destructor.
+  bricks::Executor executor_;
+  bricks::time::TimerWheelThread timers_;
+
+  Scheduler(const Scheduler&) = delete;
+  void operator=(const Scheduler&) = delete;
+};
+
+}  // namespace fsq
+
+#endif  // FSQ_SCHEDULER_H
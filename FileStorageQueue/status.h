@@ -5,7 +5,9 @@
 
 #include <deque>
 #include <string>
-#include <tuple>
+#include <utility>
+
+#include "../Bricks/memory/memory_resource.h"
 
 namespace fsq {
 
@@ -16,35 +18,74 @@ struct FileInfo {
   std::string full_path_name = std::string("");
   T_TIMESTAMP timestamp = T_TIMESTAMP(0);
   uint64_t size = 0;
-  FileInfo(const std::string& name, const std::string& full_path_name, T_TIMESTAMP timestamp, uint64_t size)
-      : name(name), full_path_name(full_path_name), timestamp(timestamp), size(size) {
-  }
-  inline std::tuple<T_TIMESTAMP, std::string, std::string, uint64_t> AsTuple() const {
-    return std::tie(timestamp, name, full_path_name, size);
+  size_t lane = 0;  // The priority lane of the file, zero being the default one. Implied by the name.
+  // The names are taken by value, for the ones just generated to be moved in.
+  FileInfo(std::string name, std::string full_path_name, T_TIMESTAMP timestamp, uint64_t size)
+      : name(std::move(name)), full_path_name(std::move(full_path_name)), timestamp(timestamp), size(size) {
   }
+  // The integers go first, for the files of the queue to mostly tell apart without comparing their names,
+  // and the names are compared in place, for the million-file queues not to copy them on every lookup.
   inline bool operator==(const FileInfo& rhs) const {
-    return AsTuple() == rhs.AsTuple();
+    return timestamp == rhs.timestamp && size == rhs.size && name == rhs.name &&
+           full_path_name == rhs.full_path_name;
   }
+  // Ordered by the timestamp, then by the names, then by the size.
   inline bool operator<(const FileInfo& rhs) const {
-    return AsTuple() < rhs.AsTuple();
+    if (timestamp != rhs.timestamp) {
+      return timestamp < rhs.timestamp;
+    }
+    const int by_name = name.compare(rhs.name);
+    if (by_name) {
+      return by_name < 0;
+    }
+    const int by_full_path_name = full_path_name.compare(rhs.full_path_name);
+    if (by_full_path_name) {
+      return by_full_path_name < 0;
+    }
+    return size < rhs.size;
   }
 };
 
 // The status of all other, finalized, files combined.
+// The queue of FSQ itself is allocated from `Config::StatusMemoryResource()`, its copies from the heap.
 template <typename TIMESTAMP>
 struct QueueFinalizedFilesStatus {
   typedef TIMESTAMP T_TIMESTAMP;
-  std::deque<FileInfo<T_TIMESTAMP>> queue;  // Sorted from oldest to newest.
+  typedef std::deque<FileInfo<T_TIMESTAMP>, bricks::memory::PolymorphicAllocator<FileInfo<T_TIMESTAMP>>>
+      T_QUEUE;
+  T_QUEUE queue;  // Sorted from oldest to newest.
   uint64_t total_size = 0;
+
+  QueueFinalizedFilesStatus() = default;
+  explicit QueueFinalizedFilesStatus(bricks::memory::MemoryResource* resource) : queue(resource) {}
 };
 
 // The status of the file that is currently being appended to.
+// With more than one priority lane, `appended_file_size` is the total of the current files of all the lanes,
+// and `appended_file_timestamp` is that of the current file of the default lane.
 template <typename TIMESTAMP>
 struct QueueStatus {
   typedef TIMESTAMP T_TIMESTAMP;
   uint64_t appended_file_size = 0;                       // Also zero if no file is currently open.
   T_TIMESTAMP appended_file_timestamp = T_TIMESTAMP(0);  // Also zero if no file is curently open.
+  uint64_t pending_reclaim_size = 0;  // The total size of the purged files not yet removed from disk.
   QueueFinalizedFilesStatus<T_TIMESTAMP> finalized;
+
+  QueueStatus() = default;
+  explicit QueueStatus(bricks::memory::MemoryResource* resource) : finalized(resource) {}
+};
+
+// The counters of FSQ's status, without the list of queued files, see `FSQ::GetQueueCounters()`.
+template <typename TIMESTAMP>
+struct QueueCounters {
+  typedef TIMESTAMP T_TIMESTAMP;
+  size_t finalized_files = 0;
+  uint64_t finalized_total_size = 0;
+  T_TIMESTAMP oldest_finalized_file_timestamp = T_TIMESTAMP(0);  // Also zero if no files are queued.
+  uint64_t appended_file_size = 0;
+  uint64_t pending_reclaim_size = 0;
+  size_t files_in_process = 0;
+  bool processing_suspended = false;
 };
 
 }  // namespace fsq
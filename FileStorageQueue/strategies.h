@@ -2,23 +2,42 @@
 #define FSQ_STRATEGIES_H
 
 #include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "status.h"
 #include "exception.h"
 
+#include "../Bricks/port.h"
 #include "../Bricks/util/util.h"
 #include "../Bricks/file/file.h"
 #include "../Bricks/time/chrono.h"
 #include "../Bricks/strings/fixed_size_serializer.h"
+#include "../Bricks/strings/records.h"
 
 namespace fsq {
 namespace strategy {
 
+// The file append strategies write into the `OutputFile` of the file system, which is `std::ofstream`
+// or anything else with `write(data, length)`, `flush()` and `bad()`, such as `bricks::PosixOutputFile`.
+
 // Default file append strategy: Appends data to files in raw format, without separators.
+// Ranges of messages, from `FSQ::PushMessages()`, are written into the stream as a whole and flushed once.
 struct JustAppendToFile {
-  void AppendToFile(bricks::FileSystem::OutputFile& fo, const std::string& message) const {
+  template <typename T_OUTPUT_FILE>
+  void AppendToFile(T_OUTPUT_FILE& fo, const std::string& message) const {
     // TODO(dkorolev): Should we flush each record? Make it part of the strategy?
-    fo << message << std::flush;
+    fo.write(message.data(), message.length());
+    fo.flush();
+  }
+  template <typename T_OUTPUT_FILE, typename ITERATOR>
+  void AppendToFile(T_OUTPUT_FILE& fo, ITERATOR begin, ITERATOR end) const {
+    for (ITERATOR it = begin; it != end; ++it) {
+      fo.write(it->data(), it->length());
+    }
+    fo.flush();
   }
   uint64_t MessageSizeInBytes(const std::string& message) const {
     return message.length();
@@ -28,9 +47,20 @@ struct JustAppendToFile {
 // Another simple file append strategy: Append messages adding a separator after each of them.
 class AppendToFileWithSeparator {
  public:
-  void AppendToFile(bricks::FileSystem::OutputFile& fo, const std::string& message) const {
+  template <typename T_OUTPUT_FILE>
+  void AppendToFile(T_OUTPUT_FILE& fo, const std::string& message) const {
     // TODO(dkorolev): Should we flush each record? Make it part of the strategy?
-    fo << message << separator_ << std::flush;
+    fo.write(message.data(), message.length());
+    fo.write(separator_.data(), separator_.length());
+    fo.flush();
+  }
+  template <typename T_OUTPUT_FILE, typename ITERATOR>
+  void AppendToFile(T_OUTPUT_FILE& fo, ITERATOR begin, ITERATOR end) const {
+    for (ITERATOR it = begin; it != end; ++it) {
+      fo.write(it->data(), it->length());
+      fo.write(separator_.data(), separator_.length());
+    }
+    fo.flush();
   }
   uint64_t MessageSizeInBytes(const std::string& message) const {
     return message.length() + separator_.length();
@@ -38,11 +68,120 @@ class AppendToFileWithSeparator {
   void SetSeparator(const std::string& separator) {
     separator_ = separator;
   }
+  // The messages of a file appended to, normally memory-mapped, as `bricks::strings::SeparatedRecord`-s.
+  bricks::strings::SeparatedRecords Records(const char* data, size_t length) const {
+    return bricks::strings::SeparatedRecords(data, length, separator_);
+  }
 
  private:
   std::string separator_ = "";
 };
 
+// Buffered file append strategy: Coalesces messages in memory, to issue one write per many messages.
+// Optionally adds a separator after each message, same as `AppendToFileWithSeparator`.
+//
+// The buffer is written into the file once it reaches `max_buffer_size` bytes, once the oldest buffered message
+// is older than `max_buffer_age`, on an explicit `FSQ::Flush()`, and before the file is finalized.
+// The sizes reported to the finalization and purge strategies include the buffered messages,
+// so the on-disk size of a finalized file is exactly what has been accounted for.
+//
+// With a non-zero `group_commit_interval`, the file is also `fdatasync()`-ed on flush, at most that often,
+// and always before it is finalized. Messages not yet written out are lost if the process crashes.
+class BufferedAppendToFile {
+ public:
+  template <typename T_OUTPUT_FILE>
+  void AppendToFile(T_OUTPUT_FILE&, const std::string& message) const {
+    if (buffer_.empty()) {
+      oldest_buffered_message_ms_ = bricks::time::Now();
+    }
+    buffer_.append(message);
+    buffer_.append(separator_);
+  }
+  template <typename T_OUTPUT_FILE, typename ITERATOR>
+  void AppendToFile(T_OUTPUT_FILE& fo, ITERATOR begin, ITERATOR end) const {
+    for (ITERATOR it = begin; it != end; ++it) {
+      AppendToFile(fo, *it);
+    }
+  }
+  uint64_t MessageSizeInBytes(const std::string& message) const {
+    return message.length() + separator_.length();
+  }
+
+  // Invoked by FSQ after each append, with `force` set to false, and with `force` set to true
+  // on `FSQ::Flush()` and before closing the file.
+  template <typename T_OUTPUT_FILE>
+  void FlushAppendBuffer(T_OUTPUT_FILE& fo, const std::string& file_name, bool force) const {
+    if (!force && buffer_.length() < max_buffer_size_ &&
+        bricks::time::Now() - oldest_buffered_message_ms_ < max_buffer_age_) {
+      return;
+    }
+    if (!buffer_.empty()) {
+      fo.write(buffer_.data(), buffer_.length());
+      buffer_.clear();
+    }
+    fo.flush();
+    if (group_commit_interval_ != bricks::time::MILLISECONDS_INTERVAL(0)) {
+      const bricks::time::EPOCH_MILLISECONDS now = bricks::time::Now();
+      if (force || now - last_sync_ms_ >= group_commit_interval_) {
+        SyncFile(file_name);
+        last_sync_ms_ = now;
+      }
+    }
+  }
+
+  void SetSeparator(const std::string& separator) {
+    separator_ = separator;
+  }
+  // The messages of a file appended to, same as `AppendToFileWithSeparator::Records()`.
+  bricks::strings::SeparatedRecords Records(const char* data, size_t length) const {
+    return bricks::strings::SeparatedRecords(data, length, separator_);
+  }
+  void SetMaxBufferSize(size_t max_buffer_size) {
+    max_buffer_size_ = max_buffer_size;
+  }
+  void SetMaxBufferAge(bricks::time::MILLISECONDS_INTERVAL max_buffer_age) {
+    max_buffer_age_ = max_buffer_age;
+  }
+  void SetGroupCommitInterval(bricks::time::MILLISECONDS_INTERVAL group_commit_interval) {
+    group_commit_interval_ = group_commit_interval;
+  }
+
+ private:
+  // `fdatasync()` syncs the file contents regardless of which descriptor of it is used.
+  static void SyncFile(const std::string& file_name) {
+    const int fd = ::open(file_name.c_str(), O_WRONLY);
+    if (fd >= 0) {
+#if defined(BRICKS_APPLE)
+      ::fsync(fd);
+#else
+      ::fdatasync(fd);
+#endif
+      ::close(fd);
+    }
+  }
+
+  std::string separator_ = "";
+  size_t max_buffer_size_ = 64 * 1024;
+  bricks::time::MILLISECONDS_INTERVAL max_buffer_age_ = bricks::time::MILLISECONDS_INTERVAL(100);
+  bricks::time::MILLISECONDS_INTERVAL group_commit_interval_ = bricks::time::MILLISECONDS_INTERVAL(0);
+
+  mutable std::string buffer_;
+  mutable bricks::time::EPOCH_MILLISECONDS oldest_buffered_message_ms_ = bricks::time::EPOCH_MILLISECONDS(0);
+  mutable bricks::time::EPOCH_MILLISECONDS last_sync_ms_ = bricks::time::EPOCH_MILLISECONDS(0);
+};
+
+// Default finalized file transform strategy: Pass finalized files on to the processor as they are.
+// A transform strategy writes the transformed contents of `input_file_name` into `output_file_name`,
+// returning false on failure. See `compression.h`.
+struct KeepFinalizedFilesAsIs {
+  inline static bool TransformsFinalizedFiles() {
+    return false;
+  }
+  bool TransformFinalizedFile(const std::string&, const std::string&) const {
+    return false;
+  }
+};
+
 // Default resume strategy: Always resume.
 struct AlwaysResume {
   inline static bool ShouldResume() {
@@ -50,6 +189,69 @@ struct AlwaysResume {
   }
 };
 
+// Default lane scheduling strategy: Strict priority, the files of lane zero go first, then those of lane one.
+// A lane scheduling strategy picks the lane to take the next file to process from, given which lanes
+// have files ready to be processed, and is notified once the file of the picked lane is taken.
+// See `CONFIG::NumberOfLanes()`.
+struct StrictLanePriority {
+  size_t PickLane(const std::vector<bool>& lane_has_files) const {
+    size_t lane = 0;
+    while (lane + 1 < lane_has_files.size() && !lane_has_files[lane]) {
+      ++lane;
+    }
+    return lane;
+  }
+  void OnLanePicked(size_t) {
+  }
+};
+
+// Weighted round-robin lane scheduling strategy: Out of every `sum(weights)` files processed
+// while all the lanes have files, `weights[i]` are taken from lane `i`, see `SetLaneWeights()`.
+// The lanes without weights set are given the weight of one.
+class WeightedRoundRobinLanes {
+ public:
+  size_t PickLane(const std::vector<bool>& lane_has_files) const {
+    for (size_t lane = 0; lane < lane_has_files.size(); ++lane) {
+      if (lane_has_files[lane] && Credits(lane)) {
+        return lane;
+      }
+    }
+    // No lane with files has credits left, so the next round starts, see `OnLanePicked()`.
+    return StrictLanePriority().PickLane(lane_has_files);
+  }
+  void OnLanePicked(size_t lane) {
+    if (!Credits(lane)) {
+      credits_.clear();
+    }
+    while (credits_.size() <= lane) {
+      credits_.push_back(Weight(credits_.size()));
+    }
+    if (credits_[lane]) {
+      --credits_[lane];
+    }
+  }
+  void SetLaneWeights(const std::vector<size_t>& weights) {
+    weights_ = weights;
+    credits_.clear();
+  }
+
+ private:
+  size_t Weight(size_t lane) const {
+    return lane < weights_.size() ? weights_[lane] : 1u;
+  }
+  // The lanes beyond `credits_.size()` have all their credits for this round left.
+  size_t Credits(size_t lane) const {
+    return lane < credits_.size() ? credits_[lane] : Weight(lane);
+  }
+
+  std::vector<size_t> weights_;
+  std::vector<size_t> credits_;
+};
+
+// Default message admission strategy: Appends all the messages pushed. For the strategies leaving some
+// of them out, which define `AdmitMessage()`, see `SampleUnderBacklog` in `admission_strategy.h`.
+struct AdmitAllMessages {};
+
 // A dummy retry strategy: Always process, no need to retry.
 template <class FILE_SYSTEM>
 class AlwaysProcessNoNeedToRetry {
@@ -66,39 +268,53 @@ class AlwaysProcessNoNeedToRetry {
   }
 };
 
-// Default file naming strategy: Use "finalized-{timestamp}.bin" and "current-{timestamp}.bin".
+// Default file naming strategy: Use "finalized-{timestamp}.bin" and "current-{timestamp}.bin",
+// as well as "finalizing-{timestamp}.bin" for finalized files waiting to be transformed,
+// "spare-{timestamp}.bin" for recycled files, and "manifest.fsq" for the queue manifest.
+// In a shared working directory, "lease.lock" is the lease on processing, and "writer-{name}.lock"
+// the locks the processes hold on their names. "{finalized file name}.offset" keeps the processed part
+// of a finalized file, for the processors resuming from where the previous attempt stopped.
 struct DummyFileNamingToUnblockAlexFromMinsk {
   struct FileNamingSchema {
     FileNamingSchema(const std::string& prefix, const std::string& suffix) : prefix_(prefix), suffix_(suffix) {
     }
     template <typename T_TIMESTAMP>
     inline std::string GenerateFileName(const T_TIMESTAMP timestamp) const {
-      return prefix_ + bricks::strings::PackToString(timestamp) + suffix_;
+      typedef bricks::strings::FixedSizeSerializer<T_TIMESTAMP> Serializer;
+      std::string result;
+      result.reserve(prefix_.length() + Serializer::size_in_bytes + suffix_.length());
+      result += prefix_;
+      result.resize(prefix_.length() + Serializer::size_in_bytes);
+      Serializer::Pack(timestamp, &result[prefix_.length()]);
+      result += suffix_;
+      return result;
     }
+    // Accepts exactly the file names `GenerateFileName()` produces, with no temporary strings.
     template <typename T_TIMESTAMP>
     inline bool ParseFileName(const std::string& filename, T_TIMESTAMP* output_timestamp) const {
-      if ((filename.length() ==
-           prefix_.length() + bricks::strings::FixedSizeSerializer<T_TIMESTAMP>::size_in_bytes +
-               suffix_.length()) &&
-          filename.substr(0, prefix_.length()) == prefix_ &&
-          filename.substr(filename.length() - suffix_.length()) == suffix_) {
-        T_TIMESTAMP timestamp;
-        bricks::strings::UnpackFromString(filename.substr(prefix_.length()), timestamp);
-        if (GenerateFileName(timestamp) == filename) {
-          *output_timestamp = timestamp;
-          return true;
-        } else {
-          return false;
-        }
-      } else {
-        return false;
-      }
+      typedef bricks::strings::FixedSizeSerializer<T_TIMESTAMP> Serializer;
+      return filename.length() == prefix_.length() + Serializer::size_in_bytes + suffix_.length() &&
+             !filename.compare(0, prefix_.length(), prefix_) &&
+             !filename.compare(filename.length() - suffix_.length(), suffix_.length(), suffix_) &&
+             Serializer::Unpack(filename.data() + prefix_.length(), *output_timestamp);
     }
     std::string prefix_;
     std::string suffix_;
   };
   FileNamingSchema current = FileNamingSchema("current-", ".bin");
   FileNamingSchema finalized = FileNamingSchema("finalized-", ".bin");
+  FileNamingSchema finalizing = FileNamingSchema("finalizing-", ".bin");
+  FileNamingSchema spare = FileNamingSchema("spare-", ".bin");
+  std::string manifest_file_name = "manifest.fsq";
+  std::string lease_file_name = "lease.lock";
+  std::string writer_lock_file_prefix = "writer-";
+  std::string writer_lock_file_suffix = ".lock";
+  std::string offset_file_suffix = ".offset";
+  // The current, finalized and finalizing files of the lanes other than the default one are named with
+  // this prefix prepended, for example, "lane1-finalized-{timestamp}.bin". See `CONFIG::NumberOfLanes()`.
+  std::string LanePrefix(size_t lane) const {
+    return "lane" + std::to_string(lane) + '-';
+  }
 };
 
 // Default time manager strategy: Use UNIX time in milliseconds.
@@ -110,6 +326,16 @@ struct UseEpochMilliseconds final {
   }
 };
 
+// Alternative time manager strategy: Use the coarse UNIX time in milliseconds, see `bricks::time::CoarseNow()`.
+// Cheaper per message, at the cost of the timestamps lagging behind by up to a few milliseconds.
+struct UseCoarseEpochMilliseconds final {
+  typedef bricks::time::EPOCH_MILLISECONDS T_TIMESTAMP;
+  typedef bricks::time::MILLISECONDS_INTERVAL T_TIME_SPAN;
+  T_TIMESTAMP Now() const {
+    return bricks::time::CoarseNow();
+  }
+};
+
 // Default file finalization strategy: Keeps files under 100KB, if there are files in the processing queue,
 // in case of no files waiting, keep them under 10KB. Also manage maximum age before forced finalization:
 // a maximum of 24 hours when there is backlog, a maximum of 10 minutes if there is no.
@@ -0,0 +1,176 @@
+// Class StripedFSQ spreads one queue across several working directories, such as one per disk.
+//
+// Each directory, a stripe, is a full FSQ of its own: its own current files, its own processing threads,
+// and its own purge strategy, applied to the files of that stripe only, thus the purge budget of
+// `T_PURGE_STRATEGY` is per stripe, and with one stripe per device, per device. Both appending and draining
+// the queue scale with the number of stripes, as the stripes share no locks.
+//
+// `PushMessage()` and `PushMessages()` go to the stripes round-robin, a batch of messages to a single stripe.
+// `PushMessageWithKey()` picks the stripe by the hash of the key instead, thus the messages with the same key
+// end up in the same stripe, in the order they have been pushed in.
+//
+// The files of each stripe are processed in the order of their timestamps, while the stripes are processed
+// independently, and concurrently: the processor should be thread safe, and should not depend on the order
+// of the files across the stripes. `GetQueueStatus()` returns the queue of all the stripes merged by timestamp,
+// the global FIFO, with the sizes summed up.
+
+#ifndef FSQ_STRIPED_FSQ_H
+#define FSQ_STRIPED_FSQ_H
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "fsq.h"
+
+namespace fsq {
+
+template <class CONFIG>
+class StripedFSQ final {
+ public:
+  typedef CONFIG T_CONFIG;
+  typedef FSQ<T_CONFIG> T_FSQ;
+  typedef typename T_FSQ::T_PROCESSOR T_PROCESSOR;
+  typedef typename T_FSQ::T_MESSAGE T_MESSAGE;
+  typedef typename T_FSQ::T_TIME_MANAGER T_TIME_MANAGER;
+  typedef typename T_FSQ::T_FILE_SYSTEM T_FILE_SYSTEM;
+  typedef typename T_FSQ::T_TIMESTAMP T_TIMESTAMP;
+  typedef typename T_FSQ::Status Status;
+  typedef typename T_FSQ::Counters Counters;
+
+  // Starts one FSQ per working directory, all of them passing the files to the same processor.
+  StripedFSQ(T_PROCESSOR& processor,
+             const std::vector<std::string>& working_directories,
+             const T_TIME_MANAGER& time_manager = T_TIME_MANAGER(),
+             const T_FILE_SYSTEM& file_system = T_FILE_SYSTEM()) {
+    if (working_directories.empty()) {
+      T_FSQ::T_ERROR_HANDLING_STRATEGY::HandleError();
+    }
+    for (const std::string& working_directory : working_directories) {
+      stripes_.emplace_back(new T_FSQ(processor, working_directory, time_manager, file_system));
+    }
+  }
+
+  size_t NumberOfStripes() const {
+    return stripes_.size();
+  }
+
+  // The FSQ of the stripe, for the rest of its methods, including the setters of the strategies.
+  T_FSQ& Stripe(size_t index) {
+    return *stripes_[index];
+  }
+
+  // `PushMessage()` appends the message to the next stripe, round-robin. THREAD SAFE.
+  void PushMessage(const T_MESSAGE& message) {
+    NextStripe().PushMessage(message);
+  }
+  template <typename ITERATOR>
+  void PushMessages(ITERATOR begin, ITERATOR end) {
+    NextStripe().PushMessages(begin, end);
+  }
+
+  // `PushMessageWithKey()` appends the message to the stripe picked by `std::hash<T_KEY>` of the key.
+  // THREAD SAFE.
+  template <typename T_KEY>
+  void PushMessageWithKey(const T_KEY& key, const T_MESSAGE& message) {
+    stripes_[std::hash<T_KEY>()(key) % stripes_.size()]->PushMessage(message);
+  }
+
+  // `GetQueueStatus()` returns the status of all the stripes combined, with the finalized files of all
+  // of them sorted by timestamp, and `appended_file_timestamp` being that of the oldest current file.
+  // EXPENSIVE: Copies the queue of each stripe.
+  const Status GetQueueStatus() const {
+    Status result;
+    for (const std::unique_ptr<T_FSQ>& stripe : stripes_) {
+      const Status status = stripe->GetQueueStatus();
+      result.appended_file_size += status.appended_file_size;
+      if (status.appended_file_timestamp != T_TIMESTAMP(0) &&
+          (result.appended_file_timestamp == T_TIMESTAMP(0) ||
+           status.appended_file_timestamp < result.appended_file_timestamp)) {
+        result.appended_file_timestamp = status.appended_file_timestamp;
+      }
+      result.pending_reclaim_size += status.pending_reclaim_size;
+      result.finalized.total_size += status.finalized.total_size;
+      typename T_FSQ::FinalizedFilesStatus::T_QUEUE merged;
+      std::merge(result.finalized.queue.begin(),
+                 result.finalized.queue.end(),
+                 status.finalized.queue.begin(),
+                 status.finalized.queue.end(),
+                 std::back_inserter(merged),
+                 [](const FileInfo<T_TIMESTAMP>& lhs, const FileInfo<T_TIMESTAMP>& rhs) {
+                   return lhs.timestamp < rhs.timestamp;
+                 });
+      result.finalized.queue.swap(merged);
+    }
+    return result;
+  }
+
+  // `GetQueueCounters()` returns the counters of all the stripes combined, without taking any locks.
+  // The processing is reported as suspended if it is suspended in any of the stripes. THREAD SAFE.
+  const Counters GetQueueCounters() const {
+    Counters result;
+    for (const std::unique_ptr<T_FSQ>& stripe : stripes_) {
+      const Counters counters = stripe->GetQueueCounters();
+      result.finalized_files += counters.finalized_files;
+      result.finalized_total_size += counters.finalized_total_size;
+      if (counters.oldest_finalized_file_timestamp != T_TIMESTAMP(0) &&
+          (result.oldest_finalized_file_timestamp == T_TIMESTAMP(0) ||
+           counters.oldest_finalized_file_timestamp < result.oldest_finalized_file_timestamp)) {
+        result.oldest_finalized_file_timestamp = counters.oldest_finalized_file_timestamp;
+      }
+      result.appended_file_size += counters.appended_file_size;
+      result.pending_reclaim_size += counters.pending_reclaim_size;
+      result.files_in_process += counters.files_in_process;
+      result.processing_suspended = result.processing_suspended || counters.processing_suspended;
+    }
+    return result;
+  }
+
+  // The methods of FSQ that apply to the queue as a whole, forwarded to each stripe.
+  void Flush() {
+    for (std::unique_ptr<T_FSQ>& stripe : stripes_) {
+      stripe->Flush();
+    }
+  }
+  void ResumeProcessing() {
+    for (std::unique_ptr<T_FSQ>& stripe : stripes_) {
+      stripe->ResumeProcessing();
+    }
+  }
+  void ForceProcessing(bool force_finalize_current_file = false) {
+    for (std::unique_ptr<T_FSQ>& stripe : stripes_) {
+      stripe->ForceProcessing(force_finalize_current_file);
+    }
+  }
+  void FinalizeCurrentFile() {
+    for (std::unique_ptr<T_FSQ>& stripe : stripes_) {
+      stripe->FinalizeCurrentFile();
+    }
+  }
+  void ShutdownAndRemoveAllFSQFiles() {
+    for (std::unique_ptr<T_FSQ>& stripe : stripes_) {
+      stripe->ShutdownAndRemoveAllFSQFiles();
+    }
+  }
+
+ private:
+  T_FSQ& NextStripe() {
+    return *stripes_[next_stripe_++ % stripes_.size()];
+  }
+
+  std::vector<std::unique_ptr<T_FSQ>> stripes_;
+  std::atomic<size_t> next_stripe_{0};
+
+  StripedFSQ(const StripedFSQ&) = delete;
+  StripedFSQ(StripedFSQ&&) = delete;
+  void operator=(const StripedFSQ&) = delete;
+  void operator=(StripedFSQ&&) = delete;
+};
+
+}  // namespace fsq
+
+#endif  // FSQ_STRIPED_FSQ_H
@@ -1,10 +1,31 @@
 // TODO(dkorolev): Add a more purge test(s), code coverage should show which.
 
+#include <algorithm>
 #include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
 
 #include "fsq.h"
+#include "adaptive_finalization_strategy.h"
+#include "circuit_breaker_retry_strategy.h"
+#include "compression.h"
+#include "flat_event_records.h"
+#include "framed_records.h"
+#include "http_access_log.h"
+#include "http_uploader.h"
+#include "ingest_server.h"
+#include "multi_writer_fsq.h"
+#include "rate_limited_retry_strategy.h"
+#include "striped_fsq.h"
 
 #include "../Bricks/file/file.h"
+#include "../Bricks/file/in_memory_file_system.h"
+#include "../Bricks/net/http/http.h"
+#include "../Bricks/util/allocation_counter.h"
 
 #include "../Bricks/3party/gtest/gtest.h"
 #include "../Bricks/3party/gtest/gtest-main.h"
@@ -12,7 +33,12 @@
 using std::string;
 using std::atomic_size_t;
 
+BRICKS_COUNT_ALLOCATIONS();
+
 const char* const kTestDir = "build/";
+const int kHTTPUploaderTestPort = 8097;
+const int kIngestServerTestPort = 8098;
+const int kHTTPAccessLogTestPort = 8099;
 
 // TestOutputFilesProcessor collects the output of finalized files.
 struct TestOutputFilesProcessor {
@@ -64,6 +90,245 @@ struct TestOutputFilesProcessor {
   bool mimic_need_retry_ = false;
 };
 
+// TestMappedFilesProcessor collects the contents of finalized files passed to it as memory-mapped views.
+struct TestMappedFilesProcessor {
+  TestMappedFilesProcessor() : finalized_count(0) {
+  }
+
+  fsq::FileProcessingResult OnMappedFileReady(const fsq::FileInfo<uint64_t>& file_info,
+                                              const char* data,
+                                              size_t length,
+                                              uint64_t) {
+    assert(file_info.size == length);
+    if (finalized_count) {
+      contents += "FILE SEPARATOR\n";
+    }
+    contents.append(data, length);
+    for (const auto& record : bricks::strings::SeparatedRecords(data, length, "\n")) {
+      messages += (messages.empty() ? "" : "|") + record.ToString();
+    }
+    ++finalized_count;
+    return fsq::FileProcessingResult::Success;
+  }
+
+  atomic_size_t finalized_count;
+  string contents = "";
+  string messages = "";
+};
+
+// TestFramedRecordsProcessor collects the records of memory-mapped framed files, separated by "|".
+struct TestFramedRecordsProcessor {
+  TestFramedRecordsProcessor() : finalized_count(0) {
+  }
+
+  fsq::FileProcessingResult OnMappedFileReady(const fsq::FileInfo<uint64_t>&,
+                                              const char* data,
+                                              size_t length,
+                                              uint64_t) {
+    for (const fsq::FramedRecord& record : fsq::FramedRecords(data, length)) {
+      records += (records.empty() ? "" : "|") + record.ToString();
+    }
+    ++finalized_count;
+    return fsq::FileProcessingResult::Success;
+  }
+
+  atomic_size_t finalized_count;
+  string records = "";
+};
+
+// TestFlatEvent is the typed message of `FlatEventsMockConfig`.
+struct TestFlatEvent {
+  uint64_t id;
+  int32_t value;
+  BRICKS_FLAT_FIELDS(7, id, value);
+};
+
+// TestFlatEventsProcessor decodes the events of memory-mapped framed files, as "id:value", separated by "|".
+struct TestFlatEventsProcessor {
+  TestFlatEventsProcessor() : finalized_count(0) {
+  }
+
+  fsq::FileProcessingResult OnMappedFileReady(const fsq::FileInfo<uint64_t>&,
+                                              const char* data,
+                                              size_t length,
+                                              uint64_t) {
+    for (const fsq::FramedRecord& record : fsq::FramedRecords(data, length)) {
+      TestFlatEvent event;
+      if (fsq::DecodeFlatEventRecord(record, event)) {
+        events += (events.empty() ? "" : "|") + std::to_string(event.id) + ':' + std::to_string(event.value);
+      } else {
+        events += (events.empty() ? "" : "|") + std::string("?");
+      }
+    }
+    ++finalized_count;
+    return fsq::FileProcessingResult::Success;
+  }
+
+  atomic_size_t finalized_count;
+  string events = "";
+};
+
+// TestAccessLogProcessor collects the access log records of finalized files, as "method path status".
+struct TestAccessLogProcessor {
+  TestAccessLogProcessor() : finalized_count(0) {
+  }
+
+  // The default time manager of `fsq::Config`, unlike `MockTime`, has `bricks::time::EPOCH_MILLISECONDS`.
+  template <typename T_TIMESTAMP>
+  fsq::FileProcessingResult OnMappedFileReady(const fsq::FileInfo<T_TIMESTAMP>&,
+                                              const char* data,
+                                              size_t length,
+                                              T_TIMESTAMP) {
+    for (const fsq::FramedRecord& record : fsq::FramedRecords(data, length)) {
+      fsq::HTTPAccessLogEvent event;
+      EXPECT_TRUE(fsq::DecodeFlatEventRecord(record, event));
+      records += (records.empty() ? "" : "|") + std::string(event.method) + ' ' + event.path + ' ' +
+                 std::to_string(event.status);
+    }
+    ++finalized_count;
+    return fsq::FileProcessingResult::Success;
+  }
+
+  atomic_size_t finalized_count;
+  string records = "";
+};
+
+// TestConcurrentFilesProcessor holds on to each file until released, to observe several files in flight.
+struct TestConcurrentFilesProcessor {
+  TestConcurrentFilesProcessor() : in_flight(0), finalized_count(0), released(false) {
+  }
+
+  fsq::FileProcessingResult OnFileReady(const fsq::FileInfo<uint64_t>& file_info, uint64_t) {
+    ++in_flight;
+    while (!released) {
+      std::this_thread::yield();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      filenames.push_back(file_info.name);
+    }
+    --in_flight;
+    ++finalized_count;
+    return fsq::FileProcessingResult::Success;
+  }
+
+  atomic_size_t in_flight;
+  atomic_size_t finalized_count;
+  std::atomic_bool released;
+  std::mutex mutex;
+  std::vector<std::string> filenames;
+};
+
+// TestBatchFilesProcessor records the timestamps of the files of each batch, and fails the file it is told to.
+struct TestBatchFilesProcessor {
+  TestBatchFilesProcessor() : finalized_count(0) {
+  }
+
+  std::vector<fsq::FileProcessingResult> OnFilesReady(const std::vector<fsq::FileInfo<uint64_t>>& files,
+                                                      uint64_t) {
+    std::vector<fsq::FileProcessingResult> results;
+    std::string batch;
+    for (const fsq::FileInfo<uint64_t>& file : files) {
+      if (mimic_unavailable || file.timestamp == unavailable_timestamp) {
+        results.push_back(fsq::FileProcessingResult::Unavailable);
+      } else {
+        results.push_back(fsq::FileProcessingResult::Success);
+        ++finalized_count;
+      }
+      batch += (batch.empty() ? "" : ",") + std::to_string(file.timestamp);
+    }
+    if (!mimic_unavailable) {
+      batches.push_back(batch);
+    }
+    return results;
+  }
+
+  atomic_size_t finalized_count;
+  std::vector<std::string> batches;
+  std::atomic_bool mimic_unavailable{false};
+  std::atomic<uint64_t> unavailable_timestamp{0};
+};
+
+// TestResumingFilesProcessor sends up to four bytes of the file per attempt, resuming from the offset given.
+struct TestResumingFilesProcessor {
+  TestResumingFilesProcessor() : finalized_count(0) {
+  }
+
+  fsq::FileProcessingResult OnFileReadyFromOffset(const fsq::FileInfo<uint64_t>& file_info,
+                                                  uint64_t& offset,
+                                                  uint64_t) {
+    offsets += (offsets.empty() ? "" : ",") + std::to_string(offset);
+    const uint64_t end = std::min(file_info.size, offset + 4);
+    contents += bricks::ReadFileAsString(file_info.full_path_name).substr(offset, end - offset);
+    offset = end;
+    if (offset < file_info.size) {
+      return fsq::FileProcessingResult::Unavailable;
+    }
+    ++finalized_count;
+    return fsq::FileProcessingResult::Success;
+  }
+
+  atomic_size_t finalized_count;
+  string offsets = "";
+  string contents = "";
+};
+
+// TestFlakyDestinationProcessor fails while the destination is down, then holds the files until released.
+struct TestFlakyDestinationProcessor {
+  TestFlakyDestinationProcessor() : attempts(0), finalized_count(0), down(true), released(false) {
+  }
+
+  fsq::FileProcessingResult OnFileReady(const fsq::FileInfo<uint64_t>&, uint64_t) {
+    ++attempts;
+    if (down) {
+      return fsq::FileProcessingResult::FailureNeedRetry;
+    }
+    while (!released) {
+      std::this_thread::yield();
+    }
+    ++finalized_count;
+    return fsq::FileProcessingResult::Success;
+  }
+
+  atomic_size_t attempts;
+  atomic_size_t finalized_count;
+  std::atomic_bool down;
+  std::atomic_bool released;
+};
+
+// TestGzippedFilesProcessor decompresses the finalized files, which are expected to be gzipped.
+struct TestGzippedFilesProcessor {
+  TestGzippedFilesProcessor() : finalized_count(0) {
+  }
+
+  fsq::FileProcessingResult OnFileReady(const fsq::FileInfo<uint64_t>& file_info, uint64_t) {
+    assert(file_info.size == bricks::FileSystem::GetFileSize(file_info.full_path_name));
+    gzFile input = gzopen(file_info.full_path_name.c_str(), "rb");
+    assert(input);
+    std::string decompressed;
+    char buffer[1024];
+    int length;
+    while ((length = gzread(input, buffer, sizeof(buffer))) > 0) {
+      decompressed.append(buffer, length);
+    }
+    gzclose(input);
+    if (finalized_count) {
+      contents += "FILE SEPARATOR\n";
+      filenames += "|";
+    }
+    contents += decompressed;
+    filenames += file_info.name;
+    compressed_size += file_info.size;
+    ++finalized_count;
+    return fsq::FileProcessingResult::Success;
+  }
+
+  atomic_size_t finalized_count;
+  string filenames = "";
+  string contents = "";
+  uint64_t compressed_size = 0;
+};
+
 struct MockTime {
   typedef uint64_t T_TIMESTAMP;
   typedef int64_t T_TIME_SPAN;
@@ -73,6 +338,22 @@ struct MockTime {
   }
 };
 
+// TestTimedFilesProcessor takes 50ms of mock time plus 0.01ms per byte to process each file.
+struct TestTimedFilesProcessor {
+  explicit TestTimedFilesProcessor(MockTime& mock_wall_time)
+      : mock_wall_time(mock_wall_time), finalized_count(0) {
+  }
+
+  fsq::FileProcessingResult OnFileReady(const fsq::FileInfo<uint64_t>& file_info, uint64_t) {
+    mock_wall_time.now += 50 + file_info.size / 100;
+    ++finalized_count;
+    return fsq::FileProcessingResult::Success;
+  }
+
+  MockTime& mock_wall_time;
+  atomic_size_t finalized_count;
+};
+
 struct MockConfig : fsq::Config<TestOutputFilesProcessor> {
   // Mock time.
   typedef MockTime T_TIME_MANAGER;
@@ -103,13 +384,339 @@ struct NoResumeMockConfig : MockConfig {
   };
 };
 
+struct BufferedMockConfig : MockConfig {
+  // Append using newlines, buffering up to 1KB for up to an hour, and syncing on each flush.
+  typedef fsq::strategy::BufferedAppendToFile T_FILE_APPEND_STRATEGY;
+  template <typename T_FSQ_INSTANCE>
+  static void Initialize(T_FSQ_INSTANCE& instance) {
+    instance.SetSeparator("\n");
+    instance.SetMaxBufferSize(1000);
+    instance.SetMaxBufferAge(bricks::time::MILLISECONDS_INTERVAL(60 * 60 * 1000));
+    instance.SetGroupCommitInterval(bricks::time::MILLISECONDS_INTERVAL(1));
+  }
+};
+
+struct LargeFilesMockConfig : MockConfig {
+  // Keep all the messages of the test in one file.
+  typedef fsq::strategy::SimpleFinalizationStrategy<MockTime::T_TIMESTAMP,
+                                                    MockTime::T_TIME_SPAN,
+                                                    1000000,
+                                                    MockTime::T_TIME_SPAN(10 * 1000),
+                                                    1000000,
+                                                    MockTime::T_TIME_SPAN(60 * 1000)> T_FINALIZE_STRATEGY;
+  typedef fsq::strategy::SimplePurgeStrategy<10000000, 1000> T_PURGE_STRATEGY;
+};
+
+struct MappedFilesMockConfig : MockConfig {
+  typedef TestMappedFilesProcessor T_PROCESSOR;
+};
+
+struct InMemoryMockConfig : MockConfig {
+  typedef TestMappedFilesProcessor T_PROCESSOR;
+  typedef bricks::InMemoryFileSystem T_FILE_SYSTEM;
+};
+
+struct ConcurrentFilesMockConfig : MockConfig {
+  typedef TestConcurrentFilesProcessor T_PROCESSOR;
+  // Do not purge the files being waited for.
+  typedef fsq::strategy::SimplePurgeStrategy<10000000, 1000> T_PURGE_STRATEGY;
+  inline static size_t NumberOfProcessingThreads() {
+    return 3;
+  }
+};
+
+struct BatchesMockConfig : LargeFilesMockConfig {
+  typedef TestBatchFilesProcessor T_PROCESSOR;
+  inline static size_t MaxFilesPerBatch() {
+    return 3;
+  }
+  inline static uint64_t MaxBytesPerBatch() {
+    return 30;
+  }
+};
+
+struct ResumingMockConfig : LargeFilesMockConfig {
+  typedef TestResumingFilesProcessor T_PROCESSOR;
+};
+
+struct GzipMockConfig : LargeFilesMockConfig {
+  typedef TestGzippedFilesProcessor T_PROCESSOR;
+  typedef fsq::strategy::GzipFinalizedFiles T_FINALIZED_FILE_TRANSFORM_STRATEGY;
+  typedef fsq::strategy::GzippedFileNaming T_FILE_NAMING_STRATEGY;
+};
+
+struct FramedRecordsMockConfig : LargeFilesMockConfig {
+  typedef TestFramedRecordsProcessor T_PROCESSOR;
+  typedef fsq::strategy::AppendFramedRecords T_FILE_APPEND_STRATEGY;
+  typedef fsq::strategy::ResumeTruncatingToLastValidRecord T_FILE_RESUME_STRATEGY;
+  template <typename T_FSQ_INSTANCE>
+  static void Initialize(T_FSQ_INSTANCE&) {
+  }
+};
+
+struct FlatEventsMockConfig : LargeFilesMockConfig {
+  typedef TestFlatEventsProcessor T_PROCESSOR;
+  typedef TestFlatEvent T_MESSAGE;
+  typedef fsq::strategy::AppendFlatEventRecords<TestFlatEvent> T_FILE_APPEND_STRATEGY;
+  typedef fsq::strategy::ResumeTruncatingToLastValidRecord T_FILE_RESUME_STRATEGY;
+  template <typename T_FSQ_INSTANCE>
+  static void Initialize(T_FSQ_INSTANCE&) {
+  }
+};
+
+struct SampledMockConfig : LargeFilesMockConfig {
+  // Sample from four messages per second on, whatever the backlog: every other "debug" message, and up to
+  // two "error" messages per second.
+  typedef fsq::strategy::SampleUnderBacklog T_ADMISSION_STRATEGY;
+  template <typename T_FSQ_INSTANCE>
+  static void Initialize(T_FSQ_INSTANCE& instance) {
+    instance.SetSeparator("\n");
+    instance.SetMessageCategory(
+        [](const std::string& message) { return message.substr(0, message.find(':')); });
+    instance.SetThroughputThreshold(4);
+    instance.SetCategorySampling("debug", 0.5, 0);
+    instance.SetCategorySampling("error", 1.0, 2);
+  }
+};
+
+struct LanesMockConfig : LargeFilesMockConfig {
+  // Keep at most three files, to confirm the lowest priority lane is purged first.
+  typedef fsq::strategy::SimplePurgeStrategy<10000000, 3> T_PURGE_STRATEGY;
+  inline static size_t NumberOfLanes() {
+    return 3;
+  }
+};
+
+struct StripedMockConfig : LargeFilesMockConfig {
+  typedef TestConcurrentFilesProcessor T_PROCESSOR;
+};
+
+struct ManifestMockConfig : MockConfig {
+  inline static bool KeepQueueManifest() {
+    return true;
+  }
+};
+
+// The file system with the directory scan held back until the test allows it.
+struct BlockedScanFileSystem : bricks::FileSystem {
+  static std::atomic_bool& ScanAllowed() {
+    static std::atomic_bool allowed(false);
+    return allowed;
+  }
+  template <typename F>
+  static void ScanDirEntriesUntil(const std::string& directory, F&& f) {
+    while (!ScanAllowed()) {
+      std::this_thread::yield();
+    }
+    bricks::FileSystem::ScanDirEntriesUntil(directory, std::forward<F>(f));
+  }
+};
+
+// The file system that does not remove files until allowed to.
+struct BlockedRemoveFileSystem : bricks::FileSystem {
+  static std::atomic_bool& RemoveAllowed() {
+    static std::atomic_bool allowed(true);
+    return allowed;
+  }
+  static void RemoveFile(const std::string& file_name,
+                         bricks::RemoveFileParameters parameters =
+                             bricks::RemoveFileParameters::ThrowExceptionOnError) {
+    while (!RemoveAllowed()) {
+      std::this_thread::yield();
+    }
+    bricks::FileSystem::RemoveFile(file_name, parameters);
+  }
+};
+
+struct ReclaimInBackgroundMockConfig : MockConfig {
+  typedef BlockedRemoveFileSystem T_FILE_SYSTEM;
+  inline static bool ReclaimPurgedFilesInBackground() {
+    return true;
+  }
+};
+
+struct WatchMockConfig : MockConfig {
+  inline static bool WatchWorkingDirectory() {
+    return true;
+  }
+};
+
+struct SharedDirectoryMockConfig : LargeFilesMockConfig {
+  inline static bool WatchWorkingDirectory() {
+    return true;
+  }
+  inline static uint64_t SharedWorkingDirectoryLeasePollMs() {
+    return 10;
+  }
+};
+
+struct SharedDirectoryFirstWriterMockConfig : SharedDirectoryMockConfig {
+  inline static std::string SharedWorkingDirectoryWriterName() {
+    return "first";
+  }
+};
+
+struct SharedDirectorySecondWriterMockConfig : SharedDirectoryMockConfig {
+  inline static std::string SharedWorkingDirectoryWriterName() {
+    return "second";
+  }
+};
+
+struct RateLimitedMockConfig : MockConfig {
+  template <typename FILESYSTEM>
+  using T_RETRY_STRATEGY = fsq::strategy::TokenBucketRateLimitedRetryStrategy<FILESYSTEM>;
+};
+
+struct CircuitBreakerMockConfig : LargeFilesMockConfig {
+  typedef TestFlakyDestinationProcessor T_PROCESSOR;
+  template <typename FILESYSTEM>
+  using T_RETRY_STRATEGY = fsq::strategy::CircuitBreakerRetryStrategy<FILESYSTEM>;
+};
+
+struct AdaptiveFinalizationMockConfig : LargeFilesMockConfig {
+  typedef TestTimedFilesProcessor T_PROCESSOR;
+  typedef fsq::strategy::AdaptiveFinalizationStrategy<MockTime::T_TIMESTAMP, MockTime::T_TIME_SPAN>
+      T_FINALIZE_STRATEGY;
+};
+
+struct BufferedUntilReadyMockConfig : MockConfig {
+  typedef BlockedScanFileSystem T_FILE_SYSTEM;
+  inline static size_t MaxMessagesBufferedUntilReady() {
+    return 2;
+  }
+};
+
+struct PosixOutputFileMockConfig : MockConfig {
+  typedef bricks::PosixFileSystem T_FILE_SYSTEM;
+  inline static uint64_t PreallocatedFileSize() {
+    return 1024 * 1024;
+  }
+  inline static bool DropFinalizedFilesFromPageCache() {
+    return true;
+  }
+  inline static uint64_t DropAppendedDataFromPageCacheEvery() {
+    return 16;
+  }
+};
+
+struct RecycledFilesMockConfig : MockConfig {
+  typedef bricks::PosixFileSystem T_FILE_SYSTEM;
+  inline static size_t RecycledFilesPoolSize() {
+    return 2;
+  }
+};
+
+// The file system that records the files it is asked to read ahead.
+struct PrefetchRecordingFileSystem : bricks::FileSystem {
+  static std::mutex& Mutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+  static std::vector<std::string>& Prefetched() {
+    static std::vector<std::string> prefetched;
+    return prefetched;
+  }
+  static void PrefetchFile(const std::string& file_name) {
+    std::lock_guard<std::mutex> lock(Mutex());
+    Prefetched().push_back(file_name);
+  }
+};
+
+struct PrefetchingMockConfig : MockConfig {
+  typedef PrefetchRecordingFileSystem T_FILE_SYSTEM;
+  inline static size_t PrefetchedFilesAhead() {
+    return 2;
+  }
+};
+
+// Counts the bytes allocated through it and not deallocated yet.
+struct CountingMemoryResource final : bricks::memory::MemoryResource {
+  std::atomic<int64_t> bytes_in_use{0};
+  static CountingMemoryResource& Singleton() {
+    static CountingMemoryResource singleton;
+    return singleton;
+  }
+
+ private:
+  void* DoAllocate(size_t bytes, size_t alignment) override {
+    bytes_in_use += bytes;
+    return bricks::memory::NewDeleteResource()->Allocate(bytes, alignment);
+  }
+  void DoDeallocate(void* p, size_t bytes, size_t alignment) override {
+    bytes_in_use -= bytes;
+    bricks::memory::NewDeleteResource()->Deallocate(p, bytes, alignment);
+  }
+  bool DoIsEqual(const bricks::memory::MemoryResource&) const override { return false; }
+};
+
+struct StatusMemoryResourceMockConfig : MockConfig {
+  inline static bricks::memory::MemoryResource* StatusMemoryResource() {
+    return &CountingMemoryResource::Singleton();
+  }
+};
+
+// All the FSQ-s of this config share one scheduler, with fewer workers than there are FSQ-s in the tests.
+struct SharedSchedulerMockConfig : MockConfig {
+  inline static fsq::Scheduler* SharedScheduler() {
+    static fsq::Scheduler scheduler(2);
+    return &scheduler;
+  }
+};
+
 typedef fsq::FSQ<MockConfig> FSQ;
 typedef fsq::FSQ<NoResumeMockConfig> NoResumeFSQ;
+typedef fsq::FSQ<BufferedMockConfig> BufferedFSQ;
+typedef fsq::FSQ<LargeFilesMockConfig> LargeFilesFSQ;
+typedef fsq::MultiWriterFSQ<LargeFilesMockConfig> MultiWriterFSQ;
+typedef fsq::MultiWriterFSQ<LargeFilesMockConfig, 4, MQOverflowPolicy::RejectNewest> LossyMultiWriterFSQ;
+typedef fsq::FSQ<MappedFilesMockConfig> MappedFilesFSQ;
+typedef fsq::FSQ<InMemoryMockConfig> InMemoryFSQ;
+typedef fsq::FSQ<SharedDirectoryFirstWriterMockConfig> SharedDirectoryFirstWriterFSQ;
+typedef fsq::FSQ<SharedDirectorySecondWriterMockConfig> SharedDirectorySecondWriterFSQ;
+typedef fsq::FSQ<ConcurrentFilesMockConfig> ConcurrentFilesFSQ;
+typedef fsq::FSQ<BatchesMockConfig> BatchesFSQ;
+typedef fsq::FSQ<ResumingMockConfig> ResumingFSQ;
+typedef fsq::StripedFSQ<StripedMockConfig> StripedFSQ;
+typedef fsq::FSQ<GzipMockConfig> GzipFSQ;
+typedef fsq::FSQ<FramedRecordsMockConfig> FramedRecordsFSQ;
+typedef fsq::FSQ<FlatEventsMockConfig> FlatEventsFSQ;
+typedef fsq::HTTPAccessLog<fsq::HTTPAccessLogConfig<TestAccessLogProcessor>> HTTPAccessLog;
+typedef fsq::FSQ<SampledMockConfig> SampledFSQ;
+typedef fsq::FSQ<LanesMockConfig> LanesFSQ;
+typedef fsq::FSQ<ManifestMockConfig> ManifestFSQ;
+typedef fsq::FSQ<BufferedUntilReadyMockConfig> BufferedUntilReadyFSQ;
+typedef fsq::FSQ<ReclaimInBackgroundMockConfig> ReclaimInBackgroundFSQ;
+typedef fsq::FSQ<WatchMockConfig> WatchFSQ;
+typedef fsq::FSQ<RateLimitedMockConfig> RateLimitedFSQ;
+typedef fsq::FSQ<CircuitBreakerMockConfig> CircuitBreakerFSQ;
+typedef fsq::FSQ<AdaptiveFinalizationMockConfig> AdaptiveFinalizationFSQ;
+typedef fsq::FSQ<PosixOutputFileMockConfig> PosixOutputFileFSQ;
+typedef fsq::FSQ<RecycledFilesMockConfig> RecycledFilesFSQ;
+typedef fsq::FSQ<PrefetchingMockConfig> PrefetchingFSQ;
+typedef fsq::FSQ<StatusMemoryResourceMockConfig> StatusMemoryResourceFSQ;
+typedef fsq::FSQ<SharedSchedulerMockConfig> SharedSchedulerFSQ;
+
+// The names of the files in the test directory that start with `prefix`, sorted.
+static std::string FileNamesWithPrefix(const std::string& prefix) {
+  std::vector<std::string> names;
+  bricks::FileSystem::ScanDir(kTestDir, [&names, &prefix](const std::string& name) {
+    if (name.substr(0, prefix.length()) == prefix) {
+      names.push_back(name);
+    }
+  });
+  std::sort(names.begin(), names.end());
+  std::string result;
+  for (const auto& name : names) {
+    result += (result.empty() ? "" : "|") + name;
+  }
+  return result;
+}
 
 static void CleanupOldFiles() {
   // Initialize a temporary FSQ to remove previously created files for the tests that need it.
+  // The one with the most lanes, to remove the files of all the lanes.
   TestOutputFilesProcessor processor;
-  FSQ(processor, kTestDir).ShutdownAndRemoveAllFSQFiles();
+  LanesFSQ(processor, kTestDir).ShutdownAndRemoveAllFSQFiles();
 }
 
 // Observe messages being processed as they exceed 20 bytes of size.
@@ -154,162 +761,1713 @@ TEST(FileSystemQueueTest, FinalizedBySize) {
   while (processor.finalized_count != 2) {
     ;  // Spin lock.
   }
-
-  EXPECT_EQ(2u, processor.finalized_count);
-  EXPECT_EQ("finalized-00000000000000000101.bin|finalized-00000000000000000103.bin", processor.filenames);
+
+  EXPECT_EQ(2u, processor.finalized_count);
+  EXPECT_EQ("finalized-00000000000000000101.bin|finalized-00000000000000000103.bin", processor.filenames);
+  EXPECT_EQ("this is\na test\nFILE SEPARATOR\nprocess now\n", processor.contents);
+  EXPECT_EQ(103ull, processor.timestamp);
+}
+
+// Observe messages being processed as they get older than 10 seconds.
+TEST(FileSystemQueueTest, FinalizedByAge) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  FSQ fsq(processor, kTestDir, mock_wall_time);
+
+  // Confirm the queue is empty.
+  EXPECT_EQ(0ull, fsq.GetQueueStatus().appended_file_size);
+  EXPECT_EQ(0u, fsq.GetQueueStatus().finalized.queue.size());
+  EXPECT_EQ(0ul, fsq.GetQueueStatus().finalized.total_size);
+
+  // Add a few entries.
+  mock_wall_time.now = 10000;
+  fsq.PushMessage("this too");
+  mock_wall_time.now = 10001;
+  fsq.PushMessage("shall");
+
+  // Confirm the queue is still empty.
+  EXPECT_EQ(15ull, fsq.GetQueueStatus().appended_file_size);  // 15 == strlen("this is\na test\n").
+  EXPECT_EQ(0u, fsq.GetQueueStatus().finalized.queue.size());
+  EXPECT_EQ(0ul, fsq.GetQueueStatus().finalized.total_size);
+  EXPECT_EQ(0u, processor.finalized_count);
+
+  // Add another message and make the current file span an interval of more than 10 seconds.
+  mock_wall_time.now = 21000;
+  fsq.PushMessage("pass");
+
+  while (processor.finalized_count != 1) {
+    ;  // Spin lock.
+  }
+
+  EXPECT_EQ(1u, processor.finalized_count);
+  EXPECT_EQ("finalized-00000000000000010000.bin", processor.filenames);
+  EXPECT_EQ("this too\nshall\n", processor.contents);
+  EXPECT_EQ(21000ull, processor.timestamp);
+
+  // Since the new message made it to the next file, finalize it and confirm the message is there as well.
+  fsq.ForceProcessing();
+  while (processor.finalized_count != 2) {
+    ;  // Spin lock.
+  }
+
+  EXPECT_EQ(2u, processor.finalized_count);
+  EXPECT_EQ("finalized-00000000000000010000.bin|finalized-00000000000000021000.bin", processor.filenames);
+  EXPECT_EQ("this too\nshall\nFILE SEPARATOR\npass\n", processor.contents);
+  EXPECT_EQ(21000ull, processor.timestamp);
+}
+
+// The adaptive finalization strategy grows the files until the per-file overhead is amortized,
+// keeps up with the rate of incoming messages, and finalizes earlier to bound the end-to-end delay.
+TEST(FileSystemQueueTest, AdaptsFinalizationToProcessingCost) {
+  fsq::strategy::AdaptiveFinalizationStrategy<uint64_t, int64_t> strategy;
+  strategy.SetFinalizedFileSizeBounds(100, 10000);
+  strategy.SetMaxFinalizationDelay(1000);
+  strategy.SetMaxProcessingOverheadShare(0.5);
+
+  // 50ms per file plus 0.01ms per byte.
+  fsq::FileInfo<uint64_t> file("", "", 0, 0);
+  EXPECT_EQ(100u, strategy.TargetFileSize());
+  file.size = 100;
+  strategy.OnFileProcessed(file, 1000, 1051);
+  file.size = 1000;
+  strategy.OnFileProcessed(file, 2000, 2060);
+  EXPECT_EQ(100u, strategy.TargetFileSize());
+  file.size = 500;
+  strategy.OnFileProcessed(file, 3000, 3055);
+  EXPECT_NEAR(50.0, strategy.EstimatedPerFileOverheadMs(), 1e-6);
+  EXPECT_NEAR(0.01, strategy.EstimatedPerByteMs(), 1e-9);
+  // The overhead is half of the processing time of a 5000 bytes file.
+  EXPECT_NEAR(5000.0, static_cast<double>(strategy.TargetFileSize()), 1.0);
+
+  fsq::QueueStatus<uint64_t> status;
+  status.appended_file_timestamp = 10000;
+  status.appended_file_size = 4900;
+  EXPECT_FALSE(strategy.ShouldFinalize(status, 10200));
+  status.appended_file_size = 5100;
+  EXPECT_TRUE(strategy.ShouldFinalize(status, 10200));
+
+  // At 80 bytes per millisecond, only files of 20000 bytes would keep up, so the maximum of 10000 it is.
+  status.appended_file_size = 8000;
+  EXPECT_FALSE(strategy.ShouldFinalize(status, 10100));
+  status.appended_file_size = 10000;
+  EXPECT_TRUE(strategy.ShouldFinalize(status, 10100));
+
+  // A small file is finalized once its age plus its predicted processing time exceeds one second.
+  status.appended_file_size = 100;
+  EXPECT_FALSE(strategy.ShouldFinalize(status, 10900));
+  EXPECT_TRUE(strategy.ShouldFinalize(status, 10960));
+
+  // With a backlog, the files are coalesced up to the maximum size.
+  status.finalized.queue.push_back(file);
+  status.appended_file_size = 9000;
+  EXPECT_FALSE(strategy.ShouldFinalize(status, 10100));
+}
+
+// FSQ reports the processing time of each processed file to the adaptive finalization strategy.
+TEST(FileSystemQueueTest, ReportsProcessingTimeToFinalizationStrategy) {
+  CleanupOldFiles();
+
+  MockTime mock_wall_time;
+  TestTimedFilesProcessor processor(mock_wall_time);
+  AdaptiveFinalizationFSQ fsq(processor, kTestDir, mock_wall_time);
+
+  mock_wall_time.now = 100;
+  for (const size_t length : {100u, 1000u, 500u}) {
+    fsq.PushMessage(std::string(length - 1, 'x'));
+    fsq.FinalizeCurrentFile();
+    while (fsq.GetQueueStatus().finalized.queue.size() || processor.finalized_count == 0) {
+      ;  // Spin lock.
+    }
+    processor.finalized_count = 0;
+  }
+  EXPECT_NEAR(50.0, fsq.EstimatedPerFileOverheadMs(), 1.0);
+  EXPECT_NEAR(0.01, fsq.EstimatedPerByteMs(), 1e-3);
+}
+
+// Pushes a few messages and force their processing.
+TEST(FileSystemQueueTest, ForceProcessing) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  FSQ fsq(processor, kTestDir, mock_wall_time);
+
+  // Confirm the queue is empty.
+  EXPECT_EQ(0ull, fsq.GetQueueStatus().appended_file_size);
+  EXPECT_EQ(0u, fsq.GetQueueStatus().finalized.queue.size());
+  EXPECT_EQ(0ul, fsq.GetQueueStatus().finalized.total_size);
+
+  // Add a few entries.
+  mock_wall_time.now = 1001;
+  fsq.PushMessage("foo");
+  mock_wall_time.now = 1002;
+  fsq.PushMessage("bar");
+  mock_wall_time.now = 1003;
+  fsq.PushMessage("baz");
+
+  // Confirm the queue is empty.
+  EXPECT_EQ(12ull, fsq.GetQueueStatus().appended_file_size);  // Three messages of (3 + '\n') bytes each.
+  EXPECT_EQ(0u, fsq.GetQueueStatus().finalized.queue.size());
+  EXPECT_EQ(0ul, fsq.GetQueueStatus().finalized.total_size);
+
+  // Force entries processing to have three freshly added ones reach our TestOutputFilesProcessor.
+  fsq.ForceProcessing();
+  while (!processor.finalized_count) {
+    ;  // Spin lock.
+  }
+
+  EXPECT_EQ(1u, processor.finalized_count);
+  EXPECT_EQ("finalized-00000000000000001001.bin", processor.filenames);
+  EXPECT_EQ("foo\nbar\nbaz\n", processor.contents);
+  EXPECT_EQ(1003ull, processor.timestamp);
+}
+
+// Confirm the buffered messages are accounted for, and make it to disk on `Flush()` and on finalization.
+TEST(FileSystemQueueTest, BufferedAppend) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  BufferedFSQ fsq(processor, kTestDir, mock_wall_time);
+
+  const std::string current_file_name =
+      bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000101.bin");
+
+  // Add a few entries.
+  mock_wall_time.now = 101;
+  fsq.PushMessage("this is");
+  mock_wall_time.now = 102;
+  fsq.PushMessage("a test");
+  mock_wall_time.now = 103;
+
+  // Confirm the entries are accounted for, but not yet written to disk.
+  EXPECT_EQ(15ull, fsq.GetQueueStatus().appended_file_size);  // 15 == strlen("this is\na test\n").
+  EXPECT_EQ(0ull, bricks::FileSystem::GetFileSize(current_file_name));
+
+  // Confirm they are written to disk on `Flush()`.
+  fsq.Flush();
+  EXPECT_EQ(15ull, bricks::FileSystem::GetFileSize(current_file_name));
+  EXPECT_EQ("this is\na test\n", bricks::ReadFileAsString(current_file_name));
+
+  // Add more entries, the last one triggering finalization by size.
+  fsq.PushMessage("and");
+  fsq.PushMessage("process now");
+  while (processor.finalized_count != 1) {
+    ;  // Spin lock.
+  }
+
+  // The finalized file has all the messages, and is exactly of the size accounted for.
+  EXPECT_EQ("finalized-00000000000000000101.bin", processor.filenames);
+  EXPECT_EQ("this is\na test\nand\n", processor.contents);
+
+  // Confirm the buffered message that made it to the next file is written out on forced finalization.
+  fsq.ForceProcessing();
+  while (processor.finalized_count != 2) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("this is\na test\nand\nFILE SEPARATOR\nprocess now\n", processor.contents);
+}
+
+// Confirm the processor that defines `OnMappedFileReady()` is passed the contents of the files in memory.
+TEST(FileSystemQueueTest, MemoryMappedFiles) {
+  CleanupOldFiles();
+
+  TestMappedFilesProcessor processor;
+  MockTime mock_wall_time;
+  MappedFilesFSQ fsq(processor, kTestDir, mock_wall_time);
+
+  mock_wall_time.now = 101;
+  fsq.PushMessage("this is");
+  mock_wall_time.now = 102;
+  fsq.PushMessage("a test");
+  mock_wall_time.now = 103;
+  fsq.PushMessage("process now");
+  while (processor.finalized_count != 1) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("this is\na test\n", processor.contents);
+
+  fsq.ForceProcessing();
+  while (processor.finalized_count != 2) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("this is\na test\nFILE SEPARATOR\nprocess now\n", processor.contents);
+  EXPECT_EQ("this is|a test|process now", processor.messages);
+  EXPECT_EQ(0u, fsq.GetQueueStatus().finalized.queue.size());
+}
+
+// Confirm `Replay()` passes the queued files holding the messages of a range of time, and leaves them queued.
+// The messages are appended to the current file with no allocations, and a file costs a few once finalized.
+TEST(FileSystemQueueTest, PushMessageAllocationBudget) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  LargeFilesFSQ fsq(processor, kTestDir, mock_wall_time);
+  const std::string message = "a message beyond the short string optimization";
+  mock_wall_time.now = 100;
+  fsq.PushMessage(message);
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_NO_ALLOCATIONS(fsq.PushMessage(message));
+  }
+  mock_wall_time.now = 200;
+  // The names and the entry of the finalized file, and the names and the stream of the new current one.
+  EXPECT_ALLOCATIONS_AT_MOST(8, {
+    fsq.FinalizeCurrentFile();
+    fsq.PushMessage(message);
+  });
+  while (processor.finalized_count != 1) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ(101u * (message.length() + 1), processor.contents.length());
+}
+
+TEST(FileSystemQueueTest, ReplaysFilesOfTimeRange) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
+  MockTime mock_wall_time;
+  LargeFilesFSQ fsq(processor, kTestDir, mock_wall_time);
+  for (const std::string message : {"a", "b", "c", "d"}) {
+    mock_wall_time.now += 100;
+    fsq.PushMessage(message);
+    fsq.FinalizeCurrentFile();
+  }
+  mock_wall_time.now = 500;
+  fsq.PushMessage("current");
+
+  const auto replay = [&fsq](uint64_t from, uint64_t to) {
+    std::string contents;
+    const size_t files = fsq.Replay(from, to, [&contents](const fsq::FileInfo<uint64_t>& file_info,
+                                                          const char* data,
+                                                          size_t length) {
+      contents += file_info.name + ":" + std::string(data, length);
+    });
+    return std::to_string(files) + " " + contents;
+  };
+  EXPECT_EQ("2 finalized-00000000000000000200.bin:b\nfinalized-00000000000000000300.bin:c\n", replay(250, 350));
+  EXPECT_EQ("1 finalized-00000000000000000100.bin:a\n", replay(100, 101));
+  EXPECT_EQ("1 finalized-00000000000000000400.bin:d\n", replay(450, 1000));
+  EXPECT_EQ("0 ", replay(0, 100));
+  EXPECT_EQ("0 ", replay(300, 300));
+  EXPECT_EQ(4u, fsq.GetQueueStatus().finalized.queue.size());
+
+  // The file gone by the time it is to be replayed is skipped.
+  bricks::RemoveFile(std::string(kTestDir) + "finalized-00000000000000000200.bin");
+  EXPECT_EQ("1 finalized-00000000000000000100.bin:a\n", replay(0, 250));
+}
+
+// Confirm `ReplayMessages()` splits the replayed files into the messages, pointing into the mapped files.
+TEST(FileSystemQueueTest, ReplaysMessagesOfTimeRange) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
+  MockTime mock_wall_time;
+  LargeFilesFSQ fsq(processor, kTestDir, mock_wall_time);
+  mock_wall_time.now = 100;
+  fsq.PushMessage("a");
+  fsq.PushMessage("");
+  fsq.PushMessage("b");
+  fsq.FinalizeCurrentFile();
+  mock_wall_time.now = 200;
+  fsq.PushMessage("c");
+  fsq.FinalizeCurrentFile();
+
+  std::string messages;
+  EXPECT_EQ(4u, fsq.ReplayMessages(0, 1000, [&messages](const fsq::FileInfo<uint64_t>& file_info,
+                                                        const char* data,
+                                                        size_t length) {
+    messages += (messages.empty() ? "" : "|") + file_info.name.substr(10, 20) + ":" + std::string(data, length);
+  }));
+  EXPECT_EQ("00000000000000000100:a|00000000000000000100:|00000000000000000100:b|00000000000000000200:c",
+            messages);
+  EXPECT_EQ(0u, fsq.ReplayMessages(0, 100, [](const fsq::FileInfo<uint64_t>&, const char*, size_t) {}));
+}
+
+// Confirm `Replay()` finds the file the range starts within in each lane.
+TEST(FileSystemQueueTest, ReplaysFilesOfTimeRangeAcrossLanes) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
+  MockTime mock_wall_time;
+  LanesFSQ fsq(processor, kTestDir, mock_wall_time);
+  const std::vector<std::pair<size_t, std::string>> messages = {{0, "a"}, {1, "b"}, {0, "c"}};
+  for (const auto& message : messages) {
+    ++mock_wall_time.now;
+    fsq.PushMessageToLane(message.first, message.second);
+    fsq.FinalizeCurrentFile();
+  }
+  std::string names;
+  EXPECT_EQ(2u, fsq.Replay(2, 3, [&names](const fsq::FileInfo<uint64_t>& file_info, const char*, size_t) {
+    names += (names.empty() ? "" : "|") + file_info.name;
+  }));
+  EXPECT_EQ("finalized-00000000000000000001.bin|lane1-finalized-00000000000000000002.bin", names);
+}
+
+// Confirm the FSQ-s sharing the working directory have one of them process the files of all,
+// and the other take the processing over, along with the current file left behind, once the first one exits.
+TEST(FileSystemQueueTest, SharedWorkingDirectory) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor first_processor;
+  first_processor.SetMimicUnavailable();
+  TestOutputFilesProcessor second_processor;
+  MockTime first_time;
+  MockTime second_time;
+  {
+    std::unique_ptr<SharedDirectoryFirstWriterFSQ> first(
+        new SharedDirectoryFirstWriterFSQ(first_processor, kTestDir, first_time));
+    SharedDirectorySecondWriterFSQ second(second_processor, kTestDir, second_time);
+
+    // The two files finalized at the same time do not overwrite each other.
+    second_time.now = 100;
+    second.PushMessage("second");
+    second.FinalizeCurrentFile();
+    first_time.now = 100;
+    first->PushMessage("first");
+    first->FinalizeCurrentFile();
+    while (first->GetQueueCounters().finalized_files != 2) {
+      ;  // Spin lock.
+    }
+    EXPECT_EQ(0u, second.GetQueueStatus().finalized.queue.size());
+    EXPECT_TRUE(bricks::FileSystem::FileExists(std::string(kTestDir) + "finalized-00000000000000000100.bin"));
+    EXPECT_TRUE(bricks::FileSystem::FileExists(std::string(kTestDir) + "finalized-00000000000000000101.bin"));
+
+    first_time.now = 200;
+    first->PushMessage("left behind");
+    EXPECT_TRUE(
+        bricks::FileSystem::FileExists(std::string(kTestDir) + "first-current-00000000000000000200.bin"));
+    first.reset();
+
+    while (second_processor.finalized_count != 3) {
+      ;  // Spin lock.
+    }
+    EXPECT_EQ("second\nFILE SEPARATOR\nfirst\nFILE SEPARATOR\nleft behind\n", second_processor.contents);
+    EXPECT_EQ(0u, first_processor.finalized_count);
+    EXPECT_FALSE(bricks::FileSystem::FileExists(std::string(kTestDir) + "writer-first.lock"));
+  }
+  bricks::RemoveFile(std::string(kTestDir) + "writer-second.lock");
+  bricks::RemoveFile(std::string(kTestDir) + "lease.lock");
+}
+
+// Confirm FSQ runs on the in-memory file system, resuming the current file, with nothing written to disk.
+TEST(FileSystemQueueTest, InMemoryFileSystem) {
+  CleanupOldFiles();
+  bricks::InMemoryFileSystem::RemoveAllFiles();
+
+  TestMappedFilesProcessor processor;
+  MockTime mock_wall_time;
+  {
+    InMemoryFSQ fsq(processor, kTestDir, mock_wall_time);
+    mock_wall_time.now = 101;
+    fsq.PushMessage("this is");
+    mock_wall_time.now = 102;
+    fsq.PushMessage("a test");
+    mock_wall_time.now = 103;
+    fsq.PushMessage("resume me");
+    while (processor.finalized_count != 1) {
+      ;  // Spin lock.
+    }
+    EXPECT_EQ("this is\na test\n", processor.contents);
+  }
+  EXPECT_TRUE(bricks::InMemoryFileSystem::FileExists(
+      bricks::InMemoryFileSystem::JoinPath(kTestDir, "current-00000000000000000103.bin")));
+  EXPECT_EQ("", FileNamesWithPrefix("current-"));
+
+  {
+    InMemoryFSQ fsq(processor, kTestDir, mock_wall_time);
+    mock_wall_time.now = 104;
+    fsq.PushMessage("and more");
+    fsq.ForceProcessing();
+    while (processor.finalized_count != 2) {
+      ;  // Spin lock.
+    }
+    EXPECT_EQ("this is\na test\nFILE SEPARATOR\nresume me\nand more\n", processor.contents);
+    EXPECT_EQ(0u, fsq.GetQueueStatus().finalized.queue.size());
+  }
+  EXPECT_EQ("", FileNamesWithPrefix("finalized-"));
+}
+
+// Confirm the in-memory file system fails the operations as configured.
+TEST(FileSystemQueueTest, InMemoryFileSystemInjectsFailures) {
+  typedef bricks::InMemoryFileSystem FS;
+  FS::RemoveAllFiles();
+  FS::WriteStringToFile("dir/file", "data");
+  EXPECT_EQ("data", FS::ReadFileAsString("dir/file"));
+
+  FS::Settings().fail_every_n_operations = 2;
+  FS::Settings().operations = 0;
+  EXPECT_EQ("data", FS::ReadFileAsString("dir/file"));
+  ASSERT_THROW(FS::ReadFileAsString("dir/file"), bricks::FileException);
+  {
+    FS::OutputFile fo("dir/file", std::ios_base::app);
+    EXPECT_FALSE(fo.bad());
+    fo.write("more", 4);
+    EXPECT_TRUE(fo.bad());
+  }
+  FS::Settings().fail_every_n_operations = 0;
+  EXPECT_EQ("data", FS::ReadFileAsString("dir/file"));
+  std::vector<std::string> names;
+  FS::ScanDir("dir", [&names](const std::string& name) { names.push_back(name); });
+  EXPECT_EQ(std::vector<std::string>{"file"}, names);
+  FS::RemoveAllFiles();
+}
+
+// Confirm several files are processed concurrently, and each leaves the queue once processed.
+TEST(FileSystemQueueTest, ProcessesFilesConcurrently) {
+  CleanupOldFiles();
+
+  TestConcurrentFilesProcessor processor;
+  MockTime mock_wall_time;
+  ConcurrentFilesFSQ fsq(processor, kTestDir, mock_wall_time);
+
+  // Each message makes it into a file of its own, finalizing the previous one.
+  for (uint64_t t = 101; t <= 104; ++t) {
+    mock_wall_time.now = t;
+    fsq.PushMessage("0123456789abcdef");
+  }
+
+  // All three finalized files are being processed at the same time, and are still in the queue.
+  while (processor.in_flight != 3) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ(3u, fsq.GetQueueStatus().finalized.queue.size());
+  EXPECT_EQ(0u, processor.finalized_count);
+
+  processor.released = true;
+  while (processor.finalized_count != 3) {
+    ;  // Spin lock.
+  }
+  while (fsq.GetQueueStatus().finalized.queue.size() != 0u) {
+    ;  // Spin lock. The queue is updated right after the processor returns.
+  }
+  EXPECT_EQ(0ul, fsq.GetQueueStatus().finalized.total_size);
+
+  std::sort(processor.filenames.begin(), processor.filenames.end());
+  EXPECT_EQ("finalized-00000000000000000101.bin,finalized-00000000000000000102.bin,"
+            "finalized-00000000000000000103.bin",
+            processor.filenames[0] + ',' + processor.filenames[1] + ',' + processor.filenames[2]);
+}
+
+// Confirm many FSQ-s sharing a scheduler each process their files in order.
+TEST(FileSystemQueueTest, SharedSchedulerProcessesManyQueues) {
+  const size_t kQueues = 10;
+  MockTime mock_wall_time;
+  std::vector<std::unique_ptr<TestOutputFilesProcessor>> processors;
+  std::vector<std::unique_ptr<SharedSchedulerFSQ>> queues;
+  for (size_t i = 0; i < kQueues; ++i) {
+    const std::string directory = bricks::FileSystem::JoinPath(kTestDir, "scheduler-" + std::to_string(i));
+    bricks::FileSystem::CreateDirectory(directory);
+    processors.emplace_back(new TestOutputFilesProcessor());
+    SharedSchedulerFSQ(*processors.back(), directory).ShutdownAndRemoveAllFSQFiles();
+    queues.emplace_back(new SharedSchedulerFSQ(*processors.back(), directory, mock_wall_time));
+  }
+  EXPECT_EQ(2u, SharedSchedulerMockConfig::SharedScheduler()->Threads());
+
+  for (uint64_t t = 101; t <= 103; ++t) {
+    mock_wall_time.now = t;
+    for (size_t i = 0; i < kQueues; ++i) {
+      queues[i]->PushMessage(std::to_string(t) + " of " + std::to_string(i));
+    }
+  }
+  // The files leave the queue once processed.
+  for (size_t i = 0; i < kQueues; ++i) {
+    queues[i]->FinalizeCurrentFile();
+  }
+  for (size_t i = 0; i < kQueues; ++i) {
+    while (queues[i]->GetQueueCounters().finalized_files != 0u) {
+      ;  // Spin lock.
+    }
+  }
+  // How the messages are split into files depends on the timing, their order does not.
+  // They are short enough to not be purged.
+  for (size_t i = 0; i < kQueues; ++i) {
+    std::string contents = processors[i]->contents;
+    const std::string separator = "FILE SEPARATOR\n";
+    for (size_t p = contents.find(separator); p != std::string::npos; p = contents.find(separator)) {
+      contents.erase(p, separator.length());
+    }
+    const std::string queue = " of " + std::to_string(i) + "\n";
+    EXPECT_EQ("101" + queue + "102" + queue + "103" + queue, contents);
+  }
+  queues.clear();
+}
+
+// Confirm the retry delay of an FSQ sharing a scheduler is waited for by a timer of the scheduler.
+TEST(FileSystemQueueTest, SharedSchedulerRetriesAfterDelay) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  typedef fsq::strategy::ExponentialDelayRetryStrategy<bricks::FileSystem> ExpRetry;
+  // Wait between 100 and 200 milliseconds before retrying.
+  SharedSchedulerFSQ fsq(processor,
+                         kTestDir,
+                         mock_wall_time,
+                         bricks::FileSystem(),
+                         ExpRetry(bricks::FileSystem(), ExpRetry::DistributionParams(150, 100, 200)));
+
+  mock_wall_time.now = 101;
+  fsq.PushMessage("blah");
+  processor.SetMimicNeedRetry();
+  fsq.ForceProcessing();
+  while (fsq.GetQueueCounters().finalized_files != 1u || fsq.GetQueueCounters().files_in_process != 0u) {
+    ;  // Spin lock.
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_EQ(0u, processor.finalized_count);
+
+  // Nothing wakes up the queue but the timer of the retry delay.
+  processor.SetMimicNeedRetry(false);
+  while (processor.finalized_count != 1) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("finalized-00000000000000000101.bin", processor.filenames);
+  EXPECT_EQ("blah\n", processor.contents);
+}
+
+// Confirm finalized files are compressed before being processed, and accounted for by their compressed sizes.
+TEST(FileSystemQueueTest, GzipFinalizedFiles) {
+  TestGzippedFilesProcessor processor;
+  {
+    MockTime mock_wall_time;
+    GzipFSQ fsq(processor, kTestDir, mock_wall_time);
+    fsq.ShutdownAndRemoveAllFSQFiles();
+  }
+
+  MockTime mock_wall_time;
+  GzipFSQ fsq(processor, kTestDir, mock_wall_time);
+
+  std::string expected_contents;
+  mock_wall_time.now = 101;
+  for (int i = 0; i < 1000; ++i) {
+    const std::string message = "{\"event\":\"test\",\"index\":" + std::to_string(i % 10) + "}";
+    fsq.PushMessage(message);
+    expected_contents += message + "\n";
+  }
+  const uint64_t uncompressed_size = fsq.GetQueueStatus().appended_file_size;
+  EXPECT_EQ(expected_contents.length(), uncompressed_size);
+
+  fsq.ForceProcessing();
+  while (processor.finalized_count != 1) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("finalized-00000000000000000101.bin.gz", processor.filenames);
+  EXPECT_EQ(expected_contents, processor.contents);
+  EXPECT_LT(processor.compressed_size * 10, uncompressed_size);
+  EXPECT_FALSE(bricks::FileSystem::GetFileSize(
+      bricks::FileSystem::JoinPath(kTestDir, "finalizing-00000000000000000101.bin")));
+
+  fsq.ShutdownAndRemoveAllFSQFiles();
+}
+
+// Confirm a batch of messages is split across files exactly as if the messages were pushed one by one.
+TEST(FileSystemQueueTest, PushMessages) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  FSQ fsq(processor, kTestDir, mock_wall_time);
+
+  // Each message is 9 bytes with the newline, so two of them fit under 20 bytes, and the third one does not.
+  const std::vector<std::string> messages{"aaaaaaaa", "bbbbbbbb", "cccccccc", "dddddddd", "eeeeeeee"};
+  mock_wall_time.now = 101;
+  fsq.PushMessages(messages.begin(), messages.end());
+  while (processor.finalized_count != 2) {
+    ;  // Spin lock.
+  }
+
+  // The second file gets the next timestamp, to not overwrite the first one.
+  EXPECT_EQ("finalized-00000000000000000101.bin|finalized-00000000000000000102.bin", processor.filenames);
+  EXPECT_EQ("aaaaaaaa\nbbbbbbbb\nFILE SEPARATOR\ncccccccc\ndddddddd\n", processor.contents);
+  EXPECT_EQ(9ull, fsq.GetQueueStatus().appended_file_size);
+
+  // An empty range is a no-op, a moved message is appended as usual.
+  fsq.PushMessages(messages.end(), messages.end());
+  std::string message("ffffffff");
+  fsq.PushMessage(std::move(message));
+  EXPECT_EQ(18ull, fsq.GetQueueStatus().appended_file_size);
+}
+
+// Pushes messages from several threads into `T_QUEUE`, returns the sorted contents of the file.
+template <typename T_QUEUE>
+static std::vector<std::string> PushConcurrentlyAndGetSortedMessages(T_QUEUE& queue,
+                                                                     TestOutputFilesProcessor& processor) {
+  const size_t number_of_threads = 4;
+  const size_t messages_per_thread = 500;
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < number_of_threads; ++t) {
+    threads.emplace_back([&queue, t]() {
+      for (size_t i = 0; i < messages_per_thread; ++i) {
+        queue.PushMessage(std::to_string(t) + ':' + std::to_string(1000 + i));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  // Every message is "T:NNNN\n", seven bytes.
+  const uint64_t expected_size = number_of_threads * messages_per_thread * 7;
+  while (queue.GetQueueStatus().appended_file_size != expected_size) {
+    ;  // Spin lock. `MultiWriterFSQ` appends asynchronously.
+  }
+  queue.ForceProcessing();
+  while (processor.finalized_count != 1) {
+    ;  // Spin lock.
+  }
+  std::vector<std::string> result;
+  std::istringstream is(processor.contents);
+  std::string line;
+  while (std::getline(is, line)) {
+    result.push_back(line);
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+static std::vector<std::string> ExpectedSortedConcurrentMessages() {
+  std::vector<std::string> result;
+  for (size_t t = 0; t < 4; ++t) {
+    for (size_t i = 0; i < 500; ++i) {
+      result.push_back(std::to_string(t) + ':' + std::to_string(1000 + i));
+    }
+  }
+  return result;
+}
+
+// Confirm `PushMessage()` can be called from several threads.
+TEST(FileSystemQueueTest, ConcurrentPushMessage) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  LargeFilesFSQ fsq(processor, kTestDir, mock_wall_time);
+  EXPECT_EQ(ExpectedSortedConcurrentMessages(), PushConcurrentlyAndGetSortedMessages(fsq, processor));
+}
+
+// Same as above, with the producers only enqueueing the messages in memory.
+TEST(FileSystemQueueTest, MultiWriterFSQ) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  MultiWriterFSQ fsq(processor, kTestDir, mock_wall_time);
+  EXPECT_EQ(ExpectedSortedConcurrentMessages(), PushConcurrentlyAndGetSortedMessages(fsq, processor));
+}
+
+// The uploader streams the file to the server over one kept alive connection, and maps the response codes.
+TEST(FileSystemQueueTest, HTTPUploader) {
+  CleanupOldFiles();
+
+  const std::string file_name = std::string(kTestDir) + "finalized-00000000000000000001.bin";
+  bricks::WriteStringToFile(file_name, "payload");
+  const fsq::FileInfo<uint64_t> file_info("finalized-00000000000000000001.bin", file_name, 1, 7);
+  fsq::processor::HTTPUploader uploader("http://localhost:" + std::to_string(kHTTPUploaderTestPort) + "/upload",
+                                        "text/plain");
+
+  bricks::net::api::HTTPClientPOSIX::ConnectionPool().Clear();
+  std::string requests;
+  std::thread server([&requests](bricks::net::Socket socket) {
+    const std::vector<bricks::net::HTTPResponseCode> codes{bricks::net::HTTPResponseCode::OK,
+                                                           bricks::net::HTTPResponseCode::ServiceUnavailable,
+                                                           bricks::net::HTTPResponseCode::RequestTimeout,
+                                                           bricks::net::HTTPResponseCode::BadRequest};
+    bricks::net::HTTPServerConnection connection(socket.Accept());
+    size_t i = 0;
+    do {
+      const auto& message = connection.Message();
+      requests += message.Method() + ' ' + message.URL() + ' ' + message.Body() + '\n';
+      connection.SendHTTPResponse("", codes[i++ % codes.size()]);
+    } while (connection.NextRequest());
+  }, bricks::net::Socket(kHTTPUploaderTestPort));
+
+  const uint64_t uploaded_before = fsq::processor::HTTPUploaderMetrics::Singleton().files_uploaded.Value();
+  const uint64_t rejected_before = fsq::processor::HTTPUploaderMetrics::Singleton().files_rejected.Value();
+  EXPECT_EQ(fsq::FileProcessingResult::Success, uploader.OnFileReady(file_info, uint64_t(1)));
+  EXPECT_EQ(fsq::FileProcessingResult::FailureNeedRetry, uploader.OnFileReady(file_info, uint64_t(1)));
+  EXPECT_EQ(fsq::FileProcessingResult::FailureNeedRetry, uploader.OnFileReady(file_info, uint64_t(1)));
+  EXPECT_EQ(fsq::FileProcessingResult::Success, uploader.OnFileReady(file_info, uint64_t(1)));
+  // Closing the idle connection lets the server know there will be no more requests.
+  bricks::net::api::HTTPClientPOSIX::ConnectionPool().Clear();
+  server.join();
+  EXPECT_EQ(
+      "POST /upload payload\n"
+      "POST /upload payload\n"
+      "POST /upload payload\n"
+      "POST /upload payload\n",
+      requests);
+  EXPECT_EQ(1u, fsq::processor::HTTPUploaderMetrics::Singleton().files_uploaded.Value() - uploaded_before);
+  EXPECT_EQ(1u, fsq::processor::HTTPUploaderMetrics::Singleton().files_rejected.Value() - rejected_before);
+
+  // With no server to connect to, processing is suspended.
+  EXPECT_EQ(fsq::FileProcessingResult::Unavailable, uploader.OnFileReady(file_info, uint64_t(1)));
+}
+
+// The `Retry-After` of a server shedding the load holds off all the queues of the breaker, closed as it is.
+TEST(FileSystemQueueTest, HTTPUploaderHoldsOffOnRetryAfter) {
+  CleanupOldFiles();
+
+  const std::string file_name = std::string(kTestDir) + "finalized-00000000000000000001.bin";
+  bricks::WriteStringToFile(file_name, "payload");
+  const fsq::FileInfo<uint64_t> file_info("finalized-00000000000000000001.bin", file_name, 1, 7);
+  fsq::strategy::CircuitBreaker& breaker =
+      fsq::strategy::CircuitBreaker::ForDestination("FSQ retry after test");
+  fsq::processor::HTTPUploader uploader("http://localhost:" + std::to_string(kHTTPUploaderTestPort) +
+                                        "/upload");
+  uploader.HoldOffOn(breaker);
+
+  bricks::net::api::HTTPClientPOSIX::ConnectionPool().Clear();
+  std::thread server([](bricks::net::Socket socket) {
+    bricks::net::HTTPServerConnection connection(socket.Accept());
+    connection.SendHTTPResponse("",
+                                bricks::net::HTTPResponseCode::ServiceUnavailable,
+                                "text/plain",
+                                bricks::net::HTTPHeadersType{{"Retry-After", "2"}});
+  }, bricks::net::Socket(kHTTPUploaderTestPort));
+
+  bricks::time::MILLISECONDS_INTERVAL wait_ms;
+  EXPECT_FALSE(breaker.ShouldWait(&wait_ms));
+  EXPECT_EQ(fsq::FileProcessingResult::FailureNeedRetry, uploader.OnFileReady(file_info, uint64_t(1)));
+  bricks::net::api::HTTPClientPOSIX::ConnectionPool().Clear();
+  server.join();
+  EXPECT_EQ(fsq::strategy::CircuitBreaker::State::Closed, breaker.GetState());
+  ASSERT_TRUE(breaker.ShouldWait(&wait_ms));
+  EXPECT_GT(static_cast<uint64_t>(wait_ms), 1000u);
+  EXPECT_LE(static_cast<uint64_t>(wait_ms), 2000u);
+}
+
+// The keys stay on their nodes as the others come and go, and move off the failing ones while they are ejected.
+TEST(FileSystemQueueTest, UploadClusterMapsKeysOntoHealthyNodes) {
+  using fsq::processor::UploadCluster;
+  UploadCluster cluster({"http://a", "http://b", "http://c"}, UploadCluster::Params(2, 50, 0));
+  std::vector<std::string> keys;
+  std::map<std::string, std::string> nodes;
+  std::map<std::string, size_t> keys_per_node;
+  for (int i = 0; i < 300; ++i) {
+    keys.push_back("device" + std::to_string(i));
+    nodes[keys.back()] = cluster.NodeFor(keys.back());
+    ++keys_per_node[nodes[keys.back()]];
+  }
+  ASSERT_EQ(3u, keys_per_node.size());
+  for (const auto& it : keys_per_node) {
+    EXPECT_GT(it.second, 50u) << it.first;
+  }
+  cluster.SetNodes({"http://a", "http://c"});
+  for (const std::string& key : keys) {
+    if (nodes[key] != "http://b") {
+      EXPECT_EQ(nodes[key], cluster.NodeFor(key));
+    } else {
+      EXPECT_NE("http://b", cluster.NodeFor(key));
+    }
+  }
+  cluster.SetNodes({"http://a", "http://b", "http://c"});
+
+  const std::string& key = keys.front();
+  const std::string node = nodes[key];
+  cluster.ReportFailure(node);
+  EXPECT_EQ(node, cluster.NodeFor(key));
+  cluster.ReportFailure(node);
+  ASSERT_TRUE(cluster.IsEjected(node));
+  EXPECT_NE(node, cluster.NodeFor(key));
+  for (const std::string& other : keys) {
+    if (nodes[other] != node) {
+      EXPECT_EQ(nodes[other], cluster.NodeFor(other));
+    }
+  }
+  // Once the ejection is over, the first failure ejects the node again, and the first success has it back.
+  std::this_thread::sleep_for(std::chrono::milliseconds(60));
+  EXPECT_EQ(node, cluster.NodeFor(key));
+  cluster.ReportFailure(node);
+  EXPECT_TRUE(cluster.IsEjected(node));
+  std::this_thread::sleep_for(std::chrono::milliseconds(60));
+  cluster.ReportSuccess(node);
+  cluster.ReportFailure(node);
+  EXPECT_FALSE(cluster.IsEjected(node));
+  EXPECT_EQ(node, cluster.NodeFor(key));
+}
+
+// The uploader sharded across a cluster fetches its nodes from the discovery URL, and uploads to them.
+TEST(FileSystemQueueTest, HTTPUploaderShardsAcrossDiscoveredNodes) {
+  CleanupOldFiles();
+
+  const std::string file_name = std::string(kTestDir) + "finalized-00000000000000000001.bin";
+  bricks::WriteStringToFile(file_name, "payload");
+  const fsq::FileInfo<uint64_t> file_info("finalized-00000000000000000001.bin", file_name, 1, 7);
+  const std::string base_url = "http://localhost:" + std::to_string(kHTTPUploaderTestPort);
+  fsq::processor::UploadCluster cluster(base_url + "/nodes");
+  fsq::processor::HTTPUploader uploader("/upload");
+  uploader.ShardAcross(cluster, "device");
+
+  bricks::net::api::HTTPClientPOSIX::ConnectionPool().Clear();
+  std::string requests;
+  std::thread server([&requests, &base_url](bricks::net::Socket socket) {
+    bricks::net::HTTPServerConnection connection(socket.Accept());
+    do {
+      const auto& message = connection.Message();
+      requests += message.Method() + ' ' + message.URL() + '\n';
+      if (message.URL() == "/nodes") {
+        connection.SendHTTPResponse(" " + base_url + "\r\n\n");
+      } else {
+        connection.SendHTTPResponse("");
+      }
+    } while (connection.NextRequest());
+  }, bricks::net::Socket(kHTTPUploaderTestPort));
+
+  EXPECT_EQ(fsq::FileProcessingResult::Success, uploader.OnFileReady(file_info, uint64_t(1)));
+  EXPECT_EQ(fsq::FileProcessingResult::Success, uploader.OnFileReady(file_info, uint64_t(1)));
+  bricks::net::api::HTTPClientPOSIX::ConnectionPool().Clear();
+  server.join();
+  EXPECT_EQ("GET /nodes\nPOST /upload\nPOST /upload\n", requests);
+  EXPECT_EQ(std::vector<std::string>{base_url}, cluster.Nodes());
+
+  // With the node gone, the uploads are retried rather than the queue suspended, and the node is ejected.
+  EXPECT_EQ(fsq::FileProcessingResult::FailureNeedRetry, uploader.OnFileReady(file_info, uint64_t(1)));
+  EXPECT_EQ(fsq::FileProcessingResult::FailureNeedRetry, uploader.OnFileReady(file_info, uint64_t(1)));
+  EXPECT_EQ(fsq::FileProcessingResult::FailureNeedRetry, uploader.OnFileReady(file_info, uint64_t(1)));
+  EXPECT_TRUE(cluster.IsEjected(base_url));
+}
+
+// The discovery server down at first has the uploads retried, rather than the queue suspended, and the nodes
+// are fetched by the first upload once it is up, with no wait for `refresh_ms`.
+TEST(FileSystemQueueTest, HTTPUploaderRetriesTheDiscovery) {
+  CleanupOldFiles();
+
+  const std::string file_name = std::string(kTestDir) + "finalized-00000000000000000001.bin";
+  bricks::WriteStringToFile(file_name, "payload");
+  const fsq::FileInfo<uint64_t> file_info("finalized-00000000000000000001.bin", file_name, 1, 7);
+  const std::string base_url = "http://localhost:" + std::to_string(kHTTPUploaderTestPort);
+  fsq::processor::UploadCluster cluster(base_url + "/nodes");
+  fsq::processor::HTTPUploader uploader("/upload");
+  uploader.ShardAcross(cluster, "device");
+
+  bricks::net::api::HTTPClientPOSIX::ConnectionPool().Clear();
+  EXPECT_EQ(fsq::FileProcessingResult::FailureNeedRetry, uploader.OnFileReady(file_info, uint64_t(1)));
+  EXPECT_TRUE(cluster.Nodes().empty());
+
+  std::string requests;
+  std::thread server([&requests, &base_url](bricks::net::Socket socket) {
+    bricks::net::HTTPServerConnection connection(socket.Accept());
+    do {
+      const auto& message = connection.Message();
+      requests += message.Method() + ' ' + message.URL() + '\n';
+      if (message.URL() == "/nodes") {
+        connection.SendHTTPResponse(base_url + "\n");
+      } else {
+        connection.SendHTTPResponse("");
+      }
+    } while (connection.NextRequest());
+  }, bricks::net::Socket(kHTTPUploaderTestPort));
+
+  EXPECT_EQ(fsq::FileProcessingResult::Success, uploader.OnFileReady(file_info, uint64_t(1)));
+  bricks::net::api::HTTPClientPOSIX::ConnectionPool().Clear();
+  server.join();
+  EXPECT_EQ("GET /nodes\nPOST /upload\n", requests);
+  EXPECT_EQ(std::vector<std::string>{base_url}, cluster.Nodes());
+}
+
+// With a tiny in-memory buffer that rejects what does not fit, the file accounts for every rejected message.
+TEST(FileSystemQueueTest, MultiWriterFSQMarksDroppedMessages) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  LossyMultiWriterFSQ fsq(processor, kTestDir, mock_wall_time);
+  const uint64_t exported_before = EfficientMQMetrics::Singleton().exported.Value();
+  size_t accepted = 0;
+  size_t rejected = 0;
+  for (int i = 0; i < 1000; ++i) {
+    (fsq.PushMessage(std::to_string(1000 + i)) ? accepted : rejected) += 1;
+  }
+  // The last message is retried until accepted, for the rejections before it to be reported with its batch.
+  while (!fsq.PushMessage("last")) {
+    ++rejected;
+  }
+  ++accepted;
+  while (EfficientMQMetrics::Singleton().exported.Value() != exported_before + accepted) {
+    ;  // Spin lock.
+  }
+  fsq.ForceProcessing();
+  while (processor.finalized_count != 1) {
+    ;  // Spin lock.
+  }
+
+  size_t messages = 0;
+  size_t marked_dropped = 0;
+  std::istringstream is(processor.contents);
+  std::string line;
+  while (std::getline(is, line)) {
+    if (line.compare(0, 9, "#DROPPED ") == 0) {
+      marked_dropped += std::stoul(line.substr(9));
+    } else {
+      ++messages;
+    }
+  }
+  EXPECT_EQ(accepted, messages);
+  EXPECT_EQ(rejected, marked_dropped);
+  EXPECT_EQ("last\n", processor.contents.substr(processor.contents.length() - 5));
+}
+
+// The processor with `OnFilesReady()` gets the files in batches, and each file of a batch has its own result.
+TEST(FileSystemQueueTest, ProcessesFilesInBatches) {
+  CleanupOldFiles();
+
+  TestBatchFilesProcessor processor;
+  processor.mimic_unavailable = true;
+  MockTime mock_wall_time;
+  BatchesFSQ fsq(processor, kTestDir, mock_wall_time);
+  for (uint64_t t = 101; t <= 105; ++t) {
+    mock_wall_time.now = t;
+    fsq.PushMessage("file " + std::to_string(t));
+    fsq.FinalizeCurrentFile();
+  }
+  mock_wall_time.now = 106;
+  fsq.PushMessage("a message too long to share a batch");
+  fsq.FinalizeCurrentFile();
+  while (fsq.GetQueueCounters().finalized_files != 6u || fsq.GetQueueCounters().files_in_process != 0u ||
+         !fsq.GetQueueCounters().processing_suspended) {
+    ;  // Spin lock.
+  }
+
+  // Up to three files per batch, the one that is not processed stays in the queue.
+  processor.unavailable_timestamp = 102;
+  processor.mimic_unavailable = false;
+  fsq.ResumeProcessing();
+  while (processor.finalized_count != 2 || fsq.GetQueueCounters().files_in_process != 0u) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ(std::vector<std::string>({"101,102,103"}), processor.batches);
+  const BatchesFSQ::Status status = fsq.GetQueueStatus();
+  ASSERT_EQ(4u, status.finalized.queue.size());
+  EXPECT_EQ(102u, status.finalized.queue[0].timestamp);
+  EXPECT_EQ(104u, status.finalized.queue[1].timestamp);
+  EXPECT_FALSE(bricks::FileSystem::FileExists(std::string(kTestDir) + "finalized-00000000000000000101.bin"));
+  EXPECT_TRUE(bricks::FileSystem::FileExists(std::string(kTestDir) + "finalized-00000000000000000102.bin"));
+
+  // Up to 30 bytes per batch, unless a single file is larger than that.
+  processor.unavailable_timestamp = 0;
+  fsq.ResumeProcessing();
+  while (processor.finalized_count != 6) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ(std::vector<std::string>({"101,102,103", "102,104,105", "106"}), processor.batches);
+  EXPECT_EQ(0u, fsq.GetQueueStatus().finalized.queue.size());
+}
+
+// The processor resumes from the offset saved by the previous attempt, including the one before a restart.
+TEST(FileSystemQueueTest, ResumesProcessingFromSavedOffset) {
+  CleanupOldFiles();
+
+  const std::string offset_file_name = std::string(kTestDir) + "finalized-00000000000000000101.bin.offset";
+  TestResumingFilesProcessor processor;
+  MockTime mock_wall_time;
+  {
+    ResumingFSQ fsq(processor, kTestDir, mock_wall_time);
+    mock_wall_time.now = 101;
+    fsq.PushMessage("abcdefghij");
+    fsq.FinalizeCurrentFile();
+    while (!fsq.GetQueueCounters().processing_suspended) {
+      ;  // Spin lock.
+    }
+  }
+  EXPECT_EQ("0", processor.offsets);
+  EXPECT_EQ("00000000000000000004", bricks::ReadFileAsString(offset_file_name));
+
+  ResumingFSQ fsq(processor, kTestDir, mock_wall_time);
+  while (!fsq.GetQueueCounters().processing_suspended) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("0,4", processor.offsets);
+  EXPECT_EQ("00000000000000000008", bricks::ReadFileAsString(offset_file_name));
+
+  fsq.ResumeProcessing();
+  while (processor.finalized_count != 1) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("0,4,8", processor.offsets);
+  EXPECT_EQ("abcdefghij\n", processor.contents);
+  EXPECT_FALSE(bricks::FileSystem::FileExists(offset_file_name));
+}
+
+// The queues sending to the same destination share the circuit breaker: one probe at a time while it is open,
+// and all of them resumed as soon as the probe succeeds.
+TEST(FileSystemQueueTest, CircuitBreakerSharedByQueues) {
+  typedef fsq::strategy::CircuitBreaker CircuitBreaker;
+  typedef fsq::strategy::CircuitBreakerRetryStrategy<bricks::FileSystem> CircuitBreakerRetryStrategy;
+  const std::vector<std::string> directories{std::string(kTestDir) + "breaker0",
+                                             std::string(kTestDir) + "breaker1"};
+  for (const std::string& directory : directories) {
+    bricks::FileSystem::CreateDirectory(directory);
+    TestOutputFilesProcessor cleanup_processor;
+    LanesFSQ(cleanup_processor, directory).ShutdownAndRemoveAllFSQFiles();
+  }
+  CircuitBreaker& breaker = CircuitBreaker::ForDestination("FSQ test destination");
+  breaker.SetParams(CircuitBreaker::Params(1, 20, 60 * 1000));
+
+  TestFlakyDestinationProcessor processor;
+  MockTime mock_wall_time;
+  CircuitBreakerFSQ first(processor,
+                          directories[0],
+                          mock_wall_time,
+                          bricks::FileSystem(),
+                          CircuitBreakerRetryStrategy(bricks::FileSystem(), "FSQ test destination"));
+  CircuitBreakerFSQ second(processor,
+                           directories[1],
+                           mock_wall_time,
+                           bricks::FileSystem(),
+                           CircuitBreakerRetryStrategy(bricks::FileSystem(), "FSQ test destination"));
+
+  mock_wall_time.now = 101;
+  first.PushMessage("first");
+  first.FinalizeCurrentFile();
+  while (processor.attempts != 1 || breaker.GetState() != CircuitBreaker::State::Open) {
+    ;  // Spin lock.
+  }
+
+  // Once the breaker is half-open, only one of the queues probes the destination.
+  processor.down = false;
+  second.PushMessage("second");
+  second.FinalizeCurrentFile();
+  while (processor.attempts != 2) {
+    ;  // Spin lock.
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(2u, processor.attempts);
+  EXPECT_EQ(CircuitBreaker::State::HalfOpen, breaker.GetState());
+
+  // The probe closes the breaker, and the other queue is resumed right away, not after the probe timeout.
+  const bricks::time::EPOCH_MILLISECONDS released = bricks::time::Now();
+  processor.released = true;
+  while (processor.finalized_count != 2) {
+    ;  // Spin lock.
+  }
+  EXPECT_LT(bricks::time::Now() - released, static_cast<bricks::time::MILLISECONDS_INTERVAL>(10 * 1000));
+  EXPECT_EQ(3u, processor.attempts);
+  EXPECT_EQ(CircuitBreaker::State::Closed, breaker.GetState());
+}
+
+// The stripes are appended to round-robin or by key, drained concurrently, and reported as one queue.
+TEST(FileSystemQueueTest, StripedFSQ) {
+  const std::vector<std::string> directories{std::string(kTestDir) + "stripe0",
+                                             std::string(kTestDir) + "stripe1"};
+  for (const std::string& directory : directories) {
+    bricks::FileSystem::CreateDirectory(directory);
+    TestOutputFilesProcessor cleanup_processor;
+    LanesFSQ(cleanup_processor, directory).ShutdownAndRemoveAllFSQFiles();
+  }
+
+  TestConcurrentFilesProcessor processor;
+  MockTime mock_wall_time;
+  StripedFSQ fsq(processor, directories, mock_wall_time);
+  EXPECT_EQ(2u, fsq.NumberOfStripes());
+
+  mock_wall_time.now = 101;
+  fsq.PushMessage("first");
+  mock_wall_time.now = 102;
+  fsq.PushMessage("second");
+  EXPECT_TRUE(bricks::FileSystem::FileExists(directories[0] + "/current-00000000000000000101.bin"));
+  EXPECT_TRUE(bricks::FileSystem::FileExists(directories[1] + "/current-00000000000000000102.bin"));
+  EXPECT_EQ(13u, fsq.GetQueueStatus().appended_file_size);
+  EXPECT_EQ(101u, fsq.GetQueueStatus().appended_file_timestamp);
+
+  // Both stripes are drained at the same time, while reported as one queue, merged by timestamp.
+  mock_wall_time.now = 103;
+  fsq.FinalizeCurrentFile();
+  while (processor.in_flight != 2) {
+    ;  // Spin lock.
+  }
+  const StripedFSQ::Status status = fsq.GetQueueStatus();
+  ASSERT_EQ(2u, status.finalized.queue.size());
+  EXPECT_EQ(101u, status.finalized.queue[0].timestamp);
+  EXPECT_EQ(directories[0] + "/finalized-00000000000000000101.bin", status.finalized.queue[0].full_path_name);
+  EXPECT_EQ(102u, status.finalized.queue[1].timestamp);
+  EXPECT_EQ(directories[1] + "/finalized-00000000000000000102.bin", status.finalized.queue[1].full_path_name);
+  EXPECT_EQ(13u, status.finalized.total_size);
+  EXPECT_EQ(2u, fsq.GetQueueCounters().files_in_process);
+  EXPECT_EQ(101u, fsq.GetQueueCounters().oldest_finalized_file_timestamp);
+
+  processor.released = true;
+  while (processor.finalized_count != 2) {
+    ;  // Spin lock.
+  }
+  std::sort(processor.filenames.begin(), processor.filenames.end());
+  EXPECT_EQ(
+      std::vector<std::string>({"finalized-00000000000000000101.bin", "finalized-00000000000000000102.bin"}),
+      processor.filenames);
+
+  // The messages with the same key go to the same stripe.
+  fsq.PushMessageWithKey(std::string("key"), "one");
+  fsq.PushMessageWithKey(std::string("key"), "two");
+  EXPECT_EQ(8u, fsq.Stripe(std::hash<std::string>()("key") % 2).GetQueueStatus().appended_file_size);
+  EXPECT_EQ(8u, fsq.GetQueueStatus().appended_file_size);
+
+  fsq.ShutdownAndRemoveAllFSQFiles();
+}
+
+// Confirm the existing file is resumed.
+TEST(FileSystemQueueTest, ResumesExistingFile) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+
+  bricks::WriteStringToFile(bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000001.bin"),
+                            "meh\n");
+
+  FSQ fsq(processor, kTestDir, mock_wall_time);
+
+  mock_wall_time.now = 1;
+  fsq.PushMessage("wow");
+
+  fsq.ForceProcessing();
+  while (!processor.finalized_count) {
+    ;  // Spin lock.
+  }
+
+  EXPECT_EQ(1u, processor.finalized_count);
+  EXPECT_EQ("finalized-00000000000000000001.bin", processor.filenames);
+  EXPECT_EQ("meh\nwow\n", processor.contents);
+}
+
+// A framed record, to write files by hand.
+static std::string FramedRecord(const std::string& message) {
+  char header[fsq::framed_records::kHeaderSize];
+  fsq::framed_records::EncodeHeader(message.data(), message.length(), header);
+  return std::string(header, sizeof(header)) + message;
+}
+
+// Confirm the records of framed files are iterated over, with corrupted bytes skipped.
+TEST(FileSystemQueueTest, IteratesOverFramedRecords) {
+  const std::string valid = FramedRecord("foo") + FramedRecord("") + FramedRecord("bar");
+  std::string records;
+  for (const fsq::FramedRecord& record : fsq::FramedRecords(valid.data(), valid.length())) {
+    records += record.ToString() + ";";
+  }
+  EXPECT_EQ("foo;;bar;", records);
+  EXPECT_EQ(valid.length(), fsq::framed_records::ValidPrefixLength(valid.data(), valid.length()));
+
+  std::string corrupted = FramedRecord("foo") + "garbage" + FramedRecord("bar") + FramedRecord("baz");
+  corrupted[corrupted.length() - 1] = 'Z';
+  records.clear();
+  for (const fsq::FramedRecord& record : fsq::FramedRecords(corrupted.data(), corrupted.length())) {
+    records += record.ToString() + ";";
+  }
+  EXPECT_EQ("foo;bar;", records);
+  EXPECT_EQ(15u, fsq::framed_records::ValidPrefixLength(corrupted.data(), corrupted.length()));
+}
+
+// The ingest server queues the valid segments into its FSQ once, however many times each of them is uploaded.
+TEST(FileSystemQueueTest, IngestServer) {
+  using bricks::net::api::GET;
+  using bricks::net::api::POST;
+  CleanupOldFiles();
+
+  TestFramedRecordsProcessor processor;
+  MockTime mock_wall_time;
+  FramedRecordsFSQ fsq(processor, kTestDir, mock_wall_time);
+  fsq::IngestServerParameters parameters;
+  parameters.port = kIngestServerTestPort;
+  parameters.threads = 2;
+  fsq::IngestServer<FramedRecordsFSQ> server(fsq, parameters);
+
+  const std::string url = "http://localhost:" + std::to_string(kIngestServerTestPort) + "/segments";
+  const std::string segment = FramedRecord("foo") + FramedRecord("bar");
+  mock_wall_time.now = 101;
+  EXPECT_EQ(200, HTTP(POST(url + "/client1-1", segment, "application/octet-stream")).code);
+  while (processor.finalized_count != 1) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("foo|bar", processor.records);
+  EXPECT_EQ(200, HTTP(POST(url + "/client1-1", segment, "application/octet-stream")).code);
+  EXPECT_EQ(400, HTTP(POST(url + "/client1-2", segment + "garbage", "application/octet-stream")).code);
+  EXPECT_EQ(404, HTTP(POST(url + "-not-found", segment, "application/octet-stream")).code);
+  EXPECT_EQ(404, HTTP(GET(url)).code);
+  // The second segment posted within the same millisecond is queued under the next timestamp.
+  EXPECT_EQ(200, HTTP(POST(url, FramedRecord("baz"), "application/octet-stream")).code);
+  while (processor.finalized_count != 2) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("foo|bar|baz", processor.records);
+
+  EXPECT_EQ(2u, server.NumberOfSegmentsAccepted());
+  EXPECT_EQ(segment.length() + FramedRecord("baz").length(), server.NumberOfBytesAccepted());
+  EXPECT_EQ(1u, server.NumberOfDuplicatesAcknowledged());
+  EXPECT_EQ(1u, server.NumberOfSegmentsRejected());
+  // Closing the idle connection lets the server thread serving it stop.
+  bricks::net::api::HTTPClientPOSIX::ConnectionPool().Clear();
+}
+
+// The retries of the uploads named by content skip the segments the ingest server has already accepted.
+TEST(FileSystemQueueTest, HTTPUploaderSkipsSegmentsTheIngestServerHas) {
+  using bricks::net::api::POST;
+  CleanupOldFiles();
+
+  const std::string url = "http://localhost:" + std::to_string(kIngestServerTestPort) + "/segments";
+  fsq::processor::HTTPUploader uploader(url);
+  uploader.UseContentIDs();
+  const std::string stored = FramedRecord("foo") + FramedRecord("bar");
+  const std::string lost = FramedRecord("baz");
+  const fsq::FileInfo<uint64_t> stored_file(
+      "stored.bin", std::string(kTestDir) + "stored.bin", 1, stored.length());
+  const fsq::FileInfo<uint64_t> lost_file("lost.bin", std::string(kTestDir) + "lost.bin", 2, lost.length());
+  bricks::WriteStringToFile(stored_file.full_path_name, stored);
+  bricks::WriteStringToFile(lost_file.full_path_name, lost);
+
+  // With no server to connect to yet, both uploads fail, ambiguously as far as the uploader can tell.
+  bricks::net::api::HTTPClientPOSIX::ConnectionPool().Clear();
+  EXPECT_EQ(fsq::FileProcessingResult::Unavailable, uploader.OnFileReady(stored_file, uint64_t(1)));
+  EXPECT_EQ(fsq::FileProcessingResult::Unavailable, uploader.OnFileReady(lost_file, uint64_t(1)));
+
+  TestFramedRecordsProcessor processor;
+  MockTime mock_wall_time;
+  FramedRecordsFSQ fsq(processor, kTestDir, mock_wall_time);
+  fsq::IngestServerParameters parameters;
+  parameters.port = kIngestServerTestPort;
+  parameters.threads = 1;
+  fsq::IngestServer<FramedRecordsFSQ> server(fsq, parameters);
+  mock_wall_time.now = 101;
+  const std::string stored_id = fsq::processor::HTTPUploader::ContentID(stored.data(), stored.length());
+  EXPECT_EQ(200, HTTP(POST(url + '/' + stored_id, stored, "application/octet-stream")).code);
+
+  const uint64_t skipped_before = fsq::processor::HTTPUploaderMetrics::Singleton().files_skipped.Value();
+  EXPECT_EQ(fsq::FileProcessingResult::Success, uploader.OnFileReady(stored_file, uint64_t(1)));
+  EXPECT_EQ(fsq::FileProcessingResult::Success, uploader.OnFileReady(lost_file, uint64_t(1)));
+  while (processor.finalized_count != 2) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("foo|bar|baz", processor.records);
+  EXPECT_EQ(1u, fsq::processor::HTTPUploaderMetrics::Singleton().files_skipped.Value() - skipped_before);
+  EXPECT_EQ(2u, server.NumberOfSegmentsAccepted());
+  EXPECT_EQ(1u, server.NumberOfKnownSegmentsPrechecked());
+  EXPECT_EQ(0u, server.NumberOfDuplicatesAcknowledged());
+  bricks::net::api::HTTPClientPOSIX::ConnectionPool().Clear();
+}
+
+// Confirm the torn last record of a current file is truncated away on resume.
+TEST(FileSystemQueueTest, TruncatesTornFramedRecordOnResume) {
+  CleanupOldFiles();
+
+  TestFramedRecordsProcessor processor;
+  MockTime mock_wall_time;
+
+  const std::string file_name = bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000001.bin");
+  const std::string torn_record = FramedRecord("torn").substr(0, 14);
+  bricks::WriteStringToFile(file_name, FramedRecord("meh") + FramedRecord("foo") + torn_record);
+
+  FramedRecordsFSQ fsq(processor, kTestDir, mock_wall_time);
+  EXPECT_EQ(30u, fsq.GetQueueStatus().appended_file_size);
+  EXPECT_EQ(30u, bricks::FileSystem::GetFileSize(file_name));
+
+  mock_wall_time.now = 1;
+  fsq.PushMessage("wow");
+  EXPECT_EQ(45u, fsq.GetQueueStatus().appended_file_size);
+
+  fsq.ForceProcessing();
+  while (!processor.finalized_count) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("meh|foo|wow", processor.records);
+}
+
+// Confirm the typed events are appended as framed flat records, sized without being encoded first.
+TEST(FileSystemQueueTest, AppendsFlatEventRecords) {
+  CleanupOldFiles();
+
+  TestFlatEventsProcessor processor;
+  MockTime mock_wall_time;
+  FlatEventsFSQ fsq(processor, kTestDir, mock_wall_time);
+  const size_t record_size = fsq::framed_records::kHeaderSize + bricks::cerealize::kFlatRecordHeaderSize + 12;
+  EXPECT_EQ(record_size,
+            static_cast<size_t>(fsq::strategy::AppendFlatEventRecords<TestFlatEvent>::kFramedRecordSize));
+
+  mock_wall_time.now = 1;
+  fsq.PushMessage(TestFlatEvent{1, -1});
+  const std::vector<TestFlatEvent> events = {TestFlatEvent{2, 20}, TestFlatEvent{3, 300}};
+  fsq.PushMessages(events.begin(), events.end());
+  EXPECT_EQ(3 * record_size, fsq.GetQueueStatus().appended_file_size);
+
+  fsq.ForceProcessing();
+  while (!processor.finalized_count) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("1:-1|2:20|3:300", processor.events);
+
+  // The records of other framed files are not taken for the events.
+  const std::string not_an_event = FramedRecord("foo");
+  fsq::FramedRecord record{not_an_event.data() + fsq::framed_records::kHeaderSize, 3};
+  TestFlatEvent event{42, 42};
+  EXPECT_FALSE(fsq::DecodeFlatEventRecord(record, event));
+  EXPECT_EQ(42u, event.id);
+}
+
+// Confirm the messages are sampled per category once the throughput is high enough, and that the file
+// tells how many of the messages of each category were appended in each window.
+TEST(FileSystemQueueTest, SamplesUnderBacklog) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  SampledFSQ fsq(processor, kTestDir, mock_wall_time);
+
+  mock_wall_time.now = 1000;
+  const std::vector<std::string> messages = {"debug:1", "debug:2", "debug:3", "debug:4", "debug:5"};
+  fsq.PushMessages(messages.begin(), messages.end());
+  fsq.PushMessage("error:1");
+  fsq.PushMessage("error:2");
+  fsq.PushMessage("error:3");
+  // The next window, still sampled, as the previous one has been above the threshold.
+  mock_wall_time.now = 2000;
+  fsq.PushMessage("info:1");
+  fsq.PushMessage("debug:6");
+
+  fsq.ForceProcessing();
+  while (!processor.finalized_count) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ(
+      "debug:1\ndebug:2\ndebug:3\ndebug:5\nerror:1\nerror:2\n"
+      "#SAMPLED 4/5 debug\n#SAMPLED 2/3 error\ninfo:1\n",
+      processor.contents);
+
+  // No sampling with the backlog below its threshold.
+  fsq::strategy::SampleUnderBacklog strategy;
+  strategy.SetBacklogThreshold(100);
+  strategy.SetDefaultSampling(0.0, 0);
+  fsq::QueueCounters<uint64_t> counters;
+  std::vector<std::string> markers;
+  counters.finalized_total_size = 99;
+  EXPECT_TRUE(strategy.AdmitMessage("foo", counters, 1u, markers));
+  counters.finalized_total_size = 100;
+  EXPECT_FALSE(strategy.AdmitMessage("bar", counters, 1u, markers));
+  EXPECT_TRUE(markers.empty());
+  EXPECT_TRUE(strategy.AdmitMessage("baz", fsq::QueueCounters<uint64_t>(), 1000u, markers));
+  ASSERT_EQ(1u, markers.size());
+  EXPECT_EQ("#SAMPLED 1/2", markers[0]);
+}
+
+// Confirm the requests served by `HTTPServer` are logged into the FSQ by the access log.
+TEST(FileSystemQueueTest, HTTPAccessLog) {
+  CleanupOldFiles();
+
+  TestAccessLogProcessor processor;
+  HTTPAccessLog access_log(processor, kTestDir);
+  {
+    bricks::net::HTTPServerParameters parameters;
+    parameters.access_log = access_log.Callback();
+    bricks::net::HTTPServer server(kHTTPAccessLogTestPort, [](const bricks::net::HTTPRequest& request,
+                                                              bricks::net::HTTPResponse& response) {
+      if (request.url.substr(0, 3) != "/ok") {
+        response.code = bricks::net::HTTPResponseCode::NotFound;
+      }
+    }, parameters);
+    bricks::net::Connection connection(bricks::net::ClientSocket("localhost", kHTTPAccessLogTestPort));
+    connection.BlockingWrite("GET /ok HTTP/1.1\r\n\r\nPOST /ok?q=1 HTTP/1.1\r\nContent-Length: 1\r\n\r\n.");
+    connection.BlockingWrite("GET /nope HTTP/1.1\r\nConnection: close\r\n\r\n");
+    connection.BlockingReadUntilEOF();
+  }
+  const uint64_t record_size =
+      fsq::strategy::AppendFlatEventRecords<fsq::HTTPAccessLogEvent>::kFramedRecordSize;
+  while (access_log.UnderlyingFSQ().GetQueueStatus().appended_file_size != 3 * record_size) {
+    std::this_thread::yield();
+  }
+  access_log.UnderlyingFSQ().ForceProcessing();
+  while (!processor.finalized_count) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("GET /ok 200|POST /ok 200|GET /nope 404", processor.records);
+  EXPECT_EQ(0u, access_log.NumberOfDroppedRecords());
+}
+
+// Confirm the files of higher priority lanes are processed first.
+TEST(FileSystemQueueTest, DrainsLanesByPriority) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  LanesFSQ fsq(processor, kTestDir, mock_wall_time);
+
+  mock_wall_time.now = 101;
+  fsq.PushMessageToLane(2, "bulk");
+  mock_wall_time.now = 102;
+  fsq.PushMessageToLane(1, "metrics");
+  mock_wall_time.now = 103;
+  fsq.PushMessage("crash");
+  EXPECT_EQ(19ull, fsq.GetQueueStatus().appended_file_size);
+  EXPECT_EQ(103ull, fsq.GetQueueStatus().appended_file_timestamp);
+
+  fsq.ForceProcessing(true);
+  while (processor.finalized_count != 3) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ(
+      "finalized-00000000000000000103.bin|"
+      "lane1-finalized-00000000000000000102.bin|"
+      "lane2-finalized-00000000000000000101.bin",
+      processor.filenames);
+  EXPECT_EQ("crash\nFILE SEPARATOR\nmetrics\nFILE SEPARATOR\nbulk\n", processor.contents);
+}
+
+// Confirm the files of the lowest priority lane are purged first.
+TEST(FileSystemQueueTest, PurgesLowestPriorityLaneFirst) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
+  MockTime mock_wall_time;
+  LanesFSQ fsq(processor, kTestDir, mock_wall_time);
+
+  const std::vector<std::pair<size_t, std::string>> messages = {
+      {0, "a"}, {2, "b"}, {1, "c"}, {2, "d"}, {0, "e"}};
+  for (const auto& message : messages) {
+    ++mock_wall_time.now;
+    fsq.PushMessageToLane(message.first, message.second);
+    fsq.FinalizeCurrentFile();
+  }
+  std::string queue;
+  for (const auto& file : fsq.GetQueueStatus().finalized.queue) {
+    queue += (queue.empty() ? "" : "|") + file.name;
+  }
+  EXPECT_EQ(
+      "finalized-00000000000000000001.bin|"
+      "lane1-finalized-00000000000000000003.bin|"
+      "finalized-00000000000000000005.bin",
+      queue);
+}
+
+// Confirm weighted round-robin takes files from the lanes in proportion to their weights.
+TEST(FileSystemQueueTest, WeightedRoundRobinLanes) {
+  fsq::strategy::WeightedRoundRobinLanes strategy;
+  strategy.SetLaneWeights({3, 1});
+  const auto pick = [&strategy](const std::vector<bool>& lane_has_files) {
+    const size_t lane = strategy.PickLane(lane_has_files);
+    strategy.OnLanePicked(lane);
+    return std::to_string(lane);
+  };
+  std::string lanes;
+  for (int i = 0; i < 8; ++i) {
+    lanes += pick({true, true});
+  }
+  EXPECT_EQ("00010001", lanes);
+  lanes.clear();
+  for (int i = 0; i < 4; ++i) {
+    lanes += pick({false, true});
+  }
+  for (int i = 0; i < 4; ++i) {
+    lanes += pick({true, false, true});
+  }
+  EXPECT_EQ("11110002", lanes);
+}
+
+// Confirm only one existing file is resumed, the rest are finalized.
+TEST(FileSystemQueueTest, ResumesOnlyExistingFileAndFinalizesTheRest) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+
+  bricks::WriteStringToFile(bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000001.bin"),
+                            "one\n");
+  bricks::WriteStringToFile(bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000002.bin"),
+                            "two\n");
+  bricks::WriteStringToFile(bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000003.bin"),
+                            "three\n");
+
+  FSQ fsq(processor, kTestDir, mock_wall_time);
+
+  while (processor.finalized_count != 2) {
+    ;  // Spin lock.
+  }
+
+  EXPECT_EQ(2u, processor.finalized_count);
+  EXPECT_EQ("finalized-00000000000000000001.bin|finalized-00000000000000000002.bin", processor.filenames);
+  EXPECT_EQ("one\nFILE SEPARATOR\ntwo\n", processor.contents);
+  processor.ClearStats();
+
+  mock_wall_time.now = 4;
+  fsq.PushMessage("four");
+
+  fsq.ForceProcessing();
+  while (processor.finalized_count != 1) {
+    ;  // Spin lock.
+  }
+
+  EXPECT_EQ(1u, processor.finalized_count);
+  EXPECT_EQ("finalized-00000000000000000003.bin", processor.filenames);
+  EXPECT_EQ("three\nfour\n", processor.contents);
+}
+
+// Same as `FinalizedBySize`, with the files written via file descriptors and preallocated.
+TEST(FileSystemQueueTest, PosixOutputFile) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  PosixOutputFileFSQ fsq(processor, kTestDir, mock_wall_time);
+
+  mock_wall_time.now = 101;
+  fsq.PushMessage("this is");
+  mock_wall_time.now = 102;
+  fsq.PushMessage("a test");
+  mock_wall_time.now = 103;
+
+  // Preallocation does not change the size of the file.
+  EXPECT_EQ(15ull, fsq.GetQueueStatus().appended_file_size);
+  EXPECT_EQ(15ull,
+            bricks::FileSystem::GetFileSize(
+                bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000101.bin")));
+
+  fsq.PushMessage("process now");
+  while (processor.finalized_count != 1) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("finalized-00000000000000000101.bin", processor.filenames);
+  EXPECT_EQ("this is\na test\n", processor.contents);
+
+  fsq.ForceProcessing();
+  while (processor.finalized_count != 2) {
+    ;  // Spin lock.
+  }
   EXPECT_EQ("this is\na test\nFILE SEPARATOR\nprocess now\n", processor.contents);
-  EXPECT_EQ(103ull, processor.timestamp);
 }
 
-// Observe messages being processed as they get older than 10 seconds.
-TEST(FileSystemQueueTest, FinalizedByAge) {
+// Confirm processed files are emptied and kept as spare ones, to become the next current files.
+TEST(FileSystemQueueTest, RecyclesFiles) {
   CleanupOldFiles();
 
   TestOutputFilesProcessor processor;
   MockTime mock_wall_time;
-  FSQ fsq(processor, kTestDir, mock_wall_time);
-
-  // Confirm the queue is empty.
-  EXPECT_EQ(0ull, fsq.GetQueueStatus().appended_file_size);
-  EXPECT_EQ(0u, fsq.GetQueueStatus().finalized.queue.size());
-  EXPECT_EQ(0ul, fsq.GetQueueStatus().finalized.total_size);
-
-  // Add a few entries.
-  mock_wall_time.now = 10000;
-  fsq.PushMessage("this too");
-  mock_wall_time.now = 10001;
-  fsq.PushMessage("shall");
-
-  // Confirm the queue is still empty.
-  EXPECT_EQ(15ull, fsq.GetQueueStatus().appended_file_size);  // 15 == strlen("this is\na test\n").
-  EXPECT_EQ(0u, fsq.GetQueueStatus().finalized.queue.size());
-  EXPECT_EQ(0ul, fsq.GetQueueStatus().finalized.total_size);
-  EXPECT_EQ(0u, processor.finalized_count);
+  RecycledFilesFSQ fsq(processor, kTestDir, mock_wall_time);
 
-  // Add another message and make the current file span an interval of more than 10 seconds.
-  mock_wall_time.now = 21000;
-  fsq.PushMessage("pass");
-
-  while (processor.finalized_count != 1) {
+  mock_wall_time.now = 101;
+  fsq.PushMessage("this is");
+  fsq.PushMessage("a test");
+  mock_wall_time.now = 102;
+  fsq.PushMessage("process now");
+  while (fsq.GetQueueStatus().finalized.queue.size() != 0u || processor.finalized_count != 1) {
     ;  // Spin lock.
   }
+  EXPECT_EQ("this is\na test\n", processor.contents);
+  EXPECT_EQ("spare-00000000000000000101.bin", FileNamesWithPrefix("spare-"));
+  const std::string spare_file_name = bricks::FileSystem::JoinPath(kTestDir, "spare-00000000000000000101.bin");
+  EXPECT_EQ(0ull, bricks::FileSystem::GetFileSize(spare_file_name));
 
-  EXPECT_EQ(1u, processor.finalized_count);
-  EXPECT_EQ("finalized-00000000000000010000.bin", processor.filenames);
-  EXPECT_EQ("this too\nshall\n", processor.contents);
-  EXPECT_EQ(21000ull, processor.timestamp);
-
-  // Since the new message made it to the next file, finalize it and confirm the message is there as well.
   fsq.ForceProcessing();
-  while (processor.finalized_count != 2) {
+  while (fsq.GetQueueStatus().finalized.queue.size() != 0u || processor.finalized_count != 2) {
     ;  // Spin lock.
   }
+  EXPECT_EQ("spare-00000000000000000101.bin|spare-00000000000000000102.bin", FileNamesWithPrefix("spare-"));
 
-  EXPECT_EQ(2u, processor.finalized_count);
-  EXPECT_EQ("finalized-00000000000000010000.bin|finalized-00000000000000021000.bin", processor.filenames);
-  EXPECT_EQ("this too\nshall\nFILE SEPARATOR\npass\n", processor.contents);
-  EXPECT_EQ(21000ull, processor.timestamp);
+  // The next current file is the oldest spare one, renamed.
+  mock_wall_time.now = 103;
+  fsq.PushMessage("more");
+  EXPECT_EQ("spare-00000000000000000102.bin", FileNamesWithPrefix("spare-"));
+  EXPECT_EQ("current-00000000000000000103.bin", FileNamesWithPrefix("current-"));
+  const std::string current_file_name =
+      bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000103.bin");
+  EXPECT_EQ("more\n", bricks::ReadFileAsString(current_file_name));
 }
 
-// Pushes a few messages and force their processing.
-TEST(FileSystemQueueTest, ForceProcessing) {
+// Confirm the next two finalized files are read ahead while the oldest one is being processed.
+TEST(FileSystemQueueTest, PrefetchesNextFiles) {
   CleanupOldFiles();
 
+  std::vector<std::string> file_names;
+  for (int i = 1; i <= 4; ++i) {
+    file_names.push_back(bricks::FileSystem::JoinPath(kTestDir, "finalized-0000000000000000000" +
+                                                                    std::to_string(i) + ".bin"));
+    bricks::WriteStringToFile(file_names.back(), std::to_string(i) + "\n");
+  }
+  {
+    std::lock_guard<std::mutex> lock(PrefetchRecordingFileSystem::Mutex());
+    PrefetchRecordingFileSystem::Prefetched().clear();
+  }
+
   TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
   MockTime mock_wall_time;
-  FSQ fsq(processor, kTestDir, mock_wall_time);
-
-  // Confirm the queue is empty.
-  EXPECT_EQ(0ull, fsq.GetQueueStatus().appended_file_size);
-  EXPECT_EQ(0u, fsq.GetQueueStatus().finalized.queue.size());
-  EXPECT_EQ(0ul, fsq.GetQueueStatus().finalized.total_size);
-
-  // Add a few entries.
-  mock_wall_time.now = 1001;
-  fsq.PushMessage("foo");
-  mock_wall_time.now = 1002;
-  fsq.PushMessage("bar");
-  mock_wall_time.now = 1003;
-  fsq.PushMessage("baz");
-
-  // Confirm the queue is empty.
-  EXPECT_EQ(12ull, fsq.GetQueueStatus().appended_file_size);  // Three messages of (3 + '\n') bytes each.
-  EXPECT_EQ(0u, fsq.GetQueueStatus().finalized.queue.size());
-  EXPECT_EQ(0ul, fsq.GetQueueStatus().finalized.total_size);
-
-  // Force entries processing to have three freshly added ones reach our TestOutputFilesProcessor.
-  fsq.ForceProcessing();
-  while (!processor.finalized_count) {
-    ;  // Spin lock.
+  PrefetchingFSQ fsq(processor, kTestDir, mock_wall_time);
+  std::vector<std::string> prefetched;
+  while (prefetched.size() < 2u) {
+    std::lock_guard<std::mutex> lock(PrefetchRecordingFileSystem::Mutex());
+    prefetched = PrefetchRecordingFileSystem::Prefetched();
   }
-
-  EXPECT_EQ(1u, processor.finalized_count);
-  EXPECT_EQ("finalized-00000000000000001001.bin", processor.filenames);
-  EXPECT_EQ("foo\nbar\nbaz\n", processor.contents);
-  EXPECT_EQ(1003ull, processor.timestamp);
+  EXPECT_EQ(std::vector<std::string>({file_names[1], file_names[2]}), prefetched);
 }
 
-// Confirm the existing file is resumed.
-TEST(FileSystemQueueTest, ResumesExistingFile) {
+// Confirm the queue is restored from the manifest, not from the directory, and validated lazily.
+TEST(FileSystemQueueTest, QueueManifest) {
   CleanupOldFiles();
 
+  const std::string manifest_file_name = bricks::FileSystem::JoinPath(kTestDir, "manifest.fsq");
   TestOutputFilesProcessor processor;
   MockTime mock_wall_time;
 
-  bricks::WriteStringToFile(bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000001.bin"),
-                            "meh\n");
+  {
+    processor.SetMimicUnavailable();
+    ManifestFSQ fsq(processor, kTestDir, mock_wall_time);
+    mock_wall_time.now = 100001;
+    fsq.PushMessage("one");
+    fsq.FinalizeCurrentFile();
+    mock_wall_time.now = 100002;
+    fsq.PushMessage("two");
+    fsq.FinalizeCurrentFile();
+  }
 
-  FSQ fsq(processor, kTestDir, mock_wall_time);
+  EXPECT_EQ(
+      "F 4 finalized-00000000000000100001.bin\n"
+      "F 4 finalized-00000000000000100002.bin\n"
+      "END\n",
+      bricks::ReadFileAsString(manifest_file_name));
 
-  mock_wall_time.now = 1;
-  fsq.PushMessage("wow");
+  // A file not in the manifest is not picked up, and a file from the manifest that is gone is skipped.
+  bricks::WriteStringToFile(bricks::FileSystem::JoinPath(kTestDir, "finalized-00000000000000100000.bin"),
+                            "zero\n");
+  bricks::RemoveFile(bricks::FileSystem::JoinPath(kTestDir, "finalized-00000000000000100001.bin"));
 
-  fsq.ForceProcessing();
-  while (!processor.finalized_count) {
+  processor.SetMimicUnavailable(false);
+  ManifestFSQ fsq(processor, kTestDir, mock_wall_time);
+  while (processor.finalized_count != 1) {
     ;  // Spin lock.
   }
-
-  EXPECT_EQ(1u, processor.finalized_count);
-  EXPECT_EQ("finalized-00000000000000000001.bin", processor.filenames);
-  EXPECT_EQ("meh\nwow\n", processor.contents);
+  EXPECT_EQ("finalized-00000000000000100002.bin", processor.filenames);
+  EXPECT_EQ("two\n", processor.contents);
+  while (fsq.GetQueueStatus().finalized.queue.size() != 0u) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ(0ul, fsq.GetQueueStatus().finalized.total_size);
+  EXPECT_EQ(0ull, bricks::FileSystem::GetFileSize(manifest_file_name));
 }
 
-// Confirm only one existing file is resumed, the rest are finalized.
-TEST(FileSystemQueueTest, ResumesOnlyExistingFileAndFinalizesTheRest) {
+// Confirm the messages pushed before the startup scan are kept, and appended after the resumed file.
+TEST(FileSystemQueueTest, BuffersMessagesUntilReady) {
   CleanupOldFiles();
 
   TestOutputFilesProcessor processor;
   MockTime mock_wall_time;
 
   bricks::WriteStringToFile(bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000001.bin"),
-                            "one\n");
-  bricks::WriteStringToFile(bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000002.bin"),
-                            "two\n");
-  bricks::WriteStringToFile(bricks::FileSystem::JoinPath(kTestDir, "current-00000000000000000003.bin"),
-                            "three\n");
-
-  FSQ fsq(processor, kTestDir, mock_wall_time);
-
-  while (processor.finalized_count != 2) {
-    ;  // Spin lock.
-  }
+                            "zero\n");
 
-  EXPECT_EQ(2u, processor.finalized_count);
-  EXPECT_EQ("finalized-00000000000000000001.bin|finalized-00000000000000000002.bin", processor.filenames);
-  EXPECT_EQ("one\nFILE SEPARATOR\ntwo\n", processor.contents);
-  processor.ClearStats();
+  BlockedScanFileSystem::ScanAllowed() = false;
+  BufferedUntilReadyFSQ fsq(processor, kTestDir, mock_wall_time);
 
-  mock_wall_time.now = 4;
-  fsq.PushMessage("four");
+  // These calls return right away, while the worker thread is blocked on scanning the directory.
+  mock_wall_time.now = 2;
+  fsq.PushMessage("one");
+  fsq.PushMessage("two");
 
+  BlockedScanFileSystem::ScanAllowed() = true;
+  EXPECT_EQ(0u, fsq.GetQueueStatus().finalized.queue.size());
   fsq.ForceProcessing();
   while (processor.finalized_count != 1) {
     ;  // Spin lock.
   }
-
-  EXPECT_EQ(1u, processor.finalized_count);
-  EXPECT_EQ("finalized-00000000000000000003.bin", processor.filenames);
-  EXPECT_EQ("three\nfour\n", processor.contents);
+  EXPECT_EQ("finalized-00000000000000000001.bin", processor.filenames);
+  EXPECT_EQ("zero\none\ntwo\n", processor.contents);
 }
 
 // Confirm the existing file is not resumed if the strategy dictates so.
@@ -382,6 +2540,30 @@ TEST(FileSystemQueueTest, PurgesByNumberOfFiles) {
   EXPECT_EQ("finalized-00000000000000100004.bin", fsq.GetQueueStatus().finalized.queue.back().name);
 }
 
+TEST(FileSystemQueueTest, AllocatesQueueStatusFromConfigMemoryResource) {
+  CleanupOldFiles();
+
+  CountingMemoryResource& resource = CountingMemoryResource::Singleton();
+  EXPECT_EQ(0, resource.bytes_in_use);
+  {
+    TestOutputFilesProcessor processor;
+    processor.SetMimicUnavailable();
+    MockTime mock_wall_time;
+    StatusMemoryResourceFSQ fsq(processor, kTestDir, mock_wall_time);
+    for (int i = 0; i < 100; ++i) {
+      mock_wall_time.now = 100001 + i;
+      fsq.PushMessage("foo");
+      fsq.FinalizeCurrentFile();
+    }
+    const StatusMemoryResourceFSQ::Status status = fsq.GetQueueStatus();
+    EXPECT_EQ(3u, status.finalized.queue.size());
+    EXPECT_LT(0, resource.bytes_in_use);
+    // The copy returned is on the heap, to not be tied to the lifetime of the resource.
+    EXPECT_EQ(bricks::memory::NewDeleteResource(), status.finalized.queue.get_allocator().Resource());
+  }
+  EXPECT_EQ(0, resource.bytes_in_use);
+}
+
 // Purges the oldest files so that the total size of the queue never exceeds 20 bytes.
 TEST(FileSystemQueueTest, PurgesByTotalSize) {
   CleanupOldFiles();
@@ -420,6 +2602,161 @@ TEST(FileSystemQueueTest, PurgesByTotalSize) {
   EXPECT_EQ("finalized-00000000000000100010.bin", fsq.GetQueueStatus().finalized.queue.back().name);
 }
 
+// Confirm the counters follow the status.
+TEST(FileSystemQueueTest, QueueCounters) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
+  MockTime mock_wall_time;
+  FSQ fsq(processor, kTestDir, mock_wall_time);
+  fsq.GetQueueStatus();
+  EXPECT_EQ(0u, fsq.GetQueueCounters().finalized_files);
+  EXPECT_FALSE(fsq.GetQueueCounters().processing_suspended);
+
+  mock_wall_time.now = 100001;
+  fsq.PushMessage("one");
+  EXPECT_EQ(4ull, fsq.GetQueueCounters().appended_file_size);
+  fsq.FinalizeCurrentFile();
+  mock_wall_time.now = 100002;
+  fsq.PushMessage("two");
+  fsq.FinalizeCurrentFile();
+  mock_wall_time.now = 100003;
+  fsq.PushMessage("three");
+
+  while (!fsq.GetQueueCounters().processing_suspended) {
+    ;  // Spin lock.
+  }
+  const FSQ::Counters counters = fsq.GetQueueCounters();
+  EXPECT_EQ(2u, counters.finalized_files);
+  EXPECT_EQ(8ull, counters.finalized_total_size);
+  EXPECT_EQ(100001ull, counters.oldest_finalized_file_timestamp);
+  EXPECT_EQ(6ull, counters.appended_file_size);
+  EXPECT_EQ(0u, counters.files_in_process);
+
+  processor.SetMimicUnavailable(false);
+  fsq.ResumeProcessing();
+  while (fsq.GetQueueCounters().finalized_files) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ(0ull, fsq.GetQueueCounters().finalized_total_size);
+  EXPECT_EQ(0ull, fsq.GetQueueCounters().oldest_finalized_file_timestamp);
+  EXPECT_FALSE(fsq.GetQueueCounters().processing_suspended);
+  EXPECT_EQ("one\nFILE SEPARATOR\ntwo\n", processor.contents);
+}
+
+// Confirm purged files leave the queue at once, and are removed from disk by the reclaimer thread.
+TEST(FileSystemQueueTest, ExportsMetrics) {
+  CleanupOldFiles();
+
+  // The metrics are shared by all the queues, only their increments are checked.
+  const fsq::FSQMetrics& metrics = fsq::FSQMetrics::Singleton();
+  const uint64_t messages_before = metrics.messages_appended.Value();
+  const uint64_t bytes_before = metrics.bytes_appended.Value();
+  const uint64_t finalized_before = metrics.files_finalized.Value();
+  const uint64_t processed_before = metrics.files_processed.Value();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  FSQ fsq(processor, kTestDir, mock_wall_time);
+  mock_wall_time.now = 101;
+  fsq.PushMessage("this is");
+  fsq.PushMessage("a test");
+  fsq.ForceProcessing(true);
+  while (metrics.files_processed.Value() != processed_before + 1) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ(messages_before + 2, metrics.messages_appended.Value());
+  EXPECT_EQ(bytes_before + 15, metrics.bytes_appended.Value());
+  EXPECT_EQ(finalized_before + 1, metrics.files_finalized.Value());
+
+  const std::string exported = bricks::metrics::Registry::Singleton().ExportPrometheus();
+  EXPECT_NE(std::string::npos, exported.find("# TYPE fsq_files_processed_total counter\n"));
+}
+
+TEST(FileSystemQueueTest, ReclaimsPurgedFilesInBackground) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  processor.SetMimicUnavailable();
+  MockTime mock_wall_time;
+  ReclaimInBackgroundFSQ fsq(processor, kTestDir, mock_wall_time);
+
+  mock_wall_time.now = 100001;
+  fsq.PushMessage("one");
+  fsq.PushMessage("two");
+  fsq.FinalizeCurrentFile();
+  mock_wall_time.now = 100003;
+  fsq.PushMessage("three");
+  fsq.PushMessage("four");
+  fsq.FinalizeCurrentFile();
+
+  // Wait for the processing to be suspended, so that no file is in process, and thus spared by the purge.
+  while (!fsq.GetQueueCounters().processing_suspended) {
+    ;  // Spin lock.
+  }
+
+  // The purge does not wait for the file to be removed.
+  BlockedRemoveFileSystem::RemoveAllowed() = false;
+  mock_wall_time.now = 100010;
+  fsq.PushMessage("very, very, very, very long message");
+  fsq.FinalizeCurrentFile();
+  EXPECT_EQ(2u, fsq.GetQueueStatus().finalized.queue.size());
+  EXPECT_EQ(47ul, fsq.GetQueueStatus().finalized.total_size);
+  EXPECT_EQ(8ul, fsq.GetQueueStatus().pending_reclaim_size);  // strlen("one\ntwo\n").
+  EXPECT_EQ(
+      "finalized-00000000000000100001.bin|"
+      "finalized-00000000000000100003.bin|"
+      "finalized-00000000000000100010.bin",
+      FileNamesWithPrefix("finalized-"));
+
+  BlockedRemoveFileSystem::RemoveAllowed() = true;
+  while (fsq.GetQueueStatus().pending_reclaim_size) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("finalized-00000000000000100003.bin|finalized-00000000000000100010.bin",
+            FileNamesWithPrefix("finalized-"));
+}
+
+// Queues finalized files moved into the working directory by other processes, each of them once.
+TEST(FileSystemQueueTest, WatchesWorkingDirectory) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  WatchFSQ fsq(processor, kTestDir, mock_wall_time);
+
+  mock_wall_time.now = 101;
+  fsq.PushMessage("own");
+  fsq.FinalizeCurrentFile();
+  while (processor.finalized_count != 1) {
+    ;  // Spin lock.
+  }
+
+  const std::string temporary_file_name = bricks::FileSystem::JoinPath(kTestDir, "upload.tmp");
+  bricks::WriteStringToFile(temporary_file_name, "dropped\n");
+  bricks::FileSystem::RenameFile(temporary_file_name,
+                                 bricks::FileSystem::JoinPath(kTestDir, "finalized-00000000000000000500.bin"));
+  while (processor.finalized_count != 2) {
+    ;  // Spin lock.
+  }
+
+  mock_wall_time.now = 102;
+  fsq.PushMessage("own again");
+  fsq.FinalizeCurrentFile();
+  while (processor.finalized_count != 3) {
+    ;  // Spin lock.
+  }
+
+  EXPECT_EQ(
+      "finalized-00000000000000000101.bin|"
+      "finalized-00000000000000000500.bin|"
+      "finalized-00000000000000000501.bin",
+      processor.filenames);
+  EXPECT_EQ("own\nFILE SEPARATOR\ndropped\nFILE SEPARATOR\nown again\n", processor.contents);
+  EXPECT_EQ(0u, fsq.GetQueueStatus().finalized.queue.size());
+}
+
 // Persists retry delay to the file.
 TEST(FileSystemQueueTest, SavesRetryDelayToFile) {
   const std::string state_file_name = std::move(bricks::FileSystem::JoinPath(kTestDir, "state"));
@@ -514,6 +2851,60 @@ TEST(FileSystemQueueTest, ReadsRetryDelayFromFile) {
   EXPECT_LE(static_cast<uint64_t>(d), 5000);
 }
 
+// Does not rewrite the state file on a success following another success.
+TEST(FileSystemQueueTest, SkipsUnchangedRetryStateWrites) {
+  const std::string state_file_name = std::move(bricks::FileSystem::JoinPath(kTestDir, "state"));
+  bricks::RemoveFile(state_file_name, bricks::RemoveFileParameters::Silent);
+
+  typedef fsq::strategy::ExponentialDelayRetryStrategy<bricks::FileSystem> ExpRetry;
+  ExpRetry strategy(bricks::FileSystem(), ExpRetry::DistributionParams(1500, 1000, 2000));
+  strategy.AttachToFile(state_file_name);
+  ASSERT_EQ(41u, bricks::ReadFileAsString(state_file_name).length());
+
+  bricks::WriteStringToFile(state_file_name, "unchanged");
+  strategy.OnSuccess();
+  EXPECT_EQ("unchanged", bricks::ReadFileAsString(state_file_name));
+
+  strategy.OnFailure();
+  EXPECT_EQ(41u, bricks::ReadFileAsString(state_file_name).length());
+  bricks::WriteStringToFile(state_file_name, "changed");
+  strategy.OnSuccess();
+  EXPECT_EQ(41u, bricks::ReadFileAsString(state_file_name).length());
+}
+
+// Persists retry delay to a binary file, and reads it back.
+TEST(FileSystemQueueTest, SavesRetryDelayToBinaryFile) {
+  const std::string state_file_name = std::move(bricks::FileSystem::JoinPath(kTestDir, "state"));
+  bricks::RemoveFile(state_file_name, bricks::RemoveFileParameters::Silent);
+
+  typedef fsq::strategy::ExponentialDelayRetryStrategy<bricks::FileSystem> ExpRetry;
+  {
+    ExpRetry strategy(bricks::FileSystem(), ExpRetry::DistributionParams(1500, 1000, 2000));
+    strategy.AttachToFile(state_file_name, ExpRetry::PersistenceParams(true, 1));
+    ASSERT_EQ(16u, bricks::ReadFileAsString(state_file_name).length());
+    strategy.OnFailure();
+    const std::string contents = bricks::ReadFileAsString(state_file_name);
+    ASSERT_EQ(16u, contents.length());
+    uint64_t a = 0, b = 0;
+    for (int i = 7; i >= 0; --i) {
+      a = (a << 8) | static_cast<uint8_t>(contents[i]);
+      b = (b << 8) | static_cast<uint8_t>(contents[8 + i]);
+    }
+    EXPECT_GE(b, a + 1000);
+    EXPECT_LE(b, a + 2000);
+  }
+  {
+    // The text strategy reads the binary file back.
+    ExpRetry strategy(bricks::FileSystem(), ExpRetry::DistributionParams(1500, 1000, 2000));
+    strategy.AttachToFile(state_file_name);
+    bricks::time::MILLISECONDS_INTERVAL d;
+    ASSERT_TRUE(strategy.ShouldWait(&d));
+    EXPECT_GE(static_cast<uint64_t>(d), 900u);
+    EXPECT_LE(static_cast<uint64_t>(d), 2000u);
+    EXPECT_EQ(41u, bricks::ReadFileAsString(state_file_name).length());
+  }
+}
+
 // Ignored retry delay if it was set from the future.
 TEST(FileSystemQueueTest, IgnoredRetryDelaySetFromTheFuture) {
   const std::string state_file_name = std::move(bricks::FileSystem::JoinPath(kTestDir, "state"));
@@ -538,3 +2929,91 @@ TEST(FileSystemQueueTest, IgnoredRetryDelaySetFromTheFuture) {
   bricks::time::MILLISECONDS_INTERVAL interval;
   ASSERT_FALSE(fsq.ShouldWait(&interval));
 }
+
+// Processes no more than 10 files per second.
+TEST(FileSystemQueueTest, RateLimitsProcessing) {
+  CleanupOldFiles();
+
+  TestOutputFilesProcessor processor;
+  MockTime mock_wall_time;
+  typedef fsq::strategy::TokenBucketRateLimitedRetryStrategy<bricks::FileSystem> RateLimitedRetry;
+  RateLimitedFSQ fsq(processor,
+                     kTestDir,
+                     mock_wall_time,
+                     bricks::FileSystem(),
+                     RateLimitedRetry(bricks::FileSystem(), RateLimitedRetry::RateLimits(10, 0)));
+
+  const bricks::time::EPOCH_MILLISECONDS begin = bricks::time::Now();
+  // Three files, as `MockConfig` purges the queue beyond that.
+  for (int i = 0; i < 3; ++i) {
+    mock_wall_time.now = 101 + i;
+    fsq.PushMessage("foo");
+    fsq.FinalizeCurrentFile();
+  }
+  while (processor.finalized_count != 3) {
+    ;  // Spin lock.
+  }
+  // The first file is processed right away, and each of the following two 100ms after the previous one.
+  EXPECT_GE(static_cast<uint64_t>(bricks::time::Now() - begin), 150u);
+}
+
+// Persists the token buckets to the file, for the limits to hold across restarts.
+TEST(FileSystemQueueTest, SavesRateLimitStateToFile) {
+  const std::string state_file_name = std::move(bricks::FileSystem::JoinPath(kTestDir, "state"));
+  bricks::RemoveFile(state_file_name, bricks::RemoveFileParameters::Silent);
+  bricks::RemoveFile(state_file_name + ".rate_limit", bricks::RemoveFileParameters::Silent);
+
+  typedef fsq::strategy::TokenBucketRateLimitedRetryStrategy<bricks::FileSystem> RateLimitedRetry;
+  // One file and 1000 bytes per second.
+  const RateLimitedRetry::RateLimits limits(1, 1000);
+  bricks::time::MILLISECONDS_INTERVAL interval;
+  {
+    RateLimitedRetry strategy(bricks::FileSystem(), limits);
+    strategy.AttachToFile(state_file_name);
+    ASSERT_FALSE(strategy.ShouldWait(&interval));
+    strategy.OnSuccess(5000);
+    ASSERT_TRUE(strategy.ShouldWait(&interval));
+    // The bytes bucket is 5000 bytes in debt, which takes five seconds to pay off.
+    EXPECT_GE(static_cast<uint64_t>(interval), 4500u);
+    EXPECT_LE(static_cast<uint64_t>(interval), 5000u);
+  }
+  {
+    RateLimitedRetry strategy(bricks::FileSystem(), limits);
+    ASSERT_FALSE(strategy.ShouldWait(&interval));
+    strategy.AttachToFile(state_file_name);
+    ASSERT_TRUE(strategy.ShouldWait(&interval));
+    EXPECT_GE(static_cast<uint64_t>(interval), 4500u);
+    EXPECT_LE(static_cast<uint64_t>(interval), 5000u);
+  }
+}
+
+// The coarse clock does not go back, within one thread or compared to what the other threads have seen.
+TEST(FileSystemQueueTest, CoarseTimeManagerIsMonotonicAcrossThreads) {
+  const fsq::strategy::UseCoarseEpochMilliseconds coarse;
+  const fsq::strategy::UseEpochMilliseconds precise;
+  std::atomic<uint64_t> latest_seen(0);
+  std::atomic_bool ok(true);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([t, &coarse, &precise, &latest_seen, &ok]() {
+      uint64_t previous = 0;
+      for (int i = 0; i < 100000; ++i) {
+        const uint64_t seen = latest_seen.load();
+        const uint64_t now = static_cast<uint64_t>((i + t) % 2 ? coarse.Now() : precise.Now());
+        if (now < previous || now < seen) {
+          ok = false;
+        }
+        previous = now;
+        latest_seen = std::max(latest_seen.load(), now);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_TRUE(ok);
+  const uint64_t coarse_now = static_cast<uint64_t>(coarse.Now());
+  const uint64_t precise_now = static_cast<uint64_t>(precise.Now());
+  EXPECT_LE(coarse_now, precise_now);
+  EXPECT_LE(precise_now - coarse_now, 100u);
+}
@@ -0,0 +1,241 @@
+// `fsq::processor::UploadCluster` spreads the uploads of `HTTPUploader`-s across a cluster of ingest servers,
+// such as `IngestServer`-s on several nodes, see `HTTPUploader::ShardAcross()`.
+//
+// The uploader has an affinity key, such as the ID of the device, and its files go to the node the key
+// maps to, with rendezvous hashing: of all the nodes, the one with the highest hash of the key and the node.
+// Thus all the files of the device land on the same node, and, as the nodes come and go, only the keys
+// of the nodes gone, and those the new nodes now hash highest for, move to another node, with no ring
+// to rebuild.
+//
+// A node is ejected once `failures_to_eject` uploads to it in a row have failed: for the next `ejection_ms`,
+// its keys go to the node with the next highest hash instead. Past that, the node is tried again: the first
+// failure ejects it right away, and the first success has it back for good. Should all the nodes be ejected,
+// the keys go to their own nodes, for the cluster to be probed rather than none of the files to be sent.
+//
+// The nodes are the base URLs, such as "http://10.0.0.1:8080", with the path of the uploader appended to them.
+// They are either given to `SetNodes()`, or fetched from the discovery URL, which responds with one of them
+// per line, every `refresh_ms`. The list is refreshed by the first upload to find it stale, and is kept
+// as it is should the discovery fail. As long as there is no list yet, the discovery is retried by the next
+// upload rather than in `refresh_ms`. The health of the nodes that stay in the list carries over.
+//
+// Each of the nodes is uploaded to over keep-alive connections of its own, as the HTTP client pools them
+// by host and port, see `HTTPClientConnectionPool`. THREAD SAFE.
+
+#ifndef FSQ_UPLOAD_CLUSTER_H
+#define FSQ_UPLOAD_CLUSTER_H
+
+#include <cstdint>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../Bricks/net/api/api.h"
+#include "../Bricks/time/chrono.h"
+
+namespace fsq {
+namespace processor {
+
+struct UploadClusterParams {
+  size_t failures_to_eject = 3;
+  uint64_t ejection_ms = 30 * 1000;
+  uint64_t refresh_ms = 60 * 1000;
+  // For the discovery server that hangs not to hold the uploads up for longer.
+  uint64_t discovery_timeout_ms = 5 * 1000;
+  UploadClusterParams() = default;
+  UploadClusterParams(size_t failures_to_eject,
+                      uint64_t ejection_ms,
+                      uint64_t refresh_ms,
+                      uint64_t discovery_timeout_ms = 5 * 1000)
+      : failures_to_eject(failures_to_eject),
+        ejection_ms(ejection_ms),
+        refresh_ms(refresh_ms),
+        discovery_timeout_ms(discovery_timeout_ms) {}
+};
+
+class UploadCluster final {
+ public:
+  typedef UploadClusterParams Params;
+
+  // The cluster of the nodes given, and set with `SetNodes()` from then on.
+  explicit UploadCluster(const std::vector<std::string>& nodes, const Params& params = Params())
+      : params_(params) {
+    SetNodes(nodes);
+  }
+
+  // The cluster of the nodes listed by `discovery_url`, fetched on the first upload.
+  explicit UploadCluster(const std::string& discovery_url, const Params& params = Params())
+      : params_(params), discovery_url_(discovery_url) {
+  }
+
+  void SetNodes(const std::vector<std::string>& nodes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::map<std::string, Node> updated;
+    for (const std::string& url : nodes) {
+      const auto existing = nodes_.find(url);
+      updated[url] = (existing != nodes_.end()) ? existing->second : Node(url);
+    }
+    nodes_.swap(updated);
+  }
+
+  std::vector<std::string> Nodes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::string> nodes;
+    for (const auto& node : nodes_) {
+      nodes.push_back(node.first);
+    }
+    return nodes;
+  }
+
+  // The base URL of the node to upload the files of `key` to, empty if there are no nodes.
+  std::string NodeFor(const std::string& key) {
+    RefreshIfStale();
+    const uint64_t key_hash = Hash(key);
+    const bricks::time::EPOCH_MILLISECONDS now = bricks::time::Now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Node* best = nullptr;
+    const Node* best_of_all = nullptr;
+    uint64_t best_score = 0;
+    uint64_t best_of_all_score = 0;
+    for (const auto& it : nodes_) {
+      const Node& node = it.second;
+      const uint64_t score = Mix(key_hash ^ node.hash);
+      if (!best_of_all || score > best_of_all_score) {
+        best_of_all = &node;
+        best_of_all_score = score;
+      }
+      if (!node.IsEjected(now) && (!best || score > best_score)) {
+        best = &node;
+        best_score = score;
+      }
+    }
+    best = best ? best : best_of_all;
+    return best ? best->url : "";
+  }
+
+  void ReportSuccess(const std::string& url) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = nodes_.find(url);
+    if (it != nodes_.end()) {
+      it->second.failures = 0;
+      it->second.on_probation = false;
+    }
+  }
+
+  void ReportFailure(const std::string& url) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = nodes_.find(url);
+    if (it != nodes_.end()) {
+      Node& node = it->second;
+      ++node.failures;
+      if (node.on_probation || node.failures >= params_.failures_to_eject) {
+        node.failures = 0;
+        node.on_probation = true;
+        node.ejected_until =
+            bricks::time::Now() + static_cast<bricks::time::MILLISECONDS_INTERVAL>(params_.ejection_ms);
+      }
+    }
+  }
+
+  bool IsEjected(const std::string& url) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = nodes_.find(url);
+    return it != nodes_.end() && it->second.IsEjected(bricks::time::Now());
+  }
+
+ private:
+  struct Node {
+    std::string url;
+    uint64_t hash = 0;
+    size_t failures = 0;  // In a row.
+    // Set once the node has been ejected, and cleared by the first success after the ejection.
+    bool on_probation = false;
+    bricks::time::EPOCH_MILLISECONDS ejected_until = bricks::time::EPOCH_MILLISECONDS(0);
+
+    Node() = default;
+    explicit Node(const std::string& url) : url(url), hash(Hash(url)) {}
+    bool IsEjected(bricks::time::EPOCH_MILLISECONDS now) const { return now < ejected_until; }
+  };
+
+  // The first upload to find the list stale fetches it, with no lock held, and the others go on
+  // with the old one. Until the first fetch succeeds, each upload after a failed one tries again.
+  void RefreshIfStale() {
+    if (discovery_url_.empty()) {
+      return;
+    }
+    const bricks::time::EPOCH_MILLISECONDS now = bricks::time::Now();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (now < next_refresh_) {
+        return;
+      }
+      next_refresh_ = now + static_cast<bricks::time::MILLISECONDS_INTERVAL>(params_.refresh_ms);
+    }
+    const std::vector<std::string> nodes = FetchNodes();
+    if (!nodes.empty()) {
+      SetNodes(nodes);
+    } else {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (nodes_.empty()) {
+        next_refresh_ = bricks::time::EPOCH_MILLISECONDS(0);
+      }
+    }
+  }
+
+  // The nodes listed by the discovery URL, none if it could not be reached.
+  std::vector<std::string> FetchNodes() const {
+    std::vector<std::string> nodes;
+    try {
+      const auto response =
+          HTTP(bricks::net::api::GET(discovery_url_).SetTimeout(params_.discovery_timeout_ms));
+      if (response.code != 200) {
+        return nodes;
+      }
+      std::istringstream lines(response.body);
+      std::string line;
+      while (std::getline(lines, line)) {
+        const size_t first = line.find_first_not_of(" \t\r");
+        if (first != std::string::npos) {
+          nodes.push_back(line.substr(first, line.find_last_not_of(" \t\r") - first + 1));
+        }
+      }
+    } catch (const std::exception&) {
+      nodes.clear();
+    }
+    return nodes;
+  }
+
+  // FNV-1a, and the 64-bit finalizer of MurmurHash3, for the scores of the nodes to be spread evenly.
+  static uint64_t Hash(const std::string& s) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const char c : s) {
+      hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+    }
+    return Mix(hash);
+  }
+  static uint64_t Mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+  }
+
+  const Params params_;
+  const std::string discovery_url_;
+  // Keyed by the base URL. Guarded by `mutex_`.
+  std::map<std::string, Node> nodes_;
+  bricks::time::EPOCH_MILLISECONDS next_refresh_ = bricks::time::EPOCH_MILLISECONDS(0);
+  mutable std::mutex mutex_;
+
+  UploadCluster(const UploadCluster&) = delete;
+  void operator=(const UploadCluster&) = delete;
+};
+
+}  // namespace processor
+}  // namespace fsq
+
+#endif  // FSQ_UPLOAD_CLUSTER_H
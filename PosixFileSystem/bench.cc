@@ -0,0 +1,450 @@
+// The benchmarks of the file I/O of FSQ-style workloads, run with `make bench`, for `bricks/file`
+// and `PosixFileManager`, in --bench_dir. Run them with --bench_dir on tmpfs, ext4 and APFS in turn
+// to compare the file systems: the numbers only hold for the one the directory is on.
+//
+// Appending 100-byte records, the size of a typical log message:
+// * Flushed after each record, as an unbuffered FSQ does, with a `write()` each: `std::ofstream`,
+//   which is `bricks::FileSystem::OutputFile`, `bricks::PosixOutputFile`, `PosixFileManager::Handle`
+//   with no buffer, and a raw `write()` to the file descriptor.
+// * Buffered: `std::ofstream`, `PosixOutputFile` and `Handle`, with their default buffers, and `writev()`
+//   of 16 records at a time.
+// * Copied into a memory-mapped file, preallocated with `ftruncate()`, and with `O_DIRECT`, the records
+//   collected into 4KB blocks, compared to the 4KB blocks written through the page cache. `O_DIRECT` is
+//   skipped on the file systems that do not support it, such as tmpfs, and on the OS-es with no `O_DIRECT`.
+// The files are started over once they reach 64MB, outside of the timed code.
+//
+// Reading the whole file of 64KB and 4MB, from the page cache, warmed up by the calibration runs:
+// `bricks::ReadFileAsString()`, `PosixFileManager::ReadFile()`, and `bricks::MemoryMappedFile`, with one byte
+// of each page touched, for the pages to be mapped, as the processor reading the file would have them.
+//
+// Scanning the directory of 10K and 100K files and getting the size of each: `ScanDirEntriesUntil()`,
+// with the sizes taken relative to the directory, `ScanDir()` followed by `GetFileSize()` of the full path,
+// and `PosixFileManager::ScanDirectory()` followed by its `GetFileSize()`. The files are created once,
+// and left in place, for the next runs, until removed along with --bench_dir, by `make clean` by default.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "posix_file_manager.h"
+
+#include "../Bricks/benchmark/benchmark.h"
+#include "../Bricks/dflags/dflags.h"
+#include "../Bricks/file/file.h"
+
+DEFINE_string(bench_dir, "build/bench_dir", "The directory to benchmark the file I/O in.");
+
+using bricks::benchmark::DoNotOptimize;
+using bricks::benchmark::State;
+
+namespace {
+
+const size_t kRecordSize = 100;
+const size_t kBlockSize = 4096;
+const uint64_t kMaxFileSize = 64 * 1024 * 1024;
+
+std::string BenchDir() {
+  bricks::FileSystem::CreateDirectory(FLAGS_bench_dir);
+  return FLAGS_bench_dir;
+}
+
+std::string BenchFile(const std::string& name) {
+  return bricks::FileSystem::JoinPath(BenchDir(), name);
+}
+
+// Appends a record per iteration via `writer.Append(record)`, with the file started over by `writer.Reset()`,
+// outside of the timed code, before it would grow past `kMaxFileSize` bytes. The writer is constructed
+// with the file truncated.
+template <typename T_WRITER>
+void AppendRecords(State& state, T_WRITER& writer, size_t record_size = kRecordSize) {
+  const std::string record(record_size, '.');
+  uint64_t size = 0;
+  while (state.KeepRunning()) {
+    writer.Append(record);
+    size += record.length();
+    if (size + record.length() > kMaxFileSize) {
+      state.PauseTiming();
+      writer.Reset();
+      size = 0;
+      state.ResumeTiming();
+    }
+  }
+  state.SetBytesProcessed(state.Iterations() * record.length());
+}
+
+struct OfstreamWriter {
+  OfstreamWriter(const std::string& file_name, bool flush_each)
+      : file_name(file_name),
+        flush_each(flush_each),
+        file(new std::ofstream(file_name, std::ofstream::binary)) {}
+  void Append(const std::string& record) {
+    file->write(record.data(), record.length());
+    if (flush_each) {
+      file->flush();
+    }
+  }
+  void Reset() { file.reset(new std::ofstream(file_name, std::ofstream::binary)); }
+  const std::string file_name;
+  const bool flush_each;
+  std::unique_ptr<std::ofstream> file;
+};
+
+struct PosixOutputFileWriter {
+  PosixOutputFileWriter(const std::string& file_name, bool flush_each)
+      : file_name(file_name), flush_each(flush_each), file(new bricks::PosixOutputFile(file_name)) {}
+  void Append(const std::string& record) {
+    file->write(record.data(), record.length());
+    if (flush_each) {
+      file->flush();
+    }
+  }
+  void Reset() { file.reset(new bricks::PosixOutputFile(file_name)); }
+  const std::string file_name;
+  const bool flush_each;
+  std::unique_ptr<bricks::PosixOutputFile> file;
+};
+
+struct HandleWriter {
+  HandleWriter(const std::string& file_name, size_t buffer_size)
+      : file_name(file_name), buffer_size(buffer_size) {
+    Reset();
+  }
+  void Append(const std::string& record) { handle->Append(record); }
+  void Reset() {
+    handle.reset();
+    handle.reset(new PosixFileManager::Handle(file_name, true, buffer_size));
+  }
+  const std::string file_name;
+  const size_t buffer_size;
+  std::unique_ptr<PosixFileManager::Handle> handle;
+};
+
+struct FileDescriptorWriter {
+  explicit FileDescriptorWriter(const std::string& file_name) : file_name(file_name) { Open(); }
+  ~FileDescriptorWriter() { Close(); }
+  void Open() { fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644); }
+  void Close() {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+  void Append(const std::string& record) {
+    if (!bricks::WriteToFileDescriptor(fd, record.data(), record.length())) {
+      std::cerr << "Can not write into " << file_name << ": " << std::strerror(errno) << std::endl;
+      std::exit(-1);
+    }
+  }
+  void Reset() {
+    Close();
+    Open();
+  }
+  const std::string file_name;
+  int fd = -1;
+};
+
+// Copies the records into the file mapped into memory, with the pages faulted in as they are written to.
+struct MemoryMappedWriter {
+  explicit MemoryMappedWriter(const std::string& file_name) : file_name(file_name) { Open(); }
+  ~MemoryMappedWriter() { Close(); }
+  void Open() {
+    fd = ::open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || ::ftruncate(fd, static_cast<off_t>(kMaxFileSize))) {
+      std::cerr << "Can not create " << file_name << ": " << std::strerror(errno) << std::endl;
+      std::exit(-1);
+    }
+    data = static_cast<char*>(::mmap(nullptr, kMaxFileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    offset = 0;
+  }
+  void Close() {
+    ::munmap(data, kMaxFileSize);
+    ::close(fd);
+  }
+  void Append(const std::string& record) {
+    std::memcpy(data + offset, record.data(), record.length());
+    offset += record.length();
+  }
+  void Reset() {
+    Close();
+    Open();
+  }
+  const std::string file_name;
+  int fd = -1;
+  char* data = nullptr;
+  uint64_t offset = 0;
+};
+
+// The 4KB blocks written with `O_DIRECT` have to be aligned in memory as well. Once found not to be supported,
+// the benchmark does nothing, and is reported as taking no time, which is told about once.
+void AppendBlocksWithODirect(State& state) {
+  static bool told = false;
+#if defined(O_DIRECT)
+  const std::string file_name = BenchFile("o_direct.bin");
+  const int fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+  void* block = nullptr;
+  if (fd < 0 || ::posix_memalign(&block, kBlockSize, kBlockSize)) {
+    if (!told) {
+      std::cerr << "O_DIRECT is not supported in " << FLAGS_bench_dir << ", skipped." << std::endl;
+      told = true;
+    }
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return;
+  }
+  std::memset(block, '.', kBlockSize);
+  uint64_t offset = 0;
+  while (state.KeepRunning()) {
+    if (::pwrite(fd, block, kBlockSize, static_cast<off_t>(offset)) != static_cast<ssize_t>(kBlockSize)) {
+      std::cerr << "O_DIRECT write failed: " << std::strerror(errno) << std::endl;
+      std::exit(-1);
+    }
+    offset = (offset + kBlockSize) % kMaxFileSize;
+  }
+  state.SetBytesProcessed(state.Iterations() * kBlockSize);
+  std::free(block);
+  ::close(fd);
+  bricks::RemoveFile(file_name, bricks::RemoveFileParameters::Silent);
+#else
+  static_cast<void>(state);
+  if (!told) {
+    std::cerr << "O_DIRECT is not available, skipped." << std::endl;
+    told = true;
+  }
+#endif
+}
+
+// The file of the size given, created once per process, and read by each of the benchmarks of that size.
+std::string FileOfSize(size_t size) {
+  const std::string file_name = BenchFile("read_" + std::to_string(size) + ".bin");
+  if (!bricks::FileSystem::FileExists(file_name) || bricks::FileSystem::GetFileSize(file_name) != size) {
+    bricks::WriteStringToFile(file_name, std::string(size, '.'));
+  }
+  return file_name;
+}
+
+void ReadFileAsString(State& state, size_t size) {
+  const std::string file_name = FileOfSize(size);
+  while (state.KeepRunning()) {
+    const std::string contents = bricks::ReadFileAsString(file_name);
+    DoNotOptimize(contents);
+  }
+  state.SetBytesProcessed(state.Iterations() * size);
+}
+
+void ReadFileWithPosixFileManager(State& state, size_t size) {
+  const std::string file_name = FileOfSize(size);
+  const PosixFileManager manager(BenchDir() + '/');
+  const std::string name = file_name.substr(file_name.rfind('/') + 1);
+  while (state.KeepRunning()) {
+    const std::vector<char> contents = manager.ReadFile(name);
+    DoNotOptimize(contents);
+  }
+  state.SetBytesProcessed(state.Iterations() * size);
+}
+
+void ReadMemoryMappedFile(State& state, size_t size) {
+  const std::string file_name = FileOfSize(size);
+  const size_t page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+  while (state.KeepRunning()) {
+    const bricks::MemoryMappedFile file(file_name);
+    char sum = 0;
+    for (size_t i = 0; i < file.size(); i += page_size) {
+      sum += file.data()[i];
+    }
+    DoNotOptimize(sum);
+  }
+  state.SetBytesProcessed(state.Iterations() * size);
+}
+
+// The directory of `count` empty files, created once per process.
+std::string DirectoryOfFiles(size_t count) {
+  const std::string directory = BenchFile("scan_" + std::to_string(count));
+  const std::string marker = directory + ".done";
+  if (!bricks::FileSystem::FileExists(marker)) {
+    bricks::FileSystem::CreateDirectory(directory);
+    for (size_t i = 0; i < count; ++i) {
+      bricks::WriteStringToFile(bricks::FileSystem::JoinPath(directory, "finalized-" + std::to_string(i)), "");
+    }
+    bricks::WriteStringToFile(marker, "");
+  }
+  return directory;
+}
+
+void ScanDirEntries(State& state, size_t count) {
+  const std::string directory = DirectoryOfFiles(count);
+  while (state.KeepRunning()) {
+    uint64_t total_size = 0;
+    bricks::FileSystem::ScanDirEntriesUntil(directory, [&total_size](const bricks::PosixDirectoryEntry& entry) {
+      total_size += entry.Size();
+      return true;
+    });
+    DoNotOptimize(total_size);
+  }
+  state.SetItemsProcessed(state.Iterations() * count);
+}
+
+void ScanDirAndGetFileSizes(State& state, size_t count) {
+  const std::string directory = DirectoryOfFiles(count);
+  while (state.KeepRunning()) {
+    uint64_t total_size = 0;
+    bricks::FileSystem::ScanDir(directory, [&directory, &total_size](const std::string& name) {
+      total_size += bricks::FileSystem::GetFileSize(bricks::FileSystem::JoinPath(directory, name));
+    });
+    DoNotOptimize(total_size);
+  }
+  state.SetItemsProcessed(state.Iterations() * count);
+}
+
+void ScanDirectoryWithPosixFileManager(State& state, size_t count) {
+  const PosixFileManager manager(DirectoryOfFiles(count) + '/');
+  while (state.KeepRunning()) {
+    uint64_t total_size = 0;
+    PosixFileManager::DirectoryIterator it = manager.ScanDirectory("*");
+    for (std::string name = it.Next(); !name.empty(); name = it.Next()) {
+      total_size += manager.GetFileSize(name);
+    }
+    DoNotOptimize(total_size);
+  }
+  state.SetItemsProcessed(state.Iterations() * count);
+}
+
+}  // namespace
+
+BRICKS_BENCHMARK(AppendOfstreamFlushEach) {
+  OfstreamWriter writer(BenchFile("append.bin"), true);
+  AppendRecords(state, writer);
+}
+
+BRICKS_BENCHMARK(AppendPosixOutputFileFlushEach) {
+  PosixOutputFileWriter writer(BenchFile("append.bin"), true);
+  AppendRecords(state, writer);
+}
+
+BRICKS_BENCHMARK(AppendHandleUnbuffered) {
+  HandleWriter writer(BenchFile("append.bin"), 0);
+  AppendRecords(state, writer);
+}
+
+BRICKS_BENCHMARK(AppendRawWrite) {
+  FileDescriptorWriter writer(BenchFile("append.bin"));
+  AppendRecords(state, writer);
+}
+
+BRICKS_BENCHMARK(AppendOfstreamBuffered) {
+  OfstreamWriter writer(BenchFile("append.bin"), false);
+  AppendRecords(state, writer);
+}
+
+BRICKS_BENCHMARK(AppendPosixOutputFileBuffered) {
+  PosixOutputFileWriter writer(BenchFile("append.bin"), false);
+  AppendRecords(state, writer);
+}
+
+BRICKS_BENCHMARK(AppendHandleBuffered) {
+  HandleWriter writer(BenchFile("append.bin"), PosixFileManager::Handle::kDefaultBufferSize);
+  AppendRecords(state, writer);
+}
+
+BRICKS_BENCHMARK(AppendWritevOf16) {
+  const std::string file_name = BenchFile("append.bin");
+  const int fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  const std::string record(kRecordSize, '.');
+  struct iovec chunks[16];
+  for (struct iovec& chunk : chunks) {
+    chunk.iov_base = const_cast<char*>(record.data());
+    chunk.iov_len = record.length();
+  }
+  uint64_t size = 0;
+  while (state.KeepRunning()) {
+    struct iovec batch[16];
+    std::copy(chunks, chunks + 16, batch);
+    bricks::WriteChunksToFileDescriptor(fd, batch, 16);
+    size += 16 * kRecordSize;
+    if (size >= kMaxFileSize) {
+      state.PauseTiming();
+      static_cast<void>(::ftruncate(fd, 0));
+      ::lseek(fd, 0, SEEK_SET);
+      size = 0;
+      state.ResumeTiming();
+    }
+  }
+  state.SetItemsProcessed(state.Iterations() * 16);
+  state.SetBytesProcessed(state.Iterations() * 16 * kRecordSize);
+  ::close(fd);
+}
+
+BRICKS_BENCHMARK(AppendMemoryMapped) {
+  MemoryMappedWriter writer(BenchFile("append.bin"));
+  AppendRecords(state, writer);
+}
+
+BRICKS_BENCHMARK(Append4KBBlocks) {
+  FileDescriptorWriter writer(BenchFile("append.bin"));
+  AppendRecords(state, writer, kBlockSize);
+}
+
+BRICKS_BENCHMARK(Append4KBBlocksWithODirect) {
+  AppendBlocksWithODirect(state);
+}
+
+BRICKS_BENCHMARK(ReadFileAsString64KB) {
+  ReadFileAsString(state, 64 * 1024);
+}
+
+BRICKS_BENCHMARK(ReadFileAsString4MB) {
+  ReadFileAsString(state, 4 * 1024 * 1024);
+}
+
+BRICKS_BENCHMARK(ReadFileWithPosixFileManager64KB) {
+  ReadFileWithPosixFileManager(state, 64 * 1024);
+}
+
+BRICKS_BENCHMARK(ReadFileWithPosixFileManager4MB) {
+  ReadFileWithPosixFileManager(state, 4 * 1024 * 1024);
+}
+
+BRICKS_BENCHMARK(ReadMemoryMappedFile64KB) {
+  ReadMemoryMappedFile(state, 64 * 1024);
+}
+
+BRICKS_BENCHMARK(ReadMemoryMappedFile4MB) {
+  ReadMemoryMappedFile(state, 4 * 1024 * 1024);
+}
+
+BRICKS_BENCHMARK(ScanDirEntriesOf10K) {
+  ScanDirEntries(state, 10000);
+}
+
+BRICKS_BENCHMARK(ScanDirAndGetFileSizesOf10K) {
+  ScanDirAndGetFileSizes(state, 10000);
+}
+
+BRICKS_BENCHMARK(ScanDirectoryWithPosixFileManagerOf10K) {
+  ScanDirectoryWithPosixFileManager(state, 10000);
+}
+
+BRICKS_BENCHMARK(ScanDirEntriesOf100K) {
+  ScanDirEntries(state, 100000);
+}
+
+BRICKS_BENCHMARK(ScanDirAndGetFileSizesOf100K) {
+  ScanDirAndGetFileSizes(state, 100000);
+}
+
+BRICKS_BENCHMARK(ScanDirectoryWithPosixFileManagerOf100K) {
+  ScanDirectoryWithPosixFileManager(state, 100000);
+}
+
+BRICKS_BENCHMARK_MAIN();
@@ -2,24 +2,104 @@
 #define SANDBOX_POSIX_FILE_MANAGER_H
 
 // A wrapper for the filesystem. Features file append, rename, read and directory scan.
-// Directory scan only supports question marks in patterns.
-// Uses C++11 complemented with POSIX rename(), stat(), remove() and {open,read,close}dir().
+// Directory scan supports question marks and asterisks in patterns, and can keep the listing cached.
+// Uses C++11 complemented with POSIX openat(), fstatat(), renameat(), unlinkat() and {fdopen,read,close}dir(),
+// relative to the working directory, which is opened once, by the constructor, and should exist by then.
+// The names of the files are thus neither prepended with the directory, nor looked up from the root.
+// Files are read with `bricks::ReadFileDescriptorAsString()` and `read()`, without `std::ifstream`.
+// Files are appended to directly via their file descriptors, with write-behind buffering, see `Handle`.
 
-#include <cstdio>  // rename().
+#include <cerrno>
+#include <cstdio>   // renameat().
+#include <cstring>  // strlen().
+#include <algorithm>
 #include <exception>
 #include <fstream>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <vector>
 
 #include <dirent.h>    // {open,read,close}dir().
+#include <fcntl.h>     // open().
 #include <sys/stat.h>  // stat().
+#include <sys/uio.h>   // writev().
+#include <unistd.h>    // write(), fdatasync(), close().
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+#include "../Bricks/file/async_io.h"
+#include "../Bricks/file/file.h"
+
+// A file name pattern with '?' matching any one character, and '*' matching any sequence of characters.
+// Compiled once into the literal prefix, the literal suffix and the parts in between, separated by '*'-s,
+// and matched against the `char*` names as they come, with no allocations.
+class FileNamePattern final {
+ public:
+  explicit FileNamePattern(const std::string& pattern) {
+    size_t begin = 0;
+    size_t star;
+    while ((star = pattern.find('*', begin)) != std::string::npos) {
+      parts_.push_back(pattern.substr(begin, star - begin));
+      begin = star + 1;
+    }
+    parts_.push_back(pattern.substr(begin));
+    for (const std::string& part : parts_) {
+      min_length_ += part.length();
+    }
+  }
+
+  bool Match(const char* name, size_t length) const {
+    if (parts_.size() == 1) {
+      return length == min_length_ && MatchPart(parts_.front(), name);
+    }
+    if (length < min_length_) {
+      return false;
+    }
+    const std::string& prefix = parts_.front();
+    const std::string& suffix = parts_.back();
+    if (!MatchPart(prefix, name) || !MatchPart(suffix, name + length - suffix.length())) {
+      return false;
+    }
+    // The parts between the '*'-s are matched leftmost first, which is never worse for the parts after them.
+    const char* begin = name + prefix.length();
+    const char* const end = name + length - suffix.length();
+    for (size_t i = 1; i + 1 < parts_.size(); ++i) {
+      const std::string& part = parts_[i];
+      while (static_cast<size_t>(end - begin) >= part.length() && !MatchPart(part, begin)) {
+        ++begin;
+      }
+      if (static_cast<size_t>(end - begin) < part.length()) {
+        return false;
+      }
+      begin += part.length();
+    }
+    return true;
+  }
+
+ private:
+  static bool MatchPart(const std::string& part, const char* s) {
+    for (size_t i = 0; i < part.length(); ++i) {
+      if (part[i] != '?' && part[i] != s[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::vector<std::string> parts_;
+  size_t min_length_ = 0;
+};
 
 struct FileManager {
   struct Exception : std::exception {};
   struct CanNotCreateFileException : Exception {};
   struct FileAlreadyExistsException : Exception {};
   struct CanNotReadFileException : Exception {};
+  struct CanNotWriteFileException : Exception {};
   struct CanNotRenameFileException : Exception {};
   struct CanNotGetFileSizeException : Exception {};
   struct CanNotRemoveFileException : Exception {};
@@ -31,67 +111,175 @@ struct FileManager {
 
 class PosixFileManager final : FileManager {
  public:
+  // The file appended to via its file descriptor. The appended data is collected in a buffer of
+  // `buffer_size` bytes, written out when it is full, on `Flush()`, `Sync()` and in the destructor.
+  // The data that does not fit the buffer is written together with what has been buffered by one `writev()`.
+  // A zero `buffer_size` has each append written right away, as one `writev()` for `AppendV()`.
   class Handle {
    public:
-    explicit inline Handle(const std::string& absolute_filename, bool truncate)
-        : impl_(new Impl(absolute_filename, truncate)) {
+    enum { kDefaultBufferSize = 64 * 1024 };
+
+    explicit inline Handle(const std::string& absolute_filename,
+                           bool truncate,
+                           size_t buffer_size = kDefaultBufferSize)
+        : Handle(::open(absolute_filename.c_str(),
+                        O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : O_APPEND),
+                        0644),
+                 buffer_size) {
     }
 
-    inline Handle(Handle&& rhs) : impl_(std::move(rhs.impl_)) {
+    inline Handle(Handle&& rhs)
+        : fd_(rhs.fd_), buffer_size_(rhs.buffer_size_), buffer_(std::move(rhs.buffer_)) {
+      rhs.fd_ = -1;
     }
 
     inline void operator=(Handle&& rhs) {
-      impl_.reset();
-      impl_.swap(rhs.impl_);
+      Close();
+      fd_ = rhs.fd_;
+      buffer_size_ = rhs.buffer_size_;
+      buffer_ = std::move(rhs.buffer_);
+      rhs.fd_ = -1;
     }
 
     Handle() = delete;
+    Handle(const Handle&) = delete;
+    void operator=(const Handle&) = delete;
+
+    inline ~Handle() {
+      Close();
+    }
 
     inline Handle& Append(const std::string& s) {
-      if (!impl_) {
+      return Append(s.data(), s.length());
+    }
+
+    inline Handle& Append(const char* data, size_t size) {
+      struct iovec chunk;
+      chunk.iov_base = const_cast<char*>(data);
+      chunk.iov_len = size;
+      return AppendV(&chunk, 1);
+    }
+
+    // Appends the chunks, in order, as if by one `Append()` per chunk. Leaves `chunks` intact.
+    inline Handle& AppendV(const struct iovec* chunks, int count) {
+      if (fd_ < 0) {
         throw NullFileHandleException();
+      }
+      size_t size = 0;
+      for (int i = 0; i < count; ++i) {
+        size += chunks[i].iov_len;
+      }
+      if (buffer_.size() + size <= buffer_size_) {
+        for (int i = 0; i < count; ++i) {
+          buffer_.append(static_cast<const char*>(chunks[i].iov_base), chunks[i].iov_len);
+        }
       } else {
-        impl_->Append(s);
-        return *this;
+        std::vector<struct iovec> all(count + 1);
+        all[0].iov_base = const_cast<char*>(buffer_.data());
+        all[0].iov_len = buffer_.size();
+        std::copy(chunks, chunks + count, all.begin() + 1);
+        const bool ok = bricks::WriteChunksToFileDescriptor(fd_, &all[0], count + 1);
+        buffer_.clear();
+        if (!ok) {
+          throw CanNotWriteFileException();
+        }
       }
+      return *this;
     }
 
-   private:
-    class Impl {
-     public:
-      inline Impl(const std::string& absolute_filename, bool truncate)
-          : fo_(absolute_filename, std::ios::binary | (truncate ? std::ios::trunc : std::ios::app)) {
-        if (!fo_) {
-          throw CanNotCreateFileException();
-        }
+    // Writes out the buffer.
+    inline Handle& Flush() {
+      if (fd_ < 0) {
+        throw NullFileHandleException();
       }
-      inline void Append(const std::string& s) {
-        fo_ << s << std::flush;
+      if (!buffer_.empty()) {
+        const bool ok = bricks::WriteToFileDescriptor(fd_, buffer_.data(), buffer_.size());
+        buffer_.clear();
+        if (!ok) {
+          throw CanNotWriteFileException();
+        }
       }
+      return *this;
+    }
 
-     private:
-      std::ofstream fo_;
-    };
+    // Writes out the buffer and flushes the file to disk.
+    inline Handle& Sync() {
+      Flush();
+#if defined(__APPLE__)
+      const bool ok = !::fsync(fd_);
+#else
+      const bool ok = !::fdatasync(fd_);
+#endif
+      if (!ok) {
+        throw CanNotWriteFileException();
+      }
+      return *this;
+    }
 
    private:
-    std::unique_ptr<Impl> impl_;
+    friend class PosixFileManager;
+
+    // Takes over the file descriptor just opened for writing.
+    inline Handle(int fd, size_t buffer_size) : fd_(fd), buffer_size_(buffer_size) {
+      if (fd_ < 0) {
+        throw CanNotCreateFileException();
+      }
+      buffer_.reserve(buffer_size_);
+    }
+
+    inline void Close() {
+      if (fd_ >= 0) {
+        if (!buffer_.empty()) {
+          bricks::WriteToFileDescriptor(fd_, buffer_.data(), buffer_.size());
+          buffer_.clear();
+        }
+        ::close(fd_);
+        fd_ = -1;
+      }
+    }
+
+    int fd_;
+    size_t buffer_size_;
+    std::string buffer_;
   };
 
+  // Returns the names of the entries of the directory that match the pattern, one per `Next()` call,
+  // and an empty string once done. Reads the directory as it goes, or iterates over the cached listing.
   class DirectoryIterator {
    public:
-    inline DirectoryIterator(const std::string& path, const std::string& pattern)
-        : dir_(opendir(path.c_str())), pattern_(pattern) {
+    // Reads the directory open as `dir_fd`, via a file descriptor of its own, for the scans to not share
+    // the position in the directory.
+    inline DirectoryIterator(int dir_fd, const std::string& pattern) : pattern_(pattern) {
+      const int fd = ::openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd >= 0) {
+        dir_ = ::fdopendir(fd);
+        if (!dir_) {
+          ::close(fd);
+        }
+      }
       if (!dir_) {
         throw CanNotScanDirectoryException();
       }
     }
 
-    inline DirectoryIterator(DirectoryIterator&& rhs) : dir_(rhs.dir_) {
+    inline DirectoryIterator(std::shared_ptr<const std::vector<std::string>> listing,
+                             const std::string& pattern)
+        : listing_(std::move(listing)), pattern_(pattern) {
+    }
+
+    inline DirectoryIterator(DirectoryIterator&& rhs)
+        : dir_(rhs.dir_), listing_(std::move(rhs.listing_)), index_(rhs.index_), pattern_(rhs.pattern_) {
       rhs.dir_ = 0;
     }
 
     inline void operator=(DirectoryIterator&& rhs) {
+      if (dir_) {
+        closedir(dir_);
+      }
       dir_ = rhs.dir_;
+      listing_ = std::move(rhs.listing_);
+      index_ = rhs.index_;
+      pattern_ = rhs.pattern_;
       rhs.dir_ = 0;
     }
 
@@ -104,94 +292,133 @@ class PosixFileManager final : FileManager {
     }
 
     inline std::string Next() {
-      if (!dir_) {
+      if (listing_) {
+        while (index_ < listing_->size()) {
+          const std::string& current = (*listing_)[index_++];
+          if (pattern_.Match(current.c_str(), current.length())) {
+            return current;
+          }
+        }
+        return "";
+      } else if (!dir_) {
         throw NullDirectoryIteratorException();
       } else {
-        dirent* entry;
-        while (true) {
-          entry = readdir(dir_);
-          if (!entry) {
-            return "";
-          } else {
-            const std::string current(entry->d_name);
-            if (current != "." && current != ".." && Match(current)) {
-              return current;
-            }
+        while (const dirent* entry = readdir(dir_)) {
+          const char* name = entry->d_name;
+          if (!IsDotOrDotDot(name) && pattern_.Match(name, ::strlen(name))) {
+            return name;
           }
         }
+        return "";
       }
     }
 
    private:
-    inline bool Match(const std::string& s) const {
-      if (s.length() == pattern_.length()) {
-        for (size_t i = 0; i < s.length(); ++i) {
-          if (!(s[i] == pattern_[i] || pattern_[i] == '?')) {
-            return false;
-          }
-        }
-        return true;
-      } else {
-        return false;
-      }
-    }
-
-    DIR* dir_;
-    std::string pattern_;
+    DIR* dir_ = nullptr;
+    std::shared_ptr<const std::vector<std::string>> listing_;
+    size_t index_ = 0;
+    FileNamePattern pattern_;
   };
 
   // Should include the trailing slash.
-  explicit inline PosixFileManager(const std::string& working_dir_with_trailing_slash = "./.tmp/")
+  // With `cache_directory_listing`, the listing of the directory is read once and kept up to date
+  // by inotify on Linux, so that `ScanDirectory()` only reads the changes since the previous call.
+  // Without inotify, the directory is read on each call, as it is by default.
+  explicit inline PosixFileManager(const std::string& working_dir_with_trailing_slash = "./.tmp/",
+                                   bool cache_directory_listing = false)
       : dir_prefix_(working_dir_with_trailing_slash) {
     if (dir_prefix_.empty() || dir_prefix_.back() != '/') {
       throw NeedTrailingSlashInWorkingDirectoryException();
     }
+    directory_ = std::make_shared<const Directory>(dir_prefix_);
+    if (cache_directory_listing) {
+      listing_ = std::make_shared<DirectoryListing>(dir_prefix_);
+    }
   }
 
-  inline Handle CreateFile(const std::string& filename) const {
-    try {
-      GetFileSize(filename);
+  // Creates the file with `O_EXCL`, which tells the file that exists already apart in the same call.
+  inline Handle CreateFile(const std::string& filename, size_t buffer_size = Handle::kDefaultBufferSize) const {
+    const int fd = ::openat(DirFD(), filename.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == EEXIST) {
       throw FileAlreadyExistsException();
-    } catch (CanNotGetFileSizeException&) {
-      return Handle(dir_prefix_ + filename, true);
     }
+    return Handle(fd, buffer_size);
   }
 
-  inline Handle CreateOrAppendToFile(const std::string& filename) const {
-    return Handle(dir_prefix_ + filename, false);
+  inline Handle CreateOrAppendToFile(const std::string& filename,
+                                     size_t buffer_size = Handle::kDefaultBufferSize) const {
+    return Handle(::openat(DirFD(), filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644),
+                  buffer_size);
   }
 
   inline std::vector<char> ReadFile(const std::string& filename) const {
-    std::ifstream fi(dir_prefix_ + filename);
-    if (!fi) {
+    const int fd = OpenForReading(filename);
+    const auto close_guard = bricks::MakeScopeGuard([fd]() { ::close(fd); });
+    struct stat info;
+    if (::fstat(fd, &info)) {
       throw CanNotReadFileException();
-    } else {
-      fi.seekg(0, std::ios::end);
-      const size_t size = fi.tellg();
-      fi.seekg(0, std::ios::beg);
-      std::vector<char> data(size);
-      fi.read(&data[0], size);
-      if (!fi) {
-        throw CanNotReadFileException();
+    }
+    std::vector<char> result(static_cast<size_t>(info.st_size));
+    size_t offset = 0;
+    while (offset < result.size()) {
+      const ssize_t bytes_read = ::read(fd, &result[offset], result.size() - offset);
+      if (bytes_read < 0) {
+        if (errno != EINTR) {
+          throw CanNotReadFileException();
+        }
+      } else if (bytes_read == 0) {
+        break;
+      } else {
+        offset += static_cast<size_t>(bytes_read);
       }
-      return data;
     }
+    result.resize(offset);
+    return result;
   }
 
   inline std::string ReadFileToString(const std::string& filename) const {
-    std::vector<char> data = ReadFile(filename);
-    return std::string(data.begin(), data.end());
+    const int fd = OpenForReading(filename);
+    const auto close_guard = bricks::MakeScopeGuard([fd]() { ::close(fd); });
+    try {
+      return bricks::ReadFileDescriptorAsString(fd);
+    } catch (const bricks::FileException&) {
+      throw CanNotReadFileException();
+    }
   }
 
+  // Replaces the file named `to`, if there is one, as `rename()` does.
   inline void RenameFile(const std::string& from, const std::string& to) const {
-    if (rename((dir_prefix_ + from).c_str(), (dir_prefix_ + to).c_str()) == -1) {
+    if (::renameat(DirFD(), from.c_str(), DirFD(), to.c_str())) {
+      throw CanNotRenameFileException();
+    }
+  }
+
+  // Renames the file unless the one named `to` exists, atomically, and returns false if it does.
+  // Uses `renameat2(RENAME_NOREPLACE)` where available, and a hard link otherwise, as
+  // `bricks::FileSystem::RenameFileUnlessExists()` does.
+  inline bool RenameFileUnlessExists(const std::string& from, const std::string& to) const {
+#if defined(RENAME_NOREPLACE)
+    if (!::renameat2(DirFD(), from.c_str(), DirFD(), to.c_str(), RENAME_NOREPLACE)) {
+      return true;
+    } else if (errno == EEXIST) {
+      return false;
+    } else if (errno != EINVAL && errno != ENOSYS) {
+      throw CanNotRenameFileException();
+    }
+#endif
+    if (!::linkat(DirFD(), from.c_str(), DirFD(), to.c_str(), 0)) {
+      ::unlinkat(DirFD(), from.c_str(), 0);
+      return true;
+    } else if (errno == EEXIST) {
+      return false;
+    } else {
       throw CanNotRenameFileException();
     }
   }
 
   inline size_t GetFileSize(const std::string& filename) const {
     struct stat result;
-    if (stat((dir_prefix_ + filename).c_str(), &result)) {
+    if (::fstatat(DirFD(), filename.c_str(), &result, 0)) {
       throw CanNotGetFileSizeException();
     } else {
       return result.st_size;
@@ -199,18 +426,158 @@ class PosixFileManager final : FileManager {
   }
 
   inline void RemoveFile(const std::string& filename) const {
-    if (remove((dir_prefix_ + filename).c_str()) != 0) {
+    if (::unlinkat(DirFD(), filename.c_str(), 0)) {
       throw CanNotRemoveFileException();
     }
   }
 
+  // The counterparts of `RenameFile()` and `RemoveFile()` run by `io`, ordered with respect to the other
+  // operations it runs on the same files. `completion(ok)` is called on the thread of `io`.
+  // As `io` orders the operations by the full names of the files, these do build the names.
+  typedef bricks::AsyncFileIO::Completion AsyncCompletion;
+
+  inline void RenameFileAsync(bricks::AsyncFileIO& io,
+                              const std::string& from,
+                              const std::string& to,
+                              AsyncCompletion completion = AsyncCompletion()) const {
+    io.Rename(dir_prefix_ + from, dir_prefix_ + to, std::move(completion));
+  }
+
+  inline void RemoveFileAsync(bricks::AsyncFileIO& io,
+                              const std::string& filename,
+                              AsyncCompletion completion = AsyncCompletion()) const {
+    io.Remove(dir_prefix_ + filename, std::move(completion));
+  }
+
+  // The pattern is matched against the whole name, with '?' matching any character, and '*' any sequence
+  // of characters, including the empty one.
   inline DirectoryIterator ScanDirectory(const std::string& pattern) const {
-    return DirectoryIterator(dir_prefix_, pattern);
+    if (listing_) {
+      std::shared_ptr<const std::vector<std::string>> names = listing_->Names();
+      if (names) {
+        return DirectoryIterator(std::move(names), pattern);
+      }
+    }
+    return DirectoryIterator(DirFD(), pattern);
   }
 
  private:
+  static inline bool IsDotOrDotDot(const char* name) {
+    return name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]));
+  }
+
+  // The working directory, open for the lifetime of the manager and its copies. Should the directory
+  // not exist, `fd` is -1, and the operations on the files in it fail, with their respective exceptions.
+  struct Directory final {
+    explicit inline Directory(const std::string& path)
+        : fd(::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) {
+    }
+    inline ~Directory() {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+    const int fd;
+  };
+
+  inline int DirFD() const {
+    return directory_->fd;
+  }
+
+  inline int OpenForReading(const std::string& filename) const {
+    const int fd = ::openat(DirFD(), filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw CanNotReadFileException();
+    }
+    return fd;
+  }
+
+  // The names of the entries of the directory, read once and then updated from the inotify events.
+  // `Names()` returns the snapshot, rebuilt only if there have been changes since the previous call,
+  // or null if the listing can not be kept, in which case the directory is read instead. THREAD SAFE.
+  class DirectoryListing final {
+   public:
+    explicit inline DirectoryListing(const std::string& path) : path_(path) {
+#if defined(__linux__)
+      fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (fd_ >= 0 &&
+          ::inotify_add_watch(fd_, path.c_str(), IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) {
+        ::close(fd_);
+        fd_ = -1;
+      }
+#endif
+      if (fd_ >= 0) {
+        ReadDirectory();
+      }
+    }
+    inline ~DirectoryListing() {
+      if (fd_ >= 0) {
+        ::close(fd_);
+      }
+    }
+
+    inline std::shared_ptr<const std::vector<std::string>> Names() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (fd_ < 0) {
+        return nullptr;
+      }
+      ReadEvents();
+      if (!snapshot_) {
+        snapshot_ = std::make_shared<const std::vector<std::string>>(names_.begin(), names_.end());
+      }
+      return snapshot_;
+    }
+
+   private:
+    inline void ReadDirectory() {
+      names_.clear();
+      snapshot_.reset();
+      DIR* dir = ::opendir(path_.c_str());
+      if (dir) {
+        while (const dirent* entry = ::readdir(dir)) {
+          if (!IsDotOrDotDot(entry->d_name)) {
+            names_.insert(entry->d_name);
+          }
+        }
+        ::closedir(dir);
+      }
+    }
+
+    inline void ReadEvents() {
+#if defined(__linux__)
+      alignas(struct inotify_event) char buffer[16 * 1024];
+      ssize_t length;
+      while ((length = ::read(fd_, buffer, sizeof(buffer))) > 0) {
+        for (const char* p = buffer; p < buffer + length;) {
+          const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+          if (event->mask & IN_Q_OVERFLOW) {
+            // The events have been dropped by the kernel, start over.
+            ReadDirectory();
+          } else if (event->len) {
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+              names_.insert(event->name);
+            } else {
+              names_.erase(event->name);
+            }
+            snapshot_.reset();
+          }
+          p += sizeof(struct inotify_event) + event->len;
+        }
+      }
+#endif
+    }
+
+    const std::string path_;
+    int fd_ = -1;
+    std::mutex mutex_;
+    std::set<std::string> names_;
+    std::shared_ptr<const std::vector<std::string>> snapshot_;
+  };
+
   // Should include the trailing slash, potentially plarform-dependent.
   const std::string dir_prefix_;
+  std::shared_ptr<const Directory> directory_;
+  std::shared_ptr<DirectoryListing> listing_;
 };
 
 #endif  // SANDBOX_POSIX_FILE_MANAGER_H
@@ -1,7 +1,10 @@
 #include <algorithm>
+#include <atomic>
 #include <exception>
+#include <mutex>
 #include <vector>
 #include <string>
+#include <thread>
 
 #include "posix_file_manager.h"
 
@@ -82,6 +85,103 @@ TEST(PosixFileSystem, BinaryDataFileOperations) {
   fs.RemoveFile("4.bin");
 }
 
+// The appends are buffered until the buffer is full, or until `Flush()`, `Sync()` or the destructor.
+TEST(PosixFileSystem, BufferedAppends) {
+  PosixFileManager fs;
+
+  {
+    PosixFileManager::Handle f = fs.CreateFile("buffered", 8);
+    f.Append("foo").Append("bar", 3);
+    EXPECT_EQ(0, fs.GetFileSize("buffered"));
+    struct iovec chunks[2];
+    chunks[0].iov_base = const_cast<char*>("baz");
+    chunks[0].iov_len = 3;
+    chunks[1].iov_base = const_cast<char*>("meh");
+    chunks[1].iov_len = 3;
+    f.AppendV(chunks, 2);
+    EXPECT_EQ("foobarbazmeh", fs.ReadFileToString("buffered"));
+    f.Append("!");
+    EXPECT_EQ(12, fs.GetFileSize("buffered"));
+    f.Flush();
+    EXPECT_EQ(13, fs.GetFileSize("buffered"));
+    f.Append("?").Sync();
+    EXPECT_EQ(14, fs.GetFileSize("buffered"));
+    f.Append("\n");
+  }
+  EXPECT_EQ("foobarbazmeh!?\n", fs.ReadFileToString("buffered"));
+
+  {
+    PosixFileManager::Handle f = fs.CreateOrAppendToFile("buffered", 0);
+    f.Append("unbuffered");
+    EXPECT_EQ(25, fs.GetFileSize("buffered"));
+  }
+
+  fs.RemoveFile("buffered");
+}
+
+// The files larger than `bricks::kReadFileAsStringMaxSizeToRead` are read via memory mapping.
+TEST(PosixFileSystem, ReadsLargeAndEmptyFiles) {
+  PosixFileManager fs;
+
+  std::string large;
+  for (size_t i = 0; large.length() <= 3 * bricks::kReadFileAsStringMaxSizeToRead; ++i) {
+    large += std::to_string(i) + '\n';
+  }
+  fs.CreateFile("large.txt").Append(large);
+  fs.CreateFile("empty.txt");
+
+  EXPECT_EQ(large, fs.ReadFileToString("large.txt"));
+  EXPECT_EQ(std::vector<char>(large.begin(), large.end()), fs.ReadFile("large.txt"));
+  EXPECT_EQ("", fs.ReadFileToString("empty.txt"));
+  EXPECT_TRUE(fs.ReadFile("empty.txt").empty());
+
+  // The files reporting zero size are read until the end.
+  EXPECT_FALSE(bricks::ReadFileAsString("/proc/self/status").empty());
+  ASSERT_THROW(bricks::ReadFileAsString("."), bricks::FileException);
+
+  fs.RemoveFile("large.txt");
+  fs.RemoveFile("empty.txt");
+}
+
+// The file is replaced as a whole, via a temporary file renamed over it.
+TEST(PosixFileSystem, WritesFilesAtomically) {
+  const std::string file_name = ".tmp/state";
+  bricks::WriteFileAtomically(file_name, "old");
+  EXPECT_EQ("old", bricks::ReadFileAsString(file_name));
+  bricks::WriteFileAtomically(file_name, "new", bricks::WriteFileAtomicallyParameters::NoSync);
+  EXPECT_EQ("new", bricks::ReadFileAsString(file_name));
+  EXPECT_FALSE(bricks::FileSystem::FileExists(file_name + ".tmp"));
+
+  bricks::WriteStringToFile(file_name, "er", true);
+  EXPECT_EQ("newer", bricks::ReadFileAsString(file_name));
+
+  ASSERT_THROW(bricks::WriteFileAtomically(".tmp/does/not/exist", "data"), bricks::FileException);
+  ASSERT_THROW(bricks::WriteStringToFile(".tmp/does/not/exist", "data"), bricks::FileException);
+  bricks::RemoveFile(file_name);
+}
+
+// The files are looked up relative to the working directory opened once, wherever it is moved to since.
+TEST(PosixFileSystem, OperatesRelativeToTheWorkingDirectory) {
+  bricks::FileSystem::CreateDirectory(".tmp/relative");
+  PosixFileManager fs(".tmp/relative/");
+  fs.CreateFile("foo").Append("foo");
+  fs.CreateFile("bar").Append("bar");
+  EXPECT_FALSE(fs.RenameFileUnlessExists("foo", "bar"));
+  EXPECT_EQ("foo", fs.ReadFileToString("foo"));
+  EXPECT_TRUE(fs.RenameFileUnlessExists("foo", "baz"));
+  ASSERT_THROW(fs.GetFileSize("foo"), FileManager::CanNotGetFileSizeException);
+  EXPECT_EQ("foo", fs.ReadFileToString("baz"));
+
+  bricks::FileSystem::RenameFile(".tmp/relative", ".tmp/moved");
+  ASSERT_THROW(fs.CreateFile("bar"), FileManager::FileAlreadyExistsException);
+  fs.RemoveFile("bar");
+  EXPECT_EQ(std::vector<char>({'f', 'o', 'o'}), fs.ReadFile("baz"));
+  PosixFileManager::DirectoryIterator dit = fs.ScanDirectory("*");
+  EXPECT_EQ("baz", dit.Next());
+  EXPECT_EQ("", dit.Next());
+  fs.RemoveFile("baz");
+}
+
 TEST(PosixFileSystem, DirectoryOperations) {
   PosixFileManager fs;
 
@@ -119,6 +219,148 @@ TEST(PosixFileSystem, DirectoryOperations) {
   fs.RemoveFile("match");
 }
 
+TEST(PosixFileSystem, FileNamePatterns) {
+  const auto match = [](const std::string& pattern, const std::string& name) {
+    return FileNamePattern(pattern).Match(name.c_str(), name.length());
+  };
+  EXPECT_TRUE(match("test-???", "test-001"));
+  EXPECT_FALSE(match("test-???", "test-0001"));
+  EXPECT_TRUE(match("finalized-*.bin", "finalized-00000000000000000042.bin"));
+  EXPECT_TRUE(match("finalized-*.bin", "finalized-.bin"));
+  EXPECT_FALSE(match("finalized-*.bin", "finalized-42.bin.tmp"));
+  EXPECT_FALSE(match("finalized-*.bin", "current-42.bin"));
+  EXPECT_TRUE(match("*", ""));
+  EXPECT_TRUE(match("*-*-*", "a-b-c"));
+  EXPECT_TRUE(match("*-*-*", "--"));
+  EXPECT_FALSE(match("*-*-*", "a-b"));
+  EXPECT_TRUE(match("a*b?c*d", "axxbycd"));
+  EXPECT_FALSE(match("a*a", "a"));
+}
+
+// The cached listing reflects the changes made since it was read.
+TEST(PosixFileSystem, CachedDirectoryListing) {
+  bricks::FileSystem::CreateDirectory(".tmp/cached");
+  PosixFileManager fs(".tmp/cached/", true);
+  const auto scan = [&fs](const std::string& pattern) {
+    PosixFileManager::DirectoryIterator dit = fs.ScanDirectory(pattern);
+    std::vector<std::string> files;
+    std::string current;
+    while (current = dit.Next(), !current.empty()) {
+      files.push_back(current);
+    }
+    std::sort(files.begin(), files.end());
+    std::string result;
+    for (const std::string& file : files) {
+      result += file + ' ';
+    }
+    return result;
+  };
+
+  fs.CreateFile("finalized-1.bin");
+  fs.CreateFile("finalized-2.bin");
+  fs.CreateFile("current-3.bin");
+  EXPECT_EQ("finalized-1.bin finalized-2.bin ", scan("finalized-*.bin"));
+
+  fs.RenameFile("current-3.bin", "finalized-3.bin");
+  fs.RemoveFile("finalized-1.bin");
+  EXPECT_EQ("finalized-2.bin finalized-3.bin ", scan("finalized-*.bin"));
+  EXPECT_EQ("", scan("current-*"));
+
+  fs.RemoveFile("finalized-2.bin");
+  fs.RemoveFile("finalized-3.bin");
+  EXPECT_EQ("", scan("*"));
+  ::rmdir(".tmp/cached");
+}
+
+// The entries come with their types and, on demand, their sizes.
+TEST(PosixFileSystem, ScansDirectoryEntries) {
+  bricks::FileSystem::CreateDirectory(".tmp/scan");
+  bricks::FileSystem::CreateDirectory(".tmp/scan/subdirectory");
+  bricks::WriteStringToFile(".tmp/scan/one", "1");
+  bricks::WriteStringToFile(".tmp/scan/three", "333");
+
+  std::vector<std::string> entries;
+  bricks::FileSystem::ScanDirEntriesUntil(".tmp/scan", [&entries](const bricks::FileSystem::DirectoryEntry& e) {
+    const std::string name(e.name, e.name_length);
+    if (e.IsRegularFile()) {
+      entries.push_back(name + '=' + std::to_string(e.Size()));
+      EXPECT_GT(e.ModificationTimeMilliseconds(), 0u);
+    } else {
+      EXPECT_TRUE(e.Type() == bricks::DirectoryEntryType::Directory);
+      entries.push_back(name + '/');
+    }
+    return true;
+  });
+  std::sort(entries.begin(), entries.end());
+  ASSERT_EQ(3u, entries.size());
+  EXPECT_EQ("one=1 subdirectory/ three=3", entries[0] + ' ' + entries[1] + ' ' + entries[2]);
+
+  size_t scanned = 0;
+  bricks::FileSystem::ScanDirEntriesUntil(".tmp/scan", [&scanned](const bricks::FileSystem::DirectoryEntry&) {
+    ++scanned;
+    return false;
+  });
+  EXPECT_EQ(1u, scanned);
+
+  bricks::RemoveFile(".tmp/scan/one");
+  bricks::RemoveFile(".tmp/scan/three");
+  ::rmdir(".tmp/scan/subdirectory");
+  ::rmdir(".tmp/scan");
+}
+
+// The operations on the same file run in the order of submission, and the ones on different files concurrently.
+TEST(PosixFileSystem, AsyncFileIO) {
+  PosixFileManager fs(".tmp/");
+  std::mutex mutex;
+  std::vector<std::string> log;
+  const auto logged = [&mutex, &log](const std::string& name) {
+    return [&mutex, &log, name](bool ok) {
+      std::lock_guard<std::mutex> lock(mutex);
+      log.push_back(name + (ok ? "+" : "-"));
+    };
+  };
+  {
+    bricks::AsyncFileIO io(4);
+    io.Write(".tmp/async", "foo", false, logged("write"));
+    io.Write(".tmp/async", "bar", true, logged("append"));
+    io.Sync(".tmp/async", logged("sync"));
+    fs.RenameFileAsync(io, "async", "renamed", logged("rename"));
+    io.Barrier(".tmp/renamed", logged("barrier"));
+    fs.RemoveFileAsync(io, "async", logged("remove"));
+    io.WaitUntilIdle();
+    EXPECT_EQ("foobar", fs.ReadFileToString("renamed"));
+    fs.RemoveFileAsync(io, "renamed", logged("remove"));
+  }
+  EXPECT_FALSE(bricks::FileSystem::FileExists(".tmp/renamed"));
+  ASSERT_EQ(7u, log.size());
+  EXPECT_EQ("write+ append+ sync+ rename+",
+            log[0] + ' ' + log[1] + ' ' + log[2] + ' ' + log[3]);
+  // The barrier on the new name and the removal of the old one both wait for the rename only.
+  std::sort(log.begin() + 4, log.begin() + 6);
+  EXPECT_EQ("barrier+ remove-", log[4] + ' ' + log[5]);
+  EXPECT_EQ("remove+", log[6]);
+
+  // A slow operation on one file does not hold back the ones on others.
+  {
+    bricks::AsyncFileIO io(2);
+    std::atomic_bool released(false);
+    std::atomic_bool other_done(false);
+    io.Submit({"slow"},
+              [&released]() {
+                while (!released) {
+                  std::this_thread::yield();
+                }
+                return true;
+              },
+              nullptr);
+    io.Submit({"fast"}, []() { return true; }, [&other_done](bool) { other_done = true; });
+    while (!other_done) {
+      std::this_thread::yield();
+    }
+    released = true;
+  }
+}
+
 TEST(PosixFileSystem, Exceptions) {
   {
     std::unique_ptr<PosixFileManager> p;